@@ -6,12 +6,26 @@ Authors:      Roxanne Archambault
 Copyright (c) Canadian Space Agency.
 
 <Description>
-This module renders document images on a plane renderer.
+This module renders document images on a plane renderer. On the device, the
+JPEG images are decoded on a worker thread and uploaded into a texture kept
+from one document to the next, so that a new document does not stall the
+frame; the editor, which has no decoder off the main thread, decodes them
+with the texture. When the GPU takes ETC2 textures, the server sends the
+documents compressed in its blocks, which are copied into the texture as they
+are, without any decoding and in a sixth of the memory of RGB24.
 
 \***************************************************************************/
 
+using System;
 using System.Collections.Generic;
+using System.Threading.Tasks;
+using Unity.Collections;
 using UnityEngine;
+#if ENABLE_WINMD_SUPPORT
+using System.Runtime.InteropServices.WindowsRuntime;
+using Windows.Graphics.Imaging;
+using Windows.Storage.Streams;
+#endif
 
 public class DocumentRenderer : MonoBehaviour
 {
@@ -19,10 +33,23 @@ public class DocumentRenderer : MonoBehaviour
     public float MinImageSize = 2.0f;
     public Renderer TargetRenderer;
 
+    // Largest width and height the textures of the documents are rendered at, in pixels, sent to the server so that it
+    // does not send them at a higher resolution; 0 to get them at the resolution of the cameras
+    public int MaxTextureSize = 1024;
+
+    // Whether the documents are asked for as ETC2 textures, when the GPU takes them, rather than as JPEG images
+    public bool UseCompressedTextures = true;
+
     private const float ImageTimeout = 30.0f;
     private const float PixelToMeter = 0.26f / 1000f; // Convert pixels to meters
     private const int MaxQueueSize = 5;
 
+    // Container of the compressed documents: magic, format (byte), width and height of the texture (ushort each), size
+    // of the blocks (int), then the blocks, from the bottom row of the texture
+    private static readonly byte[] TextureContainerMagic = { (byte)'L', (byte)'S', (byte)'T', (byte)'X' };
+    private const byte Etc2Rgb8Format = 1;
+    private const int TextureContainerHeaderSize = 4 + 1 + 2 * sizeof(ushort) + sizeof(int);
+
     private float xScaleUnitWidth;
     private float zScaleUnitHeight;
 
@@ -31,6 +58,16 @@ public class DocumentRenderer : MonoBehaviour
 
     private Queue<(short width, short height, byte[] data)> documentQueue = new();
 
+    // Texture of the documents, reallocated only when their size changes, and whether a document is being decoded
+    private Texture2D documentTexture;
+    private bool isDecoding = false;
+
+    // Time the main thread spent on the latest document, in milliseconds, shown by the performance overlay
+    public float LastDocumentUploadTime { get; private set; } = 0.0f;
+
+    // Whether the documents are asked for as compressed textures, set once the renderer is started
+    public bool IsCompressedTextureSupported { get; private set; } = false;
+
     public void Start()
     {
         if (TargetRenderer == null)
@@ -50,6 +87,8 @@ public class DocumentRenderer : MonoBehaviour
 
         TargetRenderer.material.color = Color.white * 2.0f; // brighten
         TargetRenderer.enabled = false; // Initially hide the renderer
+
+        IsCompressedTextureSupported = UseCompressedTextures && SystemInfo.SupportsTextureFormat(TextureFormat.ETC2_RGB);
     }
 
     void Update()
@@ -59,8 +98,8 @@ public class DocumentRenderer : MonoBehaviour
             timeSinceLastRender += Time.deltaTime;
         }
 
-        // If the document queue is not empty, render its first entry
-        if (documentQueue.Count > 0)
+        // If the document queue is not empty, render its first entry; one document is decoded at a time
+        if (documentQueue.Count > 0 && !isDecoding)
         {
             var (width, height, data) = documentQueue.Dequeue();
             UpdateMesh(width, height, data);
@@ -84,22 +123,61 @@ public class DocumentRenderer : MonoBehaviour
         documentQueue.Enqueue((width, height, data));
     }
 
-    public void UpdateMesh(short width, short height, byte[] data)
+    public async void UpdateMesh(short width, short height, byte[] data)
     {
         if (data == null || data.Length == 0)
         {
             return;
         }
 
-        // Load the received image into a 2D Texture
-        Texture2D texture = new Texture2D(2, 2, TextureFormat.RGB24, false, true);
+        isDecoding = true;
 
-        if (texture.LoadImage(data))
+        try
         {
-            texture.Apply();
+            float uploadStart;
+
+            if (IsTextureContainer(data))
+            {
+                uploadStart = Time.realtimeSinceStartup;
+
+                if (!LoadCompressedTexture(data))
+                {
+                    Debug.LogError("Failed to load the compressed document texture");
+                    return;
+                }
+            }
+            else
+            {
+#if ENABLE_WINMD_SUPPORT
+                // The continuation runs on the main thread, which only copies the decoded pixels into the texture
+                var (decodedWidth, decodedHeight, pixels) = await Task.Run(() => DecodeImageAsync(data));
+                uploadStart = Time.realtimeSinceStartup;
+
+                PrepareTexture(decodedWidth, decodedHeight, TextureFormat.RGBA32);
+                documentTexture.SetPixelData(pixels, 0);
+                documentTexture.Apply(false);
+#else
+                await Task.CompletedTask;
+                uploadStart = Time.realtimeSinceStartup;
+
+                // LoadImage resizes the texture to the image, so the same texture is kept for every document
+                if (documentTexture == null)
+                {
+                    documentTexture = new Texture2D(2, 2, TextureFormat.RGB24, false, true);
+                }
+
+                if (!documentTexture.LoadImage(data))
+                {
+                    Debug.LogError("Failed to load image data into texture");
+                    return;
+                }
+#endif
+            }
+
+            LastDocumentUploadTime = (Time.realtimeSinceStartup - uploadStart) * 1000.0f;
 
             // Apply the texture on the renderer
-            TargetRenderer.material.mainTexture = texture;
+            TargetRenderer.material.mainTexture = documentTexture;
             TargetRenderer.enabled = true;
 
             // Scale the renderer to match the aspect ratio
@@ -107,9 +185,110 @@ public class DocumentRenderer : MonoBehaviour
 
             timeSinceLastRender = 0.0f;
         }
-        else
+        catch (Exception e)
+        {
+            Debug.LogError("Failed to decode the document image: " + e.Message);
+        }
+        finally
+        {
+            isDecoding = false;
+        }
+    }
+
+    private static bool IsTextureContainer(byte[] data)
+    {
+        if (data.Length < TextureContainerHeaderSize)
+            return false;
+
+        for (int i = 0; i < TextureContainerMagic.Length; i++)
+        {
+            if (data[i] != TextureContainerMagic[i])
+                return false;
+        }
+
+        return true;
+    }
+
+    /// <summary>
+    /// Copies the blocks of a compressed texture into the document texture as they are; the GPU decodes them
+    /// </summary>
+    /// <returns>False if the container is not of a format or size the renderer takes</returns>
+    private bool LoadCompressedTexture(byte[] data)
+    {
+        byte format = data[4];
+        int width = BitConverter.ToUInt16(data, 5);
+        int height = BitConverter.ToUInt16(data, 7);
+        int blocksSize = BitConverter.ToInt32(data, 9);
+
+        // 8 bytes for each block of 4x4 pixels
+        if (format != Etc2Rgb8Format || width == 0 || height == 0 || width % 4 != 0 || height % 4 != 0
+            || blocksSize != width / 4 * (height / 4) * 8 || data.Length < TextureContainerHeaderSize + blocksSize)
+            return false;
+
+        PrepareTexture(width, height, TextureFormat.ETC2_RGB);
+
+        NativeArray<byte> textureData = documentTexture.GetRawTextureData<byte>();
+
+        if (textureData.Length != blocksSize)
+            return false;
+
+        NativeArray<byte>.Copy(data, TextureContainerHeaderSize, textureData, 0, blocksSize);
+        documentTexture.Apply(false);
+
+        return true;
+    }
+
+    /// <summary>
+    /// Creates the document texture, or reallocates it when the size or format of the documents changed
+    /// </summary>
+    private void PrepareTexture(int width, int height, TextureFormat format)
+    {
+        if (documentTexture == null)
+        {
+            documentTexture = new Texture2D(width, height, format, false, true);
+        }
+        else if (documentTexture.width != width || documentTexture.height != height || documentTexture.format != format)
+        {
+            documentTexture.Reinitialize(width, height, format, false);
+        }
+    }
+
+#if ENABLE_WINMD_SUPPORT
+    /// <summary>
+    /// Decodes an image to RGBA32 pixels, with the bottom row first as the textures expect them
+    /// </summary>
+    private static async Task<(int width, int height, byte[] pixels)> DecodeImageAsync(byte[] data)
+    {
+        using (var stream = new InMemoryRandomAccessStream())
+        {
+            await stream.WriteAsync(data.AsBuffer());
+            stream.Seek(0);
+
+            BitmapDecoder decoder = await BitmapDecoder.CreateAsync(stream);
+            PixelDataProvider pixelData = await decoder.GetPixelDataAsync(BitmapPixelFormat.Rgba8, BitmapAlphaMode.Ignore,
+                new BitmapTransform(), ExifOrientationMode.IgnoreExifOrientation, ColorManagementMode.DoNotColorManage);
+
+            int width = (int)decoder.PixelWidth;
+            int height = (int)decoder.PixelHeight;
+            byte[] decoded = pixelData.DetachPixelData();
+            byte[] pixels = new byte[decoded.Length];
+            int rowSize = width * 4;
+
+            for (int y = 0; y < height; y++)
+            {
+                Buffer.BlockCopy(decoded, y * rowSize, pixels, (height - 1 - y) * rowSize, rowSize);
+            }
+
+            return (width, height, pixels);
+        }
+    }
+#endif
+
+    public void OnDestroy()
+    {
+        if (documentTexture != null)
         {
-            Debug.LogError("Failed to load image data into texture");
+            Destroy(documentTexture);
         }
     }
 
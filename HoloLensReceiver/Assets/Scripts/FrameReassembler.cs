@@ -0,0 +1,192 @@
+/***************************************************************************\
+
+Module Name:  FrameReassembler.cs
+Project:      HoloLensReceiver
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module rebuilds the point cloud frames streamed over UDP from their
+packets. Each group of data packets is followed by a parity packet, so one
+lost packet per group is recovered without a retransmission. Only the newest
+frame is assembled: the packets of older frames are dropped, and a frame
+which cannot be completed is skipped when the next one starts. A frame id
+far below the current one starts again from it, as the server restarted.
+The buffers of the packets and of the frame are kept from frame to frame.
+
+\***************************************************************************/
+
+using System;
+
+public class FrameReassembler
+{
+    // Packet header: frame id (int), frame size (int), packet index (ushort), number of data packets (ushort)
+    private const int PacketHeaderSize = 12;
+    private const int PacketPayloadSize = 1200;
+    private const int GroupSize = 8;
+
+    // Frames larger than this are dropped before anything is allocated for them
+    private const int MaxFrameSize = 64 * 1024 * 1024;
+
+    // A frame id this far below the current one is a new stream, after a restart of the server, rather than a late packet
+    private const int MaxFrameIdReorder = 16;
+
+    private int frameId = -1;
+    private int frameSize = 0;
+    private int numDataPackets = 0;
+    private bool isFrameDelivered = false;
+
+    // Payloads of the data and parity packets, and whether they were received for the current frame
+    private byte[][] payloads = new byte[0][];
+    private bool[] isReceived = new bool[0];
+    private int numPackets = 0;
+
+    // Data packets received in each group, whether each group is complete, and the number of complete groups
+    private int[] numReceivedInGroup = new int[0];
+    private bool[] isGroupComplete = new bool[0];
+    private int numGroups = 0;
+    private int numCompleteGroups = 0;
+
+    private byte[] frameBuffer = new byte[0];
+
+    /// <summary>
+    /// Adds a packet to the frame it belongs to
+    /// </summary>
+    /// <param name="packet">Datagram received from the server</param>
+    /// <param name="frame">The frame, when this packet completed it; only valid until the next packet is added</param>
+    /// <returns>Whether a frame was completed</returns>
+    public bool AddPacket(byte[] packet, out ArraySegment<byte> frame)
+    {
+        frame = default;
+
+        if (packet.Length != PacketHeaderSize + PacketPayloadSize)
+            return false;
+
+        int packetFrameId = BitConverter.ToInt32(packet, 0);
+        int packetFrameSize = BitConverter.ToInt32(packet, 4);
+        int index = BitConverter.ToUInt16(packet, 8);
+        int packetNumData = BitConverter.ToUInt16(packet, 10);
+
+        // The header must describe a frame of a sensible size split like the server splits them
+        if (packetFrameSize < 0 || packetFrameSize > MaxFrameSize
+            || packetNumData != Math.Max(1, (packetFrameSize + PacketPayloadSize - 1) / PacketPayloadSize))
+            return false;
+
+        // Packets of a frame slightly older than the current one arrive late or out of order; that frame was skipped
+        long frameIdDelta = (long)packetFrameId - frameId;
+
+        if (frameIdDelta < 0 && frameIdDelta >= -MaxFrameIdReorder)
+            return false;
+
+        if (frameIdDelta != 0)
+            StartFrame(packetFrameId, packetFrameSize, packetNumData);
+        else if (packetFrameSize != frameSize || packetNumData != numDataPackets)
+            return false;
+
+        if (isFrameDelivered || index >= numPackets || isReceived[index])
+            return false;
+
+        Buffer.BlockCopy(packet, PacketHeaderSize, payloads[index], 0, PacketPayloadSize);
+        isReceived[index] = true;
+
+        int group = index < numDataPackets ? index / GroupSize : index - numDataPackets;
+
+        if (index < numDataPackets)
+            numReceivedInGroup[group]++;
+
+        UpdateGroup(group);
+
+        if (numCompleteGroups < numGroups)
+            return false;
+
+        if (frameBuffer.Length < frameSize)
+            frameBuffer = new byte[frameSize];
+
+        for (int i = 0; i < numDataPackets; i++)
+        {
+            int offset = i * PacketPayloadSize;
+            Buffer.BlockCopy(payloads[i], 0, frameBuffer, offset, Math.Min(PacketPayloadSize, frameSize - offset));
+        }
+
+        frame = new ArraySegment<byte>(frameBuffer, 0, frameSize);
+        isFrameDelivered = true;
+        return true;
+    }
+
+    private void StartFrame(int id, int size, int numData)
+    {
+        frameId = id;
+        frameSize = size;
+        numDataPackets = numData;
+        isFrameDelivered = false;
+
+        numGroups = (numDataPackets + GroupSize - 1) / GroupSize;
+        numPackets = numDataPackets + numGroups;
+        numCompleteGroups = 0;
+
+        if (payloads.Length < numPackets)
+        {
+            int numAllocated = payloads.Length;
+            Array.Resize(ref payloads, numPackets);
+            Array.Resize(ref isReceived, numPackets);
+
+            for (int i = numAllocated; i < numPackets; i++)
+                payloads[i] = new byte[PacketPayloadSize];
+        }
+
+        if (numReceivedInGroup.Length < numGroups)
+        {
+            Array.Resize(ref numReceivedInGroup, numGroups);
+            Array.Resize(ref isGroupComplete, numGroups);
+        }
+
+        Array.Clear(isReceived, 0, numPackets);
+        Array.Clear(numReceivedInGroup, 0, numGroups);
+        Array.Clear(isGroupComplete, 0, numGroups);
+    }
+
+    /// <summary>
+    /// Marks a group as complete once all its data packets are received, recovering its single missing packet from its
+    /// parity; only the group of the packet just received can change
+    /// </summary>
+    private void UpdateGroup(int group)
+    {
+        if (isGroupComplete[group])
+            return;
+
+        int start = group * GroupSize;
+        int end = Math.Min(start + GroupSize, numDataPackets);
+        int numMissing = end - start - numReceivedInGroup[group];
+
+        if (numMissing == 1 && isReceived[numDataPackets + group])
+        {
+            int missingIndex = start;
+
+            while (isReceived[missingIndex])
+                missingIndex++;
+
+            // The parity is the XOR of the group, so XORing it with the received packets gives the missing one
+            byte[] recovered = payloads[missingIndex];
+            Buffer.BlockCopy(payloads[numDataPackets + group], 0, recovered, 0, PacketPayloadSize);
+
+            for (int i = start; i < end; i++)
+            {
+                if (i == missingIndex)
+                    continue;
+
+                for (int j = 0; j < PacketPayloadSize; j++)
+                    recovered[j] ^= payloads[i][j];
+            }
+
+            isReceived[missingIndex] = true;
+            numReceivedInGroup[group]++;
+            numMissing = 0;
+        }
+
+        if (numMissing == 0)
+        {
+            isGroupComplete[group] = true;
+            numCompleteGroups++;
+        }
+    }
+}
@@ -6,7 +6,13 @@ Authors:      Roxanne Archambault
 Copyright (c) Canadian Space Agency.
 
 <Description>
-This module manages the different active Holoports in the session.
+This module manages the different active Holoports in the session, one for
+each server streamed, side by side. The receivers share out the worker
+threads the frames are decoded on, and the controller shares out a point
+budget of the session between the Holoports by the part of the view each
+one takes, so that streaming more servers does not make the device draw
+more points: the Holoports in front of the viewer get most of the budget,
+and those out of view keep a small part of it.
 
 \***************************************************************************/
 
@@ -18,19 +24,143 @@ public class HoloportController : MonoBehaviour
     // Renderer object
     public GameObject HoloportPrefab;
     public List<string> DefaultServerIPAddresses = new List<string> { "127.0.0.1" };
+    public float HoloportSpacing = 1.5f; // Distance between the Holoports, in meters, along the x axis of the controller
+
+    // Points rendered by all the Holoports together; 0 leaves each Holoport the budget of its renderer
+    public int MaxSessionPoints = 200000;
+    public float HoloportRadius = 1.0f; // Radius of the sphere around each Holoport tested against the view, in meters
+    public float EqualBudgetShare = 0.1f; // Part of the budget shared out equally, so that the Holoports out of view still show something
+
+    private const float ShareWeight = 0.1f; // Weight of the last frame in the moving average of the shares
+
     private Dictionary<string, GameObject> holoports = new Dictionary<string, GameObject>();
+    private readonly List<PointCloudRenderer> pointCloudRenderers = new();
+    private readonly List<float> budgetShares = new();
+    private readonly List<float> viewWeights = new();
+    private readonly Plane[] frustumPlanes = new Plane[6];
 
     void Start()
     {
         // Connect to all default server addresses
         foreach (string ipAddress in DefaultServerIPAddresses)
         {
-            // Store connected addresses and HoloportPrefab instances
-            GameObject newHoloport = Instantiate(HoloportPrefab, this.transform);
-            HoloportReceiver newPointCloudReceiver = newHoloport.GetComponent<HoloportReceiver>();
-            newPointCloudReceiver.ServerIPAddress = ipAddress;
-            newPointCloudReceiver.IsServerIPAddressSet = true;
-            holoports.Add(ipAddress, newHoloport);
+            AddHoloport(ipAddress);
+        }
+    }
+
+    void Update()
+    {
+        if (MaxSessionPoints > 0 && pointCloudRenderers.Count > 0)
+        {
+            ShareOutPointBudget();
+        }
+    }
+
+    /// <summary>
+    /// Instantiates a Holoport which streams the given server, unless one already does
+    /// </summary>
+    public void AddHoloport(string ipAddress)
+    {
+        if (holoports.ContainsKey(ipAddress))
+        {
+            return;
+        }
+
+        // Store connected addresses and HoloportPrefab instances
+        GameObject newHoloport = Instantiate(HoloportPrefab, this.transform);
+        HoloportReceiver newPointCloudReceiver = newHoloport.GetComponent<HoloportReceiver>();
+        newPointCloudReceiver.ServerIPAddress = ipAddress;
+        newPointCloudReceiver.IsServerIPAddressSet = true;
+        holoports.Add(ipAddress, newHoloport);
+
+        pointCloudRenderers.Add(newHoloport.GetComponent<PointCloudRenderer>());
+        budgetShares.Add(1.0f / pointCloudRenderers.Count);
+        ArrangeHoloports();
+    }
+
+    /// <summary>
+    /// Stops streaming the given server and destroys its Holoport
+    /// </summary>
+    public void RemoveHoloport(string ipAddress)
+    {
+        if (!holoports.TryGetValue(ipAddress, out GameObject holoport))
+        {
+            return;
+        }
+
+        int index = pointCloudRenderers.IndexOf(holoport.GetComponent<PointCloudRenderer>());
+        pointCloudRenderers.RemoveAt(index);
+        budgetShares.RemoveAt(index);
+        holoports.Remove(ipAddress);
+        Destroy(holoport);
+
+        ArrangeHoloports();
+    }
+
+    /// <summary>
+    /// Places the Holoports in a row centered on the controller, in the order they were added
+    /// </summary>
+    private void ArrangeHoloports()
+    {
+        for (int i = 0; i < pointCloudRenderers.Count; i++)
+        {
+            float offset = (i - 0.5f * (pointCloudRenderers.Count - 1)) * HoloportSpacing;
+            pointCloudRenderers[i].transform.localPosition = new Vector3(offset, 0.0f, 0.0f);
         }
     }
+
+    /// <summary>
+    /// Sets the point budget of each Holoport to its share of the budget of the session. Outside of the equal part,
+    /// the shares follow the solid angle of the Holoports in view, and are smoothed so that the level of detail of a
+    /// Holoport does not change with every movement of the head.
+    /// </summary>
+    private void ShareOutPointBudget()
+    {
+        int numHoloports = pointCloudRenderers.Count;
+        Camera viewer = Camera.main;
+        float weightSum = 0.0f;
+
+        if (viewer != null)
+        {
+            GeometryUtility.CalculateFrustumPlanes(viewer, frustumPlanes);
+        }
+
+        viewWeights.Clear();
+
+        for (int i = 0; i < numHoloports; i++)
+        {
+            viewWeights.Add(GetViewWeight(viewer, pointCloudRenderers[i].transform.position));
+            weightSum += viewWeights[i];
+        }
+
+        // When no Holoport is in view, the budget is shared out equally
+        for (int i = 0; i < numHoloports; i++)
+        {
+            float viewShare = weightSum > 0.0f ? viewWeights[i] / weightSum : 1.0f / numHoloports;
+            float share = EqualBudgetShare / numHoloports + (1.0f - EqualBudgetShare) * viewShare;
+
+            budgetShares[i] += ShareWeight * (share - budgetShares[i]);
+            pointCloudRenderers[i].MaxRenderedPoints = Mathf.Max(1, Mathf.RoundToInt(budgetShares[i] * MaxSessionPoints));
+        }
+    }
+
+    /// <summary>
+    /// Solid angle of a Holoport seen from the viewer, relative to that of a Holoport one radius away, or 0 when it is
+    /// out of view; every Holoport weighs the same when there is no viewer
+    /// </summary>
+    private float GetViewWeight(Camera viewer, Vector3 position)
+    {
+        if (viewer == null)
+        {
+            return 1.0f;
+        }
+
+        if (!GeometryUtility.TestPlanesAABB(frustumPlanes, new Bounds(position, 2.0f * HoloportRadius * Vector3.one)))
+        {
+            return 0.0f;
+        }
+
+        float distance = Mathf.Max(HoloportRadius, Vector3.Distance(viewer.transform.position, position));
+        return (HoloportRadius / distance) * (HoloportRadius / distance);
+    }
 }
@@ -7,7 +7,25 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module receives point clouds and documents from a TCP server and sends 
-them to the appropriate renderers.
+them to the appropriate renderers. The point clouds can also be streamed over
+UDP, where a lost frame is skipped instead of delaying the next ones, or
+received from a multicast group shared by all the headsets. The
+view pose of the headset is sent with the requests, so that the server only
+sends the points which can be seen from it, and so are the reports of the
+frames displayed, from which the server breaks down the latency of each hop
+from the cameras to the display. The frames are decompressed and
+decoded in parallel on worker threads; the main thread only reads the
+sockets and hands the decoded frames to the renderer. The full frames of
+byte positions are not decoded at all for the procedural draws, whose shader
+dequantizes the points as they were received. With split streaming,
+the positions are only received when the geometry changes, and the frames in
+between only carry the colors of the geometry held. With tiled streaming,
+only the tiles of the byte grid which changed are received, those in view
+first, and the tiles held are rendered again as each one arrives. The receiver sends the
+size it renders the documents at, so that they are not sent at a higher
+resolution, and asks for them as ETC2 textures when its GPU takes them. The points decoded from an octree keep the number of occupied
+siblings of their node in the alpha of their color, for the renderer to size
+them by their local density.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -17,6 +35,10 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 \***************************************************************************/
 
 using System;
+using System.Collections.Generic;
+using System.IO;
+using System.IO.Compression;
+using System.Net;
 using System.Net.Sockets;
 using System.Threading.Tasks;
 using UnityEngine;
@@ -28,6 +50,21 @@ public class HoloportReceiver : MonoBehaviour
     public int PointCloudPort = 48002;
     public int DocumentPort = 48003;
     public float ConnectionRetryInterval = 10.0f;
+    public bool IsDeltaStreamingEnabled = true;
+    public bool IsCompressionEnabled = true;
+    public bool IsOctreeCodingEnabled = true;
+    public bool IsProgressiveStreamingEnabled = true;
+    public bool IsUdpTransportEnabled = false;
+    public bool IsMulticastTransportEnabled = false; // Shares one stream with the other headsets; takes precedence over UDP
+    public string MulticastGroupAddress = "239.255.48.2";
+    public int MulticastPort = 48004;
+    public bool IsViewCullingEnabled = true;
+    public bool IsWideRangeEnabled = false; // Full frames keep the capture volumes larger than the byte grid of the other formats
+    public bool IsSurfelRenderingEnabled = false; // Full frames are wide frames with the normals of the points, drawn as discs lying on the surface
+    public bool IsLatencyTracingEnabled = true; // Reports when each frame is displayed; not available from the multicast group
+    public bool IsMeshStreamingEnabled = false; // Renders the fused surface of the server as triangles when it extracts a mesh; takes precedence over deltas, over TCP only
+    public bool IsSplitStreamingEnabled = false; // Full frames only send the positions when they change, and the colors alone otherwise; over TCP only, takes precedence over the other codings
+    public bool IsTiledStreamingEnabled = false; // Full frames only send the tiles of the byte grid which changed, those in view first; over TCP only, takes precedence over split streaming
 
     // Parameters used to deserialize point clouds
     private const int PointXYZDataSize = 3; // 3 bytes for (x, y, z) positions
@@ -38,7 +75,119 @@ public class HoloportReceiver : MonoBehaviour
     private const float YRangeCenter = 0.0f;
     private const float ZRangeCenter = HalfRange;
 
+    // Request bytes and frame types of the point cloud protocol
+    private const byte FullFrameRequest = 0;
+    private const byte DeltaFrameRequest = 1;
+    private const byte UdpStreamRequest = 2; // Followed by the UDP port the full frames are sent to
+    private const byte ViewPoseRequest = 3; // Followed by the view pose, in the coordinates of the point cloud; full frames are culled with it
+    private const byte MulticastStreamRequest = 4; // The full frames are sent to the multicast group, each preceded by the flags it is coded with
+    private const byte LatencyTraceRequest = 5; // The capture time of the frames is followed by their id (int) and the global timestamp of the cameras (ulong)
+    private const byte LatencyReportRequest = 6; // Followed by the report of a frame displayed
+    private const byte MeshFrameRequest = 7; // The surface is sent as a triangle mesh, or as a wide frame of points when it has no triangles
+    private const byte FrameTypeMask = 0x07; // Bits of a request below its flags
+    private const byte DocumentSizeRequest = 0; // Sent on the document socket, followed by the largest width and height the documents are rendered at (ushort each)
+    private const byte DocumentFormatRequest = 1; // Sent on the document socket, followed by the texture format the documents are sent in (byte)
+    private const byte Etc2Rgb8DocumentFormat = 1;
+    private const int LatencyReportSize = 4 * sizeof(int); // Frame id, then the times from its arrival to its decoding, its display and the report
+    private const int MaxPendingLatencyReports = 8;
+    private const int ViewPoseSize = 11 * sizeof(float); // Position, forward and up directions, tangents of the half fields of view
+    private const byte KeyframeType = 0;
+    private const byte CompressionRequestFlag = 0x80; // The frame is preceded by a payload header byte and may be compressed
+    private const byte OctreeRequestFlag = 0x40; // Full frames are coded as an octree
+    private const byte ProgressiveRequestFlag = 0x20; // Full frames are sent as a coarse octree level followed by refinements
+    private const byte WideRequestFlag = 0x10; // Full frames are sent with 32-bit positions quantized in their bounding box; takes precedence over the octrees
+    private const byte TimestampRequestFlag = 0x08; // The frame is preceded by its capture time, which the renderer buffers the frames by
+    private const byte SurfelRequestFlags = WideRequestFlag | OctreeRequestFlag; // Full frames are wide frames followed by the normal of each point
+    private const byte SplitRequestFlags = WideRequestFlag | ProgressiveRequestFlag; // Full frames are the geometry with its colors, or the colors of the geometry held
+    private const byte TiledRequestFlags = WideRequestFlag | OctreeRequestFlag | ProgressiveRequestFlag; // Full frames are the tiles which changed since those held
+    private const byte GeometryFrameType = 2;
+    private const byte ColorFrameType = 3;
+    private const byte NoSurfelNormal = 0xFF; // Normal of the points whose normal the cameras could not estimate
+    private const int SurfelNormalLevels = 15; // Values of each axis of the octahedral normals, in the high and low 4 bits
+    private static readonly Vector3[] s_surfelNormals = BuildSurfelNormals();
+    private const int WideYBits = 11; // The x positions take the 11 high bits
+    private const int WideZBits = 10;
+    private const int MaxShortIndexVertices = 1 << 16; // The triangles of the meshes with more vertices have 32-bit indices
+    private const byte EndOfFrameDepth = 0; // Follows the last chunk of a progressive frame
+    private const byte EndOfTilesIndex = 0xFF; // Follows the last tile of a tiled frame
+    private const int NumTiles = 64; // Tiles of the tiled frames, 4 along each axis of the byte grid
+    private const long TileRenderIntervalUs = 8000; // The tiles held are rendered again at most this often while a frame arrives, and once it has
+    private const byte DeflatePayload = 1;
+    private const int OctreeDepth = 8; // One level for each bit of the byte positions
+
+    // Each request is a credit for one frame; keeping two outstanding lets the server send the next frame while the
+    // current one is received, so the frame rate does not depend on the round trip time
+    private const int RequestWindowSize = 2;
+
+    // Requests sent and not answered yet, in order; the server answers them in the same order
+    private readonly Queue<byte> pendingRequests = new();
+
+    // Voxels of the last received frame when delta streaming is enabled (key: packed x, y, z bytes)
+    private readonly Dictionary<int, Color32> voxels = new();
+
+    // Geometry of the last geometry frame when split streaming is enabled, decoded, and the colors of its points; the
+    // frames of colors copy the positions instead of decoding them again
+    private int splitGeometryId = 0; // 0 when no geometry is held
+    private float splitScale = 1.0f;
+    private int splitCount = 0;
+    private Vector3[] splitVertices = new Vector3[0];
+    private Color32[] splitColors = new Color32[0];
+
+    // Points of each tile held when tiled streaming is enabled, decoded, and the tiles of the last tiled frame (bit i for
+    // tile i); the tiles of the previous frames are kept until the server sends them again or leaves them out
+    private readonly PointCloudFrame[] tiles = new PointCloudFrame[NumTiles];
+    private ulong tileMask = 0;
+
+    // Size of the read buffer of the point cloud stream
+    private const int StreamBufferSize = 1 << 20;
+
+    // Number of points decoded by each parallel batch; smaller frames are decoded by a single worker thread
+    private const int DecodeBatchSize = 16384;
+
+    // Worker threads the frames are decoded on, shared out between the receivers of the session, so that streaming
+    // several servers at once does not take more cores than streaming one; the main thread is left out
+    private static readonly int s_numDecodeWorkers = Math.Max(1, Environment.ProcessorCount - 1);
+    private static readonly ParallelOptions s_decodeOptions = new() { MaxDegreeOfParallelism = s_numDecodeWorkers };
+    private static int s_numReceivers = 0;
+
+    // Buffers the frames are read and decoded into. Frames are received one at a time, so they are kept from frame to
+    // frame and only grow; the documents are received concurrently and use their own.
+    private readonly byte[] fieldBytes = new byte[sizeof(long)];
+    private readonly byte[] inflateBytes = new byte[1 << 16];
+    private readonly MemoryStream decompressedPayload = new();
+    private byte[] compressedBytes = new byte[0];
+    private byte[] vertexBytes = new byte[0];
+    private byte[] colorBytes = new byte[0];
+    private byte[] maskBytes = new byte[0];
+    private byte[] chunkBytes = new byte[0];
+    private byte[] codedColorBytes = new byte[0];
+    private byte[] indexBytes = new byte[0];
+    private byte[] normalBytes = new byte[0];
+    private int[] colorChannels = new int[0];
+    private readonly List<int> octreeNodes = new();
+    private readonly List<int> octreeChildren = new();
+
+    // Capture time of the frame being decoded, in microseconds of the server clock; 0 if the server sent none
+    private long frameCaptureTime = 0;
+
+    // Latency trace of the frame being decoded: its id, 0 if it is not traced, the global timestamp of the cameras, and
+    // its arrival time in microseconds of the local clock
+    private int frameId = 0;
+    private ulong frameDeviceTimeStamp = 0;
+    private long frameReceiveTime = 0;
+
+    // Whether the frames of the connection are traced, and the frames displayed whose report is not sent yet. The
+    // reports only hold durations of the local clock, so the clocks of the headset and of the server can differ.
+    private bool isLatencyTraceRequested = false;
+    private readonly Queue<(int FrameId, long ReceiveTime, long DecodedTime, long DisplayedTime)> pendingLatencyReports = new();
+    private int lastReportedFrameId = 0;
+
+    // Documents received since the start, shown by the performance overlay
+    public int NumDocumentsReceived { get; private set; } = 0;
+
     private TcpClient pointCloudClient;
+    private Stream pointCloudStream;
+    private UdpClient pointCloudUdpClient;
     private bool isPointCloudClientConnected = false;
     private bool isPointCloudClientConnecting = false;
     private float pointCloudConnectionTimer = 0.0f;
@@ -55,6 +204,9 @@ public class HoloportReceiver : MonoBehaviour
     {
         pointCloudRenderer = GetComponent<PointCloudRenderer>();
         documentRenderer = GetComponent<DocumentRenderer>();
+
+        pointCloudRenderer.FrameRendered += QueueLatencyReport;
+        UpdateDecodeWorkers(1);
     }
 
     void Update()
@@ -104,7 +256,15 @@ public class HoloportReceiver : MonoBehaviour
         {
             await pointCloudClient.ConnectAsync(ServerIPAddress, PointCloudPort);
             isPointCloudClientConnected = true;
-            ReceivePointClouds();
+
+            // The requests are single bytes, which must not wait for more data to be sent
+            pointCloudClient.NoDelay = true;
+
+            if (IsUdpTransportEnabled || IsMulticastTransportEnabled)
+                StreamPointClouds();
+            else
+                ReceivePointClouds();
+
             gameObject.GetComponent<MeshRenderer>().enabled = true;
         }
         catch (Exception e)
@@ -121,6 +281,20 @@ public class HoloportReceiver : MonoBehaviour
         {
             await documentClient.ConnectAsync(ServerIPAddress, DocumentPort);
             isDocumentClientConnected = true;
+
+            // The size the documents are rendered at: request type, width and height (ushort each)
+            if (documentRenderer != null && documentRenderer.MaxTextureSize > 0)
+            {
+                ushort size = (ushort)Math.Min(documentRenderer.MaxTextureSize, ushort.MaxValue);
+                await documentClient.GetStream().WriteAsync(new byte[] { DocumentSizeRequest, (byte)size, (byte)(size >> 8), (byte)size, (byte)(size >> 8) });
+            }
+
+            // The compressed textures are uploaded as they are; the servers which do not know the request send JPEG images
+            if (documentRenderer != null && documentRenderer.IsCompressedTextureSupported)
+            {
+                await documentClient.GetStream().WriteAsync(new byte[] { DocumentFormatRequest, Etc2Rgb8DocumentFormat });
+            }
+
             ReceiveDocuments();
         }
         catch (Exception e)
@@ -131,45 +305,85 @@ public class HoloportReceiver : MonoBehaviour
 
     private async void ReceivePointClouds()
     {
+        pendingRequests.Clear();
+        ResetLatencyTrace();
+
+        // The frames are read through a buffer, so that their many small fields do not each wait for the socket.
+        // The requests are written to the socket directly.
+        pointCloudStream = new BufferedStream(pointCloudClient.GetStream(), StreamBufferSize);
+
         while (isPointCloudClientConnected && pointCloudClient.Connected)
         {
             try
             {
-                // Request a new frame
-                await pointCloudClient.GetStream().WriteAsync(new byte[] { 0 });
-
-                // Read scale factor (short)
-                short scale = await ReadShortAsync(pointCloudClient);
+                // Keep the request window full; the server pushes the newest frame for each request
+                while (pendingRequests.Count < RequestWindowSize)
+                {
+                    byte request = IsMeshStreamingEnabled ? MeshFrameRequest : IsDeltaStreamingEnabled ? DeltaFrameRequest : FullFrameRequest;
+                    request |= TimestampRequestFlag;
 
-                // Read number of points (4 bytes)
-                int numPoints = await ReadIntAsync(pointCloudClient);
+                    if (IsCompressionEnabled)
+                        request |= CompressionRequestFlag;
 
-                Debug.Log($"Received {numPoints} points with scale {scale}");
+                    // The codings only apply to the full frames; the flags set above are masked off
+                    bool isFullFrame = IsFrameType(request, FullFrameRequest);
 
-                // Initialize arrays for vertices and colors data
-                int verticesSize = PointXYZDataSize * numPoints;
-                int colorsSize = PointRGBDataSize * numPoints;
+                    if (IsTiledStreamingEnabled && isFullFrame)
+                        request |= TiledRequestFlags;
+                    else if (IsSplitStreamingEnabled && isFullFrame)
+                        request |= SplitRequestFlags;
+                    else if (IsSurfelRenderingEnabled && isFullFrame)
+                        request |= SurfelRequestFlags;
+                    else if (IsWideRangeEnabled && isFullFrame)
+                        request |= WideRequestFlag;
+                    else if (IsProgressiveStreamingEnabled && isFullFrame)
+                        request |= ProgressiveRequestFlag;
+                    else if (IsOctreeCodingEnabled && isFullFrame)
+                        request |= OctreeRequestFlag;
 
-                byte[] verticesBytes = new byte[verticesSize];
-                byte[] colorsBytes = new byte[colorsSize];
+                    pendingRequests.Enqueue(request);
+                    await pointCloudClient.GetStream().WriteAsync(BuildRequest(request));
+                }
 
-                // Read vertices data
-                int numBytesRead = 0;
+                // The format of the next frame is given by the request it answers
+                byte answeredRequest = pendingRequests.Dequeue();
+                Stream stream = pointCloudStream;
+                bool isCompressed = (answeredRequest & CompressionRequestFlag) != 0;
+                bool isTiled = IsFrameType(answeredRequest, FullFrameRequest) && (answeredRequest & TiledRequestFlags) == TiledRequestFlags;
+                bool isSplit = !isTiled && IsFrameType(answeredRequest, FullFrameRequest) && (answeredRequest & SplitRequestFlags) == SplitRequestFlags;
 
-                while (numBytesRead < verticesSize)
-                    numBytesRead += await pointCloudClient.GetStream().ReadAsync(verticesBytes, numBytesRead, Math.Min(verticesSize - numBytesRead, 64000));
+                // The chunks of progressive frames and the tiles of tiled frames are compressed one by one
+                await ReceiveTimestampHeaderAsync(stream, answeredRequest);
 
-                // Read color data
-                numBytesRead = 0;
+                if (isTiled)
+                {
+                    await ReceivePointCloudTiled(stream, isCompressed);
+                    continue;
+                }
 
-                while (numBytesRead < colorsSize)
-                    numBytesRead += await pointCloudClient.GetStream().ReadAsync(colorsBytes, numBytesRead, Math.Min(colorsSize - numBytesRead, 64000));
+                if ((answeredRequest & ProgressiveRequestFlag) != 0 && !isSplit)
+                {
+                    await ReceivePointCloudProgressive(stream, isCompressed);
+                    continue;
+                }
 
-                Vector3[] vertices;
-                Color32[] colors;
+                if (isCompressed)
+                    stream = await ReceivePayloadAsync(stream);
 
-                DeserializePointCloud(numPoints, scale, verticesBytes, colorsBytes, out vertices, out colors);
-                pointCloudRenderer.EnqueuePointCloud(scale, vertices, colors);
+                if (IsFrameType(answeredRequest, MeshFrameRequest))
+                    await ReceivePointCloudMesh(stream);
+                else if (IsFrameType(answeredRequest, DeltaFrameRequest))
+                    await ReceivePointCloudDelta(stream);
+                else if (isSplit)
+                    await ReceivePointCloudSplit(stream);
+                else if ((answeredRequest & SurfelRequestFlags) == SurfelRequestFlags)
+                    await ReceivePointCloudSurfels(stream);
+                else if ((answeredRequest & WideRequestFlag) != 0)
+                    await ReceivePointCloudWide(stream);
+                else if ((answeredRequest & OctreeRequestFlag) != 0)
+                    await ReceivePointCloudOctree(stream);
+                else
+                    await ReceivePointCloudFull(stream);
             }
             catch (Exception)
             {
@@ -181,37 +395,1031 @@ public class HoloportReceiver : MonoBehaviour
                     pointCloudClient.Close();
                     pointCloudClient.Dispose();
                     gameObject.GetComponent<MeshRenderer>().enabled = false;
+
+                    // The server sends a keyframe, a geometry and all the tiles to the next connection
+                    voxels.Clear();
+                    splitGeometryId = 0;
+                    tileMask = 0;
+
+                    foreach (PointCloudFrame tile in tiles)
+                        tile?.Resize(0);
+                    pointCloudRenderer.ResetJitterBuffer();
                 }
             }
         }
     }
 
-    private async void ReceiveDocuments()
+    /// <summary>
+    /// Receives the point clouds streamed over UDP, to this headset or to the multicast group. The TCP socket only
+    /// carries the request, and tells when the server is gone. Delta frames need every frame to be received, so only
+    /// full frames are streamed. The frames of the group are coded for all its headsets, so they are not culled.
+    /// </summary>
+    private async void StreamPointClouds()
     {
-        while (isDocumentClientConnected && documentClient.Connected)
+        bool isMulticast = IsMulticastTransportEnabled;
+        FrameReassembler reassembler = new();
+
+        ResetLatencyTrace();
+
+        if (isMulticast)
         {
-            try
+            // Several applications of the device may join the group on the same port
+            pointCloudUdpClient = new UdpClient();
+            pointCloudUdpClient.Client.SetSocketOption(SocketOptionLevel.Socket, SocketOptionName.ReuseAddress, true);
+            pointCloudUdpClient.Client.Bind(new IPEndPoint(IPAddress.Any, MulticastPort));
+            pointCloudUdpClient.JoinMulticastGroup(IPAddress.Parse(MulticastGroupAddress));
+        }
+        else
+        {
+            pointCloudUdpClient = new UdpClient(0);
+        }
+
+        byte request = isMulticast ? MulticastStreamRequest : UdpStreamRequest;
+        request |= TimestampRequestFlag;
+
+        if (IsCompressionEnabled)
+            request |= CompressionRequestFlag;
+
+        if (IsSurfelRenderingEnabled)
+            request |= SurfelRequestFlags;
+        else if (IsWideRangeEnabled)
+            request |= WideRequestFlag;
+        else if (IsOctreeCodingEnabled)
+            request |= OctreeRequestFlag;
+
+        try
+        {
+            int port = ((IPEndPoint)pointCloudUdpClient.Client.LocalEndPoint).Port;
+            await pointCloudClient.GetStream().WriteAsync(isMulticast ? new byte[] { request } : BuildRequest(request, (byte)port, (byte)(port >> 8)));
+            WatchPointCloudConnection();
+
+            while (isPointCloudClientConnected)
             {
-                // Read width
-                short width = await ReadShortAsync(documentClient);
+                UdpReceiveResult result = await pointCloudUdpClient.ReceiveAsync();
+                ArraySegment<byte> frame;
+
+                if (!reassembler.AddPacket(result.Buffer, out frame))
+                    continue;
 
-                // Read height 
-                short height = await ReadShortAsync(documentClient);
+                // The view pose is updated once for each frame received, and the reports are sent with it
+                if (!isMulticast && (IsViewCullingEnabled || pendingLatencyReports.Count > 0))
+                    await pointCloudClient.GetStream().WriteAsync(BuildRequest());
 
-                int dataSize = await ReadIntAsync(documentClient);
+                try
+                {
+                    Stream stream = new MemoryStream(frame.Array, frame.Offset, frame.Count);
 
-                Debug.Log($"Received document with width {width} and height {height}, size {dataSize}");
+                    // The frames of the group are coded with the flags all its headsets requested
+                    byte frameRequest = isMulticast ? (byte)stream.ReadByte() : request;
 
-                // Initialize array for document data
-                byte[] dataBytes = new byte[dataSize];
+                    await ReceiveTimestampHeaderAsync(stream, frameRequest);
+
+                    if ((frameRequest & CompressionRequestFlag) != 0)
+                        stream = await ReceivePayloadAsync(stream);
+
+                    if ((frameRequest & SurfelRequestFlags) == SurfelRequestFlags)
+                        await ReceivePointCloudSurfels(stream);
+                    else if ((frameRequest & WideRequestFlag) != 0)
+                        await ReceivePointCloudWide(stream);
+                    else if ((frameRequest & OctreeRequestFlag) != 0)
+                        await ReceivePointCloudOctree(stream);
+                    else
+                        await ReceivePointCloudFull(stream);
+                }
+                catch (Exception e)
+                {
+                    Debug.LogError("Invalid point cloud frame: " + e.Message);
+                }
+            }
+        }
+        catch (Exception)
+        {
+            // The UDP socket was closed when the TCP connection was lost
+        }
+
+        DisconnectPointCloudClient();
+    }
+
+    /// <summary>
+    /// Builds the bytes of a request, preceded by the latency trace request on the first request of a connection, by
+    /// the reports of the frames displayed since the last request, and by the view pose of the headset when view
+    /// culling is enabled
+    /// </summary>
+    private byte[] BuildRequest(params byte[] request)
+    {
+        Camera headCamera = Camera.main;
+        bool isTraceRequested = IsLatencyTracingEnabled && !isLatencyTraceRequested;
+        bool isPoseSent = IsViewCullingEnabled && headCamera != null;
+        int numReports = pendingLatencyReports.Count;
+
+        if (!isTraceRequested && numReports == 0 && !isPoseSent)
+            return request;
+
+        byte[] message = new byte[(isTraceRequested ? 1 : 0) + numReports * (1 + LatencyReportSize) + (isPoseSent ? 1 + ViewPoseSize : 0) + request.Length];
+        int offset = 0;
+
+        if (isTraceRequested)
+        {
+            message[offset++] = LatencyTraceRequest;
+            isLatencyTraceRequested = true;
+        }
+
+        // The server estimates the delay of the network from the time the frame was held before its report
+        long now = PointCloudRenderer.GetLocalTime();
+
+        while (pendingLatencyReports.Count > 0)
+        {
+            var report = pendingLatencyReports.Dequeue();
+            int[] fields = { report.FrameId, (int)(report.DecodedTime - report.ReceiveTime), (int)(report.DisplayedTime - report.ReceiveTime), (int)(now - report.ReceiveTime) };
+
+            message[offset++] = LatencyReportRequest;
+            Buffer.BlockCopy(fields, 0, message, offset, LatencyReportSize);
+            offset += LatencyReportSize;
+        }
+
+        if (isPoseSent)
+        {
+            // The pose of the head in the space of the point cloud; the Y axis of the points is flipped when they are decoded
+            Vector3 position = transform.InverseTransformPoint(headCamera.transform.position);
+            Vector3 forward = transform.InverseTransformDirection(headCamera.transform.forward);
+            Vector3 up = transform.InverseTransformDirection(headCamera.transform.up);
+            float tanHalfFovY = Mathf.Tan(0.5f * headCamera.fieldOfView * Mathf.Deg2Rad);
+
+            float[] pose = { position.x, -position.y, position.z, forward.x, -forward.y, forward.z, up.x, -up.y, up.z, tanHalfFovY * headCamera.aspect, tanHalfFovY };
+
+            message[offset++] = ViewPoseRequest;
+            Buffer.BlockCopy(pose, 0, message, offset, ViewPoseSize);
+            offset += ViewPoseSize;
+        }
+
+        Buffer.BlockCopy(request, 0, message, offset, request.Length);
+
+        return message;
+    }
+
+    /// <summary>
+    /// Reads the capture time of a frame when its request asked for timestamps, followed by its latency trace when
+    /// the connection is traced
+    /// </summary>
+    private async Task ReceiveTimestampHeaderAsync(Stream stream, byte request)
+    {
+        frameCaptureTime = 0;
+        frameId = 0;
+        frameDeviceTimeStamp = 0;
+
+        if ((request & TimestampRequestFlag) == 0)
+            return;
+
+        frameCaptureTime = await ReadLongAsync(stream);
+
+        if (isLatencyTraceRequested)
+        {
+            frameId = await ReadIntAsync(stream);
+            frameDeviceTimeStamp = (ulong)await ReadLongAsync(stream);
+        }
+
+        // The rest of the frame is received while it is decoded
+        frameReceiveTime = PointCloudRenderer.GetLocalTime();
+    }
+
+    /// <summary>
+    /// Queues the report of a traced frame the first time it is displayed; the report is sent with the next request
+    /// </summary>
+    private void QueueLatencyReport(PointCloudFrame frame)
+    {
+        // The refinements of a progressive frame have the id of its coarse level
+        if (frame.FrameId == 0 || frame.FrameId == lastReportedFrameId)
+            return;
+
+        lastReportedFrameId = frame.FrameId;
+
+        if (pendingLatencyReports.Count == MaxPendingLatencyReports)
+            pendingLatencyReports.Dequeue();
+
+        pendingLatencyReports.Enqueue((frame.FrameId, frame.ReceiveTime, frame.DecodedTime, PointCloudRenderer.GetLocalTime()));
+    }
+
+    /// <summary>
+    /// Forgets the latency trace of the previous connection; each connection requests its own
+    /// </summary>
+    private void ResetLatencyTrace()
+    {
+        isLatencyTraceRequested = false;
+        pendingLatencyReports.Clear();
+        lastReportedFrameId = 0;
+    }
+
+    /// <summary>
+    /// Waits for the server to close the TCP connection of a UDP stream, which sends nothing on it
+    /// </summary>
+    private async void WatchPointCloudConnection()
+    {
+        byte[] buffer = new byte[1];
+
+        try
+        {
+            while (await pointCloudClient.GetStream().ReadAsync(buffer, 0, 1) > 0)
+            {
+            }
+        }
+        catch (Exception)
+        {
+            // The connection was lost
+        }
+
+        DisconnectPointCloudClient();
+    }
+
+    private void DisconnectPointCloudClient()
+    {
+        if (!isPointCloudClientConnected)
+            return;
+
+        // Close the sockets and hide the renderer
+        isPointCloudClientConnecting = false;
+        isPointCloudClientConnected = false;
+        pointCloudClient.Close();
+        pointCloudClient.Dispose();
+        pointCloudUdpClient?.Close();
+        pointCloudUdpClient = null;
+        gameObject.GetComponent<MeshRenderer>().enabled = false;
+        pointCloudRenderer.ResetJitterBuffer();
+    }
+
+    /// <summary>
+    /// Reads the payload header byte and returns the stream to read the frame from. Compressed frames are read entirely
+    /// and decompressed on a worker thread, so that the main thread is never blocked. The decompressed payload is only
+    /// valid until the next one is read.
+    /// </summary>
+    private async Task<Stream> ReceivePayloadAsync(Stream stream)
+    {
+        byte payloadFlags = await ReadByteAsync(stream);
+
+        if (payloadFlags != DeflatePayload)
+            return stream;
+
+        int compressedSize = await ReadIntAsync(stream);
+        byte[] compressed = EnsureCapacity(ref compressedBytes, compressedSize);
+        await ReadAsync(stream, compressed, compressedSize);
+
+        await Task.Run(() =>
+        {
+            decompressedPayload.SetLength(0);
+
+            using DeflateStream deflateStream = new(new MemoryStream(compressed, 0, compressedSize), CompressionMode.Decompress);
+            int numBytes;
+
+            while ((numBytes = deflateStream.Read(inflateBytes, 0, inflateBytes.Length)) > 0)
+                decompressedPayload.Write(inflateBytes, 0, numBytes);
+        });
+
+        decompressedPayload.Position = 0;
+
+        return decompressedPayload;
+    }
+
+    /// <summary>
+    /// Receives a frame sent entirely
+    /// </summary>
+    private async Task ReceivePointCloudFull(Stream stream)
+    {
+        // Read scale factor (short)
+        short scale = await ReadShortAsync(stream);
+
+        // Read number of points (4 bytes)
+        int numPoints = await ReadIntAsync(stream);
+
+        // The procedural draws dequantize the points in their shader, so the points are read into the frame as they are
+        if (pointCloudRenderer.IsProcedural)
+        {
+            PointCloudFrame packedFrame = AcquirePackedFrame(numPoints);
+            packedFrame.Scale = scale;
+            packedFrame.PackedStep = new Vector3(1.0f / scale, -1.0f / scale, 1.0f / scale); // Flip Y axis to get the right orientation
+            packedFrame.PackedOrigin = new Vector3(XRangeCenter - HalfRange, HalfRange - YRangeCenter, ZRangeCenter - HalfRange);
+
+            await ReadAsync(stream, packedFrame.PackedPoints, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+            pointCloudRenderer.EnqueuePointCloud(packedFrame);
+            return;
+        }
+
+        // Read vertices and color data in a single read
+        int colorOffset = PointXYZDataSize * numPoints;
+        byte[] pointBytes = EnsureCapacity(ref vertexBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+        await ReadAsync(stream, pointBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+
+        PointCloudFrame frame = AcquireFrame(numPoints);
+        frame.Scale = scale;
+
+        await Task.Run(() => DeserializePointCloud(frame, pointBytes, pointBytes, colorOffset));
+        pointCloudRenderer.EnqueuePointCloud(frame);
+    }
+
+    /// <summary>
+    /// Receives a wide frame: the minimum and the quantization step of each axis, then the positions packed in 32 bits
+    /// (x in the high bits, then y, then z) and the colors. The positions are spread over the bounding box of the frame.
+    /// </summary>
+    private async Task ReceivePointCloudWide(Stream stream)
+    {
+        PointCloudFrame frame = await ReceiveWideVerticesAsync(stream);
+
+        pointCloudRenderer.EnqueuePointCloud(frame);
+    }
+
+    /// <summary>
+    /// Receives a surfel frame: a wide frame, then the normal of each point in one byte. The normals are octahedral, with
+    /// the lower half of the octahedron folded over the upper one, and decoded through a table of the 256 values.
+    /// </summary>
+    private async Task ReceivePointCloudSurfels(Stream stream)
+    {
+        PointCloudFrame frame = await ReceiveWideVerticesAsync(stream);
+        int numPoints = frame.Count;
+
+        byte[] normals = EnsureCapacity(ref normalBytes, numPoints);
+        await ReadAsync(stream, normals, numPoints);
+
+        frame.ResizeNormals();
+
+        await Task.Run(() =>
+        {
+            Vector3[] frameNormals = frame.Normals;
+
+            DecodeInParallel(numPoints, (start, end) =>
+            {
+                for (int i = start; i < end; i++)
+                    frameNormals[i] = s_surfelNormals[normals[i]];
+            });
+        });
+
+        pointCloudRenderer.EnqueuePointCloud(frame);
+    }
+
+    /// <summary>
+    /// Builds the normal of each octahedral code, in the orientation of the decoded points
+    /// </summary>
+    private static Vector3[] BuildSurfelNormals()
+    {
+        Vector3[] normals = new Vector3[256];
+        float maxLevel = SurfelNormalLevels - 1;
+
+        for (int code = 0; code < normals.Length; code++)
+        {
+            if (code == NoSurfelNormal)
+                continue;
+
+            float x = 2.0f * (code >> 4) / maxLevel - 1.0f;
+            float y = 2.0f * (code & 0x0F) / maxLevel - 1.0f;
+            float z = 1.0f - Mathf.Abs(x) - Mathf.Abs(y);
+
+            if (z < 0.0f)
+            {
+                float foldedX = (1.0f - Mathf.Abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+                float foldedY = (1.0f - Mathf.Abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+                x = foldedX;
+                y = foldedY;
+            }
+
+            // Flip Y axis like the positions
+            normals[code] = new Vector3(x, -y, z).normalized;
+        }
+
+        return normals;
+    }
+
+    /// <summary>
+    /// Receives a mesh frame: the number of triangles, the vertices coded as a wide frame, then three vertex indices for
+    /// each triangle, as ushorts when there are no more than 65536 vertices and as ints otherwise. When the server has
+    /// no mesh, the frame has no triangles and its vertices are the points of the frame.
+    /// </summary>
+    private async Task ReceivePointCloudMesh(Stream stream)
+    {
+        int numTriangles = await ReadIntAsync(stream);
+        PointCloudFrame frame = await ReceiveWideVerticesAsync(stream);
+        int numVertices = frame.Count;
+
+        if (numTriangles > 0)
+        {
+            bool isShortIndex = numVertices <= MaxShortIndexVertices;
+            int numIndexBytes = 3 * numTriangles * (isShortIndex ? sizeof(ushort) : sizeof(int));
+            byte[] indices = EnsureCapacity(ref indexBytes, numIndexBytes);
+            await ReadAsync(stream, indices, numIndexBytes);
+
+            frame.ResizeTriangles(numTriangles);
+
+            await Task.Run(() =>
+            {
+                int[] frameIndices = frame.Indices;
+
+                if (!isShortIndex)
+                {
+                    Buffer.BlockCopy(indices, 0, frameIndices, 0, numIndexBytes);
+                    return;
+                }
+
+                DecodeInParallel(3 * numTriangles, (start, end) =>
+                {
+                    for (int i = start; i < end; i++)
+                        frameIndices[i] = BitConverter.ToUInt16(indices, sizeof(ushort) * i);
+                });
+            });
+        }
+
+        pointCloudRenderer.EnqueuePointCloud(frame);
+    }
+
+    /// <summary>
+    /// Receives the points of a wide frame into a new frame, not enqueued yet
+    /// </summary>
+    private async Task<PointCloudFrame> ReceiveWideVerticesAsync(Stream stream)
+    {
+        short scale = await ReadShortAsync(stream);
+        int numPoints = await ReadIntAsync(stream);
+
+        byte[] pointBytes = EnsureCapacity(ref vertexBytes, 6 * sizeof(float) + (sizeof(uint) + PointRGBDataSize) * numPoints);
+        await ReadAsync(stream, pointBytes, 6 * sizeof(float) + (sizeof(uint) + PointRGBDataSize) * numPoints);
+
+        float minX = BitConverter.ToSingle(pointBytes, 0), minY = BitConverter.ToSingle(pointBytes, 4), minZ = BitConverter.ToSingle(pointBytes, 8);
+        float stepX = BitConverter.ToSingle(pointBytes, 12), stepY = BitConverter.ToSingle(pointBytes, 16), stepZ = BitConverter.ToSingle(pointBytes, 20);
+
+        // The points are as far apart as the coarsest step
+        PointCloudFrame frame = AcquireFrame(numPoints);
+        frame.Scale = 1.0f / Mathf.Max(stepX, Mathf.Max(stepY, stepZ));
+
+        await Task.Run(() =>
+        {
+            Vector3[] vertices = frame.Vertices;
+            int positionOffset = 6 * sizeof(float);
+            const uint YMask = (1u << WideYBits) - 1;
+            const uint ZMask = (1u << WideZBits) - 1;
+
+            DecodeInParallel(numPoints, (start, end) =>
+            {
+                for (int i = start; i < end; i++)
+                {
+                    uint position = BitConverter.ToUInt32(pointBytes, positionOffset + sizeof(uint) * i);
+                    float x = minX + (position >> (WideYBits + WideZBits)) * stepX;
+                    float y = minY + ((position >> WideZBits) & YMask) * stepY;
+                    float z = minZ + (position & ZMask) * stepZ;
+
+                    vertices[i] = new Vector3(x, -y, z); // Flip Y axis to get the right orientation
+                }
+            });
+
+            DeserializeColors(frame, pointBytes, positionOffset + sizeof(uint) * numPoints);
+        });
+
+        return frame;
+    }
+
+    /// <summary>
+    /// Receives a frame coded as an octree: the child occupancy mask of each node, level by level, then the coded colors
+    /// of the voxels in the order of the leaves. The number of masks of a level is the number of bits set at the level above.
+    /// </summary>
+    private async Task ReceivePointCloudOctree(Stream stream)
+    {
+        short scale = await ReadShortAsync(stream);
+        int numPoints = await ReadIntAsync(stream);
+
+        // Voxel positions (packed x, y, z bytes) of the nodes of the current level, in Morton order
+        List<int> nodes = octreeNodes;
+        List<int> children = octreeChildren;
+
+        nodes.Clear();
+        nodes.Add(0);
+
+        // Masks of the parents of the leaves, which give the density of the leaves
+        byte[] leafMasks = null;
+        int numParents = 0;
+
+        for (int depth = 0; depth < OctreeDepth && numPoints > 0; depth++)
+        {
+            byte[] masks = EnsureCapacity(ref maskBytes, nodes.Count);
+            await ReadAsync(stream, masks, nodes.Count);
+
+            await ExpandOctreeLevelAsync(nodes, masks, depth, children);
+            (leafMasks, numParents) = (masks, nodes.Count);
+            (nodes, children) = (children, nodes);
+        }
+
+        if (numPoints > 0 && nodes.Count != numPoints)
+            throw new InvalidDataException($"Octree has {nodes.Count} leaves for {numPoints} points");
+
+        byte[] colorsBytes = await ReceiveOctreeColorsAsync(stream, numPoints);
+
+        PointCloudFrame frame = AcquireFrame(numPoints);
+        frame.Scale = scale;
+
+        await Task.Run(() =>
+        {
+            DecodeVoxels(frame, nodes, 0, scale);
+            DeserializeColors(frame, colorsBytes, 0);
+            SetLeafDensities(frame, leafMasks, numParents);
+        });
+
+        pointCloudRenderer.EnqueuePointCloud(frame);
+    }
+
+    /// <summary>
+    /// Receives a progressive frame: a coarse octree level, then one chunk for each finer level, until the server
+    /// reaches the deadline of the frame. Each chunk gives the masks of the levels above it and the mean colors of its
+    /// nodes, and is rendered as soon as it is received, with the points the size of the nodes.
+    /// </summary>
+    private async Task ReceivePointCloudProgressive(Stream stream, bool isCompressed)
+    {
+        short scale = await ReadShortAsync(stream);
+        int numPoints = await ReadIntAsync(stream);
+
+        // Voxel positions (packed x, y, z bytes) of the nodes of the deepest level received, in Morton order
+        List<int> nodes = octreeNodes;
+        List<int> children = octreeChildren;
+        int nodeDepth = 0;
+        bool isCoarseChunk = true;
+
+        nodes.Clear();
+        nodes.Add(0);
+
+        while (true)
+        {
+            byte depth = await ReadByteAsync(stream);
+
+            if (depth == EndOfFrameDepth)
+                break;
+
+            int chunkSize = await ReadIntAsync(stream);
+            byte[] chunk = EnsureCapacity(ref chunkBytes, chunkSize);
+            await ReadAsync(stream, chunk, chunkSize);
+
+            Stream chunkStream = new MemoryStream(chunk, 0, chunkSize);
+
+            if (isCompressed)
+                chunkStream = await ReceivePayloadAsync(chunkStream);
 
-                // Read document data
-                int numBytesRead = 0;
+            int numNodes = await ReadIntAsync(chunkStream);
+            byte[] leafMasks = null;
+            int numParents = 0;
 
-                while (numBytesRead < dataSize)
-                    numBytesRead += await documentClient.GetStream().ReadAsync(dataBytes, numBytesRead, Math.Min(dataSize - numBytesRead, 64000));
+            for (; nodeDepth < depth; nodeDepth++)
+            {
+                byte[] masks = EnsureCapacity(ref maskBytes, nodes.Count);
+                await ReadAsync(chunkStream, masks, nodes.Count);
+
+                await ExpandOctreeLevelAsync(nodes, masks, nodeDepth, children);
+                (leafMasks, numParents) = (masks, nodes.Count);
+                (nodes, children) = (children, nodes);
+            }
+
+            if (nodes.Count != numNodes)
+                throw new InvalidDataException($"Progressive chunk has {nodes.Count} nodes instead of {numNodes}");
+
+            byte[] colorsBytes = EnsureCapacity(ref colorBytes, PointRGBDataSize * numNodes);
+            await ReadAsync(chunkStream, colorsBytes, PointRGBDataSize * numNodes);
+
+            // The points are at the centers of the nodes, and the nodes of the coarse levels are larger than a voxel,
+            // and so are their points
+            int cellSize = 1 << (OctreeDepth - depth);
+            PointCloudFrame frame = AcquireFrame(numNodes);
+            frame.Scale = (float)scale / cellSize;
+
+            await Task.Run(() =>
+            {
+                DecodeVoxels(frame, nodes, cellSize / 2, scale);
+                DeserializeColors(frame, colorsBytes, 0);
+                SetLeafDensities(frame, leafMasks, numParents);
+            });
+
+            if (isCoarseChunk)
+                pointCloudRenderer.EnqueuePointCloud(frame);
+            else
+                pointCloudRenderer.EnqueuePointCloudRefinement(frame);
+
+            isCoarseChunk = false;
+        }
+    }
+
+    /// <summary>
+    /// Expands a level of an octree, on a worker thread when the level is large
+    /// </summary>
+    private static async Task ExpandOctreeLevelAsync(List<int> nodes, byte[] masks, int depth, List<int> children)
+    {
+        if (nodes.Count < DecodeBatchSize)
+            ExpandOctreeLevel(nodes, masks, depth, children);
+        else
+            await Task.Run(() => ExpandOctreeLevel(nodes, masks, depth, children));
+    }
+
+    /// <summary>
+    /// Adds the children of the nodes of a level, given the child occupancy mask of each node
+    /// </summary>
+    private static void ExpandOctreeLevel(List<int> nodes, byte[] masks, int depth, List<int> children)
+    {
+        int bit = OctreeDepth - 1 - depth;
+
+        children.Clear();
+
+        for (int i = 0; i < nodes.Count; i++)
+        {
+            for (int child = 0; child < 8; child++)
+            {
+                if ((masks[i] & (1 << child)) == 0)
+                    continue;
+
+                // The child index holds one bit of each axis, (x << 2) | (y << 1) | z
+                children.Add(nodes[i] | (((child >> 2) & 1) << (16 + bit)) | (((child >> 1) & 1) << (8 + bit)) | ((child & 1) << bit));
+            }
+        }
+    }
+
+    /// <summary>
+    /// Keeps the number of occupied siblings of each leaf of an octree, 1 to 8, in the alpha of its color, for the
+    /// renderer to size the points by their local density; the leaves are in the order of the masks of their parents.
+    /// The leaves keep an alpha of 255 when the masks of their parents are unknown.
+    /// </summary>
+    private static void SetLeafDensities(PointCloudFrame frame, byte[] parentMasks, int numParents)
+    {
+        if (parentMasks == null)
+            return;
+
+        Color32[] colors = frame.Colors;
+        int leaf = 0;
+
+        for (int i = 0; i < numParents && leaf < frame.Count; i++)
+        {
+            byte siblings = 0;
+
+            for (int mask = parentMasks[i]; mask != 0; mask &= mask - 1)
+                siblings++;
+
+            for (int child = 0; child < siblings && leaf < frame.Count; child++)
+                colors[leaf++].a = siblings;
+        }
+    }
+
+    /// <summary>
+    /// Reads the colors of an octree frame: the chroma quantization step, then the residuals of the Y, Co and Cg channels
+    /// as zigzag varints, each predicted from the previous voxel
+    /// </summary>
+    /// <returns>The RGB colors of the voxels, valid until the next frame is read</returns>
+    private async Task<byte[]> ReceiveOctreeColorsAsync(Stream stream, int numPoints)
+    {
+        int chromaStep = await ReadByteAsync(stream);
+        int codedSize = await ReadIntAsync(stream);
+
+        if (codedSize < 0)
+            throw new InvalidDataException($"Octree colors of {codedSize} bytes");
+
+        byte[] coded = EnsureCapacity(ref codedColorBytes, codedSize);
+        await ReadAsync(stream, coded, codedSize);
+
+        return await Task.Run(() => DecodeOctreeColors(coded, codedSize, chromaStep, numPoints));
+    }
+
+    /// <summary>
+    /// Decodes the colors of an octree frame: the residuals of the Y, Co and Cg channels as zigzag varints, each
+    /// predicted from the previous voxel. The frame is dropped if they run past the coded bytes.
+    /// </summary>
+    private byte[] DecodeOctreeColors(byte[] coded, int codedSize, int chromaStep, int numPoints)
+    {
+        if (colorChannels.Length < 3 * numPoints)
+            colorChannels = new int[Mathf.NextPowerOfTwo(3 * numPoints)];
+
+        int[] channels = colorChannels;
+        int offset = 0;
+
+        for (int channel = 0; channel < 3; channel++)
+        {
+            int value = 0;
+
+            for (int i = 0; i < numPoints; i++)
+            {
+                uint zigzag = 0;
+                int shift = 0;
+                byte codedByte;
+
+                do
+                {
+                    if (offset >= codedSize)
+                        throw new InvalidDataException("Octree colors are shorter than their voxels");
+
+                    codedByte = coded[offset++];
+                    zigzag |= (uint)(codedByte & 0x7F) << shift;
+                    shift += 7;
+                }
+                while ((codedByte & 0x80) != 0);
+
+                value += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+                channels[channel * numPoints + i] = value;
+            }
+        }
+
+        byte[] colorsBytes = EnsureCapacity(ref colorBytes, PointRGBDataSize * numPoints);
+
+        for (int i = 0; i < numPoints; i++)
+        {
+            int y = channels[i];
+            int co = channels[numPoints + i] * chromaStep;
+            int cg = channels[2 * numPoints + i] * chromaStep;
+
+            // Inverse YCoCg-R transform; quantized chroma can land slightly out of range
+            int t = y - (cg >> 1);
+            int g = cg + t;
+            int b = t - (co >> 1);
+            int r = b + co;
+
+            int colorOffset = i * PointRGBDataSize;
+            colorsBytes[colorOffset] = (byte)Mathf.Clamp(r, 0, 255);
+            colorsBytes[colorOffset + 1] = (byte)Mathf.Clamp(g, 0, 255);
+            colorsBytes[colorOffset + 2] = (byte)Mathf.Clamp(b, 0, 255);
+        }
+
+        return colorsBytes;
+    }
+
+    /// <summary>
+    /// Receives a frame in delta mode and applies it to the voxels of the previous frame. Keyframes replace all the
+    /// voxels; delta frames list the voxels removed, then the ones added or recolored. The renderer is given the
+    /// complete point cloud, so it can drop queued frames without losing the state.
+    /// </summary>
+    private async Task ReceivePointCloudDelta(Stream stream)
+    {
+        byte frameType = await ReadByteAsync(stream);
+        short scale = await ReadShortAsync(stream);
+
+        if (frameType == KeyframeType)
+        {
+            int numPoints = await ReadIntAsync(stream);
+            byte[] pointBytes = EnsureCapacity(ref vertexBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+            await ReadAsync(stream, pointBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+
+            await Task.Run(() =>
+            {
+                voxels.Clear();
+                SetVoxels(numPoints, pointBytes, 0, PointXYZDataSize * numPoints);
+            });
+        }
+        else
+        {
+            int numRemoved = await ReadIntAsync(stream);
+            byte[] removedBytes = EnsureCapacity(ref colorBytes, PointXYZDataSize * numRemoved);
+            await ReadAsync(stream, removedBytes, PointXYZDataSize * numRemoved);
+
+            int numUpdated = await ReadIntAsync(stream);
+            byte[] pointBytes = EnsureCapacity(ref vertexBytes, (PointXYZDataSize + PointRGBDataSize) * numUpdated);
+            await ReadAsync(stream, pointBytes, (PointXYZDataSize + PointRGBDataSize) * numUpdated);
+
+            await Task.Run(() =>
+            {
+                for (int i = 0; i < numRemoved; i++)
+                {
+                    int offset = i * PointXYZDataSize;
+                    voxels.Remove(PackVoxel(removedBytes[offset], removedBytes[offset + 1], removedBytes[offset + 2]));
+                }
+
+                SetVoxels(numUpdated, pointBytes, 0, PointXYZDataSize * numUpdated);
+            });
+        }
+
+        PointCloudFrame frame = AcquireFrame(voxels.Count);
+        frame.Scale = scale;
+
+        await Task.Run(() =>
+        {
+            int index = 0;
+
+            foreach (KeyValuePair<int, Color32> voxel in voxels)
+            {
+                frame.Vertices[index] = DecodeVoxel(voxel.Key, 0, scale);
+                frame.Colors[index] = voxel.Value;
+                index++;
+            }
+        });
+
+        pointCloudRenderer.EnqueuePointCloud(frame);
+    }
+
+    /// <summary>
+    /// Receives a split frame: the type of the frame and the id of its geometry, then either the geometry as a full
+    /// frame, or the colors of the points of the geometry held, none if they did not change
+    /// </summary>
+    private async Task ReceivePointCloudSplit(Stream stream)
+    {
+        byte frameType = await ReadByteAsync(stream);
+        int geometryId = await ReadIntAsync(stream);
+        PointCloudFrame frame;
+
+        if (frameType == GeometryFrameType)
+        {
+            short scale = await ReadShortAsync(stream);
+            int numPoints = await ReadIntAsync(stream);
+
+            int colorOffset = PointXYZDataSize * numPoints;
+            byte[] pointBytes = EnsureCapacity(ref vertexBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+            await ReadAsync(stream, pointBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+
+            frame = AcquireFrame(numPoints);
+            frame.Scale = scale;
+
+            await Task.Run(() =>
+            {
+                DeserializePointCloud(frame, pointBytes, pointBytes, colorOffset);
+
+                if (splitVertices.Length < numPoints)
+                {
+                    splitVertices = new Vector3[frame.Vertices.Length];
+                    splitColors = new Color32[frame.Vertices.Length];
+                }
+
+                Array.Copy(frame.Vertices, splitVertices, numPoints);
+                Array.Copy(frame.Colors, splitColors, numPoints);
+            });
+
+            splitGeometryId = geometryId;
+            splitScale = scale;
+            splitCount = numPoints;
+        }
+        else
+        {
+            // The server only sends the colors of the geometry it sent last
+            if (geometryId != splitGeometryId)
+                throw new InvalidDataException($"Colors of geometry {geometryId}, which is not held");
+
+            int numColors = await ReadIntAsync(stream);
+
+            if (numColors != 0 && numColors != splitCount)
+                throw new InvalidDataException($"{numColors} colors for a geometry of {splitCount} points");
+
+            byte[] frameColorBytes = EnsureCapacity(ref colorBytes, PointRGBDataSize * numColors);
+            await ReadAsync(stream, frameColorBytes, PointRGBDataSize * numColors);
+
+            frame = AcquireFrame(splitCount);
+            frame.Scale = splitScale;
+
+            await Task.Run(() =>
+            {
+                Array.Copy(splitVertices, frame.Vertices, splitCount);
+
+                if (numColors > 0)
+                {
+                    DeserializeColors(frame, frameColorBytes, 0);
+                    Array.Copy(frame.Colors, splitColors, splitCount);
+                }
+                else
+                {
+                    Array.Copy(splitColors, frame.Colors, splitCount);
+                }
+            });
+        }
+
+        // The renderer keeps the positions of the geometry it shows, and only updates the colors
+        frame.GeometryId = geometryId;
+        pointCloudRenderer.EnqueuePointCloud(frame);
+    }
+
+    /// <summary>
+    /// Receives a tiled frame: its scale and the mask of the tiles which hold points, then the tiles which changed, each
+    /// as its index, the size of its chunk and the chunk, compressed on its own: a full frame of the points of the tile.
+    /// The tiles held are rendered as soon as the first tile arrives, then as the others arrive, no more often than the
+    /// render interval of the tiles.
+    /// </summary>
+    private async Task ReceivePointCloudTiled(Stream stream, bool isCompressed)
+    {
+        short scale = await ReadShortAsync(stream);
+        tileMask = (ulong)await ReadLongAsync(stream);
+
+        bool isRendered = false;
+        bool isRenderPending = true; // The tiles left out of the mask are removed even when no tile changed
+        long renderTime = 0;
+
+        while (true)
+        {
+            byte tile = await ReadByteAsync(stream);
+
+            if (tile == EndOfTilesIndex)
+                break;
+
+            if (tile >= NumTiles)
+                throw new InvalidDataException($"Tile {tile} out of the {NumTiles} tiles");
+
+            int chunkSize = await ReadIntAsync(stream);
+            byte[] chunk = EnsureCapacity(ref chunkBytes, chunkSize);
+            await ReadAsync(stream, chunk, chunkSize);
+
+            Stream chunkStream = new MemoryStream(chunk, 0, chunkSize);
+
+            if (isCompressed)
+                chunkStream = await ReceivePayloadAsync(chunkStream);
+
+            short tileScale = await ReadShortAsync(chunkStream);
+            int numPoints = await ReadIntAsync(chunkStream);
+
+            int colorOffset = PointXYZDataSize * numPoints;
+            byte[] pointBytes = EnsureCapacity(ref vertexBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+            await ReadAsync(chunkStream, pointBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+
+            // The tiles keep their own scale, since those sent before a change of scale are only replaced as they arrive
+            PointCloudFrame tileFrame = tiles[tile] ??= new PointCloudFrame();
+            tileFrame.Resize(numPoints);
+            tileFrame.Scale = tileScale;
+
+            await Task.Run(() => DeserializePointCloud(tileFrame, pointBytes, pointBytes, colorOffset));
+            isRenderPending = true;
+
+            if (!isRendered || PointCloudRenderer.GetLocalTime() - renderTime >= TileRenderIntervalUs)
+            {
+                await RenderTiles(scale, isRendered);
+                isRendered = true;
+                isRenderPending = false;
+                renderTime = PointCloudRenderer.GetLocalTime();
+            }
+        }
+
+        if (isRenderPending)
+            await RenderTiles(scale, isRendered);
+    }
+
+    /// <summary>
+    /// Enqueues the points of the tiles held in the mask of the last tiled frame, as the frame, or as a refinement of
+    /// the frame when its first tiles were already enqueued
+    /// </summary>
+    private async Task RenderTiles(short scale, bool isRefinement)
+    {
+        int numPoints = 0;
+
+        for (int i = 0; i < NumTiles; i++)
+        {
+            if ((tileMask & (1ul << i)) != 0 && tiles[i] != null)
+                numPoints += tiles[i].Count;
+        }
+
+        PointCloudFrame frame = AcquireFrame(numPoints);
+        frame.Scale = scale;
+
+        await Task.Run(() =>
+        {
+            int offset = 0;
+
+            for (int i = 0; i < NumTiles; i++)
+            {
+                if ((tileMask & (1ul << i)) == 0 || tiles[i] == null)
+                    continue;
+
+                Array.Copy(tiles[i].Vertices, 0, frame.Vertices, offset, tiles[i].Count);
+                Array.Copy(tiles[i].Colors, 0, frame.Colors, offset, tiles[i].Count);
+                offset += tiles[i].Count;
+            }
+        });
+
+        // Each refinement holds all the tiles before it, so it is never dropped for adding no detail
+        if (isRefinement)
+            pointCloudRenderer.EnqueuePointCloudRefinement(frame, false);
+        else
+            pointCloudRenderer.EnqueuePointCloud(frame);
+    }
+
+    private void SetVoxels(int numPoints, byte[] pointBytes, int vertexOffset, int colorOffset)
+    {
+        for (int i = 0; i < numPoints; i++)
+        {
+            int offset = vertexOffset + i * PointXYZDataSize;
+            int color = colorOffset + i * PointRGBDataSize;
+
+            voxels[PackVoxel(pointBytes[offset], pointBytes[offset + 1], pointBytes[offset + 2])] =
+                new Color32(pointBytes[color], pointBytes[color + 1], pointBytes[color + 2], 255);
+        }
+    }
+
+    /// <summary>
+    /// Tells whether a request, with its flags, asks for a type of frame
+    /// </summary>
+    private static bool IsFrameType(byte request, byte frameType)
+    {
+        return (request & FrameTypeMask) == frameType;
+    }
+
+    private static int PackVoxel(byte x, byte y, byte z)
+    {
+        return (x << 16) | (y << 8) | z;
+    }
+
+    private async void ReceiveDocuments()
+    {
+        // The header of each document: width (short), height (short), size of the data (int)
+        byte[] headerBytes = new byte[8];
+
+        while (isDocumentClientConnected && documentClient.Connected)
+        {
+            try
+            {
+                await ReadAsync(documentClient.GetStream(), headerBytes, headerBytes.Length);
+
+                short width = BitConverter.ToInt16(headerBytes, 0);
+                short height = BitConverter.ToInt16(headerBytes, 2);
+                int dataSize = BitConverter.ToInt32(headerBytes, 4);
+
+                // The document renderer keeps the data, so each document gets its own array; documents are rare
+                byte[] dataBytes = new byte[dataSize];
+                await ReadAsync(documentClient.GetStream(), dataBytes, dataSize);
 
                 documentRenderer.EnqueueDocument(width, height, dataBytes);
+                NumDocumentsReceived++;
             }
             catch (Exception)
             {
@@ -227,74 +1435,195 @@ public class HoloportReceiver : MonoBehaviour
         }
     }
 
-    private void DeserializePointCloud(int numPoints, float scale, byte[] verticesBytes, byte[] colorsBytes, out Vector3[] vertices, out Color32[] colors)
+    /// <summary>
+    /// Decodes the byte positions and the colors of a frame into its buffers
+    /// </summary>
+    private void DeserializePointCloud(PointCloudFrame frame, byte[] verticesBytes, byte[] colorsBytes, int colorOffset)
     {
-        vertices = new Vector3[numPoints];
-        colors = new Color32[numPoints];
+        Vector3[] vertices = frame.Vertices;
+        float scale = frame.Scale;
 
-        // Deserialize position data
-        for (int i = 0; i < numPoints; i++)
+        DecodeInParallel(frame.Count, (start, end) =>
         {
-            int offset = i * PointXYZDataSize;
-            float x = DecodeByteToFloat(verticesBytes[offset], XRangeCenter, scale);
-            float y = -1.0f * DecodeByteToFloat(verticesBytes[offset + 1], YRangeCenter, scale); // Flip Y axis to get the right orientation
-            float z = DecodeByteToFloat(verticesBytes[offset + 2], ZRangeCenter, scale);
+            for (int i = start; i < end; i++)
+            {
+                int offset = i * PointXYZDataSize;
+                float x = DecodeByteToFloat(verticesBytes[offset], XRangeCenter, scale);
+                float y = -1.0f * DecodeByteToFloat(verticesBytes[offset + 1], YRangeCenter, scale); // Flip Y axis to get the right orientation
+                float z = DecodeByteToFloat(verticesBytes[offset + 2], ZRangeCenter, scale);
 
-            vertices[i] = new Vector3(x, y, z);
-        }
+                vertices[i] = new Vector3(x, y, z);
+            }
+        });
 
-        // Deserialize color data
-        for (int i = 0; i < numPoints; i++)
+        DeserializeColors(frame, colorsBytes, colorOffset);
+    }
+
+    private static void DeserializeColors(PointCloudFrame frame, byte[] colorsBytes, int colorOffset)
+    {
+        Color32[] colors = frame.Colors;
+
+        DecodeInParallel(frame.Count, (start, end) =>
         {
-            int colorOffset = i * PointRGBDataSize;
-            byte r = colorsBytes[colorOffset];
-            byte g = colorsBytes[colorOffset + 1];
-            byte b = colorsBytes[colorOffset + 2];
+            for (int i = start; i < end; i++)
+            {
+                int offset = colorOffset + i * PointRGBDataSize;
+                colors[i] = new Color32(colorsBytes[offset], colorsBytes[offset + 1], colorsBytes[offset + 2], 255);
+            }
+        });
+    }
+
+    /// <summary>
+    /// Decodes the voxel positions of the nodes of an octree level into a frame
+    /// </summary>
+    private void DecodeVoxels(PointCloudFrame frame, List<int> nodes, int offset, float scale)
+    {
+        Vector3[] vertices = frame.Vertices;
+
+        DecodeInParallel(frame.Count, (start, end) =>
+        {
+            for (int i = start; i < end; i++)
+                vertices[i] = DecodeVoxel(nodes[i], offset, scale);
+        });
+    }
 
-            colors[i] = new Color32(r, g, b, 255);
+    /// <summary>
+    /// Splits the decoding of a frame into batches of points decoded on the worker threads; it must be called from a
+    /// worker thread, so that the main thread never waits for it
+    /// </summary>
+    private static void DecodeInParallel(int numPoints, Action<int, int> decodeBatch)
+    {
+        int numBatches = (numPoints + DecodeBatchSize - 1) / DecodeBatchSize;
+
+        if (numBatches <= 1)
+        {
+            decodeBatch(0, numPoints);
+            return;
         }
+
+        Parallel.For(0, numBatches, s_decodeOptions, batch => decodeBatch(batch * DecodeBatchSize, Math.Min(numPoints, (batch + 1) * DecodeBatchSize)));
+    }
+
+    /// <summary>
+    /// Counts a receiver in or out of the session, and gives each receiver its share of the decode worker threads
+    /// </summary>
+    private static void UpdateDecodeWorkers(int numReceiversAdded)
+    {
+        s_numReceivers = Math.Max(0, s_numReceivers + numReceiversAdded);
+        s_decodeOptions.MaxDegreeOfParallelism = Math.Max(1, s_numDecodeWorkers / Math.Max(1, s_numReceivers));
     }
 
-    private async Task<short> ReadShortAsync(TcpClient client)
+    /// <summary>
+    /// Decodes a voxel position (packed x, y, z bytes), offset within the voxel by the given number of steps
+    /// </summary>
+    private Vector3 DecodeVoxel(int voxel, int offset, float scale)
     {
-        int numBytesToRead = sizeof(short);
-        byte[] buffer = await ReadAsync(client, numBytesToRead);
+        float x = DecodeByteToFloat((byte)(voxel >> 16), XRangeCenter, scale, offset);
+        float y = -1.0f * DecodeByteToFloat((byte)(voxel >> 8), YRangeCenter, scale, offset); // Flip Y axis to get the right orientation
+        float z = DecodeByteToFloat((byte)voxel, ZRangeCenter, scale, offset);
 
-        return BitConverter.ToInt16(buffer, 0);
+        return new Vector3(x, y, z);
     }
 
-    private async Task<int> ReadIntAsync(TcpClient client)
+    private async Task<byte> ReadByteAsync(Stream stream)
     {
-        int numBytesToRead = sizeof(int);
-        byte[] buffer = await ReadAsync(client, numBytesToRead);
+        await ReadAsync(stream, fieldBytes, 1);
 
-        return BitConverter.ToInt32(buffer, 0);
+        return fieldBytes[0];
     }
 
-    private async Task<byte[]> ReadAsync(TcpClient client, int numBytesToRead)
+    private async Task<short> ReadShortAsync(Stream stream)
+    {
+        await ReadAsync(stream, fieldBytes, sizeof(short));
+
+        return BitConverter.ToInt16(fieldBytes, 0);
+    }
+
+    private async Task<int> ReadIntAsync(Stream stream)
+    {
+        await ReadAsync(stream, fieldBytes, sizeof(int));
+
+        return BitConverter.ToInt32(fieldBytes, 0);
+    }
+
+    private async Task<long> ReadLongAsync(Stream stream)
+    {
+        await ReadAsync(stream, fieldBytes, sizeof(long));
+
+        return BitConverter.ToInt64(fieldBytes, 0);
+    }
+
+    /// <summary>
+    /// Returns a frame of the renderer to decode the current frame into, stamped with its capture time and its trace
+    /// </summary>
+    private PointCloudFrame AcquireFrame(int numPoints)
+    {
+        return StampFrame(pointCloudRenderer.AcquirePointCloud(numPoints));
+    }
+
+    /// <summary>
+    /// Returns a packed frame of the renderer to read the points of the current frame into, stamped as by AcquireFrame
+    /// </summary>
+    private PointCloudFrame AcquirePackedFrame(int numPoints)
+    {
+        return StampFrame(pointCloudRenderer.AcquirePackedPointCloud(numPoints));
+    }
+
+    private PointCloudFrame StampFrame(PointCloudFrame frame)
+    {
+        frame.CaptureTime = frameCaptureTime;
+        frame.FrameId = frameId;
+        frame.DeviceTimeStamp = frameDeviceTimeStamp;
+        frame.ReceiveTime = frameReceiveTime;
+
+        return frame;
+    }
+
+    /// <summary>
+    /// Fills the start of a buffer from a stream
+    /// </summary>
+    private static async Task ReadAsync(Stream stream, byte[] buffer, int numBytesToRead)
     {
-        byte[] buffer = new byte[numBytesToRead];
         int numBytesRead = 0;
 
         while (numBytesRead < numBytesToRead)
         {
-            numBytesRead += await client.GetStream().ReadAsync(buffer, numBytesRead, numBytesToRead - numBytesRead);
+            int numBytes = await stream.ReadAsync(buffer, numBytesRead, numBytesToRead - numBytesRead);
+
+            // The connection was closed, or a decompressed frame is shorter than announced
+            if (numBytes == 0)
+                throw new EndOfStreamException();
+
+            numBytesRead += numBytes;
         }
+    }
+
+    /// <summary>
+    /// Returns a buffer of at least the given size. Buffers only grow, with some headroom, so that they are soon
+    /// allocated for good.
+    /// </summary>
+    private static byte[] EnsureCapacity(ref byte[] buffer, int size)
+    {
+        if (buffer.Length < size)
+            buffer = new byte[Mathf.NextPowerOfTwo(size)];
 
         return buffer;
     }
 
-    private float DecodeByteToFloat(byte encoded, float rangeCenter, float scale)
+    private float DecodeByteToFloat(byte encoded, float rangeCenter, float scale, int offset = 0)
     {
-        return encoded / scale - HalfRange + rangeCenter;
+        return (encoded + offset) / scale - HalfRange + rangeCenter;
     }
 
     private void OnDestroy()
     {
+        UpdateDecodeWorkers(-1);
+
         isPointCloudClientConnecting = false;
         isPointCloudClientConnected = false;
         pointCloudClient.Close();
         pointCloudClient.Dispose();
+        pointCloudUdpClient?.Close();
 
         isDocumentClientConnecting = false;
         isDocumentClientConnected = false;
@@ -0,0 +1,271 @@
+/***************************************************************************\
+
+Module Name:  PerformanceOverlay.cs
+Project:      HoloLensReceiver
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module shows the performance of the receiver in front of the viewer:
+the rates at which the point clouds are received and rendered, the frame
+rate of the device, the time the frames take to decode, the depth of the
+jitter buffer, the latency of the frames from their arrival to their
+display, and the points and documents received. The counters are summed
+over a short interval, and the text is written into a buffer allocated once
+and given to the text mesh only when the values are refreshed, so that the
+overlay allocates nothing from frame to frame. It is toggled with the
+"show stats" and "hide stats" voice commands, or the P key.
+
+\***************************************************************************/
+
+using TMPro;
+using UnityEngine;
+#if UNITY_WSA || UNITY_STANDALONE_WIN
+using UnityEngine.Windows.Speech;
+#endif
+
+[RequireComponent(typeof(PointCloudRenderer), typeof(HoloportReceiver))]
+public class PerformanceOverlay : MonoBehaviour
+{
+    public bool IsOverlayShown = false;
+    public KeyCode ToggleKey = KeyCode.P;
+    public float RefreshInterval = 0.5f; // Seconds over which the counters are summed before they are shown
+    public TMP_FontAsset Font; // The default font of TextMesh Pro if none
+    public float FontSize = 0.2f;
+    public Vector3 ViewOffset = new(0.0f, -0.1f, 0.8f); // Position of the text in front of the viewer, in meters
+
+    private const string ShowKeyword = "show stats";
+    private const string HideKeyword = "hide stats";
+    private const int TextCapacity = 512;
+
+    private PointCloudRenderer pointCloudRenderer;
+    private HoloportReceiver holoportReceiver;
+    private DocumentRenderer documentRenderer;
+    private TextMeshPro overlayText;
+    private readonly char[] textBuffer = new char[TextCapacity];
+    private int textLength = 0;
+
+#if UNITY_WSA || UNITY_STANDALONE_WIN
+    private KeywordRecognizer keywordRecognizer;
+#endif
+
+    // Counters of the current interval; the times are in microseconds of the local clock
+    private float intervalTime = 0.0f;
+    private int numDisplayFrames = 0;
+    private int numReceivedFrames = 0;
+    private int numRenderedFrames = 0;
+    private int numDecodedFrames = 0;
+    private long decodeTimeSum = 0;
+    private int numLatencyFrames = 0;
+    private long latencySum = 0;
+    private long maxLatency = 0;
+    private int maxQueueDepth = 0;
+    private long pointSum = 0;
+
+    private void Start()
+    {
+        pointCloudRenderer = GetComponent<PointCloudRenderer>();
+        holoportReceiver = GetComponent<HoloportReceiver>();
+        documentRenderer = GetComponent<DocumentRenderer>();
+
+        pointCloudRenderer.FrameEnqueued += CountReceivedFrame;
+        pointCloudRenderer.FrameRendered += CountRenderedFrame;
+
+        GameObject textObject = new("PerformanceOverlay");
+        overlayText = textObject.AddComponent<TextMeshPro>();
+
+        if (Font != null)
+            overlayText.font = Font;
+
+        overlayText.fontSize = FontSize;
+        overlayText.alignment = TextAlignmentOptions.Center;
+        overlayText.enableWordWrapping = false;
+        overlayText.rectTransform.sizeDelta = new Vector2(0.4f, 0.2f);
+        textObject.SetActive(IsOverlayShown);
+
+#if UNITY_WSA || UNITY_STANDALONE_WIN
+        if (PhraseRecognitionSystem.isSupported)
+        {
+            keywordRecognizer = new KeywordRecognizer(new[] { ShowKeyword, HideKeyword });
+            keywordRecognizer.OnPhraseRecognized += args => SetOverlayShown(args.text == ShowKeyword);
+            keywordRecognizer.Start();
+        }
+#endif
+    }
+
+    private void OnDestroy()
+    {
+        if (pointCloudRenderer != null)
+        {
+            pointCloudRenderer.FrameEnqueued -= CountReceivedFrame;
+            pointCloudRenderer.FrameRendered -= CountRenderedFrame;
+        }
+
+        if (overlayText != null)
+            Destroy(overlayText.gameObject);
+
+#if UNITY_WSA || UNITY_STANDALONE_WIN
+        keywordRecognizer?.Dispose();
+#endif
+    }
+
+    public void SetOverlayShown(bool isShown)
+    {
+        IsOverlayShown = isShown;
+    }
+
+    private void Update()
+    {
+        if (Input.GetKeyDown(ToggleKey))
+            IsOverlayShown = !IsOverlayShown;
+
+        if (overlayText.gameObject.activeSelf != IsOverlayShown)
+            overlayText.gameObject.SetActive(IsOverlayShown);
+
+        // The counters keep running while the overlay is hidden, so it shows a whole interval when it is shown again
+        numDisplayFrames++;
+        intervalTime += Time.unscaledDeltaTime;
+        maxQueueDepth = Mathf.Max(maxQueueDepth, pointCloudRenderer.QueueDepth);
+
+        if (intervalTime >= RefreshInterval)
+        {
+            if (IsOverlayShown)
+                RefreshText();
+
+            ResetCounters();
+        }
+    }
+
+    private void LateUpdate()
+    {
+        Camera viewer = Camera.main;
+
+        // The text follows the head, facing it
+        if (IsOverlayShown && viewer != null)
+        {
+            Transform head = viewer.transform;
+            overlayText.transform.SetPositionAndRotation(head.TransformPoint(ViewOffset), head.rotation);
+        }
+    }
+
+    private void CountReceivedFrame(PointCloudFrame frame)
+    {
+        numReceivedFrames++;
+
+        // Frames sent without timestamps have no arrival time
+        if (frame.ReceiveTime != 0)
+        {
+            numDecodedFrames++;
+            decodeTimeSum += frame.DecodedTime - frame.ReceiveTime;
+        }
+    }
+
+    private void CountRenderedFrame(PointCloudFrame frame)
+    {
+        numRenderedFrames++;
+        pointSum += frame.Count;
+
+        if (frame.ReceiveTime != 0)
+        {
+            long latency = PointCloudRenderer.GetLocalTime() - frame.ReceiveTime;
+            numLatencyFrames++;
+            latencySum += latency;
+            maxLatency = System.Math.Max(maxLatency, latency);
+        }
+    }
+
+    private void ResetCounters()
+    {
+        intervalTime = 0.0f;
+        numDisplayFrames = numReceivedFrames = numRenderedFrames = numDecodedFrames = numLatencyFrames = maxQueueDepth = 0;
+        decodeTimeSum = latencySum = maxLatency = pointSum = 0;
+    }
+
+    /// <summary>
+    /// Writes the values of the interval into the text buffer, and gives it to the text mesh
+    /// </summary>
+    private void RefreshText()
+    {
+        textLength = 0;
+
+        Append("Receive ");
+        AppendDecimal(numReceivedFrames / intervalTime);
+        Append(" fps\nRender ");
+        AppendDecimal(numRenderedFrames / intervalTime);
+        Append(" fps, display ");
+        AppendDecimal(numDisplayFrames / intervalTime);
+        Append(" fps\nDecode ");
+        AppendDecimal(numDecodedFrames > 0 ? decodeTimeSum * 1e-3f / numDecodedFrames : 0.0f);
+        Append(" ms\nQueue ");
+        AppendInteger(pointCloudRenderer.QueueDepth);
+        Append(" (max ");
+        AppendInteger(maxQueueDepth);
+        Append("), buffer ");
+        AppendDecimal(pointCloudRenderer.BufferLatency * 1e3f);
+        Append(" ms\nArrival to display ");
+        AppendDecimal(numLatencyFrames > 0 ? latencySum * 1e-3f / numLatencyFrames : 0.0f);
+        Append(" ms (max ");
+        AppendDecimal(maxLatency * 1e-3f);
+        Append(" ms)\nPoints ");
+        AppendInteger(numRenderedFrames > 0 ? pointSum / numRenderedFrames : 0);
+        Append(", documents ");
+        AppendInteger(holoportReceiver.NumDocumentsReceived);
+
+        if (documentRenderer != null)
+        {
+            Append(" (upload ");
+            AppendDecimal(documentRenderer.LastDocumentUploadTime);
+            Append(" ms)");
+        }
+
+        overlayText.SetCharArray(textBuffer, 0, textLength);
+    }
+
+    private void Append(string value)
+    {
+        for (int i = 0; i < value.Length && textLength < TextCapacity; i++)
+            textBuffer[textLength++] = value[i];
+    }
+
+    private void AppendInteger(long value)
+    {
+        if (value < 0)
+        {
+            Append("-");
+            value = -value;
+        }
+
+        // The digits are written backwards, then reversed in place
+        int start = textLength;
+
+        do
+        {
+            if (textLength == TextCapacity)
+                return;
+
+            textBuffer[textLength++] = (char)('0' + value % 10);
+            value /= 10;
+        }
+        while (value > 0);
+
+        System.Array.Reverse(textBuffer, start, textLength - start);
+    }
+
+    /// <summary>
+    /// Appends a value with one decimal
+    /// </summary>
+    private void AppendDecimal(float value)
+    {
+        long tenths = (long)Mathf.Round(value * 10.0f);
+
+        if (tenths < 0)
+        {
+            Append("-");
+            tenths = -tenths;
+        }
+
+        AppendInteger(tenths / 10);
+        Append(".");
+        AppendInteger(tenths % 10);
+    }
+}
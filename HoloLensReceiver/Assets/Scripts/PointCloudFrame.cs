@@ -0,0 +1,146 @@
+/***************************************************************************\
+
+Module Name:  PointCloudFrame.cs
+Project:      HoloLensReceiver
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is a decoded point cloud frame, as queued for the renderer. The
+frames are pooled by the renderer and their buffers only grow, so that the
+receiver decodes each frame into memory allocated once instead of new arrays.
+The frames of a mesh hold its triangles as well, and their points are the
+vertices of the triangles. The frames of surfels hold the normal of each
+point. The frames of a split stream carry the id of their geometry, shared by
+the frames which only updated its colors. The frames of byte positions can
+be kept packed as they were received, positions then colors, for the shader
+to dequantize, and are unpacked on the CPU only for the mesh.
+
+\***************************************************************************/
+
+using UnityEngine;
+
+public class PointCloudFrame
+{
+    public Vector3[] Vertices = new Vector3[0];
+    public Color32[] Colors = new Color32[0]; // Alpha: occupied siblings of the point in its octree node, 1 to 8, or 255 if unknown
+    public int Count = 0; // Number of points of the frame; the buffers may be larger
+    public float Scale = 1.0f; // Number of points per meter along each axis, which sets the size of the points
+    public int[] Indices = new int[0]; // Three vertex indices for each triangle of a mesh
+    public int TriangleCount = 0; // Number of triangles of a mesh; 0 for the frames rendered as points
+    public Vector3[] Normals = new Vector3[0]; // Normal of each point of the surfel frames; zero for the points without one
+    public bool HasNormals = false; // Whether the points are rendered as surfels
+    public int GeometryId = 0; // Geometry of the split frames, whose positions are those of the other frames with this id; 0 for the other frames
+    public long CaptureTime = 0; // Microseconds of the server clock at which the frame was captured; 0 if the server sent none
+    public long DueTime = 0; // Microseconds of the local clock at which the renderer shows the frame
+
+    // Packed frames: the byte positions (x, y, z) of the points followed by their colors (r, g, b), as received, and
+    // the dequantization of the positions, position = bytes * PackedStep + PackedOrigin per axis. The vertices and the
+    // colors are not set until the frame is unpacked.
+    public byte[] PackedPoints = new byte[0];
+    public bool IsPacked = false;
+    public Vector3 PackedStep = Vector3.one;
+    public Vector3 PackedOrigin = Vector3.zero;
+
+    // Latency trace of the frame: its id, 0 if the server does not trace it, the global timestamp of the cameras, and
+    // the microseconds of the local clock at which it arrived and was decoded
+    public int FrameId = 0;
+    public ulong DeviceTimeStamp = 0;
+    public long ReceiveTime = 0;
+    public long DecodedTime = 0;
+
+    /// <summary>
+    /// Sets the number of points of the frame, growing its buffers when they are too small. The frame has no
+    /// triangles, no normals and no geometry id until they are set.
+    /// </summary>
+    public void Resize(int numPoints)
+    {
+        if (Vertices.Length < numPoints)
+        {
+            // Grow with some headroom, so that frames of slowly increasing sizes do not reallocate every time
+            int capacity = Mathf.NextPowerOfTwo(numPoints);
+            Vertices = new Vector3[capacity];
+            Colors = new Color32[capacity];
+        }
+
+        Count = numPoints;
+        TriangleCount = 0;
+        HasNormals = false;
+        GeometryId = 0;
+        IsPacked = false;
+    }
+
+    /// <summary>
+    /// Sets the number of points of a packed frame, growing its packed buffer when it is too small, and returns that
+    /// buffer to receive the points into. The packed points take a whole number of 32-bit words, as they are uploaded.
+    /// </summary>
+    public byte[] ResizePacked(int numPoints)
+    {
+        int size = GetPackedSize(numPoints);
+
+        if (PackedPoints.Length < size)
+            PackedPoints = new byte[Mathf.NextPowerOfTwo(size)];
+
+        Count = numPoints;
+        TriangleCount = 0;
+        HasNormals = false;
+        GeometryId = 0;
+        IsPacked = true;
+
+        return PackedPoints;
+    }
+
+    /// <summary>
+    /// Size of the packed points of the frame, rounded up to a whole number of 32-bit words
+    /// </summary>
+    public static int GetPackedSize(int numPoints)
+    {
+        return (6 * numPoints + 3) & ~3;
+    }
+
+    /// <summary>
+    /// Dequantizes the packed points of the frame into its vertices and colors, for the renderers which do not read the
+    /// packed points
+    /// </summary>
+    public void UnpackPoints()
+    {
+        if (!IsPacked)
+            return;
+
+        int numPoints = Count;
+        Resize(numPoints);
+
+        for (int i = 0; i < numPoints; i++)
+        {
+            int position = 3 * i;
+            int color = 3 * (numPoints + i);
+
+            Vertices[i] = new Vector3(PackedPoints[position] * PackedStep.x + PackedOrigin.x, PackedPoints[position + 1] * PackedStep.y + PackedOrigin.y,
+                PackedPoints[position + 2] * PackedStep.z + PackedOrigin.z);
+            Colors[i] = new Color32(PackedPoints[color], PackedPoints[color + 1], PackedPoints[color + 2], 255);
+        }
+    }
+
+    /// <summary>
+    /// Gives the frame a normal for each of its points, growing the normal buffer when it is too small; the buffer is
+    /// only allocated for the frames of surfels
+    /// </summary>
+    public void ResizeNormals()
+    {
+        if (Normals.Length < Count)
+            Normals = new Vector3[Mathf.Max(Vertices.Length, Count)];
+
+        HasNormals = true;
+    }
+
+    /// <summary>
+    /// Sets the number of triangles of the frame, growing its index buffer when it is too small
+    /// </summary>
+    public void ResizeTriangles(int numTriangles)
+    {
+        if (Indices.Length < 3 * numTriangles)
+            Indices = new int[Mathf.NextPowerOfTwo(3 * numTriangles)];
+
+        TriangleCount = numTriangles;
+    }
+}
@@ -7,7 +7,35 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module receives point clouds from the PointCloudReceiver, enqueues them
-and renders them.
+and renders them. The refinements of a progressive frame replace the coarser
+level of the frame while it is still queued, so the queue never holds
+levels which would be rendered only to be replaced. The frames are held in a
+jitter buffer: each one is due at its capture time plus a latency which
+adapts to the jitter of the arrivals, the newest frame due is rendered and
+the frames older than the last one rendered are dropped. The frames are taken
+from a pool and given back once rendered or dropped, so that the receiver
+decodes into buffers which are reused from frame to frame. When the device
+supports it, the points are uploaded to graphics buffers and the shader
+expands them into quads, instead of building a mesh of six vertices for each
+point on the CPU. The packed frames, of byte positions and colors as they
+were received, are uploaded as they are, 6 bytes for each point instead of
+16, and the shader dequantizes and subsamples them. The frames of a
+triangle mesh are rendered as that mesh, with the colors of its vertices. The frames with normals are rendered as
+surfels, discs lying on the surface, which are larger than the billboards
+as they no longer overlap towards the viewer. The frames of the geometry
+shown, from a split stream, only update the colors of the points. The
+points are subsampled when they would be smaller than a few pixels at the
+distance of the hologram, or when the frame time of the device rises above
+its target, the refinements of the progressive frames past the budget being
+dropped, so that a headset which heats up during a long session draws fewer
+and larger points instead of missing its frame rate. The time each frame
+takes to be copied to the mesh or to the graphics buffers is kept, and the
+renderer can switch between its modes while it runs, for the benchmark. The
+points are drawn opaque with the geometry and write the depth, so that the
+hidden fragments of the overlapping points are rejected before they are
+shaded, as the device is bound by its fill rate; the surfels, which are cut
+to discs, are drawn in a depth pre-pass first. The points decoded from an
+octree are sized by the number of occupied siblings of their node.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -18,11 +46,13 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 
 using System.Collections.Generic;
 using UnityEngine;
+using UnityEngine.Rendering;
 
 [RequireComponent(typeof(MeshFilter), typeof(MeshRenderer))]
 public class PointCloudRenderer : MonoBehaviour
 {
     public Material PointCloudMaterial;
+    public bool IsProceduralRenderingEnabled = true; // Falls back to the mesh on devices without structured buffers
 
     // Indices representing the corners of each point quad
     private static readonly float[] s_baseOffsetIndices = new float[] { 0, 1, 2, 3, 4, 5 };
@@ -30,24 +60,107 @@ public class PointCloudRenderer : MonoBehaviour
     private readonly List<Vector3> Vertices = new();
     private readonly List<Color32> Colors = new();
     private readonly List<Vector2> OffsetIndices = new();
+    private readonly List<Vector3> Normals = new();
     private readonly List<int> Indices = new();
 
-    private const int MaxQueueSize = 5;
+    // Bounds the frames held if they stop being due, well above the number held at the largest latency
+    private const int MaxQueueSize = 16;
+
+    // Latency of the jitter buffer, in seconds, on top of the smallest delay of the frames
+    public float MinBufferLatency = 0.0f;
+    public float MaxBufferLatency = 0.2f;
+
+    private const float JitterLatencyRatio = 2.0f; // Latency targeted, in units of the mean jitter of the arrivals
+    private const float JitterWeight = 0.05f; // Weight of the last frame in the moving average of the jitter
+    private const long ClockOffsetLeakUs = 100; // Rise of the clock offset estimate for each frame, so it follows delays which grow for good
+
+    // Smallest difference between the arrival time and the capture time of the frames, in microseconds; it holds the
+    // offset of the clocks and the shortest delay of the network
+    private long clockOffset = long.MaxValue;
+    private float meanJitter = 0.0f; // Seconds
+    private long lastRenderedCaptureTime = 0;
+
+    // Called on the main thread with each frame rendered, before it returns to the pool
+    public event System.Action<PointCloudFrame> FrameRendered;
+
+    // Called on the main thread with each frame enqueued in the jitter buffer, which is not a refinement
+    public event System.Action<PointCloudFrame> FrameEnqueued;
+
+    // Number of frames waiting in the jitter buffer
+    public int QueueDepth => pointCloudQueue.Count;
+
+    // Time the last frame rendered took to be subsampled and copied to the mesh or to the graphics buffers, in
+    // microseconds of the local clock
+    public long UploadTime { get; private set; } = 0;
+
+    public bool IsProceduralRenderingSupported => SystemInfo.supportsComputeShaders;
+    public bool IsProcedural => isProcedural;
+
+    // Latency of the jitter buffer on top of the smallest delay of the frames, in seconds
+    public float BufferLatency => Mathf.Clamp(JitterLatencyRatio * meanJitter, MinBufferLatency, MaxBufferLatency);
+
+    // Frames free to be decoded into. The pool is only used from the main thread, by the receiver and by Update
+    private readonly Stack<PointCloudFrame> freeFrames = new();
 
     private const float PointScaleFnA = 170.0f;
     private const float PointScaleFnB = 0.8f;
     private const float PointScaleFnC = 0.002f;
 
-    // Parameters used to calculate and log FPS
-    private bool isStarted = false;
-    private float timeSinceLastRender = 0.0f;
-    private float totalTime = 0.0f;
-    private int numFrames = 0;
+    // Size of the bounds of the procedural draws, larger than the largest capture volume
+    private static readonly Vector3 ProceduralBounds = new(20.0f, 20.0f, 20.0f);
+
+    // Level of detail: the points are subsampled, one out of a stride, when they would be smaller than MinPointPixels
+    // on the display, or when there are more of them than the point budget. The budget is lowered while the frame time
+    // is above that of the target frame rate, as when the device throttles as it heats up, and raised back slowly
+    // once it is below it again.
+    public bool IsLevelOfDetailEnabled = true;
+    public float MinPointPixels = 2.0f;
+    public int MaxRenderedPoints = 200000;
+    public int TargetFrameRate = 60;
+
+    private const float MinBudgetRatio = 0.1f;
+    private const float BudgetDecreaseRatio = 0.95f; // For each frame over the frame time, so the budget halves in about a quarter of a second
+    private const float BudgetIncreaseRatio = 1.005f; // For each frame under the frame time, so the budget doubles in about two seconds
+    private const float OverFrameTimeRatio = 1.1f;
+    private const float UnderFrameTimeRatio = 0.9f;
+    private const float FrameTimeWeight = 0.1f; // Weight of the last frame in the moving average of the frame time
 
-    private Queue<(float scale, Vector3[] points, Color32[] colors)> pointCloudQueue = new();
+    private float meanFrameTime = 0.0f;
+    private float budgetRatio = 1.0f;
+    private int shownStride = 1; // Stride of the points of the geometry shown, which the frames of its colors keep
+
+    private LinkedList<PointCloudFrame> pointCloudQueue = new();
     private Mesh mesh;
+
+    // Procedural rendering: the points of the last frame rendered, drawn again every frame until the next one
+    private bool isProcedural = false;
+    private Material proceduralMaterial;
+    private MaterialPropertyBlock proceduralProperties;
+    private GraphicsBuffer positionBuffer;
+    private GraphicsBuffer colorBuffer;
+    private GraphicsBuffer normalBuffer;
+    private int numUploadedPoints = 0;
+
+    // Packed frames are drawn with the variant of the material which reads their bytes from a raw buffer
+    private Material packedMaterial;
+    private GraphicsBuffer packedBuffer;
+    private bool isPackedShown = false;
+
+    // Geometry of the split frame shown, whose positions are kept by the frames of the same geometry; 0 if none is
+    private int shownGeometryId = 0;
+    private MeshRenderer meshRenderer;
     private Quaternion rotation = Quaternion.Euler(270.0f, 0f, 0);
 
+    // Triangle meshes are drawn with the mesh renderer, which holds a mesh until the next frame of points
+    private Material triangleMaterial;
+    private bool isTriangleMeshShown = false;
+
+    // Surfels are drawn with the variant of the materials which orients the quads by the normals
+    public float SurfelSizeRatio = 2.0f; // Size of the surfels, relative to the billboards at the same scale
+    private Material surfelMaterial;
+    private Material proceduralSurfelMaterial;
+    private bool isSurfelShown = false;
+
     void Start()
     {
         // Initialize point cloud mesh
@@ -56,50 +169,468 @@ public class PointCloudRenderer : MonoBehaviour
         mesh.MarkDynamic(); // Hint for performance
 
         GetComponent<MeshFilter>().sharedMesh = mesh;
-        GetComponent<MeshRenderer>().material = PointCloudMaterial;
+        meshRenderer = GetComponent<MeshRenderer>();
+        meshRenderer.material = PointCloudMaterial;
+
+        isProcedural = IsProceduralRenderingEnabled && IsProceduralRenderingSupported;
+
+        // The materials are made whenever the device supports the procedural draws, so that they can be turned on later
+        if (IsProceduralRenderingSupported)
+        {
+            proceduralMaterial = new Material(PointCloudMaterial);
+            proceduralMaterial.EnableKeyword("PROCEDURAL_POINTS");
+            proceduralProperties = new MaterialPropertyBlock();
+
+            proceduralSurfelMaterial = new Material(proceduralMaterial);
+            proceduralSurfelMaterial.EnableKeyword("SURFELS");
+
+            packedMaterial = new Material(PointCloudMaterial);
+            packedMaterial.EnableKeyword("PACKED_POINTS");
+        }
+
+        surfelMaterial = new Material(PointCloudMaterial);
+        surfelMaterial.EnableKeyword("SURFELS");
+
+        triangleMaterial = new Material(PointCloudMaterial);
+        triangleMaterial.EnableKeyword("MESH_TRIANGLES");
+
+        // Only the surfels discard fragments, which would keep the depth test from rejecting them early
+        SetDepthPrepass(PointCloudMaterial, false);
+        SetDepthPrepass(triangleMaterial, false);
+        SetDepthPrepass(surfelMaterial, true);
+
+        if (IsProceduralRenderingSupported)
+        {
+            SetDepthPrepass(proceduralMaterial, false);
+            SetDepthPrepass(packedMaterial, false);
+            SetDepthPrepass(proceduralSurfelMaterial, true);
+        }
+    }
+
+    /// <summary>
+    /// Turns the depth pre-pass of a material on or off. After the pre-pass, the colors are only written where the
+    /// depth of the same fragment was kept, and the depth is not written again.
+    /// </summary>
+    private static void SetDepthPrepass(Material material, bool isEnabled)
+    {
+        material.SetShaderPassEnabled("Always", isEnabled);
+        material.SetFloat("_ZWrite", isEnabled ? 0.0f : 1.0f);
+        material.SetFloat("_ZTest", (float)(isEnabled ? CompareFunction.Equal : CompareFunction.LessEqual));
     }
 
     void Update()
     {
-        if (isStarted)
+        UpdatePointBudget();
+
+        // Render the newest frame which is due; the older frames due are skipped
+        long now = GetLocalTime();
+        PointCloudFrame dueFrame = null;
+
+        while (pointCloudQueue.Count > 0 && pointCloudQueue.First.Value.DueTime <= now)
         {
-            timeSinceLastRender += Time.deltaTime;
+            if (dueFrame != null)
+                freeFrames.Push(dueFrame);
+
+            dueFrame = pointCloudQueue.First.Value;
+            pointCloudQueue.RemoveFirst();
         }
 
-        // If the point cloud queue is not empty, render its first entry
+        if (dueFrame != null)
+        {
+            lastRenderedCaptureTime = dueFrame.CaptureTime;
+
+            long renderStartTime = GetLocalTime();
+            RenderPointCloud(dueFrame);
+            UploadTime = GetLocalTime() - renderStartTime;
+
+            FrameRendered?.Invoke(dueFrame);
+            freeFrames.Push(dueFrame);
+        }
+
+        // Procedural draws only last for the frame they are issued in; the receiver hides the mesh renderer when it
+        // is disconnected
+        if (isProcedural && numUploadedPoints > 0 && meshRenderer.enabled)
+            DrawPointCloud();
+    }
+
+    private void OnDestroy()
+    {
+        positionBuffer?.Release();
+        colorBuffer?.Release();
+        normalBuffer?.Release();
+        packedBuffer?.Release();
+    }
+
+    /// <summary>
+    /// Returns a frame to decode a point cloud into, with room for the given number of points. It is given back to
+    /// the renderer by enqueuing it.
+    /// </summary>
+    public PointCloudFrame AcquirePointCloud(int numPoints)
+    {
+        PointCloudFrame frame = freeFrames.Count > 0 ? freeFrames.Pop() : new PointCloudFrame();
+        frame.Resize(numPoints);
+
+        return frame;
+    }
+
+    /// <summary>
+    /// Returns a frame to read packed points into, as AcquirePointCloud; the frame is unpacked when it is rendered to
+    /// the mesh
+    /// </summary>
+    public PointCloudFrame AcquirePackedPointCloud(int numPoints)
+    {
+        PointCloudFrame frame = freeFrames.Count > 0 ? freeFrames.Pop() : new PointCloudFrame();
+        frame.ResizePacked(numPoints);
+
+        return frame;
+    }
+
+    /// <summary>
+    /// Enqueues a frame in the jitter buffer. Frames without a capture time are due immediately; frames captured before
+    /// the last one rendered arrived too late and are dropped.
+    /// </summary>
+    public void EnqueuePointCloud(PointCloudFrame frame)
+    {
+        long now = GetLocalTime();
+        frame.DecodedTime = now;
+
+        if (frame.CaptureTime == 0)
+        {
+            frame.DueTime = now;
+        }
+        else
+        {
+            if (frame.CaptureTime < lastRenderedCaptureTime)
+            {
+                freeFrames.Push(frame);
+                return;
+            }
+
+            // The delay of a frame past the smallest one is its jitter
+            long offset = now - frame.CaptureTime;
+            clockOffset = clockOffset == long.MaxValue ? offset : System.Math.Min(clockOffset + ClockOffsetLeakUs, offset);
+            meanJitter += JitterWeight * ((offset - clockOffset) * 1e-6f - meanJitter);
+
+            frame.DueTime = frame.CaptureTime + clockOffset + (long)(BufferLatency * 1e6f);
+        }
+
+        FrameEnqueued?.Invoke(frame);
+        AddToQueue(frame);
+    }
+
+    /// <summary>
+    /// Enqueues a finer level of the last enqueued progressive frame, or more tiles of the last enqueued tiled frame.
+    /// The frame refined is replaced if it was not rendered yet, otherwise the refinement is rendered next.
+    /// </summary>
+    /// <param name="isDetailOnly">Whether the refinement only adds detail to the frame it refines, and is dropped when it would be subsampled</param>
+    public void EnqueuePointCloudRefinement(PointCloudFrame frame, bool isDetailOnly = true)
+    {
+        // A refinement which would be subsampled adds no detail to the coarser level, whose points are already larger
+        if (isDetailOnly && GetLevelOfDetailStride(frame) > 1)
+        {
+            freeFrames.Push(frame);
+            return;
+        }
+
+        // The refinement is due with the coarser level, and arrives later than it by design, so it does not count as jitter
+        frame.DueTime = GetLocalTime();
+        frame.DecodedTime = frame.DueTime;
+
         if (pointCloudQueue.Count > 0)
         {
-            var (scale, positions, colorData) = pointCloudQueue.Dequeue();
-            UpdateMesh(scale, positions, colorData);
+            frame.DueTime = pointCloudQueue.Last.Value.DueTime;
+            freeFrames.Push(pointCloudQueue.Last.Value);
+            pointCloudQueue.RemoveLast();
         }
+
+        AddToQueue(frame);
     }
 
-    public void EnqueuePointCloud(float scale, Vector3[] positions, Color32[] colors)
+    /// <summary>
+    /// Forgets the clock of the server, for the frames of a new connection
+    /// </summary>
+    public void ResetJitterBuffer()
     {
-        isStarted = true;
+        clockOffset = long.MaxValue;
+        meanJitter = 0.0f;
+        lastRenderedCaptureTime = 0;
+
+        // The geometry ids of the new connection start again
+        shownGeometryId = 0;
+    }
+
+    /// <summary>
+    /// Switches between the procedural draws and the mesh, and turns the level of detail on or off. The point budget
+    /// starts again from the whole budget, and the next frame is rendered whole, as neither path holds its geometry.
+    /// </summary>
+    public void SetRenderingMode(bool isProceduralEnabled, bool isLevelOfDetailEnabled)
+    {
+        IsProceduralRenderingEnabled = isProceduralEnabled;
+        IsLevelOfDetailEnabled = isLevelOfDetailEnabled;
+        isProcedural = isProceduralEnabled && IsProceduralRenderingSupported;
+
+        meanFrameTime = 0.0f;
+        budgetRatio = 1.0f;
 
+        mesh.Clear();
+        meshRenderer.sharedMaterial = PointCloudMaterial;
+        isTriangleMeshShown = false;
+        numUploadedPoints = 0;
+        shownGeometryId = 0;
+    }
+
+    private void AddToQueue(PointCloudFrame frame)
+    {
         // If the queue is full, dequeue the first entry to add the new one
         if (pointCloudQueue.Count >= MaxQueueSize)
-            pointCloudQueue.Dequeue();
+        {
+            freeFrames.Push(pointCloudQueue.First.Value);
+            pointCloudQueue.RemoveFirst();
+        }
 
-        pointCloudQueue.Enqueue((scale, positions, colors));
+        pointCloudQueue.AddLast(frame);
     }
 
-    private void UpdateMesh(float scale, Vector3[] positions, Color32[] colorData)
+    public static long GetLocalTime()
     {
-        int pointCount = Mathf.Min(positions.Length, colorData.Length);
+        return (long)(System.Diagnostics.Stopwatch.GetTimestamp() * (1e6 / System.Diagnostics.Stopwatch.Frequency));
+    }
+
+    private void RenderPointCloud(PointCloudFrame frame)
+    {
+        // The mode may have changed since the frame was received
+        if (frame.IsPacked && !isProcedural)
+            frame.UnpackPoints();
+
+        // Split frames never have triangles nor normals
+        bool isGeometryShown = frame.GeometryId != 0 && frame.GeometryId == shownGeometryId;
+
+        // The frames of the colors of the geometry shown keep its points; the triangles of the meshes are kept whole
+        int stride = frame.TriangleCount > 0 ? 1 : (isGeometryShown ? shownStride : GetLevelOfDetailStride(frame));
+        SubsamplePoints(frame, stride);
+        shownStride = stride;
 
-        // Find the level of precision of the point cloud from the scale that was sent
-        float precision = 1.0f / scale;
+        // Find the level of precision of the point cloud from the scale that was sent; a subsampled frame has one point
+        // for each stride voxels, so its points cover their area
+        float precision = Mathf.Sqrt(stride) / frame.Scale;
 
         // Make the points slightly larger than the precision to fill holes in the point cloud
-        PointCloudMaterial.SetFloat("_PointSize", PointScaleFnA * Mathf.Pow(precision, 2)  + PointScaleFnB * precision + PointScaleFnC);
+        bool isSurfel = frame.HasNormals && frame.TriangleCount == 0;
+        Material material = frame.IsPacked ? packedMaterial : isSurfel ? (isProcedural ? proceduralSurfelMaterial : surfelMaterial) : (isProcedural ? proceduralMaterial : PointCloudMaterial);
+        float pointSize = PointScaleFnA * Mathf.Pow(precision, 2)  + PointScaleFnB * precision + PointScaleFnC;
+        material.SetFloat("_PointSize", isSurfel ? SurfelSizeRatio * pointSize : pointSize);
+
+        if (frame.TriangleCount > 0)
+        {
+            UpdateTriangleMesh(frame);
+            numUploadedPoints = 0;
+        }
+        else
+        {
+            if (isTriangleMeshShown)
+            {
+                mesh.Clear();
+                meshRenderer.sharedMaterial = PointCloudMaterial;
+                isTriangleMeshShown = false;
+            }
+
+            if (frame.IsPacked)
+            {
+                UploadPackedPointCloud(frame, stride);
+            }
+            else if (isProcedural)
+            {
+                UploadPointCloud(frame, isGeometryShown);
+            }
+            else
+            {
+                if (isGeometryShown)
+                    UpdateMeshColors(frame);
+                else
+                    UpdateMesh(frame);
+
+                meshRenderer.sharedMaterial = material;
+            }
+
+            isSurfelShown = isSurfel;
+            isPackedShown = frame.IsPacked;
+        }
+
+        shownGeometryId = frame.TriangleCount > 0 ? 0 : frame.GeometryId;
+    }
+
+    /// <summary>
+    /// Follows the frame time of the device, and lowers the point budget while it is above that of TargetFrameRate
+    /// </summary>
+    private void UpdatePointBudget()
+    {
+        float frameTime = Time.unscaledDeltaTime;
+        meanFrameTime = meanFrameTime == 0.0f ? frameTime : meanFrameTime + FrameTimeWeight * (frameTime - meanFrameTime);
+
+        float targetFrameTime = 1.0f / Mathf.Max(TargetFrameRate, 1);
+
+        if (meanFrameTime > OverFrameTimeRatio * targetFrameTime)
+            budgetRatio = Mathf.Max(MinBudgetRatio, budgetRatio * BudgetDecreaseRatio);
+        else if (meanFrameTime < UnderFrameTimeRatio * targetFrameTime)
+            budgetRatio = Mathf.Min(1.0f, budgetRatio * BudgetIncreaseRatio);
+    }
+
+    /// <summary>
+    /// Finds the stride of the points of a frame to render: large enough for the points to be at least MinPointPixels
+    /// apart at the distance of the hologram, and for the frame to fit in the point budget
+    /// </summary>
+    private int GetLevelOfDetailStride(PointCloudFrame frame)
+    {
+        if (!IsLevelOfDetailEnabled || frame.Count == 0)
+            return 1;
+
+        float stride = (float)frame.Count / Mathf.Max(1.0f, budgetRatio * MaxRenderedPoints);
+        Camera viewer = Camera.main;
+
+        if (viewer != null)
+        {
+            // Pixels covered by a voxel of the frame, which is 1 / Scale across in the space of the hologram
+            float voxelSize = transform.lossyScale.x / frame.Scale;
+            float distance = Mathf.Max(viewer.nearClipPlane, Vector3.Distance(viewer.transform.position, transform.position));
+            float pixelsPerRadian = viewer.pixelHeight / (2.0f * Mathf.Tan(0.5f * viewer.fieldOfView * Mathf.Deg2Rad));
+            float voxelPixels = voxelSize / distance * pixelsPerRadian;
+
+            // The points of one out of n voxels are sqrt(n) voxels apart
+            if (voxelPixels > 0.0f && voxelPixels < MinPointPixels)
+                stride = Mathf.Max(stride, (MinPointPixels / voxelPixels) * (MinPointPixels / voxelPixels));
+        }
+
+        return Mathf.Max(1, Mathf.CeilToInt(stride));
+    }
+
+    /// <summary>
+    /// Keeps one point out of stride in the frame, in place. The points of the frames are in spatial order, so the
+    /// points kept are spread over the whole frame. The packed frames are subsampled by the shader instead.
+    /// </summary>
+    private static void SubsamplePoints(PointCloudFrame frame, int stride)
+    {
+        if (stride <= 1 || frame.IsPacked)
+            return;
+
+        int count = 0;
+
+        for (int i = 0; i < frame.Count; i += stride, count++)
+        {
+            frame.Vertices[count] = frame.Vertices[i];
+            frame.Colors[count] = frame.Colors[i];
+
+            if (frame.HasNormals)
+                frame.Normals[count] = frame.Normals[i];
+        }
+
+        frame.Count = count;
+    }
+
+    /// <summary>
+    /// Copies the points of a frame to the graphics buffers, which grow with some headroom when they are too small
+    /// </summary>
+    /// <param name="isGeometryShown">Whether the buffers hold the positions of the frame already, so that only its colors are copied</param>
+    private void UploadPointCloud(PointCloudFrame frame, bool isGeometryShown)
+    {
+        if (positionBuffer == null || positionBuffer.count < frame.Count)
+        {
+            isGeometryShown = false;
+
+            positionBuffer?.Release();
+            colorBuffer?.Release();
+            normalBuffer?.Release();
+
+            int capacity = Mathf.NextPowerOfTwo(Mathf.Max(frame.Count, 1));
+            positionBuffer = new GraphicsBuffer(GraphicsBuffer.Target.Structured, capacity, 3 * sizeof(float));
+            colorBuffer = new GraphicsBuffer(GraphicsBuffer.Target.Structured, capacity, sizeof(uint));
+            normalBuffer = new GraphicsBuffer(GraphicsBuffer.Target.Structured, capacity, 3 * sizeof(float));
+
+            proceduralProperties.SetBuffer("_Positions", positionBuffer);
+            proceduralProperties.SetBuffer("_Colors", colorBuffer);
+            proceduralProperties.SetBuffer("_Normals", normalBuffer);
+        }
+
+        if (!isGeometryShown)
+            positionBuffer.SetData(frame.Vertices, 0, 0, frame.Count);
+
+        colorBuffer.SetData(frame.Colors, 0, 0, frame.Count);
+
+        if (frame.HasNormals)
+            normalBuffer.SetData(frame.Normals, 0, 0, frame.Count);
+
+        numUploadedPoints = frame.Count;
+    }
+
+    /// <summary>
+    /// Copies the packed points of a frame to the raw buffer as they were received, and sets their dequantization and
+    /// the stride of the points drawn, as the shader reads one point out of stride
+    /// </summary>
+    private void UploadPackedPointCloud(PointCloudFrame frame, int stride)
+    {
+        int size = PointCloudFrame.GetPackedSize(frame.Count);
+
+        // One more word than the points, which the shader reads past the last bytes
+        if (packedBuffer == null || packedBuffer.count * sizeof(uint) < size + sizeof(uint))
+        {
+            packedBuffer?.Release();
+
+            packedBuffer = new GraphicsBuffer(GraphicsBuffer.Target.Raw, Mathf.NextPowerOfTwo(size + sizeof(uint)) / sizeof(uint), sizeof(uint));
+            proceduralProperties.SetBuffer("_PackedPoints", packedBuffer);
+        }
+
+        packedBuffer.SetData(frame.PackedPoints, 0, 0, size);
+
+        proceduralProperties.SetVector("_PackedStep", frame.PackedStep);
+        proceduralProperties.SetVector("_PackedOrigin", frame.PackedOrigin);
+        proceduralProperties.SetInteger("_PackedColorOffset", 3 * frame.Count);
+        proceduralProperties.SetInteger("_PointStride", stride);
+
+        numUploadedPoints = (frame.Count + stride - 1) / stride;
+    }
+
+    private void DrawPointCloud()
+    {
+        proceduralProperties.SetMatrix("_ObjectToWorld", transform.localToWorldMatrix);
+
+        // The points are not read back to bound them, so the bounds cover the whole capture volume wherever it is placed
+        RenderParams renderParams = new(isPackedShown ? packedMaterial : isSurfelShown ? proceduralSurfelMaterial : proceduralMaterial)
+        {
+            worldBounds = new Bounds(transform.position, ProceduralBounds),
+            matProps = proceduralProperties,
+            shadowCastingMode = ShadowCastingMode.Off,
+            receiveShadows = false,
+            layer = gameObject.layer
+        };
+
+        Graphics.RenderPrimitives(renderParams, MeshTopology.Triangles, 6 * numUploadedPoints);
+    }
+
+    /// <summary>
+    /// Sets the triangles of a frame on the mesh, whose vertices are the points of the frame
+    /// </summary>
+    private void UpdateTriangleMesh(PointCloudFrame frame)
+    {
+        mesh.Clear();
+        mesh.SetVertices(frame.Vertices, 0, frame.Count);
+        mesh.SetColors(frame.Colors, 0, frame.Count);
+        mesh.SetIndices(frame.Indices, 0, 3 * frame.TriangleCount, MeshTopology.Triangles, 0);
+
+        meshRenderer.sharedMaterial = triangleMaterial;
+        isTriangleMeshShown = true;
+    }
+
+    private void UpdateMesh(PointCloudFrame frame)
+    {
+        int pointCount = frame.Count;
+        Vector3[] positions = frame.Vertices;
+        Color32[] colorData = frame.Colors;
 
         // Clear all previous mesh parameters
         mesh.Clear();
         Vertices.Clear();
         OffsetIndices.Clear();
         Colors.Clear();
+        Normals.Clear();
         Indices.Clear();
 
         // Add each new received point to global variables
@@ -114,6 +645,9 @@ public class PointCloudRenderer : MonoBehaviour
                 OffsetIndices.Add(new Vector2(s_baseOffsetIndices[j], 0));
                 Colors.Add(col);
                 Indices.Add(i * 6 + j);
+
+                if (frame.HasNormals)
+                    Normals.Add(frame.Normals[i]);
             }
         }
 
@@ -121,12 +655,28 @@ public class PointCloudRenderer : MonoBehaviour
         mesh.SetVertices(Vertices);
         mesh.SetUVs(0, OffsetIndices);
         mesh.SetColors(Colors);
+
+        if (frame.HasNormals)
+            mesh.SetNormals(Normals);
+
         mesh.SetIndices(Indices, MeshTopology.Triangles, 0);
+    }
+
+    /// <summary>
+    /// Sets the colors of a frame on the mesh built for the same geometry, leaving its vertices as they are
+    /// </summary>
+    private void UpdateMeshColors(PointCloudFrame frame)
+    {
+        Color32[] colorData = frame.Colors;
+
+        Colors.Clear();
 
-        // Calculate and log FPS
-        totalTime += timeSinceLastRender;
-        timeSinceLastRender = 0.0f;
-        numFrames++;
-        Debug.Log("Average FPS: " + numFrames / totalTime);
+        for (int i = 0; i < frame.Count; i++)
+        {
+            for (int j = 0; j < 6; j++)
+                Colors.Add(colorData[i]);
+        }
+
+        mesh.SetColors(Colors);
     }
 }
\ No newline at end of file
@@ -0,0 +1,489 @@
+/***************************************************************************\
+
+Module Name:  ReceiverBenchmark.cs
+Project:      HoloLensReceiver
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module benchmarks the receiver and the renderer of a Holoport on a
+capture of the streams of the server, made with the "Capture stream" button
+of LiveScanServer, so that they can be measured without a rig, in the editor
+or on the device. It serves the point cloud stream of the capture to the
+receiver from a local socket, at the pacing it was captured at and over
+again, and runs the rendering modes one after the other: the mesh built on
+the CPU, the procedural draws and the level of detail. For each frame, it
+records the time to decode the frames, the time to upload them, the GPU
+time of the display frames and the bytes the managed heap allocated, and
+writes their statistics for each mode as JSON to the persistent data path.
+The capture only holds the replies of the server, so the receiver of the
+Holoport must request the codings of the headset it was captured for.
+
+\***************************************************************************/
+
+using System;
+using System.Collections;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+using System.Text;
+using System.Threading;
+using System.Threading.Tasks;
+using Unity.Profiling;
+using UnityEngine;
+using Debug = UnityEngine.Debug;
+
+public enum BenchmarkMode
+{
+    Mesh,
+    Procedural,
+    LevelOfDetail
+}
+
+public class ReceiverBenchmark : MonoBehaviour
+{
+    public GameObject HoloportPrefab;
+    public string CapturePath = "stream.lsc"; // Relative to the persistent data path of the application
+    public int ConnectionId = -1; // Point cloud connection of the capture which is served; the first one if negative
+    public int PointCloudPort = 48102; // Local ports the capture is served on, apart from those of a server on the same computer
+    public int DocumentPort = 48103;
+    public BenchmarkMode[] Modes = { BenchmarkMode.Mesh, BenchmarkMode.Procedural, BenchmarkMode.LevelOfDetail };
+    public float WarmupSeconds = 3.0f; // Before each mode, for the buffers to grow to the frames and the point budget to settle
+    public float DurationSeconds = 15.0f; // Measured for each mode
+    public bool IsQuitWhenDone = true;
+
+    private const int ResultsVersion = 1;
+    private const int MaxSamples = 1 << 15; // Of each value for each mode; the later samples are dropped
+
+    // Format of the captures of LiveScanServer, as written by its StreamCapture
+    private static readonly byte[] s_captureMagic = { (byte)'L', (byte)'S', (byte)'S', (byte)'C' };
+    private const int CaptureVersion = 1;
+    private const byte PointCloudStream = 0;
+
+    private const int CapturedWriteHeaderSize = sizeof(long) + 1 + 2 * sizeof(int); // Time, stream, connection and number of bytes
+
+    // Below this, the writes wait by spinning, since a sleep can take a whole scheduler tick
+    private const long MinSleepUs = 2000;
+
+    /// <summary>
+    /// Values of one mode, in arrays allocated once so that the measures do not allocate
+    /// </summary>
+    private class Samples
+    {
+        private readonly float[] values = new float[MaxSamples];
+        private int count = 0;
+
+        public void Add(float value)
+        {
+            if (count < MaxSamples)
+                values[count++] = value;
+        }
+
+        public void Clear()
+        {
+            count = 0;
+        }
+
+        public float Mean()
+        {
+            float sum = 0.0f;
+
+            for (int i = 0; i < count; i++)
+                sum += values[i];
+
+            return count > 0 ? sum / count : float.NaN;
+        }
+
+        // Sorts the values, once the mode is measured
+        public float Percentile(float percentile)
+        {
+            if (count == 0)
+                return float.NaN;
+
+            Array.Sort(values, 0, count);
+            int index = Mathf.Clamp(Mathf.CeilToInt(percentile / 100.0f * count) - 1, 0, count - 1);
+
+            return values[index];
+        }
+    }
+
+    private PointCloudRenderer pointCloudRenderer;
+    private string capturePath;
+
+    private TcpListener pointCloudListener;
+    private TcpListener documentListener;
+    private Thread serverThread;
+    private volatile bool isServing = false;
+    private volatile string serverError = null;
+
+    private bool isMeasuring = false;
+    private int numDisplayFrames = 0;
+    private int numRenderedFrames = 0;
+    private long pointSum = 0;
+    private int collectionCountAtStart = 0;
+    private readonly Samples decodeTimes = new();
+    private readonly Samples uploadTimes = new();
+    private readonly Samples gpuFrameTimes = new();
+    private readonly Samples cpuFrameTimes = new();
+    private readonly Samples allocatedBytes = new();
+    private readonly FrameTiming[] frameTimings = new FrameTiming[1];
+    private ProfilerRecorder allocatedBytesRecorder;
+
+    private readonly StringBuilder results = new();
+    private int numModeResults = 0;
+
+    private void Start()
+    {
+        capturePath = Path.IsPathRooted(CapturePath) ? CapturePath : Path.Combine(Application.persistentDataPath, CapturePath);
+
+        if (!File.Exists(capturePath))
+        {
+            Debug.LogError("Stream capture not found: " + capturePath);
+            enabled = false;
+            return;
+        }
+
+        pointCloudListener = new TcpListener(IPAddress.Loopback, PointCloudPort);
+        documentListener = new TcpListener(IPAddress.Loopback, DocumentPort);
+        pointCloudListener.Start();
+        documentListener.Start();
+
+        isServing = true;
+        serverThread = new Thread(ServeCapture) { IsBackground = true, Name = "ReceiverBenchmark" };
+        serverThread.Start();
+
+        // The documents are not served, their socket is only accepted so that the receiver does not retry it
+        Task.Run(AcceptDocumentClient);
+
+        GameObject holoport = Instantiate(HoloportPrefab, transform);
+        HoloportReceiver receiver = holoport.GetComponent<HoloportReceiver>();
+        receiver.ServerIPAddress = IPAddress.Loopback.ToString();
+        receiver.PointCloudPort = PointCloudPort;
+        receiver.DocumentPort = DocumentPort;
+        receiver.IsServerIPAddressSet = true;
+
+        pointCloudRenderer = holoport.GetComponent<PointCloudRenderer>();
+        pointCloudRenderer.FrameEnqueued += CountEnqueuedFrame;
+        pointCloudRenderer.FrameRendered += CountRenderedFrame;
+
+        // Only counted in the development players, and in the editor
+        allocatedBytesRecorder = ProfilerRecorder.StartNew(ProfilerCategory.Memory, "GC Allocated In Frame");
+
+        StartCoroutine(RunModes());
+    }
+
+    private void OnDestroy()
+    {
+        isServing = false;
+        pointCloudListener?.Stop();
+        documentListener?.Stop();
+        allocatedBytesRecorder.Dispose();
+
+        if (pointCloudRenderer != null)
+        {
+            pointCloudRenderer.FrameEnqueued -= CountEnqueuedFrame;
+            pointCloudRenderer.FrameRendered -= CountRenderedFrame;
+        }
+    }
+
+    private void Update()
+    {
+        // The timings are only kept for the frames they are captured in
+        FrameTimingManager.CaptureFrameTimings();
+
+        if (serverError != null)
+        {
+            Debug.LogError("Stream capture could not be served: " + serverError);
+            serverError = null;
+        }
+
+        if (!isMeasuring)
+            return;
+
+        numDisplayFrames++;
+
+        // The timings are those of a frame a few frames back, whose GPU work is done
+        if (FrameTimingManager.GetLatestTimings(1, frameTimings) == 1)
+        {
+            if (frameTimings[0].gpuFrameTime > 0.0)
+                gpuFrameTimes.Add((float)frameTimings[0].gpuFrameTime);
+
+            cpuFrameTimes.Add((float)frameTimings[0].cpuFrameTime);
+        }
+
+        if (allocatedBytesRecorder.Valid)
+            allocatedBytes.Add(allocatedBytesRecorder.LastValue);
+    }
+
+    private void CountEnqueuedFrame(PointCloudFrame frame)
+    {
+        // Frames sent without timestamps have no arrival time
+        if (isMeasuring && frame.ReceiveTime != 0)
+            decodeTimes.Add((frame.DecodedTime - frame.ReceiveTime) * 1e-3f);
+    }
+
+    private void CountRenderedFrame(PointCloudFrame frame)
+    {
+        if (!isMeasuring)
+            return;
+
+        numRenderedFrames++;
+        pointSum += frame.Count;
+        uploadTimes.Add(pointCloudRenderer.UploadTime * 1e-3f);
+    }
+
+    /// <summary>
+    /// Warms up and measures each mode in turn, then writes the results
+    /// </summary>
+    private IEnumerator RunModes()
+    {
+        // The Holoport starts in the next frame
+        yield return null;
+
+        foreach (BenchmarkMode mode in Modes)
+        {
+            if (mode == BenchmarkMode.Procedural && !pointCloudRenderer.IsProceduralRenderingSupported)
+            {
+                Debug.Log("Receiver benchmark: procedural mode skipped, the device has no structured buffers");
+                continue;
+            }
+
+            // The level of detail draws procedurally when it can, as the application does
+            pointCloudRenderer.SetRenderingMode(mode != BenchmarkMode.Mesh, mode == BenchmarkMode.LevelOfDetail);
+
+            yield return new WaitForSecondsRealtime(WarmupSeconds);
+
+            ClearSamples();
+            isMeasuring = true;
+            float startTime = Time.realtimeSinceStartup;
+
+            yield return new WaitForSecondsRealtime(DurationSeconds);
+
+            isMeasuring = false;
+            AppendModeResults(mode, Time.realtimeSinceStartup - startTime);
+        }
+
+        WriteResults();
+
+        if (IsQuitWhenDone)
+        {
+#if UNITY_EDITOR
+            UnityEditor.EditorApplication.isPlaying = false;
+#else
+            Application.Quit();
+#endif
+        }
+    }
+
+    private void ClearSamples()
+    {
+        numDisplayFrames = numRenderedFrames = 0;
+        pointSum = 0;
+        collectionCountAtStart = GC.CollectionCount(0);
+
+        decodeTimes.Clear();
+        uploadTimes.Clear();
+        gpuFrameTimes.Clear();
+        cpuFrameTimes.Clear();
+        allocatedBytes.Clear();
+    }
+
+    private void AppendModeResults(BenchmarkMode mode, float seconds)
+    {
+        int numCollections = GC.CollectionCount(0) - collectionCountAtStart;
+        float allocatedBytesPerFrame = allocatedBytes.Mean();
+        float maxAllocatedBytes = allocatedBytes.Percentile(100);
+
+        Debug.Log(string.Format(CultureInfo.InvariantCulture,
+            "Receiver benchmark: {0}, {1:F1} fps, {2:F1} frames rendered per second, decode p50 {3:F2} ms, upload p50 {4:F2} ms (p95 {5:F2} ms), GPU p50 {6:F2} ms, {7:F0} bytes allocated per frame, {8} collections",
+            Name(mode), numDisplayFrames / seconds, numRenderedFrames / seconds, decodeTimes.Percentile(50), uploadTimes.Percentile(50),
+            uploadTimes.Percentile(95), gpuFrameTimes.Percentile(50), allocatedBytesPerFrame, numCollections));
+
+        if (numModeResults++ > 0)
+            results.Append(",\n");
+
+        results.Append("    { \"mode\": \"").Append(Name(mode)).Append("\", ");
+        results.Append("\"procedural\": ").Append(pointCloudRenderer.IsProcedural ? "true" : "false").Append(", ");
+        results.Append("\"displayFramesPerSecond\": ").Append(Format(numDisplayFrames / seconds)).Append(", ");
+        results.Append("\"renderedFramesPerSecond\": ").Append(Format(numRenderedFrames / seconds)).Append(", ");
+        results.Append("\"pointsPerFrame\": ").Append(numRenderedFrames > 0 ? pointSum / numRenderedFrames : 0).Append(", ");
+        results.Append("\"decodeP50Ms\": ").Append(Format(decodeTimes.Percentile(50))).Append(", ");
+        results.Append("\"decodeP95Ms\": ").Append(Format(decodeTimes.Percentile(95))).Append(", ");
+        results.Append("\"uploadP50Ms\": ").Append(Format(uploadTimes.Percentile(50))).Append(", ");
+        results.Append("\"uploadP95Ms\": ").Append(Format(uploadTimes.Percentile(95))).Append(", ");
+        results.Append("\"uploadMaxMs\": ").Append(Format(uploadTimes.Percentile(100))).Append(", ");
+        results.Append("\"gpuP50Ms\": ").Append(Format(gpuFrameTimes.Percentile(50))).Append(", ");
+        results.Append("\"gpuP95Ms\": ").Append(Format(gpuFrameTimes.Percentile(95))).Append(", ");
+        results.Append("\"cpuP50Ms\": ").Append(Format(cpuFrameTimes.Percentile(50))).Append(", ");
+        results.Append("\"cpuP95Ms\": ").Append(Format(cpuFrameTimes.Percentile(95))).Append(", ");
+        results.Append("\"allocatedBytesPerFrame\": ").Append(Format(allocatedBytesPerFrame)).Append(", ");
+        results.Append("\"allocatedBytesMax\": ").Append(Format(maxAllocatedBytes)).Append(", ");
+        results.Append("\"collections\": ").Append(numCollections).Append(" }");
+    }
+
+    /// <summary>
+    /// Writes the results of the modes to the persistent data path; the values which could not be measured, as the GPU
+    /// times without the frame timing stats or the allocations in a release player, are null
+    /// </summary>
+    private void WriteResults()
+    {
+        string path = Path.Combine(Application.persistentDataPath, "receiver_benchmark_" + DateTime.Now.ToString("yyyyMMdd_HHmmss") + ".json");
+
+        using (StreamWriter writer = new(path))
+        {
+            writer.WriteLine("{");
+            writer.WriteLine($"  \"version\": {ResultsVersion},");
+            writer.WriteLine($"  \"capture\": \"{EscapeJson(Path.GetFileName(capturePath))}\",");
+            writer.WriteLine($"  \"device\": \"{EscapeJson(SystemInfo.deviceModel)}\",");
+            writer.WriteLine($"  \"graphicsDevice\": \"{EscapeJson(SystemInfo.graphicsDeviceName)}\",");
+            writer.WriteLine($"  \"editor\": {(Application.isEditor ? "true" : "false")},");
+            writer.WriteLine($"  \"durationSeconds\": {Format(DurationSeconds)},");
+            writer.WriteLine("  \"modes\": [");
+            writer.WriteLine(results.ToString());
+            writer.WriteLine("  ]");
+            writer.WriteLine("}");
+        }
+
+        Debug.Log("Receiver benchmark results written to " + path);
+    }
+
+    /// <summary>
+    /// Serves the point cloud stream of the capture to the receiver, at the pacing of the capture and over again from
+    /// its start, until the benchmark stops. The requests of the receiver are read and dropped, since the capture
+    /// holds the replies of the server.
+    /// </summary>
+    private void ServeCapture()
+    {
+        try
+        {
+            using TcpClient client = pointCloudListener.AcceptTcpClient();
+            client.NoDelay = true;
+            Task.Run(() => DrainRequests(client));
+
+            NetworkStream stream = client.GetStream();
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            byte[] buffer = new byte[0];
+            int connectionId = ConnectionId;
+
+            while (isServing)
+            {
+                using BinaryReader reader = OpenCapture(capturePath);
+                long firstTimeUs = -1;
+                long passStartUs = stopwatch.ElapsedTicks * 1000000 / Stopwatch.Frequency;
+
+                // A write cut short, when the server stopped during it, ends the capture
+                while (isServing && reader.BaseStream.Position + CapturedWriteHeaderSize <= reader.BaseStream.Length)
+                {
+                    long timeUs = reader.ReadInt64();
+                    byte capturedStream = reader.ReadByte();
+                    int capturedConnectionId = reader.ReadInt32();
+                    int count = reader.ReadInt32();
+
+                    if (buffer.Length < count)
+                        buffer = new byte[Mathf.NextPowerOfTwo(count)];
+
+                    if (reader.Read(buffer, 0, count) < count)
+                        break;
+
+                    if (capturedStream != PointCloudStream)
+                        continue;
+
+                    if (connectionId < 0)
+                        connectionId = capturedConnectionId;
+                    else if (capturedConnectionId != connectionId)
+                        continue;
+
+                    if (firstTimeUs < 0)
+                        firstTimeUs = timeUs;
+
+                    WaitUntil(stopwatch, passStartUs + timeUs - firstTimeUs);
+                    stream.Write(buffer, 0, count);
+                }
+
+                // A capture of no point cloud would be read over again without end
+                if (firstTimeUs < 0)
+                    throw new InvalidDataException(ConnectionId >= 0 ? "the capture has no point cloud connection " + ConnectionId : "the capture has no point cloud stream");
+            }
+        }
+        catch (Exception e) when (e is IOException || e is SocketException || e is ObjectDisposedException || e is InvalidDataException)
+        {
+            if (isServing)
+                serverError = e.Message;
+        }
+    }
+
+    private static BinaryReader OpenCapture(string path)
+    {
+        BinaryReader reader = new(File.OpenRead(path));
+        byte[] magic = reader.ReadBytes(s_captureMagic.Length);
+        bool isCapture = magic.Length == s_captureMagic.Length;
+
+        for (int i = 0; isCapture && i < s_captureMagic.Length; i++)
+            isCapture = magic[i] == s_captureMagic[i];
+
+        if (!isCapture || reader.ReadInt32() != CaptureVersion)
+        {
+            reader.Dispose();
+            throw new InvalidDataException(path + " is not a stream capture of version " + CaptureVersion);
+        }
+
+        return reader;
+    }
+
+    private void AcceptDocumentClient()
+    {
+        try
+        {
+            DrainRequests(documentListener.AcceptTcpClient());
+        }
+        catch (Exception e) when (e is SocketException || e is ObjectDisposedException)
+        {
+            // The benchmark stopped before the receiver opened its document socket
+        }
+    }
+
+    private static void DrainRequests(TcpClient client)
+    {
+        byte[] buffer = new byte[4096];
+
+        try
+        {
+            while (client.GetStream().Read(buffer, 0, buffer.Length) > 0)
+            {
+            }
+        }
+        catch (Exception e) when (e is IOException || e is ObjectDisposedException || e is InvalidOperationException)
+        {
+        }
+    }
+
+    private static void WaitUntil(Stopwatch stopwatch, long timeUs)
+    {
+        while (true)
+        {
+            long remainingUs = timeUs - stopwatch.ElapsedTicks * 1000000 / Stopwatch.Frequency;
+
+            if (remainingUs <= 0)
+                return;
+
+            if (remainingUs > MinSleepUs)
+                Thread.Sleep((int)((remainingUs - MinSleepUs) / 1000) + 1);
+            else
+                Thread.SpinWait(100);
+        }
+    }
+
+    private static string Name(BenchmarkMode mode)
+    {
+        return mode == BenchmarkMode.LevelOfDetail ? "lod" : mode.ToString().ToLowerInvariant();
+    }
+
+    private static string Format(float value) => float.IsNaN(value) ? "null" : value.ToString("0.###", CultureInfo.InvariantCulture);
+
+    private static string EscapeJson(string value)
+    {
+        return value.Replace("\\", "\\\\").Replace("\"", "\\\"").Replace("\n", "\\n").Replace("\r", "");
+    }
+}
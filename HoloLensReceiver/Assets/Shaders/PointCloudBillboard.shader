@@ -7,7 +7,24 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This shader makes every point cloud vertex into a small quad plane which 
-rotates to face the camera.
+rotates to face the camera. With PROCEDURAL_POINTS, the points are read from
+buffers instead of a mesh, and each point is expanded from the index of the
+vertex, so the renderer only uploads the positions and colors once. With
+PACKED_POINTS, the points are procedural too, but are read from the bytes
+the receiver got, one out of a stride, and their positions are dequantized
+from the grid of the frame. With
+MESH_TRIANGLES, the vertices are the corners of the triangles of a mesh and
+are drawn in place, with their colors, and the triangles write the depth.
+With SURFELS, each point has a normal and its quad lies on the surface,
+perpendicular to the normal, and is cut to a disc; the points without a
+normal are discs facing the camera. The points are opaque and write the
+depth, so that the fragments of the points hidden behind others are
+rejected before they are shaded; the surfels, which are cut with a discard,
+are drawn in a depth pre-pass first, and their colors are then only written
+where their own depth was kept. The alpha of the colors holds the number of
+occupied siblings of the point in the octree it was decoded from, 1 to 8;
+the points of sparse nodes are drawn larger to cover the gaps between them and
+those of dense nodes smaller, as they overlap their neighbours.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -21,41 +38,86 @@ Shader "Custom/PointCloudBillboard"
     Properties
     {
         _PointSize("Point Size", Float) = 0.02
+        [HideInInspector] _ZWrite("ZWrite", Float) = 1
+        [HideInInspector] _ZTest("ZTest", Float) = 4 // LessEqual; Equal after the depth pre-pass
     }
 
     SubShader
     {
-        Tags { "Queue" = "Transparent" "RenderType" = "Transparent" }
-        Pass
-        {
-            Cull Off ZWrite Off
-            Blend SrcAlpha OneMinusSrcAlpha
-
-            CGPROGRAM
-            #pragma vertex vert
-            #pragma fragment frag
-            #pragma multi_compile_instancing
-            #pragma multi_compile _ UNITY_SINGLE_PASS_STEREO
+        Tags { "Queue" = "Geometry" "RenderType" = "Opaque" }
 
+        CGINCLUDE
             #include "UnityCG.cginc"
 
             // Size of each point (in world units)
             half _PointSize;
 
+            // Siblings of the points of a surface crossing a node, at which the points are drawn at _PointSize
+            static const half SurfaceSiblings = 4.0;
+
+#if PROCEDURAL_POINTS
+            // Points of the frame, and the transform of the point cloud, which procedural draws do not set
+            StructuredBuffer<float3> _Positions;
+            StructuredBuffer<uint> _Colors; // Packed Color32, r in the low byte
+#if SURFELS
+            StructuredBuffer<float3> _Normals; // Zero for the points without a normal
+#endif
+            float4x4 _ObjectToWorld;
+
+            // Six vertices for each point, drawn without a mesh
+            struct VertexInput
+            {
+                uint vertexID : SV_VertexID;
+                UNITY_VERTEX_INPUT_INSTANCE_ID
+            };
+#elif PACKED_POINTS
+            // Byte positions (x, y, z) of the points followed by their colors (r, g, b), as received; position =
+            // bytes * _PackedStep + _PackedOrigin per axis. One point out of _PointStride is drawn.
+            ByteAddressBuffer _PackedPoints;
+            float3 _PackedStep;
+            float3 _PackedOrigin;
+            int _PackedColorOffset;
+            int _PointStride;
+            float4x4 _ObjectToWorld;
+
+            struct VertexInput
+            {
+                uint vertexID : SV_VertexID;
+                UNITY_VERTEX_INPUT_INSTANCE_ID
+            };
+
+            // Three bytes starting at any address; they span at most two words, the buffer holding one more word than the points
+            uint3 LoadBytes(uint address)
+            {
+                uint wordAddress = address & ~3u;
+                uint shift = 8 * (address & 3u);
+                uint2 words = _PackedPoints.Load2(wordAddress);
+                uint bytes = shift == 0 ? words.x : (words.x >> shift) | (words.y << (32 - shift));
+
+                return uint3(bytes & 0xFF, (bytes >> 8) & 0xFF, (bytes >> 16) & 0xFF);
+            }
+#else
             // Input struct from the mesh
             struct VertexInput
             {
                 float3 position : POSITION;
-                half3 color : COLOR; // RGB only
-                float2 uv : TEXCOORD0; // uv.x stores corner index (0–5)
+                half4 color : COLOR; // Alpha holds the occupied siblings of the point
+                float2 uv : TEXCOORD0; // uv.x stores corner index (0–5); not set on the triangles of a mesh
+#if SURFELS
+                float3 normal : NORMAL; // Zero for the points without a normal
+#endif
                 UNITY_VERTEX_INPUT_INSTANCE_ID
             };
+#endif
 
             // Output struct from the vertex shader to the fragment shader
             struct VertexOutput
             {
                 float4 position : SV_POSITION;
                 half3 color : COLOR;
+#if SURFELS
+                float2 corner : TEXCOORD0; // Offset of the vertex in the quad, to cut it to a disc
+#endif
                 UNITY_VERTEX_OUTPUT_STEREO
             };
 
@@ -71,6 +133,14 @@ Shader "Custom/PointCloudBillboard"
                 return float2(-0.5, 0.5); // case 5
             }
 
+            // Ratio of the size of a point to _PointSize, from the number of occupied siblings held in its alpha; the
+            // points which were not decoded from an octree have an alpha of 255 and keep _PointSize
+            half GetDensitySizeRatio(half alpha)
+            {
+                half siblings = round(alpha * 255.0);
+                return siblings <= 8.0 ? sqrt(SurfaceSiblings / max(siblings, 1.0)) : 1.0;
+            }
+
             // Vertex shader: expands each point into a camera-facing quad in view space
             VertexOutput vert(VertexInput input)
             {
@@ -78,6 +148,30 @@ Shader "Custom/PointCloudBillboard"
                 UNITY_SETUP_INSTANCE_ID(input);
                 UNITY_INITIALIZE_VERTEX_OUTPUT_STEREO(output);
 
+#if PROCEDURAL_POINTS
+                uint pointIndex = input.vertexID / 6;
+                uint color = _Colors[pointIndex];
+
+                float4 viewPos = mul(UNITY_MATRIX_V, mul(_ObjectToWorld, float4(_Positions[pointIndex], 1.0)));
+                float2 baseOffset = GetQuadCornerOffset(input.vertexID - 6 * pointIndex);
+                output.color = half3(color & 0xFF, (color >> 8) & 0xFF, (color >> 16) & 0xFF) / 255.0;
+                half pointSize = _PointSize * GetDensitySizeRatio((color >> 24) / 255.0);
+#if SURFELS
+                float3 viewNormal = mul((float3x3)UNITY_MATRIX_V, mul((float3x3)_ObjectToWorld, _Normals[pointIndex]));
+#endif
+#elif PACKED_POINTS
+                uint quadIndex = input.vertexID / 6;
+                uint pointIndex = quadIndex * _PointStride;
+                float3 position = LoadBytes(3 * pointIndex) * _PackedStep + _PackedOrigin;
+
+                float4 viewPos = mul(UNITY_MATRIX_V, mul(_ObjectToWorld, float4(position, 1.0)));
+                float2 baseOffset = GetQuadCornerOffset(input.vertexID - 6 * quadIndex);
+                output.color = LoadBytes(_PackedColorOffset + 3 * pointIndex) / 255.0;
+                half pointSize = _PointSize; // The packed points keep the bytes received, without their density
+#if SURFELS
+                float3 viewNormal = float3(0.0, 0.0, 0.0); // The packed points have no normals, so they face the camera
+#endif
+#else
                 // Transform the vertex position from object space to view space
                 // This accounts for both object rotation and camera view
                 float4 viewPos = mul(UNITY_MATRIX_MV, float4(input.position, 1.0));
@@ -85,25 +179,93 @@ Shader "Custom/PointCloudBillboard"
                 // Get quad corner offset (e.g., -0.5 to +0.5 range)
                 float2 baseOffset = GetQuadCornerOffset(input.uv.x);
 
+                // Pass vertex color through to fragment shader
+                output.color = input.color.rgb;
+                half pointSize = _PointSize * GetDensitySizeRatio(input.color.a);
+#if SURFELS
+                float3 viewNormal = mul((float3x3)UNITY_MATRIX_MV, input.normal);
+#endif
+#endif
+
+#if SURFELS && !MESH_TRIANGLES
+                output.corner = baseOffset;
+
+                // Lay the quad on the surface, in a plane spanned by two axes perpendicular to the normal; the points
+                // without a normal fall back to the billboard
+                if (dot(viewNormal, viewNormal) > 0.25)
+                {
+                    float3 normal = normalize(viewNormal);
+                    float3 tangent = normalize(cross(abs(normal.y) < 0.9 ? float3(0.0, 1.0, 0.0) : float3(1.0, 0.0, 0.0), normal));
+                    float3 bitangent = cross(normal, tangent);
+                    viewPos.xyz += (baseOffset.x * tangent + baseOffset.y * bitangent) * pointSize;
+                }
+                else
+                {
+                    viewPos.xy += baseOffset * pointSize;
+                }
+#elif !MESH_TRIANGLES
                 // Apply the 2D billboard offset in view space (camera-facing XY plane)
                 // _PointSize is in world units but works in view space scale since projection handles perspective
-                viewPos.xy += baseOffset * _PointSize;
+                viewPos.xy += baseOffset * pointSize;
+#endif
 
                 // Transform final view-space position to clip space (for rasterization)
                 output.position = mul(UNITY_MATRIX_P, viewPos);
 
-                // Pass vertex color through to fragment shader
-                output.color = input.color;
-
                 return output;
             }
 
-            // Fragment shader: outputs point color (with forced full alpha).
+            // Fragment shader of the depth pre-pass: only writes the depth of the discs
+            half4 fragDepth(VertexOutput input) : SV_Target
+            {
+#if SURFELS && !MESH_TRIANGLES
+                // Cut the quad to the disc it bounds
+                if (dot(input.corner, input.corner) > 0.25)
+                    discard;
+#endif
+
+                return half4(0.0, 0.0, 0.0, 0.0);
+            }
+
+            // Fragment shader: outputs point color (with forced full alpha). It never discards, so that the hidden
+            // fragments are rejected by the depth test before it runs; the corners of the surfels fail the test against
+            // the depth of the pre-pass.
             half4 frag(VertexOutput input) : SV_Target
             {
                 return half4(input.color, 1.0); // Fully opaque
             }
+        ENDCG
 
+        // Depth pre-pass, only enabled on the materials of the surfels
+        Pass
+        {
+            Tags { "LightMode" = "Always" }
+            Cull Off ZWrite On ColorMask 0
+
+            CGPROGRAM
+            #pragma vertex vert
+            #pragma fragment fragDepth
+            #pragma multi_compile_instancing
+            #pragma multi_compile _ UNITY_SINGLE_PASS_STEREO
+            #pragma multi_compile_local _ PROCEDURAL_POINTS PACKED_POINTS MESH_TRIANGLES
+            #pragma multi_compile_local _ SURFELS
+            #pragma target 4.5
+            ENDCG
+        }
+
+        Pass
+        {
+            Tags { "LightMode" = "ForwardBase" }
+            Cull Off ZWrite [_ZWrite] ZTest [_ZTest]
+
+            CGPROGRAM
+            #pragma vertex vert
+            #pragma fragment frag
+            #pragma multi_compile_instancing
+            #pragma multi_compile _ UNITY_SINGLE_PASS_STEREO
+            #pragma multi_compile_local _ PROCEDURAL_POINTS PACKED_POINTS MESH_TRIANGLES
+            #pragma multi_compile_local _ SURFELS
+            #pragma target 4.5
             ENDCG
         }
     }
@@ -0,0 +1,75 @@
+﻿/***************************************************************************\
+
+Module Name:  LoadTestOptions.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module holds the options of a load test: the server, the number of
+simulated receivers, and the transports and codings of the point clouds
+they request, which are run one combination after the other. The options
+of a receiver default to those of the HoloLens receiver.
+
+\***************************************************************************/
+
+using System.Collections.Generic;
+
+namespace LiveScanLoadTest
+{
+    /// <summary>
+    /// How the point clouds reach the receivers
+    /// </summary>
+    public enum Transport
+    {
+        Tcp,
+        Udp,
+        Multicast
+    }
+
+    /// <summary>
+    /// Format of the point clouds the receivers request
+    /// </summary>
+    public enum Codec
+    {
+        Full,
+        Octree,
+        Progressive,
+        Wide,
+        Surfel,
+        Split,
+        Delta,
+        Mesh
+    }
+
+    public class LoadTestOptions
+    {
+        public string ServerAddress = "127.0.0.1";
+        public int PointCloudPort = 48002;
+        public int DocumentPort = 48003;
+        public string MulticastGroupAddress = "239.255.48.2";
+        public int MulticastPort = 48004;
+
+        public int NumReceivers = 4;
+        public double WarmupSeconds = 3.0; // Lets the receivers connect and get their keyframes before they are measured
+        public double DurationSeconds = 10.0;
+        public List<Transport> Transports = new List<Transport> { Transport.Tcp };
+        public List<Codec> Codecs = new List<Codec> { Codec.Progressive };
+
+        public bool IsCompressionEnabled = true;
+        public bool IsViewCullingEnabled = true;
+        public bool IsLatencyTracingEnabled = true;
+        public bool IsDocumentStreamEnabled = true;
+        public int DocumentSize = 1024; // Largest width and height the receivers render the documents at
+
+        public string OutputPath = "";
+
+        /// <summary>
+        /// Whether a coding can be streamed over UDP; the other ones need every frame, or the TCP socket, to be decoded
+        /// </summary>
+        public static bool IsStreamable(Codec codec)
+        {
+            return codec == Codec.Full || codec == Codec.Octree || codec == Codec.Wide || codec == Codec.Surfel;
+        }
+    }
+}
@@ -0,0 +1,694 @@
+﻿/***************************************************************************\
+
+Module Name:  PointCloudDecoder.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module decodes the point cloud frames a simulated receiver gets, in
+every format of the HoloLens receiver: full, wide, surfel, mesh, octree,
+progressive, delta and split frames, compressed or not. The frames are
+decoded like the headset decodes them, into positions and colors, so that
+a frame which the headset would reject is counted as invalid; the decoding
+runs on the thread of the receiver, as the load of the receivers is only
+what they ask of the server. The buffers are kept from frame to frame.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.IO.Compression;
+
+namespace LiveScanLoadTest
+{
+    public class PointCloudDecoder
+    {
+        // Request bytes and frame types of the point cloud protocol, as the HoloLens receiver sends them
+        public const byte FullFrameRequest = 0;
+        public const byte DeltaFrameRequest = 1;
+        public const byte MeshFrameRequest = 7;
+        public const byte FrameTypeMask = 0x07;
+        public const byte CompressionRequestFlag = 0x80;
+        public const byte OctreeRequestFlag = 0x40;
+        public const byte ProgressiveRequestFlag = 0x20;
+        public const byte WideRequestFlag = 0x10;
+        public const byte TimestampRequestFlag = 0x08;
+        public const byte SurfelRequestFlags = WideRequestFlag | OctreeRequestFlag;
+        public const byte SplitRequestFlags = WideRequestFlag | ProgressiveRequestFlag;
+
+        private const int PointXYZDataSize = 3;
+        private const int PointRGBDataSize = 3;
+        private const float Range = 0.3f;
+        private const float HalfRange = Range / 2.0f;
+        private const float XRangeCenter = 0.0f;
+        private const float YRangeCenter = 0.0f;
+        private const float ZRangeCenter = HalfRange;
+        private const byte KeyframeType = 0;
+        private const byte GeometryFrameType = 2;
+        private const byte NoSurfelNormal = 0xFF;
+        private const int SurfelNormalLevels = 15;
+        private const int WideYBits = 11;
+        private const int WideZBits = 10;
+        private const int MaxShortIndexVertices = 1 << 16;
+        private const byte EndOfFrameDepth = 0;
+        private const byte DeflatePayload = 1;
+        private const int OctreeDepth = 8;
+
+        private static readonly float[] surfelNormals = BuildSurfelNormals();
+
+        // Voxels of the last frame of a delta stream (key: packed x, y, z bytes), and the geometry of the last
+        // geometry frame of a split stream
+        private readonly Dictionary<int, int> voxels = new Dictionary<int, int>();
+        private int splitGeometryId = 0;
+        private int splitCount = 0;
+        private float[] splitPositions = new float[0];
+        private byte[] splitColors = new byte[0];
+
+        private readonly byte[] fieldBytes = new byte[sizeof(long)];
+        private readonly byte[] inflateBytes = new byte[1 << 16];
+        private readonly MemoryStream decompressedPayload = new MemoryStream();
+        private byte[] compressedBytes = new byte[0];
+        private byte[] pointBytes = new byte[0];
+        private byte[] maskBytes = new byte[0];
+        private byte[] chunkBytes = new byte[0];
+        private byte[] codedColorBytes = new byte[0];
+        private byte[] extraBytes = new byte[0];
+        private int[] colorChannels = new int[0];
+        private List<int> octreeNodes = new List<int>();
+        private List<int> octreeChildren = new List<int>();
+
+        /// <summary>
+        /// Positions (x, y, z for each point) and colors (r, g, b for each point) of the last frame decoded, with the
+        /// Y axis flipped like the headset does
+        /// </summary>
+        public float[] Positions { get; private set; } = new float[0];
+        public byte[] Colors { get; private set; } = new byte[0];
+        public float[] Normals { get; private set; } = new float[0];
+        public int[] Indices { get; private set; } = new int[0];
+
+        public int NumPoints { get; private set; }
+        public int NumTriangles { get; private set; }
+
+        /// <summary>
+        /// Forgets the state of the previous connection; the server sends a keyframe and a geometry to the next one
+        /// </summary>
+        public void Reset()
+        {
+            voxels.Clear();
+            splitGeometryId = 0;
+        }
+
+        /// <summary>
+        /// Decodes a frame after its timestamp header
+        /// </summary>
+        /// <param name="stream">Stream the frame is read from</param>
+        /// <param name="request">Request the frame answers, or the flags it is coded with on the multicast group</param>
+        /// <param name="chunkDecoded">Called after each level of a progressive frame, and once after the other frames</param>
+        public void Decode(Stream stream, byte request, Action chunkDecoded)
+        {
+            bool isCompressed = (request & CompressionRequestFlag) != 0;
+            bool isSplit = (request & FrameTypeMask) == FullFrameRequest && (request & SplitRequestFlags) == SplitRequestFlags;
+
+            NumTriangles = 0;
+
+            // The chunks of progressive frames are compressed one by one
+            if ((request & ProgressiveRequestFlag) != 0 && !isSplit)
+            {
+                DecodeProgressive(stream, isCompressed, chunkDecoded);
+                return;
+            }
+
+            if (isCompressed)
+                stream = ReadPayload(stream);
+
+            if ((request & FrameTypeMask) == MeshFrameRequest)
+                DecodeMesh(stream);
+            else if ((request & FrameTypeMask) == DeltaFrameRequest)
+                DecodeDelta(stream);
+            else if (isSplit)
+                DecodeSplit(stream);
+            else if ((request & SurfelRequestFlags) == SurfelRequestFlags)
+                DecodeSurfels(stream);
+            else if ((request & WideRequestFlag) != 0)
+                DecodeWideVertices(stream);
+            else if ((request & OctreeRequestFlag) != 0)
+                DecodeOctree(stream);
+            else
+                DecodeFull(stream);
+
+            chunkDecoded();
+        }
+
+        /// <summary>
+        /// Reads the payload header byte and returns the stream to read the frame from, decompressed when it is
+        /// </summary>
+        private Stream ReadPayload(Stream stream)
+        {
+            if (ReadByte(stream) != DeflatePayload)
+                return stream;
+
+            int compressedSize = ReadInt(stream);
+            byte[] compressed = EnsureCapacity(ref compressedBytes, compressedSize);
+            Read(stream, compressed, compressedSize);
+
+            decompressedPayload.SetLength(0);
+
+            using (DeflateStream deflateStream = new DeflateStream(new MemoryStream(compressed, 0, compressedSize), CompressionMode.Decompress))
+            {
+                int numBytes;
+
+                while ((numBytes = deflateStream.Read(inflateBytes, 0, inflateBytes.Length)) > 0)
+                    decompressedPayload.Write(inflateBytes, 0, numBytes);
+            }
+
+            decompressedPayload.Position = 0;
+
+            return decompressedPayload;
+        }
+
+        private void DecodeFull(Stream stream)
+        {
+            short scale = ReadShort(stream);
+            int numPoints = ReadInt(stream);
+
+            byte[] bytes = EnsureCapacity(ref pointBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+            Read(stream, bytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+
+            ResizeFrame(numPoints);
+            DecodeBytePositions(bytes, 0, numPoints, scale);
+            Buffer.BlockCopy(bytes, PointXYZDataSize * numPoints, Colors, 0, PointRGBDataSize * numPoints);
+        }
+
+        /// <summary>
+        /// Decodes the points of a wide frame: the minimum and the quantization step of each axis, then the positions
+        /// packed in 32 bits (x in the high bits, then y, then z) and the colors
+        /// </summary>
+        private void DecodeWideVertices(Stream stream)
+        {
+            ReadShort(stream);
+            int numPoints = ReadInt(stream);
+            int size = 6 * sizeof(float) + (sizeof(uint) + PointRGBDataSize) * numPoints;
+
+            byte[] bytes = EnsureCapacity(ref pointBytes, size);
+            Read(stream, bytes, size);
+
+            float minX = BitConverter.ToSingle(bytes, 0), minY = BitConverter.ToSingle(bytes, 4), minZ = BitConverter.ToSingle(bytes, 8);
+            float stepX = BitConverter.ToSingle(bytes, 12), stepY = BitConverter.ToSingle(bytes, 16), stepZ = BitConverter.ToSingle(bytes, 20);
+            const uint YMask = (1u << WideYBits) - 1;
+            const uint ZMask = (1u << WideZBits) - 1;
+            int positionOffset = 6 * sizeof(float);
+
+            ResizeFrame(numPoints);
+            float[] positions = Positions;
+
+            for (int i = 0; i < numPoints; i++)
+            {
+                uint position = BitConverter.ToUInt32(bytes, positionOffset + sizeof(uint) * i);
+                positions[3 * i] = minX + (position >> (WideYBits + WideZBits)) * stepX;
+                positions[3 * i + 1] = -(minY + ((position >> WideZBits) & YMask) * stepY);
+                positions[3 * i + 2] = minZ + (position & ZMask) * stepZ;
+            }
+
+            Buffer.BlockCopy(bytes, positionOffset + sizeof(uint) * numPoints, Colors, 0, PointRGBDataSize * numPoints);
+        }
+
+        /// <summary>
+        /// Decodes a surfel frame: a wide frame, then the octahedral normal of each point in one byte
+        /// </summary>
+        private void DecodeSurfels(Stream stream)
+        {
+            DecodeWideVertices(stream);
+            int numPoints = NumPoints;
+
+            byte[] normals = EnsureCapacity(ref extraBytes, numPoints);
+            Read(stream, normals, numPoints);
+
+            if (Normals.Length < 3 * numPoints)
+                Normals = new float[Positions.Length];
+
+            for (int i = 0; i < numPoints; i++)
+                Array.Copy(surfelNormals, 3 * normals[i], Normals, 3 * i, 3);
+        }
+
+        /// <summary>
+        /// Builds the normal of each octahedral code, in the orientation of the decoded points
+        /// </summary>
+        private static float[] BuildSurfelNormals()
+        {
+            float[] normals = new float[3 * 256];
+            float maxLevel = SurfelNormalLevels - 1;
+
+            for (int code = 0; code < 256; code++)
+            {
+                if (code == NoSurfelNormal)
+                    continue;
+
+                float x = 2.0f * (code >> 4) / maxLevel - 1.0f;
+                float y = 2.0f * (code & 0x0F) / maxLevel - 1.0f;
+                float z = 1.0f - Math.Abs(x) - Math.Abs(y);
+
+                if (z < 0.0f)
+                {
+                    float foldedX = (1.0f - Math.Abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+                    float foldedY = (1.0f - Math.Abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+                    x = foldedX;
+                    y = foldedY;
+                }
+
+                float length = (float)Math.Sqrt(x * x + y * y + z * z);
+                normals[3 * code] = x / length;
+                normals[3 * code + 1] = -y / length;
+                normals[3 * code + 2] = z / length;
+            }
+
+            return normals;
+        }
+
+        /// <summary>
+        /// Decodes a mesh frame: the number of triangles, the vertices coded as a wide frame, then three vertex indices
+        /// for each triangle, as ushorts when there are no more than 65536 vertices and as ints otherwise
+        /// </summary>
+        private void DecodeMesh(Stream stream)
+        {
+            int numTriangles = ReadInt(stream);
+            DecodeWideVertices(stream);
+
+            if (numTriangles <= 0)
+                return;
+
+            bool isShortIndex = NumPoints <= MaxShortIndexVertices;
+            int numIndexBytes = 3 * numTriangles * (isShortIndex ? sizeof(ushort) : sizeof(int));
+            byte[] indexBytes = EnsureCapacity(ref extraBytes, numIndexBytes);
+            Read(stream, indexBytes, numIndexBytes);
+
+            if (Indices.Length < 3 * numTriangles)
+                Indices = new int[NextPowerOfTwo(3 * numTriangles)];
+
+            if (isShortIndex)
+            {
+                for (int i = 0; i < 3 * numTriangles; i++)
+                    Indices[i] = BitConverter.ToUInt16(indexBytes, sizeof(ushort) * i);
+            }
+            else
+            {
+                Buffer.BlockCopy(indexBytes, 0, Indices, 0, numIndexBytes);
+            }
+
+            NumTriangles = numTriangles;
+        }
+
+        /// <summary>
+        /// Decodes a frame coded as an octree: the child occupancy mask of each node, level by level, then the coded
+        /// colors of the voxels in the order of the leaves
+        /// </summary>
+        private void DecodeOctree(Stream stream)
+        {
+            short scale = ReadShort(stream);
+            int numPoints = ReadInt(stream);
+
+            octreeNodes.Clear();
+            octreeNodes.Add(0);
+
+            for (int depth = 0; depth < OctreeDepth && numPoints > 0; depth++)
+            {
+                byte[] masks = EnsureCapacity(ref maskBytes, octreeNodes.Count);
+                Read(stream, masks, octreeNodes.Count);
+                ExpandOctreeLevel(masks, depth);
+            }
+
+            if (numPoints > 0 && octreeNodes.Count != numPoints)
+                throw new InvalidDataException($"Octree has {octreeNodes.Count} leaves for {numPoints} points");
+
+            int chromaStep = ReadByte(stream);
+            int codedSize = ReadInt(stream);
+            byte[] coded = EnsureCapacity(ref codedColorBytes, codedSize);
+            Read(stream, coded, codedSize);
+
+            ResizeFrame(numPoints);
+            DecodeVoxels(octreeNodes, 0, scale);
+            DecodeOctreeColors(coded, codedSize, chromaStep, numPoints);
+        }
+
+        /// <summary>
+        /// Decodes a progressive frame: a coarse octree level, then one chunk for each finer level, until the end of
+        /// frame depth. Each chunk gives the masks of the levels above it and the mean colors of its nodes.
+        /// </summary>
+        private void DecodeProgressive(Stream stream, bool isCompressed, Action chunkDecoded)
+        {
+            short scale = ReadShort(stream);
+            ReadInt(stream);
+
+            int nodeDepth = 0;
+            octreeNodes.Clear();
+            octreeNodes.Add(0);
+
+            while (true)
+            {
+                byte depth = ReadByte(stream);
+
+                if (depth == EndOfFrameDepth)
+                    break;
+
+                int chunkSize = ReadInt(stream);
+                byte[] chunk = EnsureCapacity(ref chunkBytes, chunkSize);
+                Read(stream, chunk, chunkSize);
+
+                Stream chunkStream = new MemoryStream(chunk, 0, chunkSize);
+
+                if (isCompressed)
+                    chunkStream = ReadPayload(chunkStream);
+
+                int numNodes = ReadInt(chunkStream);
+
+                for (; nodeDepth < depth; nodeDepth++)
+                {
+                    byte[] masks = EnsureCapacity(ref maskBytes, octreeNodes.Count);
+                    Read(chunkStream, masks, octreeNodes.Count);
+                    ExpandOctreeLevel(masks, nodeDepth);
+                }
+
+                if (octreeNodes.Count != numNodes)
+                    throw new InvalidDataException($"Progressive chunk has {octreeNodes.Count} nodes instead of {numNodes}");
+
+                ResizeFrame(numNodes);
+                Read(chunkStream, Colors, PointRGBDataSize * numNodes);
+
+                // The points are at the centers of the nodes
+                DecodeVoxels(octreeNodes, (1 << (OctreeDepth - depth)) / 2, scale);
+                chunkDecoded();
+            }
+        }
+
+        /// <summary>
+        /// Adds the children of the nodes of a level, given the child occupancy mask of each node
+        /// </summary>
+        private void ExpandOctreeLevel(byte[] masks, int depth)
+        {
+            int bit = OctreeDepth - 1 - depth;
+
+            octreeChildren.Clear();
+
+            for (int i = 0; i < octreeNodes.Count; i++)
+            {
+                for (int child = 0; child < 8; child++)
+                {
+                    if ((masks[i] & (1 << child)) == 0)
+                        continue;
+
+                    // The child index holds one bit of each axis, (x << 2) | (y << 1) | z
+                    octreeChildren.Add(octreeNodes[i] | (((child >> 2) & 1) << (16 + bit)) | (((child >> 1) & 1) << (8 + bit)) | ((child & 1) << bit));
+                }
+            }
+
+            List<int> nodes = octreeNodes;
+            octreeNodes = octreeChildren;
+            octreeChildren = nodes;
+        }
+
+        /// <summary>
+        /// Decodes the colors of an octree frame: the residuals of the Y, Co and Cg channels as zigzag varints, each
+        /// predicted from the previous voxel
+        /// </summary>
+        private void DecodeOctreeColors(byte[] coded, int codedSize, int chromaStep, int numPoints)
+        {
+            if (colorChannels.Length < 3 * numPoints)
+                colorChannels = new int[NextPowerOfTwo(3 * numPoints)];
+
+            int[] channels = colorChannels;
+            int offset = 0;
+
+            for (int channel = 0; channel < 3; channel++)
+            {
+                int value = 0;
+
+                for (int i = 0; i < numPoints; i++)
+                {
+                    uint zigzag = 0;
+                    int shift = 0;
+                    byte codedByte;
+
+                    do
+                    {
+                        if (offset >= codedSize)
+                            throw new InvalidDataException("Octree colors are shorter than their voxels");
+
+                        codedByte = coded[offset++];
+                        zigzag |= (uint)(codedByte & 0x7F) << shift;
+                        shift += 7;
+                    }
+                    while ((codedByte & 0x80) != 0);
+
+                    value += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+                    channels[channel * numPoints + i] = value;
+                }
+            }
+
+            byte[] colors = Colors;
+
+            for (int i = 0; i < numPoints; i++)
+            {
+                int y = channels[i];
+                int co = channels[numPoints + i] * chromaStep;
+                int cg = channels[2 * numPoints + i] * chromaStep;
+
+                // Inverse YCoCg-R transform
+                int t = y - (cg >> 1);
+                int g = cg + t;
+                int b = t - (co >> 1);
+                int r = b + co;
+
+                colors[3 * i] = (byte)Math.Max(0, Math.Min(255, r));
+                colors[3 * i + 1] = (byte)Math.Max(0, Math.Min(255, g));
+                colors[3 * i + 2] = (byte)Math.Max(0, Math.Min(255, b));
+            }
+        }
+
+        /// <summary>
+        /// Decodes a delta frame and applies it to the voxels of the previous frame. Keyframes replace all the voxels;
+        /// delta frames list the voxels removed, then the ones added or recolored.
+        /// </summary>
+        private void DecodeDelta(Stream stream)
+        {
+            byte frameType = ReadByte(stream);
+            short scale = ReadShort(stream);
+
+            if (frameType == KeyframeType)
+            {
+                int numPoints = ReadInt(stream);
+                byte[] bytes = EnsureCapacity(ref pointBytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+                Read(stream, bytes, (PointXYZDataSize + PointRGBDataSize) * numPoints);
+
+                voxels.Clear();
+                SetVoxels(bytes, numPoints);
+            }
+            else
+            {
+                int numRemoved = ReadInt(stream);
+                byte[] removedBytes = EnsureCapacity(ref extraBytes, PointXYZDataSize * numRemoved);
+                Read(stream, removedBytes, PointXYZDataSize * numRemoved);
+
+                for (int i = 0; i < numRemoved; i++)
+                    voxels.Remove(PackVoxel(removedBytes, PointXYZDataSize * i));
+
+                int numUpdated = ReadInt(stream);
+                byte[] bytes = EnsureCapacity(ref pointBytes, (PointXYZDataSize + PointRGBDataSize) * numUpdated);
+                Read(stream, bytes, (PointXYZDataSize + PointRGBDataSize) * numUpdated);
+
+                SetVoxels(bytes, numUpdated);
+            }
+
+            // The complete point cloud is decoded, like the headset gives it to its renderer
+            ResizeFrame(voxels.Count);
+            float[] positions = Positions;
+            byte[] colors = Colors;
+            int index = 0;
+
+            foreach (KeyValuePair<int, int> voxel in voxels)
+            {
+                DecodeVoxel(voxel.Key, 0, scale, positions, index);
+                colors[3 * index] = (byte)(voxel.Value >> 16);
+                colors[3 * index + 1] = (byte)(voxel.Value >> 8);
+                colors[3 * index + 2] = (byte)voxel.Value;
+                index++;
+            }
+        }
+
+        private void SetVoxels(byte[] bytes, int numPoints)
+        {
+            for (int i = 0; i < numPoints; i++)
+            {
+                int color = PointXYZDataSize * numPoints + PointRGBDataSize * i;
+                voxels[PackVoxel(bytes, PointXYZDataSize * i)] = (bytes[color] << 16) | (bytes[color + 1] << 8) | bytes[color + 2];
+            }
+        }
+
+        private static int PackVoxel(byte[] bytes, int offset)
+        {
+            return (bytes[offset] << 16) | (bytes[offset + 1] << 8) | bytes[offset + 2];
+        }
+
+        /// <summary>
+        /// Decodes a split frame: the type of the frame and the id of its geometry, then either the geometry as a full
+        /// frame, or the colors of the points of the geometry held, none if they did not change
+        /// </summary>
+        private void DecodeSplit(Stream stream)
+        {
+            byte frameType = ReadByte(stream);
+            int geometryId = ReadInt(stream);
+
+            if (frameType == GeometryFrameType)
+            {
+                DecodeFull(stream);
+
+                if (splitPositions.Length < 3 * NumPoints)
+                {
+                    splitPositions = new float[Positions.Length];
+                    splitColors = new byte[Colors.Length];
+                }
+
+                Array.Copy(Positions, splitPositions, 3 * NumPoints);
+                Buffer.BlockCopy(Colors, 0, splitColors, 0, 3 * NumPoints);
+
+                splitGeometryId = geometryId;
+                splitCount = NumPoints;
+                return;
+            }
+
+            // The server only sends the colors of the geometry it sent last
+            if (geometryId != splitGeometryId)
+                throw new InvalidDataException($"Colors of geometry {geometryId}, which is not held");
+
+            int numColors = ReadInt(stream);
+
+            if (numColors != 0 && numColors != splitCount)
+                throw new InvalidDataException($"{numColors} colors for a geometry of {splitCount} points");
+
+            ResizeFrame(splitCount);
+            Array.Copy(splitPositions, Positions, 3 * splitCount);
+
+            if (numColors > 0)
+                Read(stream, splitColors, PointRGBDataSize * numColors);
+
+            Buffer.BlockCopy(splitColors, 0, Colors, 0, PointRGBDataSize * splitCount);
+        }
+
+        private void DecodeBytePositions(byte[] bytes, int offset, int numPoints, float scale)
+        {
+            float[] positions = Positions;
+
+            for (int i = 0; i < numPoints; i++)
+            {
+                int point = offset + PointXYZDataSize * i;
+                positions[3 * i] = DecodeByteToFloat(bytes[point], XRangeCenter, scale, 0);
+                positions[3 * i + 1] = -DecodeByteToFloat(bytes[point + 1], YRangeCenter, scale, 0);
+                positions[3 * i + 2] = DecodeByteToFloat(bytes[point + 2], ZRangeCenter, scale, 0);
+            }
+        }
+
+        /// <summary>
+        /// Decodes the voxel positions of the nodes of an octree level, offset within the voxels by the given number of
+        /// steps
+        /// </summary>
+        private void DecodeVoxels(List<int> nodes, int offset, float scale)
+        {
+            for (int i = 0; i < NumPoints; i++)
+                DecodeVoxel(nodes[i], offset, scale, Positions, i);
+        }
+
+        private static void DecodeVoxel(int voxel, int offset, float scale, float[] positions, int index)
+        {
+            positions[3 * index] = DecodeByteToFloat((byte)(voxel >> 16), XRangeCenter, scale, offset);
+            positions[3 * index + 1] = -DecodeByteToFloat((byte)(voxel >> 8), YRangeCenter, scale, offset);
+            positions[3 * index + 2] = DecodeByteToFloat((byte)voxel, ZRangeCenter, scale, offset);
+        }
+
+        private static float DecodeByteToFloat(byte encoded, float rangeCenter, float scale, int offset)
+        {
+            return (encoded + offset) / scale - HalfRange + rangeCenter;
+        }
+
+        /// <summary>
+        /// Makes room for the points of the frame being decoded
+        /// </summary>
+        private void ResizeFrame(int numPoints)
+        {
+            if (numPoints < 0)
+                throw new InvalidDataException($"Frame of {numPoints} points");
+
+            if (Positions.Length < 3 * numPoints)
+            {
+                int capacity = NextPowerOfTwo(numPoints);
+                Positions = new float[3 * capacity];
+                Colors = new byte[3 * capacity];
+            }
+
+            NumPoints = numPoints;
+        }
+
+        private byte ReadByte(Stream stream)
+        {
+            Read(stream, fieldBytes, 1);
+
+            return fieldBytes[0];
+        }
+
+        private short ReadShort(Stream stream)
+        {
+            Read(stream, fieldBytes, sizeof(short));
+
+            return BitConverter.ToInt16(fieldBytes, 0);
+        }
+
+        private int ReadInt(Stream stream)
+        {
+            Read(stream, fieldBytes, sizeof(int));
+
+            return BitConverter.ToInt32(fieldBytes, 0);
+        }
+
+        /// <summary>
+        /// Fills the start of a buffer from a stream
+        /// </summary>
+        public static void Read(Stream stream, byte[] buffer, int numBytesToRead)
+        {
+            int numBytesRead = 0;
+
+            while (numBytesRead < numBytesToRead)
+            {
+                int numBytes = stream.Read(buffer, numBytesRead, numBytesToRead - numBytesRead);
+
+                // The connection was closed, or a decompressed frame is shorter than announced
+                if (numBytes == 0)
+                    throw new EndOfStreamException();
+
+                numBytesRead += numBytes;
+            }
+        }
+
+        /// <summary>
+        /// Returns a buffer of at least the given size; buffers only grow, with some headroom
+        /// </summary>
+        private static byte[] EnsureCapacity(ref byte[] buffer, int size)
+        {
+            if (size < 0)
+                throw new InvalidDataException($"Field of {size} bytes");
+
+            if (buffer.Length < size)
+                buffer = new byte[NextPowerOfTwo(size)];
+
+            return buffer;
+        }
+
+        private static int NextPowerOfTwo(int value)
+        {
+            int power = 1;
+
+            while (power < value)
+                power <<= 1;
+
+            return power;
+        }
+    }
+}
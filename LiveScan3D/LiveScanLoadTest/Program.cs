@@ -0,0 +1,274 @@
+﻿/***************************************************************************\
+
+Module Name:  Program.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is the main entry point of the load test, which finds how many
+headsets a LiveScanServer can feed. It opens a number of simulated
+receivers on the server for each transport and coding of the point clouds
+given, one combination after the other, and reports the frame rate, the
+latency and the bytes of each receiver as JSON, with a summary of each
+combination on the standard error. The server is fed by a replay of raw
+recordings, so that no camera is needed and the runs get the same frames.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Linq;
+using System.Threading;
+
+namespace LiveScanLoadTest
+{
+    static class Program
+    {
+        private const int ResultsVersion = 1;
+
+        // Lets the server close the connections of a combination before the receivers of the next one connect
+        private const int RunIntervalMs = 2000;
+
+        private const string Usage =
+            "LiveScanLoadTest.exe [--server <address>] [--port <port>] [--document-port <port>] [--receivers <count>] [--duration <seconds>]\n" +
+            "                     [--warmup <seconds>] [--transports <tcp,udp,multicast|all>] [--codecs <full,octree,progressive,wide,surfel,split,delta,mesh|all>]\n" +
+            "                     [--no-compression] [--no-culling] [--no-tracing] [--no-documents] [--document-size <pixels>] [--output <results.json>]";
+
+        /// <summary>
+        /// Main entry point for the application
+        /// </summary>
+        static int Main(string[] args)
+        {
+            LoadTestOptions options;
+
+            try
+            {
+                options = ParseOptions(args);
+            }
+            catch (Exception e) when (e is FormatException || e is ArgumentException || e is IndexOutOfRangeException)
+            {
+                Console.Error.WriteLine(e.Message);
+                Console.Error.WriteLine(Usage);
+                return 1;
+            }
+
+            List<RunResult> results = new List<RunResult>();
+
+            foreach (Transport transport in options.Transports)
+            {
+                foreach (Codec codec in options.Codecs)
+                {
+                    if (transport != Transport.Tcp && !LoadTestOptions.IsStreamable(codec))
+                    {
+                        Console.Error.WriteLine($"{Name(transport)}/{Name(codec)}: skipped, the coding is only sent over TCP");
+                        continue;
+                    }
+
+                    if (results.Count > 0)
+                        Thread.Sleep(RunIntervalMs);
+
+                    RunResult result = Run(options, transport, codec);
+                    results.Add(result);
+                    Console.Error.WriteLine(Summarize(result));
+                }
+            }
+
+            if (string.IsNullOrEmpty(options.OutputPath))
+            {
+                WriteResults(Console.Out, options, results);
+            }
+            else
+            {
+                using (StreamWriter writer = new StreamWriter(options.OutputPath))
+                    WriteResults(writer, options, results);
+            }
+
+            return 0;
+        }
+
+        private class RunResult
+        {
+            public Transport Transport;
+            public Codec Codec;
+            public List<ReceiverStats> Receivers;
+        }
+
+        private static LoadTestOptions ParseOptions(string[] args)
+        {
+            LoadTestOptions options = new LoadTestOptions();
+
+            for (int i = 0; i < args.Length; i++)
+            {
+                switch (args[i])
+                {
+                    case "--server":
+                        options.ServerAddress = args[++i];
+                        break;
+                    case "--port":
+                        options.PointCloudPort = int.Parse(args[++i]);
+                        break;
+                    case "--document-port":
+                        options.DocumentPort = int.Parse(args[++i]);
+                        break;
+                    case "--receivers":
+                        options.NumReceivers = Math.Max(1, int.Parse(args[++i]));
+                        break;
+                    case "--duration":
+                        options.DurationSeconds = double.Parse(args[++i], CultureInfo.InvariantCulture);
+                        break;
+                    case "--warmup":
+                        options.WarmupSeconds = double.Parse(args[++i], CultureInfo.InvariantCulture);
+                        break;
+                    case "--transports":
+                        options.Transports = ParseList<Transport>(args[++i]);
+                        break;
+                    case "--codecs":
+                        options.Codecs = ParseList<Codec>(args[++i]);
+                        break;
+                    case "--no-compression":
+                        options.IsCompressionEnabled = false;
+                        break;
+                    case "--no-culling":
+                        options.IsViewCullingEnabled = false;
+                        break;
+                    case "--no-tracing":
+                        options.IsLatencyTracingEnabled = false;
+                        break;
+                    case "--no-documents":
+                        options.IsDocumentStreamEnabled = false;
+                        break;
+                    case "--document-size":
+                        options.DocumentSize = int.Parse(args[++i]);
+                        break;
+                    case "--output":
+                        options.OutputPath = args[++i];
+                        break;
+                    default:
+                        throw new ArgumentException($"Unknown option {args[i]}");
+                }
+            }
+
+            return options;
+        }
+
+        /// <summary>
+        /// Parses a comma separated list of the values of an enum, or all of them
+        /// </summary>
+        private static List<T> ParseList<T>(string list) where T : struct
+        {
+            if (list == "all")
+                return Enum.GetValues(typeof(T)).Cast<T>().ToList();
+
+            List<T> values = new List<T>();
+
+            foreach (string name in list.Split(','))
+            {
+                T value;
+
+                if (!Enum.TryParse(name, true, out value))
+                    throw new ArgumentException($"Unknown {typeof(T).Name.ToLowerInvariant()} {name}");
+
+                values.Add(value);
+            }
+
+            return values;
+        }
+
+        /// <summary>
+        /// Runs the receivers of a combination: they connect and warm up, then are measured for the duration
+        /// </summary>
+        private static RunResult Run(LoadTestOptions options, Transport transport, Codec codec)
+        {
+            List<SimulatedReceiver> receivers = new List<SimulatedReceiver>();
+
+            for (int i = 0; i < options.NumReceivers; i++)
+                receivers.Add(new SimulatedReceiver(i, options.NumReceivers, options, transport, codec));
+
+            foreach (SimulatedReceiver receiver in receivers)
+                receiver.Start();
+
+            Thread.Sleep(TimeSpan.FromSeconds(options.WarmupSeconds));
+
+            foreach (SimulatedReceiver receiver in receivers)
+                receiver.Stats.Start();
+
+            Thread.Sleep(TimeSpan.FromSeconds(options.DurationSeconds));
+
+            foreach (SimulatedReceiver receiver in receivers)
+                receiver.Stats.Stop();
+
+            foreach (SimulatedReceiver receiver in receivers)
+                receiver.Stop();
+
+            return new RunResult { Transport = transport, Codec = codec, Receivers = receivers.Select(receiver => receiver.Stats).ToList() };
+        }
+
+        private static string Summarize(RunResult result)
+        {
+            List<ReceiverStats> receivers = result.Receivers;
+
+            return string.Format(CultureInfo.InvariantCulture, "{0}/{1}: {2} receivers, {3:F1} fps (min {4:F1}), {5:F1} Mbit/s each, latency p50 {6:F1} ms, p95 {7:F1} ms, {8} invalid frames, {9} disconnections",
+                Name(result.Transport), Name(result.Codec), receivers.Count, receivers.Average(stats => stats.FramesPerSecond),
+                receivers.Min(stats => stats.FramesPerSecond), receivers.Average(stats => stats.MegabitsPerSecond),
+                receivers.Average(stats => stats.GetLatencyMs(50)), receivers.Average(stats => stats.GetLatencyMs(95)),
+                receivers.Sum(stats => stats.NumInvalidFrames), receivers.Sum(stats => stats.NumDisconnections));
+        }
+
+        private static void WriteResults(TextWriter writer, LoadTestOptions options, List<RunResult> results)
+        {
+            writer.WriteLine("{");
+            writer.WriteLine($"  \"version\": {ResultsVersion},");
+            writer.WriteLine($"  \"server\": \"{EscapeJson(options.ServerAddress)}\",");
+            writer.WriteLine($"  \"receivers\": {options.NumReceivers},");
+            writer.WriteLine($"  \"durationSeconds\": {Format(options.DurationSeconds)},");
+            writer.WriteLine($"  \"compression\": {Format(options.IsCompressionEnabled)},");
+            writer.WriteLine($"  \"viewCulling\": {Format(options.IsViewCullingEnabled)},");
+            writer.WriteLine($"  \"documents\": {Format(options.IsDocumentStreamEnabled)},");
+            writer.WriteLine("  \"runs\": [");
+
+            for (int i = 0; i < results.Count; i++)
+            {
+                RunResult result = results[i];
+
+                writer.WriteLine("    {");
+                writer.WriteLine($"      \"transport\": \"{Name(result.Transport)}\",");
+                writer.WriteLine($"      \"codec\": \"{Name(result.Codec)}\",");
+                writer.WriteLine("      \"receivers\": [");
+
+                for (int j = 0; j < result.Receivers.Count; j++)
+                {
+                    ReceiverStats stats = result.Receivers[j];
+
+                    // NaN latencies, of the receivers which got no frame, are written as null
+                    writer.WriteLine($"        {{ \"index\": {j}, \"frames\": {stats.NumFrames}, \"framesPerSecond\": {Format(stats.FramesPerSecond)}, " +
+                        $"\"pointsPerFrame\": {Format(stats.PointsPerFrame)}, \"chunks\": {stats.NumChunks}, \"bytes\": {stats.NumBytes}, " +
+                        $"\"megabitsPerSecond\": {Format(stats.MegabitsPerSecond)}, \"latencyP50Ms\": {Format(stats.GetLatencyMs(50))}, " +
+                        $"\"latencyP95Ms\": {Format(stats.GetLatencyMs(95))}, \"latencyMaxMs\": {Format(stats.GetLatencyMs(100))}, " +
+                        $"\"decodeP50Ms\": {Format(stats.GetDecodeTimeMs(50))}, \"invalidFrames\": {stats.NumInvalidFrames}, " +
+                        $"\"disconnections\": {stats.NumDisconnections}, \"documents\": {stats.NumDocuments}, \"documentBytes\": {stats.NumDocumentBytes}, " +
+                        $"\"error\": \"{EscapeJson(stats.Error)}\" }}" + (j + 1 < result.Receivers.Count ? "," : ""));
+                }
+
+                writer.WriteLine("      ]");
+                writer.WriteLine("    }" + (i + 1 < results.Count ? "," : ""));
+            }
+
+            writer.WriteLine("  ]");
+            writer.WriteLine("}");
+        }
+
+        private static string Name<T>(T value) => value.ToString().ToLowerInvariant();
+
+        private static string Format(double value) => double.IsNaN(value) ? "null" : value.ToString("0.###", CultureInfo.InvariantCulture);
+
+        private static string Format(bool value) => value ? "true" : "false";
+
+        private static string EscapeJson(string value)
+        {
+            return value.Replace("\\", "\\\\").Replace("\"", "\\\"").Replace("\n", "\\n").Replace("\r", "");
+        }
+    }
+}
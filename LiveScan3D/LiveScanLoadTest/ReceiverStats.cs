@@ -0,0 +1,174 @@
+﻿/***************************************************************************\
+
+Module Name:  ReceiverStats.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module counts what a simulated receiver gets while it is measured: the
+frames, the points, the bytes and the documents, with the latency and the
+decoding time of each frame. The receiver threads add to the counts, and
+the load test reads them once the measurement ends.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+
+namespace LiveScanLoadTest
+{
+    public class ReceiverStats
+    {
+        private readonly object statsLock = new object();
+
+        private volatile bool isMeasuring = false;
+        private long startTime = 0;
+        private long stopTime = 0;
+
+        private long numBytes = 0; // Added from the sockets, so outside of the lock
+        private long numFrames = 0;
+        private long numChunks = 0;
+        private long numPoints = 0;
+        private long numInvalidFrames = 0;
+        private long numDocuments = 0;
+        private long numDocumentBytes = 0;
+        private long numDisconnections = 0;
+        private readonly List<double> latenciesMs = new List<double>();
+        private readonly List<double> decodeTimesMs = new List<double>();
+
+        /// <summary>
+        /// Last error of the connections, which ended the stream of the receiver
+        /// </summary>
+        public string Error { get; set; } = "";
+
+        public double Seconds => (double)((isMeasuring ? Stopwatch.GetTimestamp() : stopTime) - startTime) / Stopwatch.Frequency;
+        public long NumBytes => Interlocked.Read(ref numBytes);
+        public long NumFrames => numFrames;
+        public long NumChunks => numChunks;
+        public long NumInvalidFrames => numInvalidFrames;
+        public long NumDocuments => numDocuments;
+        public long NumDocumentBytes => numDocumentBytes;
+        public long NumDisconnections => numDisconnections;
+        public double FramesPerSecond => Seconds > 0.0 ? numFrames / Seconds : 0.0;
+        public double PointsPerFrame => numFrames > 0 ? (double)numPoints / numFrames : 0.0;
+        public double MegabitsPerSecond => Seconds > 0.0 ? NumBytes * 8e-6 / Seconds : 0.0;
+
+        /// <summary>
+        /// Starts counting, forgetting what was received before
+        /// </summary>
+        public void Start()
+        {
+            lock (statsLock)
+            {
+                Interlocked.Exchange(ref numBytes, 0);
+                numFrames = numChunks = numPoints = numInvalidFrames = numDocuments = numDocumentBytes = numDisconnections = 0;
+                latenciesMs.Clear();
+                decodeTimesMs.Clear();
+
+                startTime = Stopwatch.GetTimestamp();
+                isMeasuring = true;
+            }
+        }
+
+        public void Stop()
+        {
+            lock (statsLock)
+            {
+                stopTime = Stopwatch.GetTimestamp();
+                isMeasuring = false;
+            }
+        }
+
+        public void AddBytes(int count)
+        {
+            if (isMeasuring)
+                Interlocked.Add(ref numBytes, count);
+        }
+
+        /// <summary>
+        /// Counts a frame once it is decoded
+        /// </summary>
+        /// <param name="points">Number of points of the frame, or of the finest level of a progressive frame</param>
+        /// <param name="chunks">Number of levels of a progressive frame; 1 for the other frames</param>
+        /// <param name="latencyMs">Time from the merge of the frame to its first level decoded; negative if unknown</param>
+        /// <param name="decodeMs">Time from the end of the header of the frame to its last level decoded</param>
+        public void AddFrame(int points, int chunks, double latencyMs, double decodeMs)
+        {
+            lock (statsLock)
+            {
+                if (!isMeasuring)
+                    return;
+
+                numFrames++;
+                numChunks += chunks;
+                numPoints += points;
+                decodeTimesMs.Add(decodeMs);
+
+                if (latencyMs >= 0.0)
+                    latenciesMs.Add(latencyMs);
+            }
+        }
+
+        public void AddInvalidFrame()
+        {
+            lock (statsLock)
+            {
+                if (isMeasuring)
+                    numInvalidFrames++;
+            }
+        }
+
+        /// <summary>
+        /// Counts a connection lost, or refused, by the server
+        /// </summary>
+        public void AddDisconnection()
+        {
+            lock (statsLock)
+            {
+                if (isMeasuring)
+                    numDisconnections++;
+            }
+        }
+
+        public void AddDocument(int size)
+        {
+            lock (statsLock)
+            {
+                if (!isMeasuring)
+                    return;
+
+                numDocuments++;
+                numDocumentBytes += size;
+            }
+        }
+
+        /// <summary>
+        /// Latency of the frames at the given percentile, in milliseconds; NaN if no frame had a latency
+        /// </summary>
+        public double GetLatencyMs(double percentile)
+        {
+            lock (statsLock)
+                return GetPercentile(latenciesMs, percentile);
+        }
+
+        public double GetDecodeTimeMs(double percentile)
+        {
+            lock (statsLock)
+                return GetPercentile(decodeTimesMs, percentile);
+        }
+
+        private static double GetPercentile(List<double> values, double percentile)
+        {
+            if (values.Count == 0)
+                return double.NaN;
+
+            double[] sorted = values.ToArray();
+            Array.Sort(sorted);
+
+            return sorted[Math.Min(sorted.Length - 1, (int)(percentile / 100.0 * sorted.Length))];
+        }
+    }
+}
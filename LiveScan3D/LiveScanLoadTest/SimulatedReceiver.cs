@@ -0,0 +1,558 @@
+﻿/***************************************************************************\
+
+Module Name:  SimulatedReceiver.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is a headset simulated by the load test. It speaks the protocol
+of the HoloLens receiver: it keeps two point cloud requests outstanding over
+TCP, or has the frames streamed over UDP or to the multicast group, sends
+its view pose and the latency reports of the frames it decodes, and opens
+the document socket with the size it renders the documents at. Each frame
+is decoded like the headset decodes it, and counted with its latency from
+its merge on the server. The head of each receiver looks at the center of
+the first frame from its own side of the scene, so that the receivers are
+culled like headsets standing around it.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+using System.Threading;
+
+namespace LiveScanLoadTest
+{
+    public class SimulatedReceiver
+    {
+        // Requests of the point cloud protocol which are not frame types of the decoder
+        private const byte UdpStreamRequest = 2;
+        private const byte ViewPoseRequest = 3;
+        private const byte MulticastStreamRequest = 4;
+        private const byte LatencyTraceRequest = 5;
+        private const byte LatencyReportRequest = 6;
+        private const byte DocumentSizeRequest = 0;
+        private const int LatencyReportSize = 4 * sizeof(int);
+        private const int MaxPendingLatencyReports = 8;
+        private const int ViewPoseSize = 11 * sizeof(float);
+        private const int RequestWindowSize = 2;
+        private const int StreamBufferSize = 1 << 20;
+
+        // The receivers are placed on an arc in front of the scene, at about the distance and with about the field
+        // of view of a HoloLens 2
+        private const double ViewDistance = 1.5;
+        private const double ViewSpreadDegrees = 60.0;
+        private const double HalfFovXDegrees = 21.5;
+        private const double HalfFovYDegrees = 14.5;
+
+        // The simulated receivers connect again sooner than the headset, so that a receiver dropped by the server is
+        // back within the measurement
+        private const int ConnectionRetryIntervalMs = 1000;
+        private const int UdpReceiveTimeoutMs = 1000;
+
+        private readonly int index;
+        private readonly LoadTestOptions options;
+        private readonly Transport transport;
+        private readonly Codec codec;
+        private readonly double viewYaw;
+
+        private readonly PointCloudDecoder decoder = new PointCloudDecoder();
+        private Thread pointCloudThread;
+        private Thread documentThread;
+        private volatile bool isStopping = false;
+        private TcpClient pointCloudClient;
+        private UdpClient pointCloudUdpClient;
+        private TcpClient documentClient;
+        private readonly object clientLock = new object();
+
+        // Latency trace of the connection, and the frames decoded whose report is not sent yet
+        private bool isLatencyTraceRequested = false;
+        private readonly Queue<(int FrameId, long ReceiveTime, long DecodedTime)> pendingLatencyReports =
+            new Queue<(int FrameId, long ReceiveTime, long DecodedTime)>();
+
+        // View pose, in the coordinates of the server; null until the first frame gives the center of the scene
+        private float[] viewPose = null;
+
+        // Capture time, frame id and global timestamp of the cameras which precede a traced frame
+        private readonly byte[] headerBytes = new byte[sizeof(long) + sizeof(int) + sizeof(long)];
+
+        public ReceiverStats Stats { get; } = new ReceiverStats();
+
+        public SimulatedReceiver(int index, int numReceivers, LoadTestOptions options, Transport transport, Codec codec)
+        {
+            this.index = index;
+            this.options = options;
+            this.transport = transport;
+            this.codec = codec;
+
+            viewYaw = numReceivers > 1 ? (index / (numReceivers - 1.0) - 0.5) * ViewSpreadDegrees * Math.PI / 180.0 : 0.0;
+        }
+
+        public void Start()
+        {
+            pointCloudThread = new Thread(ReceivePointClouds) { IsBackground = true, Name = $"Receiver {index} point clouds" };
+            pointCloudThread.Start();
+
+            if (options.IsDocumentStreamEnabled)
+            {
+                documentThread = new Thread(ReceiveDocuments) { IsBackground = true, Name = $"Receiver {index} documents" };
+                documentThread.Start();
+            }
+        }
+
+        /// <summary>
+        /// Closes the connections and waits for the threads of the receiver
+        /// </summary>
+        public void Stop()
+        {
+            isStopping = true;
+
+            lock (clientLock)
+            {
+                pointCloudClient?.Close();
+                pointCloudUdpClient?.Close();
+                documentClient?.Close();
+            }
+
+            pointCloudThread?.Join();
+            documentThread?.Join();
+        }
+
+        private TcpClient Connect(int port)
+        {
+            TcpClient client = new TcpClient();
+
+            lock (clientLock)
+            {
+                if (isStopping)
+                    throw new ObjectDisposedException("Receiver stopped");
+
+                if (port == options.DocumentPort)
+                    documentClient = client;
+                else
+                    pointCloudClient = client;
+            }
+
+            client.Connect(options.ServerAddress, port);
+
+            // The requests are a few bytes, which must not wait for more data to be sent
+            client.NoDelay = true;
+
+            return client;
+        }
+
+        private void ReceivePointClouds()
+        {
+            while (!isStopping)
+            {
+                try
+                {
+                    using (TcpClient client = Connect(options.PointCloudPort))
+                    {
+                        isLatencyTraceRequested = false;
+                        pendingLatencyReports.Clear();
+                        decoder.Reset();
+
+                        if (transport == Transport.Tcp)
+                            ReceiveFrames(client);
+                        else
+                            StreamFrames(client);
+                    }
+                }
+                catch (Exception e)
+                {
+                    if (isStopping)
+                        break;
+
+                    Stats.Error = e.Message;
+                    Stats.AddDisconnection();
+                    Thread.Sleep(ConnectionRetryIntervalMs);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Receives the frames over TCP, keeping the request window full. A frame which cannot be decoded leaves the
+        /// stream out of step, so the receiver connects again.
+        /// </summary>
+        private void ReceiveFrames(TcpClient client)
+        {
+            NetworkStream socketStream = client.GetStream();
+            Stream stream = new BufferedStream(new CountingStream(socketStream, Stats), StreamBufferSize);
+            Queue<byte> pendingRequests = new Queue<byte>();
+            byte frameRequest = BuildFrameRequest();
+
+            while (!isStopping)
+            {
+                while (pendingRequests.Count < RequestWindowSize)
+                {
+                    pendingRequests.Enqueue(frameRequest);
+
+                    byte[] request = BuildRequest(frameRequest);
+                    socketStream.Write(request, 0, request.Length);
+                }
+
+                byte answeredRequest = pendingRequests.Dequeue();
+
+                try
+                {
+                    ReceiveFrame(stream, answeredRequest);
+                }
+                catch (InvalidDataException)
+                {
+                    Stats.AddInvalidFrame();
+                    throw;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Receives the frames streamed over UDP, to this receiver or to the multicast group. The TCP socket only carries
+        /// the request, and the view pose and the reports of a unicast stream.
+        /// </summary>
+        private void StreamFrames(TcpClient client)
+        {
+            bool isMulticast = transport == Transport.Multicast;
+            FrameReassembler reassembler = new FrameReassembler();
+            UdpClient udpClient;
+
+            if (isMulticast)
+            {
+                // The receivers all join the group on the same port, like the applications of a device
+                udpClient = new UdpClient();
+                udpClient.Client.SetSocketOption(SocketOptionLevel.Socket, SocketOptionName.ReuseAddress, true);
+                udpClient.Client.Bind(new IPEndPoint(IPAddress.Any, options.MulticastPort));
+                udpClient.JoinMulticastGroup(IPAddress.Parse(options.MulticastGroupAddress));
+            }
+            else
+            {
+                udpClient = new UdpClient(0);
+            }
+
+            lock (clientLock)
+                pointCloudUdpClient = udpClient;
+
+            using (udpClient)
+            {
+                udpClient.Client.ReceiveTimeout = UdpReceiveTimeoutMs;
+
+                NetworkStream socketStream = client.GetStream();
+                byte frameRequest = BuildFrameRequest();
+                int port = ((IPEndPoint)udpClient.Client.LocalEndPoint).Port;
+                byte[] request = isMulticast ? new byte[] { frameRequest } : BuildRequest(frameRequest, (byte)port, (byte)(port >> 8));
+                socketStream.Write(request, 0, request.Length);
+
+                IPEndPoint endPoint = new IPEndPoint(IPAddress.Any, 0);
+
+                while (!isStopping)
+                {
+                    byte[] packet;
+
+                    try
+                    {
+                        packet = udpClient.Receive(ref endPoint);
+                    }
+                    catch (SocketException e) when (e.SocketErrorCode == SocketError.TimedOut)
+                    {
+                        // The server closes the TCP connection of a stream it stops
+                        if (client.Client.Poll(0, SelectMode.SelectRead) && client.Available == 0)
+                            throw new EndOfStreamException("The server closed the connection");
+
+                        continue;
+                    }
+
+                    Stats.AddBytes(packet.Length);
+
+                    ArraySegment<byte> frame;
+
+                    if (!reassembler.AddPacket(packet, out frame))
+                        continue;
+
+                    // The view pose is updated once for each frame received, and the reports are sent with it
+                    if (!isMulticast && (options.IsViewCullingEnabled || pendingLatencyReports.Count > 0))
+                    {
+                        byte[] update = BuildRequest();
+                        socketStream.Write(update, 0, update.Length);
+                    }
+
+                    try
+                    {
+                        Stream stream = new MemoryStream(frame.Array, frame.Offset, frame.Count);
+
+                        // The frames of the group are coded with the flags all its receivers requested
+                        ReceiveFrame(stream, isMulticast ? (byte)stream.ReadByte() : frameRequest);
+                    }
+                    catch (Exception e) when (e is InvalidDataException || e is EndOfStreamException)
+                    {
+                        Stats.AddInvalidFrame();
+                    }
+                }
+            }
+        }
+
+        /// <summary>
+        /// Request byte of the frames, as the HoloLens receiver builds it for the coding of the receiver
+        /// </summary>
+        private byte BuildFrameRequest()
+        {
+            byte request;
+
+            if (transport == Transport.Multicast)
+                request = MulticastStreamRequest;
+            else if (transport == Transport.Udp)
+                request = UdpStreamRequest;
+            else if (codec == Codec.Mesh)
+                request = PointCloudDecoder.MeshFrameRequest;
+            else if (codec == Codec.Delta)
+                request = PointCloudDecoder.DeltaFrameRequest;
+            else
+                request = PointCloudDecoder.FullFrameRequest;
+
+            request |= PointCloudDecoder.TimestampRequestFlag;
+
+            if (options.IsCompressionEnabled)
+                request |= PointCloudDecoder.CompressionRequestFlag;
+
+            if (codec == Codec.Split)
+                request |= PointCloudDecoder.SplitRequestFlags;
+            else if (codec == Codec.Surfel)
+                request |= PointCloudDecoder.SurfelRequestFlags;
+            else if (codec == Codec.Wide)
+                request |= PointCloudDecoder.WideRequestFlag;
+            else if (codec == Codec.Progressive)
+                request |= PointCloudDecoder.ProgressiveRequestFlag;
+            else if (codec == Codec.Octree)
+                request |= PointCloudDecoder.OctreeRequestFlag;
+
+            return request;
+        }
+
+        /// <summary>
+        /// Builds the bytes of a request, preceded by the latency trace request on the first request of a connection, by
+        /// the reports of the frames decoded since the last request, and by the view pose once it is known
+        /// </summary>
+        private byte[] BuildRequest(params byte[] request)
+        {
+            bool isTraceRequested = options.IsLatencyTracingEnabled && !isLatencyTraceRequested && transport != Transport.Multicast;
+            bool isPoseSent = options.IsViewCullingEnabled && viewPose != null;
+            int numReports = pendingLatencyReports.Count;
+
+            byte[] message = new byte[(isTraceRequested ? 1 : 0) + numReports * (1 + LatencyReportSize) + (isPoseSent ? 1 + ViewPoseSize : 0) + request.Length];
+            int offset = 0;
+
+            if (isTraceRequested)
+            {
+                message[offset++] = LatencyTraceRequest;
+                isLatencyTraceRequested = true;
+            }
+
+            // The frames are displayed as soon as they are decoded, and reported with the time they were held
+            long now = GetLocalTimeUs();
+
+            while (pendingLatencyReports.Count > 0)
+            {
+                var report = pendingLatencyReports.Dequeue();
+                int decodedTime = (int)(report.DecodedTime - report.ReceiveTime);
+                int[] fields = { report.FrameId, decodedTime, decodedTime, (int)(now - report.ReceiveTime) };
+
+                message[offset++] = LatencyReportRequest;
+                Buffer.BlockCopy(fields, 0, message, offset, LatencyReportSize);
+                offset += LatencyReportSize;
+            }
+
+            if (isPoseSent)
+            {
+                message[offset++] = ViewPoseRequest;
+                Buffer.BlockCopy(viewPose, 0, message, offset, ViewPoseSize);
+                offset += ViewPoseSize;
+            }
+
+            Buffer.BlockCopy(request, 0, message, offset, request.Length);
+
+            return message;
+        }
+
+        /// <summary>
+        /// Reads the timestamp header of a frame, decodes the frame and counts it
+        /// </summary>
+        private void ReceiveFrame(Stream stream, byte request)
+        {
+            long captureTime = 0;
+            int frameId = 0;
+
+            if ((request & PointCloudDecoder.TimestampRequestFlag) != 0)
+            {
+                bool isTraced = isLatencyTraceRequested && transport != Transport.Multicast;
+                PointCloudDecoder.Read(stream, headerBytes, isTraced ? headerBytes.Length : sizeof(long));
+                captureTime = BitConverter.ToInt64(headerBytes, 0);
+                frameId = isTraced ? BitConverter.ToInt32(headerBytes, sizeof(long)) : 0;
+            }
+
+            // The rest of the frame is received while it is decoded
+            long receiveTime = GetLocalTimeUs();
+            long decodedTime = 0;
+            int numChunks = 0;
+
+            decoder.Decode(stream, request, () =>
+            {
+                // The coarse level of a progressive frame is the one displayed first
+                if (numChunks++ == 0)
+                    decodedTime = GetLocalTimeUs();
+            });
+
+            long endTime = GetLocalTimeUs();
+
+            // The capture time is on the clock of the server, which is the clock of this computer when the load test
+            // runs next to the server
+            double latencyMs = captureTime > 0 ? (decodedTime - captureTime) / 1000.0 : -1.0;
+            Stats.AddFrame(decoder.NumPoints, numChunks, latencyMs, (endTime - receiveTime) / 1000.0);
+
+            if (frameId != 0)
+                QueueLatencyReport(frameId, receiveTime, decodedTime);
+
+            if (viewPose == null && decoder.NumPoints > 0)
+                viewPose = BuildViewPose();
+        }
+
+        /// <summary>
+        /// Queues the report of a traced frame, which is displayed once decoded; the report is sent with the next request
+        /// </summary>
+        private void QueueLatencyReport(int frameId, long receiveTime, long decodedTime)
+        {
+            if (pendingLatencyReports.Count == MaxPendingLatencyReports)
+                pendingLatencyReports.Dequeue();
+
+            pendingLatencyReports.Enqueue((frameId, receiveTime, decodedTime));
+        }
+
+        /// <summary>
+        /// Builds the pose of a head looking at the center of the decoded frame, from the side of the receiver, in the
+        /// coordinates of the server, whose Y axis is flipped
+        /// </summary>
+        private float[] BuildViewPose()
+        {
+            double[] center = new double[3];
+            float[] positions = decoder.Positions;
+            int numPoints = decoder.NumPoints;
+
+            for (int i = 0; i < numPoints; i++)
+            {
+                center[0] += positions[3 * i];
+                center[1] -= positions[3 * i + 1];
+                center[2] += positions[3 * i + 2];
+            }
+
+            double forwardX = Math.Sin(viewYaw), forwardZ = Math.Cos(viewYaw);
+
+            return new float[]
+            {
+                (float)(center[0] / numPoints - ViewDistance * forwardX), (float)(center[1] / numPoints), (float)(center[2] / numPoints - ViewDistance * forwardZ),
+                (float)forwardX, 0.0f, (float)forwardZ,
+                0.0f, -1.0f, 0.0f,
+                (float)Math.Tan(HalfFovXDegrees * Math.PI / 180.0), (float)Math.Tan(HalfFovYDegrees * Math.PI / 180.0)
+            };
+        }
+
+        /// <summary>
+        /// Receives the documents after sending the size they are rendered at, and checks that each is a whole JPEG
+        /// </summary>
+        private void ReceiveDocuments()
+        {
+            // The header of each document: width (short), height (short), size of the data (int)
+            byte[] header = new byte[8];
+
+            while (!isStopping)
+            {
+                try
+                {
+                    using (TcpClient client = Connect(options.DocumentPort))
+                    {
+                        NetworkStream stream = client.GetStream();
+                        ushort size = (ushort)Math.Min(options.DocumentSize, ushort.MaxValue);
+
+                        if (size > 0)
+                            stream.Write(new byte[] { DocumentSizeRequest, (byte)size, (byte)(size >> 8), (byte)size, (byte)(size >> 8) }, 0, 5);
+
+                        while (!isStopping)
+                        {
+                            PointCloudDecoder.Read(stream, header, header.Length);
+
+                            int dataSize = BitConverter.ToInt32(header, 4);
+
+                            if (dataSize < 4)
+                                throw new InvalidDataException($"Document of {dataSize} bytes");
+
+                            byte[] data = new byte[dataSize];
+                            PointCloudDecoder.Read(stream, data, dataSize);
+
+                            // Start and end of image markers
+                            if (data[0] != 0xFF || data[1] != 0xD8 || data[dataSize - 2] != 0xFF || data[dataSize - 1] != 0xD9)
+                                throw new InvalidDataException("Document is not a JPEG image");
+
+                            Stats.AddDocument(header.Length + dataSize);
+                        }
+                    }
+                }
+                catch (Exception e)
+                {
+                    if (isStopping)
+                        break;
+
+                    Stats.Error = e.Message;
+                    Stats.AddDisconnection();
+                    Thread.Sleep(ConnectionRetryIntervalMs);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Time of the local clock in microseconds, like the clock the server stamps the frames with
+        /// </summary>
+        private static long GetLocalTimeUs()
+        {
+            return (long)(Stopwatch.GetTimestamp() * (1e6 / Stopwatch.Frequency));
+        }
+    }
+
+    /// <summary>
+    /// Stream which counts the bytes read from the socket of a receiver
+    /// </summary>
+    internal class CountingStream : Stream
+    {
+        private readonly Stream stream;
+        private readonly ReceiverStats stats;
+
+        public CountingStream(Stream stream, ReceiverStats stats)
+        {
+            this.stream = stream;
+            this.stats = stats;
+        }
+
+        public override bool CanRead => true;
+        public override bool CanSeek => false;
+        public override bool CanWrite => false;
+        public override long Length => throw new NotSupportedException();
+        public override long Position { get => throw new NotSupportedException(); set => throw new NotSupportedException(); }
+
+        public override int Read(byte[] buffer, int offset, int count)
+        {
+            int numBytes = stream.Read(buffer, offset, count);
+            stats.AddBytes(numBytes);
+
+            return numBytes;
+        }
+
+        public override void Flush()
+        {
+        }
+
+        public override long Seek(long offset, SeekOrigin origin) => throw new NotSupportedException();
+        public override void SetLength(long value) => throw new NotSupportedException();
+        public override void Write(byte[] buffer, int offset, int count) => throw new NotSupportedException();
+    }
+}
@@ -7,7 +7,15 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module allows reading point cloud frames from .bin files and handles
-playback functions.
+playback functions. Version 2 and 3 recordings end with an index of their
+frames, so any frame is read directly; the frames of version 1 recordings,
+and of the recordings which were not closed, are found by reading the frames
+which precede them. Version 2 and 3 recordings are mapped in memory, and
+their uncompressed frames are converted straight from the mapped file. The
+frames compressed with zstd are decoded into reused buffers, and the next
+frame is decoded on a worker thread while the current one is played. The
+recordings which interleave the frames of several cameras are played as one
+reader per camera, each reading the frames of its camera from the index.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -20,15 +28,100 @@ using System;
 using System.Collections.Generic;
 using System.Text;
 using System.IO;
+using System.IO.MemoryMappedFiles;
+using System.Runtime.InteropServices;
+using System.Threading.Tasks;
 
 namespace LiveScanPlayer
 {
     class FrameFileReaderBin : IFrameFileReader
     {
+        [DllImport("libzstd.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern unsafe UIntPtr ZSTD_decompress(byte* dst, UIntPtr dstCapacity, byte* src, UIntPtr compressedSize);
+
+        [DllImport("libzstd.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern uint ZSTD_isError(UIntPtr code);
+
+        // libzstd.dll is only copied next to the player when it is placed under lib\zstd, so it is looked for once
+        private static readonly Lazy<bool> isZstdAvailable = new Lazy<bool>(() =>
+        {
+            try
+            {
+                ZSTD_isError(UIntPtr.Zero);
+                return true;
+            }
+            catch (DllNotFoundException)
+            {
+                return false;
+            }
+        });
+
+        // File header: magic, version (ushort), reserved (ushort)
+        private static readonly byte[] RecordingMagic = { (byte)'L', (byte)'S', (byte)'3', (byte)'R' };
+        private const ushort MinRecordingVersion = 2;
+        private const ushort MaxRecordingVersion = 3;
+        private const int FileHeaderSize = 8;
+
+        // Frame header: number of points (uint), camera id (int), timestamp (ulong), then for version 3 the size of the
+        // data (uint), its encoding (byte) and 3 reserved bytes; followed by the points (3 shorts, in millimeters) and
+        // their colors (blue, green, red), compressed or not
+        private const int V2FrameHeaderSize = 16;
+        private const int V3FrameHeaderSize = 24;
+        private const int BytesPerPoint = 3 * sizeof(short) + 3;
+        private const int IndexEntrySize = 24; // Offset of the frame header (ulong), number of points (uint), timestamp (ulong), camera id (int)
+        private const int FooterSize = 16; // Offset of the index (ulong), number of frames (uint), magic
+
+        // Encodings of the frames; delta frames hold the difference of each component with the previous frame
+        private const byte RawEncoding = 0;
+        private const byte ZstdEncoding = 1;
+        private const byte ZstdDeltaEncoding = 2;
+
+        /// <summary>
+        /// Frame of a version 2 or 3 recording, as listed by its index and header
+        /// </summary>
+        private struct FrameIndexEntry
+        {
+            public long Offset;
+            public int NumPoints;
+            public ulong Timestamp;
+            public int CameraID;
+            public int DataSize;
+            public byte Encoding;
+        }
+
+        /// <summary>
+        /// Points and colors of a decoded compressed frame
+        /// </summary>
+        private sealed class DecodedFrame
+        {
+            public int Index = -1;
+            public int NumPoints = 0;
+            public short[] Points = new short[0];
+            public byte[] Colors = new byte[0];
+        }
+
         private BinaryReader binaryReader;
         private int currentFrameIdx = 0;
+        private ulong frameTimestampUs = 0; // Of the frame last read; version 1 recordings have none in microseconds
         private string filename;
 
+        // Frames of a version 2 or 3 recording; null for version 1 recordings
+        private List<FrameIndexEntry> frameIndex = null;
+        private int frameHeaderSize = V2FrameHeaderSize;
+
+        // Mapping of a version 2 or 3 recording, and the address of its first byte
+        private MemoryMappedFile mappedFile = null;
+        private MemoryMappedViewAccessor mappedView = null;
+        private unsafe byte* mappedData = null;
+        private long mappedLength = 0;
+
+        // Compressed frames: the frame played, the next one decoded by the prefetch task, and the decompressed data of
+        // the frame being decoded. Only one frame is decoded at a time, so they all are reused
+        private DecodedFrame decodedFrame = new DecodedFrame();
+        private DecodedFrame prefetchedFrame = new DecodedFrame();
+        private Task prefetchTask = null;
+        private byte[] decompressedData = new byte[0];
+
         public int FrameIdx
         {
             get
@@ -41,19 +134,102 @@ namespace LiveScanPlayer
             }
         }
 
+        public ulong FrameTimestampUs => frameTimestampUs;
+
+        // Camera whose frames are read, or AllCameras
+        public int CameraID { get; private set; } = AllCameras;
+        public const int AllCameras = -1;
+
+        /// <exception cref="IOException">The file could not be opened, or has compressed frames and libzstd.dll is missing</exception>
         public FrameFileReaderBin(string filename)
         {
             this.filename = filename;
-            binaryReader = new BinaryReader(File.Open(this.filename, FileMode.Open));
+
+            // The readers of the cameras of an interleaved recording read the same file
+            binaryReader = new BinaryReader(File.Open(this.filename, FileMode.Open, FileAccess.Read, FileShare.Read));
+
+            int version = ReadRecordingVersion();
+
+            if (version != 0)
+            {
+                frameHeaderSize = version == 2 ? V2FrameHeaderSize : V3FrameHeaderSize;
+                MapFile();
+                frameIndex = ReadFrameIndex();
+
+                if (!isZstdAvailable.Value && frameIndex.Exists(entry => entry.Encoding != RawEncoding))
+                {
+                    UnmapFile();
+                    binaryReader.Dispose();
+                    GC.SuppressFinalize(this);
+
+                    throw new IOException(filename + " has compressed frames, which cannot be read without libzstd.dll next to LiveScanPlayer.exe; " +
+                        "see the README to build the player with zstd");
+                }
+            }
+            else
+                Rewind();
+        }
+
+        /// <summary>
+        /// Opens a recording, as one reader per camera when it interleaves the frames of several cameras, so that they
+        /// are merged like the recordings of separate cameras
+        /// </summary>
+        public static List<FrameFileReaderBin> OpenCameras(string filename)
+        {
+            FrameFileReaderBin reader = new FrameFileReaderBin(filename);
+            List<FrameFileReaderBin> readers = new List<FrameFileReaderBin> { reader };
+
+            if (reader.frameIndex == null)
+                return readers;
+
+            List<int> cameraIDs = new List<int>();
+
+            foreach (FrameIndexEntry entry in reader.frameIndex)
+            {
+                if (!cameraIDs.Contains(entry.CameraID))
+                    cameraIDs.Add(entry.CameraID);
+            }
+
+            if (cameraIDs.Count < 2)
+                return readers;
+
+            reader.SelectCamera(cameraIDs[0]);
+
+            for (int i = 1; i < cameraIDs.Count; i++)
+            {
+                FrameFileReaderBin cameraReader = new FrameFileReaderBin(filename);
+                cameraReader.SelectCamera(cameraIDs[i]);
+                readers.Add(cameraReader);
+            }
+
+            return readers;
+        }
+
+        /// <summary>
+        /// Keeps the frames of one camera of the recording in the index, which the frame numbers then count
+        /// </summary>
+        private void SelectCamera(int cameraID)
+        {
+            CameraID = cameraID;
+            frameIndex = frameIndex.FindAll(entry => entry.CameraID == cameraID);
+            Rewind();
         }
 
         ~FrameFileReaderBin()
         {
+            prefetchTask?.Wait();
+            UnmapFile();
             binaryReader.Dispose();
         }
 
         public void ReadFrame(List<float> vertices, List<byte> colors)
         {
+            if (frameIndex != null)
+            {
+                ReadIndexedFrame(vertices, colors);
+                return;
+            }
+
             if (binaryReader.BaseStream.Position == binaryReader.BaseStream.Length)
                 Rewind();
 
@@ -108,6 +284,13 @@ namespace LiveScanPlayer
 
         public void JumpToFrame(int frameIdx)
         {
+            // The frames of version 2 and 3 recordings are read from their offset
+            if (frameIndex != null)
+            {
+                currentFrameIdx = frameIndex.Count > 0 ? Math.Min(Math.Max(frameIdx, 0), frameIndex.Count - 1) : 0;
+                return;
+            }
+
             Rewind();
 
             for (int i = 0; i < frameIdx; i++)
@@ -121,7 +304,353 @@ namespace LiveScanPlayer
         public void Rewind()
         {
             currentFrameIdx = 0;
-            binaryReader.BaseStream.Seek(0, SeekOrigin.Begin);
+
+            if (frameIndex == null)
+                binaryReader.BaseStream.Seek(0, SeekOrigin.Begin);
+        }
+
+        /// <summary>
+        /// Converts a frame of a version 2 or 3 recording directly from the mapped file, or from its decoded buffers
+        /// if it is compressed. The lists keep their capacity from frame to frame when they are reused, so nothing is
+        /// allocated for each frame.
+        /// </summary>
+        private unsafe void ReadIndexedFrame(List<float> vertices, List<byte> colors)
+        {
+            if (currentFrameIdx >= frameIndex.Count)
+                Rewind();
+
+            if (frameIndex.Count == 0)
+                return;
+
+            FrameIndexEntry entry = frameIndex[currentFrameIdx];
+            frameTimestampUs = entry.Timestamp;
+
+            if (entry.Encoding != RawEncoding)
+            {
+                DecodedFrame frame = GetDecodedFrame(currentFrameIdx);
+                AddDecodedFrame(frame, vertices, colors);
+
+                currentFrameIdx++;
+                StartPrefetch(currentFrameIdx % frameIndex.Count);
+                return;
+            }
+
+            short* points = (short*)(mappedData + entry.Offset + frameHeaderSize);
+            byte* pointColors = (byte*)(points + 3 * entry.NumPoints);
+
+            if (vertices.Capacity < vertices.Count + 3 * entry.NumPoints)
+                vertices.Capacity = vertices.Count + 3 * entry.NumPoints;
+            if (colors.Capacity < colors.Count + 3 * entry.NumPoints)
+                colors.Capacity = colors.Count + 3 * entry.NumPoints;
+
+            for (int i = 0; i < 3 * entry.NumPoints; i += 3)
+            {
+                vertices.Add(points[i] / 1000.0f); // Convert to float (meters)
+                vertices.Add(points[i + 1] / 1000.0f);
+                vertices.Add(points[i + 2] / 1000.0f);
+
+                // The colors are stored in blue, green, red order
+                colors.Add(pointColors[i + 2]);
+                colors.Add(pointColors[i + 1]);
+                colors.Add(pointColors[i]);
+            }
+
+            currentFrameIdx++;
+        }
+
+        private static void AddDecodedFrame(DecodedFrame frame, List<float> vertices, List<byte> colors)
+        {
+            if (vertices.Capacity < vertices.Count + 3 * frame.NumPoints)
+                vertices.Capacity = vertices.Count + 3 * frame.NumPoints;
+            if (colors.Capacity < colors.Count + 3 * frame.NumPoints)
+                colors.Capacity = colors.Count + 3 * frame.NumPoints;
+
+            for (int i = 0; i < 3 * frame.NumPoints; i += 3)
+            {
+                vertices.Add(frame.Points[i] / 1000.0f); // Convert to float (meters)
+                vertices.Add(frame.Points[i + 1] / 1000.0f);
+                vertices.Add(frame.Points[i + 2] / 1000.0f);
+
+                // The colors are stored in blue, green, red order
+                colors.Add(frame.Colors[i + 2]);
+                colors.Add(frame.Colors[i + 1]);
+                colors.Add(frame.Colors[i]);
+            }
+        }
+
+        /// <summary>
+        /// Returns a compressed frame decoded, from the prefetch task when it decoded that frame
+        /// </summary>
+        private DecodedFrame GetDecodedFrame(int frameIdx)
+        {
+            if (prefetchTask != null)
+            {
+                prefetchTask.Wait();
+                prefetchTask = null;
+
+                if (prefetchedFrame.Index == frameIdx)
+                {
+                    DecodedFrame previousFrame = decodedFrame;
+                    decodedFrame = prefetchedFrame;
+                    prefetchedFrame = previousFrame;
+                }
+            }
+
+            if (decodedFrame.Index != frameIdx)
+                DecodeFrame(frameIdx, decodedFrame, prefetchedFrame);
+
+            return decodedFrame;
+        }
+
+        /// <summary>
+        /// Decodes the next frame on a worker thread, from the frame being played when it is a delta frame. Both
+        /// frames are only read while the task runs, and it is waited for before any other frame is decoded.
+        /// </summary>
+        private void StartPrefetch(int frameIdx)
+        {
+            if (frameIndex[frameIdx].Encoding == RawEncoding)
+                return;
+
+            DecodedFrame target = prefetchedFrame;
+            DecodedFrame previousFrame = decodedFrame;
+            prefetchTask = Task.Run(() => DecodeFrame(frameIdx, target, previousFrame));
+        }
+
+        /// <summary>
+        /// Decodes a frame into a buffer. Delta frames are decoded from the last full frame before them, or from the
+        /// closest frame already decoded in either buffer.
+        /// </summary>
+        /// <param name="frameIdx">Frame to decode</param>
+        /// <param name="target">Receives the frame</param>
+        /// <param name="other">The other buffer, which is only read</param>
+        private void DecodeFrame(int frameIdx, DecodedFrame target, DecodedFrame other)
+        {
+            if (target.Index == frameIdx)
+                return;
+
+            int keyframeIdx = frameIdx;
+
+            while (keyframeIdx > 0 && frameIndex[keyframeIdx].Encoding == ZstdDeltaEncoding)
+                keyframeIdx--;
+
+            DecodedFrame previousFrame = null;
+
+            if (other.Index >= keyframeIdx && other.Index < frameIdx)
+                previousFrame = other;
+            if (target.Index >= keyframeIdx && target.Index < frameIdx && (previousFrame == null || target.Index > previousFrame.Index))
+                previousFrame = target;
+
+            for (int i = previousFrame != null ? previousFrame.Index + 1 : keyframeIdx; i <= frameIdx; i++)
+            {
+                DecodeSingleFrame(i, target, previousFrame);
+                previousFrame = target;
+            }
+        }
+
+        /// <summary>
+        /// Decompresses a frame and adds a delta frame to its previous frame, which may be the target itself
+        /// </summary>
+        private unsafe void DecodeSingleFrame(int frameIdx, DecodedFrame target, DecodedFrame previousFrame)
+        {
+            FrameIndexEntry entry = frameIndex[frameIdx];
+            int numComponents = 3 * entry.NumPoints;
+            int rawSize = BytesPerPoint * entry.NumPoints;
+            byte* data = mappedData + entry.Offset + frameHeaderSize;
+            int previousNumPoints = previousFrame != null ? previousFrame.NumPoints : 0;
+
+            if (decompressedData.Length < rawSize)
+                decompressedData = new byte[rawSize];
+
+            // The target keeps its points when it grows, since it may be the previous frame
+            if (target.Points.Length < numComponents)
+                Array.Resize(ref target.Points, numComponents);
+            if (target.Colors.Length < numComponents)
+                Array.Resize(ref target.Colors, numComponents);
+
+            // The size of the frame is only set once it is decoded, since the target may be the previous frame
+            target.Index = frameIdx;
+            target.NumPoints = 0;
+
+            fixed (byte* decompressed = decompressedData)
+            {
+                if (entry.Encoding == RawEncoding)
+                {
+                    Buffer.MemoryCopy(data, decompressed, decompressedData.Length, rawSize);
+                }
+                else
+                {
+                    UIntPtr size = ZSTD_decompress(decompressed, (UIntPtr)rawSize, data, (UIntPtr)entry.DataSize);
+
+                    // A corrupt frame is played empty
+                    if (ZSTD_isError(size) != 0 || (ulong)size != (ulong)rawSize)
+                        return;
+                }
+
+                short* points = (short*)decompressed;
+                byte* pointColors = decompressed + 3 * sizeof(short) * entry.NumPoints;
+                int numDeltaComponents = 0;
+
+                if (entry.Encoding == ZstdDeltaEncoding && previousFrame != null)
+                    numDeltaComponents = 3 * Math.Min(entry.NumPoints, previousNumPoints);
+
+                for (int i = 0; i < numDeltaComponents; i++)
+                {
+                    target.Points[i] = (short)(previousFrame.Points[i] + points[i]);
+                    target.Colors[i] = (byte)(previousFrame.Colors[i] + pointColors[i]);
+                }
+
+                for (int i = numDeltaComponents; i < numComponents; i++)
+                {
+                    target.Points[i] = points[i];
+                    target.Colors[i] = pointColors[i];
+                }
+            }
+
+            target.NumPoints = entry.NumPoints;
+        }
+
+        /// <summary>
+        /// Returns the version of a recording with a file header, or 0 for version 1 recordings
+        /// </summary>
+        private int ReadRecordingVersion()
+        {
+            Stream stream = binaryReader.BaseStream;
+
+            if (stream.Length < FileHeaderSize)
+                return 0;
+
+            stream.Seek(0, SeekOrigin.Begin);
+
+            if (!IsMagic(binaryReader.ReadBytes(RecordingMagic.Length)))
+                return 0;
+
+            ushort version = binaryReader.ReadUInt16();
+
+            return version >= MinRecordingVersion && version <= MaxRecordingVersion ? version : 0;
+        }
+
+        /// <summary>
+        /// Maps a version 2 or 3 recording in memory as it is now; the file is only read, so frames appended to a
+        /// recording which was not closed are not seen
+        /// </summary>
+        private unsafe void MapFile()
+        {
+            FileStream stream = (FileStream)binaryReader.BaseStream;
+            mappedLength = stream.Length;
+            mappedFile = MemoryMappedFile.CreateFromFile(stream, null, 0, MemoryMappedFileAccess.Read, HandleInheritability.None, true);
+            mappedView = mappedFile.CreateViewAccessor(0, mappedLength, MemoryMappedFileAccess.Read);
+
+            byte* viewData = null;
+            mappedView.SafeMemoryMappedViewHandle.AcquirePointer(ref viewData);
+            mappedData = viewData + mappedView.PointerOffset;
+        }
+
+        private unsafe void UnmapFile()
+        {
+            if (mappedView == null)
+                return;
+
+            mappedView.SafeMemoryMappedViewHandle.ReleasePointer();
+            mappedData = null;
+            mappedView.Dispose();
+            mappedFile.Dispose();
+        }
+
+        /// <summary>
+        /// Reads the index of a version 2 or 3 recording. A recording which was not closed has no index, so its frames
+        /// are listed from their headers, up to the last complete frame.
+        /// </summary>
+        private unsafe List<FrameIndexEntry> ReadFrameIndex()
+        {
+            List<FrameIndexEntry> entries = new List<FrameIndexEntry>();
+
+            if (mappedLength >= FileHeaderSize + FooterSize)
+            {
+                byte* footer = mappedData + mappedLength - FooterSize;
+                long indexOffset = (long)*(ulong*)footer;
+                int numFrames = (int)*(uint*)(footer + 8);
+
+                if (IsMagic(footer + 12) && indexOffset + (long)numFrames * IndexEntrySize == mappedLength - FooterSize)
+                {
+                    for (int i = 0; i < numFrames; i++)
+                    {
+                        byte* indexEntry = mappedData + indexOffset + (long)i * IndexEntrySize;
+
+                        FrameIndexEntry entry = new FrameIndexEntry();
+                        entry.Offset = (long)*(ulong*)indexEntry;
+                        entry.NumPoints = (int)*(uint*)(indexEntry + 8);
+                        entry.Timestamp = *(ulong*)(indexEntry + 12);
+                        entry.CameraID = *(int*)(indexEntry + 20);
+                        ReadFrameEncoding(ref entry);
+                        entries.Add(entry);
+                    }
+
+                    return entries;
+                }
+            }
+
+            long offset = FileHeaderSize;
+
+            while (offset + frameHeaderSize <= mappedLength)
+            {
+                byte* frameHeader = mappedData + offset;
+
+                FrameIndexEntry entry = new FrameIndexEntry();
+                entry.Offset = offset;
+                entry.NumPoints = (int)*(uint*)frameHeader;
+                entry.CameraID = *(int*)(frameHeader + 4);
+                entry.Timestamp = *(ulong*)(frameHeader + 8);
+                ReadFrameEncoding(ref entry);
+
+                offset += frameHeaderSize + (long)entry.DataSize;
+
+                if (offset > mappedLength)
+                    break;
+
+                entries.Add(entry);
+            }
+
+            return entries;
+        }
+
+        // Version 2 frames are never compressed; version 3 frames give the size and encoding of their data
+        private unsafe void ReadFrameEncoding(ref FrameIndexEntry entry)
+        {
+            if (frameHeaderSize == V2FrameHeaderSize)
+            {
+                entry.DataSize = BytesPerPoint * entry.NumPoints;
+                entry.Encoding = RawEncoding;
+                return;
+            }
+
+            byte* frameHeader = mappedData + entry.Offset;
+            entry.DataSize = (int)*(uint*)(frameHeader + 16);
+            entry.Encoding = frameHeader[20];
+        }
+
+        private static bool IsMagic(byte[] magic)
+        {
+            if (magic.Length != RecordingMagic.Length)
+                return false;
+
+            for (int i = 0; i < RecordingMagic.Length; i++)
+            {
+                if (magic[i] != RecordingMagic[i])
+                    return false;
+            }
+
+            return true;
+        }
+
+        private static unsafe bool IsMagic(byte* magic)
+        {
+            for (int i = 0; i < RecordingMagic.Length; i++)
+            {
+                if (magic[i] != RecordingMagic[i])
+                    return false;
+            }
+
+            return true;
         }
 
         private string ReadLine()
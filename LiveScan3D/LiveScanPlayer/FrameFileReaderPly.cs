@@ -7,11 +7,18 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module allows reading point cloud frames from .ply files and handles
-playback functions.
+playback functions. Each file is mapped in memory and its vertices are
+converted straight from the mapped file into the lists of the frame. The
+layout of the vertices is parsed from the header of the first file, and is
+reused for the following files whose header only differs by the number of
+vertices, as the frames of an exported session do. Binary files are read
+as they are laid out, with a tight loop for the float positions and byte
+colors the server exports, and ASCII files are parsed by a number parser
+working on the bytes of the file, without making strings.
 
-This code was adapted from the following research: 
-Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
-3D Data Acquisition System for Multiple Kinect v2 Sensors". in 3D Vision (3DV), 
+This code was adapted from the following research:
+Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
+3D Data Acquisition System for Multiple Kinect v2 Sensors". in 3D Vision (3DV),
 2015 International Conference on, Lyon, France, 2015
 
 \***************************************************************************/
@@ -20,13 +27,78 @@ using System;
 using System.Collections.Generic;
 using System.Text;
 using System.IO;
+using System.IO.MemoryMappedFiles;
 
 namespace LiveScanPlayer
 {
     class FrameFileReaderPly : IFrameFileReader
     {
+        private const int MaxHeaderSize = 65536;
+
+        // Properties of the vertices which make the points, in the order of the outputs
+        private static readonly string[] PointProperties = { "x", "y", "z", "red", "green", "blue" };
+        private const int NumPointProperties = 6;
+        private const int FirstColorProperty = 3;
+
+        private static readonly double[] PowersOf10 =
+        {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        private enum PlyFormat
+        {
+            Ascii,
+            BinaryLittleEndian,
+            BinaryBigEndian
+        }
+
+        private enum PlyType
+        {
+            Int8,
+            UInt8,
+            Int16,
+            UInt16,
+            Int32,
+            UInt32,
+            Float32,
+            Float64
+        }
+
+        /// <summary>
+        /// Layout of the vertices of a file, as given by its header
+        /// </summary>
+        private sealed class PlyLayout
+        {
+            public PlyFormat Format;
+            public int NumVertices;
+            public int HeaderSize;
+
+            // Binary files: bytes of the elements before the vertices, and bytes of each vertex. ASCII files: lines of
+            // the elements before the vertices
+            public long VertexOffset = 0;
+            public int VertexSize = 0;
+            public int NumLinesBefore = 0;
+
+            // Properties of each vertex, and for each point property its offset in the vertex in binary files or its
+            // index in the properties in ASCII files, or -1 when the vertices do not have it
+            public int NumProperties = 0;
+            public int[] PointOffsets = { -1, -1, -1, -1, -1, -1 };
+            public PlyType[] PointTypes = new PlyType[NumPointProperties];
+
+            // Float positions followed by byte colors, as the server exports them, which are read without conversions
+            public bool IsPacked;
+
+            // The header up to the number of vertices, and after it; the following files with the same bytes around their
+            // number of vertices reuse the layout
+            public byte[] HeaderPrefix;
+            public byte[] HeaderSuffix;
+        }
+
         private string[] filenames;
         private int currentFrameIdx = 0;
+        private PlyLayout layout = null;
+        private double[] asciiValues = new double[0];
 
         public int FrameIdx
         {
@@ -40,88 +112,517 @@ namespace LiveScanPlayer
             }
         }
 
+        // The PLY files hold no capture time, so they are played at the default frame interval of the player
+        public ulong FrameTimestampUs => 0;
+
         public FrameFileReaderPly(string[] filenames)
         {
             this.filenames = filenames;
         }
 
-        public void ReadFrame(List<float> vertices, List<byte> colors)
+        /// <summary>
+        /// Appends the points of the current file to the lists. The lists keep their capacity from frame to frame when
+        /// they are reused, so nothing is allocated for each frame but the mapping of the file. A truncated file is played
+        /// with its complete vertices.
+        /// </summary>
+        /// <exception cref="InvalidDataException">The file is not a PLY file, or its vertices have list properties</exception>
+        public unsafe void ReadFrame(List<float> vertices, List<byte> colors)
         {
-            // Open the current frame file for binary reading
-            using (BinaryReader reader = new BinaryReader(new FileStream(filenames[currentFrameIdx], FileMode.Open)))
+            using (FileStream stream = new FileStream(filenames[currentFrameIdx], FileMode.Open, FileAccess.Read, FileShare.Read))
             {
-                bool hasAlphaChannel = false;
-                string line = ReadLine(reader);
+                long length = stream.Length;
 
-                // Find the line indicating number of vertices
-                while (!line.Contains("element vertex"))
+                // An empty file cannot be mapped, and has no points
+                if (length > 0)
                 {
-                    line = ReadLine(reader);
+                    using (MemoryMappedFile mappedFile = MemoryMappedFile.CreateFromFile(stream, null, 0, MemoryMappedFileAccess.Read,
+                        HandleInheritability.None, true))
+                    using (MemoryMappedViewAccessor mappedView = mappedFile.CreateViewAccessor(0, length, MemoryMappedFileAccess.Read))
+                    {
+                        byte* viewData = null;
+                        mappedView.SafeMemoryMappedViewHandle.AcquirePointer(ref viewData);
+
+                        try
+                        {
+                            byte* data = viewData + mappedView.PointerOffset;
+
+                            if (!TryReuseLayout(data, length))
+                                layout = ParseHeader(data, length, filenames[currentFrameIdx]);
+
+                            if (layout.Format == PlyFormat.Ascii)
+                                ReadAsciiVertices(data + layout.HeaderSize, data + length, vertices, colors);
+                            else
+                                ReadBinaryVertices(data + layout.HeaderSize, length - layout.HeaderSize, vertices, colors);
+                        }
+                        finally
+                        {
+                            mappedView.SafeMemoryMappedViewHandle.ReleasePointer();
+                        }
+                    }
                 }
+            }
+
+            // Move to the next frame, looping if at the end
+            currentFrameIdx = (currentFrameIdx + 1) % filenames.Length;
+        }
+
+        public void JumpToFrame(int frameIdx)
+        {
+            currentFrameIdx = frameIdx;
+
+            if (currentFrameIdx >= filenames.Length)
+                currentFrameIdx = 0;
+        }
+
+        public void Rewind()
+        {
+            currentFrameIdx = 0;
+        }
+
+        /// <summary>
+        /// Takes the layout of the previous file when the header of this one only differs by its number of vertices
+        /// </summary>
+        private unsafe bool TryReuseLayout(byte* data, long length)
+        {
+            if (layout == null || length < layout.HeaderPrefix.Length + layout.HeaderSuffix.Length + 1)
+                return false;
+
+            for (int i = 0; i < layout.HeaderPrefix.Length; i++)
+            {
+                if (data[i] != layout.HeaderPrefix[i])
+                    return false;
+            }
 
-                // Parse number of vertices
-                string[] tokens = line.Split(' ');
-                int vertexCount = Int32.Parse(tokens[2]);
+            long position = layout.HeaderPrefix.Length;
+            long numVertices = 0;
 
-                // Continue parsing the header, checking for alpha channel
-                while (!line.Contains("end_header"))
+            while (position < length && data[position] >= '0' && data[position] <= '9' && numVertices <= int.MaxValue)
+                numVertices = 10 * numVertices + (data[position++] - '0');
+
+            if (position == layout.HeaderPrefix.Length || numVertices > int.MaxValue || length - position < layout.HeaderSuffix.Length)
+                return false;
+
+            for (int i = 0; i < layout.HeaderSuffix.Length; i++)
+            {
+                if (data[position + i] != layout.HeaderSuffix[i])
+                    return false;
+            }
+
+            layout.NumVertices = (int)numVertices;
+            layout.HeaderSize = (int)position + layout.HeaderSuffix.Length;
+            return true;
+        }
+
+        /// <summary>
+        /// Parses the header of a file into the layout of its vertices
+        /// </summary>
+        private static unsafe PlyLayout ParseHeader(byte* data, long length, string filename)
+        {
+            int searchLength = (int)Math.Min(length, MaxHeaderSize);
+            byte[] header = new byte[searchLength];
+
+            for (int i = 0; i < searchLength; i++)
+                header[i] = data[i];
+
+            PlyLayout newLayout = new PlyLayout();
+            string currentElement = null;
+            bool isBeforeVertices = true;
+            bool hasFormat = false;
+            int numElements = 0;
+            int elementSize = 0;
+            int countStart = -1;
+            int countEnd = -1;
+            int lineStart = 0;
+            int lineNumber = 0;
+
+            while (lineStart < searchLength)
+            {
+                int lineEnd = Array.IndexOf(header, (byte)'\n', lineStart);
+
+                if (lineEnd < 0)
+                    break;
+
+                string line = Encoding.ASCII.GetString(header, lineStart, lineEnd - lineStart).TrimEnd('\r');
+                string[] tokens = line.Split(new[] { ' ', '\t' }, StringSplitOptions.RemoveEmptyEntries);
+                int nextLineStart = lineEnd + 1;
+
+                if (lineNumber++ == 0)
                 {
-                    if (line.Contains("alpha"))
-                        hasAlphaChannel = true;
+                    if (line.Trim() != "ply")
+                        break;
+                }
+                else if (tokens.Length == 0 || tokens[0] == "comment" || tokens[0] == "obj_info")
+                {
+                    // The server writes an empty line after the format of its ASCII files
+                }
+                else if (tokens[0] == "format" && tokens.Length >= 2)
+                {
+                    hasFormat = true;
 
-                    line = ReadLine(reader);
+                    if (tokens[1] == "ascii")
+                        newLayout.Format = PlyFormat.Ascii;
+                    else if (tokens[1] == "binary_little_endian")
+                        newLayout.Format = PlyFormat.BinaryLittleEndian;
+                    else if (tokens[1] == "binary_big_endian")
+                        newLayout.Format = PlyFormat.BinaryBigEndian;
+                    else
+                        throw new InvalidDataException(filename + " has an unknown PLY format: " + tokens[1]);
                 }
+                else if (tokens[0] == "element" && tokens.Length >= 3)
+                {
+                    // The elements before the vertices are skipped, and those after them are not read
+                    if (currentElement != null && currentElement != "vertex" && isBeforeVertices)
+                    {
+                        newLayout.VertexOffset += (long)numElements * elementSize;
+                        newLayout.NumLinesBefore += numElements;
+                    }
+
+                    if (currentElement == "vertex" && isBeforeVertices)
+                    {
+                        newLayout.VertexSize = elementSize;
+                        isBeforeVertices = false;
+                    }
+
+                    currentElement = tokens[1];
+                    elementSize = 0;
 
-                // Read vertex and color data
-                for (int i = 0; i < vertexCount; i++)
+                    if (!int.TryParse(tokens[2], out numElements) || numElements < 0)
+                        throw new InvalidDataException(filename + " has an invalid PLY element: " + line);
+
+                    if (currentElement == "vertex" && isBeforeVertices)
+                    {
+                        newLayout.NumVertices = numElements;
+                        countStart = lineStart + line.IndexOf(tokens[2], line.IndexOf("vertex") + "vertex".Length);
+                        countEnd = countStart + tokens[2].Length;
+                    }
+                }
+                else if (tokens[0] == "property" && tokens.Length >= 3 && currentElement != null && isBeforeVertices)
                 {
-                    // Read 3 floats for the vertex position
-                    for (int j = 0; j < 3; j++)
+                    bool isVertexProperty = currentElement == "vertex";
+
+                    if (tokens[1] == "list")
                     {
-                        vertices.Add(reader.ReadSingle());
+                        // The ASCII elements before the vertices are skipped by lines, whatever their properties
+                        if (isVertexProperty || newLayout.Format != PlyFormat.Ascii)
+                            throw new InvalidDataException(filename + " has a PLY list property, which is not supported: " + line);
                     }
+                    else
+                    {
+                        PlyType type = ParseType(tokens[1], filename);
+
+                        if (isVertexProperty)
+                        {
+                            int pointProperty = Array.IndexOf(PointProperties, tokens[2]);
+
+                            if (pointProperty >= 0)
+                            {
+                                newLayout.PointOffsets[pointProperty] = newLayout.Format == PlyFormat.Ascii ? newLayout.NumProperties : elementSize;
+                                newLayout.PointTypes[pointProperty] = type;
+                            }
+
+                            newLayout.NumProperties++;
+                        }
 
-                    // Read 3 bytes for RGB color
-                    for (int j = 0; j < 3; j++)
+                        elementSize += GetTypeSize(type);
+                    }
+                }
+                else if (tokens[0] == "end_header")
+                {
+                    if (currentElement == "vertex" && isBeforeVertices)
+                        newLayout.VertexSize = elementSize;
+
+                    if (!hasFormat || countStart < 0)
+                        break;
+
+                    int headerSize = nextLineStart;
+                    newLayout.HeaderSize = headerSize;
+                    newLayout.HeaderPrefix = new byte[countStart];
+                    newLayout.HeaderSuffix = new byte[headerSize - countEnd];
+                    Array.Copy(header, 0, newLayout.HeaderPrefix, 0, countStart);
+                    Array.Copy(header, countEnd, newLayout.HeaderSuffix, 0, headerSize - countEnd);
+
+                    newLayout.IsPacked = newLayout.Format == PlyFormat.BinaryLittleEndian;
+
+                    for (int i = 0; i < NumPointProperties; i++)
                     {
-                        colors.Add(reader.ReadByte());
+                        int packedOffset = i < FirstColorProperty ? i * sizeof(float) : FirstColorProperty * sizeof(float) + i - FirstColorProperty;
+                        PlyType packedType = i < FirstColorProperty ? PlyType.Float32 : PlyType.UInt8;
+
+                        if (newLayout.PointOffsets[i] != packedOffset || newLayout.PointTypes[i] != packedType)
+                            newLayout.IsPacked = false;
                     }
 
-                    // Skip alpha byte if present
-                    if (hasAlphaChannel)
-                        reader.ReadByte();
+                    return newLayout;
                 }
+
+                lineStart = nextLineStart;
             }
 
-            // Move to the next frame, looping if at the end
-            currentFrameIdx = (currentFrameIdx + 1) % filenames.Length;
+            throw new InvalidDataException(filename + " is not a PLY file with vertices");
         }
 
-        public void JumpToFrame(int frameIdx)
+        /// <summary>
+        /// Converts the vertices of a binary file. The points of the layout the server exports are copied as they are,
+        /// and the others are converted property by property.
+        /// </summary>
+        private unsafe void ReadBinaryVertices(byte* body, long bodyLength, List<float> vertices, List<byte> colors)
         {
-            currentFrameIdx = frameIdx;
+            long availableSize = bodyLength - layout.VertexOffset;
+            int numVertices = layout.NumVertices;
 
-            if (currentFrameIdx >= filenames.Length)
-                currentFrameIdx = 0;
+            if (layout.VertexSize == 0 || availableSize <= 0)
+                return;
+
+            if ((long)numVertices * layout.VertexSize > availableSize)
+                numVertices = (int)(availableSize / layout.VertexSize);
+
+            Reserve(vertices, colors, numVertices);
+
+            byte* vertex = body + layout.VertexOffset;
+            int vertexSize = layout.VertexSize;
+
+            if (layout.IsPacked)
+            {
+                for (int i = 0; i < numVertices; i++, vertex += vertexSize)
+                {
+                    float* position = (float*)vertex;
+                    vertices.Add(position[0]);
+                    vertices.Add(position[1]);
+                    vertices.Add(position[2]);
+
+                    colors.Add(vertex[12]);
+                    colors.Add(vertex[13]);
+                    colors.Add(vertex[14]);
+                }
+
+                return;
+            }
+
+            bool isBigEndian = layout.Format == PlyFormat.BinaryBigEndian;
+
+            for (int i = 0; i < numVertices; i++, vertex += vertexSize)
+            {
+                for (int j = 0; j < NumPointProperties; j++)
+                {
+                    double value = layout.PointOffsets[j] >= 0 ? ReadBinaryValue(vertex + layout.PointOffsets[j], layout.PointTypes[j], isBigEndian) : 0.0;
+
+                    if (j < FirstColorProperty)
+                        vertices.Add((float)value);
+                    else
+                        colors.Add(ToColor(value, layout.PointOffsets[j] >= 0, layout.PointTypes[j]));
+                }
+            }
         }
 
-        public void Rewind()
+        /// <summary>
+        /// Parses the vertices of an ASCII file, whose numbers are separated by any white space
+        /// </summary>
+        private unsafe void ReadAsciiVertices(byte* body, byte* end, List<float> vertices, List<byte> colors)
         {
-            currentFrameIdx = 0;
+            byte* position = body;
+
+            // The lines of the elements before the vertices are skipped, but the empty ones
+            for (int i = 0; i < layout.NumLinesBefore && position < end; i++)
+            {
+                while (position < end && IsWhiteSpace(*position))
+                    position++;
+                while (position < end && *position != '\n')
+                    position++;
+            }
+
+            if (asciiValues.Length < layout.NumProperties)
+                asciiValues = new double[layout.NumProperties];
+
+            Reserve(vertices, colors, layout.NumVertices);
+
+            for (int i = 0; i < layout.NumVertices; i++)
+            {
+                // A vertex is only added once all its properties are parsed
+                for (int j = 0; j < layout.NumProperties; j++)
+                {
+                    while (position < end && IsWhiteSpace(*position))
+                        position++;
+
+                    byte* numberEnd = ParseNumber(position, end, out asciiValues[j]);
+
+                    if (numberEnd == position)
+                        return;
+
+                    position = numberEnd;
+                }
+
+                for (int j = 0; j < NumPointProperties; j++)
+                {
+                    double value = layout.PointOffsets[j] >= 0 ? asciiValues[layout.PointOffsets[j]] : 0.0;
+
+                    if (j < FirstColorProperty)
+                        vertices.Add((float)value);
+                    else
+                        colors.Add(ToColor(value, layout.PointOffsets[j] >= 0, layout.PointTypes[j]));
+                }
+            }
+        }
+
+        /// <summary>
+        /// Parses a decimal number, with an optional sign, fraction and exponent; the 18 first significant digits are
+        /// kept, as many as the mantissa holds
+        /// </summary>
+        /// <returns>The end of the number, or the start when there is no number there</returns>
+        private static unsafe byte* ParseNumber(byte* start, byte* end, out double value)
+        {
+            byte* position = start;
+            bool isNegative = false;
+            long mantissa = 0;
+            int numDigits = 0;
+            int numSignificantDigits = 0;
+            int exponent = 0;
+
+            value = 0.0;
+
+            if (position < end && (*position == '-' || *position == '+'))
+                isNegative = *position++ == '-';
+
+            for (; position < end && (uint)(*position - '0') <= 9; position++, numDigits++)
+            {
+                if (numSignificantDigits < 18)
+                {
+                    mantissa = 10 * mantissa + (*position - '0');
+                    numSignificantDigits += mantissa != 0 ? 1 : 0;
+                }
+                else
+                    exponent++;
+            }
+
+            if (position < end && *position == '.')
+            {
+                for (position++; position < end && (uint)(*position - '0') <= 9; position++, numDigits++)
+                {
+                    if (numSignificantDigits < 18)
+                    {
+                        mantissa = 10 * mantissa + (*position - '0');
+                        numSignificantDigits += mantissa != 0 ? 1 : 0;
+                        exponent--;
+                    }
+                }
+            }
+
+            if (numDigits == 0)
+                return start;
+
+            if (position < end && (*position == 'e' || *position == 'E'))
+            {
+                byte* exponentStart = position++;
+                bool isExponentNegative = false;
+                int explicitExponent = 0;
+
+                if (position < end && (*position == '-' || *position == '+'))
+                    isExponentNegative = *position++ == '-';
+
+                if (position < end && (uint)(*position - '0') <= 9)
+                {
+                    for (; position < end && (uint)(*position - '0') <= 9; position++)
+                    {
+                        if (explicitExponent < 10000)
+                            explicitExponent = 10 * explicitExponent + (*position - '0');
+                    }
+
+                    exponent += isExponentNegative ? -explicitExponent : explicitExponent;
+                }
+                else
+                    position = exponentStart;
+            }
+
+            // Dividing by the exact powers of ten rounds better than multiplying by their inverses
+            if (exponent >= 0)
+                value = exponent < PowersOf10.Length ? mantissa * PowersOf10[exponent] : mantissa * Math.Pow(10.0, exponent);
+            else
+                value = -exponent < PowersOf10.Length ? mantissa / PowersOf10[-exponent] : mantissa * Math.Pow(10.0, exponent);
+
+            if (isNegative)
+                value = -value;
+
+            return position;
         }
 
-        private string ReadLine(BinaryReader binaryReader)
+        private static unsafe double ReadBinaryValue(byte* data, PlyType type, bool isBigEndian)
         {
-            StringBuilder builder = new StringBuilder();
-            byte buffer = binaryReader.ReadByte();
+            byte* bytes = stackalloc byte[8];
+            int size = GetTypeSize(type);
+
+            for (int i = 0; i < size; i++)
+                bytes[i] = isBigEndian ? data[size - 1 - i] : data[i];
 
-            while (buffer != '\n')
+            switch (type)
             {
-                builder.Append((char)buffer);
-                buffer = binaryReader.ReadByte();
+                case PlyType.Int8: return *(sbyte*)bytes;
+                case PlyType.UInt8: return *bytes;
+                case PlyType.Int16: return *(short*)bytes;
+                case PlyType.UInt16: return *(ushort*)bytes;
+                case PlyType.Int32: return *(int*)bytes;
+                case PlyType.UInt32: return *(uint*)bytes;
+                case PlyType.Float32: return *(float*)bytes;
+                default: return *(double*)bytes;
             }
+        }
+
+        // The colors of floating point types are between 0 and 1; the vertices without colors are white
+        private static byte ToColor(double value, bool hasProperty, PlyType type)
+        {
+            if (!hasProperty)
+                return 255;
+
+            if (type == PlyType.Float32 || type == PlyType.Float64)
+                value = 255.0 * value + 0.5;
+
+            return (byte)Math.Min(Math.Max(value, 0.0), 255.0);
+        }
+
+        private static void Reserve(List<float> vertices, List<byte> colors, int numVertices)
+        {
+            if (vertices.Capacity < vertices.Count + 3 * numVertices)
+                vertices.Capacity = vertices.Count + 3 * numVertices;
+            if (colors.Capacity < colors.Count + 3 * numVertices)
+                colors.Capacity = colors.Count + 3 * numVertices;
+        }
 
-            return builder.ToString();
+        private static bool IsWhiteSpace(byte value)
+        {
+            return value == ' ' || value == '\t' || value == '\r' || value == '\n';
+        }
+
+        private static PlyType ParseType(string name, string filename)
+        {
+            switch (name)
+            {
+                case "char": case "int8": return PlyType.Int8;
+                case "uchar": case "uint8": return PlyType.UInt8;
+                case "short": case "int16": return PlyType.Int16;
+                case "ushort": case "uint16": return PlyType.UInt16;
+                case "int": case "int32": return PlyType.Int32;
+                case "uint": case "uint32": return PlyType.UInt32;
+                case "float": case "float32": return PlyType.Float32;
+                case "double": case "float64": return PlyType.Float64;
+                default: throw new InvalidDataException(filename + " has an unknown PLY property type: " + name);
+            }
+        }
+
+        private static int GetTypeSize(PlyType type)
+        {
+            switch (type)
+            {
+                case PlyType.Int8:
+                case PlyType.UInt8:
+                    return 1;
+                case PlyType.Int16:
+                case PlyType.UInt16:
+                    return 2;
+                case PlyType.Int32:
+                case PlyType.UInt32:
+                case PlyType.Float32:
+                    return 4;
+                default:
+                    return 8;
+            }
         }
     }
 }
@@ -0,0 +1,168 @@
+﻿/***************************************************************************\
+
+Module Name:  FramePrefetcher.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module reads the frames of the played files ahead of their playback, on
+a worker thread, so that a large frame or a slow disk does not stall the
+playback. The frames are read into a pool of reused buffers, as many ahead as
+requested; the playback waits when the next frame is not read yet, which is
+counted as an underrun. The frames read ahead are discarded when the files or
+their positions change.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.IO;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace LiveScanPlayer
+{
+    /// <summary>
+    /// Frame of all the played files, read ahead of its playback
+    /// </summary>
+    class PlayerFrame
+    {
+        public List<float> Vertices = new List<float>();
+        public List<byte> Colors = new List<byte>();
+        public int[] FrameIndices = new int[0]; // Position of each file once the frame was read, as shown by the UI
+        public ulong TimestampUs = 0; // Capture time of the frame in the first file which records it; 0 if none does
+        public int Generation = 0;
+    }
+
+    class FramePrefetcher
+    {
+        private readonly IList<IFrameFileReader> frameFiles; // Locked while they are read
+        private readonly BlockingCollection<PlayerFrame> readyFrames = new BlockingCollection<PlayerFrame>();
+        private readonly BlockingCollection<PlayerFrame> freeFrames = new BlockingCollection<PlayerFrame>();
+        private readonly CancellationTokenSource cancellation = new CancellationTokenSource();
+        private readonly Task readTask;
+        private int generation = 0;
+        private Exception readError = null;
+
+        /// <summary>
+        /// Playback waits for a frame which was not read yet
+        /// </summary>
+        public int NumUnderruns { get; private set; } = 0;
+
+        /// <param name="frameFiles">Files to read the frames from, locked whenever they are changed</param>
+        /// <param name="readAhead">Number of frames read ahead of the one played</param>
+        public FramePrefetcher(IList<IFrameFileReader> frameFiles, int readAhead)
+        {
+            this.frameFiles = frameFiles;
+
+            // One more frame than those read ahead is held by the playback
+            for (int i = 0; i < Math.Max(1, readAhead) + 1; i++)
+                freeFrames.Add(new PlayerFrame());
+
+            readTask = Task.Factory.StartNew(ReadLoop, TaskCreationOptions.LongRunning);
+        }
+
+        /// <summary>
+        /// Discards the frames read ahead. Call it with the files locked, once they or their positions are changed.
+        /// </summary>
+        public void Invalidate()
+        {
+            Interlocked.Increment(ref generation);
+        }
+
+        /// <summary>
+        /// Takes the next frame, waiting for it to be read if it is not yet. Release the frame once it is played.
+        /// </summary>
+        /// <exception cref="IOException">The files could not be read</exception>
+        public PlayerFrame Take()
+        {
+            bool isUnderrun = false;
+
+            while (true)
+            {
+                PlayerFrame frame;
+
+                if (!readyFrames.TryTake(out frame))
+                {
+                    isUnderrun = true;
+
+                    // The read task completes the frames when it fails
+                    if (!readyFrames.TryTake(out frame, Timeout.Infinite))
+                        throw new IOException("Failed to read the played frames: " + readError.Message, readError);
+                }
+
+                if (frame.Generation == Volatile.Read(ref generation))
+                {
+                    if (isUnderrun)
+                        NumUnderruns++;
+
+                    return frame;
+                }
+
+                Release(frame);
+            }
+        }
+
+        public void Release(PlayerFrame frame)
+        {
+            freeFrames.Add(frame);
+        }
+
+        /// <summary>
+        /// Stops reading ahead, once the frame being read is done
+        /// </summary>
+        public void Stop()
+        {
+            cancellation.Cancel();
+            readTask.Wait();
+        }
+
+        private void ReadLoop()
+        {
+            try
+            {
+                while (true)
+                {
+                    PlayerFrame frame = freeFrames.Take(cancellation.Token);
+
+                    // The readers append the points of each file
+                    frame.Vertices.Clear();
+                    frame.Colors.Clear();
+
+                    lock (frameFiles)
+                    {
+                        frame.Generation = generation;
+
+                        frame.TimestampUs = 0;
+
+                        for (int i = 0; i < frameFiles.Count; i++)
+                        {
+                            frameFiles[i].ReadFrame(frame.Vertices, frame.Colors);
+
+                            if (frame.TimestampUs == 0)
+                                frame.TimestampUs = frameFiles[i].FrameTimestampUs;
+                        }
+
+                        if (frame.FrameIndices.Length != frameFiles.Count)
+                            frame.FrameIndices = new int[frameFiles.Count];
+
+                        for (int i = 0; i < frameFiles.Count; i++)
+                            frame.FrameIndices[i] = frameFiles[i].FrameIdx;
+                    }
+
+                    readyFrames.Add(frame);
+                }
+            }
+            catch (OperationCanceledException)
+            {
+            }
+            catch (Exception e)
+            {
+                readError = e;
+                readyFrames.CompleteAdding();
+            }
+        }
+    }
+}
@@ -36,6 +36,14 @@ namespace LiveScanPlayer
         /// <param name="colors">List to store the RGB color bytes for each vertex</param>
         void ReadFrame(List<float> vertices, List<byte> colors);
 
+        /// <summary>
+        /// Time the frame last read was captured at, in microseconds; 0 when the file does not record it
+        /// </summary>
+        ulong FrameTimestampUs
+        {
+            get;
+        }
+
         void JumpToFrame(int frameIdx);
 
         void Rewind();
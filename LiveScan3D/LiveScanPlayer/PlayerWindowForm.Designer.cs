@@ -38,6 +38,10 @@
             this.lFrameFilesListView = new System.Windows.Forms.ListView();
             this.chSaveFrames = new System.Windows.Forms.CheckBox();
             this.btnSelectPly = new System.Windows.Forms.Button();
+            this.lReadAhead = new System.Windows.Forms.Label();
+            this.nReadAhead = new System.Windows.Forms.NumericUpDown();
+            this.lUnderruns = new System.Windows.Forms.Label();
+            ((System.ComponentModel.ISupportInitialize)(this.nReadAhead)).BeginInit();
             this.SuspendLayout();
             // 
             // btSelect
@@ -131,11 +135,54 @@
             this.btnSelectPly.UseVisualStyleBackColor = true;
             this.btnSelectPly.Click += new System.EventHandler(this.btnSelectPly_Click);
             // 
+            // lReadAhead
+            // 
+            this.lReadAhead.AutoSize = true;
+            this.lReadAhead.Location = new System.Drawing.Point(107, 160);
+            this.lReadAhead.Name = "lReadAhead";
+            this.lReadAhead.Size = new System.Drawing.Size(58, 13);
+            this.lReadAhead.TabIndex = 10;
+            this.lReadAhead.Text = "read-ahead";
+            // 
+            // nReadAhead
+            // 
+            this.nReadAhead.Location = new System.Drawing.Point(171, 157);
+            this.nReadAhead.Maximum = new decimal(new int[] {
+            64,
+            0,
+            0,
+            0});
+            this.nReadAhead.Minimum = new decimal(new int[] {
+            1,
+            0,
+            0,
+            0});
+            this.nReadAhead.Name = "nReadAhead";
+            this.nReadAhead.Size = new System.Drawing.Size(45, 20);
+            this.nReadAhead.TabIndex = 11;
+            this.nReadAhead.Value = new decimal(new int[] {
+            4,
+            0,
+            0,
+            0});
+            // 
+            // lUnderruns
+            // 
+            this.lUnderruns.AutoSize = true;
+            this.lUnderruns.Location = new System.Drawing.Point(222, 160);
+            this.lUnderruns.Name = "lUnderruns";
+            this.lUnderruns.Size = new System.Drawing.Size(66, 13);
+            this.lUnderruns.TabIndex = 12;
+            this.lUnderruns.Text = "underruns: 0";
+            // 
             // PlayerWindowForm
             // 
             this.AutoScaleDimensions = new System.Drawing.SizeF(6F, 13F);
             this.AutoScaleMode = System.Windows.Forms.AutoScaleMode.Font;
             this.ClientSize = new System.Drawing.Size(527, 190);
+            this.Controls.Add(this.lUnderruns);
+            this.Controls.Add(this.nReadAhead);
+            this.Controls.Add(this.lReadAhead);
             this.Controls.Add(this.btnSelectPly);
             this.Controls.Add(this.chSaveFrames);
             this.Controls.Add(this.lFrameFilesListView);
@@ -147,6 +194,7 @@
             this.Name = "PlayerWindowForm";
             this.Text = "LiveScanPlayer";
             this.FormClosing += new System.Windows.Forms.FormClosingEventHandler(this.CloseForm);
+            ((System.ComponentModel.ISupportInitialize)(this.nReadAhead)).EndInit();
             this.ResumeLayout(false);
             this.PerformLayout();
 
@@ -164,6 +212,9 @@
         private System.Windows.Forms.ListView lFrameFilesListView;
         private System.Windows.Forms.CheckBox chSaveFrames;
         private System.Windows.Forms.Button btnSelectPly;
+        private System.Windows.Forms.Label lReadAhead;
+        private System.Windows.Forms.NumericUpDown nReadAhead;
+        private System.Windows.Forms.Label lUnderruns;
     }
 }
 
@@ -8,6 +8,9 @@ Copyright (c) Canadian Space Agency.
 <Description>
 This module is the logic behind the main UI form of the application. It
 allows selecting files for playback and controlling the playback itself.
+The played frames are published to a frame store like the merged frames of
+the server, so that the transfer server streams them to the receivers, with
+the transfer settings saved by the server, at the rate they were recorded at.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -31,19 +34,32 @@ namespace LiveScanPlayer
     {
         private bool isPlayerRunning = false;
 
+        // Interval between two frames of the files which do not record when their frames were captured, and the longest
+        // interval kept from the recordings, beyond which the recording was paused or looped
+        private const int DefaultFrameIntervalMs = 50;
+        private const int MaxFrameIntervalMs = 1000;
+
         private BindingList<IFrameFileReader> frameFiles = new BindingList<IFrameFileReader>();
-        private List<float> vertices = new List<float>();
+        private List<float> vertices = new List<float>(); // Points of the frame played, which are saved on request
         private List<byte> colors = new List<byte>();
 
+        // The played frames are published as the frames of a single camera without a pose
+        private MergedFrameStore frameStore = new MergedFrameStore();
+        private List<FrameBuffer<float>> playedVertices = new List<FrameBuffer<float>> { new FrameBuffer<float>() };
+        private List<FrameBuffer<byte>> playedColors = new List<FrameBuffer<byte>> { new FrameBuffer<byte>() };
+        private List<ulong> playedFrameVersions = new List<ulong> { 0 };
+        private List<AffineTransform> cameraPoses = new List<AffineTransform>();
+
         private TransferServer transferServer = new TransferServer();
         private AutoResetEvent onPlayFramesFinished = new AutoResetEvent(false);
+        private FramePrefetcher prefetcher = null; // Reads the frames ahead while the player runs
 
         public PlayerWindowForm()
         {
             InitializeComponent();
            
-            transferServer.Vertices = vertices;
-            transferServer.Colors = colors;
+            transferServer.FrameStore = frameStore;
+            transferServer.Settings = CameraSettings.Load(CameraSettings.DefaultPath);
 
             lFrameFilesListView.Columns.Add("Current frame", 75);
             lFrameFilesListView.Columns.Add("Filename", 300);
@@ -59,11 +75,31 @@ namespace LiveScanPlayer
             {
                 for (int i = 0; i < dialog.FileNames.Length; i++)
                 {
-                    frameFiles.Add(new FrameFileReaderBin(dialog.FileNames[i]));
+                    List<FrameFileReaderBin> readers;
+
+                    try
+                    {
+                        readers = FrameFileReaderBin.OpenCameras(dialog.FileNames[i]);
+                    }
+                    catch (IOException ex)
+                    {
+                        MessageBox.Show(ex.Message, "LiveScanPlayer", MessageBoxButtons.OK, MessageBoxIcon.Error);
+                        continue;
+                    }
+
+                    // The cameras of an interleaved recording get a row each
+                    foreach (FrameFileReaderBin reader in readers)
+                    {
+                        frameFiles.Add(reader);
 
-                    var item = new ListViewItem(new[] { "0", dialog.FileNames[i] });
-                    lFrameFilesListView.Items.Add(item);
+                        string name = reader.CameraID == FrameFileReaderBin.AllCameras ? dialog.FileNames[i]
+                            : dialog.FileNames[i] + " (camera " + reader.CameraID + ")";
+                        var item = new ListViewItem(new[] { "0", name });
+                        lFrameFilesListView.Items.Add(item);
+                    }
                 }
+
+                prefetcher?.Invalidate();
             }
         }
 
@@ -82,6 +118,7 @@ namespace LiveScanPlayer
 
                 var item = new ListViewItem(new[] { "0", Path.GetDirectoryName(dialog.FileNames[0]) });
                 lFrameFilesListView.Items.Add(item);
+                prefetcher?.Invalidate();
             }
         }
 
@@ -93,6 +130,8 @@ namespace LiveScanPlayer
             {
                 transferServer.StartPointCloudServer();
                 transferServer.StartDocumentServer();
+                prefetcher = new FramePrefetcher(frameFiles, (int)nReadAhead.Value);
+                lUnderruns.Text = "underruns: 0";
                 updateWorker.RunWorkerAsync();
                 btStart.Text = "Stop player";
             }
@@ -102,6 +141,7 @@ namespace LiveScanPlayer
                 transferServer.StopDocumentServer();
                 btStart.Text = "Start player";
                 onPlayFramesFinished.WaitOne();
+                prefetcher = null;
             }
         }
 
@@ -115,6 +155,7 @@ namespace LiveScanPlayer
                 int idx = lFrameFilesListView.SelectedIndices[0];
                 lFrameFilesListView.Items.RemoveAt(idx);
                 frameFiles.RemoveAt(idx);
+                prefetcher?.Invalidate();
             }
         }
 
@@ -127,6 +168,8 @@ namespace LiveScanPlayer
                     frameFiles[i].Rewind();
                     lFrameFilesListView.Items[i].Text = "0";
                 }
+
+                prefetcher?.Invalidate();
             }
         }
 
@@ -156,6 +199,7 @@ namespace LiveScanPlayer
             lock (frameFiles)
             {
                 frameFiles[fileIdx].JumpToFrame(frameIdx);
+                prefetcher?.Invalidate();
             }
 
         }
@@ -173,69 +217,110 @@ namespace LiveScanPlayer
             string outDir = "outPlayer\\";
             DirectoryInfo di = Directory.CreateDirectory(outDir);
 
-            while (isPlayerRunning)
+            Stopwatch clock = Stopwatch.StartNew();
+            double nextFrameTimeMs = 0.0;
+            ulong lastTimestampUs = 0;
+
+            // The prefetcher is stopped even if reading fails, so that stopping the player does not wait forever
+            try
             {
-                Thread.Sleep(50);
+                while (isPlayerRunning)
+                {
+                    // Take the next frame, read ahead by the prefetcher; it is waited for if it could not be read in time
+                    PlayerFrame frame = prefetcher.Take();
 
-                // Read frame into local variables
-                List<float> tempVertices = new List<float>();
-                List<byte> tempColors = new List<byte>();
+                    // The frames are spaced out like their capture times, and like before with the files without them;
+                    // a frame played late does not make the next ones catch up, which would burst them to the receivers
+                    nextFrameTimeMs += GetFrameIntervalMs(lastTimestampUs, frame.TimestampUs);
+                    lastTimestampUs = frame.TimestampUs;
+                    double waitMs = nextFrameTimeMs - clock.Elapsed.TotalMilliseconds;
 
-                lock (frameFiles)
-                {
-                    for (int i = 0; i < frameFiles.Count; i++)
-                    {
-                        List<float> vertices = new List<float>();
-                        List<byte> colors = new List<byte>();
-                        frameFiles[i].ReadFrame(vertices, colors);
+                    if (waitMs > 0.0)
+                        Thread.Sleep((int)Math.Ceiling(waitMs));
+                    else
+                        nextFrameTimeMs = clock.Elapsed.TotalMilliseconds;
+
+                    int[] frameIndices = (int[])frame.FrameIndices.Clone();
+                    int numUnderruns = prefetcher.NumUnderruns;
+
+                    // Update frame indices in the UI
+                    Thread frameIdxUpdate = new Thread(() => this.Invoke((MethodInvoker)delegate { this.UpdateDisplayedFrameIndices(frameIndices, numUnderruns); }));
+                    frameIdxUpdate.Start();
 
-                        tempVertices.AddRange(vertices);                        
-                        tempColors.AddRange(colors);
+                    // Add the read frame to the global variables
+                    lock (vertices)
+                    {
+                        vertices.Clear();
+                        colors.Clear();
+                        vertices.AddRange(frame.Vertices);
+                        colors.AddRange(frame.Colors);
                     }
-                }
 
-                // Update frame indices in the UI
-                Thread frameIdxUpdate = new Thread(() => this.Invoke((MethodInvoker)delegate { this.UpdateDisplayedFrameIndices(); }));
-                frameIdxUpdate.Start();
+                    PublishFrame(frame);
+                    prefetcher.Release(frame);
 
-                // Add the read frame to the global variables
-                lock (vertices)
-                {
-                    vertices.Clear();
-                    colors.Clear();
-                    vertices.AddRange(tempVertices);
-                    colors.AddRange(tempColors);
-                }
+                    // Save the frame if requested
+                    if (chSaveFrames.Checked)
+                        SaveCurrentFrameToFile(outDir, curFrameIdx);
 
-                // Save the frame if requested
-                if (chSaveFrames.Checked)
-                    SaveCurrentFrameToFile(outDir, curFrameIdx);
-                
-                curFrameIdx++;
+                    curFrameIdx++;
+                }
             }
+            finally
+            {
+                prefetcher.Stop();
+                onPlayFramesFinished.Set();
+            }
+        }
+
+        /// <summary>
+        /// Interval between a played frame and the next one, from their capture times when the files record them
+        /// </summary>
+        private static double GetFrameIntervalMs(ulong timestampUs, ulong nextTimestampUs)
+        {
+            if (timestampUs == 0 || nextTimestampUs <= timestampUs || nextTimestampUs - timestampUs > MaxFrameIntervalMs * 1000UL)
+                return DefaultFrameIntervalMs;
 
-            onPlayFramesFinished.Set();
+            return (nextTimestampUs - timestampUs) / 1000.0;
+        }
+
+        /// <summary>
+        /// Publishes a played frame to the frame store, and has the transfer server encode it for the receivers
+        /// </summary>
+        private void PublishFrame(PlayerFrame frame)
+        {
+            playedVertices[0].Resize(frame.Vertices.Count);
+            frame.Vertices.CopyTo(0, playedVertices[0].Items, 0, frame.Vertices.Count);
+            playedColors[0].Resize(frame.Colors.Count);
+            frame.Colors.CopyTo(0, playedColors[0].Items, 0, frame.Colors.Count);
+            playedFrameVersions[0]++;
+
+            frameStore.Publish(playedVertices, playedColors, playedFrameVersions, cameraPoses);
+            transferServer.NotifyFrameUpdated();
         }
 
         private void OpenLiveViewWindowd(object sender, DoWorkEventArgs e)
         {
             OpenGLWindow openGLWindow = new OpenGLWindow();
 
-            openGLWindow.Vertices = vertices;
-            openGLWindow.Colors = colors;
+            openGLWindow.FrameStore = frameStore;
+            openGLWindow.Settings = transferServer.Settings;
 
             openGLWindow.Run();
         }
 
-        private void UpdateDisplayedFrameIndices()
+        /// <summary>
+        /// Shows the position of each file once the played frame was read, which the files are ahead of
+        /// </summary>
+        private void UpdateDisplayedFrameIndices(int[] frameIndices, int numUnderruns)
         {
-            lock (frameFiles)
+            // Files removed since the frame was read are no longer listed
+            for (int i = 0; i < Math.Min(frameIndices.Length, lFrameFilesListView.Items.Count); i++)
             {
-                for (int i = 0; i < frameFiles.Count; i++)
-                {
-                    lFrameFilesListView.Items[i].SubItems[0].Text = frameFiles[i].FrameIdx.ToString();
-                }
+                lFrameFilesListView.Items[i].SubItems[0].Text = frameIndices[i].ToString();
             }
+
+            lUnderruns.Text = "underruns: " + numUnderruns.ToString();
         }
 
         private void SaveCurrentFrameToFile(string outDir, int frameIdx)
@@ -0,0 +1,144 @@
+﻿/***************************************************************************\
+
+Module Name:  CalibrationMonitor.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module checks the calibration of the cameras in the background while
+they stream, so that a camera which was moved is noticed without having to
+look at the holograms. At a regular interval, a low priority thread runs a
+cheap projective alignment of subsampled depth frames of the cameras, and
+publishes how far the pose of each camera is from its alignment with the
+others. Small drifts can also be corrected, by sending the corrected
+calibration to the clients; larger ones need a new calibration.
+
+\***************************************************************************/
+
+using System;
+using System.Linq;
+using System.Threading;
+
+namespace LiveScanServer
+{
+    /// <summary>
+    /// Correction the pose of a camera needs to be aligned with the others
+    /// </summary>
+    public struct CameraDrift
+    {
+        // Drifts below these are the noise of the alignment and are neither reported nor corrected
+        private const float MinTranslationMm = 1.0f;
+        private const float MinRotationDegrees = 0.1f;
+
+        public float TranslationMm;
+        public float RotationDegrees;
+
+        public bool IsSignificant => TranslationMm >= MinTranslationMm || RotationDegrees >= MinRotationDegrees;
+    }
+
+    public sealed class CalibrationMonitor
+    {
+        // The check matches fewer pixels and runs fewer iterations than a refinement, since drifts are small and it runs
+        // all the time
+        private const int SampleStep = 8;
+        private const int MaxIterations = 5;
+
+        private readonly CameraServer cameraServer;
+        private readonly CameraSettings settings;
+        private readonly ProjectiveRefiner refiner = new ProjectiveRefiner();
+        private readonly ManualResetEvent stopEvent = new ManualResetEvent(false);
+        private Thread monitorThread;
+
+        /// <summary>
+        /// Drift of each camera at the last check, in the order of the clients
+        /// </summary>
+        public CameraDrift[] LatestDrift { get; private set; } = new CameraDrift[0];
+
+        /// <summary>
+        /// Raised on the monitor thread after each check, with the drift of each camera and whether it was corrected
+        /// </summary>
+        public event Action<CameraDrift[], bool> DriftMeasured;
+
+        public CalibrationMonitor(CameraServer cameraServer, CameraSettings settings)
+        {
+            this.cameraServer = cameraServer;
+            this.settings = settings;
+        }
+
+        public void Start()
+        {
+            stopEvent.Reset();
+
+            monitorThread = new Thread(MonitorLoop);
+            monitorThread.Name = "Calibration monitor";
+            monitorThread.IsBackground = true;
+            monitorThread.Priority = ThreadPriority.BelowNormal;
+            monitorThread.Start();
+        }
+
+        /// <summary>
+        /// Stops the monitor, once the check in progress is done
+        /// </summary>
+        public void Stop()
+        {
+            stopEvent.Set();
+            monitorThread?.Join();
+            monitorThread = null;
+        }
+
+        private void MonitorLoop()
+        {
+            while (!stopEvent.WaitOne(Math.Max(1, settings.CalibrationMonitorInterval) * 1000))
+            {
+                if (!settings.IsCalibrationMonitorEnabled || cameraServer.ClientCount < 2 || !cameraServer.AllCamerasCalibrated)
+                    continue;
+
+                // A failed check is retried at the next interval, so the monitor never stops on its own
+                try
+                {
+                    CheckCalibration();
+                }
+                catch (Exception e)
+                {
+                    Logger.Log("Calibration check failed: " + e.Message);
+                }
+            }
+        }
+
+        private void CheckCalibration()
+        {
+            PoseCorrections corrections = refiner.Refine(cameraServer, MaxIterations, SampleStep, settings.ProjectiveMaxDistance);
+
+            if (corrections == null)
+                return;
+
+            CameraDrift[] drift = new CameraDrift[corrections.Rs.Count];
+
+            for (int i = 0; i < drift.Length; i++)
+            {
+                drift[i].TranslationMm = corrections.GetTranslationLength(i) * 1000.0f;
+                drift[i].RotationDegrees = corrections.GetRotationAngle(i);
+            }
+
+            LatestDrift = drift;
+
+            // Only small drifts are corrected: a large one is more likely a camera which was moved a lot, or a wrong
+            // alignment, than something the alignment of subsampled frames should fix on its own
+            bool hasDrift = drift.Any(d => d.IsSignificant);
+            bool isCorrected = settings.IsDriftCorrectionEnabled && hasDrift
+                && drift.All(d => d.TranslationMm <= settings.MaxDriftCorrectionMm && d.RotationDegrees <= settings.MaxDriftCorrectionDegrees);
+
+            if (isCorrected)
+                cameraServer.ApplyPoseCorrections(corrections.Rs, corrections.Ts);
+
+            if (hasDrift)
+            {
+                Logger.Log("Calibration drift: " + string.Join(", ", drift.Select((d, i) => $"camera {i} {d.TranslationMm:F1} mm {d.RotationDegrees:F2} deg"))
+                    + (isCorrected ? ", corrected" : "") + $", mean error {corrections.Error * 1000.0f:F1} mm");
+            }
+
+            DriftMeasured?.Invoke(drift, isCorrected);
+        }
+    }
+}
@@ -19,7 +19,10 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 
 using System;
 using System.Collections.Generic;
+using System.Linq;
 using System.Runtime.InteropServices;
+using System.Text;
+using System.Threading;
 
 namespace LiveScanServer
 {
@@ -27,9 +30,24 @@ namespace LiveScanServer
     {
         #region Server to client (outbound) call imports
 
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void PrepareClients(int count);
+
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
         private static extern IntPtr CreateClient(int index);
 
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern IntPtr CreateReplayClient(int index, [MarshalAs(UnmanagedType.LPStr)] string path, [MarshalAs(UnmanagedType.I1)] bool isRealTime);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern IntPtr CreateRemoteClient(int index, [MarshalAs(UnmanagedType.LPStr)] string host, int port, int remoteIndex);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern IntPtr CreateWorkerClient(int index);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern int QueryCaptureNode([MarshalAs(UnmanagedType.LPStr)] string host, int port, int timeoutMs);
+
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
         private static extern void StartClient(IntPtr handle);
 
@@ -46,80 +64,99 @@ namespace LiveScanServer
         private static extern void Calibrate(IntPtr handle);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void SetSettings(IntPtr handle, ref NativeCameraSettings settings);
+        [return: MarshalAs(UnmanagedType.I1)]
+        private static extern bool GetCalibrationProgress(IntPtr handle, out int numSamples, out int numRequiredSamples);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void RequestRecordedFrame(IntPtr handle);
+        private static extern int GetPerfStats(IntPtr handle, [Out] PerfStageStats[] stats, int maxStages, [MarshalAs(UnmanagedType.I1)] bool isReset);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void RequestLatestFrame(IntPtr handle);
+        [return: MarshalAs(UnmanagedType.I1)]
+        private static extern bool GetMemoryStats(IntPtr handle, out ClientMemoryStats stats);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void ReceiveCalibration(IntPtr handle, ref NativeAffineTransform calibration);
+        [return: MarshalAs(UnmanagedType.I1)]
+        private static extern bool GetFunnelStats(IntPtr handle, out FrameFunnelStats stats);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void ClearRecordedFrames(IntPtr handle);
+        private static extern void SetDocumentFrameInterval(IntPtr handle, int intervalMs);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void EnableSync(IntPtr handle, int syncState, int syncOffset);
+        private static extern void SetMaxDocumentSize(IntPtr handle, int width, int height);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void DisableSync(IntPtr handle);
+        private static extern void SetSettings(IntPtr handle, ref NativeCameraSettings settings);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void StartMaster(IntPtr handle);
+        private static extern void SetExposure(IntPtr handle, [MarshalAs(UnmanagedType.I1)] bool isAutoExposureEnabled, int exposureStep);
 
-        #endregion
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern int RequestRecordedFrames(IntPtr handle, int maxFrames);
 
-        #region Client to server (inbound) call imports
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void SetSendSerialNumberCallback(IntPtr handle, SendSerialNumberCallback cb);
+        private static extern unsafe IntPtr AcquireLatestFrame(IntPtr handle, out Point3s* vertices, out RGB* colors, out int count, out ulong sequenceNumber, out ulong timeStampUs);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void SetConfirmRecordedCallback(IntPtr handle, ConfirmRecordedCallback cb);
+        private static extern void GetFrameAges(IntPtr frame, out ulong acquireAgeUs, out ulong publishAgeUs);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void SetConfirmCalibratedCallback(IntPtr handle, ConfirmCalibratedCallback cb);
+        private static extern unsafe int GetFrameNormals(IntPtr frame, out byte* normals);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void SetSendLatestFrameCallback(IntPtr handle, SendLatestFrameCallback callback);
+        [return: MarshalAs(UnmanagedType.I1)]
+        private static extern bool WaitForFrame(IntPtr handle, ulong lastSequenceNumber, int timeoutMs);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void SetSendRecordedFrameCallback(IntPtr handle, SendRecordedFrameCallback callback);
+        private static extern void ReleaseFrame(IntPtr frame);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void SetConfirmSyncStateCallback(IntPtr handle, ConfirmSyncStateCallback callback);
+        private static extern unsafe void ConvertFramePoints(Point3s* vertices, RGB* colors, int count, float* outVertices, byte* outColors);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void SetConfirmMasterRestartCallback(IntPtr handle, ConfirmMasterRestartCallback callback);
+        [return: MarshalAs(UnmanagedType.I1)]
+        private static extern bool AcquireDepthFrame(IntPtr handle, ushort[] depth, int maxPixels, out int width, out int height, float[] intrinsics,
+            float[] depthToWorld, int timeoutMs);
 
         [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern void SetSendDocumentCallback(IntPtr handle, SendDocumentCallback callback);
+        private static extern void ReceiveCalibration(IntPtr handle, ref NativeAffineTransform calibration);
 
-        // Callback definitions
-        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
-        public delegate void SendSerialNumberCallback(int clientIndex, [MarshalAs(UnmanagedType.LPStr)] string serialNumber);
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void ReceiveCameraPoses(IntPtr handle, NativeAffineTransform[] poses, int numCameras, int cameraIndex);
 
-        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
-        public delegate void ConfirmRecordedCallback(int clientIndex);
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void ClearRecordedFrames(IntPtr handle);
 
-        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
-        public unsafe delegate void ConfirmCalibratedCallback(int clientIndex, int markerId, float* R, float* t);
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void SaveFrameRing(IntPtr handle, int seconds);
 
-        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
-        public unsafe delegate void SendLatestFrameCallback(int clientIndex, Point3s* vertices, RGB* colors, int count);
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void LearnExclusionMask(IntPtr handle, int numFrames);
 
-        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
-        public unsafe delegate void SendRecordedFrameCallback(int clientIndex, Point3s* vertices, RGB* colors, int count, byte noMoreFrames);
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void EnableSync(IntPtr handle, int syncState, int syncOffset, int numSyncedDevices);
 
-        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
-        public delegate void ConfirmSyncStateCallback(int clientIndex, int syncState);
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void DisableSync(IntPtr handle);
 
-        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
-        public delegate void ConfirmMasterRestartCallback(int clientIndex);
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void StartMaster(IntPtr handle);
 
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern int CopyDocument(IntPtr handle, byte[] jpeg, int maxJpegSize, out float score, out short width, out short height,
+            byte[] signature, int maxSignatureSize);
+
+        #endregion
+
+        #region Client to server (inbound) call imports
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern int WaitForClientEvents([Out] ClientEvent[] events, int maxEvents, int timeoutMs);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void SetSendRecordedFrameCallback(IntPtr handle, SendRecordedFrameCallback callback);
+
+        // Callback definitions
         [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
-        public unsafe delegate void SendDocumentCallback(int clientIndex, byte* data, float score, short width, short height);
+        public unsafe delegate void SendRecordedFrameCallback(int clientIndex, Point3s* vertices, RGB* colors, int count, byte noMoreFrames);
 
         [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
         public delegate void SendDeviceSyncStateCallback(int clientIndex, int syncState);
@@ -129,13 +166,20 @@ namespace LiveScanServer
         public bool IsFrameRecorded = false;
         public bool IsCalibrated = false;
         public bool IsLatestFrameReceived = false;
-        public bool IsRecordedFrameReceived = false;
-        public bool NoMoreRecordedFrames = true;
         public bool IsStarted = false;
 
         public string SerialNumber = "XXXXXXXXXXX";
         public string ClientState;
 
+        // Timings of the stages of the frame loop since the previous update, shown after the state of the client
+        public PerfStageStats[] PerfStats = new PerfStageStats[NumPerfStages];
+        public string PerfSummary = "";
+        private const int NumPerfStages = 8;
+        private DateTime lastPerfStatsTime = DateTime.Now;
+
+        // Levels of optional work the client sheds to keep within its frame time budget, shown after its timings
+        public int LoadShedLevel = 0;
+
         public SyncState CurrentSyncState = SyncState.Standalone;
 
         // Pose of the camera in the scene (used by the OpenGLWindow to show the sensor)
@@ -144,36 +188,89 @@ namespace LiveScanServer
         // Transform that maps the vertices in the camera coordinate system to the world coordinate system
         public AffineTransform WorldTransform = new AffineTransform();
 
-        public List<byte> FrameColors = new List<byte>();
-        public List<float> FrameVertices = new List<float>();
-
-        public List<byte> DocumentData = new List<byte>();
+        public FrameBuffer<byte> FrameColors = new FrameBuffer<byte>();
+        public FrameBuffer<float> FrameVertices = new FrameBuffer<float>();
+        public FrameBuffer<byte> FrameNormals = new FrameBuffer<byte>(); // One octahedral byte per vertex; empty when the client does not estimate them
+        public Queue<RecordedFrame> RecordedFrames = new Queue<RecordedFrame>(); // Recorded frames received and not yet handed over to the PLY export
+        public ulong FrameSequenceNumber = 0; // Sequence number of the latest frame read with UpdateLatestFrame
+        public ulong FrameTimeStampUs = 0;
+        public long FrameAcquireTimeUs = 0; // Server clock times at which the latest frame was acquired and published by the client
+        public long FramePublishTimeUs = 0;
+        public ulong FrameVersion = 0; // Unique across the clients, changed whenever FrameVertices and FrameColors are
+        private static long s_lastFrameVersion = 0;
+
+        // Frame assembly statistics: frames used as they arrived, frames reused or dropped because the camera was late,
+        // and how far behind the newest camera the frame used in the last assembly was
+        public long NumFreshFrames = 0;
+        public long NumStaleFrames = 0;
+        public long NumDroppedFrames = 0;
+        public double FrameAgeMs = 0.0;
+
+        public byte[] DocumentJpeg = new byte[0]; // Encoded by the client, sent as is to the receivers
         public float DocumentScore = 0.0f;
         public short DocumentWidth = 0;
         public short DocumentHeight = 0;
+        public byte[] DocumentSignature = new byte[0]; // Thumbnail of the document, to tell it apart from those of the other cameras
 
         private int clientIndex;
         private IntPtr clientHandle;
 
-        // Callbacks for client to server calls
-        private SendSerialNumberCallback sendSerialNumberCallback;
-        private ConfirmRecordedCallback confirmRecordedCallback;
-        private ConfirmCalibratedCallback confirmCalibratedCallback;
-        private SendLatestFrameCallback sendLatestFrameCallback;
+        // Callback for the recorded frames, called within RequestRecordedFrames; the other messages of the clients are events
         private SendRecordedFrameCallback sendRecordedFrameCallback;
-        private ConfirmSyncStateCallback confirmSyncStateCallback;
-        private ConfirmMasterRestartCallback confirmMasterRestartCallback;
-        private SendDocumentCallback sendDocumentCallback;
 
-        public CameraClient(int index)
+        private const int DocumentSignatureSize = 16 * 16; // Thumbnail of DocumentSignatureSize x DocumentSignatureSize pixels on the clients
+
+        /// <summary>
+        /// Creates the client of a camera of this computer
+        /// </summary>
+        /// <param name="isIsolated">Run the camera in its own worker process, restarted if it crashes or hangs</param>
+        public CameraClient(int index, bool isIsolated = false)
+        {
+            clientHandle = isIsolated ? CreateWorkerClient(index) : CreateClient(index);
+            clientIndex = index;
+            ClientState = "[Client " + clientIndex.ToString() + "] Calibrated = false";
+
+            UpdateSocketState();
+        }
+
+        /// <summary>
+        /// Creates a client which replays a raw recording of a camera instead of capturing from one
+        /// </summary>
+        /// <param name="replayPath">Raw recording to replay</param>
+        /// <param name="isReplayRealTime">Replay the frames at the speed they were recorded at, instead of as fast as they are processed</param>
+        public CameraClient(int index, string replayPath, bool isReplayRealTime)
+        {
+            clientHandle = CreateReplayClient(index, replayPath, isReplayRealTime);
+            clientIndex = index;
+            ClientState = "[Client " + clientIndex.ToString() + "] Calibrated = false";
+
+            UpdateSocketState();
+        }
+
+        /// <summary>
+        /// Creates a client of a camera hosted by a capture node on another computer, which streams its frames
+        /// </summary>
+        /// <param name="remoteIndex">Index of the client on the node</param>
+        public CameraClient(int index, string host, int port, int remoteIndex)
         {
-            clientHandle = CreateClient(index);
+            clientHandle = CreateRemoteClient(index, host, port, remoteIndex);
             clientIndex = index;
             ClientState = "[Client " + clientIndex.ToString() + "] Calibrated = false";
 
             UpdateSocketState();
         }
 
+        /// <summary>
+        /// Asks a capture node how many cameras it hosts
+        /// </summary>
+        /// <returns>Number of clients of the node; -1 if it did not answer within <paramref name="timeoutMs"/></returns>
+        public static int QueryNode(string host, int port, int timeoutMs) => QueryCaptureNode(host, port, timeoutMs);
+
+        /// <summary>
+        /// Enumerates the connected cameras once for the <paramref name="count"/> clients about to be launched
+        /// </summary>
+        public static void PrepareLaunch(int count) => PrepareClients(count);
+
         public void Start() => StartClient(clientHandle);
        
         public void Stop() => StopClient(clientHandle);
@@ -199,6 +296,81 @@ namespace LiveScanServer
             Calibrate(clientHandle);
         }
 
+        /// <summary>
+        /// Number of marker samples the calibration found so far
+        /// </summary>
+        /// <returns>False once the client is not calibrating anymore</returns>
+        public bool GetCalibrationProgress(out int numSamples, out int numRequiredSamples) => GetCalibrationProgress(clientHandle, out numSamples, out numRequiredSamples);
+
+        public void SetDocumentFrameInterval(int intervalMs) => SetDocumentFrameInterval(clientHandle, intervalMs);
+
+        /// <summary>
+        /// Sets the largest size the receivers render the documents at, which the crops of the client are downscaled to fit
+        /// </summary>
+        /// <param name="width">Largest width, in pixels; 0 for no limit</param>
+        /// <param name="height">Largest height, in pixels; 0 for no limit</param>
+        public void SetMaxDocumentSize(int width, int height) => SetMaxDocumentSize(clientHandle, width, height);
+
+        /// <summary>
+        /// Reads the bytes held by the buffers of the client, as last accounted by its capture thread
+        /// </summary>
+        public bool TryGetMemoryStats(out ClientMemoryStats stats) => GetMemoryStats(clientHandle, out stats);
+
+        /// <summary>
+        /// Reads the points each step of the processing of the last frame of the client removed
+        /// </summary>
+        public bool TryGetFunnelStats(out FrameFunnelStats stats) => GetFunnelStats(clientHandle, out stats);
+
+        /// <summary>
+        /// Reads the timings of the stages of the frame loop since the previous update, and summarizes them as the frame
+        /// rate and the median, 95th and 99th percentile of each stage, in milliseconds, followed by the memory the
+        /// buffers of the client hold and the points of the last frame sent out of those with a depth
+        /// </summary>
+        public void UpdatePerfStats()
+        {
+            DateTime now = DateTime.Now;
+            int numStages = GetPerfStats(clientHandle, PerfStats, PerfStats.Length, true);
+            double elapsedSeconds = (now - lastPerfStatsTime).TotalSeconds;
+            lastPerfStatsTime = now;
+
+            if (numStages == 0 || PerfStats[(int)PerfStage.Frame].Count == 0)
+            {
+                PerfSummary = "";
+                UpdateSocketState();
+                return;
+            }
+
+            StringBuilder summary = new StringBuilder();
+            summary.Append((PerfStats[(int)PerfStage.Frame].Count / Math.Max(elapsedSeconds, 1e-3)).ToString("0.0") + " fps |");
+
+            for (int i = 0; i < numStages; i++)
+            {
+                PerfStageStats stats = PerfStats[i];
+
+                if (stats.Count > 0)
+                    summary.Append(" " + stats.Stage + " " + stats.P50Ms.ToString("0.0") + "/" + stats.P95Ms.ToString("0.0") + "/" + stats.P99Ms.ToString("0.0"));
+            }
+
+            summary.Append(" ms");
+
+            if (TryGetMemoryStats(out ClientMemoryStats memoryStats) && memoryStats.TotalBytes > 0)
+                summary.Append(" | " + (memoryStats.TotalBytes / (1024 * 1024)) + " MB");
+
+            if (TryGetFunnelStats(out FrameFunnelStats funnelStats) && funnelStats.NumDepthPixels > 0)
+            {
+                summary.Append(" | " + funnelStats.NumSentPoints + "/" + funnelStats.NumDepthPixels + " pts");
+
+                int roiWidth = funnelStats.RoiRight - funnelStats.RoiLeft;
+                int roiHeight = funnelStats.RoiBottom - funnelStats.RoiTop;
+
+                if (roiWidth < funnelStats.DepthWidth || roiHeight < funnelStats.DepthHeight)
+                    summary.Append(" | roi " + roiWidth + "x" + roiHeight + " at " + funnelStats.RoiLeft + "," + funnelStats.RoiTop);
+            }
+
+            PerfSummary = summary.ToString();
+            UpdateSocketState();
+        }
+
         public void SetSettings(CameraSettings settings)
         {
             var native = settings.ToNative(out GCHandle markerHandle);
@@ -214,9 +386,165 @@ namespace LiveScanServer
             }
         }
 
-        public void RequestRecordedFrame() => RequestRecordedFrame(clientHandle);
-        
-        public void RequestLatestFrame() => RequestLatestFrame(clientHandle);
+        /// <summary>
+        /// Sets the exposure of the color camera without sending the other settings; the next settings set it back to theirs
+        /// </summary>
+        /// <param name="exposureStep">Exposure step between 1 and 300, when the auto exposure is disabled</param>
+        public void SetExposure(bool isAutoExposureEnabled, int exposureStep) => SetExposure(clientHandle, isAutoExposureEnabled, exposureStep);
+
+        /// <summary>
+        /// Meters the latest frame of the client, as the mean luma of one point out of <paramref name="sampleStep"/>
+        /// </summary>
+        /// <param name="acquireTimeUs">Server clock time at which the frame was acquired</param>
+        /// <returns>The luma, between 0 and 255; -1 when the client has no points</returns>
+        public unsafe float MeasureBrightness(int sampleStep, out long acquireTimeUs)
+        {
+            using (FrameLease frame = AcquireLatestFrame())
+            {
+                acquireTimeUs = frame.AcquireTimeUs;
+
+                if (frame.Count == 0)
+                    return -1.0f;
+
+                long sum = 0;
+                int numSamples = 0;
+                sampleStep = Math.Max(1, sampleStep);
+
+                for (int i = 0; i < frame.Count; i += sampleStep)
+                {
+                    // Rec. 601 luma, in fixed point
+                    RGB color = frame.Colors[i];
+                    sum += 77 * color.Red + 150 * color.Green + 29 * color.Blue;
+                    numSamples++;
+                }
+
+                return sum / (256.0f * numSamples);
+            }
+        }
+
+        /// <summary>
+        /// Receives up to maxFrames recorded frames in RecordedFrames, within this call
+        /// </summary>
+        /// <returns>Number of frames received; fewer than maxFrames once the recording ended</returns>
+        public int RequestRecordedFrames(int maxFrames) => RequestRecordedFrames(clientHandle, maxFrames);
+
+        /// <summary>
+        /// Latest processed frame of a client, read in place in the native buffers. The frame never changes while it is
+        /// leased; dispose the lease as soon as possible so that the client can recycle its buffers. A lease is a struct,
+        /// so that leasing the frames of every client on every frame allocates nothing; dispose it only once.
+        /// </summary>
+        public unsafe struct FrameLease : IDisposable
+        {
+            private IntPtr frameHandle;
+
+            public readonly Point3s* Vertices; // In millimeters
+            public readonly RGB* Colors;
+            public readonly byte* Normals; // Null when the client does not estimate them
+            public readonly int Count;
+            public readonly ulong SequenceNumber;
+            public readonly ulong TimeStampUs;
+            public readonly long AcquireTimeUs; // In microseconds of the server clock; 0 until the client publishes a frame
+            public readonly long PublishTimeUs;
+
+            internal FrameLease(IntPtr clientHandle)
+            {
+                frameHandle = AcquireLatestFrame(clientHandle, out Vertices, out Colors, out Count, out SequenceNumber, out TimeStampUs);
+
+                // The client gives the ages of the frame, which do not depend on its clock
+                ulong acquireAgeUs;
+                ulong publishAgeUs;
+                GetFrameAges(frameHandle, out acquireAgeUs, out publishAgeUs);
+
+                if (GetFrameNormals(frameHandle, out Normals) != Count || Count == 0)
+                    Normals = null;
+
+                AcquireTimeUs = 0;
+                PublishTimeUs = 0;
+
+                if (SequenceNumber > 0)
+                {
+                    long now = FrameTrace.GetTimeUs();
+                    AcquireTimeUs = now - (long)acquireAgeUs;
+                    PublishTimeUs = now - (long)publishAgeUs;
+                }
+            }
+
+            public void Dispose()
+            {
+                if (frameHandle != IntPtr.Zero)
+                {
+                    ReleaseFrame(frameHandle);
+                    frameHandle = IntPtr.Zero;
+                }
+            }
+        }
+
+        public FrameLease AcquireLatestFrame() => new FrameLease(clientHandle);
+
+        /// <summary>
+        /// Waits until the client has published a frame newer than the one in FrameVertices and FrameColors
+        /// </summary>
+        /// <param name="timeoutMs">Maximum time to wait for the new frame</param>
+        /// <returns>True if a new frame is available; false if the wait timed out</returns>
+        public bool WaitForNewFrame(int timeoutMs) => WaitForNewFrame(FrameSequenceNumber, timeoutMs);
+
+        /// <summary>
+        /// Waits until the client has published a frame newer than <paramref name="lastSequenceNumber"/>
+        /// </summary>
+        public bool WaitForNewFrame(ulong lastSequenceNumber, int timeoutMs) => WaitForFrame(clientHandle, lastSequenceNumber, Math.Max(0, timeoutMs));
+
+        /// <summary>
+        /// Reads the latest processed frame of the client in place and stores it in FrameVertices and FrameColors.
+        /// The lists are kept as they are when the client has not published a new frame since the last call.
+        /// </summary>
+        /// <returns>True if a new frame was read</returns>
+        public unsafe bool UpdateLatestFrame()
+        {
+            using (FrameLease frame = AcquireLatestFrame())
+            {
+                IsLatestFrameReceived = frame.SequenceNumber > FrameSequenceNumber;
+
+                if (IsLatestFrameReceived)
+                    ReadFrame(frame);
+            }
+
+            return IsLatestFrameReceived;
+        }
+
+        /// <summary>
+        /// Stores a leased frame in FrameVertices, FrameColors and FrameNormals
+        /// </summary>
+        public unsafe void ReadFrame(FrameLease frame)
+        {
+            CopyFrame(frame.Vertices, frame.Colors, frame.Normals, frame.Count);
+            FrameSequenceNumber = frame.SequenceNumber;
+            FrameTimeStampUs = frame.TimeStampUs;
+            FrameAcquireTimeUs = frame.AcquireTimeUs;
+            FramePublishTimeUs = frame.PublishTimeUs;
+            FrameVersion = (ulong)Interlocked.Increment(ref s_lastFrameVersion);
+        }
+
+        /// <summary>
+        /// Depth frame of a client, for the projective pose refinement; the buffers are reused by the next frames
+        /// </summary>
+        public sealed class DepthFrame
+        {
+            public const int MaxPixels = 1024 * 1024;
+
+            public ushort[] Depth = new ushort[MaxPixels]; // In millimeters, Width * Height of them are set
+            public int Width = 0;
+            public int Height = 0;
+            public float[] Intrinsics = new float[4]; // Depth camera fx, fy, cx, cy
+            public float[] DepthToWorld = new float[12]; // Depth camera (meters) to world space, 3x4 row-major
+        }
+
+        /// <summary>
+        /// Copies the next depth frame acquired by the client, with what unprojects it to world space
+        /// </summary>
+        /// <param name="timeoutMs">Maximum time to wait for the frame</param>
+        /// <returns>True if the frame was copied; false if the wait timed out</returns>
+        public bool AcquireDepthFrame(DepthFrame frame, int timeoutMs) => AcquireDepthFrame(clientHandle, frame.Depth, frame.Depth.Length,
+            out frame.Width, out frame.Height, frame.Intrinsics, frame.DepthToWorld, Math.Max(0, timeoutMs));
 
         public void ReceiveCalibration()
         {
@@ -224,13 +552,35 @@ namespace LiveScanServer
             ReceiveCalibration(clientHandle, ref native);
         }
 
-        public void ClearRecordedFrames() => ClearRecordedFrames(clientHandle);
+        /// <summary>
+        /// Sends the poses of the cameras the voxels of the client are shared out between
+        /// </summary>
+        /// <param name="poses">Pose of each camera; none for the client to keep all its points</param>
+        /// <param name="cameraIndex">Index of the pose of the camera of this client among them</param>
+        public void ReceiveCameraPoses(List<AffineTransform> poses, int cameraIndex)
+        {
+            NativeAffineTransform[] native = poses.Select(pose => pose.ToNative()).ToArray();
+            ReceiveCameraPoses(clientHandle, native, native.Length, cameraIndex);
+        }
 
-        public void EnableSync(int syncState, int syncOffset)
+        public void ClearRecordedFrames()
+        {
+            while (RecordedFrames.Count > 0)
+                RecordedFrames.Dequeue().Release();
+
+            ClearRecordedFrames(clientHandle);
+        }
+
+        public void SaveFrameRing(int seconds) => SaveFrameRing(clientHandle, seconds);
+
+        public void LearnExclusionMask(int numFrames) => LearnExclusionMask(clientHandle, numFrames);
+
+        /// <param name="numSyncedDevices">Devices on the sync chain, master included, which the client staggers its processing by</param>
+        public void EnableSync(int syncState, int syncOffset, int numSyncedDevices)
         {
             IsStarted = false;
             CurrentSyncState = SyncState.Unknown;
-            EnableSync(clientHandle, syncState, syncOffset);
+            EnableSync(clientHandle, syncState, syncOffset, numSyncedDevices);
         }
 
         public void DisableSync()
@@ -242,197 +592,165 @@ namespace LiveScanServer
 
         public void StartMaster() => StartMaster(clientHandle);
 
-        public void SetSendSerialNumberCallback(Action callback)
-        {
-            sendSerialNumberCallback = new SendSerialNumberCallback((int index, string serial) =>
-            {
-                SerialNumber = serial;
-                UpdateSocketState();
-                callback();
-            });
-
-            SetSendSerialNumberCallback(clientHandle, sendSerialNumberCallback);
-        }
-
-        public void SetConfirmRecordedCallback()
+        /// <summary>
+        /// Waits for the next events of the clients, and takes all those pending at once
+        /// </summary>
+        /// <param name="events">Receives the events, oldest first</param>
+        /// <param name="timeoutMs">Maximum time to wait for an event</param>
+        /// <returns>Number of events received; 0 if the wait timed out</returns>
+        public static int WaitForEvents(ClientEvent[] events, int timeoutMs) => WaitForClientEvents(events, events.Length, Math.Max(0, timeoutMs));
+
+        /// <summary>
+        /// Applies an event of this client to its state
+        /// </summary>
+        /// <returns>False if there is nothing left to handle, when the document of the event was replaced by a newer one</returns>
+        public unsafe bool HandleEvent(ref ClientEvent clientEvent)
         {
-            confirmRecordedCallback = new ConfirmRecordedCallback((int clientIndex) => 
+            switch (clientEvent.Type)
             {
-                IsFrameRecorded = true;
-            });
+                case ClientEventType.SerialNumber:
+                    fixed (byte* text = clientEvent.Text)
+                    {
+                        SerialNumber = Marshal.PtrToStringAnsi((IntPtr)text);
+                    }
 
-            SetConfirmRecordedCallback(clientHandle, confirmRecordedCallback);
-        }
+                    UpdateSocketState();
+                    break;
 
-        public unsafe void SetConfirmCalibratedCallback(Action callback)
-        {
-            confirmCalibratedCallback = new ConfirmCalibratedCallback((clientIndex, markerId, R, t) =>
-            {
-                float[] rotation = new float[9];
-                float[] translation = new float[3];
-                Marshal.Copy((IntPtr)R, rotation, 0, 9);
-                Marshal.Copy((IntPtr)t, translation, 0, 3);
+                case ClientEventType.Recorded:
+                    IsFrameRecorded = true;
+                    break;
 
-                WorldTransform = new AffineTransform
-                {
-                    R = new float[3, 3],
-                    T = new float[3]
-                };
+                case ClientEventType.Calibrated:
+                    WorldTransform = new AffineTransform
+                    {
+                        R = new float[3, 3],
+                        T = new float[3]
+                    };
 
-                for (int i = 0; i < 3; i++)
-                    for (int j = 0; j < 3; j++)
-                        WorldTransform.R[i, j] = R[i * 3 + j];
+                    for (int i = 0; i < 3; i++)
+                        for (int j = 0; j < 3; j++)
+                            WorldTransform.R[i, j] = clientEvent.R[i * 3 + j];
 
-                for (int i = 0; i < 3; i++)
-                    WorldTransform.T[i] = t[i];
+                    for (int i = 0; i < 3; i++)
+                        WorldTransform.T[i] = clientEvent.T[i];
 
-                CameraPose.R = WorldTransform.R;
-                for (int i = 0; i < 3; i++)
-                {
-                    CameraPose.T[i] = 0.0f;
-                    for (int j = 0; j < 3; j++)
+                    CameraPose.R = WorldTransform.R;
+                    for (int i = 0; i < 3; i++)
                     {
-                        CameraPose.T[i] += WorldTransform.T[j] * WorldTransform.R[i, j];
+                        CameraPose.T[i] = 0.0f;
+                        for (int j = 0; j < 3; j++)
+                        {
+                            CameraPose.T[i] += WorldTransform.T[j] * WorldTransform.R[i, j];
+                        }
                     }
-                }
-
-                IsCalibrated = true;
-                UpdateSocketState();
-                callback();
-            });
 
-            SetConfirmCalibratedCallback(clientHandle, confirmCalibratedCallback);
-        }
-
-        public unsafe void SetSendLatestFrameCallback()
-        {
-            sendLatestFrameCallback = new SendLatestFrameCallback((int index, Point3s* vertices, RGB* colors, int count) =>
-            {
-                // Ensure list capacity
-                if (FrameVertices.Capacity < count * 3)
-                    FrameVertices.Capacity = count * 3;
-                if (FrameColors.Capacity < count * 3)
-                    FrameColors.Capacity = count * 3;
+                    IsCalibrated = true;
+                    UpdateSocketState();
+                    break;
 
-                FrameVertices.Clear();
-                FrameColors.Clear();
+                case ClientEventType.MasterRestart:
+                    IsStarted = true;
+                    break;
 
-                for (int i = 0; i < count; i++)
-                {
-                    // Divide vertex data by 1000 to convert to meters
-                    FrameVertices.Add(vertices[i].X / 1000.0f);
-                    FrameVertices.Add(vertices[i].Y / 1000.0f);
-                    FrameVertices.Add(vertices[i].Z / 1000.0f);
-
-                    FrameColors.Add(colors[i].Red);
-                    FrameColors.Add(colors[i].Green);
-                    FrameColors.Add(colors[i].Blue);
-                }
+                case ClientEventType.LoadShed:
+                    LoadShedLevel = clientEvent.Value;
+                    UpdateSocketState();
+                    break;
 
-                IsLatestFrameReceived = true;
-            });
+                case ClientEventType.Document:
+                    return ReceiveDocument(clientEvent.Value);
+            }
 
-            SetSendLatestFrameCallback(clientHandle, sendLatestFrameCallback);
+            return true;
         }
 
-        public unsafe void SetSendRecordedFrameCallback()
+        /// <summary>
+        /// Converts a sync state sent by a client
+        /// </summary>
+        public static SyncState ToSyncState(int state)
         {
-            sendRecordedFrameCallback = new SendRecordedFrameCallback((int index, Point3s* vertices, RGB* colors, int count, byte noMoreFrames) =>
+            switch (state)
             {
-                if (noMoreFrames != 0)
-                {
-                    NoMoreRecordedFrames = true;
-                    IsRecordedFrameReceived = true;
-                    return;
-                }
+                case 0:
+                    return SyncState.Subordinate;
+                case 1:
+                    return SyncState.Master;
+                case 2:
+                    return SyncState.Standalone;
+                default:
+                    return SyncState.Unknown;
+            }
+        }
 
-                // Ensure list capacity
-                if (FrameVertices.Capacity < count * 3)
-                    FrameVertices.Capacity = count * 3;
-                if (FrameColors.Capacity < count * 3)
-                    FrameColors.Capacity = count * 3;
+        /// <summary>
+        /// Copies the document announced by a document event
+        /// </summary>
+        /// <param name="jpegSize">Size of the document when it was announced</param>
+        /// <returns>False if the client has no document left to copy</returns>
+        private bool ReceiveDocument(int jpegSize)
+        {
+            // A new array for each document, so the server can keep a reference to it; the signature is kept with the
+            // document, as the arbitration compares it with later documents
+            byte[] jpeg = new byte[jpegSize];
+            byte[] signature = new byte[DocumentSignatureSize];
 
-                FrameVertices.Clear();
-                FrameColors.Clear();
+            int copiedSize = CopyDocument(clientHandle, jpeg, jpeg.Length, out float score, out short width, out short height, signature, signature.Length);
 
-                for (int i = 0; i < count; i++)
-                {
-                    // Divide vertex data by 1000 to convert to meters
-                    FrameVertices.Add(vertices[i].X / 1000.0f);
-                    FrameVertices.Add(vertices[i].Y / 1000.0f);
-                    FrameVertices.Add(vertices[i].Z / 1000.0f);
-
-                    FrameColors.Add(colors[i].Red);
-                    FrameColors.Add(colors[i].Green);
-                    FrameColors.Add(colors[i].Blue);
-                }
+            if (copiedSize == 0)
+                return false;
 
-                IsRecordedFrameReceived = true;
-            });
+            if (copiedSize < jpeg.Length)
+                Array.Resize(ref jpeg, copiedSize);
 
-            SetSendRecordedFrameCallback(clientHandle, sendRecordedFrameCallback);
+            DocumentJpeg = jpeg;
+            DocumentSignature = signature;
+            DocumentScore = score;
+            DocumentWidth = width;
+            DocumentHeight = height;
+
+            return true;
         }
 
-        public void SetConfirmSyncStateCallback(Action<int, SyncState> callback)
+        /// <summary>
+        /// Converts a native frame to FrameVertices (in meters), FrameColors and FrameNormals. The points are converted in a
+        /// single native pass over the native buffers, straight into the reused arrays of the frame buffers.
+        /// </summary>
+        private unsafe void CopyFrame(Point3s* vertices, RGB* colors, byte* normals, int count)
         {
-            confirmSyncStateCallback = new ConfirmSyncStateCallback((int index, int state) =>
+            int numValues = count * 3;
+            FrameVertices.Resize(numValues);
+            FrameColors.Resize(numValues);
+
+            // The native conversion is vectorized and gives the same floats as dividing by 1000
+            fixed (float* vertexValues = FrameVertices.Items)
+            fixed (byte* colorValues = FrameColors.Items)
             {
-               SyncState config = SyncState.Unknown;
-
-               switch (state)
-               {
-                    case 0:
-                        config = SyncState.Subordinate;
-                        break;
-                    case 1:
-                        config = SyncState.Master;
-                        break;
-                    case 2:
-                        config = SyncState.Standalone;
-                        break;
-                    default:
-                        config = SyncState.Unknown;
-                        break;
-               }
-
-               callback(index, config);
-            });
+                ConvertFramePoints(vertices, colors, count, vertexValues, colorValues);
+            }
 
-            SetConfirmSyncStateCallback(clientHandle, confirmSyncStateCallback);
-        }
+            FrameNormals.Clear();
 
-        public void SetConfirmMasterRestartCallback(Action<int> callback)
-        {
-            confirmMasterRestartCallback = new ConfirmMasterRestartCallback((int index) =>
+            if (normals != null)
             {
-                IsStarted = true;
-                callback(index);
-            });
-
-            SetConfirmMasterRestartCallback(clientHandle, confirmMasterRestartCallback);
+                FrameNormals.Resize(count);
+                Marshal.Copy((IntPtr)normals, FrameNormals.Items, 0, count);
+            }
         }
 
-        public unsafe void SetSendDocumentCallback(Action<int> callback)
+        public unsafe void SetSendRecordedFrameCallback()
         {
-            sendDocumentCallback = new SendDocumentCallback((int index, byte* data, float score, short width, short height) =>
+            sendRecordedFrameCallback = new SendRecordedFrameCallback((int index, Point3s* vertices, RGB* colors, int count, byte noMoreFrames) =>
             {
-                DocumentData.Clear();
-                DocumentData.Capacity = width * height * 3; // pre-allocate for speed
-
-                // Copy raw bytes into managed List<byte>
-                for (int i = 0; i < width * height * 3; i++)
-                {
-                    DocumentData.Add(data[i]);
-                }
-
-                DocumentScore = score;
-                DocumentWidth = width;
-                DocumentHeight = height;
+                // The end of the recording leaves the queue of the client empty
+                if (noMoreFrames != 0)
+                    return;
 
-                callback(index);
+                // The recorded frames are kept in their native layout; the export converts them while writing them
+                RecordedFrames.Enqueue(RecordedFrame.Copy(vertices, colors, count));
             });
 
-            SetSendDocumentCallback(clientHandle, sendDocumentCallback);
+            SetSendRecordedFrameCallback(clientHandle, sendRecordedFrameCallback);
         }
 
         public void UpdateSocketState()
@@ -455,6 +773,12 @@ namespace LiveScanServer
             }
 
             ClientState = "[Client " + clientIndex.ToString() + " ( " + SerialNumber +  ")] Calibrated = " + IsCalibrated + " " + syncMessage;
+
+            if (PerfSummary.Length > 0)
+                ClientState += " " + PerfSummary;
+
+            if (LoadShedLevel > 0)
+                ClientState += " | shedding level " + LoadShedLevel;
         }
     }
 }
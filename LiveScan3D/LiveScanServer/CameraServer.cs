@@ -19,6 +19,9 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 using System;
 using System.Collections.Generic;
 using System.Linq;
+using System.Runtime.InteropServices;
+using System.Threading;
+using System.Threading.Tasks;
 using System.Windows.Forms;
 
 namespace LiveScanServer
@@ -28,13 +31,23 @@ namespace LiveScanServer
 
     public class CameraServer
     {
+        // DLL imports for some required methods from the Orbbec SDK
+        [DllImport("OrbbecSDK.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern IntPtr ob_create_context();
+
+        [DllImport("OrbbecSDK.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern IntPtr ob_query_device_list(IntPtr ctx);
+
+        [DllImport("OrbbecSDK.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern UIntPtr ob_device_list_device_count(IntPtr devList);
+
         public int ClientCount
         {
             get
             {
                 int nClients;
 
-                lock (clientLock)
+                using (clientLock.Enter())
                 {
                     nClients = liveScanClients.Count;
                 }
@@ -49,7 +62,7 @@ namespace LiveScanServer
             {
                 bool allCalibrated = true;
 
-                lock (clientLock)
+                using (clientLock.Enter())
                 {
                     foreach (var client in liveScanClients)
                     {
@@ -71,7 +84,7 @@ namespace LiveScanServer
             {
                 List<AffineTransform> cameraPoses = new List<AffineTransform>();
 
-                lock (clientLock)
+                using (clientLock.Enter())
                 {
                     foreach (var client in liveScanClients)
                     {
@@ -83,7 +96,7 @@ namespace LiveScanServer
             }
             set
             {
-                lock (clientLock)
+                using (clientLock.Enter())
                 {
                     for (int i = 0; i < liveScanClients.Count; i++)
                     {
@@ -99,7 +112,7 @@ namespace LiveScanServer
             {
                 List<AffineTransform> worldTransforms = new List<AffineTransform>();
 
-                lock (clientLock)
+                using (clientLock.Enter())
                 {
                     foreach (var client in liveScanClients)
                     {
@@ -112,7 +125,7 @@ namespace LiveScanServer
 
             set
             {
-                lock (clientLock)
+                using (clientLock.Enter())
                 {
                     for (int i = 0; i < liveScanClients.Count; i++)
                     {
@@ -132,18 +145,46 @@ namespace LiveScanServer
         private bool allDevicesInitialized = true; 
 
         private CameraSettings cameraSettings;
+        private FrameAssembler frameAssembler;
         private SettingsForm settingsForm;
         private List<CameraClient> liveScanClients = new List<CameraClient>();
 
-        private object clientLock = new object();
-        private object frameRequestLock = new object();
-        private object documentDataLock = new object();
+        // Recorded frames fetched from each client at once when saving; each frame takes a few megabytes
+        private const int RecordedFrameBatchSize = 8;
+
+        // Events of all the clients, taken in batches by a single dispatcher thread
+        private const int ClientEventBatchSize = 64;
+        private const int ClientEventWaitMs = 500; // Bounds the time the dispatcher takes to notice the server stopped
+
+        // Capture nodes host the cameras of other computers; they are queried for their cameras at launch
+        private const int DefaultCaptureNodePort = 48005;
+        private const int CaptureNodeQueryTimeoutMs = 2000;
+        private Thread clientEventThread;
+        private volatile bool isDispatchingClientEvents = false;
+
+        private readonly ProfiledLock clientLock = new ProfiledLock("client");
+        private readonly ProfiledLock frameRequestLock = new ProfiledLock("frame request");
+        private readonly List<CameraClient> frameClients = new List<CameraClient>(); // Reused under frameRequestLock
+        private readonly ProfiledLock recordedFrameLock = new ProfiledLock("recorded frame"); // Apart from the live frames, read from the files of the clients
+        private object calibrationLock = new object(); // Serializes the pose corrections of the refinements
+        private readonly ProfiledLock documentDataLock = new ProfiledLock("document data"); // Also serializes the arbitration of the documents
+        private DocumentArbiter documentArbiter;
+
+        // Largest size the receivers render the documents at, sent to the clients as they start; 0 for no limit
+        private int maxDocumentWidth = 0;
+        private int maxDocumentHeight = 0;
+
+        // Exposure step the exposure coordinator locked all the cameras to, sent to the clients as they start and after
+        // the settings, which would set theirs back; 0 when the cameras follow the exposure of the settings
+        private int coordinatedExposureStep = 0;
 
         private int counter = 0;
 
         public CameraServer(CameraSettings settings)
         {
             this.cameraSettings = settings;
+            frameAssembler = new FrameAssembler(settings);
+            documentArbiter = new DocumentArbiter(SetDocumentDetectionInterval);
         }
 
         public void SetSettingsForm(SettingsForm settings)
@@ -165,35 +206,120 @@ namespace LiveScanServer
         /// Launches <paramref name="count"/> camera client processes
         /// </summary>
         /// <param name="count">Number of camera client processes to start</param>
-        public void LaunchClients(uint count)
+        /// <param name="isIsolated">Run each camera in its own worker process instead of in the server</param>
+        public void LaunchClients(uint count, bool isIsolated)
         {
+            // Enumerate the cameras once; the clients then open their camera and start in parallel. The workers
+            // enumerate them in their own process.
+            if (!isIsolated)
+                CameraClient.PrepareLaunch((int)count);
+
             // Start multiple instances of LiveScanClient
             for (int i = 0; i < count; i++)
+                StartClient(new CameraClient(i, isIsolated));
+
+            // Update client list in the main UI form
+            ClientListChanged();
+        }
+
+        /// <summary>
+        /// Launches a camera client for each camera connected to this computer
+        /// </summary>
+        /// <param name="isIsolated">Run each camera in its own worker process instead of in the server</param>
+        public void LaunchConnectedClients(bool isIsolated)
+        {
+            // Find the number of connected cameras
+            IntPtr ctx = ob_create_context();
+            IntPtr devList = ob_query_device_list(ctx);
+            uint count = ob_device_list_device_count(devList).ToUInt32();
+
+            LaunchClients(count, isIsolated);
+        }
+
+        /// <summary>
+        /// Launches one camera client for each raw recording, which replays it instead of capturing from a camera
+        /// </summary>
+        /// <param name="paths">Raw recordings to replay</param>
+        /// <param name="isRealTime">Replay the frames at the speed they were recorded at, instead of as fast as they are processed</param>
+        public void LaunchReplayClients(string[] paths, bool isRealTime)
+        {
+            for (int i = 0; i < paths.Length; i++)
+                StartClient(new CameraClient(i, paths[i], isRealTime));
+
+            ClientListChanged();
+        }
+
+        /// <summary>
+        /// Launches one remote client for each camera of the capture nodes, after the clients already launched
+        /// </summary>
+        /// <param name="nodes">Capture nodes, as host or host:port</param>
+        public void LaunchRemoteClients(string[] nodes)
+        {
+            int index;
+
+            using (clientLock.Enter())
             {
-                var client = new CameraClient(i);
-                liveScanClients.Add(client);
+                index = liveScanClients.Count;
+            }
+
+            foreach (string node in nodes)
+            {
+                string host = node;
+                int port = DefaultCaptureNodePort;
+                int separator = node.LastIndexOf(':');
 
-                // Set callbacks so the client can call server methods directly
-                client.SetSendSerialNumberCallback(OnReceiveSerialNumber);
-                client.SetConfirmRecordedCallback();
-                client.SetConfirmCalibratedCallback(OnConfirmCalibrated);
-                client.SetSendLatestFrameCallback();
-                client.SetSendRecordedFrameCallback();
-                client.SetConfirmSyncStateCallback(OnConfirmSyncState);
-                client.SetConfirmMasterRestartCallback(OnConfirmMasterRestart);
-                client.SetSendDocumentCallback(OnReceiveDocument);
-                client.Start();
-                
-                // Send settings
-                client.SetSettings(cameraSettings);
+                if (separator > 0 && int.TryParse(node.Substring(separator + 1), out int nodePort))
+                {
+                    host = node.Substring(0, separator);
+                    port = nodePort;
+                }
+
+                int count = CameraClient.QueryNode(host, port, CaptureNodeQueryTimeoutMs);
+
+                if (count < 0)
+                {
+                    Logger.Log($"The capture node {host}:{port} did not answer; its cameras are not launched");
+                    continue;
+                }
+
+                Logger.Log($"The capture node {host}:{port} hosts {count} cameras");
+
+                for (int i = 0; i < count; i++)
+                    StartClient(new CameraClient(index++, host, port, i));
             }
 
-            // Update client list in the main UI form
             ClientListChanged();
         }
 
+        private void StartClient(CameraClient client)
+        {
+            StartClientEventDispatch();
+
+            using (clientLock.Enter())
+            {
+                liveScanClients.Add(client);
+            }
+
+            // The recorded frames are sent back while they are requested; the other messages of the client are events
+            client.SetSendRecordedFrameCallback();
+            client.Start();
+
+            // Send settings
+            client.SetSettings(cameraSettings);
+
+            using (clientLock.Enter())
+            {
+                client.SetMaxDocumentSize(maxDocumentWidth, maxDocumentHeight);
+
+                if (coordinatedExposureStep > 0)
+                    client.SetExposure(false, coordinatedExposureStep);
+            }
+        }
+
         public void StopServer()
         {
+            isDispatchingClientEvents = false;
+
             // Ensure all LiveScanClients are terminated
             foreach (var client in liveScanClients)
             {
@@ -207,7 +333,7 @@ namespace LiveScanServer
         public void StartFrameRecording()
         {
             // Tell each connected client to start capturing frames
-            lock (clientLock)
+            using (clientLock.Enter())
             {
                 foreach (var client in liveScanClients)
                 {
@@ -221,7 +347,7 @@ namespace LiveScanServer
             {
                 allGathered = true;
 
-                lock (clientLock)
+                using (clientLock.Enter())
                 {
                     foreach (var client in liveScanClients)
                     {
@@ -237,7 +363,7 @@ namespace LiveScanServer
 
         public void Calibrate()
         {
-            lock (clientLock)
+            using (clientLock.Enter())
             {
                 foreach (var client in liveScanClients)
                 {
@@ -246,26 +372,195 @@ namespace LiveScanServer
             }
         }
 
+        /// <summary>
+        /// Gets the marker samples found by the calibration of each client, or -1 for the clients which are done
+        /// </summary>
+        /// <returns>False once none of the clients is calibrating</returns>
+        public bool GetCalibrationProgress(List<int> numSamples, out int numRequiredSamples)
+        {
+            bool isCalibrating = false;
+            numRequiredSamples = 0;
+            numSamples.Clear();
+
+            using (clientLock.Enter())
+            {
+                foreach (var client in liveScanClients)
+                {
+                    bool isClientCalibrating = client.GetCalibrationProgress(out int clientSamples, out int clientRequiredSamples);
+
+                    numSamples.Add(isClientCalibrating ? clientSamples : -1);
+                    numRequiredSamples = Math.Max(numRequiredSamples, clientRequiredSamples);
+                    isCalibrating |= isClientCalibrating;
+                }
+            }
+
+            return isCalibrating;
+        }
+
+        /// <summary>
+        /// Reads the timings of the frame loop of each client since the previous update, and shows them in the client list
+        /// </summary>
+        public void UpdatePerfStats()
+        {
+            using (clientLock.Enter())
+            {
+                foreach (var client in liveScanClients)
+                {
+                    client.UpdatePerfStats();
+                }
+            }
+
+            ClientListChanged();
+        }
+
         public void SendSettings()
         {
-            lock (clientLock)
+            using (clientLock.Enter())
             {
                 foreach (var client in liveScanClients)
                 {
                     client.SetSettings(cameraSettings);
+
+                    if (coordinatedExposureStep > 0)
+                        client.SetExposure(false, coordinatedExposureStep);
+                }
+            }
+
+            SendCameraPoses();
+        }
+
+        /// <summary>
+        /// Locks the exposure of all the cameras to the same step, or gives them back the exposure of the settings
+        /// </summary>
+        /// <param name="exposureStep">Exposure step between 1 and 300; 0 for the exposure of the settings</param>
+        public void SetCoordinatedExposure(int exposureStep)
+        {
+            using (clientLock.Enter())
+            {
+                coordinatedExposureStep = exposureStep;
+
+                foreach (var client in liveScanClients)
+                {
+                    if (exposureStep > 0)
+                        client.SetExposure(false, exposureStep);
+                    else
+                        client.SetExposure(cameraSettings.IsAutoExposureEnabled, cameraSettings.ExposureStep);
                 }
             }
         }
 
+        /// <summary>
+        /// Meters the latest frame of each client, as the mean luma of its points
+        /// </summary>
+        /// <param name="sampleStep">One point out of this many is metered</param>
+        /// <param name="minAcquireTimeUs">Server clock time before which the frames were acquired too early to be metered</param>
+        /// <returns>The luma of each client, between 0 and 255, in the order of the clients; -1 for those without a metered frame</returns>
+        public float[] MeasureFrameBrightness(int sampleStep, long minAcquireTimeUs)
+        {
+            List<CameraClient> clients;
+
+            using (clientLock.Enter())
+            {
+                clients = liveScanClients.ToList();
+            }
+
+            float[] brightness = new float[clients.Count];
+
+            for (int i = 0; i < clients.Count; i++)
+            {
+                brightness[i] = clients[i].MeasureBrightness(sampleStep, out long acquireTimeUs);
+
+                if (acquireTimeUs < minAcquireTimeUs)
+                    brightness[i] = -1.0f;
+            }
+
+            return brightness;
+        }
+
+        /// <summary>
+        /// Applies the pose corrections of the cameras, which move their world space points as (p + T) * R, to their
+        /// calibration and sends it to the clients. The corrections of concurrent refinements are applied one after the other.
+        /// </summary>
+        /// <param name="Rs">Rotation correction of each camera, 3x3 row-major, in the order of the clients</param>
+        /// <param name="Ts">Translation correction of each camera, in the order of the clients</param>
+        public void ApplyPoseCorrections(List<float[]> Rs, List<float[]> Ts)
+        {
+            lock (calibrationLock)
+            {
+                // Update calibration data for all connected cameras
+                List<AffineTransform> worldTransforms = WorldTransforms;
+                List<AffineTransform> cameraPoses = CameraPoses;
+
+                for (int i = 0; i < worldTransforms.Count && i < Rs.Count; i++)
+                {
+                    float[] tempT = new float[3];
+                    float[,] tempR = new float[3, 3];
+                    for (int j = 0; j < 3; j++)
+                    {
+                        for (int k = 0; k < 3; k++)
+                        {
+                            tempT[j] += Ts[i][k] * worldTransforms[i].R[k, j];
+                        }
+
+                        worldTransforms[i].T[j] += tempT[j];
+                        cameraPoses[i].T[j] += Ts[i][j];
+                    }
+
+                    for (int j = 0; j < 3; j++)
+                    {
+                        for (int k = 0; k < 3; k++)
+                        {
+                            for (int l = 0; l < 3; l++)
+                            {
+                                tempR[j, k] += Rs[i][l * 3 + j] * worldTransforms[i].R[l, k];
+                            }
+
+                            worldTransforms[i].R[j, k] = tempR[j, k];
+                            cameraPoses[i].R[j, k] = tempR[j, k];
+                        }
+                    }
+                }
+
+                WorldTransforms = worldTransforms;
+                CameraPoses = cameraPoses;
+
+                SendCalibrationData();
+            }
+        }
+
+
+
         public void SendCalibrationData()
         {
-            lock (clientLock)
+            using (clientLock.Enter())
             {
                 foreach (var client in liveScanClients)
                 {
                     client.ReceiveCalibration();
                 }
             }
+
+            SendCameraPoses();
+        }
+
+        /// <summary>
+        /// Sends the poses of the calibrated cameras to each of them, for the voxels to be shared out between them, or no
+        /// poses when the ownership is disabled. The cameras which are not calibrated keep all their points.
+        /// </summary>
+        public void SendCameraPoses()
+        {
+            using (clientLock.Enter())
+            {
+                List<CameraClient> calibratedClients = cameraSettings.IsCameraOwnershipEnabled
+                    ? liveScanClients.Where(c => c.IsCalibrated).ToList() : new List<CameraClient>();
+                List<AffineTransform> poses = calibratedClients.Select(c => c.CameraPose).ToList();
+
+                foreach (var client in liveScanClients)
+                {
+                    int cameraIndex = calibratedClients.IndexOf(client);
+                    client.ReceiveCameraPoses(cameraIndex >= 0 ? poses : new List<AffineTransform>(), cameraIndex);
+                }
+            }
         }
 
         /// <summary>
@@ -273,7 +568,7 @@ namespace LiveScanServer
         /// </summary>
         public void EnableSync()
         {
-            lock (clientLock)
+            using (clientLock.Enter())
             {
                 allDevicesInitialized = false;
                 waitForSubordinateStart = true;
@@ -289,20 +584,26 @@ namespace LiveScanServer
 
                 // First client becomes MASTER
                 CameraClient masterClient = sortedClients[0];
-                masterClient.EnableSync((int)SyncState.Master, 0);
+                masterClient.EnableSync((int)SyncState.Master, 0, sortedClients.Count);
 
-                // All others become SUBORDINATE
+                // All others become SUBORDINATE; each client only restarts its own pipeline, so they restart in parallel
+                List<Task> restartTasks = new List<Task>();
                 for (int i = 1; i < sortedClients.Count; i++)
                 {
-                    sortedClients[i].EnableSync((int)SyncState.Subordinate, i);
+                    CameraClient subordinateClient = sortedClients[i];
+                    int syncOffset = i;
+                    restartTasks.Add(Task.Run(() => subordinateClient.EnableSync((int)SyncState.Subordinate, syncOffset, sortedClients.Count)));
                 }
 
                 // Any clients not in sortedClients are set to STANDALONE
                 var standaloneClients = liveScanClients.Except(sortedClients);
                 foreach (var c in standaloneClients)
                 {
-                    c.EnableSync((int)SyncState.Standalone, 0);
+                    CameraClient standaloneClient = c;
+                    restartTasks.Add(Task.Run(() => standaloneClient.EnableSync((int)SyncState.Standalone, 0, 1)));
                 }
+
+                Task.WaitAll(restartTasks.ToArray());
             }
         }
 
@@ -310,86 +611,75 @@ namespace LiveScanServer
         {
             allDevicesInitialized = false;
 
-            lock (clientLock)
+            using (clientLock.Enter())
             {
-                foreach (var client in liveScanClients)
-                {
-                    client.DisableSync();
-                }
+                Task.WaitAll(liveScanClients.Select(client => Task.Run(() => client.DisableSync())).ToArray());
             }
         }
 
         /// <summary>
-        /// Tries to get a recorded frame from each connected camera client
+        /// Tries to get a recorded frame from each connected camera client. The frames are fetched from the clients in
+        /// batches, all the clients at once, and handed out one by one.
         /// </summary>
-        /// <param name="frameColors">List where to store the recorded frame's colors</param>
-        /// <param name="framesVertices">List where to store the recorded frame's vertices</param>
+        /// <param name="frames">List where to store the recorded frame of each client. The caller releases the frames.</param>
         /// <returns>True if a recorded frame was succesfully retrieved, false if there are no more recorded frames to retrieve</returns>
-        public bool TryGetRecordedFrame(ref List<List<byte>> frameColors, ref List<List<float>> framesVertices)
+        public bool TryGetRecordedFrame(List<RecordedFrame> frames)
         {
-            bool noMoreRecordedFrames;
-            int count = frameColors.Count;
-
-            // Ensure list capacity
-            if (framesVertices.Capacity < count)
-                framesVertices.Capacity = count;
-            if (frameColors.Capacity < count)
-                frameColors.Capacity = count;
+            frames.Clear();
 
-            frameColors.Clear();
-            framesVertices.Clear();
-            
-            lock (frameRequestLock)
+            using (recordedFrameLock.Enter())
             {
-                // Request a recorded frame from each connected client
-                lock (clientLock)
+                // The batches are read without holding the client lock, which the live frames take every frame
+                List<CameraClient> clients;
+
+                using (clientLock.Enter())
                 {
-                    foreach (var client in liveScanClients)
-                    {
-                        client.IsRecordedFrameReceived = false;
-                        client.NoMoreRecordedFrames = false;
-                        client.RequestRecordedFrame();
-                    }
+                    clients = liveScanClients.ToList();
                 }
 
-                // Wait for all frames to be received
-                bool allGathered = false;
-                noMoreRecordedFrames = false;
+                // Fetch the next batch of the clients which ran out of frames; the frames are received within the
+                // calls, so there is nothing to wait for once they return
+                CameraClient[] emptyClients = clients.Where(client => client.RecordedFrames.Count == 0).ToArray();
 
-                while (!allGathered)
-                {
-                    allGathered = true;                
-                    lock (clientLock)
-                    {
-                        foreach (var client in liveScanClients)
-                        {
-                            if (!client.IsRecordedFrameReceived)
-                            {
-                                allGathered = false;
-                                break;
-                            }
+                Task.WaitAll(emptyClients.Select(client => Task.Run(() => client.RequestRecordedFrames(RecordedFrameBatchSize))).ToArray());
 
-                            if (client.NoMoreRecordedFrames)
-                                noMoreRecordedFrames = true;
-                        }
-                    }
-                }
+                // The recording of one of the clients ended, so the frames of the others are not saved; they are
+                // released by ClearRecordedFrames
+                if (clients.Count == 0 || clients.Any(client => client.RecordedFrames.Count == 0))
+                    return false;
 
-                // Store received frame from each client in the provided lists
-                lock (clientLock)
-                {
-                    foreach (var client in liveScanClients)
-                    {
-                        frameColors.Add(client.FrameColors);
-                        framesVertices.Add(client.FrameVertices);
-                    }
-                }
+                foreach (var client in clients)
+                    frames.Add(client.RecordedFrames.Dequeue());
             }
 
-            if (noMoreRecordedFrames)
-                return false;
-            else
-                return true;
+            return true;
+        }
+
+        /// <summary>
+        /// Gets the next depth frame of each connected camera client, from all the clients at once
+        /// </summary>
+        /// <param name="frames">Frames to fill, one per client in the order of the clients; they are added or removed to
+        /// match the clients, and their buffers are reused</param>
+        /// <param name="timeoutMs">Maximum time to wait for the frames</param>
+        /// <returns>True if every client sent its frame in time</returns>
+        public bool GetDepthFrames(List<CameraClient.DepthFrame> frames, int timeoutMs)
+        {
+            List<CameraClient> clients;
+
+            using (clientLock.Enter())
+            {
+                clients = liveScanClients.ToList();
+            }
+
+            while (frames.Count < clients.Count)
+                frames.Add(new CameraClient.DepthFrame());
+
+            frames.RemoveRange(clients.Count, frames.Count - clients.Count);
+
+            Task<bool>[] requests = clients.Select((client, i) => Task.Run(() => client.AcquireDepthFrame(frames[i], timeoutMs))).ToArray();
+            Task.WaitAll(requests);
+
+            return clients.Count > 0 && requests.All(request => request.Result);
         }
 
         /// <summary>
@@ -397,7 +687,11 @@ namespace LiveScanServer
         /// </summary>
         /// <param name="frameColors">List where to store the frame's colors</param>
         /// <param name="framesVertices">List where to store the frame's vertices</param>
-        public void GetLatestFrame(ref List<List<byte>> frameColors, ref List<List<float>> framesVertices)
+        /// <param name="frameVersions">Optional list where to store the version of the frame of each camera</param>
+        /// <param name="frameTrace">Optional trace where to store the times of the camera frames</param>
+        /// <param name="frameNormals">Optional list where to store the normals of each camera, empty for the cameras without them</param>
+        public void GetLatestFrame(ref List<FrameBuffer<byte>> frameColors, ref List<FrameBuffer<float>> framesVertices, List<ulong> frameVersions = null,
+            FrameTrace frameTrace = null, List<FrameBuffer<byte>> frameNormals = null)
         {
             int count = frameColors.Count;
 
@@ -409,47 +703,67 @@ namespace LiveScanServer
 
             frameColors.Clear();
             framesVertices.Clear();
+            frameVersions?.Clear();
+            frameNormals?.Clear();
 
-            lock (frameRequestLock)
+            using (frameRequestLock.Enter())
             {
-                // Request the latest frame from each connected client
-                lock (clientLock)
+                using (clientLock.Enter())
                 {
-                    foreach (var client in liveScanClients)
-                    {
-                        client.IsLatestFrameReceived = false;
-                        client.RequestLatestFrame();
-                    }
+                    frameClients.Clear();
+                    frameClients.AddRange(liveScanClients);
                 }
 
-                // Wait for all frames to be received
-                bool allGathered = false;
+                // Wait for the frames without holding the client lock; the clients which miss the deadline reuse their
+                // previous frame or are left out, as set in the settings
+                frameAssembler.Assemble(frameClients, frameColors, framesVertices, frameVersions, frameTrace, frameNormals);
+            }
+        }
 
-                while (!allGathered)
+        /// <summary>
+        /// Sets the largest size the receivers render the documents at, so that the clients downscale their crops to it
+        /// </summary>
+        /// <param name="width">Largest width, in pixels; 0 for no limit</param>
+        /// <param name="height">Largest height, in pixels; 0 for no limit</param>
+        public void SetMaxDocumentSize(int width, int height)
+        {
+            using (clientLock.Enter())
+            {
+                maxDocumentWidth = width;
+                maxDocumentHeight = height;
+
+                foreach (var client in liveScanClients)
                 {
-                    allGathered = true;
+                    client.SetMaxDocumentSize(width, height);
+                }
+            }
+        }
 
-                    lock (clientLock)
-                    {
-                        foreach (var client in liveScanClients)
-                        {
-                            if (!client.IsLatestFrameReceived)
-                            {
-                                allGathered = false;
-                                break;
-                            }
-                        }
-                    }
+        /// <summary>
+        /// Tells each connected client to save the last seconds of its frame ring to a recording of its own
+        /// </summary>
+        public void SaveFrameRing(int seconds)
+        {
+            using (clientLock.Enter())
+            {
+                foreach (var client in liveScanClients)
+                {
+                    client.SaveFrameRing(seconds);
                 }
+            }
+        }
 
-                // Store received frames from each client in the provided lists
-                lock (clientLock)
+        /// <summary>
+        /// Tells each connected client to learn the static clutter of the empty scene from its next frames, and to
+        /// remove the points in it from then on; 0 frames clears the mask of the clients, and -1 uses their default
+        /// </summary>
+        public void LearnExclusionMask(int numFrames)
+        {
+            using (clientLock.Enter())
+            {
+                foreach (var client in liveScanClients)
                 {
-                    foreach(var client in liveScanClients)
-                    {
-                        frameColors.Add(client.FrameColors);
-                        framesVertices.Add(client.FrameVertices);
-                    }
+                    client.LearnExclusionMask(numFrames);
                 }
             }
         }
@@ -459,11 +773,15 @@ namespace LiveScanServer
         /// </summary>
         public void ClearRecordedFrames()
         {
-            lock (clientLock)
+            // The batches of TryGetRecordedFrame are read under the recorded frame lock alone
+            using (recordedFrameLock.Enter())
             {
-                foreach (var client in liveScanClients)
+                using (clientLock.Enter())
                 {
-                    client.ClearRecordedFrames();
+                    foreach (var client in liveScanClients)
+                    {
+                        client.ClearRecordedFrames();
+                    }
                 }
             }
         }
@@ -476,7 +794,7 @@ namespace LiveScanServer
                 return;
 
             // Check that each client has the STANDALONE role
-            lock (clientLock)
+            using (clientLock.Enter())
             {
                 foreach (var client in liveScanClients)
                 {
@@ -503,7 +821,7 @@ namespace LiveScanServer
             // Check if all subordinate clients have started now
             bool allSubsStarted = true;
 
-            lock (clientLock)
+            using (clientLock.Enter())
             {
                 foreach (var client in liveScanClients)
                 {
@@ -514,10 +832,10 @@ namespace LiveScanServer
                     }
                 }
 
-                waitForSubordinateStart = false;
-
                 if (allSubsStarted)
                 {
+                    waitForSubordinateStart = false;
+
                     // Start the master client
                     foreach (var client in liveScanClients)
                     {
@@ -537,14 +855,94 @@ namespace LiveScanServer
             allDevicesInitialized = true;
         }
 
-        private void OnConfirmCalibrated()
+        private void StartClientEventDispatch()
         {
-            ClientListChanged();
+            if (clientEventThread != null)
+            {
+                return;
+            }
+
+            isDispatchingClientEvents = true;
+            clientEventThread = new Thread(DispatchClientEvents)
+            {
+                IsBackground = true,
+                Name = "Client events"
+            };
+            clientEventThread.Start();
         }
 
-        private void OnReceiveSerialNumber()
+        /// <summary>
+        /// Handles the events of the clients as they arrive, taking all those pending at once so that a burst of events
+        /// is handled as a single batch
+        /// </summary>
+        private void DispatchClientEvents()
         {
-            ClientListChanged();
+            ClientEvent[] events = new ClientEvent[ClientEventBatchSize];
+
+            while (isDispatchingClientEvents)
+            {
+                int numEvents = CameraClient.WaitForEvents(events, ClientEventWaitMs);
+                bool isClientListChanged = false;
+
+                for (int i = 0; i < numEvents; i++)
+                {
+                    isClientListChanged |= DispatchClientEvent(ref events[i]);
+                }
+
+                // The main window is updated once for the whole batch
+                if (isClientListChanged)
+                {
+                    ClientListChanged();
+                }
+            }
+        }
+
+        /// <returns>True if the event changed the client list shown by the main window</returns>
+        private bool DispatchClientEvent(ref ClientEvent clientEvent)
+        {
+            CameraClient client;
+
+            using (clientLock.Enter())
+            {
+                if (clientEvent.ClientIndex < 0 || clientEvent.ClientIndex >= liveScanClients.Count)
+                {
+                    return false;
+                }
+
+                client = liveScanClients[clientEvent.ClientIndex];
+            }
+
+            if (!client.HandleEvent(ref clientEvent))
+            {
+                return false;
+            }
+
+            switch (clientEvent.Type)
+            {
+                case ClientEventType.SerialNumber:
+                case ClientEventType.LoadShed:
+                    return true;
+
+                case ClientEventType.Calibrated:
+                    // The other cameras share out their voxels with the new pose
+                    SendCameraPoses();
+                    return true;
+
+                case ClientEventType.SyncState:
+                    OnConfirmSyncState(clientEvent.ClientIndex, CameraClient.ToSyncState(clientEvent.Value));
+                    return true;
+
+                case ClientEventType.MasterRestart:
+                    OnConfirmMasterRestart(clientEvent.ClientIndex);
+                    return false;
+
+                case ClientEventType.Document:
+                    OnReceiveDocument(clientEvent.ClientIndex);
+                    return false;
+
+                default:
+                    return false;
+            }
         }
 
         private void OnConfirmSyncState(int clientIndex, SyncState state)
@@ -569,9 +967,8 @@ namespace LiveScanServer
                 ConfirmSyncDisabled();
             }
 
-            // Update client status
+            // Update client status; the client list is updated once the batch of events is handled
             client.UpdateSocketState();
-            ClientListChanged();
         }
 
         private void OnConfirmMasterRestart(int clientIndex)
@@ -581,16 +978,22 @@ namespace LiveScanServer
 
         private void OnReceiveDocument(int clientIndex)
         {
-            lock (documentDataLock)
+            using (documentDataLock.Enter())
             {
                 CameraClient client = liveScanClients[clientIndex];
 
-                if (client.DocumentData == null || client.DocumentData.Count == 0)
+                if (client.DocumentJpeg == null || client.DocumentJpeg.Length == 0)
                 {
                     return;
                 }
 
-                DocumentInfo.Data = new List<byte>(client.DocumentData);
+                // Every camera detects the documents in its view, so only the best crop of each document is forwarded
+                if (!documentArbiter.Submit(clientIndex, client.DocumentSignature, client.DocumentScore))
+                {
+                    return;
+                }
+
+                DocumentInfo.Jpeg = client.DocumentJpeg;
                 DocumentInfo.Score = client.DocumentScore; ;
                 DocumentInfo.Width = client.DocumentWidth; ;
                 DocumentInfo.Height = client.DocumentHeight; ;
@@ -598,6 +1001,17 @@ namespace LiveScanServer
             }
         }
 
+        /// <summary>
+        /// Sets how often a camera sends its frames to the document detection, lengthened while its crops lose the arbitration
+        /// </summary>
+        private void SetDocumentDetectionInterval(int clientIndex, int intervalMs)
+        {
+            if (clientIndex >= 0 && clientIndex < liveScanClients.Count)
+            {
+                liveScanClients[clientIndex].SetDocumentFrameInterval(intervalMs);
+            }
+        }
+
         // Calls event handler to modify the client list in the main window form
         private void ClientListChanged()
         {
@@ -18,11 +18,17 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 
 using System;
 using System.ComponentModel;
+using System.IO;
 using System.Linq;
+using System.Reflection;
 using System.Runtime.InteropServices;
+using System.Runtime.Serialization;
+using System.Runtime.Serialization.Formatters.Binary;
 
 namespace LiveScanServer
 {
+    // The settings are saved with the BinaryFormatter, so the fields added since the first version are optional; the
+    // settings saved before them take their defaults
     [Serializable]
     public class CameraSettings
     {
@@ -32,12 +38,54 @@ namespace LiveScanServer
         public bool Filter = false;
         public int NumFilterNeighbors = 10;
         public float FilterThreshold = 0.1f;
+        [OptionalField]
+        public FilterMode FilterMode = FilterMode.KdTree;
+
+        // The background is learned from the first frames after it is enabled, so the Holoport should be empty then
+        [OptionalField]
+        public BackgroundMode BackgroundMode = BackgroundMode.Kept;
 
         public BindingList<MarkerPose> MarkerPoses = new BindingList<MarkerPose>();
 
-        public int NumICPIterations = 10;
+        [OptionalField]
+        public int NumICPIterations = 10; // Maximum of each resolution level, which stops once it converged
         public int NumRefineIterations = 2;
 
+        // The pose refinement aligns voxel grids of the frames coarse to fine, from this voxel size (in meters) halved
+        // at each level, and ends at full resolution
+        [OptionalField]
+        public int NumICPLevels = 3;
+        [OptionalField]
+        public float ICPCoarsestVoxelSize = 0.04f;
+
+        // Each level aligns at most this many points of each camera, those in the overlap with the other cameras, spread
+        // over the directions of their normals; 0 aligns all the points
+        [OptionalField]
+        public int ICPMaxSamplesPerCamera = 4000;
+
+        // Refine the poses from the depth frames of the cameras instead, matching the points of each camera by projecting
+        // them into the frames of the others; one pixel out of ProjectiveSampleStep is matched in each direction, and
+        // matches farther apart than ProjectiveMaxDistance (in meters) are rejected
+        [OptionalField]
+        public bool IsProjectiveRefinementEnabled = false;
+        [OptionalField]
+        public int ProjectiveSampleStep = 4;
+        [OptionalField]
+        public float ProjectiveMaxDistance = 0.05f;
+
+        // Check the calibration of the cameras every CalibrationMonitorInterval seconds while they stream, and correct
+        // the drifts up to MaxDriftCorrectionMm and MaxDriftCorrectionDegrees when enabled
+        [OptionalField]
+        public bool IsCalibrationMonitorEnabled = false;
+        [OptionalField]
+        public int CalibrationMonitorInterval = 10;
+        [OptionalField]
+        public bool IsDriftCorrectionEnabled = false;
+        [OptionalField]
+        public float MaxDriftCorrectionMm = 10.0f;
+        [OptionalField]
+        public float MaxDriftCorrectionDegrees = 1.0f;
+
         public bool MergeScansForSave = true;
         public bool SaveAsBinaryPLY = true;
 
@@ -46,6 +94,256 @@ namespace LiveScanServer
         public bool IsAutoExposureEnabled = true;
         public int ExposureStep = 200;
 
+        // Locks the exposure of all the cameras to the same step, starting from ExposureStep, which the server moves
+        // slowly towards the target mean luma of their points (0 to 255), instead of the auto exposure of each camera
+        [OptionalField]
+        public bool IsExposureCoordinationEnabled = false;
+        [OptionalField]
+        public int ExposureTargetLuma = 110;
+
+        [OptionalField]
+        public bool IsGpuProcessingEnabled = false;
+
+        // Number of threads of the task scheduler shared by the clients; 0 uses one thread per hardware thread
+        [OptionalField]
+        public int NumWorkerThreads = 0;
+
+        // Receive the framesets from the camera SDK callback instead of waiting for them; standalone cameras restart to apply it
+        [OptionalField]
+        public bool IsFrameCallbackEnabled = false;
+
+        // Generate the point clouds with the alignment and point cloud filters of the camera SDK; GPU processing takes precedence
+        [OptionalField]
+        public bool IsSdkProcessingEnabled = false;
+
+        // Each point samples about one color pixel, so a lower color resolution mostly saves bandwidth. The documents are
+        // cropped from short high resolution bursts when enabled
+        [OptionalField]
+        public ColorResolution ColorResolution = ColorResolution.Res2560x1440;
+        [OptionalField]
+        public bool IsColorMjpgEnabled = false;
+        [OptionalField]
+        public bool IsDocumentBurstEnabled = true;
+
+        // Stream YUYV or NV12 color, or decode MJPG to NV12, and only convert the colors of the sampled points to RGB
+        // instead of whole frames. The point clouds are then generated on the CPU
+        [OptionalField]
+        public bool IsColorYuvEnabled = false;
+
+        // Smooth the depth over time and with a median filter before generating the point clouds; cleaner depth
+        // leaves fewer outliers, so the neighbour filter can often be disabled
+        [OptionalField]
+        public bool IsDepthDenoiseEnabled = false;
+
+        // Number of points each camera should send per frame; the cameras coarsen their voxel grid to stay close to it.
+        // 0 keeps the finest voxel grid
+        [OptionalField]
+        public int PointBudget = 0;
+
+        // Size of the capture volume on each axis, in meters, centered in front of the origin of the calibration. The
+        // default range fits in one byte per axis; larger ranges are sent to the receivers which decode wide frames
+        [OptionalField]
+        public float CaptureRange = 0.3f;
+
+        // Seconds of frames each client keeps in memory, for the last ones to be saved after the fact; 0 disables it.
+        // Each second holds 30 frames of the client, about 80 MB at 300 000 points per frame
+        [OptionalField]
+        public int RingRecordingSeconds = 0;
+
+        // zstd level of the frames the clients record; 0 records them uncompressed. Delta frames store the difference
+        // with the previous frame, which is smaller when the points of successive frames stay in the same order
+        [OptionalField]
+        public int RecordingCompressionLevel = 3;
+        [OptionalField]
+        public bool IsRecordingDeltaEnabled = false;
+
+        // Records the cameras of each process (the server, or a capture node) to a single file which interleaves their
+        // frames in the order they are recorded, written by one writer instead of one per camera. The frames of the
+        // shared recordings are not delta compressed.
+        [OptionalField]
+        public bool IsInterleavedRecordingEnabled = false;
+
+        // Record the raw depth and color frames of each camera, with their camera parameters, for as long as this is set.
+        // The raw recordings are replayed instead of the cameras when the server is started with -replay, to benchmark
+        // the processing of the clients on the same frames; they take about 350 MB per second and camera at 2560x1440
+        [OptionalField]
+        public bool IsRawRecordingEnabled = false;
+
+        // Trim the buffers of the clients to what their frames need and release the buffers of the disabled features,
+        // so that more cameras fit in the memory of one host; the buffers grow back when the frames get larger again
+        [OptionalField]
+        public bool IsLeanMemoryEnabled = false;
+
+        // Share out the voxels of the capture volume between the calibrated cameras, each voxel going to the nearest
+        // camera facing it, so that each camera only sends the points of its own voxels and the overlap between the
+        // cameras is not sent twice. The calibration does not tell what each camera sees, so the surfaces occluded from
+        // the camera owning them are left with holes
+        [OptionalField]
+        public bool IsCameraOwnershipEnabled = false;
+
+        // Estimate the normal of each point in the clients, from its neighbours in the depth frame, and send it in one
+        // byte to the receivers which request surfels, so that they draw the points as discs lying on the surface
+        // instead of squares facing the viewer; the surfaces are then covered with fewer points
+        [OptionalField]
+        public bool IsNormalEstimationEnabled = false;
+
+        // Only process a frame in the clients once the server has taken the previous one, instead of every frame of
+        // the camera, so that the clients do not spend their time on frames which are never read; while nobody reads
+        // them, the clients refresh their frame twice per second. It has no effect while the ring is recording
+        [OptionalField]
+        public bool IsConsumerPacingEnabled = false;
+
+        // Process one of every FrameDecimation frames of the cameras, to lower the frame rate of the clients below
+        // that of the cameras; 1 processes every frame
+        [OptionalField]
+        public int FrameDecimation = 1;
+
+        // Sample the colors of the points from a copy of the color frames downscaled by two, made as they are
+        // acquired, which is faster on the CPU path at the larger color resolutions: the samples of neighbouring points
+        // stay closer in memory, and each color is averaged over the region a depth pixel covers
+        [OptionalField]
+        public bool IsColorDownscaleEnabled = false;
+
+        // Depth stream of the cameras. The binned stream averages 2x2 pixels, for a quarter of the points over the same
+        // field of view. In Auto, a camera switches to it while the point budget keeps its voxels coarser than the
+        // binned pixels, and back once the budget allows finer voxels; each switch restarts the pipeline of the camera
+        // for a few frames, but not the camera. Replayed recordings keep their depth stream
+        [OptionalField]
+        public DepthBinningMode DepthBinningMode = DepthBinningMode.Unbinned;
+
+        // Time each frame of a client may take, but the wait for its camera, in milliseconds. Over it, the client sheds
+        // optional work one level at a time, starting with the documents, then the neighbour filter of every other frame,
+        // then coarser voxels, and restores it once the frames take less than 70% of it. 0 never sheds any work
+        [OptionalField]
+        public int FrameTimeBudgetMs = 0;
+
+        // Processors of the frame loop and the capture thread of each camera. NumaNode keeps each camera on the NUMA
+        // node of its USB controller, so that its frames and buffers stay in the memory of that node; the cameras whose
+        // node is unknown are spread over the nodes. CoreSet gives each camera CoresPerCamera logical processors of its
+        // own, in the order of the cameras of the computer. The workers shared by the cameras are not pinned
+        [OptionalField]
+        public ThreadAffinityMode ThreadAffinityMode = ThreadAffinityMode.None;
+        [OptionalField]
+        public int CoresPerCamera = 4;
+
+        // Backs the frame buffers of the clients, such as the depth and the points, with large pages, which saves the
+        // TLB misses of sweeping them. It needs the "Lock pages in memory" right for the account running the clients,
+        // and applies to the buffers allocated after it is set
+        [OptionalField]
+        public bool IsLargePagesEnabled = false;
+
+        // Foveated density: the regions of interest of each frame, the parts which move along with their neighbours and
+        // the last detected document, keep the voxels of the point budget, and the voxels of the rest of the frame are
+        // PeripheralVoxelScale times larger on each side. The regions stay for half a second after the motion stops, and
+        // three seconds after the document was last detected. 1 keeps the same voxels over the whole frame
+        [OptionalField]
+        public int PeripheralVoxelScale = 1;
+
+        // Fills the small holes of the depth, such as those of dark and specular surfaces, with the nearest depth around
+        // them when it is about the same on all sides, before generating the point clouds, so that the surfaces are
+        // rendered without gaps at a smaller point size
+        [OptionalField]
+        public bool IsDepthHoleFillEnabled = false;
+
+        // Generates the points of each camera only from the region of its depth frames which held the content of the
+        // bounds over the last second, plus a margin, rather than from the whole projection of the bounds. The region
+        // grows back on the next frame on the sides the content reaches, and the whole frame is processed every second
+        [OptionalField]
+        public bool IsAdaptiveRoiEnabled = false;
+
+        // Reuses the keep or reject decisions of the neighbour filter of the previous frame for the points which stayed
+        // in the same pixel and voxel, so that the neighbours are only searched for the points which moved; an eighth of
+        // the points are decided again each frame, in turn
+        [OptionalField]
+        public bool IsTemporalFilterEnabled = false;
+
+        // Has the clients publish their last frame again, rather than generating and processing the points, for the frames
+        // whose depth did not change since that frame; the frames of a static scene are processed at least twice a second
+        [OptionalField]
+        public bool IsStaticFrameReuseEnabled = false;
+
+        // The cameras send their color and depth frames in framesets which do not always hold a frame of each stream
+        // captured together. The frames are paired with the nearest frame of the other stream whose timestamp is within
+        // the tolerance, in microseconds, instead of being dropped; 0 only pairs the frames of the same timestamp. It is
+        // kept under half the frame period, so that each depth frame has a single color frame to be paired with
+        [OptionalField]
+        public int FramePairingToleranceUs = 5000;
+
+        // Live frames are assembled from the latest frame of each camera. Cameras without a new frame within the sync
+        // window of the newest one by the deadline are stale, and reuse their previous frame or are left out. The
+        // timestamps of the frames are converted from the clock of each camera, and each node, to the system clock of
+        // the server, so the window compares the cameras of all the computers; 0 only waits for a new frame
+        [OptionalField]
+        public int FrameDeadlineMs = 100;
+        [OptionalField]
+        public int FrameSyncWindowMs = 0;
+        [OptionalField]
+        public bool IsStaleFrameReused = true;
+
+        // The synced cameras capture at the same time, so their clients would all process their frames at once. Each
+        // one then starts processing at the fraction of the frame period given by its place on the sync chain, which
+        // flattens the load of the cameras of a host over the period; the frames keep their capture timestamps, but
+        // reach the server up to a frame period later, so the deadline needs that much margin
+        [OptionalField]
+        public bool IsProcessingStaggered = false;
+
+        // Quantization step of the chroma of the colors sent to the receivers which decode octrees; 1 is lossless, and
+        // larger steps trade color accuracy for bandwidth
+        [OptionalField]
+        public int TransferChromaStep = 1;
+
+        // Time after a frame is encoded past which its progressive refinements are no longer sent, in milliseconds; the
+        // receivers of progressive frames then keep the coarser level they have
+        [OptionalField]
+        public int TransferFrameDeadlineMs = 33;
+
+        // Frame rate the scale of the frames sent to the receivers is adapted to, from the frame time of the slowest one
+        [OptionalField]
+        public float TransferTargetFps = 30.0f;
+
+        // Throughput the documents are sent to each receiver at, at most, in kilobytes per second, so that a new document
+        // does not take the bandwidth of the point clouds on the same link; 0 sends them as fast as the link allows
+        [OptionalField]
+        public int TransferDocumentMaxKBps = 1000;
+
+        // Whether the documents are transcoded, once each, into the ETC2 textures the receivers which ask for them upload
+        // without decoding them; those receivers get the JPEG images otherwise
+        [OptionalField]
+        public bool IsDocumentTextureCompressionEnabled = true;
+
+        // Simulcast: each frame is encoded for up to 3 quality tiers, each with the scale of the tier above it times the
+        // ratio and a doubled chroma step, and each receiver is moved to the finest tier it takes at the target frame
+        // rate. The finest tier has the scale set by the number of points, and the coarsest tier follows the rate
+        // control. 1 encodes a single tier, whose scale follows the slowest receiver.
+        [OptionalField]
+        public int TransferTierCount = 1;
+        [OptionalField]
+        public float TransferTierScaleRatio = 0.7f;
+
+        // Fuse the frames of all the cameras into a truncated signed distance field over the bounds and the capture
+        // volume, on the GPU, and send its surface instead of their points. The surface has about one point per voxel of
+        // FusionVoxelSize meters, the points update the voxels within FusionTruncation meters of them, and the weight of
+        // the previous frames is multiplied by FusionDecay at each new frame, so that moving surfaces do not linger
+        [OptionalField]
+        public bool IsFusionEnabled = false;
+        [OptionalField]
+        public float FusionVoxelSize = 0.003f;
+        [OptionalField]
+        public float FusionTruncation = 0.01f;
+        [OptionalField]
+        public float FusionDecay = 0.6f;
+
+        // Extract the fused surface as a triangle mesh over cubes of FusionMeshStep voxels on each side, or as points
+        // when 0. Larger steps decimate the mesh as long as the cubes stay within the truncation distance. The
+        // receivers which request meshes get its triangles, and the others its vertices as points
+        [OptionalField]
+        public int FusionMeshStep = 0;
+
+        // Draw the live view of the server with one point per voxel of about the size of a pixel, and all the points only
+        // once it is zoomed in past the spacing of the points; toggled with the L key of the view
+        [OptionalField]
+        public bool IsViewLodEnabled = true;
+
         public CameraSettings()
         {
             MinBounds[0] = -5.0f;
@@ -57,6 +355,48 @@ namespace LiveScanServer
             MaxBounds[2] = 5.0f;
         }
 
+        /// <summary>
+        /// Sets the defaults of the fields, which the deserialization then overwrites with those of the file; the
+        /// constructor and the initializers of the fields do not run when the settings are deserialized
+        /// </summary>
+        [OnDeserializing]
+        private void SetDefaults(StreamingContext context)
+        {
+            CameraSettings defaults = new CameraSettings();
+
+            foreach (FieldInfo field in typeof(CameraSettings).GetFields(BindingFlags.Instance | BindingFlags.Public | BindingFlags.NonPublic))
+                field.SetValue(this, field.GetValue(defaults));
+        }
+
+        // File the settings are kept in from one run to the next, in the working directory
+        public const string DefaultPath = "settings.bin";
+
+        /// <summary>
+        /// Reads the settings saved to a file by a previous run, or returns the default settings if it cannot be read
+        /// </summary>
+        public static CameraSettings Load(string path)
+        {
+            try
+            {
+                using (Stream stream = new FileStream(path, FileMode.Open, FileAccess.Read))
+                {
+                    return (CameraSettings)new BinaryFormatter().Deserialize(stream);
+                }
+            }
+            catch (Exception)
+            {
+                return new CameraSettings();
+            }
+        }
+
+        public void Save(string path)
+        {
+            using (Stream stream = new FileStream(path, FileMode.Create, FileAccess.Write))
+            {
+                new BinaryFormatter().Serialize(stream, this);
+            }
+        }
+
         /// <summary>
         /// Converts the current C# settings object into a format compatible with C++ for communication with the LiveScanClient processes
         /// </summary>
@@ -72,11 +412,61 @@ namespace LiveScanServer
                 Filter = Filter,
                 NumFilterNeighbors = NumFilterNeighbors,
                 FilterThreshold = FilterThreshold,
+                FilterMode = (int)FilterMode,
+                BackgroundMode = (int)BackgroundMode,
                 NumMarkers = MarkerPoses.Count,
                 IsAutoExposureEnabled = IsAutoExposureEnabled,
-                ExposureStep = ExposureStep
+                ExposureStep = ExposureStep,
+                IsGpuProcessingEnabled = IsGpuProcessingEnabled,
+                NumWorkerThreads = NumWorkerThreads,
+                IsFrameCallbackEnabled = IsFrameCallbackEnabled,
+                IsSdkProcessingEnabled = IsSdkProcessingEnabled,
+                IsColorMjpgEnabled = IsColorMjpgEnabled,
+                IsDocumentBurstEnabled = IsDocumentBurstEnabled,
+                IsDepthDenoiseEnabled = IsDepthDenoiseEnabled,
+                PointBudget = PointBudget,
+                CaptureRange = CaptureRange,
+                RingRecordingSeconds = RingRecordingSeconds,
+                RecordingCompressionLevel = RecordingCompressionLevel,
+                IsRecordingDeltaEnabled = IsRecordingDeltaEnabled,
+                IsRawRecordingEnabled = IsRawRecordingEnabled,
+                IsLeanMemoryEnabled = IsLeanMemoryEnabled,
+                IsNormalEstimationEnabled = IsNormalEstimationEnabled,
+                IsConsumerPacingEnabled = IsConsumerPacingEnabled,
+                FrameDecimation = FrameDecimation,
+                IsColorDownscaleEnabled = IsColorDownscaleEnabled,
+                DepthBinningMode = (int)DepthBinningMode,
+                FrameTimeBudgetMs = FrameTimeBudgetMs,
+                ThreadAffinityMode = (int)ThreadAffinityMode,
+                CoresPerCamera = CoresPerCamera,
+                IsLargePagesEnabled = IsLargePagesEnabled,
+                PeripheralVoxelScale = PeripheralVoxelScale,
+                IsDepthHoleFillEnabled = IsDepthHoleFillEnabled,
+                FramePairingToleranceUs = FramePairingToleranceUs,
+                IsColorYuvEnabled = IsColorYuvEnabled,
+                IsProcessingStaggered = IsProcessingStaggered,
+                IsAdaptiveRoiEnabled = IsAdaptiveRoiEnabled,
+                IsTemporalFilterEnabled = IsTemporalFilterEnabled,
+                IsInterleavedRecordingEnabled = IsInterleavedRecordingEnabled,
+                IsStaticFrameReuseEnabled = IsStaticFrameReuseEnabled
             };
 
+            switch (ColorResolution)
+            {
+                case ColorResolution.Res1920x1080:
+                    native.ColorWidth = 1920;
+                    native.ColorHeight = 1080;
+                    break;
+                case ColorResolution.Res1280x720:
+                    native.ColorWidth = 1280;
+                    native.ColorHeight = 720;
+                    break;
+                default:
+                    native.ColorWidth = 2560;
+                    native.ColorHeight = 1440;
+                    break;
+            }
+
             // Allocate array for the markers
             var nativeMarkers = new NativeMarkerPose[MarkerPoses.Count];
 
@@ -0,0 +1,181 @@
+﻿/***************************************************************************\
+
+Module Name:  DocumentArbiter.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module arbitrates between the documents sent by the cameras, which
+each detect the same sheets of paper on their own. The documents are told
+apart by the signatures the cameras send with them, and only the best scoring
+crop of each document within a time window is forwarded to the receivers.
+The cameras whose crops lose are asked to detect less often for a while.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+
+namespace LiveScanServer
+{
+    public sealed class DocumentArbiter
+    {
+        // Documents received within this time of each other are compared; a document kept is forgotten once no camera
+        // sent it for that long
+        private const long ArbitrationWindowMs = 5000;
+
+        // The cameras see the documents from different points of view, so their signatures match more loosely than the
+        // ones each camera compares between its own detections
+        private const float IdentityThreshold = 0.2f;
+
+        // Detection interval of the cameras whose crops lost, and for how long they keep it
+        private const int DefaultDetectionIntervalMs = 1000;
+        private const int ThrottledDetectionIntervalMs = 5000;
+        private const long ThrottleDurationMs = 15000;
+
+        private class DocumentCandidate
+        {
+            public byte[] Signature;
+            public float Score;
+            public int ClientIndex;
+            public long LastSeenMs;
+        }
+
+        private readonly List<DocumentCandidate> candidates = new List<DocumentCandidate>();
+        private readonly Dictionary<int, long> throttleEndTimes = new Dictionary<int, long>();
+        private readonly Stopwatch clock = Stopwatch.StartNew();
+        private readonly Action<int, int> setDetectionInterval;
+
+        /// <param name="setDetectionInterval">Sets the detection interval of a camera, in milliseconds</param>
+        public DocumentArbiter(Action<int, int> setDetectionInterval)
+        {
+            this.setDetectionInterval = setDetectionInterval;
+        }
+
+        /// <summary>
+        /// Arbitrates a document received from a camera. Not thread safe; the caller serializes the documents.
+        /// </summary>
+        /// <param name="clientIndex">Camera which sent the document</param>
+        /// <param name="signature">Signature of the document</param>
+        /// <param name="score">Score of the document, higher for the sharper and larger crops</param>
+        /// <returns>True if the document should be forwarded, false if another camera sent a better crop of it</returns>
+        public bool Submit(int clientIndex, byte[] signature, float score)
+        {
+            long nowMs = clock.ElapsedMilliseconds;
+
+            candidates.RemoveAll(candidate => nowMs - candidate.LastSeenMs > ArbitrationWindowMs);
+            RestoreExpiredThrottles(nowMs);
+
+            // Documents without a signature cannot be told apart, so they are always forwarded
+            if (signature == null || signature.Length == 0)
+                return true;
+
+            DocumentCandidate match = null;
+            float bestDifference = IdentityThreshold;
+
+            foreach (DocumentCandidate candidate in candidates)
+            {
+                float difference = CompareSignatures(signature, candidate.Signature);
+
+                if (difference < bestDifference)
+                {
+                    bestDifference = difference;
+                    match = candidate;
+                }
+            }
+
+            if (match == null)
+            {
+                candidates.Add(new DocumentCandidate { Signature = signature, Score = score, ClientIndex = clientIndex, LastSeenMs = nowMs });
+                return true;
+            }
+
+            match.LastSeenMs = nowMs;
+
+            // The cameras only send a document again once it changed or got sharper, so the camera which holds a
+            // document always replaces it
+            if (match.ClientIndex == clientIndex || score > match.Score)
+            {
+                if (match.ClientIndex != clientIndex)
+                {
+                    Throttle(match.ClientIndex, nowMs);
+                    Restore(clientIndex);
+                }
+
+                match.Signature = signature;
+                match.Score = score;
+                match.ClientIndex = clientIndex;
+                return true;
+            }
+
+            Throttle(clientIndex, nowMs);
+            return false;
+        }
+
+        /// <summary>
+        /// Forgets the documents and restores the detection interval of the throttled cameras, such as when the
+        /// cameras change
+        /// </summary>
+        public void Reset()
+        {
+            candidates.Clear();
+
+            foreach (int clientIndex in throttleEndTimes.Keys)
+                setDetectionInterval(clientIndex, DefaultDetectionIntervalMs);
+
+            throttleEndTimes.Clear();
+        }
+
+        private void Throttle(int clientIndex, long nowMs)
+        {
+            if (!throttleEndTimes.ContainsKey(clientIndex))
+                setDetectionInterval(clientIndex, ThrottledDetectionIntervalMs);
+
+            throttleEndTimes[clientIndex] = nowMs + ThrottleDurationMs;
+        }
+
+        private void RestoreExpiredThrottles(long nowMs)
+        {
+            List<int> expiredClients = null;
+
+            foreach (KeyValuePair<int, long> throttle in throttleEndTimes)
+            {
+                if (throttle.Value <= nowMs)
+                {
+                    if (expiredClients == null)
+                        expiredClients = new List<int>();
+
+                    expiredClients.Add(throttle.Key);
+                }
+            }
+
+            if (expiredClients == null)
+                return;
+
+            foreach (int clientIndex in expiredClients)
+                Restore(clientIndex);
+        }
+
+        private void Restore(int clientIndex)
+        {
+            if (throttleEndTimes.Remove(clientIndex))
+                setDetectionInterval(clientIndex, DefaultDetectionIntervalMs);
+        }
+
+        /// <returns>Mean difference of the intensities of the signatures, from 0.0 (same) to 1.0</returns>
+        private static float CompareSignatures(byte[] first, byte[] second)
+        {
+            if (first.Length != second.Length)
+                return 1.0f;
+
+            int sumDifference = 0;
+
+            for (int i = 0; i < first.Length; i++)
+                sumDifference += Math.Abs(first[i] - second[i]);
+
+            return sumDifference / (first.Length * 255.0f);
+        }
+    }
+}
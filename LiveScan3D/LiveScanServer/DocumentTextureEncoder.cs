@@ -0,0 +1,305 @@
+﻿/***************************************************************************\
+
+Module Name:  DocumentTextureEncoder.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module transcodes the JPEG documents into textures compressed in ETC2
+RGB8 blocks, for the receivers which upload them to their GPU as they are
+instead of decoding them. Each block holds 4x4 pixels in 8 bytes, a sixth of
+the RGB24 texture, and is written in the ETC1 modes, which ETC2 decodes the
+same way. The texture is sent in a small container, with its rows from the
+bottom, the order the textures are uploaded in.
+
+\***************************************************************************/
+
+using System;
+using System.Drawing;
+using System.Drawing.Imaging;
+using System.IO;
+using System.Runtime.InteropServices;
+
+namespace LiveScanServer
+{
+    public static class DocumentTextureEncoder
+    {
+        // Container of a compressed document: magic, format (byte), width and height of the texture, in pixels and a
+        // multiple of 4 (ushort each), size of the blocks (int), then the blocks. The magic cannot start a JPEG image,
+        // so the receivers tell the two apart from their first bytes.
+        public static readonly byte[] ContainerMagic = { (byte)'L', (byte)'S', (byte)'T', (byte)'X' };
+        public const byte Etc2Rgb8Format = 1;
+        public const int ContainerHeaderSize = 4 + 1 + 2 * sizeof(ushort) + sizeof(int);
+
+        private const int BlockSize = 8;
+
+        // Intensity modifiers of the ETC1 tables, the pixel indices 0 to 3 selecting +small, +large, -small and -large
+        private static readonly int[,] ModifierTables =
+        {
+            { 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+        };
+
+        /// <summary>
+        /// Decodes a JPEG document and compresses it into ETC2 RGB8 blocks. The texture is the document rounded up to a
+        /// multiple of 4 pixels, the pixels past its edges repeating them.
+        /// </summary>
+        /// <returns>The container of the texture; null if the image could not be decoded or is too large</returns>
+        public static byte[] Encode(byte[] jpeg)
+        {
+            int width;
+            int height;
+            byte[] pixels;
+
+            try
+            {
+                pixels = DecodeImage(jpeg, out width, out height);
+            }
+            catch (Exception)
+            {
+                return null;
+            }
+
+            int textureWidth = (width + 3) & ~3;
+            int textureHeight = (height + 3) & ~3;
+
+            if (width == 0 || height == 0 || textureWidth > ushort.MaxValue || textureHeight > ushort.MaxValue)
+                return null;
+
+            int numBlocksX = textureWidth / 4;
+            int numBlocksY = textureHeight / 4;
+            int blocksSize = numBlocksX * numBlocksY * BlockSize;
+
+            byte[] container = new byte[ContainerHeaderSize + blocksSize];
+            Buffer.BlockCopy(ContainerMagic, 0, container, 0, ContainerMagic.Length);
+            container[4] = Etc2Rgb8Format;
+            Buffer.BlockCopy(BitConverter.GetBytes((ushort)textureWidth), 0, container, 5, 2);
+            Buffer.BlockCopy(BitConverter.GetBytes((ushort)textureHeight), 0, container, 7, 2);
+            Buffer.BlockCopy(BitConverter.GetBytes(blocksSize), 0, container, 9, 4);
+
+            // RGB of the 16 pixels of a block, x major as the pixel indices of the blocks are
+            int[] block = new int[16 * 3];
+            int offset = ContainerHeaderSize;
+
+            for (int blockY = 0; blockY < numBlocksY; blockY++)
+            {
+                for (int blockX = 0; blockX < numBlocksX; blockX++)
+                {
+                    for (int x = 0; x < 4; x++)
+                    {
+                        int imageX = Math.Min(blockX * 4 + x, width - 1);
+
+                        for (int y = 0; y < 4; y++)
+                        {
+                            // The first row of the texture is the bottom row of the image
+                            int imageY = Math.Max(height - 1 - (blockY * 4 + y), 0);
+                            int pixel = (imageY * width + imageX) * 3;
+                            int index = (x * 4 + y) * 3;
+
+                            // The decoded pixels are BGR
+                            block[index] = pixels[pixel + 2];
+                            block[index + 1] = pixels[pixel + 1];
+                            block[index + 2] = pixels[pixel];
+                        }
+                    }
+
+                    ulong bits = EncodeBlock(block);
+
+                    for (int i = 0; i < BlockSize; i++)
+                        container[offset + i] = (byte)(bits >> (56 - 8 * i));
+
+                    offset += BlockSize;
+                }
+            }
+
+            return container;
+        }
+
+        /// <summary>
+        /// Decodes an image into tightly packed BGR24 pixels, from its top row
+        /// </summary>
+        private static byte[] DecodeImage(byte[] data, out int width, out int height)
+        {
+            using (MemoryStream stream = new MemoryStream(data))
+            using (Bitmap bitmap = new Bitmap(stream))
+            {
+                width = bitmap.Width;
+                height = bitmap.Height;
+
+                BitmapData bitmapData = bitmap.LockBits(new Rectangle(0, 0, width, height), ImageLockMode.ReadOnly, PixelFormat.Format24bppRgb);
+                byte[] pixels = new byte[width * height * 3];
+
+                try
+                {
+                    for (int y = 0; y < height; y++)
+                        Marshal.Copy(bitmapData.Scan0 + y * bitmapData.Stride, pixels, y * width * 3, width * 3);
+                }
+                finally
+                {
+                    bitmap.UnlockBits(bitmapData);
+                }
+
+                return pixels;
+            }
+        }
+
+        /// <summary>
+        /// Encodes 16 pixels in the ETC1 mode and split of the least error: the block is split into two halves, side by
+        /// side or one above the other, each with a base color and a table of modifiers added to it. The base colors are
+        /// coded differentially, with 5 bits, when they are close enough, and with 4 bits each otherwise.
+        /// </summary>
+        /// <param name="block">RGB of the pixels, x major</param>
+        /// <returns>The bits of the block, the first byte in the most significant ones</returns>
+        private static ulong EncodeBlock(int[] block)
+        {
+            ulong bestBits = 0;
+            long bestError = long.MaxValue;
+
+            for (int flip = 0; flip < 2; flip++)
+            {
+                int[] average0 = new int[3];
+                int[] average1 = new int[3];
+                AverageHalf(block, flip, 0, average0);
+                AverageHalf(block, flip, 1, average1);
+
+                int[] base0 = new int[3];
+                int[] base1 = new int[3];
+                bool isDifferential = true;
+
+                for (int c = 0; c < 3; c++)
+                {
+                    base0[c] = Quantize(average0[c], 31);
+                    base1[c] = Quantize(average1[c], 31);
+                    int difference = base1[c] - base0[c];
+
+                    if (difference < -4 || difference > 3)
+                        isDifferential = false;
+                }
+
+                ulong bits = (ulong)flip << 32;
+
+                if (isDifferential)
+                {
+                    bits |= 1UL << 33;
+
+                    for (int c = 0; c < 3; c++)
+                    {
+                        bits |= (ulong)base0[c] << (59 - 8 * c);
+                        bits |= (ulong)((base1[c] - base0[c]) & 7) << (56 - 8 * c);
+                        base0[c] = (base0[c] << 3) | (base0[c] >> 2);
+                        base1[c] = (base1[c] << 3) | (base1[c] >> 2);
+                    }
+                }
+                else
+                {
+                    for (int c = 0; c < 3; c++)
+                    {
+                        base0[c] = Quantize(average0[c], 15);
+                        base1[c] = Quantize(average1[c], 15);
+                        bits |= (ulong)base0[c] << (60 - 8 * c);
+                        bits |= (ulong)base1[c] << (56 - 8 * c);
+                        base0[c] = (base0[c] << 4) | base0[c];
+                        base1[c] = (base1[c] << 4) | base1[c];
+                    }
+                }
+
+                long error = EncodeHalf(block, flip, 0, base0, ref bits) + EncodeHalf(block, flip, 1, base1, ref bits);
+
+                if (error < bestError)
+                {
+                    bestError = error;
+                    bestBits = bits;
+                }
+            }
+
+            return bestBits;
+        }
+
+        // Whether a pixel, x major, is in the second half of a block
+        private static bool IsInSecondHalf(int pixel, int flip)
+        {
+            return flip == 0 ? pixel >= 8 : (pixel & 3) >= 2;
+        }
+
+        private static void AverageHalf(int[] block, int flip, int half, int[] average)
+        {
+            for (int pixel = 0; pixel < 16; pixel++)
+            {
+                if (IsInSecondHalf(pixel, flip) != (half == 1))
+                    continue;
+
+                for (int c = 0; c < 3; c++)
+                    average[c] += block[pixel * 3 + c];
+            }
+
+            for (int c = 0; c < 3; c++)
+                average[c] = (average[c] + 4) / 8;
+        }
+
+        private static int Quantize(int value, int maxValue)
+        {
+            return (value * maxValue + 127) / 255;
+        }
+
+        /// <summary>
+        /// Picks the table of modifiers of the least error for a half of a block, and the modifier of each of its pixels
+        /// </summary>
+        /// <returns>The squared error of the half</returns>
+        private static long EncodeHalf(int[] block, int flip, int half, int[] baseColor, ref ulong bits)
+        {
+            long bestError = long.MaxValue;
+            int bestTable = 0;
+            uint bestIndices = 0;
+
+            for (int table = 0; table < 8; table++)
+            {
+                long error = 0;
+                uint indices = 0;
+
+                for (int pixel = 0; pixel < 16; pixel++)
+                {
+                    if (IsInSecondHalf(pixel, flip) != (half == 1))
+                        continue;
+
+                    long bestPixelError = long.MaxValue;
+                    int bestIndex = 0;
+
+                    for (int index = 0; index < 4; index++)
+                    {
+                        int modifier = ModifierTables[table, index & 1] * ((index & 2) != 0 ? -1 : 1);
+                        long pixelError = 0;
+
+                        for (int c = 0; c < 3; c++)
+                        {
+                            int difference = Math.Min(Math.Max(baseColor[c] + modifier, 0), 255) - block[pixel * 3 + c];
+                            pixelError += difference * difference;
+                        }
+
+                        if (pixelError < bestPixelError)
+                        {
+                            bestPixelError = pixelError;
+                            bestIndex = index;
+                        }
+                    }
+
+                    error += bestPixelError;
+
+                    // The most significant bits of the indices are in the upper 16 bits, the least significant in the lower
+                    indices |= (uint)(((bestIndex >> 1) << (16 + pixel)) | ((bestIndex & 1) << pixel));
+                }
+
+                if (error < bestError)
+                {
+                    bestError = error;
+                    bestTable = table;
+                    bestIndices = indices;
+                }
+            }
+
+            bits |= (ulong)bestTable << (half == 0 ? 37 : 34);
+            bits |= bestIndices;
+
+            return bestError;
+        }
+    }
+}
@@ -7,6 +7,13 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module is the socket used to send document data to connected clients.
+The documents are written asynchronously; a document which arrives while the
+previous one is being written replaces any other one waiting, so a slow
+client only ever gets the latest document. The documents are written at a
+limited throughput, so that they leave the bandwidth of a link shared with
+the point clouds to them, and the receivers may send the size they render
+the documents at, which the cameras downscale their crops to, and ask for
+them as textures compressed for their GPU instead of JPEG images.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -16,105 +23,196 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 \***************************************************************************/
 
 using System;
-using System.Collections.Generic;
-using System.Drawing.Imaging;
-using System.Drawing;
-using System.IO;
+using System.Diagnostics;
 using System.Net.Sockets;
-using System.Linq;
+using System.Threading.Tasks;
 
 namespace LiveScanServer
 {
     public class DocumentTransferSocket : TransferSocketBase
     {
-        public DocumentTransferSocket(TcpClient clientSocket) : base(clientSocket) { }
+        // Request sent by the receivers with the largest size they render the documents at (ushort width, ushort height),
+        // in pixels, so that they are not sent at a resolution the receiver does not show
+        private const byte DocumentSizeRequest = 0;
+        private const int DocumentSizeRequestSize = 1 + 2 * sizeof(ushort);
 
-        public void SendDocument(List<byte> data, short width, short height)
+        // Request sent by the receivers which upload the documents as they are, followed by the texture format they take
+        // (byte), DocumentTextureEncoder.Etc2Rgb8Format or 0 for JPEG images
+        private const byte DocumentFormatRequest = 1;
+        private const int DocumentFormatRequestSize = 1 + 1;
+
+        // The documents are written in chunks of this size, paced to the throughput allowed
+        private const int ChunkSize = 16 * 1024;
+
+        // Send buffer of the socket, of a few chunks only, so that the pacing of the chunks holds on the link
+        private const int SendBufferSize = 4 * ChunkSize;
+
+        // Message waiting for the one being written to complete; null if none is
+        private byte[] pendingMessage = null;
+        private bool isSending = false;
+        private object sendLock = new object();
+
+        // Throughput the documents are written at, at most, in bytes per second; 0 for no limit
+        private volatile int maxBytesPerSecond = 0;
+
+        // Called when the receiver sent its document size
+        private Action onRequest;
+
+        // Largest size the receiver renders the documents at; 0 until it sent it
+        public int RequestedWidth { get; private set; } = 0;
+        public int RequestedHeight { get; private set; } = 0;
+
+        // Whether the receiver takes the documents compressed in ETC2 RGB8 blocks rather than as JPEG images
+        public bool IsCompressedTextureRequested { get; private set; } = false;
+
+        public DocumentTransferSocket(TcpClient clientSocket, Action onRequest) : base(clientSocket)
         {
-            try
+            this.onRequest = onRequest;
+
+            // The last chunk of a document is sent at once rather than held until the previous ones are acknowledged
+            SetSocketOptions(SendBufferSize);
+
+            Task.Run(() => ReceiveRequests());
+        }
+
+        /// <summary>
+        /// Starts sending a document, or keeps it for when the previous one is written
+        /// </summary>
+        /// <param name="jpeg">Document encoded as a JPEG image, or its compressed texture container</param>
+        /// <param name="width">Width of the document</param>
+        /// <param name="height">Height of the document</param>
+        /// <param name="maxBytesPerSecond">Throughput the document is written at, at most; 0 for no limit</param>
+        public void SendDocument(byte[] jpeg, short width, short height, int maxBytesPerSecond)
+        {
+            if (jpeg == null || jpeg.Length == 0 || width == 0 || height == 0)
             {
-                if (data == null || data.Count == 0 || width == 0 || height == 0)
-                {
-                    return;
-                }
+                return;
+            }
+
+            // Width and height of the document, size of the data, then the data
+            byte[] message = new byte[2 * sizeof(short) + sizeof(int) + jpeg.Length];
+            Buffer.BlockCopy(BitConverter.GetBytes(width), 0, message, 0, 2);
+            Buffer.BlockCopy(BitConverter.GetBytes(height), 0, message, 2, 2);
+            Buffer.BlockCopy(BitConverter.GetBytes(jpeg.Length), 0, message, 4, 4);
+            Buffer.BlockCopy(jpeg, 0, message, 8, jpeg.Length);
 
-                // Encode document data
-                byte[] dataArray = EncodeToJpeg(data.ToArray(), width, height);
+            this.maxBytesPerSecond = Math.Max(0, maxBytesPerSecond);
 
-                if (dataArray == null || dataArray.Length == 0)
+            lock (sendLock)
+            {
+                if (isSending)
                 {
+                    pendingMessage = message;
                     return;
                 }
 
-                // Send width and height of document first
-                WriteShort(width);
-                WriteShort(height);
+                isSending = true;
+            }
 
-                // Write data size
-                WriteInt(dataArray.Length);
+            Task.Run(() => WriteMessages(message));
+        }
 
-                // Write actual data
-                socket.GetStream().Write(dataArray, 0, dataArray.Length);
-            }
-            catch (Exception)
+        private async Task WriteMessages(byte[] message)
+        {
+            while (message != null)
             {
+                try
+                {
+                    await WritePaced(message);
+                }
+                catch (Exception)
+                {
+                    // The socket was closed; it is removed by the connection check of the server
+                }
+
+                lock (sendLock)
+                {
+                    message = pendingMessage;
+                    pendingMessage = null;
+                    isSending = message != null;
+                }
             }
         }
 
-        public static byte[] EncodeToJpeg(byte[] rawBgr, int width, int height, int quality = 90)
+        /// <summary>
+        /// Writes a message in chunks, waiting between them so that the throughput stays within maxBytesPerSecond
+        /// </summary>
+        private async Task WritePaced(byte[] message)
         {
-            if (rawBgr == null || rawBgr.Length != width * height * 3 || width <= 0 || height <= 0)
+            long startTime = Stopwatch.GetTimestamp();
+            BeginMessage();
+
+            for (int offset = 0; offset < message.Length; offset += ChunkSize)
             {
-                // Invalid input for JPEG encoding
-                return null;
+                int size = Math.Min(ChunkSize, message.Length - offset);
+                await WriteAsync(message, offset, size);
+
+                int bytesPerSecond = maxBytesPerSecond;
+
+                if (bytesPerSecond <= 0 || offset + size == message.Length)
+                    continue;
+
+                // Time at which the bytes written are due at the throughput allowed
+                long dueTime = startTime + (long)((double)(offset + size) * Stopwatch.Frequency / bytesPerSecond);
+                int delayMs = (int)((dueTime - Stopwatch.GetTimestamp()) * 1000 / Stopwatch.Frequency);
+
+                if (delayMs > 0)
+                    await Task.Delay(delayMs);
             }
+        }
 
-            // Create Bitmap
-            using (Bitmap bmp = new Bitmap(width, height, PixelFormat.Format24bppRgb))
-            {
-                var rect = new Rectangle(0, 0, width, height);
-                var data = bmp.LockBits(rect, ImageLockMode.WriteOnly, bmp.PixelFormat);
+        /// <summary>
+        /// Reads the requests of the receiver until it disconnects
+        /// </summary>
+        private async Task ReceiveRequests()
+        {
+            byte[] buffer = new byte[Math.Max(DocumentSizeRequestSize, DocumentFormatRequestSize)];
+            int numBytes = 0;
+            int requestSize = 1;
 
-                try
+            try
+            {
+                while (true)
                 {
-                    // Copy raw pixels into Bitmap
-                    int srcStride = width * 3;
-                    int dstStride = Math.Abs(data.Stride);
+                    // Only the bytes of the current request are read, so that the next one starts the buffer
+                    int numBytesRead = await socket.GetStream().ReadAsync(buffer, numBytes, requestSize - numBytes);
+
+                    if (numBytesRead == 0)
+                        break;
+
+                    numBytes += numBytesRead;
+
+                    // The requests of the unknown types are not sized, so the receiver is left at its last size and format
+                    if (buffer[0] == DocumentSizeRequest)
+                        requestSize = DocumentSizeRequestSize;
+                    else if (buffer[0] == DocumentFormatRequest)
+                        requestSize = DocumentFormatRequestSize;
+                    else
+                        break;
 
-                    unsafe
+                    if (numBytes < requestSize)
+                        continue;
+
+                    if (buffer[0] == DocumentSizeRequest)
                     {
-                        byte* dstRow = (byte*)data.Scan0;
-                        fixed (byte* pSrc = rawBgr)
-                        {
-                            byte* srcRow = pSrc;
-                            for (int y = 0; y < height; y++)
-                            {
-                                Buffer.MemoryCopy(srcRow, dstRow, dstStride, srcStride);
-                                srcRow += srcStride;
-                                dstRow += data.Stride; // includes padding
-                            }
-                        }
+                        RequestedWidth = BitConverter.ToUInt16(buffer, 1);
+                        RequestedHeight = BitConverter.ToUInt16(buffer, 3);
                     }
-                }
-                finally
-                {
-                    // Unlock Bitmap bits
-                    bmp.UnlockBits(data);
-                }
-
-                // Save Bitmap as JPEG
-                using (MemoryStream ms = new MemoryStream())
-                {
-                    var encoder = ImageCodecInfo.GetImageEncoders().First(e => e.FormatID == ImageFormat.Jpeg.Guid);
-                    using (EncoderParameters eps = new EncoderParameters(1))
+                    else
                     {
-                        eps.Param[0] = new EncoderParameter(System.Drawing.Imaging.Encoder.Quality, (long)quality);
-                        bmp.Save(ms, encoder, eps);
+                        IsCompressedTextureRequested = buffer[1] == DocumentTextureEncoder.Etc2Rgb8Format;
                     }
 
-                    return ms.ToArray();
+                    numBytes = 0;
+                    requestSize = 1;
+
+                    onRequest();
                 }
             }
+            catch (Exception)
+            {
+                // The socket was closed; it is removed by the connection check of the server
+            }
         }
     }
-}
\ No newline at end of file
+}
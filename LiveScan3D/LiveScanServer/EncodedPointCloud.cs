@@ -0,0 +1,630 @@
+﻿/***************************************************************************\
+
+Module Name:  EncodedPointCloud.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is a merged frame encoded once for all the point cloud receivers.
+The buffers are never modified once built, so all the receiver sockets write
+them at the same time. The delta frames are built on demand, once for each
+version the receivers start from, and so are their compressed versions and
+the packets they are split into for UDP. The split frames hold the positions
+of the geometry shared by the split receivers with its colors, or its colors
+alone for the receivers which already hold the geometry, and nothing more
+when they already hold its colors. Progressive frames are kept as the
+chunks of each level, which the receivers get until the deadline of the frame.
+Tiled frames are kept as the tiles of the byte grid, each with the version at
+which its points last changed, so that the sockets only send the tiles their
+receiver does not hold.
+The receivers which buffer the frames by their capture time get it before each
+frame, followed by the id and the camera timestamp of the frame for the
+receivers which trace its latency.
+The frames and the responses built from them are segments of arrays of the
+payload pool. The frame counts its holders, the encoder, the frame sets and
+the sockets sending it, and gives the arrays back once the last one released
+it.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.IO.Compression;
+using System.Threading;
+
+namespace LiveScanServer
+{
+    public sealed class EncodedPointCloud
+    {
+        // Types of the frames sent in response to a delta frame request
+        public const byte KeyframeType = 0;
+        public const byte DeltaFrameType = 1;
+
+        // Types of the frames sent in response to a split frame request
+        public const byte GeometryFrameType = 2;
+        public const byte ColorFrameType = 3;
+
+        // Full frame wire header: scale (short) followed by the number of vertices (int)
+        public const int HeaderSize = 6;
+
+        /// <summary>
+        /// Voxels held by the delta receivers at a given version of the frames
+        /// </summary>
+        public sealed class DeltaState
+        {
+            public readonly int Version;
+            public readonly short Scale;
+            public readonly Dictionary<int, int> Voxels; // Key: packed x, y, z bytes; value: packed color
+            public readonly bool IsKeyframe; // Whether all the colors were refreshed at this version
+
+            public DeltaState(int version, short scale, Dictionary<int, int> voxels, bool isKeyframe)
+            {
+                Version = version;
+                Scale = scale;
+                Voxels = voxels;
+                IsKeyframe = isKeyframe;
+            }
+        }
+
+        /// <summary>
+        /// Geometry held by the split receivers and its colors at a given version of the frames. The geometry keeps the
+        /// version at which it was sent, and the colors the version at which they last changed.
+        /// </summary>
+        public sealed class SplitState
+        {
+            public readonly int GeometryId;
+            public readonly int ColorVersion;
+            public readonly short Scale;
+            public readonly byte[] Positions; // Byte positions of the points, as in the full frames
+            public readonly byte[] Colors; // Color of each point of the geometry
+            public readonly Dictionary<int, int> Indices; // Point of each voxel (key: packed x, y, z bytes)
+
+            public int Count => Positions.Length / 3;
+
+            public SplitState(int geometryId, int colorVersion, short scale, byte[] positions, byte[] colors, Dictionary<int, int> indices)
+            {
+                GeometryId = geometryId;
+                ColorVersion = colorVersion;
+                Scale = scale;
+                Positions = positions;
+                Colors = colors;
+                Indices = indices;
+            }
+        }
+
+        /// <summary>
+        /// Points of a tile of the byte grid, as a full frame, and the version at which they last changed. A tile is
+        /// shared by the frames in which it does not change.
+        /// </summary>
+        public sealed class Tile
+        {
+            public readonly int Version;
+            public readonly int Count;
+            public readonly byte[] Frame; // Full frame wire buffer of the points of the tile, sorted by voxel
+
+            public Tile(int version, int count, byte[] frame)
+            {
+                Version = version;
+                Count = count;
+                Frame = frame;
+            }
+        }
+
+        /// <summary>
+        /// Frame split into the tiles of the byte grid, TilesPerAxis on each axis, indexed by x, then y, then z
+        /// </summary>
+        public sealed class TiledFrame
+        {
+            public const int TilesPerAxis = 4;
+            public const int NumTiles = TilesPerAxis * TilesPerAxis * TilesPerAxis;
+            public const int TileShift = 6; // Bits of the byte positions below those of their tile
+
+            // Wire header: scale (short) followed by the mask of the tiles which hold points (ulong, bit i for tile i)
+            public const int HeaderSize = sizeof(short) + sizeof(ulong);
+
+            private const float OutOfViewPriority = 1e6f; // Added to the distance of the tiles out of view, in meters
+
+            public readonly short Scale;
+            public readonly Tile[] Tiles; // Null for the tiles without points
+            public readonly byte[] Header;
+            public readonly long Deadline; // Stopwatch timestamp past which the tiles out of the view are no longer sent
+
+            public TiledFrame(short scale, Tile[] tiles, long deadline)
+            {
+                Scale = scale;
+                Tiles = tiles;
+                Deadline = deadline;
+
+                ulong mask = 0;
+
+                for (int i = 0; i < NumTiles; i++)
+                {
+                    if (tiles[i] != null)
+                        mask |= 1ul << i;
+                }
+
+                Header = new byte[HeaderSize];
+                Buffer.BlockCopy(BitConverter.GetBytes(scale), 0, Header, 0, sizeof(short));
+                Buffer.BlockCopy(BitConverter.GetBytes(mask), 0, Header, sizeof(short), sizeof(ulong));
+            }
+
+            /// <summary>
+            /// Returns the tiles a receiver does not hold, the tiles it can see first, nearest first, then the others,
+            /// nearest first as well. Without a view pose, the tiles are in the order of their index.
+            /// </summary>
+            /// <param name="heldVersions">Version of each tile held by the receiver; -1 for the tiles it does not hold</param>
+            /// <param name="pose">Last view pose of the receiver; null if it never sent one</param>
+            /// <param name="numVisible">Number of tiles returned which the receiver can see</param>
+            public List<int> GetChangedTiles(int[] heldVersions, ViewPose pose, out int numVisible)
+            {
+                List<int> changedTiles = new List<int>();
+                List<float> priorities = new List<float>();
+
+                // Half of the size of a tile, and the radius of the sphere around it, in meters
+                float halfSize = 0.5f * (1 << TileShift) / Scale;
+                float radius = halfSize * (float)Math.Sqrt(3.0);
+                numVisible = 0;
+
+                for (int i = 0; i < NumTiles; i++)
+                {
+                    if (Tiles[i] == null || Tiles[i].Version == heldVersions[i])
+                        continue;
+
+                    changedTiles.Add(i);
+
+                    if (pose == null)
+                    {
+                        numVisible++;
+                        continue;
+                    }
+
+                    // The centers of the tiles, decoded as the positions of the full frames
+                    float x = ((i / (TilesPerAxis * TilesPerAxis)) << TileShift) / (float)Scale + halfSize - PointCloudFrameEncoder.HalfRange + PointCloudFrameEncoder.XRangeCenter;
+                    float y = (((i / TilesPerAxis) % TilesPerAxis) << TileShift) / (float)Scale + halfSize - PointCloudFrameEncoder.HalfRange + PointCloudFrameEncoder.YRangeCenter;
+                    float z = ((i % TilesPerAxis) << TileShift) / (float)Scale + halfSize - PointCloudFrameEncoder.HalfRange + PointCloudFrameEncoder.ZRangeCenter;
+                    bool isVisible = pose.IsSphereInFrustum(x, y, z, radius);
+
+                    // The tiles out of view are ranked after all those in view
+                    priorities.Add(pose.GetDistance(x, y, z) + (isVisible ? 0.0f : OutOfViewPriority));
+
+                    if (isVisible)
+                        numVisible++;
+                }
+
+                if (pose != null)
+                {
+                    int[] order = changedTiles.ToArray();
+                    Array.Sort(priorities.ToArray(), order);
+                    changedTiles = new List<int>(order);
+                }
+
+                return changedTiles;
+            }
+        }
+
+        /// <summary>
+        /// Frame coded as a progressive octree: a coarse level first, then one chunk for each finer level
+        /// </summary>
+        public sealed class ProgressiveFrame
+        {
+            public readonly ArraySegment<byte> Header; // Full frame wire header
+            public readonly byte[] Depths; // Octree depth of each chunk
+            public readonly ArraySegment<byte>[] Chunks; // Bodies of the chunks, in the array of the header: number of nodes, child occupancy masks, colors of the nodes
+            public readonly long Deadline; // Stopwatch timestamp past which no more refinement chunk is sent
+
+            public ProgressiveFrame(ArraySegment<byte> header, byte[] depths, ArraySegment<byte>[] chunks, long deadline)
+            {
+                Header = header;
+                Depths = depths;
+                Chunks = chunks;
+                Deadline = deadline;
+            }
+        }
+
+        public readonly int Version;
+        public readonly long CaptureTime; // Time at which the merged frame was assembled, in microseconds of the server clock
+        public readonly FrameTrace Trace; // Times of the frame up to its encoding
+
+        // Written before the frames of the receivers which requested timestamps: the capture time (long), followed for
+        // the receivers which trace the latency by the frame id (int) and the global timestamp of the cameras (ulong)
+        public readonly byte[] TimestampHeader;
+        public readonly byte[] TracedTimestampHeader;
+        public readonly ArraySegment<byte> FullFrame; // Response to the full frame requests
+        public readonly ArraySegment<byte> OctreeFrame; // Response to the full frame requests of the receivers which decode octrees; no array if none did
+        public readonly ArraySegment<byte> WideFrame; // Response to the full frame requests of the receivers which decode wide positions; no array if none did
+        public readonly ArraySegment<byte> MeshFrame; // Response to the mesh frame requests; no array if no receiver requested meshes
+        public readonly ArraySegment<byte> SurfelFrame; // Response to the full frame requests of the receivers which render surfels; no array if none did
+        public readonly ProgressiveFrame Progressive; // Response to the full frame requests of the progressive receivers; null if none did
+
+        // State of the delta receivers once they have this frame, and the previous states they can get a delta from;
+        // null when no receiver requested deltas
+        public readonly DeltaState State;
+        private readonly List<DeltaState> previousStates;
+
+        // Geometry and colors of the split receivers once they have this frame; null when no receiver requested split frames
+        public readonly SplitState Split;
+
+        // Tiles of the tiled receivers; null when no receiver requested tiled frames
+        public readonly TiledFrame Tiled;
+
+        private readonly object splitLock = new object();
+        private ArraySegment<byte> geometryFrame;
+        private ArraySegment<byte> colorFrame;
+        private ArraySegment<byte> unchangedColorFrame;
+
+        private readonly object deltaLock = new object();
+        private ArraySegment<byte> keyframe;
+        private Dictionary<int, ArraySegment<byte>> deltaFrames = new Dictionary<int, ArraySegment<byte>>();
+
+        // Compressed responses for each compression level (key: uncompressed response)
+        private object compressionLock = new object();
+        private Dictionary<CompressionLevel, Dictionary<ArraySegment<byte>, ArraySegment<byte>>> compressedResponses =
+            new Dictionary<CompressionLevel, Dictionary<ArraySegment<byte>, ArraySegment<byte>>>();
+
+        // Responses preceded by the timestamp header, as streamed over UDP (key: response)
+        private object timestampLock = new object();
+        private Dictionary<ArraySegment<byte>, ArraySegment<byte>> timestampedResponses = new Dictionary<ArraySegment<byte>, ArraySegment<byte>>();
+        private Dictionary<ArraySegment<byte>, ArraySegment<byte>> tracedResponses = new Dictionary<ArraySegment<byte>, ArraySegment<byte>>();
+
+        // UDP packets of the responses (key: response)
+        private object packetLock = new object();
+        private Dictionary<ArraySegment<byte>, List<byte[]>> responsePackets = new Dictionary<ArraySegment<byte>, List<byte[]>>();
+
+        // Holders of the frame, starting with its encoder, and the arrays of the payload pool its frames and responses
+        // are in, which go back to the pool once the last holder released the frame
+        private int numReferences = 1;
+        private readonly List<byte[]> pooledArrays = new List<byte[]>();
+        private readonly EncodedPointCloud source; // Frame whose mesh frame this view shares; null if it owns its mesh frame
+
+        /// <param name="source">Frame a view was encoded from, held until the view is released; null for the frames
+        /// encoded for all the receivers</param>
+        public EncodedPointCloud(int version, FrameTrace trace, ArraySegment<byte> fullFrame, ArraySegment<byte> octreeFrame, ArraySegment<byte> wideFrame,
+            ArraySegment<byte> meshFrame, ArraySegment<byte> surfelFrame, ProgressiveFrame progressive, DeltaState state, List<DeltaState> previousStates,
+            SplitState split, TiledFrame tiled, EncodedPointCloud source = null)
+        {
+            Version = version;
+            CaptureTime = trace.MergeTimeUs;
+            Trace = trace;
+            FullFrame = fullFrame;
+            OctreeFrame = octreeFrame;
+            WideFrame = wideFrame;
+            MeshFrame = meshFrame;
+            SurfelFrame = surfelFrame;
+            Progressive = progressive;
+            State = state;
+            this.previousStates = previousStates;
+            Split = split;
+            Tiled = tiled;
+            this.source = source;
+
+            // The frames are in their own arrays, but the mesh frame of a view, which is that of its source
+            Own(fullFrame.Array);
+            Own(octreeFrame.Array);
+            Own(wideFrame.Array);
+            Own(surfelFrame.Array);
+            Own(progressive?.Header.Array);
+
+            if (source != null)
+                source.AddReference();
+            else
+                Own(meshFrame.Array);
+
+            TimestampHeader = BitConverter.GetBytes(CaptureTime);
+            TracedTimestampHeader = new byte[sizeof(long) + sizeof(int) + sizeof(ulong)];
+            Buffer.BlockCopy(TimestampHeader, 0, TracedTimestampHeader, 0, sizeof(long));
+            Buffer.BlockCopy(BitConverter.GetBytes(trace.FrameId), 0, TracedTimestampHeader, sizeof(long), sizeof(int));
+            Buffer.BlockCopy(BitConverter.GetBytes(trace.DeviceTimeStampUs), 0, TracedTimestampHeader, sizeof(long) + sizeof(int), sizeof(ulong));
+        }
+
+        /// <summary>
+        /// Takes a reference on the frame for a holder which keeps it past the call it got it from; release it once done
+        /// </summary>
+        public void AddReference()
+        {
+            Interlocked.Increment(ref numReferences);
+        }
+
+        /// <summary>
+        /// Releases a reference on the frame. The last one gives the arrays of its frames and responses back to the pool,
+        /// after which none of them may be read.
+        /// </summary>
+        public void Release()
+        {
+            if (Interlocked.Decrement(ref numReferences) > 0)
+                return;
+
+            lock (pooledArrays)
+            {
+                foreach (byte[] array in pooledArrays)
+                    FramePayloadPool.Return(array);
+
+                pooledArrays.Clear();
+            }
+
+            source?.Release();
+        }
+
+        /// <summary>
+        /// Returns the response to a delta frame request from a receiver which holds the voxels of a previous version,
+        /// or a keyframe if that version is too old or was quantized with another scale
+        /// </summary>
+        /// <param name="receivedVersion">Version held by the receiver; -1 if it holds none</param>
+        /// <returns>The type of the frame followed by the frame; no array if no receiver requested deltas</returns>
+        public ArraySegment<byte> GetDeltaResponse(int receivedVersion)
+        {
+            if (State == null)
+                return default(ArraySegment<byte>);
+
+            lock (deltaLock)
+            {
+                ArraySegment<byte> deltaFrame;
+
+                if (deltaFrames.TryGetValue(receivedVersion, out deltaFrame))
+                    return deltaFrame;
+
+                DeltaState previousState = previousStates.Find(s => s.Version == receivedVersion);
+
+                if (previousState == null || previousState.Scale != State.Scale)
+                    return GetKeyframe();
+
+                deltaFrame = BuildDeltaFrame(previousState);
+                deltaFrames.Add(receivedVersion, deltaFrame);
+
+                return deltaFrame;
+            }
+        }
+
+        /// <summary>
+        /// Returns the response to a split frame request from a receiver which holds a geometry and some of its colors.
+        /// A receiver without the geometry of this frame gets it with its colors, and a receiver which has it gets the
+        /// colors alone, or no colors when it already has them.
+        /// </summary>
+        /// <param name="geometryId">Geometry held by the receiver; -1 if it holds none</param>
+        /// <param name="colorVersion">Version of the colors held by the receiver</param>
+        /// <returns>The type of the frame, the geometry it refers to, then the frame; no array if no receiver requested
+        /// split frames</returns>
+        public ArraySegment<byte> GetSplitResponse(int geometryId, int colorVersion)
+        {
+            if (Split == null)
+                return default(ArraySegment<byte>);
+
+            lock (splitLock)
+            {
+                if (geometryId != Split.GeometryId)
+                {
+                    if (geometryFrame.Array == null)
+                        geometryFrame = BuildGeometryFrame();
+
+                    return geometryFrame;
+                }
+
+                if (colorVersion != Split.ColorVersion)
+                {
+                    if (colorFrame.Array == null)
+                        colorFrame = BuildColorFrame(Split.Colors);
+
+                    return colorFrame;
+                }
+
+                if (unchangedColorFrame.Array == null)
+                    unchangedColorFrame = BuildColorFrame(null);
+
+                return unchangedColorFrame;
+            }
+        }
+
+        /// <summary>
+        /// Returns a response of this frame as sent to the receivers which support compression. A response is only
+        /// compressed once for each level, however many receivers it is sent to.
+        /// </summary>
+        /// <param name="response">The full frame, a delta response, a progressive chunk or a tile of this frame</param>
+        /// <param name="level">Compression level chosen for the link</param>
+        public ArraySegment<byte> GetCompressedResponse(ArraySegment<byte> response, CompressionLevel level)
+        {
+            lock (compressionLock)
+            {
+                Dictionary<ArraySegment<byte>, ArraySegment<byte>> responses;
+
+                if (!compressedResponses.TryGetValue(level, out responses))
+                {
+                    responses = new Dictionary<ArraySegment<byte>, ArraySegment<byte>>();
+                    compressedResponses.Add(level, responses);
+                }
+
+                ArraySegment<byte> compressedResponse;
+
+                if (!responses.TryGetValue(response, out compressedResponse))
+                {
+                    compressedResponse = PayloadCompression.Compress(response, level);
+                    Own(compressedResponse.Array);
+                    responses.Add(response, compressedResponse);
+                }
+
+                return compressedResponse;
+            }
+        }
+
+        /// <summary>
+        /// Returns a response of this frame preceded by its timestamp header, for the datagrams of the receivers which
+        /// requested timestamps; the TCP receivers get the header written before the response instead
+        /// </summary>
+        /// <param name="response">The full frame of this frame, compressed or not</param>
+        /// <param name="isTraced">Whether the receiver traces the latency, and gets the traced header</param>
+        public ArraySegment<byte> GetTimestampedResponse(ArraySegment<byte> response, bool isTraced)
+        {
+            lock (timestampLock)
+            {
+                Dictionary<ArraySegment<byte>, ArraySegment<byte>> responses = isTraced ? tracedResponses : timestampedResponses;
+                byte[] header = isTraced ? TracedTimestampHeader : TimestampHeader;
+                ArraySegment<byte> timestampedResponse;
+
+                if (!responses.TryGetValue(response, out timestampedResponse))
+                {
+                    timestampedResponse = RentResponse(header.Length + response.Count);
+                    Buffer.BlockCopy(header, 0, timestampedResponse.Array, 0, header.Length);
+                    Buffer.BlockCopy(response.Array, response.Offset, timestampedResponse.Array, header.Length, response.Count);
+                    responses.Add(response, timestampedResponse);
+                }
+
+                return timestampedResponse;
+            }
+        }
+
+        /// <summary>
+        /// Returns the UDP packets of a response of this frame, which are built once for all the receivers; a packet is
+        /// the first <see cref="FramePacketizer.PacketSize"/> bytes of its array
+        /// </summary>
+        public List<byte[]> GetPackets(ArraySegment<byte> response)
+        {
+            lock (packetLock)
+            {
+                List<byte[]> packets;
+
+                if (!responsePackets.TryGetValue(response, out packets))
+                {
+                    packets = FramePacketizer.Packetize(Version, response);
+
+                    foreach (byte[] packet in packets)
+                        Own(packet);
+
+                    responsePackets.Add(response, packets);
+                }
+
+                return packets;
+            }
+        }
+
+        private ArraySegment<byte> GetKeyframe()
+        {
+            if (keyframe.Array == null)
+            {
+                // Keyframes let the receivers start from a known state
+                keyframe = RentResponse(1 + HeaderSize + 6 * State.Voxels.Count);
+                BinaryWriter writer = new BinaryWriter(new MemoryStream(keyframe.Array, 0, keyframe.Count));
+
+                writer.Write(KeyframeType);
+                writer.Write(State.Scale);
+                writer.Write(State.Voxels.Count);
+
+                foreach (int voxel in State.Voxels.Keys)
+                    WritePackedBytes(writer, voxel);
+
+                foreach (int color in State.Voxels.Values)
+                    WritePackedBytes(writer, color);
+            }
+
+            return keyframe;
+        }
+
+        /// <summary>
+        /// Builds the voxels removed since a previous state, then the voxels added or recolored. The colors of the states
+        /// only change by more than the color threshold, so the exact differences are sent.
+        /// </summary>
+        private ArraySegment<byte> BuildDeltaFrame(DeltaState previousState)
+        {
+            List<int> removedVoxels = new List<int>();
+            List<KeyValuePair<int, int>> updatedVoxels = new List<KeyValuePair<int, int>>();
+
+            foreach (int voxel in previousState.Voxels.Keys)
+            {
+                if (!State.Voxels.ContainsKey(voxel))
+                    removedVoxels.Add(voxel);
+            }
+
+            foreach (KeyValuePair<int, int> voxel in State.Voxels)
+            {
+                int previousColor;
+
+                if (!previousState.Voxels.TryGetValue(voxel.Key, out previousColor) || previousColor != voxel.Value)
+                    updatedVoxels.Add(voxel);
+            }
+
+            ArraySegment<byte> frame = RentResponse(1 + HeaderSize + 4 + 3 * removedVoxels.Count + 6 * updatedVoxels.Count);
+            BinaryWriter writer = new BinaryWriter(new MemoryStream(frame.Array, 0, frame.Count));
+
+            writer.Write(DeltaFrameType);
+            writer.Write(State.Scale);
+
+            writer.Write(removedVoxels.Count);
+            foreach (int voxel in removedVoxels)
+                WritePackedBytes(writer, voxel);
+
+            writer.Write(updatedVoxels.Count);
+            foreach (KeyValuePair<int, int> voxel in updatedVoxels)
+                WritePackedBytes(writer, voxel.Key);
+            foreach (KeyValuePair<int, int> voxel in updatedVoxels)
+                WritePackedBytes(writer, voxel.Value);
+
+            return frame;
+        }
+
+        /// <summary>
+        /// Builds the geometry of the split receivers as a full frame with its colors
+        /// </summary>
+        private ArraySegment<byte> BuildGeometryFrame()
+        {
+            ArraySegment<byte> frame = RentResponse(1 + sizeof(int) + HeaderSize + Split.Positions.Length + Split.Colors.Length);
+            BinaryWriter writer = new BinaryWriter(new MemoryStream(frame.Array, 0, frame.Count));
+
+            writer.Write(GeometryFrameType);
+            writer.Write(Split.GeometryId);
+            writer.Write(Split.Scale);
+            writer.Write(Split.Count);
+            writer.Write(Split.Positions);
+            writer.Write(Split.Colors);
+
+            return frame;
+        }
+
+        /// <summary>
+        /// Builds the colors of the points of the geometry of the split receivers, in the order of the geometry
+        /// </summary>
+        /// <param name="colors">The colors; null for the receivers which already hold them, which get none</param>
+        private ArraySegment<byte> BuildColorFrame(byte[] colors)
+        {
+            ArraySegment<byte> frame = RentResponse(1 + 2 * sizeof(int) + (colors?.Length ?? 0));
+            BinaryWriter writer = new BinaryWriter(new MemoryStream(frame.Array, 0, frame.Count));
+
+            writer.Write(ColorFrameType);
+            writer.Write(Split.GeometryId);
+            writer.Write(colors != null ? Split.Count : 0);
+
+            if (colors != null)
+                writer.Write(colors);
+
+            return frame;
+        }
+
+        /// <summary>
+        /// Returns a response of <paramref name="size"/> bytes in an array of the payload pool, given back with the frame
+        /// </summary>
+        private ArraySegment<byte> RentResponse(int size)
+        {
+            byte[] array = FramePayloadPool.Rent(size);
+            Own(array);
+
+            return new ArraySegment<byte>(array, 0, size);
+        }
+
+        /// <summary>
+        /// Gives an array of the payload pool to the frame, which returns it once released
+        /// </summary>
+        private void Own(byte[] array)
+        {
+            if (array == null)
+                return;
+
+            lock (pooledArrays)
+                pooledArrays.Add(array);
+        }
+
+        private static void WritePackedBytes(BinaryWriter writer, int packed)
+        {
+            writer.Write((byte)(packed >> 16));
+            writer.Write((byte)(packed >> 8));
+            writer.Write((byte)packed);
+        }
+    }
+}
@@ -0,0 +1,164 @@
+﻿/***************************************************************************\
+
+Module Name:  ExposureCoordinator.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module gives all the cameras the same locked exposure, instead of
+their own auto exposure, so that the colors of the points of a camera do
+not change from frame to frame nor differ from those of the others, which
+keeps the color deltas of the streams small. Every second, a background
+thread meters the points of the latest frame of each camera and moves the
+common exposure slowly towards the target luma: it only starts moving once
+the luma is well off the target, and stops once it is close, so that the
+noise of the metering never changes the exposure.
+
+\***************************************************************************/
+
+using System;
+using System.Linq;
+using System.Threading;
+
+namespace LiveScanServer
+{
+    public sealed class ExposureCoordinator
+    {
+        private const int UpdateIntervalMs = 1000;
+        private const int SampleStep = 16; // Points between two metered points of a frame
+
+        // The frames acquired within the settle time of a change of the exposure may still have the previous exposure
+        private const long SettleTimeUs = 300000;
+
+        // Hysteresis on the ratio of the target luma to the metered luma, in log: the exposure starts moving beyond the
+        // start tolerance, about 15%, and keeps moving until within the stop tolerance, about 5%
+        private const double StartTolerance = 0.14;
+        private const double StopTolerance = 0.05;
+
+        // Each update moves the exposure half of the way to the target luma in log, by 10% at most, so that a change of
+        // the exposure is spread over several frames which the color deltas of the streams follow
+        private const double Gain = 0.5;
+        private const double MaxLogChange = 0.095;
+
+        private const int MinExposureStep = 1;
+        private const int MaxExposureStep = 300;
+        private const float MinMeteredLuma = 1.0f;
+
+        private readonly CameraServer cameraServer;
+        private readonly CameraSettings settings;
+        private readonly ManualResetEvent stopEvent = new ManualResetEvent(false);
+        private Thread coordinatorThread;
+
+        private bool isAdjusting = false;
+        private long lastChangeTimeUs = 0;
+
+        /// <summary>
+        /// Exposure step all the cameras are locked to; 0 while the coordination is disabled
+        /// </summary>
+        public int ExposureStep { get; private set; } = 0;
+
+        public ExposureCoordinator(CameraServer cameraServer, CameraSettings settings)
+        {
+            this.cameraServer = cameraServer;
+            this.settings = settings;
+        }
+
+        public void Start()
+        {
+            stopEvent.Reset();
+
+            coordinatorThread = new Thread(CoordinatorLoop);
+            coordinatorThread.Name = "Exposure coordinator";
+            coordinatorThread.IsBackground = true;
+            coordinatorThread.Priority = ThreadPriority.BelowNormal;
+            coordinatorThread.Start();
+        }
+
+        public void Stop()
+        {
+            stopEvent.Set();
+            coordinatorThread?.Join();
+            coordinatorThread = null;
+        }
+
+        private void CoordinatorLoop()
+        {
+            while (!stopEvent.WaitOne(UpdateIntervalMs))
+            {
+                // Disabling the coordination gives the cameras back the exposure of the settings
+                if (!settings.IsExposureCoordinationEnabled)
+                {
+                    if (ExposureStep > 0)
+                        SetExposureStep(0);
+
+                    isAdjusting = false;
+                    continue;
+                }
+
+                if (cameraServer.ClientCount == 0)
+                    continue;
+
+                // The cameras are first locked to the manual exposure of the settings, and move from there
+                if (ExposureStep == 0)
+                {
+                    SetExposureStep(Math.Min(Math.Max(settings.ExposureStep, MinExposureStep), MaxExposureStep));
+                    continue;
+                }
+
+                try
+                {
+                    UpdateExposure();
+                }
+                catch (Exception e)
+                {
+                    Logger.Log("Exposure update failed: " + e.Message);
+                }
+            }
+        }
+
+        private void UpdateExposure()
+        {
+            float[] metered = cameraServer.MeasureFrameBrightness(SampleStep, lastChangeTimeUs + SettleTimeUs).Where(b => b >= 0.0f).ToArray();
+
+            if (metered.Length == 0)
+                return;
+
+            // The median of the cameras, so that a single camera facing a dark or a bright region does not set the
+            // exposure of all the others
+            Array.Sort(metered);
+            int middle = metered.Length / 2;
+            float luma = metered.Length % 2 == 1 ? metered[middle] : 0.5f * (metered[middle - 1] + metered[middle]);
+
+            double error = Math.Log(Math.Max(settings.ExposureTargetLuma, MinMeteredLuma) / Math.Max(luma, MinMeteredLuma));
+
+            if (Math.Abs(error) <= (isAdjusting ? StopTolerance : StartTolerance))
+            {
+                isAdjusting = false;
+                return;
+            }
+
+            isAdjusting = true;
+
+            double change = Math.Min(Math.Max(error * Gain, -MaxLogChange), MaxLogChange);
+            int exposureStep = (int)Math.Round(ExposureStep * Math.Exp(change));
+
+            // The smallest steps move by at least one, so that the exposure never gets stuck short of the target
+            if (exposureStep == ExposureStep)
+                exposureStep += Math.Sign(change);
+
+            exposureStep = Math.Min(Math.Max(exposureStep, MinExposureStep), MaxExposureStep);
+
+            if (exposureStep != ExposureStep)
+                SetExposureStep(exposureStep);
+        }
+
+        private void SetExposureStep(int exposureStep)
+        {
+            cameraServer.SetCoordinatedExposure(exposureStep);
+
+            ExposureStep = exposureStep;
+            lastChangeTimeUs = FrameTrace.GetTimeUs();
+        }
+    }
+}
@@ -0,0 +1,233 @@
+﻿/***************************************************************************\
+
+Module Name:  FrameAssembler.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module assembles the live frames of all the camera clients into a single
+multi-camera frame. The cameras are grouped by the timestamp of their latest
+frame, and a camera which misses the deadline either reuses its previous frame
+or is left out, so one slow camera never stalls the others. The lists of
+the assembly are kept from one frame to the next, so that it allocates
+nothing once the frames have reached their size.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+
+namespace LiveScanServer
+{
+    public class FrameAssembler
+    {
+        private CameraSettings settings;
+
+        // Reused by every call to Assemble, which is only called from the frame loop
+        private readonly List<FrameInfo> frames = new List<FrameInfo>();
+        private readonly List<CameraClient.FrameLease> leases = new List<CameraClient.FrameLease>();
+
+        // Frame of the clients left out; it is shared, so it must never be written to
+        private static readonly FrameBuffer<byte> s_emptyBytes = new FrameBuffer<byte>();
+        private static readonly FrameBuffer<float> s_emptyFloats = new FrameBuffer<float>();
+
+        public FrameAssembler(CameraSettings settings)
+        {
+            this.settings = settings;
+        }
+
+        /// <summary>
+        /// Waits for a new frame from every client, then stores the frame of each client in the provided lists, in the
+        /// order of <paramref name="clients"/>. A frame is fresh if it is new and was captured within the sync window of
+        /// the newest frame; the clients without a fresh frame by the deadline are stale.
+        /// </summary>
+        /// <param name="clients">Clients to assemble the frame from</param>
+        /// <param name="frameColors">List where to store the colors of each client</param>
+        /// <param name="framesVertices">List where to store the vertices of each client</param>
+        /// <param name="frameVersions">Optional list where to store the version of the frame of each client, 0 if it was left out</param>
+        /// <param name="trace">Optional trace where to store the times of the frames assembled</param>
+        /// <param name="frameNormals">Optional list where to store the normals of each client, empty for the clients without them</param>
+        public void Assemble(List<CameraClient> clients, List<FrameBuffer<byte>> frameColors, List<FrameBuffer<float>> framesVertices,
+            List<ulong> frameVersions = null, FrameTrace trace = null, List<FrameBuffer<byte>> frameNormals = null)
+        {
+            int deadlineMs = Math.Max(0, settings.FrameDeadlineMs);
+            ulong syncWindowUs = (ulong)Math.Max(0, settings.FrameSyncWindowMs) * 1000;
+            long startTimestamp = Stopwatch.GetTimestamp();
+
+            // The waits overlap, so the deadline applies to all the clients at once
+            foreach (var client in clients)
+            {
+                client.WaitForNewFrame(deadlineMs - GetElapsedMs(startTimestamp));
+            }
+
+            // Keep waiting for the clients whose latest frame is older than the sync window allows, until the deadline
+            while (syncWindowUs > 0 && GetElapsedMs(startTimestamp) < deadlineMs)
+            {
+                frames.Clear();
+
+                foreach (var client in clients)
+                {
+                    frames.Add(PeekFrame(client));
+                }
+
+                ulong referenceTimeStampUs = GetReferenceTimeStamp(frames);
+                bool isWaiting = false;
+
+                foreach (var frame in frames)
+                {
+                    if (!IsFresh(frame, referenceTimeStampUs, syncWindowUs))
+                    {
+                        frame.Client.WaitForNewFrame(frame.SequenceNumber, deadlineMs - GetElapsedMs(startTimestamp));
+                        isWaiting = true;
+                    }
+                }
+
+                if (!isWaiting)
+                    break;
+            }
+
+            ServerTrace.TraceZone zone = ServerTrace.Zone("Assemble");
+
+            // Lease the frames to assemble; they cannot change during the assembly
+            leases.Clear();
+
+            foreach (var client in clients)
+            {
+                leases.Add(client.AcquireLatestFrame());
+            }
+
+            if (trace != null)
+            {
+                trace.AssembleTimeUs = FrameTrace.GetTimeUs();
+                trace.DeviceTimeStampUs = 0;
+                trace.AcquireTimeUs = 0;
+                trace.ProcessedTimeUs = 0;
+            }
+
+            try
+            {
+                frames.Clear();
+
+                for (int i = 0; i < leases.Count; i++)
+                {
+                    frames.Add(new FrameInfo(clients[i], leases[i].SequenceNumber, leases[i].TimeStampUs));
+                }
+
+                ulong referenceTimeStampUs = GetReferenceTimeStamp(frames);
+
+                for (int i = 0; i < clients.Count; i++)
+                {
+                    CameraClient client = clients[i];
+                    bool isNew = frames[i].SequenceNumber > client.FrameSequenceNumber;
+                    bool isFresh = IsFresh(frames[i], referenceTimeStampUs, syncWindowUs);
+
+                    if (isFresh)
+                    {
+                        client.ReadFrame(leases[i]);
+                        client.NumFreshFrames++;
+                    }
+                    else if (settings.IsStaleFrameReused)
+                    {
+                        // A new frame outside of the sync window is still the most recent one of the client
+                        if (isNew)
+                            client.ReadFrame(leases[i]);
+
+                        client.NumStaleFrames++;
+                    }
+                    else
+                    {
+                        client.NumDroppedFrames++;
+                    }
+
+                    client.IsLatestFrameReceived = isFresh;
+                    client.FrameAgeMs = referenceTimeStampUs > client.FrameTimeStampUs ? (referenceTimeStampUs - client.FrameTimeStampUs) / 1000.0 : 0.0;
+
+                    if (isFresh || settings.IsStaleFrameReused)
+                    {
+                        frameColors.Add(client.FrameColors);
+                        framesVertices.Add(client.FrameVertices);
+                        frameVersions?.Add(client.FrameVersion);
+                        frameNormals?.Add(client.FrameNormals);
+
+                        // The frame is as late as its oldest camera frame
+                        if (trace != null && client.FrameAcquireTimeUs > 0)
+                        {
+                            trace.DeviceTimeStampUs = Math.Max(trace.DeviceTimeStampUs, client.FrameTimeStampUs);
+                            trace.AcquireTimeUs = trace.AcquireTimeUs == 0 ? client.FrameAcquireTimeUs : Math.Min(trace.AcquireTimeUs, client.FrameAcquireTimeUs);
+                            trace.ProcessedTimeUs = Math.Max(trace.ProcessedTimeUs, client.FramePublishTimeUs);
+                        }
+                    }
+                    else
+                    {
+                        frameColors.Add(s_emptyBytes);
+                        framesVertices.Add(s_emptyFloats);
+                        frameVersions?.Add(0);
+                        frameNormals?.Add(s_emptyBytes);
+                    }
+                }
+            }
+            finally
+            {
+                foreach (var lease in leases)
+                {
+                    lease.Dispose();
+                }
+
+                leases.Clear();
+                zone.Dispose();
+            }
+        }
+
+        private static int GetElapsedMs(long startTimestamp)
+        {
+            return (int)((Stopwatch.GetTimestamp() - startTimestamp) * 1000 / Stopwatch.Frequency);
+        }
+
+        private struct FrameInfo
+        {
+            public CameraClient Client;
+            public ulong SequenceNumber;
+            public ulong TimeStampUs;
+
+            public FrameInfo(CameraClient client, ulong sequenceNumber, ulong timeStampUs)
+            {
+                Client = client;
+                SequenceNumber = sequenceNumber;
+                TimeStampUs = timeStampUs;
+            }
+        }
+
+        private static FrameInfo PeekFrame(CameraClient client)
+        {
+            using (CameraClient.FrameLease lease = client.AcquireLatestFrame())
+            {
+                return new FrameInfo(client, lease.SequenceNumber, lease.TimeStampUs);
+            }
+        }
+
+        // The newest of the new frames sets the time of the assembled frame
+        private static ulong GetReferenceTimeStamp(List<FrameInfo> frames)
+        {
+            ulong referenceTimeStampUs = 0;
+
+            foreach (var frame in frames)
+            {
+                if (frame.SequenceNumber > frame.Client.FrameSequenceNumber)
+                    referenceTimeStampUs = Math.Max(referenceTimeStampUs, frame.TimeStampUs);
+            }
+
+            return referenceTimeStampUs;
+        }
+
+        // A sync window of 0 disables the timestamp check, which then only waits for a new frame
+        private static bool IsFresh(FrameInfo frame, ulong referenceTimeStampUs, ulong syncWindowUs)
+        {
+            if (frame.SequenceNumber <= frame.Client.FrameSequenceNumber)
+                return false;
+
+            return syncWindowUs == 0 || frame.TimeStampUs + syncWindowUs >= referenceTimeStampUs;
+        }
+    }
+}
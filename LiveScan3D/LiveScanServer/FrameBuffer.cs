@@ -0,0 +1,183 @@
+﻿/***************************************************************************\
+
+Module Name:  FrameBuffer.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module holds the buffers of the frame path of the server, from the
+frames read from the clients to the merged frames, which keep their arrays
+from one frame to the next so that the steady state allocates nothing. A
+buffer only grows when a frame is larger than any before it, with some
+headroom. The encoded frames, which live until their last receiver sent
+them, take their arrays from a pool instead. Every array the frame path
+allocates is counted, so that the status bar shows whether it still
+allocates once the frames have reached their size.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Runtime.InteropServices;
+using System.Threading;
+
+namespace LiveScanServer
+{
+    /// <summary>
+    /// Values of one frame in a reused array, which can be longer than the frame
+    /// </summary>
+    public class FrameBuffer<T>
+    {
+        public T[] Items = new T[0];
+        public int Count { get; private set; }
+
+        /// <summary>
+        /// Sets the number of values of the frame, replacing the array with a larger one when they do not fit, in which
+        /// case the values it held are not kept
+        /// </summary>
+        public void Resize(int count)
+        {
+            Items = FrameAllocations.Reserve(Items, count);
+            Count = count;
+        }
+
+        public void Clear()
+        {
+            Count = 0;
+        }
+
+        public void CopyFrom(FrameBuffer<T> source)
+        {
+            CopyFrom(source.Items, 0, source.Count);
+        }
+
+        public void CopyFrom(T[] source, int offset, int count)
+        {
+            Resize(count);
+            Array.Copy(source, offset, Items, 0, count);
+        }
+
+        public void CopyTo(int index, T[] destination, int destinationIndex, int count)
+        {
+            Array.Copy(Items, index, destination, destinationIndex, count);
+        }
+    }
+
+    /// <summary>
+    /// Arrays of the encoded frames, whose sizes are rounded up to a power of two so that a frame can take the array of
+    /// an earlier one of a slightly different size; the frames hand out segments of them
+    /// </summary>
+    public static class FramePayloadPool
+    {
+        private const int MinArraySizeShift = 11; // Holds a UDP packet
+        private const int NumBuckets = 20;
+
+        // Arrays kept in each bucket: enough for the frames of every tier held by the encoder, the queued frame sets and
+        // the receivers still sending, each with its cached responses, and for the packets of a few frames
+        private const int MaxArraysPerBucket = 64;
+        private const long MaxBytesPerBucket = 64 << 20;
+
+        private static readonly Stack<byte[]>[] buckets = CreateBuckets();
+
+        /// <summary>
+        /// Returns an array of at least <paramref name="size"/> bytes, which holds the values of the last frame that used
+        /// it
+        /// </summary>
+        public static byte[] Rent(int size)
+        {
+            int bucket = GetBucket(size);
+            if (bucket >= NumBuckets)
+                return FrameAllocations.Allocate<byte>(size);
+
+            Stack<byte[]> arrays = buckets[bucket];
+            lock (arrays)
+            {
+                if (arrays.Count > 0)
+                    return arrays.Pop();
+            }
+
+            return FrameAllocations.Allocate<byte>(1 << (bucket + MinArraySizeShift));
+        }
+
+        /// <summary>
+        /// Gives back an array taken with <see cref="Rent"/>, which must no longer be used
+        /// </summary>
+        public static void Return(byte[] array)
+        {
+            int bucket = GetBucket(array.Length);
+            if (bucket >= NumBuckets || array.Length != 1 << (bucket + MinArraySizeShift))
+                return;
+
+            Stack<byte[]> arrays = buckets[bucket];
+            lock (arrays)
+            {
+                if (arrays.Count < MaxArraysPerBucket || (long)arrays.Count * array.Length < MaxBytesPerBucket)
+                    arrays.Push(array);
+            }
+        }
+
+        private static int GetBucket(int size)
+        {
+            int bucket = 0;
+            while (bucket < NumBuckets && 1 << (bucket + MinArraySizeShift) < size)
+                bucket++;
+
+            return bucket;
+        }
+
+        private static Stack<byte[]>[] CreateBuckets()
+        {
+            Stack<byte[]>[] buckets = new Stack<byte[]>[NumBuckets];
+            for (int i = 0; i < NumBuckets; i++)
+                buckets[i] = new Stack<byte[]>();
+
+            return buckets;
+        }
+    }
+
+    /// <summary>
+    /// Arrays allocated by the frame path: the growths of its buffers, the arrays its pool did not hold yet, and the
+    /// arrays that follow the changes of the scene, like the tiles that changed
+    /// </summary>
+    public static class FrameAllocations
+    {
+        // A quarter more than the frame needs, so that the frames whose size varies a little do not grow the buffers
+        private const int HeadroomShift = 2;
+
+        private static long numAllocations = 0;
+        private static long numAllocatedBytes = 0;
+
+        /// <summary>
+        /// Returns an array of at least <paramref name="count"/> values: the given one when they fit, or a new empty one
+        /// with headroom otherwise
+        /// </summary>
+        public static T[] Reserve<T>(T[] array, int count)
+        {
+            if (array.Length >= count)
+                return array;
+
+            return Allocate<T>((int)Math.Min(int.MaxValue, (long)count + (count >> HeadroomShift)));
+        }
+
+        /// <summary>
+        /// Returns a new array of <paramref name="length"/> values, counting it
+        /// </summary>
+        public static T[] Allocate<T>(int length)
+        {
+            Interlocked.Increment(ref numAllocations);
+            Interlocked.Add(ref numAllocatedBytes, (long)length * Marshal.SizeOf(typeof(T)));
+
+            return new T[length];
+        }
+
+        /// <summary>
+        /// Number of arrays the frame path allocated since the last call, and their size in bytes
+        /// </summary>
+        public static long TakeAllocations(out long numBytes)
+        {
+            numBytes = Interlocked.Exchange(ref numAllocatedBytes, 0);
+            return Interlocked.Exchange(ref numAllocations, 0);
+        }
+    }
+}
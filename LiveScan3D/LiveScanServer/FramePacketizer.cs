@@ -0,0 +1,93 @@
+﻿/***************************************************************************\
+
+Module Name:  FramePacketizer.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module splits the point cloud frames sent over UDP into datagrams. Each
+group of data packets is followed by a parity packet (the XOR of the group),
+so a receiver recovers one lost packet per group without a retransmission,
+and simply skips a frame it cannot complete.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+
+namespace LiveScanServer
+{
+    public static class FramePacketizer
+    {
+        // Packet header: frame id (int), frame size (int), packet index (ushort), number of data packets (ushort)
+        public const int PacketHeaderSize = 12;
+
+        // Keeps the datagrams below the usual MTU of 1500 bytes with the IP and UDP headers
+        public const int PacketPayloadSize = 1200;
+
+        public const int PacketSize = PacketHeaderSize + PacketPayloadSize;
+
+        // Number of data packets protected by each parity packet
+        public const int GroupSize = 8;
+
+        /// <summary>
+        /// Splits a frame into data packets followed by one parity packet for each group. The payload of the last data
+        /// packet is padded with zeros so that all the packets of a group have the same size.
+        /// </summary>
+        /// <param name="frameId">Id of the frame; the receivers drop the frames older than the one they are assembling</param>
+        /// <param name="frame">Bytes of the frame, as they would be sent on the TCP stream</param>
+        /// <returns>The datagrams to send, data packets first, each the first <see cref="PacketSize"/> bytes of an array of
+        /// the payload pool, which the caller gives back once they are sent</returns>
+        public static List<byte[]> Packetize(int frameId, ArraySegment<byte> frame)
+        {
+            int numDataPackets = Math.Max(1, (frame.Count + PacketPayloadSize - 1) / PacketPayloadSize);
+            int numGroups = (numDataPackets + GroupSize - 1) / GroupSize;
+            List<byte[]> packets = new List<byte[]>(numDataPackets + numGroups);
+
+            for (int i = 0; i < numDataPackets; i++)
+            {
+                byte[] packet = CreatePacket(frameId, frame.Count, i, numDataPackets);
+                int offset = i * PacketPayloadSize;
+                int size = Math.Min(PacketPayloadSize, frame.Count - offset);
+
+                Buffer.BlockCopy(frame.Array, frame.Offset + offset, packet, PacketHeaderSize, size);
+                Array.Clear(packet, PacketHeaderSize + size, PacketPayloadSize - size);
+                packets.Add(packet);
+            }
+
+            for (int group = 0; group < numGroups; group++)
+            {
+                byte[] parity = CreatePacket(frameId, frame.Count, numDataPackets + group, numDataPackets);
+                int end = Math.Min((group + 1) * GroupSize, numDataPackets);
+
+                Array.Clear(parity, PacketHeaderSize, PacketPayloadSize);
+
+                for (int i = group * GroupSize; i < end; i++)
+                {
+                    byte[] packet = packets[i];
+
+                    for (int j = PacketHeaderSize; j < PacketSize; j++)
+                        parity[j] ^= packet[j];
+                }
+
+                packets.Add(parity);
+            }
+
+            return packets;
+        }
+
+        private static byte[] CreatePacket(int frameId, int frameSize, int index, int numDataPackets)
+        {
+            // The arrays of the pool hold the bytes of their last packets
+            byte[] packet = FramePayloadPool.Rent(PacketSize);
+
+            Buffer.BlockCopy(BitConverter.GetBytes(frameId), 0, packet, 0, 4);
+            Buffer.BlockCopy(BitConverter.GetBytes(frameSize), 0, packet, 4, 4);
+            Buffer.BlockCopy(BitConverter.GetBytes((ushort)index), 0, packet, 8, 2);
+            Buffer.BlockCopy(BitConverter.GetBytes((ushort)numDataPackets), 0, packet, 10, 2);
+
+            return packet;
+        }
+    }
+}
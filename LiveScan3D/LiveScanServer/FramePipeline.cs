@@ -0,0 +1,277 @@
+﻿/***************************************************************************\
+
+Module Name:  FramePipeline.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module runs the first stages of the pipeline which turns the frames of
+the cameras into the frames sent to the receivers: the frames of the cameras
+are gathered on one worker and merged on another, so that the next frame is
+gathered while the last one is merged. The transfer server then encodes the
+merged frames and sends them on two stages of its own. The stages are
+connected by bounded queues, which hold back the stage before them when
+full, and which keep the largest depth they reached so that the status bar
+shows which stage holds the pipeline back. While the pipeline runs, the
+garbage collector is kept from blocking collections, since the frame path
+allocates nothing once the frames have reached their size.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.Runtime;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace LiveScanServer
+{
+    /// <summary>
+    /// Bounded queue between two stages of the pipeline, which keeps the largest depth it reached since it was last
+    /// reported
+    /// </summary>
+    public class PipelineQueue<T>
+    {
+        private readonly BlockingCollection<T> items;
+        private int maxDepth = 0;
+
+        public int Capacity => items.BoundedCapacity;
+
+        public PipelineQueue(int capacity)
+        {
+            items = new BlockingCollection<T>(new ConcurrentQueue<T>(), capacity);
+        }
+
+        /// <summary>
+        /// Adds an item, waiting for the stage after the queue to make room for it
+        /// </summary>
+        public void Add(T item, CancellationToken token)
+        {
+            items.Add(item, token);
+
+            int depth = items.Count;
+            int previousMaxDepth;
+
+            while (depth > (previousMaxDepth = Volatile.Read(ref maxDepth)))
+            {
+                if (Interlocked.CompareExchange(ref maxDepth, depth, previousMaxDepth) == previousMaxDepth)
+                    break;
+            }
+        }
+
+        /// <summary>
+        /// Takes the oldest item, waiting for one at most <paramref name="timeoutMs"/>
+        /// </summary>
+        /// <returns>False if the wait timed out</returns>
+        public bool TryTake(out T item, int timeoutMs)
+        {
+            return items.TryTake(out item, timeoutMs);
+        }
+
+        /// <summary>
+        /// Largest number of items the queue held since the last call
+        /// </summary>
+        public int TakeMaxDepth()
+        {
+            return Math.Max(Interlocked.Exchange(ref maxDepth, 0), items.Count);
+        }
+    }
+
+    public class FramePipeline
+    {
+        /// <summary>
+        /// Frames of the cameras, as gathered for a merged frame. The lists of the clients are overwritten by the next
+        /// gathering, so each gathered frame keeps a copy of them.
+        /// </summary>
+        private class GatheredFrame
+        {
+            public readonly List<FrameBuffer<float>> Vertices = new List<FrameBuffer<float>>();
+            public readonly List<FrameBuffer<byte>> Colors = new List<FrameBuffer<byte>>();
+            public readonly List<ulong> Versions = new List<ulong>();
+            public readonly List<FrameBuffer<byte>> Normals = new List<FrameBuffer<byte>>();
+            public readonly FrameTrace Trace = new FrameTrace();
+        }
+
+        // One frame is merged while the next is gathered and another one waits between them
+        private const int NumGatheredFrames = 3;
+
+        // Interval at which the waiting stages check whether the pipeline is stopped, in milliseconds
+        private const int StopCheckInterval = 100;
+
+        private readonly CameraServer cameraServer;
+        private readonly MergedFrameStore frameStore;
+        private readonly FusionVolume fusionVolume;
+
+        private readonly PipelineQueue<GatheredFrame> freeFrames = new PipelineQueue<GatheredFrame>(NumGatheredFrames);
+        private readonly PipelineQueue<GatheredFrame> gatheredFrames = new PipelineQueue<GatheredFrame>(NumGatheredFrames - 1);
+
+        // Lists of the clients the frames are gathered from
+        private List<FrameBuffer<float>> cameraVertices = new List<FrameBuffer<float>>();
+        private List<FrameBuffer<byte>> cameraColors = new List<FrameBuffer<byte>>();
+        private List<ulong> cameraFrameVersions = new List<ulong>();
+        private List<FrameBuffer<byte>> cameraNormals = new List<FrameBuffer<byte>>();
+
+        /// <summary>
+        /// Held while the frames are gathered, since the gathered lists are those of the clients, which the refinement
+        /// reads and updates as well
+        /// </summary>
+        public readonly object GatherLock = new object();
+
+        /// <summary>
+        /// Raised on the merge worker once a new merged frame is published
+        /// </summary>
+        public event Action FrameMerged;
+
+        public int MergeQueueCapacity => gatheredFrames.Capacity;
+
+        public FramePipeline(CameraServer cameraServer, MergedFrameStore frameStore, FusionVolume fusionVolume)
+        {
+            this.cameraServer = cameraServer;
+            this.frameStore = frameStore;
+            this.fusionVolume = fusionVolume;
+
+            for (int i = 0; i < NumGatheredFrames; i++)
+                freeFrames.Add(new GatheredFrame(), CancellationToken.None);
+        }
+
+        /// <summary>
+        /// Largest number of gathered frames waiting for the merge since the last call
+        /// </summary>
+        public int TakeMergeQueueDepth() => gatheredFrames.TakeMaxDepth();
+
+        /// <summary>
+        /// Gathers the frames of the cameras on the calling thread and merges them on a worker of its own, until
+        /// <paramref name="isStopRequested"/> returns true
+        /// </summary>
+        public void Run(Func<bool> isStopRequested)
+        {
+            CancellationTokenSource cancellation = new CancellationTokenSource();
+            Task merger = Task.Run(() => MergeFrames(cancellation.Token));
+
+            // The few collections left are then done in the background, without pausing the gathering and the merge
+            GCLatencyMode latencyMode = GCSettings.LatencyMode;
+            GCSettings.LatencyMode = GCLatencyMode.SustainedLowLatency;
+
+            try
+            {
+                GatherFrames(isStopRequested);
+            }
+            finally
+            {
+                cancellation.Cancel();
+                merger.Wait();
+                GCSettings.LatencyMode = latencyMode;
+
+                // The frames still queued are left out, like those the merge was too slow for
+                GatheredFrame frame;
+
+                while (gatheredFrames.TryTake(out frame, 0))
+                    freeFrames.Add(frame, CancellationToken.None);
+            }
+        }
+
+        private void GatherFrames(Func<bool> isStopRequested)
+        {
+            while (!isStopRequested())
+            {
+                // Check that all connected cameras are initialized
+                if (!cameraServer.GetAllDevicesInitialized())
+                {
+                    Thread.Sleep(1);
+                    continue;
+                }
+
+                GatheredFrame frame;
+
+                // Wait for the merge to hand a frame back, which holds the gathering back when the merge is slower
+                if (!freeFrames.TryTake(out frame, StopCheckInterval))
+                    continue;
+
+                bool isNewFrame;
+
+                // Request latest frame from each camera
+                lock (GatherLock)
+                {
+                    cameraServer.GetLatestFrame(ref cameraColors, ref cameraVertices, cameraFrameVersions, frame.Trace, cameraNormals);
+                    isNewFrame = CopyFrames(frame);
+                }
+
+                // The merge publishes the frame even when no camera has a new one, since the poses may have changed;
+                // those frames are spaced out like before the pipeline
+                gatheredFrames.Add(frame, CancellationToken.None);
+
+                if (!isNewFrame)
+                    Thread.Sleep(1);
+            }
+        }
+
+        /// <summary>
+        /// Copies the lists of the clients to a gathered frame, skipping the cameras whose frame the gathered frame
+        /// already holds
+        /// </summary>
+        /// <returns>True if any camera has a frame the gathered frame did not hold</returns>
+        private bool CopyFrames(GatheredFrame frame)
+        {
+            int numCameras = cameraVertices.Count;
+            bool isNewFrame = frame.Versions.Count != numCameras;
+
+            while (frame.Vertices.Count < numCameras)
+            {
+                frame.Vertices.Add(new FrameBuffer<float>());
+                frame.Colors.Add(new FrameBuffer<byte>());
+                frame.Normals.Add(new FrameBuffer<byte>());
+                frame.Versions.Add(0);
+            }
+
+            if (frame.Vertices.Count > numCameras)
+            {
+                int numRemoved = frame.Vertices.Count - numCameras;
+                frame.Vertices.RemoveRange(numCameras, numRemoved);
+                frame.Colors.RemoveRange(numCameras, numRemoved);
+                frame.Normals.RemoveRange(numCameras, numRemoved);
+                frame.Versions.RemoveRange(numCameras, numRemoved);
+            }
+
+            for (int i = 0; i < numCameras; i++)
+            {
+                // The cameras left out of the frame have a version of 0 and no points
+                if (frame.Versions[i] == cameraFrameVersions[i] && cameraFrameVersions[i] != 0)
+                    continue;
+
+                frame.Vertices[i].CopyFrom(cameraVertices[i]);
+                frame.Colors[i].CopyFrom(cameraColors[i]);
+                frame.Normals[i].CopyFrom(cameraNormals[i]);
+
+                isNewFrame |= frame.Versions[i] != cameraFrameVersions[i];
+                frame.Versions[i] = cameraFrameVersions[i];
+            }
+
+            return isNewFrame;
+        }
+
+        private void MergeFrames(CancellationToken token)
+        {
+            while (!token.IsCancellationRequested)
+            {
+                GatheredFrame frame;
+
+                if (!gatheredFrames.TryTake(out frame, StopCheckInterval))
+                    continue;
+
+                try
+                {
+                    frameStore.Publish(frame.Vertices, frame.Colors, frame.Versions, cameraServer.CameraPoses, frame.Trace, fusionVolume,
+                        frame.Normals);
+                }
+                finally
+                {
+                    freeFrames.Add(frame, CancellationToken.None);
+                }
+
+                FrameMerged?.Invoke();
+            }
+        }
+    }
+}
@@ -0,0 +1,222 @@
+﻿/***************************************************************************\
+
+Module Name:  FusionVolume.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module fuses the merged frames of all the cameras into a truncated signed
+distance field on the GPU, through the native fusion volume of the client
+DLL, and replaces their points with the surface of the volume. The surface
+is averaged over the last frames, which removes most of the depth noise of
+the cameras, and has about one point per voxel, which sets the number of
+points sent to the receivers. The surface can be extracted as a triangle
+mesh instead, whose vertices are the points of the frame.
+
+\***************************************************************************/
+
+using System;
+using System.Runtime.InteropServices;
+
+namespace LiveScanServer
+{
+    public class FusionVolume
+    {
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern IntPtr CreateFusionVolume();
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void DestroyFusionVolume(IntPtr handle);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        private static extern bool ConfigureFusionVolume(IntPtr handle, float[] minBounds, float[] maxBounds, float voxelSize, float truncation, float decay);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        private static extern unsafe bool IntegrateFusionPoints(IntPtr handle, float* vertices, byte* colors, int numVertices, float[] origin);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern int ExtractFusionPoints(IntPtr handle, out IntPtr vertices, out IntPtr colors);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern int ExtractFusionMesh(IntPtr handle, int step, out IntPtr vertices, out IntPtr colors, out IntPtr indices, out int numTriangles);
+
+        // Version of the cameras of a fused frame, whose points are all in the fused camera after them
+        private const ulong NoPointsFrameVersion = ulong.MaxValue;
+
+        private readonly CameraSettings settings;
+        private IntPtr volumeHandle = IntPtr.Zero;
+        private ulong fusedFrameVersion = 0;
+
+        // Configuration last applied, and whether it failed, so that a failed configuration is not retried every frame
+        private float[] configuration = new float[0];
+        private bool isConfigurationFailed = false;
+
+        public FusionVolume(CameraSettings settings)
+        {
+            this.settings = settings;
+        }
+
+        ~FusionVolume()
+        {
+            Release();
+        }
+
+        /// <summary>
+        /// Integrates the points of each camera of the frame into the volume, from the origin of its pose, and replaces
+        /// them with the surface of the volume. The cameras keep their poses but no points; the surface comes after them
+        /// as one more camera without a pose, so that the receivers which cull the points facing away from the cameras
+        /// keep it whole. When the surface is extracted as a mesh, its triangles are set on the frame as well. The volume
+        /// is released while the fusion is disabled.
+        /// </summary>
+        /// <returns>True if the frame was replaced with the fused surface; false if it was left as merged.</returns>
+        public unsafe bool Fuse(MergedFrame frame)
+        {
+            if (!settings.IsFusionEnabled)
+            {
+                Release();
+                return false;
+            }
+
+            if (!Configure())
+                return false;
+
+            ServerTrace.TraceZone zone = ServerTrace.Zone("Fuse");
+
+            try
+            {
+                float[] origin = new float[3];
+                int offset = 0;
+
+                fixed (float* vertices = frame.Vertices)
+                fixed (byte* colors = frame.Colors)
+                {
+                    for (int i = 0; i < frame.CameraVertexCounts.Count; i++)
+                    {
+                        int count = Math.Min(frame.CameraVertexCounts[i], frame.VertexCount - offset);
+
+                        // The translation of the pose is the position of the camera in the world
+                        for (int j = 0; j < 3; j++)
+                            origin[j] = i < frame.CameraPoses.Count ? frame.CameraPoses[i].T[j] : 0.0f;
+
+                        if (count > 0)
+                            IntegrateFusionPoints(volumeHandle, vertices + 3 * offset, colors + 3 * offset, count, origin);
+
+                        offset += Math.Max(count, 0);
+                    }
+                }
+
+                IntPtr fusedVertices, fusedColors, fusedIndices = IntPtr.Zero;
+                int numTriangles = 0;
+                int numPoints = settings.FusionMeshStep > 0
+                    ? ExtractFusionMesh(volumeHandle, settings.FusionMeshStep, out fusedVertices, out fusedColors, out fusedIndices, out numTriangles)
+                    : ExtractFusionPoints(volumeHandle, out fusedVertices, out fusedColors);
+
+                if (numPoints < 0)
+                    return false;
+
+                if (frame.Indices.Length < 3 * numTriangles)
+                    frame.Indices = new int[3 * numTriangles];
+
+                if (numTriangles > 0)
+                    Marshal.Copy(fusedIndices, frame.Indices, 0, 3 * numTriangles);
+
+                if (frame.Vertices.Length < 3 * numPoints)
+                    frame.Vertices = new float[3 * numPoints];
+
+                if (frame.Colors.Length < 3 * numPoints)
+                    frame.Colors = new byte[3 * numPoints];
+
+                if (numPoints > 0)
+                {
+                    Marshal.Copy(fusedVertices, frame.Vertices, 0, 3 * numPoints);
+                    Marshal.Copy(fusedColors, frame.Colors, 0, 3 * numPoints);
+                }
+
+                int numCameras = frame.CameraVertexCounts.Count;
+                frame.CameraVertexCounts.Clear();
+                frame.CameraFrameVersions.Clear();
+
+                for (int i = 0; i < numCameras; i++)
+                {
+                    frame.CameraVertexCounts.Add(0);
+                    frame.CameraFrameVersions.Add(NoPointsFrameVersion);
+                }
+
+                frame.CameraVertexCounts.Add(numPoints);
+                frame.CameraFrameVersions.Add(++fusedFrameVersion);
+                frame.VertexCount = numPoints;
+                frame.TriangleCount = numTriangles;
+
+                // The normals of the cameras do not apply to the points of the surface
+                frame.HasNormals = false;
+
+                return true;
+            }
+            finally
+            {
+                zone.Dispose();
+            }
+        }
+
+        /// <summary>
+        /// Releases the native volume and its GPU buffers; the next fused frame starts from an empty volume
+        /// </summary>
+        public void Release()
+        {
+            if (volumeHandle != IntPtr.Zero)
+            {
+                DestroyFusionVolume(volumeHandle);
+                volumeHandle = IntPtr.Zero;
+            }
+
+            configuration = new float[0];
+            isConfigurationFailed = false;
+        }
+
+        /// <summary>
+        /// Sets the volume to the intersection of the bounds and the capture volume, creating it if needed. The capture
+        /// volume is centered on the origin of the calibration on x and y, and in front of it on z, like the voxel grid
+        /// of the clients.
+        /// </summary>
+        private bool Configure()
+        {
+            float halfRange = settings.CaptureRange / 2;
+            float[] captureMin = { -halfRange, -halfRange, 0.0f };
+            float[] captureMax = { halfRange, halfRange, settings.CaptureRange };
+            float[] minBounds = new float[3];
+            float[] maxBounds = new float[3];
+
+            for (int i = 0; i < 3; i++)
+            {
+                minBounds[i] = Math.Max(settings.MinBounds[i], captureMin[i]);
+                maxBounds[i] = Math.Min(settings.MaxBounds[i], captureMax[i]);
+            }
+
+            float[] newConfiguration = { minBounds[0], minBounds[1], minBounds[2], maxBounds[0], maxBounds[1], maxBounds[2],
+                settings.FusionVoxelSize, settings.FusionTruncation, settings.FusionDecay };
+            bool isChanged = newConfiguration.Length != configuration.Length;
+
+            for (int i = 0; !isChanged && i < newConfiguration.Length; i++)
+                isChanged = newConfiguration[i] != configuration[i];
+
+            if (!isChanged)
+                return !isConfigurationFailed;
+
+            configuration = newConfiguration;
+
+            if (volumeHandle == IntPtr.Zero)
+                volumeHandle = CreateFusionVolume();
+
+            isConfigurationFailed = !ConfigureFusionVolume(volumeHandle, minBounds, maxBounds, settings.FusionVoxelSize,
+                settings.FusionTruncation, settings.FusionDecay);
+
+            if (isConfigurationFailed)
+                Logger.Log("The fusion volume could not be created on the GPU; the frames are sent without fusion");
+
+            return !isConfigurationFailed;
+        }
+    }
+}
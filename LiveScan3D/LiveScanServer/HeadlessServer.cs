@@ -0,0 +1,353 @@
+﻿/***************************************************************************\
+
+Module Name:  HeadlessServer.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module runs the server without its UI, for the capture hosts which only
+stream: the camera and the transfer servers are started with the settings of
+a file, and the frames of the cameras are merged for the receivers from the
+start, without a message pump, a live view or the timers of the form. A
+control socket on the loopback interface takes one command per line and
+answers each with one line, so that the server can be scripted: querying its
+status, calibrating the cameras, capturing the streams of the receivers,
+saving the settings and stopping it.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+using System.Text;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace LiveScanServer
+{
+    public sealed class HeadlessServer
+    {
+        public const int DefaultControlPort = 48006;
+
+        private const int ControlReadTimeoutMs = 60000; // Idle control connections are closed after a minute
+
+        private readonly string settingsPath;
+        private readonly int controlPort;
+        private readonly CameraSettings settings;
+        private readonly CameraServer cameraServer;
+        private readonly TransferServer transferServer;
+        private readonly MergedFrameStore frameStore = new MergedFrameStore();
+        private readonly FramePipeline framePipeline;
+        private readonly MergedFramePublisher framePublisher;
+        private readonly CalibrationMonitor calibrationMonitor;
+        private readonly ExposureCoordinator exposureCoordinator;
+        private readonly FusionVolume fusionVolume;
+
+        private readonly ManualResetEventSlim stopEvent = new ManualResetEventSlim(false);
+        private volatile bool isStopRequested = false;
+        private TcpListener controlListener;
+        private Thread pipelineThread;
+
+        // Latest states of the clients, as the form shows them in its client list
+        private List<string> clientStates = new List<string>();
+        private readonly object clientStatesLock = new object();
+        private readonly List<int> calibrationSamples = new List<int>();
+        private int[] lastCollectionCounts = new int[GC.MaxGeneration + 1];
+
+        /// <param name="settingsPath">Settings of the cameras, as saved by the form; the defaults are used if it cannot be read</param>
+        /// <param name="controlPort">Port of the control socket, on the loopback interface</param>
+        public HeadlessServer(string settingsPath, int controlPort)
+        {
+            this.settingsPath = settingsPath;
+            this.controlPort = controlPort;
+
+            settings = CameraSettings.Load(settingsPath);
+
+            cameraServer = new CameraServer(settings);
+            cameraServer.OnClientListChanged += UpdateClientStates;
+
+            calibrationMonitor = new CalibrationMonitor(cameraServer, settings);
+            calibrationMonitor.DriftMeasured += LogCalibrationDrift;
+            exposureCoordinator = new ExposureCoordinator(cameraServer, settings);
+
+            fusionVolume = new FusionVolume(settings);
+            framePipeline = new FramePipeline(cameraServer, frameStore, fusionVolume);
+
+            transferServer = new TransferServer();
+            transferServer.FrameStore = frameStore;
+            transferServer.DocumentInfo = cameraServer.DocumentInfo;
+            transferServer.Settings = settings;
+            transferServer.DocumentSizeChanged += cameraServer.SetMaxDocumentSize;
+            framePipeline.FrameMerged += transferServer.NotifyFrameUpdated;
+
+            framePublisher = new MergedFramePublisher(frameStore);
+            framePipeline.FrameMerged += framePublisher.NotifyFrameMerged;
+        }
+
+        /// <summary>
+        /// Starts the servers and launches the clients as the form does, then serves the control socket until a stop
+        /// command
+        /// </summary>
+        /// <param name="replayPaths">Raw recordings replayed instead of the connected cameras; empty to use the cameras</param>
+        /// <param name="isReplayRealTime">Replay the recordings at the speed they were recorded at, instead of as fast as they are processed</param>
+        /// <param name="nodes">Capture nodes whose cameras are also launched, as host or host:port</param>
+        /// <param name="isIsolated">Run each connected camera in its own worker process</param>
+        public void Run(string[] replayPaths, bool isReplayRealTime, string[] nodes, bool isIsolated)
+        {
+            transferServer.StartPointCloudServer();
+            transferServer.StartDocumentServer();
+            framePublisher.Start();
+
+            if (replayPaths.Length > 0)
+                cameraServer.LaunchReplayClients(replayPaths, isReplayRealTime);
+            else
+                cameraServer.LaunchConnectedClients(isIsolated);
+
+            if (nodes.Length > 0)
+                cameraServer.LaunchRemoteClients(nodes);
+
+            calibrationMonitor.Start();
+            exposureCoordinator.Start();
+
+            // The frames are merged from the start, since the receivers are the only consumers of the headless server
+            pipelineThread = new Thread(() => framePipeline.Run(() => isStopRequested)) { IsBackground = true, Name = "FramePipeline" };
+            pipelineThread.Start();
+
+            controlListener = new TcpListener(IPAddress.Loopback, controlPort);
+            controlListener.Start();
+            Task.Run(AcceptControlConnections);
+
+            Logger.Log("Headless server started with the settings of " + settingsPath + ", control port " + controlPort + ".");
+
+            stopEvent.Wait();
+
+            // Stop servers
+            controlListener.Stop();
+            pipelineThread.Join();
+            calibrationMonitor.Stop();
+            exposureCoordinator.Stop();
+            cameraServer.StopServer();
+            transferServer.StopPointCloudServer();
+            transferServer.StopDocumentServer();
+            transferServer.StopCapture();
+            framePublisher.Stop();
+
+            Logger.Log("Headless server stopped.");
+        }
+
+        private async Task AcceptControlConnections()
+        {
+            while (!isStopRequested)
+            {
+                TcpClient client;
+
+                try
+                {
+                    client = await controlListener.AcceptTcpClientAsync();
+                }
+                catch (Exception ex) when (ex is SocketException || ex is ObjectDisposedException)
+                {
+                    return;
+                }
+
+                _ = Task.Run(() => ServeControlConnection(client));
+            }
+        }
+
+        private void ServeControlConnection(TcpClient client)
+        {
+            using (client)
+            {
+                try
+                {
+                    client.ReceiveTimeout = ControlReadTimeoutMs;
+                    NetworkStream stream = client.GetStream();
+                    StreamReader reader = new StreamReader(stream, Encoding.ASCII);
+                    StreamWriter writer = new StreamWriter(stream, Encoding.ASCII) { AutoFlush = true, NewLine = "\n" };
+                    string line;
+
+                    while (!isStopRequested && (line = reader.ReadLine()) != null)
+                    {
+                        if (line.Trim().Length > 0)
+                            writer.WriteLine(ExecuteCommand(line.Trim()));
+                    }
+                }
+                catch (IOException)
+                {
+                    // The script disconnected or went idle
+                }
+            }
+        }
+
+        /// <summary>
+        /// Executes a control command and returns its single line reply, which starts with "ok" or "error"
+        /// </summary>
+        private string ExecuteCommand(string line)
+        {
+            string[] words = line.Split(new[] { ' ' }, StringSplitOptions.RemoveEmptyEntries);
+
+            switch (words[0].ToLowerInvariant())
+            {
+                case "status":
+                    return "ok " + GetStatus();
+
+                case "calibrate":
+                    cameraServer.Calibrate();
+                    return "ok calibrating";
+
+                case "refine":
+                    if (!cameraServer.AllCamerasCalibrated)
+                        return "error not all of the devices are calibrated";
+
+                    PoseCorrections corrections = new ProjectiveRefiner().Refine(cameraServer, settings.NumICPIterations, settings.ProjectiveSampleStep,
+                        settings.ProjectiveMaxDistance);
+
+                    if (corrections == null)
+                        return "error failed to get the depth frames of the devices";
+
+                    cameraServer.ApplyPoseCorrections(corrections.Rs, corrections.Ts);
+                    return "ok refined in " + corrections.NumIterations + " iterations, mean error " + (corrections.Error * 1000.0f).ToString("0.0") + " mm";
+
+                case "learnmask":
+                    cameraServer.LearnExclusionMask(-1);
+                    return "ok learning";
+
+                case "clearmask":
+                    cameraServer.LearnExclusionMask(0);
+                    return "ok cleared";
+
+                case "savering":
+                    if (settings.RingRecordingSeconds <= 0)
+                        return "error ring recording is disabled in the settings";
+
+                    cameraServer.SaveFrameRing(settings.RingRecordingSeconds);
+                    return "ok saving the last " + settings.RingRecordingSeconds + " s";
+
+                case "capture":
+                    return words.Length > 1 && words[1] == "stop" ? StopCapture() : StartCapture(words.Length > 1 ? words[1] : null);
+
+                case "savesettings":
+                    settings.Save(settingsPath);
+                    return "ok saved to " + settingsPath;
+
+                case "stop":
+                    isStopRequested = true;
+                    stopEvent.Set();
+                    return "ok stopping";
+
+                default:
+                    return "error unknown command; expected status, calibrate, refine, learnmask, clearmask, savering, capture [path|stop], savesettings or stop";
+            }
+        }
+
+        private string StartCapture(string path)
+        {
+            if (transferServer.IsCapturing)
+                return "error already capturing";
+
+            path = path ?? "stream_" + DateTime.Now.ToString("yyyyMMdd_HHmmss") + ".lsc";
+
+            try
+            {
+                transferServer.StartCapture(path);
+            }
+            catch (Exception ex) when (ex is IOException || ex is UnauthorizedAccessException)
+            {
+                return "error " + ex.Message;
+            }
+
+            return "ok capturing to " + path;
+        }
+
+        private string StopCapture()
+        {
+            StreamCapture capture = transferServer.StopCapture();
+
+            if (capture == null)
+                return "error not capturing";
+
+            return "ok captured " + capture.NumWrites + " writes, " + (capture.NumBytes >> 10) + " KB, to " + capture.Path;
+        }
+
+        /// <summary>
+        /// The states of the clients, the calibration progress and the counters of the frame path since the last status,
+        /// separated by " | "
+        /// </summary>
+        private string GetStatus()
+        {
+            cameraServer.UpdatePerfStats();
+
+            List<string> parts = new List<string>();
+
+            lock (clientStatesLock)
+            {
+                parts.Add(cameraServer.ClientCount + " clients");
+                parts.AddRange(clientStates);
+            }
+
+            lock (calibrationSamples)
+            {
+                if (cameraServer.GetCalibrationProgress(calibrationSamples, out int numRequiredSamples))
+                {
+                    List<string> progress = new List<string>();
+
+                    for (int i = 0; i < calibrationSamples.Count; i++)
+                        progress.Add("device " + i + " " + (calibrationSamples[i] < 0 ? "done" : calibrationSamples[i] + "/" + numRequiredSamples));
+
+                    parts.Add("calibrating: " + string.Join(", ", progress));
+                }
+            }
+
+            int numSkippedFrames = transferServer.TakeNumSkippedFrames();
+            long numAllocations = FrameAllocations.TakeAllocations(out long numAllocatedBytes);
+            int[] collectionCounts = new int[GC.MaxGeneration + 1];
+
+            lock (lastCollectionCounts)
+            {
+                for (int i = 0; i < collectionCounts.Length; i++)
+                {
+                    collectionCounts[i] = GC.CollectionCount(i) - lastCollectionCounts[i];
+                    lastCollectionCounts[i] += collectionCounts[i];
+                }
+            }
+
+            parts.Add("queued: merge " + framePipeline.TakeMergeQueueDepth() + "/" + framePipeline.MergeQueueCapacity
+                + ", send " + transferServer.TakeSendQueueDepth() + "/" + transferServer.SendQueueCapacity
+                + (numSkippedFrames > 0 ? ", " + numSkippedFrames + " not encoded" : "")
+                + "; frame allocations " + numAllocations + " (" + (numAllocatedBytes >> 10) + " KB), GC " + string.Join("/", collectionCounts));
+            parts.Add("locks taken/waited for/wait ms/hold ms: " + ProfiledLock.TakeSummary());
+
+            // The states of the clients hold their timings on several lines
+            return string.Join(" | ", parts).Replace("\r", "").Replace("\n", " ");
+        }
+
+        // Called by the camera server whenever a client changes state or its timings are updated
+        private void UpdateClientStates(List<CameraClient> clients)
+        {
+            List<string> states = new List<string>();
+
+            for (int i = 0; i < clients.Count; i++)
+                states.Add(clients[i].ClientState);
+
+            lock (clientStatesLock)
+            {
+                clientStates = states;
+            }
+        }
+
+        private void LogCalibrationDrift(CameraDrift[] drift, bool isCorrected)
+        {
+            for (int i = 0; i < drift.Length; i++)
+            {
+                if (drift[i].IsSignificant)
+                {
+                    Logger.Log((isCorrected ? "Corrected the calibration drift of device " : "The calibration drifted on device ") + i + " by "
+                        + drift[i].TranslationMm.ToString("0.0") + " mm, " + drift[i].RotationDegrees.ToString("0.00") + " deg.");
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,147 @@
+﻿/***************************************************************************\
+
+Module Name:  LatencyMonitor.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module traces the latency of the frames from their acquisition by the
+camera clients to their display by the receivers. Each merged frame keeps
+the time it reached each hop on the server, and the receivers which request
+traces report, for each frame they display, how long after its arrival it
+was decoded and displayed. The receivers only report durations measured with
+their own clock, so the clocks of the server and of the receivers never need
+to be synchronized: the network delay is half the round trip of the frame
+and of its report, less the time the receiver held the frame.
+
+\***************************************************************************/
+
+using System;
+using System.Diagnostics;
+
+namespace LiveScanServer
+{
+    /// <summary>
+    /// Times at which a merged frame reached each hop, in microseconds of the server clock; 0 for the hops it did not reach
+    /// </summary>
+    public sealed class FrameTrace
+    {
+        public int FrameId = 0; // Version of the merged frame
+        public ulong DeviceTimeStampUs = 0; // Global timestamp of the newest camera frame of the merged frame, on the system clock of the server
+        public long AcquireTimeUs = 0; // Oldest camera frame returned by the capture manager of its client
+        public long ProcessedTimeUs = 0; // Newest camera frame published by its client
+        public long AssembleTimeUs = 0; // Camera frames leased by the frame assembler
+        public long MergeTimeUs = 0; // Camera frames merged into the frame store
+        public long EncodeTimeUs = 0; // Merged frame encoded for the receivers
+
+        public static long GetTimeUs()
+        {
+            return (long)(Stopwatch.GetTimestamp() * (1e6 / Stopwatch.Frequency));
+        }
+
+        public void CopyFrom(FrameTrace trace)
+        {
+            FrameId = trace.FrameId;
+            DeviceTimeStampUs = trace.DeviceTimeStampUs;
+            AcquireTimeUs = trace.AcquireTimeUs;
+            ProcessedTimeUs = trace.ProcessedTimeUs;
+            AssembleTimeUs = trace.AssembleTimeUs;
+            MergeTimeUs = trace.MergeTimeUs;
+            EncodeTimeUs = trace.EncodeTimeUs;
+        }
+
+        public FrameTrace Clone()
+        {
+            return (FrameTrace)MemberwiseClone();
+        }
+    }
+
+    /// <summary>
+    /// Report of a frame displayed by a receiver, in microseconds of the clock of the receiver
+    /// </summary>
+    public sealed class LatencyReport
+    {
+        // Wire size: frame id, then the times from the arrival of the frame to its decoding, its display and the report (ints)
+        public const int Size = 4 * sizeof(int);
+
+        public readonly int FrameId;
+        public readonly int DecodedUs; // The body of the frame is received while it is decoded
+        public readonly int DisplayedUs;
+        public readonly int ReportedUs; // The report is sent with the next request, after the frame is displayed
+
+        public LatencyReport(byte[] buffer)
+        {
+            FrameId = BitConverter.ToInt32(buffer, 0);
+            DecodedUs = BitConverter.ToInt32(buffer, 4);
+            DisplayedUs = BitConverter.ToInt32(buffer, 8);
+            ReportedUs = BitConverter.ToInt32(buffer, 12);
+        }
+    }
+
+    public sealed class LatencyMonitor
+    {
+        private const double ReportWeight = 0.1; // Weight of the last report in the moving averages
+        private const double LogInterval = 10.0; // Seconds between two logs of the latencies
+
+        private readonly object monitorLock = new object();
+        private DateTime lastLogTime = DateTime.MinValue;
+
+        // Moving averages of the time the frames reported spent in each hop, in milliseconds, exposed for monitoring
+        public double ProcessMs { get; private set; } = 0.0; // From the acquisition of the oldest camera frame to the publication of the newest
+        public double AssembleMs { get; private set; } = 0.0; // Waiting for the frames of the other cameras, within the sync window
+        public double MergeMs { get; private set; } = 0.0;
+        public double EncodeMs { get; private set; } = 0.0;
+        public double SendMs { get; private set; } = 0.0; // Waiting for the receiver to request a frame, until the frame is written
+        public double NetworkMs { get; private set; } = 0.0; // One way, from half the round trip
+        public double DecodeMs { get; private set; } = 0.0; // From the arrival of the frame header to the decoded frame
+        public double DisplayMs { get; private set; } = 0.0; // In the jitter buffer, until the frame is rendered
+        public double TotalMs { get; private set; } = 0.0; // From the acquisition of the oldest camera frame to the display
+        public long NumReports { get; private set; } = 0;
+
+        /// <summary>
+        /// Adds the report of a frame displayed by a receiver to the latencies
+        /// </summary>
+        /// <param name="trace">Trace of the frame reported</param>
+        /// <param name="sendTimeUs">Time at which the frame started to be written to the receiver</param>
+        /// <param name="reportTimeUs">Time at which the report was received</param>
+        /// <param name="report">Report of the receiver</param>
+        public void AddReport(FrameTrace trace, long sendTimeUs, long reportTimeUs, LatencyReport report)
+        {
+            // The frames merged before the cameras published any frame have no acquisition to trace from
+            if (trace.AcquireTimeUs == 0)
+                return;
+
+            double networkUs = Math.Max(0.0, 0.5 * (reportTimeUs - sendTimeUs - report.ReportedUs));
+
+            lock (monitorLock)
+            {
+                ProcessMs = Average(ProcessMs, trace.ProcessedTimeUs - trace.AcquireTimeUs);
+                AssembleMs = Average(AssembleMs, trace.AssembleTimeUs - trace.ProcessedTimeUs);
+                MergeMs = Average(MergeMs, trace.MergeTimeUs - trace.AssembleTimeUs);
+                EncodeMs = Average(EncodeMs, trace.EncodeTimeUs - trace.MergeTimeUs);
+                SendMs = Average(SendMs, sendTimeUs - trace.EncodeTimeUs);
+                NetworkMs = Average(NetworkMs, networkUs);
+                DecodeMs = Average(DecodeMs, report.DecodedUs);
+                DisplayMs = Average(DisplayMs, report.DisplayedUs - report.DecodedUs);
+                TotalMs = Average(TotalMs, sendTimeUs - trace.AcquireTimeUs + networkUs + report.DisplayedUs);
+                NumReports++;
+
+                if ((DateTime.Now - lastLogTime).TotalSeconds >= LogInterval)
+                {
+                    lastLogTime = DateTime.Now;
+                    Logger.Log($"Latency: {TotalMs:F1} ms from acquisition to display (process {ProcessMs:F1}, assemble {AssembleMs:F1}, "
+                        + $"merge {MergeMs:F1}, encode {EncodeMs:F1}, send {SendMs:F1}, network {NetworkMs:F1}, decode {DecodeMs:F1}, "
+                        + $"display {DisplayMs:F1} ms), frame {trace.FrameId} captured at {trace.DeviceTimeStampUs} us");
+                }
+            }
+        }
+
+        private double Average(double averageMs, double durationUs)
+        {
+            double durationMs = durationUs / 1000.0;
+
+            return NumReports == 0 ? durationMs : averageMs + ReportWeight * (durationMs - averageMs);
+        }
+    }
+}
@@ -19,7 +19,12 @@
         private System.Windows.Forms.Button btSettings;
         private System.ComponentModel.BackgroundWorker refineWorker;
         private System.Windows.Forms.ToolStripStatusLabel statusLabel;
+        private System.Windows.Forms.ToolStripStatusLabel pipelineLabel;
         private System.Windows.Forms.Label lbSeqName;
+        private System.Windows.Forms.Button btSaveRing;
+        private System.Windows.Forms.Button btLearnMask;
+        private System.Windows.Forms.Button btClearMask;
+        private System.Windows.Forms.Button btCaptureStream;
 
         /// <summary>
         /// Clean up any resources being used
@@ -47,6 +52,7 @@
             this.lClientListBox = new System.Windows.Forms.ListBox();
             this.statusStrip1 = new System.Windows.Forms.StatusStrip();
             this.statusLabel = new System.Windows.Forms.ToolStripStatusLabel();
+            this.pipelineLabel = new System.Windows.Forms.ToolStripStatusLabel();
             this.recordingWorker = new System.ComponentModel.BackgroundWorker();
             this.txtSeqName = new System.Windows.Forms.TextBox();
             this.btRefineCalib = new System.Windows.Forms.Button();
@@ -57,6 +63,10 @@
             this.btSettings = new System.Windows.Forms.Button();
             this.refineWorker = new System.ComponentModel.BackgroundWorker();
             this.lbSeqName = new System.Windows.Forms.Label();
+            this.btSaveRing = new System.Windows.Forms.Button();
+            this.btLearnMask = new System.Windows.Forms.Button();
+            this.btClearMask = new System.Windows.Forms.Button();
+            this.btCaptureStream = new System.Windows.Forms.Button();
             this.statusStrip1.SuspendLayout();
             this.SuspendLayout();
             // 
@@ -93,8 +103,9 @@
             // 
             this.statusStrip1.ImageScalingSize = new System.Drawing.Size(20, 20);
             this.statusStrip1.Items.AddRange(new System.Windows.Forms.ToolStripItem[] {
-            this.statusLabel});
-            this.statusStrip1.Location = new System.Drawing.Point(0, 135);
+            this.statusLabel,
+            this.pipelineLabel});
+            this.statusStrip1.Location = new System.Drawing.Point(0, 164);
             this.statusStrip1.Name = "statusStrip1";
             this.statusStrip1.Size = new System.Drawing.Size(445, 22);
             this.statusStrip1.TabIndex = 6;
@@ -104,6 +115,13 @@
             // 
             this.statusLabel.Name = "statusLabel";
             this.statusLabel.Size = new System.Drawing.Size(0, 15);
+            this.statusLabel.Spring = true;
+            this.statusLabel.TextAlign = System.Drawing.ContentAlignment.MiddleLeft;
+            // 
+            // pipelineLabel
+            // 
+            this.pipelineLabel.Name = "pipelineLabel";
+            this.pipelineLabel.Size = new System.Drawing.Size(0, 15);
             // 
             // recordingWorker
             // 
@@ -180,11 +198,55 @@
             this.lbSeqName.TabIndex = 14;
             this.lbSeqName.Text = "Sequence name:";
             // 
+            // btSaveRing
+            // 
+            this.btSaveRing.Location = new System.Drawing.Point(329, 126);
+            this.btSaveRing.Name = "btSaveRing";
+            this.btSaveRing.Size = new System.Drawing.Size(95, 23);
+            this.btSaveRing.TabIndex = 15;
+            this.btSaveRing.Text = "Save last frames";
+            this.btSaveRing.UseVisualStyleBackColor = true;
+            this.btSaveRing.Click += new System.EventHandler(this.OnSaveRingButtonClick);
+            // 
+            // btLearnMask
+            // 
+            this.btLearnMask.Location = new System.Drawing.Point(10, 126);
+            this.btLearnMask.Name = "btLearnMask";
+            this.btLearnMask.Size = new System.Drawing.Size(95, 23);
+            this.btLearnMask.TabIndex = 16;
+            this.btLearnMask.Text = "Learn empty";
+            this.btLearnMask.UseVisualStyleBackColor = true;
+            this.btLearnMask.Click += new System.EventHandler(this.OnLearnMaskButtonClick);
+            // 
+            // btClearMask
+            // 
+            this.btClearMask.Location = new System.Drawing.Point(118, 126);
+            this.btClearMask.Name = "btClearMask";
+            this.btClearMask.Size = new System.Drawing.Size(95, 23);
+            this.btClearMask.TabIndex = 17;
+            this.btClearMask.Text = "Clear mask";
+            this.btClearMask.UseVisualStyleBackColor = true;
+            this.btClearMask.Click += new System.EventHandler(this.OnClearMaskButtonClick);
+            // 
+            // btCaptureStream
+            // 
+            this.btCaptureStream.Location = new System.Drawing.Point(226, 126);
+            this.btCaptureStream.Name = "btCaptureStream";
+            this.btCaptureStream.Size = new System.Drawing.Size(95, 23);
+            this.btCaptureStream.TabIndex = 18;
+            this.btCaptureStream.Text = "Capture stream";
+            this.btCaptureStream.UseVisualStyleBackColor = true;
+            this.btCaptureStream.Click += new System.EventHandler(this.OnCaptureStreamButtonClick);
+            // 
             // MainWindowForm
             // 
             this.AutoScaleDimensions = new System.Drawing.SizeF(6F, 13F);
             this.AutoScaleMode = System.Windows.Forms.AutoScaleMode.Font;
-            this.ClientSize = new System.Drawing.Size(445, 157);
+            this.ClientSize = new System.Drawing.Size(445, 186);
+            this.Controls.Add(this.btCaptureStream);
+            this.Controls.Add(this.btClearMask);
+            this.Controls.Add(this.btLearnMask);
+            this.Controls.Add(this.btSaveRing);
             this.Controls.Add(this.lbSeqName);
             this.Controls.Add(this.btSettings);
             this.Controls.Add(this.btShowLive);
@@ -23,27 +23,25 @@ using System.Collections.Generic;
 using System.ComponentModel;
 using System.IO;
 using System.Runtime.InteropServices;
-using System.Runtime.Serialization;
-using System.Threading;
 using System.Windows.Forms;
 
 namespace LiveScanServer
 {
     public partial class MainWindowForm : Form
     {
-        // DLL imports for some required methods from the Orbbec SDK
-        [DllImport("OrbbecSDK.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern IntPtr ob_create_context();
-
-        [DllImport("OrbbecSDK.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern IntPtr ob_query_device_list(IntPtr ctx);
-
-        [DllImport("OrbbecSDK.dll", CallingConvention = CallingConvention.Cdecl)]
-        private static extern UIntPtr ob_device_list_device_count(IntPtr devList);
-
         // DLL import for the ICP method (used for camera pose estimation)
         [DllImport("ICP.dll")]
-        private static extern float ICP(IntPtr verts1, IntPtr verts2, int nVerts1, int nVerts2, float[] R, float[] t, int maxIter = 200);
+        private static extern float RefineAllPoses(float[] verts, int[] numVertsPerCamera, int numCameras, float[] Rs, float[] ts, int numRefineIter,
+            int maxIterPerLevel, int numLevels, float coarsestVoxelSize, [MarshalAs(UnmanagedType.I1)] bool isPointToPlane, int maxSamplesPerCamera,
+            int[] numIterationsPerLevel);
+
+        [DllImport("ICP.dll")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        private static extern bool SetNeighbourSearchBackend(int backend);
+
+        private const int KDTreeSearch = 0;
+        private const int GpuGridSearch = 1;
+        private const int VoxelHashSearch = 2;
 
         private bool isRecording = false;
         private bool isSaving = false;
@@ -59,80 +57,130 @@ namespace LiveScanServer
         private OpenGLWindow openGLWindow;
         private System.Timers.Timer statusBarTimer = new System.Timers.Timer();
 
-        // Vertices from all of the cameras
-        private List<float> vertices = new List<float>();
+        // Polls the progress of the clients while they calibrate
+        private const int CalibrationProgressInterval = 250; // In milliseconds
+        private System.Timers.Timer calibrationProgressTimer = new System.Timers.Timer(CalibrationProgressInterval);
+        private List<int> calibrationSamples = new List<int>();
 
-        // Vertices from each camera, separated in lists
-        private List<List<float>> cameraVertices = new List<List<float>>();
+        // Updates the timings of the frame loop of the clients shown in the client list
+        private const int PerfStatsInterval = 2000; // In milliseconds
+        private System.Timers.Timer perfStatsTimer = new System.Timers.Timer(PerfStatsInterval);
+        private int[] lastCollectionCounts = new int[GC.MaxGeneration + 1]; // Collections of each generation at the last update
 
-        // Recorded frame vertices from each camera, separated in lists
-        private List<List<float>> cameraRecordedVertices = new List<List<float>>();
+        // Latest merged frame of all of the cameras, read in place by the live view and the transfer server
+        private MergedFrameStore frameStore = new MergedFrameStore();
 
-        // Color data from all of the cameras
-        private List<byte> colors = new List<byte>();
+        // Gathers the frames of the cameras and merges them into the frame store, on stages of their own
+        private FramePipeline framePipeline;
 
-        // Color data from each camera, separated in lists
-        private List<List<byte>> cameraColors = new List<List<byte>>();
-
-        // Recorded frame color data from each camera, separated in lists
-        private List<List<byte>> cameraRecordedColors = new List<List<byte>>();
+        // Shares the merged frames with the native subscribers of the process, such as the plugins
+        private MergedFramePublisher framePublisher;
 
-        // Position from each camera
-        private List<AffineTransform> cameraPoses = new List<AffineTransform>();
+        // Vertices from each camera, separated in lists, as retrieved for the refinement
+        private List<FrameBuffer<float>> cameraVertices = new List<FrameBuffer<float>>();
 
-        public MainWindowForm()
+        // Color data from each camera, separated in lists
+        private List<FrameBuffer<byte>> cameraColors = new List<FrameBuffer<byte>>();
+
+        // Replaces the points of the merged frames with the surface fused from all the cameras, when enabled
+        private FusionVolume fusionVolume;
+
+        // Refines the poses from the depth frames of the cameras on request, while the monitor checks them regularly
+        private ProjectiveRefiner projectiveRefiner = new ProjectiveRefiner();
+        private CalibrationMonitor calibrationMonitor;
+        private ExposureCoordinator exposureCoordinator;
+
+        /// <summary>
+        /// Creates the main form and launches a client for each connected camera, or for each raw recording to replay,
+        /// then for each camera of the capture nodes
+        /// </summary>
+        /// <param name="replayPaths">Raw recordings replayed instead of the connected cameras; empty to use the cameras</param>
+        /// <param name="isReplayRealTime">Replay the recordings at the speed they were recorded at, instead of as fast as they are processed</param>
+        /// <param name="nodes">Capture nodes whose cameras are also launched, as host or host:port</param>
+        /// <param name="isIsolated">Run each connected camera in its own worker process</param>
+        public MainWindowForm(string[] replayPaths, bool isReplayRealTime, string[] nodes, bool isIsolated)
         {
-            // Tries to read the settings from "settings.bin". If it fails, the settings are set to default values.
-            try
-            {
-                IFormatter formatter = new System.Runtime.Serialization.Formatters.Binary.BinaryFormatter();
-                Stream stream = new FileStream("settings.bin", FileMode.Open, FileAccess.Read);
-                settings = (CameraSettings)formatter.Deserialize(stream);
-                stream.Close();
-            }
-            catch (Exception)
-            {
-            }
+            settings = CameraSettings.Load(CameraSettings.DefaultPath);
 
             // Create the servers
             cameraServer = new CameraServer(settings);
             cameraServer.OnClientListChanged += new ClientListChangedHandler(UpdateListView);
 
+            calibrationMonitor = new CalibrationMonitor(cameraServer, settings);
+            calibrationMonitor.DriftMeasured += ReportCalibrationDrift;
+
+            exposureCoordinator = new ExposureCoordinator(cameraServer, settings);
+
+            fusionVolume = new FusionVolume(settings);
+            framePipeline = new FramePipeline(cameraServer, frameStore, fusionVolume);
+            framePublisher = new MergedFramePublisher(frameStore);
+
+            calibrationProgressTimer.AutoReset = false;
+            calibrationProgressTimer.Elapsed += ReportCalibrationProgress;
+
+            perfStatsTimer.AutoReset = false;
+            perfStatsTimer.Elapsed += UpdatePerfStats;
+
             transferServer = new TransferServer();
 
-            // Set the transfer server to point to the same vertices and colors lists to avoid copying large arrays in memory
-            transferServer.Vertices = vertices;
-            transferServer.Colors = colors;
+            // The transfer server reads the merged frames in place, to avoid copying large arrays in memory
+            transferServer.FrameStore = frameStore;
 
             transferServer.DocumentInfo = cameraServer.DocumentInfo;
+            transferServer.Settings = settings;
+
+            // The cameras downscale the documents to the size the receivers render them at
+            transferServer.DocumentSizeChanged += cameraServer.SetMaxDocumentSize;
+
+            // Each merged frame is encoded by the transfer server and counted by the live view
+            framePipeline.FrameMerged += () =>
+            {
+                transferServer.NotifyFrameUpdated();
+                framePublisher.NotifyFrameMerged();
+
+                // Note that a new frame was obtained (this is used to estimate the FPS)
+                openGLWindow?.IncreaseFrameCounter();
+            };
 
             InitializeComponent();
 
             // Start the servers
             transferServer.StartPointCloudServer();
             transferServer.StartDocumentServer();
+            framePublisher.Start();
+
+            if (replayPaths.Length > 0)
+            {
+                cameraServer.LaunchReplayClients(replayPaths, isReplayRealTime);
+            }
+            else
+            {
+                cameraServer.LaunchConnectedClients(isIsolated);
+            }
 
-            // Find the number of connected cameras
-            IntPtr ctx = ob_create_context();
-            IntPtr devList = ob_query_device_list(ctx);
-            uint count = ob_device_list_device_count(devList).ToUInt32();
+            if (nodes.Length > 0)
+                cameraServer.LaunchRemoteClients(nodes);
 
-            cameraServer.LaunchClients(count);
+            calibrationMonitor.Start();
+            exposureCoordinator.Start();
+            perfStatsTimer.Start();
         }
 
         private void CloseForm(object sender, FormClosingEventArgs e)
         {
             // Cache current settings to a file for next launch
-            IFormatter formatter = new System.Runtime.Serialization.Formatters.Binary.BinaryFormatter();
-
-            Stream stream = new FileStream("settings.bin", FileMode.Create, FileAccess.Write);
-            formatter.Serialize(stream, settings);
-            stream.Close();
+            settings.Save(CameraSettings.DefaultPath);
 
             // Stop servers
+            calibrationProgressTimer.Stop();
+            perfStatsTimer.Stop();
+            calibrationMonitor.Stop();
+            exposureCoordinator.Stop();
             cameraServer.StopServer();
             transferServer.StopPointCloudServer();
             transferServer.StopDocumentServer();
+            transferServer.StopCapture();
+            framePublisher.Stop();
         }
 
         private void OpenSettingsForm(object sender, EventArgs e)
@@ -164,7 +212,8 @@ namespace LiveScanServer
             }
         }
 
-        // Called after a recording has been terminated to save recorded frames
+        // Called after a recording has been terminated to save recorded frames. The frames are read back from the files
+        // of the clients, so the live view and the transfer resume meanwhile.
         private void SaveFrames(object sender, RunWorkerCompletedEventArgs e)
         {
             isSaving = true;
@@ -173,6 +222,9 @@ namespace LiveScanServer
             btRecord.Enabled = true;
 
             savingWorker.RunWorkerAsync();
+
+            if (isLiveViewRunning)
+                RestartUpdateWorker();
         }
 
         private void OpenLiveViewWindow(object sender, DoWorkEventArgs e)
@@ -180,14 +232,9 @@ namespace LiveScanServer
             isLiveViewRunning = true;
             openGLWindow = new OpenGLWindow();
 
-            // Set openGLWindow variables to point to local arrays to avoid copying large arrays in memory
-            lock (vertices)
-            {
-                openGLWindow.Vertices = vertices;
-                openGLWindow.Colors = colors;
-                openGLWindow.CameraPoses = cameraPoses;
-                openGLWindow.Settings = settings;
-            }
+            // The window reads the merged frames in place, to avoid copying large arrays in memory
+            openGLWindow.FrameStore = frameStore;
+            openGLWindow.Settings = settings;
 
             openGLWindow.Run();
         }
@@ -207,46 +254,46 @@ namespace LiveScanServer
 
             BackgroundWorker worker = (BackgroundWorker)sender;
 
-            // This loop runs until it is either cancelled (using the btRecord button), or until there are no more recorded frames
-            while (!worker.CancellationPending)
-            {
-                bool success = cameraServer.TryGetRecordedFrame(ref cameraRecordedColors, ref cameraRecordedVertices);
-
-                // This indicates that there are no more recorded frames
-                if (!success)
-                    break;
+            // The frames are fetched here and written by the exporter on all the cores as they arrive
+            PlyExporter exporter = new PlyExporter(settings.SaveAsBinaryPLY);
+            List<RecordedFrame> frames = new List<RecordedFrame>();
 
-                numFrames++;
-                int numVerticesTotal = 0;
-                for (int i = 0; i < cameraRecordedColors.Count; i++)
+            // The writers are completed even if fetching fails, so that their threads do not wait for files forever
+            try
+            {
+                // This loop runs until it is either cancelled (using the btRecord button), or until there are no more recorded frames
+                while (!worker.CancellationPending)
                 {
-                    numVerticesTotal += cameraRecordedVertices[i].Count;
-                }
+                    bool success = cameraServer.TryGetRecordedFrame(frames);
 
-                List<byte> frameColors = new List<byte>();
-                List<Single> frameVertices = new List<Single>();
+                    // This indicates that there are no more recorded frames
+                    if (!success)
+                        break;
 
-                SetStatusBarOnTimer("Saving frame " + (numFrames).ToString() + ".", 5000);
+                    numFrames++;
 
-                for (int i = 0; i < cameraRecordedColors.Count; i++)
-                {                                 
-                    frameColors.AddRange(cameraRecordedColors[i]);
-                    frameVertices.AddRange(cameraRecordedVertices[i]);
+                    SetStatusBarOnTimer("Saving frame " + (numFrames).ToString() + ".", 5000);
 
-                    if (!settings.MergeScansForSave)
+                    if (settings.MergeScansForSave)
+                    {
+                        // Place frames from all clients in a single file
+                        string outputFilename = outDir + "\\" + numFrames.ToString().PadLeft(5, '0') + ".ply";
+                        exporter.Add(outputFilename, new List<RecordedFrame>(frames));
+                    }
+                    else
                     {
                         // Place frames from each client in separate files if requested
-                        string outputFilename = outDir + "\\" + numFrames.ToString().PadLeft(5, '0') + i.ToString() + ".ply";
-                        Utils.saveToPly(outputFilename, cameraRecordedVertices[i], cameraRecordedColors[i], settings.SaveAsBinaryPLY);                        
+                        for (int i = 0; i < frames.Count; i++)
+                        {
+                            string outputFilename = outDir + "\\" + numFrames.ToString().PadLeft(5, '0') + i.ToString() + ".ply";
+                            exporter.Add(outputFilename, new List<RecordedFrame> { frames[i] });
+                        }
                     }
                 }
-
-                // Place frames from all clients in a single file
-                if (settings.MergeScansForSave)
-                {
-                    string outputFilename = outDir + "\\" + numFrames.ToString().PadLeft(5, '0') + ".ply";
-                    Utils.saveToPly(outputFilename, frameVertices, frameColors, settings.SaveAsBinaryPLY);
-                }
+            }
+            finally
+            {
+                exporter.Complete();
             }
         }
 
@@ -255,59 +302,18 @@ namespace LiveScanServer
             cameraServer.ClearRecordedFrames();
             isSaving = false;
 
-            // If the live view window is open, restart the UpdateWorker
-            if (isLiveViewRunning)
-                RestartUpdateWorker();
-
             btRecord.Enabled = true;
             btRecord.Text = "Start recording";
             btRefineCalib.Enabled = true;
             btCalibrate.Enabled = true;
         }
 
-        // Continually requests frames that will be displayed in the live view window
+        // Continually gathers and merges the frames that will be displayed in the live view window, the merge of each
+        // frame overlapping with the gathering of the next
         private void UpdateLatestFrame(object sender, DoWorkEventArgs e)
         {
             BackgroundWorker worker = (BackgroundWorker)sender;
-            while (!worker.CancellationPending)
-            {
-                Thread.Sleep(1);
-
-                // Check that all connected cameras are initialized
-                if (!cameraServer.GetAllDevicesInitialized())
-                {
-                    continue;
-                }
-
-                // Request latest frame from each camera
-                lock (cameraVertices)
-                {
-                    cameraServer.GetLatestFrame(ref cameraColors, ref cameraVertices);
-                }
-
-                // Update the local lists representing the latest frame
-                lock (vertices)
-                {
-                    vertices.Clear();
-                    colors.Clear();
-                    cameraPoses.Clear();
-
-                    // Add vertices and colors from each camera to the encompassing list
-                    for (int i = 0; i < cameraColors.Count; i++)
-                    {
-                        vertices.AddRange(cameraVertices[i]);
-                        colors.AddRange(cameraColors[i]);
-                    }
-
-                    cameraPoses.AddRange(cameraServer.CameraPoses);
-                }
-                
-                if (openGLWindow != null)
-                {
-                    // Note that a new frame was obtained (this is used to estimate the FPS)
-                    openGLWindow.IncreaseFrameCounter();
-                }           
-            }
+            framePipeline.Run(() => worker.CancellationPending);
         }
 
         private void RestartUpdateWorker()
@@ -326,98 +332,108 @@ namespace LiveScanServer
                 return;
             }
 
+            if (settings.IsProjectiveRefinementEnabled)
+            {
+                RefineCameraPosesProjective();
+                return;
+            }
+
             // Retrieve a frame from each connected camera
-            lock (cameraVertices)
+            lock (framePipeline.GatherLock)
             {
                 cameraServer.GetLatestFrame(ref cameraColors, ref cameraVertices);
             }
 
-            // Initialize containers for the poses
-            List<float[]> Rs = new List<float[]>();
-            List<float[]> Ts = new List<float[]>();
+            // The points of all the cameras are passed at once, one camera after the other
+            int numCameras = cameraVertices.Count;
+            int[] numVertsPerCamera = new int[numCameras];
+            int numValues = 0;
 
-            for (int i = 0; i < cameraVertices.Count; i++)
+            for (int i = 0; i < numCameras; i++)
             {
-                float[] tempR = new float[9];
-                float[] tempT = new float[3];
-                for (int j = 0; j < 3; j++)
-                {
-                    tempT[j] = 0;
-                    tempR[j + j * 3] = 1;
-                }
-
-                Rs.Add(tempR);
-                Ts.Add(tempT);
+                numVertsPerCamera[i] = cameraVertices[i].Count / 3;
+                numValues += 3 * numVertsPerCamera[i];
             }
 
-            // Use ICP to refine the sensor poses (see referenced research article for more detail)
-            for (int refineIter = 0; refineIter < settings.NumRefineIterations; refineIter++)
-            {
-                for (int i = 0; i < cameraVertices.Count; i++)
-                {
-                    List<float> otherFramesVertices = new List<float>();
-                    for (int j = 0; j < cameraVertices.Count; j++)
-                    {
-                        if (j == i)
-                            continue;
-                        otherFramesVertices.AddRange(cameraVertices[j]);
-                    }
+            float[] verts = new float[numValues];
+            int offset = 0;
 
-                    float[] verts1 = otherFramesVertices.ToArray();
-                    float[] verts2 = cameraVertices[i].ToArray();
+            for (int i = 0; i < numCameras; i++)
+            {
+                cameraVertices[i].CopyTo(0, verts, offset, 3 * numVertsPerCamera[i]);
+                offset += 3 * numVertsPerCamera[i];
+            }
 
-                    IntPtr pVerts1 = Marshal.AllocHGlobal(otherFramesVertices.Count * sizeof(float));
-                    IntPtr pVerts2 = Marshal.AllocHGlobal(cameraVertices[i].Count * sizeof(float));
+            // Initialize the poses, 9 rotation and 3 translation values per camera
+            float[] allRs = new float[9 * numCameras];
+            float[] allTs = new float[3 * numCameras];
 
-                    Marshal.Copy(verts1, 0, pVerts1, verts1.Length);
-                    Marshal.Copy(verts2, 0, pVerts2, verts2.Length);
+            for (int i = 0; i < numCameras; i++)
+            {
+                for (int j = 0; j < 3; j++)
+                    allRs[9 * i + j + j * 3] = 1;
+            }
 
-                    ICP(pVerts1, pVerts2, otherFramesVertices.Count / 3, cameraVertices[i].Count / 3, Rs[i], Ts[i], settings.NumICPIterations);
+            // Use ICP to refine the sensor poses (see referenced research article for more detail); every camera is
+            // aligned to all the others jointly, in parallel, coarse to fine and stopping each level once it converged,
+            // from a few thousand of its points in the overlap, spread over the directions of their normals
+            int[] numIterationsPerLevel = new int[Math.Max(1, settings.NumICPLevels)];
 
-                    Marshal.Copy(pVerts2, verts2, 0, verts2.Length);
-                    cameraVertices[i].Clear();
-                    cameraVertices[i].AddRange(verts2);
-                }
+            // The GPU processing setting also moves the nearest neighbour searches of the large clouds to the GPU; without
+            // it, they are searched in voxel hash grids, which are faster to build and search than the KD-trees in the
+            // small volume of the Holoport
+            if (!SetNeighbourSearchBackend(settings.IsGpuProcessingEnabled ? GpuGridSearch : VoxelHashSearch))
+            {
+                Logger.Log("No GPU is available for the ICP nearest neighbour search, using the CPU.");
+                SetNeighbourSearchBackend(VoxelHashSearch);
             }
 
-            // Update calibration data for all connected cameras
-            List<AffineTransform> worldTransforms = cameraServer.WorldTransforms;
-            List<AffineTransform> cameraPoses = cameraServer.CameraPoses;
+            RefineAllPoses(verts, numVertsPerCamera, numCameras, allRs, allTs, settings.NumRefineIterations, settings.NumICPIterations,
+                numIterationsPerLevel.Length, settings.ICPCoarsestVoxelSize, false, settings.ICPMaxSamplesPerCamera, numIterationsPerLevel);
+
+            List<float[]> Rs = new List<float[]>();
+            List<float[]> Ts = new List<float[]>();
+            int start = 0;
 
-            for (int i = 0; i < worldTransforms.Count; i++)
+            for (int i = 0; i < numCameras; i++)
             {
+                float[] tempR = new float[9];
                 float[] tempT = new float[3];
-                float[,] tempR = new float[3, 3];
-                for (int j = 0; j < 3; j++)
-                {
-                    for (int k = 0; k < 3; k++)
-                    {
-                        tempT[j] += Ts[i][k] * worldTransforms[i].R[k, j];
-                    }
+                Array.Copy(allRs, 9 * i, tempR, 0, 9);
+                Array.Copy(allTs, 3 * i, tempT, 0, 3);
 
-                    worldTransforms[i].T[j] += tempT[j];
-                    cameraPoses[i].T[j] += Ts[i][j];
-                }
+                Rs.Add(tempR);
+                Ts.Add(tempT);
 
-                for (int j = 0; j < 3; j++)
-                {
-                    for (int k = 0; k < 3; k++)
-                    {
-                        for (int l = 0; l < 3; l++)
-                        {
-                            tempR[j, k] += Rs[i][l * 3 + j] * worldTransforms[i].R[l, k];
-                        }
+                // The cameras left out of the frame share an empty buffer, which is left as it is
+                if (numVertsPerCamera[i] > 0)
+                    cameraVertices[i].CopyFrom(verts, start, 3 * numVertsPerCamera[i]);
 
-                        worldTransforms[i].R[j, k] = tempR[j, k];
-                        cameraPoses[i].R[j, k] = tempR[j, k];
-                    }
-                }
+                start += 3 * numVertsPerCamera[i];
             }
 
-            cameraServer.WorldTransforms = worldTransforms;
-            cameraServer.CameraPoses = cameraPoses;
+            cameraServer.ApplyPoseCorrections(Rs, Ts);
 
-            cameraServer.SendCalibrationData();
+            SetStatusBarOnTimer("Refined the poses in " + string.Join(" + ", numIterationsPerLevel) + " ICP iterations, coarse to fine.", 5000);
+        }
+
+        // Refines the poses from the depth frames of the cameras, matching the points of each camera by projecting them
+        // into the frames of the others, which is cheap enough to run while streaming
+        private void RefineCameraPosesProjective()
+        {
+            PoseCorrections corrections = projectiveRefiner.Refine(cameraServer, settings.NumICPIterations, settings.ProjectiveSampleStep,
+                settings.ProjectiveMaxDistance);
+
+            if (corrections == null)
+            {
+                SetStatusBarOnTimer("Failed to get the depth frames of the devices.", 5000);
+                return;
+            }
+
+            cameraServer.ApplyPoseCorrections(corrections.Rs, corrections.Ts);
+
+            SetStatusBarOnTimer("Refined the poses in " + corrections.NumIterations + " projective ICP iterations, mean error of "
+                + (corrections.Error * 1000.0f).ToString("0.0") + " mm.", 5000);
         }
 
         private void FinishRefiningCameraPoses(object sender, RunWorkerCompletedEventArgs e)
@@ -448,7 +464,8 @@ namespace LiveScanServer
             // Otherwise, start or stop the recording worker based on current state
             if (!isRecording)
             {
-                // Stop the update worker to reduce the network usage (provides better synchronization).
+                // Stop the update worker to reduce the network usage (provides better synchronization); it is restarted
+                // once the recording stops, as the frames are saved.
                 updateWorker.CancelAsync();
 
                 // Start the recording worker
@@ -467,9 +484,118 @@ namespace LiveScanServer
             isRecording = !isRecording;
         }
 
+        // Saves the frames the clients kept in their ring, without interrupting the live view or a recording
+        private void OnSaveRingButtonClick(object sender, EventArgs e)
+        {
+            if (cameraServer.ClientCount < 1 || settings.RingRecordingSeconds <= 0)
+            {
+                SetStatusBarOnTimer("Ring recording is disabled in the settings.", 5000);
+                return;
+            }
+
+            cameraServer.SaveFrameRing(settings.RingRecordingSeconds);
+            SetStatusBarOnTimer("Saving the last " + settings.RingRecordingSeconds.ToString() + " s on the clients.", 5000);
+        }
+
+        // The scene must be empty of the people and the objects to capture while the clients learn it
+        private void OnLearnMaskButtonClick(object sender, EventArgs e)
+        {
+            if (cameraServer.ClientCount < 1)
+            {
+                SetStatusBarOnTimer("No clients connected.", 5000);
+                return;
+            }
+
+            cameraServer.LearnExclusionMask(-1);
+            SetStatusBarOnTimer("Learning the empty scene on the calibrated clients.", 5000);
+        }
+
+        private void OnClearMaskButtonClick(object sender, EventArgs e)
+        {
+            cameraServer.LearnExclusionMask(0);
+            SetStatusBarOnTimer("Cleared the exclusion masks of the clients.", 5000);
+        }
+
+        // Captures the bytes sent to the receivers to a new file of the working directory, for the replay tool
+        private void OnCaptureStreamButtonClick(object sender, EventArgs e)
+        {
+            if (!transferServer.IsCapturing)
+            {
+                string path = "stream_" + DateTime.Now.ToString("yyyyMMdd_HHmmss") + ".lsc";
+
+                try
+                {
+                    transferServer.StartCapture(path);
+                }
+                catch (Exception ex) when (ex is IOException || ex is UnauthorizedAccessException)
+                {
+                    SetStatusBarOnTimer("Could not create the stream capture: " + ex.Message, 5000);
+                    return;
+                }
+
+                btCaptureStream.Text = "Stop capture";
+                SetStatusBarOnTimer("Capturing the streams of the receivers to " + path + ".", 5000);
+            }
+            else
+            {
+                StreamCapture capture = transferServer.StopCapture();
+                btCaptureStream.Text = "Capture stream";
+
+                if (capture != null)
+                    SetStatusBarOnTimer("Captured " + capture.NumWrites + " writes, " + (capture.NumBytes >> 10) + " KB, to " + capture.Path + ".", 5000);
+            }
+        }
+
         private void OnCalibrateButtonClick(object sender, EventArgs e)
         {
+            // The clients pause their point cloud processing while they calibrate, all at the same time
             cameraServer.Calibrate();
+            calibrationProgressTimer.Start();
+        }
+
+        // Shows the marker samples found by each client until all of them are calibrated; called on a timer thread
+        private void ReportCalibrationProgress(object sender, System.Timers.ElapsedEventArgs e)
+        {
+            if (!cameraServer.GetCalibrationProgress(calibrationSamples, out int numRequiredSamples))
+            {
+                SetStatusBarOnTimer("Calibrated all of the devices.", 5000);
+                return;
+            }
+
+            List<string> progress = new List<string>();
+
+            for (int i = 0; i < calibrationSamples.Count; i++)
+                progress.Add("device " + i + " " + (calibrationSamples[i] < 0 ? "done" : calibrationSamples[i] + "/" + numRequiredSamples));
+
+            SetStatusBarOnTimer("Calibrating: " + string.Join(", ", progress) + ".", 5000);
+            calibrationProgressTimer.Start();
+        }
+
+        // Shows the timings of the frame loop of each client in the client list, the largest depth of the queues
+        // between the stages of the pipeline, the buffers the frame path allocated, the collections and the counters of
+        // the locks since the last update in the status bar; called on a timer thread
+        private void UpdatePerfStats(object sender, System.Timers.ElapsedEventArgs e)
+        {
+            cameraServer.UpdatePerfStats();
+
+            int numSkippedFrames = transferServer.TakeNumSkippedFrames();
+            long numAllocatedBytes;
+            long numAllocations = FrameAllocations.TakeAllocations(out numAllocatedBytes);
+            int[] collectionCounts = new int[GC.MaxGeneration + 1];
+
+            for (int i = 0; i < collectionCounts.Length; i++)
+            {
+                collectionCounts[i] = GC.CollectionCount(i) - lastCollectionCounts[i];
+                lastCollectionCounts[i] += collectionCounts[i];
+            }
+
+            pipelineLabel.Text = "Queued: merge " + framePipeline.TakeMergeQueueDepth() + "/" + framePipeline.MergeQueueCapacity
+                + ", send " + transferServer.TakeSendQueueDepth() + "/" + transferServer.SendQueueCapacity
+                + (numSkippedFrames > 0 ? ", " + numSkippedFrames + " not encoded" : "")
+                + "; frame allocations " + numAllocations + " (" + (numAllocatedBytes >> 10) + " KB), GC " + string.Join("/", collectionCounts)
+                + "; locks taken/waited for/wait ms/hold ms: " + ProfiledLock.TakeSummary();
+
+            perfStatsTimer.Start();
         }
 
         private void OnRefineCalibrationButtonClick(object sender, EventArgs e)
@@ -516,6 +642,26 @@ namespace LiveScanServer
             statusBarTimer.Start();
         }
 
+        // Shows the drifts found by the calibration monitor; called on the monitor thread
+        private void ReportCalibrationDrift(CameraDrift[] drift, bool isCorrected)
+        {
+            List<string> driftedCameras = new List<string>();
+
+            for (int i = 0; i < drift.Length; i++)
+            {
+                if (drift[i].IsSignificant)
+                    driftedCameras.Add("device " + i + " by " + drift[i].TranslationMm.ToString("0.0") + " mm, " + drift[i].RotationDegrees.ToString("0.00") + " deg");
+            }
+
+            if (driftedCameras.Count == 0)
+                return;
+
+            if (isCorrected)
+                SetStatusBarOnTimer("Corrected the calibration drift of " + string.Join("; ", driftedCameras) + ".", 5000);
+            else
+                SetStatusBarOnTimer("The calibration drifted: " + string.Join("; ", driftedCameras) + ". Refine or recalibrate.", 10000);
+        }
+
         // Updates the ListBox contaning the connected clients. Called by events in the CameraServer.
         private void UpdateListView(List<CameraClient> socketList)
         {
@@ -0,0 +1,135 @@
+﻿/***************************************************************************\
+
+Module Name:  MergedFramePublisher.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module hands the merged frames to the native subscribers of the server
+process, such as the plugins of the server, which get them from the client
+DLL without a transfer socket or a decoding. The plugins are the DLLs of the
+plugins directory of the server. The frames are published by a thread of
+their own, and only while there are subscribers, so that neither the copy
+into the shared native frame nor a slow subscriber delays the merge.
+
+\***************************************************************************/
+
+using System;
+using System.IO;
+using System.Runtime.InteropServices;
+using System.Threading;
+
+namespace LiveScanServer
+{
+    public sealed class MergedFramePublisher
+    {
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        private static extern bool HasMergedFrameSubscribers();
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern unsafe void PublishMergedFrame(float* vertices, byte* colors, byte* normals, int numVertices, int* indices, int numTriangles,
+            int* cameraVertexCounts, int numCameras, ulong version, long captureTimeUs);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern int LoadMergedFramePlugins([MarshalAs(UnmanagedType.LPStr)] string directory);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void UnloadMergedFramePlugins();
+
+        public static readonly string PluginDirectory = Path.Combine(AppDomain.CurrentDomain.BaseDirectory, "plugins");
+
+        // Interval at which the thread checks whether it is stopped when no frame is merged, in milliseconds
+        private const int StopCheckInterval = 100;
+
+        private readonly MergedFrameStore frameStore;
+        private readonly AutoResetEvent frameEvent = new AutoResetEvent(false);
+        private volatile bool isStopRequested = false;
+        private Thread publisherThread;
+        private int[] cameraVertexCounts = new int[0];
+
+        public MergedFramePublisher(MergedFrameStore frameStore)
+        {
+            this.frameStore = frameStore;
+        }
+
+        /// <summary>
+        /// Starts the plugins, then publishes the frames merged from then on
+        /// </summary>
+        public void Start()
+        {
+            if (Directory.Exists(PluginDirectory))
+            {
+                int numPlugins = LoadMergedFramePlugins(PluginDirectory);
+                Logger.Log("Started " + numPlugins + " plugins of " + PluginDirectory + ".");
+            }
+
+            isStopRequested = false;
+            publisherThread = new Thread(PublishFrames) { IsBackground = true, Name = "MergedFramePublisher" };
+            publisherThread.Start();
+        }
+
+        /// <summary>
+        /// Stops the publication, then stops and unloads the plugins
+        /// </summary>
+        public void Stop()
+        {
+            isStopRequested = true;
+            frameEvent.Set();
+            publisherThread?.Join();
+            publisherThread = null;
+
+            UnloadMergedFramePlugins();
+        }
+
+        /// <summary>
+        /// Called on the merge worker once a new frame is published; only wakes the publisher thread
+        /// </summary>
+        public void NotifyFrameMerged()
+        {
+            frameEvent.Set();
+        }
+
+        private void PublishFrames()
+        {
+            int lastVersion = 0;
+
+            while (!isStopRequested)
+            {
+                // The frames merged while the previous one was published are skipped
+                if (!frameEvent.WaitOne(StopCheckInterval) || isStopRequested || !HasMergedFrameSubscribers())
+                    continue;
+
+                if (frameStore.LatestVersion == lastVersion)
+                    continue;
+
+                using (MergedFrame frame = frameStore.AcquireLatestFrame())
+                {
+                    lastVersion = frame.Version;
+                    Publish(frame);
+                }
+            }
+        }
+
+        private unsafe void Publish(MergedFrame frame)
+        {
+            int numCameras = frame.CameraVertexCounts.Count;
+
+            if (cameraVertexCounts.Length < numCameras)
+                cameraVertexCounts = new int[numCameras];
+
+            frame.CameraVertexCounts.CopyTo(cameraVertexCounts);
+
+            fixed (float* vertices = frame.Vertices)
+            fixed (byte* colors = frame.Colors)
+            fixed (byte* normals = frame.Normals)
+            fixed (int* indices = frame.Indices)
+            fixed (int* counts = cameraVertexCounts)
+            {
+                PublishMergedFrame(vertices, colors, frame.HasNormals ? normals : null, frame.VertexCount, frame.TriangleCount > 0 ? indices : null,
+                    frame.TriangleCount, counts, numCameras, (ulong)frame.Version, frame.CaptureTimeUs);
+            }
+        }
+    }
+}
@@ -0,0 +1,246 @@
+﻿/***************************************************************************\
+
+Module Name:  MergedFrameStore.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module holds the latest merged frame of all the cameras, for the live
+view and the transfer server. Each frame is merged once into pooled buffers
+and is not modified once published: the consumers read it in place for as
+long as they hold it, and compare its version with the last one they
+processed to skip the frames they already handled.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Threading;
+
+namespace LiveScanServer
+{
+    /// <summary>
+    /// Merged frame of all the cameras, read only once it is published. Dispose it once done with it.
+    /// </summary>
+    public class MergedFrame : IDisposable
+    {
+        public int Version { get; internal set; }
+        public long CaptureTimeUs { get; internal set; } // Time at which the frame was merged, in microseconds of the server clock
+        public readonly FrameTrace Trace = new FrameTrace(); // Times of the camera frames and of the merge
+
+        // Points of the cameras, one camera after the other; the buffers can be longer than the frame
+        public float[] Vertices = new float[0];
+        public byte[] Colors = new byte[0];
+        public int VertexCount { get; internal set; }
+
+        // Normal of each vertex, in one octahedral byte as estimated by the clients, when any camera of the frame has
+        // them; NoNormal for the vertices of the other cameras
+        public const byte NoNormal = 0xFF;
+        public byte[] Normals = new byte[0];
+        public bool HasNormals { get; internal set; }
+
+        // Triangles of the fused surface, three vertex indices each, when it is extracted as a mesh; 0 otherwise and
+        // the vertices are points
+        public int[] Indices = new int[0];
+        public int TriangleCount { get; internal set; }
+
+        public readonly List<int> CameraVertexCounts = new List<int>();
+        public readonly List<ulong> CameraFrameVersions = new List<ulong>(); // Changes whenever the points of the camera do
+        public readonly List<AffineTransform> CameraPoses = new List<AffineTransform>();
+
+        internal int NumReferences = 0;
+        private readonly MergedFrameStore store;
+
+        internal MergedFrame(MergedFrameStore store)
+        {
+            this.store = store;
+        }
+
+        /// <summary>
+        /// Releases the reference taken on the frame, so that its buffers can be reused once all of them are released
+        /// </summary>
+        public void Dispose()
+        {
+            store.Release(this);
+        }
+    }
+
+    public class MergedFrameStore
+    {
+        private static readonly FrameTrace s_untracedFrame = new FrameTrace();
+
+        private readonly object storeLock = new object();
+        private readonly Stack<MergedFrame> freeFrames = new Stack<MergedFrame>();
+        private MergedFrame latestFrame; // Referenced by the store until a newer frame is published
+        private int latestVersion = 0;
+
+        /// <summary>
+        /// Version of the latest frame, to check for a new frame without acquiring it
+        /// </summary>
+        public int LatestVersion => Volatile.Read(ref latestVersion);
+
+        public MergedFrameStore()
+        {
+            // The consumers start with an empty frame
+            latestFrame = new MergedFrame(this) { NumReferences = 1 };
+        }
+
+        /// <summary>
+        /// Merges the latest frames of the cameras into a new frame and publishes it
+        /// </summary>
+        /// <param name="cameraVertices">Vertices of each camera</param>
+        /// <param name="cameraColors">Colors of each camera</param>
+        /// <param name="cameraFrameVersions">Version of the frame of each camera</param>
+        /// <param name="cameraPoses">Pose of each camera, copied since the poses are refined in place</param>
+        /// <param name="trace">Optional times of the camera frames, as assembled</param>
+        /// <param name="fusion">Optional fusion volume, which replaces the points of the cameras with its surface when enabled</param>
+        /// <param name="cameraNormals">Optional normals of each camera, empty for the cameras without them</param>
+        public void Publish(List<FrameBuffer<float>> cameraVertices, List<FrameBuffer<byte>> cameraColors, List<ulong> cameraFrameVersions,
+            List<AffineTransform> cameraPoses, FrameTrace trace = null, FusionVolume fusion = null, List<FrameBuffer<byte>> cameraNormals = null)
+        {
+            ServerTrace.TraceZone zone = ServerTrace.Zone("Merge");
+            MergedFrame frame;
+
+            lock (storeLock)
+            {
+                frame = freeFrames.Count > 0 ? freeFrames.Pop() : new MergedFrame(this);
+            }
+
+            // The frame is not shared until it is published, so it is filled without the lock
+            int numVertexValues = 0;
+            int numColorValues = 0;
+
+            for (int i = 0; i < cameraVertices.Count; i++)
+            {
+                numVertexValues += cameraVertices[i].Count;
+                numColorValues += cameraColors[i].Count;
+            }
+
+            frame.Vertices = FrameAllocations.Reserve(frame.Vertices, numVertexValues);
+            frame.Colors = FrameAllocations.Reserve(frame.Colors, numColorValues);
+
+            frame.CameraVertexCounts.Clear();
+            int vertexOffset = 0;
+            int colorOffset = 0;
+
+            for (int i = 0; i < cameraVertices.Count; i++)
+            {
+                cameraVertices[i].CopyTo(0, frame.Vertices, vertexOffset, cameraVertices[i].Count);
+                cameraColors[i].CopyTo(0, frame.Colors, colorOffset, cameraColors[i].Count);
+                vertexOffset += cameraVertices[i].Count;
+                colorOffset += cameraColors[i].Count;
+
+                frame.CameraVertexCounts.Add(cameraVertices[i].Count / 3);
+            }
+
+            frame.VertexCount = Math.Min(numVertexValues, numColorValues) / 3;
+            MergeNormals(frame, cameraNormals);
+
+            frame.CameraFrameVersions.Clear();
+            frame.CameraFrameVersions.AddRange(cameraFrameVersions);
+
+            // The pose objects of the frame are reused as well
+            if (frame.CameraPoses.Count > cameraPoses.Count)
+                frame.CameraPoses.RemoveRange(cameraPoses.Count, frame.CameraPoses.Count - cameraPoses.Count);
+
+            for (int i = 0; i < cameraPoses.Count; i++)
+            {
+                if (i == frame.CameraPoses.Count)
+                    frame.CameraPoses.Add(new AffineTransform());
+
+                Array.Copy(cameraPoses[i].R, frame.CameraPoses[i].R, cameraPoses[i].R.Length);
+                Array.Copy(cameraPoses[i].T, frame.CameraPoses[i].T, cameraPoses[i].T.Length);
+            }
+
+            frame.TriangleCount = 0;
+            fusion?.Fuse(frame);
+
+            frame.Trace.CopyFrom(trace ?? s_untracedFrame);
+
+            frame.CaptureTimeUs = FrameTrace.GetTimeUs();
+            frame.Trace.MergeTimeUs = frame.CaptureTimeUs;
+
+            lock (storeLock)
+            {
+                frame.Version = latestVersion + 1;
+                frame.Trace.FrameId = frame.Version;
+                frame.NumReferences = 1;
+
+                MergedFrame previousFrame = latestFrame;
+                latestFrame = frame;
+                Volatile.Write(ref latestVersion, frame.Version);
+
+                ReleaseLocked(previousFrame);
+            }
+
+            zone.Dispose();
+        }
+
+        /// <summary>
+        /// Merges the normals of the cameras like their points, when any of them has normals
+        /// </summary>
+        private static void MergeNormals(MergedFrame frame, List<FrameBuffer<byte>> cameraNormals)
+        {
+            frame.HasNormals = false;
+
+            if (cameraNormals == null)
+                return;
+
+            for (int i = 0; i < cameraNormals.Count && !frame.HasNormals; i++)
+                frame.HasNormals = cameraNormals[i].Count > 0;
+
+            if (!frame.HasNormals)
+                return;
+
+            frame.Normals = FrameAllocations.Reserve(frame.Normals, frame.VertexCount);
+
+            int offset = 0;
+
+            for (int i = 0; i < frame.CameraVertexCounts.Count; i++)
+            {
+                int count = Math.Max(0, Math.Min(frame.CameraVertexCounts[i], frame.VertexCount - offset));
+
+                if (i < cameraNormals.Count && cameraNormals[i].Count == frame.CameraVertexCounts[i])
+                {
+                    cameraNormals[i].CopyTo(0, frame.Normals, offset, count);
+                }
+                else
+                {
+                    for (int j = offset; j < offset + count; j++)
+                        frame.Normals[j] = MergedFrame.NoNormal;
+                }
+
+                offset += count;
+            }
+        }
+
+        /// <summary>
+        /// Takes a reference on the latest frame. Dispose the frame once done with it.
+        /// </summary>
+        public MergedFrame AcquireLatestFrame()
+        {
+            lock (storeLock)
+            {
+                latestFrame.NumReferences++;
+                return latestFrame;
+            }
+        }
+
+        internal void Release(MergedFrame frame)
+        {
+            lock (storeLock)
+            {
+                ReleaseLocked(frame);
+            }
+        }
+
+        private void ReleaseLocked(MergedFrame frame)
+        {
+            frame.NumReferences--;
+
+            if (frame.NumReferences == 0)
+                freeFrames.Push(frame);
+        }
+    }
+}
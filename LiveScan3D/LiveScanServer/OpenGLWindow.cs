@@ -7,7 +7,13 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module is used to render the current point cloud reconstruction as well
-as the marker and camera poses.
+as the marker and camera poses. The points of each camera are kept in a
+buffer of their own, rewritten only when the frame of the camera changes, and
+the brightness is applied by a shader as they are drawn. With the level of
+detail of the view enabled, the points are decimated on the native side to
+one point per voxel of about the size of a pixel at the distance of the
+scene, and are only all drawn once the view is zoomed in enough that the
+pixels are smaller than the spacing of the points.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -17,18 +23,17 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 \***************************************************************************/
 
 using OpenTK;
-using OpenTK.Graphics;
+using OpenTK.Graphics.OpenGL;
 using OpenTK.Input;
 using System;
 using System.Collections.Generic;
+using System.Runtime.InteropServices;
 
 namespace LiveScanServer
 {
     public class OpenGLWindow : GameWindow
     {
-        public List<float> Vertices = new List<float>();
-        public List<byte> Colors = new List<byte>();
-        public List<AffineTransform> CameraPoses = new List<AffineTransform>();
+        public MergedFrameStore FrameStore = new MergedFrameStore();
         public CameraSettings Settings = new CameraSettings();
 
         private static float s_mouseOrbitSpeed = 0.30f;    // 0 = SLOWEST, 1 = FASTEST
@@ -39,6 +44,35 @@ namespace LiveScanServer
         private const int InitialWindowWidth = 800;
         private const int InitialWindowHeight = 600;
         private const string WindowTitle = "LiveScan3D";
+        private const long FenceTimeoutNs = 1000000000;
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern IntPtr CreateViewDecimator();
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void DestroyViewDecimator(IntPtr handle);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern unsafe int DecimateViewPoints(IntPtr handle, float* vertices, byte* colors, int numVertices, float voxelSize, float* outVertices, byte* outColors);
+
+        // The voxels of the level of detail are no smaller than the spacing of the captured points, below which the
+        // decimation keeps nearly all of them, and change in steps of 2^(1/LodLevelsPerOctave) so that the points are
+        // only decimated again when the view is zoomed by more than a step
+        private const float MinLodVoxelSize = 0.002f;
+        private const int LodLevelsPerOctave = 2;
+        private const int FullResolution = -1;
+        private static readonly float s_viewHeightPerDistance = (float)(2.0 * Math.Tan(MathHelper.PiOver4 / 2.0));
+
+        // Adds the brightness to the colors of the points, the fixed pipeline does the rest
+        private const string VertexShaderSource = @"
+            #version 120
+            uniform float brightness;
+
+            void main()
+            {
+                gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+                gl_FrontColor = vec4(min(gl_Color.rgb + vec3(brightness), vec3(1.0)), gl_Color.a);
+            }";
 
         private Vector2 previousMousePosition = new Vector2();
         private Vector2 currentMousePosition = new Vector2();
@@ -54,12 +88,26 @@ namespace LiveScanServer
         private byte brightnessModifier = 0;
 
         private bool drawMarkings = true;
-        private uint vboHandle;
-        private int pointCount;
+        private bool isBufferStorageSupported = false;
+        private MergedFrame frame; // Latest frame written to the buffers, held until a new frame is
+        private List<CameraBuffer> cameraBuffers = new List<CameraBuffer>();
+        private uint markingsHandle;
         private int lineCount;
         private float pointSize = 0.0f;
 
-        private VertexColorPosition[] vertexColorPositions;
+        private IntPtr viewDecimator = IntPtr.Zero;
+        private int lodLevel = FullResolution; // Level the buffers were last written at
+
+        // Decimated points of a camera, uploaded from these arrays when the buffers cannot be mapped
+        private float[] lodVertices = new float[0];
+        private byte[] lodColors = new byte[0];
+
+        private int vertexShader;
+        private int shaderProgram;
+        private int brightnessLocation;
+
+        // Lines of the markings, rebuilt on each update
+        private VertexColorPosition[] vertexColorPositions = new VertexColorPosition[0];
 
         private DateTime lastFrameTime = DateTime.Now;
         private int frameCounter = 0;
@@ -68,7 +116,7 @@ namespace LiveScanServer
         /// Creates a window with the specified title
         /// </summary>
         public OpenGLWindow()
-            : base(InitialWindowWidth, InitialWindowHeight, GraphicsMode.Default, WindowTitle)
+            : base(InitialWindowWidth, InitialWindowHeight, OpenTK.Graphics.GraphicsMode.Default, WindowTitle)
         {
             this.VSync = VSyncMode.Off;
             MouseUp += new EventHandler<MouseButtonEventArgs>(OnMouseButtonUp);
@@ -91,6 +139,21 @@ namespace LiveScanServer
             Orbit
         }
 
+        /// <summary>
+        /// Points of one camera on the GPU, all the positions followed by all the colors
+        /// </summary>
+        private class CameraBuffer
+        {
+            public uint Handle;
+            public IntPtr MappedData = IntPtr.Zero; // Persistent mapping of the buffer, when buffer storage is supported
+            public int Capacity = 0;                // In points
+            public int Count = 0;
+            public ulong FrameVersion = 0;
+            public int LodLevel = FullResolution;
+            public int FrameCount = 0;              // Points of the camera in the frame, of which Count are drawn
+            public IntPtr Fence = IntPtr.Zero;      // Signaled once the last draw of the buffer is done
+        }
+
         public void IncreaseFrameCounter()
         {
             frameCounter++;
@@ -168,6 +231,15 @@ namespace LiveScanServer
             // Increase brightness on P press
             if (keyboard[Key.P])
                 brightnessModifier = (byte)Math.Min(255, brightnessModifier + 10);
+
+            // Toggle the level of detail on L press
+            if (keyboard[Key.L])
+            {
+                lock (Settings)
+                {
+                    Settings.IsViewLodEnabled = !Settings.IsViewLodEnabled;
+                }
+            }
         }
 
         protected override void OnLoad(EventArgs e)
@@ -176,7 +248,7 @@ namespace LiveScanServer
 
             // Check OpenGL version
             Version version = new Version(GL.GetString(StringName.Version).Substring(0, 3));
-            Version target = new Version(1, 5);
+            Version target = new Version(2, 0);
             if (version < target)
             {
                 throw new NotSupportedException(String.Format(
@@ -192,24 +264,63 @@ namespace LiveScanServer
             GL.Hint(HintTarget.PointSmoothHint, HintMode.Nicest);
 
             // Setup VBO state
-            GL.EnableClientState(EnableCap.ColorArray);
-            GL.EnableClientState(EnableCap.VertexArray);
-            
-            GL.GenBuffers(1, out vboHandle);
+            GL.EnableClientState(ArrayCap.ColorArray);
+            GL.EnableClientState(ArrayCap.VertexArray);
+
+            // Without persistent mappings, the buffers of the cameras are reallocated whenever they are rewritten
+            isBufferStorageSupported = version >= new Version(4, 4) ||
+                GL.GetString(StringName.Extensions).Contains("GL_ARB_buffer_storage");
 
-            // Setup VBO since there is only one in the window
-            GL.BindBuffer(BufferTarget.ArrayBuffer, vboHandle);
-            GL.ColorPointer(4, ColorPointerType.UnsignedByte, VertexColorPosition.s_sizeInBytes, (IntPtr)0);
-            GL.VertexPointer(3, VertexPointerType.Float, VertexColorPosition.s_sizeInBytes, (IntPtr)(4 * sizeof(byte)));
+            GL.GenBuffers(1, out markingsHandle);
+            viewDecimator = CreateViewDecimator();
 
-            pointCount = 0;
-            lineCount = 12;
-            vertexColorPositions = new VertexColorPosition[pointCount + 2 * lineCount];
+            CreateShaderProgram();
         }
 
         protected override void OnUnload(EventArgs e)
         {
-            GL.DeleteBuffers(1, ref vboHandle);
+            foreach (var buffer in cameraBuffers)
+            {
+                DeleteCameraBuffer(buffer);
+            }
+
+            cameraBuffers.Clear();
+
+            frame?.Dispose();
+            frame = null;
+
+            DestroyViewDecimator(viewDecimator);
+            viewDecimator = IntPtr.Zero;
+
+            GL.DeleteBuffers(1, ref markingsHandle);
+            GL.DeleteProgram(shaderProgram);
+            GL.DeleteShader(vertexShader);
+        }
+
+        private void CreateShaderProgram()
+        {
+            vertexShader = GL.CreateShader(ShaderType.VertexShader);
+            GL.ShaderSource(vertexShader, VertexShaderSource);
+            GL.CompileShader(vertexShader);
+
+            int status;
+            GL.GetShader(vertexShader, ShaderParameter.CompileStatus, out status);
+            if (status == 0)
+            {
+                throw new NotSupportedException("Failed to compile the point shader: " + GL.GetShaderInfoLog(vertexShader));
+            }
+
+            shaderProgram = GL.CreateProgram();
+            GL.AttachShader(shaderProgram, vertexShader);
+            GL.LinkProgram(shaderProgram);
+
+            GL.GetProgram(shaderProgram, GetProgramParameterName.LinkStatus, out status);
+            if (status == 0)
+            {
+                throw new NotSupportedException("Failed to link the point shader: " + GL.GetProgramInfoLog(shaderProgram));
+            }
+
+            brightnessLocation = GL.GetUniformLocation(shaderProgram, "brightness");
         }
 
         protected override void OnResize(EventArgs e)
@@ -308,56 +419,67 @@ namespace LiveScanServer
             if ((DateTime.Now - lastFrameTime).Seconds >= 1)
             {
                 double FPS = frameCounter / (DateTime.Now - lastFrameTime).TotalSeconds;
-                this.Title = "FPS: " + string.Format("{0:F}", FPS);
+                int numDrawnPoints = 0;
+                int numFramePoints = 0;
+
+                foreach (var buffer in cameraBuffers)
+                {
+                    numDrawnPoints += buffer.Count;
+                    numFramePoints += buffer.FrameCount;
+                }
+
+                this.Title = "FPS: " + string.Format("{0:F}", FPS) + ", points: " + numDrawnPoints + " of " + numFramePoints;
 
                 lastFrameTime = DateTime.Now;
                 frameCounter = 0;
             }
 
-            lock (Vertices)
+            // Write the points of the cameras whose frame changed, straight from the merged frame, and all of them again
+            // when the view was zoomed to another level of detail
+            int targetLodLevel = GetLodLevel();
+
+            if (frame == null || FrameStore.LatestVersion != frame.Version)
             {
-                lock (Settings)
-                {
-                    pointCount = Vertices.Count / 3;
-                    lineCount = 0;
+                frame?.Dispose();
+                frame = FrameStore.AcquireLatestFrame();
 
-                    if (drawMarkings)
-                    {
-                        // Bounding box
-                        lineCount += 12;
+                UpdateCameraBuffers(targetLodLevel);
+            }
+            else if (targetLodLevel != lodLevel)
+            {
+                UpdateCameraBuffers(targetLodLevel);
+            }
 
-                        // Markers
-                        lineCount += Settings.MarkerPoses.Count * 3;
+            lock (Settings)
+            {
+                lineCount = 0;
 
-                        // Cameras
-                        lineCount += CameraPoses.Count * 3;
-                    }
+                if (drawMarkings)
+                {
+                    // Bounding box
+                    lineCount += 12;
 
-                    vertexColorPositions = new VertexColorPosition[pointCount + 2 * lineCount];
+                    // Markers
+                    lineCount += Settings.MarkerPoses.Count * 3;
 
-                    for (int i = 0; i < pointCount; i++)
+                    // Cameras
+                    lineCount += frame.CameraPoses.Count * 3;
+                }
+
+                if (vertexColorPositions.Length < 2 * lineCount)
+                    vertexColorPositions = new VertexColorPosition[2 * lineCount];
+
+                if (drawMarkings)
+                {
+                    int iCurLineCount = 0;
+                    iCurLineCount += AddBoundingBox(2 * iCurLineCount);
+                    for (int i = 0; i < Settings.MarkerPoses.Count; i++)
                     {
-                        vertexColorPositions[i].R = (byte)Math.Max(0, Math.Min(255, (Colors[i * 3] + brightnessModifier)));
-                        vertexColorPositions[i].G = (byte)Math.Max(0, Math.Min(255, (Colors[i * 3 + 1] + brightnessModifier)));
-                        vertexColorPositions[i].B = (byte)Math.Max(0, Math.Min(255, (Colors[i * 3 + 2] + brightnessModifier)));
-                        vertexColorPositions[i].A = 255;
-                        vertexColorPositions[i].Position.X = Vertices[i * 3];
-                        vertexColorPositions[i].Position.Y = Vertices[i * 3 + 1];
-                        vertexColorPositions[i].Position.Z = Vertices[i * 3 + 2];
+                        iCurLineCount += AddMarker(2 * iCurLineCount, Settings.MarkerPoses[i].Pose);
                     }
-
-                    if (drawMarkings)
+                    for (int i = 0; i < frame.CameraPoses.Count; i++)
                     {
-                        int iCurLineCount = 0;
-                        iCurLineCount += AddBoundingBox(pointCount + 2 * iCurLineCount);
-                        for (int i = 0; i < Settings.MarkerPoses.Count; i++)
-                        {
-                            iCurLineCount += AddMarker(pointCount + 2 * iCurLineCount, Settings.MarkerPoses[i].Pose);
-                        }
-                        for (int i = 0; i < CameraPoses.Count; i++)
-                        {
-                            iCurLineCount += AddCamera(pointCount + 2 * iCurLineCount, CameraPoses[i]);
-                        }
+                        iCurLineCount += AddCamera(2 * iCurLineCount, frame.CameraPoses[i]);
                     }
                 }
             }
@@ -374,21 +496,238 @@ namespace LiveScanServer
             GL.Rotate(pitchAngle, 1.0f, 0.0f, 0.0f);
             GL.Rotate(headingAngle, 0.0f, 1.0f, 0.0f);
 
-            // Tell OpenGL to discard old VBO when done drawing it and reserve memory _now_ for a new buffer.
-            // Without this, GL would wait until draw operations on old VBO are complete before writing to it
-            GL.BufferData(BufferTarget.ArrayBuffer, (IntPtr)(VertexColorPosition.s_sizeInBytes * (pointCount + 2 * lineCount)), IntPtr.Zero, BufferUsageHint.StreamDraw);
-            
-            // Fill newly allocated buffer
-            GL.BufferData(BufferTarget.ArrayBuffer, (IntPtr)(VertexColorPosition.s_sizeInBytes * (pointCount + 2 * lineCount)), vertexColorPositions, BufferUsageHint.StreamDraw);
+            GL.UseProgram(shaderProgram);
+            GL.Uniform1(brightnessLocation, brightnessModifier / 255.0f);
+
+            // The buffers are drawn as they are, whether or not their camera sent a new frame
+            foreach (var buffer in cameraBuffers)
+            {
+                if (buffer.Count == 0)
+                    continue;
+
+                GL.BindBuffer(BufferTarget.ArrayBuffer, buffer.Handle);
+                GL.VertexPointer(3, VertexPointerType.Float, 0, IntPtr.Zero);
+                GL.ColorPointer(3, ColorPointerType.UnsignedByte, 0, (IntPtr)(3 * sizeof(float) * buffer.Capacity));
+                GL.DrawArrays(PrimitiveType.Points, 0, buffer.Count);
+
+                if (isBufferStorageSupported)
+                {
+                    DeleteFence(buffer);
+                    buffer.Fence = GL.FenceSync(SyncCondition.SyncGpuCommandsComplete, WaitSyncFlags.None);
+                }
+            }
 
-            GL.DrawArrays(BeginMode.Points, 0, pointCount);
-            GL.DrawArrays(BeginMode.Lines, pointCount, 2 * lineCount);
+            if (lineCount > 0)
+            {
+                GL.Uniform1(brightnessLocation, 0.0f);
+
+                // Tell OpenGL to discard the old markings when done drawing them, there are only a few lines to upload
+                GL.BindBuffer(BufferTarget.ArrayBuffer, markingsHandle);
+                GL.BufferData(BufferTarget.ArrayBuffer, (IntPtr)(VertexColorPosition.s_sizeInBytes * 2 * lineCount), vertexColorPositions, BufferUsageHint.StreamDraw);
+                GL.ColorPointer(4, ColorPointerType.UnsignedByte, VertexColorPosition.s_sizeInBytes, (IntPtr)0);
+                GL.VertexPointer(3, VertexPointerType.Float, VertexColorPosition.s_sizeInBytes, (IntPtr)(4 * sizeof(byte)));
+                GL.DrawArrays(PrimitiveType.Lines, 0, 2 * lineCount);
+            }
+
+            GL.UseProgram(0);
 
             GL.PopMatrix();
 
             SwapBuffers();
         }
 
+        /// <summary>
+        /// Level of detail of the view: the voxels are about as large as a pixel at the distance of the rotation center
+        /// of the view, around which the scene is, or FullResolution when the pixels are smaller than the points
+        /// </summary>
+        private int GetLodLevel()
+        {
+            bool isViewLodEnabled;
+
+            lock (Settings)
+            {
+                isViewLodEnabled = Settings.IsViewLodEnabled;
+            }
+
+            if (!isViewLodEnabled)
+                return FullResolution;
+
+            // The view looks at the rotation center from a unit distance, before its translation
+            float distance = (float)Math.Sqrt(cameraPosition[0] * cameraPosition[0] + cameraPosition[1] * cameraPosition[1]
+                + (cameraPosition[2] + 1.0f) * (cameraPosition[2] + 1.0f));
+            float pixelSize = distance * s_viewHeightPerDistance / Math.Max(1, Height) * Math.Max(1.0f, pointSize);
+
+            if (pixelSize < MinLodVoxelSize)
+                return FullResolution;
+
+            return (int)Math.Floor(Math.Log(pixelSize / MinLodVoxelSize, 2.0) * LodLevelsPerOctave);
+        }
+
+        private static float GetLodVoxelSize(int level)
+        {
+            return level == FullResolution ? 0.0f : MinLodVoxelSize * (float)Math.Pow(2.0, (double)level / LodLevelsPerOctave);
+        }
+
+        /// <summary>
+        /// Writes the points of the cameras whose frame changed, or which were written at another level of detail, to
+        /// their buffers
+        /// </summary>
+        private void UpdateCameraBuffers(int targetLodLevel)
+        {
+            lodLevel = targetLodLevel;
+
+            int numCameras = frame.CameraVertexCounts.Count;
+            int offset = 0;
+
+            for (int i = 0; i < numCameras; i++)
+            {
+                if (i == cameraBuffers.Count)
+                    cameraBuffers.Add(new CameraBuffer());
+
+                int count = frame.CameraVertexCounts[i];
+                ulong frameVersion = i < frame.CameraFrameVersions.Count ? frame.CameraFrameVersions[i] : 0;
+
+                if (frameVersion != cameraBuffers[i].FrameVersion || lodLevel != cameraBuffers[i].LodLevel)
+                    WriteCameraBuffer(cameraBuffers[i], offset, count, frameVersion);
+
+                offset += count;
+            }
+
+            while (cameraBuffers.Count > numCameras)
+            {
+                DeleteCameraBuffer(cameraBuffers[cameraBuffers.Count - 1]);
+                cameraBuffers.RemoveAt(cameraBuffers.Count - 1);
+            }
+        }
+
+        /// <summary>
+        /// Writes the points of a camera to its buffer, growing it if they do not fit. The buffer holds all the points
+        /// of the camera, so that it is not reallocated as the number of points kept by the level of detail changes.
+        /// </summary>
+        /// <param name="offset">Index of the first vertex of the camera in the merged frame</param>
+        private unsafe void WriteCameraBuffer(CameraBuffer buffer, int offset, int count, ulong frameVersion)
+        {
+            if (count > buffer.Capacity || buffer.Handle == 0)
+                AllocateCameraBuffer(buffer, GetGrownCapacity(buffer.Capacity, count));
+
+            int colorOffset = 3 * sizeof(float) * buffer.Capacity;
+            float voxelSize = GetLodVoxelSize(lodLevel);
+            int numPoints = count;
+
+            if (isBufferStorageSupported)
+            {
+                // The mapping is still read by the last draw until its fence is signaled
+                if (buffer.Fence != IntPtr.Zero)
+                {
+                    GL.ClientWaitSync(buffer.Fence, ClientWaitSyncFlags.SyncFlushCommandsBit, FenceTimeoutNs);
+                    DeleteFence(buffer);
+                }
+
+                // The native side writes the points kept straight to the mapping, all of them at full resolution
+                if (count > 0)
+                {
+                    fixed (float* vertices = &frame.Vertices[3 * offset])
+                    fixed (byte* colors = &frame.Colors[3 * offset])
+                    {
+                        numPoints = DecimateViewPoints(viewDecimator, vertices, colors, count, voxelSize, (float*)buffer.MappedData,
+                            (byte*)IntPtr.Add(buffer.MappedData, colorOffset));
+                    }
+                }
+            }
+            else
+            {
+                // Orphan the buffer, so that the upload does not wait for the last draw to be done with it
+                GL.BindBuffer(BufferTarget.ArrayBuffer, buffer.Handle);
+                GL.BufferData(BufferTarget.ArrayBuffer, (IntPtr)(15 * buffer.Capacity), IntPtr.Zero, BufferUsageHint.StreamDraw);
+
+                if (count > 0 && lodLevel == FullResolution)
+                {
+                    GL.BufferSubData(BufferTarget.ArrayBuffer, IntPtr.Zero, (IntPtr)(sizeof(float) * 3 * count), ref frame.Vertices[3 * offset]);
+                    GL.BufferSubData(BufferTarget.ArrayBuffer, (IntPtr)colorOffset, (IntPtr)(3 * count), ref frame.Colors[3 * offset]);
+                }
+                else if (count > 0)
+                {
+                    if (lodVertices.Length < 3 * count)
+                    {
+                        lodVertices = new float[3 * buffer.Capacity];
+                        lodColors = new byte[3 * buffer.Capacity];
+                    }
+
+                    fixed (float* vertices = &frame.Vertices[3 * offset])
+                    fixed (byte* colors = &frame.Colors[3 * offset])
+                    fixed (float* outVertices = lodVertices)
+                    fixed (byte* outColors = lodColors)
+                    {
+                        numPoints = DecimateViewPoints(viewDecimator, vertices, colors, count, voxelSize, outVertices, outColors);
+                    }
+
+                    if (numPoints > 0)
+                    {
+                        GL.BufferSubData(BufferTarget.ArrayBuffer, IntPtr.Zero, (IntPtr)(sizeof(float) * 3 * numPoints), lodVertices);
+                        GL.BufferSubData(BufferTarget.ArrayBuffer, (IntPtr)colorOffset, (IntPtr)(3 * numPoints), lodColors);
+                    }
+                }
+            }
+
+            buffer.Count = numPoints;
+            buffer.FrameCount = count;
+            buffer.FrameVersion = frameVersion;
+            buffer.LodLevel = lodLevel;
+        }
+
+        private void AllocateCameraBuffer(CameraBuffer buffer, int capacity)
+        {
+            // 12 bytes of position and 3 bytes of color per point
+            IntPtr size = (IntPtr)(15 * Math.Max(1, capacity));
+
+            if (isBufferStorageSupported)
+            {
+                // The storage of a persistent buffer cannot be resized, so it is replaced
+                DeleteCameraBuffer(buffer);
+                GL.GenBuffers(1, out buffer.Handle);
+                GL.BindBuffer(BufferTarget.ArrayBuffer, buffer.Handle);
+                GL.BufferStorage(BufferTarget.ArrayBuffer, size, IntPtr.Zero,
+                    BufferStorageFlags.MapWriteBit | BufferStorageFlags.MapPersistentBit | BufferStorageFlags.MapCoherentBit);
+                buffer.MappedData = GL.MapBufferRange(BufferTarget.ArrayBuffer, IntPtr.Zero, size,
+                    BufferAccessMask.MapWriteBit | BufferAccessMask.MapPersistentBit | BufferAccessMask.MapCoherentBit);
+            }
+            else if (buffer.Handle == 0)
+            {
+                GL.GenBuffers(1, out buffer.Handle);
+            }
+
+            buffer.Capacity = capacity;
+        }
+
+        private void DeleteCameraBuffer(CameraBuffer buffer)
+        {
+            DeleteFence(buffer);
+
+            // Deleting the buffer also unmaps it
+            if (buffer.Handle != 0)
+                GL.DeleteBuffers(1, ref buffer.Handle);
+
+            buffer.Handle = 0;
+            buffer.MappedData = IntPtr.Zero;
+            buffer.Capacity = 0;
+        }
+
+        private void DeleteFence(CameraBuffer buffer)
+        {
+            if (buffer.Fence != IntPtr.Zero)
+                GL.DeleteSync(buffer.Fence);
+
+            buffer.Fence = IntPtr.Zero;
+        }
+
+        /// <summary>
+        /// Grows the buffers by half at least, so that the small changes of the number of points do not reallocate them
+        /// </summary>
+        private static int GetGrownCapacity(int capacity, int required)
+        {
+            return required <= capacity ? capacity : Math.Max(required, capacity + capacity / 2);
+        }
+
         private int AddBoundingBox(int startIdx)
         {
             int nLinesBeingAdded = 12;
@@ -0,0 +1,125 @@
+﻿/***************************************************************************\
+
+Module Name:  PayloadCompression.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module compresses the point cloud frames sent to the receivers which
+support it. The compression level is chosen for each link from its measured
+throughput and the measured speed and ratio of each level, so that a fast
+link is not slowed down by the compression and a slow one sends less data.
+
+\***************************************************************************/
+
+using System;
+using System.Diagnostics;
+using System.IO;
+using System.IO.Compression;
+
+namespace LiveScanServer
+{
+    public static class PayloadCompression
+    {
+        // Flags of the payload header byte sent before each frame to the receivers which support compression
+        public const byte UncompressedPayload = 0;
+        public const byte DeflatePayload = 1; // Followed by the size of the compressed payload (int) and the payload
+
+        private const double MeasurementWeight = 0.1; // Weight of the last frame in the moving averages
+
+        // Deflate stores the blocks it cannot compress with a few bytes of header, so a compressed payload grows by less
+        // than 1/256 of its size and this margin
+        private const int ExpansionShift = 8;
+        private const int ExpansionMargin = 64;
+        private const int NumLevels = 3;
+
+        // Moving averages of the speed (bytes of frame per second) and size ratio of the levels, indexed by level; the
+        // initial values are typical of point cloud frames and are replaced by the measurements
+        private static double[] compressionSpeeds = { 0.0, 120e6, 25e6 };
+        private static double[] compressionRatios = { 1.0, 0.65, 0.55 };
+        private static object statsLock = new object();
+
+        private static readonly CompressionLevel[] Levels = { CompressionLevel.NoCompression, CompressionLevel.Fastest, CompressionLevel.Optimal };
+
+        /// <summary>
+        /// Chooses the compression level which minimizes the time to compress and send a frame on a link
+        /// </summary>
+        /// <param name="linkSpeed">Measured throughput of the link, in bytes per second; 0 if unknown</param>
+        /// <returns>The compression level to use</returns>
+        public static CompressionLevel SelectLevel(double linkSpeed)
+        {
+            if (linkSpeed <= 0.0)
+                return CompressionLevel.Fastest;
+
+            int bestLevel = 0;
+            double bestTime = 1.0 / linkSpeed;
+
+            lock (statsLock)
+            {
+                for (int level = 1; level < NumLevels; level++)
+                {
+                    // Time for one byte of frame; the compression is done once for all the receivers of the frame
+                    double time = 1.0 / compressionSpeeds[level] + compressionRatios[level] / linkSpeed;
+
+                    if (time < bestTime)
+                    {
+                        bestTime = time;
+                        bestLevel = level;
+                    }
+                }
+            }
+
+            return Levels[bestLevel];
+        }
+
+        /// <summary>
+        /// Builds the response sent to a receiver which supports compression: the payload header byte, followed by the
+        /// compressed payload and its size, or by the payload itself when it is not compressed. The response is in an
+        /// array of the payload pool, which the caller gives back.
+        /// </summary>
+        public static ArraySegment<byte> Compress(ArraySegment<byte> payload, CompressionLevel level)
+        {
+            if (level == CompressionLevel.NoCompression)
+            {
+                byte[] response = FramePayloadPool.Rent(1 + payload.Count);
+                response[0] = UncompressedPayload;
+                Buffer.BlockCopy(payload.Array, payload.Offset, response, 1, payload.Count);
+
+                return new ArraySegment<byte>(response, 0, 1 + payload.Count);
+            }
+
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            byte[] compressed = FramePayloadPool.Rent(1 + sizeof(int) + payload.Count + (payload.Count >> ExpansionShift) + ExpansionMargin);
+            MemoryStream stream = new MemoryStream(compressed);
+
+            // The header is written ahead of the compressed data, then the size is filled in
+            stream.WriteByte(DeflatePayload);
+            stream.Write(BitConverter.GetBytes(0), 0, sizeof(int));
+
+            using (DeflateStream deflateStream = new DeflateStream(stream, level, true))
+                deflateStream.Write(payload.Array, payload.Offset, payload.Count);
+
+            int size = (int)stream.Position;
+            Buffer.BlockCopy(BitConverter.GetBytes(size - 1 - sizeof(int)), 0, compressed, 1, sizeof(int));
+
+            UpdateStats(level, payload.Count, size, stopwatch.Elapsed.TotalSeconds);
+
+            return new ArraySegment<byte>(compressed, 0, size);
+        }
+
+        private static void UpdateStats(CompressionLevel level, int payloadSize, int compressedSize, double seconds)
+        {
+            int index = Array.IndexOf(Levels, level);
+
+            if (index < 0 || payloadSize == 0 || seconds <= 0.0)
+                return;
+
+            lock (statsLock)
+            {
+                compressionSpeeds[index] += MeasurementWeight * (payloadSize / seconds - compressionSpeeds[index]);
+                compressionRatios[index] += MeasurementWeight * ((double)compressedSize / payloadSize - compressionRatios[index]);
+            }
+        }
+    }
+}
@@ -0,0 +1,250 @@
+﻿/***************************************************************************\
+
+Module Name:  PlyExporter.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module writes the recorded frames to PLY files on all the cores, below
+the priority of the live capture and transfer, which keep running during an
+export. The frames are queued as they are fetched from the clients, in a bounded queue
+so that fetching waits for the writers rather than holding the recording in
+memory. Each writer streams the points of a file from the buffers of the
+clients, in their native layout, converting them to meters as they are
+copied to a reused write buffer; the frames of a merged file are written one
+client after the other instead of being merged first.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Text;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace LiveScanServer
+{
+    /// <summary>
+    /// Frame recorded by a client, as sent by the native client; the buffers are pooled and reused once written
+    /// </summary>
+    public sealed class RecordedFrame
+    {
+        private static readonly ConcurrentBag<RecordedFrame> pool = new ConcurrentBag<RecordedFrame>();
+
+        public Point3s[] Points = new Point3s[0]; // In millimeters
+        public RGB[] Colors = new RGB[0];
+        public int Count = 0;
+
+        /// <summary>
+        /// Copies a frame out of the native buffers, which are only valid during the callback which received them
+        /// </summary>
+        public static unsafe RecordedFrame Copy(Point3s* points, RGB* colors, int count)
+        {
+            RecordedFrame frame;
+
+            if (!pool.TryTake(out frame))
+                frame = new RecordedFrame();
+
+            if (frame.Points.Length < count)
+            {
+                frame.Points = new Point3s[count];
+                frame.Colors = new RGB[count];
+            }
+
+            fixed (Point3s* framePoints = frame.Points)
+            fixed (RGB* frameColors = frame.Colors)
+            {
+                Buffer.MemoryCopy(points, framePoints, (long)count * sizeof(Point3s), (long)count * sizeof(Point3s));
+                Buffer.MemoryCopy(colors, frameColors, (long)count * sizeof(RGB), (long)count * sizeof(RGB));
+            }
+
+            frame.Count = count;
+            return frame;
+        }
+
+        /// <summary>
+        /// Returns the buffers of the frame to the pool once it is no longer used
+        /// </summary>
+        public void Release()
+        {
+            Count = 0;
+            pool.Add(this);
+        }
+    }
+
+    public sealed class PlyExporter
+    {
+        private const int WriteBufferSize = 1 << 20;
+        private const int BinaryPointSize = 3 * sizeof(float) + 3; // x, y, z, red, green, blue
+
+        private sealed class ExportJob
+        {
+            public readonly string Filename;
+            public readonly List<RecordedFrame> Frames; // Null entries are clients without a frame
+
+            public ExportJob(string filename, List<RecordedFrame> frames)
+            {
+                Filename = filename;
+                Frames = frames;
+            }
+        }
+
+        private readonly bool isBinary;
+        private readonly BlockingCollection<ExportJob> jobs;
+        private readonly Task[] writers;
+        private Exception error = null;
+
+        /// <param name="isBinary">Write binary little endian PLY files instead of ASCII ones</param>
+        public PlyExporter(bool isBinary)
+        {
+            this.isBinary = isBinary;
+
+            // A few files per writer are enough to keep them busy while the next frames are fetched
+            int numWriters = Environment.ProcessorCount;
+            jobs = new BlockingCollection<ExportJob>(2 * numWriters);
+            writers = new Task[numWriters];
+
+            for (int i = 0; i < numWriters; i++)
+                writers[i] = Task.Factory.StartNew(WriteLoop, TaskCreationOptions.LongRunning);
+        }
+
+        /// <summary>
+        /// Queues a file holding the frames of the given clients, waiting for the writers when they fall behind. The
+        /// frames are released once written.
+        /// </summary>
+        public void Add(string filename, List<RecordedFrame> frames)
+        {
+            jobs.Add(new ExportJob(filename, frames));
+        }
+
+        /// <summary>
+        /// Waits for the queued files to be written
+        /// </summary>
+        /// <exception cref="IOException">The first error of the writers, once all the files are done</exception>
+        public void Complete()
+        {
+            jobs.CompleteAdding();
+            Task.WaitAll(writers);
+
+            if (error != null)
+                throw new IOException("Failed to export the recorded frames: " + error.Message, error);
+        }
+
+        private void WriteLoop()
+        {
+            // The writers run on threads of their own, so that the live threads preempt them without starving them
+            Thread.CurrentThread.Priority = ThreadPriority.BelowNormal;
+
+            byte[] buffer = new byte[WriteBufferSize];
+
+            foreach (ExportJob job in jobs.GetConsumingEnumerable())
+            {
+                // A failed file does not stop the export, so that the fetching is never left waiting for the writers
+                try
+                {
+                    WriteFile(job, buffer);
+                }
+                catch (Exception e)
+                {
+                    Interlocked.CompareExchange(ref error, e, null);
+                }
+
+                foreach (RecordedFrame frame in job.Frames)
+                    frame?.Release();
+            }
+        }
+
+        private void WriteFile(ExportJob job, byte[] buffer)
+        {
+            int numPoints = 0;
+
+            foreach (RecordedFrame frame in job.Frames)
+                numPoints += frame != null ? frame.Count : 0;
+
+            using (FileStream stream = new FileStream(job.Filename, FileMode.Create, FileAccess.Write, FileShare.None, 4096, FileOptions.SequentialScan))
+            {
+                string header = "ply\nformat " + (isBinary ? "binary_little_endian" : "ascii") + " 1.0\n"
+                    + "element vertex " + numPoints.ToString(CultureInfo.InvariantCulture) + "\n"
+                    + "property float x\nproperty float y\nproperty float z\nproperty uchar red\nproperty uchar green\nproperty uchar blue\nend_header\n";
+                byte[] headerBytes = Encoding.ASCII.GetBytes(header);
+                stream.Write(headerBytes, 0, headerBytes.Length);
+
+                foreach (RecordedFrame frame in job.Frames)
+                {
+                    if (frame == null)
+                        continue;
+
+                    if (isBinary)
+                        WriteBinaryPoints(stream, frame, buffer);
+                    else
+                        WriteAsciiPoints(stream, frame, buffer);
+                }
+            }
+        }
+
+        private static unsafe void WriteBinaryPoints(Stream stream, RecordedFrame frame, byte[] buffer)
+        {
+            int pointsPerBlock = buffer.Length / BinaryPointSize;
+
+            fixed (byte* bufferStart = buffer)
+            fixed (Point3s* points = frame.Points)
+            fixed (RGB* colors = frame.Colors)
+            {
+                for (int start = 0; start < frame.Count; start += pointsPerBlock)
+                {
+                    int end = Math.Min(frame.Count, start + pointsPerBlock);
+                    byte* output = bufferStart;
+
+                    for (int i = start; i < end; i++)
+                    {
+                        // Vertices are sent in millimeters and saved in meters
+                        float* position = (float*)output;
+                        position[0] = points[i].X / 1000.0f;
+                        position[1] = points[i].Y / 1000.0f;
+                        position[2] = points[i].Z / 1000.0f;
+
+                        output[12] = colors[i].Red;
+                        output[13] = colors[i].Green;
+                        output[14] = colors[i].Blue;
+                        output += BinaryPointSize;
+                    }
+
+                    stream.Write(buffer, 0, (int)(output - bufferStart));
+                }
+            }
+        }
+
+        private static void WriteAsciiPoints(Stream stream, RecordedFrame frame, byte[] buffer)
+        {
+            StringBuilder line = new StringBuilder(64);
+            int length = 0;
+
+            for (int i = 0; i < frame.Count; i++)
+            {
+                line.Clear();
+                line.Append((frame.Points[i].X / 1000.0f).ToString(CultureInfo.InvariantCulture)).Append(' ');
+                line.Append((frame.Points[i].Y / 1000.0f).ToString(CultureInfo.InvariantCulture)).Append(' ');
+                line.Append((frame.Points[i].Z / 1000.0f).ToString(CultureInfo.InvariantCulture)).Append(' ');
+                line.Append(frame.Colors[i].Red).Append(' ');
+                line.Append(frame.Colors[i].Green).Append(' ');
+                line.Append(frame.Colors[i].Blue).Append('\n');
+
+                if (length + line.Length > buffer.Length)
+                {
+                    stream.Write(buffer, 0, length);
+                    length = 0;
+                }
+
+                // The lines only hold ASCII characters
+                for (int j = 0; j < line.Length; j++)
+                    buffer[length++] = (byte)line[j];
+            }
+
+            stream.Write(buffer, 0, length);
+        }
+    }
+}
@@ -0,0 +1,796 @@
+﻿/***************************************************************************\
+
+Module Name:  PointCloudFrameEncoder.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module encodes each new merged frame once for all the point cloud
+receivers. The points are quantized and deduplicated by the native encoder,
+and the voxels held by the delta receivers are tracked as a shared sequence
+of states, so that a receiver only needs to know which version it has. The
+octree and progressive codings of the frames are only built when a receiver
+requests them, and so are the wide frames of the capture volumes larger than
+the byte grid and the surfel frames, wide frames with the normals estimated
+by the clients. The receivers which send their view pose get their own frame,
+with the points they cannot see removed. The split receivers share a geometry
+which is kept while its voxels barely change, so that they only get the
+colors of its points, themselves only sent when they change. The tiled
+receivers share the tiles of the byte grid, and a tile keeps its version as
+long as its voxels are the same and their colors barely change. The frames
+are copied from the native encoder to arrays of the payload pool, and the
+frames encoded at another scale for the delta, split and tiled receivers go
+back to the pool once read.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Runtime.InteropServices;
+
+namespace LiveScanServer
+{
+    public class PointCloudFrameEncoder
+    {
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern IntPtr CreatePointCloudEncoder();
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void DestroyPointCloudEncoder(IntPtr handle);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern unsafe int EncodePointCloud(IntPtr handle, float* vertices, byte* colors, int numVertices, short scale, out IntPtr buffer);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern unsafe int EncodePointCloudChunks(IntPtr handle, float* vertices, byte* colors, int* chunkSizes, int numChunks, short scale, out IntPtr buffer);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern int EncodePointCloudOctree(IntPtr handle, int chromaStep, out IntPtr buffer);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern int EncodePointCloudProgressive(IntPtr handle, int coarseDepth, out IntPtr buffer);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern unsafe int EncodePointCloudWide(IntPtr handle, float* vertices, byte* colors, int numVertices, float range, short scale, out IntPtr buffer);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern unsafe int EncodePointCloudSurfels(IntPtr handle, byte* normals, out IntPtr buffer);
+
+        [DllImport("LiveScanClient.dll", CallingConvention = CallingConvention.Cdecl)]
+        private static extern unsafe int EncodePointCloudMesh(IntPtr handle, float* vertices, byte* colors, int numVertices, int* indices, int numTriangles, float range, short scale, out IntPtr buffer);
+
+        // Set the range and determine the minimal precision to make sure position values fit in a byte. The range
+        // itself is applied by the native encoder.
+        private const float Range = 0.3f; // Range of allowed values for each axis, in meters
+        private const float MinPrecision = Range / 255; // Min precision (max resolution) with the range and the range of values in a byte (255)
+
+        // Center of the byte grid on each axis, in meters, as the native encoder quantizes the positions
+        public const float HalfRange = Range / 2;
+        public const float XRangeCenter = 0.0f;
+        public const float YRangeCenter = 0.0f;
+        public const float ZRangeCenter = HalfRange;
+
+        // Parameters used to find the scale
+        public const short MinScale = 400;
+        public const short MaxScale = (short)(1 / MinPrecision);
+        private const float ScaleFnOffset = 6700.0f;
+        private const float ScaleFnFactor = -500.0f;
+
+        private const int KeyframeInterval = 60; // Number of frames between two refreshes of the colors held by the delta receivers
+        private const int ColorChangeThreshold = 12; // Minimum change of a color channel for a voxel to be sent as recolored
+        private const int ScaleChangeRatio = 20; // In delta mode, the scale is kept until it changes by more than 1/20
+        private const int NumPreviousStates = 8; // Number of versions a delta receiver can lag behind before it gets a keyframe
+        private const int ProgressiveCoarseDepth = 5; // Depth of the first chunk of the progressive frames (cubes of 8 voxels on each side)
+        private const int ChunkHeaderSize = 5; // Depth of the chunk (byte) and size of its body (int)
+
+        // The geometry of the split receivers is kept, and its voxels recolored from the new frames, while less than
+        // 1/10 of its voxels are added or removed, and for at most KeyframeInterval frames
+        private const int GeometryChangeRatio = 10;
+
+        private IntPtr encoderHandle;
+
+        // Points of the frame last set, read in place
+        private float[] vertexBuffer = new float[0];
+        private byte[] colorBuffer = new byte[0];
+        private byte[] normalBuffer = null; // Null when the frame has no normals
+        private int vertexCount = 0;
+        private int[] indexBuffer = new int[0];
+        private int triangleCount = 0;
+        private FrameTrace frameTrace = new FrameTrace();
+
+        // Cameras of the frame last set, and the buffers of the points kept for a view
+        private List<int> cameraVertexCounts = new List<int>();
+        private List<AffineTransform> cameraPoses = new List<AffineTransform>();
+        private int[] chunkSizes = new int[0]; // Points of each camera in the frame last set, encoded as one chunk each
+        private float[] visibleVertexBuffer = new float[0];
+        private byte[] visibleColorBuffer = new byte[0];
+        private byte[] visibleNormalBuffer = new byte[0];
+
+        // Latest states of the delta receivers, oldest first
+        private List<EncodedPointCloud.DeltaState> deltaStates = new List<EncodedPointCloud.DeltaState>();
+        private int numFramesSinceKeyframe = 0;
+
+        // Latest state of the split receivers; null when none requested split frames
+        private EncodedPointCloud.SplitState splitState = null;
+        private int numFramesSinceGeometry = 0;
+
+        // Latest tiles of the tiled receivers; null when none requested tiled frames
+        private EncodedPointCloud.TiledFrame tiledFrame = null;
+
+        // Voxels of the frame last tiled, sorted by tile, and their colors, kept from one frame to the next
+        private int[] tileStarts = new int[EncodedPointCloud.TiledFrame.NumTiles + 1];
+        private int[] tileEnds = new int[EncodedPointCloud.TiledFrame.NumTiles];
+        private int[] pointTiles = new int[0];
+        private int[] tileVoxels = new int[0];
+        private int[] tileColors = new int[0];
+
+        // Quantization step of the chroma of the octree frames; 1 is lossless
+        public int ChromaStep = 1;
+
+        // Time after the encoding of a progressive frame past which its refinements are no longer sent, and the tiles out
+        // of the view of a tiled frame either, in milliseconds
+        public int FrameDeadlineMs = 33;
+
+        // Scale chosen by the rate control of the server; 0 to set the scale from the number of points
+        public short TargetScale = 0;
+
+        // Size of the capture volume of the wide frames on each axis, in meters; the other frames keep the range of the byte grid
+        public float CaptureRange = Range;
+
+        public PointCloudFrameEncoder()
+        {
+            encoderHandle = CreatePointCloudEncoder();
+        }
+
+        ~PointCloudFrameEncoder()
+        {
+            if (encoderHandle != IntPtr.Zero)
+            {
+                DestroyPointCloudEncoder(encoderHandle);
+                encoderHandle = IntPtr.Zero;
+            }
+        }
+
+        /// <summary>
+        /// Sets the merged frame to encode. The frame is read in place, so hold it until its views are encoded as well.
+        /// </summary>
+        public void SetFrame(MergedFrame frame)
+        {
+            frameTrace = frame.Trace;
+            cameraVertexCounts = frame.CameraVertexCounts;
+            cameraPoses = frame.CameraPoses;
+            vertexBuffer = frame.Vertices;
+            colorBuffer = frame.Colors;
+            normalBuffer = frame.HasNormals ? frame.Normals : null;
+            vertexCount = frame.VertexCount;
+            indexBuffer = frame.Indices;
+            triangleCount = frame.TriangleCount;
+        }
+
+        /// <summary>
+        /// Encodes the frame last copied for all the receivers
+        /// </summary>
+        /// <param name="version">Version of the merged frame</param>
+        /// <param name="isDeltaRequested">Whether any receiver requests delta frames, which need the voxels of the frame</param>
+        /// <param name="isOctreeRequested">Whether any receiver requests full frames coded as an octree</param>
+        /// <param name="isProgressiveRequested">Whether any receiver requests full frames coded as a progressive octree</param>
+        /// <param name="isWideRequested">Whether any receiver requests full frames with wide positions</param>
+        /// <param name="isMeshRequested">Whether any receiver requests mesh frames</param>
+        /// <param name="isSurfelRequested">Whether any receiver requests full frames as surfels</param>
+        /// <param name="isSplitRequested">Whether any receiver requests split frames, which need the geometry they share</param>
+        /// <param name="isTiledRequested">Whether any receiver requests tiled frames, which need the tiles they share</param>
+        /// <returns>The encoded frame</returns>
+        public EncodedPointCloud Encode(int version, bool isDeltaRequested, bool isOctreeRequested, bool isProgressiveRequested, bool isWideRequested, bool isMeshRequested,
+            bool isSurfelRequested, bool isSplitRequested, bool isTiledRequested)
+        {
+            // Determine the scale (resolution) dynamically based on the measured receivers, or on the number of points
+            short scale = TargetScale > 0 ? TargetScale : DetermineScale(vertexCount);
+            ArraySegment<byte> fullFrame = EncodeMergedFrame(scale);
+            ArraySegment<byte> octreeFrame = isOctreeRequested ? EncodeOctree() : default(ArraySegment<byte>);
+            EncodedPointCloud.ProgressiveFrame progressiveFrame = isProgressiveRequested ? EncodeProgressive() : null;
+            ArraySegment<byte> wideFrame = isWideRequested ? EncodeWide(scale, vertexBuffer, colorBuffer, vertexCount) : default(ArraySegment<byte>);
+            ArraySegment<byte> surfelFrame = isSurfelRequested
+                ? EncodeSurfels(scale, vertexBuffer, colorBuffer, normalBuffer, vertexCount, wideFrame.Array != null)
+                : default(ArraySegment<byte>);
+            ArraySegment<byte> meshFrame = isMeshRequested ? EncodeMesh(scale, wideFrame) : default(ArraySegment<byte>);
+
+            // The trace of the frame set is reused with the frame, while the encoded frame is kept by the receivers
+            FrameTrace trace = frameTrace.Clone();
+            trace.FrameId = version;
+
+            EncodedPointCloud.SplitState split = null;
+
+            if (isSplitRequested)
+            {
+                // The scale of the geometry is kept like that of the delta voxels
+                short splitScale = scale;
+
+                if (splitState != null && Math.Abs(scale - splitState.Scale) <= splitState.Scale / ScaleChangeRatio)
+                    splitScale = splitState.Scale;
+
+                ArraySegment<byte> splitFrame = splitScale == scale ? fullFrame : EncodeMergedFrame(splitScale);
+                split = UpdateSplitState(version, splitFrame.Array);
+                ReturnScaledFrame(splitFrame, fullFrame);
+            }
+
+            splitState = split;
+
+            EncodedPointCloud.TiledFrame tiled = null;
+
+            if (isTiledRequested)
+            {
+                // The scale of the tiles is kept like that of the delta voxels, since a new scale changes every tile
+                short tiledScale = scale;
+
+                if (tiledFrame != null && Math.Abs(scale - tiledFrame.Scale) <= tiledFrame.Scale / ScaleChangeRatio)
+                    tiledScale = tiledFrame.Scale;
+
+                ArraySegment<byte> tiledSourceFrame = tiledScale == scale ? fullFrame : EncodeMergedFrame(tiledScale);
+                tiled = UpdateTiledFrame(version, tiledSourceFrame.Array);
+                ReturnScaledFrame(tiledSourceFrame, fullFrame);
+            }
+
+            tiledFrame = tiled;
+
+            if (!isDeltaRequested)
+            {
+                deltaStates.Clear();
+                trace.EncodeTimeUs = FrameTrace.GetTimeUs();
+                return new EncodedPointCloud(version, trace, fullFrame, octreeFrame, wideFrame, meshFrame, surfelFrame, progressiveFrame, null, null, split, tiled);
+            }
+
+            // Small variations of the number of points would change the quantization of every voxel, so the scale of
+            // the voxels held by the delta receivers is kept as long as it stays close enough
+            EncodedPointCloud.DeltaState lastState = deltaStates.Count > 0 ? deltaStates[deltaStates.Count - 1] : null;
+            short deltaScale = scale;
+
+            if (lastState != null && Math.Abs(scale - lastState.Scale) <= lastState.Scale / ScaleChangeRatio)
+                deltaScale = lastState.Scale;
+
+            ArraySegment<byte> deltaFrame = deltaScale == scale ? fullFrame : EncodeMergedFrame(deltaScale);
+            Dictionary<int, int> frameVoxels = GetFrameVoxels(deltaFrame.Array);
+            ReturnScaledFrame(deltaFrame, fullFrame);
+            Dictionary<int, int> stateVoxels;
+            bool isKeyframe = lastState == null || deltaScale != lastState.Scale || numFramesSinceKeyframe >= KeyframeInterval;
+
+            if (isKeyframe)
+            {
+                // Refresh all the colors
+                stateVoxels = frameVoxels;
+                numFramesSinceKeyframe = 0;
+            }
+            else
+            {
+                stateVoxels = UpdateVoxels(lastState.Voxels, frameVoxels);
+                numFramesSinceKeyframe++;
+            }
+
+            EncodedPointCloud.DeltaState state = new EncodedPointCloud.DeltaState(version, deltaScale, stateVoxels, isKeyframe);
+            trace.EncodeTimeUs = FrameTrace.GetTimeUs();
+            EncodedPointCloud encodedFrame = new EncodedPointCloud(version, trace, fullFrame, octreeFrame, wideFrame, meshFrame, surfelFrame, progressiveFrame, state,
+                new List<EncodedPointCloud.DeltaState>(deltaStates), split, tiled);
+
+            deltaStates.Add(state);
+
+            if (deltaStates.Count > NumPreviousStates)
+                deltaStates.RemoveAt(0);
+
+            return encodedFrame;
+        }
+
+        /// <summary>
+        /// Encodes the points of the frame last copied which can be seen from a view. The scale of the frame shared by
+        /// the other receivers is kept, so the culled points reduce the size of the frame instead of raising its
+        /// resolution. Delta frames are not culled, since their voxels are shared by all the delta receivers, and neither
+        /// are the meshes, whose triangles would lose their vertices.
+        /// </summary>
+        /// <param name="frame">Frame encoded for all the receivers from the same copy</param>
+        /// <param name="pose">View pose of the receiver</param>
+        /// <param name="isOctreeRequested">Whether the receiver requests full frames coded as an octree</param>
+        /// <param name="isProgressiveRequested">Whether the receiver requests full frames coded as a progressive octree</param>
+        /// <param name="isWideRequested">Whether the receiver requests full frames with wide positions</param>
+        /// <param name="isSurfelRequested">Whether the receiver requests full frames as surfels</param>
+        /// <returns>The encoded frame, with the version of the shared frame, which holds the shared frame until it is
+        /// released</returns>
+        public EncodedPointCloud EncodeView(EncodedPointCloud frame, ViewPose pose, bool isOctreeRequested, bool isProgressiveRequested, bool isWideRequested,
+            bool isSurfelRequested)
+        {
+            visibleVertexBuffer = FrameAllocations.Reserve(visibleVertexBuffer, vertexBuffer.Length);
+            visibleColorBuffer = FrameAllocations.Reserve(visibleColorBuffer, colorBuffer.Length);
+
+            if (normalBuffer != null)
+                visibleNormalBuffer = FrameAllocations.Reserve(visibleNormalBuffer, normalBuffer.Length);
+
+            byte[] visibleNormals = normalBuffer != null ? visibleNormalBuffer : null;
+            int numVisible = pose.Cull(vertexBuffer, colorBuffer, vertexCount, cameraVertexCounts, cameraPoses, visibleVertexBuffer, visibleColorBuffer,
+                normalBuffer, visibleNormals);
+            short scale = BitConverter.ToInt16(frame.FullFrame.Array, frame.FullFrame.Offset);
+
+            ArraySegment<byte> fullFrame = EncodeFrame(scale, visibleVertexBuffer, visibleColorBuffer, numVisible);
+            ArraySegment<byte> octreeFrame = isOctreeRequested ? EncodeOctree() : default(ArraySegment<byte>);
+            EncodedPointCloud.ProgressiveFrame progressiveFrame = isProgressiveRequested ? EncodeProgressive() : null;
+            ArraySegment<byte> wideFrame = isWideRequested ? EncodeWide(scale, visibleVertexBuffer, visibleColorBuffer, numVisible) : default(ArraySegment<byte>);
+            ArraySegment<byte> surfelFrame = isSurfelRequested
+                ? EncodeSurfels(scale, visibleVertexBuffer, visibleColorBuffer, visibleNormals, numVisible, wideFrame.Array != null)
+                : default(ArraySegment<byte>);
+
+            return new EncodedPointCloud(frame.Version, frame.Trace, fullFrame, octreeFrame, wideFrame, frame.MeshFrame, surfelFrame, progressiveFrame, null, null, null, null,
+                frame);
+        }
+
+        /// <summary>
+        /// Encodes points to a full frame wire buffer (scale, number of vertices, vertices, colors) with the native
+        /// encoder, which drops the points out of range and keeps one point per voxel
+        /// </summary>
+        private unsafe ArraySegment<byte> EncodeFrame(short scale, float[] vertices, byte[] colors, int numVertices)
+        {
+            int size;
+            IntPtr encoded;
+
+            fixed (float* vertexPtr = vertices)
+            fixed (byte* colorPtr = colors)
+            {
+                size = EncodePointCloud(encoderHandle, vertexPtr, colorPtr, numVertices, scale, out encoded);
+            }
+
+            return CopyEncoded(encoded, size, 0);
+        }
+
+        /// <summary>
+        /// Encodes the frame last set to a full frame wire buffer like <see cref="EncodeFrame"/>, with the points of
+        /// each camera quantized as a chunk of their own, concurrently, by the native encoder, which joins the chunks
+        /// under one header. The cameras which own their voxels rarely reach the same voxel, and those which do are
+        /// still sent once.
+        /// </summary>
+        private unsafe ArraySegment<byte> EncodeMergedFrame(short scale)
+        {
+            int numCameras = cameraVertexCounts.Count;
+
+            if (chunkSizes.Length < numCameras + 1)
+                chunkSizes = new int[numCameras + 1];
+
+            // The counts are clamped to the frame, and the points past those of the cameras, if any, make a last chunk,
+            // as the views count them
+            int offset = 0;
+
+            for (int i = 0; i < numCameras; i++)
+            {
+                chunkSizes[i] = Math.Max(0, Math.Min(cameraVertexCounts[i], vertexCount - offset));
+                offset += chunkSizes[i];
+            }
+
+            chunkSizes[numCameras] = vertexCount - offset;
+
+            int size;
+            IntPtr encoded;
+
+            fixed (float* vertexPtr = vertexBuffer)
+            fixed (byte* colorPtr = colorBuffer)
+            fixed (int* chunkSizePtr = chunkSizes)
+            {
+                size = EncodePointCloudChunks(encoderHandle, vertexPtr, colorPtr, chunkSizePtr, numCameras + 1, scale, out encoded);
+            }
+
+            return CopyEncoded(encoded, size, 0);
+        }
+
+        /// <summary>
+        /// Encodes points to a wide frame wire buffer (scale, number of vertices, minimum and quantization step of each
+        /// axis, packed 32-bit positions, colors) with the native encoder, which drops the points out of the capture
+        /// range and keeps one point per quantized position
+        /// </summary>
+        private ArraySegment<byte> EncodeWide(short scale, float[] vertices, byte[] colors, int numVertices)
+        {
+            IntPtr encoded;
+            int size = EncodeNativeWide(scale, vertices, colors, numVertices, out encoded);
+
+            return CopyEncoded(encoded, size, 0);
+        }
+
+        /// <summary>
+        /// Codes points as a wide frame in the buffer of the native encoder, which holds it until its next frame
+        /// </summary>
+        /// <returns>The size of the frame</returns>
+        private unsafe int EncodeNativeWide(short scale, float[] vertices, byte[] colors, int numVertices, out IntPtr encoded)
+        {
+            fixed (float* vertexPtr = vertices)
+            fixed (byte* colorPtr = colors)
+            {
+                return EncodePointCloudWide(encoderHandle, vertexPtr, colorPtr, numVertices, CaptureRange, scale, out encoded);
+            }
+        }
+
+        /// <summary>
+        /// Encodes points to a surfel frame wire buffer (their wide frame, then the normal of each point of the wide
+        /// frame). The native encoder gathers the normals of the points of its last wide frame, so the points are coded
+        /// as a wide frame first unless they just were, in its own buffer since that frame is not sent.
+        /// </summary>
+        /// <param name="normals">Normal of each point; null to send the points without normals, which face the viewer</param>
+        /// <param name="isWideEncoded">Whether the last wide frame of the native encoder is of the same points</param>
+        private unsafe ArraySegment<byte> EncodeSurfels(short scale, float[] vertices, byte[] colors, byte[] normals, int numVertices, bool isWideEncoded)
+        {
+            IntPtr encoded;
+
+            if (!isWideEncoded)
+                EncodeNativeWide(scale, vertices, colors, numVertices, out encoded);
+
+            int size;
+
+            fixed (byte* normalPtr = normals)
+            {
+                size = EncodePointCloudSurfels(encoderHandle, normalPtr, out encoded);
+            }
+
+            return CopyEncoded(encoded, size, 0);
+        }
+
+        /// <summary>
+        /// Encodes the triangles of the frame last copied to a mesh frame wire buffer (number of triangles, vertices as a
+        /// wide frame, vertex indices) with the native encoder, which keeps all the vertices. A frame without triangles
+        /// is sent as its wide frame after a count of no triangles, which the receivers render as points.
+        /// </summary>
+        private unsafe ArraySegment<byte> EncodeMesh(short scale, ArraySegment<byte> wideFrame)
+        {
+            if (triangleCount == 0)
+            {
+                ArraySegment<byte> pointFrame;
+
+                if (wideFrame.Array != null)
+                {
+                    pointFrame = new ArraySegment<byte>(FramePayloadPool.Rent(sizeof(int) + wideFrame.Count), 0, sizeof(int) + wideFrame.Count);
+                    Buffer.BlockCopy(wideFrame.Array, wideFrame.Offset, pointFrame.Array, sizeof(int), wideFrame.Count);
+                }
+                else
+                {
+                    IntPtr points;
+                    int numBytes = EncodeNativeWide(scale, vertexBuffer, colorBuffer, vertexCount, out points);
+                    pointFrame = CopyEncoded(points, numBytes, sizeof(int));
+                }
+
+                Array.Clear(pointFrame.Array, 0, sizeof(int));
+
+                return pointFrame;
+            }
+
+            int size;
+            IntPtr encoded;
+
+            fixed (float* vertexPtr = vertexBuffer)
+            fixed (byte* colorPtr = colorBuffer)
+            fixed (int* indexPtr = indexBuffer)
+            {
+                size = EncodePointCloudMesh(encoderHandle, vertexPtr, colorPtr, vertexCount, indexPtr, triangleCount, CaptureRange, scale, out encoded);
+            }
+
+            return CopyEncoded(encoded, size, 0);
+        }
+
+        /// <summary>
+        /// Codes the frame last encoded by the native encoder as an octree (scale, number of vertices, child occupancy
+        /// masks, predicted YCoCg colors in Morton order)
+        /// </summary>
+        private ArraySegment<byte> EncodeOctree()
+        {
+            IntPtr encoded;
+            int size = EncodePointCloudOctree(encoderHandle, Math.Max(1, ChromaStep), out encoded);
+
+            return CopyEncoded(encoded, size, 0);
+        }
+
+        /// <summary>
+        /// Codes the frame last encoded by the native encoder as a progressive octree, split into its chunks so that the
+        /// sockets can stop after any of them; the header and the chunks are segments of the array of the frame
+        /// </summary>
+        private EncodedPointCloud.ProgressiveFrame EncodeProgressive()
+        {
+            IntPtr encoded;
+            int size = EncodePointCloudProgressive(encoderHandle, ProgressiveCoarseDepth, out encoded);
+            byte[] frame = CopyEncoded(encoded, size, 0).Array;
+            int numChunks = 0;
+
+            for (int offset = EncodedPointCloud.HeaderSize; offset < size; offset += ChunkHeaderSize + BitConverter.ToInt32(frame, offset + 1))
+                numChunks++;
+
+            byte[] depths = new byte[numChunks];
+            ArraySegment<byte>[] chunks = new ArraySegment<byte>[numChunks];
+
+            for (int i = 0, offset = EncodedPointCloud.HeaderSize; i < numChunks; i++)
+            {
+                int chunkSize = BitConverter.ToInt32(frame, offset + 1);
+
+                depths[i] = frame[offset];
+                chunks[i] = new ArraySegment<byte>(frame, offset + ChunkHeaderSize, chunkSize);
+
+                offset += ChunkHeaderSize + chunkSize;
+            }
+
+            long deadline = Stopwatch.GetTimestamp() + FrameDeadlineMs * Stopwatch.Frequency / 1000;
+
+            return new EncodedPointCloud.ProgressiveFrame(new ArraySegment<byte>(frame, 0, EncodedPointCloud.HeaderSize), depths, chunks, deadline);
+        }
+
+        /// <summary>
+        /// Copies a frame of the native encoder to an array of the payload pool, after <paramref name="offset"/> bytes
+        /// left for a header. The frame starts its array, as the frames read by the delta, split and tiled states expect.
+        /// </summary>
+        private static ArraySegment<byte> CopyEncoded(IntPtr encoded, int size, int offset)
+        {
+            byte[] frame = FramePayloadPool.Rent(offset + size);
+
+            if (size > 0)
+                Marshal.Copy(encoded, frame, offset, size);
+
+            return new ArraySegment<byte>(frame, 0, offset + size);
+        }
+
+        /// <summary>
+        /// Gives back a frame encoded at another scale than the full frame, which is only read while encoding
+        /// </summary>
+        private static void ReturnScaledFrame(ArraySegment<byte> frame, ArraySegment<byte> fullFrame)
+        {
+            if (frame.Array != fullFrame.Array)
+                FramePayloadPool.Return(frame.Array);
+        }
+
+        /// <summary>
+        /// Reads the voxels of an encoded frame
+        /// </summary>
+        /// <returns>The voxels of the frame (key: packed x, y, z bytes; value: packed color)</returns>
+        private static Dictionary<int, int> GetFrameVoxels(byte[] frame)
+        {
+            int numVertices = BitConverter.ToInt32(frame, 2);
+            int colorOffset = EncodedPointCloud.HeaderSize + 3 * numVertices;
+            Dictionary<int, int> frameVoxels = new Dictionary<int, int>(numVertices);
+
+            for (int i = 0; i < 3 * numVertices; i += 3)
+            {
+                int vertexIndex = EncodedPointCloud.HeaderSize + i;
+                int colorIndex = colorOffset + i;
+
+                frameVoxels.Add(PackBytes(frame[vertexIndex], frame[vertexIndex + 1], frame[vertexIndex + 2]),
+                    PackBytes(frame[colorIndex], frame[colorIndex + 1], frame[colorIndex + 2]));
+            }
+
+            return frameVoxels;
+        }
+
+        /// <summary>
+        /// Builds the next state of the delta receivers: the voxels of the frame, where the voxels already held keep
+        /// their color unless it changed noticeably
+        /// </summary>
+        private static Dictionary<int, int> UpdateVoxels(Dictionary<int, int> voxels, Dictionary<int, int> frameVoxels)
+        {
+            Dictionary<int, int> updatedVoxels = new Dictionary<int, int>(frameVoxels.Count);
+
+            foreach (KeyValuePair<int, int> frameVoxel in frameVoxels)
+            {
+                int color;
+
+                // Small color changes are not sent; the receivers keep the color they already have
+                if (voxels.TryGetValue(frameVoxel.Key, out color) && !IsColorChanged(color, frameVoxel.Value))
+                    updatedVoxels.Add(frameVoxel.Key, color);
+                else
+                    updatedVoxels.Add(frameVoxel.Key, frameVoxel.Value);
+            }
+
+            return updatedVoxels;
+        }
+
+        /// <summary>
+        /// Builds the next state of the split receivers. While the voxels of the frame are close enough to those of the
+        /// geometry, the geometry is kept, and its points take the colors of the frame which changed noticeably; the
+        /// voxels added are left out and those removed keep their color until the geometry is sent again.
+        /// </summary>
+        private EncodedPointCloud.SplitState UpdateSplitState(int version, byte[] frame)
+        {
+            short scale = BitConverter.ToInt16(frame, 0);
+            int numVertices = BitConverter.ToInt32(frame, 2);
+            int colorOffset = EncodedPointCloud.HeaderSize + 3 * numVertices;
+            EncodedPointCloud.SplitState lastState = splitState;
+
+            if (lastState != null && lastState.Scale == scale && numFramesSinceGeometry < KeyframeInterval)
+            {
+                byte[] colors = null; // Copied from the colors of the geometry once one of them changes
+                int numKept = 0;
+
+                for (int i = 0; i < 3 * numVertices; i += 3)
+                {
+                    int vertexIndex = EncodedPointCloud.HeaderSize + i;
+                    int index;
+
+                    if (!lastState.Indices.TryGetValue(PackBytes(frame[vertexIndex], frame[vertexIndex + 1], frame[vertexIndex + 2]), out index))
+                        continue;
+
+                    numKept++;
+
+                    int colorIndex = colorOffset + i;
+                    int geometryIndex = 3 * index;
+                    byte[] heldColors = colors ?? lastState.Colors;
+
+                    if (!IsColorChanged(PackBytes(heldColors[geometryIndex], heldColors[geometryIndex + 1], heldColors[geometryIndex + 2]),
+                        PackBytes(frame[colorIndex], frame[colorIndex + 1], frame[colorIndex + 2])))
+                        continue;
+
+                    if (colors == null)
+                    {
+                        colors = FrameAllocations.Allocate<byte>(lastState.Colors.Length);
+                        Buffer.BlockCopy(lastState.Colors, 0, colors, 0, colors.Length);
+                    }
+
+                    Buffer.BlockCopy(frame, colorIndex, colors, geometryIndex, 3);
+                }
+
+                int numChanged = (numVertices - numKept) + (lastState.Count - numKept);
+
+                if (numChanged * GeometryChangeRatio < Math.Max(lastState.Count, 1))
+                {
+                    numFramesSinceGeometry++;
+
+                    return colors == null ? lastState
+                        : new EncodedPointCloud.SplitState(lastState.GeometryId, version, scale, lastState.Positions, colors, lastState.Indices);
+                }
+            }
+
+            // Send the points of the frame as the new geometry, kept by the states of the next frames
+            byte[] positions = FrameAllocations.Allocate<byte>(3 * numVertices);
+            byte[] geometryColors = FrameAllocations.Allocate<byte>(3 * numVertices);
+            Dictionary<int, int> indices = new Dictionary<int, int>(numVertices);
+
+            Buffer.BlockCopy(frame, EncodedPointCloud.HeaderSize, positions, 0, positions.Length);
+            Buffer.BlockCopy(frame, colorOffset, geometryColors, 0, geometryColors.Length);
+
+            for (int i = 0; i < numVertices; i++)
+                indices.Add(PackBytes(positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]), i);
+
+            numFramesSinceGeometry = 0;
+
+            return new EncodedPointCloud.SplitState(version, version, scale, positions, geometryColors, indices);
+        }
+
+        /// <summary>
+        /// Builds the next tiles of the tiled receivers. The voxels of the frame are sorted into their tiles, and a tile
+        /// keeps its version when it holds the same voxels as the tile held, with colors close enough to those sent.
+        /// </summary>
+        private EncodedPointCloud.TiledFrame UpdateTiledFrame(int version, byte[] frame)
+        {
+            const int NumTiles = EncodedPointCloud.TiledFrame.NumTiles;
+            const int TilesPerAxis = EncodedPointCloud.TiledFrame.TilesPerAxis;
+            const int TileShift = EncodedPointCloud.TiledFrame.TileShift;
+
+            short scale = BitConverter.ToInt16(frame, 0);
+            int numVertices = BitConverter.ToInt32(frame, 2);
+            int colorOffset = EncodedPointCloud.HeaderSize + 3 * numVertices;
+            EncodedPointCloud.TiledFrame lastFrame = tiledFrame != null && tiledFrame.Scale == scale ? tiledFrame : null;
+
+            // Sort the voxels by tile, then by voxel within each tile, so that the tiles compare in one pass
+            pointTiles = FrameAllocations.Reserve(pointTiles, numVertices);
+            Array.Clear(tileStarts, 0, tileStarts.Length);
+
+            for (int i = 0; i < numVertices; i++)
+            {
+                int vertexIndex = EncodedPointCloud.HeaderSize + 3 * i;
+                int tile = (((frame[vertexIndex] >> TileShift) * TilesPerAxis + (frame[vertexIndex + 1] >> TileShift)) * TilesPerAxis) + (frame[vertexIndex + 2] >> TileShift);
+
+                pointTiles[i] = tile;
+                tileStarts[tile + 1]++;
+            }
+
+            for (int tile = 0; tile < NumTiles; tile++)
+                tileStarts[tile + 1] += tileStarts[tile];
+
+            int[] voxels = tileVoxels = FrameAllocations.Reserve(tileVoxels, numVertices);
+            int[] colors = tileColors = FrameAllocations.Reserve(tileColors, numVertices);
+            Array.Copy(tileStarts, tileEnds, NumTiles);
+
+            for (int i = 0; i < numVertices; i++)
+            {
+                int vertexIndex = EncodedPointCloud.HeaderSize + 3 * i;
+                int colorIndex = colorOffset + 3 * i;
+                int index = tileEnds[pointTiles[i]]++;
+
+                voxels[index] = PackBytes(frame[vertexIndex], frame[vertexIndex + 1], frame[vertexIndex + 2]);
+                colors[index] = PackBytes(frame[colorIndex], frame[colorIndex + 1], frame[colorIndex + 2]);
+            }
+
+            EncodedPointCloud.Tile[] tiles = new EncodedPointCloud.Tile[NumTiles];
+
+            for (int tile = 0; tile < NumTiles; tile++)
+            {
+                int start = tileStarts[tile];
+                int count = tileStarts[tile + 1] - start;
+
+                if (count == 0)
+                    continue;
+
+                Array.Sort(voxels, colors, start, count);
+
+                EncodedPointCloud.Tile lastTile = lastFrame?.Tiles[tile];
+
+                if (lastTile != null && IsTileUnchanged(lastTile, voxels, colors, start, count))
+                {
+                    tiles[tile] = lastTile;
+                    continue;
+                }
+
+                // The tiles are kept by the frames in which they do not change
+                byte[] tileFrame = FrameAllocations.Allocate<byte>(EncodedPointCloud.HeaderSize + 6 * count);
+                Buffer.BlockCopy(frame, 0, tileFrame, 0, sizeof(short));
+                Buffer.BlockCopy(BitConverter.GetBytes(count), 0, tileFrame, sizeof(short), sizeof(int));
+
+                for (int i = 0; i < count; i++)
+                {
+                    WritePackedBytes(tileFrame, EncodedPointCloud.HeaderSize + 3 * i, voxels[start + i]);
+                    WritePackedBytes(tileFrame, EncodedPointCloud.HeaderSize + 3 * (count + i), colors[start + i]);
+                }
+
+                tiles[tile] = new EncodedPointCloud.Tile(version, count, tileFrame);
+            }
+
+            long deadline = Stopwatch.GetTimestamp() + FrameDeadlineMs * Stopwatch.Frequency / 1000;
+
+            return new EncodedPointCloud.TiledFrame(scale, tiles, deadline);
+        }
+
+        /// <summary>
+        /// Checks whether the sorted voxels of a tile are those of the tile held, and their colors close enough to its colors
+        /// </summary>
+        private static bool IsTileUnchanged(EncodedPointCloud.Tile tile, int[] voxels, int[] colors, int start, int count)
+        {
+            if (tile.Count != count)
+                return false;
+
+            byte[] tileFrame = tile.Frame;
+
+            for (int i = 0; i < count; i++)
+            {
+                int vertexIndex = EncodedPointCloud.HeaderSize + 3 * i;
+
+                if (PackBytes(tileFrame[vertexIndex], tileFrame[vertexIndex + 1], tileFrame[vertexIndex + 2]) != voxels[start + i])
+                    return false;
+            }
+
+            for (int i = 0; i < count; i++)
+            {
+                int colorIndex = EncodedPointCloud.HeaderSize + 3 * (count + i);
+
+                if (IsColorChanged(PackBytes(tileFrame[colorIndex], tileFrame[colorIndex + 1], tileFrame[colorIndex + 2]), colors[start + i]))
+                    return false;
+            }
+
+            return true;
+        }
+
+        private static void WritePackedBytes(byte[] buffer, int offset, int packed)
+        {
+            buffer[offset] = (byte)(packed >> 16);
+            buffer[offset + 1] = (byte)(packed >> 8);
+            buffer[offset + 2] = (byte)packed;
+        }
+
+        private static int PackBytes(byte b0, byte b1, byte b2)
+        {
+            return (b0 << 16) | (b1 << 8) | b2;
+        }
+
+        private static bool IsColorChanged(int color, int newColor)
+        {
+            for (int shift = 0; shift <= 16; shift += 8)
+            {
+                if (Math.Abs(((color >> shift) & 0xFF) - ((newColor >> shift) & 0xFF)) > ColorChangeThreshold)
+                    return true;
+            }
+
+            return false;
+        }
+
+        // Determine scale based on number of vertices
+        public static short DetermineScale(int vertexCount)
+        {
+            if (vertexCount <= 0) return MaxScale;
+            short scale = (short)Math.Truncate(ScaleFnOffset + ScaleFnFactor * Math.Log(vertexCount));
+            return Math.Min(MaxScale, Math.Max(scale, MinScale)); // Clamp between min and max acceptable scales
+        }
+    }
+}
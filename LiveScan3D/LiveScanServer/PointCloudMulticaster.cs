@@ -0,0 +1,141 @@
+﻿/***************************************************************************\
+
+Module Name:  PointCloudMulticaster.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module sends the full point cloud frames to an IP multicast group, so
+that the receivers watching the same scene share a single stream and the
+egress of the server does not grow with their number. The frames are split
+into the same packets as the UDP stream, with their parity packets. All the
+receivers of the group get the same frames, coded with the flags all of them
+requested; each frame starts with these flags.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Net;
+using System.Net.Sockets;
+using System.Threading.Tasks;
+
+namespace LiveScanServer
+{
+    public sealed class PointCloudMulticaster
+    {
+        // Administratively scoped group; the receivers join it on the same port
+        public const string GroupAddress = "239.255.48.2";
+        public const int GroupPort = 48004;
+
+        // Keeps the frames in the local network of the server
+        private const int TimeToLive = 1;
+
+        // Flags of the full frame requests which the receivers of the group must share
+        private const byte FrameFlags = PointCloudTransferSocket.CompressionRequestFlag | PointCloudTransferSocket.OctreeRequestFlag
+            | PointCloudTransferSocket.WideRequestFlag | PointCloudTransferSocket.TimestampRequestFlag;
+
+        private UdpClient sender;
+        private IPEndPoint groupEndPoint;
+        private int sentVersion = -1;
+        private volatile bool isSending = false;
+
+        // Called once a frame is sent, so that the latest frame can be sent in turn
+        private Action onReady;
+
+        public PointCloudMulticaster(Action onReady)
+        {
+            this.onReady = onReady;
+
+            sender = new UdpClient();
+            sender.Client.SetSocketOption(SocketOptionLevel.IP, SocketOptionName.MulticastTimeToLive, TimeToLive);
+            TransferSocketBase.EnlargeSendBuffer(sender.Client, PointCloudTransferSocket.UdpSendBufferSize);
+            groupEndPoint = new IPEndPoint(IPAddress.Parse(GroupAddress), GroupPort);
+        }
+
+        public void Close()
+        {
+            sender.Close();
+        }
+
+        /// <summary>
+        /// Starts sending a frame to the group if any receiver joined it and the previous frame is sent. The frames
+        /// encoded while one is being sent are skipped.
+        /// </summary>
+        /// <param name="frame">Latest encoded frame, shared by all the receivers</param>
+        /// <param name="receivers">Connected receivers, of which only those which joined the group are considered</param>
+        public void SendPointCloud(EncodedPointCloud frame, List<PointCloudTransferSocket> receivers)
+        {
+            if (isSending || frame == null || frame.Version == sentVersion)
+                return;
+
+            byte flags = FrameFlags;
+            bool isGroupJoined = false;
+
+            foreach (PointCloudTransferSocket receiver in receivers)
+            {
+                if (receiver.IsMulticastRequested)
+                {
+                    flags &= receiver.MulticastRequest;
+                    isGroupJoined = true;
+                }
+            }
+
+            if (!isGroupJoined)
+                return;
+
+            // The frame was encoded before a receiver requested octrees or wide frames; wait for the next one
+            ArraySegment<byte> response = PointCloudTransferSocket.GetFullFrame(frame, flags);
+
+            if (response.Array == null)
+                return;
+
+            sentVersion = frame.Version;
+            isSending = true;
+            frame.AddReference();
+
+            Task.Run(async () =>
+            {
+                List<byte[]> packets = null;
+
+                try
+                {
+                    ArraySegment<byte> payload = response;
+
+                    if ((flags & PointCloudTransferSocket.CompressionRequestFlag) != 0)
+                        payload = frame.GetCompressedResponse(response, PayloadCompression.SelectLevel(0.0));
+
+                    // The headsets of the group send no reports on their TCP socket, so the frames of the group are not traced
+                    if ((flags & PointCloudTransferSocket.TimestampRequestFlag) != 0)
+                        payload = frame.GetTimestampedResponse(payload, false);
+
+                    // The message and its packets are only sent to the group, and go back to the pool once sent
+                    byte[] message = FramePayloadPool.Rent(1 + payload.Count);
+                    message[0] = flags;
+                    Buffer.BlockCopy(payload.Array, payload.Offset, message, 1, payload.Count);
+                    packets = FramePacketizer.Packetize(frame.Version, new ArraySegment<byte>(message, 0, 1 + payload.Count));
+                    FramePayloadPool.Return(message);
+
+                    foreach (byte[] packet in packets)
+                        await sender.SendAsync(packet, FramePacketizer.PacketSize, groupEndPoint);
+                }
+                catch (Exception)
+                {
+                    // Lost frames are skipped by the receivers
+                }
+
+                if (packets != null)
+                {
+                    foreach (byte[] packet in packets)
+                        FramePayloadPool.Return(packet);
+                }
+
+                frame.Release();
+
+                isSending = false;
+                onReady();
+            });
+        }
+    }
+}
@@ -7,6 +7,47 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module is the socket used to send point cloud data to connected clients.
+Depending on their request, frames are sent entirely or as the voxels added,
+removed or recolored since the frame they hold, with keyframes when they are
+too far behind. Frames are encoded once for all the receivers; each socket
+only tracks the versions it has sent and writes the shared buffers.
+
+Each request byte is a credit for one frame. Receivers keep a small window of
+requests outstanding, so frames are pushed as soon as they are encoded instead
+of after a round trip, and a receiver which falls behind gets the newest frame
+once it has credit again.
+
+Receivers which set the compression flag of their requests get a payload
+header byte before each frame, and the frame is compressed with the level
+that suits the throughput measured on their link. Receivers which set the
+octree flag of their full frame requests get the frames coded as an octree.
+With the progressive flag, the full frames are sent as a coarse level of the
+octree followed by refinement chunks, until the deadline of the frame. With
+the wide flag, they get wide frames instead, whose positions are packed in
+32 bits so that capture volumes larger than the byte grid are not clipped,
+and with both the wide and the octree flags, surfel frames: wide frames
+followed by the normal of each point, which the receiver draws as oriented
+discs. With the progressive and the wide flags, the full frames are split:
+the receiver gets the positions of the geometry shared by the split receivers
+with their colors when the geometry changes, and only the colors of the
+geometry it holds otherwise, or no colors when they did not change either.
+With the progressive, the wide and the octree flags, the full frames are
+tiled: the byte grid is split into tiles with a version each, and only the
+tiles the receiver does not hold are sent, those in its view first and the
+nearest first, each compressed on its own so that the receiver renders it as
+soon as it arrives. The tiles out of its view wait for the next frame once
+the deadline of the frame is reached.
+With the timestamp flag, each frame is preceded by its capture time, so that
+the receiver can buffer the frames against the jitter of the network. The
+receivers which request latency traces also get the id and the camera
+timestamp of each frame, and report when they displayed it, which the latency
+monitor of the server breaks down by hop.
+
+A receiver can also ask for the full frames to be streamed over UDP, where a
+lost packet never delays the next frames, or to join the multicast group
+which gets each frame once for all its receivers; the TCP socket then only
+carries that request. Receivers may send their view pose at any time, so that their
+full frames only hold the points they can see.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -17,121 +58,801 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 
 using System;
 using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO.Compression;
+using System.Net;
 using System.Net.Sockets;
+using System.Threading.Tasks;
 
 namespace LiveScanServer
 {
     public class PointCloudTransferSocket : TransferSocketBase
     {
-        // Set the range and determine the minimal precision to make sure position values fit in a byte
-        private const float Range = 0.3f; // Range of allowed values for each axis, in meters
-        private const float HalfRange = Range / 2.0f;
-        private const float MinPrecision = Range / 255; // Min precision (max resolution) with the range and the range of values in a byte (255)
+        // Request bytes sent by the receivers, one for each frame they are ready to receive
+        private const byte FullFrameRequest = 0; // The frame is sent entirely
+        private const byte DeltaFrameRequest = 1; // The receiver applies deltas to the voxels of the last frame it received
+        private const byte UdpStreamRequest = 2; // Followed by the UDP port of the receiver (ushort); every new full frame is sent to it
+        private const byte ViewPoseRequest = 3; // Followed by the view pose of the receiver; does not request a frame
+        private const byte MulticastStreamRequest = 4; // Every new full frame is sent to the multicast group, shared by all the receivers which joined it
+        private const byte LatencyTraceRequest = 5; // The timestamped frames of the receiver are traced; does not request a frame
+        private const byte LatencyReportRequest = 6; // Followed by the report of a frame displayed by the receiver; does not request a frame
+        private const byte MeshFrameRequest = 7; // The fused surface is sent as a triangle mesh, or as points when it has no triangles
+        public const byte CompressionRequestFlag = 0x80; // Set on the requests of the receivers which support compression
+        public const byte OctreeRequestFlag = 0x40; // Set on the full frame requests of the receivers which decode octrees
+        private const byte ProgressiveRequestFlag = 0x20; // Set on the full frame requests of the receivers which render progressive frames
+        public const byte WideRequestFlag = 0x10; // Set on the full frame requests of the receivers which decode wide positions; takes precedence over the octrees
+        public const byte TimestampRequestFlag = 0x08; // Set on the requests of the receivers which get the capture time (long, microseconds) before each frame
+
+        // Both set on the full frame requests of the receivers which render surfels, which get the wide frames followed by
+        // the normal of each point; wide frames never come as octrees, so the combination is free
+        public const byte SurfelRequestFlags = WideRequestFlag | OctreeRequestFlag;
+
+        // Both set on the full frame requests of the receivers which get the geometry and the colors of the frames
+        // separately; progressive frames never come wide, so the combination is free
+        public const byte SplitRequestFlags = WideRequestFlag | ProgressiveRequestFlag;
+
+        // All three set on the full frame requests of the receivers which get the tiles of the frames they do not hold;
+        // split frames never come as octrees, so the combination is free. Takes precedence over the split frames.
+        public const byte TiledRequestFlags = WideRequestFlag | OctreeRequestFlag | ProgressiveRequestFlag;
+        private const byte RequestFlags = CompressionRequestFlag | OctreeRequestFlag | ProgressiveRequestFlag | WideRequestFlag | TimestampRequestFlag;
+
+        private const byte EndOfFrameDepth = 0; // Sent in place of the depth of a progressive chunk after the last chunk of a frame
+        private const int ChunkHeaderSize = 5; // Depth of a progressive chunk (byte) and size of its body (int)
+        private static readonly byte[] s_endOfFrame = { EndOfFrameDepth };
+        private const byte EndOfTilesIndex = 0xFF; // Sent in place of the index of a tile after the last tile of a frame
+        private static readonly byte[] s_endOfTiles = { EndOfTilesIndex };
+        private readonly byte[] chunkHeader = new byte[ChunkHeaderSize]; // Reused by each chunk, as a single frame is sent at a time
+
+        // Send buffers of the sockets of the frames: that of the TCP receivers takes the usual compressed frame at once, and
+        // stays small enough that the larger frames still measure the link speed; that of the UDP senders takes the
+        // packets of a frame, which are sent back to back and would be dropped past the buffer
+        private const int SendBufferSize = 256 * 1024;
+        public const int UdpSendBufferSize = 1024 * 1024;
+
+        private const int NoVersion = -1;
+        private const int RequestBufferSize = 16;
+        private const double LinkSpeedWeight = 0.2; // Weight of the last frame in the moving average of the link throughput
+        private const double FrameTimeWeight = 0.1; // Weight of the last frame in the moving average of the frame time of the receiver
+        private const int NumTracedFrames = 32; // Frames sent whose report is awaited; the reports of older frames are ignored
+
+        // Requests not answered yet a receiver may hold; the receivers keep a window of two, and the requests of a receiver
+        // past the limit are dropped instead of growing the queue
+        private const int MaxPendingRequests = 8;
+
+        // Requests not answered yet, in the order they were received; the receivers parse the frames in that order
+        private Queue<byte> pendingRequests = new Queue<byte>();
+        private object requestLock = new object();
+
+        private int sentVersion = NoVersion;
+        private int deltaVersion = NoVersion; // Version of the voxels held by a delta receiver once it has read all the frames sent
+
+        // Geometry held by a split receiver once it has read all the frames sent, and the version of its colors
+        private int splitGeometryId = NoVersion;
+        private int splitColorVersion = NoVersion;
+
+        // Version of each tile held by a tiled receiver once it has read all the frames sent
+        private int[] tileVersions = NewTileVersions();
+        private volatile bool isSending = false;
+
+        // Stopwatch timestamp of the last change of the simulcast tier of the receiver
+        private long tierChangeTime = Stopwatch.GetTimestamp();
 
-        // Parameters used to find the scale
-        private const short MinScale = 400;
-        private const short MaxScale = (short)(1 / MinPrecision);
-        private const float ScaleFnOffset = 6700.0f;
-        private const float ScaleFnFactor = -500.0f;
-        private const float xRangeCenter = 0.0f;
-        private const float yRangeCenter = 0.0f;
-        private const float zRangeCenter = HalfRange;
+        // Moving average of the throughput of the link, in bytes per second; 0 until the first frame is sent
+        private double linkSpeed = 0.0;
 
-        public PointCloudTransferSocket(TcpClient clientSocket) : base(clientSocket) { }
+        // Stopwatch timestamps of the frames sent and not acknowledged yet. Past the initial window, each request
+        // acknowledges the oldest frame sent, once the receiver has read and rendered it.
+        private Queue<long> frameSendTimes = new Queue<long>();
+        private long lastAckTime = 0;
 
-        public void SendPointCloud(List<float> vertices, List<byte> colors)
+        // Moving average of the time the receiver takes to receive and render a frame, in seconds; 0 until measured
+        private double frameTime = 0.0;
+
+        // Called when the socket can send a new frame: a request was received or the previous frame was written
+        private Action onReady;
+
+        // Traces of the last frames sent to a receiver which traces the latency, and the times they started to be sent,
+        // by frame id modulo NumTracedFrames
+        private LatencyMonitor latencyMonitor;
+        private FrameTrace[] sentTraces = new FrameTrace[NumTracedFrames];
+        private long[] sentTraceTimes = new long[NumTracedFrames];
+
+        // Destination and request flags of the frames streamed over UDP; null for the receivers which use the TCP socket
+        private UdpClient udpSender;
+        private IPEndPoint udpEndPoint = null;
+        private byte udpRequest = 0;
+
+        public bool IsDeltaRequested { get; private set; } = false;
+        public bool IsOctreeRequested { get; private set; } = false;
+        public bool IsProgressiveRequested { get; private set; } = false;
+        public bool IsWideRequested { get; private set; } = false;
+        public bool IsSurfelRequested { get; private set; } = false;
+        public bool IsMeshRequested { get; private set; } = false;
+        public bool IsSplitRequested { get; private set; } = false;
+        public bool IsTiledRequested { get; private set; } = false;
+
+        // Whether the receiver gets the frames from the multicast group, and the request it joined it with
+        public bool IsMulticastRequested { get; private set; } = false;
+        public byte MulticastRequest { get; private set; } = 0;
+
+        // Last view pose sent by the receiver; null if it never sent one
+        public ViewPose ViewPose { get; private set; } = null;
+
+        // Whether the receiver traces the latency of its timestamped frames
+        public bool IsLatencyTraceRequested { get; private set; } = false;
+
+        // Measurements of the link, used by the rate control of the server; the UDP and multicast receivers send no
+        // acknowledgements
+        public double LinkSpeed => linkSpeed;
+        public double FrameTime => udpEndPoint == null && !IsMulticastRequested ? frameTime : 0.0;
+
+        // Simulcast tier of the frames sent to the receiver, 0 being the finest, and the tier the rate control moves it to,
+        // which it switches to at the first frame of that tier it can decode on its own
+        public int Tier { get; private set; } = 0;
+        public int TargetTier = 0;
+
+        public double SecondsSinceTierChange => (double)(Stopwatch.GetTimestamp() - tierChangeTime) / Stopwatch.Frequency;
+
+        public PointCloudTransferSocket(TcpClient clientSocket, UdpClient udpSender, LatencyMonitor latencyMonitor, Action onReady) : base(clientSocket)
         {
-            // Receive 1 byte to check that the receiver has requested a new frame
-            byte[] requestBuffer = Receive(1);
+            this.udpSender = udpSender;
+            this.latencyMonitor = latencyMonitor;
+            this.onReady = onReady;
+
+            // The requests are single bytes, which must not wait for more data to be sent, and the frames are written
+            // in a single send each, when they fit in the send buffer
+            SetSocketOptions(SendBufferSize);
 
-            while (requestBuffer.Length != 0)
+            Task.Run(() => ReceiveRequests());
+        }
+
+        /// <summary>
+        /// Moves the receiver to its target tier if the latest frame of that tier needs no frame of its current tier: any
+        /// full or mesh frame, a delta frame which refreshes all the colors, or a split frame with a new geometry
+        /// </summary>
+        /// <param name="targetFrame">Latest frame of the target tier; null if it was not encoded</param>
+        public void UpdateTier(EncodedPointCloud targetFrame)
+        {
+            if (TargetTier == Tier || targetFrame == null)
+                return;
+
+            if (IsDeltaRequested && (targetFrame.State == null || !targetFrame.State.IsKeyframe))
+                return;
+
+            if (IsSplitRequested && (targetFrame.Split == null || targetFrame.Split.GeometryId != targetFrame.Version))
+                return;
+
+            SetTier(TargetTier);
+        }
+
+        /// <summary>
+        /// Moves the receiver to a tier at once. The versions of the tiers do not hold the same voxels, so the delta and
+        /// split receivers get a keyframe of their new tier, and the tiled receivers all the tiles of their new tier.
+        /// </summary>
+        public void SetTier(int tier)
+        {
+            Tier = tier;
+            TargetTier = tier;
+            tierChangeTime = Stopwatch.GetTimestamp();
+            deltaVersion = NoVersion;
+            splitGeometryId = NoVersion;
+            tileVersions = NewTileVersions();
+        }
+
+        /// <summary>
+        /// Checks whether a frame would be sent to the receiver, so that a frame is only culled for its view when needed
+        /// </summary>
+        /// <param name="version">Version of the latest frame</param>
+        public bool IsWaitingForFrame(int version)
+        {
+            if (isSending || version == sentVersion || IsMulticastRequested)
+                return false;
+
+            if (udpEndPoint != null)
+                return true;
+
+            lock (requestLock)
+                return pendingRequests.Count > 0;
+        }
+
+        /// <summary>
+        /// Starts sending a frame if the receiver has credit for one and does not have it yet. The frame is written
+        /// asynchronously, so a slow receiver never delays the others; it gets the latest frame once it is done.
+        /// </summary>
+        /// <param name="frame">Latest encoded frame, shared by all the receivers, on which the socket takes a reference
+        /// while it sends it</param>
+        public void SendPointCloud(EncodedPointCloud frame)
+        {
+            // The multicast receivers get the frames sent to their group
+            if (isSending || frame == null || frame.Version == sentVersion || IsMulticastRequested)
+                return;
+
+            if (udpEndPoint != null)
             {
-                if (requestBuffer[0] == 0)
-                {
-                    // Determine the scale (resolution) dynamically based on the number of points
-                    int originalVertexCount = vertices.Count / 3;
-                    short scale = DetermineScale(originalVertexCount);
+                StreamPointCloud(frame);
+                return;
+            }
 
-                    // Filter out points which map to the same reduced location once the scale reduction is applied
-                    HashSet<(byte, byte, byte)> uniquePoints = new HashSet<(byte, byte, byte)>();
-                    List<byte> filteredVertices = new List<byte>();
-                    List<byte> filteredColors = new List<byte>();
+            byte request;
 
-                    for (int i = 0; i < vertices.Count; i += 3)
-                    {
-                        float x = vertices[i];
-                        float y = vertices[i + 1];
-                        float z = vertices[i + 2];
-
-                        // Filter out points which do not fit in the range of values allowed in one byte
-                        if (Math.Abs(x - xRangeCenter) > HalfRange || Math.Abs(xRangeCenter - x) > HalfRange
-                            || Math.Abs(y - yRangeCenter) > HalfRange || Math.Abs(yRangeCenter - y) > HalfRange
-                            || Math.Abs(z - zRangeCenter) > HalfRange || Math.Abs(zRangeCenter - z) > HalfRange)
-                        {
-                            continue;
-                        }
+            lock (requestLock)
+            {
+                if (pendingRequests.Count == 0)
+                    return;
 
-                        // Encode each float position to a byte, using the scale to reduce the resolution
-                        byte bx = EncodeFloatToByte(x, xRangeCenter, scale);
-                        byte by = EncodeFloatToByte(y, yRangeCenter, scale);
-                        byte bz = EncodeFloatToByte(z, zRangeCenter, scale);
+                request = pendingRequests.Peek();
+            }
 
-                        var point = (bx, by, bz);
+            bool isCompressionSupported = (request & CompressionRequestFlag) != 0;
+            bool isOctreeSupported = (request & OctreeRequestFlag) != 0;
+            bool isProgressiveSupported = (request & ProgressiveRequestFlag) != 0;
+            bool isWideSupported = (request & WideRequestFlag) != 0;
+            bool isSurfelSupported = IsSurfelRequest(request);
+            bool isTiledSupported = IsTiledRequest(request);
+            bool isSplitSupported = !isTiledSupported && IsSplitRequest(request);
+            bool isTimestampRequested = (request & TimestampRequestFlag) != 0;
+            request &= unchecked((byte)~RequestFlags);
 
-                        // If no other point mapped to this reduced position yet, add the point to the filtered result
-                        if (uniquePoints.Add(point))
-                        {
-                            filteredVertices.Add(bx);
-                            filteredVertices.Add(by);
-                            filteredVertices.Add(bz);
-
-                            // Copy corresponding RGB color
-                            int colorIndex = i;
-                            filteredColors.Add(colors[colorIndex]);
-                            filteredColors.Add(colors[colorIndex + 1]);
-                            filteredColors.Add(colors[colorIndex + 2]);
-                        }
-                    }
+            ArraySegment<byte> response = default(ArraySegment<byte>);
 
-                    int numVerticesToSend = filteredVertices.Count / 3;
-                    byte[] buffer = new byte[sizeof(byte) * filteredVertices.Count];
-                    Buffer.BlockCopy(filteredVertices.ToArray(), 0, buffer, 0, buffer.Length);
+            if (request == FullFrameRequest && isTiledSupported)
+            {
+                // The frame was encoded before the receiver requested tiled frames; wait for the next one
+                if (frame.Tiled == null)
+                    return;
 
-                    try
-                    {
-                        // Send the scale first
-                        byte[] scaleBytes = BitConverter.GetBytes(scale);
-                        socket.GetStream().Write(scaleBytes, 0, scaleBytes.Length);
+                deltaVersion = NoVersion;
+            }
+            else if (request == FullFrameRequest && isSplitSupported)
+            {
+                // The frame was encoded before the receiver requested split frames; wait for the next one
+                response = frame.GetSplitResponse(splitGeometryId, splitColorVersion);
 
-                        // Send number of vertices
-                        WriteInt(numVerticesToSend);
+                if (response.Array == null)
+                    return;
 
-                        // Send vertices and colors
-                        socket.GetStream().Write(buffer, 0, buffer.Length);
-                        socket.GetStream().Write(filteredColors.ToArray(), 0, filteredColors.Count);
-                    }
-                    catch (Exception ex)
+                deltaVersion = NoVersion;
+                splitGeometryId = frame.Split.GeometryId;
+                splitColorVersion = frame.Split.ColorVersion;
+            }
+            else if (request == MeshFrameRequest)
+            {
+                // The frame was encoded before the receiver requested meshes; wait for the next one
+                response = frame.MeshFrame;
+
+                if (response.Array == null)
+                    return;
+
+                deltaVersion = NoVersion;
+            }
+            else if (request == FullFrameRequest && isSurfelSupported)
+            {
+                // The frame was encoded before the receiver requested surfels; wait for the next one
+                response = frame.SurfelFrame;
+
+                if (response.Array == null)
+                    return;
+
+                deltaVersion = NoVersion;
+            }
+            else if (request == FullFrameRequest && isWideSupported)
+            {
+                // The frame was encoded before the receiver requested wide frames; wait for the next one
+                response = frame.WideFrame;
+
+                if (response.Array == null)
+                    return;
+
+                deltaVersion = NoVersion;
+            }
+            else if (request == FullFrameRequest && isProgressiveSupported)
+            {
+                // The frame was encoded before the receiver requested progressive frames; wait for the next one
+                if (frame.Progressive == null)
+                    return;
+
+                deltaVersion = NoVersion;
+            }
+            else if (request == FullFrameRequest)
+            {
+                // The frame was encoded before the receiver requested octrees; wait for the next one
+                response = isOctreeSupported ? frame.OctreeFrame : frame.FullFrame;
+
+                if (response.Array == null)
+                    return;
+
+                deltaVersion = NoVersion;
+            }
+            else
+            {
+                // The frame was encoded before the receiver requested deltas; wait for the next one
+                response = frame.GetDeltaResponse(deltaVersion);
+
+                if (response.Array == null)
+                    return;
+
+                deltaVersion = frame.Version;
+            }
+
+            if (request != FullFrameRequest || !isSplitSupported)
+                splitGeometryId = NoVersion;
+
+            if (request != FullFrameRequest || !isTiledSupported)
+                tileVersions = NewTileVersions();
+
+            lock (requestLock)
+            {
+                pendingRequests.Dequeue();
+                frameSendTimes.Enqueue(Stopwatch.GetTimestamp());
+            }
+
+            sentVersion = frame.Version;
+            isSending = true;
+            frame.AddReference();
+
+            if (request == FullFrameRequest && isTiledSupported)
+                Task.Run(() => WriteTiledResponse(frame, isCompressionSupported, isTimestampRequested));
+            else if (response.Array == null)
+                Task.Run(() => WriteProgressiveResponse(frame, isCompressionSupported, isTimestampRequested));
+            else
+                Task.Run(() => WriteResponse(frame, response, isCompressionSupported, isTimestampRequested));
+        }
+
+        /// <summary>
+        /// Sends a full frame over UDP. Frames are never retransmitted: the receiver skips the frames it cannot recover,
+        /// and the frames encoded while one is being sent are skipped as well.
+        /// </summary>
+        private void StreamPointCloud(EncodedPointCloud frame)
+        {
+            ArraySegment<byte> response = GetFullFrame(frame, udpRequest);
+
+            // The frame was encoded before the receiver requested octrees or wide frames; wait for the next one
+            if (response.Array == null)
+                return;
+
+            sentVersion = frame.Version;
+            isSending = true;
+            frame.AddReference();
+
+            IPEndPoint endPoint = udpEndPoint;
+
+            Task.Run(async () =>
+            {
+                try
+                {
+                    ArraySegment<byte> payload = response;
+
+                    if ((udpRequest & CompressionRequestFlag) != 0)
+                        payload = frame.GetCompressedResponse(response, PayloadCompression.SelectLevel(0.0));
+
+                    if ((udpRequest & TimestampRequestFlag) != 0)
                     {
+                        payload = frame.GetTimestampedResponse(payload, IsLatencyTraceRequested);
+                        TraceFrame(frame);
                     }
+
+                    foreach (byte[] packet in frame.GetPackets(payload))
+                        await udpSender.SendAsync(packet, FramePacketizer.PacketSize, endPoint);
+                }
+                catch (Exception)
+                {
+                    // Lost frames are skipped by the receiver
+                }
+
+                frame.Release();
+                isSending = false;
+                onReady();
+            });
+        }
+
+        /// <summary>
+        /// Returns the full frame coded as set by the flags of a request
+        /// </summary>
+        /// <returns>The frame; no array if it was encoded before that coding was requested</returns>
+        public static ArraySegment<byte> GetFullFrame(EncodedPointCloud frame, byte request)
+        {
+            if (IsSurfelRequest(request))
+                return frame.SurfelFrame;
+
+            if ((request & WideRequestFlag) != 0)
+                return frame.WideFrame;
+
+            return (request & OctreeRequestFlag) != 0 ? frame.OctreeFrame : frame.FullFrame;
+        }
+
+        private static bool IsSurfelRequest(byte request)
+        {
+            return (request & SurfelRequestFlags) == SurfelRequestFlags;
+        }
+
+        private static bool IsSplitRequest(byte request)
+        {
+            return (request & SplitRequestFlags) == SplitRequestFlags;
+        }
+
+        private static bool IsTiledRequest(byte request)
+        {
+            return (request & TiledRequestFlags) == TiledRequestFlags;
+        }
+
+        private static int[] NewTileVersions()
+        {
+            int[] versions = new int[EncodedPointCloud.TiledFrame.NumTiles];
+
+            for (int i = 0; i < versions.Length; i++)
+                versions[i] = NoVersion;
+
+            return versions;
+        }
+
+        /// <summary>
+        /// Sets the codings of the full frames the receiver gets from the flags of its request; the tiled frames take
+        /// precedence over the other codings, then the split frames
+        /// </summary>
+        private void SetFullFrameRequest(byte request)
+        {
+            IsTiledRequested = IsTiledRequest(request);
+            IsSplitRequested = !IsTiledRequested && IsSplitRequest(request);
+            IsSurfelRequested = !IsTiledRequested && !IsSplitRequested && IsSurfelRequest(request);
+            IsOctreeRequested = !IsTiledRequested && !IsSplitRequested && !IsSurfelRequested && (request & OctreeRequestFlag) != 0;
+            IsWideRequested = !IsTiledRequested && !IsSplitRequested && !IsSurfelRequested && (request & WideRequestFlag) != 0;
+        }
+
+        private async Task WriteResponse(EncodedPointCloud frame, ArraySegment<byte> response, bool isCompressionSupported, bool isTimestampRequested)
+        {
+            try
+            {
+                if (isCompressionSupported)
+                    response = frame.GetCompressedResponse(response, PayloadCompression.SelectLevel(linkSpeed));
+
+                long startTimestamp = Stopwatch.GetTimestamp();
+                BeginMessage();
+
+                if (isTimestampRequested)
+                    QueueTimestampHeader(frame);
+
+                QueueWrite(response.Array, response.Offset, response.Count);
+                await FlushAsync();
+
+                UpdateLinkSpeed(response.Count, GetElapsedSeconds(startTimestamp));
+            }
+            catch (Exception)
+            {
+                // The receiver state is unknown after a failed send; start again from a keyframe
+                deltaVersion = NoVersion;
+                splitGeometryId = NoVersion;
+            }
+
+            frame.Release();
+            isSending = false;
+            onReady();
+        }
+
+        /// <summary>
+        /// Writes a progressive frame: the header, the coarse chunk, then the refinement chunks as long as the deadline
+        /// of the frame is not reached. Each chunk is the depth (byte), the size of the body (int) and the body, which
+        /// is compressed on its own so that the receiver can render it as soon as it arrives. Each chunk is sent with
+        /// its header in one send, the first one with the header of the frame and the last one with its end.
+        /// </summary>
+        private async Task WriteProgressiveResponse(EncodedPointCloud frame, bool isCompressionSupported, bool isTimestampRequested)
+        {
+            EncodedPointCloud.ProgressiveFrame progressive = frame.Progressive;
+
+            try
+            {
+                long startTimestamp = Stopwatch.GetTimestamp();
+                int numBytesWritten = progressive.Header.Count;
+                BeginMessage();
+
+                // The refinements have the capture time of the coarse chunk
+                if (isTimestampRequested)
+                    QueueTimestampHeader(frame);
+
+                QueueWrite(progressive.Header.Array, progressive.Header.Offset, progressive.Header.Count);
+                int numChunks = progressive.Chunks.Length;
+
+                for (int i = 0; i < numChunks; i++)
+                {
+                    // The coarse chunk is always sent, so the receiver has something to render
+                    if (i > 0 && Stopwatch.GetTimestamp() > progressive.Deadline)
+                        break;
+
+                    ArraySegment<byte> chunk = progressive.Chunks[i];
+
+                    if (isCompressionSupported)
+                        chunk = frame.GetCompressedResponse(chunk, PayloadCompression.SelectLevel(linkSpeed));
+
+                    // The size is little endian, as BitConverter writes it on the receivers
+                    chunkHeader[0] = progressive.Depths[i];
+                    chunkHeader[1] = (byte)chunk.Count;
+                    chunkHeader[2] = (byte)(chunk.Count >> 8);
+                    chunkHeader[3] = (byte)(chunk.Count >> 16);
+                    chunkHeader[4] = (byte)(chunk.Count >> 24);
+
+                    QueueWrite(chunkHeader, 0, chunkHeader.Length);
+                    QueueWrite(chunk.Array, chunk.Offset, chunk.Count);
+                    numBytesWritten += chunkHeader.Length + chunk.Count;
+
+                    if (i < numChunks - 1)
+                        await FlushAsync();
+                }
+
+                QueueWrite(s_endOfFrame, 0, 1);
+                await FlushAsync();
+
+                UpdateLinkSpeed(numBytesWritten, GetElapsedSeconds(startTimestamp));
+            }
+            catch (Exception)
+            {
+                // The receiver is disconnected; it is removed by the connection check of the server
+            }
+
+            frame.Release();
+            isSending = false;
+            onReady();
+        }
+
+        /// <summary>
+        /// Writes a tiled frame: the header, then each tile the receiver does not hold, as the index of the tile (byte),
+        /// the size of its body (int) and the body, a full frame of the points of the tile, which is compressed on its
+        /// own so that the receiver can render it as soon as it arrives. The tiles in the view of the receiver are all
+        /// sent; those out of it are sent until the deadline of the frame, and the others with the next frames. As with the
+        /// progressive frames, each tile is sent with its header in one send.
+        /// </summary>
+        private async Task WriteTiledResponse(EncodedPointCloud frame, bool isCompressionSupported, bool isTimestampRequested)
+        {
+            EncodedPointCloud.TiledFrame tiled = frame.Tiled;
+            int[] versions = tileVersions;
+            List<int> changedTiles = tiled.GetChangedTiles(versions, ViewPose, out int numVisible);
+
+            try
+            {
+                long startTimestamp = Stopwatch.GetTimestamp();
+                int numBytesWritten = tiled.Header.Length;
+                BeginMessage();
+
+                if (isTimestampRequested)
+                    QueueTimestampHeader(frame);
+
+                // The receiver drops the tiles left out of the mask of the header
+                QueueWrite(tiled.Header, 0, tiled.Header.Length);
+
+                for (int tile = 0; tile < versions.Length; tile++)
+                {
+                    if (tiled.Tiles[tile] == null)
+                        versions[tile] = NoVersion;
+                }
+
+                for (int i = 0; i < changedTiles.Count; i++)
+                {
+                    if (i >= numVisible && Stopwatch.GetTimestamp() > tiled.Deadline)
+                        break;
+
+                    EncodedPointCloud.Tile tile = tiled.Tiles[changedTiles[i]];
+                    ArraySegment<byte> body = new ArraySegment<byte>(tile.Frame);
+
+                    if (isCompressionSupported)
+                        body = frame.GetCompressedResponse(body, PayloadCompression.SelectLevel(linkSpeed));
+
+                    // The size is little endian, as BitConverter writes it on the receivers
+                    chunkHeader[0] = (byte)changedTiles[i];
+                    chunkHeader[1] = (byte)body.Count;
+                    chunkHeader[2] = (byte)(body.Count >> 8);
+                    chunkHeader[3] = (byte)(body.Count >> 16);
+                    chunkHeader[4] = (byte)(body.Count >> 24);
+
+                    QueueWrite(chunkHeader, 0, chunkHeader.Length);
+                    QueueWrite(body.Array, body.Offset, body.Count);
+                    numBytesWritten += chunkHeader.Length + body.Count;
+                    versions[changedTiles[i]] = tile.Version;
+
+                    if (i < changedTiles.Count - 1)
+                        await FlushAsync();
                 }
 
-                // Receive a new request byte to make sure the receiver is ready to receive
-                requestBuffer = Receive(1);
+                QueueWrite(s_endOfTiles, 0, 1);
+                await FlushAsync();
+
+                UpdateLinkSpeed(numBytesWritten, GetElapsedSeconds(startTimestamp));
+            }
+            catch (Exception)
+            {
+                // The receiver state is unknown after a failed send; start again from all the tiles
+                tileVersions = NewTileVersions();
+            }
+
+            frame.Release();
+            isSending = false;
+            onReady();
+        }
+
+        private void QueueTimestampHeader(EncodedPointCloud frame)
+        {
+            byte[] header = IsLatencyTraceRequested ? frame.TracedTimestampHeader : frame.TimestampHeader;
+
+            TraceFrame(frame);
+            QueueWrite(header, 0, header.Length);
+        }
+
+        /// <summary>
+        /// Keeps the trace of a frame which starts to be sent to a receiver which traces the latency, until it reports it
+        /// </summary>
+        private void TraceFrame(EncodedPointCloud frame)
+        {
+            if (!IsLatencyTraceRequested)
+                return;
+
+            int index = frame.Trace.FrameId % NumTracedFrames;
+
+            lock (sentTraces)
+            {
+                sentTraces[index] = frame.Trace;
+                sentTraceTimes[index] = FrameTrace.GetTimeUs();
             }
         }
 
-        // Determine scale based on number of vertices
-        private short DetermineScale(int vertexCount)
+        /// <summary>
+        /// Adds the report of a frame displayed by the receiver to the latency monitor, if the frame is still traced
+        /// </summary>
+        private void AddLatencyReport(LatencyReport report)
         {
-            if (vertexCount <= 0) return MaxScale;
-            short scale = (short)Math.Truncate(ScaleFnOffset + ScaleFnFactor * Math.Log(vertexCount));
-            return Math.Min(MaxScale, Math.Max(scale, MinScale)); // Clamp between min and max acceptable scales
+            long reportTime = FrameTrace.GetTimeUs();
+            int index = (report.FrameId & int.MaxValue) % NumTracedFrames;
+            FrameTrace trace;
+            long sendTime;
+
+            lock (sentTraces)
+            {
+                trace = sentTraces[index];
+                sendTime = sentTraceTimes[index];
+            }
+
+            if (trace != null && trace.FrameId == report.FrameId)
+                latencyMonitor.AddReport(trace, sendTime, reportTime, report);
         }
 
-        private byte EncodeFloatToByte(float value, float rangeCenter, float scale)
+        /// <summary>
+        /// Updates the throughput of the link with a frame written to the socket. The write returns once the data is in
+        /// the send buffer, so the speed is only measured when the frame is large enough to fill it.
+        /// </summary>
+        private void UpdateLinkSpeed(int numBytes, double seconds)
         {
-            float result = (value + HalfRange - rangeCenter) * scale; // Use the computed scale to reduce the resolution
-            return (byte)Math.Min(255, Math.Max(result, 0)); // Clamp between 0 and 255 to make sure it fits in a byte
+            if (numBytes > socket.SendBufferSize && seconds > 0.0)
+            {
+                double speed = numBytes / seconds;
+                linkSpeed = linkSpeed == 0.0 ? speed : linkSpeed + LinkSpeedWeight * (speed - linkSpeed);
+            }
+        }
+
+        private static double GetElapsedSeconds(long startTimestamp)
+        {
+            return (double)(Stopwatch.GetTimestamp() - startTimestamp) / Stopwatch.Frequency;
+        }
+
+        /// <summary>
+        /// Updates the frame time of the receiver with the acknowledgement of a frame. The receiver starts on a frame
+        /// once it is sent and the previous one is acknowledged, so the time the frame waited behind the previous one
+        /// is not counted.
+        /// </summary>
+        /// <param name="sendTime">Stopwatch timestamp at which the acknowledged frame was sent</param>
+        private void UpdateFrameTime(long sendTime)
+        {
+            long now = Stopwatch.GetTimestamp();
+            double seconds = (double)(now - Math.Max(sendTime, lastAckTime)) / Stopwatch.Frequency;
+
+            frameTime = frameTime == 0.0 ? seconds : frameTime + FrameTimeWeight * (seconds - frameTime);
+            lastAckTime = now;
+        }
+
+        /// <summary>
+        /// Reads the requests of the receiver until it disconnects
+        /// </summary>
+        private async Task ReceiveRequests()
+        {
+            byte[] buffer = new byte[RequestBufferSize];
+
+            // Bytes following a UDP stream, view pose or latency report request; they may be split between two reads
+            byte payloadRequest = 0;
+            byte[] payload = null;
+            int payloadLength = 0;
+
+            try
+            {
+                while (true)
+                {
+                    int numBytesRead = await socket.GetStream().ReadAsync(buffer, 0, buffer.Length);
+
+                    if (numBytesRead == 0)
+                        break;
+
+                    lock (requestLock)
+                    {
+                        for (int i = 0; i < numBytesRead; i++)
+                        {
+                            if (payload != null)
+                            {
+                                payload[payloadLength++] = buffer[i];
+
+                                if (payloadLength == payload.Length)
+                                {
+                                    if (payloadRequest == UdpStreamRequest)
+                                        udpEndPoint = new IPEndPoint(((IPEndPoint)socket.Client.RemoteEndPoint).Address, BitConverter.ToUInt16(payload, 0));
+                                    else if (payloadRequest == LatencyReportRequest)
+                                        AddLatencyReport(new LatencyReport(payload));
+                                    else
+                                        ViewPose = new ViewPose(payload);
+
+                                    payload = null;
+                                }
+
+                                continue;
+                            }
+
+                            byte request = (byte)(buffer[i] & ~RequestFlags);
+
+                            if (request == UdpStreamRequest)
+                            {
+                                udpRequest = buffer[i];
+                                IsDeltaRequested = false;
+                                SetFullFrameRequest(buffer[i]);
+                                IsProgressiveRequested = false;
+                                IsMeshRequested = false;
+                                IsSplitRequested = false; // The split frames refer to the frames before them, which the datagrams may lose
+                                IsTiledRequested = false; // And so do the tiles which did not change
+                            }
+
+                            if (request == MulticastStreamRequest)
+                            {
+                                MulticastRequest = buffer[i];
+                                IsMulticastRequested = true;
+                                IsDeltaRequested = false;
+                                SetFullFrameRequest(buffer[i]);
+                                IsProgressiveRequested = false;
+                                IsMeshRequested = false;
+                                IsSplitRequested = false;
+                                IsTiledRequested = false;
+                                continue;
+                            }
+
+                            if (request == LatencyTraceRequest)
+                            {
+                                IsLatencyTraceRequested = true;
+                                continue;
+                            }
+
+                            if (request == UdpStreamRequest || request == ViewPoseRequest || request == LatencyReportRequest)
+                            {
+                                payloadRequest = request;
+                                payload = new byte[request == UdpStreamRequest ? sizeof(ushort) : request == LatencyReportRequest ? LatencyReport.Size : ViewPose.Size];
+                                payloadLength = 0;
+                                continue;
+                            }
+
+                            if (request == FullFrameRequest || request == DeltaFrameRequest || request == MeshFrameRequest)
+                            {
+                                if (pendingRequests.Count >= MaxPendingRequests)
+                                    continue;
+
+                                if (frameSendTimes.Count > 0)
+                                    UpdateFrameTime(frameSendTimes.Dequeue());
+
+                                pendingRequests.Enqueue(buffer[i]);
+                                IsDeltaRequested = request == DeltaFrameRequest;
+                                SetFullFrameRequest(request == FullFrameRequest ? buffer[i] : (byte)0);
+                                IsProgressiveRequested = request == FullFrameRequest && !IsSplitRequested && !IsTiledRequested
+                                    && (buffer[i] & ProgressiveRequestFlag) != 0;
+                                IsMeshRequested = request == MeshFrameRequest;
+                            }
+                        }
+                    }
+
+                    onReady();
+                }
+            }
+            catch (Exception)
+            {
+                // The socket was closed; it is removed by the connection check of the server
+            }
         }
     }
-}
\ No newline at end of file
+}
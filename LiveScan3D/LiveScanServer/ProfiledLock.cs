@@ -0,0 +1,145 @@
+﻿/***************************************************************************\
+
+Module Name:  ProfiledLock.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module holds the locks of the server which are taken in the frame path,
+which count how many times they were taken, how many of these had to wait for
+another thread, and how long they were waited for and held. The status bar
+shows the counters of each lock over the last two seconds, so that the locks
+which stall the frame path can be told from those which are only taken often.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Text;
+using System.Threading;
+
+namespace LiveScanServer
+{
+    /// <summary>
+    /// Monitor lock with contention counters, taken with <c>using (profiledLock.Enter())</c> instead of a lock statement
+    /// </summary>
+    public sealed class ProfiledLock
+    {
+        // Every lock created, for the status bar; the locks of the same name, such as those of replaced objects, are
+        // added together
+        private static readonly List<ProfiledLock> s_locks = new List<ProfiledLock>();
+
+        private readonly object syncRoot = new object();
+        private long numAcquisitions = 0;
+        private long numContentions = 0;
+        private long waitTicks = 0;
+        private long holdTicks = 0;
+
+        public string Name { get; }
+
+        public ProfiledLock(string name)
+        {
+            Name = name;
+
+            lock (s_locks)
+            {
+                s_locks.Add(this);
+            }
+        }
+
+        /// <summary>
+        /// Takes the lock, waiting for it when another thread holds it; the returned scope releases it when disposed. The
+        /// lock is reentrant, and the nested scopes count their hold time too.
+        /// </summary>
+        public Scope Enter()
+        {
+            long startTicks = Stopwatch.GetTimestamp();
+            bool isContended = !Monitor.TryEnter(syncRoot);
+
+            if (isContended)
+                Monitor.Enter(syncRoot);
+
+            long acquiredTicks = Stopwatch.GetTimestamp();
+            Interlocked.Increment(ref numAcquisitions);
+
+            if (isContended)
+            {
+                Interlocked.Increment(ref numContentions);
+                Interlocked.Add(ref waitTicks, acquiredTicks - startTicks);
+            }
+
+            return new Scope(this, acquiredTicks);
+        }
+
+        /// <summary>
+        /// Counters of every lock taken since the last call, as "name taken/waited for/wait ms/hold ms" separated by
+        /// commas, or an empty string when no lock was taken
+        /// </summary>
+        public static string TakeSummary()
+        {
+            // The counters are added by name, in the order the locks were created
+            List<string> names = new List<string>();
+            Dictionary<string, long[]> counters = new Dictionary<string, long[]>();
+
+            lock (s_locks)
+            {
+                foreach (ProfiledLock profiledLock in s_locks)
+                {
+                    if (!counters.TryGetValue(profiledLock.Name, out long[] sums))
+                    {
+                        sums = new long[4];
+                        counters.Add(profiledLock.Name, sums);
+                        names.Add(profiledLock.Name);
+                    }
+
+                    sums[0] += Interlocked.Exchange(ref profiledLock.numAcquisitions, 0);
+                    sums[1] += Interlocked.Exchange(ref profiledLock.numContentions, 0);
+                    sums[2] += Interlocked.Exchange(ref profiledLock.waitTicks, 0);
+                    sums[3] += Interlocked.Exchange(ref profiledLock.holdTicks, 0);
+                }
+            }
+
+            StringBuilder summary = new StringBuilder();
+
+            foreach (string name in names)
+            {
+                long[] sums = counters[name];
+
+                if (sums[0] == 0)
+                    continue;
+
+                if (summary.Length > 0)
+                    summary.Append(", ");
+
+                summary.Append(name).Append(' ').Append(sums[0]).Append('/').Append(sums[1])
+                    .Append('/').Append((sums[2] * 1000.0 / Stopwatch.Frequency).ToString("0.0"))
+                    .Append('/').Append((sums[3] * 1000.0 / Stopwatch.Frequency).ToString("0.0"));
+            }
+
+            return summary.ToString();
+        }
+
+        /// <summary>
+        /// Hold of a <see cref="ProfiledLock"/>, which releases it when disposed
+        /// </summary>
+        public struct Scope : IDisposable
+        {
+            private readonly ProfiledLock owner;
+            private readonly long acquiredTicks;
+
+            internal Scope(ProfiledLock owner, long acquiredTicks)
+            {
+                this.owner = owner;
+                this.acquiredTicks = acquiredTicks;
+            }
+
+            public void Dispose()
+            {
+                Interlocked.Add(ref owner.holdTicks, Stopwatch.GetTimestamp() - acquiredTicks);
+                Monitor.Exit(owner.syncRoot);
+            }
+        }
+    }
+}
@@ -7,7 +7,15 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module is the main entry point of the application. It launches the
-main UI form.
+main UI form. Started with -replay followed by raw recordings, the server
+replays them instead of the connected cameras, at the recorded speed, or as
+fast as they are processed with -maxspeed. Started with -node followed by
+capture nodes, as host or host:port, the server also controls the cameras
+the nodes host on other computers. Started with -isolate, the server runs
+each of its cameras in a worker process, so that one which crashes or hangs
+is restarted without affecting the others. Started with -headless, optionally
+followed by a settings file, the server streams without its UI and is
+controlled through a local socket, whose port -control sets.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -17,6 +25,7 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 \***************************************************************************/
 
 using System;
+using System.Collections.Generic;
 using System.Windows.Forms;
 
 namespace LiveScanServer
@@ -27,11 +36,59 @@ namespace LiveScanServer
         /// Main entry point for the application
         /// </summary>
         [STAThread]
-        static void Main()
+        static void Main(string[] args)
         {
+            List<string> replayPaths = new List<string>();
+            List<string> nodes = new List<string>();
+            bool isReplayRealTime = true;
+            bool isIsolated = false;
+            bool isHeadless = false;
+            string settingsPath = CameraSettings.DefaultPath;
+            int controlPort = HeadlessServer.DefaultControlPort;
+
+            for (int i = 0; i < args.Length; i++)
+            {
+                if (args[i] == "-maxspeed")
+                {
+                    isReplayRealTime = false;
+                }
+                else if (args[i] == "-isolate")
+                {
+                    isIsolated = true;
+                }
+                else if (args[i] == "-replay")
+                {
+                    while (i + 1 < args.Length && !args[i + 1].StartsWith("-"))
+                        replayPaths.Add(args[++i]);
+                }
+                else if (args[i] == "-node")
+                {
+                    while (i + 1 < args.Length && !args[i + 1].StartsWith("-"))
+                        nodes.Add(args[++i]);
+                }
+                else if (args[i] == "-headless")
+                {
+                    isHeadless = true;
+
+                    if (i + 1 < args.Length && !args[i + 1].StartsWith("-"))
+                        settingsPath = args[++i];
+                }
+                else if (args[i] == "-control" && i + 1 < args.Length)
+                {
+                    int.TryParse(args[++i], out controlPort);
+                }
+            }
+
+            // Without a message pump, the thread only waits for the stop command of the control socket
+            if (isHeadless)
+            {
+                new HeadlessServer(settingsPath, controlPort).Run(replayPaths.ToArray(), isReplayRealTime, nodes.ToArray(), isIsolated);
+                return;
+            }
+
             Application.EnableVisualStyles();
             Application.SetCompatibleTextRenderingDefault(false);
-            Application.Run(new MainWindowForm());
+            Application.Run(new MainWindowForm(replayPaths.ToArray(), isReplayRealTime, nodes.ToArray(), isIsolated));
         }
     }
 }
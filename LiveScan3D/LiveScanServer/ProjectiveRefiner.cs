@@ -0,0 +1,132 @@
+﻿/***************************************************************************\
+
+Module Name:  ProjectiveRefiner.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module refines the poses of the cameras from their depth frames, with
+the projective ICP of the ICP library: the points of each camera are matched
+to the pixels they project to in the depth frames of the other cameras, and
+the poses of all the cameras are solved at once, the first camera being the
+reference. The refinement only finds the corrections of the poses; they are
+applied to the calibration by the camera server.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.Runtime.InteropServices;
+
+namespace LiveScanServer
+{
+    /// <summary>
+    /// Corrections of the poses of the cameras, which move their world space points as (p + T) * R
+    /// </summary>
+    public sealed class PoseCorrections
+    {
+        public List<float[]> Rs = new List<float[]>(); // 3x3 row-major
+        public List<float[]> Ts = new List<float[]>();
+        public float Error = 0; // Mean point to plane distance of the matches, in meters
+        public int NumIterations = 0;
+
+        /// <summary>
+        /// Angle of the rotation correction of a camera, in degrees
+        /// </summary>
+        public float GetRotationAngle(int camera)
+        {
+            float[] R = Rs[camera];
+            double cosAngle = Math.Max(-1.0, Math.Min(1.0, (R[0] + R[4] + R[8] - 1.0) / 2.0));
+
+            return (float)(Math.Acos(cosAngle) * 180.0 / Math.PI);
+        }
+
+        /// <summary>
+        /// Length of the translation correction of a camera, in meters
+        /// </summary>
+        public float GetTranslationLength(int camera)
+        {
+            float[] T = Ts[camera];
+
+            return (float)Math.Sqrt(T[0] * T[0] + T[1] * T[1] + T[2] * T[2]);
+        }
+    }
+
+    public sealed class ProjectiveRefiner
+    {
+        [DllImport("ICP.dll")]
+        private static extern float RefineAllPosesProjective(ushort[] depths, int[] widths, int[] heights, float[] intrinsics, float[] depthToWorld,
+            int numCameras, float[] Rs, float[] ts, int maxIter, int sampleStep, float maxDistance, out int numIterations);
+
+        private const int DepthFrameTimeoutMs = 1000;
+
+        // Depth frame of each camera, reused by the next refinements
+        private readonly List<CameraClient.DepthFrame> depthFrames = new List<CameraClient.DepthFrame>();
+
+        /// <summary>
+        /// Finds the corrections of the poses of the cameras from their next depth frames
+        /// </summary>
+        /// <param name="maxIter">Maximum number of iterations</param>
+        /// <param name="sampleStep">Matches one pixel of each camera out of sampleStep in both directions</param>
+        /// <param name="maxDistance">Matches farther apart than this are rejected, in meters</param>
+        /// <returns>The corrections, in the order of the clients; null if the depth frame of a camera was not received</returns>
+        public PoseCorrections Refine(CameraServer cameraServer, int maxIter, int sampleStep, float maxDistance)
+        {
+            if (!cameraServer.GetDepthFrames(depthFrames, DepthFrameTimeoutMs))
+                return null;
+
+            // The frames of all the cameras are passed at once, one camera after the other
+            int numCameras = depthFrames.Count;
+            int[] widths = new int[numCameras];
+            int[] heights = new int[numCameras];
+            float[] intrinsics = new float[4 * numCameras];
+            float[] depthToWorld = new float[12 * numCameras];
+            int numPixels = 0;
+
+            for (int i = 0; i < numCameras; i++)
+            {
+                widths[i] = depthFrames[i].Width;
+                heights[i] = depthFrames[i].Height;
+                Array.Copy(depthFrames[i].Intrinsics, 0, intrinsics, 4 * i, 4);
+                Array.Copy(depthFrames[i].DepthToWorld, 0, depthToWorld, 12 * i, 12);
+                numPixels += widths[i] * heights[i];
+            }
+
+            ushort[] depths = new ushort[numPixels];
+            int start = 0;
+
+            for (int i = 0; i < numCameras; i++)
+            {
+                Array.Copy(depthFrames[i].Depth, 0, depths, start, widths[i] * heights[i]);
+                start += widths[i] * heights[i];
+            }
+
+            float[] allRs = new float[9 * numCameras];
+            float[] allTs = new float[3 * numCameras];
+
+            for (int i = 0; i < numCameras; i++)
+            {
+                for (int j = 0; j < 3; j++)
+                    allRs[9 * i + j + j * 3] = 1;
+            }
+
+            PoseCorrections corrections = new PoseCorrections();
+            corrections.Error = RefineAllPosesProjective(depths, widths, heights, intrinsics, depthToWorld, numCameras, allRs, allTs, maxIter,
+                sampleStep, maxDistance, out corrections.NumIterations);
+
+            for (int i = 0; i < numCameras; i++)
+            {
+                float[] tempR = new float[9];
+                float[] tempT = new float[3];
+                Array.Copy(allRs, 9 * i, tempR, 0, 9);
+                Array.Copy(allTs, 3 * i, tempT, 0, 3);
+
+                corrections.Rs.Add(tempR);
+                corrections.Ts.Add(tempT);
+            }
+
+            return corrections;
+        }
+    }
+}
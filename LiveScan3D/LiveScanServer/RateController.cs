@@ -0,0 +1,159 @@
+﻿/***************************************************************************\
+
+Module Name:  RateController.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module chooses the scale of the frames sent to the receivers so that
+they reach the target frame rate. The frame time of each receiver, measured
+from its acknowledgements, covers both the transfer of a frame on its link
+and its rendering. Both grow with the number of points, which grows with the
+square of the scale for the surfaces captured, so the scale is corrected by
+the square root of the ratio of the slowest frame time to the target.
+With simulcast, the frames are encoded at several scales, and each receiver
+is moved to the finest tier it can take at the target frame rate; the scale
+of the coarsest tier is then corrected for its slowest receiver.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+using System.IO.Compression;
+
+namespace LiveScanServer
+{
+    public sealed class RateController
+    {
+        // Range of frame time to target frame interval ratios in which the scale is kept, so it does not oscillate
+        private const double MinLoadRatio = 0.8;
+        private const double MaxLoadRatio = 1.0;
+
+        // Largest changes of the scale for one frame; the frame time is averaged over several frames, so the scale is
+        // raised slowly and lowered faster
+        private const double MaxScaleIncrease = 1.02;
+        private const double MaxScaleDecrease = 0.95;
+
+        // Seconds a receiver stays in a tier before it is moved again, so its frame time has settled on the frames of the tier
+        private const double TierHoldSeconds = 2.0;
+
+        private const double LogInterval = 10.0; // Seconds between two logs of the chosen parameters
+
+        private double scale = 0.0;
+        private DateTime lastLogTime = DateTime.MinValue;
+
+        public float TargetFps = 30.0f;
+
+        // Parameters chosen for the last frame, exposed for monitoring
+        public short Scale { get; private set; } = 0; // 0 while no receiver is measured; the scale is then set by the number of points
+        public int PointBudget { get; private set; } = 0; // Number of points the receivers can take at the target frame rate
+        public double SlowestFrameTime { get; private set; } = 0.0; // Frame time of the slowest receiver, in seconds
+        public double SlowestLinkSpeed { get; private set; } = 0.0; // Throughput of the slowest link, in bytes per second
+        public CompressionLevel SlowestLinkCompression { get; private set; } = CompressionLevel.Fastest; // Compression level of the slowest link
+
+        /// <summary>
+        /// Chooses the scale of the next frame from the measurements of the receivers
+        /// </summary>
+        /// <param name="receivers">Connected receivers</param>
+        /// <param name="lastFrame">Last frame encoded; null if none was</param>
+        /// <param name="minScale">Lowest scale allowed</param>
+        /// <param name="maxScale">Highest scale allowed</param>
+        /// <returns>The scale of the next frame; 0 if no receiver is measured yet</returns>
+        public short Update(List<PointCloudTransferSocket> receivers, EncodedPointCloud lastFrame, short minScale, short maxScale)
+        {
+            double slowestFrameTime = 0.0;
+            double slowestLinkSpeed = 0.0;
+
+            foreach (PointCloudTransferSocket receiver in receivers)
+            {
+                slowestFrameTime = Math.Max(slowestFrameTime, receiver.FrameTime);
+
+                if (receiver.LinkSpeed > 0.0 && (slowestLinkSpeed == 0.0 || receiver.LinkSpeed < slowestLinkSpeed))
+                    slowestLinkSpeed = receiver.LinkSpeed;
+            }
+
+            SlowestFrameTime = slowestFrameTime;
+            SlowestLinkSpeed = slowestLinkSpeed;
+            SlowestLinkCompression = PayloadCompression.SelectLevel(slowestLinkSpeed);
+
+            if (slowestFrameTime == 0.0 || lastFrame == null || TargetFps <= 0.0f)
+            {
+                scale = 0.0;
+                Scale = 0;
+                PointBudget = 0;
+
+                return Scale;
+            }
+
+            short lastScale = BitConverter.ToInt16(lastFrame.FullFrame.Array, lastFrame.FullFrame.Offset);
+            int lastNumPoints = BitConverter.ToInt32(lastFrame.FullFrame.Array, lastFrame.FullFrame.Offset + sizeof(short));
+            double loadRatio = slowestFrameTime * TargetFps;
+
+            // Start from the scale of the last frame, which was set by the number of points before the first measurement
+            if (scale == 0.0)
+                scale = lastScale;
+
+            if (loadRatio < MinLoadRatio || loadRatio > MaxLoadRatio)
+            {
+                double correction = Math.Sqrt(0.5 * (MinLoadRatio + MaxLoadRatio) / loadRatio);
+                scale *= Math.Min(MaxScaleIncrease, Math.Max(correction, MaxScaleDecrease));
+            }
+
+            scale = Math.Min(maxScale, Math.Max(scale, minScale));
+
+            Scale = (short)scale;
+            PointBudget = (int)(lastNumPoints / loadRatio);
+
+            if ((DateTime.Now - lastLogTime).TotalSeconds >= LogInterval)
+            {
+                lastLogTime = DateTime.Now;
+                Logger.Log($"Transfer rate: scale {Scale}, budget {PointBudget} points, slowest frame time {SlowestFrameTime * 1000.0:F1} ms, "
+                    + $"slowest link {SlowestLinkSpeed / 1e6:F1} MB/s ({SlowestLinkCompression})");
+            }
+
+            return Scale;
+        }
+
+        /// <summary>
+        /// Moves the receivers between the simulcast tiers. The frame time of a receiver is measured on the frames of its
+        /// tier, and estimated for the tier above it from the ratio of their scales, squared like the number of points. A
+        /// receiver goes one tier down when it is slower than the target frame rate, and one tier up when it would still
+        /// be fast enough there.
+        /// </summary>
+        /// <param name="receivers">Connected receivers</param>
+        /// <param name="tierScales">Scale of the last frame of each tier, the finest first</param>
+        /// <param name="numTiers">Number of tiers encoded</param>
+        public void UpdateTiers(List<PointCloudTransferSocket> receivers, short[] tierScales, int numTiers)
+        {
+            foreach (PointCloudTransferSocket receiver in receivers)
+            {
+                // The multicast group shares the finest tier, and the receivers without measurements start from it
+                if (numTiers <= 1 || receiver.FrameTime == 0.0 || TargetFps <= 0.0f)
+                {
+                    receiver.TargetTier = 0;
+                    continue;
+                }
+
+                // A receiver waiting for the first frame of its new tier is left to switch
+                if (receiver.TargetTier != receiver.Tier || receiver.SecondsSinceTierChange < TierHoldSeconds)
+                    continue;
+
+                int tier = receiver.Tier;
+                double loadRatio = receiver.FrameTime * TargetFps;
+
+                if (loadRatio > MaxLoadRatio && tier + 1 < numTiers)
+                {
+                    receiver.TargetTier = tier + 1;
+                }
+                else if (tier > 0 && tierScales[tier] > 0)
+                {
+                    double scaleRatio = (double)tierScales[tier - 1] / tierScales[tier];
+
+                    if (loadRatio * scaleRatio * scaleRatio < MinLoadRatio)
+                        receiver.TargetTier = tier - 1;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,76 @@
+﻿/***************************************************************************\
+
+Module Name:  ServerTrace.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module marks zones of the server threads on the timeline of an ETW
+trace, next to those of the native clients, so that the assembly, merge,
+encoding and sending of the frames can be seen overlapping with the camera
+threads. The zones are written by the LiveScan3D-Server EventSource as start
+and stop events; a zone only checks whether a trace session enabled the
+source when no session did.
+
+\***************************************************************************/
+
+using System;
+using System.Diagnostics.Tracing;
+
+namespace LiveScanServer
+{
+    [EventSource(Name = "LiveScan3D-Server")]
+    public sealed class ServerTrace : EventSource
+    {
+        public static readonly ServerTrace Log = new ServerTrace();
+
+        private ServerTrace()
+        {
+        }
+
+        /// <summary>
+        /// Marks the time until the zone is disposed as a zone of the calling thread. The zone must end on the thread
+        /// it started on, so it must not span an await.
+        /// </summary>
+        /// <param name="name">Name of the zone</param>
+        public static TraceZone Zone(string name)
+        {
+            return new TraceZone(Log.IsEnabled() ? name : null);
+        }
+
+        [Event(1, Opcode = EventOpcode.Start, Level = EventLevel.Informational)]
+        public void ZoneStart(string name)
+        {
+            WriteEvent(1, name);
+        }
+
+        [Event(2, Opcode = EventOpcode.Stop, Level = EventLevel.Informational)]
+        public void ZoneStop(string name)
+        {
+            WriteEvent(2, name);
+        }
+
+        public struct TraceZone : IDisposable
+        {
+            private string name; // Null if the source was not enabled when the zone started
+
+            internal TraceZone(string name)
+            {
+                this.name = name;
+
+                if (name != null)
+                    Log.ZoneStart(name);
+            }
+
+            public void Dispose()
+            {
+                if (name == null)
+                    return;
+
+                Log.ZoneStop(name);
+                name = null;
+            }
+        }
+    }
+}
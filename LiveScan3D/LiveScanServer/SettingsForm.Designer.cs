@@ -31,6 +31,9 @@
             System.ComponentModel.ComponentResourceManager resources = new System.ComponentModel.ComponentResourceManager(typeof(SettingsForm));
             this.lbMerge = new System.Windows.Forms.Label();
             this.chMerge = new System.Windows.Forms.CheckBox();
+            this.chProjectiveRefinement = new System.Windows.Forms.CheckBox();
+            this.chCalibrationMonitor = new System.Windows.Forms.CheckBox();
+            this.chDriftCorrection = new System.Windows.Forms.CheckBox();
             this.lbICPIters = new System.Windows.Forms.Label();
             this.txtICPIters = new System.Windows.Forms.TextBox();
             this.grClient = new System.Windows.Forms.GroupBox();
@@ -75,9 +78,12 @@
             this.grFiltering = new System.Windows.Forms.GroupBox();
             this.txtFilterNeighbors = new System.Windows.Forms.TextBox();
             this.chFilter = new System.Windows.Forms.CheckBox();
+            this.chGpuProcessing = new System.Windows.Forms.CheckBox();
             this.lbFilterNeighbors = new System.Windows.Forms.Label();
             this.lbFilterDistance = new System.Windows.Forms.Label();
             this.txtFilterDistance = new System.Windows.Forms.TextBox();
+            this.lbWorkerThreads = new System.Windows.Forms.Label();
+            this.txtWorkerThreads = new System.Windows.Forms.TextBox();
             this.grServer = new System.Windows.Forms.GroupBox();
             this.rBinaryPly = new System.Windows.Forms.RadioButton();
             this.lbFormat = new System.Windows.Forms.Label();
@@ -116,6 +122,42 @@
             this.chMerge.UseVisualStyleBackColor = true;
             this.chMerge.CheckedChanged += new System.EventHandler(this.chMerge_CheckedChanged);
             // 
+            // chProjectiveRefinement
+            // 
+            this.chProjectiveRefinement.AutoSize = true;
+            this.chProjectiveRefinement.Location = new System.Drawing.Point(486, 33);
+            this.chProjectiveRefinement.Margin = new System.Windows.Forms.Padding(4, 5, 4, 5);
+            this.chProjectiveRefinement.Name = "chProjectiveRefinement";
+            this.chProjectiveRefinement.Size = new System.Drawing.Size(215, 24);
+            this.chProjectiveRefinement.TabIndex = 31;
+            this.chProjectiveRefinement.Text = "refine from depth frames";
+            this.chProjectiveRefinement.UseVisualStyleBackColor = true;
+            this.chProjectiveRefinement.CheckedChanged += new System.EventHandler(this.chProjectiveRefinement_CheckedChanged);
+            // 
+            // chCalibrationMonitor
+            // 
+            this.chCalibrationMonitor.AutoSize = true;
+            this.chCalibrationMonitor.Location = new System.Drawing.Point(486, 69);
+            this.chCalibrationMonitor.Margin = new System.Windows.Forms.Padding(4, 5, 4, 5);
+            this.chCalibrationMonitor.Name = "chCalibrationMonitor";
+            this.chCalibrationMonitor.Size = new System.Drawing.Size(222, 24);
+            this.chCalibrationMonitor.TabIndex = 32;
+            this.chCalibrationMonitor.Text = "monitor calibration drift";
+            this.chCalibrationMonitor.UseVisualStyleBackColor = true;
+            this.chCalibrationMonitor.CheckedChanged += new System.EventHandler(this.chCalibrationMonitor_CheckedChanged);
+            // 
+            // chDriftCorrection
+            // 
+            this.chDriftCorrection.AutoSize = true;
+            this.chDriftCorrection.Location = new System.Drawing.Point(486, 105);
+            this.chDriftCorrection.Margin = new System.Windows.Forms.Padding(4, 5, 4, 5);
+            this.chDriftCorrection.Name = "chDriftCorrection";
+            this.chDriftCorrection.Size = new System.Drawing.Size(172, 24);
+            this.chDriftCorrection.TabIndex = 33;
+            this.chDriftCorrection.Text = "correct small drifts";
+            this.chDriftCorrection.UseVisualStyleBackColor = true;
+            this.chDriftCorrection.CheckedChanged += new System.EventHandler(this.chDriftCorrection_CheckedChanged);
+            // 
             // lbICPIters
             // 
             this.lbICPIters.AutoSize = true;
@@ -574,9 +616,12 @@
             // 
             this.grFiltering.Controls.Add(this.txtFilterNeighbors);
             this.grFiltering.Controls.Add(this.chFilter);
+            this.grFiltering.Controls.Add(this.chGpuProcessing);
             this.grFiltering.Controls.Add(this.lbFilterNeighbors);
             this.grFiltering.Controls.Add(this.lbFilterDistance);
             this.grFiltering.Controls.Add(this.txtFilterDistance);
+            this.grFiltering.Controls.Add(this.lbWorkerThreads);
+            this.grFiltering.Controls.Add(this.txtWorkerThreads);
             this.grFiltering.Location = new System.Drawing.Point(14, 178);
             this.grFiltering.Margin = new System.Windows.Forms.Padding(4, 5, 4, 5);
             this.grFiltering.Name = "grFiltering";
@@ -607,6 +652,18 @@
             this.chFilter.UseVisualStyleBackColor = true;
             this.chFilter.CheckedChanged += new System.EventHandler(this.chFilter_CheckedChanged);
             // 
+            // chGpuProcessing
+            // 
+            this.chGpuProcessing.AutoSize = true;
+            this.chGpuProcessing.Location = new System.Drawing.Point(220, 62);
+            this.chGpuProcessing.Margin = new System.Windows.Forms.Padding(4, 5, 4, 5);
+            this.chGpuProcessing.Name = "chGpuProcessing";
+            this.chGpuProcessing.Size = new System.Drawing.Size(143, 24);
+            this.chGpuProcessing.TabIndex = 30;
+            this.chGpuProcessing.Text = "GPU processing";
+            this.chGpuProcessing.UseVisualStyleBackColor = true;
+            this.chGpuProcessing.CheckedChanged += new System.EventHandler(this.chGpuProcessing_CheckedChanged);
+            // 
             // lbFilterNeighbors
             // 
             this.lbFilterNeighbors.AutoSize = true;
@@ -636,8 +693,30 @@
             this.txtFilterDistance.TabIndex = 22;
             this.txtFilterDistance.TextChanged += new System.EventHandler(this.txtFilterDistance_TextChanged);
             // 
+            // lbWorkerThreads
+            // 
+            this.lbWorkerThreads.AutoSize = true;
+            this.lbWorkerThreads.Location = new System.Drawing.Point(220, 105);
+            this.lbWorkerThreads.Margin = new System.Windows.Forms.Padding(4, 0, 4, 0);
+            this.lbWorkerThreads.Name = "lbWorkerThreads";
+            this.lbWorkerThreads.Size = new System.Drawing.Size(68, 20);
+            this.lbWorkerThreads.TabIndex = 31;
+            this.lbWorkerThreads.Text = "Threads:";
+            // 
+            // txtWorkerThreads
+            // 
+            this.txtWorkerThreads.Location = new System.Drawing.Point(300, 100);
+            this.txtWorkerThreads.Margin = new System.Windows.Forms.Padding(4, 5, 4, 5);
+            this.txtWorkerThreads.Name = "txtWorkerThreads";
+            this.txtWorkerThreads.Size = new System.Drawing.Size(55, 26);
+            this.txtWorkerThreads.TabIndex = 32;
+            this.txtWorkerThreads.TextChanged += new System.EventHandler(this.txtWorkerThreads_TextChanged);
+            // 
             // grServer
             // 
+            this.grServer.Controls.Add(this.chDriftCorrection);
+            this.grServer.Controls.Add(this.chCalibrationMonitor);
+            this.grServer.Controls.Add(this.chProjectiveRefinement);
             this.grServer.Controls.Add(this.rBinaryPly);
             this.grServer.Controls.Add(this.lbFormat);
             this.grServer.Controls.Add(this.rAsciiPly);
@@ -746,6 +825,9 @@
 
         private System.Windows.Forms.Label lbMerge;
         private System.Windows.Forms.CheckBox chMerge;
+        private System.Windows.Forms.CheckBox chProjectiveRefinement;
+        private System.Windows.Forms.CheckBox chCalibrationMonitor;
+        private System.Windows.Forms.CheckBox chDriftCorrection;
         private System.Windows.Forms.Label lbICPIters;
         private System.Windows.Forms.TextBox txtICPIters;
         private System.Windows.Forms.GroupBox grClient;
@@ -755,9 +837,12 @@
         private System.Windows.Forms.GroupBox grFiltering;
         private System.Windows.Forms.TextBox txtFilterNeighbors;
         private System.Windows.Forms.CheckBox chFilter;
+        private System.Windows.Forms.CheckBox chGpuProcessing;
         private System.Windows.Forms.Label lbFilterNeighbors;
         private System.Windows.Forms.Label lbFilterDistance;
         private System.Windows.Forms.TextBox txtFilterDistance;
+        private System.Windows.Forms.Label lbWorkerThreads;
+        private System.Windows.Forms.TextBox txtWorkerThreads;
         private System.Windows.Forms.GroupBox grMarkers;
         private System.Windows.Forms.Label lbX2;
         private System.Windows.Forms.Button btRemove;
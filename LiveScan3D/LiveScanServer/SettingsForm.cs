@@ -47,14 +47,19 @@ namespace LiveScanServer
             txtMaxZ.Text = settings.MaxBounds[2].ToString(CultureInfo.InvariantCulture);
 
             chFilter.Checked = settings.Filter;
+            chGpuProcessing.Checked = settings.IsGpuProcessingEnabled;
             txtFilterNeighbors.Text = settings.NumFilterNeighbors.ToString();
             txtFilterDistance.Text = settings.FilterThreshold.ToString(CultureInfo.InvariantCulture);
+            txtWorkerThreads.Text = settings.NumWorkerThreads.ToString();
 
             lisMarkers.DataSource = settings.MarkerPoses;
 
             chMerge.Checked = settings.MergeScansForSave;
             txtICPIters.Text = settings.NumICPIterations.ToString();
             txtRefinIters.Text = settings.NumRefineIterations.ToString();
+            chProjectiveRefinement.Checked = settings.IsProjectiveRefinementEnabled;
+            chCalibrationMonitor.Checked = settings.IsCalibrationMonitorEnabled;
+            chDriftCorrection.Checked = settings.IsDriftCorrectionEnabled;
 
             btSyncEnable.Enabled = true;
             btSyncDisable.Enabled = false;
@@ -160,12 +165,24 @@ namespace LiveScanServer
             UpdateClients();
         }
 
+        private void chGpuProcessing_CheckedChanged(object sender, EventArgs e)
+        {
+            settings.IsGpuProcessingEnabled = chGpuProcessing.Checked;
+            UpdateClients();
+        }
+
         private void txtFilterNeighbors_TextChanged(object sender, EventArgs e)
         {
             Int32.TryParse(txtFilterNeighbors.Text, out settings.NumFilterNeighbors);
             UpdateClients();
         }
 
+        private void txtWorkerThreads_TextChanged(object sender, EventArgs e)
+        {
+            Int32.TryParse(txtWorkerThreads.Text, out settings.NumWorkerThreads);
+            UpdateClients();
+        }
+
         private void txtFilterDistance_TextChanged(object sender, EventArgs e)
         {
             Single.TryParse(txtFilterDistance.Text, NumberStyles.Any, CultureInfo.InvariantCulture, out settings.FilterThreshold);
@@ -187,6 +204,21 @@ namespace LiveScanServer
             settings.MergeScansForSave = chMerge.Checked;
         }
 
+        private void chProjectiveRefinement_CheckedChanged(object sender, EventArgs e)
+        {
+            settings.IsProjectiveRefinementEnabled = chProjectiveRefinement.Checked;
+        }
+
+        private void chCalibrationMonitor_CheckedChanged(object sender, EventArgs e)
+        {
+            settings.IsCalibrationMonitorEnabled = chCalibrationMonitor.Checked;
+        }
+
+        private void chDriftCorrection_CheckedChanged(object sender, EventArgs e)
+        {
+            settings.IsDriftCorrectionEnabled = chDriftCorrection.Checked;
+        }
+
         private void btAdd_Click(object sender, EventArgs e)
         {
             lock (settings)
@@ -0,0 +1,167 @@
+﻿/***************************************************************************\
+
+Module Name:  StreamCapture.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module captures the exact bytes the transfer server writes to the TCP
+sockets of its receivers, for the point cloud and the document streams, with
+the time at which each write started, so that a stream which stuttered on a
+headset can be played back to a receiver by the replay tool. Each socket
+records whole messages only, so that a capture started while a receiver
+streams begins at the start of a frame or a document. The frames streamed
+over UDP and multicast are not captured.
+
+The capture file is the magic "LSSC" and the version (int), then one record
+per write: the time since the start of the capture in microseconds (long),
+the stream (byte), the connection of the receiver (int), the number of bytes
+(int) and the bytes.
+
+\***************************************************************************/
+
+using System;
+using System.Diagnostics;
+using System.IO;
+
+namespace LiveScanServer
+{
+    public enum CapturedStream : byte
+    {
+        PointCloud = 0,
+        Document = 1
+    }
+
+    /// <summary>
+    /// Write of a socket, as read back from a capture
+    /// </summary>
+    public struct CapturedWrite
+    {
+        public long TimeUs; // Since the start of the capture
+        public CapturedStream Stream;
+        public int ConnectionId;
+        public byte[] Data;
+    }
+
+    /// <summary>
+    /// Records the writes of the sockets of the transfer server to a capture file; the sockets record to it from their
+    /// own tasks until it is disposed
+    /// </summary>
+    public class StreamCapture : IDisposable
+    {
+        public const int FileVersion = 1;
+        public static readonly byte[] FileMagic = { (byte)'L', (byte)'S', (byte)'S', (byte)'C' };
+
+        private const int FileBufferSize = 1 << 20;
+
+        private readonly object fileLock = new object();
+        private readonly long startTimestamp = Stopwatch.GetTimestamp();
+        private BinaryWriter writer;
+
+        public string Path { get; }
+        public long NumWrites { get; private set; } = 0;
+        public long NumBytes { get; private set; } = 0;
+
+        public StreamCapture(string path)
+        {
+            Path = path;
+            writer = new BinaryWriter(new FileStream(path, FileMode.Create, FileAccess.Write, FileShare.Read, FileBufferSize));
+            writer.Write(FileMagic);
+            writer.Write(FileVersion);
+        }
+
+        /// <summary>
+        /// Records a write which starts now; the writes recorded once the capture is disposed are dropped
+        /// </summary>
+        public void Record(CapturedStream stream, int connectionId, byte[] buffer, int offset, int count)
+        {
+            long timeUs = (Stopwatch.GetTimestamp() - startTimestamp) * 1000000 / Stopwatch.Frequency;
+
+            lock (fileLock)
+            {
+                if (writer == null)
+                    return;
+
+                writer.Write(timeUs);
+                writer.Write((byte)stream);
+                writer.Write(connectionId);
+                writer.Write(count);
+                writer.Write(buffer, offset, count);
+
+                NumWrites++;
+                NumBytes += count;
+            }
+        }
+
+        public void Dispose()
+        {
+            lock (fileLock)
+            {
+                writer?.Dispose();
+                writer = null;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Reads the writes of a capture file back, in the order they were recorded
+    /// </summary>
+    public class StreamCaptureReader : IDisposable
+    {
+        private readonly BinaryReader reader;
+
+        public StreamCaptureReader(string path)
+        {
+            reader = new BinaryReader(File.OpenRead(path));
+
+            byte[] magic = reader.ReadBytes(StreamCapture.FileMagic.Length);
+
+            for (int i = 0; i < StreamCapture.FileMagic.Length; i++)
+            {
+                if (magic.Length != StreamCapture.FileMagic.Length || magic[i] != StreamCapture.FileMagic[i])
+                {
+                    reader.Dispose();
+                    throw new InvalidDataException(path + " is not a stream capture.");
+                }
+            }
+
+            int version = reader.ReadInt32();
+
+            if (version != StreamCapture.FileVersion)
+            {
+                reader.Dispose();
+                throw new InvalidDataException(path + " is a capture of version " + version + ", " + StreamCapture.FileVersion + " is supported.");
+            }
+        }
+
+        /// <summary>
+        /// Reads the next write of the capture
+        /// </summary>
+        /// <returns>False at the end of the capture, or at a write cut short when the server stopped during it</returns>
+        public bool ReadNext(out CapturedWrite write)
+        {
+            write = new CapturedWrite();
+
+            try
+            {
+                write.TimeUs = reader.ReadInt64();
+                write.Stream = (CapturedStream)reader.ReadByte();
+                write.ConnectionId = reader.ReadInt32();
+                int count = reader.ReadInt32();
+                write.Data = reader.ReadBytes(count);
+
+                return write.Data.Length == count;
+            }
+            catch (EndOfStreamException)
+            {
+                return false;
+            }
+        }
+
+        public void Dispose()
+        {
+            reader.Dispose();
+        }
+    }
+}
@@ -7,7 +7,13 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module is the server used to listen for client connections through TCP
-and to send them point cloud data at a high frequency
+and to send them point cloud data at a high frequency. Connections are
+accepted and written asynchronously: each receiver socket sends on its own,
+and only ever holds the latest frame or document it has not sent yet, so a
+slow receiver never delays the others. The merged frames are encoded and
+sent on two stages, so that a frame is encoded while the last one is sent.
+The bytes written to the TCP receivers can also be captured to a file, for
+the replay tool.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -16,6 +22,7 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 
 \***************************************************************************/
 
+using System;
 using System.Collections.Generic;
 using System.Net;
 using System.Net.Sockets;
@@ -26,9 +33,9 @@ namespace LiveScanServer
 {
     public class TransferServer
     {
-        public List<float> Vertices = new List<float>();
-        public List<byte> Colors = new List<byte>();
+        public MergedFrameStore FrameStore = new MergedFrameStore();
         public DocumentInfo DocumentInfo = new DocumentInfo();
+        public CameraSettings Settings = new CameraSettings();
 
         private const int PointCloudPort = 48002;
         private const int DocumentPort = 48003;
@@ -38,22 +45,102 @@ namespace LiveScanServer
         private System.Timers.Timer pointCloudConnectionTimer;
         private CancellationTokenSource pointCloudCancellationTokenSource;
         private List<PointCloudTransferSocket> pointCloudClients = new List<PointCloudTransferSocket>();
-        private object pointCloudClientLock = new object();
+        private readonly ProfiledLock pointCloudClientLock = new ProfiledLock("point cloud clients");
         private bool isPointCloudServerRunning = false;
 
+        // Each merged frame is encoded once for each simulcast tier, then sent to every receiver of the tier; the views
+        // of the receivers which sent their pose are encoded by the sender
+        private const int MaxTransferTiers = 3;
+        private PointCloudFrameEncoder[] pointCloudEncoders = { new PointCloudFrameEncoder(), new PointCloudFrameEncoder(), new PointCloudFrameEncoder() };
+        private PointCloudFrameEncoder[] viewEncoders = { new PointCloudFrameEncoder(), new PointCloudFrameEncoder(), new PointCloudFrameEncoder() };
+
+        // Frames encoded and not taken by the sender yet; one frame is encoded while the last one is sent
+        private const int MaxQueuedFrameSets = 1;
+        private PipelineQueue<EncodedFrameSet> encodedFrameSets = new PipelineQueue<EncodedFrameSet>(MaxQueuedFrameSets);
+        private int numSkippedFrames = 0; // Merged frames replaced before the encoder took them, since last reported
+
+        // Chooses the scale of the frames and the tiers of the receivers from their measurements; its parameters can be monitored
+        public readonly RateController RateController = new RateController();
+
+        // Breaks down the latency of the frames reported by the receivers which trace it
+        public readonly LatencyMonitor LatencyMonitor = new LatencyMonitor();
+
+        // Wakes the point cloud encoder when a new merged frame is available or when a client can send a new frame, since
+        // its requests may have changed, and the sender when a new frame is encoded or when a client can send it
+        private SemaphoreSlim pointCloudEncodeSignal = new SemaphoreSlim(0);
+        private SemaphoreSlim pointCloudSendSignal = new SemaphoreSlim(0);
+
+        // Shared by the receivers which stream the frames over UDP
+        private UdpClient pointCloudUdpSender;
+
+        // Sends each frame once to the receivers which joined the multicast group
+        private PointCloudMulticaster pointCloudMulticaster;
+
         private TcpListener documentListener;
         private System.Timers.Timer documentConnectionTimer;
         private CancellationTokenSource documentCancellationTokenSource;
         private List<DocumentTransferSocket> documentClients = new List<DocumentTransferSocket>();
-        private object documentClientLock = new object();
+        private readonly ProfiledLock documentClientLock = new ProfiledLock("document clients");
         private bool isDocumentServerRunning = false;
 
+        // Largest size the document receivers render the documents at; 0 for no limit, while any receiver did not send it
+        private int maxDocumentWidth = 0;
+        private int maxDocumentHeight = 0;
+
+        // Capture the sockets record their writes to while the server captures, and the id of the next receiver
+        private StreamCapture streamCapture = null;
+        private object captureLock = new object();
+        private int lastConnectionId = 0;
+
+        /// <summary>
+        /// Raised with the largest width and height the document receivers render the documents at, when they change
+        /// </summary>
+        public event Action<int, int> DocumentSizeChanged;
+
+        public bool IsCapturing
+        {
+            get
+            {
+                lock (captureLock)
+                {
+                    return streamCapture != null;
+                }
+            }
+        }
+
         ~TransferServer()
         {
             StopPointCloudServer();
             StopDocumentServer();
         }
 
+        public int SendQueueCapacity => encodedFrameSets.Capacity;
+
+        /// <summary>
+        /// Notes that the frame store holds a new merged frame, which is encoded on the next pass of the encoder
+        /// </summary>
+        public void NotifyFrameUpdated()
+        {
+            pointCloudEncodeSignal.Release();
+        }
+
+        /// <summary>
+        /// Largest number of encoded frames waiting for the sender since the last call
+        /// </summary>
+        public int TakeSendQueueDepth() => encodedFrameSets.TakeMaxDepth();
+
+        /// <summary>
+        /// Number of merged frames which were replaced in the frame store before the encoder took them, since the last call
+        /// </summary>
+        public int TakeNumSkippedFrames() => Interlocked.Exchange(ref numSkippedFrames, 0);
+
+        // Called when a receiver can send a new frame
+        private void OnReceiverReady()
+        {
+            pointCloudEncodeSignal.Release();
+            pointCloudSendSignal.Release();
+        }
+
         /// <summary>
         /// Starts the TCP listener and Tasks for the point cloud server to listen for client connections and send them data
         /// </summary>
@@ -64,12 +151,16 @@ namespace LiveScanServer
                 // Start TCP listener server
                 pointCloudListener = new TcpListener(IPAddress.Any, PointCloudPort);
                 pointCloudListener.Start();
+                pointCloudUdpSender = new UdpClient();
+                TransferSocketBase.EnlargeSendBuffer(pointCloudUdpSender.Client, PointCloudTransferSocket.UdpSendBufferSize);
+                pointCloudMulticaster = new PointCloudMulticaster(OnReceiverReady);
 
                 isPointCloudServerRunning = true;
 
                 // Start tasks to listen for client connections and send data
                 pointCloudCancellationTokenSource = new CancellationTokenSource();
                 Task.Run(() => ConnectPointCloudClients(pointCloudCancellationTokenSource.Token));
+                Task.Run(() => EncodePointClouds(pointCloudCancellationTokenSource.Token));
                 Task.Run(() => SendPointCloudToAllClients(pointCloudCancellationTokenSource.Token));
 
                 // Start a timer to ping connected clients at a regular interval to ensure they are still connected
@@ -78,7 +169,7 @@ namespace LiveScanServer
 
                 pointCloudConnectionTimer.Elapsed += delegate (object sender, System.Timers.ElapsedEventArgs e)
                 {
-                    lock (pointCloudClientLock)
+                    using (pointCloudClientLock.Enter())
                     {
                         for (int i = 0; i < pointCloudClients.Count; i++)
                         {
@@ -119,7 +210,7 @@ namespace LiveScanServer
 
                 documentConnectionTimer.Elapsed += delegate (object sender, System.Timers.ElapsedEventArgs e)
                 {
-                    lock (documentClientLock)
+                    using (documentClientLock.Enter())
                     {
                         for (int i = 0; i < documentClients.Count; i++)
                         {
@@ -130,6 +221,8 @@ namespace LiveScanServer
                             }
                         }
                     }
+
+                    UpdateDocumentSize();
                 };
 
                 documentConnectionTimer.Start();
@@ -159,8 +252,10 @@ namespace LiveScanServer
 
                 // Stop the listener server
                 pointCloudListener.Stop();
+                pointCloudUdpSender.Close();
+                pointCloudMulticaster.Close();
 
-                lock (pointCloudClientLock)
+                using (pointCloudClientLock.Enter())
                     pointCloudClients.Clear();
             }
         }
@@ -189,11 +284,74 @@ namespace LiveScanServer
                 // Stop the listener server
                 documentListener.Stop();
 
-                lock (documentClientLock)
+                using (documentClientLock.Enter())
                     documentClients.Clear();
             }
         }
 
+        /// <summary>
+        /// Starts capturing the bytes written to the point cloud and document receivers connected over TCP, those
+        /// connected now and those which connect during the capture, to a new file
+        /// </summary>
+        /// <param name="path">File to write the capture to, replaced if it exists</param>
+        public void StartCapture(string path)
+        {
+            lock (captureLock)
+            {
+                if (streamCapture != null)
+                    return;
+
+                streamCapture = new StreamCapture(path);
+                SetCapture(streamCapture);
+            }
+        }
+
+        /// <summary>
+        /// Stops the capture and closes its file
+        /// </summary>
+        /// <returns>The capture, which holds its number of writes and bytes; null if the server did not capture</returns>
+        public StreamCapture StopCapture()
+        {
+            StreamCapture capture;
+
+            lock (captureLock)
+            {
+                capture = streamCapture;
+                streamCapture = null;
+                SetCapture(null);
+            }
+
+            capture?.Dispose();
+            return capture;
+        }
+
+        private void SetCapture(StreamCapture capture)
+        {
+            using (pointCloudClientLock.Enter())
+            {
+                foreach (PointCloudTransferSocket client in pointCloudClients)
+                    client.SetCapture(capture, CapturedStream.PointCloud);
+            }
+
+            using (documentClientLock.Enter())
+            {
+                foreach (DocumentTransferSocket client in documentClients)
+                    client.SetCapture(capture, CapturedStream.Document);
+            }
+        }
+
+        // Gives a new receiver its id, and the capture if the server captures; called once the receiver is in its list, so
+        // that a capture started meanwhile is not missed
+        private void AttachReceiver(TransferSocketBase client, CapturedStream stream)
+        {
+            client.ConnectionId = Interlocked.Increment(ref lastConnectionId);
+
+            lock (captureLock)
+            {
+                client.SetCapture(streamCapture, stream);
+            }
+        }
+
         /// <summary>
         /// Listens for point cloud client connections in a loop
         /// </summary>
@@ -203,22 +361,20 @@ namespace LiveScanServer
         {
             while (isPointCloudServerRunning && !token.IsCancellationRequested)
             {
-                try
-                {
-                    // Try to accept a new client
-                    TcpClient newClient = pointCloudListener.AcceptTcpClient();
+                TcpClient newClient = await AcceptClient(pointCloudListener);
 
-                    // Add the new client to the list
-                    lock (pointCloudClientLock)
-                    {
-                        pointCloudClients.Add(new PointCloudTransferSocket(newClient));
-                    }
-                }
-                catch (SocketException)
+                if (newClient == null)
+                    continue;
+
+                PointCloudTransferSocket client = new PointCloudTransferSocket(newClient, pointCloudUdpSender, LatencyMonitor, OnReceiverReady);
+
+                // Add the new client to the list
+                using (pointCloudClientLock.Enter())
                 {
+                    pointCloudClients.Add(client);
                 }
 
-                await Task.Delay(100);
+                AttachReceiver(client, CapturedStream.PointCloud);
             }
         }
 
@@ -231,50 +387,404 @@ namespace LiveScanServer
         {
             while (isDocumentServerRunning && !token.IsCancellationRequested)
             {
-                try
+                TcpClient newClient = await AcceptClient(documentListener);
+
+                if (newClient == null)
+                    continue;
+
+                DocumentTransferSocket client = new DocumentTransferSocket(newClient, UpdateDocumentSize);
+
+                // Add the new client to the list
+                using (documentClientLock.Enter())
                 {
-                    // Try to accept a new client
-                    TcpClient newClient = documentListener.AcceptTcpClient();
+                    documentClients.Add(client);
+                }
+
+                AttachReceiver(client, CapturedStream.Document);
 
-                    // Add the new client to the list
-                    lock (documentClientLock)
+                UpdateDocumentSize();
+            }
+        }
+
+        /// <summary>
+        /// Finds the largest size the document receivers render the documents at, and reports it when it changed
+        /// </summary>
+        private void UpdateDocumentSize()
+        {
+            int width = 0;
+            int height = 0;
+
+            using (documentClientLock.Enter())
+            {
+                foreach (DocumentTransferSocket client in documentClients)
+                {
+                    // The receivers which did not send their size get the documents at the resolution of the cameras
+                    if (client.RequestedWidth == 0 || client.RequestedHeight == 0)
                     {
-                        documentClients.Add(new DocumentTransferSocket(newClient));
+                        width = 0;
+                        height = 0;
+                        break;
                     }
+
+                    width = Math.Max(width, client.RequestedWidth);
+                    height = Math.Max(height, client.RequestedHeight);
                 }
-                catch (SocketException)
+
+                if (width == maxDocumentWidth && height == maxDocumentHeight)
+                    return;
+
+                maxDocumentWidth = width;
+                maxDocumentHeight = height;
+
+                // Reported under the lock, so that the clients get the changes in order
+                DocumentSizeChanged?.Invoke(width, height);
+            }
+        }
+
+        /// <summary>
+        /// Waits for the next connection without holding a thread
+        /// </summary>
+        /// <returns>The client connected; null if the connection failed or the listener was stopped</returns>
+        private static async Task<TcpClient> AcceptClient(TcpListener listener)
+        {
+            try
+            {
+                return await listener.AcceptTcpClientAsync();
+            }
+            catch (SocketException)
+            {
+                return null;
+            }
+            catch (ObjectDisposedException)
+            {
+                // The listener was stopped; the loop ends with the server
+                return null;
+            }
+        }
+
+        /// <summary>
+        /// Codings of the frames of a simulcast tier requested by its receivers
+        /// </summary>
+        private struct TierRequests
+        {
+            public bool IsUsed; // Whether any receiver is in the tier or moving to it
+            public bool IsDeltaRequested;
+            public bool IsOctreeRequested;
+            public bool IsProgressiveRequested;
+            public bool IsWideRequested;
+            public bool IsSurfelRequested;
+            public bool IsMeshRequested;
+            public bool IsSplitRequested;
+            public bool IsTiledRequested;
+
+            public void Add(PointCloudTransferSocket client)
+            {
+                IsUsed = true;
+                IsDeltaRequested |= client.IsDeltaRequested;
+                IsOctreeRequested |= client.IsOctreeRequested;
+                IsProgressiveRequested |= client.IsProgressiveRequested;
+                IsWideRequested |= client.IsWideRequested;
+                IsSurfelRequested |= client.IsSurfelRequested;
+                IsMeshRequested |= client.IsMeshRequested;
+                IsSplitRequested |= client.IsSplitRequested;
+                IsTiledRequested |= client.IsTiledRequested;
+            }
+
+            // Whether a frame holds all the codings requested
+            public bool IsEncodedIn(EncodedPointCloud frame)
+            {
+                return (!IsDeltaRequested || frame.State != null) && (!IsOctreeRequested || frame.OctreeFrame.Array != null)
+                    && (!IsProgressiveRequested || frame.Progressive != null) && (!IsWideRequested || frame.WideFrame.Array != null)
+                    && (!IsSurfelRequested || frame.SurfelFrame.Array != null) && (!IsMeshRequested || frame.MeshFrame.Array != null)
+                    && (!IsSplitRequested || frame.Split != null) && (!IsTiledRequested || frame.Tiled != null);
+            }
+        }
+
+        /// <summary>
+        /// Frames of a merged frame encoded for each simulcast tier, handed from the encoder to the sender, which hold a
+        /// reference on each encoded frame. Dispose it once done with it.
+        /// </summary>
+        private sealed class EncodedFrameSet : IDisposable
+        {
+            public MergedFrame Frame; // Read in place by the views encoded by the sender
+            public readonly EncodedPointCloud[] Frames = new EncodedPointCloud[MaxTransferTiers]; // Null for the tiers without receivers
+            public int NumTiers;
+
+            public void Dispose()
+            {
+                foreach (EncodedPointCloud frame in Frames)
+                    frame?.Release();
+
+                Frame.Dispose();
+            }
+        }
+
+        /// <summary>
+        /// Sets the coding parameters of the frames of a tier
+        /// </summary>
+        private void ConfigureEncoder(PointCloudFrameEncoder encoder, int tier)
+        {
+            // The coarser tiers also quantize the chroma of their octree frames more
+            encoder.ChromaStep = Math.Max(1, Settings.TransferChromaStep) << tier;
+            encoder.FrameDeadlineMs = Settings.TransferFrameDeadlineMs;
+            encoder.CaptureRange = Settings.CaptureRange;
+        }
+
+        /// <summary>
+        /// Waits for a signal, or for the connection check interval in case the stream of frames stops
+        /// </summary>
+        private static async Task WaitForSignal(SemaphoreSlim signal, CancellationToken token)
+        {
+            try
+            {
+                if (await signal.WaitAsync(CheckConnectionInterval, token))
                 {
+                    // Every pending event is handled by the pass which follows
+                    while (signal.Wait(0)) { }
+                }
+            }
+            catch (OperationCanceledException)
+            {
+            }
+        }
+
+        /// <summary>
+        /// Encodes each new merged frame once for each tier which has receivers, with the codings they requested, and
+        /// queues the frames for the sender, so that the next frame is encoded while the last one is sent
+        /// </summary>
+        /// <param name="token">Cancellation token to stop the Task</param>
+        /// <returns>Task representing the encoder</returns>
+        private async Task EncodePointClouds(CancellationToken token)
+        {
+            EncodedPointCloud[] encodedFrames = new EncodedPointCloud[MaxTransferTiers]; // Last frames encoded, held until the next ones; null for the tiers without receivers
+            short[] tierScales = new short[MaxTransferTiers];
+            TierRequests[] tierRequests = new TierRequests[MaxTransferTiers]; // Reused by each pass, of which only numTiers are used
+            List<PointCloudTransferSocket> coarsestTierClients = new List<PointCloudTransferSocket>();
+            int lastVersion = 0;
+
+            while (isPointCloudServerRunning && !token.IsCancellationRequested)
+            {
+                int version = FrameStore.LatestVersion;
+                int numTiers = Math.Min(MaxTransferTiers, Math.Max(1, Settings.TransferTierCount));
+                Array.Clear(tierRequests, 0, tierRequests.Length);
+                coarsestTierClients.Clear();
+
+                // The finest tier is always encoded, for the multicast group and the receivers not measured yet
+                tierRequests[0].IsUsed = true;
+
+                using (pointCloudClientLock.Enter())
+                {
+                    foreach (PointCloudTransferSocket client in pointCloudClients)
+                    {
+                        // The receivers of the tiers removed from the settings start again from the finest tier
+                        if (client.Tier >= numTiers)
+                            client.SetTier(0);
+
+                        // A receiver moving to another tier needs what it requests from both
+                        tierRequests[client.Tier].Add(client);
+                        tierRequests[client.TargetTier].Add(client);
+
+                        if (client.Tier == numTiers - 1)
+                            coarsestTierClients.Add(client);
+                    }
+                }
+
+                // A frame encoded before the first delta, octree, progressive, wide, surfel, mesh or split request of a tier,
+                // or before the tier had receivers, is encoded again with what those receivers need
+                bool isEncodingRequired = false;
+
+                for (int tier = 0; tier < numTiers; tier++)
+                {
+                    if (tierRequests[tier].IsUsed && (encodedFrames[tier] == null || encodedFrames[tier].Version != version
+                        || !tierRequests[tier].IsEncodedIn(encodedFrames[tier])))
+                        isEncodingRequired = true;
+                }
+
+                if (isEncodingRequired)
+                {
+                    // The frame is encoded once for all the clients of each tier, and held by the set until the sender
+                    // moves on to a newer one
+                    EncodedFrameSet frameSet = new EncodedFrameSet { Frame = FrameStore.AcquireLatestFrame(), NumTiers = numTiers };
+                    MergedFrame frame = frameSet.Frame;
+
+                    // The frames merged while the previous one was encoded are never sent
+                    if (lastVersion > 0 && frame.Version > lastVersion + 1)
+                        Interlocked.Add(ref numSkippedFrames, frame.Version - lastVersion - 1);
+
+                    lastVersion = Math.Max(lastVersion, frame.Version);
+
+                    // The finest tier has the scale set by the number of points and each tier below it a ratio of the scale
+                    // of the tier above; the scale of the coarsest tier follows the rate control. A single tier keeps the
+                    // scale of the rate control for all the receivers.
+                    RateController.TargetFps = Settings.TransferTargetFps;
+                    short pointScale = PointCloudFrameEncoder.DetermineScale(frame.VertexCount);
+
+                    for (int tier = 0; tier < MaxTransferTiers; tier++)
+                    {
+                        if (tier >= numTiers || !tierRequests[tier].IsUsed)
+                        {
+                            encodedFrames[tier]?.Release();
+                            encodedFrames[tier] = null;
+                            tierScales[tier] = 0;
+                            continue;
+                        }
+
+                        PointCloudFrameEncoder encoder = pointCloudEncoders[tier];
+                        short tierScale = numTiers > 1 ? (short)Math.Max(PointCloudFrameEncoder.MinScale, pointScale * Math.Pow(Settings.TransferTierScaleRatio, tier))
+                            : PointCloudFrameEncoder.MaxScale;
+
+                        encoder.TargetScale = numTiers > 1 ? tierScale : (short)0;
+
+                        if (tier == numTiers - 1)
+                        {
+                            short rateScale = RateController.Update(coarsestTierClients, encodedFrames[tier], PointCloudFrameEncoder.MinScale, tierScale);
+
+                            if (rateScale > 0)
+                                encoder.TargetScale = rateScale;
+                        }
+
+                        ConfigureEncoder(encoder, tier);
+                        encoder.SetFrame(frame);
+
+                        TierRequests requests = tierRequests[tier];
+                        encodedFrames[tier]?.Release();
+
+                        using (ServerTrace.Zone("Encode"))
+                            encodedFrames[tier] = encoder.Encode(frame.Version, requests.IsDeltaRequested, requests.IsOctreeRequested, requests.IsProgressiveRequested,
+                                requests.IsWideRequested, requests.IsMeshRequested, requests.IsSurfelRequested, requests.IsSplitRequested,
+                                requests.IsTiledRequested);
+
+                        tierScales[tier] = BitConverter.ToInt16(encodedFrames[tier].FullFrame.Array, encodedFrames[tier].FullFrame.Offset);
+                    }
+
+                    for (int tier = 0; tier < MaxTransferTiers; tier++)
+                    {
+                        encodedFrames[tier]?.AddReference();
+                        frameSet.Frames[tier] = encodedFrames[tier];
+                    }
+
+                    using (pointCloudClientLock.Enter())
+                        RateController.UpdateTiers(pointCloudClients, tierScales, numTiers);
+
+                    try
+                    {
+                        // Waits for the sender when it is still behind on the frames queued before
+                        encodedFrameSets.Add(frameSet, token);
+                        pointCloudSendSignal.Release();
+                    }
+                    catch (OperationCanceledException)
+                    {
+                        frameSet.Dispose();
+                    }
                 }
 
-                await Task.Delay(100);
+                await WaitForSignal(pointCloudEncodeSignal, token);
             }
+
+            foreach (EncodedPointCloud frame in encodedFrames)
+                frame?.Release();
         }
 
         /// <summary>
-        /// Sends point cloud data to all connected clients at regular intervals
+        /// Sends the latest encoded point cloud to all connected clients as soon as it is available and they have
+        /// requested it
         /// </summary>
         /// <param name="token">Cancellation token to stop the Task</param>
         /// <returns>Task representing the sender</returns>
         private async Task SendPointCloudToAllClients(CancellationToken token)
         {
+            EncodedFrameSet frameSet = null; // Latest frames encoded, sent again to the clients as they become ready
+            EncodedFrameSet nextFrameSet;
+
             while (isPointCloudServerRunning && !token.IsCancellationRequested)
             {
-                // Send latest point cloud to all connected clients
-                for (int i = 0; i < pointCloudClients.Count; i++)
+                // Only the latest frames queued are sent, since the sockets only ever hold the latest frame as well
+                while (encodedFrameSets.TryTake(out nextFrameSet, 0))
                 {
-                    // Send a point cloud frame
-                    lock (Vertices)
+                    frameSet?.Dispose();
+                    frameSet = nextFrameSet;
+
+                    // The views are encoded from the frame of the set, on encoders of their own since the encoder of
+                    // each tier moves on to the next frame meanwhile
+                    for (int tier = 0; tier < frameSet.NumTiers; tier++)
                     {
-                        pointCloudClients[i].SendPointCloud(Vertices, Colors);
+                        ConfigureEncoder(viewEncoders[tier], tier);
+                        viewEncoders[tier].SetFrame(frameSet.Frame);
                     }
                 }
 
-                await Task.Delay(10);
+                if (frameSet != null)
+                    SendFrameSet(frameSet);
+
+                await WaitForSignal(pointCloudSendSignal, token);
             }
+
+            frameSet?.Dispose();
+
+            while (encodedFrameSets.TryTake(out nextFrameSet, 0))
+                nextFrameSet.Dispose();
         }
 
         /// <summary>
-        /// Sends document data to all connected clients at regular intervals
+        /// Sends the latest point cloud of their tier to all connected clients which requested it, and that of the finest
+        /// tier once to the multicast group; the full frames of the clients which sent their view pose only hold what
+        /// they can see, but the delta, split and tiled frames, whose voxels are shared by their receivers
+        /// </summary>
+        private void SendFrameSet(EncodedFrameSet frameSet)
+        {
+            EncodedPointCloud[] encodedFrames = frameSet.Frames;
+
+            using (pointCloudClientLock.Enter())
+            using (ServerTrace.Zone("Send"))
+            {
+                foreach (PointCloudTransferSocket client in pointCloudClients)
+                {
+                    if (client.TargetTier < frameSet.NumTiers)
+                        client.UpdateTier(encodedFrames[client.TargetTier]);
+
+                    EncodedPointCloud encodedFrame = client.Tier < frameSet.NumTiers ? encodedFrames[client.Tier] : null;
+
+                    if (encodedFrame == null)
+                        continue;
+
+                    ViewPose viewPose = client.ViewPose;
+
+                    if (viewPose != null && !client.IsDeltaRequested && !client.IsSplitRequested && !client.IsTiledRequested && client.IsWaitingForFrame(encodedFrame.Version))
+                    {
+                        // The socket holds the view while it sends it
+                        EncodedPointCloud view = viewEncoders[client.Tier].EncodeView(encodedFrame, viewPose, client.IsOctreeRequested, client.IsProgressiveRequested,
+                            client.IsWideRequested, client.IsSurfelRequested);
+
+                        client.SendPointCloud(view);
+                        view.Release();
+                    }
+                    else
+                        client.SendPointCloud(encodedFrame);
+                }
+
+                pointCloudMulticaster.SendPointCloud(encodedFrames[0], pointCloudClients);
+            }
+        }
+
+        /// <summary>
+        /// Whether any document receiver takes the documents as compressed textures
+        /// </summary>
+        private bool IsDocumentTextureRequested()
+        {
+            using (documentClientLock.Enter())
+            {
+                foreach (DocumentTransferSocket client in documentClients)
+                {
+                    if (client.IsCompressedTextureRequested)
+                        return true;
+                }
+            }
+
+            return false;
+        }
+
+        /// <summary>
+        /// Sends each new document to all connected clients, checking for one at regular intervals
         /// </summary>
         /// <param name="token">Cancellation token to stop the Task</param>
         /// <returns>Task representing the sender</returns>
@@ -284,19 +794,45 @@ namespace LiveScanServer
             {
                 if (DocumentInfo.IsNew)
                 {
-                    lock (DocumentInfo)
+                    byte[] jpeg;
+                    short width;
+                    short height;
+
+                    using (DocumentInfo.Lock.Enter())
                     {
-                        // Send latest document to all connected clients
-                        for (int i = 0; i < documentClients.Count; i++)
+                        jpeg = DocumentInfo.Jpeg;
+                        width = DocumentInfo.Width;
+                        height = DocumentInfo.Height;
+                        DocumentInfo.IsNew = false;
+                    }
+
+                    // The document is encoded once by the camera client, at the largest size the receivers render it at, and
+                    // the same buffer is sent to every receiver; it is transcoded once, when any receiver asks for a texture
+                    if (jpeg != null && jpeg.Length > 0)
+                    {
+                        byte[] texture = null;
+
+                        if (Settings.IsDocumentTextureCompressionEnabled && IsDocumentTextureRequested())
+                            texture = await Task.Run(() => DocumentTextureEncoder.Encode(jpeg));
+
+                        using (documentClientLock.Enter())
                         {
-                            documentClients[i].SendDocument(DocumentInfo.Data, DocumentInfo.Width, DocumentInfo.Height);
+                            foreach (DocumentTransferSocket client in documentClients)
+                            {
+                                byte[] document = client.IsCompressedTextureRequested && texture != null ? texture : jpeg;
+                                client.SendDocument(document, width, height, Settings.TransferDocumentMaxKBps * 1000);
+                            }
                         }
                     }
-
-                    DocumentInfo.IsNew = false;
                 }
 
-                await Task.Delay(100);
+                try
+                {
+                    await Task.Delay(100, token);
+                }
+                catch (OperationCanceledException)
+                {
+                }
             }
         }
     }
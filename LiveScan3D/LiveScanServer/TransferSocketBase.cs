@@ -7,7 +7,8 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module contains some base logic for modules which use a TCP socket to
-send data to connected clients.
+send data to connected clients, and records the messages they write to the
+stream capture of the server while it captures.
 
 This code was adapted from the following research: 
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive 
@@ -17,7 +18,9 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 \***************************************************************************/
 
 using System;
+using System.Collections.Generic;
 using System.Net.Sockets;
+using System.Threading.Tasks;
 
 namespace LiveScanServer
 {
@@ -25,11 +28,109 @@ namespace LiveScanServer
     {
         protected TcpClient socket;
 
+        // Capture the messages are recorded to, null when the server does not capture; the capture of a message is that
+        // of the time it started, so that a capture only holds whole messages
+        private volatile StreamCapture capture = null;
+        private CapturedStream capturedStream;
+        private StreamCapture messageCapture = null;
+
+        // Buffers written together by the next FlushAsync; a single message is written at a time
+        private readonly List<ArraySegment<byte>> queuedWrites = new List<ArraySegment<byte>>();
+
+        public int ConnectionId { get; set; } // Unique across the receivers of the server, set when they connect
+
         public TransferSocketBase(TcpClient clientSocket)
         {
             socket = clientSocket;
         }
 
+        /// <summary>
+        /// Enlarges the send buffer of a socket to the size its transport needs; the buffer the system chose is kept
+        /// when it is larger
+        /// </summary>
+        public static void EnlargeSendBuffer(Socket socket, int sendBufferSize)
+        {
+            if (socket.SendBufferSize < sendBufferSize)
+                socket.SendBufferSize = sendBufferSize;
+        }
+
+        /// <summary>
+        /// Sets the options of the socket for its transport: the writes are sent without waiting for more data, as the
+        /// messages are written whole, and the send buffer takes the bytes the transport writes at once
+        /// </summary>
+        protected void SetSocketOptions(int sendBufferSize)
+        {
+            socket.NoDelay = true;
+            EnlargeSendBuffer(socket.Client, sendBufferSize);
+        }
+
+        /// <summary>
+        /// Sets the capture the next messages are recorded to, or stops recording them when null
+        /// </summary>
+        public void SetCapture(StreamCapture capture, CapturedStream stream)
+        {
+            capturedStream = stream;
+            this.capture = capture;
+        }
+
+        /// <summary>
+        /// Starts a message: its writes are recorded to the capture of the server if it captured when it started
+        /// </summary>
+        protected void BeginMessage()
+        {
+            messageCapture = capture;
+        }
+
+        /// <summary>
+        /// Writes to the socket, recording the write to the capture of the message
+        /// </summary>
+        protected Task WriteAsync(byte[] buffer, int offset, int count)
+        {
+            messageCapture?.Record(capturedStream, ConnectionId, buffer, offset, count);
+
+            return socket.GetStream().WriteAsync(buffer, offset, count);
+        }
+
+        /// <summary>
+        /// Queues a buffer to be written by the next FlushAsync, along with the others queued, so that the headers of a
+        /// message leave in the same send, and packets, as the body they precede. The buffer must not change until then.
+        /// </summary>
+        protected void QueueWrite(byte[] buffer, int offset, int count)
+        {
+            queuedWrites.Add(new ArraySegment<byte>(buffer, offset, count));
+        }
+
+        /// <summary>
+        /// Writes the queued buffers to the socket in a single send, recording them to the capture of the message
+        /// </summary>
+        protected async Task FlushAsync()
+        {
+            if (queuedWrites.Count == 0)
+                return;
+
+            foreach (ArraySegment<byte> buffer in queuedWrites)
+                messageCapture?.Record(capturedStream, ConnectionId, buffer.Array, buffer.Offset, buffer.Count);
+
+            try
+            {
+                int numBytesSent = await socket.Client.SendAsync(queuedWrites, SocketFlags.None);
+
+                // The send can take only the first bytes of the buffers when the send buffer is full; the rest follows
+                foreach (ArraySegment<byte> buffer in queuedWrites)
+                {
+                    int numBufferBytesSent = Math.Min(numBytesSent, buffer.Count);
+                    numBytesSent -= numBufferBytesSent;
+
+                    if (numBufferBytesSent < buffer.Count)
+                        await socket.GetStream().WriteAsync(buffer.Array, buffer.Offset + numBufferBytesSent, buffer.Count - numBufferBytesSent);
+                }
+            }
+            finally
+            {
+                queuedWrites.Clear();
+            }
+        }
+
         public void Stop()
         {
             if (IsConnected())
@@ -32,6 +32,45 @@ namespace LiveScanServer
         Unknown
     }
 
+    // Neighbour search used by the outlier filter of the clients
+    public enum FilterMode
+    {
+        KdTree,
+        Organized
+    }
+
+    // Color stream profiles requested from the cameras; the closest available profile is used when one is not supported
+    public enum ColorResolution
+    {
+        Res2560x1440,
+        Res1920x1080,
+        Res1280x720
+    }
+
+    // Handling of the static background points by the clients
+    public enum BackgroundMode
+    {
+        Kept,
+        Dropped,
+        Refreshed
+    }
+
+    // Depth stream of the cameras; the automatic binning follows the point budget
+    public enum DepthBinningMode
+    {
+        Unbinned,
+        Binned,
+        Auto
+    }
+
+    // Processors the capture and frame loop threads of each camera run on
+    public enum ThreadAffinityMode
+    {
+        None,
+        NumaNode,
+        CoreSet
+    }
+
     public struct Point3f
     {
         public float X;
@@ -76,6 +115,8 @@ namespace LiveScanServer
         public bool Filter;
         public int NumFilterNeighbors;
         public float FilterThreshold;
+        public int FilterMode;
+        public int BackgroundMode;
 
         public IntPtr MarkerPoses;
         public int NumMarkers;
@@ -83,6 +124,88 @@ namespace LiveScanServer
         [MarshalAs(UnmanagedType.I1)]
         public bool IsAutoExposureEnabled;
         public int ExposureStep;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsGpuProcessingEnabled;
+        public int NumWorkerThreads;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsFrameCallbackEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsSdkProcessingEnabled;
+
+        public int ColorWidth;
+        public int ColorHeight;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsColorMjpgEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsDocumentBurstEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsDepthDenoiseEnabled;
+        public int PointBudget;
+        public float CaptureRange;
+        public int RingRecordingSeconds;
+        public int RecordingCompressionLevel;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsRecordingDeltaEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsRawRecordingEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsLeanMemoryEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsNormalEstimationEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsConsumerPacingEnabled;
+
+        public int FrameDecimation;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsColorDownscaleEnabled;
+
+        public int DepthBinningMode;
+
+        public int FrameTimeBudgetMs;
+
+        public int ThreadAffinityMode;
+
+        public int CoresPerCamera;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsLargePagesEnabled;
+
+        public int PeripheralVoxelScale;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsDepthHoleFillEnabled;
+
+        public int FramePairingToleranceUs;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsColorYuvEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsProcessingStaggered;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsAdaptiveRoiEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsTemporalFilterEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsInterleavedRecordingEnabled;
+
+        [MarshalAs(UnmanagedType.I1)]
+        public bool IsStaticFrameReuseEnabled;
     }
 
     [StructLayout(LayoutKind.Sequential)]
@@ -92,6 +215,108 @@ namespace LiveScanServer
         public fixed float T[3]; // translation vector
     }
 
+    // Values shared with the ClientEventType enum of the clients
+    public enum ClientEventType
+    {
+        SerialNumber = 0,
+        Recorded = 1,
+        Calibrated = 2,
+        SyncState = 3,
+        MasterRestart = 4,
+        Document = 5,
+        LoadShed = 6
+    }
+
+    // Values shared with the PerfStage enum of the clients
+    public enum PerfStage
+    {
+        Frame = 0,
+        Acquire = 1,
+        FrameWait = 2,
+        PointCloud = 3,
+        Process = 4,
+        Filter = 5,
+        Document = 6,
+        Store = 7
+    }
+
+    // Timings of a stage of the frame loop of a client since they were last read
+    [StructLayout(LayoutKind.Sequential)]
+    public struct PerfStageStats
+    {
+        public PerfStage Stage;
+        public uint Count;
+        public float MeanMs;
+        public float P50Ms;
+        public float P95Ms;
+        public float P99Ms;
+        public float MaxMs;
+    }
+
+    // Sorts the buffers of a client in ClientMemoryStats, in the order of MemoryCategory in memoryUsage.h
+    public enum MemoryCategory
+    {
+        Capture = 0,
+        Processing = 1,
+        Frame = 2,
+        VoxelGrid = 3,
+        Filter = 4,
+        Background = 5,
+        Document = 6,
+        Ring = 7,
+        Arena = 8
+    }
+
+    // Bytes held by the buffers of a client by MemoryCategory, not counting the camera SDK and the GPU
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct ClientMemoryStats
+    {
+        public const int NumCategories = 9;
+
+        public fixed ulong Bytes[NumCategories];
+        public ulong TotalBytes;
+    }
+
+    // Points of the last processed frame of a client at each step of the processing, and the space they fill
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct FrameFunnelStats
+    {
+        public ulong SequenceNumber;
+        public uint NumDepthPixels;
+        public uint NumSourcePoints;
+        public uint NumBackgroundPoints;
+        public uint NumOutOfBoundsPoints;
+        public uint NumExcludedPoints;
+        public uint NumDuplicatePoints;
+        public uint NumForeignPoints;
+        public uint NumSparsePoints;
+        public uint NumOutlierPoints;
+        public uint NumReusedBackgroundPoints;
+        public uint NumSentPoints;
+        public fixed float ContentMin[3];
+        public fixed float ContentMax[3];
+        public float VoxelSize;
+        public uint NumOccupiedVoxels;
+        public float VoxelFillRatio;
+        public int DepthWidth;
+        public int DepthHeight;
+        public int RoiLeft; // Region of the depth frame the points were generated from; the whole frame without the adaptive region
+        public int RoiTop;
+        public int RoiRight;
+        public int RoiBottom;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct ClientEvent
+    {
+        public int ClientIndex;
+        public ClientEventType Type;
+        public int Value; // Sync state, id of the marker used by the calibration, size of the document, or load shed level
+        public fixed float R[9]; // World rotation of the calibration, row-major
+        public fixed float T[3]; // World translation of the calibration
+        public fixed byte Text[64]; // Serial number, null-terminated
+    }
+
     [Serializable]
     public class AffineTransform
     {
@@ -195,11 +420,14 @@ namespace LiveScanServer
 
     public class DocumentInfo
     {
-        public List<byte> Data { get; set; } = new List<byte>();
+        public byte[] Jpeg { get; set; } = new byte[0];
         public float Score { get; set; }
         public short Width { get; set; }
         public short Height { get; set; }
         public bool IsNew { get; set; }
+
+        // Taken by the transfer server while it reads a new document
+        public readonly ProfiledLock Lock = new ProfiledLock("document info");
     }
 
     public class Utils
@@ -0,0 +1,189 @@
+﻿/***************************************************************************\
+
+Module Name:  ViewPose.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is the head pose and field of view sent back by a receiver,
+in the coordinates of the merged point cloud. It is used to drop the points
+a receiver cannot see: the points out of its view frustum, and the points of
+the cameras which look at the other side of the scene, since the view
+direction of a camera is a cheap proxy for the normals of the surfaces it
+captures. The tiled frames send the tiles the receiver can see first, nearest
+first.
+
+\***************************************************************************/
+
+using System;
+using System.Collections.Generic;
+
+namespace LiveScanServer
+{
+    public sealed class ViewPose
+    {
+        // Wire size: position, forward and up directions (3 floats each), tangents of the half fields of view (2 floats)
+        public const int Size = 11 * sizeof(float);
+
+        // The head moves while the frames are sent, so the frustum is widened by this ratio
+        private const float FrustumMargin = 1.3f;
+
+        // Cosine of the angle between the view directions of a camera and of the receiver past which the surfaces
+        // captured by the camera face away from the receiver; slightly negative to keep the surfaces seen at grazing angles
+        private const float BackFacingThreshold = -0.2f;
+
+        private readonly float[] position = new float[3];
+        private readonly float[] forward = new float[3];
+        private readonly float[] up = new float[3];
+        private readonly float[] right = new float[3];
+        private readonly float tanHalfFovX;
+        private readonly float tanHalfFovY;
+
+        /// <summary>
+        /// Reads a pose sent by a receiver
+        /// </summary>
+        /// <param name="buffer">Position, forward direction, up direction, tangents of the horizontal and vertical half fields of view</param>
+        public ViewPose(byte[] buffer)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                position[i] = BitConverter.ToSingle(buffer, 4 * i);
+                forward[i] = BitConverter.ToSingle(buffer, 12 + 4 * i);
+                up[i] = BitConverter.ToSingle(buffer, 24 + 4 * i);
+            }
+
+            Normalize(forward);
+            Normalize(up);
+
+            right[0] = forward[1] * up[2] - forward[2] * up[1];
+            right[1] = forward[2] * up[0] - forward[0] * up[2];
+            right[2] = forward[0] * up[1] - forward[1] * up[0];
+
+            tanHalfFovX = BitConverter.ToSingle(buffer, 36) * FrustumMargin;
+            tanHalfFovY = BitConverter.ToSingle(buffer, 40) * FrustumMargin;
+        }
+
+        /// <summary>
+        /// Copies the vertices of a merged frame which the receiver can see
+        /// </summary>
+        /// <param name="vertices">Vertices of the merged frame (x, y, z for each vertex)</param>
+        /// <param name="colors">Colors of the merged frame (r, g, b for each vertex)</param>
+        /// <param name="numVertices">Number of vertices of the merged frame</param>
+        /// <param name="cameraVertexCounts">Number of vertices of each camera, in the order they were merged</param>
+        /// <param name="cameraPoses">Pose of each camera in the coordinates of the frame</param>
+        /// <param name="visibleVertices">Receives the visible vertices</param>
+        /// <param name="visibleColors">Receives the colors of the visible vertices</param>
+        /// <param name="normals">Optional normals of the merged frame (one byte for each vertex)</param>
+        /// <param name="visibleNormals">Receives the normals of the visible vertices, when the normals are given</param>
+        /// <returns>The number of visible vertices</returns>
+        public int Cull(float[] vertices, byte[] colors, int numVertices, List<int> cameraVertexCounts, List<AffineTransform> cameraPoses,
+            float[] visibleVertices, byte[] visibleColors, byte[] normals = null, byte[] visibleNormals = null)
+        {
+            int numVisible = 0;
+            int start = 0;
+
+            for (int camera = 0; start < numVertices; camera++)
+            {
+                // Vertices which are not attributed to a camera are only tested against the frustum
+                int end = camera < cameraVertexCounts.Count ? Math.Min(numVertices, start + cameraVertexCounts[camera]) : numVertices;
+
+                if (camera < cameraPoses.Count && IsBackFacing(cameraPoses[camera]))
+                {
+                    start = end;
+                    continue;
+                }
+
+                for (int i = start; i < end; i++)
+                {
+                    if (!IsInFrustum(vertices[3 * i], vertices[3 * i + 1], vertices[3 * i + 2]))
+                        continue;
+
+                    Buffer.BlockCopy(vertices, 3 * i * sizeof(float), visibleVertices, 3 * numVisible * sizeof(float), 3 * sizeof(float));
+                    Buffer.BlockCopy(colors, 3 * i, visibleColors, 3 * numVisible, 3);
+
+                    if (normals != null)
+                        visibleNormals[numVisible] = normals[i];
+
+                    numVisible++;
+                }
+
+                start = end;
+            }
+
+            return numVisible;
+        }
+
+        /// <summary>
+        /// Checks whether a camera looks at the scene from the other side than the receiver. A camera looks along the
+        /// z axis of its pose.
+        /// </summary>
+        private bool IsBackFacing(AffineTransform cameraPose)
+        {
+            float cosAngle = cameraPose.R[0, 2] * forward[0] + cameraPose.R[1, 2] * forward[1] + cameraPose.R[2, 2] * forward[2];
+            return cosAngle < BackFacingThreshold;
+        }
+
+        /// <summary>
+        /// Checks whether a sphere is at least partly in the view frustum of the receiver
+        /// </summary>
+        public bool IsSphereInFrustum(float x, float y, float z, float radius)
+        {
+            float dx = x - position[0];
+            float dy = y - position[1];
+            float dz = z - position[2];
+
+            float depth = dx * forward[0] + dy * forward[1] + dz * forward[2];
+
+            if (depth <= -radius)
+                return false;
+
+            // The distance of the center to each side plane, whose normal makes the half field of view with the forward direction
+            float horizontal = dx * right[0] + dy * right[1] + dz * right[2];
+            float vertical = dx * up[0] + dy * up[1] + dz * up[2];
+
+            return Math.Abs(horizontal) - depth * tanHalfFovX <= radius * (float)Math.Sqrt(1.0f + tanHalfFovX * tanHalfFovX)
+                && Math.Abs(vertical) - depth * tanHalfFovY <= radius * (float)Math.Sqrt(1.0f + tanHalfFovY * tanHalfFovY);
+        }
+
+        /// <summary>
+        /// Distance of a point to the receiver, in meters
+        /// </summary>
+        public float GetDistance(float x, float y, float z)
+        {
+            float dx = x - position[0];
+            float dy = y - position[1];
+            float dz = z - position[2];
+
+            return (float)Math.Sqrt(dx * dx + dy * dy + dz * dz);
+        }
+
+        private bool IsInFrustum(float x, float y, float z)
+        {
+            float dx = x - position[0];
+            float dy = y - position[1];
+            float dz = z - position[2];
+
+            float depth = dx * forward[0] + dy * forward[1] + dz * forward[2];
+
+            if (depth <= 0.0f)
+                return false;
+
+            float horizontal = dx * right[0] + dy * right[1] + dz * right[2];
+            float vertical = dx * up[0] + dy * up[1] + dz * up[2];
+
+            return Math.Abs(horizontal) <= depth * tanHalfFovX && Math.Abs(vertical) <= depth * tanHalfFovY;
+        }
+
+        private static void Normalize(float[] vector)
+        {
+            float length = (float)Math.Sqrt(vector[0] * vector[0] + vector[1] * vector[1] + vector[2] * vector[2]);
+
+            if (length <= 0.0f)
+                return;
+
+            for (int i = 0; i < 3; i++)
+                vector[i] /= length;
+        }
+    }
+}
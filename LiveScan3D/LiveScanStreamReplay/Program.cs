@@ -0,0 +1,284 @@
+﻿/***************************************************************************\
+
+Module Name:  Program.cs
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is the main entry point of the stream replay, which plays a
+capture of the transfer server back to a receiver, so that a stream which
+stuttered on a headset can be replayed to it byte for byte without cameras.
+It listens on the point cloud and document ports of the server, and writes
+the bytes the server wrote to one connection of each stream, at the pacing
+of the capture or as fast as the receiver reads them. The requests of the
+receiver are read and dropped, since the capture already holds the replies.
+
+\***************************************************************************/
+
+using System;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+using System.Threading;
+using System.Threading.Tasks;
+using LiveScanServer;
+
+namespace LiveScanStreamReplay
+{
+    static class Program
+    {
+        // Below this, the writes wait by spinning, since a sleep can take a whole scheduler tick
+        private const long MinSleepUs = 2000;
+
+        private const string Usage =
+            "LiveScanStreamReplay.exe --capture <path> [--port <port>] [--document-port <port>] [--connection <id>]\n" +
+            "                         [--document-connection <id>] [--fast] [--loop]";
+
+        private class ReplayOptions
+        {
+            public string CapturePath = null;
+            public int PointCloudPort = 48002;
+            public int DocumentPort = 48003;
+            public int PointCloudConnection = -1; // The first connection of the capture when negative
+            public int DocumentConnection = -1;
+            public bool IsPaced = true;
+            public bool IsLooping = false;
+        }
+
+        private class ReplayStats
+        {
+            public long NumWrites = 0;
+            public long NumBytes = 0;
+            public long NumSkippedWrites = 0; // Document writes made before a document receiver connected
+            public long MaxLateUs = 0;
+            public int NumPasses = 0;
+        }
+
+        /// <summary>
+        /// Main entry point for the application
+        /// </summary>
+        static int Main(string[] args)
+        {
+            ReplayOptions options;
+
+            try
+            {
+                options = ParseOptions(args);
+            }
+            catch (Exception e) when (e is FormatException || e is ArgumentException || e is IndexOutOfRangeException)
+            {
+                Console.Error.WriteLine(e.Message);
+                Console.Error.WriteLine(Usage);
+                return 1;
+            }
+
+            try
+            {
+                FindConnections(options);
+            }
+            catch (Exception e) when (e is IOException || e is UnauthorizedAccessException)
+            {
+                Console.Error.WriteLine(e.Message);
+                return 1;
+            }
+
+            if (options.PointCloudConnection < 0)
+            {
+                Console.Error.WriteLine($"{options.CapturePath} holds no point cloud stream.");
+                return 1;
+            }
+
+            TcpListener pointCloudListener = new TcpListener(IPAddress.Any, options.PointCloudPort);
+            TcpListener documentListener = new TcpListener(IPAddress.Any, options.DocumentPort);
+            pointCloudListener.Start();
+            documentListener.Start();
+
+            Console.Error.WriteLine($"Replaying point cloud connection {options.PointCloudConnection}" +
+                (options.DocumentConnection >= 0 ? $" and document connection {options.DocumentConnection}" : "") +
+                $", waiting for a receiver on port {options.PointCloudPort}");
+
+            TcpClient pointCloudClient = pointCloudListener.AcceptTcpClient();
+            pointCloudClient.NoDelay = true;
+            DrainRequests(pointCloudClient);
+
+            // The receiver may not open the document stream; its writes are skipped until it does
+            TcpClient documentClient = null;
+            Task<TcpClient> documentAccept = options.DocumentConnection >= 0 ? documentListener.AcceptTcpClientAsync() : null;
+
+            ReplayStats stats = new ReplayStats();
+            Stopwatch stopwatch = Stopwatch.StartNew();
+
+            try
+            {
+                do
+                {
+                    using (StreamCaptureReader reader = new StreamCaptureReader(options.CapturePath))
+                    {
+                        CapturedWrite write;
+                        long firstTimeUs = -1;
+                        long passStartUs = stopwatch.ElapsedTicks * 1000000 / Stopwatch.Frequency;
+
+                        while (reader.ReadNext(out write))
+                        {
+                            bool isPointCloud = write.Stream == CapturedStream.PointCloud && write.ConnectionId == options.PointCloudConnection;
+                            bool isDocument = write.Stream == CapturedStream.Document && write.ConnectionId == options.DocumentConnection;
+
+                            if (!isPointCloud && !isDocument)
+                                continue;
+
+                            if (firstTimeUs < 0)
+                                firstTimeUs = write.TimeUs;
+
+                            if (options.IsPaced)
+                            {
+                                long lateUs = WaitUntil(stopwatch, passStartUs + write.TimeUs - firstTimeUs);
+                                stats.MaxLateUs = Math.Max(stats.MaxLateUs, lateUs);
+                            }
+
+                            if (isDocument && documentClient == null && documentAccept.IsCompleted)
+                            {
+                                documentClient = documentAccept.Result;
+                                documentClient.NoDelay = true;
+                                DrainRequests(documentClient);
+                            }
+
+                            TcpClient client = isPointCloud ? pointCloudClient : documentClient;
+
+                            if (client == null)
+                            {
+                                stats.NumSkippedWrites++;
+                                continue;
+                            }
+
+                            client.GetStream().Write(write.Data, 0, write.Data.Length);
+                            stats.NumWrites++;
+                            stats.NumBytes += write.Data.Length;
+                        }
+                    }
+
+                    stats.NumPasses++;
+                } while (options.IsLooping);
+            }
+            catch (IOException)
+            {
+                Console.Error.WriteLine("The receiver disconnected.");
+            }
+
+            double seconds = stopwatch.Elapsed.TotalSeconds;
+            Console.Error.WriteLine(string.Format(CultureInfo.InvariantCulture,
+                "{0} passes, {1} writes, {2} bytes in {3:F1} s ({4:F1} Mbit/s), {5} document writes skipped, latest write {6:F1} ms behind the capture",
+                stats.NumPasses, stats.NumWrites, stats.NumBytes, seconds, seconds > 0 ? stats.NumBytes * 8 / seconds / 1e6 : 0,
+                stats.NumSkippedWrites, stats.MaxLateUs / 1000.0));
+
+            pointCloudClient.Close();
+            documentClient?.Close();
+            pointCloudListener.Stop();
+            documentListener.Stop();
+
+            return 0;
+        }
+
+        private static ReplayOptions ParseOptions(string[] args)
+        {
+            ReplayOptions options = new ReplayOptions();
+
+            for (int i = 0; i < args.Length; i++)
+            {
+                switch (args[i])
+                {
+                    case "--capture":
+                        options.CapturePath = args[++i];
+                        break;
+                    case "--port":
+                        options.PointCloudPort = int.Parse(args[++i]);
+                        break;
+                    case "--document-port":
+                        options.DocumentPort = int.Parse(args[++i]);
+                        break;
+                    case "--connection":
+                        options.PointCloudConnection = int.Parse(args[++i]);
+                        break;
+                    case "--document-connection":
+                        options.DocumentConnection = int.Parse(args[++i]);
+                        break;
+                    case "--fast":
+                        options.IsPaced = false;
+                        break;
+                    case "--loop":
+                        options.IsLooping = true;
+                        break;
+                    default:
+                        throw new ArgumentException($"Unknown option {args[i]}");
+                }
+            }
+
+            if (string.IsNullOrEmpty(options.CapturePath))
+                throw new ArgumentException("No capture given");
+
+            return options;
+        }
+
+        /// <summary>
+        /// Picks the first connection of each stream of the capture for the streams whose connection was not given
+        /// </summary>
+        private static void FindConnections(ReplayOptions options)
+        {
+            using (StreamCaptureReader reader = new StreamCaptureReader(options.CapturePath))
+            {
+                CapturedWrite write;
+
+                while ((options.PointCloudConnection < 0 || options.DocumentConnection < 0) && reader.ReadNext(out write))
+                {
+                    if (write.Stream == CapturedStream.PointCloud && options.PointCloudConnection < 0)
+                        options.PointCloudConnection = write.ConnectionId;
+                    else if (write.Stream == CapturedStream.Document && options.DocumentConnection < 0)
+                        options.DocumentConnection = write.ConnectionId;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Reads the requests of a receiver in the background and drops them, so that its socket never fills up
+        /// </summary>
+        private static void DrainRequests(TcpClient client)
+        {
+            Task.Run(() =>
+            {
+                byte[] buffer = new byte[4096];
+
+                try
+                {
+                    while (client.GetStream().Read(buffer, 0, buffer.Length) > 0)
+                    {
+                    }
+                }
+                catch (Exception e) when (e is IOException || e is ObjectDisposedException || e is InvalidOperationException)
+                {
+                }
+            });
+        }
+
+        /// <summary>
+        /// Waits until the stopwatch reaches the given time
+        /// </summary>
+        /// <returns>How late the wait ended, in microseconds, when the time had already passed</returns>
+        private static long WaitUntil(Stopwatch stopwatch, long timeUs)
+        {
+            while (true)
+            {
+                long remainingUs = timeUs - stopwatch.ElapsedTicks * 1000000 / Stopwatch.Frequency;
+
+                if (remainingUs <= 0)
+                    return -remainingUs;
+
+                if (remainingUs > MinSleepUs)
+                    Thread.Sleep((int)((remainingUs - MinSleepUs) / 1000) + 1);
+                else
+                    Thread.SpinWait(100);
+            }
+        }
+    }
+}
@@ -0,0 +1,91 @@
+/***************************************************************************\
+
+Module Name:  GpuNeighbourSearch.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module finds the nearest neighbours of the alignments with a
+DirectCompute shader, for the large point clouds whose KD-tree searches
+dominate the alignments. The target points are sorted in a uniform grid,
+and each query point searches the cells around its own. The results which
+the searched cells cannot guarantee are left to the KD-trees.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// The Direct3D headers are only included by the implementation, so that the Windows macros stay out of the alignments
+struct ID3D11Device;
+struct ID3D11DeviceContext;
+struct ID3D11ComputeShader;
+struct ID3D11Buffer;
+struct ID3D11ShaderResourceView;
+struct ID3D11UnorderedAccessView;
+
+// Uniform grid of the points of a target on the GPU, sorted by cell
+struct GpuNeighbourGrid
+{
+	ID3D11Buffer* PointBuffer = nullptr;
+	ID3D11ShaderResourceView* PointView = nullptr;
+	ID3D11Buffer* CellBuffer = nullptr; // Index of the first point of each cell, and one past the last point
+	ID3D11ShaderResourceView* CellView = nullptr;
+
+	float Min[3];
+	float CellSize;
+	unsigned int Size[3];
+
+	~GpuNeighbourGrid();
+};
+
+class GpuNeighbourSearch
+{
+public:
+	static GpuNeighbourSearch& Instance();
+
+	~GpuNeighbourSearch();
+
+	bool SetEnabled(bool isEnabled);
+	bool IsEnabled() const;
+	std::unique_ptr<GpuNeighbourGrid> CreateGrid(const float* points, int numPoints);
+	bool FindNearestNeighbours(const GpuNeighbourGrid& grid, const float* queryPoints, int numQueries, std::vector<float>& distances, std::vector<int>& indices);
+
+private:
+	const int ThreadGroupSize = 64;
+
+	// The cells are about twice the mean spacing of the points in the volume of the grid, with a bound on their number
+	const float CellSizeScale = 2.0f;
+	const unsigned int MaxGridCells = 1 << 22;
+
+	// The GPU is shared by the alignments, which run in parallel
+	std::mutex mutex;
+	std::atomic<bool> isEnabled{ false };
+	bool isInitialized = false;
+	bool isInitializationFailed = false;
+
+	ID3D11Device* device = nullptr;
+	ID3D11DeviceContext* context = nullptr;
+	ID3D11ComputeShader* shader = nullptr;
+	ID3D11Buffer* constants = nullptr;
+
+	// Query buffers, grown to the largest query
+	int queryCapacity = 0;
+	ID3D11Buffer* queryBuffer = nullptr;
+	ID3D11ShaderResourceView* queryView = nullptr;
+	ID3D11Buffer* resultBuffer = nullptr;
+	ID3D11UnorderedAccessView* resultView = nullptr;
+	ID3D11Buffer* resultStaging = nullptr;
+
+	GpuNeighbourSearch() {}
+
+	bool Initialize();
+	bool ReserveQueries(int numQueries);
+	void ReleaseQueryBuffers();
+	void Release();
+};
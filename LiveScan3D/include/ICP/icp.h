@@ -7,7 +7,26 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module applies the Iterative Closest Point algorithm to align two sets 
-of 3D points.
+of 3D points. The KD-tree of the target points is built once per alignment,
+or once for several alignments to the same target through a target handle.
+The points are aligned either point to point, with an SVD rotation update, or
+point to plane, with a linearized least-squares update of the rotation and
+translation along the normals of the target, which are estimated once; the
+point to plane alignment converges in far fewer iterations on planar scenes.
+The multi-resolution alignment runs coarse to fine on voxel grids of the
+clouds, and stops each level once it has converged. The poses of all the
+cameras can be refined in one call, each camera aligned to the others in
+parallel against targets shared by all the alignments. They can also be
+refined from the depth frames of the cameras, matching the points of each
+camera by projecting them into the depth frames of the others instead of
+searching a KD-tree, and solving for all the poses at once.
+The nearest neighbours of large clouds can be searched on the GPU instead
+of the KD-trees, when one is available, or in voxel hash grids on the CPU,
+which are built in linear time over the small volume of the Holoport. The
+joint refinement can align a
+few thousand points of each camera instead of all of them, sampled in the
+overlap with the other cameras and spread over the directions of their
+normals, as the points of the large flat regions barely constrain the pose.
 
 This code was adapted from the following research:
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
@@ -18,8 +37,16 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 
 #include <stdio.h>
 #include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <algorithm>
+#include <random>
 #include "opencv\cv.h"
 #include "nanoflann.h"
+#include "gpuNeighbourSearch.h"
+#include "voxelHashGrid.h"
 
 #if defined(ICP_DLL_EXPORTS) // inside DLL
 #   define ICP_API   __declspec(dllexport)
@@ -66,8 +93,107 @@ struct PointCloud
 	bool kdtree_get_bbox(BBOX& /*bb*/) const { return false; }
 };
 
-extern "C" ICP_API float __stdcall ICP(Point3f* targetVerts, Point3f* sourceVerts, int numTargetVerts, int numSourceVerts, float* R, float* t, int maxIter);
+typedef nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<float, PointCloud>, PointCloud, 3> PointCloudKDTree;
+
+// Target point cloud of the alignments and its KD-tree, which is built once and only read by the alignments
+struct ICPTarget
+{
+	PointCloud Cloud;
+	PointCloudKDTree KDTree;
+	vector<Point3f> Normals; // Unit normals of the points for point to plane alignments; empty if not estimated
+	std::unique_ptr<GpuNeighbourGrid> GpuGrid; // Grid of the points for the GPU searches; null if they are not used
+	VoxelHashGrid HashGrid; // Grid of the points for the voxel hash searches; empty if they are not used
+
+	ICPTarget(const Point3f* verts, int numVerts, bool isNormalEstimationRequested = false);
+
+	void EstimateNormals();
+	Point3f EstimateNormal(const Point3f& point) const;
+	float EstimatePointSpacing() const;
+};
+
+// Nearest neighbour searches of the alignments
+enum NeighbourSearchBackend
+{
+	KDTreeSearch = 0,
+	GpuGridSearch = 1, // Uniform grids in a compute shader, for the large clouds; the KD-trees answer the rest
+	VoxelHashSearch = 2 // Voxel hash grids on the CPU; the KD-trees answer the queries too far from the targets
+};
+
+// Thresholds below which an alignment stops before its maximum number of iterations; zero runs all of them
+struct ICPStopCriteria
+{
+	double MinRotationUpdate; // In radians
+	double MinTranslationUpdate; // In the units of the points
+	float MinErrorChange; // Fraction of the error
+};
 
-void FindNearestNeighbours(PointCloud& sourceCloud, cv::Mat& queryPoints, vector<float>& distances, vector<size_t>& indices);
-void RejectOutlierMatches(vector<Point3f>& matches1, vector<Point3f>& matches2, vector<float>& matchDistances, float maxStdDev);
+// Targets an alignment matches the points to, as one cloud
+typedef vector<const ICPTarget*> ICPTargets;
+
+// Correspondences of an alignment, whose buffers are reused by all of its iterations
+struct ICPMatches
+{
+	vector<float> Distances;
+	vector<size_t> Indices;
+	vector<int> MatchMap; // Maps the target points to their match, or -1
+	vector<size_t> TargetOffsets; // Index of the first point of each target in the indices of the matches
+	vector<int> MatchedTargetIndices;
+	vector<int> MatchedSourceIndices;
+	vector<Point3f> MatchedTargetVerts;
+	vector<Point3f> MatchedSourceVerts;
+	vector<float> MatchDistances;
+};
+
+// Organized depth frame of a camera for the projective alignments, with the world space point and normal of each pixel
+struct ProjectiveView
+{
+	int Width, Height;
+	float Fx, Fy, Cx, Cy;
+	float DepthToWorld[12]; // Depth camera (meters) to world space, 3x4 row-major
+	float WorldToDepth[12];
+	vector<Point3f> Points;
+	vector<Point3f> Normals; // Unit normals facing the camera
+	vector<unsigned char> IsValid; // Pixels with both a depth and a normal
+
+	ProjectiveView(const unsigned short* depth, int width, int height, const float* intrinsics, const float* depthToWorld);
+
+	bool Project(const Point3f& point, int& pixelIndex) const;
+};
+
+extern "C" ICP_API float __stdcall ICP(Point3f* targetVerts, Point3f* sourceVerts, int numTargetVerts, int numSourceVerts, float* R, float* t, int maxIter);
+extern "C" ICP_API float __stdcall ICPPointToPlane(Point3f* targetVerts, Point3f* sourceVerts, int numTargetVerts, int numSourceVerts, float* R, float* t, int maxIter);
+extern "C" ICP_API float __stdcall ICPMultiResolution(Point3f* targetVerts, Point3f* sourceVerts, int numTargetVerts, int numSourceVerts, float* R, float* t,
+	int maxIterPerLevel, int numLevels, float coarsestVoxelSize, bool isPointToPlane, int* numIterationsPerLevel);
+extern "C" ICP_API float __stdcall RefineAllPoses(Point3f* verts, int* numVertsPerCamera, int numCameras, float* Rs, float* ts, int numRefineIter,
+	int maxIterPerLevel, int numLevels, float coarsestVoxelSize, bool isPointToPlane, int maxSamplesPerCamera, int* numIterationsPerLevel);
+extern "C" ICP_API float __stdcall RefineAllPosesProjective(unsigned short* depths, int* widths, int* heights, float* intrinsics, float* depthToWorld,
+	int numCameras, float* Rs, float* ts, int maxIter, int sampleStep, float maxDistance, int* numIterations);
+extern "C" ICP_API ICPTarget* __stdcall CreateICPTarget(Point3f* targetVerts, int numTargetVerts, bool isNormalEstimationRequested);
+extern "C" ICP_API float __stdcall ICPToTarget(ICPTarget* target, Point3f* sourceVerts, int numSourceVerts, float* R, float* t, int maxIter);
+extern "C" ICP_API float __stdcall ICPToTargetPointToPlane(ICPTarget* target, Point3f* sourceVerts, int numSourceVerts, float* R, float* t, int maxIter);
+extern "C" ICP_API void __stdcall DestroyICPTarget(ICPTarget* target);
+extern "C" ICP_API bool __stdcall SetNeighbourSearchBackend(int backend);
+
+float AlignToTargets(const ICPTargets& targets, Point3f* sourceVerts, int numSourceVerts, float* R, float* t, int maxIter,
+	const ICPStopCriteria& stopCriteria, int& numIterations);
+float AlignToTargetsPointToPlane(const ICPTargets& targets, Point3f* sourceVerts, int numSourceVerts, const Point3f* sourceNormals,
+	float* R, float* t, int maxIter, const ICPStopCriteria& stopCriteria, int& numIterations);
+vector<Point3f> EstimateNormals(const Point3f* verts, int numVerts);
+Point3f EstimateNormal(const PointCloud& cloud, const PointCloudKDTree& tree, const Point3f& point);
+bool IsConverged(const ICPStopCriteria& stopCriteria, double rotationAngle, double translation, float previousError, float error);
+void ComposeTransform(float* R, float* t, const float* updateR, const float* updateT);
+void TransformPoints(Point3f* verts, int numVerts, const float* R, const float* t);
+Point3f TransformPoint(const Point3f& point, const float* R, const float* t);
+Point3f InverseTransformPoint(const Point3f& point, const float* R, const float* t);
+Point3f RotatePoint(const Point3f& point, const float* R);
+vector<Point3f> VoxelDownsample(const Point3f* verts, int numVerts, float voxelSize);
+vector<Point3f> SampleOverlapByNormals(const ICPTarget& cloud, const ICPTargets& others, int maxSamples, float maxOverlapDistance,
+	unsigned int seed);
+cv::Matx33d GetRotationFromVector(const cv::Matx31d& rotationVector);
+void MatchPoints(const ICPTargets& targets, cv::Mat& sourceVertsMat, ICPMatches& matches);
+void FindNearestNeighbours(const ICPTargets& targets, const vector<size_t>& targetOffsets, cv::Mat& queryPoints, vector<float>& distances, vector<size_t>& indices);
+bool FindNearestNeighboursGpu(const ICPTargets& targets, const vector<size_t>& targetOffsets, cv::Mat& queryPoints, vector<float>& distances, vector<size_t>& indices);
+bool FindNearestNeighboursHash(const ICPTargets& targets, const vector<size_t>& targetOffsets, cv::Mat& queryPoints, vector<float>& distances, vector<size_t>& indices);
+size_t FindTarget(const vector<size_t>& targetOffsets, size_t index);
+void RejectOutlierMatches(ICPMatches& matches, float maxStdDev);
 float GetStandardDeviation(vector<float>& data);
\ No newline at end of file
@@ -0,0 +1,55 @@
+/***************************************************************************\
+
+Module Name:  BenchmarkScenes.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module builds the scenes the alignments are benchmarked on: the point
+clouds of several cameras whose true poses are known, moved by a known
+calibration error. The synthetic scenes are rendered for a ring of cameras
+around a table and a person, with depth noise growing with the distance, so
+that the cameras only partly see the same surfaces. The recorded scenes are
+built from two frames of a raw recording, each cropped to a part of the
+field of view, so that they overlap partly with the noise of the sensor.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Points of a camera of a scene, with its depth frame for the projective alignments
+struct BenchmarkCamera
+{
+    std::vector<float> Points; // World space, in meters, 3 floats per point; moved by the calibration error
+    std::vector<float> TruePoints; // The same points where they truly are
+
+    std::vector<unsigned short> Depth; // In millimeters; zero for invalid pixels
+    int Width = 0;
+    int Height = 0;
+    float Intrinsics[4] = {}; // fx, fy, cx, cy
+    float DepthToWorld[12] = {}; // Depth camera (meters) to world, 3x4 row-major, with the calibration error
+};
+
+struct BenchmarkScene
+{
+    std::string Name;
+    std::vector<BenchmarkCamera> Cameras; // The first camera is the reference, without calibration error
+};
+
+struct BenchmarkSceneParams
+{
+    int NumCameras = 4; // Synthetic scenes only
+    float NoiseMm = 1.0f; // Depth noise at 1 m, growing with the square of the depth; synthetic scenes only
+    float Overlap = 0.5f; // Fraction of the field of view both cameras see; recorded scenes only
+    int PixelStep = 2; // One pixel out of PixelStep in both directions becomes a point
+    float RotationErrorDeg = 1.0f; // Calibration error of the cameras but the first, around their center
+    float TranslationErrorMm = 20.0f;
+    unsigned int Seed = 1;
+};
+
+void GenerateSyntheticScene(const BenchmarkSceneParams& params, BenchmarkScene& scene);
+bool LoadRecordedScene(const std::string& path, const BenchmarkSceneParams& params, BenchmarkScene& scene);
@@ -0,0 +1,55 @@
+/***************************************************************************\
+
+Module Name:  BenchmarkChecks.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module checks the results of the benchmarks against those of a
+previous run, so that a change which slows the processing down or changes
+its output is caught. The point clouds of the frames are compared with the
+golden point clouds saved by a known good version, as sets of points within
+a tolerance, since the order of the points may change with the processing.
+The median times are compared with a baseline saved on the same class of
+machine, which is recognized by its point cloud kernel and thread count.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "utils.h"
+#include <string>
+#include <vector>
+
+// Processed points of a frame, in millimeters like those the clients send
+struct GoldenFrame
+{
+    std::vector<Point3s> Vertices;
+    std::vector<RGB> Colors;
+};
+
+bool WriteGoldenFrames(const std::string& path, const std::vector<GoldenFrame>& frames);
+bool ReadGoldenFrames(const std::string& path, std::vector<GoldenFrame>& frames);
+int CountGoldenMismatches(const std::vector<GoldenFrame>& golden, const std::vector<GoldenFrame>& frames, int toleranceMm);
+
+// Median time of a benchmark, or of a stage of the frame loop of the client
+struct BenchmarkTiming
+{
+    std::string Name;
+    double MedianNs;
+};
+
+// Machine class and timings of the results of a previous run
+struct BaselineResults
+{
+    std::string Source;
+    std::string PointCloudKernel;
+    int NumThreads = 0;
+    int DepthWidth = 0;
+    int DepthHeight = 0;
+    std::vector<BenchmarkTiming> Timings;
+};
+
+bool ReadBaselineResults(const std::string& path, BaselineResults& baseline);
+int CountTimingRegressions(const BaselineResults& baseline, const std::vector<BenchmarkTiming>& timings, double maxRegression);
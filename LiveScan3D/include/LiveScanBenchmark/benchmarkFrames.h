@@ -0,0 +1,35 @@
+/***************************************************************************\
+
+Module Name:  BenchmarkFrames.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module provides the frames the benchmarks of the client processing run
+on: the frames of a raw recording of a camera, or synthetic frames of a room
+with a table and a document, generated the same way on every machine. The
+synthetic frames can be written to a raw recording, so that they can also be
+replayed by a client.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "rawFrameRecorder.h"
+#include <string>
+#include <vector>
+
+// The synthetic frames have the default depth and color profiles of the Orbbec capture manager
+const int SyntheticDepthWidth = 640;
+const int SyntheticDepthHeight = 576;
+const int SyntheticColorWidth = 1280;
+const int SyntheticColorHeight = 720;
+
+// The document only enters the synthetic scene after the first frames, which the document detection learns the
+// background from
+const int SyntheticBackgroundFrames = 5;
+
+bool LoadRecordedFrames(const std::string& path, int maxFrames, std::vector<RawFrame>& frames, std::string& serialNumber);
+void GenerateSyntheticFrames(int numFrames, std::vector<RawFrame>& frames);
+bool WriteRecording(const std::vector<RawFrame>& frames, const std::string& serialNumber, std::string& path);
@@ -0,0 +1,99 @@
+/***************************************************************************\
+
+Module Name:  AsyncLogger.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module writes the log of a client from a background thread, so that
+logging from the frame loop never waits on the disk. The messages are
+copied into a bounded ring which any thread can append to without locks,
+then timestamped, limited and written in batches by the flusher thread.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+enum LogLevel
+{
+    DebugLevel = 0,
+    InfoLevel = 1,
+    WarningLevel = 2,
+    ErrorLevel = 3
+};
+
+/// <summary>
+/// Log file written by a flusher thread. Log claims a slot of the ring with a compare and swap and copies the message
+/// into it, so it never blocks; the messages below the minimum level are ignored, and those which find the ring full
+/// are dropped and counted. The flusher writes the messages in order, except that the messages which only differ by
+/// their numbers are limited to a few per interval, and flushes the file once per batch.
+/// </summary>
+class AsyncLogger
+{
+public:
+    AsyncLogger();
+    ~AsyncLogger();
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    bool Open(const std::wstring& path);
+    void Log(LogLevel level, const std::string& message);
+    void SetMinLevel(LogLevel level) { minLevel.store(level, std::memory_order_relaxed); }
+
+private:
+    static const int NumSlots = 512; // Power of two
+    static const int MaxMessageLength = 480; // Longer messages are truncated
+
+    // The sequence of a slot is its index when it is free to write, and its index + 1 once its message can be read
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence;
+        LogLevel level;
+        std::chrono::system_clock::time_point time;
+        int length;
+        char text[MaxMessageLength];
+    };
+
+    // Messages written and suppressed in the current interval, for the messages which only differ by their numbers
+    struct RepeatCount
+    {
+        std::chrono::steady_clock::time_point intervalStart;
+        int numWritten;
+        int numSuppressed;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<uint64_t> writeIndex;
+    uint64_t readIndex; // Flusher thread only
+    std::atomic<uint32_t> numDropped;
+    std::atomic<int> minLevel;
+
+    // Owned by the flusher thread; the mutex is only taken by Open and to wake or stop the thread
+    std::mutex fileMutex;
+    std::condition_variable wakeCond;
+    bool isStopping;
+    std::ofstream file;
+    std::unordered_map<std::string, RepeatCount> repeatCounts;
+    std::chrono::steady_clock::time_point lastRepeatSweep;
+    std::thread flusherThread;
+
+    void RunFlusher();
+    void WriteQueuedMessages();
+    bool IsRepeatSuppressed(const std::string& pattern, std::chrono::steady_clock::time_point now);
+    void SweepRepeatCounts(std::chrono::steady_clock::time_point now, bool isFinal);
+    void WriteSuppressedCount(const std::string& pattern, int numSuppressed);
+    void WriteLine(LogLevel level, std::chrono::system_clock::time_point time, const char* text, size_t length);
+};
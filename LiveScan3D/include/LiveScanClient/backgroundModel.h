@@ -0,0 +1,62 @@
+/***************************************************************************\
+
+Module Name:  BackgroundModel.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module learns the static background of the scene (stand, walls) as a
+per-pixel depth image, averaged over the first frames it receives. The depth
+pixels which stay close to that depth can then be recognized as background.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+enum BackgroundMode
+{
+    BackgroundKept,      // Background points are processed and sent like the others
+    BackgroundDropped,   // Background points are removed from the frames
+    BackgroundRefreshed  // Background points are only processed on refresh frames and reused in between
+};
+
+class BackgroundModel {
+public:
+    void Reset();
+    void Update(const uint16_t* depth, int width, int height);
+    bool IsReady() const;
+    size_t GetMemoryUsage() const;
+
+    // Indicates whether the given depth of a pixel matches the learned background depth of that pixel
+    inline bool IsBackground(int pixelIndex, uint16_t depth) const {
+        uint16_t background = backgroundDepth[pixelIndex];
+        return background != 0 && depth != 0 && std::abs(depth - background) <= GetTolerance(background);
+    }
+
+private:
+    const int NumLearningFrames = 30;
+    const int BaseToleranceMm = 15;
+    const int RelativeToleranceShift = 6; // The tolerance grows by 1/64 of the depth to follow the sensor noise
+
+    int width = 0;
+    int height = 0;
+    int numLearnedFrames = 0;
+
+    // Statistics of the valid samples of each pixel while learning
+    std::vector<uint32_t> depthSums;
+    std::vector<uint16_t> numSamples;
+    std::vector<uint16_t> minDepths;
+    std::vector<uint16_t> maxDepths;
+
+    // Learned background depth of each pixel (millimeters); 0 where the pixel has no stable background
+    std::vector<uint16_t> backgroundDepth;
+
+    inline int GetTolerance(uint16_t depth) const {
+        return BaseToleranceMm + (depth >> RelativeToleranceShift);
+    }
+};
@@ -37,6 +37,7 @@ class Calibration
 public:
 	vector<float> worldT;
 	vector<vector<float>> worldR;
+	float worldTransform[3][4]; // worldR and worldR * worldT composed into a single transform, see UpdateWorldTransform
 	int usedMarkerId;
 
 	vector<MarkerPose> markerPoses;
@@ -49,15 +50,26 @@ public:
 	bool Calibrate(RGB *colorFrame, Point3f *alignedDepthFrame, int colorFrameWidth, int colorFrameHeight);
 	bool LoadCalibration(const string &serialNumber);
 	void SaveCalibration(const string &serialNumber);
+	void UpdateWorldTransform();
 	void SetLogger(std::function<void(const std::string&)> loggerFunc);
+	int GetNumSamples() const;
+	int GetNumRequiredSamples() const;
 
 private:
 	const int NumRequiredSamples = 20; // Number of samples required to average marker position
 
+	// Once a marker is found, the next samples only search a window around its corners, padded by a fraction of its
+	// size and at least a few pixels; the full frame is searched again when the marker is lost
+	const float TrackingRegionPadding = 0.5f;
+	const int MinTrackingRegionPadding = 16;
+
 	int numSamples;
+	bool isMarkerTracked;
+	int trackingRegion[4]; // Left, top, width and height of the searched window, in pixels
 	IMarkerDetector *markerDetector;
 	vector<vector<Point3f>> markerSamplePositions;
 
+	bool DetectMarker(RGB *colorFrame, int frameWidth, int frameHeight, MarkerInfo &marker);
 	void Procrustes(MarkerInfo &marker, vector<Point3f> &markerInWorld, vector<float> &markerT, vector<vector<float>> &markerR);
 	bool Get3DMarkerCorners(vector<Point3f> &marker3D, MarkerInfo &marker, Point3f *alignedDepthFrame, int colorFrameWidth, int colorFrameHeight);
 	std::function<void(const std::string&)> logFn;
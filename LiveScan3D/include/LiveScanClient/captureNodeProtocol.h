@@ -0,0 +1,222 @@
+/***************************************************************************\
+
+Module Name:  CaptureNodeProtocol.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module defines the messages a capture node exchanges with the remote
+clients of the server, over one TCP connection for each camera the node
+hosts. Each message is a fixed header, with the type and the size of its
+content, followed by the content. The server sends the calls of the client
+API, some of which wait for an answer, and pings to compare the clocks of
+the two computers; the node streams the processed frames of the camera with
+its events and the answers. The frames are sent as planes of coordinates,
+delta coded from point to point, and planes of colors, compressed with zstd
+when it is built in (LIVESCAN_ZSTD).
+
+\***************************************************************************/
+
+#pragma once
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include "utils.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Declared as zstd.h does, so that the layout of the codec does not depend on whether zstd is built in
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+
+const int DefaultCaptureNodePort = 48005;
+
+// Both ends copy the settings and the statistics of the clients as they are laid out in memory, so the node and the
+// server must be built from the same sources; the version is checked when the connection opens
+const uint32_t CaptureNodeProtocolVersion = 22;
+
+enum CaptureNodeMessageType : uint16_t
+{
+    // Server to node
+    HelloMessage = 0,                       // CaptureNodeHello
+    StartFrameRecordingMessage = 1,
+    CalibrateMessage = 2,
+    SetDocumentFrameIntervalMessage = 3,    // Interval, in ms (int32)
+    SetSettingsMessage = 4,                 // CameraSettings without its marker poses, then the MarkerPose array
+    ReceiveCalibrationMessage = 5,          // AffineTransform
+    ClearRecordedFramesMessage = 6,
+    SaveFrameRingMessage = 7,               // Seconds (int32)
+    EnableSyncMessage = 8,                  // Sync state, sync offset, number of synced devices (int32 each)
+    DisableSyncMessage = 9,
+    StartMasterMessage = 10,
+    ClockPingMessage = 11,                  // CaptureNodeClockSample, with the send time of the server
+    CalibrationProgressRequest = 12,
+    PerfStatsRequest = 13,                  // Reset the measurements (uint8)
+    MemoryStatsRequest = 14,
+    DepthFrameRequest = 15,                 // Timeout, in ms (int32)
+    RecordedFramesRequest = 16,             // Maximum number of frames (int32); 0 for RequestRecordedFrame
+    ReceiveCameraPosesMessage = 17,         // Index of the camera among the poses (int32), then the AffineTransform array
+    FunnelStatsRequest = 18,
+    SetMaxDocumentSizeMessage = 19,         // Width, height, in pixels (int32 each)
+    LearnExclusionMaskMessage = 20,         // Number of frames (int32); 0 clears the mask
+    SetExposureMessage = 21,                // Auto exposure (int32, 0 or 1), exposure step (int32)
+
+    // Node to server
+    NodeInfoMessage = 64,                   // CaptureNodeInfo, answers the hello
+    FrameMessage = 65,                      // CaptureNodeFrameHeader, then the encoded points and the normals
+    EventMessage = 66,                      // ClientEvent, but the document events
+    DocumentMessage = 67,                   // CaptureNodeDocumentHeader, then the signature and the jpeg
+    ClockPongMessage = 68,                  // CaptureNodeClockSample, with the time at which the node answered
+    CalibrationProgressReply = 69,          // CaptureNodeCalibrationProgress
+    PerfStatsReply = 70,                    // PerfStageStats array
+    MemoryStatsReply = 71,                  // ClientMemoryStats
+    DepthFrameReply = 72,                   // CaptureNodeDepthFrameHeader, then the depth; empty if none was acquired
+    RecordedFrameMessage = 73,              // CaptureNodeRecordedFrameHeader, then the points and their colors
+    RecordedFramesReply = 74,               // Number of frames sent (int32), after their RecordedFrameMessage
+    FunnelStatsReply = 75                   // FrameFunnelStats
+};
+
+// First byte of the encoded points of a frame; the node sends the planes as they are when it is built without zstd
+enum CaptureNodeFrameEncoding : uint8_t
+{
+    RawPlanesEncoding = 0,
+    ZstdPlanesEncoding = 1
+};
+
+#pragma pack(push, 1)
+struct CaptureNodeMessageHeader
+{
+    uint32_t Size; // Bytes of content which follow
+    uint16_t Type; // CaptureNodeMessageType
+};
+
+struct CaptureNodeHello
+{
+    uint32_t Version;
+    int32_t ClientIndex; // Client of the node the connection controls; -1 to only query the node
+};
+
+struct CaptureNodeInfo
+{
+    uint32_t Version;
+    int32_t NumClients;
+};
+
+struct CaptureNodeFrameHeader
+{
+    uint64_t SequenceNumber;
+    uint64_t TimeStampUs;
+    int64_t AcquireTimeUs; // Steady clock of the node
+    int64_t PublishTimeUs;
+    uint32_t NumPoints;
+    uint32_t NumNormals; // One byte for each point after the encoded points; 0 when the normals are not estimated
+};
+
+// The global timestamps of the frames are on the system clock of the node, which is compared with that of the server
+// like the steady clocks are
+struct CaptureNodeClockSample
+{
+    int64_t ServerTimeUs; // Steady clock of the server
+    int64_t NodeTimeUs; // Steady clock of the node
+    int64_t NodeSystemTimeUs; // System clock of the node
+};
+
+struct CaptureNodeCalibrationProgress
+{
+    uint8_t IsCalibrating;
+    int32_t NumSamples;
+    int32_t NumRequiredSamples;
+};
+
+struct CaptureNodeDepthFrameHeader
+{
+    int32_t Width;
+    int32_t Height;
+    float Intrinsics[4];
+    float DepthToWorld[12];
+};
+
+struct CaptureNodeDocumentHeader
+{
+    float Score;
+    int16_t Width;
+    int16_t Height;
+    uint32_t SignatureSize;
+};
+
+struct CaptureNodeRecordedFrameHeader
+{
+    uint32_t NumPoints;
+    uint8_t NoMoreFrames;
+};
+#pragma pack(pop)
+
+// Times of the steady and system clocks of this computer, in microseconds; the remote clients convert the times of
+// the nodes to them
+int64_t GetSteadyTimeUs();
+int64_t GetSystemTimeUs();
+
+bool StartWinsock();
+
+/// <summary>
+/// Connected socket which sends and receives whole messages. Messages can be sent from any thread, one at a time;
+/// they are received by a single thread.
+/// </summary>
+class CaptureNodeConnection
+{
+public:
+    explicit CaptureNodeConnection(SOCKET socket);
+    ~CaptureNodeConnection();
+
+    static SOCKET Connect(const std::string& host, int port, int timeoutMs);
+
+    bool Send(uint16_t type, const void* content = nullptr, size_t size = 0);
+    bool Send(uint16_t type, const void* header, size_t headerSize, const void* content, size_t size);
+    bool Receive(uint16_t& type, std::vector<char>& content);
+    bool WaitReadable(int timeoutMs);
+    void Shutdown();
+
+private:
+    // Larger messages are a broken connection or another protocol
+    const uint32_t MaxMessageSize = 256 * 1024 * 1024;
+
+    SOCKET socket;
+    std::mutex sendMutex;
+    std::vector<char> sendBuffer;
+
+    bool SendAll(const char* data, size_t size);
+    bool ReceiveAll(char* data, size_t size);
+};
+
+/// <summary>
+/// Compresses the processed frames sent by the nodes. The coordinates are split in one plane per axis, each coded as
+/// the difference with the previous point, which is small as the points follow the pixels of the depth frame; the
+/// colors are split in one plane per channel.
+/// </summary>
+class CaptureNodeFrameCodec
+{
+public:
+    ~CaptureNodeFrameCodec();
+
+    bool Encode(const Point3s* vertices, const RGB* colors, int count, std::vector<char>& encoded);
+    bool Decode(const char* encoded, size_t size, int count, std::vector<Point3s>& vertices, std::vector<RGB>& colors);
+
+private:
+    // Fast enough for the frame rate of the cameras, and most of the gain of the higher levels on the delta planes
+    const int CompressionLevel = 1;
+
+    // Well above the pixels of the depth frames, so that a corrupt count cannot make the decoder allocate gigabytes
+    const int MaxPoints = 4 * 1024 * 1024;
+
+    std::vector<char> planes;
+    ZSTD_CCtx* compressionContext = nullptr;
+    ZSTD_DCtx* decompressionContext = nullptr;
+};
@@ -0,0 +1,65 @@
+/***************************************************************************\
+
+Module Name:  ClientEventQueue.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the queue of the events the clients of the process
+send to the server: their serial number, the confirmations of their
+recording, calibration and sync state, and their new documents. The server
+waits on the queue and takes the pending events of all the clients at once,
+instead of being called back from the threads of each client.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Values shared with the ClientEventType enum of the server
+enum ClientEventType
+{
+    SerialNumberEvent = 0,
+    RecordedEvent = 1,
+    CalibratedEvent = 2,
+    SyncStateEvent = 3,
+    MasterRestartEvent = 4,
+    DocumentEvent = 5,
+    LoadShedEvent = 6
+};
+
+// Laid out like the ClientEvent struct of the server, which receives them in arrays
+struct ClientEvent
+{
+    int ClientIndex;
+    int Type;
+    int Value;          // Sync state, id of the marker used by the calibration, size of the document, or load shed level
+    float R[9];         // World rotation of the calibration, row-major
+    float T[3];         // World translation of the calibration
+    char Text[64];      // Serial number, null-terminated
+};
+
+class ClientEventQueue
+{
+public:
+    static ClientEventQueue& Instance();
+
+    void Push(const ClientEvent& event);
+    int Wait(ClientEvent* events, int maxEvents, int timeoutMs);
+
+private:
+    // Bounds the events kept when the server stops taking them; the oldest are dropped first
+    const size_t MaxPendingEvents = 4096;
+
+    std::mutex mutex;
+    std::condition_variable eventCond;
+    std::deque<ClientEvent> pendingEvents;
+
+    ClientEventQueue() {}
+    ClientEventQueue(const ClientEventQueue&) = delete;
+    ClientEventQueue& operator=(const ClientEventQueue&) = delete;
+};
@@ -0,0 +1,68 @@
+/***************************************************************************\
+
+Module Name:  ClockModel.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module follows the offset and the drift of a source clock, such as the
+clock of a camera or those of a capture node, from the clock of this
+computer. Each sample pairs a time of the source with the time of this
+computer it was observed at, along with the delay which skews it: the
+transfer of a frame, or the round trip of a ping. The samples are grouped
+by periods of the source clock, the least delayed sample of each period is
+kept, and a line is fit through them, so that the slow drift of the clocks
+is followed while the delays, which are never negative, are mostly left out.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+class ClockModel
+{
+public:
+    void Reset();
+    void AddSample(int64_t sourceTimeUs, int64_t targetTimeUs, int64_t delayUs);
+
+    bool IsValid() const;
+    int GetNumSamples() const;
+    int64_t ToTarget(int64_t sourceTimeUs) const;
+    int64_t GetOffsetUs() const;
+    double GetDriftPpm() const;
+
+private:
+    // Periods of the source clock of which the least delayed sample is kept; the window spans a minute, over which the
+    // drift of the crystals of the clocks, tens of ppm, is close to linear
+    static const int NumPeriods = 32;
+    const int64_t PeriodUs = 2000000;
+
+    // The drift is only fit over at least MinFitSpanUs, as the delays of a few periods would swamp it
+    const int64_t MinFitSpanUs = 10000000;
+    const double MaxDrift = 0.001;
+
+    // A sample further from the model is a clock which was set, or a device which restarted, and starts over
+    const int64_t MaxJumpUs = 1000000;
+
+    struct Sample
+    {
+        int64_t SourceTimeUs;
+        int64_t OffsetUs; // Target time minus source time
+        int64_t DelayUs;
+    };
+
+    Sample periods[NumPeriods] = {};
+    int numPeriods = 0;
+    int lastPeriod = 0;
+    int64_t lastPeriodIndex = 0;
+    int numSamples = 0;
+
+    // Offset at the reference time, and its change for each microsecond of the source clock
+    int64_t referenceTimeUs = 0;
+    int64_t referenceOffsetUs = 0;
+    double drift = 0.0;
+
+    void Fit();
+};
@@ -0,0 +1,74 @@
+/***************************************************************************\
+
+Module Name:  DeviceRegistry.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the registry of the Orbbec devices shared by all the
+clients of the process. The devices are enumerated once with a single SDK
+context and addressed by serial number, and a startup barrier lets all the
+cameras of the rig initialize at the same time. The listeners of the
+clients are told when a device is unplugged or plugged back in, so that a
+client can reopen its camera while the others keep streaming.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "libobsensor/ObSensor.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class DeviceRegistry
+{
+public:
+    static DeviceRegistry& Instance();
+
+    void PrepareStartup(int numClients);
+    std::shared_ptr<ob::Device> OpenDevice(int deviceIndex, const std::string& serialNumber);
+
+    void ArriveAtStartup();
+    bool WaitForStartup(int timeoutMs);
+
+    // Called from a thread of the SDK with the serial number of a device unplugged (false) or plugged in (true)
+    typedef std::function<void(const std::string& serialNumber, bool isConnected)> DeviceListener;
+
+    int AddDeviceListener(DeviceListener listener);
+    void RemoveDeviceListener(int listenerId);
+
+private:
+    DeviceRegistry() = default;
+    DeviceRegistry(const DeviceRegistry&) = delete;
+    DeviceRegistry& operator=(const DeviceRegistry&) = delete;
+
+    std::mutex deviceMutex;
+    std::shared_ptr<ob::Context> context;
+    std::shared_ptr<ob::DeviceList> deviceList;
+    std::vector<std::string> serialNumbers;
+
+    // Only the clients own their device, so a device is closed once no client uses it anymore
+    std::map<std::string, std::weak_ptr<ob::Device>> openedDevices;
+
+    // Listeners of the device changes, called with the listener mutex held so that a removed listener is never called
+    std::mutex listenerMutex;
+    std::map<int, DeviceListener> deviceListeners;
+    int nextListenerId = 0;
+
+    // Startup barrier, released once every expected client has started its pipeline (or failed to)
+    std::mutex startupMutex;
+    std::condition_variable startupCond;
+    int numExpectedClients = 0;
+    int numArrivedClients = 0;
+
+    bool EnumerateDevices();
+    int FindDevice(const std::string& serialNumber) const;
+    void OnDevicesChanged(std::shared_ptr<ob::DeviceList> removedList, std::shared_ptr<ob::DeviceList> addedList);
+};
@@ -8,16 +8,24 @@ Copyright (c) Canadian Space Agency.
 <Description>
 This module uses a YOLO machine learning model to detect documents from a
 provided color frame and ranks its detections based on their size and blur.
+The best document is then tracked in the next frames, which are only searched
+in full every few detections or once it is lost. The frames of a scene which
+did not change since the last detection are skipped, unless it held a
+document. The detected quadrilaterals are rectified to the size the
+receivers render them at.
 
 \***************************************************************************/
 
 #pragma once
 #include <opencv2/opencv.hpp>
-#include "libobsensor/ObSensor.hpp"
 #include <utils.h>
+#include <frameArena.h>
 #include <vector>
 #include <string>
+#include <functional>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
 
 class DocumentDetector
 {
@@ -28,10 +36,10 @@ public:
     DocumentDetector();
     ~DocumentDetector();
 
-    void DocumentDetector::SubmitFrame(std::shared_ptr<ob::ColorFrame> color, cv::Mat depth);
+    void SubmitFrame(const cv::Mat& color, const cv::Mat& depth);
 
-    bool DocumentDetector::Detect(
-        const std::shared_ptr<ob::ColorFrame>& colorFrame,
+    bool Detect(
+        cv::Mat colorImage,
         cv::Mat depthFrame,
         cv::Mat& documentData,
         short& documentPictureWidth,
@@ -41,26 +49,112 @@ public:
 
     void SetDetectionCallback(DetectionCallback callback);
     void SetLogger(std::function<void(const std::string&)> loggerFunc);
+    void SetMaxDocumentSize(int width, int height);
+    size_t GetMemoryUsage() const { return memoryUsage.load(std::memory_order_relaxed); }
 
 private:
-    std::mutex frameMutex;
-    std::condition_variable frameCond;
+    // Copy of a submitted frame, whose buffers are reused by the next frames of the same size
+    struct FrameCopy
+    {
+        cv::Mat Color;
+        cv::Mat Depth;
+    };
 
-    std::shared_ptr<ob::ColorFrame> pendingColorFrame = nullptr;
-    cv::Mat pendingDepthFrame;
+    const int JpegQuality = 90;
 
+    // Largest size the receivers render the documents at, set by the server; the crops are scaled to fit it before
+    // they are scored and encoded. 0 sets no limit, and the longer side of the crops is then capped at MaxCropSide.
+    std::atomic<int> maxDocumentWidth{ 0 };
+    std::atomic<int> maxDocumentHeight{ 0 };
+    const int MaxCropSide = 1280;
+
+    // The submitted color frames are copied down to this width at most, which is enough for the crops of the documents
+    const int MaxColorWidth = 1920;
+
+    // The frames are triple buffered, so that neither the capture thread nor the detection ever waits for the other: the
+    // capture thread fills one copy, the mailbox holds the latest filled one and the detection reads the third. The
+    // mailbox holds the index of its copy, with NewFrameFlag until the detection takes it.
+    static const int NumFrameCopies = 3;
+    static const int NewFrameFlag = 4;
+    FrameCopy frameCopies[NumFrameCopies];
+    int writeCopyIndex = 0; // Only used by the capture thread
+    int readCopyIndex = 1; // Only used by the detection task
+    std::atomic<int> mailbox{ 2 };
+
+    // Guards the end of the detection tasks, which the destructor waits for
+    std::mutex detectionMutex;
+    std::condition_variable detectionDoneCond;
+
+    // Pixels closer than the background by more than the threshold are foreground (millimeters)
+    const int ForegroundDepthThreshold = 15;
+
+    // Weight of each frame in the running average of the background, once it is learned
+    const double BackgroundAdaptationRate = 0.02;
+
+    // The background is the average of the valid depths of the first samples, then follows the background pixels of
+    // the later frames
     int numBackgroundSamples = 0;
     int numRequiredBackgroundSamples = 5;
-    std::vector<cv::Mat> backgroundDepthSamples;
+    cv::Mat backgroundDepthSum;
+    cv::Mat backgroundDepthCount;
+    cv::Mat backgroundDepth; // Running average, as floats
     cv::Mat averageBackgroundDepth;
 
-    bool newFrameAvailable = false;
-    bool stopThread = false;
-    std::thread detectThread;
+    // Once a document is found, the next detections only match its appearance around its last position (in the frame
+    // resized to the depth resolution), and the whole frame is searched again every few detections or once it is lost
+    const int FullDetectionInterval = 10;
+    const int TrackingSearchMargin = 16;
+    const double TrackingMatchThreshold = 0.8;
+    bool isDocumentTracked = false;
+    int numTrackedDetections = 0;
+    cv::Rect trackedBox;
+    std::vector<cv::Point> trackedQuad; // Corners of the tracked document, in the same frame as trackedBox
+    float trackedAreaRatio = 0.0f;
+    cv::Size trackedFrameSize;
+    cv::Mat trackedTemplate;
+
+    // Intermediate images of the current detection, released when the next one starts
+    FrameArena detectionArena;
+
+    // The average cost of the detections is logged every CostReportInterval detections
+    const int CostReportInterval = 60;
+    double detectionCostMs = 0.0;
+    int numDetections = 0;
+
+    // Bytes held by the frame copies and the images of the detection, counted by the detection task at the end of each
+    // detection, as the capture thread fills the copies meanwhile
+    std::atomic<size_t> memoryUsage{ 0 };
+
+    // The submitted frames of a scene which did not change since the last frame detected are skipped, unless a document
+    // was found in that frame, and until MaxSkippedFrames frames were skipped in a row. The change is the share of
+    // the depth samples, taken every ChangeSampleStep pixels on each axis, which moved by more than ChangeDepthThreshold
+    // millimeters or became valid or invalid; the frames are not skipped while the background is learned.
+    const int ChangeSampleStep = 8;
+    const int ChangeDepthThreshold = 30;
+    const double MinChangedRatio = 0.01;
+    const int MaxSkippedFrames = 10;
+    std::vector<uint16_t> changeSamples; // Samples of the last frame detected, only used by the capture thread
+    int numSkippedFrames = 0; // Frames skipped in a row, only used by the capture thread
+    std::atomic<int> numUnchangedFrames{ 0 }; // Frames skipped since the last cost report
+    std::atomic<bool> isDocumentFound{ false };
+    std::atomic<bool> isBackgroundLearned{ false };
+
+    std::atomic<bool> isDetectionScheduled{ false };
+    std::atomic<bool> isStopping{ false };
 
     DetectionCallback resultCallback;
 
-    void StartDetectionThread();
-    void StopDetectionThread();
+    bool HasSceneChanged(const cv::Mat& depth);
+    void ScheduleDetection();
+    void RunDetection();
+    void EndDetection();
+    void RecordDetectionCost(double costMs);
+    void PublishDocument(const cv::Mat& data, short width, short height, float score, const cv::Rect2f& region);
+    double ScoreSharpness(const cv::Mat& cropped);
+    bool TrackDocument(const cv::Mat& gray);
+    void ComputeSignature(const cv::Mat& documentData, DocumentSignature& signature);
+    cv::Size GetCropSize(const cv::Size& documentSize) const;
+    bool CropDocument(const cv::Mat& originalImage, const cv::Mat& mask, const std::vector<cv::Point>& quad, cv::Mat& cropped,
+        cv::Size& documentSize, double& sharpnessScore);
     std::function<void(const std::string&)> logFn;
 };
\ No newline at end of file
@@ -0,0 +1,76 @@
+/***************************************************************************\
+
+Module Name:  ExclusionMask.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module learns the static clutter of the empty scene (stand, walls,
+furniture) as a mask of world space voxels, from the points of the frames
+captured at setup time. The voxels the clutter fills are excluded, and the
+points which fall in them can then be removed with a single bit test. The
+mask is saved next to the calibration of the camera, and is only valid as
+long as that calibration is.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+class ExclusionMask {
+public:
+    void Clear();
+    void StartLearning(const float* minBounds, const float* maxBounds, int numFrames);
+    void Learn(const float* x, const float* y, const float* z, int count);
+    bool IsLearning() const;
+    bool IsLearned() const;
+    int GetNumExcludedVoxels() const;
+    size_t GetMemoryUsage() const;
+
+    bool Load(const std::string& serialNumber);
+    bool Save(const std::string& serialNumber) const;
+    static std::string GetFileName(const std::string& serialNumber);
+
+    // Indicates whether the given world space point is in an excluded voxel. Adding one before the truncation keeps
+    // the points below the origin negative, so that they fail the unsigned comparison with the size of the grid
+    inline bool IsExcluded(float x, float y, float z) const {
+        unsigned int ix = static_cast<unsigned int>(static_cast<int>((x - origin[0]) * inverseVoxelSize + 1.0f) - 1);
+        unsigned int iy = static_cast<unsigned int>(static_cast<int>((y - origin[1]) * inverseVoxelSize + 1.0f) - 1);
+        unsigned int iz = static_cast<unsigned int>(static_cast<int>((z - origin[2]) * inverseVoxelSize + 1.0f) - 1);
+
+        if (ix >= dims[0] || iy >= dims[1] || iz >= dims[2])
+            return false;
+
+        size_t index = (static_cast<size_t>(iz) * dims[1] + iy) * dims[0] + ix;
+        return (excludedVoxels[index >> 6] >> (index & 63)) & 1;
+    }
+
+private:
+    const float MinVoxelSize = 0.02f;
+    const size_t MaxNumVoxels = size_t(1) << 24; // The voxels grow past MinVoxelSize for larger bounds
+    const int MinHitRatio = 10; // A voxel is excluded when it has points in at least one in MinHitRatio learning frames
+    const int MinHitFrames = 2;
+
+    float origin[3] = {};
+    float voxelSize = 0.0f;
+    float inverseVoxelSize = 0.0f;
+    unsigned int dims[3] = {};
+
+    int numLearningFrames = 0;
+    int numLearnedFrames = 0;
+
+    // Number of learning frames which had points in each voxel, and the voxels of the current frame
+    std::vector<uint8_t> hitCounts;
+    std::vector<uint64_t> frameHits;
+
+    // One bit per voxel, x first; empty until the mask is learned or loaded
+    std::vector<uint64_t> excludedVoxels;
+
+    size_t GetNumVoxels() const;
+    void FinishLearning();
+};
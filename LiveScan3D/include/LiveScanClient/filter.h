@@ -7,7 +7,9 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module applies a KNN filter to a point cloud to remove some unwanted outlier
-points.
+points. The neighbours are either searched in 3D, in a voxel hash grid or a
+KD-tree, or, for the organized filter, in a small window of the depth image
+around each point.
 
 This code was adapted from the following research:
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
@@ -19,29 +21,26 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 #pragma once
 
 #include <vector>
+#include <cstdint>
+#include <cmath>
 #include "nanoflann.h"
 #include "utils.h"
-
-struct KNNResult
-{
-	std::vector<size_t> Neighbors;
-	std::vector<float> Distances;
-	float KthNeighbourDistance;
-};
+#include "voxelHashGrid.h"
 
 struct PointCloud
 {
-	std::vector<Point3f> Points;
+	// Points are read in place from the buffer, which must outlive the KD-tree
+	const PointBuffer* Points = nullptr;
 
 	// nanoflann adaptor methods
-	inline size_t kdtree_get_point_count() const { return Points.size(); }
+	inline size_t kdtree_get_point_count() const { return Points ? Points->Size() : 0; }
 
 	// Computes the distance between the vector "queryPoint[0:size-1]" and the data point with index "targetIdx" stored in the class
 	inline float kdtree_distance(const float *queryPoint, const size_t targetIdx, size_t /*size*/) const
 	{
-		const float dx = queryPoint[0] - Points[targetIdx].X;
-		const float dy = queryPoint[1] - Points[targetIdx].Y;
-		const float dz = queryPoint[2] - Points[targetIdx].Z;
+		const float dx = queryPoint[0] - Points->X[targetIdx];
+		const float dy = queryPoint[1] - Points->Y[targetIdx];
+		const float dz = queryPoint[2] - Points->Z[targetIdx];
 
 		return dx * dx + dy * dy + dz * dz;
 	}
@@ -49,9 +48,9 @@ struct PointCloud
 	// Returns the dimemsion-th component of the point at the specified index in the class:
 	inline float kdtree_get_pt(const size_t index, int dimension) const
 	{
-		if (dimension == 0) return Points[index].X;
-		else if (dimension == 1) return Points[index].Y;
-		else return Points[index].Z;
+		if (dimension == 0) return Points->X[index];
+		else if (dimension == 1) return Points->Y[index];
+		else return Points->Z[index];
 	}
 
 	// Optional bounding-box computation: return false to default to a standard bbox computation loop.
@@ -65,4 +64,138 @@ using KdTree3D = nanoflann::KDTreeSingleIndexAdaptor<
 	nanoflann::L2_Simple_Adaptor<float, PointCloud>,
 	PointCloud, 3>;
 
-void Filter(std::vector<Point3f> &vertices, std::vector<RGB> &colors, int k = 10, float maxDist = 0.01);
\ No newline at end of file
+// The mode of the RadiusOutlierFilter keeps the name it has in the settings of the server, from when it always
+// searched the KD-tree
+enum FilterMode
+{
+	KdTreeFilterMode,
+	OrganizedFilterMode
+};
+
+/// <summary>
+/// Keep or reject decisions of an outlier filter, cached for each depth pixel along with the voxel of the point they
+/// were made for, so that the points of a static scene reuse the decisions of the previous frame instead of searching
+/// their neighbours again. A decision is only reused for a point of the same pixel and voxel as in the previous frame,
+/// and one pixel out of RefreshInterval is decided again each frame, in turn, so that the decisions changed by the
+/// motion of the neighbours alone are made again within RefreshInterval frames.
+/// </summary>
+class OutlierDecisionCache
+{
+public:
+	static const int NoDecision = -1;
+
+	void Reset();
+	void BeginFrame(size_t numPixels, int k, float maxDist);
+	size_t GetMemoryUsage() const;
+
+	// Decision of the previous frame for the point of a pixel, 1 kept and 0 rejected, or NoDecision when it must be
+	// made again; the pixels are independent, so the points of a frame can be looked up and stored concurrently
+	inline int Find(int pixelIndex, float x, float y, float z) const
+	{
+		const Entry& entry = entries[pixelIndex];
+
+		if (entry.frame != previousFrame || entry.voxel != GetVoxel(x, y, z) || (pixelIndex + frameIndex) % RefreshInterval == 0)
+			return NoDecision;
+
+		return entry.isKept;
+	}
+
+	inline void Store(int pixelIndex, float x, float y, float z, bool isKept)
+	{
+		Entry& entry = entries[pixelIndex];
+		entry.voxel = GetVoxel(x, y, z);
+		entry.frame = frameIndex;
+		entry.isKept = isKept ? 1 : 0;
+	}
+
+private:
+	static const int RefreshInterval = 8;
+	static const uint16_t UnusedFrame = 0xFFFF; // Never the previous frame, so the entries of this frame are never reused
+
+	struct Entry
+	{
+		uint32_t voxel;
+		uint16_t frame;
+		uint8_t isKept;
+	};
+
+	std::vector<Entry> entries;
+	uint16_t frameIndex = 0;
+	uint16_t previousFrame = UnusedFrame;
+	int neighbours = 0;
+	float distance = 0.0f;
+	float inverseVoxelSize = 0.0f;
+
+	// The voxels are as large as the filter distance, and their coordinates wrap around every 1024 voxels, which is
+	// far more than a point moves between two frames
+	inline uint32_t GetVoxel(float x, float y, float z) const
+	{
+		uint32_t vx = static_cast<uint32_t>(static_cast<int32_t>(std::floor(x * inverseVoxelSize))) & 0x3FF;
+		uint32_t vy = static_cast<uint32_t>(static_cast<int32_t>(std::floor(y * inverseVoxelSize))) & 0x3FF;
+		uint32_t vz = static_cast<uint32_t>(static_cast<int32_t>(std::floor(z * inverseVoxelSize))) & 0x3FF;
+		return (vz << 20) | (vy << 10) | vx;
+	}
+};
+
+/// <summary>
+/// Outlier filter using the 3D neighbours of the points: a point is kept when at least k points lie within the radius of
+/// the filter. The neighbours are counted in a voxel hash grid of voxels as large as the radius, by default, or in the
+/// KD-tree, which also gives the KNN output arrays. The grid, the KD-tree and the KNN output arrays are kept between
+/// frames and only rebuilt over the new points.
+/// </summary>
+class RadiusOutlierFilter
+{
+public:
+	RadiusOutlierFilter();
+
+	void Apply(PointBuffer &points, int k = 10, float maxDist = 0.01f, OutlierDecisionCache* decisions = nullptr,
+		const unsigned char* sureKept = nullptr);
+	void SetHashGridEnabled(bool isEnabled);
+	void ComputeKNearestNeighbours(const PointBuffer &points, int k);
+	size_t GetMemoryUsage() const;
+	void ReleaseUnusedMemory();
+
+	// Output of ComputeKNearestNeighbours: the k neighbours of point i (including itself) are stored, sorted by
+	// increasing squared distance, at [i * k, (i + 1) * k)
+	std::vector<size_t> neighbourIndices;
+	std::vector<float> neighbourDistances;
+
+private:
+	const int BlockSize = 1024;
+
+	PointCloud cloud;
+	KdTree3D tree;
+	VoxelHashGrid grid;
+	bool isHashGridUsed = true; // Apply counts the neighbours in the grid rather than in the KD-tree
+
+	std::vector<unsigned char> isKept;
+
+	void BuildIndex(const PointBuffer &points);
+};
+
+/// <summary>
+/// Outlier filter using the depth image layout of the points instead of a KD-tree. The points are scattered back into
+/// image-sized coordinate planes using their pixel index, and the neighbours of a point are searched in a window of
+/// pixels around its own. The planes are kept between frames so that filtering a frame does not allocate.
+/// </summary>
+class OrganizedFilter
+{
+public:
+	void Apply(PointBuffer &points, int imageWidth, int imageHeight, int k = 10, float maxDist = 0.01f, OutlierDecisionCache* decisions = nullptr);
+	size_t GetMemoryUsage() const;
+	void ReleaseUnusedMemory();
+
+private:
+	const int WindowRadius = 3; // 7x7 pixels window
+	const int BlockSize = 4096;
+
+	int width = 0;
+	int height = 0;
+
+	// Coordinates of the point of each pixel; pixels without a point have an infinite X so they are never neighbours
+	std::vector<float> gridX;
+	std::vector<float> gridY;
+	std::vector<float> gridZ;
+
+	std::vector<unsigned char> isKept;
+};
\ No newline at end of file
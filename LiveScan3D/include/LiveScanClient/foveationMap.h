@@ -0,0 +1,72 @@
+/***************************************************************************\
+
+Module Name:  FoveationMap.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module finds the regions of interest of the depth frames, which keep
+the full density of the points while the rest of the frame is decimated in
+coarser voxels. The regions are tiles of the depth frame: the tiles where
+the depth moves along with their neighbours, such as the hands of the
+operator, and those of the last detected document, each kept for a while
+after they were last seen.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "frameAllocator.h"
+#include <vector>
+#include <cstdint>
+
+class FoveationMap {
+public:
+    void Reset();
+    void Update(const uint16_t* depth, int width, int height);
+    void SetDocumentRegion(float left, float top, float regionWidth, float regionHeight);
+    size_t GetMemoryUsage() const;
+
+    // Indicates whether a pixel of the last depth frame passed to Update lies in a region of interest
+    inline bool IsFoveated(int pixelIndex) const {
+        return pixelFovea[pixelIndex] != 0;
+    }
+
+private:
+    const int TileShift = 4; // Tiles of 16x16 pixels
+    const int TileSize = 1 << TileShift;
+    const int SampleStep = 2; // Motion is measured on one pixel out of SampleStep in each direction
+
+    // A sample moves when its depth changes more than the noise of the sensor, which grows by 1/32 of the depth, and a
+    // tile moves when one of its samples out of MovingSampleRatio does
+    const int BaseMotionMm = 30;
+    const int RelativeMotionShift = 5;
+    const int MovingSampleRatio = 8;
+
+    // Frames the regions are kept after they were last seen, so that a hand which pauses or a document which is only
+    // detected every few frames keeps its density
+    const int MotionHoldFrames = 15;
+    const int DocumentHoldFrames = 90;
+
+    // The document is found in the color frame, whose view is only close to that of the depth frame, so its region is
+    // widened by a few tiles to cover the offset between them
+    const int DocumentMarginTiles = 2;
+
+    int width = 0;
+    int height = 0;
+    int numTilesX = 0;
+    int numTilesY = 0;
+
+    FrameVector<uint16_t> previousDepth;
+    std::vector<uint16_t> numMovingSamples; // Of each tile in the current frame
+    std::vector<uint8_t> motionHoldFrames; // Frames each tile stays a region of interest without moving again
+
+    float documentRegion[4] = {}; // Left, top, width and height, as fractions of the frame
+    int documentHoldFrames = 0;
+
+    FrameVector<uint8_t> pixelFovea; // 1 for the pixels of the regions of interest
+
+    void UpdateMotion(const uint16_t* depth);
+    void UpdatePixelFovea();
+};
@@ -0,0 +1,64 @@
+/***************************************************************************\
+
+Module Name:  FrameAllocator.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the allocator of the frame-sized buffers of the
+capture, the processing and the recordings. The buffers are aligned to a
+cache line, which also suits the widest vector loads, and the largest ones
+can be backed by large pages, so that sweeping a frame does not miss the TLB
+every few kilobytes.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+const size_t FrameBufferAlignment = 64;
+
+void* AllocateFrameBuffer(size_t size);
+void FreeFrameBuffer(void* buffer);
+bool SetFrameLargePagesEnabled(bool isEnabled);
+
+/// <summary>
+/// Allocator of the standard containers which gets its storage from AllocateFrameBuffer
+/// </summary>
+template <typename T>
+class FrameAllocator
+{
+public:
+    typedef T value_type;
+
+    FrameAllocator() noexcept {}
+
+    template <typename U>
+    FrameAllocator(const FrameAllocator<U>&) noexcept {}
+
+    T* allocate(size_t count)
+    {
+        if (count > static_cast<size_t>(-1) / sizeof(T))
+            throw std::bad_alloc();
+
+        return static_cast<T*>(AllocateFrameBuffer(count * sizeof(T)));
+    }
+
+    void deallocate(T* items, size_t) noexcept
+    {
+        FreeFrameBuffer(items);
+    }
+};
+
+template <typename T, typename U>
+inline bool operator==(const FrameAllocator<T>&, const FrameAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+inline bool operator!=(const FrameAllocator<T>&, const FrameAllocator<U>&) { return false; }
+
+template <typename T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
@@ -0,0 +1,67 @@
+/***************************************************************************\
+
+Module Name:  FrameArena.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains a bump allocator for the temporary buffers of a frame.
+Allocations are served from a single block which is released all at once
+when the next frame starts. A frame which does not fit in the block falls
+back to the heap, and the block grows to fit it for the following frames.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+class FrameArena {
+public:
+    FrameArena();
+    ~FrameArena();
+
+    int Reset();
+    void* AllocateBytes(size_t size, size_t alignment);
+    cv::Mat AllocateMat(int rows, int cols, int type);
+
+    template <typename T>
+    T* Allocate(size_t count);
+
+    int GetNumHeapAllocations() const;
+    size_t GetCapacity() const;
+
+private:
+    static const size_t BlockAlignment = 64;
+
+    char* block;
+    size_t capacity;
+    size_t offset;
+
+    // Bytes requested by the current frame, padding included, whether or not they fit in the block
+    size_t frameSize;
+
+    std::vector<char*> overflowAllocations;
+    int numHeapAllocations;
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+};
+
+// Returns value-initialized items which are valid until the next reset; their destructors are never run
+template <typename T>
+T* FrameArena::Allocate(size_t count) {
+    static_assert(std::is_trivially_destructible<T>::value, "Arena items are released without being destroyed");
+
+    T* items = static_cast<T*>(AllocateBytes(count * sizeof(T), alignof(T)));
+
+    for (size_t i = 0; i < count; i++)
+        new (items + i) T();
+
+    return items;
+}
@@ -7,7 +7,19 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module reads and writes point cloud frames to files for recording and
-playback purposes.
+playback purposes. Recordings are written in the version 3 format: a file
+header, then each frame as a fixed binary header followed by its points and
+colors, then an index of the frames and a footer which locates it, so that
+readers seek to any frame directly. The points and colors of a frame are
+compressed with zstd, optionally as their difference with the previous
+frame, with a full frame at regular intervals for the readers which seek.
+Version 2 recordings, whose frames are not compressed, and version 1
+recordings, whose frames have a text header, are still read. The frames are
+compressed and written by a writer thread, in large blocks, from a bounded
+queue of the published frames; when the disk falls behind, the newest
+frames are dropped rather than the capture waiting for it. The clients of a
+process can share one recording, which interleaves the frames of their
+cameras in the order they are recorded, with a single writer and index.
 
 This code was adapted from the following research:
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
@@ -22,27 +34,199 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 #include <string>
 #include <vector>
 #include <chrono>
+#include <memory>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include "utils.h"
 
+// Declared as zstd.h does, so that the layout of the class does not depend on whether zstd is built in (LIVESCAN_ZSTD)
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+
+#pragma pack(push, 1)
+struct RecordingFileHeader
+{
+	char Magic[4]; // RecordingMagic
+	uint16_t Version; // RecordingVersion
+	uint16_t Reserved;
+};
+
+struct RecordingFrameHeader
+{
+	uint32_t NumPoints; // Followed by the points (Point3s), then their colors (RGB)
+	int32_t CameraID;
+	uint64_t Timestamp; // Capture timestamp of the device
+
+	// Version 3 only: size of the data which follows, and how it is encoded (RecordingEncoding)
+	uint32_t DataSize;
+	uint8_t Encoding;
+	uint8_t Reserved[3];
+};
+
+// Encodings of the frames of version 3 recordings; delta frames hold the difference of each coordinate and color
+// component with those of the previous frame, where it has one
+enum RecordingEncoding
+{
+	RawEncoding = 0,
+	ZstdEncoding = 1,
+	ZstdDeltaEncoding = 2
+};
+
+struct RecordingIndexEntry
+{
+	uint64_t Offset; // Offset of the frame header from the start of the file
+	uint32_t NumPoints;
+	uint64_t Timestamp;
+	int32_t CameraID;
+};
+
+struct RecordingFooter
+{
+	uint64_t IndexOffset; // Offset of the first index entry from the start of the file
+	uint32_t NumFrames;
+	char Magic[4]; // RecordingMagic
+};
+#pragma pack(pop)
+
+// Counters of the current recording, reset when a recording starts
+struct RecordingStats
+{
+	uint64_t NumWrittenFrames = 0;
+	uint64_t NumDroppedFrames = 0; // Frames which were not recorded because the write queue was full
+	uint64_t NumWrittenBytes = 0;
+	size_t MaxQueuedFrames = 0; // Highest number of frames waiting to be written
+};
+
 class FrameIOHandler
 {
 public:
+	// Reads the frames of all the cameras of a recording
+	static const int AnyDevice = -1;
+
 	~FrameIOHandler();
 
-	void WriteFrame(std::vector<Point3s> points, std::vector<RGB> colors, uint64_t timestamp, int deviceID);
-	bool ReadFrame(std::vector<Point3s> &outPoints, std::vector<RGB> &outColors);
+	// Recording shared by the clients of the process, which interleaves the frames of their cameras in one file; it is
+	// created by the first client which acquires it, and closed once the last one releases it
+	static std::shared_ptr<FrameIOHandler> AcquireSharedRecording();
+
+	bool WriteFrame(std::shared_ptr<const std::vector<Point3s>> points, std::shared_ptr<const std::vector<RGB>> colors, uint64_t timestamp, int deviceID,
+		bool isQueueWaited = false);
+	bool ReadFrame(std::vector<Point3s> &outPoints, std::vector<RGB> &outColors, int deviceID = AnyDevice);
 	void CloseFile();
 
+	RecordingStats GetRecordingStats();
+
+	// Applied when the next recording starts; a level of 0, or a build without zstd (LIVESCAN_ZSTD), leaves the
+	// frames uncompressed
+	void SetCompression(int level, bool isDeltaEnabled);
+
 private:
+	static const char RecordingMagic[4];
+	static const uint16_t RecordingVersion = 3;
+	static const size_t V2FrameHeaderSize = 16;
+
+	// Frames between two full frames of a delta compressed recording
+	static const int DeltaKeyframeInterval = 30;
+
+	// Frames waiting to be written, for each camera recorded, past which the new frames are dropped, and size of the
+	// blocks written to the file
+	static const size_t MaxQueuedFrames = 8;
+	static const size_t WriteBlockSize = 4 * 1024 * 1024;
+
+	// Frame waiting to be written; the buffers are those of the published frame, which is never modified
+	struct QueuedFrame
+	{
+		std::shared_ptr<const std::vector<Point3s>> Points;
+		std::shared_ptr<const std::vector<RGB>> Colors;
+		uint64_t Timestamp = 0;
+		int DeviceID = 0;
+	};
+
+	// Frame of another camera of an interleaved recording, read before the frame asked for and kept for its client
+	struct PendingFrame
+	{
+		std::vector<Point3s> Points;
+		std::vector<RGB> Colors;
+	};
+
+	static std::mutex sharedRecordingMutex;
+	static std::weak_ptr<FrameIOHandler> sharedRecording;
+
+	// Guards the opening, reading and closing of the file, which the clients of a shared recording do concurrently
+	std::mutex fileMutex;
+
 	FILE* fileHandle = nullptr;
 	std::string filename = "";
 	bool isFileOpenForWriting = false;
 	bool isFileOpenForReading = false;
+	bool isShared = false;
+
+	// Frames written to the current recording, indexed when it is closed; only used by the writer thread while it runs
+	std::vector<RecordingIndexEntry> frameIndex;
+
+	std::thread writerThread;
+	std::mutex writeQueueMutex;
+	std::condition_variable writeQueueCond;
+	std::condition_variable writeQueueSpaceCond; // Signaled whenever the writer thread takes a frame
+	std::deque<QueuedFrame> writeQueue;
+	std::map<int, uint64_t> queuedDeviceFrames; // Frames queued by each camera of the recording so far
+	bool isWriteStopRequested = false;
+
+	// Bytes waiting to be written as one block, and the offset in the file they start at
+	std::vector<char> writeBuffer;
+	uint64_t writeBufferOffset = 0;
+
+	// Compression requested for the next recording, and the one of the current recording
+	std::atomic<int> requestedCompressionLevel{ 3 };
+	std::atomic<bool> isDeltaRequested{ false };
+	int compressionLevel = 0;
+	bool isDeltaEnabled = false;
+
+	// Compression state of the writer thread: the frame staged for compression, the compressed frame, and the
+	// previous frame the deltas are taken from
+	ZSTD_CCtx* compressionContext = nullptr;
+	FrameVector<char> stagedFrame;
+	FrameVector<char> compressedFrame;
+	std::vector<short> previousCoordinates;
+	std::vector<uint8_t> previousColorBytes;
+	int numFramesSinceKeyframe = 0;
+
+	// Decompression state of the reader, which keeps the previous frame for the delta frames
+	ZSTD_DCtx* decompressionContext = nullptr;
+	std::vector<char> readCompressedFrame;
+	std::vector<char> readDecodedFrame;
+	int readCameraID = 0; // Of the frame last read
+	std::map<int, std::deque<PendingFrame>> pendingFrames;
+
+	std::atomic<uint64_t> numWrittenFrames{ 0 };
+	std::atomic<uint64_t> numWrittenBytes{ 0 };
+	uint64_t numDroppedFrames = 0;
+	size_t maxQueuedFrames = 0;
+
+	// Version of the recording being read, and the end of its frames (the start of the index, or the end of the file
+	// if the recording was not closed)
+	int readVersion = 0;
+	int64_t framesEndOffset = 0;
 
 	std::chrono::steady_clock::time_point recordingStartTime;
 
 	void OpenNewFileForWriting(int deviceID);
 	void OpenFileForReading();
+	void CloseOpenFile();
+	void StopWriter();
+	void WriteLoop();
+	void AppendFrame(const QueuedFrame& frame);
+	bool CompressFrame(const QueuedFrame& frame, uint32_t numPoints, RecordingFrameHeader& header);
+	void AppendBytes(const void* data, size_t size);
+	void FlushWriteBuffer();
+	void WriteFrameIndex();
+
+	bool ReadFrameV1(std::vector<Point3s> &outPoints, std::vector<RGB> &outColors);
+	bool ReadFrameV2(std::vector<Point3s> &outPoints, std::vector<RGB> &outColors);
 
 	void ResetRecordingTimer();
 	int GetElapsedRecordingTimeMs();
@@ -0,0 +1,60 @@
+/***************************************************************************\
+
+Module Name:  FrameRing.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module keeps the last seconds of processed frames in memory, so that
+they can be saved after the fact without the server requesting each frame.
+The ring holds one slot per frame of its duration at the camera frame rate;
+the buffers of a slot are reused once it wraps around. A save writes the
+frames to a recording on a thread of its own, and the ring stops taking new
+frames until then so that the saved ones are not overwritten.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "frameIOHandler.h"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class FrameRing {
+public:
+    ~FrameRing();
+
+    void SetDuration(int seconds);
+    void SetCompression(int level, bool isDeltaEnabled);
+    bool Push(const std::vector<Point3s>& points, const std::vector<RGB>& colors, uint64_t timestamp);
+    bool Save(int seconds, int deviceID);
+    size_t GetMemoryUsage();
+    void ReleaseUnusedMemory();
+
+private:
+    static const int FramesPerSecond = 30;
+    static const int MaxDuration = 120; // In seconds
+
+    struct Slot {
+        std::shared_ptr<std::vector<Point3s>> Points;
+        std::shared_ptr<std::vector<RGB>> Colors;
+        uint64_t Timestamp = 0;
+        std::chrono::steady_clock::time_point PushTime;
+    };
+
+    std::mutex ringMutex;
+    std::vector<Slot> slots;
+    size_t numRequestedSlots = 0; // Applied by the next frame pushed while no save runs
+    size_t nextSlot = 0;
+    size_t numFrames = 0;
+    bool isSaving = false;
+
+    std::thread saverThread;
+    FrameIOHandler snapshotWriter;
+
+    void SaveFrames(std::vector<Slot> frames, int deviceID);
+};
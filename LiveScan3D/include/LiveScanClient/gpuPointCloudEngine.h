@@ -0,0 +1,80 @@
+/***************************************************************************\
+
+Module Name:  GpuPointCloudEngine.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module generates the point cloud of a depth frame with a DirectCompute
+shader. On top of the depth to color alignment done by the point cloud kernel,
+it applies the calibration, the bounds crop and the voxel grid decimation on
+the GPU and reads back only the compacted points.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "utils.h"
+#include "pointCloudKernel.h"
+#include <d3d11.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+class GpuPointCloudEngine
+{
+public:
+    GpuPointCloudEngine();
+    ~GpuPointCloudEngine();
+
+    bool Initialize(int depthWidth, int depthHeight, int colorWidth, int colorHeight, const FrameVector<Point2f>& rays);
+    bool IsInitialized() const;
+    bool Process(const PointCloudKernelParams& params, const FrameProcessingParams& processing, PointBuffer& points, cv::Mat* alignedDepth);
+    void Release();
+    void SetLogger(std::function<void(const std::string&)> loggerFunc);
+
+private:
+    const int ThreadGroupSize = 8;
+
+    bool isInitialized = false;
+
+    int depthWidth = 0;
+    int depthHeight = 0;
+    int colorWidth = 0;
+    int colorHeight = 0;
+    UINT claimSlots = 0; // Power of two
+    UINT claimShift = 0;
+
+    ID3D11Device* device = NULL;
+    ID3D11DeviceContext* context = NULL;
+    ID3D11ComputeShader* shader = NULL;
+    ID3D11ComputeShader* claimShader = NULL;
+    ID3D11Buffer* constants = NULL;
+
+    ID3D11Buffer* depthBuffer = NULL;
+    ID3D11Buffer* colorBuffer = NULL;
+    ID3D11Buffer* rayBuffer = NULL;
+    ID3D11ShaderResourceView* depthView = NULL;
+    ID3D11ShaderResourceView* colorView = NULL;
+    ID3D11ShaderResourceView* rayView = NULL;
+
+    ID3D11Buffer* outputBuffer = NULL;
+    ID3D11Buffer* claimKeyBuffer = NULL;
+    ID3D11Buffer* claimWinnerBuffer = NULL;
+    ID3D11Buffer* alignedDepthBuffer = NULL;
+    ID3D11UnorderedAccessView* outputView = NULL;
+    ID3D11UnorderedAccessView* claimKeyView = NULL;
+    ID3D11UnorderedAccessView* claimWinnerView = NULL;
+    ID3D11UnorderedAccessView* alignedDepthView = NULL;
+
+    ID3D11Buffer* countStaging = NULL;
+    ID3D11Buffer* outputStaging = NULL;
+    ID3D11Buffer* alignedDepthStaging = NULL;
+
+    std::function<void(const std::string&)> logFn;
+
+    bool CreateShader();
+    bool CreateBuffers(const FrameVector<Point2f>& rays);
+    void UpdateConstants(const PointCloudKernelParams& params, const FrameProcessingParams& processing, bool isAlignedDepthRequested);
+};
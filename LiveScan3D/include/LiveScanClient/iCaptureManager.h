@@ -20,7 +20,13 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 #pragma once
 
 #include "utils.h"
+#include "rawFrameRecorder.h"
+#include "perfStats.h"
+#include "memoryUsage.h"
+#include "threadAffinity.h"
+#include "sceneChangeDetector.h"
 #include <functional>
+#include <atomic>
 #include <documentDetector.h>
 
 class ICaptureManager
@@ -31,30 +37,86 @@ public:
 	int colorFrameHeight, colorFrameWidth;
 	int depthFrameHeight, depthFrameWidth;
 
-	UINT16* depthData;
-	RGB* colorData;
+	// Read-only views into the buffers of the latest frame; they remain valid until the next AcquireFrame call
+	const UINT16* depthData;
+	const BYTE* colorData; // Laid out as colorFormat, packed RGB888 (Red, Green, Blue) unless a YUV stream was requested
+	ColorFormat colorFormat;
+	bool isColorVideoRange; // The YUV values span 16 to 235, as the camera streams them, rather than the whole byte
 
-	std::vector<Point3f> lastFrameVertices;
-	std::vector<RGB> lastFrameColors;
+	// Valid points of the latest frame
+	PointBuffer lastFramePoints;
+	bool isFrameInWorldSpace; // Set when the calibration has already been applied to lastFramePoints
 
-	cv::Mat lastDocumentData;
+	// Compacted world space point cloud, filled instead of lastFramePoints when the frame was processed by the capture backend
+	bool hasProcessedFrame;
+	PointBuffer lastProcessedPoints;
+
+	// The frames whose depth did not change since the last frame the client processed are not generated while the
+	// detection is enabled and the client can reuse its last frame, both set by the client before each AcquireFrame;
+	// isFrameStatic is then set instead, and the client accepts the frames it processes
+	bool isStaticFrameDetectionEnabled;
+	bool isStaticFrameReusable;
+	bool isFrameStatic;
+	SceneChangeDetector sceneChangeDetector;
+
+	std::vector<uchar> lastDocumentJpeg;
 	float lastDocumentScore;
 	short lastDocumentWidth;
 	short lastDocumentHeight;
+	DocumentSignature lastDocumentSignature;
+	cv::Rect2f lastDocumentRegion; // Fractions of the color frame
 	bool hasNewDocument;
 
+	// Time between two frames sent to the document detection, lengthened by the server while the documents of this
+	// camera lose its arbitration to those of another camera
+	static const int DefaultDocumentFrameIntervalMs = 1000;
+	std::atomic<int> documentFrameIntervalMs;
+
+	// Set by the frame time budget of the client, which stops sending frames to the document detection under load
+	std::atomic<bool> isDocumentSubmissionPaused;
+
+	// Fraction of the frame period the processing of each frame is delayed by after the frame arrives, set by the
+	// client to spread the processing of the synced cameras over the period; 0 processes the frames as they arrive
+	std::atomic<float> processingPhase;
+
 	std::string serialNumber;
 
 	std::unique_ptr<DocumentDetector> documentDetector;
 
+	// Stage timings of the client, which owns them; null to leave the stages of the capture unmeasured
+	PerfStats* perfStats;
+
 	ICaptureManager();
 	~ICaptureManager();
 
 	virtual bool Initialize(SyncState state, int syncOffset) = 0;
 	virtual bool AcquireFrame(bool isCalibrationDataRequested) = 0;
+	virtual bool StartStreaming(SyncState state, int syncOffset) = 0;
+	virtual bool StopStreaming() = 0;
 	virtual bool Close() = 0;
 	virtual uint64_t GetTimeStamp() = 0;
 	virtual int GetDeviceIndex() = 0;
 	virtual void SetExposureState(bool enableAutoExposure, int exposureStep) = 0;
 	virtual void SetLogger(std::function<void(const std::string&)> loggerFunc) = 0;
+	virtual void SetProcessingBackend(ProcessingBackend backend) = 0;
+	virtual void SetCaptureMode(CaptureMode mode) = 0;
+	virtual void SetColorStreamSettings(const ColorStreamSettings& settings) = 0;
+	virtual void SetFrameProcessingParams(const FrameProcessingParams& params) = 0;
+	virtual void SetRawRecording(bool isEnabled) = 0;
+	virtual void SetDepthBinning(bool isBinned) = 0; // Applied before the next frame, by restarting the pipeline
+	virtual void SetThreadAffinity(const ThreadAffinity& affinity) = 0; // Processors of the threads of the capture manager
+	virtual RawCameraParams GetCameraParams() = 0; // Camera parameters of the latest frame
+
+	// Buffers of the frames, not counting the document detection; both are called by the capture thread between frames
+	virtual size_t GetMemoryUsage() const;
+	virtual void ReleaseUnusedMemory();
+
+	// Recovery of a camera lost by its connection: the implementations which can reopen their device close it once it
+	// is lost, and reopen it when RecoverDevice is called by the client, which keeps its calibration meanwhile
+	virtual bool IsDeviceLost() const;
+	virtual void RequestDeviceRecovery();
+	virtual bool RecoverDevice(SyncState state, int syncOffset);
+
+protected:
+	bool UpdateStaticFrame(bool isGenerationRequired);
 };
\ No newline at end of file
@@ -0,0 +1,89 @@
+/***************************************************************************\
+
+Module Name:  ILiveScanClient.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module defines the interface of the clients the DLL hands to the
+server through its API: the clients of the cameras of this computer, and
+the remote clients of the cameras hosted by capture nodes on other
+computers, which the server controls the same way.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "utils.h"
+#include "transferObjectUtils.h"
+#include "perfStats.h"
+#include "memoryUsage.h"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct LiveScanClientWrapper;
+
+// Processed point cloud handed to the server; never modified once published
+struct ProcessedFrame
+{
+    std::vector<Point3s> Vertices;
+    std::vector<RGB> Colors;
+    std::vector<uint8_t> Normals; // One octahedral byte per vertex, see NormalEstimator; empty when not estimated
+    uint64_t SequenceNumber = 0; // Incremented for every published frame; 0 until the first one
+    uint64_t TimeStampUs = 0; // Global timestamp of the color frame the points were generated from, on the system clock of this computer
+
+    // Host times at which the capture manager returned the frame and at which its points were published, so that the
+    // server can trace the latency of each frame from its acquisition
+    std::chrono::steady_clock::time_point AcquireTime;
+    std::chrono::steady_clock::time_point PublishTime;
+};
+
+// Depth frame handed to the server for the projective pose refinement, with what unprojects it to world space
+struct DepthFrame
+{
+    std::vector<UINT16> Depth; // In millimeters
+    int Width = 0;
+    int Height = 0;
+    float Intrinsics[4] = {}; // Depth camera fx, fy, cx, cy
+    float DepthToWorld[12] = {}; // Depth camera space (meters) to world space, 3x4 row-major
+};
+
+class ILiveScanClient
+{
+public:
+    LiveScanClientWrapper* wrapper = nullptr;
+
+    virtual ~ILiveScanClient() {}
+
+    // Runs the client on the thread of its wrapper until RequestExit is called
+    virtual void Run() = 0;
+    virtual void RequestExit() = 0;
+
+    virtual void StartFrameRecording() = 0;
+    virtual void Calibrate() = 0;
+    virtual bool GetCalibrationProgress(int& numSamples, int& numRequiredSamples) = 0;
+    virtual void SetDocumentFrameInterval(int intervalMs) = 0;
+    virtual void SetMaxDocumentSize(int width, int height) = 0;
+    virtual void SetSettings(const CameraSettings& settings) = 0;
+    virtual void SetExposure(bool isAutoExposureEnabled, int exposureStep) = 0;
+    virtual void RequestRecordedFrame() = 0;
+    virtual int RequestRecordedFrames(int maxFrames) = 0;
+    virtual std::shared_ptr<const ProcessedFrame> AcquireLatestFrame() = 0;
+    virtual bool WaitForNewFrame(uint64_t lastSequenceNumber, int timeoutMs) = 0;
+    virtual int CopyDocument(unsigned char* jpeg, int maxJpegSize, float& score, short& width, short& height, unsigned char* signature, int maxSignatureSize) = 0;
+    virtual int GetPerfStats(PerfStageStats* stats, int maxStages, bool isReset) = 0;
+    virtual void GetMemoryStats(ClientMemoryStats& stats) = 0;
+    virtual void GetFunnelStats(FrameFunnelStats& stats) = 0;
+    virtual bool AcquireDepthFrame(DepthFrame& frame, int timeoutMs) = 0;
+    virtual void ReceiveCalibration(const AffineTransform& transform) = 0;
+    virtual void ReceiveCameraPoses(const std::vector<AffineTransform>& poses, int cameraIndex) = 0;
+    virtual void ClearRecordedFrames() = 0;
+    virtual void SaveFrameRing(int seconds) = 0;
+    virtual void LearnExclusionMask(int numFrames) = 0;
+    virtual void EnableSync(int syncState, int syncOffset, int numSyncedDevices) = 0;
+    virtual void DisableSync() = 0;
+    virtual void StartMaster() = 0;
+};
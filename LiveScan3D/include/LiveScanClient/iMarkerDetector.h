@@ -49,4 +49,7 @@ public:
 
 	// Finds all markers in the provided 2D color frame and keeps the best detected one
 	virtual bool DetectMarkersInImage(RGB *img, int height, int width, MarkerInfo &marker) = 0;
+
+	// Same as above, but only searches the given region of the frame, in pixels
+	virtual bool DetectMarkersInImage(RGB *img, int height, int width, int regionX, int regionY, int regionWidth, int regionHeight, MarkerInfo &marker) = 0;
 };
\ No newline at end of file
@@ -27,33 +27,66 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 #include <windows.h>
 
 #include "liveScanClientWrapper.h"
+#include "iLiveScanClient.h"
+#include "clientEventQueue.h"
 #include "resource.h"
 #include "calibration.h"
 #include "orbbecCaptureManager.h"
+#include "replayCaptureManager.h"
 #include "frameIOHandler.h"
+#include "frameRing.h"
 #include "transferObjectUtils.h"
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <voxelGridFilter.h>
+#include <voxelDensityCounter.h>
+#include <filter.h>
+#include <normalEstimator.h>
+#include <backgroundModel.h>
+#include <exclusionMask.h>
+#include <foveationMap.h>
+#include <occupancyRoi.h>
+#include <frameArena.h>
+#include <perfStats.h>
+#include <asyncLogger.h>
+#include <memoryUsage.h>
+#include <clockModel.h>
+#include <threadAffinity.h>
 
-class LiveScanClient
+class LiveScanClient : public ILiveScanClient
 {
 public:
-    LiveScanClientWrapper* wrapper = nullptr;
-
-    LiveScanClient(int index);
+    LiveScanClient(int index, const std::string& replayPath = std::string(), bool isReplayRealTime = true);
     ~LiveScanClient();
 
     void Run();
     void StartFrameRecording();
     void Calibrate();
+    bool GetCalibrationProgress(int& numSamples, int& numRequiredSamples);
+    void SetDocumentFrameInterval(int intervalMs);
+    void SetMaxDocumentSize(int width, int height);
     void SetSettings(const CameraSettings& settings);
+    void SetExposure(bool isAutoExposureEnabled, int exposureStep);
     void RequestRecordedFrame();
-    void RequestLatestFrame();
+    int RequestRecordedFrames(int maxFrames);
+    std::shared_ptr<const ProcessedFrame> AcquireLatestFrame();
+    bool WaitForNewFrame(uint64_t lastSequenceNumber, int timeoutMs);
+    int CopyDocument(unsigned char* jpeg, int maxJpegSize, float& score, short& width, short& height, unsigned char* signature, int maxSignatureSize);
+    int GetPerfStats(PerfStageStats* stats, int maxStages, bool isReset);
+    void GetMemoryStats(ClientMemoryStats& stats);
+    void GetFunnelStats(FrameFunnelStats& stats);
+    bool AcquireDepthFrame(DepthFrame& frame, int timeoutMs);
     void ReceiveCalibration(const AffineTransform& transform);
+    void ReceiveCameraPoses(const std::vector<AffineTransform>& poses, int cameraIndex);
     void ClearRecordedFrames();
-    void EnableSync(int syncState, int syncOffset);
+    void SaveFrameRing(int seconds);
+    void LearnExclusionMask(int numFrames);
+    void EnableSync(int syncState, int syncOffset, int numSyncedDevices);
     void DisableSync();
     void StartMaster();
     void RequestExit();
@@ -61,75 +94,350 @@ public:
     std::function<void(const std::string&)> GetLogger();
 
 private:
-    const float Range = 0.3f;
-    const float HalfRange = Range / 2.0f;
-    const float MinPrecision = Range / 255; // Min precision (max resolution) with the set range and the number of values in a byte (255)
-    const int GridResolution = Range / MinPrecision;
+    // The capture range is set by the server. The default range fits in the byte grid of the receivers, with its min
+    // precision (max resolution) set by the number of values in a byte (255); larger ranges are sent with wider
+    // positions, and the voxel grid is then capped to MaxGridResolution cells on each axis to bound its memory
+    const float DefaultRange = 0.3f;
+    const float MaxRange = 10.0f;
+    const int MaxGridResolution = 511;
+
+    float range = DefaultRange;
+    float requestedRange = DefaultRange;
+    float halfRange = DefaultRange / 2.0f;
+    float minPrecision = DefaultRange / 255;
 
     const float XRangeCenter = 0.0f;
     const float YRangeCenter = 0.0f;
-    const float ZRangeCenter = HalfRange;
+    float zRangeCenter = DefaultRange / 2.0f;
+
+    const float DensityVoxelSize = 0.006f;
+    const int MinPointsPerDensityVoxel = 12;
+
+    // The point budget coarsens the voxel grid in steps of 2^(1/4), up to 16 times MinPrecision, one step per frame
+    const int VoxelLevelsPerOctave = 4;
+    const int MaxVoxelLevel = 16;
+    const float PointBudgetTolerance = 1.1f;
+
+    const int ProcessingChunkSize = 8192; // Number of points processed by each task of the parallel crop step
+
+    const int BackgroundRefreshInterval = 30; // Number of frames between two refreshes of the background points
+
+    // With the automatic depth binning, the camera is binned once the point budget holds the voxels at 4 times the
+    // finest size, which the binned pixels still fill, and unbinned an octave finer. The voxel level must stay past the
+    // threshold for a while, as each switch restarts the pipeline
+    const int BinnedDepthVoxelLevel = 8;
+    const int UnbinnedDepthVoxelLevel = 4;
+    const int DepthBinningSwitchFrames = 60;
+
+    // Frame time budget. Over the budget, the busy time of the frames sheds one more level of optional work: first the
+    // documents, then the neighbour filter of every other frame, then two voxel levels at a time, up to two octaves.
+    // Under RestoreBudgetRatio of the budget, one level is restored. The busy time is averaged over about 10 frames,
+    // and each change waits LoadShedSettleFrames for the average to follow it
+    const int ShedDocumentsLevel = 1;
+    const int ShedFilterLevel = 2;
+    const int NumShedVoxelLevels = 2;
+    const int MaxLoadShedLevel = 6;
+    const int FilterShedInterval = 2;
+    const float BusyTimeSmoothing = 0.1f;
+    const float RestoreBudgetRatio = 0.7f;
+    const int LoadShedSettleFrames = 30;
 
     const float DocumentDiffThreshold = 0.50;
     const int DocumentSendTimeout = 30000; // In milliseconds
 
     int clientIndex = -1;
-    bool isClientThreadRunning;
 
     bool isCalibrateRequested;
     bool isRecordFrameRequested;
-    bool isConfirmRecordedRequested;
-    bool isConfirmSyncStateRequested;
-    bool isConfirmRestartAsMasterRequested;
-    bool isConfirmCalibratedRequested;
-    bool isSendDocumentRequested;
     
     bool isFilterEnabled;
     int numFilterNeighbors;
     float filterThreshold;
+    FilterMode filterMode;
+    bool isDepthDenoiseEnabled;
+    bool isDepthHoleFillEnabled = false;
+    bool isColorDownscaleEnabled = false;
+    int framePairingToleranceUs = 5000;
+
+    BackgroundMode backgroundMode;
+    int numFramesSinceBackgroundRefresh;
 
     bool isAutoExposureEnabled;
     int numExposureSteps;
 
     bool isRestartingCamera;
 
+    ProcessingBackend processingBackend;
+    CaptureMode captureMode;
+    ColorStreamSettings colorStreamSettings;
+
+    int pointBudget; // Number of points each frame should have; 0 keeps the finest voxel grid
+    int voxelLevel;
+
+    DepthBinningMode depthBinningMode = DepthUnbinned;
+    bool isDepthBinned = false;
+    int numFramesPastBinningThreshold = 0;
+
+    // Processors of the frame loop and of the capture thread of the camera, applied by the frame loop before its next
+    // frame
+    ThreadAffinityMode threadAffinityMode = AffinityNone;
+    int numCoresPerCamera = 0;
+    ThreadAffinityMode appliedThreadAffinityMode = AffinityNone;
+    int appliedNumCoresPerCamera = 0;
+    ThreadAffinity threadAffinity;
+
+    bool areLargePagesRequested = false;
+
+    int frameTimeBudgetMs = 0; // Busy time each frame should take at most; 0 disables the load shedding
+    int loadShedLevel = 0;
+    float busyTimeAverageMs = 0.0f;
+    int numFramesSinceLoadShedChange = 0;
+    int numFramesSinceFiltered = 0;
+
     volatile bool isExitRequested = false;
 
     SyncState currentSyncState;
+    int currentSyncOffset = 0; // Capture offset multiplier of a subordinate, sent by the server
+    int numSyncedDevices = 1; // Devices on the sync chain, master included, sent by the server with the sync state
+
+    // The synced cameras capture together, so their frames would all be processed at once; when staggered, each camera
+    // starts processing its frames at the fraction of the frame period given by its place on the sync chain
+    bool isProcessingStaggered = false;
+
+    // Set while the camera is lost and reopened by the frame loop
+    const int RecoveryPollIntervalMs = 100;
+    bool isCameraLost = false;
 
     ICaptureManager* captureManager;
     Calibration calibration;
+
+    // Marker samples are detected on the task scheduler from a snapshot of the frame, one sample at a time, so that
+    // calibrating never slows down the capture loop. The result is copied to calibration once enough samples are found
+    Calibration calibrationSampler;
+    std::mutex calibrationMutex;
+    std::condition_variable calibrationDoneCond;
+    bool isCalibrationSampleRunning = false;
+    bool isCalibrationSampleComplete = false;
+    PointBuffer calibrationFramePoints;
+    int calibrationFrameWidth = 0;
+    int calibrationFrameHeight = 0;
+    std::vector<Point3f> calibrationDepthFrame;
+    std::vector<RGB> calibrationColorFrame;
+    std::atomic<int> numCalibrationSamples{ 0 }; // Samples found by the calibration task, read by the server for its progress
     VoxelGridFilter voxelGridFilter;
+
+    // Poses of all the calibrated cameras, from the server, between which the voxels of the grid are shared out. They
+    // are applied to the voxel grid by the capture thread before its next frame
+    std::mutex cameraOwnersMutex;
+    std::vector<VoxelOwner> requestedCameraOwners;
+    int requestedCameraOwnerIndex = -1;
+    bool isCameraOwnersChanged = false;
+    std::vector<VoxelOwner> cameraOwners;
+    int cameraOwnerIndex = -1;
+
+    VoxelDensityCounter densityCounter;
+    RadiusOutlierFilter radiusOutlierFilter;
+    OrganizedFilter organizedFilter;
+
+    // Decisions of the neighbour filter of the last filtered frame, reused by the points which did not move when
+    // enabled, for the filter mode they were made by
+    OutlierDecisionCache outlierDecisions;
+    FilterMode outlierDecisionsMode = KdTreeFilterMode;
+    bool isTemporalFilterEnabled = false;
+
+    // Normals of the processed points, estimated from the depth frame for the receivers which render surfels
+    NormalEstimator normalEstimator;
+    bool isNormalEstimationEnabled = false;
+    BackgroundModel backgroundModel;
+
+    // Voxels of the static clutter of the empty scene, whose points are removed from the frames. A request of the
+    // server starts learning it from the next frames, and 0 frames clears it; -1 when there is no request
+    const int DefaultExclusionLearningFrames = 30;
+    ExclusionMask exclusionMask;
+    std::atomic<int> requestedExclusionFrames{ -1 };
+
+    // Regions of interest of the frames, the moving parts and the last document, which keep the voxel size of the point
+    // budget while the voxels of the rest of the frame are peripheralVoxelScale times larger; 1 keeps the same voxels
+    // over the whole frame
+    FoveationMap foveationMap;
+    int peripheralVoxelScale = 1;
+    bool wasFrameFoveated = false;
+
+    // Region of the depth frames which holds the content of the bounds, followed over the recent frames; the points of
+    // the next frame are only generated from it when enabled. processingRoi is the region of the latest acquired frame,
+    // empty for the whole frame
+    OccupancyRoi occupancyRoi;
+    bool isAdaptiveRoiEnabled = false;
+    int processingRoi[4] = {};
     FrameIOHandler framesFileWriterReader;
 
+    // Recording shared with the other clients of the process while interleaved recording is enabled, held from the
+    // first frame recorded until the recorded frames are cleared; read and replaced atomically, as the capture thread
+    // writes to it
+    std::shared_ptr<FrameIOHandler> sharedRecording;
+    bool isInterleavedRecordingEnabled = false;
+    int recordingCompressionLevel = 3;
+    bool isRecordingDeltaEnabled = false;
+
+    // Last seconds of processed frames, saved on request of the server
+    FrameRing frameRing;
+
+    // Temporary buffers of the current frame, released when the next frame is acquired
+    FrameArena frameArena;
+
+    // Time taken by each stage of the frame loop, including the stages of the capture manager
+    PerfStats perfStats;
+
     std::vector<float> bounds;
 
-    std::vector<Point3s> lastFrameVertices;
-    std::vector<RGB> lastFrameColors;
+    // Latest processed frame, published by the capture thread with an atomic pointer swap and read by the server
+    // thread without locking. With one frame published, one being sent and one being processed, three buffers are enough
+    static const int FramePoolSize = 3;
+    std::shared_ptr<const ProcessedFrame> latestFrame;
+    std::shared_ptr<ProcessedFrame> framePool[FramePoolSize];
+
+    // Signaled whenever a frame is published, so that the server can wait for new frames instead of polling
+    std::mutex frameReadyMutex;
+    std::condition_variable frameReadyCond;
+    uint64_t latestSequenceNumber = 0;
+
+    // Frame pacing. With consumer pacing, a frame is only processed once the consumers have taken the published one,
+    // or waited for a newer one, and the published frame is refreshed every IdleRefreshInterval while nobody reads
+    // it; the ring and the recordings, which need every frame, disable it. On top of that, one of every
+    // frameDecimation acquired frames is processed. A replay at maximum speed waits for the consumers instead of
+    // skipping the frames, so that they read every frame of the recording in order
+    const std::chrono::milliseconds IdleRefreshInterval{ 500 };
+    const int ReplayPacingPollIntervalMs = 1;
+    std::atomic<uint64_t> takenSequenceNumber{ 0 }; // Newest frame a consumer has taken or waited past
+    bool isConsumerPacingEnabled = false;
+    bool isMaxSpeedReplay = false;
+    bool isFrameRingEnabled = false;
+    int frameDecimation = 1;
+    int numFramesSinceProcessed = 0;
 
-    cv::Mat lastDocumentData;
+    // Frames of a static scene, whose depth did not change since the last processed frame, publish the points of that
+    // frame again rather than being generated and processed, while enabled. A change of the settings or of the
+    // calibration has the next frame processed. The frames reused are logged every StaticFrameReportInterval frames.
+    const int StaticFrameReportInterval = 300;
+    bool isStaticFrameReuseEnabled = false;
+    std::atomic<bool> isProcessingChanged{ true };
+    int numReusedFrames = 0;
+    int numFramesSinceReuseReport = 0;
+
+    // Time at which the frame being processed was returned by the capture manager
+    std::chrono::steady_clock::time_point frameAcquireTime;
+    int64_t frameAcquireSystemTimeUs = 0;
+
+    // Clock of the camera, from the global timestamps of its frames and the times they were acquired at, so that the
+    // timestamps of the frames are published on the system clock of this computer, shared by all its cameras
+    ClockModel deviceClock;
+
+    // Depth frame requested by the server, copied by the capture thread from the next acquired frame
+    std::mutex depthFrameMutex;
+    std::condition_variable depthFrameCond;
+    std::atomic<bool> isDepthFrameRequested{ false };
+    DepthFrame depthFrame;
+
+    // Points removed by each step of StageChunk in one chunk
+    struct StageRejections
+    {
+        unsigned int Background;
+        unsigned int OutOfBounds;
+        unsigned int Excluded;
+        unsigned int Duplicate;
+        unsigned int Foreign;
+    };
+
+    // Reusable working buffers of ProcessFrame
+    PointBuffer stagedPoints;
+    std::vector<int> chunkPointCounts;
+    std::vector<StageRejections> chunkRejections;
+    FrameVector<uint32_t> stagedVoxelSlots; // Claim of each staged point in the voxel grid, when the frame is cropped
+    PointBuffer candidatePoints;
+    FrameVector<uint32_t> candidateDensityCells;
+    FrameVector<uint8_t> sureKeptPoints; // Points left by the density filter whose voxel alone passes them through the k-d tree filter
+
+    // Processed background points of the last refresh frame, appended to the frames in between
+    std::vector<Point3s> backgroundVertices;
+    std::vector<RGB> backgroundColors;
+    std::vector<uint8_t> backgroundNormals;
+
+    // Encoded document to send, cleared once the server copied it; only its signature is kept to compare it with the
+    // next detections. The server copies it from its own thread, under the mutex.
+    std::mutex documentMutex;
+    std::vector<uchar> lastDocumentJpeg;
     float lastDocumentScore;
     short lastDocumentWidth;
     short lastDocumentHeight;
+    DocumentSignature lastDocumentSignature;
+    bool hasSentDocument = false;
     std::chrono::milliseconds lastDocumentSendTime;
 
-    Point3f* cameraSpaceCoordinates;
+    // Bytes held by the buffers of the client, accounted by the capture thread every MemoryStatsInterval frames and
+    // read by the server. In lean mode, the buffers are trimmed to what the frames need and the buffers of the
+    // disabled features are released first, so that more cameras fit in the memory of one host.
+    static const int MemoryStatsInterval = 30;
+    int numFramesSinceMemoryStats = 0;
+    bool isLeanMemoryEnabled = false;
+    std::mutex memoryStatsMutex;
+    ClientMemoryStats memoryStats = {};
+
+    // Points of the last processed frame at each step of the processing, read by the server
+    std::mutex funnelStatsMutex;
+    FrameFunnelStats funnelStats = {};
 
-    std::ofstream logFile;
+    AsyncLogger logger;
 
+    void RestartCamera();
+    void RecoverCamera();
+    void UpdateProcessingPhase();
     void UpdateFrame();
+    void ReleaseUnusedMemory();
+    void UpdateMemoryStats();
+    void UpdateCalibration();
+    void CaptureDepthFrame();
+    void RunCalibrationSample();
+    FrameProcessingParams GetFrameProcessingParams();
     void ProcessFrame();
+    void UpdateFunnelStats(FrameFunnelStats& funnel, const ProcessedFrame& frame);
+    void PublishFrame(std::shared_ptr<ProcessedFrame> frame);
+    bool IsStaticFrameReusable();
+    void RepublishFrame();
+    void ReportReusedFrames(bool isFrameReused);
+
+    typedef unsigned int (LiveScanClient::*StageChunkKernel)(const PointBuffer& source, unsigned int begin, unsigned int end, StageRejections& rejections);
+
+    template <bool IsBackgroundSkipped, bool IsTransformRequired, bool IsCropRequired, bool IsFoveated, bool IsMasked>
+    unsigned int StageChunk(const PointBuffer& source, unsigned int begin, unsigned int end, StageRejections& rejections);
+    unsigned int KeepClaimedPoints(unsigned int begin, unsigned int count, StageRejections& rejections);
+    static StageChunkKernel SelectStageChunkKernel(bool isBackgroundSkipped, bool isTransformRequired, bool isCropRequired, bool isFoveated, bool isMasked);
+    void UpdateExclusionMask();
+    void UpdateCaptureRange();
+    void UpdateProcessingRoi();
+    void UpdateCameraOwners();
+    float GetVoxelSize() const;
+    int GetMinPointsPerDensityVoxel() const;
+    void UpdateVoxelLevel(size_t numPoints);
+    uint64_t GetFrameTimeStamp();
+    void UpdateDepthBinning();
+    void UpdateLoadShedding();
+    void UpdateThreadAffinity();
+    int GetShedVoxelLevels() const;
+    bool IsFrameProcessingRequired();
+    void MarkFrameTaken(uint64_t sequenceNumber);
+    std::shared_ptr<ProcessedFrame> AcquireFreeFrame();
     void ProcessDocument();
-    float ComputeImageDifference(cv::Mat& newDocumentData);
+    float CompareDocumentSignatures(const DocumentSignature& newSignature) const;
     void SendSerialNumber();
     void ConfirmRecorded();
     void ConfirmCalibrated();
-    void SendLatestFrame();
     void SendRecordedFrame(vector<Point3s>& vertices, vector<RGB>& RGB, bool noMoreFrames);
     void ConfirmSyncState();
     void ConfirmMasterRestart();
+    void ConfirmLoadShedLevel();
     void SendDocument();
-    void SendClientConfirmations();
+    ClientEvent MakeClientEvent(ClientEventType type);
     void SetupLogging(int clientIndex);
     void Log(const std::string& message);
+    void Log(LogLevel level, const std::string& message);
 };
@@ -21,36 +21,99 @@ C++ clients and vice-versa.
 #endif
 
 #include "LiveScanClient.h"
+#include "remoteClient.h"
 #include "transferObjectUtils.h"
+#include "pointCloudEncoder.h"
+#include "tsdfFusionVolume.h"
+#include "viewDecimator.h"
+#include "mergedFrameHub.h"
 
 extern "C" {
 
 	typedef void* LiveScanClientHandle;
+	typedef void* LiveScanFrameHandle;
+	typedef void* PointCloudEncoderHandle;
+	typedef void* FusionVolumeHandle;
+	typedef void* ViewDecimatorHandle;
+	typedef void* MergedFrameSubscriberHandle;
+	typedef void* MergedFrameHandle;
 
 	// Server to client (inbound) calls
+	LIVESCAN_API void PrepareClients(int count);
 	LIVESCAN_API LiveScanClientHandle CreateClient(int index);
+	LIVESCAN_API LiveScanClientHandle CreateReplayClient(int index, const char* path, bool isRealTime);
+	LIVESCAN_API LiveScanClientHandle CreateRemoteClient(int index, const char* host, int port, int remoteIndex);
+	LIVESCAN_API LiveScanClientHandle CreateWorkerClient(int index);
+	LIVESCAN_API int QueryCaptureNode(const char* host, int port, int timeoutMs);
 	LIVESCAN_API void StartClient(LiveScanClientHandle handle);
 	LIVESCAN_API void StopClient(LiveScanClientHandle handle);
 	LIVESCAN_API void DestroyClient(LiveScanClientHandle handle);
 
 	LIVESCAN_API void StartFrameRecording(LiveScanClientHandle handle);
 	LIVESCAN_API void Calibrate(LiveScanClientHandle handle);
+	LIVESCAN_API bool GetCalibrationProgress(LiveScanClientHandle handle, int* numSamples, int* numRequiredSamples);
+	LIVESCAN_API int GetPerfStats(LiveScanClientHandle handle, PerfStageStats* stats, int maxStages, bool isReset);
+	LIVESCAN_API bool GetMemoryStats(LiveScanClientHandle handle, ClientMemoryStats* stats);
+	LIVESCAN_API bool GetFunnelStats(LiveScanClientHandle handle, FrameFunnelStats* stats);
+	LIVESCAN_API void SetDocumentFrameInterval(LiveScanClientHandle handle, int intervalMs);
+	LIVESCAN_API void SetMaxDocumentSize(LiveScanClientHandle handle, int width, int height);
     LIVESCAN_API void SetSettings(LiveScanClientHandle handle, const CameraSettings* settings);
+	LIVESCAN_API void SetExposure(LiveScanClientHandle handle, bool isAutoExposureEnabled, int exposureStep);
 	LIVESCAN_API void RequestRecordedFrame(LiveScanClientHandle handle);
-	LIVESCAN_API void RequestLatestFrame(LiveScanClientHandle handle);
+	LIVESCAN_API int RequestRecordedFrames(LiveScanClientHandle handle, int maxFrames);
+	LIVESCAN_API LiveScanFrameHandle AcquireLatestFrame(LiveScanClientHandle handle, const Point3s** vertices, const RGB** colors, int* count, unsigned long long* sequenceNumber, unsigned long long* timeStampUs);
+	LIVESCAN_API void GetFrameAges(LiveScanFrameHandle frame, unsigned long long* acquireAgeUs, unsigned long long* publishAgeUs);
+	LIVESCAN_API int GetFrameNormals(LiveScanFrameHandle frame, const unsigned char** normals);
+	LIVESCAN_API bool WaitForFrame(LiveScanClientHandle handle, unsigned long long lastSequenceNumber, int timeoutMs);
+	LIVESCAN_API void ReleaseFrame(LiveScanFrameHandle frame);
+	LIVESCAN_API void ConvertFramePoints(const Point3s* vertices, const RGB* colors, int count, float* outVertices, unsigned char* outColors);
+	LIVESCAN_API bool AcquireDepthFrame(LiveScanClientHandle handle, UINT16* depth, int maxPixels, int* width, int* height, float* intrinsics, float* depthToWorld, int timeoutMs);
 	LIVESCAN_API void ReceiveCalibration(LiveScanClientHandle handle, const AffineTransform* transform);
+	LIVESCAN_API void ReceiveCameraPoses(LiveScanClientHandle handle, const AffineTransform* poses, int numCameras, int cameraIndex);
 	LIVESCAN_API void ClearRecordedFrames(LiveScanClientHandle handle);
-	LIVESCAN_API void EnableSync(LiveScanClientHandle handle, int syncState, int syncOffset);
+	LIVESCAN_API void SaveFrameRing(LiveScanClientHandle handle, int seconds);
+	LIVESCAN_API void LearnExclusionMask(LiveScanClientHandle handle, int numFrames);
+	LIVESCAN_API void EnableSync(LiveScanClientHandle handle, int syncState, int syncOffset, int numSyncedDevices);
 	LIVESCAN_API void DisableSync(LiveScanClientHandle handle);
 	LIVESCAN_API void StartMaster(LiveScanClientHandle handle);
+	LIVESCAN_API int CopyDocument(LiveScanClientHandle handle, unsigned char* jpeg, int maxJpegSize, float* score, short* width, short* height, unsigned char* signature, int maxSignatureSize);
 
-	// Client to server (outbound) calls
-	LIVESCAN_API void SetSendSerialNumberCallback(LiveScanClientHandle handle, SendSerialNumberCallback cb);
-	LIVESCAN_API void SetConfirmRecordedCallback(LiveScanClientHandle handle, ConfirmRecordedCallback cb);
-	LIVESCAN_API void SetConfirmCalibratedCallback(LiveScanClientHandle handle, ConfirmCalibratedCallback cb);
-	LIVESCAN_API void SetSendLatestFrameCallback(LiveScanClientHandle handle, SendLatestFrameCallback cb);
+	// Client to server (outbound) calls; the events of all the clients are taken at once from the client event queue
+	LIVESCAN_API int WaitForClientEvents(ClientEvent* events, int maxEvents, int timeoutMs);
 	LIVESCAN_API void SetSendRecordedFrameCallback(LiveScanClientHandle handle, SendRecordedFrameCallback cb);
-	LIVESCAN_API void SetConfirmSyncStateCallback(LiveScanClientHandle handle, ConfirmSyncStateCallback cb);
-	LIVESCAN_API void SetConfirmMasterRestartCallback(LiveScanClientHandle handle, ConfirmMasterRestartCallback cb);
-	LIVESCAN_API void SetSendDocumentCallback(LiveScanClientHandle handle, SendDocumentCallback cb);
+
+	// Encoding of the merged point cloud sent to the receivers
+	LIVESCAN_API PointCloudEncoderHandle CreatePointCloudEncoder();
+	LIVESCAN_API void DestroyPointCloudEncoder(PointCloudEncoderHandle handle);
+	LIVESCAN_API int EncodePointCloud(PointCloudEncoderHandle handle, const float* vertices, const unsigned char* colors, int numVertices, short scale, const unsigned char** buffer);
+	LIVESCAN_API int EncodePointCloudChunks(PointCloudEncoderHandle handle, const float* vertices, const unsigned char* colors, const int* chunkSizes, int numChunks, short scale, const unsigned char** buffer);
+	LIVESCAN_API int EncodePointCloudOctree(PointCloudEncoderHandle handle, int chromaStep, const unsigned char** buffer);
+	LIVESCAN_API int EncodePointCloudProgressive(PointCloudEncoderHandle handle, int coarseDepth, const unsigned char** buffer);
+	LIVESCAN_API int EncodePointCloudWide(PointCloudEncoderHandle handle, const float* vertices, const unsigned char* colors, int numVertices, float range, short scale, const unsigned char** buffer);
+	LIVESCAN_API int EncodePointCloudSurfels(PointCloudEncoderHandle handle, const unsigned char* normals, const unsigned char** buffer);
+	LIVESCAN_API int EncodePointCloudMesh(PointCloudEncoderHandle handle, const float* vertices, const unsigned char* colors, int numVertices, const int* indices, int numTriangles, float range, short scale, const unsigned char** buffer);
+
+	// Fusion of the frames of all the cameras into a signed distance field, whose surface is sent instead
+	LIVESCAN_API FusionVolumeHandle CreateFusionVolume();
+	LIVESCAN_API void DestroyFusionVolume(FusionVolumeHandle handle);
+	LIVESCAN_API bool ConfigureFusionVolume(FusionVolumeHandle handle, const float* minBounds, const float* maxBounds, float voxelSize, float truncation, float decay);
+	LIVESCAN_API bool IntegrateFusionPoints(FusionVolumeHandle handle, const float* vertices, const unsigned char* colors, int numVertices, const float* origin);
+	LIVESCAN_API int ExtractFusionPoints(FusionVolumeHandle handle, const float** vertices, const unsigned char** colors);
+	LIVESCAN_API int ExtractFusionMesh(FusionVolumeHandle handle, int step, const float** vertices, const unsigned char** colors, const int** indices, int* numTriangles);
+
+	// Level of detail of the live view of the server, which draws one point per voxel of the size of its pixels
+	LIVESCAN_API ViewDecimatorHandle CreateViewDecimator();
+	LIVESCAN_API void DestroyViewDecimator(ViewDecimatorHandle handle);
+	LIVESCAN_API int DecimateViewPoints(ViewDecimatorHandle handle, const float* vertices, const unsigned char* colors, int numVertices, float voxelSize, float* outVertices, unsigned char* outColors);
+
+	// Merged frames of the server shared with the subscribers of its process, such as its plugins
+	LIVESCAN_API bool HasMergedFrameSubscribers();
+	LIVESCAN_API void PublishMergedFrame(const float* vertices, const unsigned char* colors, const unsigned char* normals, int numVertices, const int* indices, int numTriangles,
+		const int* cameraVertexCounts, int numCameras, unsigned long long version, long long captureTimeUs);
+	LIVESCAN_API MergedFrameSubscriberHandle SubscribeMergedFrames();
+	LIVESCAN_API void UnsubscribeMergedFrames(MergedFrameSubscriberHandle handle);
+	LIVESCAN_API MergedFrameHandle AcquireMergedFrame(MergedFrameSubscriberHandle handle, int timeoutMs, MergedFrameInfo* info);
+	LIVESCAN_API void ReleaseMergedFrame(MergedFrameHandle frame);
+	LIVESCAN_API int LoadMergedFramePlugins(const char* directory);
+	LIVESCAN_API void UnloadMergedFramePlugins();
 }
\ No newline at end of file
@@ -6,9 +6,10 @@ Authors:      Roxanne Archambault
 Copyright (c) Canadian Space Agency.
 
 <Description>
-This module is a wrapper around each instance of LiveScanClient to handle
-the thread it runs on and the callback functions it can call on the server
-if they have been previously registered.
+This module is a wrapper around each client, local or remote, to handle
+the thread it runs on and the callback function it sends the recorded frames
+with, if it has been previously registered. The other messages of the
+clients go through the client event queue.
 
 \***************************************************************************/
 
@@ -21,28 +22,14 @@ if they have been previously registered.
 #include <string>
 
 // Forward declaration
-class LiveScanClient;
+class ILiveScanClient;
 
-// Typedefs for the callback signatures
-typedef void(*SendSerialNumberCallback)(int clientIndex, const char* serialNumber);
-typedef void(*ConfirmRecordedCallback)(int clientIndex);
-typedef void(*ConfirmCalibratedCallback)(int clientIndex, int markerId, const float* R, const float* t);
-typedef void(*SendLatestFrameCallback)(int clientIndex, const Point3s* vertices, const RGB* colors, int count);
+// Typedef for the callback signature; it is called within RequestRecordedFrame(s), on the thread of the server
 typedef void(*SendRecordedFrameCallback)(int clientIndex, const Point3s* vertices, const RGB* colors, int count, bool noMoreFrames);
-typedef void(*ConfirmSyncStateCallback)(int clientIndex, int tempSyncState);
-typedef void(*ConfirmMasterRestartCallback)(int clientIndex);
-typedef void(*SendDocumentCallback)(int clientIndex, const unsigned char* data, float score, short width, short height);
 
 struct LiveScanClientWrapper {
-	std::unique_ptr<LiveScanClient> client;
+	std::unique_ptr<ILiveScanClient> client;
 	std::thread thread;
 
-	SendSerialNumberCallback sendSerialNumberCallback = nullptr;
-	ConfirmRecordedCallback confirmRecordedCallback = nullptr;
-	ConfirmCalibratedCallback confirmCalibratedCallback = nullptr;
-	SendLatestFrameCallback sendLatestFrameCallback = nullptr;
 	SendRecordedFrameCallback sendStoredFrameCallback = nullptr;
-	ConfirmSyncStateCallback confirmSyncStateCallback = nullptr;
-	ConfirmMasterRestartCallback confirmMasterRestartCallback = nullptr;
-	SendDocumentCallback sendDocumentCallback = nullptr;
 };
\ No newline at end of file
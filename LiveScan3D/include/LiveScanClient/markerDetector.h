@@ -7,7 +7,11 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module uses the iMarker interface to detect markers in a provided
-2D color frame.
+2D color frame. The frame is searched at a lower resolution first, and the
+markers are only detected at full resolution in the regions around the
+candidates found there. A frame without a marker at the usual threshold of
+the binary image is searched again at a few other thresholds in parallel,
+so that a marker too dark or too bright for it is still found.
 
 This code was adapted from the following research:
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
@@ -28,6 +32,7 @@ class MarkerDetector : public IMarkerDetector
 {
 public:
 	bool DetectMarkersInImage(RGB *img, int height, int width, MarkerInfo &marker);
+	bool DetectMarkersInImage(RGB *img, int height, int width, int regionX, int regionY, int regionWidth, int regionHeight, MarkerInfo &marker);
 private:
 	const int NumMarkerCorners = 5; // Number of corners to find in the detected marker
 
@@ -36,6 +41,17 @@ private:
 	const int MaxSize = 1000000000;
 
 	const int ColorFrameBitThreshold = 120; // Threshold used to obtain a binary (black and white) image from the color frame
+
+	// Thresholds tried in parallel when no marker is found at ColorFrameBitThreshold, for the lightings it does not
+	// suit; OtsuBitThreshold stands for the threshold which best splits the histogram of each searched image
+	const int OtsuBitThreshold = -1;
+	const vector<int> FallbackBitThresholds = { OtsuBitThreshold, 80, 160, 200 };
+
+	// The candidates are searched in the frame downsampled by 2^CandidatePyramidLevel, and their bounding box is padded
+	// by a fraction of its size, and at least a few pixels, before the markers are detected in it at full resolution
+	const int CandidatePyramidLevel = 1;
+	const float CandidateRegionPadding = 0.25f;
+	const int MinCandidateRegionPadding = 8;
 	const double ApproxPolyCoefficient = 0.12; // Coefficient used to map the image to the polygon representing the markers
 
 	// Normalized point coordinates which make up the shape of the markers
@@ -66,6 +82,13 @@ private:
 	const bool DrawOnOriginalImage = false;
 
 	bool DetectMarkers(cv::Mat &img, MarkerInfo &marker);
+	void DetectMarkersAtThreshold(cv::Mat &img, int threshold, vector<MarkerInfo> &markers);
+	template <typename Detect>
+	bool DetectMarkersAtThresholds(cv::Mat &img, Detect detect, MarkerInfo &marker);
+	void Binarize(cv::Mat &grayImg, int threshold);
+	void FindCandidateRegions(cv::Mat &img, int threshold, vector<cv::Rect> &regions);
+	void DetectMarkersInRegion(cv::Mat &img, const cv::Rect &region, int threshold, vector<MarkerInfo> &markers);
+	bool SelectMarker(cv::Mat &img, vector<MarkerInfo> &markers, MarkerInfo &marker);
 	bool OrderCorners(vector<cv::Point2f> &corners);
 	int GetCode(cv::Mat &img, vector<cv::Point2f> points, vector<cv::Point2f> corners);
 	void RefineCornerPositions(vector<cv::Point2f> &corners, vector<cv::Point> contour, bool order);
@@ -0,0 +1,94 @@
+/***************************************************************************\
+
+Module Name:  MemoryUsage.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module accounts for the memory held by the buffers of a client, so
+that the number of cameras a host can run without paging can be planned.
+The buffers are counted by their capacity, in categories read by the
+server. In lean mode, the buffers which hold much more than the latest
+frames needed, for instance since a larger stream profile or point budget
+was used, are trimmed down to what they hold.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "utils.h"
+#include <opencv2/core.hpp>
+#include <cstddef>
+#include <vector>
+
+// Values shared with the MemoryCategory enum of the server
+enum MemoryCategory
+{
+    CaptureMemory = 0,      // Points and depth buffers of the capture manager
+    ProcessingMemory = 1,   // Working buffers of the processing, and the copies made for the calibration and the server
+    FrameMemory = 2,        // Processed frames published to the server
+    VoxelGridMemory = 3,    // Voxel grid and density counter
+    FilterMemory = 4,       // Outlier filters
+    BackgroundMemory = 5,   // Background model, background points and exclusion mask
+    DocumentMemory = 6,     // Frames and images of the document detection
+    RingMemory = 7,         // Frames of the ring recording
+    ArenaMemory = 8,        // Temporary buffers of the frame
+    NumMemoryCategories
+};
+
+// Bytes held by the buffers of a client in each category when they were last accounted, read by the server
+struct ClientMemoryStats
+{
+    unsigned long long Bytes[NumMemoryCategories];
+    unsigned long long TotalBytes;
+};
+
+template <typename T, typename Allocator>
+inline size_t GetCapacityBytes(const std::vector<T, Allocator>& buffer)
+{
+    return buffer.capacity() * sizeof(T);
+}
+
+inline size_t GetCapacityBytes(const PointBuffer& points)
+{
+    return GetCapacityBytes(points.X) + GetCapacityBytes(points.Y) + GetCapacityBytes(points.Z)
+        + GetCapacityBytes(points.Colors) + GetCapacityBytes(points.PixelIndices);
+}
+
+// Matrices over external buffers, such as the frames of the SDK, own no pixels
+inline size_t GetCapacityBytes(const cv::Mat& mat)
+{
+    return mat.u ? mat.u->size : 0;
+}
+
+// Buffers smaller than this are never trimmed, as the allocations would cost more than they save
+const size_t MinTrimmedBytes = 64 * 1024;
+
+/// <summary>
+/// Frees the storage a buffer does not use when it holds over twice its size, so that a buffer which grew for a
+/// larger frame does not keep its peak size; the margin keeps the buffers whose size varies from frame to frame from
+/// being reallocated every time.
+/// </summary>
+template <typename T, typename Allocator>
+inline void TrimCapacity(std::vector<T, Allocator>& buffer)
+{
+    if (buffer.capacity() > 2 * buffer.size() && GetCapacityBytes(buffer) >= MinTrimmedBytes)
+        buffer.shrink_to_fit();
+}
+
+inline void TrimCapacity(PointBuffer& points)
+{
+    TrimCapacity(points.X);
+    TrimCapacity(points.Y);
+    TrimCapacity(points.Z);
+    TrimCapacity(points.Colors);
+    TrimCapacity(points.PixelIndices);
+}
+
+// Frees the storage of a buffer of a disabled feature
+template <typename T, typename Allocator>
+inline void ReleaseCapacity(std::vector<T, Allocator>& buffer)
+{
+    std::vector<T, Allocator>().swap(buffer);
+}
@@ -0,0 +1,116 @@
+/***************************************************************************\
+
+Module Name:  MergedFrameHub.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module shares the merged frames of the server with the subscribers of
+the same process, such as the plugins of the server, without going through
+the transfer server. Each frame is copied once into a pooled native frame,
+which is never modified once published and is referenced, not copied, by
+every subscriber which acquires it. The publisher never waits for the
+subscribers: each of them only holds the latest frame it did not acquire,
+which a newer frame replaces, so a slow subscriber drops frames instead of
+holding back the frames of the others or the capture.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Version of the subscriber API, given to the plugins when they are started; it changes whenever a call or the
+// meaning of a field of MergedFrameInfo does, the fields only ever being appended
+const int MergedFrameApiVersion = 1;
+
+// Description of an acquired merged frame, whose buffers stay valid and unchanged until the frame is released
+struct MergedFrameInfo
+{
+    int ApiVersion; // MergedFrameApiVersion of the DLL which filled the description
+    unsigned long long Version; // Version of the merged frame on the server, which increases with each frame merged
+    long long CaptureTimeUs; // Time at which the frame was merged, in microseconds of the server clock
+    unsigned long long NumDroppedFrames; // Frames the subscriber did not acquire before a newer one replaced them, so far
+
+    const float* Vertices; // x, y, z of each vertex, in meters
+    const unsigned char* Colors; // r, g, b of each vertex
+    const unsigned char* Normals; // Octahedral normal of each vertex, 0xFF for those without; null when the frame has none
+    int NumVertices;
+
+    const int* Indices; // Three vertex indices for each triangle when the frame is a mesh; null otherwise
+    int NumTriangles;
+
+    const int* CameraVertexCounts; // Vertices of each camera, one camera after the other
+    int NumCameras;
+};
+
+// Merged frame shared by the subscribers, read only once published
+struct SharedMergedFrame
+{
+    uint64_t Version = 0;
+    int64_t CaptureTimeUs = 0;
+    std::vector<float> Vertices;
+    std::vector<uint8_t> Colors;
+    std::vector<uint8_t> Normals;
+    std::vector<int> Indices;
+    std::vector<int> CameraVertexCounts;
+};
+
+class MergedFrameSubscriber
+{
+public:
+    void Deliver(const std::shared_ptr<const SharedMergedFrame>& frame);
+    std::shared_ptr<const SharedMergedFrame> Acquire(int timeoutMs);
+    void Close();
+    uint64_t GetNumDroppedFrames() const;
+
+private:
+    std::mutex mutex;
+    std::condition_variable frameCond;
+    std::shared_ptr<const SharedMergedFrame> pendingFrame; // Latest frame not acquired yet
+    bool isClosed = false;
+    std::atomic<uint64_t> numDroppedFrames{ 0 };
+};
+
+class MergedFrameHub
+{
+public:
+    static MergedFrameHub& Instance();
+
+    std::shared_ptr<MergedFrameSubscriber> Subscribe();
+    void Unsubscribe(const std::shared_ptr<MergedFrameSubscriber>& subscriber);
+    bool HasSubscribers() const;
+
+    void Publish(const float* vertices, const uint8_t* colors, const uint8_t* normals, int numVertices, const int* indices, int numTriangles,
+        const int* cameraVertexCounts, int numCameras, uint64_t version, int64_t captureTimeUs);
+
+    int LoadPlugins(const std::string& directory);
+    void UnloadPlugins();
+
+private:
+    // Frames kept for reuse once no subscriber holds them; the frames held past that are allocated and freed
+    static const size_t MaxPooledFrames = 4;
+
+    MergedFrameHub() = default;
+    MergedFrameHub(const MergedFrameHub&) = delete;
+    MergedFrameHub& operator=(const MergedFrameHub&) = delete;
+
+    mutable std::mutex subscribersMutex;
+    std::vector<std::shared_ptr<MergedFrameSubscriber>> subscribers;
+    std::atomic<int> numSubscribers{ 0 };
+
+    // Only used by the publisher
+    std::vector<std::shared_ptr<SharedMergedFrame>> framePool;
+
+    std::mutex pluginsMutex;
+    std::vector<void*> plugins; // Module handles of the loaded plugins, in the order they were started
+
+    std::shared_ptr<SharedMergedFrame> AcquireFreeFrame();
+};
@@ -0,0 +1,55 @@
+/***************************************************************************\
+
+Module Name:  NormalEstimator.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module estimates the normal of the points from their neighbours in the
+depth image, without any search in 3D: the points of a frame are scattered
+back into image-sized coordinate planes, and the normal of a point is the
+cross product of the differences with its neighbours along the rows and the
+columns of the image. The normals face the camera and are quantized to one
+byte, as an octahedral direction with 4 bits per axis.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "utils.h"
+#include <cstdint>
+#include <vector>
+
+class NormalEstimator {
+public:
+    // Code of the points whose normal could not be estimated, which are drawn facing the viewer
+    static const uint8_t NoNormal = 0xFF;
+
+    void Prepare(const PointBuffer& points, int imageWidth, int imageHeight, const float viewOrigin[3], const float (*newRotation)[4]);
+    uint8_t GetNormal(int pixelIndex) const;
+    void Clear(const PointBuffer& points);
+    size_t GetMemoryUsage() const;
+    void ReleaseMemory();
+
+    static uint8_t EncodeNormal(float x, float y, float z);
+
+private:
+    const int WindowRadius = 2; // Farthest pixel a neighbour is searched at, on each side
+    const float MaxNeighbourDistance = 0.02f; // In meters per pixel between the point and its neighbour
+    static const int NumLevels = 15; // Values of each octahedral axis, so that the axes of the frame are exact
+
+    int width = 0;
+    int height = 0;
+
+    float origin[3] = {};
+    float rotation[3][3] = {}; // Identity when the normals stay in the space of the points
+
+    // Coordinates of the point of each pixel; pixels without a point have an infinite X so they are never neighbours
+    std::vector<float> gridX;
+    std::vector<float> gridY;
+    std::vector<float> gridZ;
+
+    bool FindNeighbour(int u, int v, int stepU, int stepV, const float center[3], float neighbour[3]) const;
+    bool GetTangent(int u, int v, int stepU, int stepV, const float center[3], float tangent[3]) const;
+};
@@ -0,0 +1,47 @@
+/***************************************************************************\
+
+Module Name:  OccupancyRoi.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module finds the region of the depth frames the points are generated
+from, which follows the content of the bounds rather than the whole box: it
+is the bounding box of the pixels of the points kept over the last frames,
+plus a margin. The region grows back to the border of the frame on the next
+frame on each side where the content reaches its edge, and the whole frame
+is processed at intervals, so that content appearing elsewhere is still seen.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+
+class OccupancyRoi {
+public:
+    void Reset();
+    void Update(const int* pixelIndices, size_t numPoints, int frameWidth, int frameHeight, const int processedRegion[4]);
+
+    // Region the next frame should be processed in: left, top, right and bottom, one past the last column and row; all
+    // zeros, for the whole frame, until the first frame is passed to Update
+    void GetRegion(int outRegion[4]) const;
+
+private:
+    static const int HistoryFrames = 30; // The region covers the content of about the last second
+    static const int ProbeIntervalFrames = 30; // Frames between two frames processed whole
+
+    // The margin is a fraction of the frame, so that it covers about the same motion between two frames whether the
+    // depth is binned or not; the content closer than half of it to a side of the region may be cut by that side
+    const int MarginRatio = 16;
+
+    int width = 0;
+    int height = 0;
+
+    int boxes[HistoryFrames][4] = {}; // Bounding box of the pixels of the points of each recent frame; empty without points
+    int nextBox = 0;
+    int numFramesSinceProbe = 0;
+
+    int region[4] = {};
+};
@@ -22,14 +22,18 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 #include "ICaptureManager.h"
 #include <opencv2/opencv.hpp>
 #include "utils.h"
+#include "pointCloudKernel.h"
+#include "gpuPointCloudEngine.h"
+#include "rawFrameRecorder.h"
 #include <functional>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <thread>
 #include <atomic>
-#include <queue>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
+#include <vector>
 
 class OrbbecCaptureManager : public ICaptureManager
 {
@@ -39,25 +43,191 @@ public:
     
     bool Initialize(SyncState state, int syncOffset);
     bool AcquireFrame(bool isCalibrationDataRequested);
+    bool StartStreaming(SyncState state, int syncOffset);
+    bool StopStreaming();
     uint64_t GetTimeStamp();
     int GetDeviceIndex();
     void SetExposureState(bool enableAutoExposure, int exposureStep);
     void SetLogger(std::function<void(const std::string&)> loggerFunc);
+    void SetProcessingBackend(ProcessingBackend backend);
+    void SetFrameProcessingParams(const FrameProcessingParams& params);
+    void SetCaptureMode(CaptureMode mode);
+    void SetColorStreamSettings(const ColorStreamSettings& settings);
+    void SetRawRecording(bool isEnabled);
+    void SetDepthBinning(bool isBinned);
+    void SetThreadAffinity(const ThreadAffinity& affinity);
+    RawCameraParams GetCameraParams();
+    size_t GetMemoryUsage() const;
+    void ReleaseUnusedMemory();
+    uint64_t GetNumCapturedFrames() const;
+    uint64_t GetNumDroppedFrames() const;
+    uint64_t GetNumMismatchedFrames() const;
+    bool IsDeviceLost() const;
+    void RequestDeviceRecovery();
+    bool RecoverDevice(SyncState state, int syncOffset);
 
 private:
     const int SyncDelayUs = 160;
-    const int DocumentServerSendDelayMs = 1000;
     const int CaptureTimeoutMs = 500;
+    const int StartupBarrierTimeoutMs = 10000;
+    const size_t FrameRingCapacity = 3;
+    const size_t PairingBufferCapacity = 4;
+    const uint64_t PairingReportInterval = 1800; // About a minute of frames
+    const int MaxFramePairingToleranceUs = 16000; // Under half the frame period, so a depth frame has one color frame to pair with
+    const int CostReportInterval = 300;
+    const int HighResolutionColorWidth = 2560;
+    const int HighResolutionColorHeight = 1440;
+    const int DocumentBurstDurationMs = 3000;
+    const int DocumentBurstCooldownMs = 30000;
+    const int DepthWidth = 640;
+    const int DepthHeight = 576;
+    const int BinnedDepthWidth = 320;
+    const int BinnedDepthHeight = 288;
+    const int RecoveryIntervalMs = 1000;
+    const int MaxRecoveryIntervalMs = 16000;
 
     int deviceIndex = 0;
     int deviceIDForRestart = -1;
     int restartAttempts = 0;
 
+    // Recovery of the device when it is unplugged, or fails to restart: the device is closed by the next AcquireFrame,
+    // then reopened by its serial number by RecoverDevice, right away when it is plugged back in, and otherwise at
+    // intervals which double after each failed attempt. The flags are set by the listener of the device registry and
+    // by the client; the times are only used by the frame loop
+    int deviceListenerId = -1;
+    std::atomic<bool> isDeviceLost{ false };
+    std::atomic<bool> isDeviceArrived{ false };
+    std::chrono::steady_clock::time_point deviceLostTime;
+    std::chrono::steady_clock::time_point nextRecoveryTime;
+
     std::shared_ptr<ob::Device> device;
     std::shared_ptr<ob::Pipeline> pipeline;
 
+    // Color and depth frames captured together, with the color frame decoded to RGB888 when the color stream is
+    // compressed. The frameset is only kept when both frames came in it, for the filters of the SDK backend
+    struct CapturedFrameset
+    {
+        std::shared_ptr<ob::FrameSet> frameset;
+        std::shared_ptr<ob::ColorFrame> colorFrame;
+        std::shared_ptr<ob::DepthFrame> depthFrame;
+        bool isColorCompressed = false;
+        std::chrono::steady_clock::time_point arrivalTime; // When the pair was pushed to the ring
+        float framePeriodUs = 0.0f; // Average time between the framesets at arrivalTime
+    };
+
+    // Frame of one stream waiting for the frame of the other stream nearest to it
+    template<typename FrameType>
+    struct UnpairedFrame
+    {
+        std::shared_ptr<FrameType> frame;
+        std::shared_ptr<ob::FrameSet> frameset;
+        uint64_t timeStampUs;
+    };
+
+    ColorStreamSettings colorStreamSettings = { 2560, 1440, false, true, false };
+    std::shared_ptr<ob::FormatConvertFilter> mjpgDecoder;
+    bool isColorStreamCompressed = false;
+    bool isColorDecodedToYuv = false; // The MJPG frames are decoded to NV12 instead of RGB888; set before the capture starts
+
+    // RGB888 copy of the latest YUV color frame, only converted for the document detection and the raw recording
+    cv::Mat rgbColorImage;
+    bool isRgbColorImageCurrent = false;
+
+    // High resolution color stream used for a few seconds when the document detection needs sharper crops
+    std::atomic<bool> isDocumentBurstRequested{ false };
+    std::atomic<bool> isDocumentBurstActive{ false };
+    std::chrono::steady_clock::time_point documentBurstEndTime;
+
+    // Binned depth stream, requested by the client and applied by the capture thread before its next frame
+    std::atomic<bool> isDepthBinningRequested{ false };
+    bool isDepthBinned = false;
+
+    // Framesets received from the pipeline while the previous frame is processed, either by the capture thread or by
+    // the SDK callback. Only the latest one is processed: older framesets are dropped, as is the oldest one when the
+    // ring is full
+    CaptureMode captureMode = PollingCapture;
+    std::thread captureThread;
+    std::atomic<bool> isCaptureStopRequested{ false };
+    std::mutex frameRingMutex;
+    std::condition_variable frameRingCond;
+    std::deque<CapturedFrameset> frameRing;
+    std::atomic<uint64_t> numCapturedFrames{ 0 };
+    std::atomic<uint64_t> numDroppedFrames{ 0 };
+    std::atomic<uint64_t> numMismatchedFrames{ 0 }; // Color and depth frames dropped without a frame of the other stream to pair with
+    std::atomic<uint64_t> numIncompleteFrames{ 0 }; // Framesets without any frame, or whose color frame failed to decode
+
+    // Moving average of the time between the framesets pushed to the ring, which the processing phase is a fraction
+    // of; under frameRingMutex
+    const float DefaultFramePeriodUs = 33333.0f;
+    const int64_t MaxFramePeriodUs = 200000; // Longer gaps are pauses of the stream rather than frame periods
+    const float FramePeriodWeight = 0.05f; // Weight of the latest interval in the average
+    std::chrono::steady_clock::time_point lastArrivalTime;
+    float framePeriodUs = DefaultFramePeriodUs;
+
+    // The SDK aggregates the frames of the streams loosely, so a frameset can carry a single frame, or a color frame
+    // and a depth frame of different captures. The frames are buffered per stream, and each depth frame is paired with
+    // the color frame nearest to it within the tolerance; the others are dropped once they are older than a pair or
+    // pushed out of the buffer. Only used by the thread which receives the framesets, under frameRingMutex
+    std::atomic<int> framePairingToleranceUs{ 5000 };
+    std::deque<UnpairedFrame<ob::ColorFrame>> unpairedColorFrames;
+    std::deque<UnpairedFrame<ob::DepthFrame>> unpairedDepthFrames;
+    uint64_t numExactPairs = 0; // Frames of the same timestamp
+    uint64_t numNearestPairs = 0; // Frames of different timestamps, within the tolerance
+    uint64_t pairOffsetSumUs = 0;
+    uint64_t maxPairOffsetUs = 0;
+
+    // Processors of the capture thread, set by the client and applied by the thread before its next wait, and again
+    // whenever the thread is restarted with the pipeline. The threads of the SDK callback are left as they are
+    std::mutex captureAffinityMutex;
+    ThreadAffinity captureAffinity;
+    std::atomic<int> captureAffinityVersion{ 0 };
+
+    // Frames of the latest frameset; kept alive so that depthData and colorData can point directly into the SDK buffers
+    std::shared_ptr<ob::ColorFrame> currentColorFrame;
+    std::shared_ptr<ob::DepthFrame> currentDepthFrame;
+
     cv::Mat alignedDepthFrame;
 
+    // Camera parameters of the running stream profile and the per-pixel unprojection rays derived from them
+    OBCameraParam cameraParams;
+    FrameVector<Point2f> depthRayTable;
+    int rayTableWidth = 0;
+    int rayTableHeight = 0;
+
+    PointCloudKernelType pointCloudKernel = KernelScalar;
+
+    // Full frame output buffers of the point cloud kernel; only the valid points are copied to lastFramePoints
+    PointBuffer kernelPoints;
+
+    // Depth frame without its flying pixels, used instead of depthData when the filter is enabled
+    FrameVector<UINT16> filteredDepth;
+
+    // Depth frame with its small holes filled, used instead of depthData when the hole filling is enabled
+    FrameVector<UINT16> holeFilledDepth;
+
+    // Temporal moving average of the depth and its median filtered copy, used when the depth denoising is enabled
+    FrameVector<UINT16> depthHistory;
+    FrameVector<UINT16> denoisedDepth;
+
+    // Color frame downscaled by two, which the kernel samples instead of colorData when enabled
+    FrameVector<uint32_t> downscaledColor;
+
+    ProcessingBackend processingBackend = CpuProcessing;
+    FrameProcessingParams frameProcessingParams = {};
+    std::unique_ptr<GpuPointCloudEngine> gpuEngine;
+
+    // Filters of the SDK backend: the color frame is aligned to the depth frame, so the points keep the depth pixel order
+    std::shared_ptr<ob::Align> sdkAlignFilter;
+    std::shared_ptr<ob::PointCloudFilter> sdkPointCloudFilter;
+
+    // Time spent generating the point clouds with each backend since the last report
+    double pointCloudCostMs[NumProcessingBackends] = {};
+    int numPointCloudFrames[NumProcessingBackends] = {};
+
+    // Raw frames recorded for the replay capture manager; started and stopped by the capture thread before its next frame
+    std::atomic<bool> isRawRecordingRequested{ false };
+    RawFrameRecorder rawRecorder;
+
     uint64_t currentTimeStamp = 0;
     std::chrono::milliseconds lastFrameTime;
 
@@ -67,7 +237,29 @@ private:
     std::function<void(const std::string&)> logFn;
 
     bool TryOpenDevice();
-    void UpdatePointCloud();
+    void ReleaseDevice();
+    std::shared_ptr<ob::Config> CreatePipelineConfig();
+    std::shared_ptr<ob::VideoStreamProfile> SelectColorProfile(std::shared_ptr<ob::StreamProfileList> colorProfiles, int width, int height, bool isMjpg, bool isYuv);
+    cv::Mat GetRgbColorImage();
+    bool RestartPipeline();
+    void UpdateDocumentBurst();
+    void UpdateDepthBinning();
+    void StartCapture(std::shared_ptr<ob::Config> config);
+    void StopCapture();
+    void CaptureLoop();
+    void PushFrameset(std::shared_ptr<ob::FrameSet> frameset);
+    void PairFrames(std::vector<CapturedFrameset>& pairs);
+    void ClearUnpairedFrames();
+    std::string GetFramePairingSummary();
+    CapturedFrameset PopLatestFrameset();
+    void UpdateCameraParameters();
+    PointCloudKernelParams GetPointCloudKernelParams(bool isWorldTransformApplied, bool isBoundsCullingEnabled);
+    const UINT16* GetFilteredDepth();
+    void UpdatePointCloud(bool isWorldTransformRequested, bool isBoundsCullingRequested, bool isAlignedDepthRequested);
+    bool UpdatePointCloudGpu(bool isAlignedDepthRequested);
+    bool UpdatePointCloudSdk(std::shared_ptr<ob::FrameSet> frameset, bool isWorldTransformRequested);
+    void RecordPointCloudCost(ProcessingBackend backend, double costMs);
+    void UpdateRawRecording();
     bool Close();
 };
 
@@ -0,0 +1,158 @@
+/***************************************************************************\
+
+Module Name:  PerfStats.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module measures the time each stage of the frame loop of a client
+takes, so that a drop of the frame rate can be traced to its stage. The
+durations are recorded without locks into a histogram per stage, with
+logarithmic buckets, from which the server reads the percentiles. The
+points each step of the processing removes from the last frame are counted
+too, with the extent of the points sent and the fill of the voxel grid, so
+that the setting which thins a point cloud out can be told apart.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "traceZones.h"
+
+// Values shared with the PerfStage enum of the server
+enum PerfStage
+{
+    FrameStage = 0,         // Whole frame loop of a processed frame
+    AcquireStage = 1,       // AcquireFrame of the capture manager
+    FrameWaitStage = 2,     // Wait for the next frame of the camera, or for the replay clock
+    PointCloudStage = 3,    // Point cloud generation of the capture manager
+    ProcessStage = 4,       // Processing of the point cloud, filters included
+    FilterStage = 5,        // Density and neighbour filters of the processing
+    DocumentStage = 6,      // Processing of a new document
+    StoreStage = 7,         // Frame ring and recording queue
+    NumPerfStages
+};
+
+inline const char* GetPerfStageName(PerfStage stage)
+{
+    static const char* const names[NumPerfStages] = { "Frame", "Acquire", "FrameWait", "PointCloud", "Process", "Filter", "Document", "Store" };
+    return names[stage];
+}
+
+// Timings of a stage since they were last reset, read by the server
+struct PerfStageStats
+{
+    int Stage;
+    unsigned int Count;
+    float MeanMs;
+    float P50Ms;
+    float P95Ms;
+    float P99Ms;
+    float MaxMs;
+};
+
+// Points of the last processed frame at each step of the processing, in order, and the space they fill, read by the
+// server. The steps the frame skipped count no point; the points the capture manager culls, such as the flying
+// pixels, and with the backends which process the frame, those out of the bounds or in a taken voxel, are the
+// difference between the depth pixels and the source points.
+struct FrameFunnelStats
+{
+    unsigned long long SequenceNumber;
+    unsigned int NumDepthPixels;            // Pixels of the depth frame with a depth
+    unsigned int NumSourcePoints;           // Points of the point cloud of the capture manager
+    unsigned int NumBackgroundPoints;       // Skipped as static background
+    unsigned int NumOutOfBoundsPoints;
+    unsigned int NumExcludedPoints;         // In a voxel of the exclusion mask
+    unsigned int NumDuplicatePoints;        // In a voxel which already had a point of the frame
+    unsigned int NumForeignPoints;          // In a voxel owned by another camera
+    unsigned int NumSparsePoints;           // Removed by the density filter
+    unsigned int NumOutlierPoints;          // Removed by the neighbour filter
+    unsigned int NumReusedBackgroundPoints; // Background points of the last refresh frame appended
+    unsigned int NumSentPoints;
+    float ContentMin[3];                    // Extent of the points sent, in meters; zero without points
+    float ContentMax[3];
+    float VoxelSize;                        // Finest voxel of the grid, in meters; zero without crop
+    unsigned int NumOccupiedVoxels;         // Voxels of the grid the frame filled, owned or not
+    float VoxelFillRatio;                   // Occupied voxels over the voxels of the bounds
+    int DepthWidth;
+    int DepthHeight;
+    int RoiLeft;                            // Region of the depth frame the points were generated from, one past the last column and row
+    int RoiTop;
+    int RoiRight;
+    int RoiBottom;
+};
+
+/// <summary>
+/// Histogram of durations with BucketsPerOctave buckets per doubling of the duration in microseconds. It is recorded
+/// by the frame loop and read by the server without locks; a read which overlaps a record may miss that record.
+/// </summary>
+class PerfHistogram
+{
+public:
+    PerfHistogram();
+
+    void Record(double durationUs);
+    PerfStageStats GetStats(bool isReset);
+    double GetLastDurationUs() const { return lastUs.load(std::memory_order_relaxed); }
+
+private:
+    static const int BucketsPerOctave = 4;
+    static const int NumBuckets = 26 * BucketsPerOctave; // Up to 2^26 us, about a minute
+
+    std::atomic<uint32_t> buckets[NumBuckets];
+    std::atomic<uint64_t> totalUs;
+    std::atomic<uint32_t> maxUs;
+    std::atomic<uint32_t> lastUs; // Kept across the resets, for the frame loop to react to its own timings
+
+    static float GetBucketDurationMs(int bucket);
+};
+
+class PerfStats
+{
+public:
+    void Record(PerfStage stage, double durationUs);
+    int GetStats(PerfStageStats* stats, int maxStages, bool isReset);
+    double GetLastDurationUs(PerfStage stage) const { return histograms[stage].GetLastDurationUs(); }
+
+private:
+    PerfHistogram histograms[NumPerfStages];
+};
+
+/// <summary>
+/// Records the time from its creation to its destruction, or to Stop, in a stage of the statistics, if there are any.
+/// Cancel drops the time of a frame which is not processed to the end of the stage. The stage is also marked as a
+/// trace zone, whether there are statistics or not.
+/// </summary>
+class PerfTimer
+{
+public:
+    PerfTimer(PerfStats* stats, PerfStage stage) : stats(stats), stage(stage), zone(GetPerfStageName(stage)), start(std::chrono::steady_clock::now()) {}
+    ~PerfTimer() { Stop(); }
+
+    PerfTimer(const PerfTimer&) = delete;
+    PerfTimer& operator=(const PerfTimer&) = delete;
+
+    void Stop()
+    {
+        zone.End();
+
+        if (!stats)
+            return;
+
+        stats->Record(stage, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        stats = nullptr;
+    }
+
+    void Cancel() { stats = nullptr; }
+
+private:
+    PerfStats* stats;
+    PerfStage stage;
+    TraceZone zone;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,143 @@
+/***************************************************************************\
+
+Module Name:  PointCloudEncoder.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the encoder of the merged point cloud sent to the
+receivers. The points of all the cameras are quantized to one byte per axis,
+four at a time with SSE2, deduplicated with an occupancy bitmap of the whole
+byte grid and written to the full frame wire buffer. The points of each
+camera can be encoded as a chunk of their own, the chunks of a frame
+concurrently, and joined under the header of the frame. The frame can also
+be coded as an octree, with the voxels in Morton order and one child
+occupancy mask per node, and with the colors in YCoCg predicted from the
+previous voxel in that order, or as a progressive frame: a coarse level of
+the octree, then one refinement chunk for each finer level, each with the
+mean colors of its nodes. Capture volumes larger than the byte grid are
+coded as wide frames, with 32-bit positions quantized within the bounding
+box of each frame. Triangle meshes are coded like wide frames, with all
+their vertices, followed by the vertex indices of their triangles. Surfel
+frames are wide frames followed by the normal of each of their points, in
+one octahedral byte.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+class PointCloudEncoder
+{
+public:
+    // Range of allowed values for each axis around the range centers, in meters
+    static constexpr float Range = 0.3f;
+    static constexpr float HalfRange = Range / 2.0f;
+    static constexpr float XRangeCenter = 0.0f;
+    static constexpr float YRangeCenter = 0.0f;
+    static constexpr float ZRangeCenter = HalfRange;
+
+    // Wire header: scale (short) followed by the number of vertices (int)
+    static constexpr int HeaderSize = sizeof(int16_t) + sizeof(int32_t);
+
+    // Progressive chunk header: depth of the chunk (byte) followed by the size of the chunk body (int)
+    static constexpr int ChunkHeaderSize = sizeof(uint8_t) + sizeof(int32_t);
+    static constexpr int OctreeDepth = 8;
+
+    // Wide frame header: the full frame header, then the minimum and the quantization step of each axis (floats).
+    // The positions are packed in 32 bits, with the number of bits of each axis below.
+    static constexpr int WideHeaderSize = HeaderSize + 6 * sizeof(float);
+    static constexpr int WideXBits = 11;
+    static constexpr int WideYBits = 11;
+    static constexpr int WideZBits = 10;
+
+    // Mesh frame: the number of triangles (int), the vertices coded as a wide frame, then three vertex indices per
+    // triangle, as ushorts when there are no more than MaxShortIndexVertices vertices and as ints otherwise
+    static constexpr int MaxShortIndexVertices = 1 << 16;
+
+    // Surfel frame: the last wide frame, then the normal of each of its points in the order of the wide frame, as coded
+    // by NormalEstimator; NoSurfelNormal for the points whose normal is unknown
+    static constexpr uint8_t NoSurfelNormal = 0xFF;
+
+    PointCloudEncoder();
+
+    static void ConvertPoints(const int16_t* millimeters, const uint8_t* bgrColors, int numPoints, float* vertices, uint8_t* colors);
+
+    int Encode(const float* vertices, const uint8_t* colors, int numVertices, int16_t scale);
+    int EncodeChunks(const float* vertices, const uint8_t* colors, const int* chunkSizes, int numChunks, int16_t scale);
+    int EncodeOctree(int chromaStep);
+    int EncodeProgressive(int coarseDepth);
+    int EncodeWide(const float* vertices, const uint8_t* colors, int numVertices, float range, int16_t scale);
+    int EncodeMesh(const float* vertices, const uint8_t* colors, int numVertices, const int32_t* indices, int numTriangles, float range, int16_t scale);
+    int EncodeSurfels(const uint8_t* normals);
+
+    const uint8_t* GetBuffer() const;
+    int GetSize() const;
+    int GetNumVertices() const;
+
+    const uint8_t* GetOctreeBuffer() const;
+    int GetOctreeSize() const;
+
+    const uint8_t* GetProgressiveBuffer() const;
+    int GetProgressiveSize() const;
+
+    const uint8_t* GetWideBuffer() const;
+    int GetWideSize() const;
+
+    const uint8_t* GetMeshBuffer() const;
+    int GetMeshSize() const;
+
+    const uint8_t* GetSurfelBuffer() const;
+    int GetSurfelSize() const;
+
+private:
+    // One bit for each of the 256 x 256 x 256 voxels of the byte grid
+    static constexpr int NumVoxels = 1 << 24;
+
+    // Frames below this many vertices are encoded as one chunk, as sharing them out would cost more than it saves
+    static constexpr int MinChunkedVertices = 32768;
+
+    // The bits are set atomically by the chunks encoded concurrently, so that a voxel is kept by one chunk only
+    std::vector<std::atomic<uint64_t>> occupancy;
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> voxelColors;
+    std::vector<int> chunkOffsets; // First point of each chunk in the merged frame
+    std::vector<int> chunkCounts; // Points encoded by each chunk
+    int numEncodedVertices;
+
+    // Octree coding of the last frame, and the Morton codes of its voxels (code << 32 | index) sorted to build it
+    std::vector<uint8_t> octreeBuffer;
+    std::vector<uint64_t> mortonCodes;
+
+    // Progressive coding of the last frame
+    std::vector<uint8_t> progressiveBuffer;
+
+    // Wide coding of the last frame, with the indices of the points in range and their packed positions
+    // (position << 32 | index) sorted to deduplicate them
+    std::vector<uint8_t> wideBuffer;
+    std::vector<int> wideIndices;
+    std::vector<uint64_t> wideCodes;
+
+    // Mesh coding of the last mesh, with whether each of its vertices is in range and the triangles kept
+    std::vector<uint8_t> meshBuffer;
+    std::vector<uint8_t> meshVertexInRange;
+    std::vector<int32_t> meshIndices;
+
+    // Surfel coding of the last wide frame
+    std::vector<uint8_t> surfelBuffer;
+
+    // Buffer the radix sorts of the Morton and wide codes scatter to
+    std::vector<uint64_t> sortScratch;
+
+    int EncodeRange(const float* vertices, const uint8_t* colors, int begin, int end, int16_t scale, uint8_t* outVertices, uint8_t* outColors,
+        bool isConcurrent);
+    void ClearOccupancy();
+    void SortMortonCodes();
+    void AppendLevelMasks(std::vector<uint8_t>& output, int depth) const;
+    int AppendLevelColors(std::vector<uint8_t>& output, int depth) const;
+    void EncodeOctreeColors(int chromaStep);
+};
@@ -0,0 +1,354 @@
+/***************************************************************************\
+
+Module Name:  PointCloudKernel.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module converts a depth frame into a compacted point cloud expressed in
+world space (color camera space when no world transform is given), samples the
+color of every point and builds the depth frame aligned to the color frame.
+Scalar, SSE2, AVX2 and AVX-512 implementations are provided and the fastest
+one supported by the CPU is selected at runtime. The colors can be sampled
+from a copy of the color frame downscaled by two, with about one color
+pixel per depth pixel, whose samples stay within fewer cache lines, or from
+a YUYV or NV12 color frame, in which case only the sampled colors are
+converted to RGB.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "utils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <emmintrin.h>
+
+enum PointCloudKernelType
+{
+	KernelScalar,
+	KernelSSE2,
+	KernelAVX2,
+	KernelAVX512
+};
+
+typedef struct PointCloudKernelParams
+{
+	// Depth frame (millimeters) and its normalized unprojection rays
+	const UINT16* depth;
+	const Point2f* rays;
+	int depthWidth;
+	int depthHeight;
+
+	// Color frame, laid out as colorFormat; the YUV frames use the BT.601 matrix, over 16 to 235 when
+	// isColorVideoRange is set (camera streams) and over the whole byte otherwise (decoded MJPG)
+	const BYTE* color;
+	int colorWidth;
+	int colorHeight;
+	ColorFormat colorFormat;
+	bool isColorVideoRange;
+
+	// Color frame downscaled by two, packed RGBX with r in the low byte, sampled instead of color when not null; see
+	// UseDownscaledColor
+	const uint32_t* colorRgbx;
+
+	// Depth to color camera transform (translation in meters)
+	float rot[9];
+	float trans[3];
+
+	// Color camera intrinsics
+	float colorFx;
+	float colorFy;
+	float colorCx;
+	float colorCy;
+
+	// Color camera to world transform applied to the output vertices (3x4, row-major)
+	float world[12];
+
+	// Region of the depth image (first and one past the last column/row) and range of depth values (millimeters)
+	// which can contain points inside the bounds; the other pixels are stored as invalid without further processing
+	int roiLeft;
+	int roiTop;
+	int roiRight;
+	int roiBottom;
+	UINT16 minDepth;
+	UINT16 maxDepth;
+
+	// World space bounds; when culling is enabled, points outside them are stored as invalid before color sampling
+	bool isBoundsCullingEnabled;
+	float minBounds[3];
+	float maxBounds[3];
+} PointCloudKernelParams;
+
+// Output arrays of the point cloud kernels, each able to hold depthWidth * depthHeight elements
+typedef struct PointCloudKernelOutput
+{
+	float* X;
+	float* Y;
+	float* Z;
+	RGB* colors;
+	int* pixelIndices;
+	UINT16* alignedDepth; // Must be zeroed by the caller; null when the aligned depth frame is not needed
+} PointCloudKernelOutput;
+
+void SetIdentityWorldTransform(PointCloudKernelParams& params);
+void DisableBoundsCulling(PointCloudKernelParams& params);
+void EnableBoundsCulling(PointCloudKernelParams& params, float depthFx, float depthFy, float depthCx, float depthCy,
+	const float minBounds[3], const float maxBounds[3]);
+void RestrictRoi(PointCloudKernelParams& params, const int region[4]);
+
+/// <summary>
+/// Averages each 2x2 block of pixels of a color frame into the packed RGBX pixel of a frame half its size, with r in
+/// the low byte. The rows are shared out between the worker threads.
+/// </summary>
+void DownscaleColorFrame(const BYTE* color, int width, int height, uint32_t* output);
+
+/// <summary>
+/// Has the kernel sample the colors from the output of DownscaleColorFrame, instead of the color frame whose size and
+/// color intrinsics are set in params; they are halved to match the downscaled frame.
+/// </summary>
+void UseDownscaledColor(PointCloudKernelParams& params, const uint32_t* downscaledColor);
+
+PointCloudKernelType SelectPointCloudKernel();
+const char* GetPointCloudKernelName(PointCloudKernelType type);
+
+/// <summary>
+/// Computes the vertex and color of every valid depth pixel and stores them contiguously, along with the index
+/// of their depth pixel (v * depthWidth + u). alignedDepth, when not null, keeps the nearest depth per aligned pixel.
+/// Pixels without depth or rejected by the bounds culling produce no point and do not contribute to alignedDepth.
+/// </summary>
+/// <returns>The number of points stored</returns>
+int RunPointCloudKernel(PointCloudKernelType type, const PointCloudKernelParams& params, const PointCloudKernelOutput& output);
+
+int RunPointCloudKernelScalar(const PointCloudKernelParams& params, int rowBegin, int rowEnd, const PointCloudKernelOutput& output);
+int RunPointCloudKernelSSE2(const PointCloudKernelParams& params, int rowBegin, int rowEnd, const PointCloudKernelOutput& output);
+int RunPointCloudKernelAVX2(const PointCloudKernelParams& params, int rowBegin, int rowEnd, const PointCloudKernelOutput& output);
+int RunPointCloudKernelAVX512(const PointCloudKernelParams& params, int rowBegin, int rowEnd, const PointCloudKernelOutput& output);
+
+/// <summary>
+/// Copies a depth frame to output, setting to zero the flying pixels: pixels whose 3x3 neighbourhood contains a depth
+/// further than 1/32 of their own depth (about 3 cm at 1 m) in front or behind them. Pixels without depth are ignored
+/// in the neighbourhoods, so the borders of the holes are kept.
+/// </summary>
+void RejectFlyingPixels(const UINT16* depth, UINT16* output, int width, int height);
+
+/// <summary>
+/// Blends a depth frame into the exponential moving average kept in history, each frame contributing 1/4. Pixels whose
+/// depth moved by more than 1/32 of their depth, or which have no depth in either frame, restart from the new depth so
+/// that moving people do not leave trails. history must be zeroed before the first frame.
+/// </summary>
+void UpdateTemporalDepth(const UINT16* depth, UINT16* history, int numPixels);
+
+/// <summary>
+/// Copies a depth frame to output, replacing every pixel by the median of its 3x3 neighbourhood. The median keeps the
+/// depth discontinuities in place; neighbours without depth are replaced by the depth of the pixel and pixels without
+/// depth are kept empty, so the holes neither grow nor get filled. The borders of the frame are copied unchanged.
+/// </summary>
+void FilterDepthMedian(const UINT16* depth, UINT16* output, int width, int height);
+
+/// <summary>
+/// Copies a depth frame to output, filling the pixels without depth which have at least 4 of their 8 neighbours with
+/// a depth, all within 1/32 of the nearest one, with that nearest depth. The small holes of the dark and specular
+/// surfaces are filled, while the holes along the depth discontinuities and the larger ones are kept empty, so that no
+/// point is made up between two surfaces.
+/// </summary>
+void FillDepthHoles(const UINT16* depth, UINT16* output, int width, int height);
+
+/// <summary>
+/// Reads the luma and the chroma of a pixel of a YUYV or NV12 color frame
+/// </summary>
+static inline void ReadYuvPixel(const PointCloudKernelParams& params, int u, int v, int& y, int& cb, int& cr)
+{
+	if (params.colorFormat == ColorYuyv)
+	{
+		const BYTE* row = params.color + static_cast<size_t>(v) * params.colorWidth * 2;
+		const BYTE* pair = row + (u & ~1) * 2;
+
+		y = row[u * 2];
+		cb = pair[1];
+		cr = pair[3];
+	}
+	else
+	{
+		size_t numLumaPixels = static_cast<size_t>(params.colorWidth) * params.colorHeight;
+		const BYTE* chroma = params.color + numLumaPixels + static_cast<size_t>(v >> 1) * params.colorWidth + (u & ~1);
+
+		y = params.color[static_cast<size_t>(v) * params.colorWidth + u];
+		cb = chroma[0];
+		cr = chroma[1];
+	}
+}
+
+/// <summary>
+/// Samples a YUYV or NV12 color frame using bilinear interpolation, and converts the sample to RGB
+/// </summary>
+static inline void SampleYuvColor(const PointCloudKernelParams& params, int u0, int v0, float du, float dv, BYTE& r, BYTE& g, BYTE& b)
+{
+	const float weights[4] = { (1 - du) * (1 - dv), du * (1 - dv), (1 - du) * dv, du * dv };
+	float y = 0, cb = 0, cr = 0;
+
+	for (int i = 0; i < 4; i++)
+	{
+		int pixelY, pixelCb, pixelCr;
+		ReadYuvPixel(params, u0 + (i & 1), v0 + (i >> 1), pixelY, pixelCb, pixelCr);
+
+		y += weights[i] * pixelY;
+		cb += weights[i] * pixelCb;
+		cr += weights[i] * pixelCr;
+	}
+
+	cb -= 128;
+	cr -= 128;
+	float red, green, blue;
+
+	if (params.isColorVideoRange)
+	{
+		y = 1.164383f * (y - 16);
+		red = y + 1.596027f * cr;
+		green = y - 0.391762f * cb - 0.812968f * cr;
+		blue = y + 2.017232f * cb;
+	}
+	else
+	{
+		red = y + 1.402f * cr;
+		green = y - 0.344136f * cb - 0.714136f * cr;
+		blue = y + 1.772f * cb;
+	}
+
+	r = static_cast<BYTE>((std::min)((std::max)(red + 0.5f, 0.0f), 255.0f));
+	g = static_cast<BYTE>((std::min)((std::max)(green + 0.5f, 0.0f), 255.0f));
+	b = static_cast<BYTE>((std::min)((std::max)(blue + 0.5f, 0.0f), 255.0f));
+}
+
+/// <summary>
+/// Stores the point of a single depth pixel once it has been transformed to color camera space (Z) and to
+/// world space (worldX, worldY, worldZ) and projected into the color image. Valid points are appended at index
+/// numPoints, which is then incremented. Shared by all kernels so that they
+/// produce the same output; it has internal linkage so that the copy compiled with AVX2 code generation is never
+/// picked by the linker for the other kernels.
+/// </summary>
+static inline void StorePointCloudSample(const PointCloudKernelParams& params, int depthIdx, UINT16 d, float Z, float projU, float projV,
+	float worldX, float worldY, float worldZ, const PointCloudKernelOutput& output, int& numPoints)
+{
+	bool isOutsideBounds = params.isBoundsCullingEnabled
+		&& (worldX < params.minBounds[0] || worldX > params.maxBounds[0]
+			|| worldY < params.minBounds[1] || worldY > params.maxBounds[1]
+			|| worldZ < params.minBounds[2] || worldZ > params.maxBounds[2]);
+
+	// No depth data, invalid projection or culled point
+	if (d == 0 || d < params.minDepth || d > params.maxDepth || Z <= 0 || isOutsideBounds)
+		return;
+
+	// Fill the aligned depth frame (original depth frame aligned to a scaled down version of the color frame)
+	int alignedU = static_cast<int>(round(projU * params.depthWidth / params.colorWidth));
+	int alignedV = static_cast<int>(round(projV * params.depthHeight / params.colorHeight));
+
+	if (output.alignedDepth && alignedU >= 0 && alignedV >= 0 && alignedU < params.depthWidth && alignedV < params.depthHeight)
+	{
+		UINT16& existingDepth = output.alignedDepth[alignedV * params.depthWidth + alignedU];
+
+		if (existingDepth == 0 || d < existingDepth)
+			existingDepth = d; // Keep nearest depth
+	}
+
+	// Sample color image using bilinear interpolation
+	BYTE r = 0, g = 0, b = 0;
+	int u0 = static_cast<int>(floor(projU));
+	int v0 = static_cast<int>(floor(projV));
+
+	if (params.colorRgbx && u0 >= 0 && v0 >= 0 && u0 + 1 < params.colorWidth && v0 + 1 < params.colorHeight)
+	{
+		// Fixed point, with 7 bits of weight: the two pixels of a row are loaded together as 8 channels of 16 bits and
+		// blended with the row below, then the right pixel is blended into the left one
+		const int WeightBits = 7;
+		const int WeightOne = 1 << WeightBits;
+		int weightU = static_cast<int>((projU - u0) * WeightOne + 0.5f);
+		int weightV = static_cast<int>((projV - v0) * WeightOne + 0.5f);
+
+		const uint32_t* top = params.colorRgbx + v0 * params.colorWidth + u0;
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i half = _mm_set1_epi16(WeightOne / 2);
+		__m128i topPixels = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(top)), zero);
+		__m128i bottomPixels = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(top + params.colorWidth)), zero);
+
+		__m128i column = _mm_add_epi16(_mm_mullo_epi16(topPixels, _mm_set1_epi16(static_cast<short>(WeightOne - weightV))),
+			_mm_mullo_epi16(bottomPixels, _mm_set1_epi16(static_cast<short>(weightV))));
+		column = _mm_srli_epi16(_mm_add_epi16(column, half), WeightBits);
+
+		__m128i blended = _mm_add_epi16(_mm_mullo_epi16(column, _mm_set1_epi16(static_cast<short>(WeightOne - weightU))),
+			_mm_mullo_epi16(_mm_srli_si128(column, 8), _mm_set1_epi16(static_cast<short>(weightU))));
+		blended = _mm_srli_epi16(_mm_add_epi16(blended, half), WeightBits);
+
+		uint32_t rgbx = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(blended, zero)));
+		r = static_cast<BYTE>(rgbx);
+		g = static_cast<BYTE>(rgbx >> 8);
+		b = static_cast<BYTE>(rgbx >> 16);
+	}
+	else if (params.colorFormat != ColorRgb888 && u0 >= 0 && v0 >= 0 && u0 + 1 < params.colorWidth && v0 + 1 < params.colorHeight)
+	{
+		SampleYuvColor(params, u0, v0, projU - u0, projV - v0, r, g, b);
+	}
+	else if (u0 >= 0 && v0 >= 0 && u0 + 1 < params.colorWidth && v0 + 1 < params.colorHeight)
+	{
+		float du = projU - u0;
+		float dv = projV - v0;
+
+		const BYTE* c00 = params.color + (v0 * params.colorWidth + u0) * 3;
+		const BYTE* c10 = c00 + 3;
+		const BYTE* c01 = c00 + params.colorWidth * 3;
+		const BYTE* c11 = c01 + 3;
+
+		float w00 = (1 - du) * (1 - dv);
+		float w10 = du * (1 - dv);
+		float w01 = (1 - du) * dv;
+		float w11 = du * dv;
+
+		r = static_cast<BYTE>(w00 * c00[0] + w10 * c10[0] + w01 * c01[0] + w11 * c11[0]);
+		g = static_cast<BYTE>(w00 * c00[1] + w10 * c10[1] + w01 * c01[1] + w11 * c11[1]);
+		b = static_cast<BYTE>(w00 * c00[2] + w10 * c10[2] + w01 * c01[2] + w11 * c11[2]);
+	}
+
+	output.X[numPoints] = worldX;
+	output.Y[numPoints] = worldY;
+	output.Z[numPoints] = worldZ;
+	output.colors[numPoints] = { b, g, r };
+	output.pixelIndices[numPoints] = depthIdx;
+	numPoints++;
+}
+
+/// <summary>
+/// Scalar processing of a single depth pixel, used by the reference kernel and for the row remainders of the SIMD kernels.
+/// </summary>
+static inline void ProcessPointCloudPixel(const PointCloudKernelParams& params, int u, int v, const PointCloudKernelOutput& output, int& numPoints)
+{
+	const float* rot = params.rot;
+	const float* trans = params.trans;
+
+	int depthIdx = v * params.depthWidth + u;
+	UINT16 d = params.depth[depthIdx];
+
+	// Convert from depth pixel to depth camera space (in meters)
+	const Point2f& ray = params.rays[depthIdx];
+	float z = d / 1000.0f;
+	float x = ray.X * z;
+	float y = ray.Y * z;
+
+	// Transform point from depth to color camera space
+	float X = rot[0] * x + rot[1] * y + rot[2] * z + trans[0];
+	float Y = rot[3] * x + rot[4] * y + rot[5] * z + trans[1];
+	float Z = rot[6] * x + rot[7] * y + rot[8] * z + trans[2];
+
+	// Project from color camera space to color image pixel coordinates
+	float projU = params.colorFx * X / Z + params.colorCx;
+	float projV = params.colorFy * Y / Z + params.colorCy;
+
+	// Transform point from color camera to world space
+	const float* world = params.world;
+	float worldX = world[0] * X + world[1] * Y + world[2] * Z + world[3];
+	float worldY = world[4] * X + world[5] * Y + world[6] * Z + world[7];
+	float worldZ = world[8] * X + world[9] * Y + world[10] * Z + world[11];
+
+	StorePointCloudSample(params, depthIdx, d, Z, projU, projV, worldX, worldY, worldZ, output, numPoints);
+}
@@ -0,0 +1,112 @@
+/***************************************************************************\
+
+Module Name:  RawFrameRecorder.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module records the raw frames of a camera, before any processing: the
+depth frame (Y16), the color frame (RGB888) and the camera parameters the
+point clouds are generated from. The recordings are replayed by the replay
+capture manager, so that the processing of the clients can be benchmarked
+and profiled on the same frames on any machine. Each frame holds its own
+camera parameters, since they change with the stream profile. The frames are
+copied to a bounded queue and written by a writer thread; when the disk
+falls behind, the newest frames are dropped.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "utils.h"
+
+#pragma pack(push, 1)
+struct RawRecordingFileHeader {
+    char Magic[4]; // RawRecordingMagic
+    uint16_t Version; // RawRecordingVersion
+    uint16_t Reserved;
+    char SerialNumber[32]; // Serial number of the recorded device, which its calibration is loaded from when replayed
+};
+
+// Camera parameters the point clouds are generated from, as given by the camera SDK
+struct RawCameraParams {
+    float DepthFx, DepthFy, DepthCx, DepthCy;
+    float ColorFx, ColorFy, ColorCx, ColorCy;
+    float Rot[9]; // Depth camera to color camera rotation
+    float Trans[3]; // Depth camera to color camera translation, in millimeters
+};
+
+struct RawFrameHeader {
+    uint64_t Timestamp; // Capture timestamp of the device, in microseconds
+    int32_t DepthWidth; // Followed by the depth frame (UINT16 per pixel)
+    int32_t DepthHeight;
+    int32_t ColorWidth; // Then by the color frame (RGB888)
+    int32_t ColorHeight;
+    RawCameraParams CameraParams;
+};
+#pragma pack(pop)
+
+struct RawFrame {
+    RawFrameHeader Header = {};
+    FrameVector<UINT16> Depth;
+    FrameVector<BYTE> Color;
+};
+
+class RawFrameRecorder {
+public:
+    ~RawFrameRecorder();
+
+    bool Start(int deviceID, const std::string& serialNumber);
+    void Stop();
+    bool IsRecording() const;
+    bool WriteFrame(const RawFrameHeader& header, const UINT16* depth, const BYTE* color);
+
+    const std::string& GetFilename() const;
+    uint64_t GetNumWrittenFrames() const;
+    uint64_t GetNumDroppedFrames() const;
+
+private:
+    // Frames waiting to be written past which the new frames are dropped; each raw frame takes several megabytes
+    static const size_t MaxQueuedFrames = 4;
+
+    FILE* fileHandle = nullptr;
+    std::string filename;
+
+    std::thread writerThread;
+    std::mutex writeQueueMutex;
+    std::condition_variable writeQueueCond;
+    std::deque<std::unique_ptr<RawFrame>> writeQueue;
+    std::vector<std::unique_ptr<RawFrame>> freeFrames; // Frames already written, whose buffers are reused
+    bool isWriteStopRequested = false;
+
+    std::atomic<uint64_t> numWrittenFrames{ 0 };
+    uint64_t numDroppedFrames = 0;
+
+    void WriteLoop();
+};
+
+class RawFrameReader {
+public:
+    ~RawFrameReader();
+
+    bool Open(const std::string& path);
+    void Close();
+    bool ReadFrame(RawFrame& frame);
+    void Rewind();
+
+    const std::string& GetSerialNumber() const;
+
+private:
+    FILE* fileHandle = nullptr;
+    std::string serialNumber;
+};
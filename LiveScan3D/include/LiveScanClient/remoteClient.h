@@ -0,0 +1,171 @@
+/***************************************************************************\
+
+Module Name:  RemoteClient.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module handles a camera hosted by a capture node on another computer,
+so that the server controls it through the client API like the cameras of
+this computer. The calls of the server are sent to the node; those which
+return a value wait for its answer. The node streams the processed frames,
+which are decoded and published like those of a local client, with their
+acquisition and publication times and their global timestamp converted to
+the clocks of this computer from regular pings of the node. The connection
+is opened again whenever it is lost, with the last settings of the server.
+A remote client may also isolate a camera of this computer in a worker
+process, a node which hosts that camera alone: it is controlled the same way
+over loopback, but its frames are read from a shared frame ring, and the
+worker is started again whenever it exits or stops answering.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "captureNodeProtocol.h"
+#include "iLiveScanClient.h"
+#include "liveScanClientWrapper.h"
+#include "clientEventQueue.h"
+#include "sharedFrameRing.h"
+#include "clockModel.h"
+#include <asyncLogger.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class RemoteClient : public ILiveScanClient
+{
+public:
+    RemoteClient(int index, const std::string& host, int port, int remoteIndex);
+    explicit RemoteClient(int index);
+
+    static int QueryNode(const std::string& host, int port, int timeoutMs);
+
+    void Run();
+    void RequestExit();
+
+    void StartFrameRecording();
+    void Calibrate();
+    bool GetCalibrationProgress(int& numSamples, int& numRequiredSamples);
+    void SetDocumentFrameInterval(int intervalMs);
+    void SetMaxDocumentSize(int width, int height);
+    void SetSettings(const CameraSettings& settings);
+    void SetExposure(bool isAutoExposureEnabled, int exposureStep);
+    void RequestRecordedFrame();
+    int RequestRecordedFrames(int maxFrames);
+    std::shared_ptr<const ProcessedFrame> AcquireLatestFrame();
+    bool WaitForNewFrame(uint64_t lastSequenceNumber, int timeoutMs);
+    int CopyDocument(unsigned char* jpeg, int maxJpegSize, float& score, short& width, short& height, unsigned char* signature, int maxSignatureSize);
+    int GetPerfStats(PerfStageStats* stats, int maxStages, bool isReset);
+    void GetMemoryStats(ClientMemoryStats& stats);
+    void GetFunnelStats(FrameFunnelStats& stats);
+    bool AcquireDepthFrame(DepthFrame& frame, int timeoutMs);
+    void ReceiveCalibration(const AffineTransform& transform);
+    void ReceiveCameraPoses(const std::vector<AffineTransform>& poses, int cameraIndex);
+    void ClearRecordedFrames();
+    void SaveFrameRing(int seconds);
+    void LearnExclusionMask(int numFrames);
+    void EnableSync(int syncState, int syncOffset, int numSyncedDevices);
+    void DisableSync();
+    void StartMaster();
+
+private:
+    const int ConnectTimeoutMs = 2000;
+    const int ReconnectIntervalMs = 2000;
+    const int ClockPingIntervalMs = 1000;
+    const int ReceiveWaitMs = 100;
+
+    // Answers of the statistics are waited for on the timers of the server, so they give up quickly; the recorded
+    // frames are read from the disk of the node
+    const int RequestTimeoutMs = 1000;
+    const int RecordedFramesTimeoutMs = 30000;
+
+    // A worker which answers no ping for longer than the longest request is hung, and is killed; one asked to stop is
+    // killed if it has not exited in time
+    const int WorkerHangTimeoutMs = 2 * RecordedFramesTimeoutMs;
+    const int WorkerExitTimeoutMs = 5000;
+
+    int clientIndex;
+    std::string host;
+    int port;
+    int remoteIndex; // Index of the client on the node
+
+    // Worker process of an isolated camera, and the ring of its frames; the clients of the nodes have none
+    bool isWorker = false;
+    HANDLE workerProcess = nullptr;
+    SharedFrameRing frameRing;
+    std::thread frameRingThread;
+    std::atomic<int64_t> lastClockPongTimeUs{ 0 };
+
+    std::atomic<bool> isExitRequested{ false };
+
+    // Null while the node is not connected
+    std::mutex connectionMutex;
+    std::shared_ptr<CaptureNodeConnection> connection;
+
+    // Last settings of the server, sent again when the connection opens again
+    std::mutex settingsMutex;
+    bool hasSettings = false;
+    CameraSettings settings;
+    std::vector<MarkerPose> markerPoses;
+    int documentFrameIntervalMs = -1;
+    int maxDocumentWidth = -1;
+    int maxDocumentHeight = -1;
+    int exposureStep = -1; // Exposure set since the last settings, which override it; 0 for the auto exposure
+
+    // Answers of the node, by message type; each type of request waits for one answer at a time
+    std::mutex replyMutex;
+    std::condition_variable replyCond;
+    std::map<uint16_t, std::vector<char>> replies;
+    std::vector<std::vector<char>> recordedFrames; // Received for the pending RecordedFramesRequest
+    uint64_t connectionNumber = 0; // Changed when the connection closes, which abandons the pending requests
+
+    // Latest decoded frame, published like those of the local clients
+    static const int FramePoolSize = 3;
+    std::shared_ptr<const ProcessedFrame> latestFrame;
+    std::shared_ptr<ProcessedFrame> framePool[FramePoolSize];
+    std::mutex frameReadyMutex;
+    std::condition_variable frameReadyCond;
+    uint64_t latestSequenceNumber = 0; // Counted here, so that it keeps increasing when the node restarts
+    CaptureNodeFrameCodec frameCodec;
+
+    // Clocks of the node, followed from the pings: each ping is a sample delayed by its round trip, so the pings of the
+    // shortest round trips set the offsets and the drifts. Both are only used by the thread which receives the messages.
+    const int NumFastClockPings = 8;
+    ClockModel steadyClock;
+    ClockModel systemClock;
+
+    // Document announced to the server, until it copies it
+    std::mutex documentMutex;
+    std::vector<unsigned char> documentJpeg;
+    std::vector<unsigned char> documentSignature;
+    float documentScore = 0.0f;
+    short documentWidth = 0;
+    short documentHeight = 0;
+
+    AsyncLogger logger;
+
+    std::shared_ptr<CaptureNodeConnection> Connect();
+    void ReceiveMessages(CaptureNodeConnection& node);
+    void HandleMessage(uint16_t type, std::vector<char>& content);
+    void ReceiveFrame(const std::vector<char>& content);
+    void ReceiveSharedFrames();
+    void PublishFrame(std::shared_ptr<ProcessedFrame> frame);
+    bool StartWorker();
+    void StopWorker(bool isKilled);
+    void ReceiveClockPong(const std::vector<char>& content);
+    void ReceiveEvent(const std::vector<char>& content);
+    void ReceiveDocument(const std::vector<char>& content);
+    bool SendToNode(uint16_t type, const void* content = nullptr, size_t size = 0);
+    bool SendSettings(CaptureNodeConnection& node);
+    bool Request(uint16_t type, const void* content, size_t size, uint16_t replyType, int timeoutMs, std::vector<char>& reply);
+    std::shared_ptr<ProcessedFrame> AcquireFreeFrame();
+    void SetupLogging();
+    void Log(LogLevel level, const std::string& message);
+};
@@ -0,0 +1,117 @@
+/***************************************************************************\
+
+Module Name:  ReplayCaptureManager.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module replays a raw recording of a camera instead of capturing from
+one, so that the processing of the clients can be benchmarked and profiled
+on the same frames on any machine. The frames are played at the speed they
+were recorded at, or as fast as they are processed, and the recording loops
+once it ends. The point clouds are generated like the CPU and GPU backends
+of the Orbbec capture manager do, and the frames are sent to the document
+detection once per second of the recording.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "ICaptureManager.h"
+#include "rawFrameRecorder.h"
+#include "utils.h"
+#include "pointCloudKernel.h"
+#include "gpuPointCloudEngine.h"
+#include <opencv2/core.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class ReplayCaptureManager : public ICaptureManager
+{
+public:
+    ReplayCaptureManager(int deviceIndex, const std::string& path, bool isRealTime);
+    ~ReplayCaptureManager();
+
+    bool Initialize(SyncState state, int syncOffset);
+    bool AcquireFrame(bool isCalibrationDataRequested);
+    bool StartStreaming(SyncState state, int syncOffset);
+    bool StopStreaming();
+    uint64_t GetTimeStamp();
+    int GetDeviceIndex();
+    void SetExposureState(bool enableAutoExposure, int exposureStep);
+    void SetLogger(std::function<void(const std::string&)> loggerFunc);
+    void SetProcessingBackend(ProcessingBackend backend);
+    void SetFrameProcessingParams(const FrameProcessingParams& params);
+    void SetCaptureMode(CaptureMode mode);
+    void SetColorStreamSettings(const ColorStreamSettings& settings);
+    void SetRawRecording(bool isEnabled);
+    void SetDepthBinning(bool isBinned);
+    void SetThreadAffinity(const ThreadAffinity& affinity);
+    RawCameraParams GetCameraParams();
+    size_t GetMemoryUsage() const;
+    void ReleaseUnusedMemory();
+    bool Close();
+
+private:
+    const uint64_t LoopFrameIntervalUs = 33333; // Time between the last frame of the recording and the first one of the next loop
+    const int CostReportInterval = 300;
+
+    int deviceIndex = 0;
+    std::string path;
+    bool isRealTime = true;
+    bool isStreaming = false;
+
+    RawFrameReader reader;
+    RawFrame currentFrame;
+
+    // Playback clock: the recorded timestamp of the first frame of the loop, when it was played, and the offset added to
+    // the recorded timestamps so that they keep increasing across loops
+    uint64_t loopStartTimeStamp = 0;
+    std::chrono::steady_clock::time_point loopStartTime;
+    uint64_t loopTimeStampOffset = 0;
+    uint64_t lastRecordedTimeStamp = 0;
+    uint64_t lastDocumentTimeStamp = 0;
+    bool isFirstFrameOfLoop = true;
+    uint64_t numReplayedFrames = 0; // Frames replayed in the current loop
+
+    // Camera parameters of the current frame and the per-pixel unprojection rays derived from them
+    RawCameraParams rayTableParams = {};
+    FrameVector<Point2f> depthRayTable;
+    int rayTableWidth = 0;
+    int rayTableHeight = 0;
+
+    PointCloudKernelType pointCloudKernel = KernelScalar;
+    PointBuffer kernelPoints;
+    FrameVector<UINT16> filteredDepth;
+    FrameVector<UINT16> holeFilledDepth;
+    FrameVector<UINT16> depthHistory;
+    FrameVector<UINT16> denoisedDepth;
+    FrameVector<uint32_t> downscaledColor;
+    cv::Mat alignedDepthFrame;
+
+    ProcessingBackend processingBackend = CpuProcessing;
+    bool isSdkFallbackLogged = false;
+    FrameProcessingParams frameProcessingParams = {};
+    std::unique_ptr<GpuPointCloudEngine> gpuEngine;
+    int gpuColorWidth = 0; // Color frame size the GPU engine was created for
+    int gpuColorHeight = 0;
+
+    double pointCloudCostMs[NumProcessingBackends] = {};
+    int numPointCloudFrames[NumProcessingBackends] = {};
+
+    uint64_t currentTimeStamp = 0;
+
+    std::function<void(const std::string&)> logFn;
+
+    bool ReadNextFrame();
+    bool UpdateCameraParameters();
+    PointCloudKernelParams GetPointCloudKernelParams(bool isWorldTransformApplied, bool isBoundsCullingEnabled);
+    const UINT16* GetFilteredDepth();
+    void UpdatePointCloud(bool isWorldTransformRequested, bool isBoundsCullingRequested, bool isAlignedDepthRequested);
+    bool UpdatePointCloudGpu(bool isAlignedDepthRequested, bool isRayTableUpdated);
+    void RecordPointCloudCost(ProcessingBackend backend, double costMs);
+};
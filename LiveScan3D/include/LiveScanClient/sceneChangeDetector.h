@@ -0,0 +1,53 @@
+/***************************************************************************\
+
+Module Name:  SceneChangeDetector.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module tells whether the depth of a frame changed since the last frame
+which was processed, so that the frames of a static scene are published
+again instead of generated and processed. The depth is sampled on a sparse
+grid and compared with the samples of the last processed frame, a frame
+being unchanged when few enough of its samples moved by more than the noise
+of the sensor or became valid or invalid.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class SceneChangeDetector
+{
+public:
+	void Reset();
+	bool IsUnchanged(const uint16_t* depth, int width, int height);
+	void MarkReused();
+	void AcceptFrame();
+	size_t GetMemoryUsage() const;
+
+private:
+	const int SampleStep = 4; // The depth is sampled on one pixel out of SampleStep in each direction
+
+	// A sample changes when its depth moves by more than the noise of the sensor, which grows by 1/64 of the depth, and
+	// a frame changes when more than MaxChangedRatio of its valid samples do
+	const int BaseChangeMm = 12;
+	const int RelativeChangeShift = 6;
+	const double MaxChangedRatio = 0.002;
+
+	// Frames reused in a row at most, so that the colors of a static scene, and a change too slow to be seen between
+	// two frames, are processed at least twice a second
+	const int MaxReusedFrames = 15;
+
+	int width = 0;
+	int height = 0;
+	std::vector<uint16_t> referenceSamples; // Of the last frame accepted
+	std::vector<uint16_t> currentSamples; // Of the last frame passed to IsUnchanged
+	bool hasReference = false;
+	bool hasCurrentSamples = false;
+	int numReusedFrames = 0;
+};
@@ -0,0 +1,80 @@
+/***************************************************************************\
+
+Module Name:  SharedFrameRing.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module passes the processed frames of a camera from the worker process
+which hosts its client to the server on the same computer, through a named
+file mapping of three slots. The worker writes each frame in the slot it
+owns, then swaps it with the slot last published, and the server swaps that
+one with the slot it reads, so that neither process ever waits for the
+other, and a worker which crashes while writing a frame only loses it. The
+server creates the mapping, which outlives the workers it restarts.
+
+\***************************************************************************/
+
+#pragma once
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <windows.h>
+#include "utils.h"
+#include <cstdint>
+#include <string>
+
+// Frame held by a slot of the ring; its points, colors and normals follow in the slot
+struct SharedFrameInfo
+{
+    uint64_t SequenceNumber;
+    uint64_t TimeStampUs;
+    int64_t AcquireTimeUs; // Steady clock, which the processes of a computer share
+    int64_t PublishTimeUs;
+    uint32_t NumPoints;
+    uint32_t NumNormals; // 0 when the normals are not estimated
+};
+
+class SharedFrameRing
+{
+public:
+    ~SharedFrameRing();
+
+    static std::string GetName(DWORD serverProcessId, int clientIndex);
+
+    bool Create(const std::string& name);
+    bool Open(const std::string& name);
+    void Close();
+
+    bool Publish(const SharedFrameInfo& info, const Point3s* vertices, const RGB* colors, const uint8_t* normals);
+    bool WaitForFrame(int timeoutMs);
+    bool ReadLatest(SharedFrameInfo& info, const Point3s*& vertices, const RGB*& colors, const uint8_t*& normals);
+
+    // Port on which the worker accepts the control connection of the server; 0 until it listens
+    void SetControlPort(int port);
+    int GetControlPort() const;
+
+    void RequestExit();
+    bool IsExitRequested() const;
+
+private:
+    // Largest frame of the ring, one point per pixel of the widest depth mode
+    const uint32_t MaxPoints = 1024 * 1024;
+    const uint32_t RingVersion = 1;
+
+    struct RingHeader;
+
+    HANDLE mapping = nullptr;
+    HANDLE frameEvent = nullptr; // Auto-reset, set by the worker for each frame published
+    HANDLE exitEvent = nullptr; // Manual-reset, set by the server to stop the worker
+    char* view = nullptr;
+    size_t slotSize = 0;
+    LONG frontSlot = 0; // Slot read by the server
+
+    RingHeader* GetHeader() const;
+    char* GetSlot(LONG slot) const;
+    bool Map(const std::string& name, bool isCreated);
+};
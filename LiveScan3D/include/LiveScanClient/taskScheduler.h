@@ -0,0 +1,74 @@
+/***************************************************************************\
+
+Module Name:  TaskScheduler.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the work-stealing task scheduler shared by all the
+clients of the process. Each worker thread keeps its own queue of tasks and
+steals from the others when it runs out of work. Frame tasks (point cloud
+processing) are always run before background tasks (document detection),
+which run at a lower thread priority than the frame loops of the clients.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum TaskPriority
+{
+    FrameTaskPriority,      // Point cloud processing of the current frame
+    BackgroundTaskPriority  // Document detection and other work which can lag behind the frames
+};
+
+class TaskScheduler
+{
+public:
+    static TaskScheduler& Instance();
+
+    void SetThreadCount(int numThreads);
+    int GetThreadCount() const;
+
+    void Submit(TaskPriority priority, std::function<void()> task);
+    void ParallelFor(int begin, int end, const std::function<void(int)>& body);
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+    };
+
+    TaskScheduler();
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    std::mutex configMutex;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<int> numWorkers;
+
+    // Tasks submitted from outside the workers, one queue per priority
+    std::mutex queueMutex;
+    std::condition_variable queueCond;
+    std::deque<std::function<void()>> frameTasks;
+    std::deque<std::function<void()>> backgroundTasks;
+    int numQueuedTasks = 0;
+    bool stopWorkers = false;
+
+    void StartWorkers(int numThreads);
+    void StopWorkers();
+    void WorkerLoop(int workerIndex);
+    bool PopTask(int workerIndex, std::function<void()>& task, TaskPriority& priority);
+    bool PopQueuedTask(std::deque<std::function<void()>>& queue, std::function<void()>& task);
+};
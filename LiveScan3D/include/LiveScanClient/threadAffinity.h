@@ -0,0 +1,37 @@
+/***************************************************************************\
+
+Module Name:  ThreadAffinity.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module chooses the processors the threads of a camera run on. With
+several NUMA nodes, the threads of a camera are kept on the node of the USB
+controller it is plugged into, found from its serial number in the device
+tree, so that its frames and the buffers they are processed in stay in the
+memory of that node; the cameras can also be given blocks of logical
+processors of their own.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "utils.h"
+#include <cstdint>
+#include <string>
+
+// Processors of one processor group; an empty mask stands for all the processors of the process
+struct ThreadAffinity
+{
+    uint16_t Group = 0;
+    uint64_t Mask = 0;
+
+    bool operator==(const ThreadAffinity& other) const { return Group == other.Group && Mask == other.Mask; }
+    bool operator!=(const ThreadAffinity& other) const { return !(*this == other); }
+};
+
+ThreadAffinity GetCameraThreadAffinity(ThreadAffinityMode mode, int deviceIndex, int numCoresPerCamera, const std::string& serialNumber);
+bool SetCurrentThreadAffinity(const ThreadAffinity& affinity);
+int FindDeviceNumaNode(const std::string& serialNumber);
+std::string DescribeThreadAffinity(const ThreadAffinity& affinity);
@@ -0,0 +1,80 @@
+/***************************************************************************\
+
+Module Name:  TraceZones.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module marks zones of the native threads on the timeline of an ETW
+trace, so that the stages of the camera threads, the tasks of the workers,
+the document detection and the alignments can be seen overlapping. The
+zones are written by the LiveScan3D-Native TraceLogging provider, shared by
+the client and ICP libraries, as start and stop events on the thread they
+run on. A zone only checks whether a trace session enabled the provider
+when no session did, and compiles to nothing without LIVESCAN_TRACING.
+
+\***************************************************************************/
+
+#pragma once
+
+#ifdef LIVESCAN_TRACING
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+
+TRACELOGGING_DECLARE_PROVIDER(g_liveScanTraceProvider);
+
+/// <summary>
+/// Marks the time from its creation to its destruction, or to End, as a zone of the calling thread. The name must
+/// outlive the zone; it is meant to be a literal.
+/// </summary>
+class TraceZone
+{
+public:
+    explicit TraceZone(const char* name) : name(name), isEnabled(TraceLoggingProviderEnabled(g_liveScanTraceProvider, 0, 0))
+    {
+        if (isEnabled)
+            TraceLoggingWrite(g_liveScanTraceProvider, "Zone", TraceLoggingOpcode(WINEVENT_OPCODE_START), TraceLoggingString(name, "Name"));
+    }
+
+    ~TraceZone() { End(); }
+
+    TraceZone(const TraceZone&) = delete;
+    TraceZone& operator=(const TraceZone&) = delete;
+
+    void End()
+    {
+        if (!isEnabled)
+            return;
+
+        TraceLoggingWrite(g_liveScanTraceProvider, "Zone", TraceLoggingOpcode(WINEVENT_OPCODE_STOP), TraceLoggingString(name, "Name"));
+        isEnabled = false;
+    }
+
+private:
+    const char* name;
+    bool isEnabled;
+};
+
+#define LIVESCAN_TRACE_CONCAT_(a, b) a##b
+#define LIVESCAN_TRACE_CONCAT(a, b) LIVESCAN_TRACE_CONCAT_(a, b)
+
+// Marks the rest of the enclosing scope as a zone
+#define TRACE_ZONE(name) TraceZone LIVESCAN_TRACE_CONCAT(traceZone, __LINE__)(name)
+
+#else
+
+class TraceZone
+{
+public:
+    explicit TraceZone(const char*) {}
+    void End() {}
+};
+
+#define TRACE_ZONE(name) ((void)0)
+
+#endif
@@ -22,12 +22,51 @@ struct CameraSettings
     bool Filter;
     int FilterNeighbors;
     float FilterThreshold;
+    int FilterMode; // FilterMode value
+    int BackgroundMode; // BackgroundMode value
 
     MarkerPose* MarkerPoses;
     int NumMarkers;
 
     bool AutoExposureEnabled;
     int ExposureStep;
+
+    bool GpuProcessingEnabled;
+    int NumWorkerThreads;
+    bool FrameCallbackEnabled;
+    bool SdkProcessingEnabled;
+
+    int ColorWidth;
+    int ColorHeight;
+    bool ColorMjpgEnabled;
+    bool DocumentBurstEnabled;
+
+    bool DepthDenoiseEnabled;
+    int PointBudget;
+    float CaptureRange;
+    int RingRecordingSeconds;
+    int RecordingCompressionLevel;
+    bool RecordingDeltaEnabled;
+    bool RawRecordingEnabled;
+    bool LeanMemoryEnabled;
+    bool NormalEstimationEnabled;
+    bool ConsumerPacingEnabled;
+    int FrameDecimation; // One of every FrameDecimation acquired frames is processed; 0 or 1 for all of them
+    bool ColorDownscaleEnabled;
+    int DepthBinningMode; // DepthBinningMode value
+    int FrameTimeBudgetMs; // 0 to never shed work
+    int ThreadAffinityMode; // ThreadAffinityMode value
+    int CoresPerCamera; // Logical processors of each camera with the core set affinity
+    bool LargePagesEnabled;
+    int PeripheralVoxelScale; // Voxels outside the regions of interest are this many times larger; 0 or 1 for the same voxels everywhere
+    bool DepthHoleFillEnabled;
+    int FramePairingToleranceUs; // Color frames are paired with the depth frame nearest to them within this many microseconds
+    bool ColorYuvEnabled;
+    bool ProcessingStaggered; // Synced cameras start processing their frames at a fraction of the frame period by their place on the sync chain
+    bool AdaptiveRoiEnabled; // Generate the points only from the region of the depth frames which held content in the recent frames
+    bool TemporalFilterEnabled; // Reuse the decisions of the neighbour filter of the previous frame for the points which did not move
+    bool InterleavedRecordingEnabled; // Record the cameras of the process to one shared file
+    bool StaticFrameReuseEnabled; // Publish the last frame again for the frames whose depth did not change since it
 };
 
 struct AffineTransform
@@ -0,0 +1,113 @@
+/***************************************************************************\
+
+Module Name:  TsdfFusionVolume.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module fuses the point clouds of all the cameras into a truncated signed
+distance field (TSDF) with DirectCompute shaders. Each point updates the
+voxels along the ray from its camera within the truncation distance, the
+frames are averaged over time with a decaying weight, and the surface is
+extracted as one point per voxel it crosses, which averages out the depth
+noise of the cameras and sets the density of the points. The surface can be
+extracted as a triangle mesh instead, with surface nets over cubes of one or
+more voxels on each side.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "utils.h"
+#include <d3d11.h>
+#include <vector>
+
+class TsdfFusionVolume
+{
+public:
+    TsdfFusionVolume();
+    ~TsdfFusionVolume();
+
+    bool Configure(const float minBounds[3], const float maxBounds[3], float voxelSize, float truncation, float decay);
+    bool Integrate(const float* vertices, const unsigned char* colors, int numVertices, const float origin[3]);
+    int Extract();
+    int ExtractMesh(int step);
+    const float* GetVertices() const;
+    const unsigned char* GetColors() const;
+    const int* GetIndices() const;
+    int GetTriangleCount() const;
+    void Release();
+
+private:
+    const int PointGroupSize = 64;
+    const int VoxelGroupSize = 4;
+    const UINT MaxVoxels = 1 << 22; // 96 MB of volume and accumulators
+    const UINT MaxPoints = 65535 * 64; // Points of one camera in a single dispatch
+    const UINT MaxSurfacePoints = 1 << 21;
+    const UINT MaxTriangles = 1 << 21; // 24 MB of triangles and as much to read them back, created on the first mesh
+    const int MaxMeshStep = 16;
+    const float MaxWeight = 64.0f;
+    const float MinSurfaceWeight = 1.0f; // Weight of a voxel for it to be part of the extracted surface
+    const float ForgetWeight = 0.05f; // Weight under which a voxel is cleared
+
+    bool isConfigured = false;
+
+    float minBounds[3] = {};
+    float maxBounds[3] = {};
+    float voxelSize = 0.0f;
+    float truncation = 0.0f;
+    float decay = 0.0f;
+    UINT gridSize[3] = {};
+    UINT pointCapacity = 0;
+
+    ID3D11Device* device = NULL;
+    ID3D11DeviceContext* context = NULL;
+    ID3D11ComputeShader* integrateShader = NULL;
+    ID3D11ComputeShader* blendShader = NULL;
+    ID3D11ComputeShader* extractShader = NULL;
+    ID3D11ComputeShader* meshVerticesShader = NULL;
+    ID3D11ComputeShader* meshFacesShader = NULL;
+    ID3D11Buffer* constants = NULL;
+
+    ID3D11Buffer* pointBuffer = NULL;
+    ID3D11Buffer* pointColorBuffer = NULL;
+    ID3D11ShaderResourceView* pointView = NULL;
+    ID3D11ShaderResourceView* pointColorView = NULL;
+
+    ID3D11Buffer* accumulatorBuffer = NULL;
+    ID3D11Buffer* volumeBuffer = NULL;
+    ID3D11Buffer* surfaceBuffer = NULL;
+    ID3D11Buffer* surfaceCountBuffer = NULL;
+    ID3D11UnorderedAccessView* accumulatorView = NULL;
+    ID3D11UnorderedAccessView* volumeView = NULL;
+    ID3D11UnorderedAccessView* surfaceView = NULL;
+    ID3D11UnorderedAccessView* surfaceCountView = NULL;
+
+    // Vertex of each cube of the mesh and triangles of the mesh
+    ID3D11Buffer* cubeVertexBuffer = NULL;
+    ID3D11Buffer* triangleBuffer = NULL;
+    ID3D11UnorderedAccessView* cubeVertexView = NULL;
+    ID3D11UnorderedAccessView* triangleView = NULL;
+
+    ID3D11Buffer* countStaging = NULL;
+    ID3D11Buffer* surfaceStaging = NULL;
+    ID3D11Buffer* triangleStaging = NULL;
+
+    // Extracted surface, read by the server until the next extraction
+    std::vector<float> surfaceVertices;
+    std::vector<unsigned char> surfaceColors;
+    std::vector<int> surfaceIndices; // Three vertices per triangle, counter-clockwise seen from outside the surface
+
+    bool CreateDevice();
+    bool CreateVolume();
+    bool CreateMeshBuffers();
+    bool CreateRawBuffer(UINT numWords, ID3D11Buffer** buffer, ID3D11UnorderedAccessView** view);
+    bool CreateStructuredBuffer(UINT stride, UINT count, ID3D11Buffer** buffer, ID3D11UnorderedAccessView** view);
+    bool CreateStagingBuffer(UINT byteWidth, ID3D11Buffer** buffer);
+    bool ReservePoints(UINT numPoints);
+    void UpdateConstants(const float origin[3], UINT numPoints, UINT meshStep = 0);
+    int ReadSurface(bool isMesh);
+    void Dispatch(ID3D11ComputeShader* shader, UINT groupsX, UINT groupsY, UINT groupsZ);
+    void ReleaseVolume();
+};
@@ -19,9 +19,11 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 #pragma once
 
 #include "stdafx.h"
+#include "frameAllocator.h"
 #include <stdio.h>
 #include <string>
 #include <vector>
+#include <array>
 #include <opencv2/opencv.hpp>
 
 enum SyncState 
@@ -121,12 +123,175 @@ typedef struct RGB
 } RGB;
 #pragma pack(pop)
 
+// Point cloud stored as a structure of arrays, shared by the processing stages of the client: positions (in meters),
+// colors and the index of the depth pixel (v * depthWidth + u) each point comes from. Only valid points are stored.
+// The arrays are aligned frame buffers, so that the vectorized stages never load across a cache line.
+typedef struct PointBuffer
+{
+	FrameVector<float> X;
+	FrameVector<float> Y;
+	FrameVector<float> Z;
+	FrameVector<RGB> Colors;
+	FrameVector<int> PixelIndices;
+
+	size_t Size() const
+	{
+		return X.size();
+	}
+
+	void Clear()
+	{
+		X.clear();
+		Y.clear();
+		Z.clear();
+		Colors.clear();
+		PixelIndices.clear();
+	}
+
+	void Resize(size_t size)
+	{
+		X.resize(size);
+		Y.resize(size);
+		Z.resize(size);
+		Colors.resize(size);
+		PixelIndices.resize(size);
+	}
+
+	void PushBack(float x, float y, float z, const RGB& color, int pixelIndex)
+	{
+		X.push_back(x);
+		Y.push_back(y);
+		Z.push_back(z);
+		Colors.push_back(color);
+		PixelIndices.push_back(pixelIndex);
+	}
+
+	// Copies the point at index source over the one at index destination, used for in-place compaction
+	void MovePoint(size_t destination, size_t source)
+	{
+		X[destination] = X[source];
+		Y[destination] = Y[source];
+		Z[destination] = Z[source];
+		Colors[destination] = Colors[source];
+		PixelIndices[destination] = PixelIndices[source];
+	}
+
+	// Copies the point at index sourceIndex of another buffer over the one at index destination
+	void CopyPoint(size_t destination, const PointBuffer& source, size_t sourceIndex)
+	{
+		X[destination] = source.X[sourceIndex];
+		Y[destination] = source.Y[sourceIndex];
+		Z[destination] = source.Z[sourceIndex];
+		Colors[destination] = source.Colors[sourceIndex];
+		PixelIndices[destination] = source.PixelIndices[sourceIndex];
+	}
+
+	// Copies the first count points of another buffer, reusing the capacity of this one
+	void AssignFirst(const PointBuffer& other, size_t count)
+	{
+		X.assign(other.X.begin(), other.X.begin() + count);
+		Y.assign(other.Y.begin(), other.Y.begin() + count);
+		Z.assign(other.Z.begin(), other.Z.begin() + count);
+		Colors.assign(other.Colors.begin(), other.Colors.begin() + count);
+		PixelIndices.assign(other.PixelIndices.begin(), other.PixelIndices.begin() + count);
+	}
+
+	void Swap(PointBuffer& other)
+	{
+		X.swap(other.X);
+		Y.swap(other.Y);
+		Z.swap(other.Z);
+		Colors.swap(other.Colors);
+		PixelIndices.swap(other.PixelIndices);
+	}
+} PointBuffer;
+
+// Grayscale thumbnail of a detected document, compared instead of the crops to tell whether a detection shows a new document
+const int DocumentSignatureSize = 16;
+typedef std::array<uint8_t, DocumentSignatureSize * DocumentSignatureSize> DocumentSignature;
+
 typedef struct DetectionResult {
-	cv::Mat data;
+	std::vector<uchar> jpeg; // Crop of the document, encoded once for all the receivers
 	short width;
 	short height;
 	float score;
+	DocumentSignature signature;
+	cv::Rect2f region; // Box of the document in the color frame, as fractions of its width and height
+};
+
+enum ProcessingBackend
+{
+	CpuProcessing, // Point cloud kernels of the client
+	GpuProcessing, // DirectCompute shader
+	SdkProcessing, // Alignment and point cloud filters of the camera SDK
+	NumProcessingBackends
 };
 
+// Color stream requested from the camera; the closest available profile is used when it is not supported
+typedef struct ColorStreamSettings
+{
+	int width;
+	int height;
+	bool isMjpg; // Compressed stream, decoded to RGB888 by the capture thread
+	bool isDocumentBurstEnabled; // Switch to the high resolution stream for a few seconds when a document is detected
+	bool isYuv; // YUYV or NV12 stream, or MJPG decoded to NV12, whose colors are only converted for the sampled points
+} ColorStreamSettings;
+
+// Layout of the color frames handed to the point cloud kernels
+enum ColorFormat
+{
+	ColorRgb888, // Packed r, g, b
+	ColorYuyv,   // Packed y0, u, y1, v for each pair of pixels
+	ColorNv12    // Plane of y, followed by a plane of interleaved u, v for each 2x2 block of pixels
+};
+
+// Depth stream of the camera: binning averages 2x2 pixels, for a quarter of the points at the same field of view
+enum DepthBinningMode
+{
+	DepthUnbinned,    // Full resolution depth stream
+	DepthBinned,      // Binned depth stream
+	DepthBinningAuto  // Binned while the point budget keeps the voxels coarser than the binned pixels
+};
+
+// Processors the capture and frame loop threads of each camera run on
+enum ThreadAffinityMode
+{
+	AffinityNone,      // Any processor of the process
+	AffinityNumaNode,  // Processors of the NUMA node of the USB controller of the camera
+	AffinityCoreSet    // A block of logical processors of its own for each camera
+};
+
+// How the framesets are received from the camera
+enum CaptureMode
+{
+	PollingCapture,  // A capture thread waits for each frameset
+	CallbackCapture  // The camera SDK pushes the framesets as soon as they arrive
+};
+
+// Parameters of the calibration, bounds crop and voxel decimation steps, for backends which apply them at capture time
+typedef struct FrameProcessingParams
+{
+	bool isCalibrated;
+	float worldTransform[3][4]; // Color camera to world space, see Calibration::UpdateWorldTransform
+
+	float minBounds[3];
+	float maxBounds[3];
+
+	float voxelSize;
+	float gridCenter[3];
+	float gridHalfRange;
+
+	bool isFlyingPixelFilterEnabled; // Reject the depth pixels at discontinuities before generating the point cloud
+	bool isDepthDenoiseEnabled; // Smooth the depth over time and with a median filter before generating the point cloud
+	bool isDepthHoleFillEnabled; // Fill the small holes of the depth before it is denoised
+	bool isColorDownscaleEnabled; // Sample the colors of the points from the color frame downscaled by two
+
+	int framePairingToleranceUs; // Largest difference between the timestamps of the color and depth frames paired together
+
+	// Region of the depth frame (left, top, right and bottom, one past the last column and row) which holds the content
+	// of the bounds; the other pixels are skipped along with those which cannot see the bounds. Empty for the whole frame
+	int processingRoi[4];
+} FrameProcessingParams;
+
 Point3f RotatePoint(Point3f &point, std::vector<std::vector<float>> &R);
 Point3f InverseRotatePoint(Point3f &point, std::vector<std::vector<float>> &R);
@@ -0,0 +1,38 @@
+/***************************************************************************\
+
+Module Name:  ViewDecimator.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module decimates the points of the live view of the server to one point
+per voxel of a given size, which the view sizes to the pixels of its window,
+so that it does not draw many points per pixel while the frames stream. The
+voxels are kept in an open-addressing hash table whose slots are tagged with
+the generation of the call which wrote them, so that the table is never
+cleared between the calls.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+class ViewDecimator {
+public:
+    int Decimate(const float* vertices, const uint8_t* colors, int numPoints, float voxelSize,
+        float* outVertices, uint8_t* outColors);
+    size_t GetMemoryUsage() const;
+
+private:
+    // The keys pack the 21 low bits of each voxel coordinate
+    std::vector<uint64_t> slotKeys;
+    std::vector<uint32_t> slotGenerations;
+    uint32_t generation = 0;
+    size_t slotMask = 0;
+
+    void Reserve(int numPoints);
+};
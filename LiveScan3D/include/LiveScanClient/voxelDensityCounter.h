@@ -0,0 +1,54 @@
+/***************************************************************************\
+
+Module Name:  VoxelDensityCounter.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module counts the number of points falling in each cell of a voxel grid
+aligned to the world origin. Cells inside the Holoport volume are counted in a
+dense array; cells outside of it fall back to an open-addressing hash table.
+Only the cells touched since the last reset are cleared.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+class VoxelDensityCounter {
+public:
+    VoxelDensityCounter(float voxelSize,
+        float centerX, float centerY, float centerZ,
+        float halfRange);
+
+    void Reset(size_t maxInsertions);
+    uint32_t Insert(float x, float y, float z);
+    int GetCount(uint32_t cell) const;
+    bool IsCellWithin(float x, float y, float z, float distance) const;
+    size_t GetMemoryUsage() const;
+    void ReleaseUnusedMemory();
+
+private:
+    float voxelSize;
+    int minCellX, minCellY, minCellZ;
+    int gridSizeX, gridSizeY, gridSizeZ;
+
+    // Dense counts of the cells inside the volume
+    std::vector<uint16_t> denseCounts;
+
+    // Hash table of the cells outside the volume; the keys pack the 21 low bits of each cell coordinate
+    std::vector<uint64_t> hashKeys;
+    std::vector<uint16_t> hashCounts;
+    std::vector<uint32_t> hashSlotStates;
+    uint32_t hashGeneration;
+    size_t hashMask;
+    size_t requiredHashSize; // Size of the hash table the last reset needed
+
+    std::vector<uint32_t> touchedCells;
+
+    uint32_t InsertOutsideCell(int x, int y, int z);
+};
@@ -7,7 +7,17 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module reduces points according to a voxel grid with customizeable size
-such that there remains only one point per grid cell.
+such that there remains only one point per grid cell. The cells are stored as
+bits packed in 64-bit words, each tagged with the generation in which it was
+last written, so that resetting the grid does not touch its memory and points
+can be inserted concurrently without locks. The voxels can also be shared out
+between the cameras of the calibration, each camera keeping only the points
+of the voxels it owns, so that the overlap of the cameras is not duplicated.
+Points can also be inserted in coarser voxels, blocks of the voxels of the
+grid, so that the density of the points varies over the frame. For the frames
+processed in parallel, the points claim their voxels in a hash table which
+keeps the lowest index of the points reaching each voxel, so that the point
+kept in a voxel does not depend on the order the threads reach it in.
 
 \***************************************************************************/
 
@@ -15,6 +25,14 @@ such that there remains only one point per grid cell.
 
 #include <vector>
 #include <cstdint>
+#include <atomic>
+#include <memory>
+
+// Camera which the voxels of the grid can belong to, in world space
+struct VoxelOwner {
+    float center[3];
+    float axis[3]; // Optical axis, of unit length
+};
 
 class VoxelGridFilter {
 public:
@@ -22,15 +40,55 @@ public:
         float centerX, float centerY, float centerZ,
         float halfRange);
 
+    void SetVoxelSize(float voxelSize);
     void Reset();
     bool Insert(float x, float y, float z);
+    bool InsertConcurrent(float x, float y, float z);
+    bool InsertCoarseConcurrent(float x, float y, float z, int scale);
+    void BeginClaims(size_t maxClaims);
+    bool ClaimConcurrent(float x, float y, float z, int scale, uint32_t pointIndex, uint32_t& slot);
+    bool IsClaimWinner(uint32_t slot, uint32_t pointIndex) const;
+    void SetOwners(const std::vector<VoxelOwner>& owners, int ownerIndex);
+    bool IsOwned(float x, float y, float z) const;
+    bool HasOwners() const;
+    size_t GetMemoryUsage() const;
+    void ReleaseUnusedMemory();
 
 private:
+    // Each word holds the occupancy of 48 cells in its low bits and its generation in the 16 high bits
+    static const int CellsPerWord = 48;
+    static const int GenerationShift = 48;
+    static const uint64_t CellMask = (1ull << CellsPerWord) - 1;
+
+    // Another camera only owns a voxel when it faces it within this cone and is nearer by this ratio of distances,
+    // so that the cameras whose voxel sizes differ still keep the voxels at the boundary between them
+    static const float MinOwnerViewCos;
+    static const float MaxOwnerDistanceRatio;
+
     size_t gridSizeX, gridSizeY, gridSizeZ;
     float invVoxelSize;
+    float halfRange;
 
     float minX, minY, minZ;
-    std::vector<bool> voxelGrid;
+    size_t numWords;
+    size_t capacityWords;
+    std::unique_ptr<std::atomic<uint64_t>[]> voxelWords;
+    uint64_t generation;
+
+    // Each claim key holds the voxel index plus one in its low bits and the claim generation in the high bits; each
+    // winner holds the lowest point index which claimed the voxel in its low 32 bits and the claim generation above
+    static const int ClaimGenerationShift = 40;
+    static const int MinClaimSlots = 1024;
+
+    size_t claimCapacity; // Power of two, at least twice the claims of the frame so that the probes stay short
+    int claimShift;
+    std::unique_ptr<std::atomic<uint64_t>[]> claimKeys;
+    std::unique_ptr<std::atomic<uint64_t>[]> claimWinners;
+    uint64_t claimGeneration;
+
+    std::vector<VoxelOwner> owners; // Empty when this camera keeps all the voxels
+    int ownerIndex;
 
-    size_t VoxelIndex(int x, int y, int z) const;
+    bool VoxelIndex(float x, float y, float z, int scale, size_t& idx) const;
+    bool InsertIndexConcurrent(size_t idx);
 };
\ No newline at end of file
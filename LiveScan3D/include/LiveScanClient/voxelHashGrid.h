@@ -0,0 +1,52 @@
+/***************************************************************************\
+
+Module Name:  VoxelHashGrid.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module searches the neighbours of points in a uniform grid of voxels
+whose size is about the search radius, for the point clouds of the small
+volume of the Holoport, instead of a KD-tree. The voxels are hashed into a
+table of buckets, and the points are sorted by bucket with a counting sort,
+so the grid is built in linear time into a few flat arrays, and a query
+reads the contiguous points of the buckets of the voxels around its own.
+It is shared by the outlier filter of the clients and the alignments.
+
+\***************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class VoxelHashGrid
+{
+public:
+    void Build(const float* x, const float* y, const float* z, size_t stride, int numPoints, float cellSize);
+    void Clear();
+    bool IsEmpty() const;
+
+    int CountNeighbours(float x, float y, float z, float radius, int maxCount) const;
+    bool FindNearest(float x, float y, float z, int maxRings, int& index, float& distanceSquared) const;
+
+    size_t GetMemoryUsage() const;
+    void ReleaseUnusedMemory();
+
+private:
+    float cellSize = 0.0f;
+    float inverseCellSize = 0.0f;
+    uint32_t bucketMask = 0;
+
+    std::vector<uint32_t> bucketStarts; // First point of each bucket in the sorted points, then one past the last point
+    std::vector<uint64_t> sortedCells; // Voxel of each sorted point, which tells apart the voxels sharing a bucket
+    std::vector<float> sortedPoints; // x, y, z of each point, sorted by bucket
+    std::vector<int> sortedIndices; // Index of each sorted point in the built points
+    std::vector<uint32_t> pointBuckets; // Bucket of each built point, only used by the build
+
+    int GetCell(float coordinate) const;
+    uint32_t GetBucket(int cellX, int cellY, int cellZ) const;
+    void SearchCell(int cellX, int cellY, int cellZ, float x, float y, float z, int& index, float& distanceSquared) const;
+};
@@ -0,0 +1,92 @@
+/***************************************************************************\
+
+Module Name:  CaptureNode.h
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module serves the clients of a capture node to the remote clients of a
+server on another computer, one TCP connection for each client. The calls
+of the server are passed to the client through the LiveScanClient API and
+answered on the same connection, while the processed frames of the client
+are compressed and streamed as they are published, with its events. The
+clients keep running when the server disconnects, so that it can connect
+again without restarting the cameras. A node may also be the worker process
+of a single camera of a server on the same computer, which then publishes
+the frames in a shared frame ring instead, and only listens on loopback.
+
+\***************************************************************************/
+
+#pragma once
+
+#include "captureNodeProtocol.h"
+#include "liveScanClientApi.h"
+#include "sharedFrameRing.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class CaptureNode
+{
+public:
+    explicit CaptureNode(const std::vector<LiveScanClientHandle>& clients, int firstClientIndex = 0, SharedFrameRing* frameRing = nullptr);
+    ~CaptureNode();
+
+    bool Run(int port);
+    void RequestExit();
+
+private:
+    const int AcceptWaitMs = 100;
+    const int HelloTimeoutMs = 2000;
+    const int FrameWaitMs = 100;
+    const int EventWaitMs = 100;
+    const int MaxEvents = 64;
+
+    // Sizes of the buffers the answers are copied to, like those of the server
+    const int MaxDepthPixels = 1024 * 1024;
+    const int DocumentSignatureSize = 16 * 16;
+
+    struct Session
+    {
+        int ClientIndex = 0;
+        LiveScanClientHandle Client = nullptr;
+
+        // Null while the server is not connected
+        std::mutex ConnectionMutex;
+        std::shared_ptr<CaptureNodeConnection> Connection;
+        std::thread ReaderThread;
+        std::thread SenderThread;
+
+        // Last serial number, calibration and sync state of the client, sent again to each new connection
+        std::mutex EventMutex;
+        std::vector<ClientEvent> StateEvents;
+
+        // Frames sent through the recorded frame callback during the pending RecordedFramesRequest
+        std::shared_ptr<CaptureNodeConnection> RecordedFrameConnection;
+        int NumRecordedFrames = 0;
+    };
+
+    static CaptureNode* instance; // For the recorded frame callback
+
+    std::vector<std::unique_ptr<Session>> sessions;
+    int firstClientIndex; // Index of the client of the first session, which its events carry
+    SharedFrameRing* frameRing; // Of the worker of a local server; null for the nodes of remote servers
+    std::atomic<bool> isExitRequested{ false };
+    std::thread eventThread;
+
+    void Accept(SOCKET socket);
+    void ReadMessages(Session& session, std::shared_ptr<CaptureNodeConnection> connection);
+    void HandleMessage(Session& session, CaptureNodeConnection& connection, uint16_t type, const std::vector<char>& content);
+    void SetSettings(Session& session, const std::vector<char>& content);
+    void SendRecordedFrames(Session& session, std::shared_ptr<CaptureNodeConnection> connection, int maxFrames);
+    void SendDepthFrame(Session& session, CaptureNodeConnection& connection, int timeoutMs);
+    void SendFrames(Session& session);
+    void DispatchEvents();
+    void SendDocument(Session& session, const ClientEvent& event);
+    std::shared_ptr<CaptureNodeConnection> GetConnection(Session& session);
+
+    static void SendRecordedFrame(int clientIndex, const Point3s* vertices, const RGB* colors, int count, bool noMoreFrames);
+};
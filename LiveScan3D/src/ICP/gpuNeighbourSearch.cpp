@@ -0,0 +1,470 @@
+/***************************************************************************\
+
+Module Name:  GpuNeighbourSearch.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module finds the nearest neighbours of the alignments with a
+DirectCompute shader, for the large point clouds whose KD-tree searches
+dominate the alignments. The target points are sorted in a uniform grid,
+and each query point searches the cells around its own. The results which
+the searched cells cannot guarantee are left to the KD-trees.
+
+\***************************************************************************/
+
+#include "gpuNeighbourSearch.h"
+#include <d3d11.h>
+#include <d3dcompiler.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#pragma comment(lib, "d3d11.lib")
+#pragma comment(lib, "d3dcompiler.lib")
+
+namespace
+{
+	template <class T> void SafeRelease(T*& object)
+	{
+		if (object != NULL)
+		{
+			object->Release();
+			object = NULL;
+		}
+	}
+
+	// Layout must match the QueryConstants cbuffer of the shader below
+	struct QueryConstants
+	{
+		float gridMin[4]; // w: inverse cell size
+		UINT gridSize[4]; // w: number of query points
+	};
+
+	// Layout must match the GridPoint struct of the shader below
+	struct GridPoint
+	{
+		float position[3];
+		UINT index; // Index of the point in the target
+	};
+
+	// Layout must match the QueryResult struct of the shader below
+	struct QueryResult
+	{
+		UINT index; // 0xFFFFFFFF if no point was found in the searched cells
+		float distance; // Squared
+	};
+
+	const char* NeighbourSearchShaderSource = R"(
+cbuffer QueryConstants : register(b0)
+{
+	float4 GridMin;
+	uint4 GridSize;
+};
+
+struct GridPoint
+{
+	float3 Position;
+	uint Index;
+};
+
+struct QueryResult
+{
+	uint Index;
+	float Distance;
+};
+
+StructuredBuffer<GridPoint> Points : register(t0);
+StructuredBuffer<uint> CellStarts : register(t1);
+StructuredBuffer<float3> Queries : register(t2);
+
+RWStructuredBuffer<QueryResult> Results : register(u0);
+
+[numthreads(64, 1, 1)]
+void main(uint3 id : SV_DispatchThreadID)
+{
+	if (id.x >= GridSize.w)
+		return;
+
+	float3 query = Queries[id.x];
+	int3 cell = (int3)floor((query - GridMin.xyz) * GridMin.w);
+
+	QueryResult result;
+	result.Index = 0xFFFFFFFF;
+	result.Distance = 3.402823466e+38f;
+
+	// Any point closer than a cell is in one of the cells around the one of the query, even outside of the grid
+	for (int z = max(cell.z - 1, 0); z <= min(cell.z + 1, (int)GridSize.z - 1); z++)
+	{
+		for (int y = max(cell.y - 1, 0); y <= min(cell.y + 1, (int)GridSize.y - 1); y++)
+		{
+			for (int x = max(cell.x - 1, 0); x <= min(cell.x + 1, (int)GridSize.x - 1); x++)
+			{
+				uint cellIdx = ((uint)z * GridSize.y + (uint)y) * GridSize.x + (uint)x;
+				uint end = CellStarts[cellIdx + 1];
+
+				for (uint i = CellStarts[cellIdx]; i < end; i++)
+				{
+					float3 diff = Points[i].Position - query;
+					float distance = dot(diff, diff);
+
+					if (distance < result.Distance)
+					{
+						result.Distance = distance;
+						result.Index = Points[i].Index;
+					}
+				}
+			}
+		}
+	}
+
+	Results[id.x] = result;
+}
+)";
+}
+
+GpuNeighbourGrid::~GpuNeighbourGrid()
+{
+	SafeRelease(PointView);
+	SafeRelease(PointBuffer);
+	SafeRelease(CellView);
+	SafeRelease(CellBuffer);
+}
+
+GpuNeighbourSearch& GpuNeighbourSearch::Instance()
+{
+	static GpuNeighbourSearch instance;
+	return instance;
+}
+
+GpuNeighbourSearch::~GpuNeighbourSearch()
+{
+	Release();
+}
+
+/// <summary>
+/// Enables the GPU search for the targets created from now on. The device is created the first time it is enabled.
+/// </summary>
+/// <returns>False if the search was requested but no GPU is available, in which case it stays disabled</returns>
+bool GpuNeighbourSearch::SetEnabled(bool isEnabled)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (isEnabled && !isInitialized && !isInitializationFailed)
+	{
+		isInitialized = Initialize();
+		isInitializationFailed = !isInitialized;
+
+		if (!isInitialized)
+			Release();
+	}
+
+	this->isEnabled = isEnabled && isInitialized;
+
+	return this->isEnabled || !isEnabled;
+}
+
+bool GpuNeighbourSearch::IsEnabled() const
+{
+	return isEnabled;
+}
+
+bool GpuNeighbourSearch::Initialize()
+{
+	D3D_FEATURE_LEVEL featureLevels[] = { D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0 };
+	HRESULT hr = D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL, 0, featureLevels, ARRAYSIZE(featureLevels),
+		D3D11_SDK_VERSION, &device, NULL, &context);
+
+	if (FAILED(hr))
+		return false;
+
+	ID3DBlob* byteCode = NULL;
+	ID3DBlob* errors = NULL;
+
+	hr = D3DCompile(NeighbourSearchShaderSource, strlen(NeighbourSearchShaderSource), "NeighbourSearchShader", NULL, NULL,
+		"main", "cs_5_0", D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, &byteCode, &errors);
+	SafeRelease(errors);
+
+	if (FAILED(hr))
+	{
+		SafeRelease(byteCode);
+		return false;
+	}
+
+	hr = device->CreateComputeShader(byteCode->GetBufferPointer(), byteCode->GetBufferSize(), NULL, &shader);
+	SafeRelease(byteCode);
+
+	if (FAILED(hr))
+		return false;
+
+	D3D11_BUFFER_DESC constantsDesc = {};
+	constantsDesc.ByteWidth = (sizeof(QueryConstants) + 15) & ~15;
+	constantsDesc.Usage = D3D11_USAGE_DYNAMIC;
+	constantsDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	constantsDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+	return SUCCEEDED(device->CreateBuffer(&constantsDesc, NULL, &constants));
+}
+
+/// <summary>
+/// Sorts the points of a target in a uniform grid, on the CPU, and uploads them
+/// </summary>
+/// <param name="points">Target points, three floats each</param>
+/// <returns>The grid, or null if the upload failed or the search is disabled</returns>
+std::unique_ptr<GpuNeighbourGrid> GpuNeighbourSearch::CreateGrid(const float* points, int numPoints)
+{
+	if (!isEnabled || numPoints <= 0)
+		return nullptr;
+
+	float minPoint[3], maxPoint[3];
+
+	for (int j = 0; j < 3; j++)
+	{
+		minPoint[j] = points[j];
+		maxPoint[j] = points[j];
+	}
+
+	for (int i = 1; i < numPoints; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			minPoint[j] = (std::min)(minPoint[j], points[3 * i + j]);
+			maxPoint[j] = (std::max)(maxPoint[j], points[3 * i + j]);
+		}
+	}
+
+	// Flat clouds keep some thickness, so that their cells are not sized after a null volume
+	float maxExtent = (std::max)((std::max)(maxPoint[0] - minPoint[0], maxPoint[1] - minPoint[1]), maxPoint[2] - minPoint[2]);
+	maxExtent = (std::max)(maxExtent, std::numeric_limits<float>::epsilon());
+	double volume = 1.0;
+
+	for (int j = 0; j < 3; j++)
+		volume *= (std::max)(maxPoint[j] - minPoint[j], 0.01f * maxExtent);
+
+	std::unique_ptr<GpuNeighbourGrid> grid(new GpuNeighbourGrid());
+	grid->CellSize = CellSizeScale * static_cast<float>(std::cbrt(volume / numPoints));
+	uint64_t numCells = 0;
+
+	while (true)
+	{
+		numCells = 1;
+
+		for (int j = 0; j < 3; j++)
+		{
+			grid->Min[j] = minPoint[j];
+			grid->Size[j] = static_cast<unsigned int>((maxPoint[j] - minPoint[j]) / grid->CellSize) + 1;
+			numCells *= grid->Size[j];
+		}
+
+		if (numCells <= MaxGridCells)
+			break;
+
+		grid->CellSize *= static_cast<float>(std::cbrt(static_cast<double>(numCells) / MaxGridCells)) * 1.01f;
+	}
+
+	// Counting sort of the points by cell
+	std::vector<UINT> cellStarts(static_cast<size_t>(numCells) + 1, 0);
+	std::vector<UINT> pointCells(numPoints);
+	float invCellSize = 1.0f / grid->CellSize;
+
+	for (int i = 0; i < numPoints; i++)
+	{
+		UINT cell[3];
+
+		for (int j = 0; j < 3; j++)
+			cell[j] = (std::min)(static_cast<UINT>((points[3 * i + j] - minPoint[j]) * invCellSize), grid->Size[j] - 1);
+
+		pointCells[i] = (cell[2] * grid->Size[1] + cell[1]) * grid->Size[0] + cell[0];
+		cellStarts[pointCells[i] + 1]++;
+	}
+
+	for (size_t c = 0; c < numCells; c++)
+		cellStarts[c + 1] += cellStarts[c];
+
+	std::vector<GridPoint> gridPoints(numPoints);
+	std::vector<UINT> cellEnds(cellStarts.begin(), cellStarts.end() - 1);
+
+	for (int i = 0; i < numPoints; i++)
+	{
+		GridPoint& gridPoint = gridPoints[cellEnds[pointCells[i]]++];
+		memcpy(gridPoint.position, points + 3 * i, sizeof(gridPoint.position));
+		gridPoint.index = static_cast<UINT>(i);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto CreateInput = [&](UINT stride, UINT count, const void* data, ID3D11Buffer** buffer, ID3D11ShaderResourceView** view) {
+		D3D11_BUFFER_DESC desc = {};
+		desc.ByteWidth = stride * count;
+		desc.Usage = D3D11_USAGE_IMMUTABLE;
+		desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+		desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+		desc.StructureByteStride = stride;
+
+		D3D11_SUBRESOURCE_DATA initData = {};
+		initData.pSysMem = data;
+
+		return SUCCEEDED(device->CreateBuffer(&desc, &initData, buffer)) && SUCCEEDED(device->CreateShaderResourceView(*buffer, NULL, view));
+	};
+
+	if (!CreateInput(sizeof(GridPoint), static_cast<UINT>(numPoints), gridPoints.data(), &grid->PointBuffer, &grid->PointView)
+		|| !CreateInput(sizeof(UINT), static_cast<UINT>(cellStarts.size()), cellStarts.data(), &grid->CellBuffer, &grid->CellView))
+	{
+		return nullptr;
+	}
+
+	return grid;
+}
+
+/// <summary>
+/// Finds the closest point of the grid for each query point. Only the points closer than a cell are certain to be
+/// found, so the queries whose closest point is farther are left for the caller to search.
+/// </summary>
+/// <param name="queryPoints">Query points, three floats each</param>
+/// <param name="distances">Output squared distances to the closest points</param>
+/// <param name="indices">Output indices of the closest points in the target, or -1 where the search is left to the caller</param>
+/// <returns>False if the GPU failed, in which case none of the queries were searched</returns>
+bool GpuNeighbourSearch::FindNearestNeighbours(const GpuNeighbourGrid& grid, const float* queryPoints, int numQueries,
+	std::vector<float>& distances, std::vector<int>& indices)
+{
+	distances.resize(numQueries);
+	indices.resize(numQueries);
+
+	if (numQueries == 0)
+		return true;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (!isInitialized || !ReserveQueries(numQueries))
+		return false;
+
+	D3D11_BOX queryBox = { 0, 0, 0, static_cast<UINT>(numQueries * 3 * sizeof(float)), 1, 1 };
+	context->UpdateSubresource(queryBuffer, 0, &queryBox, queryPoints, 0, 0);
+
+	QueryConstants queryConstants = {};
+
+	for (int j = 0; j < 3; j++)
+	{
+		queryConstants.gridMin[j] = grid.Min[j];
+		queryConstants.gridSize[j] = grid.Size[j];
+	}
+
+	queryConstants.gridMin[3] = 1.0f / grid.CellSize;
+	queryConstants.gridSize[3] = static_cast<UINT>(numQueries);
+
+	D3D11_MAPPED_SUBRESOURCE mapped;
+
+	if (FAILED(context->Map(constants, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+		return false;
+
+	memcpy(mapped.pData, &queryConstants, sizeof(QueryConstants));
+	context->Unmap(constants, 0);
+
+	// Bind resources and dispatch one thread per query point
+	ID3D11ShaderResourceView* views[] = { grid.PointView, grid.CellView, queryView };
+
+	context->CSSetShader(shader, NULL, 0);
+	context->CSSetConstantBuffers(0, 1, &constants);
+	context->CSSetShaderResources(0, ARRAYSIZE(views), views);
+	context->CSSetUnorderedAccessViews(0, 1, &resultView, NULL);
+	context->Dispatch((numQueries + ThreadGroupSize - 1) / ThreadGroupSize, 1, 1);
+
+	ID3D11ShaderResourceView* nullViews[ARRAYSIZE(views)] = { NULL };
+	ID3D11UnorderedAccessView* nullUav = NULL;
+	context->CSSetShaderResources(0, ARRAYSIZE(nullViews), nullViews);
+	context->CSSetUnorderedAccessViews(0, 1, &nullUav, NULL);
+
+	D3D11_BOX resultBox = { 0, 0, 0, static_cast<UINT>(numQueries * sizeof(QueryResult)), 1, 1 };
+	context->CopySubresourceRegion(resultStaging, 0, 0, 0, 0, resultBuffer, 0, &resultBox);
+
+	if (FAILED(context->Map(resultStaging, 0, D3D11_MAP_READ, 0, &mapped)))
+		return false;
+
+	const QueryResult* results = static_cast<const QueryResult*>(mapped.pData);
+	float maxExactDistance = grid.CellSize * grid.CellSize;
+
+	for (int i = 0; i < numQueries; i++)
+	{
+		bool isExact = results[i].index != 0xFFFFFFFF && results[i].distance <= maxExactDistance;
+
+		distances[i] = results[i].distance;
+		indices[i] = isExact ? static_cast<int>(results[i].index) : -1;
+	}
+
+	context->Unmap(resultStaging, 0);
+
+	return true;
+}
+
+/// <summary>
+/// Grows the query buffers to hold at least the given number of queries, doubling their size
+/// </summary>
+bool GpuNeighbourSearch::ReserveQueries(int numQueries)
+{
+	if (numQueries <= queryCapacity)
+		return true;
+
+	ReleaseQueryBuffers();
+
+	int capacity = 1024;
+
+	while (capacity < numQueries)
+		capacity *= 2;
+
+	D3D11_BUFFER_DESC queryDesc = {};
+	queryDesc.ByteWidth = capacity * 3 * sizeof(float);
+	queryDesc.Usage = D3D11_USAGE_DEFAULT;
+	queryDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	queryDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+	queryDesc.StructureByteStride = 3 * sizeof(float);
+
+	D3D11_BUFFER_DESC resultDesc = {};
+	resultDesc.ByteWidth = capacity * sizeof(QueryResult);
+	resultDesc.Usage = D3D11_USAGE_DEFAULT;
+	resultDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+	resultDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+	resultDesc.StructureByteStride = sizeof(QueryResult);
+
+	D3D11_BUFFER_DESC stagingDesc = {};
+	stagingDesc.ByteWidth = resultDesc.ByteWidth;
+	stagingDesc.Usage = D3D11_USAGE_STAGING;
+	stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+
+	bool res = SUCCEEDED(device->CreateBuffer(&queryDesc, NULL, &queryBuffer))
+		&& SUCCEEDED(device->CreateShaderResourceView(queryBuffer, NULL, &queryView))
+		&& SUCCEEDED(device->CreateBuffer(&resultDesc, NULL, &resultBuffer))
+		&& SUCCEEDED(device->CreateUnorderedAccessView(resultBuffer, NULL, &resultView))
+		&& SUCCEEDED(device->CreateBuffer(&stagingDesc, NULL, &resultStaging));
+
+	if (!res)
+	{
+		ReleaseQueryBuffers();
+		return false;
+	}
+
+	queryCapacity = capacity;
+	return true;
+}
+
+void GpuNeighbourSearch::ReleaseQueryBuffers()
+{
+	SafeRelease(queryView);
+	SafeRelease(queryBuffer);
+	SafeRelease(resultView);
+	SafeRelease(resultBuffer);
+	SafeRelease(resultStaging);
+	queryCapacity = 0;
+}
+
+void GpuNeighbourSearch::Release()
+{
+	ReleaseQueryBuffers();
+	SafeRelease(constants);
+	SafeRelease(shader);
+	SafeRelease(context);
+	SafeRelease(device);
+	isInitialized = false;
+}
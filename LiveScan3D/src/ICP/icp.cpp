@@ -7,7 +7,26 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module applies the Iterative Closest Point algorithm to align two sets
-of 3D points.
+of 3D points. The KD-tree of the target points is built once per alignment,
+or once for several alignments to the same target through a target handle.
+The points are aligned either point to point, with an SVD rotation update, or
+point to plane, with a linearized least-squares update of the rotation and
+translation along the normals of the target, which are estimated once; the
+point to plane alignment converges in far fewer iterations on planar scenes.
+The multi-resolution alignment runs coarse to fine on voxel grids of the
+clouds, and stops each level once it has converged. The poses of all the
+cameras can be refined in one call, each camera aligned to the others in
+parallel against targets shared by all the alignments. They can also be
+refined from the depth frames of the cameras, matching the points of each
+camera by projecting them into the depth frames of the others instead of
+searching a KD-tree, and solving for all the poses at once.
+The nearest neighbours of large clouds can be searched on the GPU instead
+of the KD-trees, when one is available, or in voxel hash grids on the CPU,
+which are built in linear time over the small volume of the Holoport. The
+joint refinement can align a
+few thousand points of each camera instead of all of them, sampled in the
+overlap with the other cameras and spread over the directions of their
+normals, as the points of the large flat regions barely constrain the pose.
 
 This code was adapted from the following research:
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
@@ -17,6 +36,321 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 \***************************************************************************/
 
 #include "icp.h"
+#include "traceZones.h"
+#include <atomic>
+
+// Neighbours the normal of a target point is fitted to, for point to plane alignments, and the largest distance of the
+// point to their centroid, relative to their spread along the surface, for the point not to be on the border of the cloud
+static const int NumNormalNeighbours = 12;
+static const double MaxNormalCentroidOffset = 0.5;
+
+// Point to plane alignments stop once an update moves the points by less than this
+static const ICPStopCriteria PointToPlaneStopCriteria = { 1e-6, 1e-6, 0.0f };
+
+// Point to plane alignments reject the matches farther apart than a multiple of their median distance, or than an
+// absolute distance, and those whose normals differ by more than about 35 degrees: the points outside of the overlap
+// would otherwise slide along the planes of the target. The plane distances beyond a multiple of their median are
+// weighted down (Huber), and the normal equations are damped so that the directions the matches barely constrain
+// move little.
+static const float PointToPlaneMedianDistanceScale = 3.0f;
+static const float PointToPlaneMaxDistance = 0.1f; // In the units of the points, meters for the clients
+static const float PointToPlaneMinNormalCosine = 0.8f;
+static const double PointToPlaneHuberScale = 1.345 * 1.4826; // Of the median plane distance, as the Huber threshold
+static const double PointToPlaneDamping = 1e-3; // Of the diagonal of the normal equations
+
+// Multi-resolution alignments stop each level once an update moves the points by less than a fraction of the voxel
+// size of the level, or the error changes by less than a fraction of itself
+static const double LevelMinRotationUpdate = 1e-4; // In radians
+static const double LevelTranslationTolerance = 0.01; // Fraction of the voxel size
+static const float LevelMinErrorChange = 1e-3f;
+
+// Projective alignments reject the normals of the pixels across depth discontinuities, and the matches whose normals
+// differ by more than about 35 degrees
+static const float ProjectiveMaxDepthJump = 0.05f; // In meters
+static const float ProjectiveMinNormalCosine = 0.8f;
+
+// The GPU only pays off for the large clouds; the smaller targets and queries, like the coarse levels of the
+// multi-resolution alignments, are searched on the CPU
+static const int GpuMinNumTargetPoints = 20000;
+static const int GpuMinNumQueryPoints = 20000;
+
+// The voxels of the hash grids are a few times the spacing of the target points, estimated from a sample of them, so
+// that a voxel holds about ten points of a surface; the queries which the rings of voxels around their own cannot
+// answer, far from the target, are left to the KD-trees
+static const float HashCellSpacingScale = 3.0f;
+static const int NumSpacingSamples = 64;
+static const int MaxHashRings = 2;
+
+// Whether the targets created from now on get a voxel hash grid, set by SetNeighbourSearchBackend
+static std::atomic<bool> isHashSearchEnabled{ false };
+
+// Normal-space sampling: the normals are bucketed on a grid of NumNormalSampleCells cells per axis, the normals of
+// SampleCandidateRatio candidates per sample are estimated, and the candidates are in the overlap when one of the other
+// clouds has a point within SampleOverlapVoxels voxels of the level
+static const int NumNormalSampleCells = 6;
+static const int SampleCandidateRatio = 8;
+static const float SampleOverlapVoxels = 2.0f;
+
+/// <summary>
+/// Copies the target points and builds their KD-tree
+/// </summary>
+/// <param name="isNormalEstimationRequested">Also estimates the normals of the points, for point to plane alignments</param>
+ICPTarget::ICPTarget(const Point3f* verts, int numVerts, bool isNormalEstimationRequested) :
+	Cloud{ vector<Point3f>(verts, verts + numVerts) },
+	KDTree(3, Cloud)
+{
+	KDTree.buildIndex();
+
+	if (isNormalEstimationRequested)
+		EstimateNormals();
+
+	// The KD-tree is still used for the queries the grids cannot answer
+	if (numVerts >= GpuMinNumTargetPoints)
+		GpuGrid = GpuNeighbourSearch::Instance().CreateGrid(&Cloud.Points[0].X, numVerts);
+
+	if (isHashSearchEnabled && numVerts > 0)
+		HashGrid.Build(&Cloud.Points[0].X, &Cloud.Points[0].Y, &Cloud.Points[0].Z, 3, numVerts, HashCellSpacingScale * EstimatePointSpacing());
+}
+
+/// <summary>
+/// Estimates the spacing of the target points as the median distance of a sample of them to their nearest neighbour
+/// </summary>
+/// <returns>The spacing; 0 if the points are all duplicates of their neighbours</returns>
+float ICPTarget::EstimatePointSpacing() const
+{
+	int numPoints = static_cast<int>(Cloud.Points.size());
+	int numSamples = (std::min)(numPoints, NumSpacingSamples);
+	vector<float> spacings;
+	spacings.reserve(numSamples);
+
+	for (int i = 0; i < numSamples; i++)
+	{
+		// The nearest point of the sample is itself
+		const Point3f& point = Cloud.Points[static_cast<size_t>(i) * numPoints / numSamples];
+		size_t neighbourIndices[2];
+		float neighbourDistances[2];
+
+		nanoflann::KNNResultSet<float> resultSet(2);
+		resultSet.init(neighbourIndices, neighbourDistances);
+		KDTree.findNeighbors(resultSet, &point.X, nanoflann::SearchParams());
+
+		if (resultSet.size() == 2)
+			spacings.push_back(std::sqrt(neighbourDistances[1]));
+	}
+
+	if (spacings.empty())
+		return 0.0f;
+
+	std::nth_element(spacings.begin(), spacings.begin() + spacings.size() / 2, spacings.end());
+	return spacings[spacings.size() / 2];
+}
+
+/// <summary>
+/// Estimates the normal of each target point as the direction of least variance of its nearest neighbours. Points
+/// without enough neighbours get a null normal, so that they do not constrain point to plane alignments.
+/// </summary>
+void ICPTarget::EstimateNormals()
+{
+	int numPoints = static_cast<int>(Cloud.Points.size());
+	Normals.resize(numPoints);
+
+#pragma omp parallel for
+	for (int i = 0; i < numPoints; i++)
+		Normals[i] = EstimateNormal(Cloud.Points[i]);
+}
+
+/// <summary>
+/// Estimates the normal of the target at a point as the direction of least variance of the nearest target points
+/// </summary>
+/// <returns>The unit normal, or a null normal if the point has too few neighbours</returns>
+Point3f ICPTarget::EstimateNormal(const Point3f& point) const
+{
+	return ::EstimateNormal(Cloud, KDTree, point);
+}
+
+/// <summary>
+/// Estimates the normals of the source points of a point to plane alignment, from a KD-tree of their own
+/// </summary>
+vector<Point3f> EstimateNormals(const Point3f* verts, int numVerts)
+{
+	PointCloud cloud{ vector<Point3f>(verts, verts + numVerts) };
+	PointCloudKDTree tree(3, cloud);
+	tree.buildIndex();
+
+	vector<Point3f> normals(numVerts);
+
+#pragma omp parallel for
+	for (int i = 0; i < numVerts; i++)
+		normals[i] = EstimateNormal(cloud, tree, cloud.Points[i]);
+
+	return normals;
+}
+
+/// <summary>
+/// Estimates the normal of a cloud at a point as the direction of least variance of its nearest points
+/// </summary>
+/// <returns>The unit normal, or a null normal if the point has too few neighbours</returns>
+Point3f EstimateNormal(const PointCloud& cloud, const PointCloudKDTree& tree, const Point3f& point)
+{
+	size_t neighbourIndices[NumNormalNeighbours];
+	float neighbourDistances[NumNormalNeighbours];
+
+	nanoflann::KNNResultSet<float> resultSet(NumNormalNeighbours);
+	resultSet.init(neighbourIndices, neighbourDistances);
+	tree.findNeighbors(resultSet, &point.X, nanoflann::SearchParams());
+
+	int numNeighbours = static_cast<int>(resultSet.size());
+
+	if (numNeighbours < 3)
+		return Point3f{ 0.0f, 0.0f, 0.0f };
+
+	// Covariance of the neighbours around their centroid
+	double centroid[3] = { 0.0, 0.0, 0.0 };
+
+	for (int j = 0; j < numNeighbours; j++)
+	{
+		const Point3f& neighbour = cloud.Points[neighbourIndices[j]];
+		centroid[0] += neighbour.X;
+		centroid[1] += neighbour.Y;
+		centroid[2] += neighbour.Z;
+	}
+
+	for (int k = 0; k < 3; k++)
+		centroid[k] /= numNeighbours;
+
+	cv::Matx33d covariance = cv::Matx33d::zeros();
+
+	for (int j = 0; j < numNeighbours; j++)
+	{
+		const Point3f& neighbour = cloud.Points[neighbourIndices[j]];
+		cv::Vec3d d(neighbour.X - centroid[0], neighbour.Y - centroid[1], neighbour.Z - centroid[2]);
+		covariance += d * d.t();
+	}
+
+	// The eigenvalues are sorted in descending order, so the last eigenvector is the normal
+	cv::Mat eigenValues, eigenVectors;
+
+	if (!cv::eigen(cv::Mat(covariance), eigenValues, eigenVectors))
+		return Point3f{ 0.0f, 0.0f, 0.0f };
+
+	// The neighbours of a point on the border of the cloud lie on one side of it, far from their centroid compared with
+	// their spread along the surface; matches to the border have no plane to slide on
+	double offset[3] = { point.X - centroid[0], point.Y - centroid[1], point.Z - centroid[2] };
+	double spread = std::sqrt(eigenValues.at<double>(0) / numNeighbours);
+
+	if (offset[0] * offset[0] + offset[1] * offset[1] + offset[2] * offset[2] > MaxNormalCentroidOffset * MaxNormalCentroidOffset * spread * spread)
+		return Point3f{ 0.0f, 0.0f, 0.0f };
+
+	return Point3f{ static_cast<float>(eigenVectors.at<double>(2, 0)), static_cast<float>(eigenVectors.at<double>(2, 1)),
+		static_cast<float>(eigenVectors.at<double>(2, 2)) };
+}
+
+/// <summary>
+/// Unprojects a depth frame to world space and estimates the normal of each pixel from its right and bottom neighbours
+/// </summary>
+/// <param name="depth">Depth frame, in millimeters; zero for invalid pixels</param>
+/// <param name="intrinsics">Depth camera fx, fy, cx, cy</param>
+/// <param name="depthToWorld">Depth camera to world space transform, 3x4 row-major; it must be rigid</param>
+ProjectiveView::ProjectiveView(const unsigned short* depth, int width, int height, const float* intrinsics, const float* depthToWorld) :
+	Width(width), Height(height), Fx(intrinsics[0]), Fy(intrinsics[1]), Cx(intrinsics[2]), Cy(intrinsics[3])
+{
+	memcpy(DepthToWorld, depthToWorld, 12 * sizeof(float));
+
+	// The inverse of a rigid transform [R | T] is [R^T | -R^T * T]
+	for (int i = 0; i < 3; i++)
+	{
+		WorldToDepth[i * 4 + 3] = 0.0f;
+
+		for (int j = 0; j < 3; j++)
+		{
+			WorldToDepth[i * 4 + j] = DepthToWorld[j * 4 + i];
+			WorldToDepth[i * 4 + 3] -= DepthToWorld[j * 4 + i] * DepthToWorld[j * 4 + 3];
+		}
+	}
+
+	int numPixels = width * height;
+	Points.resize(numPixels);
+	Normals.assign(numPixels, Point3f{ 0.0f, 0.0f, 0.0f });
+	IsValid.assign(numPixels, 0);
+
+	const float* m = DepthToWorld;
+
+#pragma omp parallel for
+	for (int v = 0; v < height; v++)
+	{
+		for (int u = 0; u < width; u++)
+		{
+			int idx = v * width + u;
+			float z = depth[idx] / 1000.0f;
+			float x = (u - Cx) / Fx * z;
+			float y = (v - Cy) / Fy * z;
+
+			Points[idx].X = m[0] * x + m[1] * y + m[2] * z + m[3];
+			Points[idx].Y = m[4] * x + m[5] * y + m[6] * z + m[7];
+			Points[idx].Z = m[8] * x + m[9] * y + m[10] * z + m[11];
+		}
+	}
+
+#pragma omp parallel for
+	for (int v = 0; v < height - 1; v++)
+	{
+		for (int u = 0; u < width - 1; u++)
+		{
+			int idx = v * width + u;
+			int right = idx + 1;
+			int bottom = idx + width;
+
+			if (depth[idx] == 0 || depth[right] == 0 || depth[bottom] == 0)
+				continue;
+
+			if (std::abs(depth[right] - depth[idx]) > ProjectiveMaxDepthJump * 1000.0f
+				|| std::abs(depth[bottom] - depth[idx]) > ProjectiveMaxDepthJump * 1000.0f)
+				continue;
+
+			const Point3f& p = Points[idx];
+			Point3f du = { Points[right].X - p.X, Points[right].Y - p.Y, Points[right].Z - p.Z };
+			Point3f dv = { Points[bottom].X - p.X, Points[bottom].Y - p.Y, Points[bottom].Z - p.Z };
+			Point3f n = { du.Y * dv.Z - du.Z * dv.Y, du.Z * dv.X - du.X * dv.Z, du.X * dv.Y - du.Y * dv.X };
+			float length = std::sqrt(n.X * n.X + n.Y * n.Y + n.Z * n.Z);
+
+			if (length == 0.0f)
+				continue;
+
+			// The normal faces the camera, whose center is the translation of the depth to world transform
+			float toCamera = (m[3] - p.X) * n.X + (m[7] - p.Y) * n.Y + (m[11] - p.Z) * n.Z;
+
+			if (toCamera < 0.0f)
+				length = -length;
+
+			Normals[idx] = Point3f{ n.X / length, n.Y / length, n.Z / length };
+			IsValid[idx] = 1;
+		}
+	}
+}
+
+/// <summary>
+/// Finds the pixel a world space point projects to
+/// </summary>
+/// <returns>False if the point projects outside of the frame or to a pixel which is not valid</returns>
+bool ProjectiveView::Project(const Point3f& point, int& pixelIndex) const
+{
+	const float* m = WorldToDepth;
+	float x = m[0] * point.X + m[1] * point.Y + m[2] * point.Z + m[3];
+	float y = m[4] * point.X + m[5] * point.Y + m[6] * point.Z + m[7];
+	float z = m[8] * point.X + m[9] * point.Y + m[10] * point.Z + m[11];
+
+	if (z <= 0.0f)
+		return false;
+
+	int u = static_cast<int>(std::floor(Fx * x / z + Cx + 0.5f));
+	int v = static_cast<int>(std::floor(Fy * y / z + Cy + 0.5f));
+
+	if (u < 0 || u >= Width || v < 0 || v >= Height)
+		return false;
+
+	pixelIndex = v * Width + u;
+	return IsValid[pixelIndex] != 0;
+}
 
 /// <summary>
 /// Performs Iterative Closest Point (ICP) alignment to compute a rigid transformation 
@@ -32,181 +366,1343 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 /// <returns>Final alignment error</returns>
 ICP_API float __stdcall ICP(Point3f* targetVerts, Point3f* sourceVerts, int numTargetVerts, int numSourceVerts, float* R, float* t, int maxIter)
 {
-	// Convert targetVerts into a point cloud structure for KD-tree
-	PointCloud targetCloud;
-	targetCloud.Points = vector<Point3f>(targetVerts, targetVerts + numTargetVerts);
+	TRACE_ZONE("ICP");
+	ICPTarget target(targetVerts, numTargetVerts);
+	int numIterations;
 
-	// Wrap output rotation and translation as cv::Mat
-	cv::Mat matR(3, 3, CV_32F, R);
-	cv::Mat matT(1, 3, CV_32F, t);
+	return AlignToTargets({ &target }, sourceVerts, numSourceVerts, R, t, maxIter, ICPStopCriteria(), numIterations);
+}
 
-	// Convert sourceVerts into a CV matrix for matrix operations
-	cv::Mat sourceVertsMat(numSourceVerts, 3, CV_32F, (float*)sourceVerts);
+/// <summary>
+/// Performs point to plane ICP alignment, with the same parameters and results as ICP. Each iteration solves for the
+/// rotation and translation which minimize the distances of the source points to the tangent planes of their matches,
+/// and the iterations stop early once the alignment no longer moves.
+/// </summary>
+ICP_API float __stdcall ICPPointToPlane(Point3f* targetVerts, Point3f* sourceVerts, int numTargetVerts, int numSourceVerts, float* R, float* t, int maxIter)
+{
+	TRACE_ZONE("ICPPointToPlane");
+	ICPTarget target(targetVerts, numTargetVerts, true);
+	vector<Point3f> sourceNormals = EstimateNormals(sourceVerts, numSourceVerts);
+	int numIterations;
+
+	return AlignToTargetsPointToPlane({ &target }, sourceVerts, numSourceVerts, sourceNormals.data(), R, t, maxIter, PointToPlaneStopCriteria,
+		numIterations);
+}
+
+/// <summary>
+/// Performs ICP alignment coarse to fine: the clouds are downsampled to voxel grids, from the coarsest one of the
+/// given voxel size to a grid of half its voxel size per level, and the last level aligns the full clouds. Each level
+/// starts from the alignment of the previous one, and stops when the alignment no longer moves or its error no longer
+/// changes, so most of the iterations run on few points.
+/// </summary>
+/// <param name="targetVerts">Target point cloud (fixed)</param>
+/// <param name="sourceVerts">Source point cloud (will be transformed in place)</param>
+/// <param name="numTargetVerts">Number of points in targetVerts</param>
+/// <param name="numSourceVerts">Number of points in sourceVerts</param>
+/// <param name="R">Output 3x3 rotation matrix (row-major)</param>
+/// <param name="t">Output 3D translation vector</param>
+/// <param name="maxIterPerLevel">Maximum number of ICP iterations of each level</param>
+/// <param name="numLevels">Number of levels, including the full resolution one</param>
+/// <param name="coarsestVoxelSize">Voxel size of the coarsest level, in the units of the points</param>
+/// <param name="isPointToPlane">Aligns each level point to plane instead of point to point</param>
+/// <param name="numIterationsPerLevel">Output number of iterations run by each level, coarsest first; may be null</param>
+/// <returns>Final alignment error, at full resolution</returns>
+ICP_API float __stdcall ICPMultiResolution(Point3f* targetVerts, Point3f* sourceVerts, int numTargetVerts, int numSourceVerts, float* R, float* t,
+	int maxIterPerLevel, int numLevels, float coarsestVoxelSize, bool isPointToPlane, int* numIterationsPerLevel)
+{
+	TRACE_ZONE("ICPMultiResolution");
+	numLevels = (std::max)(1, numLevels);
 
 	float error = 1.0f;
+	float voxelSize = coarsestVoxelSize;
 
-	for (int iter = 0; iter < maxIter; iter++)
+	for (int level = 0; level < numLevels; level++)
 	{
-		vector<Point3f> matchedTargetVerts;
-		vector<Point3f> matchedSourceVerts;
+		bool isFullResolution = level == numLevels - 1;
 
-		vector<float> distances(numSourceVerts);
-		vector<size_t> indices(numSourceVerts);
+		// The full resolution level stops at the tolerance the next coarser level would have
+		ICPStopCriteria stopCriteria = { LevelMinRotationUpdate, LevelTranslationTolerance * voxelSize, LevelMinErrorChange };
 
-		// Find nearest neighbors from sourceVerts to targetVerts
-		FindNearestNeighbours(targetCloud, sourceVertsMat, distances, indices);
+		// Each level aligns the points moved by the previous levels, and its transform is then composed with theirs
+		float levelR[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+		float levelT[3] = { 0.0f, 0.0f, 0.0f };
+		int numIterations = 0;
 
-		// For each source point, keep only the best match
-		vector<float> matchDistances;
-		vector<int> matchMap(numTargetVerts, -1); // Maps targetVerts index to matched index
+		vector<Point3f> levelTarget;
+		vector<Point3f> levelSource;
 
-		for (int i = 0; i < numSourceVerts; ++i)
+		if (!isFullResolution)
 		{
-			int targetIdx = indices[i];
-			float currentDistance = distances[i];
-
-			int existingMatchPos = matchMap[targetIdx];
+			levelTarget = VoxelDownsample(targetVerts, numTargetVerts, voxelSize);
+			levelSource = VoxelDownsample(sourceVerts, numSourceVerts, voxelSize);
+		}
 
-			if (existingMatchPos != -1 && matchDistances[existingMatchPos] < currentDistance)
-				continue;
+		// The full resolution level aligns the clouds themselves, and moves the source points in place
+		const Point3f* levelTargetVerts = isFullResolution ? targetVerts : levelTarget.data();
+		int numLevelTargetVerts = isFullResolution ? numTargetVerts : static_cast<int>(levelTarget.size());
+		Point3f* levelSourceVerts = isFullResolution ? sourceVerts : levelSource.data();
+		int numLevelSourceVerts = isFullResolution ? numSourceVerts : static_cast<int>(levelSource.size());
 
-			// Get matched point from sourceVerts
-			Point3f queryPoint;
-			queryPoint.X = sourceVertsMat.at<float>(i, 0);
-			queryPoint.Y = sourceVertsMat.at<float>(i, 1);
-			queryPoint.Z = sourceVertsMat.at<float>(i, 2);
+		if (numLevelSourceVerts > 0 && numLevelTargetVerts > 0)
+		{
+			ICPTarget target(levelTargetVerts, numLevelTargetVerts, isPointToPlane);
 
-			if (existingMatchPos == -1)
+			if (isPointToPlane)
 			{
-				matchedTargetVerts.push_back(targetVerts[targetIdx]);
-				matchedSourceVerts.push_back(queryPoint);
-				matchDistances.push_back(currentDistance);
-				matchMap[targetIdx] = matchedSourceVerts.size() - 1;
+				vector<Point3f> levelSourceNormals = EstimateNormals(levelSourceVerts, numLevelSourceVerts);
+				error = AlignToTargetsPointToPlane({ &target }, levelSourceVerts, numLevelSourceVerts, levelSourceNormals.data(), levelR, levelT,
+					maxIterPerLevel, stopCriteria, numIterations);
 			}
 			else
-			{
-				matchedSourceVerts[existingMatchPos] = queryPoint;
-				matchDistances[existingMatchPos] = currentDistance;
-			}
+				error = AlignToTargets({ &target }, levelSourceVerts, numLevelSourceVerts, levelR, levelT, maxIterPerLevel, stopCriteria, numIterations);
 		}
 
-		// Remove outliers based on distance threshold
-		RejectOutlierMatches(matchedTargetVerts, matchedSourceVerts, matchDistances, 2.5f);
+		if (numIterationsPerLevel)
+			numIterationsPerLevel[level] = numIterations;
 
-		// Estimate translation (centroid difference)
-		cv::Mat matchedTargetMat(matchedTargetVerts.size(), 3, CV_32F, matchedTargetVerts.data());
-		cv::Mat matchedSourceMat(matchedSourceVerts.size(), 3, CV_32F, matchedSourceVerts.data());
+		if (!isFullResolution)
+			TransformPoints(sourceVerts, numSourceVerts, levelR, levelT);
 
-		cv::Mat centroidShift;
-		cv::reduce(matchedTargetMat - matchedSourceMat, centroidShift, 0, CV_REDUCE_AVG);
+		ComposeTransform(R, t, levelR, levelT);
+		voxelSize /= 2.0f;
+	}
 
-		// Apply translation shift to sourceVerts and matchedSourceVerts
-		for (int i = 0; i < sourceVertsMat.rows; ++i)
-		{
-			sourceVertsMat.row(i) += centroidShift;
-		}
+	return error;
+}
 
-		for (int i = 0; i < matchedSourceMat.rows; ++i)
-		{
-			matchedSourceMat.row(i) += centroidShift;
-		}
+/// <summary>
+/// Refines the poses of all the cameras in one call, coarse to fine like ICPMultiResolution. Each round builds the
+/// targets of the cameras once per level, from their points at the start of the level, and aligns every camera to the
+/// union of the targets of the others, all the cameras in parallel; so the cameras are aligned to each other jointly
+/// rather than one after the other. The first camera is the reference and is not moved: two cameras aligned to each
+/// other at the same time would otherwise swap their misalignment instead of removing it.
+/// </summary>
+/// <param name="verts">Points of all the cameras, one camera after the other (transformed in place)</param>
+/// <param name="numVertsPerCamera">Number of points of each camera</param>
+/// <param name="numCameras">Number of cameras</param>
+/// <param name="Rs">Rotation of each camera, 9 floats per camera (row-major), composed with the refinement</param>
+/// <param name="ts">Translation of each camera, 3 floats per camera, composed with the refinement</param>
+/// <param name="numRefineIter">Number of rounds of alignment of all the cameras</param>
+/// <param name="maxIterPerLevel">Maximum number of ICP iterations of each level</param>
+/// <param name="numLevels">Number of levels, including the full resolution one</param>
+/// <param name="coarsestVoxelSize">Voxel size of the coarsest level, in the units of the points</param>
+/// <param name="isPointToPlane">Aligns each level point to plane instead of point to point</param>
+/// <param name="maxSamplesPerCamera">Aligns at most this many points of each camera at each level, sampled by
+/// SampleOverlapByNormals; 0 aligns all the points</param>
+/// <param name="numIterationsPerLevel">Output number of iterations run by each level over all the cameras and rounds,
+/// coarsest first; may be null</param>
+/// <returns>Mean alignment error of the cameras at the end of the last round</returns>
+ICP_API float __stdcall RefineAllPoses(Point3f* verts, int* numVertsPerCamera, int numCameras, float* Rs, float* ts, int numRefineIter,
+	int maxIterPerLevel, int numLevels, float coarsestVoxelSize, bool isPointToPlane, int maxSamplesPerCamera, int* numIterationsPerLevel)
+{
+	TRACE_ZONE("RefineAllPoses");
+	numLevels = (std::max)(1, numLevels);
 
-		// Estimate optimal rotation using SVD
-		cv::Mat crossCov = matchedSourceMat.t() * matchedTargetMat;
-		cv::SVD svd;
-		svd(crossCov);
+	vector<Point3f*> cameraVerts(numCameras);
+	Point3f* nextVerts = verts;
 
-		cv::Mat rotationUpdate = svd.u * svd.vt;
-		
-		// Ensure a proper rotation (handle reflection case)
-		if (cv::determinant(rotationUpdate) < 0)
+	for (int c = 0; c < numCameras; c++)
+	{
+		cameraVerts[c] = nextVerts;
+		nextVerts += numVertsPerCamera[c];
+	}
+
+	if (numIterationsPerLevel)
+		std::fill(numIterationsPerLevel, numIterationsPerLevel + numLevels, 0);
+
+	// The normals of the sampled candidates are estimated from the targets of the cameras, which hold their points
+	bool isSampled = maxSamplesPerCamera > 0;
+
+	vector<float> errors(numCameras, 0.0f);
+	vector<int> numCameraIterations(numCameras);
+
+	for (int refineIter = 0; refineIter < numRefineIter; refineIter++)
+	{
+		float voxelSize = coarsestVoxelSize;
+
+		for (int level = 0; level < numLevels; level++)
 		{
-			cv::Mat reflexionFix = cv::Mat::eye(3, 3, CV_32F);
-			reflexionFix.at<float>(2, 2) = -1.0f;
-			rotationUpdate = svd.u * reflexionFix * svd.vt;
-		}
+			bool isFullResolution = level == numLevels - 1;
+			ICPStopCriteria stopCriteria = { LevelMinRotationUpdate, LevelTranslationTolerance * voxelSize, LevelMinErrorChange };
 
-		// Apply rotation update
-		sourceVertsMat = sourceVertsMat * rotationUpdate;
+			// The targets hold copies of the points, so every camera is aligned to the others as they were at the start
+			// of the level while they move; the downsampled points are also the sources of the coarse levels
+			vector<vector<Point3f>> levelVerts(numCameras);
+			vector<unique_ptr<ICPTarget>> targets(numCameras);
 
-		matT += centroidShift * matR.t();
-		matR = matR * rotationUpdate;
+#pragma omp parallel for
+			for (int c = 0; c < numCameras; c++)
+			{
+				if (!isFullResolution)
+					levelVerts[c] = VoxelDownsample(cameraVerts[c], numVertsPerCamera[c], voxelSize);
 
-		// Optionally compute and print alignment error
-		
-		error = 0.0f;
-		for (float d : matchDistances)
-			error += std::sqrt(d);
-		error /= matchDistances.size();
+				const Point3f* levelTargetVerts = isFullResolution ? cameraVerts[c] : levelVerts[c].data();
+				int numLevelTargetVerts = isFullResolution ? numVertsPerCamera[c] : static_cast<int>(levelVerts[c].size());
+
+				if (numLevelTargetVerts > 0)
+					targets[c].reset(new ICPTarget(levelTargetVerts, numLevelTargetVerts, isPointToPlane));
+			}
+
+#pragma omp parallel for
+			for (int c = 1; c < numCameras; c++)
+			{
+				ICPTargets otherTargets;
+
+				for (int other = 0; other < numCameras; other++)
+				{
+					if (other != c && targets[other])
+						otherTargets.push_back(targets[other].get());
+				}
+
+				Point3f* levelSourceVerts = isFullResolution ? cameraVerts[c] : levelVerts[c].data();
+				int numLevelSourceVerts = isFullResolution ? numVertsPerCamera[c] : static_cast<int>(levelVerts[c].size());
+
+				numCameraIterations[c] = 0;
+
+				// The samples are copies, so the points of the camera are moved after the alignment of a sampled level
+				vector<Point3f> samples;
+				bool isLevelSampled = isSampled && numLevelSourceVerts > maxSamplesPerCamera && targets[c] && !otherTargets.empty();
+
+				if (isLevelSampled)
+				{
+					samples = SampleOverlapByNormals(*targets[c], otherTargets, maxSamplesPerCamera, SampleOverlapVoxels * voxelSize,
+						static_cast<unsigned int>(c));
+					levelSourceVerts = samples.data();
+					numLevelSourceVerts = static_cast<int>(samples.size());
+				}
+
+				if (otherTargets.empty() || numLevelSourceVerts == 0)
+					continue;
+
+				float levelR[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+				float levelT[3] = { 0.0f, 0.0f, 0.0f };
+
+				if (isPointToPlane)
+				{
+					// The target of the camera holds the points of the level and their normals; those of the samples are
+					// estimated from it
+					vector<Point3f> sampleNormals;
+
+					if (isLevelSampled)
+					{
+						sampleNormals.resize(samples.size());
+
+						for (size_t i = 0; i < samples.size(); i++)
+							sampleNormals[i] = targets[c]->EstimateNormal(samples[i]);
+					}
+
+					const Point3f* levelSourceNormals = isLevelSampled ? sampleNormals.data() : targets[c] ? targets[c]->Normals.data() : nullptr;
+					errors[c] = AlignToTargetsPointToPlane(otherTargets, levelSourceVerts, numLevelSourceVerts, levelSourceNormals, levelR, levelT,
+						maxIterPerLevel, stopCriteria, numCameraIterations[c]);
+				}
+				else
+					errors[c] = AlignToTargets(otherTargets, levelSourceVerts, numLevelSourceVerts, levelR, levelT, maxIterPerLevel, stopCriteria, numCameraIterations[c]);
+
+				if (!isFullResolution || isLevelSampled)
+					TransformPoints(cameraVerts[c], numVertsPerCamera[c], levelR, levelT);
+
+				ComposeTransform(Rs + 9 * c, ts + 3 * c, levelR, levelT);
+			}
+
+			if (numIterationsPerLevel)
+			{
+				for (int c = 0; c < numCameras; c++)
+					numIterationsPerLevel[level] += numCameraIterations[c];
+			}
+
+			voxelSize /= 2.0f;
+		}
 	}
 
-	// Copy the transformed sourceVerts data back to original buffer
-	memcpy(sourceVerts, sourceVertsMat.data, sourceVertsMat.rows * sizeof(float) * 3);
+	float error = 0.0f;
 
-	// Copy the final transformation results
-	memcpy(R, matR.data, 9 * sizeof(float));
-	memcpy(t, matT.data, 3 * sizeof(float));;
+	for (float cameraError : errors)
+		error += cameraError;
 
-	return error;
+	return numCameras > 1 ? error / (numCameras - 1) : 0.0f;
 }
 
 /// <summary>
-/// Finds the closest point in the source point cloud for each point in the destination set.
+/// Refines the poses of all the cameras at once from their depth frames, point to plane. The sampled pixels of each
+/// camera are matched to the pixels they project to in the depth frames of the other cameras, in constant time per
+/// point, and each iteration solves the poses of all the cameras together from all the matches; the first camera is
+/// the reference and is not moved. The matching runs on all the pairs of cameras in parallel.
 /// </summary>
-/// <param name="sourceCloud">Original point cloud to compare with the query points</param>
-/// <param name="queryPoints">Query points to compare with the point cloud</param>
-/// <param name="distances">Output squared distances to the nearest neighbours for each query point</param>
-/// <param name="indices">Output indices of the closest points in sourceCloud for each query point</param>
-void FindNearestNeighbours(PointCloud &sourceCloud, cv::Mat &queryPoints, vector<float> &distances, vector<size_t> &indices)
+/// <param name="depths">Depth frames of all the cameras, one after the other, in millimeters; zero for invalid pixels</param>
+/// <param name="widths">Width of the depth frame of each camera</param>
+/// <param name="heights">Height of the depth frame of each camera</param>
+/// <param name="intrinsics">Depth camera fx, fy, cx, cy of each camera, 4 floats per camera</param>
+/// <param name="depthToWorld">Depth camera (meters) to world space transform of each camera, 12 floats per camera (3x4
+/// row-major)</param>
+/// <param name="numCameras">Number of cameras</param>
+/// <param name="Rs">Rotation of each camera, 9 floats per camera (row-major), composed with the refinement</param>
+/// <param name="ts">Translation of each camera, 3 floats per camera, composed with the refinement</param>
+/// <param name="maxIter">Maximum number of iterations</param>
+/// <param name="sampleStep">Matches one pixel of each camera out of sampleStep in both directions</param>
+/// <param name="maxDistance">Matches farther apart than this are rejected, in meters</param>
+/// <param name="numIterations">Output number of iterations run; may be null</param>
+/// <returns>Mean point to plane distance of the matches of the last iteration, in meters</returns>
+ICP_API float __stdcall RefineAllPosesProjective(unsigned short* depths, int* widths, int* heights, float* intrinsics, float* depthToWorld,
+	int numCameras, float* Rs, float* ts, int maxIter, int sampleStep, float maxDistance, int* numIterations)
 {
-	int numQueryPoints = queryPoints.rows;
+	TRACE_ZONE("RefineAllPosesProjective");
+	sampleStep = (std::max)(1, sampleStep);
 
-	// Define a 3D KD-tree using the source point cloud
-	using KDTree = nanoflann::KDTreeSingleIndexAdaptor<
-		nanoflann::L2_Simple_Adaptor<float, PointCloud>,
-		PointCloud, 3>;
+	if (numIterations)
+		*numIterations = 0;
 
-	KDTree kdTree(3, sourceCloud);
-	kdTree.buildIndex();
+	if (numCameras < 2)
+		return 0.0f;
 
-	// Parallel search for the nearest neighbor of each query point
-#pragma omp parallel for
-	for (int i = 0; i < numQueryPoints; i++)
-	{
-		nanoflann::KNNResultSet<float> resultSet(1); // Only 1 nearest neighbor
-		resultSet.init(&indices[i], &distances[i]);
+	vector<unique_ptr<ProjectiveView>> views(numCameras);
+	const unsigned short* cameraDepth = depths;
 
-		// Query point is assumed to be a row in the Mat (3 floats)
-		kdTree.findNeighbors(resultSet, (float*)queryPoints.row(i).data, nanoflann::SearchParams());
+	for (int c = 0; c < numCameras; c++)
+	{
+		views[c].reset(new ProjectiveView(cameraDepth, widths[c], heights[c], intrinsics + 4 * c, depthToWorld + 12 * c));
+		cameraDepth += static_cast<size_t>(widths[c]) * heights[c];
 	}
+
+	// Normal equations of the matches of each ordered pair of cameras: a match of a source point p to a target point q
+	// with the normal n has the residual (p - q) . n, whose derivative is a = [p x n, n] for the rotation and
+	// translation updates of the source and -a for those of the target
+	int numPairs = numCameras * numCameras;
+	vector<cv::Matx<double, 6, 6>> pairMatrices(numPairs);
+	vector<cv::Matx<double, 6, 1>> pairVectors(numPairs);
+	vector<double> pairErrors(numPairs);
+	vector<int> pairMatches(numPairs);
+
+	int numUnknowns = 6 * (numCameras - 1);
+	float error = 0.0f;
+
+	for (int iter = 0; iter < maxIter; iter++)
+	{
+#pragma omp parallel for schedule(dynamic)
+		for (int pair = 0; pair < numPairs; pair++)
+		{
+			int source = pair / numCameras;
+			int target = pair % numCameras;
+
+			pairMatrices[pair] = cv::Matx<double, 6, 6>::zeros();
+			pairVectors[pair] = cv::Matx<double, 6, 1>::zeros();
+			pairErrors[pair] = 0.0;
+			pairMatches[pair] = 0;
+
+			if (source == target)
+				continue;
+
+			const ProjectiveView& sourceView = *views[source];
+			const ProjectiveView& targetView = *views[target];
+			const float* sourceR = Rs + 9 * source;
+			const float* sourceT = ts + 3 * source;
+			const float* targetR = Rs + 9 * target;
+			const float* targetT = ts + 3 * target;
+
+			for (int v = 0; v < sourceView.Height; v += sampleStep)
+			{
+				for (int u = 0; u < sourceView.Width; u += sampleStep)
+				{
+					int sourceIdx = v * sourceView.Width + u;
+
+					if (!sourceView.IsValid[sourceIdx])
+						continue;
+
+					// The views are in the world space they were given in, before the refinement of their camera
+					Point3f p = TransformPoint(sourceView.Points[sourceIdx], sourceR, sourceT);
+					int targetIdx;
+
+					if (!targetView.Project(InverseTransformPoint(p, targetR, targetT), targetIdx))
+						continue;
+
+					Point3f q = TransformPoint(targetView.Points[targetIdx], targetR, targetT);
+					Point3f n = RotatePoint(targetView.Normals[targetIdx], targetR);
+					Point3f sourceNormal = RotatePoint(sourceView.Normals[sourceIdx], sourceR);
+
+					Point3f d = { p.X - q.X, p.Y - q.Y, p.Z - q.Z };
+
+					if (d.X * d.X + d.Y * d.Y + d.Z * d.Z > maxDistance * maxDistance
+						|| sourceNormal.X * n.X + sourceNormal.Y * n.Y + sourceNormal.Z * n.Z < ProjectiveMinNormalCosine)
+						continue;
+
+					cv::Matx<double, 6, 1> row(
+						p.Y * n.Z - p.Z * n.Y,
+						p.Z * n.X - p.X * n.Z,
+						p.X * n.Y - p.Y * n.X,
+						n.X, n.Y, n.Z);
+					double residual = d.X * n.X + d.Y * n.Y + d.Z * n.Z;
+
+					pairMatrices[pair] += row * row.t();
+					pairVectors[pair] += row * residual;
+					pairErrors[pair] += std::abs(residual);
+					pairMatches[pair]++;
+				}
+			}
+		}
+
+		// Assemble the normal equations of all the cameras but the reference one
+		cv::Mat normalMatrix = cv::Mat::zeros(numUnknowns, numUnknowns, CV_64F);
+		cv::Mat normalVector = cv::Mat::zeros(numUnknowns, 1, CV_64F);
+		double totalError = 0.0;
+		int totalMatches = 0;
+
+		for (int pair = 0; pair < numPairs; pair++)
+		{
+			int cameras[2] = { pair / numCameras, pair % numCameras };
+			double signs[2] = { 1.0, -1.0 };
+
+			totalError += pairErrors[pair];
+			totalMatches += pairMatches[pair];
+
+			for (int a = 0; a < 2; a++)
+			{
+				if (cameras[a] == 0 || pairMatches[pair] == 0)
+					continue;
+
+				int rowStart = 6 * (cameras[a] - 1);
+
+				for (int j = 0; j < 6; j++)
+					normalVector.at<double>(rowStart + j) -= signs[a] * pairVectors[pair](j);
+
+				for (int b = 0; b < 2; b++)
+				{
+					if (cameras[b] == 0)
+						continue;
+
+					int colStart = 6 * (cameras[b] - 1);
+
+					for (int j = 0; j < 6; j++)
+					{
+						for (int k = 0; k < 6; k++)
+							normalMatrix.at<double>(rowStart + j, colStart + k) += signs[a] * signs[b] * pairMatrices[pair](j, k);
+					}
+				}
+			}
+		}
+
+		if (totalMatches == 0)
+			break;
+
+		float previousError = error;
+		error = static_cast<float>(totalError / totalMatches);
+
+		// The directions the matches do not constrain are left unchanged by the least-squares solution
+		cv::Mat update;
+		cv::solve(normalMatrix, normalVector, update, cv::DECOMP_SVD);
+
+		double maxRotationUpdate = 0.0;
+		double maxTranslationUpdate = 0.0;
+
+		for (int c = 1; c < numCameras; c++)
+		{
+			const double* cameraUpdate = update.ptr<double>(6 * (c - 1));
+			cv::Matx31d rotationVector(cameraUpdate[0], cameraUpdate[1], cameraUpdate[2]);
+			cv::Matx31d translationUpdate(cameraUpdate[3], cameraUpdate[4], cameraUpdate[5]);
+			cv::Matx33d rotationIncrement = GetRotationFromVector(rotationVector);
+
+			// The increment maps the points as columns, p' = Ri * p + ti, while the transforms of the cameras move
+			// them as rows, (p + t) * R; so the update is R = Ri^T after a shift of ti * Ri
+			cv::Matx13d shift = translationUpdate.t() * rotationIncrement;
+			float updateR[9], updateT[3];
+
+			for (int j = 0; j < 3; j++)
+			{
+				for (int k = 0; k < 3; k++)
+					updateR[j * 3 + k] = static_cast<float>(rotationIncrement(k, j));
+
+				updateT[j] = static_cast<float>(shift(j));
+			}
+
+			ComposeTransform(Rs + 9 * c, ts + 3 * c, updateR, updateT);
+
+			maxRotationUpdate = (std::max)(maxRotationUpdate, cv::norm(rotationVector));
+			maxTranslationUpdate = (std::max)(maxTranslationUpdate, cv::norm(translationUpdate));
+		}
+
+		if (numIterations)
+			(*numIterations)++;
+
+		if (IsConverged(PointToPlaneStopCriteria, maxRotationUpdate, maxTranslationUpdate, iter > 0 ? previousError : -1.0f, error))
+			break;
+	}
+
+	return error;
+}
+
+/// <summary>
+/// Builds a target for several alignments, so that its KD-tree is only built once. The target points are copied.
+/// </summary>
+/// <param name="isNormalEstimationRequested">Estimates the normals of the target, for point to plane alignments</param>
+/// <returns>Target handle, to destroy with DestroyICPTarget</returns>
+ICP_API ICPTarget* __stdcall CreateICPTarget(Point3f* targetVerts, int numTargetVerts, bool isNormalEstimationRequested)
+{
+	return new ICPTarget(targetVerts, numTargetVerts, isNormalEstimationRequested);
+}
+
+/// <summary>
+/// Performs ICP alignment like ICP does, to a target created by CreateICPTarget. The target is only read, so
+/// several alignments to it can run at once.
+/// </summary>
+ICP_API float __stdcall ICPToTarget(ICPTarget* target, Point3f* sourceVerts, int numSourceVerts, float* R, float* t, int maxIter)
+{
+	TRACE_ZONE("ICPToTarget");
+	if (!target) return 0.0f;
+
+	int numIterations;
+
+	return AlignToTargets({ target }, sourceVerts, numSourceVerts, R, t, maxIter, ICPStopCriteria(), numIterations);
+}
+
+/// <summary>
+/// Performs point to plane ICP alignment like ICPPointToPlane does, to a target created by CreateICPTarget with its
+/// normals; the alignment is point to point if they were not estimated.
+/// </summary>
+ICP_API float __stdcall ICPToTargetPointToPlane(ICPTarget* target, Point3f* sourceVerts, int numSourceVerts, float* R, float* t, int maxIter)
+{
+	TRACE_ZONE("ICPToTargetPointToPlane");
+	if (!target) return 0.0f;
+
+	int numIterations;
+
+	if (target->Normals.empty())
+		return AlignToTargets({ target }, sourceVerts, numSourceVerts, R, t, maxIter, ICPStopCriteria(), numIterations);
+
+	vector<Point3f> sourceNormals = EstimateNormals(sourceVerts, numSourceVerts);
+
+	return AlignToTargetsPointToPlane({ target }, sourceVerts, numSourceVerts, sourceNormals.data(), R, t, maxIter, PointToPlaneStopCriteria,
+		numIterations);
+}
+
+ICP_API void __stdcall DestroyICPTarget(ICPTarget* target)
+{
+	delete target;
+}
+
+/// <summary>
+/// Selects the nearest neighbour search of the targets created from now on, see NeighbourSearchBackend
+/// </summary>
+/// <returns>False if the GPU search was requested but no GPU is available, in which case the KD-trees are used</returns>
+ICP_API bool __stdcall SetNeighbourSearchBackend(int backend)
+{
+	isHashSearchEnabled = backend == VoxelHashSearch;
+
+	return GpuNeighbourSearch::Instance().SetEnabled(backend == GpuGridSearch);
+}
+
+/// <summary>
+/// Aligns the source vertices to the union of the targets; the correspondence buffers are allocated once and reused by
+/// all the iterations.
+/// </summary>
+/// <param name="stopCriteria">Thresholds below which the alignment stops before maxIter iterations</param>
+/// <param name="numIterations">Output number of iterations run</param>
+float AlignToTargets(const ICPTargets& targets, Point3f* sourceVerts, int numSourceVerts, float* R, float* t, int maxIter,
+	const ICPStopCriteria& stopCriteria, int& numIterations)
+{
+	// Wrap output rotation and translation as cv::Mat
+	cv::Mat matR(3, 3, CV_32F, R);
+	cv::Mat matT(1, 3, CV_32F, t);
+
+	// Convert sourceVerts into a CV matrix for matrix operations
+	cv::Mat sourceVertsMat(numSourceVerts, 3, CV_32F, (float*)sourceVerts);
+
+	ICPMatches matches;
+	float error = 1.0f;
+	numIterations = 0;
+
+	for (int iter = 0; iter < maxIter; iter++)
+	{
+		vector<Point3f>& matchedTargetVerts = matches.MatchedTargetVerts;
+		vector<Point3f>& matchedSourceVerts = matches.MatchedSourceVerts;
+		vector<float>& matchDistances = matches.MatchDistances;
+
+		// Match each target point to its closest source point, without the outliers
+		MatchPoints(targets, sourceVertsMat, matches);
+
+		// Estimate translation (centroid difference)
+		cv::Mat matchedTargetMat(matchedTargetVerts.size(), 3, CV_32F, matchedTargetVerts.data());
+		cv::Mat matchedSourceMat(matchedSourceVerts.size(), 3, CV_32F, matchedSourceVerts.data());
+
+		cv::Mat centroidShift;
+		cv::reduce(matchedTargetMat - matchedSourceMat, centroidShift, 0, CV_REDUCE_AVG);
+
+		// Apply translation shift to sourceVerts and matchedSourceVerts
+		for (int i = 0; i < sourceVertsMat.rows; ++i)
+		{
+			sourceVertsMat.row(i) += centroidShift;
+		}
+
+		for (int i = 0; i < matchedSourceMat.rows; ++i)
+		{
+			matchedSourceMat.row(i) += centroidShift;
+		}
+
+		// Estimate optimal rotation using SVD
+		cv::Mat crossCov = matchedSourceMat.t() * matchedTargetMat;
+		cv::SVD svd;
+		svd(crossCov);
+
+		cv::Mat rotationUpdate = svd.u * svd.vt;
+		
+		// Ensure a proper rotation (handle reflection case)
+		if (cv::determinant(rotationUpdate) < 0)
+		{
+			cv::Mat reflexionFix = cv::Mat::eye(3, 3, CV_32F);
+			reflexionFix.at<float>(2, 2) = -1.0f;
+			rotationUpdate = svd.u * reflexionFix * svd.vt;
+		}
+
+		// Apply rotation update
+		sourceVertsMat = sourceVertsMat * rotationUpdate;
+
+		matT += centroidShift * matR.t();
+		matR = matR * rotationUpdate;
+
+		// Optionally compute and print alignment error
+		
+		float previousError = error;
+		error = 0.0f;
+		for (float d : matchDistances)
+			error += std::sqrt(d);
+		error /= matchDistances.size();
+
+		numIterations++;
+
+		// The angle of the rotation update is found from its trace
+		double rotationAngle = std::acos((std::min)(1.0, (std::max)(-1.0, (cv::trace(rotationUpdate)[0] - 1.0) / 2.0)));
+
+		if (IsConverged(stopCriteria, rotationAngle, cv::norm(centroidShift), iter > 0 ? previousError : -1.0f, error))
+			break;
+	}
+
+	// Copy the transformed sourceVerts data back to original buffer
+	memcpy(sourceVerts, sourceVertsMat.data, sourceVertsMat.rows * sizeof(float) * 3);
+
+	// Copy the final transformation results
+	memcpy(R, matR.data, 9 * sizeof(float));
+	memcpy(t, matT.data, 3 * sizeof(float));;
+
+	return error;
+}
+
+/// <summary>
+/// Aligns the source vertices to the normals of the union of the targets, which all have their normals. Each iteration
+/// linearizes the rotation around the current alignment and solves the damped 6x6 normal equations of the weighted point
+/// to plane distances for a rotation vector and translation. The matches too far apart, or whose normals are not
+/// compatible, are left out, and the others are weighted down beyond a multiple of their median plane distance.
+/// </summary>
+/// <param name="sourceNormals">Unit normals of the source points as they are given; null to skip the test of the normals
+/// of the matches</param>
+/// <returns>Mean distance of the matches kept by the last iteration</returns>
+float AlignToTargetsPointToPlane(const ICPTargets& targets, Point3f* sourceVerts, int numSourceVerts, const Point3f* sourceNormals,
+	float* R, float* t, int maxIter, const ICPStopCriteria& stopCriteria, int& numIterations)
+{
+	cv::Mat matR(3, 3, CV_32F, R);
+	cv::Mat matT(1, 3, CV_32F, t);
+	cv::Mat sourceVertsMat(numSourceVerts, 3, CV_32F, (float*)sourceVerts);
+
+	// Rotation of the source points since the start of the alignment, which also rotates their normals
+	float sourceRotation[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+
+	ICPMatches matches;
+	vector<float> matchDistances;
+	vector<float> sortedValues;
+	vector<double> residuals;
+	vector<int> keptMatches;
+	float error = 1.0f;
+	numIterations = 0;
+
+	for (int iter = 0; iter < maxIter; iter++)
+	{
+		MatchPoints(targets, sourceVertsMat, matches);
+
+		size_t numMatches = matches.MatchedSourceVerts.size();
+		matchDistances.resize(numMatches);
+
+		for (size_t i = 0; i < numMatches; i++)
+		{
+			const Point3f& p = matches.MatchedSourceVerts[i];
+			const Point3f& q = matches.MatchedTargetVerts[i];
+			matchDistances[i] = std::sqrt((p.X - q.X) * (p.X - q.X) + (p.Y - q.Y) * (p.Y - q.Y) + (p.Z - q.Z) * (p.Z - q.Z));
+		}
+
+		sortedValues = matchDistances;
+		float maxDistance = PointToPlaneMaxDistance;
+
+		if (!sortedValues.empty())
+		{
+			std::nth_element(sortedValues.begin(), sortedValues.begin() + sortedValues.size() / 2, sortedValues.end());
+			maxDistance = (std::min)(maxDistance, PointToPlaneMedianDistanceScale * sortedValues[sortedValues.size() / 2]);
+		}
+
+		// Plane distances of the kept matches, (p - q) . n
+		residuals.clear();
+		keptMatches.clear();
+
+		for (size_t i = 0; i < numMatches; i++)
+		{
+			if (matchDistances[i] > maxDistance)
+				continue;
+
+			const Point3f& p = matches.MatchedSourceVerts[i];
+			const Point3f& q = matches.MatchedTargetVerts[i];
+			size_t targetIdx = matches.MatchedTargetIndices[i];
+			size_t k = FindTarget(matches.TargetOffsets, targetIdx);
+			const Point3f& n = targets[k]->Normals[targetIdx - matches.TargetOffsets[k]];
+
+			// The normals are unoriented, and the null normals, of the points with too few neighbours, never pass
+			if (sourceNormals)
+			{
+				Point3f sourceNormal = RotatePoint(sourceNormals[matches.MatchedSourceIndices[i]], sourceRotation);
+
+				if (std::abs(sourceNormal.X * n.X + sourceNormal.Y * n.Y + sourceNormal.Z * n.Z) < PointToPlaneMinNormalCosine)
+					continue;
+			}
+
+			residuals.push_back((p.X - q.X) * n.X + (p.Y - q.Y) * n.Y + (p.Z - q.Z) * n.Z);
+			keptMatches.push_back(static_cast<int>(i));
+		}
+
+		if (keptMatches.empty())
+			break;
+
+		sortedValues.resize(residuals.size());
+
+		for (size_t j = 0; j < residuals.size(); j++)
+			sortedValues[j] = static_cast<float>(std::abs(residuals[j]));
+
+		std::nth_element(sortedValues.begin(), sortedValues.begin() + sortedValues.size() / 2, sortedValues.end());
+		double huberThreshold = PointToPlaneHuberScale * sortedValues[sortedValues.size() / 2];
+
+		// Accumulate the weighted normal equations; each match gives the row [p x n, n] and its plane distance
+		cv::Matx<double, 6, 6> normalMatrix = cv::Matx<double, 6, 6>::zeros();
+		cv::Matx<double, 6, 1> normalVector = cv::Matx<double, 6, 1>::zeros();
+		double keptDistance = 0.0;
+
+		for (size_t j = 0; j < keptMatches.size(); j++)
+		{
+			int i = keptMatches[j];
+			const Point3f& p = matches.MatchedSourceVerts[i];
+			size_t targetIdx = matches.MatchedTargetIndices[i];
+			size_t k = FindTarget(matches.TargetOffsets, targetIdx);
+			const Point3f& n = targets[k]->Normals[targetIdx - matches.TargetOffsets[k]];
+
+			cv::Matx<double, 6, 1> row(
+				p.Y * n.Z - p.Z * n.Y,
+				p.Z * n.X - p.X * n.Z,
+				p.X * n.Y - p.Y * n.X,
+				n.X, n.Y, n.Z);
+			double residual = residuals[j];
+			double absResidual = std::abs(residual);
+			double weight = absResidual > huberThreshold ? huberThreshold / absResidual : 1.0;
+
+			normalMatrix += weight * (row * row.t());
+			normalVector -= weight * residual * row;
+			keptDistance += matchDistances[i];
+		}
+
+		for (int k = 0; k < 6; k++)
+			normalMatrix(k, k) *= 1.0 + PointToPlaneDamping;
+
+		// The directions a planar target does not constrain are left unchanged by the least-squares solution
+		cv::Matx<double, 6, 1> update;
+		cv::solve(normalMatrix, normalVector, update, cv::DECOMP_SVD);
+
+		cv::Matx31d rotationVector(update(0), update(1), update(2));
+		cv::Matx31d translationUpdate(update(3), update(4), update(5));
+		cv::Matx33d rotationIncrement = GetRotationFromVector(rotationVector);
+
+		// The increment maps the points as columns, p' = Ri * p + ti, while the source points are rows transformed as
+		// (p + T) * R; so the update is R = Ri^T after a shift of ti * Ri
+		cv::Mat rotationUpdate, centroidShift;
+		cv::Mat(rotationIncrement.t()).convertTo(rotationUpdate, CV_32F);
+		cv::Mat(translationUpdate.t() * rotationIncrement).convertTo(centroidShift, CV_32F);
+
+		for (int i = 0; i < sourceVertsMat.rows; ++i)
+		{
+			sourceVertsMat.row(i) += centroidShift;
+		}
+
+		sourceVertsMat = sourceVertsMat * rotationUpdate;
+
+		matT += centroidShift * matR.t();
+		matR = matR * rotationUpdate;
+
+		cv::Mat nextSourceRotation = cv::Mat(3, 3, CV_32F, sourceRotation) * rotationUpdate;
+		memcpy(sourceRotation, nextSourceRotation.data, 9 * sizeof(float));
+
+		float previousError = error;
+		error = static_cast<float>(keptDistance / keptMatches.size());
+
+		numIterations++;
+
+		if (IsConverged(stopCriteria, cv::norm(rotationVector), cv::norm(translationUpdate), iter > 0 ? previousError : -1.0f, error))
+			break;
+	}
+
+	memcpy(sourceVerts, sourceVertsMat.data, sourceVertsMat.rows * sizeof(float) * 3);
+	memcpy(R, matR.data, 9 * sizeof(float));
+	memcpy(t, matT.data, 3 * sizeof(float));
+
+	return error;
+}
+
+/// <summary>
+/// Tells whether an alignment stops after an update, either because it no longer moves the points or because the error
+/// no longer changes
+/// </summary>
+/// <param name="previousError">Error before the update, or a negative value after the first update</param>
+bool IsConverged(const ICPStopCriteria& stopCriteria, double rotationAngle, double translation, float previousError, float error)
+{
+	if (rotationAngle < stopCriteria.MinRotationUpdate && translation < stopCriteria.MinTranslationUpdate)
+		return true;
+
+	return previousError >= 0.0f && std::abs(previousError - error) < stopCriteria.MinErrorChange * previousError;
+}
+
+/// <summary>
+/// Moves points as the alignments do, p' = (p + t) * R with the points as rows
+/// </summary>
+void TransformPoints(Point3f* verts, int numVerts, const float* R, const float* t)
+{
+#pragma omp parallel for
+	for (int i = 0; i < numVerts; i++)
+	{
+		float x = verts[i].X + t[0];
+		float y = verts[i].Y + t[1];
+		float z = verts[i].Z + t[2];
+
+		verts[i].X = x * R[0] + y * R[3] + z * R[6];
+		verts[i].Y = x * R[1] + y * R[4] + z * R[7];
+		verts[i].Z = x * R[2] + y * R[5] + z * R[8];
+	}
+}
+
+/// <summary>
+/// Moves a point as TransformPoints does
+/// </summary>
+Point3f TransformPoint(const Point3f& point, const float* R, const float* t)
+{
+	Point3f shifted = { point.X + t[0], point.Y + t[1], point.Z + t[2] };
+
+	return RotatePoint(shifted, R);
+}
+
+/// <summary>
+/// Moves a point back to where it was before TransformPoint: p = p' * R^T - t
+/// </summary>
+Point3f InverseTransformPoint(const Point3f& point, const float* R, const float* t)
+{
+	return Point3f{
+		point.X * R[0] + point.Y * R[1] + point.Z * R[2] - t[0],
+		point.X * R[3] + point.Y * R[4] + point.Z * R[5] - t[1],
+		point.X * R[6] + point.Y * R[7] + point.Z * R[8] - t[2] };
+}
+
+/// <summary>
+/// Rotates a point, or a normal, as a row: p * R
+/// </summary>
+Point3f RotatePoint(const Point3f& point, const float* R)
+{
+	return Point3f{
+		point.X * R[0] + point.Y * R[3] + point.Z * R[6],
+		point.X * R[1] + point.Y * R[4] + point.Z * R[7],
+		point.X * R[2] + point.Y * R[5] + point.Z * R[8] };
+}
+
+/// <summary>
+/// Composes a transform with an update applied to the points it moved: the points are moved by (p + t) * R then by
+/// (p + updateT) * updateR, which is (p + t + updateT * R^T) * (R * updateR)
+/// </summary>
+void ComposeTransform(float* R, float* t, const float* updateR, const float* updateT)
+{
+	float composedR[9] = {};
+
+	for (int j = 0; j < 3; j++)
+	{
+		for (int k = 0; k < 3; k++)
+			t[j] += updateT[k] * R[j * 3 + k];
+	}
+
+	for (int j = 0; j < 3; j++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			for (int l = 0; l < 3; l++)
+				composedR[j * 3 + k] += R[j * 3 + l] * updateR[l * 3 + k];
+		}
+	}
+
+	memcpy(R, composedR, 9 * sizeof(float));
+}
+
+/// <summary>
+/// Selects up to maxSamples points of a cloud to align it to other clouds (normal-space sampling): only the points
+/// which have a point of the others within maxOverlapDistance, and so can be matched, spread as evenly as possible over
+/// the directions of their normals, so that the points of the few surfaces which constrain the pose across the flat
+/// regions are all kept while the points of the flat regions are thinned out. The normals of a random subset of
+/// candidates are estimated and bucketed, and the buckets are taken from in turn until enough candidates were found in
+/// the overlap.
+/// </summary>
+/// <param name="cloud">Points to sample and their KD-tree, from which the normals are estimated if it has none</param>
+/// <param name="others">Clouds the points are aligned to</param>
+/// <param name="maxOverlapDistance">Distance to the others below which a point is in the overlap, in the units of the
+/// points</param>
+/// <param name="seed">Seed of the random order of the candidates, so that the samples of a cloud are repeatable</param>
+vector<Point3f> SampleOverlapByNormals(const ICPTarget& cloud, const ICPTargets& others, int maxSamples, float maxOverlapDistance,
+	unsigned int seed)
+{
+	const vector<Point3f>& points = cloud.Cloud.Points;
+	int numPoints = static_cast<int>(points.size());
+	std::mt19937 random(seed);
+
+	vector<int> candidates(numPoints);
+
+	for (int i = 0; i < numPoints; i++)
+		candidates[i] = i;
+
+	// Only the first candidates of a random order are bucketed, so that few normals are estimated
+	int numCandidates = (std::min)(numPoints, SampleCandidateRatio * maxSamples);
+
+	for (int i = 0; i < numCandidates; i++)
+		std::swap(candidates[i], candidates[i + random() % (numPoints - i)]);
+
+	candidates.resize(numCandidates);
+
+	// The normals have no sign, so they are folded onto the half of the sphere facing +Z; the candidates without a
+	// normal share the last bucket
+	const int numCells = NumNormalSampleCells;
+	const int noNormalBucket = numCells * numCells * numCells;
+	vector<Point3f> normals(numCandidates);
+	vector<int> bucketIndices(numCandidates);
+
+#pragma omp parallel for
+	for (int i = 0; i < numCandidates; i++)
+	{
+		const Point3f& point = points[candidates[i]];
+		Point3f normal = cloud.Normals.empty() ? cloud.EstimateNormal(point) : cloud.Normals[candidates[i]];
+
+		if (normal.X == 0.0f && normal.Y == 0.0f && normal.Z == 0.0f)
+		{
+			bucketIndices[i] = noNormalBucket;
+			continue;
+		}
+
+		float sign = normal.Z < 0.0f ? -1.0f : 1.0f;
+		int x = (std::min)(numCells - 1, static_cast<int>((sign * normal.X + 1.0f) * 0.5f * numCells));
+		int y = (std::min)(numCells - 1, static_cast<int>((sign * normal.Y + 1.0f) * 0.5f * numCells));
+		int z = (std::min)(numCells - 1, static_cast<int>(sign * normal.Z * numCells));
+		bucketIndices[i] = (std::max)(0, (x * numCells + y) * numCells + z);
+	}
+
+	// The candidates are in a random order already, so each bucket keeps them in that order
+	vector<vector<int>> buckets(noNormalBucket + 1);
+
+	for (int i = 0; i < numCandidates; i++)
+		buckets[bucketIndices[i]].push_back(candidates[i]);
+
+	buckets.erase(std::remove_if(buckets.begin(), buckets.end(), [](const vector<int>& bucket) { return bucket.empty(); }), buckets.end());
+
+	vector<Point3f> samples;
+	samples.reserve(maxSamples);
+	vector<size_t> nextCandidates(buckets.size(), 0);
+	float maxSquaredDistance = maxOverlapDistance * maxOverlapDistance;
+	bool isExhausted = false;
+
+	while (static_cast<int>(samples.size()) < maxSamples && !isExhausted)
+	{
+		isExhausted = true;
+
+		for (size_t b = 0; b < buckets.size() && static_cast<int>(samples.size()) < maxSamples; b++)
+		{
+			if (nextCandidates[b] >= buckets[b].size())
+				continue;
+
+			isExhausted = false;
+			const Point3f& point = points[buckets[b][nextCandidates[b]++]];
+
+			for (const ICPTarget* other : others)
+			{
+				size_t index;
+				float distance;
+
+				nanoflann::KNNResultSet<float> resultSet(1);
+				resultSet.init(&index, &distance);
+				other->KDTree.findNeighbors(resultSet, &point.X, nanoflann::SearchParams());
+
+				if (resultSet.size() > 0 && distance <= maxSquaredDistance)
+				{
+					samples.push_back(point);
+					break;
+				}
+			}
+		}
+	}
+
+	return samples;
+}
+
+/// <summary>
+/// Downsamples points to the centroid of the points of each voxel of a grid
+/// </summary>
+/// <param name="voxelSize">Size of the voxels, in the units of the points</param>
+vector<Point3f> VoxelDownsample(const Point3f* verts, int numVerts, float voxelSize)
+{
+	struct VoxelSum
+	{
+		double X, Y, Z;
+		int Count;
+	};
+
+	if (voxelSize <= 0.0f)
+		return vector<Point3f>(verts, verts + numVerts);
+
+	// The voxel coordinates are packed in 21 bits each, which covers kilometers of points at centimeter voxels
+	unordered_map<uint64_t, VoxelSum> voxels;
+	voxels.reserve(numVerts / 4 + 1);
+
+	for (int i = 0; i < numVerts; i++)
+	{
+		const Point3f& point = verts[i];
+		uint64_t key = 0;
+		const float coordinates[3] = { point.X, point.Y, point.Z };
+
+		for (int k = 0; k < 3; k++)
+		{
+			int64_t cell = static_cast<int64_t>(std::floor(coordinates[k] / voxelSize)) + (1 << 20);
+			key = (key << 21) | (static_cast<uint64_t>(cell) & 0x1FFFFF);
+		}
+
+		VoxelSum& sum = voxels[key];
+		sum.X += point.X;
+		sum.Y += point.Y;
+		sum.Z += point.Z;
+		sum.Count++;
+	}
+
+	vector<Point3f> downsampled;
+	downsampled.reserve(voxels.size());
+
+	for (const auto& voxel : voxels)
+	{
+		const VoxelSum& sum = voxel.second;
+		downsampled.push_back(Point3f{ static_cast<float>(sum.X / sum.Count), static_cast<float>(sum.Y / sum.Count), static_cast<float>(sum.Z / sum.Count) });
+	}
+
+	return downsampled;
+}
+
+/// <summary>
+/// Converts a rotation vector, whose direction is the axis and norm the angle of the rotation, to a rotation matrix
+/// (Rodrigues' formula)
+/// </summary>
+cv::Matx33d GetRotationFromVector(const cv::Matx31d& rotationVector)
+{
+	double angle = cv::norm(rotationVector);
+
+	if (angle < 1e-12)
+		return cv::Matx33d::eye();
+
+	cv::Matx31d axis = rotationVector * (1.0 / angle);
+	cv::Matx33d crossMatrix(
+		0.0, -axis(2), axis(1),
+		axis(2), 0.0, -axis(0),
+		-axis(1), axis(0), 0.0);
+
+	return cv::Matx33d::eye() + crossMatrix * std::sin(angle) + crossMatrix * crossMatrix * (1.0 - std::cos(angle));
+}
+
+/// <summary>
+/// Matches the source points to their closest point of the targets, keeping the closest source point of each target point,
+/// then rejects the outlier matches. The distances of all the matches are kept in MatchDistances, before the
+/// rejection, and are what the alignment error is computed from.
+/// </summary>
+void MatchPoints(const ICPTargets& targets, cv::Mat& sourceVertsMat, ICPMatches& matches)
+{
+	TRACE_ZONE("MatchPoints");
+
+	int numSourceVerts = sourceVertsMat.rows;
+	vector<size_t>& targetOffsets = matches.TargetOffsets;
+
+	// The points of the targets are indexed one target after the other
+	targetOffsets.resize(targets.size() + 1);
+	targetOffsets[0] = 0;
+
+	for (size_t k = 0; k < targets.size(); k++)
+		targetOffsets[k + 1] = targetOffsets[k] + targets[k]->Cloud.Points.size();
+
+	vector<Point3f>& matchedTargetVerts = matches.MatchedTargetVerts;
+	vector<Point3f>& matchedSourceVerts = matches.MatchedSourceVerts;
+	vector<int>& matchedTargetIndices = matches.MatchedTargetIndices;
+	vector<int>& matchedSourceIndices = matches.MatchedSourceIndices;
+	vector<float>& matchDistances = matches.MatchDistances;
+	vector<int>& matchMap = matches.MatchMap;
+
+	vector<float>& distances = matches.Distances;
+	vector<size_t>& indices = matches.Indices;
+
+	distances.resize(numSourceVerts);
+	indices.resize(numSourceVerts);
+	matchedTargetVerts.clear();
+	matchedSourceVerts.clear();
+	matchedTargetIndices.clear();
+	matchedSourceIndices.clear();
+	matchDistances.clear();
+	matchMap.assign(targetOffsets.back(), -1);
+
+	// Find nearest neighbors from sourceVerts to targetVerts
+	FindNearestNeighbours(targets, targetOffsets, sourceVertsMat, distances, indices);
+
+	// For each source point, keep only the best match
+	for (int i = 0; i < numSourceVerts; ++i)
+	{
+		int targetIdx = indices[i];
+		float currentDistance = distances[i];
+
+		int existingMatchPos = matchMap[targetIdx];
+
+		if (existingMatchPos != -1 && matchDistances[existingMatchPos] < currentDistance)
+			continue;
+
+		// Get matched point from sourceVerts
+		Point3f queryPoint;
+		queryPoint.X = sourceVertsMat.at<float>(i, 0);
+		queryPoint.Y = sourceVertsMat.at<float>(i, 1);
+		queryPoint.Z = sourceVertsMat.at<float>(i, 2);
+
+		if (existingMatchPos == -1)
+		{
+			size_t k = FindTarget(targetOffsets, targetIdx);
+			matchedTargetVerts.push_back(targets[k]->Cloud.Points[targetIdx - targetOffsets[k]]);
+			matchedSourceVerts.push_back(queryPoint);
+			matchedTargetIndices.push_back(targetIdx);
+			matchedSourceIndices.push_back(i);
+			matchDistances.push_back(currentDistance);
+			matchMap[targetIdx] = matchedSourceVerts.size() - 1;
+		}
+		else
+		{
+			matchedSourceVerts[existingMatchPos] = queryPoint;
+			matchedSourceIndices[existingMatchPos] = i;
+			matchDistances[existingMatchPos] = currentDistance;
+		}
+	}
+
+	// Remove outliers based on distance threshold
+	RejectOutlierMatches(matches, 2.5f);
+}
+
+/// <summary>
+/// Finds the closest point of the targets for each query point.
+/// </summary>
+/// <param name="targets">Point clouds to compare with the query points</param>
+/// <param name="targetOffsets">Index of the first point of each target in the output indices</param>
+/// <param name="queryPoints">Query points to compare with the point clouds</param>
+/// <param name="distances">Output squared distances to the nearest neighbours for each query point</param>
+/// <param name="indices">Output indices of the closest points in the targets for each query point</param>
+void FindNearestNeighbours(const ICPTargets& targets, const vector<size_t>& targetOffsets, cv::Mat &queryPoints, vector<float> &distances, vector<size_t> &indices)
+{
+	if (FindNearestNeighboursGpu(targets, targetOffsets, queryPoints, distances, indices))
+		return;
+
+	if (FindNearestNeighboursHash(targets, targetOffsets, queryPoints, distances, indices))
+		return;
+
+	int numQueryPoints = queryPoints.rows;
+
+	// Parallel search for the nearest neighbor of each query point, marked as a zone on each thread of the team
+#pragma omp parallel
+	{
+		TRACE_ZONE("NearestNeighbours");
+
+#pragma omp for
+		for (int i = 0; i < numQueryPoints; i++)
+		{
+			distances[i] = std::numeric_limits<float>::max();
+			indices[i] = 0;
+
+			for (size_t k = 0; k < targets.size(); k++)
+			{
+				size_t index;
+				float distance;
+
+				nanoflann::KNNResultSet<float> resultSet(1); // Only 1 nearest neighbor
+				resultSet.init(&index, &distance);
+
+				// Query point is assumed to be a row in the Mat (3 floats)
+				targets[k]->KDTree.findNeighbors(resultSet, (float*)queryPoints.row(i).data, nanoflann::SearchParams());
+
+				if (resultSet.size() > 0 && distance < distances[i])
+				{
+					distances[i] = distance;
+					indices[i] = targetOffsets[k] + index;
+				}
+			}
+		}
+	}
+}
+
+/// <summary>
+/// Finds the closest point of the targets for each query point like FindNearestNeighbours, on the GPU. The queries the
+/// grids cannot answer exactly are searched in the KD-trees, so the results are the same.
+/// </summary>
+/// <returns>False if the targets have no GPU grid, the queries are too few or the GPU failed</returns>
+bool FindNearestNeighboursGpu(const ICPTargets& targets, const vector<size_t>& targetOffsets, cv::Mat& queryPoints, vector<float>& distances, vector<size_t>& indices)
+{
+	int numQueryPoints = queryPoints.rows;
+
+	if (numQueryPoints < GpuMinNumQueryPoints || !queryPoints.isContinuous())
+		return false;
+
+	for (size_t k = 0; k < targets.size(); k++)
+	{
+		if (!targets[k]->GpuGrid)
+			return false;
+	}
+
+	vector<vector<float>> gpuDistances(targets.size());
+	vector<vector<int>> gpuIndices(targets.size());
+
+	for (size_t k = 0; k < targets.size(); k++)
+	{
+		if (!GpuNeighbourSearch::Instance().FindNearestNeighbours(*targets[k]->GpuGrid, queryPoints.ptr<float>(0), numQueryPoints,
+			gpuDistances[k], gpuIndices[k]))
+		{
+			return false;
+		}
+	}
+
+#pragma omp parallel for
+	for (int i = 0; i < numQueryPoints; i++)
+	{
+		distances[i] = std::numeric_limits<float>::max();
+		indices[i] = 0;
+
+		for (size_t k = 0; k < targets.size(); k++)
+		{
+			size_t index = gpuIndices[k][i];
+			float distance = gpuDistances[k][i];
+
+			if (gpuIndices[k][i] < 0)
+			{
+				nanoflann::KNNResultSet<float> resultSet(1);
+				resultSet.init(&index, &distance);
+				targets[k]->KDTree.findNeighbors(resultSet, (float*)queryPoints.row(i).data, nanoflann::SearchParams());
+
+				if (resultSet.size() == 0)
+					continue;
+			}
+
+			if (distance < distances[i])
+			{
+				distances[i] = distance;
+				indices[i] = targetOffsets[k] + index;
+			}
+		}
+	}
+
+	return true;
+}
+
+/// <summary>
+/// Finds the closest point of the targets for each query point like FindNearestNeighbours, in the voxel hash grids of
+/// the targets. The queries the rings of voxels around their own cannot answer exactly are searched in the KD-trees, so
+/// the results are the same.
+/// </summary>
+/// <returns>False if the targets have no voxel hash grid</returns>
+bool FindNearestNeighboursHash(const ICPTargets& targets, const vector<size_t>& targetOffsets, cv::Mat& queryPoints, vector<float>& distances, vector<size_t>& indices)
+{
+	for (size_t k = 0; k < targets.size(); k++)
+	{
+		if (targets[k]->HashGrid.IsEmpty())
+			return false;
+	}
+
+	int numQueryPoints = queryPoints.rows;
+
+#pragma omp parallel
+	{
+		TRACE_ZONE("NearestNeighbours");
+
+#pragma omp for
+		for (int i = 0; i < numQueryPoints; i++)
+		{
+			const float* queryPoint = queryPoints.ptr<float>(i);
+			distances[i] = std::numeric_limits<float>::max();
+			indices[i] = 0;
+
+			for (size_t k = 0; k < targets.size(); k++)
+			{
+				int hashIndex;
+				float distance;
+				size_t index;
+
+				if (targets[k]->HashGrid.FindNearest(queryPoint[0], queryPoint[1], queryPoint[2], MaxHashRings, hashIndex, distance))
+				{
+					index = static_cast<size_t>(hashIndex);
+				}
+				else
+				{
+					nanoflann::KNNResultSet<float> resultSet(1);
+					resultSet.init(&index, &distance);
+					targets[k]->KDTree.findNeighbors(resultSet, queryPoint, nanoflann::SearchParams());
+
+					if (resultSet.size() == 0)
+						continue;
+				}
+
+				if (distance < distances[i])
+				{
+					distances[i] = distance;
+					indices[i] = targetOffsets[k] + index;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+/// <summary>
+/// Returns the target a point index of the targets falls in
+/// </summary>
+size_t FindTarget(const vector<size_t>& targetOffsets, size_t index)
+{
+	size_t k = 0;
+
+	while (index >= targetOffsets[k + 1])
+		k++;
+
+	return k;
 }
 
 /// <summary>
 /// Filters out outlier correspondences between two point sets based on match distance
 /// </summary>
-/// <param name="matches1">Input/output 3D points from the first set (in-place update)</param>
-/// <param name="matches2">Input/output 3D points from the second set (in-place update)</param>
-/// <param name="matchDistances">Precomputed distances between point pairs</param>
+/// <param name="matches">Matches to filter in place; MatchDistances is only read</param>
 /// <param name="maxStdDev">Maximum allowed distance in terms of standard deviations from the mean</param>
-void RejectOutlierMatches(vector<Point3f>& matches1, vector<Point3f>& matches2, vector<float>& matchDistances, float maxStdDev)
+void RejectOutlierMatches(ICPMatches& matches, float maxStdDev)
 {
-	float distanceStdDev = GetStandardDeviation(matchDistances);
+	float distanceStdDev = GetStandardDeviation(matches.MatchDistances);
 
-	vector<Point3f> filteredMatches1;
-	vector<Point3f> filteredMatches2;
+	// The kept matches are moved to the front, so that the buffers are reused
+	size_t numKept = 0;
 
-	for (size_t i = 0; i < matches1.size(); i++)
+	for (size_t i = 0; i < matches.MatchedTargetVerts.size(); i++)
 	{
 		// Reject match if its distance is too far from the mean
-		if (matchDistances[i] > maxStdDev * distanceStdDev)
+		if (matches.MatchDistances[i] > maxStdDev * distanceStdDev)
 			continue;
 
-		filteredMatches1.push_back(matches1[i]);
-		filteredMatches2.push_back(matches2[i]);
+		matches.MatchedTargetVerts[numKept] = matches.MatchedTargetVerts[i];
+		matches.MatchedSourceVerts[numKept] = matches.MatchedSourceVerts[i];
+		matches.MatchedTargetIndices[numKept] = matches.MatchedTargetIndices[i];
+		matches.MatchedSourceIndices[numKept] = matches.MatchedSourceIndices[i];
+		numKept++;
 	}
 
-	matches1 = filteredMatches1;
-	matches2 = filteredMatches2;
+	matches.MatchedTargetVerts.resize(numKept);
+	matches.MatchedSourceVerts.resize(numKept);
+	matches.MatchedTargetIndices.resize(numKept);
+	matches.MatchedSourceIndices.resize(numKept);
 }
 
 /// <summary>
@@ -0,0 +1,409 @@
+/***************************************************************************\
+
+Module Name:  BenchmarkScenes.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module builds the scenes the alignments are benchmarked on: the point
+clouds of several cameras whose true poses are known, moved by a known
+calibration error. The synthetic scenes are rendered for a ring of cameras
+around a table and a person, with depth noise growing with the distance, so
+that the cameras only partly see the same surfaces. The recorded scenes are
+built from two frames of a raw recording, each cropped to a part of the
+field of view, so that they overlap partly with the noise of the sensor.
+
+\***************************************************************************/
+
+#include "benchmarkScenes.h"
+#include "rawFrameRecorder.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace
+{
+    const float Pi = 3.14159265358979f;
+
+    // Depth camera of the synthetic scenes, like the narrow field of view mode of the cameras
+    const int SyntheticWidth = 640;
+    const int SyntheticHeight = 576;
+    const float SyntheticFocalLength = 504.0f;
+    const float MinDepth = 0.25f; // In meters
+    const float MaxDepth = 5.0f;
+
+    // Ring of cameras around the Holoport, all looking at the same point above the table
+    const float RingRadius = 2.0f;
+    const float CameraHeight = 1.6f;
+    const float LookAtHeight = 0.6f;
+
+    struct Vector3
+    {
+        float X, Y, Z;
+    };
+
+    Vector3 operator+(const Vector3& a, const Vector3& b) { return { a.X + b.X, a.Y + b.Y, a.Z + b.Z }; }
+    Vector3 operator-(const Vector3& a, const Vector3& b) { return { a.X - b.X, a.Y - b.Y, a.Z - b.Z }; }
+    Vector3 operator*(const Vector3& a, float s) { return { a.X * s, a.Y * s, a.Z * s }; }
+    float Dot(const Vector3& a, const Vector3& b) { return a.X * b.X + a.Y * b.Y + a.Z * b.Z; }
+    Vector3 Cross(const Vector3& a, const Vector3& b) { return { a.Y * b.Z - a.Z * b.Y, a.Z * b.X - a.X * b.Z, a.X * b.Y - a.Y * b.X }; }
+    Vector3 Normalize(const Vector3& a) { return a * (1.0f / std::sqrt(Dot(a, a))); }
+
+    // Rotation as a 3x3 row-major matrix which maps the points as columns, p' = R * p
+    struct Rotation
+    {
+        float M[9];
+
+        Vector3 Apply(const Vector3& p) const
+        {
+            return { M[0] * p.X + M[1] * p.Y + M[2] * p.Z, M[3] * p.X + M[4] * p.Y + M[5] * p.Z, M[6] * p.X + M[7] * p.Y + M[8] * p.Z };
+        }
+    };
+
+    Rotation Multiply(const Rotation& a, const Rotation& b)
+    {
+        Rotation result = {};
+
+        for (int j = 0; j < 3; j++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                for (int l = 0; l < 3; l++)
+                    result.M[j * 3 + k] += a.M[j * 3 + l] * b.M[l * 3 + k];
+            }
+        }
+
+        return result;
+    }
+
+    Rotation FromAxisAngle(const Vector3& axis, float angle)
+    {
+        float c = std::cos(angle), s = std::sin(angle), C = 1.0f - c;
+        float x = axis.X, y = axis.Y, z = axis.Z;
+
+        return { {
+            c + x * x * C, x * y * C - z * s, x * z * C + y * s,
+            y * x * C + z * s, c + y * y * C, y * z * C - x * s,
+            z * x * C - y * s, z * y * C + x * s, c + z * z * C } };
+    }
+
+    // Small deterministic generator, so that the scenes are the same with every standard library
+    class SceneNoise
+    {
+    public:
+        explicit SceneNoise(uint32_t seed) : state(seed * 2654435761u + 1) {}
+
+        // Uniform in (0, 1]
+        float NextUniform()
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return static_cast<float>((state & 0xFFFFFF) + 1) / 0x1000000;
+        }
+
+        float NextGaussian()
+        {
+            float u = NextUniform();
+            float v = NextUniform();
+            return std::sqrt(-2.0f * std::log(u)) * std::cos(2.0f * Pi * v);
+        }
+
+        Vector3 NextDirection()
+        {
+            return Normalize({ NextGaussian(), NextGaussian(), NextGaussian() });
+        }
+
+    private:
+        uint32_t state;
+    };
+
+    // Pose of a depth camera: its axes in world space (x right, y down, z forward) and its center
+    struct CameraPose
+    {
+        Rotation DepthToWorld;
+        Vector3 Center;
+    };
+
+    CameraPose LookAt(const Vector3& center, const Vector3& target)
+    {
+        const Vector3 up = { 0.0f, 1.0f, 0.0f };
+
+        Vector3 z = Normalize(target - center);
+        Vector3 y = Normalize(z * Dot(up, z) - up);
+        Vector3 x = Cross(y, z);
+
+        return { { { x.X, y.X, z.X, x.Y, y.Y, z.Y, x.Z, y.Z, z.Z } }, center };
+    }
+
+    float MinPositive(float a, float b)
+    {
+        if (a <= 0.0f) return b;
+        if (b <= 0.0f) return a;
+        return (std::min)(a, b);
+    }
+
+    // Hits of the rays origin + t * direction with the surfaces of the scene; 0 when they miss
+    float HitBox(const Vector3& origin, const Vector3& direction, const Vector3& minCorner, const Vector3& maxCorner)
+    {
+        float tMin = 0.0f, tMax = std::numeric_limits<float>::max();
+        const float o[3] = { origin.X, origin.Y, origin.Z }, d[3] = { direction.X, direction.Y, direction.Z };
+        const float lo[3] = { minCorner.X, minCorner.Y, minCorner.Z }, hi[3] = { maxCorner.X, maxCorner.Y, maxCorner.Z };
+
+        for (int i = 0; i < 3; i++)
+        {
+            if (std::fabs(d[i]) < 1e-9f)
+            {
+                if (o[i] < lo[i] || o[i] > hi[i])
+                    return 0.0f;
+                continue;
+            }
+
+            float t0 = (lo[i] - o[i]) / d[i], t1 = (hi[i] - o[i]) / d[i];
+            tMin = (std::max)(tMin, (std::min)(t0, t1));
+            tMax = (std::min)(tMax, (std::max)(t0, t1));
+
+            if (tMin > tMax)
+                return 0.0f;
+        }
+
+        return tMin;
+    }
+
+    float HitSphere(const Vector3& origin, const Vector3& direction, const Vector3& center, float radius)
+    {
+        Vector3 offset = origin - center;
+        float a = Dot(direction, direction), b = Dot(offset, direction), c = Dot(offset, offset) - radius * radius;
+        float discriminant = b * b - a * c;
+
+        if (discriminant < 0.0f)
+            return 0.0f;
+
+        float root = std::sqrt(discriminant);
+        return MinPositive((-b - root) / a, (-b + root) / a);
+    }
+
+    // Vertical cylinder standing on the floor, with its top closed
+    float HitCylinder(const Vector3& origin, const Vector3& direction, float centerX, float centerZ, float radius, float height)
+    {
+        float t = 0.0f;
+        float ox = origin.X - centerX, oz = origin.Z - centerZ;
+        float a = direction.X * direction.X + direction.Z * direction.Z;
+        float b = ox * direction.X + oz * direction.Z;
+        float c = ox * ox + oz * oz - radius * radius;
+        float discriminant = b * b - a * c;
+
+        if (a > 1e-9f && discriminant >= 0.0f)
+        {
+            float root = std::sqrt(discriminant);
+
+            for (float candidate : { (-b - root) / a, (-b + root) / a })
+            {
+                float y = origin.Y + candidate * direction.Y;
+
+                if (candidate > 0.0f && y >= 0.0f && y <= height)
+                    t = MinPositive(t, candidate);
+            }
+        }
+
+        if (std::fabs(direction.Y) > 1e-9f)
+        {
+            float candidate = (height - origin.Y) / direction.Y;
+            float x = origin.X + candidate * direction.X - centerX, z = origin.Z + candidate * direction.Z - centerZ;
+
+            if (candidate > 0.0f && x * x + z * z <= radius * radius)
+                t = MinPositive(t, candidate);
+        }
+
+        return t;
+    }
+
+    /// <summary>
+    /// Depth of the first surface of the synthetic scene along a ray: the floor of the Holoport, a table with a box on
+    /// it and a person standing beside it. With the direction of a depth pixel (its ray with a depth of 1), the
+    /// distance along the ray is the depth.
+    /// </summary>
+    float TraceSyntheticScene(const Vector3& origin, const Vector3& direction)
+    {
+        const float FloorRadius = 3.0f;
+
+        float t = 0.0f;
+
+        if (direction.Y < 0.0f)
+        {
+            float floor = -origin.Y / direction.Y;
+            Vector3 hit = origin + direction * floor;
+
+            if (hit.X * hit.X + hit.Z * hit.Z <= FloorRadius * FloorRadius)
+                t = floor;
+        }
+
+        t = MinPositive(t, HitBox(origin, direction, { -0.5f, 0.0f, -0.35f }, { 0.5f, 0.75f, 0.35f }));
+        t = MinPositive(t, HitBox(origin, direction, { -0.35f, 0.75f, -0.2f }, { -0.1f, 0.95f, 0.05f }));
+        t = MinPositive(t, HitCylinder(origin, direction, 0.1f, 0.75f, 0.2f, 1.7f));
+        t = MinPositive(t, HitSphere(origin, direction, { 0.1f, 1.82f, 0.75f }, 0.12f));
+
+        return t;
+    }
+
+    /// <summary>
+    /// Fills the points of a camera from its depth frame and true pose, and moves them by a calibration error of the
+    /// given size around the center of the camera, in a random direction
+    /// </summary>
+    void BuildCamera(const CameraPose& pose, bool isCalibrationErrorApplied, const BenchmarkSceneParams& params, SceneNoise& noise,
+        BenchmarkCamera& camera)
+    {
+        Rotation errorRotation = { { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f } };
+        Vector3 errorTranslation = { 0.0f, 0.0f, 0.0f };
+
+        if (isCalibrationErrorApplied)
+        {
+            errorRotation = FromAxisAngle(noise.NextDirection(), params.RotationErrorDeg * Pi / 180.0f);
+            errorTranslation = noise.NextDirection() * (params.TranslationErrorMm / 1000.0f);
+        }
+
+        Rotation depthToWorld = Multiply(errorRotation, pose.DepthToWorld);
+        Vector3 center = pose.Center + errorTranslation;
+
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+                camera.DepthToWorld[i * 4 + j] = depthToWorld.M[i * 3 + j];
+        }
+
+        camera.DepthToWorld[3] = center.X;
+        camera.DepthToWorld[7] = center.Y;
+        camera.DepthToWorld[11] = center.Z;
+
+        int step = (std::max)(1, params.PixelStep);
+        camera.Points.clear();
+        camera.TruePoints.clear();
+
+        for (int v = 0; v < camera.Height; v += step)
+        {
+            for (int u = 0; u < camera.Width; u += step)
+            {
+                unsigned short d = camera.Depth[v * camera.Width + u];
+
+                if (d == 0)
+                    continue;
+
+                float z = d / 1000.0f;
+                Vector3 point = { (u - camera.Intrinsics[2]) / camera.Intrinsics[0] * z, (v - camera.Intrinsics[3]) / camera.Intrinsics[1] * z, z };
+                Vector3 truePoint = pose.DepthToWorld.Apply(point) + pose.Center;
+                Vector3 movedPoint = depthToWorld.Apply(point) + center;
+
+                camera.TruePoints.insert(camera.TruePoints.end(), { truePoint.X, truePoint.Y, truePoint.Z });
+                camera.Points.insert(camera.Points.end(), { movedPoint.X, movedPoint.Y, movedPoint.Z });
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Renders the depth frames of a ring of cameras around the synthetic scene. The first camera keeps its true pose; the
+/// others are moved by the calibration error of the parameters.
+/// </summary>
+void GenerateSyntheticScene(const BenchmarkSceneParams& params, BenchmarkScene& scene)
+{
+    int numCameras = (std::max)(2, params.NumCameras);
+    SceneNoise noise(params.Seed);
+
+    scene.Name = "synthetic";
+    scene.Cameras.assign(numCameras, BenchmarkCamera());
+
+    for (int c = 0; c < numCameras; c++)
+    {
+        BenchmarkCamera& camera = scene.Cameras[c];
+        camera.Width = SyntheticWidth;
+        camera.Height = SyntheticHeight;
+        camera.Intrinsics[0] = SyntheticFocalLength;
+        camera.Intrinsics[1] = SyntheticFocalLength;
+        camera.Intrinsics[2] = SyntheticWidth / 2.0f;
+        camera.Intrinsics[3] = SyntheticHeight / 2.0f;
+        camera.Depth.assign(static_cast<size_t>(SyntheticWidth) * SyntheticHeight, 0);
+
+        float angle = 2.0f * Pi * c / numCameras + Pi / 4.0f;
+        CameraPose pose = LookAt({ RingRadius * std::cos(angle), CameraHeight, RingRadius * std::sin(angle) }, { 0.0f, LookAtHeight, 0.0f });
+
+        for (int v = 0; v < SyntheticHeight; v++)
+        {
+            for (int u = 0; u < SyntheticWidth; u++)
+            {
+                Vector3 ray = { (u - camera.Intrinsics[2]) / SyntheticFocalLength, (v - camera.Intrinsics[3]) / SyntheticFocalLength, 1.0f };
+                float depth = TraceSyntheticScene(pose.Center, pose.DepthToWorld.Apply(ray));
+
+                if (depth < MinDepth || depth > MaxDepth)
+                    continue;
+
+                depth += noise.NextGaussian() * params.NoiseMm / 1000.0f * depth * depth;
+                camera.Depth[v * SyntheticWidth + u] = static_cast<unsigned short>(std::lround(depth * 1000.0f));
+            }
+        }
+
+        BuildCamera(pose, c > 0, params, noise, camera);
+    }
+}
+
+/// <summary>
+/// Builds a scene of two cameras from the first two frames of a raw recording: the first camera keeps the left part
+/// of the first frame and the second one the right part of the second frame, moved by the calibration error of the
+/// parameters. The world space is the depth camera space of the recording.
+/// </summary>
+/// <returns>False if the recording could not be read</returns>
+bool LoadRecordedScene(const std::string& path, const BenchmarkSceneParams& params, BenchmarkScene& scene)
+{
+    RawFrameReader reader;
+    RawFrame frames[2];
+
+    if (!reader.Open(path) || !reader.ReadFrame(frames[0]))
+        return false;
+
+    // A recording of a single frame gives both cameras the same noise
+    if (!reader.ReadFrame(frames[1]) || frames[1].Header.DepthWidth != frames[0].Header.DepthWidth
+        || frames[1].Header.DepthHeight != frames[0].Header.DepthHeight)
+        frames[1] = frames[0];
+
+    const RawFrameHeader& header = frames[0].Header;
+    int width = header.DepthWidth;
+    int height = header.DepthHeight;
+    float overlap = (std::min)(1.0f, (std::max)(0.0f, params.Overlap));
+    int firstEnd = static_cast<int>(std::lround(width * (0.5f + overlap / 2.0f)));
+    int secondBegin = static_cast<int>(std::lround(width * (0.5f - overlap / 2.0f)));
+
+    SceneNoise noise(params.Seed);
+    CameraPose pose = { { { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f } }, { 0.0f, 0.0f, 0.0f } };
+
+    scene.Name = path;
+    scene.Cameras.assign(2, BenchmarkCamera());
+
+    for (int c = 0; c < 2; c++)
+    {
+        BenchmarkCamera& camera = scene.Cameras[c];
+        camera.Width = width;
+        camera.Height = height;
+        camera.Intrinsics[0] = header.CameraParams.DepthFx;
+        camera.Intrinsics[1] = header.CameraParams.DepthFy;
+        camera.Intrinsics[2] = header.CameraParams.DepthCx;
+        camera.Intrinsics[3] = header.CameraParams.DepthCy;
+        camera.Depth.assign(frames[c].Depth.begin(), frames[c].Depth.end());
+
+        int begin = c == 0 ? 0 : secondBegin;
+        int end = c == 0 ? firstEnd : width;
+
+        for (int v = 0; v < height; v++)
+        {
+            for (int u = 0; u < width; u++)
+            {
+                if (u < begin || u >= end)
+                    camera.Depth[v * width + u] = 0;
+            }
+        }
+
+        BuildCamera(pose, c > 0, params, noise, camera);
+    }
+
+    return true;
+}
@@ -0,0 +1,776 @@
+/***************************************************************************\
+
+Module Name:  ICPBenchmark.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is a console application which benchmarks the alignments of
+the ICP library on scenes whose true camera poses are known: synthetic rigs
+with noise and partial overlap, and pairs of frames of raw recordings. Each
+alignment variant is timed, its iterations are counted and the remaining
+error of the poses is measured; the single resolution alignments are also
+traced one iteration at a time, to show when they converge. The results are
+written as JSON, so that the number of iterations and the alignment of a
+rig can be chosen from them.
+
+\***************************************************************************/
+
+#include "icp.h"
+#include "benchmarkScenes.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+
+// Version of the layout of the results, changed whenever a field changes meaning
+const int ResultsVersion = 1;
+
+namespace
+{
+    // An iteration of a trace has converged once its errors are within these of the errors of the last iteration
+    const double ConvergedRotationDeg = 0.05;
+    const double ConvergedTranslationMm = 0.5;
+
+    // The points of a camera overlap the reference camera when they are this close to one of its points, in meters
+    const float OverlapDistance = 0.01f;
+
+    struct BenchmarkOptions
+    {
+        std::vector<std::string> RecordingPaths; // Synthetic scene when empty
+        std::string OutputPath; // Standard output when empty
+        BenchmarkSceneParams SceneParams;
+        int MaxIterations = 30; // Of each level
+        int NumLevels = 3;
+        float CoarsestVoxelSize = 0.04f;
+        int NumRefineIterations = 2;
+        int MaxSamplesPerCamera = 4000; // Of the sampled joint alignments
+        int ProjectiveSampleStep = 4;
+        float ProjectiveMaxDistance = 0.05f;
+        int NumRepeats = 3;
+        bool IsGpuBenchmarked = true;
+    };
+
+    // Remaining misalignment of a camera: the rigid transform from its points to where they truly are
+    struct PoseError
+    {
+        double RotationDeg = 0.0;
+        double TranslationMm = 0.0; // At the centroid of the points
+        double RmsMm = 0.0;
+    };
+
+    struct TraceIteration
+    {
+        double ElapsedMs = 0.0; // Since the start of the alignments, including the creation of their targets
+        double RotationDeg = 0.0; // Mean of the cameras
+        double TranslationMm = 0.0;
+    };
+
+    struct VariantResult
+    {
+        std::string Name;
+        std::string Backend;
+        double TimeMs = 0.0; // Median of the repeats
+        float AlignmentError = 0.0f; // As returned by the alignments
+        int NumAlignments = 0; // Calls of the alignment, or cameras aligned by one call
+        std::vector<int> IterationsPerLevel; // Summed over the alignments; empty when the alignment does not report them
+        std::vector<PoseError> Errors; // Of each camera but the reference
+        std::vector<TraceIteration> Trace; // From the initial errors, one entry per iteration; empty when not traced
+        int ConvergedIteration = -1;
+        double TimeToConvergenceMs = 0.0;
+    };
+
+    struct SceneResult
+    {
+        std::string Name;
+        std::vector<size_t> NumPoints; // Of each camera
+        std::vector<double> Overlaps; // Fraction of the points of each camera which the reference camera also sees
+        std::vector<PoseError> InitialErrors;
+        std::vector<VariantResult> Variants;
+    };
+
+    // Working copy of the points of the cameras, which the alignments move in place
+    typedef std::vector<std::vector<float>> CameraPoints;
+
+    // Runs a variant on a copy of the points of the scene; returns the points where the variant moved them
+    typedef std::function<void(CameraPoints& points, VariantResult& result)> Variant;
+
+    void PrintUsage()
+    {
+        std::cerr << "Usage: ICPBenchmark [--recording <raw recording>]... [--cameras <count>] [--noise <mm at 1 m>] [--overlap <fraction>]" << std::endl
+            << "                    [--step <pixels>] [--rotation-error <degrees>] [--translation-error <mm>] [--seed <seed>]" << std::endl
+            << "                    [--iterations <count>] [--levels <count>] [--voxel-size <m>] [--refine-iterations <count>]" << std::endl
+            << "                    [--samples <count>] [--repeats <count>] [--no-gpu] [--output <results.json>]" << std::endl
+            << "Benchmarks the alignments on a synthetic rig, or on pairs of frames of raw recordings." << std::endl;
+    }
+
+    bool ParseOptions(int argc, char** argv, BenchmarkOptions& options)
+    {
+        BenchmarkSceneParams& scene = options.SceneParams;
+
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (arg == "--recording" && hasValue)
+                options.RecordingPaths.push_back(argv[++i]);
+            else if (arg == "--output" && hasValue)
+                options.OutputPath = argv[++i];
+            else if (arg == "--cameras" && hasValue)
+                scene.NumCameras = (std::max)(2, std::atoi(argv[++i]));
+            else if (arg == "--noise" && hasValue)
+                scene.NoiseMm = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--overlap" && hasValue)
+                scene.Overlap = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--step" && hasValue)
+                scene.PixelStep = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--rotation-error" && hasValue)
+                scene.RotationErrorDeg = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--translation-error" && hasValue)
+                scene.TranslationErrorMm = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--seed" && hasValue)
+                scene.Seed = static_cast<unsigned int>(std::atoi(argv[++i]));
+            else if (arg == "--iterations" && hasValue)
+                options.MaxIterations = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--levels" && hasValue)
+                options.NumLevels = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--voxel-size" && hasValue)
+                options.CoarsestVoxelSize = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--refine-iterations" && hasValue)
+                options.NumRefineIterations = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--samples" && hasValue)
+                options.MaxSamplesPerCamera = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--repeats" && hasValue)
+                options.NumRepeats = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--no-gpu")
+                options.IsGpuBenchmarked = false;
+            else
+                return false;
+        }
+
+        return true;
+    }
+
+    Point3f* AsPoints(std::vector<float>& points)
+    {
+        return reinterpret_cast<Point3f*>(points.data());
+    }
+
+    int NumPoints(const std::vector<float>& points)
+    {
+        return static_cast<int>(points.size() / 3);
+    }
+
+    double ElapsedMs(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /// <summary>
+    /// Measures how far points are from where they truly are, as the rigid transform between them (Kabsch)
+    /// </summary>
+    PoseError GetPoseError(const std::vector<float>& points, const std::vector<float>& truePoints)
+    {
+        PoseError error;
+        size_t numPoints = points.size() / 3;
+
+        if (numPoints == 0)
+            return error;
+
+        cv::Vec3d centroid, trueCentroid;
+        double squaredDistances = 0.0;
+
+        for (size_t i = 0; i < numPoints; i++)
+        {
+            cv::Vec3d p(points[3 * i], points[3 * i + 1], points[3 * i + 2]);
+            cv::Vec3d q(truePoints[3 * i], truePoints[3 * i + 1], truePoints[3 * i + 2]);
+
+            centroid += p;
+            trueCentroid += q;
+            squaredDistances += (q - p).dot(q - p);
+        }
+
+        centroid /= static_cast<double>(numPoints);
+        trueCentroid /= static_cast<double>(numPoints);
+
+        cv::Matx33d crossCov = cv::Matx33d::zeros();
+
+        for (size_t i = 0; i < numPoints; i++)
+        {
+            cv::Vec3d p = cv::Vec3d(points[3 * i], points[3 * i + 1], points[3 * i + 2]) - centroid;
+            cv::Vec3d q = cv::Vec3d(truePoints[3 * i], truePoints[3 * i + 1], truePoints[3 * i + 2]) - trueCentroid;
+            crossCov += p * q.t();
+        }
+
+        cv::Mat w, u, vt;
+        cv::SVD::compute(cv::Mat(crossCov), w, u, vt);
+        cv::Mat rotation = vt.t() * u.t();
+
+        // Ensure a proper rotation (handle reflection case)
+        if (cv::determinant(rotation) < 0)
+        {
+            cv::Mat reflexionFix = cv::Mat::eye(3, 3, CV_64F);
+            reflexionFix.at<double>(2, 2) = -1.0;
+            rotation = vt.t() * reflexionFix * u.t();
+        }
+
+        double cosine = (std::min)(1.0, (std::max)(-1.0, (cv::trace(rotation)[0] - 1.0) / 2.0));
+
+        error.RotationDeg = std::acos(cosine) * 180.0 / CV_PI;
+        error.TranslationMm = cv::norm(trueCentroid - centroid) * 1000.0;
+        error.RmsMm = std::sqrt(squaredDistances / numPoints) * 1000.0;
+
+        return error;
+    }
+
+    std::vector<PoseError> GetPoseErrors(const BenchmarkScene& scene, const CameraPoints& points)
+    {
+        std::vector<PoseError> errors;
+
+        for (size_t c = 1; c < scene.Cameras.size(); c++)
+            errors.push_back(GetPoseError(points[c], scene.Cameras[c].TruePoints));
+
+        return errors;
+    }
+
+    /// <summary>
+    /// Fraction of the true points of each camera which are close to a true point of the reference camera
+    /// </summary>
+    std::vector<double> GetOverlaps(const BenchmarkScene& scene)
+    {
+        std::vector<double> overlaps;
+        const std::vector<float>& reference = scene.Cameras[0].TruePoints;
+
+        PointCloud cloud;
+        cloud.Points.assign(reinterpret_cast<const Point3f*>(reference.data()), reinterpret_cast<const Point3f*>(reference.data()) + NumPoints(reference));
+        PointCloudKDTree tree(3, cloud);
+        tree.buildIndex();
+
+        for (size_t c = 1; c < scene.Cameras.size(); c++)
+        {
+            const std::vector<float>& truePoints = scene.Cameras[c].TruePoints;
+            int numPoints = NumPoints(truePoints);
+            int numOverlapping = 0;
+
+            for (int i = 0; i < numPoints; i++)
+            {
+                size_t index;
+                float distance;
+                nanoflann::KNNResultSet<float> resultSet(1);
+                resultSet.init(&index, &distance);
+                tree.findNeighbors(resultSet, &truePoints[3 * i], nanoflann::SearchParams());
+
+                if (resultSet.size() > 0 && distance <= OverlapDistance * OverlapDistance)
+                    numOverlapping++;
+            }
+
+            overlaps.push_back(numPoints > 0 ? static_cast<double>(numOverlapping) / numPoints : 0.0);
+        }
+
+        return overlaps;
+    }
+
+    /// <summary>
+    /// Runs a variant on fresh copies of the points NumRepeats times, keeping the median time and the results of the
+    /// last run
+    /// </summary>
+    VariantResult RunVariant(const BenchmarkScene& scene, const BenchmarkOptions& options, const std::string& name,
+        const std::string& backend, const Variant& variant)
+    {
+        VariantResult result;
+        std::vector<double> times;
+        CameraPoints points;
+
+        for (int repeat = 0; repeat < options.NumRepeats; repeat++)
+        {
+            result = VariantResult();
+            result.Name = name;
+            result.Backend = backend;
+
+            points.clear();
+
+            for (const BenchmarkCamera& camera : scene.Cameras)
+                points.push_back(camera.Points);
+
+            auto start = std::chrono::steady_clock::now();
+            variant(points, result);
+            times.push_back(ElapsedMs(start));
+        }
+
+        std::sort(times.begin(), times.end());
+        result.TimeMs = times[times.size() / 2];
+        result.TimeToConvergenceMs = result.TimeMs;
+        result.Errors = GetPoseErrors(scene, points);
+
+        std::cerr << scene.Name << " " << name << " (" << backend << "): " << result.TimeMs << " ms" << std::endl;
+
+        return result;
+    }
+
+    /// <summary>
+    /// Aligns each camera to the reference camera one iteration at a time, to a target built once per camera, and
+    /// records the mean errors of the cameras after each iteration. The first entry holds the initial errors.
+    /// </summary>
+    void TraceAlignments(const BenchmarkScene& scene, const BenchmarkOptions& options, bool isPointToPlane, VariantResult& result)
+    {
+        std::vector<float> reference = scene.Cameras[0].Points;
+        size_t numCameras = scene.Cameras.size();
+
+        result.Trace.assign(options.MaxIterations + 1, TraceIteration());
+
+        for (size_t c = 1; c < numCameras; c++)
+        {
+            std::vector<float> source = scene.Cameras[c].Points;
+            float R[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+            float t[3] = { 0.0f, 0.0f, 0.0f };
+
+            auto start = std::chrono::steady_clock::now();
+            ICPTarget* target = CreateICPTarget(AsPoints(reference), NumPoints(reference), isPointToPlane);
+            double elapsedMs = ElapsedMs(start);
+
+            for (int iter = 0; iter <= options.MaxIterations; iter++)
+            {
+                if (iter > 0)
+                {
+                    start = std::chrono::steady_clock::now();
+
+                    if (isPointToPlane)
+                        ICPToTargetPointToPlane(target, AsPoints(source), NumPoints(source), R, t, 1);
+                    else
+                        ICPToTarget(target, AsPoints(source), NumPoints(source), R, t, 1);
+
+                    elapsedMs += ElapsedMs(start);
+                }
+
+                PoseError error = GetPoseError(source, scene.Cameras[c].TruePoints);
+                TraceIteration& traceIteration = result.Trace[iter];
+                traceIteration.ElapsedMs += elapsedMs;
+                traceIteration.RotationDeg += error.RotationDeg / (numCameras - 1);
+                traceIteration.TranslationMm += error.TranslationMm / (numCameras - 1);
+            }
+
+            DestroyICPTarget(target);
+        }
+
+        const TraceIteration& last = result.Trace.back();
+
+        for (int iter = 0; iter <= options.MaxIterations; iter++)
+        {
+            const TraceIteration& traceIteration = result.Trace[iter];
+
+            if (traceIteration.RotationDeg <= last.RotationDeg + ConvergedRotationDeg
+                && traceIteration.TranslationMm <= last.TranslationMm + ConvergedTranslationMm)
+            {
+                result.ConvergedIteration = iter;
+                result.TimeToConvergenceMs = traceIteration.ElapsedMs;
+                break;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Moves points as the alignments do, p' = (p + t) * R with the points as rows
+    /// </summary>
+    void TransformPoints(std::vector<float>& points, const float* R, const float* t)
+    {
+        for (size_t i = 0; i + 2 < points.size(); i += 3)
+        {
+            float x = points[i] + t[0];
+            float y = points[i + 1] + t[1];
+            float z = points[i + 2] + t[2];
+
+            points[i] = x * R[0] + y * R[3] + z * R[6];
+            points[i + 1] = x * R[1] + y * R[4] + z * R[7];
+            points[i + 2] = x * R[2] + y * R[5] + z * R[8];
+        }
+    }
+
+    std::vector<float> GetIdentityRotations(size_t numCameras)
+    {
+        std::vector<float> Rs(9 * numCameras, 0.0f);
+
+        for (size_t c = 0; c < numCameras; c++)
+            Rs[9 * c] = Rs[9 * c + 4] = Rs[9 * c + 8] = 1.0f;
+
+        return Rs;
+    }
+
+    /// <summary>
+    /// Benchmarks all the variants on a scene, with the GPU nearest neighbour searches when requested and available
+    /// </summary>
+    SceneResult RunSceneBenchmarks(const BenchmarkScene& scene, const BenchmarkOptions& options, bool isGpuAvailable)
+    {
+        SceneResult sceneResult;
+        sceneResult.Name = scene.Name;
+        sceneResult.Overlaps = GetOverlaps(scene);
+
+        CameraPoints initialPoints;
+
+        for (const BenchmarkCamera& camera : scene.Cameras)
+        {
+            sceneResult.NumPoints.push_back(camera.Points.size() / 3);
+            initialPoints.push_back(camera.Points);
+        }
+
+        sceneResult.InitialErrors = GetPoseErrors(scene, initialPoints);
+
+        size_t numCameras = scene.Cameras.size();
+
+        // Pairwise alignments of each camera to the reference camera
+        auto Pairwise = [&](const std::function<float(std::vector<float>& target, std::vector<float>& source, float* R, float* t, int* iterationsPerLevel)>& align,
+            int numLevels)
+        {
+            return [&, align, numLevels](CameraPoints& points, VariantResult& result)
+            {
+                std::vector<int> iterationsPerLevel(numLevels);
+                result.IterationsPerLevel.assign(numLevels, 0);
+
+                for (size_t c = 1; c < numCameras; c++)
+                {
+                    float R[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+                    float t[3] = { 0.0f, 0.0f, 0.0f };
+
+                    std::fill(iterationsPerLevel.begin(), iterationsPerLevel.end(), 0);
+                    result.AlignmentError += align(points[0], points[c], R, t, iterationsPerLevel.data()) / (numCameras - 1);
+                    result.NumAlignments++;
+
+                    for (int level = 0; level < numLevels; level++)
+                        result.IterationsPerLevel[level] += iterationsPerLevel[level];
+                }
+            };
+        };
+
+        Variant pointToPoint = Pairwise([&](std::vector<float>& target, std::vector<float>& source, float* R, float* t, int* iterationsPerLevel)
+        {
+            // The point to point alignment has no stop criteria, so it runs all its iterations
+            iterationsPerLevel[0] = options.MaxIterations;
+            return ICP(AsPoints(target), AsPoints(source), NumPoints(target), NumPoints(source), R, t, options.MaxIterations);
+        }, 1);
+
+        Variant pointToPlane = [&](CameraPoints& points, VariantResult& result)
+        {
+            for (size_t c = 1; c < numCameras; c++)
+            {
+                float R[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };
+                float t[3] = { 0.0f, 0.0f, 0.0f };
+
+                result.AlignmentError += ICPPointToPlane(AsPoints(points[0]), AsPoints(points[c]), NumPoints(points[0]), NumPoints(points[c]),
+                    R, t, options.MaxIterations) / (numCameras - 1);
+                result.NumAlignments++;
+            }
+        };
+
+        auto MultiResolution = [&](bool isPointToPlane)
+        {
+            return Pairwise([&, isPointToPlane](std::vector<float>& target, std::vector<float>& source, float* R, float* t, int* iterationsPerLevel)
+            {
+                return ICPMultiResolution(AsPoints(target), AsPoints(source), NumPoints(target), NumPoints(source), R, t,
+                    options.MaxIterations, options.NumLevels, options.CoarsestVoxelSize, isPointToPlane, iterationsPerLevel);
+            }, options.NumLevels);
+        };
+
+        // Joint alignment of all the cameras to each other, as the server refines the poses, from all their points or from
+        // the samples of their overlap
+        auto AllPoses = [&](bool isPointToPlane, bool isSampled)
+        {
+            return [&, isPointToPlane, isSampled](CameraPoints& points, VariantResult& result)
+            {
+                std::vector<float> verts;
+                std::vector<int> numVertsPerCamera;
+
+                for (const std::vector<float>& cameraPoints : points)
+                {
+                    verts.insert(verts.end(), cameraPoints.begin(), cameraPoints.end());
+                    numVertsPerCamera.push_back(NumPoints(cameraPoints));
+                }
+
+                std::vector<float> Rs = GetIdentityRotations(numCameras);
+                std::vector<float> ts(3 * numCameras, 0.0f);
+                result.IterationsPerLevel.assign(options.NumLevels, 0);
+
+                result.AlignmentError = RefineAllPoses(AsPoints(verts), numVertsPerCamera.data(), static_cast<int>(numCameras), Rs.data(), ts.data(),
+                    options.NumRefineIterations, options.MaxIterations, options.NumLevels, options.CoarsestVoxelSize, isPointToPlane,
+                    isSampled ? options.MaxSamplesPerCamera : 0, result.IterationsPerLevel.data());
+                result.NumAlignments = static_cast<int>(numCameras - 1) * options.NumRefineIterations;
+
+                size_t offset = 0;
+
+                for (std::vector<float>& cameraPoints : points)
+                {
+                    std::copy(verts.begin() + offset, verts.begin() + offset + cameraPoints.size(), cameraPoints.begin());
+                    offset += cameraPoints.size();
+                }
+            };
+        };
+
+        // Joint alignment from the depth frames, which moves no point: the corrections are applied to the points after
+        Variant projective = [&](CameraPoints& points, VariantResult& result)
+        {
+            std::vector<unsigned short> depths;
+            std::vector<int> widths, heights;
+            std::vector<float> intrinsics, depthToWorld;
+
+            for (const BenchmarkCamera& camera : scene.Cameras)
+            {
+                depths.insert(depths.end(), camera.Depth.begin(), camera.Depth.end());
+                widths.push_back(camera.Width);
+                heights.push_back(camera.Height);
+                intrinsics.insert(intrinsics.end(), camera.Intrinsics, camera.Intrinsics + 4);
+                depthToWorld.insert(depthToWorld.end(), camera.DepthToWorld, camera.DepthToWorld + 12);
+            }
+
+            std::vector<float> Rs = GetIdentityRotations(numCameras);
+            std::vector<float> ts(3 * numCameras, 0.0f);
+            int numIterations = 0;
+
+            result.AlignmentError = RefineAllPosesProjective(depths.data(), widths.data(), heights.data(), intrinsics.data(), depthToWorld.data(),
+                static_cast<int>(numCameras), Rs.data(), ts.data(), options.MaxIterations, options.ProjectiveSampleStep, options.ProjectiveMaxDistance,
+                &numIterations);
+            result.NumAlignments = 1;
+            result.IterationsPerLevel.assign(1, numIterations);
+
+            for (size_t c = 1; c < numCameras; c++)
+                TransformPoints(points[c], &Rs[9 * c], &ts[3 * c]);
+        };
+
+        struct NamedVariant
+        {
+            std::string Name;
+            Variant Run;
+            bool IsNeighbourSearchUsed; // The variant searches nearest neighbours, which the GPU and the voxel hashes can do
+            int TracedAlignment; // 0: not traced, 1: point to point, 2: point to plane
+        };
+
+        std::vector<NamedVariant> variants = {
+            { "PointToPoint", pointToPoint, true, 1 },
+            { "PointToPlane", pointToPlane, true, 2 },
+            { "MultiResolution", MultiResolution(false), true, 0 },
+            { "MultiResolution/PointToPlane", MultiResolution(true), true, 0 },
+            { "RefineAllPoses", AllPoses(false, false), true, 0 },
+            { "RefineAllPoses/PointToPlane", AllPoses(true, false), true, 0 },
+            { "RefineAllPoses/Sampled", AllPoses(false, true), true, 0 },
+            { "RefineAllPoses/PointToPlane/Sampled", AllPoses(true, true), true, 0 },
+            { "Projective", projective, false, 0 }
+        };
+
+        for (const NamedVariant& variant : variants)
+        {
+            VariantResult result = RunVariant(scene, options, variant.Name, "KDTree", variant.Run);
+
+            if (variant.TracedAlignment != 0)
+                TraceAlignments(scene, options, variant.TracedAlignment == 2, result);
+
+            sceneResult.Variants.push_back(result);
+        }
+
+        if (isGpuAvailable)
+        {
+            SetNeighbourSearchBackend(GpuGridSearch);
+
+            for (const NamedVariant& variant : variants)
+            {
+                if (variant.IsNeighbourSearchUsed)
+                    sceneResult.Variants.push_back(RunVariant(scene, options, variant.Name, "GPU", variant.Run));
+            }
+
+            SetNeighbourSearchBackend(KDTreeSearch);
+        }
+
+        // The targets get their voxel hash grids when they are created, within each run
+        SetNeighbourSearchBackend(VoxelHashSearch);
+
+        for (const NamedVariant& variant : variants)
+        {
+            if (variant.IsNeighbourSearchUsed)
+                sceneResult.Variants.push_back(RunVariant(scene, options, variant.Name, "VoxelHash", variant.Run));
+        }
+
+        SetNeighbourSearchBackend(KDTreeSearch);
+
+        return sceneResult;
+    }
+
+    std::string EscapeJson(const std::string& text)
+    {
+        std::string escaped;
+
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+
+            if (static_cast<unsigned char>(c) >= 0x20)
+                escaped += c;
+        }
+
+        return escaped;
+    }
+
+    void WritePoseErrors(std::ostream& out, const std::vector<PoseError>& errors)
+    {
+        out << "[";
+
+        for (size_t i = 0; i < errors.size(); i++)
+        {
+            out << (i > 0 ? ", " : "") << "{ \"rotationDeg\": " << errors[i].RotationDeg << ", \"translationMm\": " << errors[i].TranslationMm
+                << ", \"rmsMm\": " << errors[i].RmsMm << " }";
+        }
+
+        out << "]";
+    }
+
+    template <typename T>
+    void WriteArray(std::ostream& out, const std::vector<T>& values)
+    {
+        out << "[";
+
+        for (size_t i = 0; i < values.size(); i++)
+            out << (i > 0 ? ", " : "") << values[i];
+
+        out << "]";
+    }
+
+    void WriteResults(std::ostream& out, const BenchmarkOptions& options, bool isGpuAvailable, const std::vector<SceneResult>& scenes)
+    {
+        const BenchmarkSceneParams& params = options.SceneParams;
+
+        out << "{\n";
+        out << "  \"version\": " << ResultsVersion << ",\n";
+        out << "  \"maxIterations\": " << options.MaxIterations << ",\n";
+        out << "  \"levels\": " << options.NumLevels << ",\n";
+        out << "  \"coarsestVoxelSize\": " << options.CoarsestVoxelSize << ",\n";
+        out << "  \"refineIterations\": " << options.NumRefineIterations << ",\n";
+        out << "  \"samplesPerCamera\": " << options.MaxSamplesPerCamera << ",\n";
+        out << "  \"rotationErrorDeg\": " << params.RotationErrorDeg << ",\n";
+        out << "  \"translationErrorMm\": " << params.TranslationErrorMm << ",\n";
+        out << "  \"noiseMm\": " << params.NoiseMm << ",\n";
+        out << "  \"pixelStep\": " << params.PixelStep << ",\n";
+        out << "  \"gpuAvailable\": " << (isGpuAvailable ? "true" : "false") << ",\n";
+        out << "  \"scenes\": [\n";
+
+        for (size_t s = 0; s < scenes.size(); s++)
+        {
+            const SceneResult& scene = scenes[s];
+
+            out << "    {\n";
+            out << "      \"name\": \"" << EscapeJson(scene.Name) << "\",\n";
+            out << "      \"points\": ";
+            WriteArray(out, scene.NumPoints);
+            out << ",\n      \"overlaps\": ";
+            WriteArray(out, scene.Overlaps);
+            out << ",\n      \"initialErrors\": ";
+            WritePoseErrors(out, scene.InitialErrors);
+            out << ",\n      \"variants\": [\n";
+
+            for (size_t v = 0; v < scene.Variants.size(); v++)
+            {
+                const VariantResult& variant = scene.Variants[v];
+                double meanRotationDeg = 0.0, maxRotationDeg = 0.0, meanTranslationMm = 0.0, maxTranslationMm = 0.0;
+
+                for (const PoseError& error : variant.Errors)
+                {
+                    meanRotationDeg += error.RotationDeg / variant.Errors.size();
+                    meanTranslationMm += error.TranslationMm / variant.Errors.size();
+                    maxRotationDeg = (std::max)(maxRotationDeg, error.RotationDeg);
+                    maxTranslationMm = (std::max)(maxTranslationMm, error.TranslationMm);
+                }
+
+                out << "        { \"name\": \"" << variant.Name << "\", \"backend\": \"" << variant.Backend << "\", \"timeMs\": " << variant.TimeMs
+                    << ", \"alignments\": " << variant.NumAlignments << ", \"iterationsPerLevel\": ";
+                WriteArray(out, variant.IterationsPerLevel);
+                out << ", \"alignmentError\": " << variant.AlignmentError
+                    << ", \"meanRotationErrorDeg\": " << meanRotationDeg << ", \"maxRotationErrorDeg\": " << maxRotationDeg
+                    << ", \"meanTranslationErrorMm\": " << meanTranslationMm << ", \"maxTranslationErrorMm\": " << maxTranslationMm
+                    << ", \"convergedIteration\": " << variant.ConvergedIteration << ", \"timeToConvergenceMs\": " << variant.TimeToConvergenceMs
+                    << ", \"errors\": ";
+                WritePoseErrors(out, variant.Errors);
+
+                if (!variant.Trace.empty())
+                {
+                    out << ", \"trace\": [";
+
+                    for (size_t i = 0; i < variant.Trace.size(); i++)
+                    {
+                        const TraceIteration& traceIteration = variant.Trace[i];
+                        out << (i > 0 ? ", " : "") << "{ \"elapsedMs\": " << traceIteration.ElapsedMs << ", \"rotationDeg\": " << traceIteration.RotationDeg
+                            << ", \"translationMm\": " << traceIteration.TranslationMm << " }";
+                    }
+
+                    out << "]";
+                }
+
+                out << " }" << (v + 1 < scene.Variants.size() ? "," : "") << "\n";
+            }
+
+            out << "      ]\n    }" << (s + 1 < scenes.size() ? "," : "") << "\n";
+        }
+
+        out << "  ]\n}\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkOptions options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    std::vector<BenchmarkScene> scenes;
+
+    if (options.RecordingPaths.empty())
+    {
+        scenes.emplace_back();
+        GenerateSyntheticScene(options.SceneParams, scenes.back());
+    }
+
+    for (const std::string& path : options.RecordingPaths)
+    {
+        scenes.emplace_back();
+
+        if (!LoadRecordedScene(path, options.SceneParams, scenes.back()))
+        {
+            std::cerr << "Failed to read the frames of " << path << std::endl;
+            return 1;
+        }
+    }
+
+    // The GPU searches are only benchmarked when a GPU is available; the KD-trees are used otherwise
+    bool isGpuAvailable = options.IsGpuBenchmarked && SetNeighbourSearchBackend(GpuGridSearch);
+    SetNeighbourSearchBackend(KDTreeSearch);
+
+    if (options.IsGpuBenchmarked && !isGpuAvailable)
+        std::cerr << "No GPU is available for the nearest neighbour searches; only the KD-trees are benchmarked" << std::endl;
+
+    std::vector<SceneResult> results;
+
+    for (const BenchmarkScene& scene : scenes)
+        results.push_back(RunSceneBenchmarks(scene, options, isGpuAvailable));
+
+    if (options.OutputPath.empty())
+    {
+        WriteResults(std::cout, options, isGpuAvailable, results);
+    }
+    else
+    {
+        std::ofstream output(options.OutputPath);
+        WriteResults(output, options, isGpuAvailable, results);
+
+        if (!output)
+        {
+            std::cerr << "Failed to write the results to " << options.OutputPath << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
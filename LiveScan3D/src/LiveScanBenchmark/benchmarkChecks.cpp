@@ -0,0 +1,296 @@
+/***************************************************************************\
+
+Module Name:  BenchmarkChecks.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module checks the results of the benchmarks against those of a
+previous run, so that a change which slows the processing down or changes
+its output is caught. The point clouds of the frames are compared with the
+golden point clouds saved by a known good version, as sets of points within
+a tolerance, since the order of the points may change with the processing.
+The median times are compared with a baseline saved on the same class of
+machine, which is recognized by its point cloud kernel and thread count.
+
+\***************************************************************************/
+
+#include "benchmarkChecks.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+namespace
+{
+    const uint32_t GoldenMagic = 0x44474C53; // "SLGD"
+    const uint32_t GoldenVersion = 1;
+
+    // A frame differs from its golden frame when more than this share of the points of either has no match in the other
+    const double MaxMismatchRatio = 0.001;
+    const int MaxColorDifference = 8; // On each channel, for the lossy color conversions of the kernels
+
+    // The benchmarks faster than this are left out of the timing checks, as their timings are mostly noise
+    const double MinRegressionNs = 20000.0;
+
+    uint64_t GetCellKey(int x, int y, int z)
+    {
+        const int64_t Offset = 1 << 20;
+        return (static_cast<uint64_t>(x + Offset) << 42) | (static_cast<uint64_t>(y + Offset) << 21) | static_cast<uint64_t>(z + Offset);
+    }
+
+    int GetCell(int coordinate, int cellSize)
+    {
+        return coordinate >= 0 ? coordinate / cellSize : (coordinate - cellSize + 1) / cellSize;
+    }
+
+    /// <summary>
+    /// Counts the points of a frame which have no point of the reference frame within the tolerance, with about the
+    /// same color
+    /// </summary>
+    size_t CountUnmatchedPoints(const GoldenFrame& reference, const GoldenFrame& frame, int toleranceMm)
+    {
+        int cellSize = (std::max)(1, toleranceMm);
+        std::unordered_map<uint64_t, std::vector<size_t>> cells;
+        cells.reserve(reference.Vertices.size());
+
+        for (size_t i = 0; i < reference.Vertices.size(); i++)
+        {
+            const Point3s& vertex = reference.Vertices[i];
+            cells[GetCellKey(GetCell(vertex.X, cellSize), GetCell(vertex.Y, cellSize), GetCell(vertex.Z, cellSize))].push_back(i);
+        }
+
+        auto IsMatch = [&](const Point3s& vertex, const RGB& color, size_t j)
+        {
+            const Point3s& other = reference.Vertices[j];
+            const RGB& otherColor = reference.Colors[j];
+
+            return std::abs(vertex.X - other.X) <= toleranceMm && std::abs(vertex.Y - other.Y) <= toleranceMm
+                && std::abs(vertex.Z - other.Z) <= toleranceMm
+                && std::abs(color.Red - otherColor.Red) <= MaxColorDifference
+                && std::abs(color.Green - otherColor.Green) <= MaxColorDifference
+                && std::abs(color.Blue - otherColor.Blue) <= MaxColorDifference;
+        };
+
+        size_t numUnmatched = 0;
+
+        for (size_t i = 0; i < frame.Vertices.size(); i++)
+        {
+            const Point3s& vertex = frame.Vertices[i];
+            int cellX = GetCell(vertex.X, cellSize), cellY = GetCell(vertex.Y, cellSize), cellZ = GetCell(vertex.Z, cellSize);
+            bool isMatched = false;
+
+            for (int dz = -1; dz <= 1 && !isMatched; dz++)
+            {
+                for (int dy = -1; dy <= 1 && !isMatched; dy++)
+                {
+                    for (int dx = -1; dx <= 1 && !isMatched; dx++)
+                    {
+                        auto cell = cells.find(GetCellKey(cellX + dx, cellY + dy, cellZ + dz));
+
+                        if (cell == cells.end())
+                            continue;
+
+                        for (size_t j : cell->second)
+                        {
+                            if (IsMatch(vertex, frame.Colors[i], j))
+                            {
+                                isMatched = true;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+
+            if (!isMatched)
+                numUnmatched++;
+        }
+
+        return numUnmatched;
+    }
+
+    // Finds the number of a "key": value pair in a line of the results
+    bool FindJsonNumber(const std::string& line, const std::string& key, double& value)
+    {
+        size_t position = line.find("\"" + key + "\": ");
+
+        if (position == std::string::npos)
+            return false;
+
+        value = std::strtod(line.c_str() + position + key.size() + 4, nullptr);
+        return true;
+    }
+
+    bool FindJsonString(const std::string& line, const std::string& key, std::string& value)
+    {
+        size_t position = line.find("\"" + key + "\": \"");
+
+        if (position == std::string::npos)
+            return false;
+
+        size_t begin = position + key.size() + 5;
+        size_t end = line.find('"', begin);
+
+        if (end == std::string::npos)
+            return false;
+
+        value = line.substr(begin, end - begin);
+        return true;
+    }
+}
+
+/// <summary>
+/// Writes the processed points of the frames, as the golden frames of later runs
+/// </summary>
+bool WriteGoldenFrames(const std::string& path, const std::vector<GoldenFrame>& frames)
+{
+    std::ofstream file(path, std::ios::binary);
+    uint32_t header[3] = { GoldenMagic, GoldenVersion, static_cast<uint32_t>(frames.size()) };
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    for (const GoldenFrame& frame : frames)
+    {
+        uint32_t numPoints = static_cast<uint32_t>(frame.Vertices.size());
+        file.write(reinterpret_cast<const char*>(&numPoints), sizeof(numPoints));
+        file.write(reinterpret_cast<const char*>(frame.Vertices.data()), numPoints * sizeof(Point3s));
+        file.write(reinterpret_cast<const char*>(frame.Colors.data()), numPoints * sizeof(RGB));
+    }
+
+    return static_cast<bool>(file);
+}
+
+/// <summary>
+/// Reads the golden frames written by WriteGoldenFrames
+/// </summary>
+/// <returns>False if the file could not be read or was written by another version</returns>
+bool ReadGoldenFrames(const std::string& path, std::vector<GoldenFrame>& frames)
+{
+    std::ifstream file(path, std::ios::binary);
+    uint32_t header[3] = {};
+
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != GoldenMagic || header[1] != GoldenVersion)
+        return false;
+
+    frames.assign(header[2], GoldenFrame());
+
+    for (GoldenFrame& frame : frames)
+    {
+        uint32_t numPoints = 0;
+
+        if (!file.read(reinterpret_cast<char*>(&numPoints), sizeof(numPoints)))
+            return false;
+
+        frame.Vertices.resize(numPoints);
+        frame.Colors.resize(numPoints);
+        file.read(reinterpret_cast<char*>(frame.Vertices.data()), numPoints * sizeof(Point3s));
+        file.read(reinterpret_cast<char*>(frame.Colors.data()), numPoints * sizeof(RGB));
+    }
+
+    return static_cast<bool>(file);
+}
+
+/// <summary>
+/// Compares the processed points of the frames with the golden frames, in both directions, and reports the frames which
+/// differ on the standard error
+/// </summary>
+/// <param name="toleranceMm">Distance along each axis within which two points match</param>
+/// <returns>Number of frames which differ from their golden frame, the missing frames included</returns>
+int CountGoldenMismatches(const std::vector<GoldenFrame>& golden, const std::vector<GoldenFrame>& frames, int toleranceMm)
+{
+    int numFrames = static_cast<int>((std::min)(golden.size(), frames.size()));
+    int numMismatches = static_cast<int>((std::max)(golden.size(), frames.size())) - numFrames;
+
+    if (numMismatches > 0)
+        std::cerr << "The golden frames have " << golden.size() << " frames, the run " << frames.size() << std::endl;
+
+    for (int i = 0; i < numFrames; i++)
+    {
+        size_t numMissing = CountUnmatchedPoints(frames[i], golden[i], toleranceMm);
+        size_t numExtra = CountUnmatchedPoints(golden[i], frames[i], toleranceMm);
+        size_t numPoints = (std::max)(golden[i].Vertices.size(), frames[i].Vertices.size());
+
+        if ((std::max)(numMissing, numExtra) > MaxMismatchRatio * numPoints)
+        {
+            std::cerr << "Frame " << i << " differs from its golden frame: " << numMissing << " of its " << golden[i].Vertices.size()
+                << " golden points are missing, " << numExtra << " of its " << frames[i].Vertices.size() << " points are new" << std::endl;
+            numMismatches++;
+        }
+    }
+
+    return numMismatches;
+}
+
+/// <summary>
+/// Reads the machine class and the median times of the results written by a previous run
+/// </summary>
+bool ReadBaselineResults(const std::string& path, BaselineResults& baseline)
+{
+    std::ifstream file(path);
+
+    if (!file)
+        return false;
+
+    baseline = BaselineResults();
+    std::string line;
+    double value = 0.0;
+
+    // The results are written one benchmark, or one stage of the client, per line
+    while (std::getline(file, line))
+    {
+        std::string name;
+
+        if (FindJsonString(line, "name", name))
+        {
+            if (FindJsonNumber(line, "medianNs", value))
+                baseline.Timings.push_back({ name, value });
+            else if (FindJsonNumber(line, "p50Ms", value))
+                baseline.Timings.push_back({ "Client/" + name, value * 1e6 });
+        }
+        else if (FindJsonNumber(line, "threads", value))
+            baseline.NumThreads = static_cast<int>(value);
+        else if (FindJsonNumber(line, "depthWidth", value))
+            baseline.DepthWidth = static_cast<int>(value);
+        else if (FindJsonNumber(line, "depthHeight", value))
+            baseline.DepthHeight = static_cast<int>(value);
+        else
+        {
+            FindJsonString(line, "source", baseline.Source);
+            FindJsonString(line, "pointCloudKernel", baseline.PointCloudKernel);
+        }
+    }
+
+    return !baseline.Timings.empty();
+}
+
+/// <summary>
+/// Compares the median times with those of the baseline, and reports the regressions on the standard error. The
+/// benchmarks missing from either are skipped, as are those faster than MinRegressionNs in the baseline.
+/// </summary>
+/// <param name="maxRegression">Share by which a median time may exceed that of the baseline</param>
+/// <returns>Number of benchmarks slower than the baseline by more than maxRegression</returns>
+int CountTimingRegressions(const BaselineResults& baseline, const std::vector<BenchmarkTiming>& timings, double maxRegression)
+{
+    int numRegressions = 0;
+
+    for (const BenchmarkTiming& timing : timings)
+    {
+        auto reference = std::find_if(baseline.Timings.begin(), baseline.Timings.end(),
+            [&timing](const BenchmarkTiming& other) { return other.Name == timing.Name; });
+
+        if (reference == baseline.Timings.end() || reference->MedianNs < MinRegressionNs)
+            continue;
+
+        if (timing.MedianNs > reference->MedianNs * (1.0 + maxRegression))
+        {
+            std::cerr << timing.Name << " regressed: " << timing.MedianNs / 1e6 << " ms, against " << reference->MedianNs / 1e6
+                << " ms in the baseline" << std::endl;
+            numRegressions++;
+        }
+    }
+
+    return numRegressions;
+}
@@ -0,0 +1,242 @@
+/***************************************************************************\
+
+Module Name:  BenchmarkFrames.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module provides the frames the benchmarks of the client processing run
+on: the frames of a raw recording of a camera, or synthetic frames of a room
+with a table and a document, generated the same way on every machine. The
+synthetic frames can be written to a raw recording, so that they can also be
+replayed by a client.
+
+\***************************************************************************/
+
+#include "benchmarkFrames.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+namespace
+{
+    // Small deterministic generator, so that the synthetic frames are the same with every standard library
+    class SyntheticNoise
+    {
+    public:
+        explicit SyntheticNoise(uint32_t seed) : state(seed * 2654435761u + 1) {}
+
+        // Uniform in [-1, 1)
+        float Next()
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return static_cast<float>(state & 0xFFFFFF) / 0x800000 - 1.0f;
+        }
+
+    private:
+        uint32_t state;
+    };
+
+    RawCameraParams GetSyntheticCameraParams()
+    {
+        RawCameraParams params = {};
+        params.DepthFx = 504.0f;
+        params.DepthFy = 504.0f;
+        params.DepthCx = SyntheticDepthWidth / 2.0f;
+        params.DepthCy = SyntheticDepthHeight / 2.0f;
+        params.ColorFx = 690.0f;
+        params.ColorFy = 690.0f;
+        params.ColorCx = SyntheticColorWidth / 2.0f;
+        params.ColorCy = SyntheticColorHeight / 2.0f;
+        params.Rot[0] = params.Rot[4] = params.Rot[8] = 1.0f;
+        params.Trans[0] = -32.0f; // The color camera is 32 mm beside the depth camera
+
+        return params;
+    }
+
+    /// <summary>
+    /// Distance along the ray of a depth pixel to the synthetic scene: a back wall, a table top seen from above at an
+    /// angle, and for the frames after the background ones, a sheet of paper lying on the table
+    /// </summary>
+    /// <param name="documentOffsetX">Position of the document across the table, in the camera space of the ray</param>
+    /// <param name="isDocument">Set when the ray hits the document</param>
+    /// <returns>Depth of the hit in meters, or 0 when the ray hits nothing</returns>
+    float TraceSyntheticScene(float rayX, float rayY, bool isDocumentVisible, float documentOffsetX, bool& isDocument)
+    {
+        const float WallDepth = 3.0f;
+        const float TableHeight = 0.5f; // Below the camera
+        const float TableMinZ = 0.9f, TableMaxZ = 1.8f, TableHalfWidth = 0.6f;
+        const float DocumentMinZ = 1.2f, DocumentMaxZ = 1.5f, DocumentHalfWidth = 0.105f;
+
+        isDocument = false;
+        float depth = WallDepth;
+
+        // Table top: the plane y = TableHeight in camera space, with y pointing down
+        if (rayY > 0.0f)
+        {
+            float z = TableHeight / rayY;
+            float x = rayX * z;
+
+            if (z >= TableMinZ && z <= TableMaxZ && std::fabs(x) <= TableHalfWidth)
+            {
+                depth = z;
+
+                if (isDocumentVisible && z >= DocumentMinZ && z <= DocumentMaxZ && std::fabs(x - documentOffsetX) <= DocumentHalfWidth)
+                {
+                    // The sheet curls slightly above the table
+                    depth = (TableHeight - 0.004f) / rayY;
+                    isDocument = true;
+                }
+            }
+        }
+
+        return depth;
+    }
+}
+
+/// <summary>
+/// Reads the first frames of a raw recording
+/// </summary>
+/// <param name="maxFrames">Number of frames to read at most; the frames are kept in memory, each takes a few megabytes</param>
+/// <returns>False if the recording could not be opened or has no frame</returns>
+bool LoadRecordedFrames(const std::string& path, int maxFrames, std::vector<RawFrame>& frames, std::string& serialNumber)
+{
+    RawFrameReader reader;
+
+    if (!reader.Open(path))
+        return false;
+
+    serialNumber = reader.GetSerialNumber();
+    frames.clear();
+
+    while (static_cast<int>(frames.size()) < maxFrames)
+    {
+        RawFrame frame;
+
+        if (!reader.ReadFrame(frame))
+            break;
+
+        frames.push_back(std::move(frame));
+    }
+
+    return !frames.empty();
+}
+
+/// <summary>
+/// Generates the frames of a camera looking at a table, on which a document is placed after the first
+/// SyntheticBackgroundFrames frames and then slides slowly. The depth has about 1 mm of noise at 1 m, growing with
+/// the square of the depth like that of a time-of-flight camera, and a few pixels without depth.
+/// </summary>
+void GenerateSyntheticFrames(int numFrames, std::vector<RawFrame>& frames)
+{
+    RawCameraParams cameraParams = GetSyntheticCameraParams();
+    frames.resize(numFrames);
+
+    for (int i = 0; i < numFrames; i++)
+    {
+        RawFrame& frame = frames[i];
+        frame.Header = {};
+        frame.Header.Timestamp = static_cast<uint64_t>(i) * 33333;
+        frame.Header.DepthWidth = SyntheticDepthWidth;
+        frame.Header.DepthHeight = SyntheticDepthHeight;
+        frame.Header.ColorWidth = SyntheticColorWidth;
+        frame.Header.ColorHeight = SyntheticColorHeight;
+        frame.Header.CameraParams = cameraParams;
+
+        bool isDocumentVisible = i >= SyntheticBackgroundFrames;
+        float documentOffsetX = 0.002f * (i % 50);
+        SyntheticNoise noise(i);
+
+        frame.Depth.resize(static_cast<size_t>(SyntheticDepthWidth) * SyntheticDepthHeight);
+
+        for (int v = 0; v < SyntheticDepthHeight; v++)
+        {
+            float rayY = (v - cameraParams.DepthCy) / cameraParams.DepthFy;
+
+            for (int u = 0; u < SyntheticDepthWidth; u++)
+            {
+                float rayX = (u - cameraParams.DepthCx) / cameraParams.DepthFx;
+                bool isDocument = false;
+                float depth = TraceSyntheticScene(rayX, rayY, isDocumentVisible, documentOffsetX, isDocument);
+                float depthNoise = noise.Next();
+
+                // About one pixel in fifty has no depth
+                bool isMissing = std::fabs(depthNoise) > 0.98f;
+                depth += depthNoise * 0.001f * depth * depth;
+
+                frame.Depth[v * SyntheticDepthWidth + u] = isMissing || depth <= 0.0f ? 0 : static_cast<UINT16>(depth * 1000.0f + 0.5f);
+            }
+        }
+
+        // The color frame sees the same scene from the color camera: a grey wall, a brown table and a white document
+        // with lines of text
+        frame.Color.resize(static_cast<size_t>(SyntheticColorWidth) * SyntheticColorHeight * 3);
+
+        for (int v = 0; v < SyntheticColorHeight; v++)
+        {
+            float rayY = (v - cameraParams.ColorCy) / cameraParams.ColorFy;
+
+            for (int u = 0; u < SyntheticColorWidth; u++)
+            {
+                float rayX = (u - cameraParams.ColorCx) / cameraParams.ColorFx;
+                bool isDocument = false;
+                float depth = TraceSyntheticScene(rayX, rayY, isDocumentVisible, documentOffsetX + cameraParams.Trans[0] / 1000.0f, isDocument);
+
+                BYTE r = 120, g = 124, b = 128;
+
+                if (isDocument)
+                {
+                    // Lines of text every 8 mm of the sheet
+                    bool isText = static_cast<int>(depth * 1000.0f / 4.0f) % 2 == 0 && (u % 7) < 5;
+                    r = g = b = isText ? 40 : 235;
+                }
+                else if (depth < 2.9f)
+                {
+                    r = 110;
+                    g = 72;
+                    b = 40;
+                }
+
+                int grain = static_cast<int>(noise.Next() * 6.0f);
+                BYTE* pixel = &frame.Color[(static_cast<size_t>(v) * SyntheticColorWidth + u) * 3];
+                pixel[0] = static_cast<BYTE>((std::min)(255, (std::max)(0, r + grain)));
+                pixel[1] = static_cast<BYTE>((std::min)(255, (std::max)(0, g + grain)));
+                pixel[2] = static_cast<BYTE>((std::min)(255, (std::max)(0, b + grain)));
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Writes frames to a new raw recording in the working directory, waiting for the recorder rather than dropping frames
+/// </summary>
+/// <param name="path">Receives the name of the recording</param>
+bool WriteRecording(const std::vector<RawFrame>& frames, const std::string& serialNumber, std::string& path)
+{
+    RawFrameRecorder recorder;
+
+    if (!recorder.Start(0, serialNumber))
+        return false;
+
+    for (const RawFrame& frame : frames)
+    {
+        while (!recorder.WriteFrame(frame.Header, frame.Depth.data(), frame.Color.data()))
+        {
+            if (!recorder.IsRecording())
+                return false;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+
+    path = recorder.GetFilename();
+    recorder.Stop();
+
+    return true;
+}
@@ -0,0 +1,1075 @@
+/***************************************************************************\
+
+Module Name:  LiveScanBenchmark.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is a console application which benchmarks the processing of the
+clients offline, on the frames of a raw recording or on synthetic frames.
+The kernels are timed in isolation and chained like a client chains them,
+then a client of the LiveScanClient library replays the frames to time each
+stage of its frame loop. The results are written as JSON, so that they can
+be compared across versions to track regressions. The results of a previous
+run can be given as a baseline, and the frames a client publishes for the
+replayed frames checked against golden point clouds, in which case the exit
+code tells if the processing became slower or its output changed.
+
+\***************************************************************************/
+
+#include "benchmarkChecks.h"
+#include "benchmarkFrames.h"
+#include "pointCloudKernel.h"
+#include "voxelGridFilter.h"
+#include "voxelDensityCounter.h"
+#include "filter.h"
+#include "documentDetector.h"
+#include "taskScheduler.h"
+#include "liveScanClientApi.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Version of the layout of the results, changed whenever a field changes meaning
+const int ResultsVersion = 1;
+
+// Heap allocations of the benchmarked code compiled into this program. The allocations of OpenCV, and those of the
+// client library in the client benchmark, go through their own allocators and are not counted.
+static std::atomic<uint64_t> numAllocations{ 0 };
+static std::atomic<uint64_t> numAllocatedBytes{ 0 };
+
+void* operator new(size_t size)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    numAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+
+    if (void* memory = std::malloc(size > 0 ? size : 1))
+        return memory;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+namespace
+{
+    struct BenchmarkOptions
+    {
+        std::string RecordingPath; // Synthetic frames when empty
+        std::string OutputPath; // Standard output when empty
+        int NumFrames = 30;
+        int NumIterations = 100;
+        int NumClientFrames = 300;
+        bool IsClientBenchmarked = true;
+        std::string BaselinePath; // Results of a previous run on the same class of machine, not checked when empty
+        double MaxRegression = 0.1;
+        std::string GoldenPath; // Golden frames checked against, not checked when empty
+        std::string GoldenOutputPath; // Where the golden frames of this run are written, when not empty
+        int GoldenToleranceMm = 1;
+    };
+
+    struct BenchmarkResult
+    {
+        std::string Name;
+        int NumIterations = 0;
+        double NumPoints = 0.0; // Input points of an iteration, on average
+        double MeanNs = 0.0;
+        double MedianNs = 0.0;
+        double MinNs = 0.0;
+        double NumAllocations = 0.0; // Per iteration
+        double NumAllocatedBytes = 0.0;
+    };
+
+    struct ClientBenchmarkResult
+    {
+        bool IsCompleted = false;
+        int NumFrames = 0;
+        double FramesPerSecond = 0.0;
+        double PointsPerFrame = 0.0;
+        PerfStageStats Stages[NumPerfStages] = {};
+    };
+
+    // Buffers of the point cloud kernels, sized for a depth frame
+    struct KernelBuffers
+    {
+        PointBuffer Points;
+        std::vector<UINT16> AlignedDepth;
+
+        PointCloudKernelOutput GetOutput(bool isAlignedDepthRequested)
+        {
+            PointCloudKernelOutput output;
+            output.X = Points.X.data();
+            output.Y = Points.Y.data();
+            output.Z = Points.Z.data();
+            output.colors = Points.Colors.data();
+            output.pixelIndices = Points.PixelIndices.data();
+            output.alignedDepth = isAlignedDepthRequested ? AlignedDepth.data() : nullptr;
+
+            return output;
+        }
+    };
+
+    // Voxel grids of the same size as those of a client capturing a 4 m range
+    const float GridCenterZ = 2.0f;
+    const float GridHalfRange = 2.0f;
+    const float GridVoxelSize = 0.005f;
+    const float DensityVoxelSize = 0.006f;
+    const int MinDensityPoints = 12; // Density filter of a client with the voxels of the default range
+    const int FilterNeighbours = 10;
+    const float FilterThreshold = 0.01f;
+    const int ChunkSize = 4096; // Points of each task of the parallel insertions
+
+    // Exit code of a run whose timings regressed or whose output differs from the golden frames
+    const int CheckFailedExitCode = 2;
+
+    const char* PerfStageNames[NumPerfStages] = { "Frame", "Acquire", "FrameWait", "PointCloud", "Process", "Filter", "Document", "Store" };
+
+    void PrintUsage()
+    {
+        std::cerr << "Usage: LiveScanBenchmark [--recording <raw recording>] [--frames <count>] [--iterations <count>]" << std::endl
+            << "                         [--client-frames <count>] [--no-client] [--output <results.json>]" << std::endl
+            << "                         [--baseline <results.json>] [--max-regression <percent>]" << std::endl
+            << "                         [--golden <frames>] [--write-golden <frames>] [--golden-tolerance <mm>]" << std::endl
+            << "Benchmarks the processing of the clients on the first frames of a raw recording, or on synthetic frames." << std::endl
+            << "Exits with " << CheckFailedExitCode << " when a median time exceeds that of the baseline by more than the" << std::endl
+            << "maximum regression (10% by default), or when the processed points differ from the golden frames." << std::endl;
+    }
+
+    bool ParseOptions(int argc, char** argv, BenchmarkOptions& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (arg == "--recording" && hasValue)
+                options.RecordingPath = argv[++i];
+            else if (arg == "--output" && hasValue)
+                options.OutputPath = argv[++i];
+            else if (arg == "--frames" && hasValue)
+                options.NumFrames = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--iterations" && hasValue)
+                options.NumIterations = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--client-frames" && hasValue)
+                options.NumClientFrames = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--no-client")
+                options.IsClientBenchmarked = false;
+            else if (arg == "--baseline" && hasValue)
+                options.BaselinePath = argv[++i];
+            else if (arg == "--max-regression" && hasValue)
+                options.MaxRegression = (std::max)(0.0, std::atof(argv[++i]) / 100.0);
+            else if (arg == "--golden" && hasValue)
+                options.GoldenPath = argv[++i];
+            else if (arg == "--write-golden" && hasValue)
+                options.GoldenOutputPath = argv[++i];
+            else if (arg == "--golden-tolerance" && hasValue)
+                options.GoldenToleranceMm = (std::max)(0, std::atoi(argv[++i]));
+            else
+                return false;
+        }
+
+        return true;
+    }
+
+    /// <summary>
+    /// Times an iteration of body numIterations times, after one untimed iteration which brings the buffers to their
+    /// steady state capacity. prepare runs untimed before each iteration. The iterations cycle through the frames.
+    /// </summary>
+    /// <param name="body">Processes the frame of an iteration and returns the number of points it was given</param>
+    BenchmarkResult RunBenchmark(const std::string& name, int numIterations, const std::function<void(int)>& prepare,
+        const std::function<size_t(int)>& body)
+    {
+        prepare(0);
+        body(0);
+
+        std::vector<double> durationsNs(numIterations);
+        double totalPoints = 0.0;
+        uint64_t allocations = 0;
+        uint64_t allocatedBytes = 0;
+
+        for (int i = 0; i < numIterations; i++)
+        {
+            prepare(i);
+
+            uint64_t startAllocations = numAllocations.load(std::memory_order_relaxed);
+            uint64_t startAllocatedBytes = numAllocatedBytes.load(std::memory_order_relaxed);
+            auto start = std::chrono::steady_clock::now();
+
+            totalPoints += static_cast<double>(body(i));
+
+            durationsNs[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            allocations += numAllocations.load(std::memory_order_relaxed) - startAllocations;
+            allocatedBytes += numAllocatedBytes.load(std::memory_order_relaxed) - startAllocatedBytes;
+        }
+
+        BenchmarkResult result;
+        result.Name = name;
+        result.NumIterations = numIterations;
+        result.NumPoints = totalPoints / numIterations;
+        result.NumAllocations = static_cast<double>(allocations) / numIterations;
+        result.NumAllocatedBytes = static_cast<double>(allocatedBytes) / numIterations;
+
+        for (double duration : durationsNs)
+            result.MeanNs += duration / numIterations;
+
+        std::sort(durationsNs.begin(), durationsNs.end());
+        result.MedianNs = durationsNs[numIterations / 2];
+        result.MinNs = durationsNs.front();
+
+        std::cerr << name << ": " << result.MedianNs / 1e6 << " ms" << std::endl;
+
+        return result;
+    }
+
+    /// <summary>
+    /// Builds the unprojection rays of the depth pixels, as the capture managers do
+    /// </summary>
+    void BuildRayTable(const RawFrame& frame, std::vector<Point2f>& rays)
+    {
+        const RawCameraParams& params = frame.Header.CameraParams;
+        int width = frame.Header.DepthWidth;
+        int height = frame.Header.DepthHeight;
+        rays.resize(static_cast<size_t>(width) * height);
+
+        for (int v = 0; v < height; ++v)
+        {
+            float rayY = (v - params.DepthCy) / params.DepthFy;
+
+            for (int u = 0; u < width; ++u)
+                rays[v * width + u] = Point2f((u - params.DepthCx) / params.DepthFx, rayY);
+        }
+    }
+
+    /// <summary>
+    /// Parameters of the point cloud kernels for a frame, which output the points in color camera space without culling
+    /// </summary>
+    PointCloudKernelParams GetKernelParams(const RawFrame& frame, const UINT16* depth, const std::vector<Point2f>& rays)
+    {
+        const RawCameraParams& cameraParams = frame.Header.CameraParams;
+
+        PointCloudKernelParams params;
+        params.depth = depth;
+        params.rays = rays.data();
+        params.depthWidth = frame.Header.DepthWidth;
+        params.depthHeight = frame.Header.DepthHeight;
+        params.color = frame.Color.data();
+        params.colorWidth = frame.Header.ColorWidth;
+        params.colorHeight = frame.Header.ColorHeight;
+        params.colorFormat = ColorRgb888;
+        params.isColorVideoRange = false;
+        params.colorRgbx = nullptr;
+        params.colorFx = cameraParams.ColorFx;
+        params.colorFy = cameraParams.ColorFy;
+        params.colorCx = cameraParams.ColorCx;
+        params.colorCy = cameraParams.ColorCy;
+
+        for (int i = 0; i < 9; ++i)
+            params.rot[i] = cameraParams.Rot[i];
+
+        for (int i = 0; i < 3; ++i)
+            params.trans[i] = cameraParams.Trans[i] / 1000.0f;
+
+        SetIdentityWorldTransform(params);
+        DisableBoundsCulling(params);
+
+        return params;
+    }
+
+    /// <summary>
+    /// Converts the color frame of a recorded frame to full range NV12, as the MJPG frames are decoded when a YUV color
+    /// stream is requested
+    /// </summary>
+    std::vector<BYTE> ConvertToNv12(const RawFrame& frame)
+    {
+        int width = frame.Header.ColorWidth;
+        int height = frame.Header.ColorHeight;
+        cv::Mat ycrcb;
+        cv::cvtColor(cv::Mat(height, width, CV_8UC3, const_cast<BYTE*>(frame.Color.data())), ycrcb, cv::COLOR_RGB2YCrCb);
+
+        std::vector<BYTE> nv12(static_cast<size_t>(width) * height * 3 / 2);
+        BYTE* chroma = nv12.data() + static_cast<size_t>(width) * height;
+
+        for (int v = 0; v < height; v++)
+        {
+            const BYTE* pixel = ycrcb.ptr<BYTE>(v);
+
+            for (int u = 0; u < width; u++)
+                nv12[static_cast<size_t>(v) * width + u] = pixel[u * 3];
+
+            // The chroma of each 2x2 block is that of its top left pixel
+            if ((v & 1) == 0)
+            {
+                for (int u = 0; u + 1 < width; u += 2)
+                {
+                    chroma[static_cast<size_t>(v / 2) * width + u] = pixel[u * 3 + 2];
+                    chroma[static_cast<size_t>(v / 2) * width + u + 1] = pixel[u * 3 + 1];
+                }
+            }
+        }
+
+        return nv12;
+    }
+
+    /// <summary>
+    /// Inserts points in a voxel grid in parallel chunks; the point kept in each voxel depends on the thread timings
+    /// </summary>
+    size_t InsertPointsConcurrent(VoxelGridFilter& grid, const PointBuffer& points)
+    {
+        int numPoints = static_cast<int>(points.Size());
+        int numChunks = (numPoints + ChunkSize - 1) / ChunkSize;
+        std::atomic<int> numKept{ 0 };
+
+        grid.Reset();
+
+        TaskScheduler::Instance().ParallelFor(0, numChunks, [&](int chunk)
+        {
+            int end = (std::min)(numPoints, (chunk + 1) * ChunkSize);
+            int chunkKept = 0;
+
+            for (int i = chunk * ChunkSize; i < end; i++)
+            {
+                if (grid.InsertConcurrent(points.X[i], points.Y[i], points.Z[i]))
+                    chunkKept++;
+            }
+
+            numKept.fetch_add(chunkKept, std::memory_order_relaxed);
+        });
+
+        return numKept;
+    }
+
+    /// <summary>
+    /// Claims the voxels of points in parallel chunks, then keeps the first point of each voxel, as the processing of the
+    /// clients does
+    /// </summary>
+    size_t ClaimPointsConcurrent(VoxelGridFilter& grid, const PointBuffer& points, std::vector<uint32_t>& slots)
+    {
+        int numPoints = static_cast<int>(points.Size());
+        int numChunks = (numPoints + ChunkSize - 1) / ChunkSize;
+        std::atomic<int> numKept{ 0 };
+
+        slots.resize(numPoints);
+        grid.BeginClaims(numPoints);
+
+        TaskScheduler::Instance().ParallelFor(0, numChunks, [&](int chunk)
+        {
+            int end = (std::min)(numPoints, (chunk + 1) * ChunkSize);
+
+            for (int i = chunk * ChunkSize; i < end; i++)
+            {
+                if (!grid.ClaimConcurrent(points.X[i], points.Y[i], points.Z[i], 1, i, slots[i]))
+                    slots[i] = UINT32_MAX;
+            }
+        });
+
+        TaskScheduler::Instance().ParallelFor(0, numChunks, [&](int chunk)
+        {
+            int end = (std::min)(numPoints, (chunk + 1) * ChunkSize);
+            int chunkKept = 0;
+
+            for (int i = chunk * ChunkSize; i < end; i++)
+            {
+                if (slots[i] != UINT32_MAX && grid.IsClaimWinner(slots[i], i))
+                    chunkKept++;
+            }
+
+            numKept.fetch_add(chunkKept, std::memory_order_relaxed);
+        });
+
+        return numKept;
+    }
+
+    /// <summary>
+    /// Replays a raw recording with a client of the LiveScanClient library, as fast as the frames are processed, and
+    /// reads the timings of the stages of its frame loop
+    /// </summary>
+    ClientBenchmarkResult RunClientBenchmark(const std::string& path, int numFrames)
+    {
+        // The first frames, processed while the client fills its buffers, are not measured
+        const int NumWarmupFrames = 10;
+        const int FrameTimeoutMs = 5000;
+
+        ClientBenchmarkResult result;
+        LiveScanClientHandle client = CreateReplayClient(0, path.c_str(), false);
+        StartClient(client);
+
+        unsigned long long sequenceNumber = 0;
+        unsigned long long startSequenceNumber = 0;
+        double totalPoints = 0.0;
+        int numObservedFrames = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        while (WaitForFrame(client, sequenceNumber, FrameTimeoutMs))
+        {
+            const Point3s* vertices = nullptr;
+            const RGB* colors = nullptr;
+            int count = 0;
+            unsigned long long timeStampUs = 0;
+
+            LiveScanFrameHandle frame = AcquireLatestFrame(client, &vertices, &colors, &count, &sequenceNumber, &timeStampUs);
+            ReleaseFrame(frame);
+
+            if (startSequenceNumber == 0)
+            {
+                if (sequenceNumber < NumWarmupFrames)
+                    continue;
+
+                // Start the measurements from this frame
+                GetPerfStats(client, result.Stages, NumPerfStages, true);
+                startSequenceNumber = sequenceNumber;
+                start = std::chrono::steady_clock::now();
+                continue;
+            }
+
+            totalPoints += count;
+            numObservedFrames++;
+
+            if (sequenceNumber - startSequenceNumber >= static_cast<unsigned long long>(numFrames))
+            {
+                result.IsCompleted = true;
+                break;
+            }
+        }
+
+        double elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        GetPerfStats(client, result.Stages, NumPerfStages, false);
+
+        StopClient(client);
+        DestroyClient(client);
+
+        if (startSequenceNumber > 0)
+        {
+            result.NumFrames = static_cast<int>(sequenceNumber - startSequenceNumber);
+            result.FramesPerSecond = result.NumFrames / (std::max)(elapsedSeconds, 1e-6);
+            result.PointsPerFrame = numObservedFrames > 0 ? totalPoints / numObservedFrames : 0.0;
+        }
+
+        return result;
+    }
+
+    /// <summary>
+    /// Replays a recording with a client of the LiveScanClient library and keeps the points it publishes for each of the
+    /// first numFrames frames. With the consumer pacing, the client waits for each frame to be read before it replays
+    /// the next one, so that none is skipped. A camera without a calibration gets the identity one for the replay, so
+    /// that its frames go through the crop and the voxel grid like those of a calibrated camera.
+    /// </summary>
+    /// <returns>False if the client stopped publishing frames or skipped one</returns>
+    bool RunGoldenClient(const std::string& path, const std::string& serialNumber, int numFrames, std::vector<GoldenFrame>& goldenFrames)
+    {
+        const int FrameTimeoutMs = 5000;
+
+        // The client loads the calibration of the recorded camera from the working directory
+        std::string calibrationPath = "calibration_" + serialNumber + ".txt";
+        bool isCalibrationWritten = !std::ifstream(calibrationPath).is_open();
+
+        if (isCalibrationWritten)
+        {
+            std::ofstream calibrationFile(calibrationPath);
+            calibrationFile << "0 0 0\n1 0 0\n0 1 0\n0 0 1\n-1\n1\n";
+        }
+
+        // The filters of the frame processing, without the settings which depend on the timings or on other frames
+        CameraSettings settings = {};
+
+        for (int i = 0; i < 3; i++)
+        {
+            settings.MinBounds[i] = -GridHalfRange;
+            settings.MaxBounds[i] = GridHalfRange;
+        }
+
+        settings.MinBounds[2] = GridCenterZ - GridHalfRange;
+        settings.MaxBounds[2] = GridCenterZ + GridHalfRange;
+        settings.Filter = true;
+        settings.FilterNeighbors = FilterNeighbours;
+        settings.FilterThreshold = FilterThreshold;
+        settings.FilterMode = OrganizedFilterMode;
+        settings.AutoExposureEnabled = true;
+        settings.NumWorkerThreads = TaskScheduler::Instance().GetThreadCount();
+        settings.CaptureRange = 2 * GridHalfRange;
+        settings.ConsumerPacingEnabled = true;
+
+        LiveScanClientHandle client = CreateReplayClient(0, path.c_str(), false);
+        SetSettings(client, &settings);
+        StartClient(client);
+
+        goldenFrames.assign(numFrames, GoldenFrame());
+        unsigned long long sequenceNumber = 0;
+        bool isCompleted = true;
+
+        for (int i = 0; i < numFrames && isCompleted; i++)
+        {
+            const Point3s* vertices = nullptr;
+            const RGB* colors = nullptr;
+            int count = 0;
+            unsigned long long timeStampUs = 0;
+            unsigned long long lastSequenceNumber = sequenceNumber;
+
+            if (!WaitForFrame(client, lastSequenceNumber, FrameTimeoutMs))
+            {
+                isCompleted = false;
+                break;
+            }
+
+            LiveScanFrameHandle frame = AcquireLatestFrame(client, &vertices, &colors, &count, &sequenceNumber, &timeStampUs);
+            goldenFrames[i].Vertices.assign(vertices, vertices + count);
+            goldenFrames[i].Colors.assign(colors, colors + count);
+            ReleaseFrame(frame);
+
+            isCompleted = sequenceNumber == lastSequenceNumber + 1;
+        }
+
+        StopClient(client);
+        DestroyClient(client);
+
+        if (isCalibrationWritten)
+            std::remove(calibrationPath.c_str());
+
+        return isCompleted;
+    }
+
+    std::string EscapeJson(const std::string& text)
+    {
+        std::string escaped;
+
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+
+            if (static_cast<unsigned char>(c) >= 0x20)
+                escaped += c;
+        }
+
+        return escaped;
+    }
+
+    /// <summary>
+    /// Checks the median times of the benchmarks and of the stages of the client against the baseline, if its machine
+    /// class is the same; those of another class are not comparable, and are only reported.
+    /// </summary>
+    /// <returns>False if a median time regressed</returns>
+    bool CheckBaseline(const BenchmarkOptions& options, const RawFrame& frame, PointCloudKernelType kernel,
+        const std::vector<BenchmarkResult>& results, const ClientBenchmarkResult* clientResult)
+    {
+        BaselineResults baseline;
+
+        if (!ReadBaselineResults(options.BaselinePath, baseline))
+        {
+            std::cerr << "Failed to read the baseline " << options.BaselinePath << std::endl;
+            return false;
+        }
+
+        std::string source = options.RecordingPath.empty() ? std::string("synthetic") : EscapeJson(options.RecordingPath);
+
+        if (baseline.PointCloudKernel != GetPointCloudKernelName(kernel) || baseline.NumThreads != TaskScheduler::Instance().GetThreadCount()
+            || baseline.DepthWidth != frame.Header.DepthWidth || baseline.DepthHeight != frame.Header.DepthHeight || baseline.Source != source)
+        {
+            std::cerr << "The baseline was run on another class of machine or other frames; the timings are not checked" << std::endl;
+            return true;
+        }
+
+        std::vector<BenchmarkTiming> timings;
+
+        for (const BenchmarkResult& result : results)
+            timings.push_back({ result.Name, result.MedianNs });
+
+        for (int i = 0; clientResult && i < NumPerfStages; i++)
+        {
+            if (clientResult->Stages[i].Count > 0)
+                timings.push_back({ std::string("Client/") + PerfStageNames[i], clientResult->Stages[i].P50Ms * 1e6 });
+        }
+
+        return CountTimingRegressions(baseline, timings, options.MaxRegression) == 0;
+    }
+
+    void WriteResults(std::ostream& out, const BenchmarkOptions& options, const RawFrame& frame, PointCloudKernelType kernel,
+        const std::vector<BenchmarkResult>& results, const ClientBenchmarkResult* clientResult)
+    {
+        out << "{\n";
+        out << "  \"version\": " << ResultsVersion << ",\n";
+        out << "  \"source\": \"" << (options.RecordingPath.empty() ? std::string("synthetic") : EscapeJson(options.RecordingPath)) << "\",\n";
+        out << "  \"frames\": " << options.NumFrames << ",\n";
+        out << "  \"depthWidth\": " << frame.Header.DepthWidth << ",\n";
+        out << "  \"depthHeight\": " << frame.Header.DepthHeight << ",\n";
+        out << "  \"colorWidth\": " << frame.Header.ColorWidth << ",\n";
+        out << "  \"colorHeight\": " << frame.Header.ColorHeight << ",\n";
+        out << "  \"threads\": " << TaskScheduler::Instance().GetThreadCount() << ",\n";
+        out << "  \"pointCloudKernel\": \"" << GetPointCloudKernelName(kernel) << "\",\n";
+        out << "  \"benchmarks\": [\n";
+
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const BenchmarkResult& result = results[i];
+            double nsPerPoint = result.NumPoints > 0.0 ? result.MedianNs / result.NumPoints : 0.0;
+            double pointsPerSecond = result.MedianNs > 0.0 ? result.NumPoints * 1e9 / result.MedianNs : 0.0;
+
+            out << "    { \"name\": \"" << result.Name << "\", \"iterations\": " << result.NumIterations
+                << ", \"points\": " << result.NumPoints << ", \"meanNs\": " << result.MeanNs << ", \"medianNs\": " << result.MedianNs
+                << ", \"minNs\": " << result.MinNs << ", \"nsPerPoint\": " << nsPerPoint << ", \"pointsPerSecond\": " << pointsPerSecond
+                << ", \"allocations\": " << result.NumAllocations << ", \"allocatedBytes\": " << result.NumAllocatedBytes << " }"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+
+        out << "  ]";
+
+        if (clientResult)
+        {
+            out << ",\n  \"client\": {\n";
+            out << "    \"completed\": " << (clientResult->IsCompleted ? "true" : "false") << ",\n";
+            out << "    \"frames\": " << clientResult->NumFrames << ",\n";
+            out << "    \"framesPerSecond\": " << clientResult->FramesPerSecond << ",\n";
+            out << "    \"pointsPerFrame\": " << clientResult->PointsPerFrame << ",\n";
+            out << "    \"stages\": [\n";
+
+            for (int i = 0; i < NumPerfStages; i++)
+            {
+                const PerfStageStats& stats = clientResult->Stages[i];
+
+                out << "      { \"name\": \"" << PerfStageNames[i] << "\", \"count\": " << stats.Count << ", \"meanMs\": " << stats.MeanMs
+                    << ", \"p50Ms\": " << stats.P50Ms << ", \"p95Ms\": " << stats.P95Ms << ", \"p99Ms\": " << stats.P99Ms
+                    << ", \"maxMs\": " << stats.MaxMs << " }" << (i + 1 < NumPerfStages ? "," : "") << "\n";
+            }
+
+            out << "    ]\n  }";
+        }
+
+        out << "\n}\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkOptions options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    // Frames the benchmarks cycle through
+    std::vector<RawFrame> frames;
+    std::string serialNumber = "SYNTHETIC";
+
+    if (options.RecordingPath.empty())
+    {
+        GenerateSyntheticFrames(options.NumFrames, frames);
+    }
+    else if (!LoadRecordedFrames(options.RecordingPath, options.NumFrames, frames, serialNumber))
+    {
+        std::cerr << "Failed to read the frames of " << options.RecordingPath << std::endl;
+        return 1;
+    }
+
+    options.NumFrames = static_cast<int>(frames.size());
+    int numFrames = options.NumFrames;
+    int numIterations = options.NumIterations;
+    const RawFrame& firstFrame = frames.front();
+    int depthWidth = firstFrame.Header.DepthWidth;
+    int depthHeight = firstFrame.Header.DepthHeight;
+    size_t numPixels = static_cast<size_t>(depthWidth) * depthHeight;
+
+    // The benchmarks assume a single stream profile, as a client only changes it when the device is initialized again
+    for (const RawFrame& frame : frames)
+    {
+        if (frame.Header.DepthWidth != depthWidth || frame.Header.DepthHeight != depthHeight
+            || frame.Header.ColorWidth != firstFrame.Header.ColorWidth || frame.Header.ColorHeight != firstFrame.Header.ColorHeight)
+        {
+            std::cerr << "The stream profile of the recording changes; only its frames before the change are benchmarked" << std::endl;
+            break;
+        }
+    }
+
+    std::vector<Point2f> rays;
+    BuildRayTable(firstFrame, rays);
+
+    KernelBuffers kernelBuffers;
+    kernelBuffers.Points.Resize(numPixels);
+    kernelBuffers.AlignedDepth.resize(numPixels);
+
+    // Point clouds and aligned depth frames of each frame, which the later stages take as input
+    PointCloudKernelType bestKernel = SelectPointCloudKernel();
+    std::vector<PointBuffer> framePoints(numFrames);
+    std::vector<std::vector<UINT16>> alignedDepthFrames(numFrames);
+
+    for (int i = 0; i < numFrames; i++)
+    {
+        std::fill(kernelBuffers.AlignedDepth.begin(), kernelBuffers.AlignedDepth.end(), 0);
+        int numPoints = RunPointCloudKernel(bestKernel, GetKernelParams(frames[i], frames[i].Depth.data(), rays), kernelBuffers.GetOutput(true));
+
+        framePoints[i].AssignFirst(kernelBuffers.Points, numPoints);
+        alignedDepthFrames[i] = kernelBuffers.AlignedDepth;
+    }
+
+    auto FrameOf = [numFrames](int iteration) { return iteration % numFrames; };
+    auto NoPreparation = [](int) {};
+    std::vector<BenchmarkResult> results;
+
+    // Point cloud generation, for each kernel the CPU supports
+    for (int type = KernelScalar; type <= bestKernel; type++)
+    {
+        PointCloudKernelType kernel = static_cast<PointCloudKernelType>(type);
+
+        results.push_back(RunBenchmark(std::string("PointCloudKernel/") + GetPointCloudKernelName(kernel), numIterations,
+            [&](int i) { std::fill(kernelBuffers.AlignedDepth.begin(), kernelBuffers.AlignedDepth.end(), 0); },
+            [&](int i)
+            {
+                const RawFrame& frame = frames[FrameOf(i)];
+                RunPointCloudKernel(kernel, GetKernelParams(frame, frame.Depth.data(), rays), kernelBuffers.GetOutput(true));
+                return numPixels;
+            }));
+    }
+
+    // Depth filters applied before the point cloud generation
+    std::vector<UINT16> depthHistory(numPixels, 0);
+    std::vector<UINT16> denoisedDepth(numPixels);
+    std::vector<UINT16> filteredDepth(numPixels);
+    std::vector<UINT16> holeFilledDepth(numPixels);
+
+    results.push_back(RunBenchmark("DepthFilter/Temporal", numIterations, NoPreparation, [&](int i)
+    {
+        UpdateTemporalDepth(frames[FrameOf(i)].Depth.data(), depthHistory.data(), static_cast<int>(numPixels));
+        return numPixels;
+    }));
+
+    results.push_back(RunBenchmark("DepthFilter/Median", numIterations, NoPreparation, [&](int i)
+    {
+        FilterDepthMedian(frames[FrameOf(i)].Depth.data(), denoisedDepth.data(), depthWidth, depthHeight);
+        return numPixels;
+    }));
+
+    results.push_back(RunBenchmark("DepthFilter/FlyingPixels", numIterations, NoPreparation, [&](int i)
+    {
+        RejectFlyingPixels(frames[FrameOf(i)].Depth.data(), filteredDepth.data(), depthWidth, depthHeight);
+        return numPixels;
+    }));
+
+    results.push_back(RunBenchmark("DepthFilter/HoleFill", numIterations, NoPreparation, [&](int i)
+    {
+        FillDepthHoles(frames[FrameOf(i)].Depth.data(), holeFilledDepth.data(), depthWidth, depthHeight);
+        return numPixels;
+    }));
+
+    // The CPU path of the capture managers, with the depth filters enabled and the aligned depth frame requested
+    PointBuffer lastFramePoints;
+    std::fill(depthHistory.begin(), depthHistory.end(), 0);
+
+    std::vector<uint32_t> downscaledColor;
+    std::vector<std::vector<BYTE>> nv12Colors;
+
+    for (const RawFrame& frame : frames)
+        nv12Colors.push_back(ConvertToNv12(frame));
+
+    auto UpdatePointCloudWith = [&](int i, bool isColorDownscaled, bool isColorNv12)
+    {
+        const RawFrame& frame = frames[FrameOf(i)];
+
+        UpdateTemporalDepth(frame.Depth.data(), depthHistory.data(), static_cast<int>(numPixels));
+        FilterDepthMedian(depthHistory.data(), denoisedDepth.data(), depthWidth, depthHeight);
+        RejectFlyingPixels(denoisedDepth.data(), filteredDepth.data(), depthWidth, depthHeight);
+
+        PointCloudKernelParams params = GetKernelParams(frame, filteredDepth.data(), rays);
+
+        if (isColorNv12)
+        {
+            params.color = nv12Colors[FrameOf(i)].data();
+            params.colorFormat = ColorNv12;
+        }
+
+        if (isColorDownscaled)
+        {
+            downscaledColor.resize(static_cast<size_t>(params.colorWidth / 2) * (params.colorHeight / 2));
+            DownscaleColorFrame(params.color, params.colorWidth, params.colorHeight, downscaledColor.data());
+            UseDownscaledColor(params, downscaledColor.data());
+        }
+
+        std::fill(kernelBuffers.AlignedDepth.begin(), kernelBuffers.AlignedDepth.end(), 0);
+        int numPoints = RunPointCloudKernel(bestKernel, params, kernelBuffers.GetOutput(true));
+        lastFramePoints.AssignFirst(kernelBuffers.Points, numPoints);
+
+        return numPixels;
+    };
+
+    auto UpdatePointCloud = [&](int i) { return UpdatePointCloudWith(i, false, false); };
+
+    results.push_back(RunBenchmark("UpdatePointCloud", numIterations, NoPreparation, UpdatePointCloud));
+
+    // The colors sampled from the color frame downscaled by two, the downscaling included
+    results.push_back(RunBenchmark("UpdatePointCloud/DownscaledColor", numIterations, NoPreparation,
+        [&](int i) { return UpdatePointCloudWith(i, true, false); }));
+
+    // The colors sampled from the NV12 frames, converted to RGB for the sampled points only
+    results.push_back(RunBenchmark("UpdatePointCloud/Nv12Color", numIterations, NoPreparation,
+        [&](int i) { return UpdatePointCloudWith(i, false, true); }));
+
+    // Decimation and density counting of the point clouds
+    VoxelGridFilter voxelGrid(GridVoxelSize, 0.0f, 0.0f, GridCenterZ, GridHalfRange);
+    VoxelDensityCounter densityCounter(DensityVoxelSize, 0.0f, 0.0f, GridCenterZ, GridHalfRange);
+
+    results.push_back(RunBenchmark("VoxelGridFilter/Insert", numIterations, NoPreparation, [&](int i)
+    {
+        const PointBuffer& points = framePoints[FrameOf(i)];
+        voxelGrid.Reset();
+
+        for (size_t j = 0; j < points.Size(); j++)
+            voxelGrid.Insert(points.X[j], points.Y[j], points.Z[j]);
+
+        return points.Size();
+    }));
+
+    results.push_back(RunBenchmark("VoxelGridFilter/InsertConcurrent", numIterations, NoPreparation, [&](int i)
+    {
+        const PointBuffer& points = framePoints[FrameOf(i)];
+        InsertPointsConcurrent(voxelGrid, points);
+        return points.Size();
+    }));
+
+    std::vector<uint32_t> claimSlots;
+
+    results.push_back(RunBenchmark("VoxelGridFilter/ClaimConcurrent", numIterations, NoPreparation, [&](int i)
+    {
+        const PointBuffer& points = framePoints[FrameOf(i)];
+        ClaimPointsConcurrent(voxelGrid, points, claimSlots);
+        return points.Size();
+    }));
+
+    results.push_back(RunBenchmark("VoxelDensityCounter/Insert", numIterations, NoPreparation, [&](int i)
+    {
+        const PointBuffer& points = framePoints[FrameOf(i)];
+        densityCounter.Reset(points.Size());
+
+        for (size_t j = 0; j < points.Size(); j++)
+            densityCounter.Insert(points.X[j], points.Y[j], points.Z[j]);
+
+        return points.Size();
+    }));
+
+    // Outlier filters, which filter the points in place; the 3D filter searches the KD-tree or the voxel hash grid
+    RadiusOutlierFilter kdTreeFilter;
+    RadiusOutlierFilter voxelHashFilter;
+    OrganizedFilter organizedFilter;
+    PointBuffer filteredPoints;
+    kdTreeFilter.SetHashGridEnabled(false);
+
+    auto CopyFramePoints = [&](int i) { filteredPoints.AssignFirst(framePoints[FrameOf(i)], framePoints[FrameOf(i)].Size()); };
+
+    results.push_back(RunBenchmark("Filter/KdTree", numIterations, CopyFramePoints, [&](int i)
+    {
+        size_t numPoints = filteredPoints.Size();
+        kdTreeFilter.Apply(filteredPoints, FilterNeighbours, FilterThreshold);
+        return numPoints;
+    }));
+
+    results.push_back(RunBenchmark("Filter/VoxelHash", numIterations, CopyFramePoints, [&](int i)
+    {
+        size_t numPoints = filteredPoints.Size();
+        voxelHashFilter.Apply(filteredPoints, FilterNeighbours, FilterThreshold);
+        return numPoints;
+    }));
+
+    results.push_back(RunBenchmark("Filter/Organized", numIterations, CopyFramePoints, [&](int i)
+    {
+        size_t numPoints = filteredPoints.Size();
+        organizedFilter.Apply(filteredPoints, depthWidth, depthHeight, FilterNeighbours, FilterThreshold);
+        return numPoints;
+    }));
+
+    // The same filters reusing the decisions of the previous frame, as the clients do when the temporal filter is enabled
+    OutlierDecisionCache kdTreeDecisions;
+    OutlierDecisionCache organizedDecisions;
+
+    results.push_back(RunBenchmark("Filter/KdTreeTemporal", numIterations, CopyFramePoints, [&](int i)
+    {
+        size_t numPoints = filteredPoints.Size();
+        kdTreeDecisions.BeginFrame(numPixels, FilterNeighbours, FilterThreshold);
+        kdTreeFilter.Apply(filteredPoints, FilterNeighbours, FilterThreshold, &kdTreeDecisions);
+        return numPoints;
+    }));
+
+    results.push_back(RunBenchmark("Filter/OrganizedTemporal", numIterations, CopyFramePoints, [&](int i)
+    {
+        size_t numPoints = filteredPoints.Size();
+        organizedDecisions.BeginFrame(numPixels, FilterNeighbours, FilterThreshold);
+        organizedFilter.Apply(filteredPoints, depthWidth, depthHeight, FilterNeighbours, FilterThreshold, &organizedDecisions);
+        return numPoints;
+    }));
+
+    // The radius outlier filter, searching the KD-tree, after the density filter, which flags the points it does not need to search
+    std::vector<uint32_t> cascadeCells;
+    std::vector<unsigned char> sureKept;
+
+    auto CopyDensePoints = [&](int i)
+    {
+        const PointBuffer& points = framePoints[FrameOf(i)];
+        densityCounter.Reset(points.Size());
+        cascadeCells.resize(points.Size());
+
+        for (size_t j = 0; j < points.Size(); j++)
+            cascadeCells[j] = densityCounter.Insert(points.X[j], points.Y[j], points.Z[j]);
+
+        filteredPoints.Resize(points.Size());
+        sureKept.resize(points.Size());
+        size_t numKept = 0;
+
+        for (size_t j = 0; j < points.Size(); j++)
+        {
+            int count = densityCounter.GetCount(cascadeCells[j]);
+
+            if (count < MinDensityPoints)
+                continue;
+
+            sureKept[numKept] = count >= FilterNeighbours && densityCounter.IsCellWithin(points.X[j], points.Y[j], points.Z[j], FilterThreshold);
+            filteredPoints.CopyPoint(numKept++, points, j);
+        }
+
+        filteredPoints.Resize(numKept);
+    };
+
+    results.push_back(RunBenchmark("Filter/KdTreeCascade", numIterations, CopyDensePoints, [&](int i)
+    {
+        size_t numPoints = filteredPoints.Size();
+        kdTreeFilter.Apply(filteredPoints, FilterNeighbours, FilterThreshold, nullptr, sureKept.data());
+        return numPoints;
+    }));
+
+    // Document detection; the detector first learns the background from the first frames
+    DocumentDetector documentDetector;
+    cv::Mat documentData;
+    short documentWidth = 0;
+    short documentHeight = 0;
+    float documentScore = 0.0f;
+
+    auto DetectDocument = [&](int i)
+    {
+        RawFrame& frame = frames[FrameOf(i)];
+        cv::Mat color(frame.Header.ColorHeight, frame.Header.ColorWidth, CV_8UC3, frame.Color.data());
+        cv::Mat alignedDepth(depthHeight, depthWidth, CV_16U, alignedDepthFrames[FrameOf(i)].data());
+
+        documentDetector.Detect(color, alignedDepth, documentData, documentWidth, documentHeight, documentScore);
+        return numPixels;
+    };
+
+    for (int i = 0; i < (std::min)(numFrames, SyntheticBackgroundFrames); i++)
+        DetectDocument(i);
+
+    results.push_back(RunBenchmark("DocumentDetector/Detect", numIterations, NoPreparation, DetectDocument));
+
+    // The point cloud generation and processing chained like in a client, except for the calibration and decimation
+    // to the point budget which depend on the state of the client
+    results.push_back(RunBenchmark("Pipeline", numIterations, NoPreparation, [&](int i)
+    {
+        UpdatePointCloud(i);
+        InsertPointsConcurrent(voxelGrid, lastFramePoints);
+
+        densityCounter.Reset(lastFramePoints.Size());
+
+        for (size_t j = 0; j < lastFramePoints.Size(); j++)
+            densityCounter.Insert(lastFramePoints.X[j], lastFramePoints.Y[j], lastFramePoints.Z[j]);
+
+        organizedFilter.Apply(lastFramePoints, depthWidth, depthHeight, FilterNeighbours, FilterThreshold);
+        return numPixels;
+    }));
+
+    // The client and the golden check replay the frames; the synthetic ones are written to a recording for them
+    bool isGoldenChecked = !options.GoldenPath.empty() || !options.GoldenOutputPath.empty();
+    std::string replayPath = options.RecordingPath;
+    bool isRecordingWritten = false;
+
+    if ((options.IsClientBenchmarked || isGoldenChecked) && replayPath.empty())
+    {
+        isRecordingWritten = WriteRecording(frames, serialNumber, replayPath);
+
+        if (!isRecordingWritten)
+        {
+            std::cerr << "Failed to write the synthetic frames to a recording; the client is not benchmarked" << std::endl;
+            options.IsClientBenchmarked = false;
+        }
+    }
+
+    // Output of the processing of each frame by a client replaying them one after the other
+    std::vector<GoldenFrame> goldenFrames;
+
+    if (isGoldenChecked && (replayPath.empty() || !RunGoldenClient(replayPath, serialNumber, numFrames, goldenFrames)))
+    {
+        std::cerr << "Failed to replay the frames for the golden check" << std::endl;
+
+        if (isRecordingWritten)
+            std::remove(replayPath.c_str());
+
+        return 1;
+    }
+
+    bool isCheckPassed = true;
+
+    if (!options.GoldenOutputPath.empty() && !WriteGoldenFrames(options.GoldenOutputPath, goldenFrames))
+    {
+        std::cerr << "Failed to write the golden frames to " << options.GoldenOutputPath << std::endl;
+        return 1;
+    }
+
+    if (!options.GoldenPath.empty())
+    {
+        std::vector<GoldenFrame> expectedFrames;
+
+        if (!ReadGoldenFrames(options.GoldenPath, expectedFrames))
+        {
+            std::cerr << "Failed to read the golden frames of " << options.GoldenPath << std::endl;
+            isCheckPassed = false;
+        }
+        else if (CountGoldenMismatches(expectedFrames, goldenFrames, options.GoldenToleranceMm) > 0)
+        {
+            isCheckPassed = false;
+        }
+    }
+
+    // Whole frame loop of a client, replaying the frames
+    ClientBenchmarkResult clientResult;
+
+    if (options.IsClientBenchmarked)
+    {
+        clientResult = RunClientBenchmark(replayPath, options.NumClientFrames);
+
+        if (!clientResult.IsCompleted)
+            std::cerr << "The client stopped publishing frames after " << clientResult.NumFrames << " frames" << std::endl;
+    }
+
+    // The synthetic recording is only written for the replays
+    if (isRecordingWritten)
+        std::remove(replayPath.c_str());
+
+    const ClientBenchmarkResult* clientResults = options.IsClientBenchmarked ? &clientResult : nullptr;
+
+    if (options.OutputPath.empty())
+    {
+        WriteResults(std::cout, options, firstFrame, bestKernel, results, clientResults);
+    }
+    else
+    {
+        std::ofstream output(options.OutputPath);
+        WriteResults(output, options, firstFrame, bestKernel, results, clientResults);
+
+        if (!output)
+        {
+            std::cerr << "Failed to write the results to " << options.OutputPath << std::endl;
+            return 1;
+        }
+    }
+
+    if (!options.BaselinePath.empty() && !CheckBaseline(options, firstFrame, bestKernel, results, clientResults))
+        isCheckPassed = false;
+
+    return isCheckPassed ? 0 : CheckFailedExitCode;
+}
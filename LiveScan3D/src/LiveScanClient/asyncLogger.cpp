@@ -0,0 +1,316 @@
+/***************************************************************************\
+
+Module Name:  AsyncLogger.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module writes the log of a client from a background thread, so that
+logging from the frame loop never waits on the disk. The messages are
+copied into a bounded ring which any thread can append to without locks,
+then timestamped, limited and written in batches by the flusher thread.
+
+\***************************************************************************/
+
+#include "asyncLogger.h"
+#include <windows.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+    // Longest time a message waits in the ring; errors wake the flusher at once
+    const std::chrono::milliseconds FlushInterval(50);
+
+    // Messages which only differ by their numbers, such as the warnings of every frame, are written MaxRepeats times
+    // per interval; the others are counted and reported at the end of the interval
+    const std::chrono::seconds RepeatInterval(10);
+    const int MaxRepeats = 5;
+
+    const char* GetLevelTag(LogLevel level)
+    {
+        switch (level)
+        {
+        case DebugLevel: return "[Debug] ";
+        case WarningLevel: return "[Warning] ";
+        case ErrorLevel: return "[Error] ";
+        default: return "";
+        }
+    }
+
+    // Replaces each run of digits with a single #, so that the messages of a call site map to the same pattern
+    std::string GetPattern(const char* text, size_t length)
+    {
+        std::string pattern;
+        pattern.reserve(length);
+
+        for (size_t i = 0; i < length; i++)
+        {
+            if (std::isdigit(static_cast<unsigned char>(text[i])))
+            {
+                if (pattern.empty() || pattern.back() != '#')
+                    pattern.push_back('#');
+            }
+            else
+            {
+                pattern.push_back(text[i]);
+            }
+        }
+
+        return pattern;
+    }
+}
+
+AsyncLogger::AsyncLogger() : slots(new Slot[NumSlots]), readIndex(0), isStopping(false)
+{
+    for (int i = 0; i < NumSlots; i++)
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+
+    writeIndex.store(0, std::memory_order_relaxed);
+    numDropped.store(0, std::memory_order_relaxed);
+    minLevel.store(InfoLevel, std::memory_order_relaxed);
+    lastRepeatSweep = std::chrono::steady_clock::now();
+
+    flusherThread = std::thread(&AsyncLogger::RunFlusher, this);
+}
+
+/// <summary>
+/// Writes the messages still in the ring and the suppressed message counts, then stops the flusher thread
+/// </summary>
+AsyncLogger::~AsyncLogger()
+{
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+        isStopping = true;
+    }
+
+    wakeCond.notify_one();
+    flusherThread.join();
+}
+
+/// <summary>
+/// Opens the log file, appending to it. Until it is open, the messages are written to the debugger output.
+/// </summary>
+/// <param name="path">Path of the log file</param>
+/// <returns>True if the file could be opened</returns>
+bool AsyncLogger::Open(const std::wstring& path)
+{
+    std::lock_guard<std::mutex> lock(fileMutex);
+
+    file.open(path, std::ios::out | std::ios::app);
+    return file.is_open();
+}
+
+/// <summary>
+/// Queues a message for the flusher thread. It can be called from any thread; it only copies the message.
+/// </summary>
+/// <param name="level">Level of the message, ignored below the minimum level</param>
+/// <param name="message">Message to write, truncated to MaxMessageLength characters</param>
+void AsyncLogger::Log(LogLevel level, const std::string& message)
+{
+    if (level < minLevel.load(std::memory_order_relaxed))
+        return;
+
+    uint64_t index = writeIndex.load(std::memory_order_relaxed);
+    Slot* slot;
+
+    for (;;)
+    {
+        slot = &slots[index & (NumSlots - 1)];
+        int64_t diff = static_cast<int64_t>(slot->sequence.load(std::memory_order_acquire)) - static_cast<int64_t>(index);
+
+        if (diff == 0)
+        {
+            // The slot is free; claim it, unless another producer did first
+            if (writeIndex.compare_exchange_weak(index, index + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // The flusher has not read this slot yet: the ring is full
+            numDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            index = writeIndex.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->time = std::chrono::system_clock::now();
+    slot->length = static_cast<int>((std::min)(message.size(), static_cast<size_t>(MaxMessageLength)));
+    memcpy(slot->text, message.data(), slot->length);
+
+    if (message.size() > static_cast<size_t>(MaxMessageLength))
+        memcpy(slot->text + MaxMessageLength - 3, "...", 3);
+
+    slot->sequence.store(index + 1, std::memory_order_release);
+
+    if (level == ErrorLevel)
+        wakeCond.notify_one();
+}
+
+void AsyncLogger::RunFlusher()
+{
+    std::unique_lock<std::mutex> lock(fileMutex);
+
+    for (;;)
+    {
+        bool isLast = isStopping;
+
+        WriteQueuedMessages();
+
+        if (isLast)
+            break;
+
+        wakeCond.wait_for(lock, FlushInterval);
+    }
+
+    SweepRepeatCounts(std::chrono::steady_clock::now(), true);
+
+    if (file.is_open())
+        file.flush();
+}
+
+/// <summary>
+/// Writes the messages of the ring in order, then the count of the dropped ones, and flushes the file once
+/// </summary>
+void AsyncLogger::WriteQueuedMessages()
+{
+    auto now = std::chrono::steady_clock::now();
+    bool isWritten = false;
+
+    for (;;)
+    {
+        Slot& slot = slots[readIndex & (NumSlots - 1)];
+
+        if (slot.sequence.load(std::memory_order_acquire) != readIndex + 1)
+            break;
+
+        if (!IsRepeatSuppressed(GetPattern(slot.text, slot.length), now))
+        {
+            WriteLine(slot.level, slot.time, slot.text, slot.length);
+            isWritten = true;
+        }
+
+        // Hand the slot back to the producers for the next turn of the ring
+        slot.sequence.store(readIndex + NumSlots, std::memory_order_release);
+        readIndex++;
+    }
+
+    uint32_t dropped = numDropped.exchange(0, std::memory_order_relaxed);
+
+    if (dropped > 0)
+    {
+        std::string message = "[AsyncLogger] " + std::to_string(dropped) + " messages dropped, the log queue was full";
+        WriteLine(WarningLevel, std::chrono::system_clock::now(), message.data(), message.size());
+        isWritten = true;
+    }
+
+    if (now - lastRepeatSweep >= RepeatInterval)
+    {
+        SweepRepeatCounts(now, false);
+        lastRepeatSweep = now;
+    }
+
+    if (isWritten && file.is_open())
+        file.flush();
+}
+
+/// <summary>
+/// Counts a message of the pattern in its current interval
+/// </summary>
+/// <returns>True if the message should not be written, since the pattern was already written MaxRepeats times</returns>
+bool AsyncLogger::IsRepeatSuppressed(const std::string& pattern, std::chrono::steady_clock::time_point now)
+{
+    auto it = repeatCounts.find(pattern);
+
+    if (it == repeatCounts.end())
+    {
+        repeatCounts.emplace(pattern, RepeatCount{ now, 1, 0 });
+        return false;
+    }
+
+    RepeatCount& count = it->second;
+
+    if (now - count.intervalStart >= RepeatInterval)
+    {
+        if (count.numSuppressed > 0)
+            WriteSuppressedCount(pattern, count.numSuppressed);
+
+        count = RepeatCount{ now, 1, 0 };
+        return false;
+    }
+
+    if (count.numWritten < MaxRepeats)
+    {
+        count.numWritten++;
+        return false;
+    }
+
+    count.numSuppressed++;
+    return true;
+}
+
+/// <summary>
+/// Reports the messages suppressed by the intervals which are over, and forgets their patterns, so that the patterns
+/// seen once do not pile up
+/// </summary>
+/// <param name="isFinal">True to end all the intervals, when the logger stops</param>
+void AsyncLogger::SweepRepeatCounts(std::chrono::steady_clock::time_point now, bool isFinal)
+{
+    bool isWritten = false;
+
+    for (auto it = repeatCounts.begin(); it != repeatCounts.end();)
+    {
+        if (!isFinal && now - it->second.intervalStart < RepeatInterval)
+        {
+            ++it;
+            continue;
+        }
+
+        if (it->second.numSuppressed > 0)
+        {
+            WriteSuppressedCount(it->first, it->second.numSuppressed);
+            isWritten = true;
+        }
+
+        it = repeatCounts.erase(it);
+    }
+
+    if (isWritten && file.is_open())
+        file.flush();
+}
+
+void AsyncLogger::WriteSuppressedCount(const std::string& pattern, int numSuppressed)
+{
+    std::string message = "[AsyncLogger] " + std::to_string(numSuppressed) + " more messages like: " + pattern;
+    WriteLine(InfoLevel, std::chrono::system_clock::now(), message.data(), message.size());
+}
+
+void AsyncLogger::WriteLine(LogLevel level, std::chrono::system_clock::time_point time, const char* text, size_t length)
+{
+    std::time_t timeC = std::chrono::system_clock::to_time_t(time);
+    int milliseconds = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000);
+
+    std::tm tm;
+    localtime_s(&tm, &timeC); // Windows-specific thread-safe function
+
+    std::ostringstream line;
+    line << std::put_time(&tm, "[%Y-%m-%d %H:%M:%S")
+        << "." << std::setfill('0') << std::setw(3) << milliseconds
+        << "] " << GetLevelTag(level);
+    line.write(text, length);
+    line << '\n';
+
+    if (file.is_open())
+        file << line.str();
+    else
+        OutputDebugStringA(line.str().c_str()); // fallback to debugger output
+}
@@ -0,0 +1,103 @@
+/***************************************************************************\
+
+Module Name:  BackgroundModel.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module learns the static background of the scene (stand, walls) as a
+per-pixel depth image, averaged over the first frames it receives. The depth
+pixels which stay close to that depth can then be recognized as background.
+
+\***************************************************************************/
+
+#include "backgroundModel.h"
+#include "memoryUsage.h"
+#include <algorithm>
+
+// Forgets the learned background and frees its storage; the next frames passed to Update are used to learn it again
+void BackgroundModel::Reset() {
+    width = 0;
+    height = 0;
+    numLearnedFrames = 0;
+    backgroundDepth = std::vector<uint16_t>();
+}
+
+bool BackgroundModel::IsReady() const {
+    return numLearnedFrames >= NumLearningFrames;
+}
+
+size_t BackgroundModel::GetMemoryUsage() const {
+    return GetCapacityBytes(depthSums) + GetCapacityBytes(numSamples) + GetCapacityBytes(minDepths)
+        + GetCapacityBytes(maxDepths) + GetCapacityBytes(backgroundDepth);
+}
+
+/// <summary>
+/// Accumulates a depth frame into the background statistics while the model is learning. Once enough frames have been
+/// seen, the pixels which had a valid and stable depth in most of them get their average depth as background.
+/// Frames are ignored afterwards, except when their size changes, which restarts the learning.
+/// </summary>
+void BackgroundModel::Update(const uint16_t* depth, int frameWidth, int frameHeight) {
+    size_t numPixels = static_cast<size_t>(frameWidth) * frameHeight;
+
+    if (frameWidth != width || frameHeight != height) {
+        width = frameWidth;
+        height = frameHeight;
+        numLearnedFrames = 0;
+    }
+
+    if (IsReady()) {
+        return;
+    }
+
+    if (numLearnedFrames == 0) {
+        depthSums.assign(numPixels, 0);
+        numSamples.assign(numPixels, 0);
+        minDepths.assign(numPixels, UINT16_MAX);
+        maxDepths.assign(numPixels, 0);
+
+        // No pixel is background until the learning is done
+        backgroundDepth.assign(numPixels, 0);
+    }
+
+    for (size_t i = 0; i < numPixels; i++) {
+        uint16_t d = depth[i];
+
+        if (d == 0) {
+            continue;
+        }
+
+        depthSums[i] += d;
+        numSamples[i]++;
+        minDepths[i] = (std::min)(minDepths[i], d);
+        maxDepths[i] = (std::max)(maxDepths[i], d);
+    }
+
+    numLearnedFrames++;
+
+    if (!IsReady()) {
+        return;
+    }
+
+    // Pixels which were often invalid or which moved during the learning (e.g. someone walking by) are left out
+    int minSamples = NumLearningFrames * 3 / 4;
+
+    for (size_t i = 0; i < numPixels; i++) {
+        if (numSamples[i] < minSamples) {
+            continue;
+        }
+
+        uint16_t average = static_cast<uint16_t>(depthSums[i] / numSamples[i]);
+
+        if (maxDepths[i] - minDepths[i] <= 2 * GetTolerance(average)) {
+            backgroundDepth[i] = average;
+        }
+    }
+
+    // The statistics are not needed anymore
+    depthSums = std::vector<uint32_t>();
+    numSamples = std::vector<uint16_t>();
+    minDepths = std::vector<uint16_t>();
+    maxDepths = std::vector<uint16_t>();
+}
@@ -21,12 +21,14 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 
 #include <fstream>
 #include <functional>
+#include <algorithm>
 
 Calibration::Calibration() : usedMarkerId(-1)
 {
 	// Initialize variables
 	isCalibrated = false;
 	numSamples = 0;
+	isMarkerTracked = false;
 
 	worldT = vector<float>(3, 0.0f);
 
@@ -36,6 +38,8 @@ Calibration::Calibration() : usedMarkerId(-1)
 		worldR[i][i] = 1.0f;
 	}
 
+	UpdateWorldTransform();
+
 	markerDetector = new MarkerDetector();
 }
 
@@ -66,7 +70,7 @@ bool Calibration::Calibrate(RGB *colorFrame, Point3f *depthFrame, int frameWidth
 	MarkerInfo marker;
 
 	// Try to find a marker in the color frame provided
-	bool res = markerDetector->DetectMarkersInImage(colorFrame, frameHeight, frameWidth, marker);
+	bool res = DetectMarker(colorFrame, frameWidth, frameHeight, marker);
 
 	if (!res) {
 		return false;
@@ -150,10 +154,57 @@ bool Calibration::Calibrate(RGB *colorFrame, Point3f *depthFrame, int frameWidth
 	worldT[1] += translationIncr[1];
 	worldT[2] += translationIncr[2];
 
+	UpdateWorldTransform();
+
 	isCalibrated = true;
 
 	markerSamplePositions.clear();
 	numSamples = 0;
+	isMarkerTracked = false;
+
+	return true;
+}
+
+/// <summary>
+/// Finds a marker in the color frame, in the window around the one found in the previous sample if any, or in the full
+/// frame otherwise. The window is then moved to the marker found.
+/// </summary>
+/// <param name="colorFrame">A color frame (RGB data) from the camera</param>
+/// <param name="frameWidth">Width of the color frame</param>
+/// <param name="frameHeight">Height of the color frame</param>
+/// <param name="marker">Output information on the detected marker</param>
+/// <returns>True if a marker was detected, false otherwise</returns>
+bool Calibration::DetectMarker(RGB *colorFrame, int frameWidth, int frameHeight, MarkerInfo &marker)
+{
+	bool res = isMarkerTracked && markerDetector->DetectMarkersInImage(colorFrame, frameHeight, frameWidth,
+		trackingRegion[0], trackingRegion[1], trackingRegion[2], trackingRegion[3], marker);
+
+	// Fall back to the full frame when the marker moved out of the window or was never found
+	if (!res)
+		res = markerDetector->DetectMarkersInImage(colorFrame, frameHeight, frameWidth, marker);
+
+	isMarkerTracked = res;
+
+	if (!res)
+		return false;
+
+	float minX = marker.Corners[0].X, maxX = marker.Corners[0].X;
+	float minY = marker.Corners[0].Y, maxY = marker.Corners[0].Y;
+
+	for (unsigned int i = 1; i < marker.Corners.size(); i++)
+	{
+		minX = (std::min)(minX, marker.Corners[i].X);
+		maxX = (std::max)(maxX, marker.Corners[i].X);
+		minY = (std::min)(minY, marker.Corners[i].Y);
+		maxY = (std::max)(maxY, marker.Corners[i].Y);
+	}
+
+	int padding = (std::max)(MinTrackingRegionPadding, static_cast<int>(TrackingRegionPadding * (std::max)(maxX - minX, maxY - minY)));
+
+	trackingRegion[0] = static_cast<int>(minX) - padding;
+	trackingRegion[1] = static_cast<int>(minY) - padding;
+	trackingRegion[2] = static_cast<int>(maxX - minX) + 2 * padding;
+	trackingRegion[3] = static_cast<int>(maxY - minY) + 2 * padding;
 
 	return true;
 }
@@ -183,9 +234,30 @@ bool Calibration::LoadCalibration(const string &serialNumber)
 	file >> usedMarkerId;
 	file >> isCalibrated;
 
+	UpdateWorldTransform();
+
 	return true;
 }
 
+/// <summary>
+/// Composes worldR and worldT into the 3x4 transform applied at capture time. The calibration translates points
+/// by worldT and then rotates them by worldR, so the translation column is worldR * worldT. Must be called
+/// whenever worldR or worldT change.
+/// </summary>
+void Calibration::UpdateWorldTransform()
+{
+	for (int i = 0; i < 3; i++)
+	{
+		worldTransform[i][3] = 0.0f;
+
+		for (int j = 0; j < 3; j++)
+		{
+			worldTransform[i][j] = worldR[i][j];
+			worldTransform[i][3] += worldR[i][j] * worldT[j];
+		}
+	}
+}
+
 /// <summary>
 /// Saves the current calibration to a file.
 /// </summary>
@@ -222,6 +294,19 @@ void Calibration::SetLogger(std::function<void(const std::string&)> loggerFunc)
 	logFn = loggerFunc;
 }
 
+/// <summary>
+/// Number of marker samples found so far, out of the number required to calibrate
+/// </summary>
+int Calibration::GetNumSamples() const
+{
+	return numSamples;
+}
+
+int Calibration::GetNumRequiredSamples() const
+{
+	return NumRequiredSamples;
+}
+
 /// <summary>
 /// Applies the Procrustes algorithm to find the transformation (rotation and translation)
 /// that maps the detected marker points in camera space to their known positions in world space.
@@ -0,0 +1,366 @@
+/***************************************************************************\
+
+Module Name:  CaptureNodeProtocol.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module defines the messages a capture node exchanges with the remote
+clients of the server, over one TCP connection for each camera the node
+hosts. Each message is a fixed header, with the type and the size of its
+content, followed by the content. The server sends the calls of the client
+API, some of which wait for an answer, and pings to compare the clocks of
+the two computers; the node streams the processed frames of the camera with
+its events and the answers. The frames are sent as planes of coordinates,
+delta coded from point to point, and planes of colors, compressed with zstd
+when it is built in (LIVESCAN_ZSTD).
+
+\***************************************************************************/
+
+#include "captureNodeProtocol.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#ifdef LIVESCAN_ZSTD
+#include <zstd.h>
+#endif
+
+#pragma comment(lib, "Ws2_32.lib")
+
+int64_t GetSteadyTimeUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t GetSystemTimeUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/// <summary>
+/// Initializes Winsock for the process; it stays initialized until the process exits
+/// </summary>
+bool StartWinsock()
+{
+    static const bool isStarted = []() {
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }();
+
+    return isStarted;
+}
+
+CaptureNodeConnection::CaptureNodeConnection(SOCKET socket) : socket(socket)
+{
+    // The small messages, such as the pings and the answers, are sent as soon as they are written
+    BOOL isNoDelay = TRUE;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&isNoDelay), sizeof(isNoDelay));
+}
+
+CaptureNodeConnection::~CaptureNodeConnection()
+{
+    if (socket != INVALID_SOCKET)
+        closesocket(socket);
+}
+
+/// <summary>
+/// Opens a connection to a node, trying each address of the host in turn
+/// </summary>
+/// <param name="timeoutMs">Maximum time to wait for each address to answer</param>
+/// <returns>The connected socket; INVALID_SOCKET if no address answered</returns>
+SOCKET CaptureNodeConnection::Connect(const std::string& host, int port, int timeoutMs)
+{
+    if (!StartWinsock())
+        return INVALID_SOCKET;
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    addrinfo* addresses = nullptr;
+
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+        return INVALID_SOCKET;
+
+    SOCKET connected = INVALID_SOCKET;
+
+    for (addrinfo* address = addresses; address && connected == INVALID_SOCKET; address = address->ai_next)
+    {
+        SOCKET candidate = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+
+        if (candidate == INVALID_SOCKET)
+            continue;
+
+        // Connect without blocking, so that an unreachable node does not hold the caller for the timeout of the system
+        u_long isNonBlocking = 1;
+        ioctlsocket(candidate, FIONBIO, &isNonBlocking);
+
+        connect(candidate, address->ai_addr, static_cast<int>(address->ai_addrlen));
+
+        fd_set writable;
+        fd_set failed;
+        FD_ZERO(&writable);
+        FD_ZERO(&failed);
+        FD_SET(candidate, &writable);
+        FD_SET(candidate, &failed);
+        timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+
+        if (select(0, nullptr, &writable, &failed, &timeout) == 1 && FD_ISSET(candidate, &writable))
+        {
+            isNonBlocking = 0;
+            ioctlsocket(candidate, FIONBIO, &isNonBlocking);
+            connected = candidate;
+        }
+        else
+        {
+            closesocket(candidate);
+        }
+    }
+
+    freeaddrinfo(addresses);
+
+    return connected;
+}
+
+bool CaptureNodeConnection::Send(uint16_t type, const void* content, size_t size)
+{
+    return Send(type, nullptr, 0, content, size);
+}
+
+/// <summary>
+/// Sends a message whose content is made of a header and of the data which follows it, in one write
+/// </summary>
+/// <returns>False if the connection is closed</returns>
+bool CaptureNodeConnection::Send(uint16_t type, const void* header, size_t headerSize, const void* content, size_t size)
+{
+    CaptureNodeMessageHeader messageHeader;
+    messageHeader.Size = static_cast<uint32_t>(headerSize + size);
+    messageHeader.Type = type;
+
+    std::lock_guard<std::mutex> lock(sendMutex);
+
+    sendBuffer.resize(sizeof(messageHeader) + headerSize + size);
+    memcpy(sendBuffer.data(), &messageHeader, sizeof(messageHeader));
+
+    if (headerSize > 0)
+        memcpy(sendBuffer.data() + sizeof(messageHeader), header, headerSize);
+
+    if (size > 0)
+        memcpy(sendBuffer.data() + sizeof(messageHeader) + headerSize, content, size);
+
+    return SendAll(sendBuffer.data(), sendBuffer.size());
+}
+
+/// <summary>
+/// Receives the next message, blocking until all of it arrived
+/// </summary>
+/// <returns>False if the connection is closed or sent a message which is too large</returns>
+bool CaptureNodeConnection::Receive(uint16_t& type, std::vector<char>& content)
+{
+    CaptureNodeMessageHeader header;
+
+    if (!ReceiveAll(reinterpret_cast<char*>(&header), sizeof(header)) || header.Size > MaxMessageSize)
+        return false;
+
+    type = header.Type;
+    content.resize(header.Size);
+
+    return header.Size == 0 || ReceiveAll(content.data(), header.Size);
+}
+
+/// <summary>
+/// Waits until a message starts to arrive, or until the connection is closed
+/// </summary>
+/// <returns>True if Receive can be called without waiting for the other end</returns>
+bool CaptureNodeConnection::WaitReadable(int timeoutMs)
+{
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(socket, &readable);
+    timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+
+    return select(0, &readable, nullptr, nullptr, &timeout) == 1;
+}
+
+/// <summary>
+/// Closes both directions of the connection, which unblocks the threads sending or receiving on it
+/// </summary>
+void CaptureNodeConnection::Shutdown()
+{
+    shutdown(socket, SD_BOTH);
+}
+
+bool CaptureNodeConnection::SendAll(const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        int sent = send(socket, data, static_cast<int>((std::min)(size, static_cast<size_t>(INT_MAX))), 0);
+
+        if (sent <= 0)
+            return false;
+
+        data += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+bool CaptureNodeConnection::ReceiveAll(char* data, size_t size)
+{
+    while (size > 0)
+    {
+        int received = recv(socket, data, static_cast<int>((std::min)(size, static_cast<size_t>(INT_MAX))), 0);
+
+        if (received <= 0)
+            return false;
+
+        data += received;
+        size -= received;
+    }
+
+    return true;
+}
+
+CaptureNodeFrameCodec::~CaptureNodeFrameCodec()
+{
+#ifdef LIVESCAN_ZSTD
+    ZSTD_freeCCtx(compressionContext);
+    ZSTD_freeDCtx(decompressionContext);
+#endif
+}
+
+/// <summary>
+/// Compresses the points of a frame, which keep their order. Without zstd, the planes are sent uncompressed.
+/// </summary>
+/// <param name="encoded">Receives the encoding (CaptureNodeFrameEncoding), then the planes</param>
+/// <returns>False if zstd failed</returns>
+bool CaptureNodeFrameCodec::Encode(const Point3s* vertices, const RGB* colors, int count, std::vector<char>& encoded)
+{
+    size_t numPoints = static_cast<size_t>(count);
+    size_t rawSize = numPoints * (3 * sizeof(short) + 3);
+    planes.resize(rawSize);
+
+    short* x = reinterpret_cast<short*>(planes.data());
+    short* y = x + numPoints;
+    short* z = y + numPoints;
+    uint8_t* red = reinterpret_cast<uint8_t*>(z + numPoints);
+    uint8_t* green = red + numPoints;
+    uint8_t* blue = green + numPoints;
+
+    // The differences wrap around, so they are exact
+    Point3s previous;
+
+    for (size_t i = 0; i < numPoints; i++)
+    {
+        x[i] = static_cast<short>(vertices[i].X - previous.X);
+        y[i] = static_cast<short>(vertices[i].Y - previous.Y);
+        z[i] = static_cast<short>(vertices[i].Z - previous.Z);
+        previous = vertices[i];
+
+        red[i] = colors[i].Red;
+        green[i] = colors[i].Green;
+        blue[i] = colors[i].Blue;
+    }
+
+#ifdef LIVESCAN_ZSTD
+    if (!compressionContext)
+        compressionContext = ZSTD_createCCtx();
+
+    encoded.resize(1 + ZSTD_compressBound(rawSize));
+    encoded[0] = static_cast<char>(ZstdPlanesEncoding);
+    size_t size = ZSTD_compressCCtx(compressionContext, encoded.data() + 1, encoded.size() - 1, planes.data(), rawSize, CompressionLevel);
+
+    if (ZSTD_isError(size))
+        return false;
+
+    encoded.resize(1 + size);
+#else
+    encoded.resize(1 + rawSize);
+    encoded[0] = static_cast<char>(RawPlanesEncoding);
+    memcpy(encoded.data() + 1, planes.data(), rawSize);
+#endif
+
+    return true;
+}
+
+/// <summary>
+/// Decompresses the points of a frame encoded with Encode
+/// </summary>
+/// <param name="count">Number of points of the frame</param>
+/// <returns>False if the data is not a frame of count points, or is compressed and zstd is not built in</returns>
+bool CaptureNodeFrameCodec::Decode(const char* encoded, size_t size, int count, std::vector<Point3s>& vertices, std::vector<RGB>& colors)
+{
+    if (count < 0 || count > MaxPoints || size < 1)
+        return false;
+
+    size_t numPoints = static_cast<size_t>(count);
+    size_t rawSize = numPoints * (3 * sizeof(short) + 3);
+    uint8_t encoding = static_cast<uint8_t>(encoded[0]);
+    encoded++;
+    size--;
+
+    if (encoding == RawPlanesEncoding)
+    {
+        if (size != rawSize)
+            return false;
+
+        planes.assign(encoded, encoded + size);
+    }
+    else if (encoding == ZstdPlanesEncoding)
+    {
+#ifdef LIVESCAN_ZSTD
+        // Encode writes the size of the planes in the frame header, so a count which does not match it is rejected
+        // before the planes are sized for it
+        unsigned long long contentSize = ZSTD_getFrameContentSize(encoded, size);
+
+        if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR || contentSize != rawSize)
+            return false;
+
+        planes.resize(rawSize);
+
+        if (!decompressionContext)
+            decompressionContext = ZSTD_createDCtx();
+
+        size_t decodedSize = ZSTD_decompressDCtx(decompressionContext, planes.data(), rawSize, encoded, size);
+
+        if (ZSTD_isError(decodedSize) || decodedSize != rawSize)
+            return false;
+#else
+        return false;
+#endif
+    }
+    else
+    {
+        return false;
+    }
+
+    const short* x = reinterpret_cast<const short*>(planes.data());
+    const short* y = x + numPoints;
+    const short* z = y + numPoints;
+    const uint8_t* red = reinterpret_cast<const uint8_t*>(z + numPoints);
+    const uint8_t* green = red + numPoints;
+    const uint8_t* blue = green + numPoints;
+
+    vertices.resize(numPoints);
+    colors.resize(numPoints);
+
+    Point3s previous;
+
+    for (size_t i = 0; i < numPoints; i++)
+    {
+        previous.X = static_cast<short>(previous.X + x[i]);
+        previous.Y = static_cast<short>(previous.Y + y[i]);
+        previous.Z = static_cast<short>(previous.Z + z[i]);
+        vertices[i] = previous;
+
+        colors[i].Red = red[i];
+        colors[i].Green = green[i];
+        colors[i].Blue = blue[i];
+    }
+
+    return true;
+}
@@ -0,0 +1,62 @@
+/***************************************************************************\
+
+Module Name:  ClientEventQueue.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the queue of the events the clients of the process
+send to the server: their serial number, the confirmations of their
+recording, calibration and sync state, and their new documents. The server
+waits on the queue and takes the pending events of all the clients at once,
+instead of being called back from the threads of each client.
+
+\***************************************************************************/
+
+#include "clientEventQueue.h"
+#include <algorithm>
+#include <chrono>
+
+ClientEventQueue& ClientEventQueue::Instance()
+{
+    // Never destroyed, since the clients may still push events while the process exits
+    static ClientEventQueue* instance = new ClientEventQueue();
+    return *instance;
+}
+
+void ClientEventQueue::Push(const ClientEvent& event)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (pendingEvents.size() >= MaxPendingEvents)
+            pendingEvents.pop_front();
+
+        pendingEvents.push_back(event);
+    }
+
+    eventCond.notify_one();
+}
+
+/// <summary>
+/// Waits for the next events of the clients, and takes all those pending at once
+/// </summary>
+/// <param name="events">Receives the events, oldest first</param>
+/// <param name="maxEvents">Maximum number of events to take; the others are left for the next call</param>
+/// <param name="timeoutMs">Maximum time to wait for an event</param>
+/// <returns>Number of events taken; 0 if the wait timed out</returns>
+int ClientEventQueue::Wait(ClientEvent* events, int maxEvents, int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (!eventCond.wait_for(lock, std::chrono::milliseconds((std::max)(timeoutMs, 0)), [this]() { return !pendingEvents.empty(); }))
+        return 0;
+
+    int numEvents = static_cast<int>((std::min)(pendingEvents.size(), static_cast<size_t>((std::max)(maxEvents, 0))));
+
+    std::copy(pendingEvents.begin(), pendingEvents.begin() + numEvents, events);
+    pendingEvents.erase(pendingEvents.begin(), pendingEvents.begin() + numEvents);
+
+    return numEvents;
+}
@@ -0,0 +1,146 @@
+/***************************************************************************\
+
+Module Name:  ClockModel.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module follows the offset and the drift of a source clock, such as the
+clock of a camera or those of a capture node, from the clock of this
+computer. Each sample pairs a time of the source with the time of this
+computer it was observed at, along with the delay which skews it: the
+transfer of a frame, or the round trip of a ping. The samples are grouped
+by periods of the source clock, the least delayed sample of each period is
+kept, and a line is fit through them, so that the slow drift of the clocks
+is followed while the delays, which are never negative, are mostly left out.
+
+\***************************************************************************/
+
+#include "clockModel.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+
+void ClockModel::Reset()
+{
+    numPeriods = 0;
+    lastPeriod = 0;
+    lastPeriodIndex = 0;
+    numSamples = 0;
+    referenceTimeUs = 0;
+    referenceOffsetUs = 0;
+    drift = 0.0;
+}
+
+/// <summary>
+/// Adds the observation of a time of the source clock at a time of this computer, and fits the model again
+/// </summary>
+/// <param name="delayUs">Delay which skews the observation; only the order of the delays of a period matters</param>
+void ClockModel::AddSample(int64_t sourceTimeUs, int64_t targetTimeUs, int64_t delayUs)
+{
+    Sample sample = { sourceTimeUs, targetTimeUs - sourceTimeUs, delayUs };
+
+    if (IsValid() && std::abs(targetTimeUs - ToTarget(sourceTimeUs)) > MaxJumpUs)
+        Reset();
+
+    int64_t periodIndex = sourceTimeUs / PeriodUs;
+
+    if (numPeriods == 0 || periodIndex > lastPeriodIndex)
+    {
+        lastPeriod = numPeriods == 0 ? 0 : (lastPeriod + 1) % NumPeriods;
+        periods[lastPeriod] = sample;
+
+        if (numPeriods < NumPeriods)
+            numPeriods++;
+
+        lastPeriodIndex = periodIndex;
+    }
+    else if (delayUs < periods[lastPeriod].DelayUs)
+    {
+        // A source clock set back by less than the jump is kept in the last period
+        periods[lastPeriod] = sample;
+    }
+
+    numSamples = (std::min)(numSamples + 1, INT_MAX - 1);
+    Fit();
+}
+
+// The model converts times once it has a sample
+bool ClockModel::IsValid() const
+{
+    return numSamples > 0;
+}
+
+int ClockModel::GetNumSamples() const
+{
+    return numSamples;
+}
+
+/// <summary>
+/// Converts a time of the source clock to the clock of this computer
+/// </summary>
+int64_t ClockModel::ToTarget(int64_t sourceTimeUs) const
+{
+    return sourceTimeUs + referenceOffsetUs + static_cast<int64_t>(std::llround(drift * static_cast<double>(sourceTimeUs - referenceTimeUs)));
+}
+
+// Offset of the clock of this computer from the source clock, at the last sample
+int64_t ClockModel::GetOffsetUs() const
+{
+    return referenceOffsetUs;
+}
+
+// Rate at which the clock of this computer gains on the source clock, in microseconds each second
+double ClockModel::GetDriftPpm() const
+{
+    return drift * 1e6;
+}
+
+/// <summary>
+/// Fits the line of the offsets through the least delayed sample of each period, by least squares. Until the periods
+/// span MinFitSpanUs, the drift is left out and the least delayed sample sets the offset.
+/// </summary>
+void ClockModel::Fit()
+{
+    int firstPeriod = (lastPeriod - numPeriods + 1 + NumPeriods) % NumPeriods;
+    const Sample& last = periods[lastPeriod];
+    referenceTimeUs = last.SourceTimeUs;
+
+    if (last.SourceTimeUs - periods[firstPeriod].SourceTimeUs < MinFitSpanUs)
+    {
+        const Sample* best = &last;
+
+        for (int i = 0; i < numPeriods; i++)
+        {
+            if (periods[i].DelayUs < best->DelayUs)
+                best = &periods[i];
+        }
+
+        referenceOffsetUs = best->OffsetUs;
+        drift = 0.0;
+        return;
+    }
+
+    // Relative to the last sample, so that the sums keep the precision of the microseconds
+    double sumX = 0.0, sumY = 0.0, sumXX = 0.0, sumXY = 0.0;
+
+    for (int i = 0; i < numPeriods; i++)
+    {
+        double x = static_cast<double>(periods[i].SourceTimeUs - last.SourceTimeUs);
+        double y = static_cast<double>(periods[i].OffsetUs - last.OffsetUs);
+        sumX += x;
+        sumY += y;
+        sumXX += x * x;
+        sumXY += x * y;
+    }
+
+    double meanX = sumX / numPeriods;
+    double meanY = sumY / numPeriods;
+    double varianceX = sumXX / numPeriods - meanX * meanX;
+    double slope = varianceX > 0.0 ? (sumXY / numPeriods - meanX * meanY) / varianceX : 0.0;
+
+    drift = (std::max)(-MaxDrift, (std::min)(slope, MaxDrift));
+    referenceOffsetUs = last.OffsetUs + static_cast<int64_t>(std::llround(meanY - drift * meanX));
+}
@@ -0,0 +1,244 @@
+/***************************************************************************\
+
+Module Name:  DeviceRegistry.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the registry of the Orbbec devices shared by all the
+clients of the process. The devices are enumerated once with a single SDK
+context and addressed by serial number, and a startup barrier lets all the
+cameras of the rig initialize at the same time. The listeners of the
+clients are told when a device is unplugged or plugged back in, so that a
+client can reopen its camera while the others keep streaming.
+
+\***************************************************************************/
+
+#include "deviceRegistry.h"
+#include <algorithm>
+
+/// <summary>
+/// Returns the registry shared by all the clients. Like the task scheduler, it is intentionally never destroyed so
+/// that the SDK context is not released from the static destructors when the DLL is unloaded.
+/// </summary>
+DeviceRegistry& DeviceRegistry::Instance()
+{
+    static DeviceRegistry* instance = new DeviceRegistry();
+    return *instance;
+}
+
+/// <summary>
+/// Enumerates the connected devices and sizes the startup barrier for the clients about to be launched. The barrier
+/// only waits for as many clients as there are devices, since the other clients cannot open a device.
+/// </summary>
+/// <param name="numClients">Number of clients about to be launched</param>
+void DeviceRegistry::PrepareStartup(int numClients)
+{
+    int numDevices = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(deviceMutex);
+
+        try
+        {
+            EnumerateDevices();
+            numDevices = static_cast<int>(serialNumbers.size());
+        }
+        catch (const ob::Error&)
+        {
+            // The clients enumerate again when opening their device and report the error themselves
+            deviceList.reset();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(startupMutex);
+    numExpectedClients = (std::min)(numClients, numDevices);
+    numArrivedClients = 0;
+}
+
+/// <summary>
+/// Opens a device, or returns it if it is already open. The serial number is used once the client knows its device,
+/// so that it finds the same camera again even if the enumeration order has changed.
+/// </summary>
+/// <param name="deviceIndex">Index of the device in the enumeration, used when no serial number is given</param>
+/// <param name="serialNumber">Serial number of the device; empty for the first opening</param>
+/// <returns>The device, or nullptr if it is not connected. Throws ob::Error if the device fails to open.</returns>
+std::shared_ptr<ob::Device> DeviceRegistry::OpenDevice(int deviceIndex, const std::string& serialNumber)
+{
+    std::shared_ptr<ob::DeviceList> list;
+    std::string key;
+    int listIndex = -1;
+
+    {
+        std::lock_guard<std::mutex> lock(deviceMutex);
+
+        if (!deviceList)
+            EnumerateDevices();
+
+        listIndex = serialNumber.empty() ? deviceIndex : FindDevice(serialNumber);
+
+        // A device which is not in the list was plugged in (or back in) after the enumeration
+        if (!serialNumber.empty() && listIndex < 0)
+        {
+            EnumerateDevices();
+            listIndex = FindDevice(serialNumber);
+        }
+
+        if (listIndex < 0 || listIndex >= static_cast<int>(serialNumbers.size()))
+            return nullptr;
+
+        key = serialNumbers[listIndex];
+
+        std::shared_ptr<ob::Device> openedDevice = openedDevices[key].lock();
+
+        if (openedDevice)
+            return openedDevice;
+
+        list = deviceList;
+    }
+
+    // Opening a device takes a while, so the clients open theirs in parallel
+    std::shared_ptr<ob::Device> device;
+
+    try
+    {
+        device = list->getDevice(listIndex);
+    }
+    catch (const ob::Error&)
+    {
+        // The list may be older than the last time the device was plugged in; enumerate again for the next attempt
+        std::lock_guard<std::mutex> lock(deviceMutex);
+        deviceList.reset();
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(deviceMutex);
+    openedDevices[key] = device;
+
+    return device;
+}
+
+/// <summary>
+/// Marks a client as done starting its pipeline (or as failed to), releasing the barrier when it is the last one.
+/// </summary>
+void DeviceRegistry::ArriveAtStartup()
+{
+    std::lock_guard<std::mutex> lock(startupMutex);
+    numArrivedClients++;
+
+    if (numArrivedClients >= numExpectedClients)
+        startupCond.notify_all();
+}
+
+/// <summary>
+/// Waits until every client expected at startup has arrived. Returns immediately once the barrier has been released,
+/// so restarting a single camera later on never waits for the others.
+/// </summary>
+/// <param name="timeoutMs">Maximum time to wait for the other clients</param>
+/// <returns>True if all the clients arrived; false if the wait timed out.</returns>
+bool DeviceRegistry::WaitForStartup(int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(startupMutex);
+
+    return startupCond.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+        [this]() { return numArrivedClients >= numExpectedClients; });
+}
+
+/// <summary>
+/// Adds a listener of the devices unplugged and plugged in
+/// </summary>
+/// <returns>Id of the listener, to remove it</returns>
+int DeviceRegistry::AddDeviceListener(DeviceListener listener)
+{
+    std::lock_guard<std::mutex> lock(listenerMutex);
+    deviceListeners[nextListenerId] = listener;
+
+    return nextListenerId++;
+}
+
+/// <summary>
+/// Removes a listener; it is not called anymore once this returns
+/// </summary>
+void DeviceRegistry::RemoveDeviceListener(int listenerId)
+{
+    std::lock_guard<std::mutex> lock(listenerMutex);
+    deviceListeners.erase(listenerId);
+}
+
+/// <summary>
+/// Queries the connected devices with the shared context. Must be called with the device mutex held.
+/// </summary>
+bool DeviceRegistry::EnumerateDevices()
+{
+    if (!context)
+    {
+        context = std::make_shared<ob::Context>();
+        context->setLoggerSeverity(OB_LOG_SEVERITY_DEBUG);
+        context->setDeviceChangedCallback([this](std::shared_ptr<ob::DeviceList> removedList, std::shared_ptr<ob::DeviceList> addedList) {
+            OnDevicesChanged(removedList, addedList);
+        });
+    }
+
+    deviceList = context->queryDeviceList();
+    serialNumbers.clear();
+
+    int count = static_cast<int>(deviceList->deviceCount());
+
+    for (int i = 0; i < count; i++)
+        serialNumbers.push_back(deviceList->serialNumber(i));
+
+    return count > 0;
+}
+
+int DeviceRegistry::FindDevice(const std::string& serialNumber) const
+{
+    auto it = std::find(serialNumbers.begin(), serialNumbers.end(), serialNumber);
+
+    if (it == serialNumbers.end())
+        return -1;
+
+    return static_cast<int>(it - serialNumbers.begin());
+}
+
+/// <summary>
+/// Called by the SDK when devices are unplugged or plugged in. The devices are enumerated again by the next opening,
+/// rather than from the thread of the SDK, and the devices unplugged are forgotten so that they are opened anew.
+/// </summary>
+void DeviceRegistry::OnDevicesChanged(std::shared_ptr<ob::DeviceList> removedList, std::shared_ptr<ob::DeviceList> addedList)
+{
+    std::vector<std::string> removedSerialNumbers;
+    std::vector<std::string> addedSerialNumbers;
+
+    try
+    {
+        for (uint32_t i = 0; removedList && i < removedList->deviceCount(); i++)
+            removedSerialNumbers.push_back(removedList->serialNumber(i));
+
+        for (uint32_t i = 0; addedList && i < addedList->deviceCount(); i++)
+            addedSerialNumbers.push_back(addedList->serialNumber(i));
+    }
+    catch (const ob::Error&)
+    {
+        // Tell the listeners about the devices read so far
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(deviceMutex);
+        deviceList.reset();
+
+        for (const std::string& serialNumber : removedSerialNumbers)
+            openedDevices.erase(serialNumber);
+    }
+
+    std::lock_guard<std::mutex> lock(listenerMutex);
+
+    for (const auto& listener : deviceListeners)
+    {
+        for (const std::string& serialNumber : removedSerialNumbers)
+            listener.second(serialNumber, false);
+
+        for (const std::string& serialNumber : addedSerialNumbers)
+            listener.second(serialNumber, true);
+    }
+}
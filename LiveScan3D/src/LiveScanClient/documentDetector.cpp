@@ -8,20 +8,30 @@ Copyright (c) Canadian Space Agency.
 <Description>
 This module uses a YOLO machine learning model to detect documents from a 
 provided color frame and ranks its detections based on their size and blur.
+The best document is then tracked in the next frames, which are only searched
+in full every few detections or once it is lost. The detected
+quadrilaterals are rectified to the size the receivers render them at.
 
 \***************************************************************************/
 
 #include "documentDetector.h"
+#include "taskScheduler.h"
+#include "traceZones.h"
+#include "memoryUsage.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 
 DocumentDetector::DocumentDetector()
 {
-    StartDetectionThread();
 }
 
 DocumentDetector::~DocumentDetector()
 {
-    // Stop the detection thread
-    StopDetectionThread();
+    // Wait for the queued or running detection task, which uses this object
+    std::unique_lock<std::mutex> lock(detectionMutex);
+    isStopping = true;
+    detectionDoneCond.wait(lock, [this]() { return !isDetectionScheduled; });
 }
 
 void DocumentDetector::SetDetectionCallback(DetectionCallback callback) {
@@ -37,94 +47,238 @@ void DocumentDetector::SetLogger(std::function<void(const std::string&)> loggerF
 }
 
 /// <summary>
-/// Submits a new frame for document detection.
+/// Sets the largest size the receivers render the documents at, so that the crops are not scored, encoded and sent at
+/// a resolution no receiver shows. The crops keep their aspect ratio.
+/// </summary>
+/// <param name="width">Largest width, in pixels; 0 for no limit</param>
+/// <param name="height">Largest height, in pixels; 0 for no limit</param>
+void DocumentDetector::SetMaxDocumentSize(int width, int height)
+{
+    maxDocumentWidth = (std::max)(width, 0);
+    maxDocumentHeight = (std::max)(height, 0);
+}
+
+/// <summary>
+/// Submits a new frame for document detection. The frame is copied, downscaled if it is larger than needed, so the
+/// buffers can be released as soon as this returns; only the latest submitted frame is kept until the detection task
+/// runs. Frames must always be submitted from the same thread.
 /// </summary>
 /// <param name="color">Color frame on which to perform the document detection</param>
 /// <param name="depth">Depth frame on which to perform the document detection, aligned with the color frame</param>
-void DocumentDetector::SubmitFrame(std::shared_ptr<ob::ColorFrame> color, cv::Mat depth)
+void DocumentDetector::SubmitFrame(const cv::Mat& color, const cv::Mat& depth)
 {
-    // Store the newly submitted frame in local variables for thread processing
-    std::lock_guard<std::mutex> lock(frameMutex);
-    pendingColorFrame = color;
-    pendingDepthFrame = depth;
-    newFrameAvailable = true;
-    frameCond.notify_one();
+    if (!HasSceneChanged(depth))
+        return;
+
+    FrameCopy& copy = frameCopies[writeCopyIndex];
+
+    if (color.cols > MaxColorWidth)
+    {
+        cv::Size size(MaxColorWidth, cvRound(static_cast<double>(color.rows) * MaxColorWidth / color.cols));
+        cv::resize(color, copy.Color, size, 0, 0, cv::INTER_AREA);
+    }
+    else
+    {
+        color.copyTo(copy.Color);
+    }
+
+    depth.copyTo(copy.Depth);
+
+    // Publish the copy and take back the previous one of the mailbox, read or not
+    writeCopyIndex = mailbox.exchange(writeCopyIndex | NewFrameFlag) & ~NewFrameFlag;
+
+    ScheduleDetection();
 }
 
 /// <summary>
-/// Starts the detection thread and detects document from provided frames
+/// Checks whether a submitted frame should be detected: the samples of its depth are compared with those of the last
+/// frame detected, which they replace when it is. Sampling the depth costs a few thousand reads, far less than copying
+/// and searching the frame.
 /// </summary>
-void DocumentDetector::StartDetectionThread()
+/// <returns>False if the frame can be skipped</returns>
+bool DocumentDetector::HasSceneChanged(const cv::Mat& depth)
 {
-    stopThread = false;
+    if (depth.empty() || depth.type() != CV_16U)
+        return true;
+
+    int numColumns = (depth.cols + ChangeSampleStep - 1) / ChangeSampleStep;
+    int numRows = (depth.rows + ChangeSampleStep - 1) / ChangeSampleStep;
+    size_t numSamples = static_cast<size_t>(numColumns) * numRows;
+    bool isSizeChanged = changeSamples.size() != numSamples;
+
+    if (isSizeChanged)
+        changeSamples.assign(numSamples, 0);
 
-    detectThread = std::thread([this]() {
+    int numChanged = 0;
+    int numValid = 0;
+    size_t sample = 0;
 
-        while (!stopThread)
+    for (int y = 0; y < depth.rows; y += ChangeSampleStep)
+    {
+        const uint16_t* row = depth.ptr<uint16_t>(y);
+
+        for (int x = 0; x < depth.cols; x += ChangeSampleStep, sample++)
         {
-            std::shared_ptr<ob::ColorFrame> localColor;
-            cv::Mat localDepth;
+            int value = row[x];
+            int previous = changeSamples[sample];
 
-            // Wait for new frame
-            {
-                std::unique_lock<std::mutex> lock(frameMutex);
-                frameCond.wait(lock, [this]() { return newFrameAvailable || stopThread; });
+            numValid += value > 0 || previous > 0 ? 1 : 0;
+            numChanged += (value > 0) != (previous > 0) || std::abs(value - previous) > ChangeDepthThreshold ? 1 : 0;
+        }
+    }
 
-                if (stopThread) break;
+    bool isChanged = isSizeChanged || !isBackgroundLearned || isDocumentFound || numSkippedFrames >= MaxSkippedFrames
+        || numChanged > MinChangedRatio * numValid;
 
-                // Store latest frame in local variables
-                localColor = pendingColorFrame;
-                localDepth = pendingDepthFrame;
+    if (!isChanged)
+    {
+        numSkippedFrames++;
+        numUnchangedFrames++;
+        return false;
+    }
 
-                newFrameAvailable = false;
-            }
+    sample = 0;
 
-            // Try to detect a document from the frame
-            cv::Mat data;
-            float score = 0.0f;
-            short width = 0, height = 0;
-            bool found = Detect(localColor, localDepth, data, width, height, score);
-
-            // Call the detection callback if a document has been detected
-            if (found && resultCallback) {
-                DetectionResult result;
-                result.data = std::move(data);
-                result.width = width;
-                result.height = height;
-                result.score = score;
-
-                resultCallback(result);
-            }
-        }
-    });
+    for (int y = 0; y < depth.rows; y += ChangeSampleStep)
+    {
+        const uint16_t* row = depth.ptr<uint16_t>(y);
+
+        for (int x = 0; x < depth.cols; x += ChangeSampleStep)
+            changeSamples[sample++] = row[x];
+    }
+
+    numSkippedFrames = 0;
+    return true;
+}
+
+/// <summary>
+/// Queues a detection task on the shared task scheduler, unless one is already queued or running
+/// </summary>
+void DocumentDetector::ScheduleDetection()
+{
+    bool wasScheduled = false;
+
+    if (isStopping || !isDetectionScheduled.compare_exchange_strong(wasScheduled, true))
+        return;
+
+    // Detection runs at background priority so that it never delays the point cloud processing of the clients
+    TaskScheduler::Instance().Submit(BackgroundTaskPriority, [this]() { RunDetection(); });
 }
 
-void DocumentDetector::StopDetectionThread()
+/// <summary>
+/// Detects a document in the latest submitted frame, then queues a new task if another frame arrived in the meantime
+/// </summary>
+void DocumentDetector::RunDetection()
 {
+    TRACE_ZONE("DocumentDetection");
+
+    if (!isStopping && (mailbox.load() & NewFrameFlag) != 0)
     {
-        std::lock_guard<std::mutex> lock(frameMutex);
-        stopThread = true;
-        frameCond.notify_all();  // Wake the thread if waiting
+        // Take the latest copy, and leave the one read last time to the capture thread
+        readCopyIndex = mailbox.exchange(readCopyIndex) & ~NewFrameFlag;
+        const FrameCopy& copy = frameCopies[readCopyIndex];
+
+        // Try to detect a document from the frame
+        cv::Mat data;
+        float score = 0.0f;
+        short width = 0, height = 0;
+        auto start = std::chrono::steady_clock::now();
+        bool found = Detect(copy.Color, copy.Depth, data, width, height, score);
+        RecordDetectionCost(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        isDocumentFound = found;
+
+        // Call the detection callback if a document has been detected; the contour detection leaves it in trackedBox,
+        // at the resolution of the depth frame
+        if (found) {
+            cv::Rect2f region(static_cast<float>(trackedBox.x) / copy.Depth.cols, static_cast<float>(trackedBox.y) / copy.Depth.rows,
+                static_cast<float>(trackedBox.width) / copy.Depth.cols, static_cast<float>(trackedBox.height) / copy.Depth.rows);
+            PublishDocument(data, width, height, score, region);
+        }
     }
 
-    if (detectThread.joinable())
-        detectThread.join();
+    EndDetection();
 }
 
+/// <summary>
+/// Ends the current detection, and queues a new one if a frame was submitted meanwhile
+/// </summary>
+void DocumentDetector::EndDetection()
+{
+    // The copies have the size of the frames, so the one read stands for the others
+    const FrameCopy& copy = frameCopies[readCopyIndex];
+    memoryUsage.store(NumFrameCopies * (GetCapacityBytes(copy.Color) + GetCapacityBytes(copy.Depth))
+        + GetCapacityBytes(backgroundDepthSum) + GetCapacityBytes(backgroundDepthCount) + GetCapacityBytes(backgroundDepth)
+        + GetCapacityBytes(averageBackgroundDepth) + GetCapacityBytes(trackedTemplate) + detectionArena.GetCapacity(),
+        std::memory_order_relaxed);
+
+    // A new task is queued instead of looping so that frame tasks submitted meanwhile run first. The flag is cleared
+    // before the mailbox is checked, so that a frame submitted meanwhile is either seen here or schedules its own task.
+    std::lock_guard<std::mutex> lock(detectionMutex);
+    isDetectionScheduled = false;
+
+    if ((mailbox.load() & NewFrameFlag) != 0)
+        ScheduleDetection();
+
+    detectionDoneCond.notify_all();
+}
 
+/// <summary>
+/// Adds the cost of a detection to its average, which is logged every CostReportInterval detections along with the
+/// frames skipped meanwhile
+/// </summary>
+void DocumentDetector::RecordDetectionCost(double costMs)
+{
+    detectionCostMs += costMs;
+    numDetections++;
+
+    if (numDetections < CostReportInterval)
+        return;
+
+    std::string report = "[DocumentDetector] Detection: " + std::to_string(detectionCostMs / numDetections) + " ms per frame, " +
+        std::to_string(numUnchangedFrames.exchange(0)) + " unchanged frames skipped";
+
+    if (logFn) logFn(report);
+
+    detectionCostMs = 0.0;
+    numDetections = 0;
+}
+
+/// <summary>
+/// Encodes a detected document and passes it to the detection callback
+/// </summary>
+void DocumentDetector::PublishDocument(const cv::Mat& data, short width, short height, float score, const cv::Rect2f& region)
+{
+    if (!resultCallback)
+        return;
+
+    DetectionResult result;
+    result.width = width;
+    result.height = height;
+    result.score = score;
+    result.region = region;
+    ComputeSignature(data, result.signature);
+
+    // The crop is encoded here rather than by the server, off the capture and client threads. Progressive scans are
+    // a little smaller than baseline ones at this quality, and let the decoders which support it show the document
+    // before all of it is received.
+    if (cv::imencode(".jpg", data, result.jpeg, { cv::IMWRITE_JPEG_QUALITY, JpegQuality, cv::IMWRITE_JPEG_PROGRESSIVE, 1 })) {
+        resultCallback(result);
+    }
+}
 
 /// <summary>
 /// Uses computer vision techniques to detect any documents in the provided frame
 /// </summary>
-/// <param name="colorFrame">Color frame from the camera from which to detect documents</param>
+/// <param name="colorImage">Color frame from the camera from which to detect documents</param>
 /// <param name="depthMat">Depth frame, converted to an OpenCV Mat, from the camera from which to detect documents</param>
 /// <param name="documentData">Output pixels composing the detected document</param>
-/// <param name="documentPictureWidth">Output width of the detected document, in pixels</param>
-/// <param name="documentPictureHeight">Output height of the detected document, in pixels</param>
+/// <param name="documentPictureWidth">Output width of the detected document in the color frame, in pixels; the pixels
+/// are scaled to the crop size</param>
+/// <param name="documentPictureHeight">Output height of the detected document in the color frame, in pixels</param>
 /// <param name="documentScore">Score of the detected document to compare it with other detections</param>
 /// <returns>True if a document was detected, false otherwise</returns>
 bool DocumentDetector::Detect(
-    const std::shared_ptr<ob::ColorFrame>& colorFrame,
+    cv::Mat colorImage,
     cv::Mat depthMat,
     cv::Mat& documentData,
     short& documentPictureWidth,
@@ -132,83 +286,73 @@ bool DocumentDetector::Detect(
     float& bestScore
 )
 {
-    // Convert Orbbec color frame to OpenCV Mat
-    cv::Mat originalImage(colorFrame->height(), colorFrame->width(), CV_8UC3, colorFrame->data());
-    cv::cvtColor(originalImage, originalImage, cv::COLOR_BGR2RGB);
+    // Release the images of the previous detection; in debug builds, report the detections which did not fit in the arena
+    int numHeapAllocations = detectionArena.Reset();
 
-    // Resize image to match the resolution of the depth frame for detection
-    cv::Mat resizedImage;
-    cv::resize(originalImage, resizedImage, depthMat.size());
+#ifdef _DEBUG
+    if (numHeapAllocations > 0 && logFn) logFn("[DocumentDetector] Detection arena grew to " + std::to_string(detectionArena.GetCapacity()) + " bytes");
+#endif
 
-    // Compute the average depth of the background over several samples
+    cv::Mat validMask = detectionArena.AllocateMat(depthMat.rows, depthMat.cols, CV_8U);
+    cv::compare(depthMat, cv::Scalar(0), validMask, cv::CMP_GT);
+
+    // Compute the average depth of the background over several samples, from the valid depths of each pixel
     if (numBackgroundSamples < numRequiredBackgroundSamples)
     {
-        backgroundDepthSamples.push_back(depthMat.clone());
-        numBackgroundSamples++;
-
-        if (numBackgroundSamples >= numRequiredBackgroundSamples)
+        if (numBackgroundSamples == 0)
         {
-            // Accumulators
-            cv::Mat depthSum = cv::Mat::zeros(resizedImage.size(), CV_32F);
-            cv::Mat depthCount = cv::Mat::zeros(resizedImage.size(), CV_32S);
-
-            for (size_t i = 0; i < numRequiredBackgroundSamples; ++i)
-            {
-                cv::Mat depthSample = backgroundDepthSamples[i];
-
-                cv::Mat depthSampleFloat;
-                depthSample.convertTo(depthSampleFloat, CV_32F);
-
-                // Binary mask: 255 where valid, 0 elsewhere
-                cv::Mat validMaskBinary = (depthSample >= 0);
-
-                // For sum: convert to float in [0.0, 1.0]
-                cv::Mat validMaskFloat;
-                validMaskBinary.convertTo(validMaskFloat, CV_32F, 1.0 / 255.0);
-
-                // For count: convert to int (0 or 1)
-                cv::Mat validMaskInt;
-                validMaskBinary.convertTo(validMaskInt, CV_32S, 1.0f / 255.0f);
-
-                // Add valid depths to sum
-                depthSum += depthSampleFloat.mul(validMaskFloat);
-
-                // Add 1 to count where valid
-                depthCount += validMaskInt;
-            }
-
-            // Compute average: where count > 0
-            averageBackgroundDepth = cv::Mat::zeros(resizedImage.size(), CV_16U);
+            backgroundDepthSum = cv::Mat::zeros(depthMat.size(), CV_32F);
+            backgroundDepthCount = cv::Mat::zeros(depthMat.size(), CV_32F);
+        }
 
-            cv::Mat avgDepthFloat;
-            cv::divide(depthSum, depthCount, avgDepthFloat, 1, CV_32F);
+        cv::accumulate(depthMat, backgroundDepthSum, validMask);
+        cv::add(backgroundDepthCount, cv::Scalar(1.0), backgroundDepthCount, validMask);
+        numBackgroundSamples++;
 
-            // Convert to 16U safely
-            avgDepthFloat.convertTo(averageBackgroundDepth, CV_16U);
-        }
-        else
+        if (numBackgroundSamples < numRequiredBackgroundSamples)
         {
             return false;
         }
-    }
 
-    // Create a mask where depth has changed significantly (i.e., foreground)
-    cv::Mat mask = cv::Mat::zeros(resizedImage.size(), CV_8U);
+        isBackgroundLearned = true;
 
-    for (int y = 0; y < resizedImage.rows; ++y) {
-        for (int x = 0; x < resizedImage.cols; ++x) {
-            // Depth difference
-            uint16_t bgDepth = averageBackgroundDepth.at<uint16_t>(y, x);
-            uint16_t currDepth = depthMat.at<uint16_t>(y, x);
-            int depthDiff = static_cast<int>(bgDepth) - static_cast<int>(currDepth);
-            bool isDepthForeground = depthDiff > 15 || (bgDepth == 0 && depthDiff < -15);
+        // The pixels which were never valid get a null background
+        cv::max(backgroundDepthCount, cv::Scalar(1.0), backgroundDepthCount);
+        cv::divide(backgroundDepthSum, backgroundDepthCount, backgroundDepth);
+        backgroundDepth.convertTo(averageBackgroundDepth, CV_16U);
 
-            if (isDepthForeground) {
-                mask.at<uint8_t>(y, x) = 255;
-            }
-        }
+        backgroundDepthSum.release();
+        backgroundDepthCount.release();
     }
 
+    // Create a mask where the depth came closer than the background (i.e., foreground); the subtraction saturates at
+    // zero where the depth is farther. Depths where there is no background are foreground too.
+    cv::Mat mask = detectionArena.AllocateMat(depthMat.rows, depthMat.cols, CV_8U);
+    cv::Mat depthDiff = detectionArena.AllocateMat(depthMat.rows, depthMat.cols, CV_16U);
+    cv::subtract(averageBackgroundDepth, depthMat, depthDiff);
+    cv::compare(depthDiff, cv::Scalar(ForegroundDepthThreshold), mask, cv::CMP_GT);
+
+    cv::Mat uncoveredMask = detectionArena.AllocateMat(depthMat.rows, depthMat.cols, CV_8U);
+    cv::Mat farMask = detectionArena.AllocateMat(depthMat.rows, depthMat.cols, CV_8U);
+    cv::compare(averageBackgroundDepth, cv::Scalar(0), uncoveredMask, cv::CMP_EQ);
+    cv::compare(depthMat, cv::Scalar(ForegroundDepthThreshold), farMask, cv::CMP_GT);
+    cv::bitwise_and(uncoveredMask, farMask, uncoveredMask);
+    cv::bitwise_or(mask, uncoveredMask, mask);
+
+    // Let the background follow the slow changes of the scene, from the valid pixels which are not foreground
+    cv::Mat backgroundMask = detectionArena.AllocateMat(depthMat.rows, depthMat.cols, CV_8U);
+    cv::bitwise_not(mask, backgroundMask);
+    cv::bitwise_and(backgroundMask, validMask, backgroundMask);
+    cv::accumulateWeighted(depthMat, backgroundDepth, BackgroundAdaptationRate, backgroundMask);
+    backgroundDepth.convertTo(averageBackgroundDepth, CV_16U);
+
+    // Only the crops of the candidates are processed at full resolution; the rest of the detection runs on the color
+    // frame resized to the resolution of the depth frame, converted to RGB once resized
+    cv::Mat originalImage = colorImage;
+    cv::Mat resizedImage = detectionArena.AllocateMat(depthMat.rows, depthMat.cols, CV_8UC3);
+    cv::resize(originalImage, resizedImage, depthMat.size());
+    cv::cvtColor(resizedImage, resizedImage, cv::COLOR_BGR2RGB);
+
     // Depth mask pre-processing
     // Erode then dilate to clean up small noise
     cv::Mat morphKernelDepth = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(5,5));
@@ -218,18 +362,31 @@ bool DocumentDetector::Detect(
     // Apply mask: set color to black for masked pixels
     resizedImage.setTo(cv::Scalar(0, 0, 0), mask == 0);
 
-    // Apply mask to original image too for cropping
-    cv::Mat resizedMask;
-    cv::resize(mask, resizedMask, originalImage.size());
-    originalImage.setTo(cv::Scalar(0, 0, 0), resizedMask == 0);
-
     // Preprocess: Convert to grayscale and blur slightly
-    cv::Mat gray;
+    cv::Mat gray = detectionArena.AllocateMat(resizedImage.rows, resizedImage.cols, CV_8U);
     cv::cvtColor(resizedImage, gray, cv::COLOR_RGB2GRAY);
     cv::GaussianBlur(gray, gray, cv::Size(5, 5), 0);
 
+    // While a document is tracked, only check that it is still in place, and search the whole frame every few detections
+    if (isDocumentTracked && numTrackedDetections < FullDetectionInterval && TrackDocument(gray))
+    {
+        double sharpnessScore = 0.0;
+        cv::Size documentSize;
+
+        if (CropDocument(originalImage, mask, trackedQuad, documentData, documentSize, sharpnessScore))
+        {
+            numTrackedDetections++;
+            documentPictureWidth = static_cast<short>(documentSize.width);
+            documentPictureHeight = static_cast<short>(documentSize.height);
+            bestScore = static_cast<float>((0.9 * sharpnessScore / 1000.0) + (0.1 * trackedAreaRatio));
+            return true;
+        }
+    }
+
+    isDocumentTracked = false;
+
     // Edge detection
-    cv::Mat edges;
+    cv::Mat edges = detectionArena.AllocateMat(gray.rows, gray.cols, CV_8U);
     cv::Canny(gray, edges, 100, 200);
     cv::dilate(edges, edges, cv::Mat(), cv::Point(-1, -1), 1);
 
@@ -237,12 +394,12 @@ bool DocumentDetector::Detect(
     std::vector<std::vector<cv::Point>> contours;
     cv::findContours(edges, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
 
-    cv::Mat debugImage = resizedImage.clone();
-    cv::drawContours(debugImage, contours, -1, cv::Scalar(0, 255, 0), 2);
-
     // Look through all predictions and save the best one
     bestScore = 0.0f;
     bool found = false;
+    cv::Rect bestBox;
+    std::vector<cv::Point> bestQuad;
+    float bestAreaRatio = 0.0f;
 
     int imageWidth = resizedImage.cols;
     int imageHeight = resizedImage.rows;
@@ -279,37 +436,219 @@ bool DocumentDetector::Detect(
                 continue;
             }
 
-            // Project bounding box back to the original image's resolution
-            float scaleX = static_cast<float>(originalImage.size().width) / resizedImage.size().width;
-            float scaleY = static_cast<float>(originalImage.size().height) / resizedImage.size().height;
-            cv::Rect origBox = cv::Rect(
-                cv::Point(cvRound(boundingBox.x * scaleX), cvRound(boundingBox.y * scaleY)), 
-                cv::Size(cvRound(boundingBox.width * scaleX),
-                cvRound(boundingBox.height * scaleY))
-            );
-            
-            // Crop image
-            cv::Mat cropped = originalImage(origBox).clone();
-
-            // Compute sharpness score
-            cv::Mat croppedGray;
-            cv::cvtColor(cropped, croppedGray, cv::COLOR_RGB2GRAY);
-            cv::Mat lap;
-            cv::Laplacian(croppedGray, lap, CV_64F);
-            cv::Scalar mean, stddev;
-            cv::meanStdDev(lap, mean, stddev);
-            double sharpnessScore = stddev[0] * stddev[0];
+            cv::Mat cropped;
+            cv::Size documentSize;
+            double sharpnessScore = 0.0;
+
+            if (!CropDocument(originalImage, mask, approx, cropped, documentSize, sharpnessScore))
+            {
+                continue;
+            }
+
             double newScore = (0.9 * sharpnessScore / 1000.0) + (0.1 * areaRatio);
 
             if (newScore > bestScore) {
-                documentData = cropped.clone();
-                documentPictureWidth = cropped.cols;
-                documentPictureHeight = cropped.rows;
+                documentData = cropped;
+                documentPictureWidth = static_cast<short>(documentSize.width);
+                documentPictureHeight = static_cast<short>(documentSize.height);
                 bestScore = newScore;
+                bestBox = boundingBox;
+                bestQuad = approx;
+                bestAreaRatio = areaRatio;
                 found = true;
             }
         }
     }
 
+    // Track the best document in the next frames, from its appearance in this one
+    if (found)
+    {
+        isDocumentTracked = true;
+        numTrackedDetections = 0;
+        trackedBox = bestBox;
+        trackedQuad = bestQuad;
+        trackedAreaRatio = bestAreaRatio;
+        trackedFrameSize = gray.size();
+        gray(bestBox).copyTo(trackedTemplate);
+    }
+
     return found;
 }
+
+/// <summary>
+/// Checks that the tracked document is still in place, by matching its last appearance around its last position in
+/// the downscaled frame. The tracked position, and the corners of the document, follow its small moves.
+/// </summary>
+/// <param name="gray">Masked and blurred grayscale frame, at the resolution of the depth frame</param>
+/// <returns>True if the document was found around its last position, false if it is lost</returns>
+bool DocumentDetector::TrackDocument(const cv::Mat& gray)
+{
+    if (gray.size() != trackedFrameSize)
+    {
+        return false;
+    }
+
+    cv::Rect searchRegion = cv::Rect(
+        trackedBox.x - TrackingSearchMargin, trackedBox.y - TrackingSearchMargin,
+        trackedBox.width + 2 * TrackingSearchMargin, trackedBox.height + 2 * TrackingSearchMargin
+    ) & cv::Rect(0, 0, gray.cols, gray.rows);
+
+    cv::Mat matchScores;
+    cv::matchTemplate(gray(searchRegion), trackedTemplate, matchScores, cv::TM_CCOEFF_NORMED);
+
+    double bestMatch = 0.0;
+    cv::Point bestLocation;
+    cv::minMaxLoc(matchScores, nullptr, &bestMatch, nullptr, &bestLocation);
+
+    // A uniform region matches nothing, and gives no valid score
+    if (!(bestMatch >= TrackingMatchThreshold))
+    {
+        return false;
+    }
+
+    cv::Point offset(searchRegion.x + bestLocation.x - trackedBox.x, searchRegion.y + bestLocation.y - trackedBox.y);
+    trackedBox += offset;
+
+    for (cv::Point& corner : trackedQuad)
+        corner += offset;
+
+    return true;
+}
+
+/// <summary>
+/// Computes the signature of a detected document, a grayscale thumbnail which is cheap to compare with the signatures of
+/// the next detections
+/// </summary>
+/// <param name="documentData">Crop of the detected document (RGB)</param>
+/// <param name="signature">Output signature of the document</param>
+void DocumentDetector::ComputeSignature(const cv::Mat& documentData, DocumentSignature& signature)
+{
+    cv::Mat thumbnail;
+    cv::resize(documentData, thumbnail, cv::Size(DocumentSignatureSize, DocumentSignatureSize), 0, 0, cv::INTER_AREA);
+
+    // The signature is the storage of the grayscale thumbnail
+    cv::Mat gray(DocumentSignatureSize, DocumentSignatureSize, CV_8U, signature.data());
+    cv::cvtColor(thumbnail, gray, cv::COLOR_RGB2GRAY);
+}
+
+/// <summary>
+/// Gets the size a document is cropped at: the size of the document in the color frame, scaled down to fit the size
+/// the receivers render it at, or MaxCropSide when they set no limit
+/// </summary>
+/// <param name="documentSize">Size of the document in the color frame, in pixels</param>
+cv::Size DocumentDetector::GetCropSize(const cv::Size& documentSize) const
+{
+    int maxWidth = maxDocumentWidth;
+    int maxHeight = maxDocumentHeight;
+
+    if (maxWidth <= 0 && maxHeight <= 0)
+    {
+        maxWidth = MaxCropSide;
+        maxHeight = MaxCropSide;
+    }
+
+    double scale = 1.0;
+
+    if (maxWidth > 0 && documentSize.width > maxWidth)
+        scale = static_cast<double>(maxWidth) / documentSize.width;
+
+    if (maxHeight > 0 && documentSize.height * scale > maxHeight)
+        scale = static_cast<double>(maxHeight) / documentSize.height;
+
+    return cv::Size((std::max)(1, cvRound(documentSize.width * scale)), (std::max)(1, cvRound(documentSize.height * scale)));
+}
+
+/// <summary>
+/// Crops a document candidate from the full resolution color frame, rectified from its corners to the crop size, masks
+/// its background and scores its sharpness. Only the pixels of the crop are warped, so a tilted or close-up document
+/// costs no more to score, encode and send than one which faces the camera.
+/// </summary>
+/// <param name="originalImage">Full resolution color frame</param>
+/// <param name="mask">Foreground mask, at the resolution of the depth frame</param>
+/// <param name="quad">Corners of the candidate, in either winding, at the resolution of the depth frame</param>
+/// <param name="cropped">Output rectified crop of the candidate (RGB)</param>
+/// <param name="documentSize">Output size of the rectified candidate in the color frame, in pixels</param>
+/// <param name="sharpnessScore">Output variance of the Laplacian of the crop</param>
+/// <returns>False if the candidate is outside the color frame</returns>
+bool DocumentDetector::CropDocument(const cv::Mat& originalImage, const cv::Mat& mask, const std::vector<cv::Point>& quad, cv::Mat& cropped,
+    cv::Size& documentSize, double& sharpnessScore)
+{
+    if (quad.size() != 4)
+    {
+        return false;
+    }
+
+    // Order the corners clockwise in the image from the top left one, the closest to the origin
+    int first = 0;
+
+    for (int i = 1; i < 4; i++)
+    {
+        if (quad[i].x + quad[i].y < quad[first].x + quad[first].y)
+            first = i;
+    }
+
+    cv::Point edge1 = quad[(first + 1) % 4] - quad[first];
+    cv::Point edge2 = quad[(first + 3) % 4] - quad[first];
+    int step = edge1.x * edge2.y - edge1.y * edge2.x > 0 ? 1 : 3;
+
+    // Project the corners back to the original image's resolution
+    float scaleX = static_cast<float>(originalImage.size().width) / mask.size().width;
+    float scaleY = static_cast<float>(originalImage.size().height) / mask.size().height;
+    cv::Point2f maskCorners[4];
+    cv::Point2f imageCorners[4];
+
+    for (int i = 0; i < 4; i++)
+    {
+        maskCorners[i] = quad[(first + i * step) % 4];
+        imageCorners[i] = cv::Point2f(maskCorners[i].x * scaleX, maskCorners[i].y * scaleY);
+    }
+
+    // The document is as wide and high as its longest opposite edges
+    documentSize = cv::Size(
+        cvRound((std::max)(cv::norm(imageCorners[1] - imageCorners[0]), cv::norm(imageCorners[2] - imageCorners[3]))),
+        cvRound((std::max)(cv::norm(imageCorners[3] - imageCorners[0]), cv::norm(imageCorners[2] - imageCorners[1])))
+    );
+
+    cv::Rect origBox = cv::boundingRect(std::vector<cv::Point2f>(imageCorners, imageCorners + 4));
+
+    if (documentSize.area() == 0 || (origBox & cv::Rect(0, 0, originalImage.cols, originalImage.rows)).area() == 0)
+    {
+        return false;
+    }
+
+    cv::Size cropSize = GetCropSize(documentSize);
+    cv::Point2f cropCorners[4] = {
+        cv::Point2f(0.0f, 0.0f),
+        cv::Point2f(static_cast<float>(cropSize.width - 1), 0.0f),
+        cv::Point2f(static_cast<float>(cropSize.width - 1), static_cast<float>(cropSize.height - 1)),
+        cv::Point2f(0.0f, static_cast<float>(cropSize.height - 1))
+    };
+
+    // Warp the crop, converted to RGB once rectified, and apply the part of the mask under the document to the crop
+    // only; the pixels outside the color frame are black, like the background
+    cv::Mat warped;
+    cv::warpPerspective(originalImage, warped, cv::getPerspectiveTransform(imageCorners, cropCorners), cropSize, cv::INTER_LINEAR);
+    cv::cvtColor(warped, cropped, cv::COLOR_BGR2RGB);
+
+    cv::Mat croppedMask;
+    cv::warpPerspective(mask, croppedMask, cv::getPerspectiveTransform(maskCorners, cropCorners), cropSize, cv::INTER_NEAREST);
+    cropped.setTo(cv::Scalar(0, 0, 0), croppedMask == 0);
+
+    sharpnessScore = ScoreSharpness(cropped);
+
+    return true;
+}
+
+/// <summary>
+/// Scores the sharpness of a crop, as the variance of its Laplacian
+/// </summary>
+double DocumentDetector::ScoreSharpness(const cv::Mat& cropped)
+{
+    cv::Mat croppedGray;
+    cv::cvtColor(cropped, croppedGray, cv::COLOR_RGB2GRAY);
+    cv::Mat lap;
+    cv::Laplacian(croppedGray, lap, CV_64F);
+    cv::Scalar mean, stddev;
+    cv::meanStdDev(lap, mean, stddev);
+    return stddev[0] * stddev[0];
+}
@@ -0,0 +1,262 @@
+/***************************************************************************\
+
+Module Name:  ExclusionMask.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module learns the static clutter of the empty scene (stand, walls,
+furniture) as a mask of world space voxels, from the points of the frames
+captured at setup time. The voxels the clutter fills are excluded, and the
+points which fall in them can then be removed with a single bit test. The
+mask is saved next to the calibration of the camera, and is only valid as
+long as that calibration is.
+
+\***************************************************************************/
+
+#include "exclusionMask.h"
+#include "memoryUsage.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+    const char FileMagic[4] = { 'L', 'S', 'E', 'M' };
+    const uint32_t FileVersion = 1;
+
+    struct ExclusionMaskFileHeader {
+        char magic[4];
+        uint32_t version;
+        float origin[3];
+        float voxelSize;
+        uint32_t dims[3];
+    };
+}
+
+// Forgets the mask and frees its storage, so that no point is excluded
+void ExclusionMask::Clear() {
+    origin[0] = origin[1] = origin[2] = 0.0f;
+    voxelSize = inverseVoxelSize = 0.0f;
+    dims[0] = dims[1] = dims[2] = 0;
+    numLearningFrames = numLearnedFrames = 0;
+    hitCounts = std::vector<uint8_t>();
+    frameHits = std::vector<uint64_t>();
+    excludedVoxels = std::vector<uint64_t>();
+}
+
+/// <summary>
+/// Forgets the current mask and starts learning a new one over the given world space bounds from the next frames
+/// passed to Learn. The voxels are as fine as MinVoxelSize, unless the bounds would need more than MaxNumVoxels.
+/// </summary>
+void ExclusionMask::StartLearning(const float* minBounds, const float* maxBounds, int numFrames) {
+    Clear();
+
+    float extent[3];
+
+    for (int i = 0; i < 3; i++)
+        extent[i] = (std::max)(maxBounds[i] - minBounds[i], MinVoxelSize);
+
+    // The rounding up of each axis can still make too many voxels, in which case they grow a little more
+    voxelSize = (std::max)(MinVoxelSize, std::cbrt(extent[0] * extent[1] * extent[2] / MaxNumVoxels));
+
+    do {
+        inverseVoxelSize = 1.0f / voxelSize;
+
+        for (int i = 0; i < 3; i++) {
+            origin[i] = minBounds[i];
+            dims[i] = static_cast<unsigned int>(std::ceil(extent[i] * inverseVoxelSize));
+        }
+
+        voxelSize *= 1.01f;
+    } while (GetNumVoxels() > MaxNumVoxels);
+
+    voxelSize = 1.0f / inverseVoxelSize;
+
+    size_t numVoxels = GetNumVoxels();
+    numLearningFrames = (std::min)((std::max)(numFrames, 1), int(UINT8_MAX));
+    hitCounts.assign(numVoxels, 0);
+    frameHits.assign((numVoxels + 63) / 64, 0);
+}
+
+bool ExclusionMask::IsLearning() const {
+    return numLearnedFrames < numLearningFrames;
+}
+
+bool ExclusionMask::IsLearned() const {
+    return !excludedVoxels.empty();
+}
+
+int ExclusionMask::GetNumExcludedVoxels() const {
+    int count = 0;
+
+    for (uint64_t word : excludedVoxels) {
+        for (; word != 0; word &= word - 1)
+            count++;
+    }
+
+    return count;
+}
+
+size_t ExclusionMask::GetMemoryUsage() const {
+    return GetCapacityBytes(hitCounts) + GetCapacityBytes(frameHits) + GetCapacityBytes(excludedVoxels);
+}
+
+size_t ExclusionMask::GetNumVoxels() const {
+    return static_cast<size_t>(dims[0]) * dims[1] * dims[2];
+}
+
+/// <summary>
+/// Counts the voxels the world space points of one learning frame fall in, each voxel once per frame. The mask is
+/// built once the requested number of frames have been learned.
+/// </summary>
+void ExclusionMask::Learn(const float* x, const float* y, const float* z, int count) {
+    if (!IsLearning())
+        return;
+
+    std::fill(frameHits.begin(), frameHits.end(), 0);
+
+    for (int i = 0; i < count; i++) {
+        int ix = static_cast<int>(std::floor((x[i] - origin[0]) * inverseVoxelSize));
+        int iy = static_cast<int>(std::floor((y[i] - origin[1]) * inverseVoxelSize));
+        int iz = static_cast<int>(std::floor((z[i] - origin[2]) * inverseVoxelSize));
+
+        if (ix < 0 || iy < 0 || iz < 0 || ix >= int(dims[0]) || iy >= int(dims[1]) || iz >= int(dims[2]))
+            continue;
+
+        size_t index = (static_cast<size_t>(iz) * dims[1] + iy) * dims[0] + ix;
+        frameHits[index >> 6] |= uint64_t(1) << (index & 63);
+    }
+
+    // Most of the words of a frame are empty, and are skipped whole
+    for (size_t word = 0; word < frameHits.size(); word++) {
+        uint64_t bits = frameHits[word];
+
+        for (int bit = 0; bits != 0; bit++, bits >>= 1) {
+            if (bits & 1)
+                hitCounts[word * 64 + bit]++;
+        }
+    }
+
+    if (++numLearnedFrames == numLearningFrames)
+        FinishLearning();
+}
+
+/// <summary>
+/// Excludes the voxels which had points in enough learning frames, then grows them by one voxel in every direction,
+/// so that the sensor noise on the surfaces of the clutter does not leak through the mask
+/// </summary>
+void ExclusionMask::FinishLearning() {
+    size_t numVoxels = GetNumVoxels();
+    int minHits = (std::max)(MinHitFrames, numLearningFrames / MinHitRatio);
+    std::vector<uint8_t> isExcluded(numVoxels);
+
+    for (size_t i = 0; i < numVoxels; i++)
+        isExcluded[i] = hitCounts[i] >= minHits;
+
+    hitCounts = std::vector<uint8_t>();
+    frameHits = std::vector<uint64_t>();
+
+    // The 3x3x3 dilation is separable, so it is done along each axis in turn
+    size_t strides[3] = { 1, dims[0], static_cast<size_t>(dims[0]) * dims[1] };
+    std::vector<uint8_t> dilated(numVoxels);
+
+    for (int axis = 0; axis < 3; axis++) {
+        size_t stride = strides[axis];
+        size_t length = dims[axis];
+
+        for (size_t i = 0; i < numVoxels; i++) {
+            size_t position = (i / stride) % length;
+            uint8_t value = isExcluded[i];
+
+            if (position > 0)
+                value |= isExcluded[i - stride];
+            if (position + 1 < length)
+                value |= isExcluded[i + stride];
+
+            dilated[i] = value;
+        }
+
+        isExcluded.swap(dilated);
+    }
+
+    excludedVoxels.assign((numVoxels + 63) / 64, 0);
+
+    for (size_t i = 0; i < numVoxels; i++) {
+        if (isExcluded[i])
+            excludedVoxels[i >> 6] |= uint64_t(1) << (i & 63);
+    }
+
+    // A scene without clutter needs no mask; keep one word so that the mask still counts as learned
+    if (excludedVoxels.empty())
+        excludedVoxels.assign(1, 0);
+}
+
+std::string ExclusionMask::GetFileName(const std::string& serialNumber) {
+    return "exclusion_" + serialNumber + ".bin";
+}
+
+/// <summary>
+/// Attempts to load the mask of the given camera from a file saved by a previous run
+/// </summary>
+bool ExclusionMask::Load(const std::string& serialNumber) {
+    FILE* file = fopen(GetFileName(serialNumber).c_str(), "rb");
+
+    if (!file)
+        return false;
+
+    ExclusionMaskFileHeader header;
+    bool isRead = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, FileMagic, sizeof(FileMagic)) == 0
+        && header.version == FileVersion && header.voxelSize > 0.0f
+        && static_cast<size_t>(header.dims[0]) * header.dims[1] * header.dims[2] <= MaxNumVoxels;
+
+    if (isRead) {
+        Clear();
+
+        for (int i = 0; i < 3; i++) {
+            origin[i] = header.origin[i];
+            dims[i] = header.dims[i];
+        }
+
+        voxelSize = header.voxelSize;
+        inverseVoxelSize = 1.0f / voxelSize;
+        excludedVoxels.resize((std::max)((GetNumVoxels() + 63) / 64, size_t(1)));
+        isRead = fread(excludedVoxels.data(), sizeof(uint64_t), excludedVoxels.size(), file) == excludedVoxels.size();
+
+        if (!isRead)
+            Clear();
+    }
+
+    fclose(file);
+    return isRead;
+}
+
+/// <summary>
+/// Saves the learned mask of the given camera to a file, next to its calibration
+/// </summary>
+bool ExclusionMask::Save(const std::string& serialNumber) const {
+    if (!IsLearned())
+        return false;
+
+    FILE* file = fopen(GetFileName(serialNumber).c_str(), "wb");
+
+    if (!file)
+        return false;
+
+    ExclusionMaskFileHeader header;
+    memcpy(header.magic, FileMagic, sizeof(FileMagic));
+    header.version = FileVersion;
+    header.voxelSize = voxelSize;
+
+    for (int i = 0; i < 3; i++) {
+        header.origin[i] = origin[i];
+        header.dims[i] = dims[i];
+    }
+
+    bool isWritten = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(excludedVoxels.data(), sizeof(uint64_t), excludedVoxels.size(), file) == excludedVoxels.size();
+
+    fclose(file);
+    return isWritten;
+}
@@ -17,87 +17,426 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 \***************************************************************************/
 
 #include "filter.h"
+#include "memoryUsage.h"
+#include "taskScheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
 
 using namespace std;
 
+namespace
+{
+	/// <summary>
+	/// nanoflann result set counting the points within a radius of the query. Once the required count is reached,
+	/// its worst distance becomes negative, which makes the search skip all the remaining branches of the tree.
+	/// </summary>
+	class RadiusCountResultSet
+	{
+	public:
+		RadiusCountResultSet(float radiusSquared, size_t requiredCount) :
+			radiusSquared(radiusSquared), requiredCount(requiredCount), count(0)
+		{
+		}
+
+		inline bool full() const { return true; }
+		inline size_t size() const { return count; }
+		inline bool IsCountReached() const { return count >= requiredCount; }
+
+		inline void addPoint(float dist, size_t /*index*/)
+		{
+			// Points on the sphere count too, as in the k-th neighbour distance test
+			if (dist <= radiusSquared)
+				count++;
+		}
+
+		inline float worstDist() const
+		{
+			return IsCountReached() ? -1.0f : nextafterf(radiusSquared, numeric_limits<float>::infinity());
+		}
+
+	private:
+		float radiusSquared;
+		size_t requiredCount;
+		size_t count;
+	};
+
+	const unsigned char Undecided = 2; // Kept flag of the points whose neighbours must be searched
+
+	/// <summary>
+	/// Sets the kept flag of each point to the decision cached for it, or to Undecided, and stores the reused
+	/// decisions for the next frame; without a cache, every point is undecided. The points flagged in sureKept are
+	/// kept without looking up the cache.
+	/// </summary>
+	/// <returns>The number of undecided points</returns>
+	int FindCachedDecisions(const PointBuffer& points, OutlierDecisionCache* decisions, const unsigned char* sureKept,
+		std::vector<unsigned char>& isKept, int blockSize)
+	{
+		int numPoints = static_cast<int>(points.Size());
+
+		if (!decisions && !sureKept)
+		{
+			std::fill(isKept.begin(), isKept.begin() + numPoints, Undecided);
+			return numPoints;
+		}
+
+		int numBlocks = (numPoints + blockSize - 1) / blockSize;
+		std::atomic<int> numUndecided{ 0 };
+
+		TaskScheduler::Instance().ParallelFor(0, numBlocks, [&](int block)
+		{
+			int end = (std::min)(numPoints, (block + 1) * blockSize);
+			int numBlockUndecided = 0;
+
+			for (int i = block * blockSize; i < end; i++)
+			{
+				if (sureKept && sureKept[i])
+				{
+					isKept[i] = 1;
+					continue;
+				}
+
+				if (!decisions)
+				{
+					isKept[i] = Undecided;
+					numBlockUndecided++;
+					continue;
+				}
+
+				int pixelIndex = points.PixelIndices[i];
+				int decision = decisions->Find(pixelIndex, points.X[i], points.Y[i], points.Z[i]);
+
+				if (decision == OutlierDecisionCache::NoDecision)
+				{
+					isKept[i] = Undecided;
+					numBlockUndecided++;
+					continue;
+				}
+
+				isKept[i] = static_cast<unsigned char>(decision);
+				decisions->Store(pixelIndex, points.X[i], points.Y[i], points.Z[i], decision != 0);
+			}
+
+			numUndecided += numBlockUndecided;
+		});
+
+		return numUndecided;
+	}
+}
+
+/// <summary>
+/// Forgets the decisions, and frees the storage
+/// </summary>
+void OutlierDecisionCache::Reset()
+{
+	ReleaseCapacity(entries);
+	frameIndex = 0;
+	previousFrame = UnusedFrame;
+	neighbours = 0;
+	distance = 0.0f;
+}
+
+size_t OutlierDecisionCache::GetMemoryUsage() const
+{
+	return GetCapacityBytes(entries);
+}
+
+/// <summary>
+/// Starts the decisions of a new frame; those of the previous frame are forgotten when the size of the depth frames
+/// or the parameters of the filter changed. Must be called before each frame the cache is passed to a filter for.
+/// </summary>
+/// <param name="numPixels">Pixels of the depth frame the points come from</param>
+void OutlierDecisionCache::BeginFrame(size_t numPixels, int k, float maxDist)
+{
+	bool isForgotten = entries.size() != numPixels || k != neighbours || maxDist != distance;
+	previousFrame = frameIndex;
+
+	// The frame indices wrap around before they reach UnusedFrame, and the entries are cleared when they do, so that an
+	// entry of the last frame of one round is never taken for the previous frame of the next one
+	if (++frameIndex == UnusedFrame)
+	{
+		frameIndex = 0;
+		isForgotten = true;
+	}
+
+	if (isForgotten)
+	{
+		entries.assign(numPixels, Entry{ 0, UnusedFrame, 0 });
+		previousFrame = UnusedFrame;
+		neighbours = k;
+		distance = maxDist;
+		inverseVoxelSize = maxDist > 0.0f ? 1.0f / maxDist : 0.0f;
+	}
+}
+
+RadiusOutlierFilter::RadiusOutlierFilter() : tree(3, cloud)
+{
+}
+
+/// <summary>
+/// Returns the bytes held by the grid, the KD-tree and the KNN output arrays
+/// </summary>
+size_t RadiusOutlierFilter::GetMemoryUsage() const
+{
+	return grid.GetMemoryUsage() + tree.usedMemory() + GetCapacityBytes(neighbourIndices) + GetCapacityBytes(neighbourDistances)
+		+ GetCapacityBytes(isKept);
+}
+
+/// <summary>
+/// Selects the search of the neighbours of Apply: the voxel hash grid, by default, or the KD-tree; both keep the same
+/// points
+/// </summary>
+void RadiusOutlierFilter::SetHashGridEnabled(bool isEnabled)
+{
+	isHashGridUsed = isEnabled;
+}
+
+/// <summary>
+/// Trims the KNN output arrays to twice what the last frame needed
+/// </summary>
+void RadiusOutlierFilter::ReleaseUnusedMemory()
+{
+	TrimCapacity(neighbourIndices);
+	TrimCapacity(neighbourDistances);
+	TrimCapacity(isKept);
+	grid.ReleaseUnusedMemory();
+}
+
+/// <summary>
+/// Rebuilds the KD-tree over new points. The tree and its index array are reused from the previous frame.
+/// </summary>
+void RadiusOutlierFilter::BuildIndex(const PointBuffer &points)
+{
+	cloud.Points = &points;
+	tree.buildIndex();
+}
+
 /// <summary>
 /// Computes the k-nearest neighbours for each point in a point cloud using the KD-tree.
+/// The results are stored in the k-strided neighbourIndices and neighbourDistances arrays.
 /// </summary>
-/// <param name="cloud">Point cloud in which to compute the k-nearest neighbours</param>
-/// <param name="tree">KD-tree to use to compute the k-nearest neighbours</param>
+/// <param name="points">Point cloud in which to compute the k-nearest neighbours; it must not change until the next call</param>
 /// <param name="k">Number of neighbours to evaluate</param>
-/// <returns>A list of KNNResult, each containing the indices and distances of the k-nearest neighbors.</returns>
-vector<KNNResult> ComputeKNearestNeighbours(PointCloud &cloud, KdTree3D &tree, int k)
+void RadiusOutlierFilter::ComputeKNearestNeighbours(const PointBuffer &points, int k)
 {
-	vector<KNNResult> results(cloud.Points.size());
-	int numPoints = static_cast<int>(cloud.Points.size());
+	int numPoints = static_cast<int>(points.Size());
+	int numBlocks = (numPoints + BlockSize - 1) / BlockSize;
 
-#pragma omp parallel for
-	for (int i = 0; i < numPoints; i++)
+	neighbourIndices.resize(static_cast<size_t>(numPoints) * k);
+	neighbourDistances.resize(static_cast<size_t>(numPoints) * k);
+
+	if (numPoints == 0 || k <= 0)
+		return;
+
+	BuildIndex(points);
+
+	// The searches are independent; blocks of points are spread over the shared task scheduler
+	TaskScheduler::Instance().ParallelFor(0, numBlocks, [&](int block)
+	{
+		int end = (std::min)(numPoints, (block + 1) * BlockSize);
+
+		for (int i = block * BlockSize; i < end; i++)
+		{
+			// Perform the k-NN search using nanoflann
+			float queryPoint[3] = { points.X[i], points.Y[i], points.Z[i] };
+			tree.knnSearch(queryPoint, k, &neighbourIndices[static_cast<size_t>(i) * k], &neighbourDistances[static_cast<size_t>(i) * k]);
+		}
+	});
+}
+
+/// <summary>
+/// Removes outlier points from the input point cloud based on k-nearest neighbor distance. A point is kept when its
+/// k-th nearest neighbour (the point itself being the first one) is within maxDist. Rather than computing that
+/// distance, the search counts the points within maxDist and stops as soon as k of them are found.
+/// </summary>
+/// <param name="points">Input point cloud (this buffer will be modified directly)</param>
+/// <param name="k">Number of neighbours to evaluate</param>
+/// <param name="maxDist">Maximum distance with the k nearest neighbours for a point to be kept</param>
+/// <param name="decisions">Optional decisions of the previous frame, reused for the points which did not move, and
+/// updated with those of this frame; the pixel indices of the points must then be valid</param>
+/// <param name="sureKept">Optional flag of each point, set for those already known to have k neighbours within maxDist,
+/// such as those of a dense enough voxel; they are kept without searching the tree, which still holds them as the
+/// neighbours of the others</param>
+void RadiusOutlierFilter::Apply(PointBuffer &points, int k, float maxDist, OutlierDecisionCache* decisions, const unsigned char* sureKept)
+{
+	if (k <= 0 || maxDist <= 0 || points.Size() == 0)
+		return;
+
+	int numPoints = static_cast<int>(points.Size());
+	int numBlocks = (numPoints + BlockSize - 1) / BlockSize;
+	float distanceThresholdSquared = maxDist * maxDist;
+
+	isKept.resize(numPoints);
+
+	// The grid or the tree is only built when some points have no decision to reuse, and only those points search it.
+	// The voxels of the grid are as large as the distance, so the neighbours of a point are in the 27 voxels around it.
+	if (FindCachedDecisions(points, decisions, sureKept, isKept, BlockSize) > 0)
 	{
-		results[i].Neighbors.resize(k);
-		results[i].Distances.resize(k);
+		if (isHashGridUsed)
+			grid.Build(points.X.data(), points.Y.data(), points.Z.data(), 1, numPoints, maxDist);
+		else
+			BuildIndex(points);
+
+		TaskScheduler::Instance().ParallelFor(0, numBlocks, [&](int block)
+		{
+			int end = (std::min)(numPoints, (block + 1) * BlockSize);
+
+			for (int i = block * BlockSize; i < end; i++)
+			{
+				if (isKept[i] != Undecided)
+					continue;
+
+				if (isHashGridUsed)
+				{
+					isKept[i] = grid.CountNeighbours(points.X[i], points.Y[i], points.Z[i], maxDist, k) >= k;
+				}
+				else
+				{
+					float queryPoint[3] = { points.X[i], points.Y[i], points.Z[i] };
+					RadiusCountResultSet resultSet(distanceThresholdSquared, k);
+					tree.findNeighbors(resultSet, queryPoint, nanoflann::SearchParams());
 
-		// Perform the k-NN search using nanoflann
-		tree.knnSearch((float*)(cloud.Points.data() + i), k, (size_t*)results[i].Neighbors.data(), results[i].Distances.data());
+					isKept[i] = resultSet.IsCountReached();
+				}
+
+				if (decisions)
+					decisions->Store(points.PixelIndices[i], points.X[i], points.Y[i], points.Z[i], isKept[i] != 0);
+			}
+		});
+	}
+
+	// Remove the identified outliers (in-place compaction)
+	int writeIndex = 0;
+
+	for (int i = 0; i < numPoints; i++)
+	{
+		if (!isKept[i])
+			continue;
 
-		// Store the distance to the k-th nearest neighbor
-		results[i].KthNeighbourDistance = results[i].Distances[k - 1];
+		points.MovePoint(writeIndex, i);
+		writeIndex++;
 	}
 
-	return results;
+	points.Resize(writeIndex);
+}
+
+/// <summary>
+/// Returns the bytes held by the coordinate planes
+/// </summary>
+size_t OrganizedFilter::GetMemoryUsage() const
+{
+	return GetCapacityBytes(gridX) + GetCapacityBytes(gridY) + GetCapacityBytes(gridZ) + GetCapacityBytes(isKept);
+}
+
+/// <summary>
+/// Trims the kept flags to twice what the last frame needed; the planes have the size of the depth frame
+/// </summary>
+void OrganizedFilter::ReleaseUnusedMemory()
+{
+	TrimCapacity(isKept);
 }
 
 /// <summary>
-/// Removes outlier points from the input point cloud based on k-nearest neighbor distance.
+/// Removes outlier points from the input point cloud based on the number of neighbours found in their depth image window.
+/// A point is kept when at least k - 1 other points of the window are within maxDist of it, which matches the k-th
+/// nearest neighbour test of Filter (whose k nearest neighbours include the point itself) restricted to the window.
 /// </summary>
-/// <param name="vertices">Vertices of the input point cloud (this vector will be modified directly)</param>
-/// <param name="colors">Colors of the input point cloud (this vector will be modified directly)</param>
+/// <param name="points">Input point cloud (this buffer will be modified directly); its pixel indices must be valid</param>
+/// <param name="imageWidth">Width of the depth image the points come from</param>
+/// <param name="imageHeight">Height of the depth image the points come from</param>
 /// <param name="k">Number of neighbours to evaluate</param>
 /// <param name="maxDist">Maximum distance with the k nearest neighbours for a point to be kept</param>
-void Filter(std::vector<Point3f> &vertices, std::vector<RGB> &colors, int k, float maxDist)
+/// <param name="decisions">Optional decisions of the previous frame, reused for the points which did not move, and
+/// updated with those of this frame</param>
+void OrganizedFilter::Apply(PointBuffer &points, int imageWidth, int imageHeight, int k, float maxDist, OutlierDecisionCache* decisions)
 {
 	if (k <= 0 || maxDist <= 0)
 		return;
 
-	// Wrap input points into a PointCloud object
-	PointCloud cloud;
-	cloud.Points = vertices;
+	const float Empty = numeric_limits<float>::infinity();
 
-	// Build the KD-tree
-	KdTree3D tree(3, cloud);
-	tree.buildIndex();
-
-	// Compute k-nearest neighbors for all points
-	vector<KNNResult> knnResults = ComputeKNearestNeighbours(cloud, tree, k);
+	if (imageWidth != width || imageHeight != height)
+	{
+		width = imageWidth;
+		height = imageHeight;
+		gridX.assign(width * height, Empty);
+		gridY.assign(width * height, 0.0f);
+		gridZ.assign(width * height, 0.0f);
+	}
 
-	float distanceThresholdSquared = maxDist * maxDist;
-	vector<int> outlierIndices;
+	int numPoints = static_cast<int>(points.Size());
+	int numBlocks = (numPoints + BlockSize - 1) / BlockSize;
+	isKept.resize(numPoints);
 
-	// Identify outliers whose k-th neighbor is too far away
-	for (unsigned int i = 0; i < cloud.Points.size(); i++)
+	for (int i = 0; i < numPoints; i++)
 	{
-		if (knnResults[i].KthNeighbourDistance > distanceThresholdSquared)
-			outlierIndices.push_back(i);
+		int pixelIndex = points.PixelIndices[i];
+		gridX[pixelIndex] = points.X[i];
+		gridY[pixelIndex] = points.Y[i];
+		gridZ[pixelIndex] = points.Z[i];
 	}
 
-	// Remove the identified outliers (in-place compaction)
-	int writeIndex = 0;
-	unsigned int removeIndexCursor = 0;
-	for (unsigned int i = 0; i < vertices.size(); i++)
+	int numRequiredNeighbours = k - 1;
+	float distanceThresholdSquared = maxDist * maxDist;
+	bool hasUndecided = FindCachedDecisions(points, decisions, nullptr, isKept, BlockSize) > 0;
+
+	TaskScheduler::Instance().ParallelFor(0, hasUndecided ? numBlocks : 0, [&](int block)
 	{
-		if (removeIndexCursor < outlierIndices.size() && i == outlierIndices[removeIndexCursor])
+		int end = (std::min)(numPoints, (block + 1) * BlockSize);
+
+		for (int i = block * BlockSize; i < end; i++)
 		{
-			removeIndexCursor++;
-			continue;
+			if (isKept[i] != Undecided)
+				continue;
+
+			int pixelIndex = points.PixelIndices[i];
+			int u = pixelIndex % width;
+			int v = pixelIndex / width;
+			int u0 = (std::max)(0, u - WindowRadius), u1 = (std::min)(width - 1, u + WindowRadius);
+			int v0 = (std::max)(0, v - WindowRadius), v1 = (std::min)(height - 1, v + WindowRadius);
+
+			float x = points.X[i], y = points.Y[i], z = points.Z[i];
+			int numNeighbours = -1; // The point itself is part of its window
+
+			// Rows are contiguous in the planes and the comparison is branchless, so the inner loop vectorizes;
+			// the search stops after the first row which gives enough neighbours
+			for (int row = v0; row <= v1 && numNeighbours < numRequiredNeighbours; row++)
+			{
+				const float* rowX = &gridX[row * width];
+				const float* rowY = &gridY[row * width];
+				const float* rowZ = &gridZ[row * width];
+
+				for (int col = u0; col <= u1; col++)
+				{
+					float dx = rowX[col] - x;
+					float dy = rowY[col] - y;
+					float dz = rowZ[col] - z;
+
+					numNeighbours += (dx * dx + dy * dy + dz * dz <= distanceThresholdSquared) ? 1 : 0;
+				}
+			}
+
+			isKept[i] = numNeighbours >= numRequiredNeighbours;
+
+			if (decisions)
+				decisions->Store(pixelIndex, x, y, z, isKept[i] != 0);
 		}
+	});
+
+	// Compact the kept points in place and clear the pixels used by this frame
+	int writeIndex = 0;
 
-		vertices[writeIndex] = vertices[i];
-		colors[writeIndex] = colors[i];
+	for (int i = 0; i < numPoints; i++)
+	{
+		gridX[points.PixelIndices[i]] = Empty;
+
+		if (!isKept[i])
+			continue;
 
+		points.MovePoint(writeIndex, i);
 		writeIndex++;
 	}
 
-	vertices.resize(writeIndex);
-	colors.resize(writeIndex);
+	points.Resize(writeIndex);
 }
\ No newline at end of file
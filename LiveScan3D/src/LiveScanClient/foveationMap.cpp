@@ -0,0 +1,184 @@
+/***************************************************************************\
+
+Module Name:  FoveationMap.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module finds the regions of interest of the depth frames, which keep
+the full density of the points while the rest of the frame is decimated in
+coarser voxels. The regions are tiles of the depth frame: the tiles where
+the depth moves along with their neighbours, such as the hands of the
+operator, and those of the last detected document, each kept for a while
+after they were last seen.
+
+\***************************************************************************/
+
+#include "foveationMap.h"
+#include "memoryUsage.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+// Forgets the regions and frees the storage; the next frame passed to Update has no motion
+void FoveationMap::Reset() {
+    width = 0;
+    height = 0;
+    numTilesX = 0;
+    numTilesY = 0;
+    documentHoldFrames = 0;
+
+    ReleaseCapacity(previousDepth);
+    ReleaseCapacity(numMovingSamples);
+    ReleaseCapacity(motionHoldFrames);
+    ReleaseCapacity(pixelFovea);
+}
+
+size_t FoveationMap::GetMemoryUsage() const {
+    return GetCapacityBytes(previousDepth) + GetCapacityBytes(numMovingSamples) + GetCapacityBytes(motionHoldFrames)
+        + GetCapacityBytes(pixelFovea);
+}
+
+/// <summary>
+/// Sets the region of the last detected document, as fractions of the width and the height of the frame; it is kept
+/// for DocumentHoldFrames frames
+/// </summary>
+void FoveationMap::SetDocumentRegion(float left, float top, float regionWidth, float regionHeight) {
+    if (regionWidth <= 0.0f || regionHeight <= 0.0f)
+        return;
+
+    documentRegion[0] = left;
+    documentRegion[1] = top;
+    documentRegion[2] = regionWidth;
+    documentRegion[3] = regionHeight;
+    documentHoldFrames = DocumentHoldFrames;
+}
+
+/// <summary>
+/// Finds the regions of interest of a depth frame, from its motion since the previous frame and the last detected
+/// document. A change of the size of the frames starts again without motion.
+/// </summary>
+void FoveationMap::Update(const uint16_t* depth, int frameWidth, int frameHeight) {
+    size_t numPixels = static_cast<size_t>(frameWidth) * frameHeight;
+
+    if (frameWidth != width || frameHeight != height) {
+        width = frameWidth;
+        height = frameHeight;
+        numTilesX = (width + TileSize - 1) >> TileShift;
+        numTilesY = (height + TileSize - 1) >> TileShift;
+
+        previousDepth.assign(depth, depth + numPixels);
+        numMovingSamples.assign(static_cast<size_t>(numTilesX) * numTilesY, 0);
+        motionHoldFrames.assign(static_cast<size_t>(numTilesX) * numTilesY, 0);
+        pixelFovea.resize(numPixels);
+    }
+    else {
+        UpdateMotion(depth);
+        std::copy(depth, depth + numPixels, previousDepth.begin());
+    }
+
+    if (documentHoldFrames > 0)
+        documentHoldFrames--;
+
+    UpdatePixelFovea();
+}
+
+/// <summary>
+/// Counts the moving samples of each tile, and keeps the moving tiles which have a moving neighbour, along with their
+/// neighbours. Isolated tiles are left out, as they are more often the noise along the edges of the objects than parts
+/// in motion, and the neighbours cover the edges of the parts, which move less than their middle.
+/// </summary>
+void FoveationMap::UpdateMotion(const uint16_t* depth) {
+    std::fill(numMovingSamples.begin(), numMovingSamples.end(), static_cast<uint16_t>(0));
+
+    for (int y = 0; y < height; y += SampleStep) {
+        const uint16_t* row = depth + static_cast<size_t>(y) * width;
+        const uint16_t* previousRow = previousDepth.data() + static_cast<size_t>(y) * width;
+        uint16_t* tileCounts = numMovingSamples.data() + static_cast<size_t>(y >> TileShift) * numTilesX;
+
+        for (int x = 0; x < width; x += SampleStep) {
+            int d = row[x];
+            int previous = previousRow[x];
+
+            // Pixels appearing or disappearing are mostly the edges of the objects, and are not counted
+            if (d == 0 || previous == 0)
+                continue;
+
+            if (std::abs(d - previous) > BaseMotionMm + ((std::min)(d, previous) >> RelativeMotionShift))
+                tileCounts[x >> TileShift]++;
+        }
+    }
+
+    int numTileSamples = (TileSize / SampleStep) * (TileSize / SampleStep);
+    int minMovingSamples = numTileSamples / MovingSampleRatio;
+
+    auto IsMoving = [&](int tx, int ty) {
+        return tx >= 0 && ty >= 0 && tx < numTilesX && ty < numTilesY
+            && numMovingSamples[static_cast<size_t>(ty) * numTilesX + tx] >= minMovingSamples;
+    };
+
+    for (uint8_t& hold : motionHoldFrames) {
+        if (hold > 0)
+            hold--;
+    }
+
+    for (int ty = 0; ty < numTilesY; ty++) {
+        for (int tx = 0; tx < numTilesX; tx++) {
+            if (!IsMoving(tx, ty))
+                continue;
+
+            bool hasMovingNeighbour = false;
+
+            for (int ny = ty - 1; ny <= ty + 1 && !hasMovingNeighbour; ny++) {
+                for (int nx = tx - 1; nx <= tx + 1; nx++) {
+                    if ((nx != tx || ny != ty) && IsMoving(nx, ny)) {
+                        hasMovingNeighbour = true;
+                        break;
+                    }
+                }
+            }
+
+            if (!hasMovingNeighbour)
+                continue;
+
+            for (int ny = (std::max)(ty - 1, 0); ny <= (std::min)(ty + 1, numTilesY - 1); ny++) {
+                for (int nx = (std::max)(tx - 1, 0); nx <= (std::min)(tx + 1, numTilesX - 1); nx++)
+                    motionHoldFrames[static_cast<size_t>(ny) * numTilesX + nx] = static_cast<uint8_t>(MotionHoldFrames);
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Expands the tiles of the regions of interest to the pixels of the frame; each row of tiles is written once, and
+/// copied to the other rows of pixels of the tiles
+/// </summary>
+void FoveationMap::UpdatePixelFovea() {
+    int documentFirstX = 0, documentLastX = -1, documentFirstY = 0, documentLastY = -1;
+
+    if (documentHoldFrames > 0) {
+        documentFirstX = static_cast<int>(documentRegion[0] * numTilesX) - DocumentMarginTiles;
+        documentFirstY = static_cast<int>(documentRegion[1] * numTilesY) - DocumentMarginTiles;
+        documentLastX = static_cast<int>((documentRegion[0] + documentRegion[2]) * numTilesX) + DocumentMarginTiles;
+        documentLastY = static_cast<int>((documentRegion[1] + documentRegion[3]) * numTilesY) + DocumentMarginTiles;
+    }
+
+    for (int ty = 0; ty < numTilesY; ty++) {
+        int firstRow = ty << TileShift;
+        int numRows = (std::min)(TileSize, height - firstRow);
+        uint8_t* firstRowFovea = pixelFovea.data() + static_cast<size_t>(firstRow) * width;
+        bool isDocumentRow = ty >= documentFirstY && ty <= documentLastY;
+
+        for (int tx = 0; tx < numTilesX; tx++) {
+            bool isFoveated = motionHoldFrames[static_cast<size_t>(ty) * numTilesX + tx] > 0
+                || (isDocumentRow && tx >= documentFirstX && tx <= documentLastX);
+            int firstColumn = tx << TileShift;
+
+            std::memset(firstRowFovea + firstColumn, isFoveated ? 1 : 0, (std::min)(TileSize, width - firstColumn));
+        }
+
+        for (int row = 1; row < numRows; row++)
+            std::memcpy(firstRowFovea + static_cast<size_t>(row) * width, firstRowFovea, width);
+    }
+}
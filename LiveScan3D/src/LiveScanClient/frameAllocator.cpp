@@ -0,0 +1,126 @@
+/***************************************************************************\
+
+Module Name:  FrameAllocator.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the allocator of the frame-sized buffers of the
+capture, the processing and the recordings. The buffers are aligned to a
+cache line, which also suits the widest vector loads, and the largest ones
+can be backed by large pages, so that sweeping a frame does not miss the TLB
+every few kilobytes.
+
+\***************************************************************************/
+
+#include "frameAllocator.h"
+#include <windows.h>
+#include <malloc.h>
+#include <atomic>
+
+#pragma comment(lib, "advapi32.lib")
+
+namespace
+{
+    // Placed in the alignment padding in front of each buffer
+    struct FrameBufferHeader
+    {
+        bool IsLargePage;
+    };
+
+    static_assert(sizeof(FrameBufferHeader) <= FrameBufferAlignment, "The header must fit in front of the buffer");
+
+    std::atomic<bool> isLargePageEnabled{ false };
+
+    size_t GetLargePageSize()
+    {
+        static const size_t size = GetLargePageMinimum();
+        return size;
+    }
+
+    /// <summary>
+    /// Large pages are locked in memory, which needs the "Lock pages in memory" right of the account, enabled in the
+    /// token of the process
+    /// </summary>
+    bool EnableLockMemoryPrivilege()
+    {
+        HANDLE token = nullptr;
+
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+            return false;
+
+        TOKEN_PRIVILEGES privileges = {};
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+        // AdjustTokenPrivileges succeeds without the right, so its absence is only told by the last error
+        bool isEnabled = LookupPrivilegeValueA(nullptr, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+            && AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr)
+            && GetLastError() == ERROR_SUCCESS;
+
+        CloseHandle(token);
+        return isEnabled;
+    }
+}
+
+/// <summary>
+/// Allocates a buffer aligned to FrameBufferAlignment. With the large pages enabled, the buffers of at least one large
+/// page are backed by large pages, rounded up to a whole number of them; the others, and those for which no large page
+/// is left, come from the heap.
+/// </summary>
+void* AllocateFrameBuffer(size_t size)
+{
+    size_t totalSize = size + FrameBufferAlignment;
+    size_t largePageSize = GetLargePageSize();
+    void* base = nullptr;
+    bool isLargePage = false;
+
+    if (isLargePageEnabled && largePageSize > 0 && totalSize >= largePageSize)
+    {
+        size_t roundedSize = (totalSize + largePageSize - 1) / largePageSize * largePageSize;
+        base = VirtualAlloc(nullptr, roundedSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        isLargePage = base != nullptr;
+    }
+
+    if (!base)
+        base = _aligned_malloc(totalSize, FrameBufferAlignment);
+
+    if (!base)
+        throw std::bad_alloc();
+
+    static_cast<FrameBufferHeader*>(base)->IsLargePage = isLargePage;
+    return static_cast<char*>(base) + FrameBufferAlignment;
+}
+
+void FreeFrameBuffer(void* buffer)
+{
+    if (!buffer)
+        return;
+
+    void* base = static_cast<char*>(buffer) - FrameBufferAlignment;
+
+    if (static_cast<FrameBufferHeader*>(base)->IsLargePage)
+        VirtualFree(base, 0, MEM_RELEASE);
+    else
+        _aligned_free(base);
+}
+
+/// <summary>
+/// Enables or disables the large pages for the frame buffers allocated from then on; the buffers keep their pages
+/// until they are reallocated
+/// </summary>
+/// <returns>False if the large pages were requested but the system or the account does not allow them</returns>
+bool SetFrameLargePagesEnabled(bool isEnabled)
+{
+    if (!isEnabled)
+    {
+        isLargePageEnabled = false;
+        return true;
+    }
+
+    static const bool isAvailable = GetLargePageSize() > 0 && EnableLockMemoryPrivilege();
+    isLargePageEnabled = isAvailable;
+
+    return isAvailable;
+}
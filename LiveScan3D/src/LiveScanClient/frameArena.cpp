@@ -0,0 +1,93 @@
+/***************************************************************************\
+
+Module Name:  FrameArena.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains a bump allocator for the temporary buffers of a frame.
+Allocations are served from a single block which is released all at once
+when the next frame starts. A frame which does not fit in the block falls
+back to the heap, and the block grows to fit it for the following frames.
+
+\***************************************************************************/
+
+#include "frameArena.h"
+#include <cstdint>
+
+FrameArena::FrameArena() : block(nullptr), capacity(0), offset(0), frameSize(0), numHeapAllocations(0) {
+}
+
+FrameArena::~FrameArena() {
+    for (char* allocation : overflowAllocations)
+        delete[] allocation;
+
+    delete[] block;
+}
+
+// Releases everything allocated since the last reset and returns the number of heap allocations the frame needed,
+// which is 0 once the block has grown to the size of the largest frame
+int FrameArena::Reset() {
+    int numFrameHeapAllocations = numHeapAllocations;
+
+    if (!overflowAllocations.empty()) {
+        for (char* allocation : overflowAllocations)
+            delete[] allocation;
+
+        overflowAllocations.clear();
+
+        delete[] block;
+        block = new char[frameSize];
+        capacity = frameSize;
+    }
+
+    offset = 0;
+    frameSize = 0;
+    numHeapAllocations = 0;
+
+    return numFrameHeapAllocations;
+}
+
+// Returns uninitialized memory which is valid until the next reset
+void* FrameArena::AllocateBytes(size_t size, size_t alignment) {
+    if (alignment < BlockAlignment)
+        alignment = BlockAlignment;
+
+    // Count the worst case padding so that a block of the frame size always fits all of its allocations
+    frameSize += size + alignment - 1;
+
+    if (block) {
+        uintptr_t start = reinterpret_cast<uintptr_t>(block) + offset;
+        uintptr_t alignedStart = (start + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+        size_t alignedOffset = offset + static_cast<size_t>(alignedStart - start);
+
+        if (alignedOffset + size <= capacity) {
+            offset = alignedOffset + size;
+            return block + alignedOffset;
+        }
+    }
+
+    // The block is full; the block grows on the next reset so that this frame would have fit
+    char* allocation = new char[size + alignment];
+    overflowAllocations.push_back(allocation);
+    numHeapAllocations++;
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(allocation);
+    return reinterpret_cast<void*>((start + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1));
+}
+
+// Returns a continuous matrix which does not own its data. OpenCV functions writing to it reuse its memory as long as
+// the size and type of their output match.
+cv::Mat FrameArena::AllocateMat(int rows, int cols, int type) {
+    size_t size = static_cast<size_t>(rows) * cols * CV_ELEM_SIZE(type);
+    return cv::Mat(rows, cols, type, AllocateBytes(size, BlockAlignment));
+}
+
+int FrameArena::GetNumHeapAllocations() const {
+    return numHeapAllocations;
+}
+
+size_t FrameArena::GetCapacity() const {
+    return capacity;
+}
@@ -7,7 +7,19 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module reads and writes point cloud frames to files for recording and
-playback purposes.
+playback purposes. Recordings are written in the version 3 format: a file
+header, then each frame as a fixed binary header followed by its points and
+colors, then an index of the frames and a footer which locates it, so that
+readers seek to any frame directly. The points and colors of a frame are
+compressed with zstd, optionally as their difference with the previous
+frame, with a full frame at regular intervals for the readers which seek.
+Version 2 recordings, whose frames are not compressed, and version 1
+recordings, whose frames have a text header, are still read. The frames are
+compressed and written by a writer thread, in large blocks, from a bounded
+queue of the published frames; when the disk falls behind, the newest
+frames are dropped rather than the capture waiting for it. The clients of a
+process can share one recording, which interleaves the frames of their
+cameras in the order they are recorded, with a single writer and index.
 
 This code was adapted from the following research:
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
@@ -18,16 +30,81 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 
 #include "frameIOHandler.h"
 #include <ctime>
+#include <cstring>
+#include <algorithm>
+#ifdef LIVESCAN_ZSTD
+#include <zstd.h>
+#endif
+
+const char FrameIOHandler::RecordingMagic[4] = { 'L', 'S', '3', 'R' };
+std::mutex FrameIOHandler::sharedRecordingMutex;
+std::weak_ptr<FrameIOHandler> FrameIOHandler::sharedRecording;
 
 FrameIOHandler::~FrameIOHandler()
 {
 	CloseFile();
+
+#ifdef LIVESCAN_ZSTD
+	ZSTD_freeCCtx(compressionContext);
+	ZSTD_freeDCtx(decompressionContext);
+#endif
+}
+
+/// <summary>
+/// Gets the recording shared by the clients of the process, creating it if no client holds it. Its file is written
+/// by a single writer thread, in large blocks, rather than by a writer for each camera.
+/// </summary>
+std::shared_ptr<FrameIOHandler> FrameIOHandler::AcquireSharedRecording()
+{
+	std::lock_guard<std::mutex> lock(sharedRecordingMutex);
+	std::shared_ptr<FrameIOHandler> recording = sharedRecording.lock();
+
+	if (!recording)
+	{
+		recording = std::make_shared<FrameIOHandler>();
+		recording->isShared = true;
+		sharedRecording = recording;
+	}
+
+	return recording;
+}
+
+void FrameIOHandler::SetCompression(int level, bool isDeltaEnabled)
+{
+#ifdef LIVESCAN_ZSTD
+	requestedCompressionLevel = (std::max)(0, (std::min)(level, ZSTD_maxCLevel()));
+	isDeltaRequested = isDeltaEnabled;
+#else
+	requestedCompressionLevel = 0;
+	isDeltaRequested = false;
+#endif
 }
 
 void FrameIOHandler::CloseFile()
 {
+	std::lock_guard<std::mutex> lock(fileMutex);
+	CloseOpenFile();
+}
+
+void FrameIOHandler::CloseOpenFile()
+{
+	pendingFrames.clear();
+
 	if (fileHandle == nullptr)
+	{
+		isFileOpenForReading = false;
+		isFileOpenForWriting = false;
 		return;
+	}
+
+	// The index is only written once all the frames are, so a recording which is not closed has none; its frames
+	// are still read in order
+	if (isFileOpenForWriting)
+	{
+		StopWriter();
+		WriteFrameIndex();
+		FlushWriteBuffer();
+	}
 
 	fclose(fileHandle);
 	fileHandle = nullptr; 
@@ -48,39 +125,249 @@ int FrameIOHandler::GetElapsedRecordingTimeMs()
 
 void FrameIOHandler::OpenFileForReading()
 {
-	CloseFile();
+	CloseOpenFile();
 
 	fileHandle = fopen(filename.c_str(), "rb");
 
 	isFileOpenForReading = true;
 	isFileOpenForWriting = false;
+	readVersion = 1;
+
+	if (fileHandle == nullptr)
+		return;
+
+	RecordingFileHeader header;
+
+	if (fread(&header, sizeof(header), 1, fileHandle) != 1 || memcmp(header.Magic, RecordingMagic, sizeof(RecordingMagic)) != 0
+		|| (header.Version != 2 && header.Version != RecordingVersion))
+	{
+		rewind(fileHandle);
+		return;
+	}
+
+	readVersion = header.Version;
+	readDecodedFrame.clear();
+
+	// The frames end where the index starts, or at the end of the file if the recording was not closed
+	_fseeki64(fileHandle, 0, SEEK_END);
+	framesEndOffset = _ftelli64(fileHandle);
+
+	RecordingFooter footer;
+
+	if (framesEndOffset >= static_cast<int64_t>(sizeof(header) + sizeof(footer)))
+	{
+		_fseeki64(fileHandle, -static_cast<int64_t>(sizeof(footer)), SEEK_END);
+
+		if (fread(&footer, sizeof(footer), 1, fileHandle) == 1 && memcmp(footer.Magic, RecordingMagic, sizeof(RecordingMagic)) == 0)
+			framesEndOffset = static_cast<int64_t>(footer.IndexOffset);
+	}
+
+	_fseeki64(fileHandle, sizeof(header), SEEK_SET);
 }
 
 void FrameIOHandler::OpenNewFileForWriting(int deviceID)
 {
-	CloseFile();
+	CloseOpenFile();
 
 	char filename[1024];
 	time_t t = time(0);
 	struct tm * now = localtime(&t);
-	sprintf(filename, "recording_%01d_%04d_%02d_%02d_%02d_%02d_%02d.bin", deviceID, now->tm_year + 1900, now->tm_mon + 1, now->tm_mday, now->tm_hour, now->tm_min, now->tm_sec);
+
+	if (isShared)
+		sprintf(filename, "recording_all_%04d_%02d_%02d_%02d_%02d_%02d.bin", now->tm_year + 1900, now->tm_mon + 1, now->tm_mday, now->tm_hour, now->tm_min, now->tm_sec);
+	else
+		sprintf(filename, "recording_%01d_%04d_%02d_%02d_%02d_%02d_%02d.bin", deviceID, now->tm_year + 1900, now->tm_mon + 1, now->tm_mday, now->tm_hour, now->tm_min, now->tm_sec);
+
 	this->filename = filename; 
 	fileHandle = fopen(filename, "wb");
 
 	isFileOpenForReading = false;
 	isFileOpenForWriting = true;
+	frameIndex.clear();
+
+	numWrittenFrames = 0;
+	numWrittenBytes = 0;
+	numDroppedFrames = 0;
+	maxQueuedFrames = 0;
+	queuedDeviceFrames.clear();
+
+	if (fileHandle == nullptr)
+		return;
+
+	// The frames of a camera do not follow each other in a shared recording, so they are not delta compressed
+	compressionLevel = requestedCompressionLevel;
+	isDeltaEnabled = isDeltaRequested && compressionLevel > 0 && !isShared;
+	numFramesSinceKeyframe = 0;
+	previousCoordinates.clear();
+	previousColorBytes.clear();
+
+#ifdef LIVESCAN_ZSTD
+	if (compressionLevel > 0 && compressionContext == nullptr)
+		compressionContext = ZSTD_createCCtx();
+#endif
+
+	// The frames are written in blocks of their own, so the stream buffer would only add a copy
+	setvbuf(fileHandle, nullptr, _IONBF, 0);
+	writeBuffer.clear();
+	writeBuffer.reserve(WriteBlockSize);
+	writeBufferOffset = 0;
+
+	RecordingFileHeader header;
+	memcpy(header.Magic, RecordingMagic, sizeof(RecordingMagic));
+	header.Version = RecordingVersion;
+	header.Reserved = 0;
+	AppendBytes(&header, sizeof(header));
+
+	isWriteStopRequested = false;
+	writerThread = std::thread(&FrameIOHandler::WriteLoop, this);
 
 	ResetRecordingTimer();
 }
 
-bool FrameIOHandler::ReadFrame(std::vector<Point3s> &outPoints, std::vector<RGB> &outColors)
+/// <summary>
+/// Reads the next frame of the recording, closing it for writing first. The frames which are read before the next
+/// frame of the camera asked for are kept for the clients of their cameras, so that the clients of a shared recording
+/// read it once, in order.
+/// </summary>
+/// <param name="deviceID">Camera whose next frame to read, or AnyDevice for the next frame of any camera</param>
+bool FrameIOHandler::ReadFrame(std::vector<Point3s> &outPoints, std::vector<RGB> &outColors, int deviceID)
 {
+	std::lock_guard<std::mutex> lock(fileMutex);
+
 	if (!isFileOpenForReading)
 		OpenFileForReading();
 
 	outPoints.clear();
 	outColors.clear();
 
+	auto pending = pendingFrames.find(deviceID);
+
+	if (pending != pendingFrames.end() && !pending->second.empty())
+	{
+		outPoints.swap(pending->second.front().Points);
+		outColors.swap(pending->second.front().Colors);
+		pending->second.pop_front();
+		return true;
+	}
+
+	if (fileHandle == nullptr)
+		return false;
+
+	if (readVersion < 2)
+		return ReadFrameV1(outPoints, outColors);
+
+	while (ReadFrameV2(outPoints, outColors))
+	{
+		if (deviceID == AnyDevice || readCameraID == deviceID)
+			return true;
+
+		PendingFrame frame;
+		frame.Points.swap(outPoints);
+		frame.Colors.swap(outColors);
+		pendingFrames[readCameraID].push_back(std::move(frame));
+	}
+
+	return false;
+}
+
+/// <summary>
+/// Reads a frame of a version 2 or 3 recording. The frames are read in order, so the previous frame the delta frames
+/// are applied to is the last one read.
+/// </summary>
+bool FrameIOHandler::ReadFrameV2(std::vector<Point3s> &outPoints, std::vector<RGB> &outColors)
+{
+	FILE *fp = fileHandle;
+	RecordingFrameHeader header;
+	size_t headerSize = readVersion == 2 ? V2FrameHeaderSize : sizeof(header);
+
+	if (_ftelli64(fp) + static_cast<int64_t>(headerSize) > framesEndOffset || fread(&header, headerSize, 1, fp) != 1)
+		return false;
+
+	readCameraID = header.CameraID;
+
+	size_t coordinatesSize = sizeof(Point3s) * header.NumPoints;
+	size_t rawSize = coordinatesSize + sizeof(RGB) * header.NumPoints;
+
+	if (readVersion == 2)
+	{
+		header.DataSize = static_cast<uint32_t>(rawSize);
+		header.Encoding = RawEncoding;
+	}
+
+	// A frame cut short by the end of an unclosed recording is not read
+	if (_ftelli64(fp) + static_cast<int64_t>(header.DataSize) > framesEndOffset)
+		return false;
+
+	outPoints.resize(header.NumPoints);
+	outColors.resize(header.NumPoints);
+
+	if (header.Encoding == RawEncoding)
+	{
+		fread((void*)outPoints.data(), sizeof(Point3s), header.NumPoints, fp);
+		fread((void*)outColors.data(), sizeof(RGB), header.NumPoints, fp);
+
+		if (readVersion == 2)
+			return true;
+
+		readDecodedFrame.resize(rawSize);
+		memcpy(readDecodedFrame.data(), outPoints.data(), coordinatesSize);
+		memcpy(readDecodedFrame.data() + coordinatesSize, outColors.data(), rawSize - coordinatesSize);
+		return true;
+	}
+
+#ifndef LIVESCAN_ZSTD
+	// A build without zstd cannot decode the compressed frames, so the recording ends at the first of them
+	return false;
+#else
+	if (decompressionContext == nullptr)
+		decompressionContext = ZSTD_createDCtx();
+
+	readCompressedFrame.resize(header.DataSize);
+
+	if (fread(readCompressedFrame.data(), 1, header.DataSize, fp) != header.DataSize)
+		return false;
+
+	// The previous frame is kept in the decoded frame, which the delta frames are added to
+	size_t numPreviousPoints = readDecodedFrame.size() / (sizeof(Point3s) + sizeof(RGB));
+	std::vector<char> previousFrame;
+
+	if (header.Encoding == ZstdDeltaEncoding)
+		previousFrame.swap(readDecodedFrame);
+
+	readDecodedFrame.resize(rawSize);
+	size_t size = ZSTD_decompressDCtx(decompressionContext, readDecodedFrame.data(), rawSize, readCompressedFrame.data(), header.DataSize);
+
+	if (ZSTD_isError(size) || size != rawSize)
+	{
+		readDecodedFrame.clear();
+		return false;
+	}
+
+	if (header.Encoding == ZstdDeltaEncoding)
+	{
+		short* coordinates = reinterpret_cast<short*>(readDecodedFrame.data());
+		const short* previousCoordinates = reinterpret_cast<const short*>(previousFrame.data());
+		size_t numDeltaPoints = (std::min)(static_cast<size_t>(header.NumPoints), numPreviousPoints);
+
+		for (size_t i = 0; i < 3 * numDeltaPoints; i++)
+			coordinates[i] = static_cast<short>(coordinates[i] + previousCoordinates[i]);
+
+		uint8_t* colorBytes = reinterpret_cast<uint8_t*>(readDecodedFrame.data() + coordinatesSize);
+		const uint8_t* previousColorBytes = reinterpret_cast<const uint8_t*>(previousFrame.data() + sizeof(Point3s) * numPreviousPoints);
+
+		for (size_t i = 0; i < 3 * numDeltaPoints; i++)
+			colorBytes[i] = static_cast<uint8_t>(colorBytes[i] + previousColorBytes[i]);
+	}
+
+	memcpy(outPoints.data(), readDecodedFrame.data(), coordinatesSize);
+	memcpy(outColors.data(), readDecodedFrame.data() + coordinatesSize, rawSize - coordinatesSize);
+
+	return true;
+#endif
+}
+
+bool FrameIOHandler::ReadFrameV1(std::vector<Point3s> &outPoints, std::vector<RGB> &outColors)
+{
 	FILE *fp = fileHandle;
 
 	int numPoints = 0;
@@ -114,25 +401,251 @@ bool FrameIOHandler::ReadFrame(std::vector<Point3s> &outPoints, std::vector<RGB>
 }
 
 
-void FrameIOHandler::WriteFrame(const std::vector<Point3s> points, const std::vector<RGB> colors, uint64_t timestamp, int deviceID)
+/// <summary>
+/// Queues a frame for the writer thread, starting a new recording if none is open. The buffers are held until the
+/// frame is written, so they must not be modified meanwhile.
+/// </summary>
+/// <param name="isQueueWaited">Wait for the writer thread when the queue is full instead of dropping the frame; only
+/// for the callers which are not capturing</param>
+/// <returns>False if the frame was dropped because the write queue is full or the file could not be opened</returns>
+bool FrameIOHandler::WriteFrame(std::shared_ptr<const std::vector<Point3s>> points, std::shared_ptr<const std::vector<RGB>> colors, uint64_t timestamp, int deviceID,
+	bool isQueueWaited)
 {
-	if (!isFileOpenForWriting)
-		OpenNewFileForWriting(deviceID);
+	{
+		std::lock_guard<std::mutex> lock(fileMutex);
 
-	FILE *fp = fileHandle;
+		if (!isFileOpenForWriting)
+			OpenNewFileForWriting(deviceID);
+
+		if (fileHandle == nullptr)
+			return false;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(writeQueueMutex);
+
+		// The cameras of a shared recording queue their frames at once, so each of them gets as many as a recording of
+		// its own would
+		queuedDeviceFrames[deviceID]++;
+		size_t maxQueueSize = MaxQueuedFrames * queuedDeviceFrames.size();
+
+		if (isQueueWaited)
+			writeQueueSpaceCond.wait(lock, [this, maxQueueSize]() { return writeQueue.size() < maxQueueSize; });
+
+		if (writeQueue.size() >= maxQueueSize)
+		{
+			numDroppedFrames++;
+			return false;
+		}
+
+		QueuedFrame frame;
+		frame.Points = std::move(points);
+		frame.Colors = std::move(colors);
+		frame.Timestamp = timestamp;
+		frame.DeviceID = deviceID;
+		writeQueue.push_back(std::move(frame));
+
+		maxQueuedFrames = (std::max)(maxQueuedFrames, writeQueue.size());
+	}
+
+	writeQueueCond.notify_one();
+	return true;
+}
+
+RecordingStats FrameIOHandler::GetRecordingStats()
+{
+	RecordingStats stats;
+	stats.NumWrittenFrames = numWrittenFrames;
+	stats.NumWrittenBytes = numWrittenBytes;
+
+	std::lock_guard<std::mutex> lock(writeQueueMutex);
+	stats.NumDroppedFrames = numDroppedFrames;
+	stats.MaxQueuedFrames = maxQueuedFrames;
+
+	return stats;
+}
+
+/// <summary>
+/// Waits for the writer thread to write the queued frames, then stops it
+/// </summary>
+void FrameIOHandler::StopWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(writeQueueMutex);
+		isWriteStopRequested = true;
+	}
+
+	writeQueueCond.notify_one();
+
+	if (writerThread.joinable())
+		writerThread.join();
+}
+
+void FrameIOHandler::WriteLoop()
+{
+	while (true)
+	{
+		QueuedFrame frame;
+		bool isQueueEmpty;
+
+		{
+			std::unique_lock<std::mutex> lock(writeQueueMutex);
+			writeQueueCond.wait(lock, [this]() { return !writeQueue.empty() || isWriteStopRequested; });
+
+			if (writeQueue.empty())
+				break;
+
+			frame = std::move(writeQueue.front());
+			writeQueue.pop_front();
+			isQueueEmpty = writeQueue.empty();
+		}
+
+		writeQueueSpaceCond.notify_one();
+		AppendFrame(frame);
 
-	int numPoints = static_cast<int>(points.size());
-	
-	// Write text header
-	fprintf(fp, "n_points= %d\nframe_timestamp= %d\n", numPoints, (int)timestamp);
+		// Release the buffers of the frame so the capture can reuse them
+		frame = QueuedFrame();
 
-	if (numPoints > 0)
+		// Write what is buffered whenever the writer catches up, so a recording which is not closed loses little
+		if (isQueueEmpty)
+			FlushWriteBuffer();
+	}
+}
+
+void FrameIOHandler::AppendFrame(const QueuedFrame& frame)
+{
+	RecordingFrameHeader header;
+	header.NumPoints = static_cast<uint32_t>((std::min)(frame.Points->size(), frame.Colors->size()));
+	header.CameraID = frame.DeviceID;
+	header.Timestamp = frame.Timestamp;
+	header.DataSize = static_cast<uint32_t>((sizeof(Point3s) + sizeof(RGB)) * header.NumPoints);
+	header.Encoding = RawEncoding;
+	memset(header.Reserved, 0, sizeof(header.Reserved));
+
+	// Frames which fail to compress are written as they are
+	bool isCompressed = compressionLevel > 0 && header.NumPoints > 0 && CompressFrame(frame, header.NumPoints, header);
+
+	RecordingIndexEntry entry;
+	entry.Offset = writeBufferOffset + writeBuffer.size();
+	entry.NumPoints = header.NumPoints;
+	entry.Timestamp = frame.Timestamp;
+	entry.CameraID = frame.DeviceID;
+
+	AppendBytes(&header, sizeof(header));
+
+	if (isCompressed)
+	{
+		AppendBytes(compressedFrame.data(), header.DataSize);
+	}
+	else if (header.NumPoints > 0)
 	{
 		// Write binary point data
-		fwrite((void*)points.data(), sizeof(points[0]), numPoints, fp);
-		fwrite((void*)colors.data(), sizeof(colors[0]), numPoints, fp);
+		AppendBytes(frame.Points->data(), sizeof(Point3s) * header.NumPoints);
+		AppendBytes(frame.Colors->data(), sizeof(RGB) * header.NumPoints);
+	}
+
+	frameIndex.push_back(entry);
+	numWrittenFrames++;
+}
+
+/// <summary>
+/// Compresses the points and colors of a frame, as the difference with the previous frame between the keyframes of a
+/// delta compressed recording. The difference of each component wraps around, so it is exact.
+/// </summary>
+/// <returns>False if zstd failed or is not built in, in which case the frame is written uncompressed</returns>
+bool FrameIOHandler::CompressFrame(const QueuedFrame& frame, uint32_t numPoints, RecordingFrameHeader& header)
+{
+	size_t numComponents = 3 * static_cast<size_t>(numPoints);
+	size_t coordinatesSize = sizeof(Point3s) * numPoints;
+	size_t rawSize = coordinatesSize + sizeof(RGB) * numPoints;
+
+	bool isDelta = isDeltaEnabled && numFramesSinceKeyframe > 0;
+	numFramesSinceKeyframe = (numFramesSinceKeyframe + 1) % DeltaKeyframeInterval;
+
+	const short* coordinates = reinterpret_cast<const short*>(frame.Points->data());
+	const uint8_t* colorBytes = reinterpret_cast<const uint8_t*>(frame.Colors->data());
+
+	stagedFrame.resize(rawSize);
+	short* stagedCoordinates = reinterpret_cast<short*>(stagedFrame.data());
+	uint8_t* stagedColorBytes = reinterpret_cast<uint8_t*>(stagedFrame.data() + coordinatesSize);
+
+	size_t numDeltaComponents = isDelta ? (std::min)(numComponents, previousCoordinates.size()) : 0;
+
+	for (size_t i = 0; i < numDeltaComponents; i++)
+	{
+		stagedCoordinates[i] = static_cast<short>(coordinates[i] - previousCoordinates[i]);
+		stagedColorBytes[i] = static_cast<uint8_t>(colorBytes[i] - previousColorBytes[i]);
+	}
+
+	memcpy(stagedCoordinates + numDeltaComponents, coordinates + numDeltaComponents, (numComponents - numDeltaComponents) * sizeof(short));
+	memcpy(stagedColorBytes + numDeltaComponents, colorBytes + numDeltaComponents, numComponents - numDeltaComponents);
+
+	if (isDeltaEnabled)
+	{
+		previousCoordinates.assign(coordinates, coordinates + numComponents);
+		previousColorBytes.assign(colorBytes, colorBytes + numComponents);
+	}
+
+#ifdef LIVESCAN_ZSTD
+	compressedFrame.resize(ZSTD_compressBound(rawSize));
+	size_t size = ZSTD_compressCCtx(compressionContext, compressedFrame.data(), compressedFrame.size(), stagedFrame.data(), rawSize, compressionLevel);
+
+	if (ZSTD_isError(size))
+		return false;
+
+	header.DataSize = static_cast<uint32_t>(size);
+	header.Encoding = static_cast<uint8_t>(isDelta ? ZstdDeltaEncoding : ZstdEncoding);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/// <summary>
+/// Adds bytes to the block being written; data larger than a block is written directly once the block is
+/// </summary>
+void FrameIOHandler::AppendBytes(const void* data, size_t size)
+{
+	if (writeBuffer.size() + size > WriteBlockSize)
+		FlushWriteBuffer();
+
+	if (size >= WriteBlockSize)
+	{
+		fwrite(data, 1, size, fileHandle);
+		writeBufferOffset += size;
+		numWrittenBytes += size;
+		return;
 	}
 
-	// Write a newline to mark the end of this frame
-	fprintf(fp, "\n");
+	const char* bytes = static_cast<const char*>(data);
+	writeBuffer.insert(writeBuffer.end(), bytes, bytes + size);
+}
+
+void FrameIOHandler::FlushWriteBuffer()
+{
+	if (writeBuffer.empty())
+		return;
+
+	fwrite(writeBuffer.data(), 1, writeBuffer.size(), fileHandle);
+	writeBufferOffset += writeBuffer.size();
+	numWrittenBytes += writeBuffer.size();
+	writeBuffer.clear();
+}
+
+/// <summary>
+/// Writes the index of the frames of the recording and the footer which locates it, at the end of the file
+/// </summary>
+void FrameIOHandler::WriteFrameIndex()
+{
+	RecordingFooter footer;
+	footer.IndexOffset = writeBufferOffset + writeBuffer.size();
+	footer.NumFrames = static_cast<uint32_t>(frameIndex.size());
+	memcpy(footer.Magic, RecordingMagic, sizeof(RecordingMagic));
+
+	if (!frameIndex.empty())
+		AppendBytes(frameIndex.data(), sizeof(RecordingIndexEntry) * frameIndex.size());
+
+	AppendBytes(&footer, sizeof(footer));
+	frameIndex.clear();
 }
\ No newline at end of file
@@ -0,0 +1,150 @@
+/***************************************************************************\
+
+Module Name:  FrameRing.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module keeps the last seconds of processed frames in memory, so that
+they can be saved after the fact without the server requesting each frame.
+The ring holds one slot per frame of its duration at the camera frame rate;
+the buffers of a slot are reused once it wraps around. A save writes the
+frames to a recording on a thread of its own, and the ring stops taking new
+frames until then so that the saved ones are not overwritten.
+
+\***************************************************************************/
+
+#include "frameRing.h"
+#include "memoryUsage.h"
+#include <algorithm>
+
+FrameRing::~FrameRing() {
+    if (saverThread.joinable())
+        saverThread.join();
+}
+
+// Sets the number of seconds of frames kept; 0 disables the ring and releases its frames
+void FrameRing::SetDuration(int seconds) {
+    std::lock_guard<std::mutex> lock(ringMutex);
+    numRequestedSlots = static_cast<size_t>((std::min)((std::max)(seconds, 0), MaxDuration)) * FramesPerSecond;
+}
+
+// Sets the compression of the recordings saved from the ring, from the next save
+void FrameRing::SetCompression(int level, bool isDeltaEnabled) {
+    snapshotWriter.SetCompression(level, isDeltaEnabled);
+}
+
+/// <summary>
+/// Copies a frame into the oldest slot of the ring
+/// </summary>
+/// <returns>False if the ring is disabled or a save is running</returns>
+bool FrameRing::Push(const std::vector<Point3s>& points, const std::vector<RGB>& colors, uint64_t timestamp) {
+    std::lock_guard<std::mutex> lock(ringMutex);
+
+    if (isSaving)
+        return false;
+
+    if (slots.size() != numRequestedSlots) {
+        slots.clear();
+        slots.resize(numRequestedSlots);
+        nextSlot = 0;
+        numFrames = 0;
+
+        for (Slot& slot : slots) {
+            slot.Points = std::make_shared<std::vector<Point3s>>();
+            slot.Colors = std::make_shared<std::vector<RGB>>();
+        }
+    }
+
+    if (slots.empty())
+        return false;
+
+    Slot& slot = slots[nextSlot];
+    slot.Points->assign(points.begin(), points.end());
+    slot.Colors->assign(colors.begin(), colors.end());
+    slot.Timestamp = timestamp;
+    slot.PushTime = std::chrono::steady_clock::now();
+
+    nextSlot = (nextSlot + 1) % slots.size();
+    numFrames = (std::min)(numFrames + 1, slots.size());
+
+    return true;
+}
+
+// Returns the bytes held by the frames of the ring, those being saved included
+size_t FrameRing::GetMemoryUsage() {
+    std::lock_guard<std::mutex> lock(ringMutex);
+    size_t numBytes = 0;
+
+    for (const Slot& slot : slots) {
+        if (slot.Points)
+            numBytes += GetCapacityBytes(*slot.Points) + GetCapacityBytes(*slot.Colors);
+    }
+
+    return numBytes;
+}
+
+// Trims the buffers of the slots which hold over twice their frame, since their buffers are reused by smaller frames;
+// the slots are left alone while a save reads them
+void FrameRing::ReleaseUnusedMemory() {
+    std::lock_guard<std::mutex> lock(ringMutex);
+
+    if (isSaving)
+        return;
+
+    for (Slot& slot : slots) {
+        if (slot.Points) {
+            TrimCapacity(*slot.Points);
+            TrimCapacity(*slot.Colors);
+        }
+    }
+}
+
+/// <summary>
+/// Starts writing the frames of the last seconds to a new recording
+/// </summary>
+/// <param name="seconds">Duration saved, counted back from the newest frame</param>
+/// <param name="deviceID">Index of the device, which names the recording</param>
+/// <returns>False if the ring holds no frame or a save is already running</returns>
+bool FrameRing::Save(int seconds, int deviceID) {
+    std::vector<Slot> frames;
+
+    {
+        std::lock_guard<std::mutex> lock(ringMutex);
+
+        if (isSaving || numFrames == 0)
+            return false;
+
+        size_t oldestSlot = (nextSlot + slots.size() - numFrames) % slots.size();
+        std::chrono::steady_clock::time_point newestPushTime = slots[(nextSlot + slots.size() - 1) % slots.size()].PushTime;
+        std::chrono::steady_clock::time_point startTime = newestPushTime - std::chrono::seconds((std::max)(seconds, 0));
+
+        for (size_t i = 0; i < numFrames; i++) {
+            const Slot& slot = slots[(oldestSlot + i) % slots.size()];
+
+            if (slot.PushTime >= startTime)
+                frames.push_back(slot);
+        }
+
+        isSaving = true;
+    }
+
+    // The previous save is done, since it cleared isSaving last
+    if (saverThread.joinable())
+        saverThread.join();
+
+    saverThread = std::thread(&FrameRing::SaveFrames, this, std::move(frames), deviceID);
+    return true;
+}
+
+void FrameRing::SaveFrames(std::vector<Slot> frames, int deviceID) {
+    for (const Slot& frame : frames)
+        snapshotWriter.WriteFrame(frame.Points, frame.Colors, frame.Timestamp, deviceID, true);
+
+    snapshotWriter.CloseFile();
+    frames.clear();
+
+    std::lock_guard<std::mutex> lock(ringMutex);
+    isSaving = false;
+}
@@ -0,0 +1,637 @@
+/***************************************************************************\
+
+Module Name:  GpuPointCloudEngine.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module generates the point cloud of a depth frame with a DirectCompute
+shader. On top of the depth to color alignment done by the point cloud kernel,
+it applies the calibration, the bounds crop and the voxel grid decimation on
+the GPU and reads back only the compacted points. A first pass claims the
+voxels of the points in a hash table which keeps the lowest depth pixel of
+each voxel, so that the points kept do not depend on the order the threads
+run in, and match those of the processing on the CPU.
+
+\***************************************************************************/
+
+#include "gpuPointCloudEngine.h"
+#include <d3dcompiler.h>
+#include <cmath>
+#include <cstring>
+
+#pragma comment(lib, "d3d11.lib")
+#pragma comment(lib, "d3dcompiler.lib")
+
+namespace
+{
+    // Layout must match the FrameConstants cbuffer of the shader below
+    struct FrameConstants
+    {
+        UINT depthWidth;
+        UINT depthHeight;
+        UINT colorWidth;
+        UINT colorHeight;
+        float depthToColor[3][4];   // Rows: rotation | translation (meters)
+        float colorIntrinsics[4];   // fx, fy, cx, cy
+        float worldTransform[3][4]; // Rows: worldR | worldR * worldT
+        float boundsMin[4];         // w: 1 if the calibration is applied
+        float boundsMax[4];
+        float gridMin[4];           // w: inverse voxel size
+        UINT gridSize[4];           // w: 1 if the aligned depth frame is requested
+        UINT claimTable[4];         // x: mask of the slots of the voxel claims, y: shift of their hash
+    };
+
+    // Layout must match the GpuPoint struct of the shader below
+    struct GpuPoint
+    {
+        float position[3];
+        UINT color; // Blue | Green << 8 | Red << 16
+        UINT pixelIndex;
+    };
+
+    const char* PointCloudShaderSource = R"(
+cbuffer FrameConstants : register(b0)
+{
+    uint DepthWidth;
+    uint DepthHeight;
+    uint ColorWidth;
+    uint ColorHeight;
+    float4 DepthToColor[3];
+    float4 ColorIntrinsics;
+    float4 WorldTransform[3];
+    float4 BoundsMin;
+    float4 BoundsMax;
+    float4 GridMin;
+    uint4 GridSize;
+    uint4 ClaimTable;
+};
+
+struct GpuPoint
+{
+    float3 Position;
+    uint Color;
+    uint PixelIndex;
+};
+
+ByteAddressBuffer DepthFrame : register(t0);
+ByteAddressBuffer ColorFrame : register(t1);
+StructuredBuffer<float2> Rays : register(t2);
+
+AppendStructuredBuffer<GpuPoint> OutputPoints : register(u0);
+RWStructuredBuffer<uint> ClaimKeys : register(u1); // Voxel index plus one, or 0 for a free slot
+RWStructuredBuffer<uint> AlignedDepth : register(u2);
+RWStructuredBuffer<uint> ClaimWinners : register(u3); // Lowest depth pixel which claimed the voxel of the slot
+
+float3 LoadColor(uint pixelIdx)
+{
+    uint address = pixelIdx * 3;
+    uint2 words = ColorFrame.Load2(address & ~3u);
+    uint shift = (address & 3u) * 8u;
+    uint packed = shift == 0 ? words.x : (words.x >> shift) | (words.y << (32u - shift));
+
+    return float3(packed & 0xFFu, (packed >> 8) & 0xFFu, (packed >> 16) & 0xFFu);
+}
+
+// Converts a depth pixel to color camera space (in meters); false if it has no depth or is behind the color camera
+bool ProjectPixel(uint depthIdx, out uint d, out float3 colorPoint)
+{
+    uint depthWord = DepthFrame.Load((depthIdx * 2) & ~3u);
+    d = (depthIdx & 1u) ? (depthWord >> 16) : (depthWord & 0xFFFFu);
+    colorPoint = float3(0, 0, 0);
+
+    if (d == 0)
+        return false;
+
+    float z = d / 1000.0f;
+    float4 depthPoint = float4(Rays[depthIdx] * z, z, 1.0f);
+    colorPoint = float3(dot(DepthToColor[0], depthPoint), dot(DepthToColor[1], depthPoint), dot(DepthToColor[2], depthPoint));
+
+    return colorPoint.z > 0;
+}
+
+// Applies the calibration to a point; false if it is outside the bounds or the voxel grid
+bool FindVoxel(float3 colorPoint, out float3 worldPoint, out uint voxelIdx)
+{
+    float4 p = float4(colorPoint, 1.0f);
+    worldPoint = float3(dot(WorldTransform[0], p), dot(WorldTransform[1], p), dot(WorldTransform[2], p));
+    voxelIdx = 0;
+
+    if (any(worldPoint < BoundsMin.xyz) || any(worldPoint > BoundsMax.xyz))
+        return false;
+
+    int3 cell = int3((worldPoint - GridMin.xyz) * GridMin.w);
+
+    if (any(cell < 0) || any(cell >= int3(GridSize.xyz)))
+        return false;
+
+    voxelIdx = ((uint)cell.z * GridSize.y + (uint)cell.y) * GridSize.x + (uint)cell.x;
+    return true;
+}
+
+// Slot of the claims of a voxel, taken by the first thread which probes a free slot for it; the table has at least
+// twice the slots of the depth pixels, so a free slot is always found
+uint FindClaimSlot(uint voxelIdx)
+{
+    uint key = voxelIdx + 1u;
+    uint slot = (voxelIdx * 2654435769u) >> ClaimTable.y; // Fibonacci hash, then linear probing
+
+    [loop]
+    for (uint probe = 0; probe <= ClaimTable.x; probe++)
+    {
+        uint current;
+        InterlockedCompareExchange(ClaimKeys[slot], 0u, key, current);
+
+        if (current == 0u || current == key)
+            break;
+
+        slot = (slot + 1u) & ClaimTable.x;
+    }
+
+    return slot;
+}
+
+// Each point of the calibrated frame claims its voxel with its depth pixel, the lowest of which is kept by the main pass
+[numthreads(8, 8, 1)]
+void ClaimVoxels(uint3 id : SV_DispatchThreadID)
+{
+    if (id.x >= DepthWidth || id.y >= DepthHeight)
+        return;
+
+    uint depthIdx = id.y * DepthWidth + id.x;
+    uint d;
+    float3 colorPoint;
+    float3 worldPoint;
+    uint voxelIdx;
+
+    if (!ProjectPixel(depthIdx, d, colorPoint) || !FindVoxel(colorPoint, worldPoint, voxelIdx))
+        return;
+
+    InterlockedMin(ClaimWinners[FindClaimSlot(voxelIdx)], depthIdx);
+}
+
+[numthreads(8, 8, 1)]
+void main(uint3 id : SV_DispatchThreadID)
+{
+    if (id.x >= DepthWidth || id.y >= DepthHeight)
+        return;
+
+    uint depthIdx = id.y * DepthWidth + id.x;
+    uint d;
+    float3 colorPoint;
+
+    if (!ProjectPixel(depthIdx, d, colorPoint))
+        return;
+
+    float projU = ColorIntrinsics.x * colorPoint.x / colorPoint.z + ColorIntrinsics.z;
+    float projV = ColorIntrinsics.y * colorPoint.y / colorPoint.z + ColorIntrinsics.w;
+
+    // Keep the nearest depth in the aligned depth frame; it is filled for every point, even the cropped ones
+    if (GridSize.w != 0)
+    {
+        int alignedU = (int)round(projU * DepthWidth / ColorWidth);
+        int alignedV = (int)round(projV * DepthHeight / ColorHeight);
+
+        if (alignedU >= 0 && alignedV >= 0 && alignedU < (int)DepthWidth && alignedV < (int)DepthHeight)
+            InterlockedMin(AlignedDepth[alignedV * DepthWidth + alignedU], d);
+    }
+
+    float3 worldPoint = colorPoint;
+
+    if (BoundsMin.w != 0)
+    {
+        // Apply the calibration, remove the point if it is outside the bounds, and only keep the first point of each
+        // voxel of the grid, in the order of the depth pixels
+        uint voxelIdx;
+
+        if (!FindVoxel(colorPoint, worldPoint, voxelIdx) || ClaimWinners[FindClaimSlot(voxelIdx)] != depthIdx)
+            return;
+    }
+
+    // Sample color image using bilinear interpolation
+    float3 color = float3(0, 0, 0);
+    int u0 = (int)floor(projU);
+    int v0 = (int)floor(projV);
+
+    if (u0 >= 0 && v0 >= 0 && u0 + 1 < (int)ColorWidth && v0 + 1 < (int)ColorHeight)
+    {
+        float du = projU - u0;
+        float dv = projV - v0;
+        uint idx = v0 * ColorWidth + u0;
+
+        color = (1 - du) * (1 - dv) * LoadColor(idx) + du * (1 - dv) * LoadColor(idx + 1)
+            + (1 - du) * dv * LoadColor(idx + ColorWidth) + du * dv * LoadColor(idx + ColorWidth + 1);
+    }
+
+    uint3 rgb = (uint3)color;
+
+    GpuPoint point;
+    point.Position = worldPoint;
+    point.Color = rgb.z | (rgb.y << 8) | (rgb.x << 16);
+    point.PixelIndex = depthIdx;
+    OutputPoints.Append(point);
+}
+)";
+}
+
+GpuPointCloudEngine::GpuPointCloudEngine()
+{
+}
+
+GpuPointCloudEngine::~GpuPointCloudEngine()
+{
+    Release();
+}
+
+void GpuPointCloudEngine::SetLogger(std::function<void(const std::string&)> loggerFunc)
+{
+    logFn = loggerFunc;
+}
+
+bool GpuPointCloudEngine::IsInitialized() const
+{
+    return isInitialized;
+}
+
+/// <summary>
+/// Creates the Direct3D device, compiles the compute shader and allocates the GPU buffers for the given frame sizes.
+/// </summary>
+/// <param name="rays">Normalized unprojection ray of each depth pixel; uploaded once</param>
+/// <returns>True if the engine is ready to process frames; false otherwise.</returns>
+bool GpuPointCloudEngine::Initialize(int depthWidth, int depthHeight, int colorWidth, int colorHeight, const FrameVector<Point2f>& rays)
+{
+    Release();
+
+    this->depthWidth = depthWidth;
+    this->depthHeight = depthHeight;
+    this->colorWidth = colorWidth;
+    this->colorHeight = colorHeight;
+
+    D3D_FEATURE_LEVEL featureLevels[] = { D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0 };
+    HRESULT hr = D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL, 0, featureLevels, ARRAYSIZE(featureLevels),
+        D3D11_SDK_VERSION, &device, NULL, &context);
+
+    if (FAILED(hr))
+    {
+        if (logFn) logFn("[GpuPointCloudEngine] Failed to create a Direct3D 11 device: " + std::to_string(hr));
+        Release();
+        return false;
+    }
+
+    if (!CreateShader() || !CreateBuffers(rays))
+    {
+        Release();
+        return false;
+    }
+
+    isInitialized = true;
+
+    if (logFn) logFn("[GpuPointCloudEngine] Initialized for " + std::to_string(depthWidth) + "x" + std::to_string(depthHeight) + " depth frames");
+
+    return isInitialized;
+}
+
+bool GpuPointCloudEngine::CreateShader()
+{
+    // The voxel claims and the point cloud are two entry points of the same source
+    auto Compile = [&](const char* entryPoint, ID3D11ComputeShader** computeShader) {
+        ID3DBlob* byteCode = NULL;
+        ID3DBlob* errors = NULL;
+
+        HRESULT hr = D3DCompile(PointCloudShaderSource, strlen(PointCloudShaderSource), "PointCloudShader", NULL, NULL,
+            entryPoint, "cs_5_0", D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, &byteCode, &errors);
+
+        if (FAILED(hr))
+        {
+            std::string message = errors ? static_cast<const char*>(errors->GetBufferPointer()) : std::to_string(hr);
+            if (logFn) logFn("[GpuPointCloudEngine] Failed to compile compute shader " + std::string(entryPoint) + ": " + message);
+            SafeRelease(errors);
+            SafeRelease(byteCode);
+            return false;
+        }
+
+        hr = device->CreateComputeShader(byteCode->GetBufferPointer(), byteCode->GetBufferSize(), NULL, computeShader);
+        SafeRelease(errors);
+        SafeRelease(byteCode);
+
+        if (FAILED(hr))
+        {
+            if (logFn) logFn("[GpuPointCloudEngine] Failed to create compute shader " + std::string(entryPoint) + ": " + std::to_string(hr));
+            return false;
+        }
+
+        return true;
+    };
+
+    if (!Compile("ClaimVoxels", &claimShader) || !Compile("main", &shader))
+        return false;
+
+    D3D11_BUFFER_DESC constantsDesc = {};
+    constantsDesc.ByteWidth = (sizeof(FrameConstants) + 15) & ~15;
+    constantsDesc.Usage = D3D11_USAGE_DYNAMIC;
+    constantsDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    constantsDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+    return SUCCEEDED(device->CreateBuffer(&constantsDesc, NULL, &constants));
+}
+
+bool GpuPointCloudEngine::CreateBuffers(const FrameVector<Point2f>& rays)
+{
+    UINT numDepthPixels = static_cast<UINT>(depthWidth * depthHeight);
+    HRESULT hr = S_OK;
+
+    // Raw input buffers for the depth and color frames, rounded up to whole 32-bit words
+    auto CreateRawInput = [&](UINT byteWidth, ID3D11Buffer** buffer, ID3D11ShaderResourceView** view) {
+        D3D11_BUFFER_DESC desc = {};
+        desc.ByteWidth = (byteWidth + 7) & ~3u; // Extra word so that unaligned two-word loads stay in bounds
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+
+        if (FAILED(hr = device->CreateBuffer(&desc, NULL, buffer)))
+            return false;
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc = {};
+        viewDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+        viewDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFEREX;
+        viewDesc.BufferEx.NumElements = desc.ByteWidth / 4;
+        viewDesc.BufferEx.Flags = D3D11_BUFFEREX_SRV_FLAG_RAW;
+
+        return SUCCEEDED(hr = device->CreateShaderResourceView(*buffer, &viewDesc, view));
+    };
+
+    auto CreateStructured = [&](UINT stride, UINT count, UINT bindFlags, const void* data, ID3D11Buffer** buffer) {
+        D3D11_BUFFER_DESC desc = {};
+        desc.ByteWidth = stride * count;
+        desc.Usage = data ? D3D11_USAGE_IMMUTABLE : D3D11_USAGE_DEFAULT;
+        desc.BindFlags = bindFlags;
+        desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+        desc.StructureByteStride = stride;
+
+        D3D11_SUBRESOURCE_DATA initData = {};
+        initData.pSysMem = data;
+
+        return SUCCEEDED(hr = device->CreateBuffer(&desc, data ? &initData : NULL, buffer));
+    };
+
+    auto CreateStaging = [&](UINT byteWidth, ID3D11Buffer** buffer) {
+        D3D11_BUFFER_DESC desc = {};
+        desc.ByteWidth = byteWidth;
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+
+        return SUCCEEDED(hr = device->CreateBuffer(&desc, NULL, buffer));
+    };
+
+    // The claim table has at least twice the slots of the depth pixels, so that its probes stay short
+    claimSlots = 1;
+    claimShift = 32;
+
+    while (claimSlots < 2 * numDepthPixels)
+    {
+        claimSlots *= 2;
+        claimShift--;
+    }
+
+    bool res = CreateRawInput(numDepthPixels * sizeof(UINT16), &depthBuffer, &depthView)
+        && CreateRawInput(static_cast<UINT>(colorWidth * colorHeight * 3), &colorBuffer, &colorView)
+        && CreateStructured(sizeof(Point2f), numDepthPixels, D3D11_BIND_SHADER_RESOURCE, rays.data(), &rayBuffer)
+        && SUCCEEDED(hr = device->CreateShaderResourceView(rayBuffer, NULL, &rayView))
+        && CreateStructured(sizeof(GpuPoint), numDepthPixels, D3D11_BIND_UNORDERED_ACCESS, NULL, &outputBuffer)
+        && CreateStructured(sizeof(UINT), numDepthPixels, D3D11_BIND_UNORDERED_ACCESS, NULL, &alignedDepthBuffer)
+        && SUCCEEDED(hr = device->CreateUnorderedAccessView(alignedDepthBuffer, NULL, &alignedDepthView))
+        && CreateStructured(sizeof(UINT), claimSlots, D3D11_BIND_UNORDERED_ACCESS, NULL, &claimKeyBuffer)
+        && SUCCEEDED(hr = device->CreateUnorderedAccessView(claimKeyBuffer, NULL, &claimKeyView))
+        && CreateStructured(sizeof(UINT), claimSlots, D3D11_BIND_UNORDERED_ACCESS, NULL, &claimWinnerBuffer)
+        && SUCCEEDED(hr = device->CreateUnorderedAccessView(claimWinnerBuffer, NULL, &claimWinnerView))
+        && CreateStaging(sizeof(UINT), &countStaging)
+        && CreateStaging(numDepthPixels * sizeof(GpuPoint), &outputStaging)
+        && CreateStaging(numDepthPixels * sizeof(UINT), &alignedDepthStaging);
+
+    if (res)
+    {
+        // The output points are appended, the counter is reset on every dispatch
+        D3D11_UNORDERED_ACCESS_VIEW_DESC outputViewDesc = {};
+        outputViewDesc.Format = DXGI_FORMAT_UNKNOWN;
+        outputViewDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+        outputViewDesc.Buffer.NumElements = numDepthPixels;
+        outputViewDesc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_APPEND;
+
+        res = SUCCEEDED(hr = device->CreateUnorderedAccessView(outputBuffer, &outputViewDesc, &outputView));
+    }
+
+    if (!res && logFn)
+        logFn("[GpuPointCloudEngine] Failed to create GPU buffers: " + std::to_string(hr));
+
+    return res;
+}
+
+void GpuPointCloudEngine::UpdateConstants(const PointCloudKernelParams& params, const FrameProcessingParams& processing, bool isAlignedDepthRequested)
+{
+    FrameConstants frameConstants = {};
+    frameConstants.depthWidth = params.depthWidth;
+    frameConstants.depthHeight = params.depthHeight;
+    frameConstants.colorWidth = params.colorWidth;
+    frameConstants.colorHeight = params.colorHeight;
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            frameConstants.depthToColor[i][j] = params.rot[i * 3 + j];
+
+        frameConstants.depthToColor[i][3] = params.trans[i];
+    }
+
+    frameConstants.colorIntrinsics[0] = params.colorFx;
+    frameConstants.colorIntrinsics[1] = params.colorFy;
+    frameConstants.colorIntrinsics[2] = params.colorCx;
+    frameConstants.colorIntrinsics[3] = params.colorCy;
+
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 4; j++)
+            frameConstants.worldTransform[i][j] = processing.worldTransform[i][j];
+
+        frameConstants.boundsMin[i] = processing.minBounds[i];
+        frameConstants.boundsMax[i] = processing.maxBounds[i];
+    }
+
+    frameConstants.boundsMin[3] = processing.isCalibrated ? 1.0f : 0.0f;
+
+    // Same grid layout as the VoxelGridFilter
+    float invVoxelSize = 1.0f / processing.voxelSize;
+    UINT gridSize = static_cast<UINT>(std::ceil((processing.gridHalfRange * 2) * invVoxelSize));
+
+    for (int i = 0; i < 3; i++)
+    {
+        frameConstants.gridMin[i] = processing.gridCenter[i] - processing.gridHalfRange;
+        frameConstants.gridSize[i] = gridSize;
+    }
+
+    frameConstants.gridMin[3] = invVoxelSize;
+    frameConstants.gridSize[3] = isAlignedDepthRequested ? 1 : 0;
+    frameConstants.claimTable[0] = claimSlots - 1;
+    frameConstants.claimTable[1] = claimShift;
+
+    D3D11_MAPPED_SUBRESOURCE mapped;
+
+    if (SUCCEEDED(context->Map(constants, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+    {
+        memcpy(mapped.pData, &frameConstants, sizeof(FrameConstants));
+        context->Unmap(constants, 0);
+    }
+}
+
+/// <summary>
+/// Uploads the depth and color frames, runs the compute shader and reads back the compacted point cloud.
+/// </summary>
+/// <param name="processing">Calibration, bounds and voxel grid parameters to apply to the points</param>
+/// <param name="alignedDepth">If not null, receives the depth frame aligned to the color frame</param>
+/// <returns>True if the point cloud was generated; false otherwise.</returns>
+bool GpuPointCloudEngine::Process(const PointCloudKernelParams& params, const FrameProcessingParams& processing,
+    PointBuffer& points, cv::Mat* alignedDepth)
+{
+    if (!isInitialized || params.depthWidth != depthWidth || params.depthHeight != depthHeight
+        || params.colorWidth != colorWidth || params.colorHeight != colorHeight)
+    {
+        return false;
+    }
+
+    // Upload the frames once
+    D3D11_BOX depthBox = { 0, 0, 0, static_cast<UINT>(depthWidth * depthHeight * sizeof(UINT16)), 1, 1 };
+    context->UpdateSubresource(depthBuffer, 0, &depthBox, params.depth, 0, 0);
+    D3D11_BOX colorBox = { 0, 0, 0, static_cast<UINT>(colorWidth * colorHeight * 3), 1, 1 };
+    context->UpdateSubresource(colorBuffer, 0, &colorBox, params.color, 0, 0);
+
+    UpdateConstants(params, processing, alignedDepth != NULL);
+
+    const UINT zeros[4] = { 0, 0, 0, 0 };
+    const UINT emptyDepth[4] = { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF };
+
+    if (processing.isCalibrated)
+    {
+        context->ClearUnorderedAccessViewUint(claimKeyView, zeros);
+        context->ClearUnorderedAccessViewUint(claimWinnerView, emptyDepth);
+    }
+
+    if (alignedDepth)
+        context->ClearUnorderedAccessViewUint(alignedDepthView, emptyDepth);
+
+    // Bind resources and dispatch one thread per depth pixel; the voxels of the calibrated frames are claimed first
+    ID3D11ShaderResourceView* views[] = { depthView, colorView, rayView };
+    ID3D11UnorderedAccessView* uavs[] = { outputView, claimKeyView, alignedDepthView, claimWinnerView };
+    UINT initialCounts[] = { 0, (UINT)-1, (UINT)-1, (UINT)-1 };
+    UINT numGroupsX = (depthWidth + ThreadGroupSize - 1) / ThreadGroupSize;
+    UINT numGroupsY = (depthHeight + ThreadGroupSize - 1) / ThreadGroupSize;
+
+    context->CSSetConstantBuffers(0, 1, &constants);
+    context->CSSetShaderResources(0, ARRAYSIZE(views), views);
+    context->CSSetUnorderedAccessViews(0, ARRAYSIZE(uavs), uavs, initialCounts);
+
+    if (processing.isCalibrated)
+    {
+        context->CSSetShader(claimShader, NULL, 0);
+        context->Dispatch(numGroupsX, numGroupsY, 1);
+    }
+
+    context->CSSetShader(shader, NULL, 0);
+    context->Dispatch(numGroupsX, numGroupsY, 1);
+
+    ID3D11ShaderResourceView* nullViews[ARRAYSIZE(views)] = { NULL };
+    ID3D11UnorderedAccessView* nullUavs[ARRAYSIZE(uavs)] = { NULL };
+    context->CSSetShaderResources(0, ARRAYSIZE(nullViews), nullViews);
+    context->CSSetUnorderedAccessViews(0, ARRAYSIZE(nullUavs), nullUavs, NULL);
+
+    // Read back the number of points first so that only the used part of the output is copied
+    context->CopyStructureCount(countStaging, 0, outputView);
+
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    UINT numPoints = 0;
+
+    if (FAILED(context->Map(countStaging, 0, D3D11_MAP_READ, 0, &mapped)))
+        return false;
+
+    numPoints = *static_cast<const UINT*>(mapped.pData);
+    context->Unmap(countStaging, 0);
+
+    points.Resize(numPoints);
+
+    if (numPoints > 0)
+    {
+        D3D11_BOX outputBox = { 0, 0, 0, static_cast<UINT>(numPoints * sizeof(GpuPoint)), 1, 1 };
+        context->CopySubresourceRegion(outputStaging, 0, 0, 0, 0, outputBuffer, 0, &outputBox);
+
+        if (FAILED(context->Map(outputStaging, 0, D3D11_MAP_READ, 0, &mapped)))
+            return false;
+
+        const GpuPoint* gpuPoints = static_cast<const GpuPoint*>(mapped.pData);
+
+        for (UINT i = 0; i < numPoints; i++)
+        {
+            points.X[i] = gpuPoints[i].position[0];
+            points.Y[i] = gpuPoints[i].position[1];
+            points.Z[i] = gpuPoints[i].position[2];
+            points.Colors[i].Blue = static_cast<BYTE>(gpuPoints[i].color & 0xFF);
+            points.Colors[i].Green = static_cast<BYTE>((gpuPoints[i].color >> 8) & 0xFF);
+            points.Colors[i].Red = static_cast<BYTE>((gpuPoints[i].color >> 16) & 0xFF);
+            points.PixelIndices[i] = static_cast<int>(gpuPoints[i].pixelIndex);
+        }
+
+        context->Unmap(outputStaging, 0);
+    }
+
+    if (alignedDepth)
+    {
+        context->CopyResource(alignedDepthStaging, alignedDepthBuffer);
+
+        if (FAILED(context->Map(alignedDepthStaging, 0, D3D11_MAP_READ, 0, &mapped)))
+            return false;
+
+        const UINT* depth = static_cast<const UINT*>(mapped.pData);
+        *alignedDepth = cv::Mat(depthHeight, depthWidth, CV_16U);
+        UINT16* dst = alignedDepth->ptr<UINT16>();
+
+        for (int i = 0; i < depthWidth * depthHeight; i++)
+        {
+            dst[i] = depth[i] == 0xFFFFFFFF ? 0 : static_cast<UINT16>(depth[i]);
+        }
+
+        context->Unmap(alignedDepthStaging, 0);
+    }
+
+    return true;
+}
+
+void GpuPointCloudEngine::Release()
+{
+    isInitialized = false;
+    claimSlots = 0;
+    claimShift = 0;
+
+    SafeRelease(alignedDepthStaging);
+    SafeRelease(outputStaging);
+    SafeRelease(countStaging);
+
+    SafeRelease(claimWinnerView);
+    SafeRelease(claimKeyView);
+    SafeRelease(alignedDepthView);
+    SafeRelease(outputView);
+    SafeRelease(claimWinnerBuffer);
+    SafeRelease(claimKeyBuffer);
+    SafeRelease(alignedDepthBuffer);
+    SafeRelease(outputBuffer);
+
+    SafeRelease(rayView);
+    SafeRelease(colorView);
+    SafeRelease(depthView);
+    SafeRelease(rayBuffer);
+    SafeRelease(colorBuffer);
+    SafeRelease(depthBuffer);
+
+    SafeRelease(constants);
+    SafeRelease(claimShader);
+    SafeRelease(shader);
+    SafeRelease(context);
+    SafeRelease(device);
+}
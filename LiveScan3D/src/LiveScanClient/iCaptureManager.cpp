@@ -28,21 +28,93 @@ ICaptureManager::ICaptureManager()
 
 	depthData = NULL;
 	colorData = NULL;
+	colorFormat = ColorRgb888;
+	isColorVideoRange = false;
 
 	hasNewDocument = false;
+	documentFrameIntervalMs = DefaultDocumentFrameIntervalMs;
+	isDocumentSubmissionPaused = false;
+	processingPhase = 0.0f;
+	isFrameInWorldSpace = false;
+	hasProcessedFrame = false;
+	isStaticFrameDetectionEnabled = false;
+	isStaticFrameReusable = false;
+	isFrameStatic = false;
+	perfStats = NULL;
 }
 
 ICaptureManager::~ICaptureManager()
 {
-	if (depthData != NULL)
-	{
-		delete[] depthData;
-		depthData = NULL;
-	}
+	// The frame buffers are owned by the capture manager implementation and are only viewed here
+	depthData = NULL;
+	colorData = NULL;
+}
+
+/// <summary>
+/// Returns the bytes held by the point buffers of the latest frame; the implementations add their own buffers
+/// </summary>
+size_t ICaptureManager::GetMemoryUsage() const
+{
+	return GetCapacityBytes(lastFramePoints) + GetCapacityBytes(lastProcessedPoints) + sceneChangeDetector.GetMemoryUsage();
+}
+
+/// <summary>
+/// Trims the point buffers of the latest frame to twice what they hold; the implementations also release the buffers
+/// of the disabled filters
+/// </summary>
+void ICaptureManager::ReleaseUnusedMemory()
+{
+	TrimCapacity(lastFramePoints);
+	TrimCapacity(lastProcessedPoints);
+}
+
+/// <summary>
+/// Compares the depth of the latest frame with that of the last frame the client processed, while the detection is
+/// enabled, and sets isFrameStatic when the points of the frame need not be generated
+/// </summary>
+/// <param name="isGenerationRequired">Whether the points of the frame are needed whatever its depth, such as for the
+/// calibration, the document detection or new camera parameters</param>
+/// <returns>True if the frame is static</returns>
+bool ICaptureManager::UpdateStaticFrame(bool isGenerationRequired)
+{
+	isFrameStatic = false;
 
-	if (colorData != NULL)
+	if (!isStaticFrameDetectionEnabled || !depthData)
 	{
-		delete[] colorData;
-		colorData = NULL;
+		sceneChangeDetector.Reset();
+		return false;
 	}
+
+	// The depth is sampled even when the frame is generated, so that the client can accept it once processed
+	bool isUnchanged = sceneChangeDetector.IsUnchanged(depthData, depthFrameWidth, depthFrameHeight);
+	isFrameStatic = isUnchanged && isStaticFrameReusable && !isGenerationRequired;
+
+	if (isFrameStatic)
+		sceneChangeDetector.MarkReused();
+
+	return isFrameStatic;
+}
+
+/// <summary>
+/// Whether the device was lost and is waiting to be reopened by RecoverDevice; never for the captures without a device
+/// </summary>
+bool ICaptureManager::IsDeviceLost() const
+{
+	return false;
+}
+
+/// <summary>
+/// Closes the device so that it is reopened by RecoverDevice, as when it fails to restart
+/// </summary>
+void ICaptureManager::RequestDeviceRecovery()
+{
+}
+
+/// <summary>
+/// Tries to reopen the lost device and to start it with the given sync configuration
+/// </summary>
+/// <returns>True once the device streams again; false if it is still lost</returns>
+bool ICaptureManager::RecoverDevice(SyncState state, int syncOffset)
+{
+	return false;
 }
\ No newline at end of file
@@ -20,6 +20,7 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 #include "resource.h"
 #include "liveScanClient.h"
 #include "filter.h"
+#include "taskScheduler.h"
 #include <chrono>
 #include <strsafe.h>
 #include <fstream>
@@ -28,29 +29,52 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 #include <chrono>
 #include <iomanip>
 #include <sstream>
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
 
-LiveScanClient::LiveScanClient(int index) :
+/// <summary>
+/// Creates the client of a camera, or of a raw recording of one which is replayed instead
+/// </summary>
+/// <param name="replayPath">Raw recording to replay; empty to capture from the camera of this index</param>
+/// <param name="isReplayRealTime">Replay the frames at the speed they were recorded at, instead of as fast as they are processed</param>
+LiveScanClient::LiveScanClient(int index, const std::string& replayPath, bool isReplayRealTime) :
 	clientIndex(index),
-	cameraSpaceCoordinates(NULL),
 	isCalibrateRequested(false),
 	isFilterEnabled(false),
+	isDepthDenoiseEnabled(false),
+	pointBudget(0),
+	voxelLevel(0),
 	isRecordFrameRequested(false),
-	isConfirmRecordedRequested(false),
-	isConfirmCalibratedRequested(false),
-	isConfirmRestartAsMasterRequested(false),
-	isClientThreadRunning(true),
 	numFilterNeighbors(10),
 	filterThreshold(0.01f),
+	filterMode(KdTreeFilterMode),
+	backgroundMode(BackgroundKept),
+	numFramesSinceBackgroundRefresh(0),
 	isRestartingCamera(false),
 	isAutoExposureEnabled(true),
 	numExposureSteps(-5),
-	voxelGridFilter(MinPrecision, XRangeCenter, YRangeCenter, ZRangeCenter, HalfRange)
+	processingBackend(CpuProcessing),
+	captureMode(PollingCapture),
+	colorStreamSettings({ 2560, 1440, false, true, false }),
+	currentSyncState(Standalone),
+	voxelGridFilter(minPrecision, XRangeCenter, YRangeCenter, zRangeCenter, halfRange),
+	densityCounter(DensityVoxelSize, XRangeCenter, YRangeCenter, zRangeCenter, halfRange),
+	latestFrame(std::make_shared<ProcessedFrame>())
 {
 	SetupLogging(clientIndex);
 
-	captureManager = new OrbbecCaptureManager(clientIndex);
+	if (replayPath.empty())
+		captureManager = new OrbbecCaptureManager(clientIndex);
+	else
+		captureManager = new ReplayCaptureManager(clientIndex, replayPath, isReplayRealTime);
+
+	isMaxSpeedReplay = !replayPath.empty() && !isReplayRealTime;
+
 	captureManager->SetLogger(GetLogger());
+	captureManager->perfStats = &perfStats;
 	calibration.SetLogger(GetLogger());
+	calibrationSampler.SetLogger(GetLogger());
 
 	bounds.push_back(-0.5);
 	bounds.push_back(-0.5);
@@ -62,16 +86,16 @@ LiveScanClient::LiveScanClient(int index) :
 
 LiveScanClient::~LiveScanClient()
 {
-	if (captureManager)
+	// The calibration task uses the members of the client
 	{
-		delete captureManager;
-		captureManager = NULL;
+		std::unique_lock<std::mutex> lock(calibrationMutex);
+		calibrationDoneCond.wait(lock, [this]() { return !isCalibrationSampleRunning; });
 	}
 
-	if (cameraSpaceCoordinates)
+	if (captureManager)
 	{
-		delete[] cameraSpaceCoordinates;
-		cameraSpaceCoordinates = NULL;
+		delete captureManager;
+		captureManager = NULL;
 	}
 }
 
@@ -91,39 +115,108 @@ void LiveScanClient::Run()
 		calibration.LoadCalibration(captureManager->serialNumber);
 
 		if (calibration.isCalibrated)
-			isConfirmCalibratedRequested = true;
+		{
+			ConfirmCalibrated();
+
+			// The exclusion mask learned for this calibration, if any
+			if (exclusionMask.Load(captureManager->serialNumber))
+				Log("[LiveScanClient] Loaded the exclusion mask, " + std::to_string(exclusionMask.GetNumExcludedVoxels()) + " voxels excluded");
+		}
 
-		cameraSpaceCoordinates = new Point3f[captureManager->colorFrameWidth * captureManager->colorFrameHeight];
 		captureManager->SetExposureState(true, 0);
 	}
 	else
 	{
-		Log("[LiveScanClient] Failed to initialize capture device.");
+		Log(ErrorLevel, "[LiveScanClient] Failed to initialize capture device.");
 	}
 
-	// Start a thread to handle some client callbacks to the server in parallel to the main data loop
-	std::thread t1(&LiveScanClient::SendClientConfirmations, this);
-
-	// Start the main loop to retrieve data from the camera
+	// Start the main loop to retrieve data from the camera; the confirmations are queued for the server as they happen
 	while (!isExitRequested)
 	{
 		UpdateFrame();
 	}
-
-	isClientThreadRunning = false;
-	t1.join();
 }
 
 void LiveScanClient::StartFrameRecording()
 {
+	// The shared recording is taken before the capture thread writes to it, and kept until the frames are cleared
+	if (isInterleavedRecordingEnabled && !std::atomic_load(&sharedRecording))
+	{
+		std::shared_ptr<FrameIOHandler> recording = FrameIOHandler::AcquireSharedRecording();
+		recording->SetCompression(recordingCompressionLevel, isRecordingDeltaEnabled);
+		std::atomic_store(&sharedRecording, recording);
+	}
+
 	isRecordFrameRequested = true;
 }
 
 void LiveScanClient::Calibrate()
 {
+	numCalibrationSamples = 0;
 	isCalibrateRequested = true;
 }
 
+/// <summary>
+/// Reports how many marker samples the calibration found so far
+/// </summary>
+/// <returns>False once the camera is not calibrating anymore</returns>
+bool LiveScanClient::GetCalibrationProgress(int& numSamples, int& numRequiredSamples)
+{
+	numSamples = numCalibrationSamples;
+	numRequiredSamples = calibrationSampler.GetNumRequiredSamples();
+
+	return isCalibrateRequested;
+}
+
+/// <summary>
+/// Summarizes the time taken by each stage of the frame loop
+/// </summary>
+/// <param name="isReset">Starts new measurements, so that the next summary only covers the frames after this one</param>
+/// <returns>Number of stages written to stats</returns>
+int LiveScanClient::GetPerfStats(PerfStageStats* stats, int maxStages, bool isReset)
+{
+	return perfStats.GetStats(stats, maxStages, isReset);
+}
+
+/// <summary>
+/// Sets the time between two frames sent to the document detection; the server lengthens it while another camera sends
+/// better crops of the same documents
+/// </summary>
+void LiveScanClient::SetDocumentFrameInterval(int intervalMs)
+{
+	if (captureManager)
+	{
+		captureManager->documentFrameIntervalMs = (std::max)(intervalMs, 0);
+	}
+}
+
+/// <summary>
+/// Sets the largest size the receivers of the server render the documents at, which the crops are downscaled to fit
+/// </summary>
+void LiveScanClient::SetMaxDocumentSize(int width, int height)
+{
+	if (captureManager && captureManager->documentDetector)
+	{
+		captureManager->documentDetector->SetMaxDocumentSize(width, height);
+	}
+}
+
+/// <summary>
+/// Sets the exposure of the color camera without changing the other settings, as the server does to give all the
+/// cameras the same exposure; the next settings set it back to theirs
+/// </summary>
+/// <param name="exposureStep">Exposure step between 1 and 300, when the auto exposure is disabled</param>
+void LiveScanClient::SetExposure(bool isAutoExposureEnabled, int exposureStep)
+{
+	this->isAutoExposureEnabled = isAutoExposureEnabled;
+	numExposureSteps = exposureStep;
+
+	if (captureManager)
+	{
+		captureManager->SetExposureState(isAutoExposureEnabled, exposureStep);
+	}
+}
+
 void LiveScanClient::SetSettings(const CameraSettings& settings)
 {
 	bounds = { settings.MinBounds[0], settings.MinBounds[1], settings.MinBounds[2],
@@ -132,6 +225,70 @@ void LiveScanClient::SetSettings(const CameraSettings& settings)
 	isFilterEnabled = settings.Filter;
 	numFilterNeighbors = settings.FilterNeighbors;
 	filterThreshold = settings.FilterThreshold;
+	filterMode = settings.FilterMode == OrganizedFilterMode ? OrganizedFilterMode : KdTreeFilterMode;
+	isDepthDenoiseEnabled = settings.DepthDenoiseEnabled;
+	isDepthHoleFillEnabled = settings.DepthHoleFillEnabled;
+	isColorDownscaleEnabled = settings.ColorDownscaleEnabled;
+	framePairingToleranceUs = (std::max)(0, settings.FramePairingToleranceUs);
+
+	pointBudget = (std::max)(0, settings.PointBudget);
+
+	frameRing.SetDuration(settings.RingRecordingSeconds);
+	isFrameRingEnabled = settings.RingRecordingSeconds > 0;
+
+	// Applied when the next recording starts
+	framesFileWriterReader.SetCompression(settings.RecordingCompressionLevel, settings.RecordingDeltaEnabled);
+	frameRing.SetCompression(settings.RecordingCompressionLevel, settings.RecordingDeltaEnabled);
+	recordingCompressionLevel = settings.RecordingCompressionLevel;
+	isRecordingDeltaEnabled = settings.RecordingDeltaEnabled;
+	isInterleavedRecordingEnabled = settings.InterleavedRecordingEnabled;
+
+	// Applied by the capture thread before its next frame, since the voxel grid is rebuilt for the new range
+	requestedRange = settings.CaptureRange > 0.0f ? (std::min)(settings.CaptureRange, MaxRange) : DefaultRange;
+
+	if (pointBudget == 0)
+		voxelLevel = 0;
+
+	peripheralVoxelScale = (std::max)(1, settings.PeripheralVoxelScale);
+	isAdaptiveRoiEnabled = settings.AdaptiveRoiEnabled;
+	isTemporalFilterEnabled = settings.TemporalFilterEnabled;
+
+	// The frame published last may have been processed with other settings, so the next frame is processed again
+	isStaticFrameReuseEnabled = settings.StaticFrameReuseEnabled;
+	isProcessingChanged = true;
+
+	// Applied by the capture thread after its next frame, which restores all the shed work when the budget is disabled
+	frameTimeBudgetMs = (std::max)(0, settings.FrameTimeBudgetMs);
+
+	threadAffinityMode = settings.ThreadAffinityMode == AffinityNumaNode ? AffinityNumaNode
+		: settings.ThreadAffinityMode == AffinityCoreSet ? AffinityCoreSet : AffinityNone;
+	numCoresPerCamera = settings.CoresPerCamera;
+
+	// Shared by the clients of the process, and only used by the buffers allocated from then on
+	if (settings.LargePagesEnabled != areLargePagesRequested)
+	{
+		areLargePagesRequested = settings.LargePagesEnabled;
+
+		if (!SetFrameLargePagesEnabled(areLargePagesRequested))
+			Log(WarningLevel, "[LiveScanClient] Large pages are not available, the account needs the Lock pages in memory right");
+	}
+
+	depthBinningMode = settings.DepthBinningMode == DepthBinned ? DepthBinned
+		: settings.DepthBinningMode == DepthBinningAuto ? DepthBinningAuto : DepthUnbinned;
+
+	// Learn the background again whenever its removal gets enabled, and start again with a refresh frame
+	BackgroundMode newBackgroundMode = settings.BackgroundMode == BackgroundDropped ? BackgroundDropped
+		: settings.BackgroundMode == BackgroundRefreshed ? BackgroundRefreshed : BackgroundKept;
+
+	if (newBackgroundMode != backgroundMode)
+	{
+		if (backgroundMode == BackgroundKept)
+			backgroundModel.Reset();
+
+		numFramesSinceBackgroundRefresh = BackgroundRefreshInterval;
+	}
+
+	backgroundMode = newBackgroundMode;
 
 	// Copy marker poses to calibration data
 	calibration.markerPoses.resize(settings.NumMarkers);
@@ -146,6 +303,51 @@ void LiveScanClient::SetSettings(const CameraSettings& settings)
 	numExposureSteps = settings.ExposureStep;
 
 	captureManager->SetExposureState(isAutoExposureEnabled, numExposureSteps);
+
+	// GPU processing takes precedence over the SDK backend; each camera falls back to the CPU when its backend fails
+	processingBackend = settings.GpuProcessingEnabled ? GpuProcessing : settings.SdkProcessingEnabled ? SdkProcessing : CpuProcessing;
+	captureManager->SetProcessingBackend(processingBackend);
+
+	// The scheduler is shared by all the clients, which receive the same settings
+	TaskScheduler::Instance().SetThreadCount(settings.NumWorkerThreads);
+
+	// The capture mode and the color stream are applied when the pipeline starts, so a running standalone camera is
+	// restarted right away; synchronized cameras use them from their next restart
+	bool isRestartRequired = false;
+	CaptureMode newCaptureMode = settings.FrameCallbackEnabled ? CallbackCapture : PollingCapture;
+
+	if (newCaptureMode != captureMode)
+	{
+		captureMode = newCaptureMode;
+		captureManager->SetCaptureMode(captureMode);
+		isRestartRequired = true;
+	}
+
+	ColorStreamSettings newColorStreamSettings = { settings.ColorWidth, settings.ColorHeight, settings.ColorMjpgEnabled, settings.DocumentBurstEnabled,
+		settings.ColorYuvEnabled };
+
+	if (newColorStreamSettings.width != colorStreamSettings.width || newColorStreamSettings.height != colorStreamSettings.height
+		|| newColorStreamSettings.isMjpg != colorStreamSettings.isMjpg || newColorStreamSettings.isYuv != colorStreamSettings.isYuv)
+	{
+		isRestartRequired = true;
+	}
+
+	colorStreamSettings = newColorStreamSettings;
+	captureManager->SetColorStreamSettings(colorStreamSettings);
+
+	captureManager->SetRawRecording(settings.RawRecordingEnabled);
+
+	isLeanMemoryEnabled = settings.LeanMemoryEnabled;
+	isNormalEstimationEnabled = settings.NormalEstimationEnabled;
+
+	isConsumerPacingEnabled = settings.ConsumerPacingEnabled;
+	frameDecimation = (std::max)(1, settings.FrameDecimation);
+
+	isProcessingStaggered = settings.ProcessingStaggered;
+	UpdateProcessingPhase();
+
+	if (isRestartRequired && captureManager->isInitialized && currentSyncState == Standalone && !isRestartingCamera)
+		RestartCamera();
 }
 
 void LiveScanClient::RequestRecordedFrame()
@@ -153,14 +355,100 @@ void LiveScanClient::RequestRecordedFrame()
 	// Read the first recorded frame saved during recording
 	vector<Point3s> points;
 	vector<RGB> colors;
-	bool res = framesFileWriterReader.ReadFrame(points, colors);
+	std::shared_ptr<FrameIOHandler> recording = std::atomic_load(&sharedRecording);
+	bool res = recording ? recording->ReadFrame(points, colors, captureManager->GetDeviceIndex()) : framesFileWriterReader.ReadFrame(points, colors);
 
 	SendRecordedFrame(points, colors, !res);
 }
 
-void LiveScanClient::RequestLatestFrame()
+/// <summary>
+/// Sends the next recorded frames through the recorded frame callback, one after the other within this call, so that
+/// the server fetches them without a request per frame. The end of the recording is sent like RequestRecordedFrame does.
+/// </summary>
+/// <param name="maxFrames">Maximum number of frames to send</param>
+/// <returns>Number of frames sent; fewer than maxFrames if the recording ended</returns>
+int LiveScanClient::RequestRecordedFrames(int maxFrames)
+{
+	// The buffers are reused by the frames of the batch, as the callback copies them out
+	vector<Point3s> points;
+	vector<RGB> colors;
+	int numFrames = 0;
+
+	// The frames of the other cameras of a shared recording are kept for their clients as it is read
+	std::shared_ptr<FrameIOHandler> recording = std::atomic_load(&sharedRecording);
+	FrameIOHandler& reader = recording ? *recording : framesFileWriterReader;
+	int deviceID = recording ? captureManager->GetDeviceIndex() : FrameIOHandler::AnyDevice;
+
+	while (numFrames < maxFrames)
+	{
+		if (!reader.ReadFrame(points, colors, deviceID))
+		{
+			SendRecordedFrame(points, colors, true);
+			break;
+		}
+
+		SendRecordedFrame(points, colors, false);
+		numFrames++;
+	}
+
+	return numFrames;
+}
+
+/// <summary>
+/// Returns the latest published frame. Published frames are never modified, so it can be read from any thread for as
+/// long as it is held; the frame pool allocates a new frame if all of them are held.
+/// </summary>
+std::shared_ptr<const ProcessedFrame> LiveScanClient::AcquireLatestFrame()
+{
+	std::shared_ptr<const ProcessedFrame> frame = std::atomic_load(&latestFrame);
+	MarkFrameTaken(frame->SequenceNumber);
+
+	return frame;
+}
+
+/// <summary>
+/// Waits until a frame newer than lastSequenceNumber has been published
+/// </summary>
+/// <param name="lastSequenceNumber">Sequence number of the last frame read by the caller</param>
+/// <param name="timeoutMs">Maximum time to wait for the new frame</param>
+/// <returns>True if a new frame is available; false if the wait timed out.</returns>
+bool LiveScanClient::WaitForNewFrame(uint64_t lastSequenceNumber, int timeoutMs)
+{
+	// Waiting for a newer frame asks for one, with consumer pacing
+	MarkFrameTaken(lastSequenceNumber);
+
+	std::unique_lock<std::mutex> lock(frameReadyMutex);
+
+	return frameReadyCond.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+		[this, lastSequenceNumber]() { return latestSequenceNumber > lastSequenceNumber || isExitRequested; })
+		&& latestSequenceNumber > lastSequenceNumber;
+}
+
+/// <summary>
+/// Copies the depth frame the capture thread acquires next, with the camera parameters and world transform it is
+/// unprojected with
+/// </summary>
+/// <param name="timeoutMs">Maximum time to wait for the next frame</param>
+/// <returns>True if the frame was copied; false if the wait timed out.</returns>
+bool LiveScanClient::AcquireDepthFrame(DepthFrame& frame, int timeoutMs)
 {
-	SendLatestFrame();
+	std::unique_lock<std::mutex> lock(depthFrameMutex);
+	isDepthFrameRequested = true;
+
+	if (!depthFrameCond.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return !isDepthFrameRequested || isExitRequested; })
+		|| isDepthFrameRequested)
+	{
+		isDepthFrameRequested = false;
+		return false;
+	}
+
+	frame.Depth.assign(depthFrame.Depth.begin(), depthFrame.Depth.end());
+	frame.Width = depthFrame.Width;
+	frame.Height = depthFrame.Height;
+	std::copy(depthFrame.Intrinsics, depthFrame.Intrinsics + 4, frame.Intrinsics);
+	std::copy(depthFrame.DepthToWorld, depthFrame.DepthToWorld + 12, frame.DepthToWorld);
+
+	return true;
 }
 
 void LiveScanClient::ReceiveCalibration(const AffineTransform& transform)
@@ -172,78 +460,144 @@ void LiveScanClient::ReceiveCalibration(const AffineTransform& transform)
 
 		calibration.worldT[i] = transform.T[i];
 	}
+
+	calibration.UpdateWorldTransform();
+	isProcessingChanged = true;
+}
+
+/// <summary>
+/// Receives the poses of all the calibrated cameras, between which the voxels of the grid are shared out so that the
+/// points seen by several cameras are only kept by one of them
+/// </summary>
+/// <param name="poses">Pose of each camera in world space, whose translation is its position; empty to keep all the voxels</param>
+/// <param name="cameraIndex">Index of the pose of this camera among them</param>
+void LiveScanClient::ReceiveCameraPoses(const std::vector<AffineTransform>& poses, int cameraIndex)
+{
+	std::vector<VoxelOwner> owners(poses.size());
+
+	for (size_t i = 0; i < poses.size(); i++)
+	{
+		// The optical axis of the camera is the z axis of its pose
+		for (int j = 0; j < 3; j++)
+		{
+			owners[i].center[j] = poses[i].T[j];
+			owners[i].axis[j] = poses[i].R[j][2];
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(cameraOwnersMutex);
+	requestedCameraOwners = owners;
+	requestedCameraOwnerIndex = cameraIndex;
+	isCameraOwnersChanged = true;
+	isProcessingChanged = true;
 }
 
 void LiveScanClient::ClearRecordedFrames()
 {
-	framesFileWriterReader.CloseFile();
+	// A shared recording is closed once its last client releases it, which reports it for all of them
+	std::shared_ptr<FrameIOHandler> recording = std::atomic_exchange(&sharedRecording, std::shared_ptr<FrameIOHandler>());
+
+	if (recording && recording.use_count() > 1)
+		return;
+
+	// Report whether the disk kept up with the recording before its counters are reset by the next one
+	FrameIOHandler& closedRecording = recording ? *recording : framesFileWriterReader;
+	RecordingStats stats = closedRecording.GetRecordingStats();
+	closedRecording.CloseFile();
+
+	if (stats.NumWrittenFrames > 0 || stats.NumDroppedFrames > 0)
+		Log("[LiveScanClient] Recorded " + std::to_string(stats.NumWrittenFrames) + " frames (" + std::to_string(stats.NumWrittenBytes / (1024 * 1024))
+			+ " MB), dropped " + std::to_string(stats.NumDroppedFrames) + ", at most " + std::to_string(stats.MaxQueuedFrames) + " queued");
+}
+
+/// <summary>
+/// Saves the last seconds of the frame ring to a new recording, in the background
+/// </summary>
+void LiveScanClient::SaveFrameRing(int seconds)
+{
+	if (frameRing.Save(seconds, captureManager->GetDeviceIndex()))
+		Log("[LiveScanClient] Saving the last " + std::to_string(seconds) + " s of frames");
+	else
+		Log("[LiveScanClient] No frame to save, or the previous save is not done");
+}
+
+/// <summary>
+/// Learns the exclusion mask of the static clutter from the next frames, which should see the empty scene; the
+/// capture thread starts it before its next frame
+/// </summary>
+/// <param name="numFrames">Number of frames to learn the mask from; 0 clears the mask, and negative learns from the default number</param>
+void LiveScanClient::LearnExclusionMask(int numFrames)
+{
+	requestedExclusionFrames = numFrames < 0 ? DefaultExclusionLearningFrames : numFrames;
+	isProcessingChanged = true;
 }
 
-void LiveScanClient::EnableSync(int syncState, int syncOffset)
+/// <summary>
+/// Switches the sync mode of the camera. Only the pipeline is restarted with the new sync configuration; the device
+/// stays open, so all the cameras can switch in parallel within their pipeline startup time.
+/// </summary>
+void LiveScanClient::EnableSync(int syncState, int syncOffset, int numSyncedDevices)
 {
 	bool res = false;
 
+	this->numSyncedDevices = (std::max)(1, numSyncedDevices);
+
 	switch (syncState)
 	{
 	case 0:
 		currentSyncState = Subordinate;
+		currentSyncOffset = syncOffset;
+		UpdateProcessingPhase();
 		isRestartingCamera = true;
 
-		// Close camera
-		res = captureManager->Close();
-		if (!res) {
-			Log("[LiveScanClient] Subordinate device failed to close! Restart Application!");
-			return;
-		}
-
-		// Re-initialize as Subordinate with a unique syncOffset (sent by the server)
-		res = captureManager->Initialize(Subordinate, syncOffset);
+		// Restart as Subordinate with a unique syncOffset (sent by the server)
+		res = captureManager->StopStreaming() && captureManager->StartStreaming(Subordinate, syncOffset);
 		if (!res) {
-			Log("[LiveScanClient] Subordinate device failed to reinitialize! Restart Application!");
+			// The frame loop reopens the camera, and confirms the sync state once it streams again
+			Log(ErrorLevel, "[LiveScanClient] Subordinate device failed to restart, reopening it");
+			captureManager->RequestDeviceRecovery();
 			return;
 		}
 
 		// Confirm reinitialization as Subordinate to the server
-		isConfirmSyncStateRequested = true;
+		ConfirmSyncState();
 		isRestartingCamera = false;
 		break;
 
 	case 1:
 		currentSyncState = Master;
+		currentSyncOffset = 0;
+		UpdateProcessingPhase();
 		isRestartingCamera = true;
 
-		// Close camera; need to wait until all Subordinates have reinitialized before restarting the Master
-		res = captureManager->Close();
+		// Stop streaming; need to wait until all Subordinates have restarted before restarting the Master
+		res = captureManager->StopStreaming();
 		if (!res) {
-			Log("[LiveScanClient] Master device failed to close! Restart Application!");
+			Log(ErrorLevel, "[LiveScanClient] Master device failed to stop, reopening it");
+			captureManager->RequestDeviceRecovery();
 			return;
 		}
 
 		// Confirm reinitialization as Master to the server
-		isConfirmSyncStateRequested = true;
+		ConfirmSyncState();
 		break;
 
 	case 2:
 		currentSyncState = Standalone;
+		currentSyncOffset = 0;
+		UpdateProcessingPhase();
 		isRestartingCamera = true;
 
-		// Close camera
-		res = captureManager->Close();
-		if (!res) {
-			Log("[LiveScanClient] Capture device failed to close! Restart Application!");
-			return;
-		}
-
-		// Re-initialize as Standalone
-		res = captureManager->Initialize(Standalone, 0);
-
+		// Restart as Standalone
+		res = captureManager->StopStreaming() && captureManager->StartStreaming(Standalone, 0);
 		if (!res) {
-			Log("[LiveScanClient] Capture device failed to reinitialize! Restart Application!");
+			Log(ErrorLevel, "[LiveScanClient] Capture device failed to restart, reopening it");
+			captureManager->RequestDeviceRecovery();
 			return;
 		}
 
 		// Confirm reinitialization as Standalone to the server
-		isConfirmSyncStateRequested = true;
+		ConfirmSyncState();
 		isRestartingCamera = false;
 		break;
 
@@ -256,82 +610,117 @@ void LiveScanClient::DisableSync()
 {
 	// Set this device as Standalone
 	currentSyncState = Standalone;
+	currentSyncOffset = 0;
+	UpdateProcessingPhase();
 	isRestartingCamera = true;
 
-	bool res;
-
-	// Close the camera
-	res = captureManager->Close();
+	// Restart the pipeline as Standalone
+	bool res = captureManager->StopStreaming() && captureManager->StartStreaming(Standalone, 0);
 	if (!res) {
-		Log("[LiveScanClient] Capture device failed to close! Restart Application!");
+		Log(ErrorLevel, "[LiveScanClient] Capture device failed to restart, reopening it");
+		captureManager->RequestDeviceRecovery();
 		return;
 	}
 
-	// Re-initialize as Standalone
-	res = captureManager->Initialize(Standalone, 0);
+	// Confirm reinitialization as Standalone to the server
+	ConfirmSyncState();
+	isRestartingCamera = false;
+}
+
+/// <summary>
+/// Delays the processing of the frames of a synced camera by its place on the sync chain, as a fraction of the frame
+/// period, so that the cameras of a host do not all process their frames at the same time. The frames keep the
+/// timestamps of their capture, which stays synchronized, so the server groups them as before.
+/// </summary>
+void LiveScanClient::UpdateProcessingPhase()
+{
+	bool isStaggered = isProcessingStaggered && currentSyncState != Standalone && numSyncedDevices > 1;
+
+	captureManager->processingPhase = isStaggered ? static_cast<float>(currentSyncOffset % numSyncedDevices) / numSyncedDevices : 0.0f;
+}
+
+void LiveScanClient::RestartCamera()
+{
+	isRestartingCamera = true;
+
+	bool res = captureManager->StopStreaming() && captureManager->StartStreaming(currentSyncState, currentSyncOffset);
 
 	if (!res) {
-		Log("[LiveScanClient] Capture device failed to reinitialize! Restart Application!");
+		Log(ErrorLevel, "[LiveScanClient] Capture device failed to restart, reopening it");
+		captureManager->RequestDeviceRecovery();
 		return;
 	}
 
-	// Confirm reinitialization as Standalone to the server
-	isConfirmSyncStateRequested = true;
 	isRestartingCamera = false;
 }
 
+/// <summary>
+/// Reopens the lost camera, with the sync configuration it had or was switching to, so that it rejoins the sync chain
+/// while the other cameras keep streaming. The calibration and the settings are kept by the client and applied again
+/// from the next frame; the capture manager applies the exposure again when the pipeline starts.
+/// </summary>
+void LiveScanClient::RecoverCamera()
+{
+	if (!isCameraLost)
+	{
+		isCameraLost = true;
+		Log(WarningLevel, "[LiveScanClient] Camera " + captureManager->serialNumber + " was lost, reopening it");
+	}
+
+	if (!captureManager->RecoverDevice(currentSyncState, currentSyncOffset))
+	{
+		// The capture manager spaces out the attempts; the frame loop has nothing else to do meanwhile
+		std::this_thread::sleep_for(std::chrono::milliseconds(RecoveryPollIntervalMs));
+		return;
+	}
+
+	isCameraLost = false;
+	Log(WarningLevel, "[LiveScanClient] Camera " + captureManager->serialNumber + " was reopened");
+
+	// A sync switch which failed with the camera is confirmed now that the camera streams in its new mode; the master
+	// still waits for StartMaster, which finds it streaming
+	if (isRestartingCamera)
+	{
+		ConfirmSyncState();
+
+		if (currentSyncState != Master)
+			isRestartingCamera = false;
+	}
+}
+
 void LiveScanClient::StartMaster()
 {
-	// This is called by the server once all Subordinates have been re-initialized, meaning the Master can now start
+	// This is called by the server once all Subordinates have been restarted, meaning the Master can now start
 	if (currentSyncState == Master)
 	{
-		bool res = captureManager->Initialize(Master, 0);
+		// A master reopened after it failed to stop already streams
+		bool res = captureManager->isInitialized || captureManager->StartStreaming(Master, 0);
 		if (!res) {
-			Log("[LiveScanClient] Master device failed to reinitialize! Restart Application!");
+			Log(ErrorLevel, "[LiveScanClient] Master device failed to restart, reopening it");
+			captureManager->RequestDeviceRecovery();
 			return;
 		}
 
-		isConfirmRestartAsMasterRequested = true;
+		ConfirmMasterRestart();
 		isRestartingCamera = false;
 	}
 }
 
 void LiveScanClient::RequestExit()
 {
-	isExitRequested = true;
-}
-
-void LiveScanClient::SendClientConfirmations()
-{
-	while (isClientThreadRunning)
 	{
-		if (isConfirmRecordedRequested)
-		{
-			ConfirmRecorded();
-		}
-
-		if (isConfirmCalibratedRequested)
-		{
-			ConfirmCalibrated();
-		}
-
-		if (isConfirmSyncStateRequested)
-		{
-			ConfirmSyncState();
-		}
-
-		if (isConfirmRestartAsMasterRequested)
-		{
-			ConfirmMasterRestart();
-		}
+		std::lock_guard<std::mutex> lock(frameReadyMutex);
+		isExitRequested = true;
+	}
 
-		if (isSendDocumentRequested)
-		{
-			SendDocument();
-		}
+	// Do not keep the server waiting for a frame which will never come
+	frameReadyCond.notify_all();
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	{
+		std::lock_guard<std::mutex> lock(depthFrameMutex);
 	}
+
+	depthFrameCond.notify_all();
 }
 
 /// <summary>
@@ -339,324 +728,1515 @@ void LiveScanClient::SendClientConfirmations()
 /// </summary>
 void LiveScanClient::UpdateFrame()
 {
-	// Check that the capture manager is initialized
+	// Check that the capture manager is initialized; a camera lost by its connection is reopened meanwhile
 	if (!captureManager->isInitialized)
 	{
+		if (captureManager->IsDeviceLost())
+			RecoverCamera();
+
+		return;
+	}
+
+	// With the consumer pacing, a replay at maximum speed keeps its next frame until the latest one was taken
+	if (isConsumerPacingEnabled && isMaxSpeedReplay && takenSequenceNumber.load() < latestSequenceNumber)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(ReplayPacingPollIntervalMs));
 		return;
 	}
 
+	UpdateThreadAffinity();
+	UpdateCaptureRange();
+	UpdateCameraOwners();
+	UpdateDepthBinning();
+	UpdateProcessingRoi();
+
+	// Backends which process the frame at capture time need the latest calibration and bounds
+	captureManager->SetFrameProcessingParams(GetFrameProcessingParams());
+
+	// The capture manager skips the points of a frame whose depth did not change since the last processed frame, when
+	// that frame can be published again
+	captureManager->isStaticFrameDetectionEnabled = isStaticFrameReuseEnabled;
+	captureManager->isStaticFrameReusable = IsStaticFrameReusable();
+
+	// Only the frames which are processed to the end are measured as a whole
+	PerfTimer frameTimer(&perfStats, FrameStage);
+
 	// Acquire a new point cloud frame from the camera
+	PerfTimer acquireTimer(&perfStats, AcquireStage);
 	bool newFrameAcquired = captureManager->AcquireFrame(isCalibrateRequested);
+	acquireTimer.Stop();
+	frameAcquireTime = std::chrono::steady_clock::now();
+	frameAcquireSystemTimeUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 
 	if (!newFrameAcquired)
 	{
+		frameTimer.Cancel();
+		return;
+	}
+
+	if (isDepthFrameRequested)
+	{
+		CaptureDepthFrame();
+	}
+
+	// Calibrating pauses the processing of the point clouds, so that the marker detection of all the cameras has the
+	// worker pool to itself; the last processed frame stays published meanwhile
+	if (isCalibrateRequested)
+	{
+		frameTimer.Cancel();
+		UpdateCalibration();
 		return;
 	}
 
-	// Apply some processing to the data that was just retrieved and store it in local variables
-	ProcessFrame();
+	// The frames nobody will read are not processed, and the published frame stays the latest one
+	bool isFrameProcessed = IsFrameProcessingRequired();
+
+	if (isFrameProcessed)
+	{
+		// Release the temporary buffers of the previous frame; in debug builds, report the frames which did not fit in the arena
+		int numFrameHeapAllocations = frameArena.Reset();
+
+#ifdef _DEBUG
+		if (numFrameHeapAllocations > 0)
+			Log("[LiveScanClient] Frame arena grew to " + std::to_string(frameArena.GetCapacity()) + " bytes after " + std::to_string(numFrameHeapAllocations) + " heap allocations");
+#endif
+
+		if (captureManager->isFrameStatic)
+		{
+			RepublishFrame();
+		}
+		else
+		{
+			// The settings changed from here on are applied to the next frame; the depth of this one is what the next
+			// frames are compared with
+			isProcessingChanged = false;
+
+			// Apply some processing to the data that was just retrieved and store it in local variables
+			PerfTimer processTimer(&perfStats, ProcessStage);
+			ProcessFrame();
+			captureManager->sceneChangeDetector.AcceptFrame();
+		}
+
+		if (isStaticFrameReuseEnabled)
+			ReportReusedFrames(captureManager->isFrameStatic);
+	}
+	else
+	{
+		frameTimer.Cancel();
+	}
 
 	// Process the document data from the frame
 	if (captureManager->hasNewDocument) 
 	{
+		PerfTimer documentTimer(&perfStats, DocumentStage);
+		const cv::Rect2f& documentRegion = captureManager->lastDocumentRegion;
+		foveationMap.SetDocumentRegion(documentRegion.x, documentRegion.y, documentRegion.width, documentRegion.height);
 		ProcessDocument();
 		captureManager->hasNewDocument = false;
 	}
+
+	if (!isFrameProcessed)
+		return;
 	
+	PerfTimer storeTimer(&perfStats, StoreStage);
+
+	// Keep every processed frame in the ring, when enabled, so that the server can save them after the fact
+	{
+		std::shared_ptr<const ProcessedFrame> frame = std::atomic_load(&latestFrame);
+		frameRing.Push(frame->Vertices, frame->Colors, captureManager->GetTimeStamp());
+	}
 
 	if (isRecordFrameRequested)
 	{
-		// If we are recording frames, save the frame that was just processed
+		// If we are recording frames, queue the frame that was just processed; the writer thread holds the published
+		// buffers until they are written, and the frame is dropped from the recording if the writer falls behind
 		uint64_t timeStamp = captureManager->GetTimeStamp();
-		framesFileWriterReader.WriteFrame(lastFrameVertices, lastFrameColors, timeStamp, captureManager->GetDeviceIndex());
+		std::shared_ptr<const ProcessedFrame> frame = std::atomic_load(&latestFrame);
+		std::shared_ptr<FrameIOHandler> recording = std::atomic_load(&sharedRecording);
+		(recording ? *recording : framesFileWriterReader).WriteFrame(std::shared_ptr<const std::vector<Point3s>>(frame, &frame->Vertices),
+			std::shared_ptr<const std::vector<RGB>>(frame, &frame->Colors), timeStamp, captureManager->GetDeviceIndex());
 
-		isConfirmRecordedRequested = true;
+		ConfirmRecorded();
 		isRecordFrameRequested = false;
 	}
 
-	if (isCalibrateRequested)
-	{
-		// Calibrate the camera by using the marker(s) and their positions as specified in the settings
-		int totalPixels = captureManager->depthFrameWidth * captureManager->depthFrameHeight;
-		Point3f* floatPoints = new Point3f[totalPixels];
-		RGB* colors = new RGB[totalPixels];
+	storeTimer.Stop();
+	frameTimer.Stop();
 
-		for (int i = 0; i < totalPixels; i++) {
-			floatPoints[i].X = captureManager->lastFrameVertices[i].X;
-			floatPoints[i].Y = captureManager->lastFrameVertices[i].Y;
-			floatPoints[i].Z = captureManager->lastFrameVertices[i].Z;
+	UpdateLoadShedding();
 
-			colors[i].Red = captureManager->lastFrameColors[i].Red;
-			colors[i].Green = captureManager->lastFrameColors[i].Green;
-			colors[i].Blue = captureManager->lastFrameColors[i].Blue;
-		} 
+	if (++numFramesSinceMemoryStats >= MemoryStatsInterval)
+	{
+		numFramesSinceMemoryStats = 0;
+
+		if (isLeanMemoryEnabled)
+			ReleaseUnusedMemory();
+
+		UpdateMemoryStats();
+	}
+}
+
+/// <summary>
+/// Trims the working buffers to twice what the recent frames used and releases the buffers of the disabled features;
+/// they grow back when the frames or the features need them again
+/// </summary>
+void LiveScanClient::ReleaseUnusedMemory()
+{
+	captureManager->ReleaseUnusedMemory();
+
+	TrimCapacity(stagedPoints);
+	TrimCapacity(candidatePoints);
+	TrimCapacity(chunkPointCounts);
+	TrimCapacity(stagedVoxelSlots);
+	TrimCapacity(chunkRejections);
+	TrimCapacity(candidateDensityCells);
+	TrimCapacity(sureKeptPoints);
+
+	voxelGridFilter.ReleaseUnusedMemory();
+	densityCounter.ReleaseUnusedMemory();
+	radiusOutlierFilter.ReleaseUnusedMemory();
+	organizedFilter.ReleaseUnusedMemory();
+	frameRing.ReleaseUnusedMemory();
+
+	if (!isNormalEstimationEnabled)
+		normalEstimator.ReleaseMemory();
+
+	if (!wasFrameFoveated)
+		foveationMap.Reset();
+
+	// Only the frames of the pool which nobody reads can be trimmed, the published one is referenced by latestFrame
+	for (auto& frame : framePool)
+	{
+		if (frame && frame.use_count() == 1)
+		{
+			std::atomic_thread_fence(std::memory_order_acquire);
+			TrimCapacity(frame->Vertices);
+			TrimCapacity(frame->Colors);
+			TrimCapacity(frame->Normals);
+		}
+	}
+
+	if (backgroundMode == BackgroundKept)
+		backgroundModel.Reset();
 
-		bool res = calibration.Calibrate(colors, floatPoints, captureManager->depthFrameWidth, captureManager->depthFrameHeight);
+	if (backgroundMode != BackgroundRefreshed)
+	{
+		ReleaseCapacity(backgroundVertices);
+		ReleaseCapacity(backgroundColors);
+		ReleaseCapacity(backgroundNormals);
+	}
 
-		delete[] floatPoints;
-		delete[] colors;
+	{
+		std::lock_guard<std::mutex> lock(calibrationMutex);
 
-		if (res)
+		if (!isCalibrationSampleRunning && !isCalibrateRequested)
 		{
-			// Save the new calibration to a file to reuse in a later run
-			calibration.SaveCalibration(captureManager->serialNumber);
-			isConfirmCalibratedRequested = true;
-			isCalibrateRequested = false;
+			calibrationFramePoints = PointBuffer();
+			ReleaseCapacity(calibrationDepthFrame);
+			ReleaseCapacity(calibrationColorFrame);
 		}
 	}
 }
 
 /// <summary>
-/// Applies some processing steps to the last retrieved point cloud such as filtering and removing points outside the bounds
+/// Accounts for the bytes held by the buffers of the client, by category. The buffers of the camera SDK and of the
+/// GPU are not counted.
 /// </summary>
-void LiveScanClient::ProcessFrame()
+void LiveScanClient::UpdateMemoryStats()
 {
-	unsigned int numVertices = captureManager->lastFrameVertices.size();
+	ClientMemoryStats stats = {};
+
+	stats.Bytes[CaptureMemory] = captureManager->GetMemoryUsage();
+	stats.Bytes[ProcessingMemory] = GetCapacityBytes(stagedPoints) + GetCapacityBytes(candidatePoints)
+		+ GetCapacityBytes(chunkPointCounts) + GetCapacityBytes(chunkRejections) + GetCapacityBytes(stagedVoxelSlots) + GetCapacityBytes(candidateDensityCells)
+		+ GetCapacityBytes(sureKeptPoints);
+	stats.Bytes[VoxelGridMemory] = voxelGridFilter.GetMemoryUsage() + densityCounter.GetMemoryUsage() + foveationMap.GetMemoryUsage();
+	stats.Bytes[FilterMemory] = radiusOutlierFilter.GetMemoryUsage() + organizedFilter.GetMemoryUsage()
+		+ outlierDecisions.GetMemoryUsage() + normalEstimator.GetMemoryUsage();
+	stats.Bytes[BackgroundMemory] = backgroundModel.GetMemoryUsage() + GetCapacityBytes(backgroundVertices)
+		+ GetCapacityBytes(backgroundColors) + GetCapacityBytes(backgroundNormals) + exclusionMask.GetMemoryUsage();
+	stats.Bytes[RingMemory] = frameRing.GetMemoryUsage();
+	stats.Bytes[ArenaMemory] = frameArena.GetCapacity();
+
+	for (auto& frame : framePool)
+	{
+		if (frame)
+			stats.Bytes[FrameMemory] += GetCapacityBytes(frame->Vertices) + GetCapacityBytes(frame->Colors)
+				+ GetCapacityBytes(frame->Normals);
+	}
 
-	// To save some processing cost, we allocate a full frame size (numVertices) of a Point3f Vector beforehand
-	// instead of using push_back for each vertex. Even though we have to copy the vertices into a clean array
-	// later and it uses a little bit more RAM, this gives us a nice speed increase for this function, around 25-50%.
+	{
+		std::lock_guard<std::mutex> lock(calibrationMutex);
+		stats.Bytes[ProcessingMemory] += GetCapacityBytes(calibrationFramePoints) + GetCapacityBytes(calibrationDepthFrame)
+			+ GetCapacityBytes(calibrationColorFrame);
+	}
 
-	// Create a placeholder for a point to remove
-	Point3f invalidPoint = Point3f(0, 0, 0, true);
+	{
+		std::lock_guard<std::mutex> lock(depthFrameMutex);
+		stats.Bytes[ProcessingMemory] += GetCapacityBytes(depthFrame.Depth);
+	}
 
-	vector<Point3f> allVertices(numVertices);
-	int goodVerticesCount = 0;
+	stats.Bytes[DocumentMemory] = GetCapacityBytes(captureManager->lastDocumentJpeg);
 
-	voxelGridFilter.Reset();
+	if (captureManager->documentDetector)
+		stats.Bytes[DocumentMemory] += captureManager->documentDetector->GetMemoryUsage();
 
-	// Apply calibration and remove points outside bounds
-	for (unsigned int vertexIndex = 0; vertexIndex < numVertices; vertexIndex++)
 	{
-		Point3f temp = captureManager->lastFrameVertices[vertexIndex];
+		std::lock_guard<std::mutex> lock(documentMutex);
+		stats.Bytes[DocumentMemory] += GetCapacityBytes(lastDocumentJpeg);
+	}
 
-		if (calibration.isCalibrated)
+	for (int i = 0; i < NumMemoryCategories; i++)
+		stats.TotalBytes += stats.Bytes[i];
+
+	std::lock_guard<std::mutex> lock(memoryStatsMutex);
+	memoryStats = stats;
+}
+
+/// <summary>
+/// Copies the last memory accounting of the client, made every MemoryStatsInterval processed frames
+/// </summary>
+void LiveScanClient::GetMemoryStats(ClientMemoryStats& stats)
+{
+	std::lock_guard<std::mutex> lock(memoryStatsMutex);
+	stats = memoryStats;
+}
+
+/// <summary>
+/// Copies the acquired depth frame for the server, along with the depth intrinsics and the depth camera to world
+/// transform, which is the world transform of the calibration composed with the depth to color camera transform
+/// </summary>
+void LiveScanClient::CaptureDepthFrame()
+{
+	RawCameraParams params = captureManager->GetCameraParams();
+
+	{
+		std::lock_guard<std::mutex> lock(depthFrameMutex);
+
+		if (!isDepthFrameRequested)
+			return;
+
+		size_t numPixels = static_cast<size_t>(captureManager->depthFrameWidth) * captureManager->depthFrameHeight;
+		depthFrame.Depth.assign(captureManager->depthData, captureManager->depthData + numPixels);
+		depthFrame.Width = captureManager->depthFrameWidth;
+		depthFrame.Height = captureManager->depthFrameHeight;
+		depthFrame.Intrinsics[0] = params.DepthFx;
+		depthFrame.Intrinsics[1] = params.DepthFy;
+		depthFrame.Intrinsics[2] = params.DepthCx;
+		depthFrame.Intrinsics[3] = params.DepthCy;
+
+		for (int i = 0; i < 3; i++)
 		{
-			// Rotate the point to match the calibration
-			temp.X += calibration.worldT[0];
-			temp.Y += calibration.worldT[1];
-			temp.Z += calibration.worldT[2];
-			temp = RotatePoint(temp, calibration.worldR);
+			const float* world = calibration.worldTransform[i];
+			float* depthToWorld = depthFrame.DepthToWorld + 4 * i;
+
+			depthToWorld[3] = world[3];
+
+			for (int j = 0; j < 3; j++)
+			{
+				depthToWorld[j] = 0.0f;
+
+				for (int k = 0; k < 3; k++)
+					depthToWorld[j] += world[k] * params.Rot[k * 3 + j];
 
+				// The depth to color translation is in millimeters
+				depthToWorld[3] += world[j] * params.Trans[j] / 1000.0f;
+			}
+		}
+
+		isDepthFrameRequested = false;
+	}
+
+	depthFrameCond.notify_all();
+}
+
+/// <summary>
+/// Applies the calibration once enough marker samples were found, otherwise hands the current frame to the calibration
+/// task when it is idle. Frames acquired while a sample is being detected are not used for the calibration.
+/// </summary>
+void LiveScanClient::UpdateCalibration()
+{
+	{
+		std::lock_guard<std::mutex> lock(calibrationMutex);
+
+		if (isCalibrationSampleRunning)
+			return;
+	}
+
+	if (isCalibrationSampleComplete)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+				calibration.worldR[i][j] = calibrationSampler.worldR[i][j];
+
+			calibration.worldT[i] = calibrationSampler.worldT[i];
+		}
+
+		calibration.usedMarkerId = calibrationSampler.usedMarkerId;
+		calibration.UpdateWorldTransform();
+		calibration.isCalibrated = true;
+
+		// Save the new calibration to a file to reuse in a later run
+		calibration.SaveCalibration(captureManager->serialNumber);
+
+		// The voxels of the mask were in the world space of the previous calibration
+		if (exclusionMask.IsLearned() || exclusionMask.IsLearning())
+		{
+			exclusionMask.Clear();
+			std::remove(ExclusionMask::GetFileName(captureManager->serialNumber).c_str());
+			Log(WarningLevel, "[LiveScanClient] Cleared the exclusion mask of the previous calibration, it needs to be learned again");
+		}
+		ConfirmCalibrated();
+		isCalibrateRequested = false;
+		isCalibrationSampleComplete = false;
+		isProcessingChanged = true;
+		return;
+	}
+
+	// Calibrate the camera by using the marker(s) and their positions as specified in the settings
+	calibrationSampler.markerPoses = calibration.markerPoses;
+	calibrationFramePoints = captureManager->lastFramePoints;
+	calibrationFrameWidth = captureManager->depthFrameWidth;
+	calibrationFrameHeight = captureManager->depthFrameHeight;
+
+	{
+		std::lock_guard<std::mutex> lock(calibrationMutex);
+		isCalibrationSampleRunning = true;
+	}
+
+	// Each client has its own task, so all the cameras can calibrate at the same time
+	TaskScheduler::Instance().Submit(BackgroundTaskPriority, [this]() { RunCalibrationSample(); });
+}
+
+/// <summary>
+/// Looks for a marker in the frame snapshot taken by UpdateCalibration and adds it to the calibration samples
+/// </summary>
+void LiveScanClient::RunCalibrationSample()
+{
+	size_t totalPixels = static_cast<size_t>(calibrationFrameWidth) * calibrationFrameHeight;
+	calibrationDepthFrame.assign(totalPixels, Point3f());
+	calibrationColorFrame.assign(totalPixels, RGB());
+
+	// The marker detection needs the organized frame, so scatter the valid points back to their depth pixels
+	for (size_t i = 0; i < calibrationFramePoints.Size(); i++) {
+		int pixelIndex = calibrationFramePoints.PixelIndices[i];
+
+		calibrationDepthFrame[pixelIndex] = Point3f(calibrationFramePoints.X[i], calibrationFramePoints.Y[i], calibrationFramePoints.Z[i]);
+		calibrationColorFrame[pixelIndex] = calibrationFramePoints.Colors[i];
+	}
+
+	bool res = calibrationSampler.Calibrate(calibrationColorFrame.data(), calibrationDepthFrame.data(), calibrationFrameWidth, calibrationFrameHeight);
+
+	// The sampler starts over once it has calibrated
+	numCalibrationSamples = res ? calibrationSampler.GetNumRequiredSamples() : calibrationSampler.GetNumSamples();
+
+	std::lock_guard<std::mutex> lock(calibrationMutex);
+	isCalibrationSampleComplete = res;
+	isCalibrationSampleRunning = false;
+	calibrationDoneCond.notify_all();
+}
+
+/// <summary>
+/// Gathers the calibration, bounds and voxel grid parameters for capture backends which apply them while generating the point cloud
+/// </summary>
+FrameProcessingParams LiveScanClient::GetFrameProcessingParams()
+{
+	FrameProcessingParams params;
+	params.isCalibrated = calibration.isCalibrated;
+
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 4; j++)
+			params.worldTransform[i][j] = calibration.worldTransform[i][j];
+
+		params.minBounds[i] = bounds[i];
+		params.maxBounds[i] = bounds[i + 3];
+	}
+
+	params.voxelSize = GetVoxelSize();
+	params.gridCenter[0] = XRangeCenter;
+	params.gridCenter[1] = YRangeCenter;
+	params.gridCenter[2] = zRangeCenter;
+	params.gridHalfRange = halfRange;
+
+	// Flying pixels are outliers too, so they are rejected along with the other filtering steps
+	params.isFlyingPixelFilterEnabled = isFilterEnabled;
+	params.isDepthDenoiseEnabled = isDepthDenoiseEnabled;
+	params.isDepthHoleFillEnabled = isDepthHoleFillEnabled;
+	params.isColorDownscaleEnabled = isColorDownscaleEnabled;
+	params.framePairingToleranceUs = framePairingToleranceUs;
+
+	for (int i = 0; i < 4; i++)
+		params.processingRoi[i] = processingRoi[i];
+
+	return params;
+}
+
+/// <summary>
+/// Applies the calibration, the background separation, the bounds and the exclusion mask to the points of one chunk of
+/// the frame, claims their voxels in the voxel grid, and writes the kept points in place in stagedPoints; when foveated,
+/// the points outside the regions of interest claim the coarser voxels of the periphery. Each combination of steps is a separate
+/// instantiation, so the loop has no test for the steps the frame skips; without the background, the crop and the
+/// mask, it keeps every point and has no branch at all.
+/// </summary>
+/// <param name="rejections">Set to the number of points each step removed</param>
+/// <returns>Number of points kept, written from begin in stagedPoints</returns>
+template <bool IsBackgroundSkipped, bool IsTransformRequired, bool IsCropRequired, bool IsFoveated, bool IsMasked>
+unsigned int LiveScanClient::StageChunk(const PointBuffer& source, unsigned int begin, unsigned int end, StageRejections& rejections)
+{
+	// Copied to locals, so that the compiler knows the stores to the staged points do not change them
+	const float* sourceX = source.X.data();
+	const float* sourceY = source.Y.data();
+	const float* sourceZ = source.Z.data();
+	const RGB* sourceColors = source.Colors.data();
+	const int* sourcePixelIndices = source.PixelIndices.data();
+	float* stagedX = stagedPoints.X.data();
+	float* stagedY = stagedPoints.Y.data();
+	float* stagedZ = stagedPoints.Z.data();
+	RGB* stagedColors = stagedPoints.Colors.data();
+	int* stagedPixelIndices = stagedPoints.PixelIndices.data();
+	uint32_t* stagedSlots = stagedVoxelSlots.data();
+	const UINT16* depthData = captureManager->depthData;
+
+	const float (*M)[4] = calibration.worldTransform;
+	const float m00 = M[0][0], m01 = M[0][1], m02 = M[0][2], m03 = M[0][3];
+	const float m10 = M[1][0], m11 = M[1][1], m12 = M[1][2], m13 = M[1][3];
+	const float m20 = M[2][0], m21 = M[2][1], m22 = M[2][2], m23 = M[2][3];
+	const float minX = bounds[0], minY = bounds[1], minZ = bounds[2];
+	const float maxX = bounds[3], maxY = bounds[4], maxZ = bounds[5];
+	const int peripheralScale = peripheralVoxelScale;
+
+	unsigned int count = 0;
+	StageRejections rejected = {};
+
+	for (unsigned int vertexIndex = begin; vertexIndex < end; vertexIndex++)
+	{
+		int pixelIndex = sourcePixelIndices[vertexIndex];
+
+		if (IsBackgroundSkipped && backgroundModel.IsBackground(pixelIndex, depthData[pixelIndex]))
+		{
+			rejected.Background++;
+			continue;
+		}
+
+		float x = sourceX[vertexIndex];
+		float y = sourceY[vertexIndex];
+		float z = sourceZ[vertexIndex];
+
+		if (IsTransformRequired)
+		{
+			float sx = x, sy = y, sz = z;
+			x = m00 * sx + m01 * sy + m02 * sz + m03;
+			y = m10 * sx + m11 * sy + m12 * sz + m13;
+			z = m20 * sx + m21 * sy + m22 * sz + m23;
+		}
+
+		if (IsCropRequired)
+		{
 			// Remove the point if it is outside the bounds specified in the settings
-			if (temp.X < bounds[0] || temp.X > bounds[3]
-				|| temp.Y < bounds[1] || temp.Y > bounds[4]
-				|| temp.Z < bounds[2] || temp.Z > bounds[5])
+			if (x < minX || x > maxX || y < minY || y > maxY || z < minZ || z > maxZ)
 			{
-				allVertices[vertexIndex] = invalidPoint;
+				rejected.OutOfBounds++;
 				continue;
 			}
-			// Only keep the point if there is not already data for the same reduced point when considering the range
-			else if (!voxelGridFilter.Insert(temp.X, temp.Y, temp.Z))
+		}
+
+		// The points of the static clutter are removed before they fill the voxels of the grid
+		if (IsMasked && exclusionMask.IsExcluded(x, y, z))
+		{
+			rejected.Excluded++;
+			continue;
+		}
+
+		unsigned int stagedIndex = begin + count;
+
+		if (IsCropRequired)
+		{
+			// The point claims its voxel under its staged index, which follows the order of the source points; which of
+			// the points of a voxel is kept is only known once all the chunks are staged, in KeepClaimedPoints
+			if (!voxelGridFilter.ClaimConcurrent(x, y, z, IsFoveated && !foveationMap.IsFoveated(pixelIndex) ? peripheralScale : 1,
+				stagedIndex, stagedSlots[stagedIndex]))
 			{
-				allVertices[vertexIndex] = invalidPoint;
+				rejected.Duplicate++;
 				continue;
 			}
 		}
 
-		allVertices[vertexIndex] = temp;
-		goodVerticesCount++;
+		count++;
+		stagedX[stagedIndex] = x;
+		stagedY[stagedIndex] = y;
+		stagedZ[stagedIndex] = z;
+		stagedColors[stagedIndex] = sourceColors[vertexIndex];
+		stagedPixelIndices[stagedIndex] = pixelIndex;
 	}
 
-	// Apply simple voxel density-based filter
-	const float voxelSize = 0.006f;
-	const int minPointsPerVoxel = 12;
+	rejections = rejected;
+	return count;
+}
 
-	// Count points per voxel
-	std::map<uint64_t, int> voxelCounts;
-	auto HashVoxel = [](int x, int y, int z) -> uint64_t {
-		return (static_cast<uint64_t>(x) & 0x1FFFFF) << 42 |
-			(static_cast<uint64_t>(y) & 0x1FFFFF) << 21 |
-			(static_cast<uint64_t>(z) & 0x1FFFFF);
-		};
+/// <summary>
+/// Second pass of the crop over the points a chunk staged, once all the chunks claimed their voxels: only keeps a point
+/// if it is the first of the frame in its voxel, and if no other camera owns its voxel, so that the points kept do not
+/// depend on the order the threads ran in. The ownership is only tested once per voxel, by its first point
+/// </summary>
+/// <param name="rejections">Incremented by the number of points each test removed</param>
+/// <returns>Number of points kept, compacted in place from begin in stagedPoints</returns>
+unsigned int LiveScanClient::KeepClaimedPoints(unsigned int begin, unsigned int count, StageRejections& rejections)
+{
+	const float* stagedX = stagedPoints.X.data();
+	const float* stagedY = stagedPoints.Y.data();
+	const float* stagedZ = stagedPoints.Z.data();
+	const uint32_t* stagedSlots = stagedVoxelSlots.data();
+
+	unsigned int numKept = 0;
 
-	vector<uint64_t> vertexVoxelKeys(numVertices);
-	for (unsigned int i = 0; i < allVertices.size(); ++i)
+	for (unsigned int i = begin; i < begin + count; i++)
 	{
-		Point3f& pt = allVertices[i];
-		if (!pt.Invalid)
+		if (!voxelGridFilter.IsClaimWinner(stagedSlots[i], i))
 		{
-			int vx = static_cast<int>(floor(pt.X / voxelSize));
-			int vy = static_cast<int>(floor(pt.Y / voxelSize));
-			int vz = static_cast<int>(floor(pt.Z / voxelSize));
-			uint64_t key = HashVoxel(vx, vy, vz);
-			vertexVoxelKeys[i] = key;
-			voxelCounts[key]++;
+			rejections.Duplicate++;
+			continue;
 		}
-		else
+
+		if (!voxelGridFilter.IsOwned(stagedX[i], stagedY[i], stagedZ[i]))
+		{
+			rejections.Foreign++;
+			continue;
+		}
+
+		stagedPoints.MovePoint(begin + numKept++, i);
+	}
+
+	return numKept;
+}
+
+/// <summary>
+/// Returns the instantiation of StageChunk which runs the given steps
+/// </summary>
+LiveScanClient::StageChunkKernel LiveScanClient::SelectStageChunkKernel(bool isBackgroundSkipped, bool isTransformRequired, bool isCropRequired, bool isFoveated, bool isMasked)
+{
+	// Indexed by the mask, background, transform and crop steps, in that order of bits; the foveation is part of the crop
+	static const StageChunkKernel kernels[16] = {
+		&LiveScanClient::StageChunk<false, false, false, false, false>,
+		&LiveScanClient::StageChunk<false, false, true, false, false>,
+		&LiveScanClient::StageChunk<false, true, false, false, false>,
+		&LiveScanClient::StageChunk<false, true, true, false, false>,
+		&LiveScanClient::StageChunk<true, false, false, false, false>,
+		&LiveScanClient::StageChunk<true, false, true, false, false>,
+		&LiveScanClient::StageChunk<true, true, false, false, false>,
+		&LiveScanClient::StageChunk<true, true, true, false, false>,
+		&LiveScanClient::StageChunk<false, false, false, false, true>,
+		&LiveScanClient::StageChunk<false, false, true, false, true>,
+		&LiveScanClient::StageChunk<false, true, false, false, true>,
+		&LiveScanClient::StageChunk<false, true, true, false, true>,
+		&LiveScanClient::StageChunk<true, false, false, false, true>,
+		&LiveScanClient::StageChunk<true, false, true, false, true>,
+		&LiveScanClient::StageChunk<true, true, false, false, true>,
+		&LiveScanClient::StageChunk<true, true, true, false, true>
+	};
+
+	static const StageChunkKernel foveatedKernels[8] = {
+		&LiveScanClient::StageChunk<false, false, true, true, false>,
+		&LiveScanClient::StageChunk<false, true, true, true, false>,
+		&LiveScanClient::StageChunk<true, false, true, true, false>,
+		&LiveScanClient::StageChunk<true, true, true, true, false>,
+		&LiveScanClient::StageChunk<false, false, true, true, true>,
+		&LiveScanClient::StageChunk<false, true, true, true, true>,
+		&LiveScanClient::StageChunk<true, false, true, true, true>,
+		&LiveScanClient::StageChunk<true, true, true, true, true>
+	};
+
+	if (isFoveated && isCropRequired)
+		return foveatedKernels[(isMasked ? 4 : 0) | (isBackgroundSkipped ? 2 : 0) | (isTransformRequired ? 1 : 0)];
+
+	return kernels[(isMasked ? 8 : 0) | (isBackgroundSkipped ? 4 : 0) | (isTransformRequired ? 2 : 0) | (isCropRequired ? 1 : 0)];
+}
+
+/// <summary>
+/// Applies the last request of the server to learn or clear the exclusion mask. The mask is learned over the bounds
+/// of the settings, in the world space of the calibration, so an uncalibrated camera cannot learn one.
+/// </summary>
+void LiveScanClient::UpdateExclusionMask()
+{
+	int numFrames = requestedExclusionFrames.exchange(-1);
+
+	if (numFrames < 0)
+		return;
+
+	if (numFrames == 0)
+	{
+		exclusionMask.Clear();
+		std::remove(ExclusionMask::GetFileName(captureManager->serialNumber).c_str());
+		Log("[LiveScanClient] Cleared the exclusion mask");
+		return;
+	}
+
+	if (!calibration.isCalibrated)
+	{
+		Log(WarningLevel, "[LiveScanClient] The camera needs to be calibrated to learn the exclusion mask");
+		return;
+	}
+
+	exclusionMask.StartLearning(bounds.data(), bounds.data() + 3, numFrames);
+	Log("[LiveScanClient] Learning the exclusion mask from the next " + std::to_string(numFrames) + " frames");
+}
+
+/// <summary>
+/// Applies some processing steps to the last retrieved point cloud such as filtering and removing points outside the bounds
+/// </summary>
+void LiveScanClient::ProcessFrame()
+{
+	// When the capture backend has already applied the calibration, bounds and voxel grid, start from its compacted output
+	bool isFrameProcessed = captureManager->hasProcessedFrame;
+	const PointBuffer& source = isFrameProcessed ? captureManager->lastProcessedPoints : captureManager->lastFramePoints;
+
+	unsigned int numVertices = source.Size();
+
+	// The capture manager normally outputs world space points; only apply the calibration here when it did not
+	bool isTransformRequired = !isFrameProcessed && calibration.isCalibrated && !captureManager->isFrameInWorldSpace;
+	bool isCropRequired = !isFrameProcessed && calibration.isCalibrated;
+
+	// The backends which process the frame do not share out the voxels between the cameras, so their points go through
+	// the crop again; they are already in the bounds and the voxel grid, so only the voxels of the other cameras are removed
+	if (isFrameProcessed && calibration.isCalibrated && voxelGridFilter.HasOwners())
+		isCropRequired = true;
+
+	// Foveation needs the depth frame, whose pixels the regions of interest are made of. The backends which process the
+	// frame use the same voxels over the whole frame, so their points go through the crop again, the points of the
+	// regions of interest keeping their voxels and the others being merged in the coarser ones
+	bool isFoveated = peripheralVoxelScale > 1 && calibration.isCalibrated && captureManager->depthData;
+
+	if (isFoveated)
+	{
+		// Motion is measured between consecutive foveated frames only
+		if (!wasFrameFoveated)
+			foveationMap.Reset();
+
+		foveationMap.Update(captureManager->depthData, captureManager->depthFrameWidth, captureManager->depthFrameHeight);
+		isCropRequired = true;
+	}
+
+	wasFrameFoveated = isFoveated;
+
+	// The voxel size follows the point budget; changing it also clears the grid
+	if (isCropRequired)
+		voxelGridFilter.SetVoxelSize(GetVoxelSize());
+
+	// Recognize the static background from the raw depth frame; the model learns from the first frames after being enabled
+	const UINT16* depthData = captureManager->depthData;
+	bool isBackgroundSeparated = false;
+	bool isBackgroundRefreshFrame = false;
+
+	if (backgroundMode != BackgroundKept && depthData)
+	{
+		backgroundModel.Update(depthData, captureManager->depthFrameWidth, captureManager->depthFrameHeight);
+		isBackgroundSeparated = backgroundModel.IsReady();
+	}
+
+	if (isBackgroundSeparated && backgroundMode == BackgroundRefreshed)
+	{
+		isBackgroundRefreshFrame = numFramesSinceBackgroundRefresh >= BackgroundRefreshInterval;
+		numFramesSinceBackgroundRefresh = isBackgroundRefreshFrame ? 0 : numFramesSinceBackgroundRefresh + 1;
+	}
+
+	// Background points are skipped before any other processing, except on refresh frames where they are processed to be reused
+	bool isBackgroundSkipped = isBackgroundSeparated && !isBackgroundRefreshFrame;
+
+	// Apply calibration, remove points outside bounds and decimate. The frame is split in chunks of consecutive points
+	// (rows of the depth image) processed in parallel on the shared task scheduler; each chunk writes its kept points
+	// in place in stagedPoints, and the chunks are then concatenated in order. The voxel grid takes a second pass, once all
+	// the points claimed their voxels, so that each voxel keeps its first point of the frame whatever the thread timings
+	int numChunks = static_cast<int>((numVertices + ProcessingChunkSize - 1) / ProcessingChunkSize);
+
+	// The working buffers are members which keep their capacity between frames, so that the steady state does not allocate
+	stagedPoints.Resize(numVertices);
+	chunkPointCounts.resize(numChunks);
+	chunkRejections.resize(numChunks);
+
+	if (isCropRequired)
+	{
+		stagedVoxelSlots.resize(numVertices);
+		voxelGridFilter.BeginClaims(numVertices);
+	}
+
+	// The mask is in world space, so it is only applied to the frames of a calibrated camera
+	UpdateExclusionMask();
+	bool isMasked = calibration.isCalibrated && exclusionMask.IsLearned();
+
+	// The steps of the frame are chosen once, so that the loop of each chunk only has the tests of the steps it runs
+	StageChunkKernel stageChunk = SelectStageChunkKernel(isBackgroundSkipped, isTransformRequired, isCropRequired, isFoveated, isMasked);
+
+	TaskScheduler::Instance().ParallelFor(0, numChunks, [&](int chunk)
+	{
+		unsigned int begin = chunk * ProcessingChunkSize;
+		unsigned int end = (std::min)(numVertices, begin + ProcessingChunkSize);
+
+		chunkPointCounts[chunk] = (this->*stageChunk)(source, begin, end, chunkRejections[chunk]);
+	});
+
+	if (isCropRequired)
+	{
+		TaskScheduler::Instance().ParallelFor(0, numChunks, [&](int chunk)
+		{
+			chunkPointCounts[chunk] = KeepClaimedPoints(chunk * ProcessingChunkSize, chunkPointCounts[chunk], chunkRejections[chunk]);
+		});
+	}
+
+	// Exclusive prefix sum of the chunk sizes gives the position of each chunk in the compacted buffer
+	int numCandidates = 0;
+	FrameFunnelStats funnel = {};
+	funnel.NumSourcePoints = numVertices;
+
+	for (int chunk = 0; chunk < numChunks; chunk++)
+	{
+		int count = chunkPointCounts[chunk];
+		chunkPointCounts[chunk] = numCandidates;
+		numCandidates += count;
+
+		const StageRejections& rejected = chunkRejections[chunk];
+		funnel.NumBackgroundPoints += rejected.Background;
+		funnel.NumOutOfBoundsPoints += rejected.OutOfBounds;
+		funnel.NumExcludedPoints += rejected.Excluded;
+		funnel.NumDuplicatePoints += rejected.Duplicate;
+		funnel.NumForeignPoints += rejected.Foreign;
+	}
+
+	// Each point the grid took filled a voxel of its own, whichever camera owns it
+	if (isCropRequired)
+	{
+		funnel.VoxelSize = GetVoxelSize();
+		funnel.NumOccupiedVoxels = numCandidates + funnel.NumForeignPoints;
+	}
+
+	candidatePoints.Resize(numCandidates);
+
+	TaskScheduler::Instance().ParallelFor(0, numChunks, [&](int chunk)
+	{
+		int offset = chunkPointCounts[chunk];
+		int count = (chunk + 1 < numChunks ? chunkPointCounts[chunk + 1] : numCandidates) - offset;
+		int begin = chunk * ProcessingChunkSize;
+
+		for (int i = 0; i < count; i++)
+			candidatePoints.CopyPoint(offset + i, stagedPoints, begin + i);
+	});
+
+	// The points of the empty scene are what the mask excludes, once enough frames of it were seen
+	if (exclusionMask.IsLearning() && calibration.isCalibrated)
+	{
+		exclusionMask.Learn(candidatePoints.X.data(), candidatePoints.Y.data(), candidatePoints.Z.data(), numCandidates);
+
+		if (!exclusionMask.IsLearning())
 		{
-			vertexVoxelKeys[i] = 0; // placeholder
+			bool isSaved = exclusionMask.Save(captureManager->serialNumber);
+			Log(isSaved ? InfoLevel : WarningLevel, "[LiveScanClient] Learned the exclusion mask, " + std::to_string(exclusionMask.GetNumExcludedVoxels())
+				+ " voxels excluded" + (isSaved ? "" : "; failed to save it"));
 		}
 	}
 
-	int filteredCount = 0;
+	// Count points per voxel for the simple voxel density-based filter
+	PerfTimer filterTimer(&perfStats, FilterStage);
+	densityCounter.Reset(numCandidates);
+	int minPointsPerDensityVoxel = GetMinPointsPerDensityVoxel();
+	candidateDensityCells.resize(numCandidates);
+
+	for (int i = 0; i < numCandidates; i++)
+		candidateDensityCells[i] = densityCounter.Insert(candidatePoints.X[i], candidatePoints.Y[i], candidatePoints.Z[i]);
+
+	// Fill a frame which is neither published nor being sent; its buffers keep their capacity from previous frames
+	std::shared_ptr<ProcessedFrame> frame = AcquireFreeFrame();
+	std::vector<Point3s>& processedVertices = frame->Vertices;
+	std::vector<RGB>& processedColors = frame->Colors;
+	std::vector<uint8_t>& processedNormals = frame->Normals;
+	processedVertices.clear();
+	processedColors.clear();
+	processedNormals.clear();
+
+	if (isBackgroundRefreshFrame)
+	{
+		backgroundVertices.clear();
+		backgroundColors.clear();
+		backgroundNormals.clear();
+	}
+
+	// The normals are estimated on all the points of the frame, so that the points next to the removed ones keep their
+	// neighbours. They face the camera, which is at the origin of the source points unless they are already in world
+	// space, and are rotated to world space with the points
+	bool isNormalEstimated = isNormalEstimationEnabled;
 
-	// Mark isolated points as invalid
-	for (unsigned int i = 0; i < allVertices.size(); ++i)
+	if (isNormalEstimated)
 	{
-		if (!allVertices[i].Invalid)
+		bool isSourceInWorldSpace = calibration.isCalibrated && !isTransformRequired;
+		float viewOrigin[3];
+
+		for (int i = 0; i < 3; i++)
+			viewOrigin[i] = isSourceInWorldSpace ? calibration.worldTransform[i][3] : 0.0f;
+
+		normalEstimator.Prepare(source, captureManager->depthFrameWidth, captureManager->depthFrameHeight, viewOrigin,
+			isTransformRequired ? calibration.worldTransform : nullptr);
+	}
+
+	// Convert the kept vertices to shorts (in millimeters) to save memory; on refresh frames, keep a copy of the background
+	auto AppendProcessedPoint = [&](size_t i) {
+		Point3s vertex(static_cast<short>(1000 * candidatePoints.X[i]),
+			static_cast<short>(1000 * candidatePoints.Y[i]),
+			static_cast<short>(1000 * candidatePoints.Z[i]));
+		processedVertices.push_back(vertex);
+		processedColors.push_back(candidatePoints.Colors[i]);
+
+		int pixelIndex = candidatePoints.PixelIndices[i];
+		uint8_t normal = isNormalEstimated ? normalEstimator.GetNormal(pixelIndex) : NormalEstimator::NoNormal;
+
+		if (isNormalEstimated)
+			processedNormals.push_back(normal);
+
+		if (isBackgroundRefreshFrame && backgroundModel.IsBackground(pixelIndex, depthData[pixelIndex]))
 		{
-			if (voxelCounts[vertexVoxelKeys[i]] < minPointsPerVoxel)
+			backgroundVertices.push_back(vertex);
+			backgroundColors.push_back(candidatePoints.Colors[i]);
+			backgroundNormals.push_back(normal);
+		}
+	};
+
+	if (isFilterEnabled)
+	{
+		// Under load, the neighbour filter only runs on one of every FilterShedInterval frames
+		bool isNeighbourFilterDue = loadShedLevel < ShedFilterLevel || ++numFramesSinceFiltered >= FilterShedInterval;
+
+		// The radius outlier filter only searches the neighbours of the points the density voxels leave uncertain: the
+		// points of a voxel with k points, which lies within the filter distance of them, are kept without a search
+		bool isCascadeUsed = isNeighbourFilterDue && filterMode != OrganizedFilterMode;
+
+		if (isCascadeUsed)
+			sureKeptPoints.resize(candidatePoints.Size());
+
+		// Remove isolated points in place, then apply the more complex filtering step on the remaining ones
+		size_t writeIndex = 0;
+
+		for (size_t i = 0; i < candidatePoints.Size(); ++i)
+		{
+			int count = densityCounter.GetCount(candidateDensityCells[i]);
+
+			if (count < minPointsPerDensityVoxel)
+				continue;
+
+			if (isCascadeUsed)
 			{
-				allVertices[i] = invalidPoint;
-				filteredCount++;
+				sureKeptPoints[writeIndex] = count >= numFilterNeighbors &&
+					densityCounter.IsCellWithin(candidatePoints.X[i], candidatePoints.Y[i], candidatePoints.Z[i], filterThreshold);
 			}
+
+			candidatePoints.MovePoint(writeIndex, i);
+			writeIndex++;
 		}
-	}
 
-	// Copy all valid vertices into a clean vector 
-	vector<Point3f> goodVertices(goodVerticesCount);
-	vector<RGB> goodColorPoints(goodVerticesCount);
-	int goodVerticesShortCounter = 0;
+		funnel.NumSparsePoints = static_cast<unsigned int>(candidatePoints.Size() - writeIndex);
+		candidatePoints.Resize(writeIndex);
+
+		if (isNeighbourFilterDue)
+		{
+			numFramesSinceFiltered = 0;
 
-	for (unsigned int i = 0; i < allVertices.size(); i++)
+			// The decisions of the two filters differ, so those of one are never reused by the other
+			OutlierDecisionCache* decisions = nullptr;
+
+			if (isTemporalFilterEnabled && filterMode == outlierDecisionsMode)
+			{
+				outlierDecisions.BeginFrame(static_cast<size_t>(captureManager->depthFrameWidth) * captureManager->depthFrameHeight,
+					numFilterNeighbors, filterThreshold);
+				decisions = &outlierDecisions;
+			}
+			else
+			{
+				outlierDecisions.Reset();
+				outlierDecisionsMode = filterMode;
+			}
+
+			if (filterMode == OrganizedFilterMode)
+				organizedFilter.Apply(candidatePoints, captureManager->depthFrameWidth, captureManager->depthFrameHeight, numFilterNeighbors, filterThreshold, decisions);
+			else
+				radiusOutlierFilter.Apply(candidatePoints, numFilterNeighbors, filterThreshold, decisions, sureKeptPoints.data());
+
+			funnel.NumOutlierPoints = static_cast<unsigned int>(writeIndex - candidatePoints.Size());
+		}
+
+		for (size_t i = 0; i < candidatePoints.Size(); ++i)
+			AppendProcessedPoint(i);
+	}
+	else
 	{
-		if (!allVertices[i].Invalid)
+		// Remove isolated points
+		for (size_t i = 0; i < candidatePoints.Size(); ++i)
 		{
-			goodVertices[goodVerticesShortCounter] = allVertices[i];
-			goodColorPoints[goodVerticesShortCounter] = captureManager->lastFrameColors[i];
-			goodVerticesShortCounter++;
+			if (densityCounter.GetCount(candidateDensityCells[i]) >= minPointsPerDensityVoxel)
+				AppendProcessedPoint(i);
 		}
+
+		funnel.NumSparsePoints = static_cast<unsigned int>(candidatePoints.Size() - processedVertices.size());
 	}
 
-	// If the more complex filtering step is enabled, apply it now
-	if (isFilterEnabled)
+	filterTimer.Stop();
+
+	// The kept points are the content the region of the next frames follows
+	if (isAdaptiveRoiEnabled && calibration.isCalibrated)
+	{
+		occupancyRoi.Update(candidatePoints.PixelIndices.data(), candidatePoints.Size(), captureManager->depthFrameWidth,
+			captureManager->depthFrameHeight, processingRoi);
+	}
+
+	if (isNormalEstimated)
+		normalEstimator.Clear(source);
+
+	// Between refreshes, the background points of the last refresh frame stand in for the skipped ones
+	if (isBackgroundSkipped && backgroundMode == BackgroundRefreshed)
 	{
-		Filter(goodVertices, goodColorPoints, numFilterNeighbors, filterThreshold);
+		processedVertices.insert(processedVertices.end(), backgroundVertices.begin(), backgroundVertices.end());
+		processedColors.insert(processedColors.end(), backgroundColors.begin(), backgroundColors.end());
+
+		if (isNormalEstimated)
+			processedNormals.insert(processedNormals.end(), backgroundNormals.begin(), backgroundNormals.end());
+
+		funnel.NumReusedBackgroundPoints = static_cast<unsigned int>(backgroundVertices.size());
 	}
 
-	// Convert the remaining vertices to shorts to save memory
-	vector<Point3s> goodVerticesShort(goodVertices.size());
+	// The point budget can only be met by decimating, which needs the calibration
+	if (calibration.isCalibrated)
+		UpdateVoxelLevel(processedVertices.size());
+
+	funnel.SequenceNumber = latestSequenceNumber + 1;
+	UpdateFunnelStats(funnel, *frame);
+	PublishFrame(std::move(frame));
+}
+
+/// <summary>
+/// Publishes a frame as the latest one and wakes the consumers waiting for it; the previous one is recycled once the
+/// server thread is done sending it
+/// </summary>
+void LiveScanClient::PublishFrame(std::shared_ptr<ProcessedFrame> frame)
+{
+	uint64_t sequenceNumber = latestSequenceNumber + 1;
+	frame->SequenceNumber = sequenceNumber;
+	frame->TimeStampUs = GetFrameTimeStamp();
+	frame->AcquireTime = frameAcquireTime;
+	frame->PublishTime = std::chrono::steady_clock::now();
+	std::atomic_store(&latestFrame, std::shared_ptr<const ProcessedFrame>(std::move(frame)));
 
-	for (size_t i = 0; i < goodVertices.size(); i++)
 	{
-		goodVerticesShort[i] = goodVertices[i];
+		std::lock_guard<std::mutex> lock(frameReadyMutex);
+		latestSequenceNumber = sequenceNumber;
 	}
 
-	lastFrameVertices = goodVerticesShort;
-	lastFrameColors = goodColorPoints;
+	frameReadyCond.notify_all();
 }
 
-void LiveScanClient::ProcessDocument()
+/// <summary>
+/// Completes the counts of the processing of a frame with its depth pixels and the space its points fill, and
+/// publishes them for the server
+/// </summary>
+void LiveScanClient::UpdateFunnelStats(FrameFunnelStats& funnel, const ProcessedFrame& frame)
 {
-	if (captureManager->lastDocumentData.empty())
+	const UINT16* depthData = captureManager->depthData;
+	int numPixels = depthData ? captureManager->depthFrameWidth * captureManager->depthFrameHeight : 0;
+
+	for (int i = 0; i < numPixels; i++)
+		funnel.NumDepthPixels += depthData[i] != 0;
+
+	funnel.DepthWidth = captureManager->depthFrameWidth;
+	funnel.DepthHeight = captureManager->depthFrameHeight;
+	bool hasProcessingRoi = processingRoi[2] > processingRoi[0] && processingRoi[3] > processingRoi[1];
+	funnel.RoiLeft = hasProcessingRoi ? processingRoi[0] : 0;
+	funnel.RoiTop = hasProcessingRoi ? processingRoi[1] : 0;
+	funnel.RoiRight = hasProcessingRoi ? processingRoi[2] : funnel.DepthWidth;
+	funnel.RoiBottom = hasProcessingRoi ? processingRoi[3] : funnel.DepthHeight;
+
+	const std::vector<Point3s>& vertices = frame.Vertices;
+	funnel.NumSentPoints = static_cast<unsigned int>(vertices.size());
+
+	if (!vertices.empty())
 	{
-		return;
+		short minX = vertices[0].X, minY = vertices[0].Y, minZ = vertices[0].Z;
+		short maxX = minX, maxY = minY, maxZ = minZ;
+
+		for (const Point3s& vertex : vertices)
+		{
+			minX = (std::min)(minX, vertex.X);
+			minY = (std::min)(minY, vertex.Y);
+			minZ = (std::min)(minZ, vertex.Z);
+			maxX = (std::max)(maxX, vertex.X);
+			maxY = (std::max)(maxY, vertex.Y);
+			maxZ = (std::max)(maxZ, vertex.Z);
+		}
+
+		funnel.ContentMin[0] = minX / 1000.0f;
+		funnel.ContentMin[1] = minY / 1000.0f;
+		funnel.ContentMin[2] = minZ / 1000.0f;
+		funnel.ContentMax[0] = maxX / 1000.0f;
+		funnel.ContentMax[1] = maxY / 1000.0f;
+		funnel.ContentMax[2] = maxZ / 1000.0f;
 	}
 
-	cv::Mat newDocumentData = captureManager->lastDocumentData;
-	float newDocumentScore = captureManager->lastDocumentScore;
-	short newDocumentWidth = captureManager->lastDocumentWidth;
-	short newDocumentHeight = captureManager->lastDocumentHeight;
+	// The voxels of the bounds, as the grid would fill them all with a point each
+	if (funnel.VoxelSize > 0.0f)
+	{
+		double numBoundVoxels = 1.0;
+
+		for (int i = 0; i < 3; i++)
+			numBoundVoxels *= (std::max)(1.0, std::ceil((bounds[i + 3] - bounds[i]) / funnel.VoxelSize));
+
+		funnel.VoxelFillRatio = static_cast<float>(funnel.NumOccupiedVoxels / numBoundVoxels);
+	}
+
+	std::lock_guard<std::mutex> lock(funnelStatsMutex);
+	funnelStats = funnel;
+}
 
-	// Check if LiveScanClient has no data yet
-	if (lastDocumentData.empty()) {
-		lastDocumentData = newDocumentData;
-		lastDocumentScore = newDocumentScore;
-		lastDocumentWidth = newDocumentWidth;
-		lastDocumentHeight = newDocumentHeight;
-		isSendDocumentRequested = true;
+/// <summary>
+/// Copies the counts of the points at each step of the processing of the last frame
+/// </summary>
+void LiveScanClient::GetFunnelStats(FrameFunnelStats& stats)
+{
+	std::lock_guard<std::mutex> lock(funnelStatsMutex);
+	stats = funnelStats;
+}
+
+/// <summary>
+/// Selects the region of the depth frame the points of the next frame are generated from: the region of the content
+/// of the recent frames, or the whole frame for the frames which need the whole scene, those whose background points
+/// are kept and those the exclusion mask learns from
+/// </summary>
+void LiveScanClient::UpdateProcessingRoi()
+{
+	bool isBackgroundRefreshDue = backgroundMode == BackgroundRefreshed && numFramesSinceBackgroundRefresh >= BackgroundRefreshInterval;
+	bool isMaskLearning = exclusionMask.IsLearning() || requestedExclusionFrames >= 0;
+
+	// The content is followed again from the whole frame once the region is enabled again, or the camera calibrated
+	if (!isAdaptiveRoiEnabled || !calibration.isCalibrated)
+		occupancyRoi.Reset();
+
+	if (isAdaptiveRoiEnabled && calibration.isCalibrated && !isBackgroundRefreshDue && !isMaskLearning)
+	{
+		occupancyRoi.GetRegion(processingRoi);
+	}
+	else
+	{
+		for (int i = 0; i < 4; i++)
+			processingRoi[i] = 0;
+	}
+}
+
+/// <summary>
+/// Applies the capture range requested by the server. The points out of the range are dropped by the voxel grid, so
+/// the grid is rebuilt around the new range, with its finest voxel size coarsened to keep MaxGridResolution cells on
+/// each axis at most.
+/// </summary>
+void LiveScanClient::UpdateCaptureRange()
+{
+	float newRange = requestedRange;
+
+	if (newRange == range)
 		return;
+
+	range = newRange;
+	halfRange = range / 2.0f;
+	zRangeCenter = halfRange;
+	minPrecision = (std::max)(DefaultRange / 255, range / MaxGridResolution);
+
+	voxelGridFilter = VoxelGridFilter(minPrecision, XRangeCenter, YRangeCenter, zRangeCenter, halfRange);
+	voxelGridFilter.SetOwners(cameraOwners, cameraOwnerIndex);
+
+	Log("[LiveScanClient] Capture range set to " + std::to_string(range) + " m, voxel size " + std::to_string(minPrecision * 1000.0f) + " mm");
+}
+
+/// <summary>
+/// Applies the camera poses last received from the server to the voxel grid
+/// </summary>
+void LiveScanClient::UpdateCameraOwners()
+{
+	{
+		std::lock_guard<std::mutex> lock(cameraOwnersMutex);
+
+		if (!isCameraOwnersChanged)
+			return;
+
+		cameraOwners = requestedCameraOwners;
+		cameraOwnerIndex = requestedCameraOwnerIndex;
+		isCameraOwnersChanged = false;
 	}
 
-	float diff = ComputeImageDifference(newDocumentData);
+	voxelGridFilter.SetOwners(cameraOwners, cameraOwnerIndex);
+}
 
-	auto now = std::chrono::steady_clock::now();
-	auto nowMs = std::chrono::time_point_cast<std::chrono::milliseconds>(now).time_since_epoch().count();
+float LiveScanClient::GetVoxelSize() const
+{
+	int level = (std::min)(voxelLevel + GetShedVoxelLevels(), MaxVoxelLevel);
+	return minPrecision * std::pow(2.0f, static_cast<float>(level) / VoxelLevelsPerOctave);
+}
+
+/// <summary>
+/// Returns the number of points a density voxel needs to be kept. Coarser voxels leave fewer points on the same surface,
+/// about one per voxel face, so the threshold shrinks with the square of the voxel size.
+/// </summary>
+int LiveScanClient::GetMinPointsPerDensityVoxel() const
+{
+	// The threshold is set for the voxels of the default range
+	float scale = (DefaultRange / 255) / GetVoxelSize();
+	return (std::max)(2, static_cast<int>(std::lround(MinPointsPerDensityVoxel * scale * scale)));
+}
+
+/// <summary>
+/// Moves the voxel size one step towards the point budget. The surfaces seen by a camera keep about one point per
+/// voxel face, so one finer step multiplies the number of points by about 2^(2/4); it is only taken when the frame
+/// would still fit in the budget, which keeps the level from oscillating between two steps. While the frame time budget
+/// coarsens the voxels, the level is not made finer, as it would only give back the points the load shedding removed.
+/// </summary>
+/// <param name="numPoints">Number of points of the frame just processed</param>
+void LiveScanClient::UpdateVoxelLevel(size_t numPoints)
+{
+	if (pointBudget <= 0)
+		return;
 
-	if (nowMs - lastDocumentSendTime.count() >= DocumentSendTimeout || diff > DocumentDiffThreshold || newDocumentScore > lastDocumentScore)
+	float finerStepRatio = std::pow(2.0f, 2.0f / VoxelLevelsPerOctave);
+
+	if (numPoints > pointBudget * PointBudgetTolerance && voxelLevel < MaxVoxelLevel)
+		voxelLevel++;
+	else if (numPoints * finerStepRatio < pointBudget * PointBudgetTolerance && voxelLevel > 0 && GetShedVoxelLevels() == 0)
+		voxelLevel--;
+}
+
+/// <summary>
+/// Converts the global timestamp of the frame just processed to the system clock of this computer. The transfer of the
+/// frames to the capture manager only ever delays them, so the least delayed frames of the last minute set the offset and the drift of the camera clock; all the cameras of a computer are then compared on
+/// the same clock, whatever the clocks of their devices.
+/// </summary>
+/// <returns>0 if the camera gives no timestamp</returns>
+uint64_t LiveScanClient::GetFrameTimeStamp()
+{
+	uint64_t deviceTimeStampUs = captureManager->GetTimeStamp();
+
+	if (deviceTimeStampUs == 0)
+		return 0;
+
+	int64_t sourceTimeUs = static_cast<int64_t>(deviceTimeStampUs);
+	int numSamples = deviceClock.GetNumSamples();
+
+	// The offset stands for the delay of the frame, as they only differ by the offset of the clocks, which the period shares
+	deviceClock.AddSample(sourceTimeUs, frameAcquireSystemTimeUs, frameAcquireSystemTimeUs - sourceTimeUs);
+
+	if (deviceClock.GetNumSamples() <= numSamples)
+		Log(WarningLevel, "[LiveScanClient] The clock of the camera jumped; its offset is estimated again");
+
+	return static_cast<uint64_t>(deviceClock.ToTarget(sourceTimeUs));
+}
+
+/// <summary>
+/// Selects the depth stream of the camera. With the automatic binning, it follows the voxel level of the point
+/// budget: once the voxels are coarser than the pixels of the binned stream, the full resolution only adds points
+/// which the voxel grid drops, at the cost of four times the depth pixels to generate.
+/// </summary>
+void LiveScanClient::UpdateDepthBinning()
+{
+	bool isBinned = depthBinningMode == DepthBinned;
+
+	if (depthBinningMode == DepthBinningAuto)
 	{
-		lastDocumentData = newDocumentData;
-		lastDocumentScore = newDocumentScore;
-		lastDocumentWidth = newDocumentWidth;
-		lastDocumentHeight = newDocumentHeight;
-		isSendDocumentRequested = true;
-		lastDocumentSendTime = std::chrono::milliseconds(nowMs);
+		bool isPastThreshold = pointBudget > 0
+			&& (isDepthBinned ? voxelLevel <= UnbinnedDepthVoxelLevel : voxelLevel >= BinnedDepthVoxelLevel);
+		numFramesPastBinningThreshold = isPastThreshold ? numFramesPastBinningThreshold + 1 : 0;
+		isBinned = isDepthBinned != (numFramesPastBinningThreshold >= DepthBinningSwitchFrames);
+	}
+
+	if (isBinned != isDepthBinned)
+	{
+		isDepthBinned = isBinned;
+		numFramesPastBinningThreshold = 0;
+		captureManager->SetDepthBinning(isDepthBinned);
 	}
 }
 
-float LiveScanClient::ComputeImageDifference(cv::Mat& newDocumentData)
+/// <summary>
+/// Sheds or restores one level of optional work when the average busy time of the frames, the frame loop but the wait
+/// for the camera, strays from the frame time budget. Called after each frame processed to the end.
+/// </summary>
+void LiveScanClient::UpdateLoadShedding()
 {
-	if (newDocumentData.empty())
-		return 1.0f; // Completely different if new is empty
+	int newLevel = loadShedLevel;
 
-	if (lastDocumentData.empty())
+	if (frameTimeBudgetMs <= 0)
 	{
-		lastDocumentData = newDocumentData;
-		return 1.0f; // No previous frame, assume max difference
+		newLevel = 0;
 	}
+	else
+	{
+		float busyTimeMs = static_cast<float>((perfStats.GetLastDurationUs(FrameStage) - perfStats.GetLastDurationUs(FrameWaitStage)) / 1000.0);
+		busyTimeMs = (std::max)(busyTimeMs, 0.0f);
+		busyTimeAverageMs = busyTimeAverageMs > 0.0f ? busyTimeAverageMs + BusyTimeSmoothing * (busyTimeMs - busyTimeAverageMs) : busyTimeMs;
 
-	// Resize to same dimensions
-	cv::Mat resizedLast;
-	cv::resize(lastDocumentData, resizedLast, newDocumentData.size());
+		if (++numFramesSinceLoadShedChange >= LoadShedSettleFrames)
+		{
+			if (busyTimeAverageMs > frameTimeBudgetMs && loadShedLevel < MaxLoadShedLevel)
+				newLevel = loadShedLevel + 1;
+			else if (busyTimeAverageMs < frameTimeBudgetMs * RestoreBudgetRatio && loadShedLevel > 0)
+				newLevel = loadShedLevel - 1;
+		}
+	}
 
-	// Compute absolute difference
-	cv::Mat diff;
-	cv::absdiff(newDocumentData, resizedLast, diff);
+	if (newLevel == loadShedLevel)
+		return;
 
-	// Convert to grayscale to simplify metric
-	cv::Mat grayDiff;
-	cv::cvtColor(diff, grayDiff, cv::COLOR_BGR2GRAY);
+	bool isShedding = newLevel > loadShedLevel;
+	loadShedLevel = newLevel;
+	numFramesSinceLoadShedChange = 0;
+	isProcessingChanged = true;
+	numFramesSinceFiltered = 0;
+	captureManager->isDocumentSubmissionPaused = loadShedLevel >= ShedDocumentsLevel;
 
-	// Compute mean difference
-	double meanDiff = cv::mean(grayDiff)[0]; // average intensity difference (0255)
+	Log("[LiveScanClient] Frame time of " + std::to_string(std::lround(busyTimeAverageMs)) + " ms for a budget of "
+		+ std::to_string(frameTimeBudgetMs) + " ms, " + (isShedding ? "shedding" : "restoring") + " to level " + std::to_string(loadShedLevel)
+		+ ": documents " + (loadShedLevel >= ShedDocumentsLevel ? "paused" : "sent")
+		+ ", neighbour filter on " + (loadShedLevel >= ShedFilterLevel ? "every other frame" : "every frame")
+		+ ", voxels " + std::to_string(GetShedVoxelLevels()) + " levels coarser");
 
-	// Normalize to 0.01.0
-	float normalizedDiff = static_cast<float>(meanDiff / 255.0);
+	ConfirmLoadShedLevel();
+}
 
-	// Update stored frame
-	lastDocumentData = newDocumentData;
+/// <summary>
+/// Moves the frame loop and the capture thread of the camera to the processors of the thread affinity. Windows takes
+/// the pages of a buffer from the node of the thread which first touches them, so the working buffers of the frames
+/// are released when the processors change, and allocated again from the new node by the next frames.
+/// </summary>
+void LiveScanClient::UpdateThreadAffinity()
+{
+	// The node of the camera is looked up in the device tree, so only once per change of the settings
+	if (threadAffinityMode == appliedThreadAffinityMode && numCoresPerCamera == appliedNumCoresPerCamera)
+		return;
+
+	appliedThreadAffinityMode = threadAffinityMode;
+	appliedNumCoresPerCamera = numCoresPerCamera;
+	ThreadAffinity newAffinity = GetCameraThreadAffinity(threadAffinityMode, captureManager->GetDeviceIndex(), numCoresPerCamera, captureManager->serialNumber);
+
+	if (newAffinity == threadAffinity)
+		return;
+
+	threadAffinity = newAffinity;
 
-	return normalizedDiff;
+	if (!SetCurrentThreadAffinity(threadAffinity))
+		Log(WarningLevel, "[LiveScanClient] Failed to move the frame loop to " + DescribeThreadAffinity(threadAffinity));
+	else
+		Log("[LiveScanClient] Frame loop moved to " + DescribeThreadAffinity(threadAffinity));
+
+	captureManager->SetThreadAffinity(threadAffinity);
+
+	stagedPoints = PointBuffer();
+	candidatePoints = PointBuffer();
+	ReleaseCapacity(chunkPointCounts);
+	ReleaseCapacity(stagedVoxelSlots);
+	ReleaseCapacity(chunkRejections);
+	ReleaseCapacity(candidateDensityCells);
+	ReleaseCapacity(sureKeptPoints);
+	normalEstimator.ReleaseMemory();
+	captureManager->lastFramePoints = PointBuffer();
+	captureManager->lastProcessedPoints = PointBuffer();
 }
 
-void LiveScanClient::SendSerialNumber()
+/// <summary>
+/// Number of voxel levels the frame time budget adds to those of the point budget
+/// </summary>
+int LiveScanClient::GetShedVoxelLevels() const
 {
-	if (wrapper && wrapper->sendSerialNumberCallback)
-		wrapper->sendSerialNumberCallback(clientIndex, captureManager->serialNumber.c_str());
+	return (std::max)(0, loadShedLevel - ShedFilterLevel) * NumShedVoxelLevels;
 }
 
-void LiveScanClient::ConfirmRecorded()
+/// <summary>
+/// Tells whether the frame just acquired is processed, following the decimation and the consumer pacing
+/// </summary>
+bool LiveScanClient::IsFrameProcessingRequired()
 {
-	if (wrapper && wrapper->confirmRecordedCallback)
-		wrapper->confirmRecordedCallback(clientIndex);
+	if (++numFramesSinceProcessed < frameDecimation)
+		return false;
 
-	isConfirmRecordedRequested = false;
+	// Only the capture thread publishes frames, so latestSequenceNumber is read without locking
+	if (isConsumerPacingEnabled && !isFrameRingEnabled && !isRecordFrameRequested
+		&& takenSequenceNumber.load() < latestSequenceNumber
+		&& frameAcquireTime - std::atomic_load(&latestFrame)->PublishTime < IdleRefreshInterval)
+	{
+		return false;
+	}
+
+	numFramesSinceProcessed = 0;
+	return true;
 }
 
-void LiveScanClient::ConfirmCalibrated()
+/// <summary>
+/// Tells whether the next frame can publish the points of the latest frame again when its depth did not change. The
+/// frames the exclusion mask or the background model learn from are processed, as is the first frame after a change
+/// of the settings or the calibration.
+/// </summary>
+bool LiveScanClient::IsStaticFrameReusable()
+{
+	bool isLearning = exclusionMask.IsLearning() || requestedExclusionFrames >= 0
+		|| (backgroundMode != BackgroundKept && !backgroundModel.IsReady());
+
+	return isStaticFrameReuseEnabled && latestSequenceNumber > 0 && !isProcessingChanged && !isLearning;
+}
+
+/// <summary>
+/// Publishes the points of the latest frame again, with the time of the frame just acquired, for a frame of a static
+/// scene; copying them costs far less than processing the frame
+/// </summary>
+void LiveScanClient::RepublishFrame()
+{
+	std::shared_ptr<const ProcessedFrame> previous = std::atomic_load(&latestFrame);
+	std::shared_ptr<ProcessedFrame> frame = AcquireFreeFrame();
+	frame->Vertices.assign(previous->Vertices.begin(), previous->Vertices.end());
+	frame->Colors.assign(previous->Colors.begin(), previous->Colors.end());
+	frame->Normals.assign(previous->Normals.begin(), previous->Normals.end());
+
+	PublishFrame(std::move(frame));
+}
+
+/// <summary>
+/// Counts the processed frames which were reused from a static scene, and logs their share every StaticFrameReportInterval frames
+/// </summary>
+void LiveScanClient::ReportReusedFrames(bool isFrameReused)
 {
-	if (wrapper && wrapper->confirmCalibratedCallback)
+	numReusedFrames += isFrameReused ? 1 : 0;
+
+	if (++numFramesSinceReuseReport < StaticFrameReportInterval)
+		return;
+
+	Log("[LiveScanClient] Reused " + std::to_string(numReusedFrames) + " of the last " + std::to_string(numFramesSinceReuseReport)
+		+ " frames of a static scene (" + std::to_string(100 * numReusedFrames / numFramesSinceReuseReport) + "%)");
+
+	numReusedFrames = 0;
+	numFramesSinceReuseReport = 0;
+}
+
+/// <summary>
+/// Records that a consumer has read the frames up to sequenceNumber, for the consumer pacing
+/// </summary>
+void LiveScanClient::MarkFrameTaken(uint64_t sequenceNumber)
+{
+	uint64_t takenNumber = takenSequenceNumber.load();
+
+	while (takenNumber < sequenceNumber && !takenSequenceNumber.compare_exchange_weak(takenNumber, sequenceNumber))
 	{
-		float* R = new float[9] {
-			calibration.worldR[0][0], calibration.worldR[0][1], calibration.worldR[0][2],
-			calibration.worldR[1][0], calibration.worldR[1][1], calibration.worldR[1][2],
-			calibration.worldR[2][0], calibration.worldR[2][1], calibration.worldR[2][2]
-		};
+	}
+}
 
-		float* t = calibration.worldT.data();
+/// <summary>
+/// Returns a frame of the pool which only the pool references, so that it can be overwritten without affecting the
+/// published frame or the one being sent. A new frame is allocated in the unlikely case where all of them are in use.
+/// </summary>
+std::shared_ptr<ProcessedFrame> LiveScanClient::AcquireFreeFrame()
+{
+	for (auto& frame : framePool)
+	{
+		if (!frame)
+			frame = std::make_shared<ProcessedFrame>();
 
-		wrapper->confirmCalibratedCallback(clientIndex, calibration.usedMarkerId, R, t);
+		if (frame.use_count() == 1)
+		{
+			// Make sure the reads of the last reader are done before the buffers get overwritten
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return frame;
+		}
 	}
 
-	isConfirmCalibratedRequested = false;
+	return std::make_shared<ProcessedFrame>();
 }
 
-void LiveScanClient::SendLatestFrame()
+void LiveScanClient::ProcessDocument()
 {
-	if (wrapper && wrapper->sendLatestFrameCallback)
+	if (captureManager->lastDocumentJpeg.empty())
+	{
+		return;
+	}
+
+	float newDocumentScore = captureManager->lastDocumentScore;
+	short newDocumentWidth = captureManager->lastDocumentWidth;
+	short newDocumentHeight = captureManager->lastDocumentHeight;
+	DocumentSignature newDocumentSignature = captureManager->lastDocumentSignature;
+
+	auto now = std::chrono::steady_clock::now();
+	auto nowMs = std::chrono::time_point_cast<std::chrono::milliseconds>(now).time_since_epoch().count();
+
+	// The first document is always sent, the next ones if they differ from the last sent one, are sharper, or the last one is old
+	if (!hasSentDocument || nowMs - lastDocumentSendTime.count() >= DocumentSendTimeout ||
+		CompareDocumentSignatures(newDocumentSignature) > DocumentDiffThreshold || newDocumentScore > lastDocumentScore)
 	{
-		int count = static_cast<int>(lastFrameVertices.size());
-		if (count != lastFrameColors.size())
 		{
-			Log("[LiveScanClient] Warning: size mismatch! There were " + std::to_string(count) + " vertices and " + std::to_string(lastFrameColors.size()) + " colors. Sending smallest size.");
+			std::lock_guard<std::mutex> lock(documentMutex);
 
-			if (count < lastFrameColors.size())
-				count = lastFrameColors.size();
+			lastDocumentJpeg = captureManager->lastDocumentJpeg;
+			lastDocumentScore = newDocumentScore;
+			lastDocumentWidth = newDocumentWidth;
+			lastDocumentHeight = newDocumentHeight;
+			lastDocumentSignature = newDocumentSignature;
 		}
 
-		wrapper->sendLatestFrameCallback(clientIndex, lastFrameVertices.data(), lastFrameColors.data(), count);
+		hasSentDocument = true;
+		lastDocumentSendTime = std::chrono::milliseconds(nowMs);
+
+		SendDocument();
+	}
+}
+
+/// <summary>
+/// Compares the signature of a new document with the one of the last sent document
+/// </summary>
+/// <param name="newSignature">Signature of the new document</param>
+/// <returns>Mean difference of the intensities of the signatures, from 0.0 (same) to 1.0</returns>
+float LiveScanClient::CompareDocumentSignatures(const DocumentSignature& newSignature) const
+{
+	int sumDiff = 0;
+
+	for (size_t i = 0; i < newSignature.size(); i++)
+	{
+		sumDiff += std::abs(static_cast<int>(newSignature[i]) - static_cast<int>(lastDocumentSignature[i]));
+	}
+
+	return static_cast<float>(sumDiff) / (newSignature.size() * 255.0f);
+}
+
+/// <summary>
+/// Creates an event of this client for the server, with an empty payload
+/// </summary>
+ClientEvent LiveScanClient::MakeClientEvent(ClientEventType type)
+{
+	ClientEvent event = {};
+	event.ClientIndex = clientIndex;
+	event.Type = type;
+
+	return event;
+}
+
+void LiveScanClient::SendSerialNumber()
+{
+	ClientEvent event = MakeClientEvent(SerialNumberEvent);
+	captureManager->serialNumber.copy(event.Text, sizeof(event.Text) - 1);
+
+	ClientEventQueue::Instance().Push(event);
+}
+
+void LiveScanClient::ConfirmRecorded()
+{
+	ClientEventQueue::Instance().Push(MakeClientEvent(RecordedEvent));
+}
+
+void LiveScanClient::ConfirmCalibrated()
+{
+	ClientEvent event = MakeClientEvent(CalibratedEvent);
+	event.Value = calibration.usedMarkerId;
+
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			event.R[i * 3 + j] = calibration.worldR[i][j];
+
+		event.T[i] = calibration.worldT[i];
 	}
+
+	ClientEventQueue::Instance().Push(event);
 }
 
 void LiveScanClient::SendRecordedFrame(std::vector<Point3s>& vertices, std::vector<RGB>& RGB, bool noMoreFrames)
@@ -666,7 +2246,7 @@ void LiveScanClient::SendRecordedFrame(std::vector<Point3s>& vertices, std::vect
 		int count = static_cast<int>(vertices.size());
 		if (count != RGB.size())
 		{
-			Log("[LiveScanClient] Warning: size mismatch! There were " + std::to_string(count) + " vertices and " + std::to_string(RGB.size()) + " colors. Sending smallest size.");
+			Log(WarningLevel, "[LiveScanClient] Size mismatch! There were " + std::to_string(count) + " vertices and " + std::to_string(RGB.size()) + " colors. Sending smallest size.");
 
 			if (count < RGB.size())
 				count = RGB.size();
@@ -678,46 +2258,78 @@ void LiveScanClient::SendRecordedFrame(std::vector<Point3s>& vertices, std::vect
 
 void LiveScanClient::ConfirmSyncState()
 {
-	if (wrapper && wrapper->confirmSyncStateCallback)
-	{
-		int syncStateToSend = 2; // default: Standalone
-		switch (currentSyncState)
-		{
-		case Subordinate: 
-			syncStateToSend = 0;
-			break;
-		case Master:      
-			syncStateToSend = 1;
-			break;
-		case Standalone:  
-			syncStateToSend = 2;
-			break;
-		}
+	ClientEvent event = MakeClientEvent(SyncStateEvent);
+	event.Value = 2; // default: Standalone
 
-		wrapper->confirmSyncStateCallback(clientIndex, syncStateToSend);
+	switch (currentSyncState)
+	{
+	case Subordinate: 
+		event.Value = 0;
+		break;
+	case Master:      
+		event.Value = 1;
+		break;
+	case Standalone:  
+		event.Value = 2;
+		break;
 	}
 
-	isConfirmSyncStateRequested = false;
+	ClientEventQueue::Instance().Push(event);
 }
 
 void LiveScanClient::ConfirmMasterRestart()
 {
-	if (wrapper && wrapper->confirmMasterRestartCallback)
-	{
-		wrapper->confirmMasterRestartCallback(clientIndex);
-	}
+	ClientEventQueue::Instance().Push(MakeClientEvent(MasterRestartEvent));
+}
+
+void LiveScanClient::ConfirmLoadShedLevel()
+{
+	ClientEvent event = MakeClientEvent(LoadShedEvent);
+	event.Value = loadShedLevel;
 
-	isConfirmRestartAsMasterRequested = false;
+	ClientEventQueue::Instance().Push(event);
 }
 
+/// <summary>
+/// Tells the server that a new document is ready, which it then copies with CopyDocument
+/// </summary>
 void LiveScanClient::SendDocument()
 {
-	if (wrapper && wrapper->sendDocumentCallback)
+	ClientEvent event = MakeClientEvent(DocumentEvent);
+
 	{
-		wrapper->sendDocumentCallback(clientIndex, lastDocumentData.data, lastDocumentScore, lastDocumentWidth, lastDocumentHeight);
+		std::lock_guard<std::mutex> lock(documentMutex);
+		event.Value = static_cast<int>(lastDocumentJpeg.size());
 	}
 
-	isSendDocumentRequested = false;
+	ClientEventQueue::Instance().Push(event);
+}
+
+/// <summary>
+/// Copies the document to send, and releases it. A document replaced before the server copied it is only sent once,
+/// as the newer one.
+/// </summary>
+/// <param name="maxJpegSize">Size of the jpeg buffer; the document is not copied if it does not fit</param>
+/// <param name="maxSignatureSize">Size of the signature buffer; the signature is truncated to it</param>
+/// <returns>Size of the encoded document copied; 0 if there is none to send</returns>
+int LiveScanClient::CopyDocument(unsigned char* jpeg, int maxJpegSize, float& score, short& width, short& height, unsigned char* signature, int maxSignatureSize)
+{
+	std::lock_guard<std::mutex> lock(documentMutex);
+
+	int jpegSize = static_cast<int>(lastDocumentJpeg.size());
+
+	if (jpegSize == 0 || jpegSize > maxJpegSize)
+		return 0;
+
+	std::copy(lastDocumentJpeg.begin(), lastDocumentJpeg.end(), jpeg);
+	std::copy_n(lastDocumentSignature.begin(), (std::min)(static_cast<int>(lastDocumentSignature.size()), maxSignatureSize), signature);
+	score = lastDocumentScore;
+	width = lastDocumentWidth;
+	height = lastDocumentHeight;
+
+	lastDocumentJpeg.clear();
+
+	return jpegSize;
 }
 
 /// <summary>
@@ -734,9 +2346,7 @@ void LiveScanClient::SetupLogging(int clientIndex)
 	CreateDirectoryW(dir.c_str(), NULL);
 
 	std::wstring logPath = dir + L"\\LiveScanClient_" + std::to_wstring(clientIndex) + L"_Log.txt";
-	logFile.open(logPath, std::ios::out | std::ios::app);
-
-	if (!logFile.is_open())
+	if (!logger.Open(logPath))
 	{
 		OutputDebugStringW(L"Failed to open log file.\n");
 		return;
@@ -755,40 +2365,22 @@ std::function<void(const std::string&)> LiveScanClient::GetLogger() {
 }
 
 /// <summary>
-/// Appends the provided message to the end of the previously opened log file.
+/// Queues the provided message to be appended to the log file, as an information message
 /// </summary>
 /// <param name="message">Message to append to the log file</param>
 void LiveScanClient::Log(const std::string& message)
 {
-	// Get current time
-	auto now = std::chrono::system_clock::now();
-	auto now_ms = std::chrono::time_point_cast<std::chrono::milliseconds>(now);
-	auto value = now_ms.time_since_epoch();
-	long duration = value.count();
-	std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-
-	std::tm tm;
-	localtime_s(&tm, &now_c); // Windows-specific thread-safe function
-
-	// Extract milliseconds
-	int milliseconds = static_cast<int>(duration % 1000);
-
-	// Format time to string with milliseconds
-	std::ostringstream timestamp;
-	timestamp << std::put_time(&tm, "[%Y-%m-%d %H:%M:%S")
-		<< "." << std::setfill('0') << std::setw(3) << milliseconds
-		<< "] " << message;
-
-	std::string logEntry = timestamp.str();
+	logger.Log(InfoLevel, message);
+}
 
-	if (logFile.is_open())
-	{
-		logFile << logEntry << std::endl;
-		logFile.flush();
-	}
-	else
-	{
-		OutputDebugStringA((logEntry + "\n").c_str()); // fallback to debugger output
-	}
+/// <summary>
+/// Queues the provided message to be appended to the log file by the flusher thread of the logger, so that it can be
+/// called from the frame loop
+/// </summary>
+/// <param name="level">Level of the message</param>
+/// <param name="message">Message to append to the log file</param>
+void LiveScanClient::Log(LogLevel level, const std::string& message)
+{
+	logger.Log(level, message);
 }
 
@@ -13,15 +13,24 @@ C++ clients and vice-versa.
 \***************************************************************************/
 
 #include "LiveScanClientApi.h"
+#include "deviceRegistry.h"
 #include <thread>
 #include <memory>
+#include <algorithm>
 #include <map>
+#include <chrono>
 #include <locale>
 #include <codecvt> 
 
 /*
 * Server to client (inbound) calls
 */
+void PrepareClients(int count)
+{
+	// Enumerate the devices once for all the clients and size their startup barrier
+	DeviceRegistry::Instance().PrepareStartup(count);
+}
+
 LiveScanClientHandle CreateClient(int index)
 {
 	auto* wrapper = new LiveScanClientWrapper();
@@ -31,6 +40,52 @@ LiveScanClientHandle CreateClient(int index)
 	return wrapper;
 }
 
+LiveScanClientHandle CreateReplayClient(int index, const char* path, bool isRealTime)
+{
+	auto* wrapper = new LiveScanClientWrapper();
+
+	wrapper->client = std::make_unique<LiveScanClient>(index, path, isRealTime);
+	wrapper->client->wrapper = wrapper;
+	return wrapper;
+}
+
+/// <summary>
+/// Creates the client of a camera hosted by a capture node on another computer; it is controlled like the others
+/// </summary>
+/// <param name="remoteIndex">Index of the client on the node</param>
+LiveScanClientHandle CreateRemoteClient(int index, const char* host, int port, int remoteIndex)
+{
+	auto* wrapper = new LiveScanClientWrapper();
+
+	wrapper->client = std::make_unique<RemoteClient>(index, host, port, remoteIndex);
+	wrapper->client->wrapper = wrapper;
+	return wrapper;
+}
+
+/// <summary>
+/// Creates the client of a camera of this computer which runs in its own worker process, so that a crash or a hang of
+/// its camera does not affect the others; it is controlled like the others
+/// </summary>
+LiveScanClientHandle CreateWorkerClient(int index)
+{
+	auto* wrapper = new LiveScanClientWrapper();
+
+	wrapper->client = std::make_unique<RemoteClient>(index);
+	wrapper->client->wrapper = wrapper;
+	return wrapper;
+}
+
+/// <summary>
+/// Asks a capture node how many cameras it hosts
+/// </summary>
+/// <returns>Number of clients of the node; -1 if it did not answer within the timeout</returns>
+int QueryCaptureNode(const char* host, int port, int timeoutMs)
+{
+	if (!host) return -1;
+
+	return RemoteClient::QueryNode(host, port, timeoutMs);
+}
+
 void StartClient(LiveScanClientHandle handle)
 {
 	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
@@ -76,6 +131,71 @@ void Calibrate(LiveScanClientHandle handle)
 	wrapper->client->Calibrate();
 }
 
+bool GetCalibrationProgress(LiveScanClientHandle handle, int* numSamples, int* numRequiredSamples)
+{
+	*numSamples = 0;
+	*numRequiredSamples = 0;
+
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return false;
+
+	return wrapper->client->GetCalibrationProgress(*numSamples, *numRequiredSamples);
+}
+
+/// <summary>
+/// Summarizes the time taken by each stage of the frame loop of a client, in the order of PerfStage
+/// </summary>
+/// <param name="isReset">Starts new measurements, so that the next summary only covers the frames after this one</param>
+/// <returns>Number of stages written to stats</returns>
+int GetPerfStats(LiveScanClientHandle handle, PerfStageStats* stats, int maxStages, bool isReset)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return 0;
+
+	return wrapper->client->GetPerfStats(stats, maxStages, isReset);
+}
+
+/// <summary>
+/// Copies the bytes held by the buffers of a client by MemoryCategory, as last accounted by its capture thread
+/// </summary>
+bool GetMemoryStats(LiveScanClientHandle handle, ClientMemoryStats* stats)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper || !stats) return false;
+
+	wrapper->client->GetMemoryStats(*stats);
+	return true;
+}
+
+/// <summary>
+/// Copies the number of points each step of the processing of the last frame of a client removed, with the extent of
+/// the points sent and the fill of the voxel grid
+/// </summary>
+bool GetFunnelStats(LiveScanClientHandle handle, FrameFunnelStats* stats)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper || !stats) return false;
+
+	wrapper->client->GetFunnelStats(*stats);
+	return true;
+}
+
+void SetDocumentFrameInterval(LiveScanClientHandle handle, int intervalMs)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return;
+
+	wrapper->client->SetDocumentFrameInterval(intervalMs);
+}
+
+void SetMaxDocumentSize(LiveScanClientHandle handle, int width, int height)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return;
+
+	wrapper->client->SetMaxDocumentSize(width, height);
+}
+
 void SetSettings(LiveScanClientHandle handle, const CameraSettings* settings)
 {
 	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
@@ -84,6 +204,17 @@ void SetSettings(LiveScanClientHandle handle, const CameraSettings* settings)
 	wrapper->client->SetSettings(*settings);
 }
 
+/// <summary>
+/// Sets the exposure of the color camera without changing the other settings, until the next settings
+/// </summary>
+void SetExposure(LiveScanClientHandle handle, bool isAutoExposureEnabled, int exposureStep)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return;
+
+	wrapper->client->SetExposure(isAutoExposureEnabled, exposureStep);
+}
+
 void RequestRecordedFrame(LiveScanClientHandle handle)
 {
 	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
@@ -92,12 +223,133 @@ void RequestRecordedFrame(LiveScanClientHandle handle)
 	wrapper->client->RequestRecordedFrame();
 }
 
-void RequestLatestFrame(LiveScanClientHandle handle)
+/// <summary>
+/// Sends up to maxFrames recorded frames through the recorded frame callback before returning
+/// </summary>
+/// <returns>Number of frames sent; fewer than maxFrames once the recording ended</returns>
+int RequestRecordedFrames(LiveScanClientHandle handle, int maxFrames)
 {
 	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
-	if (!wrapper) return;
+	if (!wrapper) return 0;
+
+	return wrapper->client->RequestRecordedFrames(maxFrames);
+}
+
+/// <summary>
+/// Leases the latest processed frame of a client. The buffers stay valid and unchanged until ReleaseFrame is called,
+/// so the server can read them in place; the client keeps publishing new frames in the meantime.
+/// </summary>
+LiveScanFrameHandle AcquireLatestFrame(LiveScanClientHandle handle, const Point3s** vertices, const RGB** colors, int* count, unsigned long long* sequenceNumber, unsigned long long* timeStampUs)
+{
+	*vertices = nullptr;
+	*colors = nullptr;
+	*count = 0;
+	*sequenceNumber = 0;
+	*timeStampUs = 0;
+
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return nullptr;
+
+	std::shared_ptr<const ProcessedFrame> frame = wrapper->client->AcquireLatestFrame();
+
+	*vertices = frame->Vertices.data();
+	*colors = frame->Colors.data();
+	*count = static_cast<int>((std::min)(frame->Vertices.size(), frame->Colors.size()));
+	*sequenceNumber = frame->SequenceNumber;
+	*timeStampUs = frame->TimeStampUs;
+
+	// The lease holds a reference to the frame, which keeps it from being recycled by the client
+	return new std::shared_ptr<const ProcessedFrame>(std::move(frame));
+}
+
+/// <summary>
+/// Gives the time elapsed since the capture manager returned a leased frame, and since its points were published. The
+/// ages do not depend on the clock of the caller, which stamps the times of the frame with its own clock.
+/// </summary>
+void GetFrameAges(LiveScanFrameHandle frame, unsigned long long* acquireAgeUs, unsigned long long* publishAgeUs)
+{
+	*acquireAgeUs = 0;
+	*publishAgeUs = 0;
+
+	auto* lease = static_cast<std::shared_ptr<const ProcessedFrame>*>(frame);
+
+	// The initial empty frame was never acquired
+	if (!lease || (*lease)->SequenceNumber == 0)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	*acquireAgeUs = std::chrono::duration_cast<std::chrono::microseconds>(now - (*lease)->AcquireTime).count();
+	*publishAgeUs = std::chrono::duration_cast<std::chrono::microseconds>(now - (*lease)->PublishTime).count();
+}
+
+/// <summary>
+/// Gives the normals of the points of a leased frame, one octahedral byte per vertex, which stay valid until the frame
+/// is released
+/// </summary>
+/// <returns>The number of normals; 0 if the client does not estimate them</returns>
+int GetFrameNormals(LiveScanFrameHandle frame, const unsigned char** normals)
+{
+	*normals = nullptr;
+
+	auto* lease = static_cast<std::shared_ptr<const ProcessedFrame>*>(frame);
+	if (!lease) return 0;
+
+	*normals = (*lease)->Normals.data();
+
+	return static_cast<int>((std::min)((*lease)->Normals.size(), (*lease)->Vertices.size()));
+}
+
+void ReleaseFrame(LiveScanFrameHandle frame)
+{
+	delete static_cast<std::shared_ptr<const ProcessedFrame>*>(frame);
+}
+
+/// <summary>
+/// Converts the points of an acquired frame to meters and RGB colors, the layout of the merged frames
+/// </summary>
+void ConvertFramePoints(const Point3s* vertices, const RGB* colors, int count, float* outVertices, unsigned char* outColors)
+{
+	PointCloudEncoder::ConvertPoints(reinterpret_cast<const int16_t*>(vertices), reinterpret_cast<const uint8_t*>(colors), count, outVertices, outColors);
+}
+
+/// <summary>
+/// Blocks until the client publishes a frame newer than lastSequenceNumber, or until the timeout expires
+/// </summary>
+bool WaitForFrame(LiveScanClientHandle handle, unsigned long long lastSequenceNumber, int timeoutMs)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return false;
+
+	return wrapper->client->WaitForNewFrame(lastSequenceNumber, timeoutMs);
+}
+
+/// <summary>
+/// Copies the next depth frame of a client, for the projective pose refinement
+/// </summary>
+/// <param name="depth">Output depth frame, in millimeters, able to hold maxPixels pixels</param>
+/// <param name="intrinsics">Output depth camera fx, fy, cx, cy</param>
+/// <param name="depthToWorld">Output depth camera (meters) to world space transform, 3x4 row-major</param>
+/// <returns>False if no frame was acquired before the timeout or if the frame does not fit in the buffer</returns>
+bool AcquireDepthFrame(LiveScanClientHandle handle, UINT16* depth, int maxPixels, int* width, int* height, float* intrinsics, float* depthToWorld, int timeoutMs)
+{
+	*width = 0;
+	*height = 0;
+
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return false;
+
+	DepthFrame frame;
+
+	if (!wrapper->client->AcquireDepthFrame(frame, timeoutMs) || frame.Depth.size() > static_cast<size_t>(maxPixels))
+		return false;
+
+	std::copy(frame.Depth.begin(), frame.Depth.end(), depth);
+	std::copy(frame.Intrinsics, frame.Intrinsics + 4, intrinsics);
+	std::copy(frame.DepthToWorld, frame.DepthToWorld + 12, depthToWorld);
+	*width = frame.Width;
+	*height = frame.Height;
 
-	wrapper->client->RequestLatestFrame();
+	return true;
 }
 
 void ReceiveCalibration(LiveScanClientHandle handle, const AffineTransform* transform)
@@ -109,6 +361,21 @@ void ReceiveCalibration(LiveScanClientHandle handle, const AffineTransform* tran
 	wrapper->client->ReceiveCalibration(*transform);
 }
 
+/// <summary>
+/// Shares out the voxels of the client between the cameras of the calibration; the client then only keeps the points
+/// of the voxels its camera owns
+/// </summary>
+/// <param name="poses">Pose of each camera in world space; none to keep all the points</param>
+/// <param name="cameraIndex">Index of the pose of the camera of the client among them</param>
+void ReceiveCameraPoses(LiveScanClientHandle handle, const AffineTransform* poses, int numCameras, int cameraIndex)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper || !wrapper->client || (numCameras > 0 && !poses))
+		return;
+
+	wrapper->client->ReceiveCameraPoses(std::vector<AffineTransform>(poses, poses + (std::max)(numCameras, 0)), cameraIndex);
+}
+
 void ClearRecordedFrames(LiveScanClientHandle handle)
 {
 	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
@@ -117,12 +384,28 @@ void ClearRecordedFrames(LiveScanClientHandle handle)
 	wrapper->client->ClearRecordedFrames();
 }
 
-void EnableSync(LiveScanClientHandle handle, int syncState, int syncOffset)
+void SaveFrameRing(LiveScanClientHandle handle, int seconds)
 {
 	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
 	if (!wrapper) return;
 
-	wrapper->client->EnableSync(syncState, syncOffset);
+	wrapper->client->SaveFrameRing(seconds);
+}
+
+void LearnExclusionMask(LiveScanClientHandle handle, int numFrames)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return;
+
+	wrapper->client->LearnExclusionMask(numFrames);
+}
+
+void EnableSync(LiveScanClientHandle handle, int syncState, int syncOffset, int numSyncedDevices)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return;
+
+	wrapper->client->EnableSync(syncState, syncOffset, numSyncedDevices);
 }
 
 void DisableSync(LiveScanClientHandle handle)
@@ -141,61 +424,368 @@ void StartMaster(LiveScanClientHandle handle)
 	wrapper->client->StartMaster();
 }
 
+/// <summary>
+/// Copies the document a client announced with a document event, and releases it
+/// </summary>
+/// <returns>Size of the encoded document; 0 if it was already copied or does not fit in maxJpegSize</returns>
+int CopyDocument(LiveScanClientHandle handle, unsigned char* jpeg, int maxJpegSize, float* score, short* width, short* height, unsigned char* signature, int maxSignatureSize)
+{
+	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
+	if (!wrapper) return 0;
+
+	return wrapper->client->CopyDocument(jpeg, maxJpegSize, *score, *width, *height, signature, maxSignatureSize);
+}
+
 /*
 * Client to server (outbound) calls
 */
-void SetSendSerialNumberCallback(LiveScanClientHandle handle, SendSerialNumberCallback cb)
+int WaitForClientEvents(ClientEvent* events, int maxEvents, int timeoutMs)
 {
-	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
-	if (wrapper)
-		wrapper->sendSerialNumberCallback = cb;
+	return ClientEventQueue::Instance().Wait(events, maxEvents, timeoutMs);
 }
 
-void SetConfirmRecordedCallback(LiveScanClientHandle handle, ConfirmRecordedCallback cb)
+void SetSendRecordedFrameCallback(LiveScanClientHandle handle, SendRecordedFrameCallback cb)
 {
 	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
 	if (wrapper)
-		wrapper->confirmRecordedCallback = cb;
+		wrapper->sendStoredFrameCallback = cb;
+}
+/*
+* Point cloud encoding
+*/
+PointCloudEncoderHandle CreatePointCloudEncoder()
+{
+	return new PointCloudEncoder();
 }
 
-void SetConfirmCalibratedCallback(LiveScanClientHandle handle, ConfirmCalibratedCallback cb)
+void DestroyPointCloudEncoder(PointCloudEncoderHandle handle)
 {
-	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
-	if (wrapper)
-		wrapper->confirmCalibratedCallback = cb;
+	delete static_cast<PointCloudEncoder*>(handle);
 }
 
-void SetSendLatestFrameCallback(LiveScanClientHandle handle, SendLatestFrameCallback cb)
+/// <summary>
+/// Encodes a merged frame to the full frame wire buffer (scale, number of vertices, vertices, colors). The buffer is
+/// owned by the encoder and stays valid until the next frame is encoded with it.
+/// </summary>
+/// <returns>The size of the buffer, in bytes</returns>
+int EncodePointCloud(PointCloudEncoderHandle handle, const float* vertices, const unsigned char* colors, int numVertices, short scale, const unsigned char** buffer)
 {
-	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
-	if (wrapper)
-		wrapper->sendLatestFrameCallback = cb;
+	*buffer = nullptr;
+
+	auto* encoder = static_cast<PointCloudEncoder*>(handle);
+	if (!encoder) return 0;
+
+	int size = encoder->Encode(vertices, colors, numVertices, scale);
+	*buffer = encoder->GetBuffer();
+
+	return size;
 }
 
-void SetSendRecordedFrameCallback(LiveScanClientHandle handle, SendRecordedFrameCallback cb)
+/// <summary>
+/// Encodes a merged frame to the full frame wire buffer like EncodePointCloud, with the points of each camera encoded
+/// as a chunk of their own on the task scheduler, the chunks joined in order under the header of the frame. The
+/// buffer is owned by the encoder and stays valid until the next frame is encoded with it.
+/// </summary>
+/// <param name="chunkSizes">Number of vertices of each camera, in the order of the merged frame</param>
+/// <returns>The size of the buffer, in bytes</returns>
+int EncodePointCloudChunks(PointCloudEncoderHandle handle, const float* vertices, const unsigned char* colors, const int* chunkSizes, int numChunks, short scale,
+	const unsigned char** buffer)
 {
-	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
-	if (wrapper)
-		wrapper->sendStoredFrameCallback = cb;
+	*buffer = nullptr;
+
+	auto* encoder = static_cast<PointCloudEncoder*>(handle);
+	if (!encoder || !chunkSizes || numChunks < 0) return 0;
+
+	int size = encoder->EncodeChunks(vertices, colors, chunkSizes, numChunks, scale);
+	*buffer = encoder->GetBuffer();
+
+	return size;
 }
 
-void SetConfirmSyncStateCallback(LiveScanClientHandle handle, ConfirmSyncStateCallback cb)
+/// <summary>
+/// Codes the frame last encoded with EncodePointCloud as an octree (scale, number of vertices, child occupancy masks,
+/// predicted YCoCg colors in Morton order). The buffer is owned by the encoder and stays valid until the next frame is coded with it.
+/// </summary>
+/// <returns>The size of the buffer, in bytes</returns>
+int EncodePointCloudOctree(PointCloudEncoderHandle handle, int chromaStep, const unsigned char** buffer)
 {
-	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
-	if (wrapper)
-		wrapper->confirmSyncStateCallback = cb;
+	*buffer = nullptr;
+
+	auto* encoder = static_cast<PointCloudEncoder*>(handle);
+	if (!encoder) return 0;
+
+	int size = encoder->EncodeOctree(chromaStep);
+	*buffer = encoder->GetOctreeBuffer();
+
+	return size;
 }
 
-void SetConfirmMasterRestartCallback(LiveScanClientHandle handle, ConfirmMasterRestartCallback cb)
+/// <summary>
+/// Codes the frame last encoded with EncodePointCloud as a progressive octree (scale, number of vertices, then one
+/// chunk for the coarse depth and one for each finer level). The buffer is owned by the encoder and stays valid until
+/// the next frame is coded with it.
+/// </summary>
+/// <returns>The size of the buffer, in bytes</returns>
+int EncodePointCloudProgressive(PointCloudEncoderHandle handle, int coarseDepth, const unsigned char** buffer)
 {
-	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
-	if (wrapper)
-		wrapper->confirmMasterRestartCallback = cb;
+	*buffer = nullptr;
+
+	auto* encoder = static_cast<PointCloudEncoder*>(handle);
+	if (!encoder) return 0;
+
+	int size = encoder->EncodeProgressive(coarseDepth);
+	*buffer = encoder->GetProgressiveBuffer();
+
+	return size;
 }
 
-void SetSendDocumentCallback(LiveScanClientHandle handle, SendDocumentCallback cb)
+/// <summary>
+/// Encodes a merged frame to the wide frame wire buffer (scale, number of vertices, minimum and quantization step of
+/// each axis, packed 32-bit positions, colors), for capture ranges larger than the byte grid. The buffer is owned by
+/// the encoder and stays valid until the next frame is coded with it.
+/// </summary>
+/// <returns>The size of the buffer, in bytes</returns>
+int EncodePointCloudWide(PointCloudEncoderHandle handle, const float* vertices, const unsigned char* colors, int numVertices, float range, short scale, const unsigned char** buffer)
 {
-	auto* wrapper = static_cast<LiveScanClientWrapper*>(handle);
-	if (wrapper)
-		wrapper->sendDocumentCallback = cb;
-}
\ No newline at end of file
+	*buffer = nullptr;
+
+	auto* encoder = static_cast<PointCloudEncoder*>(handle);
+	if (!encoder) return 0;
+
+	int size = encoder->EncodeWide(vertices, colors, numVertices, range, scale);
+	*buffer = encoder->GetWideBuffer();
+
+	return size;
+}
+
+/// <summary>
+/// Encodes a triangle mesh to the mesh frame wire buffer (number of triangles, the vertices as a wide frame, vertex
+/// indices of the triangles). The buffer is owned by the encoder and stays valid until the next mesh is coded with it.
+/// </summary>
+/// <returns>The size of the buffer, in bytes</returns>
+int EncodePointCloudMesh(PointCloudEncoderHandle handle, const float* vertices, const unsigned char* colors, int numVertices, const int* indices, int numTriangles, float range, short scale, const unsigned char** buffer)
+{
+	*buffer = nullptr;
+
+	auto* encoder = static_cast<PointCloudEncoder*>(handle);
+	if (!encoder) return 0;
+
+	int size = encoder->EncodeMesh(vertices, colors, numVertices, indices, numTriangles, range, scale);
+	*buffer = encoder->GetMeshBuffer();
+
+	return size;
+}
+
+/// <summary>
+/// Encodes the last wide frame of the encoder as surfels (the wide frame, then the normal of each of its points). The
+/// normals are those of the vertices given to EncodePointCloudWide, which must be called first on the same frame.
+/// </summary>
+/// <returns>The size of the buffer, in bytes</returns>
+int EncodePointCloudSurfels(PointCloudEncoderHandle handle, const unsigned char* normals, const unsigned char** buffer)
+{
+	*buffer = nullptr;
+
+	auto* encoder = static_cast<PointCloudEncoder*>(handle);
+	if (!encoder) return 0;
+
+	int size = encoder->EncodeSurfels(normals);
+	*buffer = encoder->GetSurfelBuffer();
+
+	return size;
+}
+
+FusionVolumeHandle CreateFusionVolume()
+{
+	return new TsdfFusionVolume();
+}
+
+void DestroyFusionVolume(FusionVolumeHandle handle)
+{
+	delete static_cast<TsdfFusionVolume*>(handle);
+}
+
+/// <summary>
+/// Sets the world space region, voxel size (meters), truncation distance (meters) and temporal decay of the volume.
+/// The volume is cleared when its region or resolution changes.
+/// </summary>
+/// <returns>True if the volume is ready; false if the GPU buffers could not be created</returns>
+bool ConfigureFusionVolume(FusionVolumeHandle handle, const float* minBounds, const float* maxBounds, float voxelSize, float truncation, float decay)
+{
+	auto* volume = static_cast<TsdfFusionVolume*>(handle);
+	if (!volume) return false;
+
+	return volume->Configure(minBounds, maxBounds, voxelSize, truncation, decay);
+}
+
+/// <summary>
+/// Integrates the world space points of one camera into the current frame of the volume, along the rays from the
+/// origin of the camera.
+/// </summary>
+bool IntegrateFusionPoints(FusionVolumeHandle handle, const float* vertices, const unsigned char* colors, int numVertices, const float* origin)
+{
+	auto* volume = static_cast<TsdfFusionVolume*>(handle);
+	if (!volume) return false;
+
+	return volume->Integrate(vertices, colors, numVertices, origin);
+}
+
+/// <summary>
+/// Ends the current frame of the volume and extracts its surface points. The buffers are owned by the volume and stay
+/// valid until the next extraction.
+/// </summary>
+/// <returns>The number of points, or -1 if the surface could not be extracted</returns>
+int ExtractFusionPoints(FusionVolumeHandle handle, const float** vertices, const unsigned char** colors)
+{
+	*vertices = nullptr;
+	*colors = nullptr;
+
+	auto* volume = static_cast<TsdfFusionVolume*>(handle);
+	if (!volume) return -1;
+
+	int numPoints = volume->Extract();
+	*vertices = volume->GetVertices();
+	*colors = volume->GetColors();
+
+	return numPoints;
+}
+
+/// <summary>
+/// Ends the current frame of the volume and extracts its surface as a triangle mesh over cubes of step voxels on each
+/// side. The buffers are owned by the volume and stay valid until the next extraction.
+/// </summary>
+/// <param name="indices">Three vertex indices per triangle, counter-clockwise seen from outside the surface</param>
+/// <returns>The number of vertices, or -1 if the surface could not be extracted</returns>
+int ExtractFusionMesh(FusionVolumeHandle handle, int step, const float** vertices, const unsigned char** colors, const int** indices, int* numTriangles)
+{
+	*vertices = nullptr;
+	*colors = nullptr;
+	*indices = nullptr;
+	*numTriangles = 0;
+
+	auto* volume = static_cast<TsdfFusionVolume*>(handle);
+	if (!volume) return -1;
+
+	int numVertices = volume->ExtractMesh(step);
+	*vertices = volume->GetVertices();
+	*colors = volume->GetColors();
+	*indices = volume->GetIndices();
+	*numTriangles = volume->GetTriangleCount();
+
+	return numVertices;
+}
+
+/*
+* Level of detail of the live view of the server
+*/
+ViewDecimatorHandle CreateViewDecimator()
+{
+	return new ViewDecimator();
+}
+
+void DestroyViewDecimator(ViewDecimatorHandle handle)
+{
+	delete static_cast<ViewDecimator*>(handle);
+}
+
+/// <summary>
+/// Keeps the first point of each voxel of voxelSize meters, writing the points kept to the output buffers in the
+/// layout of the merged frames; a voxel size of 0 or less copies all the points
+/// </summary>
+/// <returns>The number of points written</returns>
+int DecimateViewPoints(ViewDecimatorHandle handle, const float* vertices, const unsigned char* colors, int numVertices, float voxelSize, float* outVertices, unsigned char* outColors)
+{
+	auto* decimator = static_cast<ViewDecimator*>(handle);
+	if (!decimator) return 0;
+
+	return decimator->Decimate(vertices, colors, numVertices, voxelSize, outVertices, outColors);
+}
+
+/*
+* Merged frames of the server shared with the subscribers of its process
+*/
+bool HasMergedFrameSubscribers()
+{
+	return MergedFrameHub::Instance().HasSubscribers();
+}
+
+/// <summary>
+/// Hands a merged frame of the server to the subscribers, copied once into a frame which they all share; returns
+/// without copying when there is no subscriber, and never waits for the subscribers
+/// </summary>
+void PublishMergedFrame(const float* vertices, const unsigned char* colors, const unsigned char* normals, int numVertices, const int* indices, int numTriangles,
+	const int* cameraVertexCounts, int numCameras, unsigned long long version, long long captureTimeUs)
+{
+	MergedFrameHub::Instance().Publish(vertices, colors, normals, numVertices, indices, numTriangles, cameraVertexCounts, numCameras, version, captureTimeUs);
+}
+
+MergedFrameSubscriberHandle SubscribeMergedFrames()
+{
+	return new std::shared_ptr<MergedFrameSubscriber>(MergedFrameHub::Instance().Subscribe());
+}
+
+/// <summary>
+/// Stops the delivery of the frames to a subscriber and wakes its waiting acquisition. The frames it acquired stay
+/// valid until they are released.
+/// </summary>
+void UnsubscribeMergedFrames(MergedFrameSubscriberHandle handle)
+{
+	auto* subscriber = static_cast<std::shared_ptr<MergedFrameSubscriber>*>(handle);
+	if (!subscriber) return;
+
+	MergedFrameHub::Instance().Unsubscribe(*subscriber);
+	delete subscriber;
+}
+
+/// <summary>
+/// Leases the latest merged frame published since the last one the subscriber acquired, waiting for it up to the
+/// timeout. The frames published in the meantime are dropped for this subscriber only. The buffers described by info
+/// stay valid and unchanged until ReleaseMergedFrame is called.
+/// </summary>
+/// <returns>Null if no new frame was published before the timeout</returns>
+MergedFrameHandle AcquireMergedFrame(MergedFrameSubscriberHandle handle, int timeoutMs, MergedFrameInfo* info)
+{
+	*info = MergedFrameInfo();
+	info->ApiVersion = MergedFrameApiVersion;
+
+	auto* subscriber = static_cast<std::shared_ptr<MergedFrameSubscriber>*>(handle);
+	if (!subscriber) return nullptr;
+
+	std::shared_ptr<const SharedMergedFrame> frame = (*subscriber)->Acquire(timeoutMs);
+	info->NumDroppedFrames = (*subscriber)->GetNumDroppedFrames();
+
+	if (!frame)
+		return nullptr;
+
+	info->Version = frame->Version;
+	info->CaptureTimeUs = frame->CaptureTimeUs;
+	info->Vertices = frame->Vertices.data();
+	info->Colors = frame->Colors.data();
+	info->Normals = frame->Normals.empty() ? nullptr : frame->Normals.data();
+	info->NumVertices = static_cast<int>(frame->Colors.size() / 3);
+	info->Indices = frame->Indices.empty() ? nullptr : frame->Indices.data();
+	info->NumTriangles = static_cast<int>(frame->Indices.size() / 3);
+	info->CameraVertexCounts = frame->CameraVertexCounts.data();
+	info->NumCameras = static_cast<int>(frame->CameraVertexCounts.size());
+
+	// The lease holds a reference to the frame, which keeps it from being reused by the publisher
+	return new std::shared_ptr<const SharedMergedFrame>(std::move(frame));
+}
+
+void ReleaseMergedFrame(MergedFrameHandle frame)
+{
+	delete static_cast<std::shared_ptr<const SharedMergedFrame>*>(frame);
+}
+
+/// <summary>
+/// Loads and starts the plugins of a directory, the DLLs which export StartLiveScanPlugin and StopLiveScanPlugin
+/// </summary>
+/// <returns>The number of plugins started</returns>
+int LoadMergedFramePlugins(const char* directory)
+{
+	return MergedFrameHub::Instance().LoadPlugins(directory ? directory : "");
+}
+
+void UnloadMergedFramePlugins()
+{
+	MergedFrameHub::Instance().UnloadPlugins();
+}
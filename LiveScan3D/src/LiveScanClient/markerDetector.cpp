@@ -7,7 +7,11 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module uses the iMarkerDetector interface to detect markers in a provided
-2D color frame.
+2D color frame. The frame is searched at a lower resolution first, and the
+markers are only detected at full resolution in the regions around the
+candidates found there. A frame without a marker at the usual threshold of
+the binary image is searched again at a few other thresholds in parallel,
+so that a marker too dark or too bright for it is still found.
 
 This code was adapted from the following research:
 Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
@@ -17,6 +21,7 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 \***************************************************************************/
 
 #include "markerDetector.h"
+#include "taskScheduler.h"
 #include <opencv2/opencv.hpp>
 
 using namespace std;
@@ -32,55 +37,239 @@ using namespace std;
 /// <returns>True if a marker was detected, false otherwise</returns>
 bool MarkerDetector::DetectMarkersInImage(RGB* img, int height, int width, MarkerInfo& marker)
 {
-	// Create an OpenCV 8-bit 3-channel image to hold the RGB data
-	cv::Mat cvImg(height, width, CV_8UC3);
+	// The pixels are stored in the BGR order of OpenCV, so the frame is wrapped without a copy; the markers are drawn
+	// straight on it when requested
+	cv::Mat cvImg(height, width, CV_8UC3, img);
 
-	// Copy raw RGB pixel data into the OpenCV Mat format (BGR order)
-	for (int i = 0; i < height; i++)
+	return DetectMarkers(cvImg, marker);
+}
+
+/// <summary>
+/// Finds all markers in the provided 2D color frame and outputs the best detected one.
+/// </summary>
+/// <param name="img">Color frame from which to detect markers</param>
+/// <param name="marker">Output information on the detected marker</param>
+/// <returns>True if a marker was detected, false otherwise</returns>
+bool MarkerDetector::DetectMarkers(cv::Mat &img, MarkerInfo &marker)
+{
+	return DetectMarkersAtThresholds(img, [this, &img](int threshold, vector<MarkerInfo> &markers) {
+		DetectMarkersAtThreshold(img, threshold, markers);
+	}, marker);
+}
+
+/// <summary>
+/// Detects the markers of the whole color frame, binarized at one threshold.
+/// </summary>
+/// <param name="img">Color frame from which to detect markers</param>
+/// <param name="threshold">Threshold of the binary image, or OtsuBitThreshold</param>
+/// <param name="markers">List the detected markers are added to</param>
+void MarkerDetector::DetectMarkersAtThreshold(cv::Mat &img, int threshold, vector<MarkerInfo> &markers)
+{
+	// Only the regions of the candidates found at low resolution are searched at full resolution
+	vector<cv::Rect> candidateRegions;
+	FindCandidateRegions(img, threshold, candidateRegions);
+
+	for (unsigned int i = 0; i < candidateRegions.size(); i++)
 	{
-		for (int j = 0; j < width; j++)
-		{
-			cvImg.at<cv::Vec3b>(i, j)[0] = img[j + width * i].Blue;
-			cvImg.at<cv::Vec3b>(i, j)[1] = img[j + width * i].Green;
-			cvImg.at<cv::Vec3b>(i, j)[2] = img[j + width * i].Red;
-		}
+		DetectMarkersInRegion(img, candidateRegions[i], threshold, markers);
 	}
+}
+
+/// <summary>
+/// Selects the best marker detected at ColorFrameBitThreshold, or if there is none, at each of the fallback thresholds,
+/// which are searched in parallel on the shared task scheduler. The searches share the frame, which they only read
+/// unless the markers are drawn.
+/// </summary>
+/// <param name="detect">Adds the markers detected at a threshold to a list</param>
+/// <returns>True if a marker was detected, false otherwise</returns>
+template <typename Detect>
+bool MarkerDetector::DetectMarkersAtThresholds(cv::Mat &img, Detect detect, MarkerInfo &marker)
+{
+	vector<MarkerInfo> markers;
+	detect(ColorFrameBitThreshold, markers);
+
+	if (markers.empty())
+	{
+		int numThresholds = static_cast<int>(FallbackBitThresholds.size());
+		vector<vector<MarkerInfo>> thresholdMarkers(numThresholds);
+
+		TaskScheduler::Instance().ParallelFor(0, numThresholds, [&](int i) {
+			detect(FallbackBitThresholds[i], thresholdMarkers[i]);
+		});
+
+		for (int i = 0; i < numThresholds; i++)
+			markers.insert(markers.end(), thresholdMarkers[i].begin(), thresholdMarkers[i].end());
+	}
+
+	return SelectMarker(img, markers, marker);
+}
+
+/// <summary>
+/// Binarizes a grayscale image in place at a threshold, or at the threshold which best splits its histogram.
+/// </summary>
+void MarkerDetector::Binarize(cv::Mat &grayImg, int threshold)
+{
+	if (threshold == OtsuBitThreshold)
+		cv::threshold(grayImg, grayImg, 0, 255, CV_THRESH_BINARY | CV_THRESH_OTSU);
+	else
+		cv::threshold(grayImg, grayImg, threshold, 255, CV_THRESH_BINARY);
+}
 
-	bool res = DetectMarkers(cvImg, marker);
+/// <summary>
+/// Finds all markers in a region of the provided 2D color frame and outputs the best detected one. The region is
+/// searched at full resolution, so it is meant for a small window around a marker found in a previous frame.
+/// </summary>
+/// <param name="img">Color frame from which to detect markers</param>
+/// <param name="height">Height of the color frame</param>
+/// <param name="width">Width of the color frame</param>
+/// <param name="regionX">Left of the searched region, clipped to the frame</param>
+/// <param name="regionY">Top of the searched region, clipped to the frame</param>
+/// <param name="regionWidth">Width of the searched region</param>
+/// <param name="regionHeight">Height of the searched region</param>
+/// <param name="marker">Output information on the detected marker, with its corners in frame coordinates</param>
+/// <returns>True if a marker was detected, false otherwise</returns>
+bool MarkerDetector::DetectMarkersInImage(RGB* img, int height, int width, int regionX, int regionY, int regionWidth, int regionHeight, MarkerInfo& marker)
+{
+	cv::Mat cvImg(height, width, CV_8UC3, img);
+	cv::Rect region = cv::Rect(regionX, regionY, regionWidth, regionHeight) & cv::Rect(0, 0, width, height);
 
-	// If the original image was modified to add marker drawings, copy it back to the original one
-	if (DrawOnOriginalImage)
+	if (region.area() == 0)
+		return false;
+
+	return DetectMarkersAtThresholds(cvImg, [this, &cvImg, &region](int threshold, vector<MarkerInfo> &markers) {
+		DetectMarkersInRegion(cvImg, region, threshold, markers);
+	}, marker);
+}
+
+/// <summary>
+/// Selects the largest of the detected markers; when a marker was found at several thresholds, the largest of its
+/// outlines is taken, as too high a threshold erodes the white border which the outline follows.
+/// </summary>
+/// <param name="img">Color frame the markers were detected in, drawn on when requested</param>
+/// <param name="markers">Detected markers</param>
+/// <param name="marker">Output information on the selected marker</param>
+/// <returns>True if a marker was detected, false otherwise</returns>
+bool MarkerDetector::SelectMarker(cv::Mat &img, vector<MarkerInfo> &markers, MarkerInfo &marker)
+{
+	// If one or more markers were found, select the largest one and return it
+	if (markers.size() > 0)
 	{
-		for (int i = 0; i < height; i++)
+		double maxArea = 0;
+		int maxInd = 0;
+
+		// Find marker with the largest area
+		for (unsigned int i = 0; i < markers.size(); i++)
 		{
-			for (int j = 0; j < width; j++)
+			if (GetMarkerArea(markers[i]) > maxArea)
 			{
-				img[j + width * i].Blue = cvImg.at<cv::Vec3b>(i, j)[0];
-				img[j + width * i].Green = cvImg.at<cv::Vec3b>(i, j)[1];
-				img[j + width * i].Red = cvImg.at<cv::Vec3b>(i, j)[2];
+				maxInd = i;
+				maxArea = GetMarkerArea(markers[i]);
+			}
+		}
+
+		marker = markers[maxInd];
+
+		// Optional: draw the final selected marker with green outline
+		if (DrawOnOriginalImage)
+		{
+			for (int j = 0; j < NumMarkerCorners; j++)
+			{
+				cv::Point2f pt1 = cv::Point2f(marker.Corners[j].X, marker.Corners[j].Y);
+				cv::Point2f pt2 = cv::Point2f(marker.Corners[(j + 1) % NumMarkerCorners].X, marker.Corners[(j + 1) % NumMarkerCorners].Y);
+				cv::line(img, pt1, pt2, cv::Scalar(0, 255, 0), 2);
 			}
 		}
+
+		return true;
 	}
+	
+	// No valid marker found
+	return false;
+}
+
+/// <summary>
+/// Finds the regions of the color frame which may hold a marker, from the contours of the downsampled frame which have
+/// the size and about the number of corners of a marker. The regions are padded, and those inside another are dropped.
+/// </summary>
+/// <param name="img">Color frame from which to detect markers</param>
+/// <param name="threshold">Threshold of the binary image, or OtsuBitThreshold</param>
+/// <param name="regions">Output regions of the candidates, in full resolution pixels</param>
+void MarkerDetector::FindCandidateRegions(cv::Mat &img, int threshold, vector<cv::Rect> &regions)
+{
+	regions.clear();
+
+	double scale = 1.0 / (1 << CandidatePyramidLevel);
+	double areaScale = scale * scale;
+
+	// Downsample the color frame before converting it, so that only the small frame is converted to grayscale
+	cv::Mat smallImg, grayImg;
+	cv::resize(img, smallImg, cv::Size(), scale, scale, cv::INTER_AREA);
+	cv::cvtColor(smallImg, grayImg, CV_BGR2GRAY);
+	Binarize(grayImg, threshold);
+
+	// The candidates only need their area and approximate corners, so the contours are compressed
+	vector<vector<cv::Point>> contours;
+	cv::findContours(grayImg, contours, CV_RETR_CCOMP, CV_CHAIN_APPROX_SIMPLE);
+
+	cv::Rect frameRect(0, 0, img.cols, img.rows);
+
+	for (unsigned int i = 0; i < contours.size(); i++)
+	{
+		double area = cv::contourArea(contours[i]);
 
-	return res;
+		if (area < MinSize * areaScale || area > MaxSize * areaScale)
+			continue;
+
+		// The corners of small markers are less reliable at low resolution, so one corner more or less is accepted
+		vector<cv::Point> corners;
+		cv::approxPolyDP(contours[i], corners, sqrt(area) * ApproxPolyCoefficient, true);
+
+		if (abs(static_cast<int>(corners.size()) - NumMarkerCorners) > 1)
+			continue;
+
+		cv::Rect box = cv::boundingRect(contours[i]);
+		int padding = (std::max)(MinCandidateRegionPadding, static_cast<int>(CandidateRegionPadding * (std::max)(box.width, box.height) / scale));
+		cv::Rect region(static_cast<int>(box.x / scale) - padding, static_cast<int>(box.y / scale) - padding,
+			static_cast<int>(box.width / scale) + 2 * padding, static_cast<int>(box.height / scale) + 2 * padding);
+		region &= frameRect;
+
+		if (region.area() == 0)
+			continue;
+
+		// The contours of a marker and of its code give nested regions, which only need to be searched once
+		bool isInsideRegion = false;
+
+		for (unsigned int j = 0; j < regions.size() && !isInsideRegion; j++)
+		{
+			isInsideRegion = (region & regions[j]) == region;
+		}
+
+		if (isInsideRegion)
+			continue;
+
+		regions.erase(remove_if(regions.begin(), regions.end(), [&region](const cv::Rect& other) { return (other & region) == other; }), regions.end());
+		regions.push_back(region);
+	}
 }
 
 /// <summary>
-/// Finds all markers in the provided 2D color frame and outputs the best detected one.
+/// Detects the markers in a region of the color frame at full resolution.
 /// </summary>
 /// <param name="img">Color frame from which to detect markers</param>
-/// <param name="marker">Output information on the detected marker</param>
-/// <returns>True if a marker was detected, false otherwise</returns>
-bool MarkerDetector::DetectMarkers(cv::Mat &img, MarkerInfo &marker)
+/// <param name="region">Region of the frame to search</param>
+/// <param name="threshold">Threshold of the binary image, or OtsuBitThreshold for that of the region</param>
+/// <param name="markers">List the detected markers are added to, with their corners in frame coordinates</param>
+void MarkerDetector::DetectMarkersInRegion(cv::Mat &img, const cv::Rect &region, int threshold, vector<MarkerInfo> &markers)
 {
-	vector<MarkerInfo> markers;
+	// The region shares the pixels of the frame
+	cv::Mat regionImg = img(region);
 
 	// Convert color image to grayscale for thresholding
 	cv::Mat grayImg, thresholdedGrayImg;
-	cv::cvtColor(img, grayImg, CV_BGR2GRAY);
+	cv::cvtColor(regionImg, grayImg, CV_BGR2GRAY);
 
 	// Apply binary thresholding to extract high-contrast areas
-	cv::threshold(grayImg, grayImg, ColorFrameBitThreshold, 255, CV_THRESH_BINARY);
+	Binarize(grayImg, threshold);
 
 	// Copy binary image for contour detection
 	grayImg.copyTo(thresholdedGrayImg);
@@ -137,7 +326,7 @@ bool MarkerDetector::DetectMarkers(cv::Mat &img, MarkerInfo &marker)
 
 			for (int i = 0; i < NumMarkerCorners; i++)
 			{
-				cornersFloat[i] = Point2f(cornersFloatDetected[i].x, cornersFloatDetected[i].y);
+				cornersFloat[i] = Point2f(cornersFloatDetected[i].x + region.x, cornersFloatDetected[i].y + region.y);
 			}
 
 			// Store detected marker info
@@ -148,47 +337,12 @@ bool MarkerDetector::DetectMarkers(cv::Mat &img, MarkerInfo &marker)
 			{
 				for (unsigned int j = 0; j < corners.size(); j++)
 				{
-					cv::circle(img, cornersFloatDetected[j], 2, cv::Scalar(0, 50 * j, 0), 1);
-					cv::line(img, cornersFloatDetected[j], cornersFloatDetected[(j + 1) % cornersFloatDetected.size()], cv::Scalar(0, 0, 255), 2);
+					cv::circle(regionImg, cornersFloatDetected[j], 2, cv::Scalar(0, 50 * j, 0), 1);
+					cv::line(regionImg, cornersFloatDetected[j], cornersFloatDetected[(j + 1) % cornersFloatDetected.size()], cv::Scalar(0, 0, 255), 2);
 				}
 			}
 		}
 	}
-
-	// If one or more markers were found, select the largest one and return it
-	if (markers.size() > 0)
-	{
-		double maxArea = 0;
-		int maxInd = 0;
-
-		// Find marker with the largest area
-		for (unsigned int i = 0; i < markers.size(); i++)
-		{
-			if (GetMarkerArea(markers[i]) > maxArea)
-			{
-				maxInd = i;
-				maxArea = GetMarkerArea(markers[i]);
-			}
-		}
-
-		marker = markers[maxInd];
-
-		// Optional: draw the final selected marker with green outline
-		if (DrawOnOriginalImage)
-		{
-			for (int j = 0; j < NumMarkerCorners; j++)
-			{
-				cv::Point2f pt1 = cv::Point2f(marker.Corners[j].X, marker.Corners[j].Y);
-				cv::Point2f pt2 = cv::Point2f(marker.Corners[(j + 1) % NumMarkerCorners].X, marker.Corners[(j + 1) % NumMarkerCorners].Y);
-				cv::line(img, pt1, pt2, cv::Scalar(0, 255, 0), 2);
-			}
-		}
-
-		return true;
-	}
-	
-	// No valid marker found
-	return false;
 }
 
 /// <summary>
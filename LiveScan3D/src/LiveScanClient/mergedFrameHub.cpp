@@ -0,0 +1,244 @@
+/***************************************************************************\
+
+Module Name:  MergedFrameHub.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module shares the merged frames of the server with the subscribers of
+the same process, such as the plugins of the server, without going through
+the transfer server. Each frame is copied once into a pooled native frame,
+which is never modified once published and is referenced, not copied, by
+every subscriber which acquires it. The publisher never waits for the
+subscribers: each of them only holds the latest frame it did not acquire,
+which a newer frame replaces, so a slow subscriber drops frames instead of
+holding back the frames of the others or the capture.
+
+\***************************************************************************/
+
+#include "mergedFrameHub.h"
+#include <windows.h>
+#include <algorithm>
+#include <chrono>
+
+// Exported by the plugins. The plugin is started with the API version of the DLL, and is only kept when it accepts
+// it; it must unsubscribe and stop its threads when it is stopped, before it is unloaded.
+typedef bool(*StartLiveScanPluginFunc)(int apiVersion);
+typedef void(*StopLiveScanPluginFunc)();
+
+/// <summary>
+/// Replaces the frame waiting for the subscriber, if any, with a newer one. The lock is only held by the subscriber
+/// to take the frame, so that the publisher never waits for the subscriber to process a frame.
+/// </summary>
+void MergedFrameSubscriber::Deliver(const std::shared_ptr<const SharedMergedFrame>& frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (isClosed)
+            return;
+
+        if (pendingFrame)
+            numDroppedFrames++;
+
+        pendingFrame = frame;
+    }
+
+    frameCond.notify_one();
+}
+
+/// <summary>
+/// Takes the latest frame published since the last one the subscriber acquired, waiting for it up to the timeout
+/// </summary>
+/// <returns>Null if no new frame was published before the timeout, or if the subscriber was closed</returns>
+std::shared_ptr<const SharedMergedFrame> MergedFrameSubscriber::Acquire(int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    frameCond.wait_for(lock, std::chrono::milliseconds((std::max)(0, timeoutMs)), [this]() { return pendingFrame || isClosed; });
+
+    return std::move(pendingFrame);
+}
+
+/// <summary>
+/// Wakes the waiting acquisitions and drops the waiting frame; the frames already acquired stay valid until released
+/// </summary>
+void MergedFrameSubscriber::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        isClosed = true;
+        pendingFrame.reset();
+    }
+
+    frameCond.notify_all();
+}
+
+uint64_t MergedFrameSubscriber::GetNumDroppedFrames() const
+{
+    return numDroppedFrames;
+}
+
+MergedFrameHub& MergedFrameHub::Instance()
+{
+    static MergedFrameHub instance;
+    return instance;
+}
+
+std::shared_ptr<MergedFrameSubscriber> MergedFrameHub::Subscribe()
+{
+    std::shared_ptr<MergedFrameSubscriber> subscriber = std::make_shared<MergedFrameSubscriber>();
+
+    std::lock_guard<std::mutex> lock(subscribersMutex);
+    subscribers.push_back(subscriber);
+    numSubscribers = static_cast<int>(subscribers.size());
+
+    return subscriber;
+}
+
+void MergedFrameHub::Unsubscribe(const std::shared_ptr<MergedFrameSubscriber>& subscriber)
+{
+    {
+        std::lock_guard<std::mutex> lock(subscribersMutex);
+        subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), subscriber), subscribers.end());
+        numSubscribers = static_cast<int>(subscribers.size());
+    }
+
+    subscriber->Close();
+}
+
+/// <summary>
+/// Tells whether any subscriber would get a published frame, so that the publisher skips the copy when none would
+/// </summary>
+bool MergedFrameHub::HasSubscribers() const
+{
+    return numSubscribers > 0;
+}
+
+/// <summary>
+/// Copies a merged frame into a pooled frame and hands it to every subscriber. Only called by the thread which
+/// publishes the frames of the server.
+/// </summary>
+/// <param name="normals">Octahedral normal of each vertex; null when the frame has none</param>
+/// <param name="indices">Three vertex indices for each triangle when the frame is a mesh; null otherwise</param>
+/// <param name="cameraVertexCounts">Vertices of each camera, one camera after the other</param>
+void MergedFrameHub::Publish(const float* vertices, const uint8_t* colors, const uint8_t* normals, int numVertices, const int* indices, int numTriangles,
+    const int* cameraVertexCounts, int numCameras, uint64_t version, int64_t captureTimeUs)
+{
+    std::vector<std::shared_ptr<MergedFrameSubscriber>> receivers;
+
+    {
+        std::lock_guard<std::mutex> lock(subscribersMutex);
+        receivers = subscribers;
+    }
+
+    if (receivers.empty())
+        return;
+
+    numVertices = (std::max)(0, numVertices);
+    numTriangles = indices ? (std::max)(0, numTriangles) : 0;
+    numCameras = cameraVertexCounts ? (std::max)(0, numCameras) : 0;
+
+    // The frame is not shared until it is delivered, so it is filled without any lock
+    std::shared_ptr<SharedMergedFrame> frame = AcquireFreeFrame();
+    frame->Version = version;
+    frame->CaptureTimeUs = captureTimeUs;
+    frame->Vertices.assign(vertices, vertices + 3 * static_cast<size_t>(numVertices));
+    frame->Colors.assign(colors, colors + 3 * static_cast<size_t>(numVertices));
+
+    if (normals)
+        frame->Normals.assign(normals, normals + numVertices);
+    else
+        frame->Normals.clear();
+
+    frame->Indices.assign(indices, indices + 3 * static_cast<size_t>(numTriangles));
+    frame->CameraVertexCounts.assign(cameraVertexCounts, cameraVertexCounts + numCameras);
+
+    std::shared_ptr<const SharedMergedFrame> publishedFrame = std::move(frame);
+
+    for (const auto& subscriber : receivers)
+        subscriber->Deliver(publishedFrame);
+}
+
+/// <summary>
+/// Returns a frame of the pool which no subscriber holds any more, or a new frame when they are all held; its buffers
+/// keep their capacity from the previous frames
+/// </summary>
+std::shared_ptr<SharedMergedFrame> MergedFrameHub::AcquireFreeFrame()
+{
+    for (auto& frame : framePool)
+    {
+        if (frame.use_count() == 1)
+            return frame;
+    }
+
+    std::shared_ptr<SharedMergedFrame> frame = std::make_shared<SharedMergedFrame>();
+
+    if (framePool.size() < MaxPooledFrames)
+        framePool.push_back(frame);
+
+    return frame;
+}
+
+/// <summary>
+/// Loads the DLLs of a directory which export StartLiveScanPlugin and StopLiveScanPlugin, and starts them. The plugins
+/// link to this DLL, whose subscriber API they call from their own threads.
+/// </summary>
+/// <returns>The number of plugins started</returns>
+int MergedFrameHub::LoadPlugins(const std::string& directory)
+{
+    std::lock_guard<std::mutex> lock(pluginsMutex);
+
+    WIN32_FIND_DATAA findData;
+    HANDLE find = FindFirstFileA((directory + "\\*.dll").c_str(), &findData);
+
+    if (find == INVALID_HANDLE_VALUE)
+        return 0;
+
+    int numStarted = 0;
+
+    do
+    {
+        HMODULE module = LoadLibraryA((directory + "\\" + findData.cFileName).c_str());
+
+        if (!module)
+            continue;
+
+        auto start = reinterpret_cast<StartLiveScanPluginFunc>(GetProcAddress(module, "StartLiveScanPlugin"));
+        auto stop = reinterpret_cast<StopLiveScanPluginFunc>(GetProcAddress(module, "StopLiveScanPlugin"));
+
+        if (!start || !stop || !start(MergedFrameApiVersion))
+        {
+            FreeLibrary(module);
+            continue;
+        }
+
+        plugins.push_back(module);
+        numStarted++;
+    } while (FindNextFileA(find, &findData));
+
+    FindClose(find);
+
+    return numStarted;
+}
+
+/// <summary>
+/// Stops the plugins in the reverse order they were started, then unloads them
+/// </summary>
+void MergedFrameHub::UnloadPlugins()
+{
+    std::lock_guard<std::mutex> lock(pluginsMutex);
+
+    for (auto plugin = plugins.rbegin(); plugin != plugins.rend(); ++plugin)
+    {
+        HMODULE module = static_cast<HMODULE>(*plugin);
+        auto stop = reinterpret_cast<StopLiveScanPluginFunc>(GetProcAddress(module, "StopLiveScanPlugin"));
+
+        if (stop)
+            stop();
+
+        FreeLibrary(module);
+    }
+
+    plugins.clear();
+}
@@ -0,0 +1,208 @@
+/***************************************************************************\
+
+Module Name:  NormalEstimator.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module estimates the normal of the points from their neighbours in the
+depth image, without any search in 3D: the points of a frame are scattered
+back into image-sized coordinate planes, and the normal of a point is the
+cross product of the differences with its neighbours along the rows and the
+columns of the image. The normals face the camera and are quantized to one
+byte, as an octahedral direction with 4 bits per axis.
+
+\***************************************************************************/
+
+#include "normalEstimator.h"
+#include "memoryUsage.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+/// <summary>
+/// Scatters the points of a frame into the coordinate planes, for the normals of its points to be estimated
+/// </summary>
+/// <param name="points">Points of the frame, with valid pixel indices; all of them are used as neighbours</param>
+/// <param name="imageWidth">Width of the depth image the points come from</param>
+/// <param name="imageHeight">Height of the depth image the points come from</param>
+/// <param name="viewOrigin">Position of the camera, in the space of the points, which the normals are turned towards</param>
+/// <param name="newRotation">Rotation applied to the normals, in the 3x3 part of a 3x4 transform; null to keep them in the space of the points</param>
+void NormalEstimator::Prepare(const PointBuffer& points, int imageWidth, int imageHeight, const float viewOrigin[3], const float (*newRotation)[4])
+{
+    const float Empty = std::numeric_limits<float>::infinity();
+
+    if (imageWidth != width || imageHeight != height || gridX.empty())
+    {
+        width = imageWidth;
+        height = imageHeight;
+        gridX.assign(static_cast<size_t>(width) * height, Empty);
+        gridY.assign(static_cast<size_t>(width) * height, 0.0f);
+        gridZ.assign(static_cast<size_t>(width) * height, 0.0f);
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        origin[i] = viewOrigin[i];
+
+        for (int j = 0; j < 3; j++)
+            rotation[i][j] = newRotation ? newRotation[i][j] : (i == j ? 1.0f : 0.0f);
+    }
+
+    for (size_t i = 0; i < points.Size(); i++)
+    {
+        int pixelIndex = points.PixelIndices[i];
+        gridX[pixelIndex] = points.X[i];
+        gridY[pixelIndex] = points.Y[i];
+        gridZ[pixelIndex] = points.Z[i];
+    }
+}
+
+/// <summary>
+/// Clears the pixels of the points passed to Prepare, which must be the same
+/// </summary>
+void NormalEstimator::Clear(const PointBuffer& points)
+{
+    const float Empty = std::numeric_limits<float>::infinity();
+
+    for (size_t i = 0; i < points.Size(); i++)
+        gridX[points.PixelIndices[i]] = Empty;
+}
+
+size_t NormalEstimator::GetMemoryUsage() const
+{
+    return GetCapacityBytes(gridX) + GetCapacityBytes(gridY) + GetCapacityBytes(gridZ);
+}
+
+/// <summary>
+/// Releases the coordinate planes, while the normals are not estimated
+/// </summary>
+void NormalEstimator::ReleaseMemory()
+{
+    ReleaseCapacity(gridX);
+    ReleaseCapacity(gridY);
+    ReleaseCapacity(gridZ);
+    width = 0;
+    height = 0;
+}
+
+/// <summary>
+/// Estimates the normal of the point of a pixel prepared by Prepare
+/// </summary>
+/// <returns>The quantized normal, facing the camera; NoNormal if the point has too few neighbours</returns>
+uint8_t NormalEstimator::GetNormal(int pixelIndex) const
+{
+    int u = pixelIndex % width;
+    int v = pixelIndex / width;
+    float center[3] = { gridX[pixelIndex], gridY[pixelIndex], gridZ[pixelIndex] };
+    float tangentU[3], tangentV[3];
+
+    if (!GetTangent(u, v, 1, 0, center, tangentU) || !GetTangent(u, v, 0, 1, center, tangentV))
+        return NoNormal;
+
+    float normal[3] = {
+        tangentU[1] * tangentV[2] - tangentU[2] * tangentV[1],
+        tangentU[2] * tangentV[0] - tangentU[0] * tangentV[2],
+        tangentU[0] * tangentV[1] - tangentU[1] * tangentV[0]
+    };
+
+    // The rows and the columns of the image are not oriented the same way in every space, so the side of the surface is
+    // given by the camera
+    float towardsCamera = 0.0f;
+
+    for (int i = 0; i < 3; i++)
+        towardsCamera += normal[i] * (origin[i] - center[i]);
+
+    float sign = towardsCamera < 0.0f ? -1.0f : 1.0f;
+    float rotated[3];
+
+    for (int i = 0; i < 3; i++)
+        rotated[i] = sign * (rotation[i][0] * normal[0] + rotation[i][1] * normal[1] + rotation[i][2] * normal[2]);
+
+    return EncodeNormal(rotated[0], rotated[1], rotated[2]);
+}
+
+/// <summary>
+/// Quantizes a direction to one byte: the direction is projected onto the octahedron, whose lower half is folded over
+/// the upper one, and each of its two coordinates is quantized to NumLevels values, in the high and low 4 bits
+/// </summary>
+/// <returns>The quantized direction; NoNormal if it is null</returns>
+uint8_t NormalEstimator::EncodeNormal(float x, float y, float z)
+{
+    float length = std::abs(x) + std::abs(y) + std::abs(z);
+
+    if (!(length > 0.0f))
+        return NoNormal;
+
+    float octX = x / length;
+    float octY = y / length;
+
+    if (z < 0.0f)
+    {
+        float foldedX = (1.0f - std::abs(octY)) * (octX >= 0.0f ? 1.0f : -1.0f);
+        float foldedY = (1.0f - std::abs(octX)) * (octY >= 0.0f ? 1.0f : -1.0f);
+        octX = foldedX;
+        octY = foldedY;
+    }
+
+    const float maxLevel = NumLevels - 1.0f;
+    int levelX = static_cast<int>(std::floor((octX * 0.5f + 0.5f) * maxLevel + 0.5f));
+    int levelY = static_cast<int>(std::floor((octY * 0.5f + 0.5f) * maxLevel + 0.5f));
+    levelX = (std::min)((std::max)(levelX, 0), NumLevels - 1);
+    levelY = (std::min)((std::max)(levelY, 0), NumLevels - 1);
+
+    return static_cast<uint8_t>((levelX << 4) | levelY);
+}
+
+/// <summary>
+/// Finds the nearest point of a direction of the image which is close enough to the center to be on the same surface
+/// </summary>
+bool NormalEstimator::FindNeighbour(int u, int v, int stepU, int stepV, const float center[3], float neighbour[3]) const
+{
+    for (int step = 1; step <= WindowRadius; step++)
+    {
+        int neighbourU = u + step * stepU;
+        int neighbourV = v + step * stepV;
+
+        if (neighbourU < 0 || neighbourU >= width || neighbourV < 0 || neighbourV >= height)
+            return false;
+
+        size_t index = static_cast<size_t>(neighbourV) * width + neighbourU;
+        float dx = gridX[index] - center[0];
+        float dy = gridY[index] - center[1];
+        float dz = gridZ[index] - center[2];
+        float maxDistance = MaxNeighbourDistance * step;
+
+        // The empty pixels have an infinite distance
+        if (dx * dx + dy * dy + dz * dz <= maxDistance * maxDistance)
+        {
+            neighbour[0] = gridX[index];
+            neighbour[1] = gridY[index];
+            neighbour[2] = gridZ[index];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// <summary>
+/// Computes the tangent of the surface along a direction of the image, from the neighbours on both sides of the point,
+/// or from the point and its neighbour on one side at the borders of the surface
+/// </summary>
+/// <returns>False if the point has no neighbour in that direction</returns>
+bool NormalEstimator::GetTangent(int u, int v, int stepU, int stepV, const float center[3], float tangent[3]) const
+{
+    float after[3], before[3];
+    bool isAfterFound = FindNeighbour(u, v, stepU, stepV, center, after);
+    bool isBeforeFound = FindNeighbour(u, v, -stepU, -stepV, center, before);
+
+    if (!isAfterFound && !isBeforeFound)
+        return false;
+
+    for (int i = 0; i < 3; i++)
+        tangent[i] = (isAfterFound ? after[i] : center[i]) - (isBeforeFound ? before[i] : center[i]);
+
+    return true;
+}
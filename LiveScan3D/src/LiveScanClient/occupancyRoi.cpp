@@ -0,0 +1,139 @@
+/***************************************************************************\
+
+Module Name:  OccupancyRoi.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module finds the region of the depth frames the points are generated
+from, which follows the content of the bounds rather than the whole box: it
+is the bounding box of the pixels of the points kept over the last frames,
+plus a margin. The region grows back to the border of the frame on the next
+frame on each side where the content reaches its edge, and the whole frame
+is processed at intervals, so that content appearing elsewhere is still seen.
+
+\***************************************************************************/
+
+#include "occupancyRoi.h"
+#include <algorithm>
+
+// Forgets the content of the previous frames; the next frame is processed whole
+void OccupancyRoi::Reset() {
+    width = 0;
+    height = 0;
+    nextBox = 0;
+    numFramesSinceProbe = 0;
+
+    for (int i = 0; i < HistoryFrames; i++) {
+        for (int j = 0; j < 4; j++)
+            boxes[i][j] = 0;
+    }
+
+    for (int j = 0; j < 4; j++)
+        region[j] = 0;
+}
+
+void OccupancyRoi::GetRegion(int outRegion[4]) const {
+    for (int j = 0; j < 4; j++)
+        outRegion[j] = region[j];
+}
+
+/// <summary>
+/// Adds the points kept from a frame to the content, and finds the region of the next frame. A change of the size of
+/// the frames starts again from the whole frame.
+/// </summary>
+/// <param name="pixelIndices">Depth pixel of each point kept (v * frameWidth + u), mostly in increasing order</param>
+/// <param name="processedRegion">Region the frame was processed in, as returned by GetRegion; empty for the whole frame</param>
+void OccupancyRoi::Update(const int* pixelIndices, size_t numPoints, int frameWidth, int frameHeight, const int processedRegion[4]) {
+    if (frameWidth != width || frameHeight != height) {
+        Reset();
+        width = frameWidth;
+        height = frameHeight;
+    }
+
+    int processed[4] = { 0, 0, width, height };
+
+    if (processedRegion[2] > processedRegion[0] && processedRegion[3] > processedRegion[1]) {
+        for (int j = 0; j < 4; j++)
+            processed[j] = processedRegion[j];
+    }
+
+    // The points follow the rows of the depth frame, so the row only needs a division when it changes
+    int left = width, top = height, right = 0, bottom = 0;
+    int rowStart = 0;
+    int row = 0;
+
+    for (size_t i = 0; i < numPoints; i++) {
+        int pixelIndex = pixelIndices[i];
+
+        if (pixelIndex < rowStart || pixelIndex >= rowStart + width) {
+            row = pixelIndex / width;
+            rowStart = row * width;
+        }
+
+        int column = pixelIndex - rowStart;
+        left = (std::min)(left, column);
+        right = (std::max)(right, column + 1);
+        top = (std::min)(top, row);
+        bottom = (std::max)(bottom, row + 1);
+    }
+
+    int* box = boxes[nextBox];
+    box[0] = left;
+    box[1] = top;
+    box[2] = right;
+    box[3] = bottom;
+    nextBox = (nextBox + 1) % HistoryFrames;
+
+    // Union of the content of the recent frames
+    int content[4] = { width, height, 0, 0 };
+
+    for (int i = 0; i < HistoryFrames; i++) {
+        if (boxes[i][2] <= boxes[i][0] || boxes[i][3] <= boxes[i][1])
+            continue;
+
+        content[0] = (std::min)(content[0], boxes[i][0]);
+        content[1] = (std::min)(content[1], boxes[i][1]);
+        content[2] = (std::max)(content[2], boxes[i][2]);
+        content[3] = (std::max)(content[3], boxes[i][3]);
+    }
+
+    // Without content, anything may appear anywhere
+    bool isProbeDue = ++numFramesSinceProbe >= ProbeIntervalFrames;
+
+    if (content[2] <= content[0] || content[3] <= content[1] || isProbeDue) {
+        region[0] = 0;
+        region[1] = 0;
+        region[2] = width;
+        region[3] = height;
+        numFramesSinceProbe = 0;
+        return;
+    }
+
+    int marginX = (std::max)(1, width / MarginRatio);
+    int marginY = (std::max)(1, height / MarginRatio);
+    region[0] = (std::max)(0, content[0] - marginX);
+    region[1] = (std::max)(0, content[1] - marginY);
+    region[2] = (std::min)(width, content[2] + marginX);
+    region[3] = (std::min)(height, content[3] + marginY);
+
+    // The content which reached a side of the region of this frame may go on beyond it, so the region grows back to
+    // the border of the frame on that side
+    if (right > left && bottom > top) {
+        if (processed[0] > 0 && left < processed[0] + marginX / 2)
+            region[0] = 0;
+
+        if (processed[1] > 0 && top < processed[1] + marginY / 2)
+            region[1] = 0;
+
+        if (processed[2] < width && right > processed[2] - marginX / 2)
+            region[2] = width;
+
+        if (processed[3] < height && bottom > processed[3] - marginY / 2)
+            region[3] = height;
+    }
+
+    if (region[0] == 0 && region[1] == 0 && region[2] == width && region[3] == height)
+        numFramesSinceProbe = 0;
+}
@@ -17,10 +17,13 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 \***************************************************************************/
 
 #include "orbbecCaptureManager.h"
+#include "deviceRegistry.h"
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <vector>
 #include <thread>
@@ -28,22 +31,36 @@ Kowalski, M.; Naruniec, J.; Daniluk, M.: "LiveScan3D: A Fast and Inexpensive
 
 OrbbecCaptureManager::OrbbecCaptureManager(int deviceIndex) : deviceIndex(deviceIndex), lastFrameTime(0)
 {
+    pointCloudKernel = SelectPointCloudKernel();
+
     documentDetector = std::make_unique<DocumentDetector>();
 
     documentDetector->SetDetectionCallback([=](const DetectionResult& result) {
         // Save the new detection result
         lastDocumentHeight = result.height;
         lastDocumentWidth = result.width;
-        lastDocumentData = result.data;
+        lastDocumentJpeg = result.jpeg;
         lastDocumentScore = result.score;
+        lastDocumentSignature = result.signature;
+        lastDocumentRegion = result.region;
         hasNewDocument = true;
+
+        // Crops of a low resolution color stream are blurry; ask for a few high resolution frames
+        if (colorStreamSettings.isDocumentBurstEnabled && !isDocumentBurstActive && colorFrameWidth < HighResolutionColorWidth) {
+            isDocumentBurstRequested = true;
+        }
     });
 }
 
 OrbbecCaptureManager::~OrbbecCaptureManager()
 {
+    if (deviceListenerId != -1) {
+        DeviceRegistry::Instance().RemoveDeviceListener(deviceListenerId);
+    }
+
     // Release the device and stop the pipeline
     Close();
+    StopCapture();
 }
 
 /// <summary>
@@ -53,6 +70,8 @@ OrbbecCaptureManager::~OrbbecCaptureManager()
 void OrbbecCaptureManager::SetLogger(std::function<void(const std::string&)> loggerFunc) {
     logFn = loggerFunc;
 
+    if (logFn) logFn("[OrbbecCaptureManager] Using " + std::string(GetPointCloudKernelName(pointCloudKernel)) + " point cloud kernel");
+
     // Propagate to document detector
     documentDetector->SetLogger(loggerFunc);
 }
@@ -66,34 +85,147 @@ void OrbbecCaptureManager::SetLogger(std::function<void(const std::string&)> log
 /// <returns></returns>
 bool OrbbecCaptureManager::Initialize(SyncState state, int syncOffsetMultiplier)
 {
+    DeviceRegistry& registry = DeviceRegistry::Instance();
     bool res = TryOpenDevice();
 
     if (!res)
     {
+        // Do not hold back the cameras which did open
+        registry.ArriveAtStartup();
         isInitialized = false;
         return isInitialized;
     }
 
-    // Set sync configuration on the device
-    OBMultiDeviceSyncConfig syncConfig = device->getMultiDeviceSyncConfig();
+    // Create a pipeline with the current device
+    pipeline = std::make_shared<ob::Pipeline>(device);
+
+    StartStreaming(state, syncOffsetMultiplier);
+
+    // At startup, wait for the pipelines of all the cameras to be started so that they warm up together
+    registry.ArriveAtStartup();
 
-    if (state == Master) {
-        syncConfig.syncMode = OB_MULTI_DEVICE_SYNC_MODE_PRIMARY;
+    if (!registry.WaitForStartup(StartupBarrierTimeoutMs)) {
+        if (logFn) logFn("[OrbbecCaptureManager] Timed out waiting for the other devices to start");
     }
-    else if (state == Subordinate) {
-        syncConfig.syncMode = OB_MULTI_DEVICE_SYNC_MODE_SECONDARY;
-        syncConfig.trigger2ImageDelayUs = SyncDelayUs * syncOffsetMultiplier;
+
+    // Wait a bit before starting capture
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // Check that the device is able to capture a frame in under 5 seconds
+    // If this device is a subordinate, it only starts capturing when the master has started, so skip this check
+    if (state != Subordinate) {
+        auto start = std::chrono::system_clock::now();
+        bool bTemp;
+
+        do {
+            bTemp = AcquireFrame(false);
+            auto elapsedSeconds = std::chrono::duration<double>(std::chrono::system_clock::now() - start);
+
+            if (elapsedSeconds.count() > 5.0) {
+                StopCapture();
+                isInitialized = false;
+                break;
+            }
+        } 
+        while (!bTemp);
     }
-    else {
-        syncConfig.syncMode = OB_MULTI_DEVICE_SYNC_MODE_STANDALONE;
+
+    return isInitialized;
+}
+
+/// <summary>
+/// Applies the sync configuration to the opened device and starts its pipeline. Used by Initialize and to switch the
+/// sync mode of a running device, which only requires restarting the pipeline.
+/// </summary>
+/// <param name="state">Sync State with which to start the device</param>
+/// <param name="syncOffsetMultiplier">Multiplier of the capture offset of a subordinate device</param>
+/// <returns>True if the pipeline was started; false otherwise.</returns>
+bool OrbbecCaptureManager::StartStreaming(SyncState state, int syncOffsetMultiplier)
+{
+    if (!device || !pipeline) {
+        return false;
     }
 
-    device->setMultiDeviceSyncConfig(syncConfig);
+    try {
+        // Set sync configuration on the device
+        OBMultiDeviceSyncConfig syncConfig = device->getMultiDeviceSyncConfig();
+
+        if (state == Master) {
+            syncConfig.syncMode = OB_MULTI_DEVICE_SYNC_MODE_PRIMARY;
+        }
+        else if (state == Subordinate) {
+            syncConfig.syncMode = OB_MULTI_DEVICE_SYNC_MODE_SECONDARY;
+            syncConfig.trigger2ImageDelayUs = SyncDelayUs * syncOffsetMultiplier;
+        }
+        else {
+            syncConfig.syncMode = OB_MULTI_DEVICE_SYNC_MODE_STANDALONE;
+        }
+
+        device->setMultiDeviceSyncConfig(syncConfig);
 
-    // Create a pipeline with the current device
-    pipeline = std::make_shared<ob::Pipeline>(device);
+        // Create a configuration to set color and depth sensor parameters
+        isDocumentBurstActive = false;
+        isDepthBinned = isDepthBinningRequested;
+        std::shared_ptr<ob::Config> config = CreatePipelineConfig();
+
+        // Start the pipeline with the new configuration
+        StartCapture(config);
+        isInitialized = true;
+
+        // The stream profile may have changed; rebuild the unprojection rays on the next frame and restart the
+        // temporal depth smoothing
+        depthRayTable.clear();
+        rayTableWidth = 0;
+        rayTableHeight = 0;
+        depthHistory.clear();
+    }
+    catch (const ob::Error& e) {
+        if (logFn) logFn("[OrbbecCaptureManager] Failed to start pipeline: " + std::string(e.getMessage()));
+        isInitialized = false;
+    }
+
+    if (isInitialized && autoExposureEnabled == false) {
+        SetExposureState(false, exposureTimeStep);
+    }
+
+    return isInitialized;
+}
+
+/// <summary>
+/// Stops the pipeline but keeps the device open, so that it can be started again with another sync configuration
+/// without querying the devices again
+/// </summary>
+/// <returns>True if the pipeline was stopped; false if it was not running.</returns>
+bool OrbbecCaptureManager::StopStreaming()
+{
+    if (!isInitialized || !pipeline) {
+        return false;
+    }
+
+    try {
+        // Release the frames held by this instance before stopping the pipeline that owns them
+        StopCapture();
+        currentColorFrame.reset();
+        currentDepthFrame.reset();
+        colorData = nullptr;
+        depthData = nullptr;
+
+        pipeline->stop();
+        isInitialized = false;
+        return true;
+    }
+    catch (const ob::Error& e) {
+        if (logFn) logFn("[OrbbecCaptureManager] Failed to stop pipeline: " + std::string(e.getMessage()));
+        return false;
+    }
+}
 
-    // Create a configuration to set color and depth sensor parameters
+/// <summary>
+/// Creates the pipeline configuration of the color and depth streams. The color stream uses the requested profile, or
+/// the closest available one, and the high resolution profile during a document burst.
+/// </summary>
+std::shared_ptr<ob::Config> OrbbecCaptureManager::CreatePipelineConfig()
+{
     auto config = std::make_shared<ob::Config>();
 
     // Configure color stream
@@ -101,18 +233,32 @@ bool OrbbecCaptureManager::Initialize(SyncState state, int syncOffsetMultiplier)
     std::shared_ptr <ob::VideoStreamProfile> colorProfile;
 
     if (colorProfiles) {
-        try {
-            // Find the corresponding Profile according to the specified format
-            colorProfile = colorProfiles->getVideoStreamProfile(2560, 1440, OB_FORMAT_RGB888, 30);
+        if (isDocumentBurstActive) {
+            colorProfile = SelectColorProfile(colorProfiles, HighResolutionColorWidth, HighResolutionColorHeight, false, false);
         }
-        catch (ob::Error& e) {
-            // If the specified format is not found, select the first one (default stream profile)
-            colorProfile = std::const_pointer_cast<ob::StreamProfile>(colorProfiles->getProfile(OB_PROFILE_DEFAULT))->as<ob::VideoStreamProfile>();
+        else {
+            colorProfile = SelectColorProfile(colorProfiles, colorStreamSettings.width, colorStreamSettings.height,
+                colorStreamSettings.isMjpg, colorStreamSettings.isYuv);
         }
     }
 
     config->enableStream(colorProfile);
 
+    // The capture thread is not running yet, so the decoder can be replaced when it has to decode to another format
+    bool isDecodedToYuv = !isDocumentBurstActive && colorStreamSettings.isYuv;
+
+    if (isDecodedToYuv != isColorDecodedToYuv) {
+        mjpgDecoder.reset();
+        isColorDecodedToYuv = isDecodedToYuv;
+    }
+
+    if (colorProfile && logFn) {
+        OBFormat format = colorProfile->format();
+        std::string formatName = format == OB_FORMAT_MJPG ? " MJPG" : format == OB_FORMAT_YUYV ? " YUYV" : format == OB_FORMAT_NV12 ? " NV12" : "";
+        logFn("[OrbbecCaptureManager] Using " + std::to_string(colorProfile->width()) + "x" + std::to_string(colorProfile->height())
+            + formatName + " color stream");
+    }
+
     // Configure depth stream
     std::shared_ptr<ob::StreamProfileList> depthProfileList;
     OBAlignMode alignMode = ALIGN_DISABLE;
@@ -123,8 +269,18 @@ bool OrbbecCaptureManager::Initialize(SyncState state, int syncOffsetMultiplier)
         std::shared_ptr<ob::StreamProfile> depthProfile;
         try {
             // Select the profile with the same frame rate as color and the specified parameters
-            if (colorProfile) {
-                depthProfile = depthProfileList->getVideoStreamProfile(640, 576, OB_FORMAT_Y16, colorProfile->fps());
+            if (colorProfile && isDepthBinned) {
+                depthProfile = depthProfileList->getVideoStreamProfile(BinnedDepthWidth, BinnedDepthHeight, OB_FORMAT_Y16, colorProfile->fps());
+            }
+        }
+        catch (...) {
+            if (logFn) logFn("[OrbbecCaptureManager] Binned depth profile is not available, using the full resolution one");
+            depthProfile = nullptr;
+        }
+
+        try {
+            if (colorProfile && !depthProfile) {
+                depthProfile = depthProfileList->getVideoStreamProfile(DepthWidth, DepthHeight, OB_FORMAT_Y16, colorProfile->fps());
             }
         }
         catch (...) {
@@ -142,42 +298,136 @@ bool OrbbecCaptureManager::Initialize(SyncState state, int syncOffsetMultiplier)
     // Enable D2C alignment to generate RGBD point clouds
     config->setAlignMode(alignMode);
 
-    // Start the pipeline with the new configuration
+    return config;
+}
+
+/// <summary>
+/// Finds the color stream profile to use: the requested resolution in the requested format, then in the other formats,
+/// then the other supported resolutions from the closest to the requested one, and finally the default profile. The
+/// YUV formats come before RGB888 when they are requested, and after MJPG when it is requested too, since MJPG is then
+/// decoded to NV12.
+/// </summary>
+std::shared_ptr<ob::VideoStreamProfile> OrbbecCaptureManager::SelectColorProfile(std::shared_ptr<ob::StreamProfileList> colorProfiles, int width, int height, bool isMjpg, bool isYuv)
+{
+    static const int Resolutions[][2] = { { 2560, 1440 }, { 1920, 1080 }, { 1280, 720 } };
+
+    std::vector<std::pair<int, int>> candidates = { { width, height } };
+
+    for (const auto& resolution : Resolutions) {
+        if (resolution[0] != width || resolution[1] != height) {
+            candidates.push_back({ resolution[0], resolution[1] });
+        }
+    }
+
+    std::stable_sort(candidates.begin() + 1, candidates.end(), [width, height](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+        return std::abs(a.first * a.second - width * height) < std::abs(b.first * b.second - width * height);
+    });
+
+    std::vector<OBFormat> formats;
+
+    if (isMjpg) {
+        formats.push_back(OB_FORMAT_MJPG);
+    }
+
+    if (isYuv) {
+        formats.push_back(OB_FORMAT_YUYV);
+        formats.push_back(OB_FORMAT_NV12);
+    }
+
+    formats.push_back(OB_FORMAT_RGB888);
+
+    if (!isMjpg) {
+        formats.push_back(OB_FORMAT_MJPG);
+    }
+
+    for (const auto& candidate : candidates) {
+        for (OBFormat format : formats) {
+            try {
+                return colorProfiles->getVideoStreamProfile(candidate.first, candidate.second, format, 30);
+            }
+            catch (ob::Error&) {
+                // Not supported by this camera, try the next one
+            }
+        }
+    }
+
+    // If none of the profiles is found, select the first one (default stream profile)
+    if (logFn) logFn("[OrbbecCaptureManager] Requested color profile is not available, using the default one");
+    return std::const_pointer_cast<ob::StreamProfile>(colorProfiles->getProfile(OB_PROFILE_DEFAULT))->as<ob::VideoStreamProfile>();
+}
+
+/// <summary>
+/// Restarts the pipeline with a new color stream configuration, keeping the sync configuration of the device
+/// </summary>
+/// <returns>True if the pipeline was restarted; false otherwise.</returns>
+bool OrbbecCaptureManager::RestartPipeline()
+{
     try {
-        pipeline->start(config);
-        isInitialized = true;
+        // Release the frames held by this instance before stopping the pipeline that owns them
+        StopCapture();
+        currentColorFrame.reset();
+        currentDepthFrame.reset();
+        colorData = nullptr;
+        depthData = nullptr;
+
+        pipeline->stop();
+        StartCapture(CreatePipelineConfig());
+
+        // The color intrinsics changed with the profile; rebuild the camera parameters on the next frame
+        depthRayTable.clear();
+        rayTableWidth = 0;
+        rayTableHeight = 0;
+
+        return true;
     }
     catch (const ob::Error& e) {
-        if (logFn) logFn("[OrbbecCaptureManager] Failed to start pipeline: " + std::string(e.getMessage()));
-        isInitialized = false;
+        if (logFn) logFn("[OrbbecCaptureManager] Failed to restart pipeline: " + std::string(e.getMessage()));
+        return false;
     }
+}
 
-    if (autoExposureEnabled == false) {
-        SetExposureState(false, exposureTimeStep);
-    }
+/// <summary>
+/// Starts a document burst when the document detection asked for sharper crops, and ends it after its duration. The
+/// pipeline is restarted each time, so bursts are spaced by a cooldown.
+/// </summary>
+void OrbbecCaptureManager::UpdateDocumentBurst()
+{
+    auto now = std::chrono::steady_clock::now();
 
-    // Wait a bit before starting capture
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    if (!isDocumentBurstActive && isDocumentBurstRequested) {
+        isDocumentBurstRequested = false;
 
-    // Check that the device is able to capture a frame in under 5 seconds
-    // If this device is a subordinate, it only starts capturing when the master has started, so skip this check
-    if (state != Subordinate) {
-        auto start = std::chrono::system_clock::now();
-        bool bTemp;
+        if (now - documentBurstEndTime < std::chrono::milliseconds(DocumentBurstCooldownMs)) {
+            return;
+        }
 
-        do {
-            bTemp = AcquireFrame(false);
-            auto elapsedSeconds = std::chrono::duration<double>(std::chrono::system_clock::now() - start);
+        isDocumentBurstActive = true;
+        documentBurstEndTime = now + std::chrono::milliseconds(DocumentBurstDurationMs);
 
-            if (elapsedSeconds.count() > 5.0) {
-                isInitialized = false;
-                break;
-            }
-        } 
-        while (!bTemp);
+        if (logFn) logFn("[OrbbecCaptureManager] Starting high resolution document burst");
+        RestartPipeline();
+    }
+    else if (isDocumentBurstActive && now >= documentBurstEndTime) {
+        isDocumentBurstActive = false;
+        documentBurstEndTime = now;
+        RestartPipeline();
     }
+}
 
-    return isInitialized;
+/// <summary>
+/// Switches the depth stream to the binning requested by the client. The pipeline is restarted, which rebuilds the
+/// unprojection rays and the buffers of the new resolution on the next frame, but keeps the device open.
+/// </summary>
+void OrbbecCaptureManager::UpdateDepthBinning()
+{
+    if (isDepthBinningRequested == isDepthBinned) {
+        return;
+    }
+
+    isDepthBinned = isDepthBinningRequested;
+
+    if (logFn) logFn(std::string("[OrbbecCaptureManager] Switching to the ") + (isDepthBinned ? "binned" : "full resolution") + " depth stream");
+    RestartPipeline();
 }
 
 /// <summary>
@@ -187,80 +437,133 @@ bool OrbbecCaptureManager::Initialize(SyncState state, int syncOffsetMultiplier)
 /// <returns>True if a frame was acquired successfully; false otherwise.</returns>
 bool OrbbecCaptureManager::AcquireFrame(bool isCalibrationDataRequested)
 {
+    // A lost device is closed by the thread which uses it, then reopened by RecoverDevice
+    if (isDeviceLost) {
+        if (isInitialized) {
+            if (logFn) logFn("[OrbbecCaptureManager] Device " + serialNumber + " was lost, closing it until it can be reopened");
+            ReleaseDevice();
+        }
+
+        return false;
+    }
+
     if (!isInitialized || !pipeline) {
         return false;
     }
 
+    UpdateDocumentBurst();
+    UpdateDepthBinning();
+
     try {
-        // Wait for a frameset (color + depth)
-        std::shared_ptr<ob::FrameSet> frameset = pipeline->waitForFrames(CaptureTimeoutMs);
+        // Take the latest pair of color and depth frames received from the pipeline
+        PerfTimer waitTimer(perfStats, FrameWaitStage);
+        CapturedFrameset captured = PopLatestFrameset();
 
-        if (!frameset || !frameset->colorFrame() || !frameset->depthFrame() || (frameset->colorFrame()->globalTimeStampUs() != frameset->depthFrame()->globalTimeStampUs())) {
-            return false;
+        // A staggered camera starts processing at its phase of the frame period; the wait is not busy time, so it is
+        // measured with the wait for the frame
+        float phase = processingPhase;
+
+        if (phase > 0.0f && captured.depthFrame) {
+            auto delay = std::chrono::microseconds(static_cast<int64_t>(phase * captured.framePeriodUs));
+            std::this_thread::sleep_until(captured.arrivalTime + delay);
         }
 
-        // Get color and depth frames
-        auto colorFrame = frameset->colorFrame();
-        auto depthFrame = frameset->depthFrame();
+        waitTimer.Stop();
+        std::shared_ptr<ob::FrameSet> frameset = captured.frameset;
+
+        if (!captured.depthFrame) {
+            return false;
+        }
 
-        int colorWidth = colorFrame->width();
-        int colorHeight = colorFrame->height();
+        // Get color and depth frames; compressed color frames were already decoded by the capture thread
+        auto colorFrame = captured.colorFrame;
+        auto depthFrame = captured.depthFrame;
+        isColorStreamCompressed = captured.isColorCompressed;
 
-        int depthWidth = depthFrame->width();
-        int depthHeight = depthFrame->height();
+        // Check the frame formats before exposing their buffers; the YUV frames are sampled as they are
+        OBFormat colorFrameFormat = colorFrame->format();
 
-        // Resize color frame buffer if needed
-        if (!colorData || colorFrameWidth != colorWidth || colorFrameHeight != colorHeight) {
-            colorFrameWidth = colorWidth;
-            colorFrameHeight = colorHeight;
-            if (colorData) delete[] colorData;
-            colorData = new RGB[colorWidth * colorHeight];
+        if (colorFrameFormat == OB_FORMAT_YUYV) {
+            colorFormat = ColorYuyv;
         }
-
-        // Resize depth frame buffer if needed
-        if (!depthData || depthFrameWidth != depthWidth || depthFrameHeight != depthHeight) {
-            depthFrameWidth = depthWidth;
-            depthFrameHeight = depthHeight;
-            if (depthData) delete[] depthData;
-            depthData = new UINT16[depthWidth * depthHeight];
+        else if (colorFrameFormat == OB_FORMAT_NV12) {
+            colorFormat = ColorNv12;
         }
+        else {
+            colorFormat = ColorRgb888;
 
-        // Copy color frame data into color frame buffer
-        if (colorFrame->format() != OB_FORMAT_RGB888) {
-            logFn("[OrbbecCaptureManager] Warning: Expected RGB888 format but got " + std::to_string(colorFrame->format()));
+            if (colorFrameFormat != OB_FORMAT_RGB888) {
+                if (logFn) logFn("[OrbbecCaptureManager] Warning: Expected RGB888, YUYV or NV12 format but got " + std::to_string(colorFrameFormat));
+            }
         }
 
-        const uint8_t* colorSrc = static_cast<const uint8_t*>(colorFrame->data());
-        for (int i = 0; i < colorWidth * colorHeight; ++i) {
-            colorData[i].Red = colorSrc[i * 3 + 0];
-            colorData[i].Green = colorSrc[i * 3 + 1];
-            colorData[i].Blue = colorSrc[i * 3 + 2];
-        }
+        // The camera streams video range YUV, while the decoder of the MJPG frames uses the whole byte
+        isColorVideoRange = !isColorStreamCompressed;
 
-        // Copy depth frame data into depth frame buffer
         if (depthFrame->format() != OB_FORMAT_Y16) {
-            logFn("[OrbbecCaptureManager] Warning: Expected Y16 format but got " + std::to_string(depthFrame->format()));
+            if (logFn) logFn("[OrbbecCaptureManager] Warning: Expected Y16 format but got " + std::to_string(depthFrame->format()));
         }
 
-        const uint16_t* depthSrc = static_cast<const uint16_t*>(depthFrame->data());
-        for (int i = 0; i < depthWidth * depthHeight; ++i) {
-            depthData[i] = depthSrc[i];
-        }
+        // Hold on to the SDK frames and expose read-only views of their buffers instead of copying them;
+        // the previous frameset is released back to the SDK here
+        currentColorFrame = colorFrame;
+        currentDepthFrame = depthFrame;
 
-        // Generate point cloud from Orbbec SDK
-        UpdatePointCloud();
+        colorFrameWidth = colorFrame->width();
+        colorFrameHeight = colorFrame->height();
+        depthFrameWidth = depthFrame->width();
+        depthFrameHeight = depthFrame->height();
 
-        // Store timestamp
-        currentTimeStamp = colorFrame->globalTimeStampUs();
+        colorData = static_cast<const BYTE*>(colorFrame->data());
+        depthData = static_cast<const UINT16*>(depthFrame->data());
+        isRgbColorImageCurrent = false;
 
-        // Send the latest frame to the document detection
-        // Get the current time and check the interval
+        // Check whether the latest frame should be sent to the document detection
         auto now = std::chrono::steady_clock::now();
         auto nowMs = std::chrono::time_point_cast<std::chrono::milliseconds>(now).time_since_epoch().count();
+        bool isDocumentFrameDue = !isDocumentSubmissionPaused && nowMs - lastFrameTime.count() >= documentFrameIntervalMs;
+
+        // Generate point cloud; calibration needs the full camera space frame, so it always uses the CPU path
+        // without the world transform. The document detection needs the full aligned depth frame, so pixels
+        // outside the bounds are only culled early when the frame is not sent to it. The SDK backend does not
+        // produce the aligned depth frame, so document frames use the CPU path too, as do the frames paired from
+        // different framesets, which the SDK filters cannot be given. Both backends expect RGB888, so the YUV frames
+        // use the CPU path.
+        bool isColorRgb = colorFormat == ColorRgb888;
+        hasProcessedFrame = false;
+        ProcessingBackend usedBackend = CpuProcessing;
+        PerfTimer pointCloudTimer(perfStats, PointCloudStage);
+        auto pointCloudStart = std::chrono::steady_clock::now();
+
+        // The client publishes its last frame again for a frame of a static scene, which is not generated at all
+        if (!UpdateStaticFrame(isCalibrationDataRequested || isDocumentFrameDue)) {
+            if (processingBackend == GpuProcessing && isColorRgb && !isCalibrationDataRequested && UpdatePointCloudGpu(isDocumentFrameDue)) {
+                hasProcessedFrame = true;
+                usedBackend = GpuProcessing;
+            }
+            else if (processingBackend == SdkProcessing && isColorRgb && frameset && !isCalibrationDataRequested && !isDocumentFrameDue && UpdatePointCloudSdk(frameset, true)) {
+                usedBackend = SdkProcessing;
+            }
+            else {
+                UpdatePointCloud(!isCalibrationDataRequested, !isCalibrationDataRequested && !isDocumentFrameDue, isDocumentFrameDue);
+            }
+
+            RecordPointCloudCost(usedBackend, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pointCloudStart).count());
+        }
+
+        pointCloudTimer.Stop();
+
+        // Store timestamp; that of the depth frame, which the color frame was paired with
+        currentTimeStamp = depthFrame->globalTimeStampUs();
+
+        // Record the frame as it was received, along with the camera parameters updated by the point cloud generation
+        UpdateRawRecording();
 
-        if (nowMs - lastFrameTime.count() >= DocumentServerSendDelayMs)
+        // Send the latest frame to the document detection
+        if (isDocumentFrameDue)
         {
-            documentDetector->SubmitFrame(colorFrame, alignedDepthFrame);
+            // The detector copies the frame, so the SDK frame is not held past this call
+            documentDetector->SubmitFrame(GetRgbColorImage(), alignedDepthFrame);
             lastFrameTime = std::chrono::milliseconds(nowMs);
         }
 
@@ -273,205 +576,1034 @@ bool OrbbecCaptureManager::AcquireFrame(bool isCalibrationDataRequested)
 }
 
 /// <summary>
-/// Enables/Disables Auto Exposure and/or sets the exposure to a step value between 1 and 300
+/// Starts receiving the framesets of the pipeline. Polling waits for them on a separate thread; in callback mode, the
+/// SDK pushes them from its own thread as soon as they arrive. Either way, the camera keeps being read while the
+/// previous frame is processed.
 /// </summary>
-/// <param name="exposureStep">The Exposure Step between 1 and 300</param>
-void OrbbecCaptureManager::SetExposureState(bool enableAutoExposure, int exposureStep)
+void OrbbecCaptureManager::StartCapture(std::shared_ptr<ob::Config> config)
 {
-    if (!isInitialized || !device) {
-        return;
+    StopCapture();
+
+    numCapturedFrames = 0;
+    numDroppedFrames = 0;
+    numMismatchedFrames = 0;
+    numIncompleteFrames = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(frameRingMutex);
+        isCaptureStopRequested = false;
+        numExactPairs = 0;
+        numNearestPairs = 0;
+        pairOffsetSumUs = 0;
+        maxPairOffsetUs = 0;
+        lastArrivalTime = std::chrono::steady_clock::time_point();
+        framePeriodUs = DefaultFramePeriodUs;
     }
 
-    try {
-        if (enableAutoExposure) {
-            device->setBoolProperty(OB_PROP_COLOR_AUTO_EXPOSURE_BOOL, true);
-            autoExposureEnabled = true;
-        }
-        else {
-            device->setBoolProperty(OB_PROP_COLOR_AUTO_EXPOSURE_BOOL, false);
-            device->setIntProperty(OB_PROP_COLOR_EXPOSURE_INT, exposureStep);
-            autoExposureEnabled = false;
-            exposureTimeStep = exposureStep;
-        }
+    if (captureMode == CallbackCapture) {
+        pipeline->start(config, [this](std::shared_ptr<ob::FrameSet> frameset) { PushFrameset(frameset); });
     }
-    catch (const ob::Error& e) {
-        if (logFn) logFn("[OrbbecCaptureManager] Failed to set exposure: " + std::string(e.getMessage()));
+    else {
+        pipeline->start(config);
+        captureThread = std::thread(&OrbbecCaptureManager::CaptureLoop, this);
     }
 }
 
-uint64_t OrbbecCaptureManager::GetTimeStamp()
+/// <summary>
+/// Stops accepting framesets and releases the ones which were not processed; must be called before the pipeline is stopped
+/// </summary>
+void OrbbecCaptureManager::StopCapture()
 {
-    return currentTimeStamp;
-}
+    {
+        std::lock_guard<std::mutex> lock(frameRingMutex);
+        isCaptureStopRequested = true;
+    }
 
-int OrbbecCaptureManager::GetDeviceIndex()
-{
-    return deviceIDForRestart;
+    if (captureThread.joinable())
+        captureThread.join();
+
+    std::lock_guard<std::mutex> lock(frameRingMutex);
+    frameRing.clear();
+    ClearUnpairedFrames();
 }
 
-bool OrbbecCaptureManager::TryOpenDevice()
+void OrbbecCaptureManager::CaptureLoop()
 {
-    bool opened = false;
-
-    // Find the requested device in the device list
-    ob::Context ctx;
-    ctx.setLoggerSeverity(OB_LOG_SEVERITY_DEBUG);
+    int appliedAffinityVersion = 0;
 
-    auto devList = ctx.queryDeviceList();
-    int count = static_cast<int>(devList->deviceCount());
+    while (!isCaptureStopRequested) {
+        std::shared_ptr<ob::FrameSet> frameset;
 
-    if (count < (deviceIndex - 1)) {
-        if (logFn) logFn("[OrbbecCaptureManager] Device not found!");
-        return opened;
-    }
+        if (captureAffinityVersion != appliedAffinityVersion) {
+            std::lock_guard<std::mutex> lock(captureAffinityMutex);
+            appliedAffinityVersion = captureAffinityVersion;
+            SetCurrentThreadAffinity(captureAffinity);
+        }
 
-    int deviceIdx = deviceIndex;
+        try {
+            frameset = pipeline->waitForFrames(CaptureTimeoutMs);
+        }
+        catch (const ob::Error& e) {
+            if (logFn) logFn("[OrbbecCaptureManager] Failed to wait for frames: " + std::string(e.getMessage()));
+            std::this_thread::sleep_for(std::chrono::milliseconds(CaptureTimeoutMs));
+            continue;
+        }
 
-    // Save the deviceId of this Client; when the cameras are reinitialized during runtime, they will then use the same ID as before
-    if (deviceIDForRestart != -1) {
-        deviceIdx = deviceIDForRestart;
+        if (frameset) {
+            PushFrameset(frameset);
+        }
     }
+}
 
-    // Open the device at the specified index
-    std::shared_ptr<ob::Device> newDevice;
+/// <summary>
+/// Pairs the frames of a received frameset with those of the previous ones, then adds each pair of color and depth
+/// frames to the ring, dropping the oldest one when the ring is full
+/// </summary>
+void OrbbecCaptureManager::PushFrameset(std::shared_ptr<ob::FrameSet> frameset)
+{
+    UnpairedFrame<ob::ColorFrame> color;
+    UnpairedFrame<ob::DepthFrame> depth;
 
     try {
-        newDevice = devList->getDevice(deviceIdx);
+        color.frame = frameset->colorFrame();
+        depth.frame = frameset->depthFrame();
 
-        if (logFn) {
-            logFn("[OrbbecCaptureManager] Device opened successfully at index: " + std::to_string(deviceIdx));
+        if (!color.frame && !depth.frame) {
+            numIncompleteFrames++;
+            return;
         }
 
-        opened = true;
+        color.frameset = frameset;
+        depth.frameset = frameset;
+        color.timeStampUs = color.frame ? color.frame->globalTimeStampUs() : 0;
+        depth.timeStampUs = depth.frame ? depth.frame->globalTimeStampUs() : 0;
     }
     catch (const ob::Error& e) {
-        if (logFn) logFn("[OrbbecCaptureManager] Failed to open device at index: " + std::to_string(deviceIdx) +
-            " - Error: " + e.getMessage());
+        if (logFn) logFn("[OrbbecCaptureManager] Failed to read frameset: " + std::string(e.getMessage()));
+        return;
     }
 
-    // Store device if opened
-    if (opened) {
-        device = newDevice;
-        deviceIDForRestart = deviceIdx;
+    std::vector<CapturedFrameset> pairs;
 
-        // Get device info to store serial number
+    {
+        std::lock_guard<std::mutex> lock(frameRingMutex);
+
+        if (isCaptureStopRequested) {
+            return;
+        }
+
+        if (color.frame) {
+            unpairedColorFrames.push_back(color);
+        }
+
+        if (depth.frame) {
+            unpairedDepthFrames.push_back(depth);
+        }
+
+        PairFrames(pairs);
+    }
+
+    for (CapturedFrameset& captured : pairs) {
+        // Decode the compressed color frames here, so that the processing thread only gets RGB888 frames, or NV12
+        // frames when a YUV stream was requested
+        try {
+            captured.isColorCompressed = captured.colorFrame->format() == OB_FORMAT_MJPG;
+
+            if (captured.isColorCompressed) {
+                if (!mjpgDecoder) {
+                    mjpgDecoder = std::make_shared<ob::FormatConvertFilter>();
+                    mjpgDecoder->setFormatConvertType(isColorDecodedToYuv ? FORMAT_MJPG_TO_NV12 : FORMAT_MJPG_TO_RGB);
+                }
+
+                std::shared_ptr<ob::Frame> decodedFrame = mjpgDecoder->process(captured.colorFrame);
+                captured.colorFrame = decodedFrame ? decodedFrame->as<ob::ColorFrame>() : nullptr;
+            }
+        }
+        catch (const ob::Error& e) {
+            if (logFn) logFn("[OrbbecCaptureManager] Failed to decode color frame: " + std::string(e.getMessage()));
+            captured.colorFrame = nullptr;
+        }
+
+        if (!captured.colorFrame) {
+            numIncompleteFrames++;
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(frameRingMutex);
+
+            if (isCaptureStopRequested) {
+                return;
+            }
+
+            if (frameRing.size() >= FrameRingCapacity) {
+                frameRing.pop_front();
+                numDroppedFrames++;
+            }
+
+            captured.arrivalTime = std::chrono::steady_clock::now();
+            int64_t intervalUs = std::chrono::duration_cast<std::chrono::microseconds>(captured.arrivalTime - lastArrivalTime).count();
+
+            if (lastArrivalTime.time_since_epoch().count() != 0 && intervalUs < MaxFramePeriodUs) {
+                framePeriodUs += FramePeriodWeight * (intervalUs - framePeriodUs);
+            }
+
+            lastArrivalTime = captured.arrivalTime;
+            captured.framePeriodUs = framePeriodUs;
+            frameRing.push_back(captured);
+            numCapturedFrames++;
+        }
+
+        frameRingCond.notify_one();
+    }
+}
+
+/// <summary>
+/// Pairs each buffered depth frame, from the oldest one, with the color frame nearest to it within the tolerance. The
+/// frames older than a pair can no longer be paired and are dropped, as are the oldest ones of a full buffer. Called
+/// under frameRingMutex.
+/// </summary>
+/// <param name="pairs">Receives the pairs made, from the oldest one</param>
+void OrbbecCaptureManager::PairFrames(std::vector<CapturedFrameset>& pairs)
+{
+    uint64_t toleranceUs = (std::min)((std::max)(0, framePairingToleranceUs.load()), MaxFramePairingToleranceUs);
+    size_t depthIndex = 0;
+
+    while (depthIndex < unpairedDepthFrames.size()) {
+        const UnpairedFrame<ob::DepthFrame>& depth = unpairedDepthFrames[depthIndex];
+        size_t colorIndex = unpairedColorFrames.size();
+        uint64_t offsetUs = 0;
+
+        for (size_t i = 0; i < unpairedColorFrames.size(); i++) {
+            uint64_t colorTimeStampUs = unpairedColorFrames[i].timeStampUs;
+            uint64_t colorOffsetUs = colorTimeStampUs > depth.timeStampUs ? colorTimeStampUs - depth.timeStampUs : depth.timeStampUs - colorTimeStampUs;
+
+            if (colorOffsetUs <= toleranceUs && (colorIndex == unpairedColorFrames.size() || colorOffsetUs < offsetUs)) {
+                colorIndex = i;
+                offsetUs = colorOffsetUs;
+            }
+        }
+
+        if (colorIndex == unpairedColorFrames.size()) {
+            depthIndex++;
+            continue;
+        }
+
+        const UnpairedFrame<ob::ColorFrame>& color = unpairedColorFrames[colorIndex];
+
+        CapturedFrameset captured;
+        captured.frameset = color.frameset == depth.frameset ? depth.frameset : nullptr;
+        captured.colorFrame = color.frame;
+        captured.depthFrame = depth.frame;
+        pairs.push_back(captured);
+
+        if (offsetUs == 0) {
+            numExactPairs++;
+        }
+        else {
+            numNearestPairs++;
+            pairOffsetSumUs += offsetUs;
+            maxPairOffsetUs = (std::max)(maxPairOffsetUs, offsetUs);
+        }
+
+        if (logFn && (numExactPairs + numNearestPairs) % PairingReportInterval == 0) {
+            logFn("[OrbbecCaptureManager] Device " + std::to_string(deviceIndex) + ": " + GetFramePairingSummary());
+        }
+
+        // The frames before the pair were not paired, and would only be paired with older frames
+        numMismatchedFrames += depthIndex + colorIndex;
+        unpairedDepthFrames.erase(unpairedDepthFrames.begin(), unpairedDepthFrames.begin() + depthIndex + 1);
+        unpairedColorFrames.erase(unpairedColorFrames.begin(), unpairedColorFrames.begin() + colorIndex + 1);
+        depthIndex = 0;
+    }
+
+    while (unpairedColorFrames.size() > PairingBufferCapacity) {
+        unpairedColorFrames.pop_front();
+        numMismatchedFrames++;
+    }
+
+    while (unpairedDepthFrames.size() > PairingBufferCapacity) {
+        unpairedDepthFrames.pop_front();
+        numMismatchedFrames++;
+    }
+}
+
+/// <summary>
+/// Releases the frames waiting for a pair; called under frameRingMutex, before the pipeline which owns them is stopped
+/// </summary>
+void OrbbecCaptureManager::ClearUnpairedFrames()
+{
+    unpairedColorFrames.clear();
+    unpairedDepthFrames.clear();
+}
+
+/// <summary>
+/// Describes the quality of the pairs of color and depth frames since the capture started; called under frameRingMutex
+/// </summary>
+std::string OrbbecCaptureManager::GetFramePairingSummary()
+{
+    uint64_t meanOffsetUs = numNearestPairs > 0 ? pairOffsetSumUs / numNearestPairs : 0;
+
+    return std::to_string(numExactPairs) + " frames paired exactly, " + std::to_string(numNearestPairs) + " to the nearest frame "
+        + std::to_string(meanOffsetUs) + " us apart on average (" + std::to_string(maxPairOffsetUs) + " us at most), "
+        + std::to_string(numMismatchedFrames) + " frames without a pair";
+}
+
+/// <summary>
+/// Waits for a frameset from the capture thread or the SDK callback and returns the latest one; the older ones are dropped
+/// </summary>
+/// <returns>The latest frameset, with a null frameset if none arrived before the capture timeout</returns>
+OrbbecCaptureManager::CapturedFrameset OrbbecCaptureManager::PopLatestFrameset()
+{
+    std::unique_lock<std::mutex> lock(frameRingMutex);
+
+    if (!frameRingCond.wait_for(lock, std::chrono::milliseconds(CaptureTimeoutMs), [this]() { return !frameRing.empty(); })) {
+        return CapturedFrameset();
+    }
+
+    CapturedFrameset frameset = frameRing.back();
+    numDroppedFrames += frameRing.size() - 1;
+    frameRing.clear();
+
+    return frameset;
+}
+
+/// <summary>
+/// Selects the color stream profile and whether the document detection can ask for high resolution bursts; takes
+/// effect the next time the device is initialized
+/// </summary>
+void OrbbecCaptureManager::SetColorStreamSettings(const ColorStreamSettings& settings)
+{
+    colorStreamSettings = settings;
+}
+
+/// <summary>
+/// Selects the binned depth stream, or the full resolution one; applied by the capture thread before its next frame
+/// </summary>
+void OrbbecCaptureManager::SetDepthBinning(bool isBinned)
+{
+    isDepthBinningRequested = isBinned;
+}
+
+void OrbbecCaptureManager::SetThreadAffinity(const ThreadAffinity& affinity)
+{
+    std::lock_guard<std::mutex> lock(captureAffinityMutex);
+    captureAffinity = affinity;
+    captureAffinityVersion++;
+}
+
+/// <summary>
+/// Selects how the framesets are received; takes effect the next time the device is initialized
+/// </summary>
+void OrbbecCaptureManager::SetCaptureMode(CaptureMode mode)
+{
+    captureMode = mode;
+}
+
+uint64_t OrbbecCaptureManager::GetNumCapturedFrames() const
+{
+    return numCapturedFrames;
+}
+
+uint64_t OrbbecCaptureManager::GetNumDroppedFrames() const
+{
+    return numDroppedFrames;
+}
+
+uint64_t OrbbecCaptureManager::GetNumMismatchedFrames() const
+{
+    return numMismatchedFrames;
+}
+
+/// <summary>
+/// Enables/Disables Auto Exposure and/or sets the exposure to a step value between 1 and 300
+/// </summary>
+/// <param name="exposureStep">The Exposure Step between 1 and 300</param>
+void OrbbecCaptureManager::SetExposureState(bool enableAutoExposure, int exposureStep)
+{
+    if (!isInitialized || !device) {
+        return;
+    }
+
+    try {
+        if (enableAutoExposure) {
+            device->setBoolProperty(OB_PROP_COLOR_AUTO_EXPOSURE_BOOL, true);
+            autoExposureEnabled = true;
+        }
+        else {
+            device->setBoolProperty(OB_PROP_COLOR_AUTO_EXPOSURE_BOOL, false);
+            device->setIntProperty(OB_PROP_COLOR_EXPOSURE_INT, exposureStep);
+            autoExposureEnabled = false;
+            exposureTimeStep = exposureStep;
+        }
+    }
+    catch (const ob::Error& e) {
+        if (logFn) logFn("[OrbbecCaptureManager] Failed to set exposure: " + std::string(e.getMessage()));
+    }
+}
+
+uint64_t OrbbecCaptureManager::GetTimeStamp()
+{
+    return currentTimeStamp;
+}
+
+int OrbbecCaptureManager::GetDeviceIndex()
+{
+    return deviceIDForRestart;
+}
+
+bool OrbbecCaptureManager::TryOpenDevice()
+{
+    bool opened = false;
+
+    int deviceIdx = deviceIndex;
+
+    // Save the deviceId of this Client; when the cameras are reinitialized during runtime, they will then use the same ID as before
+    if (deviceIDForRestart != -1) {
+        deviceIdx = deviceIDForRestart;
+    }
+
+    // Open the requested device from the registry shared by all the clients; once known, the serial number identifies
+    // the device even if the enumeration order changes
+    std::shared_ptr<ob::Device> newDevice;
+
+    try {
+        newDevice = DeviceRegistry::Instance().OpenDevice(deviceIdx, serialNumber);
+
+        if (!newDevice) {
+            if (logFn) logFn("[OrbbecCaptureManager] Device not found!");
+            return opened;
+        }
+
+        if (logFn) {
+            logFn("[OrbbecCaptureManager] Device opened successfully at index: " + std::to_string(deviceIdx));
+        }
+
+        opened = true;
+    }
+    catch (const ob::Error& e) {
+        if (logFn) logFn("[OrbbecCaptureManager] Failed to open device at index: " + std::to_string(deviceIdx) +
+            " - Error: " + e.getMessage());
+    }
+
+    // Store device if opened
+    if (opened) {
+        device = newDevice;
+        deviceIDForRestart = deviceIdx;
+
+        // Get device info to store serial number
         auto devInfo = newDevice->getDeviceInfo();
         serialNumber = devInfo->serialNumber();
+
+        // Follow the device once it is known, to close it when it is unplugged and reopen it when it is plugged back
+        if (deviceListenerId == -1) {
+            std::string listenedSerialNumber = serialNumber;
+
+            deviceListenerId = DeviceRegistry::Instance().AddDeviceListener([this, listenedSerialNumber](const std::string& changedSerialNumber, bool isConnected) {
+                if (changedSerialNumber != listenedSerialNumber) {
+                    return;
+                }
+
+                if (isConnected) {
+                    isDeviceArrived = true;
+                }
+                else {
+                    if (logFn) logFn("[OrbbecCaptureManager] Device " + listenedSerialNumber + " was unplugged");
+                    isDeviceLost = true;
+                }
+            });
+        }
     }
 
     return opened;
 }
 
 /// <summary>
-/// Generates a new point cloud from the latest acquired frameset
+/// Stops the capture and the pipeline of a lost device and releases it, so that it can be opened again by its serial
+/// number. The errors of the SDK are ignored, since the device may already be gone.
+/// </summary>
+void OrbbecCaptureManager::ReleaseDevice()
+{
+    StopCapture();
+    currentColorFrame.reset();
+    currentDepthFrame.reset();
+    colorData = nullptr;
+    depthData = nullptr;
+
+    // The filters of the SDK hold state of the streams of the device
+    sdkAlignFilter.reset();
+    sdkPointCloudFilter.reset();
+    mjpgDecoder.reset();
+
+    if (pipeline) {
+        try {
+            pipeline->stop();
+        }
+        catch (const ob::Error&) {
+            // Already stopped along with the device
+        }
+
+        pipeline.reset();
+    }
+
+    device.reset();
+    isInitialized = false;
+}
+
+bool OrbbecCaptureManager::IsDeviceLost() const
+{
+    return isDeviceLost;
+}
+
+/// <summary>
+/// Marks the device as lost, so that it is closed by the frame loop and reopened by RecoverDevice; used by the client
+/// when the device fails to restart
+/// </summary>
+void OrbbecCaptureManager::RequestDeviceRecovery()
+{
+    isDeviceLost = true;
+}
+
+/// <summary>
+/// Tries to reopen the lost device by its serial number and to start its pipeline with the given sync configuration,
+/// so that it rejoins the sync chain without restarting the other cameras. The attempts are spaced out, but one is
+/// made right away when the device is plugged back in.
+/// </summary>
+/// <param name="state">Sync State with which to start the device</param>
+/// <param name="syncOffsetMultiplier">Multiplier of the capture offset of a subordinate device</param>
+/// <returns>True once the device streams again; false if it is still lost.</returns>
+bool OrbbecCaptureManager::RecoverDevice(SyncState state, int syncOffsetMultiplier)
+{
+    if (!isDeviceLost || serialNumber.empty()) {
+        return false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+
+    // The first attempt is made right away
+    if (restartAttempts == 0) {
+        deviceLostTime = now;
+        nextRecoveryTime = now;
+    }
+
+    if (!isDeviceArrived && now < nextRecoveryTime) {
+        return false;
+    }
+
+    isDeviceArrived = false;
+    restartAttempts++;
+
+    ReleaseDevice();
+
+    if (TryOpenDevice()) {
+        try {
+            pipeline = std::make_shared<ob::Pipeline>(device);
+        }
+        catch (const ob::Error& e) {
+            if (logFn) logFn("[OrbbecCaptureManager] Failed to create pipeline: " + std::string(e.getMessage()));
+        }
+
+        if (pipeline && StartStreaming(state, syncOffsetMultiplier)) {
+            if (logFn) logFn("[OrbbecCaptureManager] Device " + serialNumber + " recovered after " + std::to_string(restartAttempts) + " attempts in "
+                + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(now - deviceLostTime).count()) + " s");
+
+            isDeviceLost = false;
+            restartAttempts = 0;
+            return true;
+        }
+    }
+
+    ReleaseDevice();
+
+    int intervalMs = (std::min)(MaxRecoveryIntervalMs, RecoveryIntervalMs << (std::min)(restartAttempts - 1, 4));
+    nextRecoveryTime = now + std::chrono::milliseconds(intervalMs);
+
+    return false;
+}
+
+/// <summary>
+/// Retrieves the camera parameters of the running stream profile and precomputes the normalized
+/// unprojection ray (u - cx) / fx, (v - cy) / fy of every depth pixel.
 /// </summary>
-void OrbbecCaptureManager::UpdatePointCloud() {
-    // Get camera parameters
-    auto cameraParams = pipeline->getCameraParam();
-    const auto& depthIntrinsics = cameraParams.depthIntrinsic; // Depth camera intrinsics (used to go from depth pixel -> depth camera space)
+void OrbbecCaptureManager::UpdateCameraParameters() {
+    cameraParams = pipeline->getCameraParam();
+    const auto& depthIntrinsics = cameraParams.depthIntrinsic;
+
+    rayTableWidth = depthFrameWidth;
+    rayTableHeight = depthFrameHeight;
+    depthRayTable.resize(static_cast<size_t>(rayTableWidth) * rayTableHeight);
+
+    for (int v = 0; v < rayTableHeight; ++v) {
+        float rayY = (v - depthIntrinsics.cy) / depthIntrinsics.fy;
+
+        for (int u = 0; u < rayTableWidth; ++u) {
+            depthRayTable[v * rayTableWidth + u] = Point2f((u - depthIntrinsics.cx) / depthIntrinsics.fx, rayY);
+        }
+    }
+
+    if (logFn) logFn("[OrbbecCaptureManager] Built unprojection ray table for " + std::to_string(rayTableWidth) + "x" + std::to_string(rayTableHeight) + " depth stream");
+}
+
+/// <summary>
+/// Gathers the buffers of the latest frameset and the camera parameters used by the point cloud kernels
+/// </summary>
+/// <param name="isWorldTransformApplied">Indicates whether the kernel should output the vertices in world space using the
+/// calibration set by SetFrameProcessingParams, instead of color camera space</param>
+/// <param name="isBoundsCullingEnabled">Indicates whether the pixels which cannot see the bounds set by SetFrameProcessingParams
+/// should be skipped; only used when the world transform is applied</param>
+PointCloudKernelParams OrbbecCaptureManager::GetPointCloudKernelParams(bool isWorldTransformApplied, bool isBoundsCullingEnabled) {
     const auto& colorIntrinsics = cameraParams.rgbIntrinsic; // Color camera intrinsics (used to project from color camera space -> color image)
     const auto& extrinsics = cameraParams.transform; // This transforms a point in depth camera space into color camera space
 
-    float fx = depthIntrinsics.fx; // focal length x (depth cam)
-    float fy = depthIntrinsics.fy; // focal length y (depth cam)
-    float cx = depthIntrinsics.cx; // principal point x (depth cam)
-    float cy = depthIntrinsics.cy; // principal point y (depth cam)
+    PointCloudKernelParams params;
+    params.depth = depthData;
+    params.rays = depthRayTable.data();
+    params.depthWidth = depthFrameWidth;
+    params.depthHeight = depthFrameHeight;
+    params.color = colorData;
+    params.colorWidth = colorFrameWidth;
+    params.colorHeight = colorFrameHeight;
+    params.colorFormat = colorFormat;
+    params.isColorVideoRange = isColorVideoRange;
+    params.colorRgbx = nullptr;
+    params.colorFx = colorIntrinsics.fx;
+    params.colorFy = colorIntrinsics.fy;
+    params.colorCx = colorIntrinsics.cx;
+    params.colorCy = colorIntrinsics.cy;
+
+    for (int i = 0; i < 9; ++i) {
+        params.rot[i] = extrinsics.rot[i];
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        params.trans[i] = extrinsics.trans[i] / 1000.0f; // convert mm to meters
+    }
+
+    if (isWorldTransformApplied && frameProcessingParams.isCalibrated) {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                params.world[i * 4 + j] = frameProcessingParams.worldTransform[i][j];
+            }
+        }
+    }
+    else {
+        SetIdentityWorldTransform(params);
+    }
+
+    if (isWorldTransformApplied && isBoundsCullingEnabled && frameProcessingParams.isCalibrated) {
+        const auto& depthIntrinsics = cameraParams.depthIntrinsic;
+        EnableBoundsCulling(params, depthIntrinsics.fx, depthIntrinsics.fy, depthIntrinsics.cx, depthIntrinsics.cy,
+            frameProcessingParams.minBounds, frameProcessingParams.maxBounds);
+        RestrictRoi(params, frameProcessingParams.processingRoi);
+    }
+    else {
+        DisableBoundsCulling(params);
+    }
+
+    return params;
+}
+
+/// <summary>
+/// Generates a new point cloud from the latest acquired frameset
+/// </summary>
+/// <param name="isWorldTransformRequested">Indicates whether the calibration should be applied to the vertices while they are generated</param>
+/// <param name="isBoundsCullingRequested">Indicates whether the points outside the bounds can be discarded while they are generated</param>
+/// <param name="isAlignedDepthRequested">Indicates whether the aligned depth frame should be generated for the document detection</param>
+void OrbbecCaptureManager::UpdatePointCloud(bool isWorldTransformRequested, bool isBoundsCullingRequested, bool isAlignedDepthRequested) {
+    // Rebuild the unprojection rays only when the stream profile has changed
+    if (depthRayTable.empty() || rayTableWidth != depthFrameWidth || rayTableHeight != depthFrameHeight) {
+        UpdateCameraParameters();
+    }
+
+    PointCloudKernelParams params = GetPointCloudKernelParams(isWorldTransformRequested, isBoundsCullingRequested);
+    isFrameInWorldSpace = isWorldTransformRequested && frameProcessingParams.isCalibrated;
+
+    // Calibration frames keep the raw depth
+    if (isWorldTransformRequested) {
+        params.depth = GetFilteredDepth();
+    }
+
+    // A depth pixel covers about one pixel of the downscaled color frame, whose bilinear samples are closer in memory.
+    // The YUV frames are sampled as they are, their chroma being already subsampled.
+    if (frameProcessingParams.isColorDownscaleEnabled && colorData && colorFormat == ColorRgb888) {
+        downscaledColor.resize(static_cast<size_t>(colorFrameWidth / 2) * (colorFrameHeight / 2));
+        DownscaleColorFrame(colorData, colorFrameWidth, colorFrameHeight, downscaledColor.data());
+        UseDownscaledColor(params, downscaledColor.data());
+    }
 
-    // Reset point cloud buffers
-    lastFrameVertices.clear();
-    lastFrameColors.clear();
-    lastFrameColors.reserve(depthFrameWidth * depthFrameHeight);
+    // Every depth pixel can produce at most one vertex; the buffers are only reallocated when the stream profile changes
+    size_t numPixels = static_cast<size_t>(depthFrameWidth) * depthFrameHeight;
 
-    alignedDepthFrame = cv::Mat::zeros(depthFrameHeight, depthFrameWidth, CV_16U);
+    if (kernelPoints.Size() != numPixels) {
+        kernelPoints.Resize(numPixels);
+    }
+
+    // Only the frames sent to the document detection need the aligned depth frame; the detector keeps its own
+    // reference to the submitted one, so a new frame is allocated each time
+    if (isAlignedDepthRequested) {
+        alignedDepthFrame = cv::Mat::zeros(depthFrameHeight, depthFrameWidth, CV_16U);
+    }
+
+    PointCloudKernelOutput output;
+    output.X = kernelPoints.X.data();
+    output.Y = kernelPoints.Y.data();
+    output.Z = kernelPoints.Z.data();
+    output.colors = kernelPoints.Colors.data();
+    output.pixelIndices = kernelPoints.PixelIndices.data();
+    output.alignedDepth = isAlignedDepthRequested ? alignedDepthFrame.ptr<UINT16>() : nullptr;
 
     // Align the color frame to the depth frame and compute point cloud
-    for (int v = 0; v < depthFrameHeight; ++v) {
-        for (int u = 0; u < depthFrameWidth; ++u) {
-            int depthIdx = v * depthFrameWidth + u;
-            uint16_t d = depthData[depthIdx]; // depth in millimeters
-
-            if (d == 0)
-            {
-                // No depth data for the current point: store zero vertex and black color
-                lastFrameVertices.emplace_back(0.0f, 0.0f, 0.0f);
-                lastFrameColors.push_back({ 0, 0, 0 });
-                continue;
-            }
+    int numPoints = RunPointCloudKernel(pointCloudKernel, params, output);
 
-            // Convert from depth pixel to depth camera space (in meters)
-            float z = d / 1000.0f; // convert mm to meters
-            float x = (u - cx) * z / fx;
-            float y = (v - cy) * z / fy;
-
-            // Transform point from depth to color camera space
-            float X = extrinsics.rot[0] * x + extrinsics.rot[1] * y + extrinsics.rot[2] * z + extrinsics.trans[0] / 1000.0f;
-            float Y = extrinsics.rot[3] * x + extrinsics.rot[4] * y + extrinsics.rot[5] * z + extrinsics.trans[1] / 1000.0f;
-            float Z = extrinsics.rot[6] * x + extrinsics.rot[7] * y + extrinsics.rot[8] * z + extrinsics.trans[2] / 1000.0f;
-
-            if (Z <= 0)
-            {
-                // Invalid projection: store zero vertex and black color
-                lastFrameVertices.emplace_back(0.0f, 0.0f, 0.0f);
-                lastFrameColors.push_back({ 0, 0, 0 });
-                continue;
-            }
+    // Keep only the valid points
+    lastFramePoints.AssignFirst(kernelPoints, numPoints);
+}
 
-            // Project from color camera space to color image pixel coordinates
-            float projU = colorIntrinsics.fx * X / Z + colorIntrinsics.cx;
-            float projV = colorIntrinsics.fy * Y / Z + colorIntrinsics.cy;
+/// <summary>
+/// Returns the depth frame to generate the point cloud from: depthData with its small holes filled and denoised when
+/// enabled, then with its flying pixels set to zero when the filter is enabled, so that they are never unprojected,
+/// color sampled or inserted in the voxel structures.
+/// </summary>
+const UINT16* OrbbecCaptureManager::GetFilteredDepth() {
+    const UINT16* depth = depthData;
+    size_t numPixels = static_cast<size_t>(depthFrameWidth) * depthFrameHeight;
+
+    if (frameProcessingParams.isDepthHoleFillEnabled) {
+        holeFilledDepth.resize(numPixels);
+        FillDepthHoles(depthData, holeFilledDepth.data(), depthFrameWidth, depthFrameHeight);
+        depth = holeFilledDepth.data();
+    }
 
-            // Fill alignedDepthFrame (original depth frame aligned to a scaled down version of the color frame)
-            // Scale from color frame dimensions to depth frame dimensions
-            int alignedU = static_cast<int>(round(projU * depthFrameWidth / colorFrameWidth));
-            int alignedV = static_cast<int>(round(projV * depthFrameHeight / colorFrameHeight));
+    if (frameProcessingParams.isDepthDenoiseEnabled) {
+        // The history starts again whenever the stream profile changes
+        if (depthHistory.size() != numPixels) {
+            depthHistory.assign(numPixels, 0);
+        }
 
-            if (alignedU >= 0 && alignedV >= 0 && alignedU < depthFrameWidth && alignedV < depthFrameHeight) {
-                uint16_t& existingDepth = alignedDepthFrame.at<uint16_t>(alignedV, alignedU);
-                if (existingDepth == 0 || d < existingDepth) {
-                    existingDepth = d; // Keep nearest depth
-                }
-            }
+        UpdateTemporalDepth(depth, depthHistory.data(), static_cast<int>(numPixels));
 
-            // Sample color image using bilinear interpolation
-            uint8_t r = 0, g = 0, b = 0;
-            int u0 = static_cast<int>(floor(projU));
-            int v0 = static_cast<int>(floor(projV));
-            float du = projU - u0;
-            float dv = projV - v0;
-
-            if (u0 >= 0 && v0 >= 0 && u0 + 1 < colorFrameWidth && v0 + 1 < colorFrameHeight) {
-                RGB c00 = colorData[v0 * colorFrameWidth + u0];
-                RGB c10 = colorData[v0 * colorFrameWidth + u0 + 1];
-                RGB c01 = colorData[(v0 + 1) * colorFrameWidth + u0];
-                RGB c11 = colorData[(v0 + 1) * colorFrameWidth + u0 + 1];
-
-                // Interpolate red channel
-                r = static_cast<uint8_t>(
-                    (1 - du) * (1 - dv) * c00.Red +
-                    du * (1 - dv) * c10.Red +
-                    (1 - du) * dv * c01.Red +
-                    du * dv * c11.Red);
-
-                // Interpolate green channel
-                g = static_cast<uint8_t>(
-                    (1 - du) * (1 - dv) * c00.Green +
-                    du * (1 - dv) * c10.Green +
-                    (1 - du) * dv * c01.Green +
-                    du * dv * c11.Green);
-
-                // Interpolate blue channel
-                b = static_cast<uint8_t>(
-                    (1 - du) * (1 - dv) * c00.Blue +
-                    du * (1 - dv) * c10.Blue +
-                    (1 - du) * dv * c01.Blue +
-                    du * dv * c11.Blue);
-            }
+        denoisedDepth.resize(numPixels);
+        FilterDepthMedian(depthHistory.data(), denoisedDepth.data(), depthFrameWidth, depthFrameHeight);
+        depth = denoisedDepth.data();
+    }
+    else {
+        // Do not blend stale frames in when the denoising is enabled again
+        depthHistory.clear();
+    }
+
+    if (!frameProcessingParams.isFlyingPixelFilterEnabled) {
+        return depth;
+    }
 
-            // Store results
-            lastFrameVertices.emplace_back(X, Y, Z); // Position in color camera space
-            lastFrameColors.push_back({ b, g, r });
+    filteredDepth.resize(numPixels);
+    RejectFlyingPixels(depth, filteredDepth.data(), depthFrameWidth, depthFrameHeight);
+
+    return filteredDepth.data();
+}
+
+/// <summary>
+/// Returns the bytes held by the buffers of the latest frame; the frames of the SDK are not counted
+/// </summary>
+size_t OrbbecCaptureManager::GetMemoryUsage() const {
+    return ICaptureManager::GetMemoryUsage() + GetCapacityBytes(kernelPoints) + GetCapacityBytes(depthRayTable)
+        + GetCapacityBytes(filteredDepth) + GetCapacityBytes(holeFilledDepth) + GetCapacityBytes(depthHistory) + GetCapacityBytes(denoisedDepth)
+        + GetCapacityBytes(downscaledColor) + GetCapacityBytes(rgbColorImage)
+        + GetCapacityBytes(alignedDepthFrame);
+}
+
+/// <summary>
+/// Releases the depth buffers of the disabled filters and trims the point buffers to twice what they hold
+/// </summary>
+void OrbbecCaptureManager::ReleaseUnusedMemory() {
+    ICaptureManager::ReleaseUnusedMemory();
+    TrimCapacity(kernelPoints);
+
+    if (!frameProcessingParams.isDepthDenoiseEnabled) {
+        ReleaseCapacity(depthHistory);
+        ReleaseCapacity(denoisedDepth);
+    }
+
+    if (!frameProcessingParams.isFlyingPixelFilterEnabled) {
+        ReleaseCapacity(filteredDepth);
+    }
+
+    if (!frameProcessingParams.isDepthHoleFillEnabled) {
+        ReleaseCapacity(holeFilledDepth);
+    }
+
+    if (!frameProcessingParams.isColorDownscaleEnabled) {
+        ReleaseCapacity(downscaledColor);
+    }
+
+    if (colorFormat == ColorRgb888) {
+        rgbColorImage.release();
+    }
+}
+
+/// <summary>
+/// Generates the compacted world space point cloud of the latest acquired frameset on the GPU, applying the
+/// calibration, the bounds crop and the voxel grid decimation as set by SetFrameProcessingParams.
+/// </summary>
+/// <param name="isAlignedDepthRequested">Indicates whether the aligned depth frame should be read back for the document detection</param>
+/// <returns>True if the point cloud was generated on the GPU; false if the CPU path should be used instead.</returns>
+bool OrbbecCaptureManager::UpdatePointCloudGpu(bool isAlignedDepthRequested) {
+    // The processing parameters have not been set yet
+    if (frameProcessingParams.voxelSize <= 0.0f) {
+        return false;
+    }
+
+    bool isRayTableUpdated = false;
+
+    if (depthRayTable.empty() || rayTableWidth != depthFrameWidth || rayTableHeight != depthFrameHeight) {
+        UpdateCameraParameters();
+        isRayTableUpdated = true;
+    }
+
+    // Create the GPU engine on first use and whenever the stream profile changes
+    if (!gpuEngine || !gpuEngine->IsInitialized() || isRayTableUpdated) {
+        if (!gpuEngine) {
+            gpuEngine = std::make_unique<GpuPointCloudEngine>();
+            gpuEngine->SetLogger(logFn);
+        }
+
+        if (!gpuEngine->Initialize(depthFrameWidth, depthFrameHeight, colorFrameWidth, colorFrameHeight, depthRayTable)) {
+            // Fall back to the CPU backend for this device
+            if (logFn) logFn("[OrbbecCaptureManager] GPU processing is not available, using the CPU backend");
+            processingBackend = CpuProcessing;
+            gpuEngine.reset();
+            return false;
         }
     }
+
+    PointCloudKernelParams params = GetPointCloudKernelParams(false, false);
+    params.depth = GetFilteredDepth();
+
+    cv::Mat gpuAlignedDepth;
+    bool res = gpuEngine->Process(params, frameProcessingParams, lastProcessedPoints,
+        isAlignedDepthRequested ? &gpuAlignedDepth : nullptr);
+
+    if (res && isAlignedDepthRequested) {
+        alignedDepthFrame = gpuAlignedDepth;
+    }
+
+    return res;
+}
+
+/// <summary>
+/// Generates the point cloud of the latest acquired frameset with the filters of the Orbbec SDK: the color frame is
+/// aligned to the depth frame, then the SDK computes one colored point per depth pixel. The points are then moved to
+/// color camera space, like the ones of the point cloud kernels, and to world space when requested.
+/// </summary>
+/// <param name="isWorldTransformRequested">Indicates whether the calibration should be applied to the vertices</param>
+/// <returns>True if the point cloud was generated by the SDK; false if the CPU path should be used instead.</returns>
+bool OrbbecCaptureManager::UpdatePointCloudSdk(std::shared_ptr<ob::FrameSet> frameset, bool isWorldTransformRequested) {
+    // The SDK filters get the frameset as received, before the color frame is decoded
+    if (isColorStreamCompressed) {
+        return false;
+    }
+
+    if (depthRayTable.empty() || rayTableWidth != depthFrameWidth || rayTableHeight != depthFrameHeight) {
+        UpdateCameraParameters();
+    }
+
+    std::shared_ptr<ob::PointsFrame> pointsFrame;
+
+    try {
+        if (!sdkAlignFilter) {
+            sdkAlignFilter = std::make_shared<ob::Align>(OB_STREAM_DEPTH);
+            sdkPointCloudFilter = std::make_shared<ob::PointCloudFilter>();
+            sdkPointCloudFilter->setCreatePointFormat(OB_FORMAT_RGB_POINT);
+        }
+
+        sdkPointCloudFilter->setCameraParam(cameraParams);
+
+        std::shared_ptr<ob::Frame> alignedFrameset = sdkAlignFilter->process(frameset);
+        std::shared_ptr<ob::Frame> points = alignedFrameset ? sdkPointCloudFilter->process(alignedFrameset) : nullptr;
+        pointsFrame = points ? points->as<ob::PointsFrame>() : nullptr;
+    }
+    catch (const ob::Error& e) {
+        if (logFn) logFn("[OrbbecCaptureManager] SDK point cloud failed, using the CPU backend: " + std::string(e.getMessage()));
+        processingBackend = CpuProcessing;
+        return false;
+    }
+
+    size_t numPixels = static_cast<size_t>(depthFrameWidth) * depthFrameHeight;
+
+    if (!pointsFrame || pointsFrame->dataSize() != numPixels * sizeof(OBColorPoint)) {
+        return false;
+    }
+
+    // Same transforms as the point cloud kernels: depth camera to color camera, then color camera to world
+    PointCloudKernelParams params = GetPointCloudKernelParams(isWorldTransformRequested, false);
+    isFrameInWorldSpace = isWorldTransformRequested && frameProcessingParams.isCalibrated;
+
+    const OBColorPoint* sdkPoints = static_cast<const OBColorPoint*>(pointsFrame->data());
+    float positionScale = pointsFrame->getPositionValueScale() / 1000.0f; // SDK positions are in millimeters
+    const float* R = params.rot;
+    const float* t = params.trans;
+    const float* M = params.world;
+
+    if (kernelPoints.Size() != numPixels) {
+        kernelPoints.Resize(numPixels);
+    }
+
+    int numPoints = 0;
+
+    for (size_t i = 0; i < numPixels; ++i) {
+        const OBColorPoint& point = sdkPoints[i];
+
+        if (point.z <= 0.0f) {
+            continue;
+        }
+
+        float x = point.x * positionScale;
+        float y = point.y * positionScale;
+        float z = point.z * positionScale;
+
+        float colorX = R[0] * x + R[1] * y + R[2] * z + t[0];
+        float colorY = R[3] * x + R[4] * y + R[5] * z + t[1];
+        float colorZ = R[6] * x + R[7] * y + R[8] * z + t[2];
+
+        kernelPoints.X[numPoints] = M[0] * colorX + M[1] * colorY + M[2] * colorZ + M[3];
+        kernelPoints.Y[numPoints] = M[4] * colorX + M[5] * colorY + M[6] * colorZ + M[7];
+        kernelPoints.Z[numPoints] = M[8] * colorX + M[9] * colorY + M[10] * colorZ + M[11];
+        kernelPoints.Colors[numPoints] = { static_cast<BYTE>(point.b), static_cast<BYTE>(point.g), static_cast<BYTE>(point.r) };
+        kernelPoints.PixelIndices[numPoints] = static_cast<int>(i);
+        numPoints++;
+    }
+
+    lastFramePoints.AssignFirst(kernelPoints, numPoints);
+
+    return true;
+}
+
+/// <summary>
+/// Accumulates the point cloud generation time of a backend and periodically logs its average cost per frame
+/// </summary>
+void OrbbecCaptureManager::RecordPointCloudCost(ProcessingBackend backend, double costMs) {
+    static const char* BackendNames[NumProcessingBackends] = { "CPU", "GPU", "SDK" };
+
+    pointCloudCostMs[backend] += costMs;
+    numPointCloudFrames[backend]++;
+
+    if (numPointCloudFrames[backend] < CostReportInterval) {
+        return;
+    }
+
+    if (logFn) logFn("[OrbbecCaptureManager] Device " + std::to_string(deviceIndex) + ": " + BackendNames[backend] + " point cloud takes "
+        + std::to_string(pointCloudCostMs[backend] / numPointCloudFrames[backend]) + " ms per frame");
+
+    pointCloudCostMs[backend] = 0.0;
+    numPointCloudFrames[backend] = 0;
+}
+
+/// <summary>
+/// Starts or stops the raw recording as requested, then copies the latest frame to it
+/// </summary>
+void OrbbecCaptureManager::UpdateRawRecording() {
+    if (isRawRecordingRequested && !rawRecorder.IsRecording()) {
+        if (rawRecorder.Start(deviceIndex, serialNumber)) {
+            if (logFn) logFn("[OrbbecCaptureManager] Recording raw frames to " + rawRecorder.GetFilename());
+        }
+        else {
+            if (logFn) logFn("[OrbbecCaptureManager] Failed to open " + rawRecorder.GetFilename() + " for the raw recording");
+            isRawRecordingRequested = false;
+        }
+    }
+    else if (!isRawRecordingRequested && rawRecorder.IsRecording()) {
+        rawRecorder.Stop();
+
+        if (logFn) logFn("[OrbbecCaptureManager] Device " + std::to_string(deviceIndex) + ": " + std::to_string(rawRecorder.GetNumWrittenFrames())
+            + " raw frames recorded, " + std::to_string(rawRecorder.GetNumDroppedFrames()) + " dropped");
+    }
+
+    if (!rawRecorder.IsRecording()) {
+        return;
+    }
+
+    RawFrameHeader header = {};
+    header.Timestamp = currentTimeStamp;
+    header.DepthWidth = depthFrameWidth;
+    header.DepthHeight = depthFrameHeight;
+    header.ColorWidth = colorFrameWidth;
+    header.ColorHeight = colorFrameHeight;
+
+    header.CameraParams = GetCameraParams();
+
+    rawRecorder.WriteFrame(header, depthData, GetRgbColorImage().data);
+}
+
+/// <summary>
+/// Gives the latest color frame in RGB888, as the document detection and the raw recordings expect it. YUV frames are
+/// converted once per frame, into a buffer reused from one frame to the next.
+/// </summary>
+cv::Mat OrbbecCaptureManager::GetRgbColorImage() {
+    BYTE* data = const_cast<BYTE*>(colorData);
+
+    if (colorFormat == ColorRgb888) {
+        return cv::Mat(colorFrameHeight, colorFrameWidth, CV_8UC3, data);
+    }
+
+    if (!isRgbColorImageCurrent) {
+        if (colorFormat == ColorYuyv) {
+            cv::cvtColor(cv::Mat(colorFrameHeight, colorFrameWidth, CV_8UC2, data), rgbColorImage, cv::COLOR_YUV2RGB_YUYV);
+        }
+        else {
+            cv::cvtColor(cv::Mat(colorFrameHeight * 3 / 2, colorFrameWidth, CV_8UC1, data), rgbColorImage, cv::COLOR_YUV2RGB_NV12);
+        }
+
+        isRgbColorImageCurrent = true;
+    }
+
+    return rgbColorImage;
+}
+
+/// <summary>
+/// Gives the camera parameters of the running stream profile, as recorded with the raw frames
+/// </summary>
+RawCameraParams OrbbecCaptureManager::GetCameraParams() {
+    RawCameraParams params;
+    params.DepthFx = cameraParams.depthIntrinsic.fx;
+    params.DepthFy = cameraParams.depthIntrinsic.fy;
+    params.DepthCx = cameraParams.depthIntrinsic.cx;
+    params.DepthCy = cameraParams.depthIntrinsic.cy;
+    params.ColorFx = cameraParams.rgbIntrinsic.fx;
+    params.ColorFy = cameraParams.rgbIntrinsic.fy;
+    params.ColorCx = cameraParams.rgbIntrinsic.cx;
+    params.ColorCy = cameraParams.rgbIntrinsic.cy;
+
+    for (int i = 0; i < 9; ++i) {
+        params.Rot[i] = cameraParams.transform.rot[i];
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        params.Trans[i] = cameraParams.transform.trans[i];
+    }
+
+    return params;
+}
+
+/// <summary>
+/// Starts or stops recording the raw depth and color frames, with their camera parameters, for the replay capture
+/// manager; applied by the capture thread before its next frame
+/// </summary>
+void OrbbecCaptureManager::SetRawRecording(bool isEnabled) {
+    isRawRecordingRequested = isEnabled;
+}
+
+/// <summary>
+/// Selects whether point clouds are generated on the CPU, with the GPU engine or with the filters of the camera SDK
+/// </summary>
+void OrbbecCaptureManager::SetProcessingBackend(ProcessingBackend backend) {
+    processingBackend = backend;
+}
+
+/// <summary>
+/// Sets the calibration, bounds and voxel grid parameters applied by backends which process frames at capture time
+/// </summary>
+void OrbbecCaptureManager::SetFrameProcessingParams(const FrameProcessingParams& params) {
+    frameProcessingParams = params;
+    framePairingToleranceUs = params.framePairingToleranceUs;
 }
 
 bool OrbbecCaptureManager::Close()
@@ -480,6 +1612,25 @@ bool OrbbecCaptureManager::Close()
         return false;
 
     try {
+        // Stop waiting for frames, then release the frames held by this instance before stopping the pipeline that owns them
+        StopCapture();
+
+        if (logFn) {
+            std::lock_guard<std::mutex> lock(frameRingMutex);
+            logFn("[OrbbecCaptureManager] Device " + std::to_string(deviceIndex) + ": " + std::to_string(numCapturedFrames) + " frames captured, "
+                + std::to_string(numDroppedFrames) + " dropped, " + std::to_string(numIncompleteFrames) + " incomplete; " + GetFramePairingSummary());
+        }
+
+        rawRecorder.Stop();
+        currentColorFrame.reset();
+        currentDepthFrame.reset();
+        gpuEngine.reset();
+        sdkAlignFilter.reset();
+        sdkPointCloudFilter.reset();
+        mjpgDecoder.reset();
+        colorData = nullptr;
+        depthData = nullptr;
+
         if (pipeline) {
             pipeline->stop(); // Stop streaming
             pipeline.reset(); // Release the pipeline
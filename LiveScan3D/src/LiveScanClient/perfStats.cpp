@@ -0,0 +1,128 @@
+/***************************************************************************\
+
+Module Name:  PerfStats.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module measures the time each stage of the frame loop of a client
+takes, so that a drop of the frame rate can be traced to its stage. The
+durations are recorded without locks into a histogram per stage, with
+logarithmic buckets, from which the server reads the percentiles.
+
+\***************************************************************************/
+
+#include "perfStats.h"
+#include <algorithm>
+#include <cmath>
+
+PerfHistogram::PerfHistogram()
+{
+    for (int i = 0; i < NumBuckets; i++)
+        buckets[i].store(0, std::memory_order_relaxed);
+
+    totalUs.store(0, std::memory_order_relaxed);
+    maxUs.store(0, std::memory_order_relaxed);
+    lastUs.store(0, std::memory_order_relaxed);
+}
+
+void PerfHistogram::Record(double durationUs)
+{
+    durationUs = (std::max)(durationUs, 0.0);
+
+    // Bucket 0 holds everything below the first octave
+    int bucket = durationUs < 1.0 ? 0 : static_cast<int>(std::log2(durationUs) * BucketsPerOctave);
+    bucket = (std::min)(bucket, NumBuckets - 1);
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    totalUs.fetch_add(static_cast<uint64_t>(durationUs), std::memory_order_relaxed);
+
+    uint32_t duration = static_cast<uint32_t>((std::min)(durationUs, 4e9));
+    uint32_t currentMax = maxUs.load(std::memory_order_relaxed);
+    lastUs.store(duration, std::memory_order_relaxed);
+
+    while (duration > currentMax && !maxUs.compare_exchange_weak(currentMax, duration, std::memory_order_relaxed))
+    {
+    }
+}
+
+/// <summary>
+/// Summarizes the recorded durations; the percentiles are the middle of their bucket, within 9% of the exact value
+/// </summary>
+/// <param name="isReset">Starts a new histogram, so that the next summary only covers the durations recorded after this one</param>
+PerfStageStats PerfHistogram::GetStats(bool isReset)
+{
+    uint32_t counts[NumBuckets];
+    uint64_t count = 0;
+
+    for (int i = 0; i < NumBuckets; i++)
+    {
+        counts[i] = isReset ? buckets[i].exchange(0, std::memory_order_relaxed) : buckets[i].load(std::memory_order_relaxed);
+        count += counts[i];
+    }
+
+    uint64_t total = isReset ? totalUs.exchange(0, std::memory_order_relaxed) : totalUs.load(std::memory_order_relaxed);
+    uint32_t max = isReset ? maxUs.exchange(0, std::memory_order_relaxed) : maxUs.load(std::memory_order_relaxed);
+
+    PerfStageStats stats = {};
+    stats.Count = static_cast<unsigned int>(count);
+
+    if (count == 0)
+        return stats;
+
+    float maxMs = max / 1000.0f;
+    stats.MeanMs = static_cast<float>(total / 1000.0 / count);
+    stats.MaxMs = maxMs;
+
+    // Walk the buckets once for the three percentiles, in increasing order
+    const double percentiles[] = { 0.50, 0.95, 0.99 };
+    float* results[] = { &stats.P50Ms, &stats.P95Ms, &stats.P99Ms };
+    int percentile = 0;
+    uint64_t cumulativeCount = 0;
+
+    for (int i = 0; i < NumBuckets && percentile < 3; i++)
+    {
+        cumulativeCount += counts[i];
+
+        while (percentile < 3 && cumulativeCount >= std::ceil(percentiles[percentile] * count))
+        {
+            *results[percentile] = (std::min)(GetBucketDurationMs(i), maxMs);
+            percentile++;
+        }
+    }
+
+    return stats;
+}
+
+/// <summary>
+/// Geometric middle of the durations of a bucket
+/// </summary>
+float PerfHistogram::GetBucketDurationMs(int bucket)
+{
+    return std::pow(2.0f, (bucket + 0.5f) / BucketsPerOctave) / 1000.0f;
+}
+
+void PerfStats::Record(PerfStage stage, double durationUs)
+{
+    histograms[stage].Record(durationUs);
+}
+
+/// <summary>
+/// Summarizes the timings of each stage
+/// </summary>
+/// <param name="stats">Receives the timings of the stages, in the order of PerfStage</param>
+/// <param name="isReset">Starts new histograms, so that the next summaries only cover the frames after this one</param>
+/// <returns>Number of stages written to stats</returns>
+int PerfStats::GetStats(PerfStageStats* stats, int maxStages, bool isReset)
+{
+    int numStages = (std::min)(maxStages, static_cast<int>(NumPerfStages));
+
+    for (int i = 0; i < numStages; i++)
+    {
+        stats[i] = histograms[i].GetStats(isReset);
+        stats[i].Stage = i;
+    }
+
+    return numStages;
+}
@@ -0,0 +1,950 @@
+/***************************************************************************\
+
+Module Name:  PointCloudEncoder.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the encoder of the merged point cloud sent to the
+receivers. The points of all the cameras are quantized to one byte per axis,
+four at a time with SSE2, deduplicated with an occupancy bitmap of the whole
+byte grid and written to the full frame wire buffer. The frame can also be
+coded as an octree, with the voxels radix sorted in Morton order and one
+child occupancy mask per node, and with the colors in YCoCg predicted from the previous
+voxel in that order, or as a progressive frame: a coarse level of the
+octree, then one refinement chunk for each finer level, each with the mean
+colors of its nodes. Capture volumes larger than the byte grid are coded as
+wide frames, with 32-bit positions quantized within the bounding box of each
+frame. Triangle meshes are coded like wide frames, with all their vertices,
+followed by the vertex indices of their triangles.
+
+\***************************************************************************/
+
+#include "pointCloudEncoder.h"
+#include "taskScheduler.h"
+#include <emmintrin.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+    // Below this many codes, sorting with std::sort costs less than clearing and summing the histograms
+    const size_t MinRadixSortedCodes = 1024;
+
+    /// <summary>
+    /// Sorts codes of the form key << 32 | index by their key, with a least significant digit radix sort of the bits
+    /// of the key that can be set. The sort is stable, so the codes whose indices are increasing end up fully sorted,
+    /// the same as with std::sort. The histograms of all the digits are counted in a single read of the codes, and
+    /// the digits which are the same for all the codes are skipped.
+    /// </summary>
+    /// <param name="codes">Codes to sort</param>
+    /// <param name="scratch">Buffer the codes are scattered to, reused by the next sorts</param>
+    /// <param name="numKeyBits">Number of low bits of the keys which can be set</param>
+    void RadixSortCodes(std::vector<uint64_t>& codes, std::vector<uint64_t>& scratch, int numKeyBits)
+    {
+        if (codes.size() < MinRadixSortedCodes)
+        {
+            std::sort(codes.begin(), codes.end());
+            return;
+        }
+
+        const int DigitBits = 8;
+        const int NumBuckets = 1 << DigitBits;
+        const int MaxDigits = 32 / DigitBits;
+        int numDigits = (std::min)((numKeyBits + DigitBits - 1) / DigitBits, MaxDigits);
+        size_t histograms[MaxDigits][NumBuckets] = {};
+
+        for (uint64_t code : codes)
+        {
+            uint32_t key = static_cast<uint32_t>(code >> 32);
+
+            for (int digit = 0; digit < numDigits; digit++)
+                histograms[digit][(key >> (digit * DigitBits)) & (NumBuckets - 1)]++;
+        }
+
+        scratch.resize(codes.size());
+
+        for (int digit = 0; digit < numDigits; digit++)
+        {
+            size_t* counts = histograms[digit];
+            int shift = 32 + digit * DigitBits;
+
+            if (counts[(codes[0] >> shift) & (NumBuckets - 1)] == codes.size())
+                continue;
+
+            // Turn the counts into the first position of each bucket
+            size_t offset = 0;
+
+            for (int bucket = 0; bucket < NumBuckets; bucket++)
+            {
+                size_t count = counts[bucket];
+                counts[bucket] = offset;
+                offset += count;
+            }
+
+            for (uint64_t code : codes)
+                scratch[counts[(code >> shift) & (NumBuckets - 1)]++] = code;
+
+            codes.swap(scratch);
+        }
+    }
+
+    /// <summary>
+    /// Spreads the 8 bits of a byte 3 bits apart, so that the bits of three bytes can be interleaved with shifts and ors
+    /// </summary>
+    inline uint32_t SpreadByteBits(uint32_t value)
+    {
+        value = (value | (value << 8)) & 0x0000F00F;
+        value = (value | (value << 4)) & 0x000C30C3;
+        value = (value | (value << 2)) & 0x00249249;
+        return value;
+    }
+
+    /// <summary>
+    /// Encodes a position to a byte, using the scale to reduce the resolution. Matches the encoding of the receivers.
+    /// </summary>
+    inline uint8_t EncodeFloatToByte(float value, float rangeCenter, float scale)
+    {
+        float result = (value + PointCloudEncoder::HalfRange - rangeCenter) * scale;
+
+        if (result < 0.0f)
+            result = 0.0f;
+        else if (result > 255.0f)
+            result = 255.0f;
+
+        return static_cast<uint8_t>(result);
+    }
+
+    /// <summary>
+    /// Checks that a position fits in the range of values allowed in one byte. NaN positions are rejected.
+    /// </summary>
+    inline bool IsInRange(float value, float rangeCenter)
+    {
+        return std::fabs(value - rangeCenter) <= PointCloudEncoder::HalfRange;
+    }
+
+    inline uint32_t PackVoxel(const uint8_t* voxel)
+    {
+        return (static_cast<uint32_t>(voxel[0]) << 16) | (static_cast<uint32_t>(voxel[1]) << 8) | voxel[2];
+    }
+
+    /// <summary>
+    /// Quantizes one axis of four points like EncodeFloatToByte, and sets the lanes of the mask of the values out of
+    /// range, NaN included, like IsInRange. The operations are those of the scalar functions, in the same order, so the
+    /// bytes are the same.
+    /// </summary>
+    inline __m128i QuantizeAxis(__m128 values, float rangeCenter, __m128 scale, __m128& outOfRange)
+    {
+        const __m128 center = _mm_set1_ps(rangeCenter);
+        const __m128 halfRange = _mm_set1_ps(PointCloudEncoder::HalfRange);
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+        __m128 distance = _mm_and_ps(_mm_sub_ps(values, center), absMask);
+        outOfRange = _mm_or_ps(outOfRange, _mm_cmpnle_ps(distance, halfRange));
+
+        __m128 result = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(values, halfRange), center), scale);
+        result = _mm_min_ps(_mm_max_ps(result, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+
+        return _mm_cvttps_epi32(result);
+    }
+
+    /// <summary>
+    /// Quantizes four consecutive points to their packed voxels (x << 16 | y << 8 | z), read as three vectors of
+    /// interleaved coordinates and split by axis
+    /// </summary>
+    /// <returns>The mask of the points in range, one bit for each point</returns>
+    inline int QuantizeVoxels(const float* vertices, __m128 scale, uint32_t* voxels)
+    {
+        __m128 a = _mm_loadu_ps(vertices); // x0 y0 z0 x1
+        __m128 b = _mm_loadu_ps(vertices + 4); // y1 z1 x2 y2
+        __m128 c = _mm_loadu_ps(vertices + 8); // z2 x3 y3 z3
+
+        __m128 x = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 2, 3, 0)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 1, 0, 2)), _MM_SHUFFLE(2, 0, 1, 0));
+        __m128 y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 2, 0, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 1, 0, 2)), c, _MM_SHUFFLE(3, 0, 2, 0));
+
+        __m128 outOfRange = _mm_setzero_ps();
+        __m128i qx = QuantizeAxis(x, PointCloudEncoder::XRangeCenter, scale, outOfRange);
+        __m128i qy = QuantizeAxis(y, PointCloudEncoder::YRangeCenter, scale, outOfRange);
+        __m128i qz = QuantizeAxis(z, PointCloudEncoder::ZRangeCenter, scale, outOfRange);
+
+        __m128i packed = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(qx, 16), _mm_slli_epi32(qy, 8)), qz);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(voxels), packed);
+
+        return ~_mm_movemask_ps(outOfRange) & 0xF;
+    }
+
+    /// <summary>
+    /// Divides a chroma value by the quantization step, rounding to the nearest
+    /// </summary>
+    inline int QuantizeChroma(int value, int step)
+    {
+        return value >= 0 ? (value + step / 2) / step : -((-value + step / 2) / step);
+    }
+
+    /// <summary>
+    /// Appends a prediction residual as a zigzag varint: 7 bits per byte, so the small residuals take a single byte
+    /// </summary>
+    inline void AppendResidual(std::vector<uint8_t>& output, int residual)
+    {
+        uint32_t value = (static_cast<uint32_t>(residual) << 1) ^ static_cast<uint32_t>(residual >> 31);
+
+        while (value >= 0x80)
+        {
+            output.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+
+        output.push_back(static_cast<uint8_t>(value));
+    }
+}
+
+PointCloudEncoder::PointCloudEncoder() : occupancy(NumVoxels / 64), numEncodedVertices(0)
+{
+    buffer.resize(HeaderSize, 0);
+}
+
+/// <summary>
+/// Converts the points of a camera frame, in millimeters with BGR colors as the clients publish them, to the layout of
+/// the merged frames, in meters with RGB colors. The coordinates are divided rather than multiplied by 0.001, so that
+/// they are the same floats as those the server converted before.
+/// </summary>
+/// <param name="millimeters">Positions of the points (x, y, z for each point)</param>
+/// <param name="bgrColors">Colors of the points (b, g, r for each point)</param>
+void PointCloudEncoder::ConvertPoints(const int16_t* millimeters, const uint8_t* bgrColors, int numPoints, float* vertices, uint8_t* colors)
+{
+    int numValues = 3 * (numPoints > 0 ? numPoints : 0);
+    const __m128 millimetersPerMeter = _mm_set1_ps(1000.0f);
+    int i = 0;
+
+    // The axes are interleaved the same way on both sides, so the values are converted in order, eight at a time
+    for (; i + 8 <= numValues; i += 8)
+    {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(millimeters + i));
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(values, values), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(values, values), 16);
+
+        _mm_storeu_ps(vertices + i, _mm_div_ps(_mm_cvtepi32_ps(low), millimetersPerMeter));
+        _mm_storeu_ps(vertices + i + 4, _mm_div_ps(_mm_cvtepi32_ps(high), millimetersPerMeter));
+    }
+
+    for (; i < numValues; i++)
+        vertices[i] = millimeters[i] / 1000.0f;
+
+    for (i = 0; i < numValues; i += 3)
+    {
+        colors[i] = bgrColors[i + 2];
+        colors[i + 1] = bgrColors[i + 1];
+        colors[i + 2] = bgrColors[i];
+    }
+}
+
+/// <summary>
+/// Encodes a frame: the points out of range are dropped, the others are quantized with the given scale and only the
+/// first point of each voxel is kept, so that the points seen by several cameras are sent once.
+/// </summary>
+/// <param name="vertices">Positions of the merged frame, in meters (x, y, z for each vertex)</param>
+/// <param name="colors">Colors of the merged frame (r, g, b for each vertex)</param>
+/// <param name="numVertices">Number of vertices of the frame</param>
+/// <param name="scale">Scale applied to the positions before they are quantized</param>
+/// <returns>The size of the wire buffer, which is valid until the next call</returns>
+int PointCloudEncoder::Encode(const float* vertices, const uint8_t* colors, int numVertices, int16_t scale)
+{
+    numVertices = numVertices > 0 ? numVertices : 0;
+
+    // The colors follow all the vertices on the wire, so they are gathered apart and appended once the count is known
+    buffer.resize(HeaderSize + 3 * static_cast<size_t>(numVertices));
+    voxelColors.resize(3 * static_cast<size_t>(numVertices));
+
+    int numEncoded = EncodeRange(vertices, colors, 0, numVertices, scale, buffer.data() + HeaderSize, voxelColors.data(), false);
+
+    std::memcpy(buffer.data(), &scale, sizeof(scale));
+    std::memcpy(buffer.data() + sizeof(scale), &numEncoded, sizeof(numEncoded));
+
+    buffer.resize(HeaderSize + 6 * static_cast<size_t>(numEncoded));
+    std::memcpy(buffer.data() + HeaderSize + 3 * numEncoded, voxelColors.data(), 3 * static_cast<size_t>(numEncoded));
+
+    numEncodedVertices = numEncoded;
+    ClearOccupancy();
+
+    return GetSize();
+}
+
+/// <summary>
+/// Encodes a frame like Encode, with the points of each chunk, such as the points of one camera, quantized on a task of
+/// their own. Each chunk writes its voxels to its own part of the buffer, and the parts are then joined in the order
+/// of the chunks under the header of the frame. A voxel reached by several chunks is kept by the first one to reach
+/// it, so the points of the cameras which see the same surface are still sent once.
+/// </summary>
+/// <param name="chunkSizes">Number of vertices of each chunk, in the order of the merged frame; the vertices past the
+/// last chunk are left out</param>
+/// <param name="numChunks">Number of chunks of the frame</param>
+/// <returns>The size of the wire buffer, which is valid until the next call</returns>
+int PointCloudEncoder::EncodeChunks(const float* vertices, const uint8_t* colors, const int* chunkSizes, int numChunks, int16_t scale)
+{
+    int numVertices = 0;
+    chunkOffsets.clear();
+
+    for (int i = 0; i < numChunks; i++)
+    {
+        chunkOffsets.push_back(numVertices);
+        numVertices += chunkSizes[i] > 0 ? chunkSizes[i] : 0;
+    }
+
+    if (numChunks <= 1 || numVertices < MinChunkedVertices)
+        return Encode(vertices, colors, numVertices, scale);
+
+    buffer.resize(HeaderSize + 3 * static_cast<size_t>(numVertices));
+    voxelColors.resize(3 * static_cast<size_t>(numVertices));
+    chunkCounts.assign(numChunks, 0);
+
+    uint8_t* outVertices = buffer.data() + HeaderSize;
+    uint8_t* outColors = voxelColors.data();
+
+    TaskScheduler::Instance().ParallelFor(0, numChunks, [&](int chunk)
+    {
+        int begin = chunkOffsets[chunk];
+        int end = begin + (chunkSizes[chunk] > 0 ? chunkSizes[chunk] : 0);
+
+        chunkCounts[chunk] = EncodeRange(vertices, colors, begin, end, scale, outVertices + 3 * static_cast<size_t>(begin),
+            outColors + 3 * static_cast<size_t>(begin), true);
+    });
+
+    // The parts of the chunks are moved down to follow each other; a part never moves past its own start, so the
+    // parts not yet moved are never overwritten
+    int numEncoded = 0;
+
+    for (int i = 0; i < numChunks; i++)
+    {
+        size_t offset = 3 * static_cast<size_t>(chunkOffsets[i]);
+        std::memmove(outVertices + 3 * static_cast<size_t>(numEncoded), outVertices + offset, 3 * static_cast<size_t>(chunkCounts[i]));
+        std::memmove(outColors + 3 * static_cast<size_t>(numEncoded), outColors + offset, 3 * static_cast<size_t>(chunkCounts[i]));
+        numEncoded += chunkCounts[i];
+    }
+
+    std::memcpy(buffer.data(), &scale, sizeof(scale));
+    std::memcpy(buffer.data() + sizeof(scale), &numEncoded, sizeof(numEncoded));
+
+    buffer.resize(HeaderSize + 6 * static_cast<size_t>(numEncoded));
+    std::memcpy(buffer.data() + HeaderSize + 3 * numEncoded, voxelColors.data(), 3 * static_cast<size_t>(numEncoded));
+
+    numEncodedVertices = numEncoded;
+    ClearOccupancy();
+
+    return GetSize();
+}
+
+/// <summary>
+/// Quantizes a range of the points of a frame, and writes the voxels not yet occupied and their colors in order
+/// </summary>
+/// <param name="isConcurrent">Whether other ranges of the frame are encoded at the same time, which then set the bits
+/// of the occupancy bitmap with atomic operations</param>
+/// <returns>The number of voxels written</returns>
+int PointCloudEncoder::EncodeRange(const float* vertices, const uint8_t* colors, int begin, int end, int16_t scale, uint8_t* outVertices, uint8_t* outColors,
+    bool isConcurrent)
+{
+    float scaleValue = static_cast<float>(scale);
+    int numEncoded = 0;
+
+    // Keeps the first point of each voxel; another point, possibly from another camera, may already map to it
+    auto AppendVoxel = [&](int i, uint32_t voxel) {
+        uint64_t bit = 1ull << (voxel & 63);
+        std::atomic<uint64_t>& word = occupancy[voxel >> 6];
+        uint64_t previous = isConcurrent ? word.fetch_or(bit, std::memory_order_relaxed) : word.load(std::memory_order_relaxed);
+
+        if (previous & bit)
+            return;
+
+        if (!isConcurrent)
+            word.store(previous | bit, std::memory_order_relaxed);
+
+        uint8_t* outVertex = outVertices + 3 * static_cast<size_t>(numEncoded);
+        outVertex[0] = static_cast<uint8_t>(voxel >> 16);
+        outVertex[1] = static_cast<uint8_t>(voxel >> 8);
+        outVertex[2] = static_cast<uint8_t>(voxel);
+        std::memcpy(outColors + 3 * static_cast<size_t>(numEncoded), colors + 3 * static_cast<size_t>(i), 3);
+        numEncoded++;
+    };
+
+    // The points are quantized four at a time, straight from the floats of the merged frame to their voxels
+    const __m128 scaleVector = _mm_set1_ps(scaleValue);
+    alignas(16) uint32_t voxels[4];
+    int i = begin;
+
+    for (; i + 4 <= end; i += 4)
+    {
+        int inRangeMask = QuantizeVoxels(vertices + 3 * static_cast<size_t>(i), scaleVector, voxels);
+
+        for (int lane = 0; inRangeMask != 0; lane++, inRangeMask >>= 1)
+        {
+            if (inRangeMask & 1)
+                AppendVoxel(i + lane, voxels[lane]);
+        }
+    }
+
+    for (; i < end; i++)
+    {
+        const float* vertex = vertices + 3 * static_cast<size_t>(i);
+
+        if (!IsInRange(vertex[0], XRangeCenter) || !IsInRange(vertex[1], YRangeCenter) || !IsInRange(vertex[2], ZRangeCenter))
+            continue;
+
+        uint8_t voxel[3] = {
+            EncodeFloatToByte(vertex[0], XRangeCenter, scaleValue),
+            EncodeFloatToByte(vertex[1], YRangeCenter, scaleValue),
+            EncodeFloatToByte(vertex[2], ZRangeCenter, scaleValue)
+        };
+
+        AppendVoxel(i, PackVoxel(voxel));
+    }
+
+    return numEncoded;
+}
+
+const uint8_t* PointCloudEncoder::GetBuffer() const
+{
+    return buffer.data();
+}
+
+int PointCloudEncoder::GetSize() const
+{
+    return static_cast<int>(buffer.size());
+}
+
+int PointCloudEncoder::GetNumVertices() const
+{
+    return numEncodedVertices;
+}
+
+/// <summary>
+/// Clears the bits set by the last frame. A frame only touches a small part of the 2 MB bitmap, so this is much
+/// cheaper than clearing all of it.
+/// </summary>
+void PointCloudEncoder::ClearOccupancy()
+{
+    const uint8_t* encodedVertices = buffer.data() + HeaderSize;
+
+    for (int i = 0; i < numEncodedVertices; i++)
+        occupancy[PackVoxel(encodedVertices + 3 * i) >> 6].store(0, std::memory_order_relaxed);
+}
+
+/// <summary>
+/// Codes the last encoded frame as an octree of the byte grid. The voxels are sorted in Morton order and each node
+/// of the 8 levels is sent as the mask of its occupied children, breadth first, followed by the colors in the same
+/// order. The header is the same as the full frame's, so the number of masks to read is given by the masks themselves.
+/// </summary>
+/// <param name="chromaStep">Quantization step of the chroma channels; 1 codes the colors without loss</param>
+/// <returns>The size of the octree buffer, which is valid until the next call</returns>
+int PointCloudEncoder::EncodeOctree(int chromaStep)
+{
+    SortMortonCodes();
+
+    octreeBuffer.assign(buffer.begin(), buffer.begin() + HeaderSize);
+
+    for (int depth = 0; depth < OctreeDepth && numEncodedVertices > 0; depth++)
+        AppendLevelMasks(octreeBuffer, depth);
+
+    EncodeOctreeColors(chromaStep);
+
+    return GetOctreeSize();
+}
+
+/// <summary>
+/// Codes the last encoded frame as a progressive octree, so that the receivers can render a coarse frame before all
+/// of it is received. The first chunk holds the masks of the levels above the coarse depth and the colors of its
+/// nodes; each following chunk refines the frame by one level, with the masks of the level above and the colors of
+/// its nodes. A chunk body is the number of nodes (int), the masks and the mean RGB colors of the nodes.
+/// </summary>
+/// <param name="coarseDepth">Depth of the first chunk, from 1 to 8; a node of depth d is a cube of 2^(8-d) voxels on each side</param>
+/// <returns>The size of the progressive buffer, which is valid until the next call</returns>
+int PointCloudEncoder::EncodeProgressive(int coarseDepth)
+{
+    SortMortonCodes();
+
+    coarseDepth = (std::max)(1, (std::min)(coarseDepth, OctreeDepth));
+    progressiveBuffer.assign(buffer.begin(), buffer.begin() + HeaderSize);
+
+    for (int depth = coarseDepth; depth <= OctreeDepth && numEncodedVertices > 0; depth++)
+    {
+        size_t chunkOffset = progressiveBuffer.size();
+        progressiveBuffer.resize(chunkOffset + ChunkHeaderSize + sizeof(int32_t));
+
+        for (int maskDepth = depth == coarseDepth ? 0 : depth - 1; maskDepth < depth; maskDepth++)
+            AppendLevelMasks(progressiveBuffer, maskDepth);
+
+        int32_t numNodes = AppendLevelColors(progressiveBuffer, depth);
+        int32_t bodySize = static_cast<int32_t>(progressiveBuffer.size() - chunkOffset - ChunkHeaderSize);
+
+        progressiveBuffer[chunkOffset] = static_cast<uint8_t>(depth);
+        std::memcpy(progressiveBuffer.data() + chunkOffset + 1, &bodySize, sizeof(bodySize));
+        std::memcpy(progressiveBuffer.data() + chunkOffset + ChunkHeaderSize, &numNodes, sizeof(numNodes));
+    }
+
+    return GetProgressiveSize();
+}
+
+/// <summary>
+/// Sorts the voxels of the last encoded frame in Morton order
+/// </summary>
+void PointCloudEncoder::SortMortonCodes()
+{
+    const uint8_t* encodedVertices = buffer.data() + HeaderSize;
+
+    mortonCodes.resize(numEncodedVertices);
+
+    for (int i = 0; i < numEncodedVertices; i++)
+    {
+        const uint8_t* voxel = encodedVertices + 3 * i;
+
+        // The bits of x, y and z are interleaved from the most significant, so a child index is (x << 2) | (y << 1) | z
+        uint64_t code = (SpreadByteBits(voxel[0]) << 2) | (SpreadByteBits(voxel[1]) << 1) | SpreadByteBits(voxel[2]);
+
+        mortonCodes[i] = (code << 32) | static_cast<uint32_t>(i);
+    }
+
+    RadixSortCodes(mortonCodes, sortScratch, 3 * OctreeDepth);
+}
+
+/// <summary>
+/// Appends the child occupancy masks of the nodes of a level. The nodes of a level are the distinct prefixes of the
+/// sorted codes, so the children of each node are contiguous.
+/// </summary>
+void PointCloudEncoder::AppendLevelMasks(std::vector<uint8_t>& output, int depth) const
+{
+    if (mortonCodes.empty())
+        return;
+
+    int nodeShift = 32 + 3 * (OctreeDepth - depth);
+    int childShift = nodeShift - 3;
+    uint64_t node = mortonCodes[0] >> nodeShift;
+    uint8_t mask = 0;
+
+    for (uint64_t code : mortonCodes)
+    {
+        if ((code >> nodeShift) != node)
+        {
+            output.push_back(mask);
+            node = code >> nodeShift;
+            mask = 0;
+        }
+
+        mask |= static_cast<uint8_t>(1 << ((code >> childShift) & 7));
+    }
+
+    output.push_back(mask);
+}
+
+/// <summary>
+/// Appends the mean RGB color of each node of a level, in Morton order. The leaves keep the color of their voxel.
+/// </summary>
+/// <returns>The number of nodes of the level</returns>
+int PointCloudEncoder::AppendLevelColors(std::vector<uint8_t>& output, int depth) const
+{
+    if (mortonCodes.empty())
+        return 0;
+
+    const uint8_t* encodedColors = buffer.data() + HeaderSize + 3 * static_cast<size_t>(numEncodedVertices);
+    int nodeShift = 32 + 3 * (OctreeDepth - depth);
+    uint64_t node = mortonCodes[0] >> nodeShift;
+    uint32_t sums[3] = { 0, 0, 0 };
+    uint32_t count = 0;
+    int numNodes = 0;
+
+    auto appendMean = [&]()
+    {
+        for (int channel = 0; channel < 3; channel++)
+            output.push_back(static_cast<uint8_t>((sums[channel] + count / 2) / count));
+
+        numNodes++;
+    };
+
+    for (uint64_t code : mortonCodes)
+    {
+        if ((code >> nodeShift) != node)
+        {
+            appendMean();
+            node = code >> nodeShift;
+            sums[0] = sums[1] = sums[2] = 0;
+            count = 0;
+        }
+
+        const uint8_t* color = encodedColors + 3 * static_cast<size_t>(code & 0xFFFFFFFF);
+
+        for (int channel = 0; channel < 3; channel++)
+            sums[channel] += color[channel];
+
+        count++;
+    }
+
+    appendMean();
+
+    return numNodes;
+}
+
+/// <summary>
+/// Appends the colors of the voxels in Morton order: the quantization step (byte) and the size of the coded colors
+/// (int), then the residuals of the Y, Co and Cg channels, one channel after the other. Neighbouring voxels have
+/// similar colors, so each value is predicted from the previous voxel; the channels are kept apart so that the
+/// compression of the payload finds the same residuals together.
+/// </summary>
+void PointCloudEncoder::EncodeOctreeColors(int chromaStep)
+{
+    const uint8_t* encodedColors = buffer.data() + HeaderSize + 3 * static_cast<size_t>(numEncodedVertices);
+    int step = (std::max)(1, (std::min)(chromaStep, 255));
+
+    octreeBuffer.push_back(static_cast<uint8_t>(step));
+
+    size_t sizeOffset = octreeBuffer.size();
+    octreeBuffer.resize(sizeOffset + sizeof(int32_t));
+
+    for (int channel = 0; channel < 3; channel++)
+    {
+        int previous = 0;
+
+        for (uint64_t code : mortonCodes)
+        {
+            const uint8_t* color = encodedColors + 3 * static_cast<size_t>(code & 0xFFFFFFFF);
+
+            // Lossless YCoCg-R transform
+            int co = color[0] - color[2];
+            int t = color[2] + (co >> 1);
+            int cg = color[1] - t;
+            int y = t + (cg >> 1);
+
+            int value = channel == 0 ? y : QuantizeChroma(channel == 1 ? co : cg, step);
+
+            AppendResidual(octreeBuffer, value - previous);
+            previous = value;
+        }
+    }
+
+    int32_t colorSize = static_cast<int32_t>(octreeBuffer.size() - sizeOffset - sizeof(int32_t));
+    std::memcpy(octreeBuffer.data() + sizeOffset, &colorSize, sizeof(colorSize));
+}
+
+const uint8_t* PointCloudEncoder::GetOctreeBuffer() const
+{
+    return octreeBuffer.data();
+}
+
+int PointCloudEncoder::GetOctreeSize() const
+{
+    return static_cast<int>(octreeBuffer.size());
+}
+
+const uint8_t* PointCloudEncoder::GetProgressiveBuffer() const
+{
+    return progressiveBuffer.data();
+}
+
+int PointCloudEncoder::GetProgressiveSize() const
+{
+    return static_cast<int>(progressiveBuffer.size());
+}
+
+/// <summary>
+/// Codes a frame for a capture volume larger than the byte grid. Each position is quantized within the bounding box
+/// of the frame and packed in 32 bits (x in the high bits, then y, then z). The step of an axis is the extent of the
+/// box over the number of values of the axis, and never finer than the voxels of the byte grid at the given scale, so
+/// small volumes keep the resolution of the full frames. Only the first point of each quantized position is kept. The
+/// bounding box and the quantization are computed with SSE2, one point per register.
+/// </summary>
+/// <param name="vertices">Positions of the merged frame, in meters (x, y, z for each vertex)</param>
+/// <param name="colors">Colors of the merged frame (r, g, b for each vertex)</param>
+/// <param name="numVertices">Number of vertices of the frame</param>
+/// <param name="range">Size of the capture volume on each axis, in meters; the points out of it are dropped</param>
+/// <param name="scale">Scale of the full frame, which sets the finest quantization step</param>
+/// <returns>The size of the wide buffer, which is valid until the next call</returns>
+int PointCloudEncoder::EncodeWide(const float* vertices, const uint8_t* colors, int numVertices, float range, int16_t scale)
+{
+    numVertices = numVertices > 0 ? numVertices : 0;
+
+    float halfRange = range / 2.0f;
+    const __m128 center = _mm_set_ps(0.0f, halfRange, YRangeCenter, XRangeCenter);
+    const __m128 halfRanges = _mm_set1_ps(halfRange);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+    __m128 minimum = _mm_set1_ps(FLT_MAX);
+    __m128 maximum = _mm_set1_ps(-FLT_MAX);
+
+    wideIndices.clear();
+
+    // Keep the points in range; NaN positions fail the comparison and are dropped
+    for (int i = 0; i < numVertices; i++)
+    {
+        const float* vertex = vertices + 3 * i;
+        __m128 position = _mm_set_ps(0.0f, vertex[2], vertex[1], vertex[0]);
+        __m128 isInRange = _mm_cmple_ps(_mm_and_ps(_mm_sub_ps(position, center), absMask), halfRanges);
+
+        if ((_mm_movemask_ps(isInRange) & 7) != 7)
+            continue;
+
+        minimum = _mm_min_ps(minimum, position);
+        maximum = _mm_max_ps(maximum, position);
+        wideIndices.push_back(i);
+    }
+
+    int numInRange = static_cast<int>(wideIndices.size());
+    float minStep = 1.0f / (std::max)(scale, static_cast<int16_t>(1));
+    float minimums[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    float steps[4] = { minStep, minStep, minStep, minStep };
+
+    if (numInRange > 0)
+    {
+        float maximums[4];
+        const float numLevels[3] = { (1 << WideXBits) - 1.0f, (1 << WideYBits) - 1.0f, (1 << WideZBits) - 1.0f };
+
+        _mm_storeu_ps(minimums, minimum);
+        _mm_storeu_ps(maximums, maximum);
+
+        for (int axis = 0; axis < 3; axis++)
+            steps[axis] = (std::max)(minStep, (maximums[axis] - minimums[axis]) / numLevels[axis]);
+    }
+
+    // Quantize to the nearest value of each axis; the values are clamped as floats since SSE2 has no integer min
+    const __m128 origin = _mm_loadu_ps(minimums);
+    const __m128 invSteps = _mm_set_ps(1.0f, 1.0f / steps[2], 1.0f / steps[1], 1.0f / steps[0]);
+    const __m128 maxValues = _mm_set_ps(0.0f, (1 << WideZBits) - 1.0f, (1 << WideYBits) - 1.0f, (1 << WideXBits) - 1.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    wideCodes.resize(numInRange);
+
+    for (int i = 0; i < numInRange; i++)
+    {
+        const float* vertex = vertices + 3 * wideIndices[i];
+        __m128 position = _mm_set_ps(0.0f, vertex[2], vertex[1], vertex[0]);
+        __m128 value = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(position, origin), invSteps), half);
+        __m128i quantized = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(value, _mm_setzero_ps()), maxValues));
+
+        alignas(16) uint32_t axes[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(axes), quantized);
+
+        uint32_t code = (axes[0] << (WideYBits + WideZBits)) | (axes[1] << WideZBits) | axes[2];
+        wideCodes[i] = (static_cast<uint64_t>(code) << 32) | static_cast<uint32_t>(wideIndices[i]);
+    }
+
+    // Sorting keeps the first point of each position first, and gives the receivers the points in spatial order
+    RadixSortCodes(wideCodes, sortScratch, WideXBits + WideYBits + WideZBits);
+
+    wideBuffer.resize(WideHeaderSize + 7 * static_cast<size_t>(numInRange));
+
+    uint8_t* outPositions = wideBuffer.data() + WideHeaderSize;
+    int numEncoded = 0;
+
+    for (int i = 0; i < numInRange; i++)
+    {
+        uint32_t code = static_cast<uint32_t>(wideCodes[i] >> 32);
+
+        if (i > 0 && code == static_cast<uint32_t>(wideCodes[i - 1] >> 32))
+            continue;
+
+        // The indices of the kept points are gathered in place to copy their colors once the count is known
+        std::memcpy(outPositions + 4 * static_cast<size_t>(numEncoded), &code, sizeof(code));
+        wideIndices[numEncoded++] = static_cast<int>(wideCodes[i] & 0xFFFFFFFF);
+    }
+
+    uint8_t* outColors = outPositions + 4 * static_cast<size_t>(numEncoded);
+
+    for (int i = 0; i < numEncoded; i++)
+        std::memcpy(outColors + 3 * static_cast<size_t>(i), colors + 3 * static_cast<size_t>(wideIndices[i]), 3);
+
+    uint8_t* header = wideBuffer.data();
+    std::memcpy(header, &scale, sizeof(scale));
+    std::memcpy(header + sizeof(scale), &numEncoded, sizeof(numEncoded));
+    std::memcpy(header + HeaderSize, minimums, 3 * sizeof(float));
+    std::memcpy(header + HeaderSize + 3 * sizeof(float), steps, 3 * sizeof(float));
+
+    wideBuffer.resize(WideHeaderSize + 7 * static_cast<size_t>(numEncoded));
+
+    return GetWideSize();
+}
+
+const uint8_t* PointCloudEncoder::GetWideBuffer() const
+{
+    return wideBuffer.data();
+}
+
+int PointCloudEncoder::GetWideSize() const
+{
+    return static_cast<int>(wideBuffer.size());
+}
+
+/// <summary>
+/// Codes a triangle mesh for the receivers which render triangles. The vertices are coded like the points of a wide
+/// frame, but all of them are kept in their order so that the indices of the triangles still refer to them; the
+/// triangles with a vertex out of the capture volume are dropped.
+/// </summary>
+/// <param name="vertices">Positions of the vertices, in meters (x, y, z for each vertex)</param>
+/// <param name="colors">Colors of the vertices (r, g, b for each vertex)</param>
+/// <param name="indices">Three vertex indices for each triangle</param>
+/// <param name="range">Size of the capture volume on each axis, in meters</param>
+/// <param name="scale">Scale of the full frame, which sets the finest quantization step</param>
+/// <returns>The size of the mesh buffer, which is valid until the next call</returns>
+int PointCloudEncoder::EncodeMesh(const float* vertices, const uint8_t* colors, int numVertices, const int32_t* indices, int numTriangles, float range, int16_t scale)
+{
+    numVertices = numVertices > 0 ? numVertices : 0;
+    numTriangles = numTriangles > 0 ? numTriangles : 0;
+
+    float halfRange = range / 2.0f;
+    const float centers[3] = { XRangeCenter, YRangeCenter, halfRange };
+    float minimums[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float maximums[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    int numInRange = 0;
+
+    meshVertexInRange.assign(numVertices, 0);
+
+    // NaN positions fail the comparison and are out of range
+    for (int i = 0; i < numVertices; i++)
+    {
+        const float* vertex = vertices + 3 * i;
+
+        if (!(std::fabs(vertex[0] - centers[0]) <= halfRange && std::fabs(vertex[1] - centers[1]) <= halfRange
+            && std::fabs(vertex[2] - centers[2]) <= halfRange))
+        {
+            continue;
+        }
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            minimums[axis] = (std::min)(minimums[axis], vertex[axis]);
+            maximums[axis] = (std::max)(maximums[axis], vertex[axis]);
+        }
+
+        meshVertexInRange[i] = 1;
+        numInRange++;
+    }
+
+    float minStep = 1.0f / (std::max)(scale, static_cast<int16_t>(1));
+    float steps[3] = { minStep, minStep, minStep };
+    const float numLevels[3] = { (1 << WideXBits) - 1.0f, (1 << WideYBits) - 1.0f, (1 << WideZBits) - 1.0f };
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (numInRange == 0)
+            minimums[axis] = 0.0f;
+        else
+            steps[axis] = (std::max)(minStep, (maximums[axis] - minimums[axis]) / numLevels[axis]);
+    }
+
+    meshIndices.clear();
+
+    for (int i = 0; i < numTriangles; i++)
+    {
+        const int32_t* triangle = indices + 3 * i;
+        bool isInRange = true;
+
+        for (int j = 0; j < 3; j++)
+            isInRange = isInRange && triangle[j] >= 0 && triangle[j] < numVertices && meshVertexInRange[triangle[j]];
+
+        if (isInRange)
+            meshIndices.insert(meshIndices.end(), triangle, triangle + 3);
+    }
+
+    int numKept = static_cast<int>(meshIndices.size() / 3);
+    bool isShortIndex = numVertices <= MaxShortIndexVertices;
+    size_t indexSize = isShortIndex ? sizeof(uint16_t) : sizeof(int32_t);
+
+    meshBuffer.resize(sizeof(int32_t) + WideHeaderSize + 7 * static_cast<size_t>(numVertices) + meshIndices.size() * indexSize);
+
+    uint8_t* header = meshBuffer.data();
+    std::memcpy(header, &numKept, sizeof(numKept));
+    header += sizeof(int32_t);
+    std::memcpy(header, &scale, sizeof(scale));
+    std::memcpy(header + sizeof(scale), &numVertices, sizeof(numVertices));
+    std::memcpy(header + HeaderSize, minimums, 3 * sizeof(float));
+    std::memcpy(header + HeaderSize + 3 * sizeof(float), steps, 3 * sizeof(float));
+
+    // The vertices out of range are not used by any triangle; they are sent at the minimum of the box
+    uint8_t* outPositions = header + WideHeaderSize;
+
+    for (int i = 0; i < numVertices; i++)
+    {
+        uint32_t code = 0;
+
+        if (meshVertexInRange[i])
+        {
+            uint32_t axes[3];
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float value = (vertices[3 * i + axis] - minimums[axis]) / steps[axis] + 0.5f;
+                axes[axis] = static_cast<uint32_t>((std::min)((std::max)(value, 0.0f), numLevels[axis]));
+            }
+
+            code = (axes[0] << (WideYBits + WideZBits)) | (axes[1] << WideZBits) | axes[2];
+        }
+
+        std::memcpy(outPositions + 4 * static_cast<size_t>(i), &code, sizeof(code));
+    }
+
+    uint8_t* outColors = outPositions + 4 * static_cast<size_t>(numVertices);
+
+    if (numVertices > 0)
+        std::memcpy(outColors, colors, 3 * static_cast<size_t>(numVertices));
+
+    uint8_t* outIndices = outColors + 3 * static_cast<size_t>(numVertices);
+
+    if (isShortIndex)
+    {
+        for (size_t i = 0; i < meshIndices.size(); i++)
+        {
+            uint16_t index = static_cast<uint16_t>(meshIndices[i]);
+            std::memcpy(outIndices + sizeof(uint16_t) * i, &index, sizeof(index));
+        }
+    }
+    else if (!meshIndices.empty())
+    {
+        std::memcpy(outIndices, meshIndices.data(), meshIndices.size() * sizeof(int32_t));
+    }
+
+    return GetMeshSize();
+}
+
+const uint8_t* PointCloudEncoder::GetMeshBuffer() const
+{
+    return meshBuffer.data();
+}
+
+int PointCloudEncoder::GetMeshSize() const
+{
+    return static_cast<int>(meshBuffer.size());
+}
+
+/// <summary>
+/// Codes the last wide frame as surfels, by appending the normal of each of its points. The normals are gathered from
+/// the indices of the points kept by EncodeWide, so this must follow the wide coding of the same frame.
+/// </summary>
+/// <param name="normals">Normal of each vertex given to EncodeWide; null if none of them is known</param>
+/// <returns>The size of the surfel buffer, which is valid until the next call</returns>
+int PointCloudEncoder::EncodeSurfels(const uint8_t* normals)
+{
+    int numEncoded = 0;
+
+    if (wideBuffer.size() >= WideHeaderSize)
+        std::memcpy(&numEncoded, wideBuffer.data() + sizeof(int16_t), sizeof(numEncoded));
+
+    surfelBuffer.resize(wideBuffer.size() + numEncoded);
+
+    if (!wideBuffer.empty())
+        std::memcpy(surfelBuffer.data(), wideBuffer.data(), wideBuffer.size());
+
+    uint8_t* outNormals = surfelBuffer.data() + wideBuffer.size();
+
+    for (int i = 0; i < numEncoded; i++)
+        outNormals[i] = normals ? normals[wideIndices[i]] : NoSurfelNormal;
+
+    return GetSurfelSize();
+}
+
+const uint8_t* PointCloudEncoder::GetSurfelBuffer() const
+{
+    return surfelBuffer.data();
+}
+
+int PointCloudEncoder::GetSurfelSize() const
+{
+    return static_cast<int>(surfelBuffer.size());
+}
@@ -0,0 +1,682 @@
+/***************************************************************************\
+
+Module Name:  PointCloudKernel.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module converts a depth frame into a compacted point cloud expressed in
+world space (color camera space when no world transform is given), samples the
+color of every point and builds the depth frame aligned to the color frame.
+Scalar, SSE2, AVX2 and AVX-512 implementations are provided and the fastest
+one supported by the CPU is selected at runtime. The colors can be sampled
+from a copy of the color frame downscaled by two, with about one color
+pixel per depth pixel, whose samples stay within fewer cache lines.
+
+\***************************************************************************/
+
+#include "pointCloudKernel.h"
+#include "taskScheduler.h"
+#include <intrin.h>
+#include <emmintrin.h>
+#include <algorithm>
+#include <cfloat>
+
+/// <summary>
+/// Determines the fastest point cloud kernel supported by the CPU and the operating system.
+/// </summary>
+PointCloudKernelType SelectPointCloudKernel()
+{
+	int cpuInfo[4] = { 0 };
+
+	__cpuid(cpuInfo, 0);
+	int maxLeaf = cpuInfo[0];
+
+	if (maxLeaf < 1)
+		return KernelScalar;
+
+	__cpuid(cpuInfo, 1);
+	bool hasSSE2 = (cpuInfo[3] & (1 << 26)) != 0;
+	bool hasOSXSave = (cpuInfo[2] & (1 << 27)) != 0;
+	bool hasAVX = (cpuInfo[2] & (1 << 28)) != 0;
+
+	// AVX registers can only be used if the operating system saves them on context switches
+	bool isAVXStateEnabled = false;
+	bool isAVX512StateEnabled = false;
+
+	if (hasOSXSave && hasAVX)
+	{
+		unsigned long long enabledState = _xgetbv(0);
+		isAVXStateEnabled = (enabledState & 0x6) == 0x6;
+
+		// AVX-512 also needs the opmask and the upper halves of the 32 ZMM registers to be saved
+		isAVX512StateEnabled = (enabledState & 0xE6) == 0xE6;
+	}
+
+	if (isAVXStateEnabled && maxLeaf >= 7)
+	{
+		__cpuidex(cpuInfo, 7, 0);
+		bool hasAVX2 = (cpuInfo[1] & (1 << 5)) != 0;
+		bool hasAVX512F = (cpuInfo[1] & (1 << 16)) != 0;
+
+		if (hasAVX2 && hasAVX512F && isAVX512StateEnabled)
+			return KernelAVX512;
+
+		if (hasAVX2)
+			return KernelAVX2;
+	}
+
+	return hasSSE2 ? KernelSSE2 : KernelScalar;
+}
+
+const char* GetPointCloudKernelName(PointCloudKernelType type)
+{
+	switch (type)
+	{
+	case KernelAVX512:
+		return "AVX-512";
+	case KernelAVX2:
+		return "AVX2";
+	case KernelSSE2:
+		return "SSE2";
+	default:
+		return "Scalar";
+	}
+}
+
+/// <summary>
+/// Sets the world transform of the kernel to identity, so that the vertices are output in color camera space.
+/// </summary>
+void SetIdentityWorldTransform(PointCloudKernelParams& params)
+{
+	for (int i = 0; i < 12; i++)
+		params.world[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+}
+
+/// <summary>
+/// Processes the full depth image and keeps every point, whatever its position in world space.
+/// </summary>
+void DisableBoundsCulling(PointCloudKernelParams& params)
+{
+	params.roiLeft = 0;
+	params.roiTop = 0;
+	params.roiRight = params.depthWidth;
+	params.roiBottom = params.depthHeight;
+	params.minDepth = 1;
+	params.maxDepth = 0xFFFF;
+	params.isBoundsCullingEnabled = false;
+}
+
+/// <summary>
+/// Restricts the kernel to the pixels which can see the world space bounds. The corners of the bounds are brought
+/// back into depth camera space with the inverse of the depth to world transform, and their projection gives a
+/// conservative region of the depth image and range of depth values. Must be called after the depth to color and
+/// world transforms have been set, both of which are expected to be rigid.
+/// </summary>
+void EnableBoundsCulling(PointCloudKernelParams& params, float depthFx, float depthFy, float depthCx, float depthCy,
+	const float minBounds[3], const float maxBounds[3])
+{
+	DisableBoundsCulling(params);
+
+	params.isBoundsCullingEnabled = true;
+
+	for (int i = 0; i < 3; i++)
+	{
+		params.minBounds[i] = minBounds[i];
+		params.maxBounds[i] = maxBounds[i];
+	}
+
+	// Compose the depth to world transform: world * [rot | trans]
+	float R[3][3], T[3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			R[i][j] = 0.0f;
+
+			for (int k = 0; k < 3; k++)
+				R[i][j] += params.world[i * 4 + k] * params.rot[k * 3 + j];
+		}
+
+		T[i] = params.world[i * 4 + 3];
+
+		for (int k = 0; k < 3; k++)
+			T[i] += params.world[i * 4 + k] * params.trans[k];
+	}
+
+	float minU = FLT_MAX, minV = FLT_MAX, maxU = -FLT_MAX, maxV = -FLT_MAX;
+	float minZ = FLT_MAX, maxZ = -FLT_MAX;
+
+	for (int corner = 0; corner < 8; corner++)
+	{
+		float worldCorner[3];
+
+		for (int i = 0; i < 3; i++)
+			worldCorner[i] = ((corner >> i) & 1) ? maxBounds[i] : minBounds[i];
+
+		// Inverse of a rigid transform: transpose(R) * (p - T)
+		float depthCorner[3];
+
+		for (int i = 0; i < 3; i++)
+		{
+			depthCorner[i] = 0.0f;
+
+			for (int k = 0; k < 3; k++)
+				depthCorner[i] += R[k][i] * (worldCorner[k] - T[k]);
+		}
+
+		// The camera is inside or too close to the bounds: the projection of the box is unbounded, only cull by position
+		if (depthCorner[2] <= 0.01f)
+			return;
+
+		minU = (std::min)(minU, depthFx * depthCorner[0] / depthCorner[2] + depthCx);
+		maxU = (std::max)(maxU, depthFx * depthCorner[0] / depthCorner[2] + depthCx);
+		minV = (std::min)(minV, depthFy * depthCorner[1] / depthCorner[2] + depthCy);
+		maxV = (std::max)(maxV, depthFy * depthCorner[1] / depthCorner[2] + depthCy);
+		minZ = (std::min)(minZ, depthCorner[2]);
+		maxZ = (std::max)(maxZ, depthCorner[2]);
+	}
+
+	// The box is convex, so its projection lies within the projection of its corners; add a pixel of margin for rounding
+	params.roiLeft = (std::max)(0, (std::min)(params.depthWidth, static_cast<int>(floor(minU)) - 1));
+	params.roiRight = (std::max)(params.roiLeft, (std::min)(params.depthWidth, static_cast<int>(ceil(maxU)) + 2));
+	params.roiTop = (std::max)(0, (std::min)(params.depthHeight, static_cast<int>(floor(minV)) - 1));
+	params.roiBottom = (std::max)(params.roiTop, (std::min)(params.depthHeight, static_cast<int>(ceil(maxV)) + 2));
+
+	// The depth of any point of the box along the optical axis lies between the depths of its corners
+	params.minDepth = static_cast<UINT16>((std::max)(1.0f, (std::min)(65535.0f, floorf(minZ * 1000.0f) - 1.0f)));
+	params.maxDepth = static_cast<UINT16>((std::max)(1.0f, (std::min)(65535.0f, ceilf(maxZ * 1000.0f) + 1.0f)));
+}
+
+/// <summary>
+/// Restricts the region of the depth image of the kernel to its intersection with the given region (left, top, right
+/// and bottom, one past the last column and row); an empty region leaves it as it is
+/// </summary>
+void RestrictRoi(PointCloudKernelParams& params, const int region[4])
+{
+	if (region[2] <= region[0] || region[3] <= region[1])
+		return;
+
+	params.roiLeft = (std::max)(params.roiLeft, (std::min)(params.depthWidth, region[0]));
+	params.roiTop = (std::max)(params.roiTop, (std::min)(params.depthHeight, region[1]));
+	params.roiRight = (std::max)(params.roiLeft, (std::min)(params.roiRight, region[2]));
+	params.roiBottom = (std::max)(params.roiTop, (std::min)(params.roiBottom, region[3]));
+}
+
+void DownscaleColorFrame(const BYTE* color, int width, int height, uint32_t* output)
+{
+	const int RowsPerBlock = 32; // Output rows of each task
+	int outputWidth = width / 2;
+	int outputHeight = height / 2;
+	int numBlocks = (outputHeight + RowsPerBlock - 1) / RowsPerBlock;
+
+	TaskScheduler::Instance().ParallelFor(0, numBlocks, [&](int block)
+	{
+		int rowEnd = (std::min)(outputHeight, (block + 1) * RowsPerBlock);
+
+		for (int v = block * RowsPerBlock; v < rowEnd; v++)
+		{
+			const BYTE* top = color + static_cast<size_t>(2 * v) * width * 3;
+			const BYTE* bottom = top + static_cast<size_t>(width) * 3;
+			uint32_t* row = output + static_cast<size_t>(v) * outputWidth;
+
+			for (int u = 0; u < outputWidth; u++)
+			{
+				const BYTE* t = top + 6 * u;
+				const BYTE* b = bottom + 6 * u;
+				uint32_t red = (t[0] + t[3] + b[0] + b[3] + 2) >> 2;
+				uint32_t green = (t[1] + t[4] + b[1] + b[4] + 2) >> 2;
+				uint32_t blue = (t[2] + t[5] + b[2] + b[5] + 2) >> 2;
+				row[u] = red | (green << 8) | (blue << 16);
+			}
+		}
+	});
+}
+
+void UseDownscaledColor(PointCloudKernelParams& params, const uint32_t* downscaledColor)
+{
+	// The pixel centers are at the integer coordinates, and a downscaled pixel is centered between the two it averages
+	params.colorRgbx = downscaledColor;
+	params.colorWidth /= 2;
+	params.colorHeight /= 2;
+	params.colorFx *= 0.5f;
+	params.colorFy *= 0.5f;
+	params.colorCx = params.colorCx * 0.5f - 0.25f;
+	params.colorCy = params.colorCy * 0.5f - 0.25f;
+}
+
+int RunPointCloudKernel(PointCloudKernelType type, const PointCloudKernelParams& params, const PointCloudKernelOutput& output)
+{
+	// The pixels outside the region of interest never produce a point
+	switch (type)
+	{
+	case KernelAVX512:
+		return RunPointCloudKernelAVX512(params, params.roiTop, params.roiBottom, output);
+	case KernelAVX2:
+		return RunPointCloudKernelAVX2(params, params.roiTop, params.roiBottom, output);
+	case KernelSSE2:
+		return RunPointCloudKernelSSE2(params, params.roiTop, params.roiBottom, output);
+	default:
+		return RunPointCloudKernelScalar(params, params.roiTop, params.roiBottom, output);
+	}
+}
+
+/// <summary>
+/// Reference implementation processing one depth pixel at a time.
+/// </summary>
+int RunPointCloudKernelScalar(const PointCloudKernelParams& params, int rowBegin, int rowEnd, const PointCloudKernelOutput& output)
+{
+	int numPoints = 0;
+
+	for (int v = rowBegin; v < rowEnd; ++v)
+	{
+		for (int u = params.roiLeft; u < params.roiRight; ++u)
+		{
+			ProcessPointCloudPixel(params, u, v, output, numPoints);
+		}
+	}
+
+	return numPoints;
+}
+
+/// <summary>
+/// SSE2 implementation: the unprojection, transform and projection are computed four pixels at a time;
+/// the color sampling and aligned depth scatter are done per pixel.
+/// </summary>
+int RunPointCloudKernelSSE2(const PointCloudKernelParams& params, int rowBegin, int rowEnd, const PointCloudKernelOutput& output)
+{
+	const int Lanes = 4;
+	int numPoints = 0;
+
+	const __m128 r0 = _mm_set1_ps(params.rot[0]), r1 = _mm_set1_ps(params.rot[1]), r2 = _mm_set1_ps(params.rot[2]);
+	const __m128 r3 = _mm_set1_ps(params.rot[3]), r4 = _mm_set1_ps(params.rot[4]), r5 = _mm_set1_ps(params.rot[5]);
+	const __m128 r6 = _mm_set1_ps(params.rot[6]), r7 = _mm_set1_ps(params.rot[7]), r8 = _mm_set1_ps(params.rot[8]);
+	const __m128 t0 = _mm_set1_ps(params.trans[0]), t1 = _mm_set1_ps(params.trans[1]), t2 = _mm_set1_ps(params.trans[2]);
+	const __m128 fx = _mm_set1_ps(params.colorFx), fy = _mm_set1_ps(params.colorFy);
+	const __m128 cx = _mm_set1_ps(params.colorCx), cy = _mm_set1_ps(params.colorCy);
+	const __m128 mmToMeters = _mm_set1_ps(1000.0f);
+	const __m128 w0 = _mm_set1_ps(params.world[0]), w1 = _mm_set1_ps(params.world[1]), w2 = _mm_set1_ps(params.world[2]), w3 = _mm_set1_ps(params.world[3]);
+	const __m128 w4 = _mm_set1_ps(params.world[4]), w5 = _mm_set1_ps(params.world[5]), w6 = _mm_set1_ps(params.world[6]), w7 = _mm_set1_ps(params.world[7]);
+	const __m128 w8 = _mm_set1_ps(params.world[8]), w9 = _mm_set1_ps(params.world[9]), w10 = _mm_set1_ps(params.world[10]), w11 = _mm_set1_ps(params.world[11]);
+	const __m128i zero = _mm_setzero_si128();
+
+	alignas(16) float Z[Lanes], projU[Lanes], projV[Lanes], worldX[Lanes], worldY[Lanes], worldZ[Lanes];
+
+	for (int v = rowBegin; v < rowEnd; ++v)
+	{
+		int rowStart = v * params.depthWidth;
+		int u = params.roiLeft;
+
+		for (; u + Lanes <= params.roiRight; u += Lanes)
+		{
+			int depthIdx = rowStart + u;
+
+			// Load four depth values and widen them to floats (in meters)
+			__m128i d16 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(params.depth + depthIdx));
+			__m128 z = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(d16, zero)), mmToMeters);
+
+			// Load four interleaved rays and split them into x and y components
+			const float* rays = reinterpret_cast<const float*>(params.rays + depthIdx);
+			__m128 raysLo = _mm_loadu_ps(rays);
+			__m128 raysHi = _mm_loadu_ps(rays + 4);
+			__m128 x = _mm_mul_ps(_mm_shuffle_ps(raysLo, raysHi, _MM_SHUFFLE(2, 0, 2, 0)), z);
+			__m128 y = _mm_mul_ps(_mm_shuffle_ps(raysLo, raysHi, _MM_SHUFFLE(3, 1, 3, 1)), z);
+
+			// Transform points from depth to color camera space
+			__m128 vX = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r0, x), _mm_mul_ps(r1, y)), _mm_mul_ps(r2, z)), t0);
+			__m128 vY = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r3, x), _mm_mul_ps(r4, y)), _mm_mul_ps(r5, z)), t1);
+			__m128 vZ = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r6, x), _mm_mul_ps(r7, y)), _mm_mul_ps(r8, z)), t2);
+
+			// Project into the color image
+			_mm_store_ps(projU, _mm_add_ps(_mm_div_ps(_mm_mul_ps(fx, vX), vZ), cx));
+			_mm_store_ps(projV, _mm_add_ps(_mm_div_ps(_mm_mul_ps(fy, vY), vZ), cy));
+			_mm_store_ps(Z, vZ);
+
+			// Transform points from color camera to world space
+			_mm_store_ps(worldX, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w0, vX), _mm_mul_ps(w1, vY)), _mm_mul_ps(w2, vZ)), w3));
+			_mm_store_ps(worldY, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w4, vX), _mm_mul_ps(w5, vY)), _mm_mul_ps(w6, vZ)), w7));
+			_mm_store_ps(worldZ, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w8, vX), _mm_mul_ps(w9, vY)), _mm_mul_ps(w10, vZ)), w11));
+
+			for (int i = 0; i < Lanes; ++i)
+			{
+				StorePointCloudSample(params, depthIdx + i, params.depth[depthIdx + i], Z[i], projU[i], projV[i], worldX[i], worldY[i], worldZ[i], output, numPoints);
+			}
+		}
+
+		// Process the remaining pixels of the row one at a time
+		for (; u < params.roiRight; ++u)
+		{
+			ProcessPointCloudPixel(params, u, v, output, numPoints);
+		}
+	}
+
+	return numPoints;
+}
+
+namespace
+{
+	const int FlyingPixelJumpShift = 5; // Maximum depth jump of 1/32 of the depth
+
+	bool IsFlyingPixel(const UINT16* depth, int width, int height, int u, int v)
+	{
+		UINT16 d = depth[v * width + u];
+		UINT16 minDepth = d, maxDepth = d;
+
+		for (int y = (std::max)(0, v - 1); y <= (std::min)(height - 1, v + 1); ++y)
+		{
+			for (int x = (std::max)(0, u - 1); x <= (std::min)(width - 1, u + 1); ++x)
+			{
+				UINT16 n = depth[y * width + x];
+
+				if (n == 0)
+					continue;
+
+				minDepth = (std::min)(minDepth, n);
+				maxDepth = (std::max)(maxDepth, n);
+			}
+		}
+
+		int threshold = d >> FlyingPixelJumpShift;
+		return maxDepth - d > threshold || d - minDepth > threshold;
+	}
+
+	// SSE2 has no unsigned 16-bit min, max and compare; they are built from saturated subtractions and a sign flip
+	inline __m128i MinU16(__m128i a, __m128i b) { return _mm_sub_epi16(a, _mm_subs_epu16(a, b)); }
+	inline __m128i MaxU16(__m128i a, __m128i b) { return _mm_add_epi16(_mm_subs_epu16(a, b), b); }
+
+	inline __m128i CompareGreaterU16(__m128i a, __m128i b)
+	{
+		const __m128i signBit = _mm_set1_epi16(static_cast<short>(0x8000));
+		return _mm_cmpgt_epi16(_mm_xor_si128(a, signBit), _mm_xor_si128(b, signBit));
+	}
+}
+
+/// <summary>
+/// Flying pixel rejection; the interior of the frame is processed eight pixels at a time with SSE2 and the
+/// borders one pixel at a time.
+/// </summary>
+void RejectFlyingPixels(const UINT16* depth, UINT16* output, int width, int height)
+{
+	const int Lanes = 8;
+	const __m128i zero = _mm_setzero_si128();
+
+	for (int v = 0; v < height; ++v)
+	{
+		const UINT16* row = depth + v * width;
+		UINT16* outRow = output + v * width;
+		int u = 0;
+
+		if (v > 0 && v + 1 < height && width > 1)
+		{
+			// The first column has no left neighbour
+			outRow[0] = IsFlyingPixel(depth, width, height, 0, v) ? 0 : row[0];
+			u = 1;
+
+			for (; u + Lanes + 1 <= width; u += Lanes)
+			{
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + u));
+				__m128i minDepth = d, maxDepth = d;
+
+				for (int dy = -1; dy <= 1; ++dy)
+				{
+					for (int dx = -1; dx <= 1; ++dx)
+					{
+						__m128i n = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + dy * width + u + dx));
+
+						// Pixels without depth must not lower the minimum; they become 0xFFFF for it
+						minDepth = MinU16(minDepth, _mm_or_si128(n, _mm_cmpeq_epi16(n, zero)));
+						maxDepth = MaxU16(maxDepth, n);
+					}
+				}
+
+				__m128i jumpBehind = _mm_subs_epu16(maxDepth, d);
+				__m128i jumpFront = _mm_subs_epu16(d, minDepth);
+				__m128i threshold = _mm_srli_epi16(d, FlyingPixelJumpShift);
+				__m128i isFlying = CompareGreaterU16(MaxU16(jumpBehind, jumpFront), threshold);
+
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(outRow + u), _mm_andnot_si128(isFlying, d));
+			}
+		}
+
+		// Remaining pixels of the row, and the first and last rows
+		for (; u < width; ++u)
+			outRow[u] = IsFlyingPixel(depth, width, height, u, v) ? 0 : row[u];
+	}
+}
+
+namespace
+{
+	const int TemporalSmoothingShift = 2; // Each frame contributes 1/4 of the smoothed depth
+
+	UINT16 SmoothTemporalDepth(UINT16 d, UINT16 h)
+	{
+		int jump = d > h ? d - h : h - d;
+
+		// The history restarts where the depth moved further than the noise, and on the pixels without depth
+		if (d == 0 || h == 0 || jump > (d >> FlyingPixelJumpShift))
+			return d;
+
+		return static_cast<UINT16>(d > h ? h + (jump >> TemporalSmoothingShift) : h - (jump >> TemporalSmoothingShift));
+	}
+
+	// Sorting network of the median of 9 values; the median ends up in p[4]
+	template <typename T, typename Sort>
+	inline void SortMedian9(T* p, Sort sort)
+	{
+		sort(p[1], p[2]); sort(p[4], p[5]); sort(p[7], p[8]);
+		sort(p[0], p[1]); sort(p[3], p[4]); sort(p[6], p[7]);
+		sort(p[1], p[2]); sort(p[4], p[5]); sort(p[7], p[8]);
+		sort(p[0], p[3]); sort(p[5], p[8]); sort(p[4], p[7]);
+		sort(p[3], p[6]); sort(p[1], p[4]); sort(p[2], p[5]);
+		sort(p[4], p[7]); sort(p[4], p[2]); sort(p[6], p[4]);
+		sort(p[4], p[2]);
+	}
+
+	UINT16 MedianDepth(const UINT16* depth, int width, int u, int v)
+	{
+		UINT16 d = depth[v * width + u];
+
+		if (d == 0)
+			return 0;
+
+		UINT16 p[9];
+		int i = 0;
+
+		for (int dy = -1; dy <= 1; ++dy)
+		{
+			for (int dx = -1; dx <= 1; ++dx)
+			{
+				UINT16 n = depth[(v + dy) * width + u + dx];
+				p[i++] = n == 0 ? d : n;
+			}
+		}
+
+		SortMedian9(p, [](UINT16& a, UINT16& b) { UINT16 t = (std::min)(a, b); b = (std::max)(a, b); a = t; });
+		return p[4];
+	}
+}
+
+/// <summary>
+/// Temporal smoothing of the depth; eight pixels at a time with SSE2, the remaining pixels one at a time.
+/// </summary>
+void UpdateTemporalDepth(const UINT16* depth, UINT16* history, int numPixels)
+{
+	const int Lanes = 8;
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+
+	for (; i + Lanes <= numPixels; i += Lanes)
+	{
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(depth + i));
+		__m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(history + i));
+
+		// The smoothed depth lies between the history and the new depth, so it never overflows
+		__m128i jumpUp = _mm_subs_epu16(d, h);
+		__m128i jumpDown = _mm_subs_epu16(h, d);
+		__m128i smoothed = _mm_sub_epi16(_mm_add_epi16(h, _mm_srli_epi16(jumpUp, TemporalSmoothingShift)),
+			_mm_srli_epi16(jumpDown, TemporalSmoothingShift));
+
+		__m128i threshold = _mm_srli_epi16(d, FlyingPixelJumpShift);
+		__m128i isReset = _mm_or_si128(CompareGreaterU16(MaxU16(jumpUp, jumpDown), threshold),
+			_mm_or_si128(_mm_cmpeq_epi16(d, zero), _mm_cmpeq_epi16(h, zero)));
+
+		__m128i result = _mm_or_si128(_mm_and_si128(isReset, d), _mm_andnot_si128(isReset, smoothed));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(history + i), result);
+	}
+
+	for (; i < numPixels; ++i)
+		history[i] = SmoothTemporalDepth(depth[i], history[i]);
+}
+
+/// <summary>
+/// 3x3 median of the depth; the interior of the frame is processed eight pixels at a time with SSE2 and the
+/// borders are copied.
+/// </summary>
+void FilterDepthMedian(const UINT16* depth, UINT16* output, int width, int height)
+{
+	const int Lanes = 8;
+	const __m128i zero = _mm_setzero_si128();
+
+	auto sortLanes = [](__m128i& a, __m128i& b) { __m128i t = MinU16(a, b); b = MaxU16(a, b); a = t; };
+
+	for (int v = 0; v < height; ++v)
+	{
+		const UINT16* row = depth + v * width;
+		UINT16* outRow = output + v * width;
+
+		if (v == 0 || v + 1 == height || width < 3)
+		{
+			std::copy(row, row + width, outRow);
+			continue;
+		}
+
+		outRow[0] = row[0];
+		int u = 1;
+
+		for (; u + Lanes + 1 <= width; u += Lanes)
+		{
+			__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + u));
+			__m128i p[9];
+			int i = 0;
+
+			for (int dy = -1; dy <= 1; ++dy)
+			{
+				for (int dx = -1; dx <= 1; ++dx)
+				{
+					__m128i n = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + dy * width + u + dx));
+
+					// Neighbours without depth take the depth of the pixel, so the holes do not grow
+					__m128i isHole = _mm_cmpeq_epi16(n, zero);
+					p[i++] = _mm_or_si128(_mm_and_si128(isHole, d), _mm_andnot_si128(isHole, n));
+				}
+			}
+
+			SortMedian9(p, sortLanes);
+
+			// Pixels without depth stay empty
+			__m128i median = _mm_andnot_si128(_mm_cmpeq_epi16(d, zero), p[4]);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(outRow + u), median);
+		}
+
+		for (; u + 1 < width; ++u)
+			outRow[u] = MedianDepth(depth, width, u, v);
+
+		outRow[width - 1] = row[width - 1];
+	}
+}
+
+namespace
+{
+	const int MinHoleFillNeighbours = 4; // Fills the holes of up to 2x2 pixels, but neither the gaps nor the rims of larger holes
+
+	UINT16 FillDepthHole(const UINT16* depth, int width, int height, int u, int v)
+	{
+		UINT16 d = depth[v * width + u];
+
+		if (d != 0)
+			return d;
+
+		UINT16 minDepth = 0xFFFF, maxDepth = 0;
+		int numNeighbours = 0;
+
+		for (int y = (std::max)(0, v - 1); y <= (std::min)(height - 1, v + 1); ++y)
+		{
+			for (int x = (std::max)(0, u - 1); x <= (std::min)(width - 1, u + 1); ++x)
+			{
+				UINT16 n = depth[y * width + x];
+
+				if (n == 0)
+					continue;
+
+				minDepth = (std::min)(minDepth, n);
+				maxDepth = (std::max)(maxDepth, n);
+				numNeighbours++;
+			}
+		}
+
+		if (numNeighbours < MinHoleFillNeighbours || maxDepth - minDepth > (minDepth >> FlyingPixelJumpShift))
+			return 0;
+
+		return minDepth;
+	}
+}
+
+/// <summary>
+/// Hole filling of the depth; the interior of the frame is processed eight pixels at a time with SSE2 and the borders
+/// one pixel at a time.
+/// </summary>
+void FillDepthHoles(const UINT16* depth, UINT16* output, int width, int height)
+{
+	const int Lanes = 8;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i maxNumHoles = _mm_set1_epi16(static_cast<short>(8 - MinHoleFillNeighbours));
+
+	for (int v = 0; v < height; ++v)
+	{
+		const UINT16* row = depth + v * width;
+		UINT16* outRow = output + v * width;
+		int u = 0;
+
+		if (v > 0 && v + 1 < height && width > 1)
+		{
+			// The first column has no left neighbour
+			outRow[0] = FillDepthHole(depth, width, height, 0, v);
+			u = 1;
+
+			for (; u + Lanes + 1 <= width; u += Lanes)
+			{
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + u));
+				__m128i minDepth = _mm_set1_epi16(-1), maxDepth = zero, numHoles = zero;
+
+				for (int dy = -1; dy <= 1; ++dy)
+				{
+					for (int dx = -1; dx <= 1; ++dx)
+					{
+						if (dx == 0 && dy == 0)
+							continue;
+
+						__m128i n = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + dy * width + u + dx));
+						__m128i isHole = _mm_cmpeq_epi16(n, zero);
+
+						// Neighbours without depth must not lower the minimum; they become 0xFFFF for it
+						minDepth = MinU16(minDepth, _mm_or_si128(n, isHole));
+						maxDepth = MaxU16(maxDepth, n);
+						numHoles = _mm_sub_epi16(numHoles, isHole);
+					}
+				}
+
+				// Only the holes with enough neighbours, all on the same surface, are filled
+				__m128i isSpread = CompareGreaterU16(_mm_subs_epu16(maxDepth, minDepth), _mm_srli_epi16(minDepth, FlyingPixelJumpShift));
+				__m128i isFilled = _mm_andnot_si128(_mm_or_si128(isSpread, _mm_cmpgt_epi16(numHoles, maxNumHoles)), _mm_cmpeq_epi16(d, zero));
+
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(outRow + u), _mm_or_si128(d, _mm_and_si128(isFilled, minDepth)));
+			}
+		}
+
+		// Remaining pixels of the row, and the first and last rows
+		for (; u < width; ++u)
+			outRow[u] = FillDepthHole(depth, width, height, u, v);
+	}
+}
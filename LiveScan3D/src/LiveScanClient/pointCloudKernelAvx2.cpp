@@ -0,0 +1,98 @@
+/***************************************************************************\
+
+Module Name:  PointCloudKernelAvx2.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the AVX2 implementation of the point cloud kernel. It is
+compiled with AVX2 code generation enabled and must only be called when
+SelectPointCloudKernel reports that the CPU supports it.
+
+\***************************************************************************/
+
+#include "pointCloudKernel.h"
+#include <immintrin.h>
+
+/// <summary>
+/// AVX2 implementation: the unprojection, transform and projection are computed eight pixels at a time;
+/// the color sampling and aligned depth scatter are done per pixel.
+/// </summary>
+int RunPointCloudKernelAVX2(const PointCloudKernelParams& params, int rowBegin, int rowEnd, const PointCloudKernelOutput& output)
+{
+	const int Lanes = 8;
+	int numPoints = 0;
+
+	const __m256 r0 = _mm256_set1_ps(params.rot[0]), r1 = _mm256_set1_ps(params.rot[1]), r2 = _mm256_set1_ps(params.rot[2]);
+	const __m256 r3 = _mm256_set1_ps(params.rot[3]), r4 = _mm256_set1_ps(params.rot[4]), r5 = _mm256_set1_ps(params.rot[5]);
+	const __m256 r6 = _mm256_set1_ps(params.rot[6]), r7 = _mm256_set1_ps(params.rot[7]), r8 = _mm256_set1_ps(params.rot[8]);
+	const __m256 t0 = _mm256_set1_ps(params.trans[0]), t1 = _mm256_set1_ps(params.trans[1]), t2 = _mm256_set1_ps(params.trans[2]);
+	const __m256 fx = _mm256_set1_ps(params.colorFx), fy = _mm256_set1_ps(params.colorFy);
+	const __m256 cx = _mm256_set1_ps(params.colorCx), cy = _mm256_set1_ps(params.colorCy);
+	const __m256 mmToMeters = _mm256_set1_ps(1000.0f);
+	const __m256 w0 = _mm256_set1_ps(params.world[0]), w1 = _mm256_set1_ps(params.world[1]), w2 = _mm256_set1_ps(params.world[2]), w3 = _mm256_set1_ps(params.world[3]);
+	const __m256 w4 = _mm256_set1_ps(params.world[4]), w5 = _mm256_set1_ps(params.world[5]), w6 = _mm256_set1_ps(params.world[6]), w7 = _mm256_set1_ps(params.world[7]);
+	const __m256 w8 = _mm256_set1_ps(params.world[8]), w9 = _mm256_set1_ps(params.world[9]), w10 = _mm256_set1_ps(params.world[10]), w11 = _mm256_set1_ps(params.world[11]);
+
+	alignas(32) float Z[Lanes], projU[Lanes], projV[Lanes], worldX[Lanes], worldY[Lanes], worldZ[Lanes];
+
+	for (int v = rowBegin; v < rowEnd; ++v)
+	{
+		int rowStart = v * params.depthWidth;
+		int u = params.roiLeft;
+
+		for (; u + Lanes <= params.roiRight; u += Lanes)
+		{
+			int depthIdx = rowStart + u;
+
+			// Load eight depth values and widen them to floats (in meters)
+			__m128i d16 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(params.depth + depthIdx));
+			__m256 z = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(d16)), mmToMeters);
+
+			// Load eight interleaved rays and split them into x and y components; the shuffle works per
+			// 128-bit lane, so the 64-bit blocks are permuted back into pixel order afterwards
+			const float* rays = reinterpret_cast<const float*>(params.rays + depthIdx);
+			__m256 raysLo = _mm256_loadu_ps(rays);
+			__m256 raysHi = _mm256_loadu_ps(rays + 8);
+			__m256 rayX = _mm256_shuffle_ps(raysLo, raysHi, _MM_SHUFFLE(2, 0, 2, 0));
+			__m256 rayY = _mm256_shuffle_ps(raysLo, raysHi, _MM_SHUFFLE(3, 1, 3, 1));
+			rayX = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(rayX), _MM_SHUFFLE(3, 1, 2, 0)));
+			rayY = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(rayY), _MM_SHUFFLE(3, 1, 2, 0)));
+
+			__m256 x = _mm256_mul_ps(rayX, z);
+			__m256 y = _mm256_mul_ps(rayY, z);
+
+			// Transform points from depth to color camera space
+			__m256 vX = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r0, x), _mm256_mul_ps(r1, y)), _mm256_mul_ps(r2, z)), t0);
+			__m256 vY = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r3, x), _mm256_mul_ps(r4, y)), _mm256_mul_ps(r5, z)), t1);
+			__m256 vZ = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r6, x), _mm256_mul_ps(r7, y)), _mm256_mul_ps(r8, z)), t2);
+
+			// Project into the color image
+			_mm256_store_ps(projU, _mm256_add_ps(_mm256_div_ps(_mm256_mul_ps(fx, vX), vZ), cx));
+			_mm256_store_ps(projV, _mm256_add_ps(_mm256_div_ps(_mm256_mul_ps(fy, vY), vZ), cy));
+			_mm256_store_ps(Z, vZ);
+
+			// Transform points from color camera to world space
+			_mm256_store_ps(worldX, _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(w0, vX), _mm256_mul_ps(w1, vY)), _mm256_mul_ps(w2, vZ)), w3));
+			_mm256_store_ps(worldY, _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(w4, vX), _mm256_mul_ps(w5, vY)), _mm256_mul_ps(w6, vZ)), w7));
+			_mm256_store_ps(worldZ, _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(w8, vX), _mm256_mul_ps(w9, vY)), _mm256_mul_ps(w10, vZ)), w11));
+
+			for (int i = 0; i < Lanes; ++i)
+			{
+				StorePointCloudSample(params, depthIdx + i, params.depth[depthIdx + i], Z[i], projU[i], projV[i], worldX[i], worldY[i], worldZ[i], output, numPoints);
+			}
+		}
+
+		// Process the remaining pixels of the row one at a time
+		for (; u < params.roiRight; ++u)
+		{
+			ProcessPointCloudPixel(params, u, v, output, numPoints);
+		}
+	}
+
+	// Avoid AVX to SSE transition penalties in the code that follows
+	_mm256_zeroupper();
+
+	return numPoints;
+}
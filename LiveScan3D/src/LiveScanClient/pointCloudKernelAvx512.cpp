@@ -0,0 +1,101 @@
+/***************************************************************************\
+
+Module Name:  PointCloudKernelAvx512.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the AVX-512 implementation of the point cloud kernel. It
+is compiled with AVX-512 code generation enabled and must only be called when
+SelectPointCloudKernel reports that the CPU supports it.
+
+\***************************************************************************/
+
+#include "pointCloudKernel.h"
+#include <immintrin.h>
+
+/// <summary>
+/// AVX-512 implementation: the unprojection, transform and projection are computed sixteen pixels at a time;
+/// the color sampling and aligned depth scatter are done per pixel.
+/// </summary>
+int RunPointCloudKernelAVX512(const PointCloudKernelParams& params, int rowBegin, int rowEnd, const PointCloudKernelOutput& output)
+{
+	const int Lanes = 16;
+	int numPoints = 0;
+
+	const __m512 r0 = _mm512_set1_ps(params.rot[0]), r1 = _mm512_set1_ps(params.rot[1]), r2 = _mm512_set1_ps(params.rot[2]);
+	const __m512 r3 = _mm512_set1_ps(params.rot[3]), r4 = _mm512_set1_ps(params.rot[4]), r5 = _mm512_set1_ps(params.rot[5]);
+	const __m512 r6 = _mm512_set1_ps(params.rot[6]), r7 = _mm512_set1_ps(params.rot[7]), r8 = _mm512_set1_ps(params.rot[8]);
+	const __m512 t0 = _mm512_set1_ps(params.trans[0]), t1 = _mm512_set1_ps(params.trans[1]), t2 = _mm512_set1_ps(params.trans[2]);
+	const __m512 fx = _mm512_set1_ps(params.colorFx), fy = _mm512_set1_ps(params.colorFy);
+	const __m512 cx = _mm512_set1_ps(params.colorCx), cy = _mm512_set1_ps(params.colorCy);
+	const __m512 mmToMeters = _mm512_set1_ps(1000.0f);
+	const __m512 w0 = _mm512_set1_ps(params.world[0]), w1 = _mm512_set1_ps(params.world[1]), w2 = _mm512_set1_ps(params.world[2]), w3 = _mm512_set1_ps(params.world[3]);
+	const __m512 w4 = _mm512_set1_ps(params.world[4]), w5 = _mm512_set1_ps(params.world[5]), w6 = _mm512_set1_ps(params.world[6]), w7 = _mm512_set1_ps(params.world[7]);
+	const __m512 w8 = _mm512_set1_ps(params.world[8]), w9 = _mm512_set1_ps(params.world[9]), w10 = _mm512_set1_ps(params.world[10]), w11 = _mm512_set1_ps(params.world[11]);
+
+	// Indices of the x and y components of sixteen interleaved rays, across the two registers they are loaded in
+	const __m512i rayXIndices = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+	const __m512i rayYIndices = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+
+	alignas(64) float Z[Lanes], projU[Lanes], projV[Lanes], worldX[Lanes], worldY[Lanes], worldZ[Lanes];
+
+	for (int v = rowBegin; v < rowEnd; ++v)
+	{
+		int rowStart = v * params.depthWidth;
+		int u = params.roiLeft;
+
+		for (; u + Lanes <= params.roiRight; u += Lanes)
+		{
+			int depthIdx = rowStart + u;
+
+			// Load sixteen depth values and widen them to floats (in meters)
+			__m256i d16 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(params.depth + depthIdx));
+			__m512 z = _mm512_div_ps(_mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(d16)), mmToMeters);
+
+			// Load sixteen interleaved rays and split them into x and y components; unlike the AVX2 shuffles, the
+			// two-register permutes cross the 128-bit lanes, so the components come out in pixel order
+			const float* rays = reinterpret_cast<const float*>(params.rays + depthIdx);
+			__m512 raysLo = _mm512_loadu_ps(rays);
+			__m512 raysHi = _mm512_loadu_ps(rays + 16);
+			__m512 rayX = _mm512_permutex2var_ps(raysLo, rayXIndices, raysHi);
+			__m512 rayY = _mm512_permutex2var_ps(raysLo, rayYIndices, raysHi);
+
+			__m512 x = _mm512_mul_ps(rayX, z);
+			__m512 y = _mm512_mul_ps(rayY, z);
+
+			// Transform points from depth to color camera space; the products are not fused, so that the points are
+			// the same as those of the other kernels
+			__m512 vX = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(r0, x), _mm512_mul_ps(r1, y)), _mm512_mul_ps(r2, z)), t0);
+			__m512 vY = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(r3, x), _mm512_mul_ps(r4, y)), _mm512_mul_ps(r5, z)), t1);
+			__m512 vZ = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(r6, x), _mm512_mul_ps(r7, y)), _mm512_mul_ps(r8, z)), t2);
+
+			// Project into the color image
+			_mm512_store_ps(projU, _mm512_add_ps(_mm512_div_ps(_mm512_mul_ps(fx, vX), vZ), cx));
+			_mm512_store_ps(projV, _mm512_add_ps(_mm512_div_ps(_mm512_mul_ps(fy, vY), vZ), cy));
+			_mm512_store_ps(Z, vZ);
+
+			// Transform points from color camera to world space
+			_mm512_store_ps(worldX, _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(w0, vX), _mm512_mul_ps(w1, vY)), _mm512_mul_ps(w2, vZ)), w3));
+			_mm512_store_ps(worldY, _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(w4, vX), _mm512_mul_ps(w5, vY)), _mm512_mul_ps(w6, vZ)), w7));
+			_mm512_store_ps(worldZ, _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(w8, vX), _mm512_mul_ps(w9, vY)), _mm512_mul_ps(w10, vZ)), w11));
+
+			for (int i = 0; i < Lanes; ++i)
+			{
+				StorePointCloudSample(params, depthIdx + i, params.depth[depthIdx + i], Z[i], projU[i], projV[i], worldX[i], worldY[i], worldZ[i], output, numPoints);
+			}
+		}
+
+		// Process the remaining pixels of the row one at a time
+		for (; u < params.roiRight; ++u)
+		{
+			ProcessPointCloudPixel(params, u, v, output, numPoints);
+		}
+	}
+
+	// Avoid AVX to SSE transition penalties in the code that follows
+	_mm256_zeroupper();
+
+	return numPoints;
+}
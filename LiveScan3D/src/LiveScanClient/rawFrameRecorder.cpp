@@ -0,0 +1,241 @@
+/***************************************************************************\
+
+Module Name:  RawFrameRecorder.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module records the raw frames of a camera, before any processing: the
+depth frame (Y16), the color frame (RGB888) and the camera parameters the
+point clouds are generated from. The recordings are replayed by the replay
+capture manager, so that the processing of the clients can be benchmarked
+and profiled on the same frames on any machine. Each frame holds its own
+camera parameters, since they change with the stream profile. The frames are
+copied to a bounded queue and written by a writer thread; when the disk
+falls behind, the newest frames are dropped.
+
+\***************************************************************************/
+
+#include "rawFrameRecorder.h"
+#include <ctime>
+#include <cstring>
+#include <algorithm>
+
+static const char RawRecordingMagic[4] = { 'L', 'S', 'R', 'D' };
+static const uint16_t RawRecordingVersion = 1;
+
+RawFrameRecorder::~RawFrameRecorder() {
+    Stop();
+}
+
+/// <summary>
+/// Opens a new raw recording, named after the device and the current time, and starts its writer thread
+/// </summary>
+/// <returns>False if the file could not be opened</returns>
+bool RawFrameRecorder::Start(int deviceID, const std::string& serialNumber) {
+    Stop();
+
+    char name[1024];
+    time_t t = time(0);
+    struct tm* now = localtime(&t);
+    sprintf(name, "raw_recording_%01d_%04d_%02d_%02d_%02d_%02d_%02d.bin", deviceID, now->tm_year + 1900, now->tm_mon + 1, now->tm_mday, now->tm_hour, now->tm_min, now->tm_sec);
+    filename = name;
+    fileHandle = fopen(name, "wb");
+
+    numWrittenFrames = 0;
+    numDroppedFrames = 0;
+
+    if (fileHandle == nullptr)
+        return false;
+
+    // The frames are written in one block each, so the stream buffer would only add a copy
+    setvbuf(fileHandle, nullptr, _IONBF, 0);
+
+    RawRecordingFileHeader header = {};
+    memcpy(header.Magic, RawRecordingMagic, sizeof(RawRecordingMagic));
+    header.Version = RawRecordingVersion;
+    strncpy(header.SerialNumber, serialNumber.c_str(), sizeof(header.SerialNumber) - 1);
+    fwrite(&header, sizeof(header), 1, fileHandle);
+
+    isWriteStopRequested = false;
+    writerThread = std::thread(&RawFrameRecorder::WriteLoop, this);
+
+    return true;
+}
+
+/// <summary>
+/// Writes the queued frames, then closes the recording
+/// </summary>
+void RawFrameRecorder::Stop() {
+    if (writerThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(writeQueueMutex);
+            isWriteStopRequested = true;
+        }
+
+        writeQueueCond.notify_all();
+        writerThread.join();
+    }
+
+    if (fileHandle != nullptr) {
+        fclose(fileHandle);
+        fileHandle = nullptr;
+    }
+}
+
+bool RawFrameRecorder::IsRecording() const {
+    return fileHandle != nullptr;
+}
+
+/// <summary>
+/// Copies a frame to the write queue; the buffers can be released as soon as this returns
+/// </summary>
+/// <returns>False if no recording is open or the frame was dropped because the write queue is full</returns>
+bool RawFrameRecorder::WriteFrame(const RawFrameHeader& header, const UINT16* depth, const BYTE* color) {
+    if (fileHandle == nullptr)
+        return false;
+
+    std::unique_ptr<RawFrame> frame;
+
+    {
+        std::lock_guard<std::mutex> lock(writeQueueMutex);
+
+        if (writeQueue.size() >= MaxQueuedFrames) {
+            numDroppedFrames++;
+            return false;
+        }
+
+        if (!freeFrames.empty()) {
+            frame = std::move(freeFrames.back());
+            freeFrames.pop_back();
+        }
+    }
+
+    // The copy is done outside of the lock so that the writer thread keeps writing meanwhile
+    if (!frame)
+        frame = std::make_unique<RawFrame>();
+
+    size_t numDepthPixels = static_cast<size_t>(header.DepthWidth) * header.DepthHeight;
+    size_t numColorBytes = 3 * static_cast<size_t>(header.ColorWidth) * header.ColorHeight;
+
+    frame->Header = header;
+    frame->Depth.assign(depth, depth + numDepthPixels);
+    frame->Color.assign(color, color + numColorBytes);
+
+    {
+        std::lock_guard<std::mutex> lock(writeQueueMutex);
+        writeQueue.push_back(std::move(frame));
+    }
+
+    writeQueueCond.notify_one();
+    return true;
+}
+
+void RawFrameRecorder::WriteLoop() {
+    while (true) {
+        std::unique_ptr<RawFrame> frame;
+
+        {
+            std::unique_lock<std::mutex> lock(writeQueueMutex);
+            writeQueueCond.wait(lock, [this]() { return isWriteStopRequested || !writeQueue.empty(); });
+
+            // The queued frames are still written when the recording stops
+            if (writeQueue.empty())
+                return;
+
+            frame = std::move(writeQueue.front());
+            writeQueue.pop_front();
+        }
+
+        fwrite(&frame->Header, sizeof(frame->Header), 1, fileHandle);
+        fwrite(frame->Depth.data(), sizeof(UINT16), frame->Depth.size(), fileHandle);
+        fwrite(frame->Color.data(), sizeof(BYTE), frame->Color.size(), fileHandle);
+        numWrittenFrames++;
+
+        std::lock_guard<std::mutex> lock(writeQueueMutex);
+        freeFrames.push_back(std::move(frame));
+    }
+}
+
+const std::string& RawFrameRecorder::GetFilename() const {
+    return filename;
+}
+
+uint64_t RawFrameRecorder::GetNumWrittenFrames() const {
+    return numWrittenFrames;
+}
+
+uint64_t RawFrameRecorder::GetNumDroppedFrames() const {
+    return numDroppedFrames;
+}
+
+RawFrameReader::~RawFrameReader() {
+    Close();
+}
+
+/// <summary>
+/// Opens a raw recording and reads its file header
+/// </summary>
+/// <returns>False if the file could not be opened or is not a raw recording</returns>
+bool RawFrameReader::Open(const std::string& path) {
+    Close();
+
+    fileHandle = fopen(path.c_str(), "rb");
+
+    if (fileHandle == nullptr)
+        return false;
+
+    RawRecordingFileHeader header;
+
+    if (fread(&header, sizeof(header), 1, fileHandle) != 1 || memcmp(header.Magic, RawRecordingMagic, sizeof(RawRecordingMagic)) != 0
+        || header.Version != RawRecordingVersion) {
+        Close();
+        return false;
+    }
+
+    serialNumber.assign(header.SerialNumber, strnlen(header.SerialNumber, sizeof(header.SerialNumber)));
+    return true;
+}
+
+void RawFrameReader::Close() {
+    if (fileHandle != nullptr) {
+        fclose(fileHandle);
+        fileHandle = nullptr;
+    }
+}
+
+/// <summary>
+/// Reads the next frame of the recording; the buffers of the frame are reused
+/// </summary>
+/// <returns>False at the end of the recording, including a frame cut short by the end of an unclosed recording</returns>
+bool RawFrameReader::ReadFrame(RawFrame& frame) {
+    if (fileHandle == nullptr)
+        return false;
+
+    if (fread(&frame.Header, sizeof(frame.Header), 1, fileHandle) != 1)
+        return false;
+
+    const RawFrameHeader& header = frame.Header;
+
+    if (header.DepthWidth <= 0 || header.DepthHeight <= 0 || header.ColorWidth <= 0 || header.ColorHeight <= 0)
+        return false;
+
+    frame.Depth.resize(static_cast<size_t>(header.DepthWidth) * header.DepthHeight);
+    frame.Color.resize(3 * static_cast<size_t>(header.ColorWidth) * header.ColorHeight);
+
+    return fread(frame.Depth.data(), sizeof(UINT16), frame.Depth.size(), fileHandle) == frame.Depth.size()
+        && fread(frame.Color.data(), sizeof(BYTE), frame.Color.size(), fileHandle) == frame.Color.size();
+}
+
+/// <summary>
+/// Goes back to the first frame of the recording
+/// </summary>
+void RawFrameReader::Rewind() {
+    if (fileHandle != nullptr)
+        fseek(fileHandle, sizeof(RawRecordingFileHeader), SEEK_SET);
+}
+
+const std::string& RawFrameReader::GetSerialNumber() const {
+    return serialNumber;
+}
@@ -0,0 +1,1072 @@
+/***************************************************************************\
+
+Module Name:  RemoteClient.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module handles a camera hosted by a capture node on another computer,
+so that the server controls it through the client API like the cameras of
+this computer. The calls of the server are sent to the node; those which
+return a value wait for its answer. The node streams the processed frames,
+which are decoded and published like those of a local client, with their
+acquisition and publication times and their global timestamp converted to
+the clocks of this computer from regular pings of the node. The connection
+is opened again whenever it is lost, with the last settings of the server.
+A remote client may also isolate a camera of this computer in a worker
+process, a node which hosts that camera alone: it is controlled the same way
+over loopback, but its frames are read from a shared frame ring, and the
+worker is started again whenever it exits or stops answering.
+
+\***************************************************************************/
+
+#include "remoteClient.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+static std::chrono::steady_clock::time_point ToSteadyTimePoint(int64_t timeUs)
+{
+    return std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::microseconds(timeUs)));
+}
+
+/// <summary>
+/// Returns the job of the workers, which kills them when the server exits, even when it crashes, so that they do not
+/// hold on to their cameras
+/// </summary>
+static HANDLE GetWorkerJob()
+{
+    static HANDLE job = []() {
+        HANDLE workerJob = CreateJobObjectW(nullptr, nullptr);
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+        limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+
+        if (workerJob)
+            SetInformationJobObject(workerJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits));
+
+        return workerJob;
+    }();
+
+    return job;
+}
+
+/// <summary>
+/// Creates the client of a camera of a capture node; it connects to the node once it runs
+/// </summary>
+/// <param name="index">Index of the client for the server</param>
+/// <param name="remoteIndex">Index of the client on the node</param>
+RemoteClient::RemoteClient(int index, const std::string& host, int port, int remoteIndex) :
+    clientIndex(index),
+    host(host),
+    port(port),
+    remoteIndex(remoteIndex),
+    settings(),
+    latestFrame(std::make_shared<ProcessedFrame>())
+{
+    SetupLogging();
+}
+
+/// <summary>
+/// Creates the client of a camera of this computer isolated in a worker process, which it starts once it runs; the
+/// camera keeps its index
+/// </summary>
+/// <param name="index">Index of the client for the server, which is also that of its camera</param>
+RemoteClient::RemoteClient(int index) :
+    clientIndex(index),
+    host("127.0.0.1"),
+    port(0),
+    remoteIndex(0),
+    isWorker(true),
+    settings(),
+    latestFrame(std::make_shared<ProcessedFrame>())
+{
+    SetupLogging();
+}
+
+/// <summary>
+/// Asks a capture node how many cameras it hosts
+/// </summary>
+/// <param name="timeoutMs">Maximum time to wait for the node to connect, then to answer</param>
+/// <returns>Number of clients of the node; -1 if it did not answer or runs another version of the protocol</returns>
+int RemoteClient::QueryNode(const std::string& host, int port, int timeoutMs)
+{
+    SOCKET socket = CaptureNodeConnection::Connect(host, port, timeoutMs);
+
+    if (socket == INVALID_SOCKET)
+        return -1;
+
+    CaptureNodeConnection node(socket);
+    CaptureNodeHello hello = { CaptureNodeProtocolVersion, -1 };
+    uint16_t type = 0;
+    std::vector<char> content;
+
+    if (!node.Send(HelloMessage, &hello, sizeof(hello)) || !node.WaitReadable(timeoutMs) || !node.Receive(type, content)
+        || type != NodeInfoMessage || content.size() < sizeof(CaptureNodeInfo))
+    {
+        return -1;
+    }
+
+    CaptureNodeInfo info;
+    memcpy(&info, content.data(), sizeof(info));
+
+    return info.Version == CaptureNodeProtocolVersion ? info.NumClients : -1;
+}
+
+/// <summary>
+/// Keeps the connection to the node open and receives its messages, until RequestExit is called. The worker of an
+/// isolated camera is kept running as well, while a thread of its own reads the frames of its ring.
+/// </summary>
+void RemoteClient::Run()
+{
+    bool wasConnected = false;
+
+    if (isWorker)
+    {
+        if (!frameRing.Create(SharedFrameRing::GetName(GetCurrentProcessId(), clientIndex)))
+        {
+            Log(ErrorLevel, "[RemoteClient] Failed to create the frame ring of the worker");
+            return;
+        }
+
+        frameRingThread = std::thread([this]() { ReceiveSharedFrames(); });
+    }
+
+    while (!isExitRequested)
+    {
+        std::shared_ptr<CaptureNodeConnection> node = !isWorker || StartWorker() ? Connect() : nullptr;
+
+        if (!node)
+        {
+            for (int waitedMs = 0; waitedMs < ReconnectIntervalMs && !isExitRequested; waitedMs += ReceiveWaitMs)
+                std::this_thread::sleep_for(std::chrono::milliseconds(ReceiveWaitMs));
+
+            continue;
+        }
+
+        Log(InfoLevel, "[RemoteClient] Connected to client " + std::to_string(remoteIndex) + " of the capture node " + host + ":" + std::to_string(port));
+        wasConnected = true;
+
+        {
+            std::lock_guard<std::mutex> lock(connectionMutex);
+            connection = node;
+        }
+
+        lastClockPongTimeUs = GetSteadyTimeUs();
+        ReceiveMessages(*node);
+        bool isHung = isWorker && GetSteadyTimeUs() - lastClockPongTimeUs >= 1000LL * WorkerHangTimeoutMs;
+
+        {
+            std::lock_guard<std::mutex> lock(connectionMutex);
+            connection.reset();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(replyMutex);
+            connectionNumber++;
+        }
+
+        replyCond.notify_all();
+
+        // The node may have restarted, with other clocks
+        steadyClock.Reset();
+        systemClock.Reset();
+
+        if (!isExitRequested)
+            Log(WarningLevel, "[RemoteClient] Lost the connection to the capture node " + host + ":" + std::to_string(port));
+
+        if (isHung && !isExitRequested)
+        {
+            Log(ErrorLevel, "[RemoteClient] The worker of the camera stopped answering; it is killed and started again");
+            StopWorker(true);
+        }
+    }
+
+    if (!wasConnected)
+        Log(WarningLevel, "[RemoteClient] Never connected to the capture node " + host + ":" + std::to_string(port));
+
+    if (isWorker)
+    {
+        StopWorker(false);
+        frameRingThread.join();
+    }
+}
+
+void RemoteClient::RequestExit()
+{
+    isExitRequested = true;
+
+    {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+
+        if (connection)
+            connection->Shutdown();
+    }
+
+    replyCond.notify_all();
+    frameReadyCond.notify_all();
+}
+
+void RemoteClient::StartFrameRecording()
+{
+    SendToNode(StartFrameRecordingMessage);
+}
+
+void RemoteClient::Calibrate()
+{
+    SendToNode(CalibrateMessage);
+}
+
+/// <summary>
+/// Reports how many marker samples the calibration of the node found so far
+/// </summary>
+/// <returns>False once the camera is not calibrating anymore, or if the node did not answer</returns>
+bool RemoteClient::GetCalibrationProgress(int& numSamples, int& numRequiredSamples)
+{
+    numSamples = 0;
+    numRequiredSamples = 0;
+
+    std::vector<char> reply;
+
+    if (!Request(CalibrationProgressRequest, nullptr, 0, CalibrationProgressReply, RequestTimeoutMs, reply)
+        || reply.size() < sizeof(CaptureNodeCalibrationProgress))
+    {
+        return false;
+    }
+
+    CaptureNodeCalibrationProgress progress;
+    memcpy(&progress, reply.data(), sizeof(progress));
+    numSamples = progress.NumSamples;
+    numRequiredSamples = progress.NumRequiredSamples;
+
+    return progress.IsCalibrating != 0;
+}
+
+void RemoteClient::SetDocumentFrameInterval(int intervalMs)
+{
+    {
+        std::lock_guard<std::mutex> lock(settingsMutex);
+        documentFrameIntervalMs = intervalMs;
+    }
+
+    int32_t interval = intervalMs;
+    SendToNode(SetDocumentFrameIntervalMessage, &interval, sizeof(interval));
+}
+
+void RemoteClient::SetMaxDocumentSize(int width, int height)
+{
+    {
+        std::lock_guard<std::mutex> lock(settingsMutex);
+        maxDocumentWidth = width;
+        maxDocumentHeight = height;
+    }
+
+    int32_t size[2] = { width, height };
+    SendToNode(SetMaxDocumentSizeMessage, size, sizeof(size));
+}
+
+/// <summary>
+/// Sends the exposure to the node, and keeps it for when the connection opens again, until the next settings
+/// </summary>
+void RemoteClient::SetExposure(bool isAutoExposureEnabled, int exposureStep)
+{
+    int32_t exposure[2] = { isAutoExposureEnabled ? 1 : 0, exposureStep };
+
+    {
+        std::lock_guard<std::mutex> lock(settingsMutex);
+        this->exposureStep = isAutoExposureEnabled ? 0 : (std::max)(exposureStep, 1);
+    }
+
+    SendToNode(SetExposureMessage, exposure, sizeof(exposure));
+}
+
+/// <summary>
+/// Sends the settings to the node, and keeps them for when the connection opens again
+/// </summary>
+void RemoteClient::SetSettings(const CameraSettings& newSettings)
+{
+    {
+        std::lock_guard<std::mutex> lock(settingsMutex);
+
+        settings = newSettings;
+
+        if (newSettings.MarkerPoses && newSettings.NumMarkers > 0)
+            markerPoses.assign(newSettings.MarkerPoses, newSettings.MarkerPoses + newSettings.NumMarkers);
+        else
+            markerPoses.clear();
+
+        settings.MarkerPoses = nullptr;
+        settings.NumMarkers = static_cast<int>(markerPoses.size());
+        hasSettings = true;
+        exposureStep = -1;
+    }
+
+    std::shared_ptr<CaptureNodeConnection> node;
+
+    {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        node = connection;
+    }
+
+    if (node)
+        SendSettings(*node);
+}
+
+void RemoteClient::RequestRecordedFrame()
+{
+    RequestRecordedFrames(0);
+}
+
+/// <summary>
+/// Has the node read up to maxFrames frames of its recording, then sends them through the recorded frame callback
+/// within this call, like a local client does. With maxFrames 0, the node reads a single frame like
+/// RequestRecordedFrame does.
+/// </summary>
+/// <returns>Number of frames sent; fewer than maxFrames if the recording ended or the node did not answer</returns>
+int RemoteClient::RequestRecordedFrames(int maxFrames)
+{
+    int32_t numRequestedFrames = (std::max)(maxFrames, 0);
+    std::vector<char> reply;
+    std::vector<std::vector<char>> frames;
+
+    bool isAnswered = Request(RecordedFramesRequest, &numRequestedFrames, sizeof(numRequestedFrames), RecordedFramesReply,
+        RecordedFramesTimeoutMs, reply) && reply.size() >= sizeof(int32_t);
+
+    {
+        std::lock_guard<std::mutex> lock(replyMutex);
+        frames.swap(recordedFrames);
+    }
+
+    if (!isAnswered)
+    {
+        Log(WarningLevel, "[RemoteClient] The capture node did not send the recorded frames");
+        return 0;
+    }
+
+    // The points are copied out of the messages, whose content is not aligned for them
+    std::vector<Point3s> vertices;
+    std::vector<RGB> colors;
+
+    for (const std::vector<char>& frame : frames)
+    {
+        CaptureNodeRecordedFrameHeader header;
+
+        if (frame.size() < sizeof(header))
+            continue;
+
+        memcpy(&header, frame.data(), sizeof(header));
+
+        if (frame.size() < sizeof(header) + static_cast<size_t>(header.NumPoints) * (sizeof(Point3s) + sizeof(RGB)))
+            continue;
+
+        vertices.resize(header.NumPoints);
+        colors.resize(header.NumPoints);
+        memcpy(vertices.data(), frame.data() + sizeof(header), vertices.size() * sizeof(Point3s));
+        memcpy(colors.data(), frame.data() + sizeof(header) + vertices.size() * sizeof(Point3s), colors.size() * sizeof(RGB));
+
+        if (wrapper && wrapper->sendStoredFrameCallback)
+            wrapper->sendStoredFrameCallback(clientIndex, vertices.data(), colors.data(), static_cast<int>(header.NumPoints), header.NoMoreFrames != 0);
+    }
+
+    int32_t numFrames;
+    memcpy(&numFrames, reply.data(), sizeof(numFrames));
+
+    return numFrames;
+}
+
+/// <summary>
+/// Returns the latest frame received from the node. Published frames are never modified, so it can be read from any
+/// thread for as long as it is held.
+/// </summary>
+std::shared_ptr<const ProcessedFrame> RemoteClient::AcquireLatestFrame()
+{
+    return std::atomic_load(&latestFrame);
+}
+
+/// <summary>
+/// Waits until a frame newer than lastSequenceNumber has been received from the node
+/// </summary>
+/// <returns>True if a new frame is available; false if the wait timed out.</returns>
+bool RemoteClient::WaitForNewFrame(uint64_t lastSequenceNumber, int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(frameReadyMutex);
+
+    return frameReadyCond.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+        [this, lastSequenceNumber]() { return latestSequenceNumber > lastSequenceNumber || isExitRequested; })
+        && latestSequenceNumber > lastSequenceNumber;
+}
+
+/// <summary>
+/// Copies the document the node sent with its last document event, and releases it
+/// </summary>
+/// <returns>Size of the encoded document copied; 0 if there is none to send</returns>
+int RemoteClient::CopyDocument(unsigned char* jpeg, int maxJpegSize, float& score, short& width, short& height, unsigned char* signature, int maxSignatureSize)
+{
+    std::lock_guard<std::mutex> lock(documentMutex);
+
+    int jpegSize = static_cast<int>(documentJpeg.size());
+
+    if (jpegSize == 0 || jpegSize > maxJpegSize)
+        return 0;
+
+    std::copy(documentJpeg.begin(), documentJpeg.end(), jpeg);
+    std::copy_n(documentSignature.begin(), (std::min)(static_cast<int>(documentSignature.size()), maxSignatureSize), signature);
+    score = documentScore;
+    width = documentWidth;
+    height = documentHeight;
+
+    documentJpeg.clear();
+
+    return jpegSize;
+}
+
+/// <summary>
+/// Summarizes the time taken by each stage of the frame loop of the client of the node
+/// </summary>
+/// <returns>Number of stages written to stats; 0 if the node did not answer</returns>
+int RemoteClient::GetPerfStats(PerfStageStats* stats, int maxStages, bool isReset)
+{
+    uint8_t isResetRequested = isReset ? 1 : 0;
+    std::vector<char> reply;
+
+    if (!Request(PerfStatsRequest, &isResetRequested, sizeof(isResetRequested), PerfStatsReply, RequestTimeoutMs, reply))
+        return 0;
+
+    int numStages = (std::min)(static_cast<int>(reply.size() / sizeof(PerfStageStats)), maxStages);
+    memcpy(stats, reply.data(), numStages * sizeof(PerfStageStats));
+
+    return numStages;
+}
+
+/// <summary>
+/// Copies the last memory accounting of the client of the node; all zero if the node did not answer
+/// </summary>
+void RemoteClient::GetMemoryStats(ClientMemoryStats& stats)
+{
+    stats = {};
+    std::vector<char> reply;
+
+    if (Request(MemoryStatsRequest, nullptr, 0, MemoryStatsReply, RequestTimeoutMs, reply) && reply.size() >= sizeof(stats))
+        memcpy(&stats, reply.data(), sizeof(stats));
+}
+
+/// <summary>
+/// Copies the counts of the points at each step of the processing of the last frame of the client of the node; all
+/// zero if the node did not answer
+/// </summary>
+void RemoteClient::GetFunnelStats(FrameFunnelStats& stats)
+{
+    stats = {};
+    std::vector<char> reply;
+
+    if (Request(FunnelStatsRequest, nullptr, 0, FunnelStatsReply, RequestTimeoutMs, reply) && reply.size() >= sizeof(stats))
+        memcpy(&stats, reply.data(), sizeof(stats));
+}
+
+/// <summary>
+/// Copies the depth frame the node acquires next, with the camera parameters and world transform it is unprojected with
+/// </summary>
+/// <param name="timeoutMs">Maximum time the node waits for the next frame; the network adds to it</param>
+/// <returns>True if the frame was copied; false if the wait timed out.</returns>
+bool RemoteClient::AcquireDepthFrame(DepthFrame& frame, int timeoutMs)
+{
+    int32_t requestTimeoutMs = timeoutMs;
+    std::vector<char> reply;
+    CaptureNodeDepthFrameHeader header;
+
+    if (!Request(DepthFrameRequest, &requestTimeoutMs, sizeof(requestTimeoutMs), DepthFrameReply, timeoutMs + RequestTimeoutMs, reply)
+        || reply.size() < sizeof(header))
+    {
+        return false;
+    }
+
+    memcpy(&header, reply.data(), sizeof(header));
+    size_t numPixels = static_cast<size_t>((std::max)(header.Width, 0)) * (std::max)(header.Height, 0);
+
+    if (reply.size() < sizeof(header) + numPixels * sizeof(UINT16))
+        return false;
+
+    frame.Depth.resize(numPixels);
+    memcpy(frame.Depth.data(), reply.data() + sizeof(header), numPixels * sizeof(UINT16));
+    frame.Width = header.Width;
+    frame.Height = header.Height;
+    std::copy(header.Intrinsics, header.Intrinsics + 4, frame.Intrinsics);
+    std::copy(header.DepthToWorld, header.DepthToWorld + 12, frame.DepthToWorld);
+
+    return true;
+}
+
+void RemoteClient::ReceiveCalibration(const AffineTransform& transform)
+{
+    SendToNode(ReceiveCalibrationMessage, &transform, sizeof(transform));
+}
+
+void RemoteClient::ReceiveCameraPoses(const std::vector<AffineTransform>& poses, int cameraIndex)
+{
+    std::vector<char> content(sizeof(int32_t) + poses.size() * sizeof(AffineTransform));
+    int32_t index = cameraIndex;
+    memcpy(content.data(), &index, sizeof(index));
+
+    if (!poses.empty())
+        memcpy(content.data() + sizeof(index), poses.data(), poses.size() * sizeof(AffineTransform));
+
+    SendToNode(ReceiveCameraPosesMessage, content.data(), content.size());
+}
+
+void RemoteClient::ClearRecordedFrames()
+{
+    SendToNode(ClearRecordedFramesMessage);
+}
+
+void RemoteClient::SaveFrameRing(int seconds)
+{
+    int32_t numSeconds = seconds;
+    SendToNode(SaveFrameRingMessage, &numSeconds, sizeof(numSeconds));
+}
+
+void RemoteClient::LearnExclusionMask(int numFrames)
+{
+    int32_t frames = numFrames;
+    SendToNode(LearnExclusionMaskMessage, &frames, sizeof(frames));
+}
+
+void RemoteClient::EnableSync(int syncState, int syncOffset, int numSyncedDevices)
+{
+    int32_t sync[3] = { syncState, syncOffset, numSyncedDevices };
+    SendToNode(EnableSyncMessage, sync, sizeof(sync));
+}
+
+void RemoteClient::DisableSync()
+{
+    SendToNode(DisableSyncMessage);
+}
+
+void RemoteClient::StartMaster()
+{
+    SendToNode(StartMasterMessage);
+}
+
+/// <summary>
+/// Opens a connection to the client of the node, and sends it the last settings of the server
+/// </summary>
+/// <returns>The connection; null if the node did not answer or cannot serve the client</returns>
+std::shared_ptr<CaptureNodeConnection> RemoteClient::Connect()
+{
+    SOCKET socket = CaptureNodeConnection::Connect(host, port, ConnectTimeoutMs);
+
+    if (socket == INVALID_SOCKET)
+        return nullptr;
+
+    std::shared_ptr<CaptureNodeConnection> node = std::make_shared<CaptureNodeConnection>(socket);
+    CaptureNodeHello hello = { CaptureNodeProtocolVersion, remoteIndex };
+    uint16_t type = 0;
+    std::vector<char> content;
+
+    if (!node->Send(HelloMessage, &hello, sizeof(hello)) || !node->WaitReadable(ConnectTimeoutMs) || !node->Receive(type, content)
+        || type != NodeInfoMessage || content.size() < sizeof(CaptureNodeInfo))
+    {
+        Log(WarningLevel, "[RemoteClient] The capture node " + host + ":" + std::to_string(port) + " did not answer");
+        return nullptr;
+    }
+
+    CaptureNodeInfo info;
+    memcpy(&info, content.data(), sizeof(info));
+
+    if (info.Version != CaptureNodeProtocolVersion)
+    {
+        Log(ErrorLevel, "[RemoteClient] The capture node " + host + ":" + std::to_string(port) + " runs version " + std::to_string(info.Version)
+            + " of the protocol instead of " + std::to_string(CaptureNodeProtocolVersion));
+        return nullptr;
+    }
+
+    if (remoteIndex >= info.NumClients)
+    {
+        Log(ErrorLevel, "[RemoteClient] The capture node " + host + ":" + std::to_string(port) + " only hosts " + std::to_string(info.NumClients) + " clients");
+        return nullptr;
+    }
+
+    if (!SendSettings(*node))
+        return nullptr;
+
+    return node;
+}
+
+/// <summary>
+/// Receives the messages of the node until the connection closes, and pings the node regularly to follow its clocks.
+/// The first pings are sent quickly, so that the clocks are known from the first frames.
+/// </summary>
+void RemoteClient::ReceiveMessages(CaptureNodeConnection& node)
+{
+    int64_t lastPingTimeUs = 0;
+    uint16_t type = 0;
+    std::vector<char> content;
+
+    while (!isExitRequested)
+    {
+        int64_t nowUs = GetSteadyTimeUs();
+        int64_t pingIntervalUs = 1000LL * (steadyClock.GetNumSamples() < NumFastClockPings ? ReceiveWaitMs : ClockPingIntervalMs);
+
+        if (nowUs - lastPingTimeUs >= pingIntervalUs)
+        {
+            CaptureNodeClockSample ping = { nowUs, 0, 0 };
+
+            if (!node.Send(ClockPingMessage, &ping, sizeof(ping)))
+                return;
+
+            lastPingTimeUs = nowUs;
+        }
+
+        // The camera of a worker may hang in its SDK and take the calls of the server with it
+        if (isWorker && nowUs - lastClockPongTimeUs >= 1000LL * WorkerHangTimeoutMs)
+            return;
+
+        if (!node.WaitReadable(ReceiveWaitMs))
+            continue;
+
+        if (!node.Receive(type, content))
+            return;
+
+        HandleMessage(type, content);
+    }
+}
+
+void RemoteClient::HandleMessage(uint16_t type, std::vector<char>& content)
+{
+    switch (type)
+    {
+    case FrameMessage:
+        ReceiveFrame(content);
+        break;
+
+    case ClockPongMessage:
+        ReceiveClockPong(content);
+        break;
+
+    case EventMessage:
+        ReceiveEvent(content);
+        break;
+
+    case DocumentMessage:
+        ReceiveDocument(content);
+        break;
+
+    case RecordedFrameMessage:
+    {
+        std::lock_guard<std::mutex> lock(replyMutex);
+        recordedFrames.push_back(std::move(content));
+        break;
+    }
+
+    default:
+    {
+        // Answers to the requests
+        {
+            std::lock_guard<std::mutex> lock(replyMutex);
+            replies[type] = std::move(content);
+        }
+
+        replyCond.notify_all();
+        break;
+    }
+    }
+}
+
+/// <summary>
+/// Decodes a frame of the node and publishes it, with its times converted to the clocks of this computer
+/// </summary>
+void RemoteClient::ReceiveFrame(const std::vector<char>& content)
+{
+    CaptureNodeFrameHeader header;
+
+    if (content.size() < sizeof(header))
+        return;
+
+    memcpy(&header, content.data(), sizeof(header));
+
+    // The normals, when the node estimates them, follow the encoded points uncompressed
+    if (header.NumNormals != 0 && header.NumNormals != header.NumPoints)
+        return;
+
+    if (content.size() < sizeof(header) + header.NumNormals)
+        return;
+
+    std::shared_ptr<ProcessedFrame> frame = AcquireFreeFrame();
+    size_t encodedSize = content.size() - sizeof(header) - header.NumNormals;
+    const char* normals = content.data() + sizeof(header) + encodedSize;
+
+    frame->Normals.assign(reinterpret_cast<const uint8_t*>(normals), reinterpret_cast<const uint8_t*>(normals) + header.NumNormals);
+
+    if (!frameCodec.Decode(content.data() + sizeof(header), encodedSize, static_cast<int>(header.NumPoints), frame->Vertices, frame->Colors))
+    {
+        Log(WarningLevel, "[RemoteClient] Dropped a frame of " + std::to_string(header.NumPoints) + " points which could not be decoded");
+        return;
+    }
+
+    // Until the node answers the first ping, the frames are taken to be published as they arrive
+    bool isSynced = steadyClock.IsValid();
+    int64_t arrivalOffsetUs = GetSteadyTimeUs() - header.PublishTimeUs;
+
+    auto ToSteadyTime = [&](int64_t nodeTimeUs) {
+        return ToSteadyTimePoint(isSynced ? steadyClock.ToTarget(nodeTimeUs) : nodeTimeUs + arrivalOffsetUs);
+    };
+
+    frame->AcquireTime = ToSteadyTime(header.AcquireTimeUs);
+    frame->PublishTime = ToSteadyTime(header.PublishTimeUs);
+    frame->TimeStampUs = header.TimeStampUs;
+
+    // The node publishes the timestamps on its system clock
+    if (isSynced && header.TimeStampUs != 0)
+        frame->TimeStampUs = static_cast<uint64_t>(systemClock.ToTarget(static_cast<int64_t>(header.TimeStampUs)));
+
+    PublishFrame(std::move(frame));
+}
+
+/// <summary>
+/// Copies the frames the worker publishes in its ring, until RequestExit is called. The worker shares the clocks of
+/// this computer, so the times of the frames are kept.
+/// </summary>
+void RemoteClient::ReceiveSharedFrames()
+{
+    while (!isExitRequested)
+    {
+        SharedFrameInfo info;
+        const Point3s* vertices = nullptr;
+        const RGB* colors = nullptr;
+        const uint8_t* normals = nullptr;
+
+        if (!frameRing.WaitForFrame(ReceiveWaitMs) || !frameRing.ReadLatest(info, vertices, colors, normals))
+            continue;
+
+        std::shared_ptr<ProcessedFrame> frame = AcquireFreeFrame();
+        frame->Vertices.assign(vertices, vertices + info.NumPoints);
+        frame->Colors.assign(colors, colors + info.NumPoints);
+        frame->Normals.assign(normals, normals + info.NumNormals);
+        frame->AcquireTime = ToSteadyTimePoint(info.AcquireTimeUs);
+        frame->PublishTime = ToSteadyTimePoint(info.PublishTimeUs);
+        frame->TimeStampUs = info.TimeStampUs;
+
+        PublishFrame(std::move(frame));
+    }
+}
+
+/// <summary>
+/// Publishes a frame received from the node in place of the previous one, numbered after it
+/// </summary>
+void RemoteClient::PublishFrame(std::shared_ptr<ProcessedFrame> frame)
+{
+    uint64_t sequenceNumber = latestSequenceNumber + 1;
+    frame->SequenceNumber = sequenceNumber;
+    std::atomic_store(&latestFrame, std::shared_ptr<const ProcessedFrame>(std::move(frame)));
+
+    {
+        std::lock_guard<std::mutex> lock(frameReadyMutex);
+        latestSequenceNumber = sequenceNumber;
+    }
+
+    frameReadyCond.notify_all();
+}
+
+/// <summary>
+/// Follows the clocks of the node from the answer to a ping, taking the node to have answered half way through the
+/// round trip
+/// </summary>
+void RemoteClient::ReceiveClockPong(const std::vector<char>& content)
+{
+    CaptureNodeClockSample pong;
+
+    if (content.size() < sizeof(pong))
+        return;
+
+    memcpy(&pong, content.data(), sizeof(pong));
+
+    int64_t nowUs = GetSteadyTimeUs();
+    int64_t systemNowUs = GetSystemTimeUs();
+    int64_t roundTripUs = nowUs - pong.ServerTimeUs;
+
+    int numSamples = steadyClock.GetNumSamples();
+
+    steadyClock.AddSample(pong.NodeTimeUs, pong.ServerTimeUs + roundTripUs / 2, roundTripUs);
+    systemClock.AddSample(pong.NodeSystemTimeUs, systemNowUs - roundTripUs / 2, roundTripUs);
+    lastClockPongTimeUs = nowUs;
+
+    if (steadyClock.GetNumSamples() <= numSamples)
+        Log(WarningLevel, "[RemoteClient] The clocks of the capture node " + host + ":" + std::to_string(port) + " jumped; their offsets are estimated again");
+}
+
+/// <summary>
+/// Passes an event of the client of the node to the server, as an event of this client
+/// </summary>
+void RemoteClient::ReceiveEvent(const std::vector<char>& content)
+{
+    ClientEvent event;
+
+    if (content.size() < sizeof(event))
+        return;
+
+    memcpy(&event, content.data(), sizeof(event));
+    event.ClientIndex = clientIndex;
+
+    ClientEventQueue::Instance().Push(event);
+}
+
+/// <summary>
+/// Keeps a document sent by the node until the server copies it, and tells the server that it is ready
+/// </summary>
+void RemoteClient::ReceiveDocument(const std::vector<char>& content)
+{
+    CaptureNodeDocumentHeader header;
+
+    if (content.size() < sizeof(header))
+        return;
+
+    memcpy(&header, content.data(), sizeof(header));
+
+    if (content.size() < sizeof(header) + header.SignatureSize)
+        return;
+
+    const unsigned char* signature = reinterpret_cast<const unsigned char*>(content.data()) + sizeof(header);
+    const unsigned char* jpeg = signature + header.SignatureSize;
+    const unsigned char* end = reinterpret_cast<const unsigned char*>(content.data()) + content.size();
+
+    ClientEvent event = {};
+    event.ClientIndex = clientIndex;
+    event.Type = DocumentEvent;
+
+    {
+        std::lock_guard<std::mutex> lock(documentMutex);
+        documentSignature.assign(signature, jpeg);
+        documentJpeg.assign(jpeg, end);
+        documentScore = header.Score;
+        documentWidth = header.Width;
+        documentHeight = header.Height;
+        event.Value = static_cast<int>(documentJpeg.size());
+    }
+
+    ClientEventQueue::Instance().Push(event);
+}
+
+/// <summary>
+/// Sends a message to the node
+/// </summary>
+/// <returns>False if the node is not connected</returns>
+bool RemoteClient::SendToNode(uint16_t type, const void* content, size_t size)
+{
+    std::shared_ptr<CaptureNodeConnection> node;
+
+    {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        node = connection;
+    }
+
+    return node && node->Send(type, content, size);
+}
+
+/// <summary>
+/// Sends the last settings, document frame interval, document size and exposure of the server, if it set them
+/// </summary>
+/// <returns>False if the connection is closed</returns>
+bool RemoteClient::SendSettings(CaptureNodeConnection& node)
+{
+    std::lock_guard<std::mutex> lock(settingsMutex);
+
+    if (documentFrameIntervalMs >= 0)
+    {
+        int32_t interval = documentFrameIntervalMs;
+
+        if (!node.Send(SetDocumentFrameIntervalMessage, &interval, sizeof(interval)))
+            return false;
+    }
+
+    if (maxDocumentWidth >= 0)
+    {
+        int32_t size[2] = { maxDocumentWidth, maxDocumentHeight };
+
+        if (!node.Send(SetMaxDocumentSizeMessage, size, sizeof(size)))
+            return false;
+    }
+
+    if (hasSettings && !node.Send(SetSettingsMessage, &settings, sizeof(settings), markerPoses.data(), markerPoses.size() * sizeof(MarkerPose)))
+        return false;
+
+    // The exposure set after the settings overrides theirs
+    if (exposureStep >= 0)
+    {
+        int32_t exposure[2] = { exposureStep == 0 ? 1 : 0, exposureStep };
+
+        if (!node.Send(SetExposureMessage, exposure, sizeof(exposure)))
+            return false;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Sends a request to the node and waits for its answer
+/// </summary>
+/// <param name="replyType">Type of the message which answers the request</param>
+/// <param name="reply">Receives the content of the answer</param>
+/// <returns>False if the node is not connected, or did not answer before the timeout or the connection closed</returns>
+bool RemoteClient::Request(uint16_t type, const void* content, size_t size, uint16_t replyType, int timeoutMs, std::vector<char>& reply)
+{
+    std::unique_lock<std::mutex> lock(replyMutex);
+
+    // Drop the late answer of an abandoned request
+    replies.erase(replyType);
+
+    if (replyType == RecordedFramesReply)
+        recordedFrames.clear();
+
+    uint64_t requestConnectionNumber = connectionNumber;
+    lock.unlock();
+
+    if (!SendToNode(type, content, size))
+        return false;
+
+    lock.lock();
+
+    replyCond.wait_for(lock, std::chrono::milliseconds((std::max)(timeoutMs, 0)), [this, replyType, requestConnectionNumber]() {
+        return replies.count(replyType) > 0 || connectionNumber != requestConnectionNumber || isExitRequested;
+        });
+
+    auto answer = replies.find(replyType);
+
+    if (answer == replies.end())
+        return false;
+
+    reply.swap(answer->second);
+    replies.erase(answer);
+
+    return true;
+}
+
+/// <summary>
+/// Starts the worker if it is not running, again if it exited, and finds the port it listens on. The worker is the
+/// capture node next to the server, which hosts the camera of this client alone.
+/// </summary>
+/// <returns>True once the worker listens for the connection of this client</returns>
+bool RemoteClient::StartWorker()
+{
+    if (workerProcess && WaitForSingleObject(workerProcess, 0) == WAIT_OBJECT_0)
+    {
+        DWORD exitCode = 0;
+        GetExitCodeProcess(workerProcess, &exitCode);
+        CloseHandle(workerProcess);
+        workerProcess = nullptr;
+
+        Log(ErrorLevel, "[RemoteClient] The worker of the camera exited with code " + std::to_string(exitCode) + "; it is started again");
+    }
+
+    if (!workerProcess)
+    {
+        wchar_t buffer[MAX_PATH];
+        GetModuleFileNameW(NULL, buffer, MAX_PATH);
+        std::wstring path(buffer);
+        std::wstring workerPath = path.substr(0, path.find_last_of(L"\\/")) + L"\\LiveScanNode.exe";
+        std::wstring commandLine = L"\"" + workerPath + L"\" --worker " + std::to_wstring(clientIndex) + L" --server " + std::to_wstring(GetCurrentProcessId());
+
+        STARTUPINFOW startupInfo = {};
+        startupInfo.cb = sizeof(startupInfo);
+        PROCESS_INFORMATION processInfo = {};
+
+        // The port of the previous worker is cleared, so that the new one is connected to once it listens
+        frameRing.SetControlPort(0);
+
+        if (!CreateProcessW(workerPath.c_str(), &commandLine[0], nullptr, nullptr, FALSE, CREATE_NO_WINDOW | CREATE_SUSPENDED, nullptr, nullptr,
+            &startupInfo, &processInfo))
+        {
+            Log(ErrorLevel, "[RemoteClient] Failed to start the worker of the camera (error " + std::to_string(GetLastError()) + ")");
+            return false;
+        }
+
+        // The worker joins the job before it runs, so none of its time is spent outside of it
+        AssignProcessToJobObject(GetWorkerJob(), processInfo.hProcess);
+        ResumeThread(processInfo.hThread);
+        CloseHandle(processInfo.hThread);
+        workerProcess = processInfo.hProcess;
+
+        Log(InfoLevel, "[RemoteClient] Started the worker of the camera, process " + std::to_string(processInfo.dwProcessId));
+    }
+
+    port = frameRing.GetControlPort();
+
+    return port != 0;
+}
+
+/// <summary>
+/// Stops the worker, asking it to exit first unless it is hung; it is killed if it does not exit in time
+/// </summary>
+void RemoteClient::StopWorker(bool isKilled)
+{
+    if (!workerProcess)
+        return;
+
+    if (!isKilled)
+        frameRing.RequestExit();
+
+    if (isKilled || WaitForSingleObject(workerProcess, WorkerExitTimeoutMs) != WAIT_OBJECT_0)
+    {
+        TerminateProcess(workerProcess, 1);
+        WaitForSingleObject(workerProcess, WorkerExitTimeoutMs);
+    }
+
+    CloseHandle(workerProcess);
+    workerProcess = nullptr;
+}
+
+/// <summary>
+/// Returns a frame of the pool which only the pool references, so that it can be overwritten without affecting the
+/// published frame or the one being sent. A new frame is allocated in the unlikely case where all of them are in use.
+/// </summary>
+std::shared_ptr<ProcessedFrame> RemoteClient::AcquireFreeFrame()
+{
+    for (auto& frame : framePool)
+    {
+        if (!frame)
+            frame = std::make_shared<ProcessedFrame>();
+
+        if (frame.use_count() == 1)
+        {
+            // Make sure the reads of the last reader are done before the buffers get overwritten
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return frame;
+        }
+    }
+
+    return std::make_shared<ProcessedFrame>();
+}
+
+/// <summary>
+/// Creates the log file of this client, named like those of the local clients
+/// </summary>
+void RemoteClient::SetupLogging()
+{
+    wchar_t buffer[MAX_PATH];
+    GetModuleFileNameW(NULL, buffer, MAX_PATH);
+    std::wstring path(buffer);
+    std::wstring dir = path.substr(0, path.find_last_of(L"\\/")) + L"\\Log";
+
+    CreateDirectoryW(dir.c_str(), NULL);
+
+    // The client hosted by the worker writes the log of the local clients in the same folder
+    std::wstring logPath = dir + (isWorker ? L"\\LiveScanWorker_" : L"\\LiveScanClient_") + std::to_wstring(clientIndex) + L"_Log.txt";
+    if (!logger.Open(logPath))
+    {
+        OutputDebugStringW(L"Failed to open log file.\n");
+        return;
+    }
+
+    if (isWorker)
+    {
+        Log(InfoLevel, "==== Application Started (Client " + std::to_string(clientIndex) + ", isolated in a worker process) ====");
+        return;
+    }
+
+    Log(InfoLevel, "==== Application Started (Client " + std::to_string(clientIndex) + ", client " + std::to_string(remoteIndex)
+        + " of the capture node " + host + ":" + std::to_string(port) + ") ====");
+}
+
+void RemoteClient::Log(LogLevel level, const std::string& message)
+{
+    logger.Log(level, message);
+}
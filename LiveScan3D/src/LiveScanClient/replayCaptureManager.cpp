@@ -0,0 +1,543 @@
+/***************************************************************************\
+
+Module Name:  ReplayCaptureManager.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module replays a raw recording of a camera instead of capturing from
+one, so that the processing of the clients can be benchmarked and profiled
+on the same frames on any machine. The frames are played at the speed they
+were recorded at, or as fast as they are processed, and the recording loops
+once it ends. The point clouds are generated like the CPU and GPU backends
+of the Orbbec capture manager do, and the frames are sent to the document
+detection once per second of the recording.
+
+\***************************************************************************/
+
+#include "replayCaptureManager.h"
+#include <algorithm>
+#include <thread>
+
+ReplayCaptureManager::ReplayCaptureManager(int deviceIndex, const std::string& path, bool isRealTime)
+    : deviceIndex(deviceIndex), path(path), isRealTime(isRealTime)
+{
+    pointCloudKernel = SelectPointCloudKernel();
+
+    documentDetector = std::make_unique<DocumentDetector>();
+
+    documentDetector->SetDetectionCallback([=](const DetectionResult& result) {
+        lastDocumentHeight = result.height;
+        lastDocumentWidth = result.width;
+        lastDocumentJpeg = result.jpeg;
+        lastDocumentScore = result.score;
+        lastDocumentSignature = result.signature;
+        lastDocumentRegion = result.region;
+        hasNewDocument = true;
+    });
+}
+
+ReplayCaptureManager::~ReplayCaptureManager()
+{
+    Close();
+}
+
+/// <summary>
+/// Sets the logging function to be used to append messages to the logging file.
+/// </summary>
+/// <param name="loggerFunc">Function to be used for logging. Should be passed by liveScanClient.cpp.</param>
+void ReplayCaptureManager::SetLogger(std::function<void(const std::string&)> loggerFunc) {
+    logFn = loggerFunc;
+
+    if (logFn) logFn("[ReplayCaptureManager] Using " + std::string(GetPointCloudKernelName(pointCloudKernel)) + " point cloud kernel");
+
+    documentDetector->SetLogger(loggerFunc);
+}
+
+/// <summary>
+/// Opens the recording and replays its first frame. The sync state does not apply to replays.
+/// </summary>
+/// <returns>True if the recording holds at least one frame; false otherwise.</returns>
+bool ReplayCaptureManager::Initialize(SyncState state, int syncOffset)
+{
+    if (!reader.Open(path)) {
+        if (logFn) logFn("[ReplayCaptureManager] Failed to open the raw recording " + path);
+        isInitialized = false;
+        return isInitialized;
+    }
+
+    // The calibration of the recorded device is loaded from its serial number
+    serialNumber = reader.GetSerialNumber().empty() ? "replay_" + std::to_string(deviceIndex) : reader.GetSerialNumber();
+
+    if (logFn) logFn("[ReplayCaptureManager] Replaying " + path + " of device " + serialNumber + (isRealTime ? " at the recorded speed" : " at maximum speed"));
+
+    isInitialized = true;
+    isStreaming = true;
+    isFirstFrameOfLoop = true;
+
+    if (!AcquireFrame(false)) {
+        if (logFn) logFn("[ReplayCaptureManager] The raw recording " + path + " holds no frame");
+        reader.Close();
+        isInitialized = false;
+    }
+
+    return isInitialized;
+}
+
+bool ReplayCaptureManager::StartStreaming(SyncState state, int syncOffset)
+{
+    isStreaming = isInitialized;
+    return isStreaming;
+}
+
+bool ReplayCaptureManager::StopStreaming()
+{
+    isStreaming = false;
+    return true;
+}
+
+/// <summary>
+/// Replays the next frame of the recording, waiting for its time to come when replaying at the recorded speed, and
+/// generates its point cloud.
+/// </summary>
+/// <param name="isCalibrationDataRequested">Indicates whether or not to save data to be used for calibration</param>
+/// <returns>True if a frame was replayed; false otherwise.</returns>
+bool ReplayCaptureManager::AcquireFrame(bool isCalibrationDataRequested)
+{
+    if (!isInitialized || !isStreaming || !ReadNextFrame()) {
+        return false;
+    }
+
+    uint64_t recordedTimeStamp = currentFrame.Header.Timestamp;
+
+    if (isRealTime && recordedTimeStamp > loopStartTimeStamp) {
+        PerfTimer waitTimer(perfStats, FrameWaitStage);
+        std::this_thread::sleep_until(loopStartTime + std::chrono::microseconds(recordedTimeStamp - loopStartTimeStamp));
+    }
+
+    currentTimeStamp = recordedTimeStamp + loopTimeStampOffset;
+
+    // The document frames follow the clock of the recording, so that every replay submits the same frames
+    bool isDocumentFrameDue = !isDocumentSubmissionPaused
+        && (lastDocumentTimeStamp == 0 || currentTimeStamp - lastDocumentTimeStamp >= static_cast<uint64_t>(documentFrameIntervalMs) * 1000);
+    bool isRayTableUpdated = UpdateCameraParameters();
+
+    // Same backend choice as the Orbbec capture manager: calibration frames always use the CPU path without the world
+    // transform, and the pixels outside the bounds are only culled early when the frame is not sent to the document detection
+    hasProcessedFrame = false;
+    ProcessingBackend usedBackend = CpuProcessing;
+    PerfTimer pointCloudTimer(perfStats, PointCloudStage);
+    auto pointCloudStart = std::chrono::steady_clock::now();
+
+    // The client publishes its last frame again for a frame of a static scene, which is not generated at all
+    if (!UpdateStaticFrame(isCalibrationDataRequested || isDocumentFrameDue || isRayTableUpdated)) {
+        if (processingBackend == GpuProcessing && !isCalibrationDataRequested && UpdatePointCloudGpu(isDocumentFrameDue, isRayTableUpdated)) {
+            hasProcessedFrame = true;
+            usedBackend = GpuProcessing;
+        }
+        else {
+            UpdatePointCloud(!isCalibrationDataRequested, !isCalibrationDataRequested && !isDocumentFrameDue, isDocumentFrameDue);
+        }
+
+        RecordPointCloudCost(usedBackend, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pointCloudStart).count());
+    }
+
+    pointCloudTimer.Stop();
+
+    // The detector copies the replayed frame, whose buffer is reused by the next frame
+    if (isDocumentFrameDue) {
+        cv::Mat colorImage(colorFrameHeight, colorFrameWidth, CV_8UC3, const_cast<BYTE*>(colorData));
+        documentDetector->SubmitFrame(colorImage, alignedDepthFrame);
+        lastDocumentTimeStamp = currentTimeStamp;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Reads the next frame of the recording into the frame buffers, going back to the first frame at the end
+/// </summary>
+bool ReplayCaptureManager::ReadNextFrame() {
+    if (!reader.ReadFrame(currentFrame)) {
+        if (numReplayedFrames == 0) {
+            return false;
+        }
+
+        double elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - loopStartTime).count();
+
+        if (logFn) logFn("[ReplayCaptureManager] Device " + std::to_string(deviceIndex) + ": replayed " + std::to_string(numReplayedFrames) + " frames in "
+            + std::to_string(elapsedSeconds) + " s (" + std::to_string(numReplayedFrames / (std::max)(elapsedSeconds, 1e-6)) + " fps)");
+
+        // The timestamps of the next loop follow those of this one
+        loopTimeStampOffset += lastRecordedTimeStamp - loopStartTimeStamp + LoopFrameIntervalUs;
+        numReplayedFrames = 0;
+        isFirstFrameOfLoop = true;
+
+        // Do not blend the end of the recording into its start
+        depthHistory.clear();
+
+        reader.Rewind();
+
+        if (!reader.ReadFrame(currentFrame)) {
+            return false;
+        }
+    }
+
+    if (isFirstFrameOfLoop) {
+        loopStartTimeStamp = currentFrame.Header.Timestamp;
+        loopStartTime = std::chrono::steady_clock::now();
+        isFirstFrameOfLoop = false;
+    }
+
+    lastRecordedTimeStamp = currentFrame.Header.Timestamp;
+    numReplayedFrames++;
+
+    colorFrameWidth = currentFrame.Header.ColorWidth;
+    colorFrameHeight = currentFrame.Header.ColorHeight;
+    depthFrameWidth = currentFrame.Header.DepthWidth;
+    depthFrameHeight = currentFrame.Header.DepthHeight;
+
+    colorData = currentFrame.Color.data();
+    depthData = currentFrame.Depth.data();
+
+    return true;
+}
+
+/// <summary>
+/// Takes the camera parameters of the current frame, and precomputes the normalized unprojection ray
+/// (u - cx) / fx, (v - cy) / fy of every depth pixel when they or the stream profile changed.
+/// </summary>
+/// <returns>True if the ray table was rebuilt</returns>
+bool ReplayCaptureManager::UpdateCameraParameters() {
+    const RawCameraParams& params = currentFrame.Header.CameraParams;
+    bool isProfileChanged = depthRayTable.empty() || rayTableWidth != depthFrameWidth || rayTableHeight != depthFrameHeight
+        || (gpuEngine && gpuEngine->IsInitialized() && (gpuColorWidth != colorFrameWidth || gpuColorHeight != colorFrameHeight))
+        || params.DepthFx != rayTableParams.DepthFx || params.DepthFy != rayTableParams.DepthFy
+        || params.DepthCx != rayTableParams.DepthCx || params.DepthCy != rayTableParams.DepthCy;
+
+    rayTableParams = params;
+
+    if (!isProfileChanged) {
+        return false;
+    }
+
+    rayTableWidth = depthFrameWidth;
+    rayTableHeight = depthFrameHeight;
+    depthRayTable.resize(static_cast<size_t>(rayTableWidth) * rayTableHeight);
+
+    for (int v = 0; v < rayTableHeight; ++v) {
+        float rayY = (v - params.DepthCy) / params.DepthFy;
+
+        for (int u = 0; u < rayTableWidth; ++u) {
+            depthRayTable[v * rayTableWidth + u] = Point2f((u - params.DepthCx) / params.DepthFx, rayY);
+        }
+    }
+
+    if (logFn) logFn("[ReplayCaptureManager] Built unprojection ray table for " + std::to_string(rayTableWidth) + "x" + std::to_string(rayTableHeight) + " depth stream");
+
+    return true;
+}
+
+/// <summary>
+/// Gathers the buffers of the current frame and its camera parameters for the point cloud kernels
+/// </summary>
+/// <param name="isWorldTransformApplied">Indicates whether the kernel should output the vertices in world space</param>
+/// <param name="isBoundsCullingEnabled">Indicates whether the pixels which cannot see the bounds should be skipped</param>
+PointCloudKernelParams ReplayCaptureManager::GetPointCloudKernelParams(bool isWorldTransformApplied, bool isBoundsCullingEnabled) {
+    PointCloudKernelParams params;
+    params.depth = depthData;
+    params.rays = depthRayTable.data();
+    params.depthWidth = depthFrameWidth;
+    params.depthHeight = depthFrameHeight;
+    params.color = colorData;
+    params.colorWidth = colorFrameWidth;
+    params.colorHeight = colorFrameHeight;
+    params.colorFormat = colorFormat;
+    params.isColorVideoRange = isColorVideoRange;
+    params.colorRgbx = nullptr;
+    params.colorFx = rayTableParams.ColorFx;
+    params.colorFy = rayTableParams.ColorFy;
+    params.colorCx = rayTableParams.ColorCx;
+    params.colorCy = rayTableParams.ColorCy;
+
+    for (int i = 0; i < 9; ++i) {
+        params.rot[i] = rayTableParams.Rot[i];
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        params.trans[i] = rayTableParams.Trans[i] / 1000.0f; // convert mm to meters
+    }
+
+    if (isWorldTransformApplied && frameProcessingParams.isCalibrated) {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                params.world[i * 4 + j] = frameProcessingParams.worldTransform[i][j];
+            }
+        }
+    }
+    else {
+        SetIdentityWorldTransform(params);
+    }
+
+    if (isWorldTransformApplied && isBoundsCullingEnabled && frameProcessingParams.isCalibrated) {
+        EnableBoundsCulling(params, rayTableParams.DepthFx, rayTableParams.DepthFy, rayTableParams.DepthCx, rayTableParams.DepthCy,
+            frameProcessingParams.minBounds, frameProcessingParams.maxBounds);
+        RestrictRoi(params, frameProcessingParams.processingRoi);
+    }
+    else {
+        DisableBoundsCulling(params);
+    }
+
+    return params;
+}
+
+/// <summary>
+/// Returns the depth frame to generate the point cloud from, with its small holes filled, denoised and without its
+/// flying pixels when enabled
+/// </summary>
+const UINT16* ReplayCaptureManager::GetFilteredDepth() {
+    const UINT16* depth = depthData;
+    size_t numPixels = static_cast<size_t>(depthFrameWidth) * depthFrameHeight;
+
+    if (frameProcessingParams.isDepthHoleFillEnabled) {
+        holeFilledDepth.resize(numPixels);
+        FillDepthHoles(depthData, holeFilledDepth.data(), depthFrameWidth, depthFrameHeight);
+        depth = holeFilledDepth.data();
+    }
+
+    if (frameProcessingParams.isDepthDenoiseEnabled) {
+        if (depthHistory.size() != numPixels) {
+            depthHistory.assign(numPixels, 0);
+        }
+
+        UpdateTemporalDepth(depth, depthHistory.data(), static_cast<int>(numPixels));
+
+        denoisedDepth.resize(numPixels);
+        FilterDepthMedian(depthHistory.data(), denoisedDepth.data(), depthFrameWidth, depthFrameHeight);
+        depth = denoisedDepth.data();
+    }
+    else {
+        depthHistory.clear();
+    }
+
+    if (!frameProcessingParams.isFlyingPixelFilterEnabled) {
+        return depth;
+    }
+
+    filteredDepth.resize(numPixels);
+    RejectFlyingPixels(depth, filteredDepth.data(), depthFrameWidth, depthFrameHeight);
+
+    return filteredDepth.data();
+}
+
+/// <summary>
+/// Returns the bytes held by the buffers of the latest frame, the raw frame read from the recording included
+/// </summary>
+size_t ReplayCaptureManager::GetMemoryUsage() const {
+    return ICaptureManager::GetMemoryUsage() + GetCapacityBytes(kernelPoints) + GetCapacityBytes(depthRayTable)
+        + GetCapacityBytes(filteredDepth) + GetCapacityBytes(holeFilledDepth) + GetCapacityBytes(depthHistory) + GetCapacityBytes(denoisedDepth)
+        + GetCapacityBytes(downscaledColor)
+        + GetCapacityBytes(alignedDepthFrame)
+        + GetCapacityBytes(currentFrame.Depth) + GetCapacityBytes(currentFrame.Color);
+}
+
+/// <summary>
+/// Releases the depth buffers of the disabled filters and trims the point buffers to twice what they hold
+/// </summary>
+void ReplayCaptureManager::ReleaseUnusedMemory() {
+    ICaptureManager::ReleaseUnusedMemory();
+    TrimCapacity(kernelPoints);
+
+    if (!frameProcessingParams.isDepthDenoiseEnabled) {
+        ReleaseCapacity(depthHistory);
+        ReleaseCapacity(denoisedDepth);
+    }
+
+    if (!frameProcessingParams.isFlyingPixelFilterEnabled) {
+        ReleaseCapacity(filteredDepth);
+    }
+
+    if (!frameProcessingParams.isDepthHoleFillEnabled) {
+        ReleaseCapacity(holeFilledDepth);
+    }
+
+    if (!frameProcessingParams.isColorDownscaleEnabled) {
+        ReleaseCapacity(downscaledColor);
+    }
+}
+
+/// <summary>
+/// Generates a new point cloud from the current frame with the point cloud kernels
+/// </summary>
+/// <param name="isWorldTransformRequested">Indicates whether the calibration should be applied to the vertices while they are generated</param>
+/// <param name="isBoundsCullingRequested">Indicates whether the points outside the bounds can be discarded while they are generated</param>
+/// <param name="isAlignedDepthRequested">Indicates whether the aligned depth frame should be generated for the document detection</param>
+void ReplayCaptureManager::UpdatePointCloud(bool isWorldTransformRequested, bool isBoundsCullingRequested, bool isAlignedDepthRequested) {
+    PointCloudKernelParams params = GetPointCloudKernelParams(isWorldTransformRequested, isBoundsCullingRequested);
+    isFrameInWorldSpace = isWorldTransformRequested && frameProcessingParams.isCalibrated;
+
+    // Calibration frames keep the raw depth
+    if (isWorldTransformRequested) {
+        params.depth = GetFilteredDepth();
+    }
+
+    // A depth pixel covers about one pixel of the downscaled color frame, whose bilinear samples are closer in memory
+    if (frameProcessingParams.isColorDownscaleEnabled && colorData) {
+        downscaledColor.resize(static_cast<size_t>(colorFrameWidth / 2) * (colorFrameHeight / 2));
+        DownscaleColorFrame(colorData, colorFrameWidth, colorFrameHeight, downscaledColor.data());
+        UseDownscaledColor(params, downscaledColor.data());
+    }
+
+    size_t numPixels = static_cast<size_t>(depthFrameWidth) * depthFrameHeight;
+
+    if (kernelPoints.Size() != numPixels) {
+        kernelPoints.Resize(numPixels);
+    }
+
+    if (isAlignedDepthRequested) {
+        alignedDepthFrame = cv::Mat::zeros(depthFrameHeight, depthFrameWidth, CV_16U);
+    }
+
+    PointCloudKernelOutput output;
+    output.X = kernelPoints.X.data();
+    output.Y = kernelPoints.Y.data();
+    output.Z = kernelPoints.Z.data();
+    output.colors = kernelPoints.Colors.data();
+    output.pixelIndices = kernelPoints.PixelIndices.data();
+    output.alignedDepth = isAlignedDepthRequested ? alignedDepthFrame.ptr<UINT16>() : nullptr;
+
+    int numPoints = RunPointCloudKernel(pointCloudKernel, params, output);
+
+    lastFramePoints.AssignFirst(kernelPoints, numPoints);
+}
+
+/// <summary>
+/// Generates the compacted world space point cloud of the current frame on the GPU
+/// </summary>
+/// <param name="isAlignedDepthRequested">Indicates whether the aligned depth frame should be read back for the document detection</param>
+/// <param name="isRayTableUpdated">Indicates whether the stream profile changed, so that the GPU engine is created again</param>
+/// <returns>True if the point cloud was generated on the GPU; false if the CPU path should be used instead.</returns>
+bool ReplayCaptureManager::UpdatePointCloudGpu(bool isAlignedDepthRequested, bool isRayTableUpdated) {
+    if (frameProcessingParams.voxelSize <= 0.0f) {
+        return false;
+    }
+
+    if (!gpuEngine || !gpuEngine->IsInitialized() || isRayTableUpdated) {
+        if (!gpuEngine) {
+            gpuEngine = std::make_unique<GpuPointCloudEngine>();
+            gpuEngine->SetLogger(logFn);
+        }
+
+        if (!gpuEngine->Initialize(depthFrameWidth, depthFrameHeight, colorFrameWidth, colorFrameHeight, depthRayTable)) {
+            if (logFn) logFn("[ReplayCaptureManager] GPU processing is not available, using the CPU backend");
+            processingBackend = CpuProcessing;
+            gpuEngine.reset();
+            return false;
+        }
+
+        gpuColorWidth = colorFrameWidth;
+        gpuColorHeight = colorFrameHeight;
+    }
+
+    PointCloudKernelParams params = GetPointCloudKernelParams(false, false);
+    params.depth = GetFilteredDepth();
+
+    cv::Mat gpuAlignedDepth;
+    bool res = gpuEngine->Process(params, frameProcessingParams, lastProcessedPoints,
+        isAlignedDepthRequested ? &gpuAlignedDepth : nullptr);
+
+    if (res && isAlignedDepthRequested) {
+        alignedDepthFrame = gpuAlignedDepth;
+    }
+
+    return res;
+}
+
+/// <summary>
+/// Accumulates the point cloud generation time of a backend and periodically logs its average cost per frame
+/// </summary>
+void ReplayCaptureManager::RecordPointCloudCost(ProcessingBackend backend, double costMs) {
+    static const char* BackendNames[NumProcessingBackends] = { "CPU", "GPU", "SDK" };
+
+    pointCloudCostMs[backend] += costMs;
+    numPointCloudFrames[backend]++;
+
+    if (numPointCloudFrames[backend] < CostReportInterval) {
+        return;
+    }
+
+    if (logFn) logFn("[ReplayCaptureManager] Device " + std::to_string(deviceIndex) + ": " + BackendNames[backend] + " point cloud takes "
+        + std::to_string(pointCloudCostMs[backend] / numPointCloudFrames[backend]) + " ms per frame");
+
+    pointCloudCostMs[backend] = 0.0;
+    numPointCloudFrames[backend] = 0;
+}
+
+uint64_t ReplayCaptureManager::GetTimeStamp()
+{
+    return currentTimeStamp;
+}
+
+int ReplayCaptureManager::GetDeviceIndex()
+{
+    return deviceIndex;
+}
+
+/// <summary>
+/// Selects whether point clouds are generated on the CPU or with the GPU engine; the filters of the camera SDK need
+/// its frames, so replays use the CPU backend instead
+/// </summary>
+void ReplayCaptureManager::SetProcessingBackend(ProcessingBackend backend) {
+    if (backend == SdkProcessing && !isSdkFallbackLogged) {
+        if (logFn) logFn("[ReplayCaptureManager] SDK processing is not available for replays, using the CPU backend");
+        isSdkFallbackLogged = true;
+    }
+
+    processingBackend = backend == SdkProcessing ? CpuProcessing : backend;
+}
+
+void ReplayCaptureManager::SetFrameProcessingParams(const FrameProcessingParams& params) {
+    frameProcessingParams = params;
+}
+
+// The exposure, capture mode and color stream were set when the frames were recorded
+void ReplayCaptureManager::SetExposureState(bool enableAutoExposure, int exposureStep) {
+}
+
+void ReplayCaptureManager::SetCaptureMode(CaptureMode mode) {
+}
+
+void ReplayCaptureManager::SetColorStreamSettings(const ColorStreamSettings& settings) {
+}
+
+// The replayed frames are already recorded
+void ReplayCaptureManager::SetRawRecording(bool isEnabled) {
+}
+
+// The replayed frames keep the depth stream they were recorded with
+void ReplayCaptureManager::SetDepthBinning(bool isBinned) {
+}
+
+// The recording is read by the frame loop of the client, which has no thread of its own
+void ReplayCaptureManager::SetThreadAffinity(const ThreadAffinity& affinity) {
+}
+
+RawCameraParams ReplayCaptureManager::GetCameraParams() {
+    return currentFrame.Header.CameraParams;
+}
+
+bool ReplayCaptureManager::Close()
+{
+    if (!isInitialized)
+        return false;
+
+    reader.Close();
+    gpuEngine.reset();
+    colorData = nullptr;
+    depthData = nullptr;
+    isStreaming = false;
+    isInitialized = false;
+
+    return true;
+}
@@ -0,0 +1,105 @@
+/***************************************************************************\
+
+Module Name:  SceneChangeDetector.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module tells whether the depth of a frame changed since the last frame
+which was processed, so that the frames of a static scene are published
+again instead of generated and processed. The depth is sampled on a sparse
+grid and compared with the samples of the last processed frame, a frame
+being unchanged when few enough of its samples moved by more than the noise
+of the sensor or became valid or invalid.
+
+\***************************************************************************/
+
+#include "sceneChangeDetector.h"
+#include "memoryUsage.h"
+#include <algorithm>
+#include <cstdlib>
+
+// Forgets the last processed frame; the next frame is changed
+void SceneChangeDetector::Reset()
+{
+	width = 0;
+	height = 0;
+	hasReference = false;
+	hasCurrentSamples = false;
+	numReusedFrames = 0;
+
+	ReleaseCapacity(referenceSamples);
+	ReleaseCapacity(currentSamples);
+}
+
+size_t SceneChangeDetector::GetMemoryUsage() const
+{
+	return GetCapacityBytes(referenceSamples) + GetCapacityBytes(currentSamples);
+}
+
+/// <summary>
+/// Samples the depth of a frame and compares it with the last frame accepted. Sampling the depth costs a few tens of
+/// thousands of reads, far less than generating and processing the points of the frame.
+/// </summary>
+/// <returns>True if the frame can reuse the points of the last frame accepted</returns>
+bool SceneChangeDetector::IsUnchanged(const uint16_t* depth, int frameWidth, int frameHeight)
+{
+	if (frameWidth != width || frameHeight != height)
+	{
+		width = frameWidth;
+		height = frameHeight;
+		hasReference = false;
+	}
+
+	int numColumns = (width + SampleStep - 1) / SampleStep;
+	int numRows = (height + SampleStep - 1) / SampleStep;
+	currentSamples.resize(static_cast<size_t>(numColumns) * numRows);
+	hasCurrentSamples = true;
+
+	int numChanged = 0;
+	int numValid = 0;
+	size_t sample = 0;
+
+	for (int y = 0; y < height; y += SampleStep)
+	{
+		const uint16_t* row = depth + static_cast<size_t>(y) * width;
+
+		for (int x = 0; x < width; x += SampleStep, sample++)
+		{
+			int value = row[x];
+			currentSamples[sample] = static_cast<uint16_t>(value);
+
+			if (!hasReference)
+				continue;
+
+			int previous = referenceSamples[sample];
+			int threshold = BaseChangeMm + ((std::max)(value, previous) >> RelativeChangeShift);
+
+			numValid += value > 0 || previous > 0 ? 1 : 0;
+			numChanged += (value > 0) != (previous > 0) || std::abs(value - previous) > threshold ? 1 : 0;
+		}
+	}
+
+	return hasReference && numReusedFrames < MaxReusedFrames && numChanged <= MaxChangedRatio * numValid;
+}
+
+// Counts a frame which reused the points of the last frame accepted
+void SceneChangeDetector::MarkReused()
+{
+	numReusedFrames++;
+}
+
+/// <summary>
+/// Makes the last frame passed to IsUnchanged the frame the next ones are compared with, once it was processed
+/// </summary>
+void SceneChangeDetector::AcceptFrame()
+{
+	if (!hasCurrentSamples)
+		return;
+
+	std::swap(referenceSamples, currentSamples);
+	hasReference = true;
+	hasCurrentSamples = false;
+	numReusedFrames = 0;
+}
@@ -0,0 +1,248 @@
+/***************************************************************************\
+
+Module Name:  SharedFrameRing.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module passes the processed frames of a camera from the worker process
+which hosts its client to the server on the same computer, through a named
+file mapping of three slots. The worker writes each frame in the slot it
+owns, then swaps it with the slot last published, and the server swaps that
+one with the slot it reads, so that neither process ever waits for the
+other, and a worker which crashes while writing a frame only loses it. The
+server creates the mapping, which outlives the workers it restarts.
+
+\***************************************************************************/
+
+#include "sharedFrameRing.h"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+    const int NumSlots = 3;
+    const LONG NewFrameFlag = 0x100; // Set on the published slot until the server takes it
+    const size_t SlotAlignment = 64;
+
+    size_t AlignUp(size_t size)
+    {
+        return (size + SlotAlignment - 1) / SlotAlignment * SlotAlignment;
+    }
+}
+
+// Start of the mapping; the slots follow it
+struct SharedFrameRing::RingHeader
+{
+    uint32_t Version;
+    uint32_t MaxPoints;
+    volatile LONG ControlPort;
+    volatile LONG BackSlot; // Slot the worker writes; only the worker changes it, so a restarted worker goes on with it
+    volatile LONG MiddleSlot; // Slot last published, with NewFrameFlag
+    SharedFrameInfo Frames[NumSlots];
+};
+
+SharedFrameRing::~SharedFrameRing()
+{
+    Close();
+}
+
+/// <summary>
+/// Name of the ring of a client, unique to the server which launched its worker
+/// </summary>
+std::string SharedFrameRing::GetName(DWORD serverProcessId, int clientIndex)
+{
+    return "Local\\LiveScan3D_Worker_" + std::to_string(serverProcessId) + "_" + std::to_string(clientIndex);
+}
+
+/// <summary>
+/// Creates the ring of a client, on the server; no frame is published yet
+/// </summary>
+/// <returns>False if the mapping or its events could not be created</returns>
+bool SharedFrameRing::Create(const std::string& name)
+{
+    if (!Map(name, true))
+        return false;
+
+    RingHeader* header = GetHeader();
+    memset(header, 0, sizeof(RingHeader));
+    header->Version = RingVersion;
+    header->MaxPoints = MaxPoints;
+    header->BackSlot = 0;
+    header->MiddleSlot = 1;
+    frontSlot = 2;
+
+    return true;
+}
+
+/// <summary>
+/// Opens the ring the server created for the client of the worker
+/// </summary>
+/// <returns>False if it does not exist or was created by another version</returns>
+bool SharedFrameRing::Open(const std::string& name)
+{
+    if (!Map(name, false))
+        return false;
+
+    if (GetHeader()->Version != RingVersion || GetHeader()->MaxPoints != MaxPoints)
+    {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void SharedFrameRing::Close()
+{
+    if (view)
+        UnmapViewOfFile(view);
+
+    if (mapping)
+        CloseHandle(mapping);
+
+    if (frameEvent)
+        CloseHandle(frameEvent);
+
+    if (exitEvent)
+        CloseHandle(exitEvent);
+
+    view = nullptr;
+    mapping = nullptr;
+    frameEvent = nullptr;
+    exitEvent = nullptr;
+}
+
+/// <summary>
+/// Writes a frame in the slot of the worker and publishes it, replacing the frame the server has not taken yet
+/// </summary>
+/// <param name="normals">One byte for each point; null when the normals are not estimated</param>
+/// <returns>False if the frame has more points than a slot holds</returns>
+bool SharedFrameRing::Publish(const SharedFrameInfo& info, const Point3s* vertices, const RGB* colors, const uint8_t* normals)
+{
+    if (!view || info.NumPoints > MaxPoints)
+        return false;
+
+    RingHeader* header = GetHeader();
+    LONG backSlot = header->BackSlot;
+    char* slot = GetSlot(backSlot);
+
+    SharedFrameInfo& frame = header->Frames[backSlot];
+    frame = info;
+    frame.NumNormals = normals ? info.NumPoints : 0;
+
+    memcpy(slot, vertices, info.NumPoints * sizeof(Point3s));
+    memcpy(slot + MaxPoints * sizeof(Point3s), colors, info.NumPoints * sizeof(RGB));
+
+    if (normals)
+        memcpy(slot + MaxPoints * (sizeof(Point3s) + sizeof(RGB)), normals, info.NumPoints);
+
+    // The exchange is a full barrier, so the server sees the whole frame once it sees the slot
+    header->BackSlot = InterlockedExchange(&header->MiddleSlot, backSlot | NewFrameFlag) & ~NewFrameFlag;
+    SetEvent(frameEvent);
+
+    return true;
+}
+
+/// <summary>
+/// Waits until the worker publishes a frame, on the server
+/// </summary>
+/// <returns>True if a frame was published since the last wait; false if the wait timed out.</returns>
+bool SharedFrameRing::WaitForFrame(int timeoutMs)
+{
+    return frameEvent && WaitForSingleObject(frameEvent, static_cast<DWORD>(timeoutMs)) == WAIT_OBJECT_0;
+}
+
+/// <summary>
+/// Takes the frame last published, on the server. Its buffers are read in place, and stay unchanged until the next
+/// call, as the worker never writes the slot the server holds.
+/// </summary>
+/// <returns>False if no frame was published since the last call</returns>
+bool SharedFrameRing::ReadLatest(SharedFrameInfo& info, const Point3s*& vertices, const RGB*& colors, const uint8_t*& normals)
+{
+    if (!view || (GetHeader()->MiddleSlot & NewFrameFlag) == 0)
+        return false;
+
+    frontSlot = InterlockedExchange(&GetHeader()->MiddleSlot, frontSlot) & ~NewFrameFlag;
+
+    const char* slot = GetSlot(frontSlot);
+    info = GetHeader()->Frames[frontSlot];
+    info.NumPoints = (std::min)(info.NumPoints, MaxPoints);
+    info.NumNormals = (std::min)(info.NumNormals, info.NumPoints);
+
+    vertices = reinterpret_cast<const Point3s*>(slot);
+    colors = reinterpret_cast<const RGB*>(slot + MaxPoints * sizeof(Point3s));
+    normals = reinterpret_cast<const uint8_t*>(slot + MaxPoints * (sizeof(Point3s) + sizeof(RGB)));
+
+    return true;
+}
+
+void SharedFrameRing::SetControlPort(int port)
+{
+    if (view)
+        InterlockedExchange(&GetHeader()->ControlPort, port);
+}
+
+int SharedFrameRing::GetControlPort() const
+{
+    return view ? GetHeader()->ControlPort : 0;
+}
+
+void SharedFrameRing::RequestExit()
+{
+    if (exitEvent)
+        SetEvent(exitEvent);
+}
+
+bool SharedFrameRing::IsExitRequested() const
+{
+    return exitEvent && WaitForSingleObject(exitEvent, 0) == WAIT_OBJECT_0;
+}
+
+SharedFrameRing::RingHeader* SharedFrameRing::GetHeader() const
+{
+    return reinterpret_cast<RingHeader*>(view);
+}
+
+char* SharedFrameRing::GetSlot(LONG slot) const
+{
+    return view + AlignUp(sizeof(RingHeader)) + slot * slotSize;
+}
+
+/// <summary>
+/// Creates or opens the mapping and the events of the ring, and maps the whole ring
+/// </summary>
+bool SharedFrameRing::Map(const std::string& name, bool isCreated)
+{
+    Close();
+
+    slotSize = AlignUp(static_cast<size_t>(MaxPoints) * (sizeof(Point3s) + sizeof(RGB) + 1));
+    uint64_t size = AlignUp(sizeof(RingHeader)) + NumSlots * slotSize;
+    std::string frameEventName = name + "_Frame";
+    std::string exitEventName = name + "_Exit";
+
+    if (isCreated)
+    {
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), name.c_str());
+        frameEvent = CreateEventA(nullptr, FALSE, FALSE, frameEventName.c_str());
+        exitEvent = CreateEventA(nullptr, TRUE, FALSE, exitEventName.c_str());
+    }
+    else
+    {
+        mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+        frameEvent = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, frameEventName.c_str());
+        exitEvent = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, exitEventName.c_str());
+    }
+
+    if (mapping)
+        view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<SIZE_T>(size)));
+
+    if (!view || !frameEvent || !exitEvent)
+    {
+        Close();
+        return false;
+    }
+
+    return true;
+}
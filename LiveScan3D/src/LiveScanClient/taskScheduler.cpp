@@ -0,0 +1,322 @@
+/***************************************************************************\
+
+Module Name:  TaskScheduler.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module contains the work-stealing task scheduler shared by all the
+clients of the process. Each worker thread keeps its own queue of tasks and
+steals from the others when it runs out of work. Frame tasks (point cloud
+processing) are always run before background tasks (document detection),
+which run at a lower thread priority than the frame loops of the clients.
+
+\***************************************************************************/
+
+#include "taskScheduler.h"
+#include "traceZones.h"
+#include <algorithm>
+#include <windows.h>
+
+namespace
+{
+    // Index of the worker running on the current thread; -1 for the threads which do not belong to the scheduler
+    thread_local int currentWorkerIndex = -1;
+
+    // Shared by the caller of ParallelFor and its helper tasks, which may still be queued when the loop is done
+    struct ParallelForState
+    {
+        std::atomic<int> nextIndex;
+        int endIndex;
+        int numIndices;
+        const std::function<void(int)>* body;
+
+        std::mutex mutex;
+        std::condition_variable doneCond;
+        int numDone = 0;
+    };
+
+    /// <summary>
+    /// Runs loop iterations until none are left. The body is only accessed after an iteration has been claimed,
+    /// so helpers which start after the end of the loop return without touching it.
+    /// </summary>
+    void RunParallelForIndices(ParallelForState& state)
+    {
+        int numDone = 0;
+
+        for (int i = state.nextIndex.fetch_add(1); i < state.endIndex; i = state.nextIndex.fetch_add(1))
+        {
+            (*state.body)(i);
+            numDone++;
+        }
+
+        if (numDone > 0)
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.numDone += numDone;
+
+            if (state.numDone == state.numIndices)
+                state.doneCond.notify_all();
+        }
+    }
+
+    int GetDefaultThreadCount()
+    {
+        return (std::max)(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+}
+
+/// <summary>
+/// Returns the scheduler shared by all the clients. It is intentionally never destroyed: joining its threads from
+/// the static destructors would run under the loader lock when the DLL is unloaded.
+/// </summary>
+TaskScheduler& TaskScheduler::Instance()
+{
+    static TaskScheduler* instance = new TaskScheduler();
+    return *instance;
+}
+
+TaskScheduler::TaskScheduler() : numWorkers(0)
+{
+    StartWorkers(GetDefaultThreadCount());
+}
+
+/// <summary>
+/// Changes the number of worker threads. The workers are only restarted when the count changes; queued tasks are kept.
+/// </summary>
+/// <param name="numThreads">Number of worker threads; 0 or less uses one thread per hardware thread</param>
+void TaskScheduler::SetThreadCount(int numThreads)
+{
+    if (numThreads <= 0)
+        numThreads = GetDefaultThreadCount();
+
+    std::lock_guard<std::mutex> lock(configMutex);
+
+    if (numThreads == numWorkers)
+        return;
+
+    StopWorkers();
+    StartWorkers(numThreads);
+}
+
+int TaskScheduler::GetThreadCount() const
+{
+    return numWorkers;
+}
+
+/// <summary>
+/// Queues a task. Frame tasks submitted from a worker go to its own queue, where they are run first by that worker
+/// and can be stolen by the idle ones.
+/// </summary>
+void TaskScheduler::Submit(TaskPriority priority, std::function<void()> task)
+{
+    bool isLocalTask = priority == FrameTaskPriority && currentWorkerIndex >= 0;
+
+    if (isLocalTask)
+    {
+        Worker& worker = *workers[currentWorkerIndex];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+
+        if (!isLocalTask)
+            (priority == FrameTaskPriority ? frameTasks : backgroundTasks).push_back(std::move(task));
+
+        numQueuedTasks++;
+    }
+
+    queueCond.notify_one();
+}
+
+/// <summary>
+/// Runs body(i) for every i in [begin, end) on the workers at frame priority and returns once all the iterations are
+/// done. The calling thread runs iterations too, so a loop always makes progress, even when called from a worker.
+/// </summary>
+void TaskScheduler::ParallelFor(int begin, int end, const std::function<void(int)>& body)
+{
+    int numIndices = end - begin;
+
+    if (numIndices <= 0)
+        return;
+
+    if (numIndices == 1)
+    {
+        body(begin);
+        return;
+    }
+
+    std::shared_ptr<ParallelForState> state = std::make_shared<ParallelForState>();
+    state->nextIndex = begin;
+    state->endIndex = end;
+    state->numIndices = numIndices;
+    state->body = &body;
+
+    int numHelpers = (std::min)(static_cast<int>(numWorkers), numIndices - 1);
+
+    for (int i = 0; i < numHelpers; i++)
+        Submit(FrameTaskPriority, [state]() { RunParallelForIndices(*state); });
+
+    RunParallelForIndices(*state);
+
+    // The remaining iterations are already running on other threads
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->doneCond.wait(lock, [&state]() { return state->numDone == state->numIndices; });
+}
+
+void TaskScheduler::StartWorkers(int numThreads)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopWorkers = false;
+    }
+
+    // All the workers must exist before the first thread starts stealing from them
+    for (int i = 0; i < numThreads; i++)
+        workers.push_back(std::unique_ptr<Worker>(new Worker()));
+
+    for (int i = 0; i < numThreads; i++)
+        workers[i]->thread = std::thread(&TaskScheduler::WorkerLoop, this, i);
+
+    numWorkers = numThreads;
+}
+
+void TaskScheduler::StopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopWorkers = true;
+    }
+
+    queueCond.notify_all();
+
+    for (auto& worker : workers)
+    {
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
+
+    // Tasks left in the worker queues are picked up by the next workers; they are already counted as queued
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+
+        for (auto& worker : workers)
+        {
+            for (auto& task : worker->tasks)
+                frameTasks.push_back(std::move(task));
+        }
+    }
+
+    workers.clear();
+    numWorkers = 0;
+}
+
+void TaskScheduler::WorkerLoop(int workerIndex)
+{
+    currentWorkerIndex = workerIndex;
+    std::function<void()> task;
+    TaskPriority priority;
+
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+
+            if (stopWorkers)
+                break;
+        }
+
+        if (PopTask(workerIndex, task, priority))
+        {
+            // A detection which already runs when a frame arrives is preempted by the frame loops, so that it never
+            // delays the frames
+            bool isBackgroundTask = priority == BackgroundTaskPriority;
+
+            if (isBackgroundTask)
+                SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+
+            {
+                TRACE_ZONE("Task");
+                task();
+            }
+            task = nullptr;
+
+            if (isBackgroundTask)
+                SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+
+            continue;
+        }
+
+        // No task could be found; a task being submitted makes the count positive and wakes a worker
+        std::unique_lock<std::mutex> lock(queueMutex);
+        queueCond.wait(lock, [this]() { return numQueuedTasks > 0 || stopWorkers; });
+    }
+
+    currentWorkerIndex = -1;
+}
+
+/// <summary>
+/// Finds the next task of a worker: the latest task of its own queue, then the oldest external frame task, then the
+/// oldest task of another worker and finally the oldest background task.
+/// </summary>
+bool TaskScheduler::PopTask(int workerIndex, std::function<void()>& task, TaskPriority& priority)
+{
+    int numThreads = static_cast<int>(workers.size());
+    bool isFound = false;
+    priority = FrameTaskPriority;
+
+    {
+        Worker& worker = *workers[workerIndex];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+
+        if (!worker.tasks.empty())
+        {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            isFound = true;
+        }
+    }
+
+    if (!isFound && PopQueuedTask(frameTasks, task))
+        return true;
+
+    for (int i = 1; i < numThreads && !isFound; i++)
+    {
+        Worker& victim = *workers[(workerIndex + i) % numThreads];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            isFound = true;
+        }
+    }
+
+    if (isFound)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        numQueuedTasks--;
+        return true;
+    }
+
+    priority = BackgroundTaskPriority;
+    return PopQueuedTask(backgroundTasks, task);
+}
+
+bool TaskScheduler::PopQueuedTask(std::deque<std::function<void()>>& queue, std::function<void()>& task)
+{
+    std::lock_guard<std::mutex> lock(queueMutex);
+
+    if (queue.empty())
+        return false;
+
+    task = std::move(queue.front());
+    queue.pop_front();
+    numQueuedTasks--;
+
+    return true;
+}
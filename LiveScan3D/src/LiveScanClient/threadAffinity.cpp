@@ -0,0 +1,207 @@
+/***************************************************************************\
+
+Module Name:  ThreadAffinity.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module chooses the processors the threads of a camera run on. With
+several NUMA nodes, the threads of a camera are kept on the node of the USB
+controller it is plugged into, found from its serial number in the device
+tree, so that its frames and the buffers they are processed in stay in the
+memory of that node; the cameras can also be given blocks of logical
+processors of their own.
+
+\***************************************************************************/
+
+#include "threadAffinity.h"
+#include <algorithm>
+#include <initguid.h>
+#include <devpkey.h>
+#include <setupapi.h>
+#include <cfgmgr32.h>
+#include <sstream>
+
+#pragma comment(lib, "setupapi.lib")
+#pragma comment(lib, "cfgmgr32.lib")
+
+namespace
+{
+    /// <summary>
+    /// Mask of count consecutive processors starting at first
+    /// </summary>
+    uint64_t GetProcessorMask(int first, int count)
+    {
+        uint64_t bits = count >= 64 ? ~0ull : (1ull << count) - 1;
+        return bits << first;
+    }
+
+    /// <summary>
+    /// Gives each camera its own block of logical processors, numbered across the processor groups; the block of a
+    /// camera is cut at the end of its group, as a thread only runs in one group
+    /// </summary>
+    ThreadAffinity GetCoreSetAffinity(int deviceIndex, int numCoresPerCamera)
+    {
+        ThreadAffinity affinity;
+        int numProcessors = static_cast<int>(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+
+        if (numProcessors <= 0)
+            return affinity;
+
+        int numCores = (std::min)((std::max)(numCoresPerCamera, 1), numProcessors);
+        int first = static_cast<int>((static_cast<int64_t>(deviceIndex) * numCores) % numProcessors);
+        WORD numGroups = GetActiveProcessorGroupCount();
+
+        for (WORD group = 0; group < numGroups; group++)
+        {
+            int numGroupProcessors = static_cast<int>(GetActiveProcessorCount(group));
+
+            if (first < numGroupProcessors)
+            {
+                affinity.Group = group;
+                affinity.Mask = GetProcessorMask(first, (std::min)(numCores, numGroupProcessors - first));
+                break;
+            }
+
+            first -= numGroupProcessors;
+        }
+
+        return affinity;
+    }
+
+    /// <summary>
+    /// Keeps the camera on the NUMA node of its USB controller; the cameras whose node is unknown, like the replayed
+    /// recordings, are spread over the nodes by their index
+    /// </summary>
+    ThreadAffinity GetNumaNodeAffinity(int deviceIndex, const std::string& serialNumber)
+    {
+        ThreadAffinity affinity;
+        ULONG highestNode = 0;
+
+        if (!GetNumaHighestNodeNumber(&highestNode) || highestNode == 0)
+            return affinity;
+
+        int node = FindDeviceNumaNode(serialNumber);
+
+        if (node < 0 || node > static_cast<int>(highestNode))
+            node = deviceIndex % static_cast<int>(highestNode + 1);
+
+        GROUP_AFFINITY nodeAffinity = {};
+
+        if (GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &nodeAffinity) && nodeAffinity.Mask != 0)
+        {
+            affinity.Group = nodeAffinity.Group;
+            affinity.Mask = nodeAffinity.Mask;
+        }
+
+        return affinity;
+    }
+}
+
+/// <summary>
+/// Chooses the processors of the threads of a camera
+/// </summary>
+/// <param name="deviceIndex">Index of the camera among those of the computer</param>
+/// <param name="numCoresPerCamera">Logical processors of each camera, with AffinityCoreSet</param>
+/// <param name="serialNumber">Serial number of the camera, with which its USB controller is found</param>
+/// <returns>The processors; an empty mask when the threads are not pinned, or on computers with a single NUMA node</returns>
+ThreadAffinity GetCameraThreadAffinity(ThreadAffinityMode mode, int deviceIndex, int numCoresPerCamera, const std::string& serialNumber)
+{
+    switch (mode)
+    {
+    case AffinityNumaNode:
+        return GetNumaNodeAffinity((std::max)(deviceIndex, 0), serialNumber);
+    case AffinityCoreSet:
+        return GetCoreSetAffinity((std::max)(deviceIndex, 0), numCoresPerCamera);
+    default:
+        return ThreadAffinity();
+    }
+}
+
+/// <summary>
+/// Moves the calling thread to the processors of an affinity; an empty mask gives it all the processors of the process
+/// back
+/// </summary>
+bool SetCurrentThreadAffinity(const ThreadAffinity& affinity)
+{
+    if (affinity.Mask == 0)
+    {
+        DWORD_PTR processMask = 0;
+        DWORD_PTR systemMask = 0;
+
+        if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+            return false;
+
+        return SetThreadAffinityMask(GetCurrentThread(), processMask) != 0;
+    }
+
+    GROUP_AFFINITY groupAffinity = {};
+    groupAffinity.Group = affinity.Group;
+    groupAffinity.Mask = static_cast<KAFFINITY>(affinity.Mask);
+
+    return SetThreadGroupAffinity(GetCurrentThread(), &groupAffinity, nullptr) != 0;
+}
+
+/// <summary>
+/// Finds the NUMA node of the USB controller of a camera. The instance id of a USB device ends with its serial number;
+/// the node is a property of the PCI devices, so it is looked up from the camera up through its parents.
+/// </summary>
+/// <returns>The node; -1 if the camera is not found or the computer does not report the node of its controller</returns>
+int FindDeviceNumaNode(const std::string& serialNumber)
+{
+    if (serialNumber.empty())
+        return -1;
+
+    HDEVINFO devices = SetupDiGetClassDevsA(nullptr, "USB", nullptr, DIGCF_ALLCLASSES | DIGCF_PRESENT);
+
+    if (devices == INVALID_HANDLE_VALUE)
+        return -1;
+
+    int node = -1;
+    SP_DEVINFO_DATA deviceInfo = {};
+    deviceInfo.cbSize = sizeof(deviceInfo);
+
+    for (DWORD i = 0; node < 0 && SetupDiEnumDeviceInfo(devices, i, &deviceInfo); i++)
+    {
+        char instanceId[MAX_DEVICE_ID_LEN];
+
+        if (!SetupDiGetDeviceInstanceIdA(devices, &deviceInfo, instanceId, sizeof(instanceId), nullptr))
+            continue;
+
+        std::string id = instanceId;
+        size_t serialStart = id.size() - (std::min)(id.size(), serialNumber.size());
+
+        if (serialStart == 0 || id[serialStart - 1] != '\\' || _stricmp(id.c_str() + serialStart, serialNumber.c_str()) != 0)
+            continue;
+
+        DEVINST device = deviceInfo.DevInst;
+
+        do
+        {
+            DEVPROPTYPE type = DEVPROP_TYPE_EMPTY;
+            ULONG value = 0;
+            ULONG size = sizeof(value);
+
+            if (CM_Get_DevNode_PropertyW(device, &DEVPKEY_Numa_Node, &type, reinterpret_cast<PBYTE>(&value), &size, 0) == CR_SUCCESS
+                && type == DEVPROP_TYPE_UINT32)
+            {
+                node = static_cast<int>(value);
+                break;
+            }
+        } while (CM_Get_Parent(&device, device, 0) == CR_SUCCESS);
+    }
+
+    SetupDiDestroyDeviceInfoList(devices);
+    return node;
+}
+
+std::string DescribeThreadAffinity(const ThreadAffinity& affinity)
+{
+    if (affinity.Mask == 0)
+        return "all processors";
+
+    std::ostringstream description;
+    description << "processors 0x" << std::hex << affinity.Mask << std::dec << " of group " << affinity.Group;
+    return description.str();
+}
@@ -0,0 +1,41 @@
+/***************************************************************************\
+
+Module Name:  TraceZones.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module marks zones of the native threads on the timeline of an ETW
+trace, so that the stages of the camera threads, the tasks of the workers,
+the document detection and the alignments can be seen overlapping. The
+zones are written by the LiveScan3D-Native TraceLogging provider, shared by
+the client and ICP libraries, as start and stop events on the thread they
+run on. A zone only checks whether a trace session enabled the provider
+when no session did, and compiles to nothing without LIVESCAN_TRACING.
+
+\***************************************************************************/
+
+#include "traceZones.h"
+
+#ifdef LIVESCAN_TRACING
+
+// The GUID is the one ETW derives from the name, so that sessions can enable the provider as *LiveScan3D-Native
+TRACELOGGING_DEFINE_PROVIDER(
+    g_liveScanTraceProvider,
+    "LiveScan3D-Native",
+    (0x9ff19d3d, 0x1fb9, 0x5ef3, 0x53, 0xca, 0x47, 0x56, 0x6f, 0xf9, 0x14, 0x77));
+
+namespace
+{
+    // Registered for as long as the library is loaded; each library of the process registers the provider on its own
+    struct TraceProviderRegistration
+    {
+        TraceProviderRegistration() { TraceLoggingRegister(g_liveScanTraceProvider); }
+        ~TraceProviderRegistration() { TraceLoggingUnregister(g_liveScanTraceProvider); }
+    };
+
+    TraceProviderRegistration registration;
+}
+
+#endif
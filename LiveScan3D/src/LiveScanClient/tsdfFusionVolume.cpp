@@ -0,0 +1,970 @@
+/***************************************************************************\
+
+Module Name:  TsdfFusionVolume.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module fuses the point clouds of all the cameras into a truncated signed
+distance field (TSDF) with DirectCompute shaders. Each point updates the
+voxels along the ray from its camera within the truncation distance, the
+frames are averaged over time with a decaying weight, and the surface is
+extracted as one point per voxel it crosses, which averages out the depth
+noise of the cameras and sets the density of the points. The surface can be
+extracted as a triangle mesh instead, with surface nets over cubes of one or
+more voxels on each side.
+
+\***************************************************************************/
+
+#include "tsdfFusionVolume.h"
+#include <d3dcompiler.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#pragma comment(lib, "d3d11.lib")
+#pragma comment(lib, "d3dcompiler.lib")
+
+namespace
+{
+    // Layout must match the FusionConstants cbuffer of the shaders below
+    struct FusionConstants
+    {
+        float gridMin[4];  // w: voxel size
+        UINT gridSize[4];  // w: number of voxel steps on each side of a point
+        float origin[4];   // w: truncation distance
+        float blending[4]; // Decay, maximum weight, minimum weight of the surface voxels, weight under which a voxel is cleared
+        UINT counts[4];    // Points to integrate, capacity of the surface points, voxels on each side of the mesh cubes, capacity of the triangles
+    };
+
+    // Layout must match the SurfacePoint struct of the shaders below
+    struct SurfacePoint
+    {
+        float position[3];
+        UINT color; // First | second << 8 | third << 16 byte of the input colors
+    };
+
+    const char* FusionShaderSource = R"(
+cbuffer FusionConstants : register(b0)
+{
+    float4 GridMin;
+    uint4 GridSize;
+    float4 Origin;
+    float4 Blending;
+    uint4 Counts;
+};
+
+// Fixed point scale of the signed distances summed by the points, in truncation distances
+static const float SdfScale = 4096.0f;
+
+struct SurfacePoint
+{
+    float3 Position;
+    uint Color;
+};
+
+StructuredBuffer<float3> Points : register(t0);
+ByteAddressBuffer PointColors : register(t1);
+
+// Per voxel: sum of the signed distances, number of samples, first | second << 16 and third color channel sums | number
+// of color samples << 16. Cleared by the blend once added to the volume
+RWByteAddressBuffer Accumulator : register(u0);
+
+// Per voxel: signed distance | weight << 16 as halfs, and color | 1 << 24 once it has a color
+RWStructuredBuffer<uint2> Volume : register(u1);
+
+// Surface points, or vertices of the mesh, then the number of points and the number of triangles
+RWStructuredBuffer<SurfacePoint> SurfacePoints : register(u2);
+RWByteAddressBuffer SurfaceCount : register(u3);
+
+// Per mesh cube: index of its vertex in the surface points, or NoVertex
+RWStructuredBuffer<uint> CubeVertices : register(u4);
+RWStructuredBuffer<uint3> Triangles : register(u5);
+
+static const uint NoVertex = 0xFFFFFFFFu;
+
+uint LoadColor(uint pointIdx)
+{
+    uint address = pointIdx * 3;
+    uint2 words = PointColors.Load2(address & ~3u);
+    uint shift = (address & 3u) * 8u;
+    uint packed = shift == 0 ? words.x : (words.x >> shift) | (words.y << (32u - shift));
+
+    return packed & 0xFFFFFFu;
+}
+
+bool GetVoxelIndex(int3 cell, out uint voxelIdx)
+{
+    voxelIdx = 0;
+
+    if (any(cell < 0) || any(cell >= int3(GridSize.xyz)))
+        return false;
+
+    voxelIdx = ((uint)cell.z * GridSize.y + (uint)cell.y) * GridSize.x + (uint)cell.x;
+    return true;
+}
+
+// Loads a voxel of the volume; false if it is out of the grid or has too little weight to be part of the surface
+bool LoadSurfaceVoxel(int3 cell, out float tsdf, out uint color)
+{
+    uint voxelIdx;
+    tsdf = 0;
+    color = 0;
+
+    if (!GetVoxelIndex(cell, voxelIdx))
+        return false;
+
+    uint2 voxel = Volume[voxelIdx];
+    tsdf = f16tof32(voxel.x);
+    color = voxel.y;
+
+    return f16tof32(voxel.x >> 16) >= Blending.z;
+}
+
+// Gives the offset of the zero crossing between two samples, from 0 at the first to 1 at the second
+bool GetCrossing(float tsdf, float nextTsdf, float maxDelta, out float offset)
+{
+    offset = 0;
+
+    // The truncated values on both sides of a thin object change sign without a surface between them
+    if ((tsdf >= 0) == (nextTsdf >= 0) || abs(tsdf - nextTsdf) > maxDelta)
+        return false;
+
+    offset = tsdf / (tsdf - nextTsdf);
+    return true;
+}
+
+// Largest change of the signed distance across a surface between two samples of the mesh, which are further apart
+// than the voxels when the mesh is decimated
+float GetMeshMaxDelta()
+{
+    return max(1.0f, Counts.z * GridMin.w / Origin.w);
+}
+
+bool GetCubeIndex(int3 cube, out uint cubeIdx)
+{
+    uint3 numCubes = (GridSize.xyz - 1) / Counts.z;
+    cubeIdx = 0;
+
+    if (any(cube < 0) || any(cube >= int3(numCubes)))
+        return false;
+
+    cubeIdx = ((uint)cube.z * numCubes.y + (uint)cube.y) * numCubes.x + (uint)cube.x;
+    return true;
+}
+
+[numthreads(64, 1, 1)]
+void Integrate(uint3 id : SV_DispatchThreadID)
+{
+    if (id.x >= Counts.x)
+        return;
+
+    float3 p = Points[id.x];
+    float3 ray = p - Origin.xyz;
+    float distance = length(ray);
+
+    if (distance < 1e-6f)
+        return;
+
+    float3 direction = ray / distance;
+    int numSteps = (int)GridSize.w;
+    uint previous;
+
+    for (int k = -numSteps; k <= numSteps; k++)
+    {
+        // The voxels in front of the point, towards the camera, are outside of the surface and have a positive distance
+        float s = k * GridMin.w;
+        uint voxelIdx;
+
+        if (!GetVoxelIndex((int3)floor((p + direction * s - GridMin.xyz) / GridMin.w), voxelIdx))
+            continue;
+
+        uint address = voxelIdx * 16;
+        int sdf = (int)round(clamp(-s / Origin.w, -1.0f, 1.0f) * SdfScale);
+        Accumulator.InterlockedAdd(address, asuint(sdf), previous);
+        Accumulator.InterlockedAdd(address + 4, 1u, previous);
+
+        if (k == 0)
+        {
+            // The voxel of the point takes its color; the 16-bit sums hold up to 255 samples
+            Accumulator.InterlockedAdd(address + 12, 1u << 16, previous);
+
+            if ((previous >> 16) < 255)
+            {
+                uint color = LoadColor(id.x);
+                Accumulator.InterlockedAdd(address + 8, (color & 0xFFu) | (((color >> 8) & 0xFFu) << 16), previous);
+                Accumulator.InterlockedAdd(address + 12, (color >> 16) & 0xFFu, previous);
+            }
+            else
+            {
+                Accumulator.InterlockedAdd(address + 12, 0xFFFF0000u, previous);
+            }
+        }
+    }
+}
+
+[numthreads(4, 4, 4)]
+void Blend(uint3 id : SV_DispatchThreadID)
+{
+    uint voxelIdx;
+
+    if (!GetVoxelIndex(int3(id), voxelIdx))
+        return;
+
+    uint2 voxel = Volume[voxelIdx];
+    float tsdf = f16tof32(voxel.x);
+    float weight = f16tof32(voxel.x >> 16) * Blending.x;
+    uint color = voxel.y;
+    uint4 sums = Accumulator.Load4(voxelIdx * 16);
+
+    if (sums.y > 0)
+    {
+        float numSamples = (float)sums.y;
+        float frameTsdf = (float)asint(sums.x) / (SdfScale * numSamples);
+        tsdf = (tsdf * weight + frameTsdf * numSamples) / (weight + numSamples);
+
+        uint numColors = sums.w >> 16;
+
+        if (numColors > 0)
+        {
+            float3 frameColor = float3(sums.z & 0xFFFFu, sums.z >> 16, sums.w & 0xFFFFu) / numColors;
+            float3 previousColor = float3(color & 0xFFu, (color >> 8) & 0xFFu, (color >> 16) & 0xFFu);
+            float alpha = (color >> 24) != 0 ? numColors / (weight + numColors) : 1.0f;
+            uint3 rgb = (uint3)round(lerp(previousColor, frameColor, alpha));
+            color = rgb.x | (rgb.y << 8) | (rgb.z << 16) | (1u << 24);
+        }
+
+        weight = min(weight + numSamples, Blending.y);
+        Accumulator.Store4(voxelIdx * 16, uint4(0, 0, 0, 0));
+    }
+
+    // The voxels which are no longer observed fade out, then are forgotten
+    if (weight < Blending.w)
+    {
+        tsdf = 0;
+        weight = 0;
+        color = 0;
+    }
+
+    Volume[voxelIdx] = uint2(f32tof16(tsdf) | (f32tof16(weight) << 16), color);
+}
+
+[numthreads(4, 4, 4)]
+void Extract(uint3 id : SV_DispatchThreadID)
+{
+    uint voxelIdx;
+
+    if (!GetVoxelIndex(int3(id), voxelIdx))
+        return;
+
+    uint2 voxel = Volume[voxelIdx];
+    float tsdf = f16tof32(voxel.x);
+
+    if (f16tof32(voxel.x >> 16) < Blending.z)
+        return;
+
+    // Place the point at the mean of the zero crossings towards the next voxel on each axis
+    float3 offset = float3(0, 0, 0);
+    uint numCrossings = 0;
+    uint color = voxel.y;
+
+    [unroll]
+    for (uint axis = 0; axis < 3; axis++)
+    {
+        int3 neighbourCell = int3(id);
+        neighbourCell[axis] += 1;
+        uint neighbourIdx;
+
+        if (!GetVoxelIndex(neighbourCell, neighbourIdx))
+            continue;
+
+        uint2 neighbour = Volume[neighbourIdx];
+        float neighbourTsdf = f16tof32(neighbour.x);
+
+        if (f16tof32(neighbour.x >> 16) < Blending.z)
+            continue;
+
+        // The truncated values on both sides of a thin object change sign without a surface between them
+        if ((tsdf >= 0) == (neighbourTsdf >= 0) || abs(tsdf - neighbourTsdf) > 1.0f)
+            continue;
+
+        float3 crossing = float3(0, 0, 0);
+        crossing[axis] = tsdf / (tsdf - neighbourTsdf);
+        offset += crossing;
+        numCrossings++;
+
+        if ((color >> 24) == 0)
+            color = neighbour.y;
+    }
+
+    // A surface voxel without a color has not been the voxel of any point yet
+    if (numCrossings == 0 || (color >> 24) == 0)
+        return;
+
+    uint index;
+    SurfaceCount.InterlockedAdd(0, 1u, index);
+
+    if (index >= Counts.y)
+        return;
+
+    SurfacePoint point;
+    point.Position = GridMin.xyz + (float3(id) + 0.5f + offset / numCrossings) * GridMin.w;
+    point.Color = color & 0xFFFFFFu;
+    SurfacePoints[index] = point;
+}
+
+[numthreads(4, 4, 4)]
+void MeshVertices(uint3 id : SV_DispatchThreadID)
+{
+    uint cubeIdx;
+
+    if (!GetCubeIndex(int3(id), cubeIdx))
+        return;
+
+    CubeVertices[cubeIdx] = NoVertex;
+
+    // The corners of a cube are the samples Counts.z voxels apart; bit 0 of a corner is its x offset, then y and z
+    int step = (int)Counts.z;
+    float tsdf[8];
+    uint colors[8];
+
+    [unroll]
+    for (uint corner = 0; corner < 8; corner++)
+    {
+        int3 offset = int3(corner & 1u, (corner >> 1) & 1u, corner >> 2);
+
+        if (!LoadSurfaceVoxel((int3(id) + offset) * step, tsdf[corner], colors[corner]))
+            return;
+    }
+
+    // Place the vertex at the mean of the zero crossings on the edges of the cube, and take the color of one of their
+    // samples
+    float maxDelta = GetMeshMaxDelta();
+    float3 position = float3(0, 0, 0);
+    uint numCrossings = 0;
+    uint color = 0;
+
+    [unroll]
+    for (uint edge = 0; edge < 12; edge++)
+    {
+        uint axis = edge / 4;
+        uint start = ((edge & 1u) << ((axis + 1) % 3)) | (((edge >> 1) & 1u) << ((axis + 2) % 3));
+        uint end = start | (1u << axis);
+        float offset;
+
+        if (!GetCrossing(tsdf[start], tsdf[end], maxDelta, offset))
+            continue;
+
+        float3 crossing = float3(start & 1u, (start >> 1) & 1u, start >> 2);
+        crossing[axis] += offset;
+        position += crossing;
+        numCrossings++;
+
+        if ((color >> 24) == 0)
+            color = (colors[start] >> 24) != 0 ? colors[start] : colors[end];
+    }
+
+    if (numCrossings == 0 || (color >> 24) == 0)
+        return;
+
+    uint index;
+    SurfaceCount.InterlockedAdd(0, 1u, index);
+
+    if (index >= Counts.y)
+        return;
+
+    SurfacePoint point;
+    point.Position = GridMin.xyz + ((float3(id) + position / numCrossings) * step + 0.5f) * GridMin.w;
+    point.Color = color & 0xFFFFFFu;
+    SurfacePoints[index] = point;
+    CubeVertices[cubeIdx] = index;
+}
+
+[numthreads(4, 4, 4)]
+void MeshFaces(uint3 id : SV_DispatchThreadID)
+{
+    int step = (int)Counts.z;
+    float tsdf;
+    uint color;
+
+    if (!LoadSurfaceVoxel(int3(id) * step, tsdf, color))
+        return;
+
+    float maxDelta = GetMeshMaxDelta();
+
+    // Each edge from the sample which the surface crosses joins the vertices of the four cubes around it
+    [unroll]
+    for (uint axis = 0; axis < 3; axis++)
+    {
+        int3 next = int3(id);
+        next[axis] += 1;
+        float nextTsdf;
+        uint nextColor;
+        float offset;
+
+        if (!LoadSurfaceVoxel(next * step, nextTsdf, nextColor) || !GetCrossing(tsdf, nextTsdf, maxDelta, offset))
+            continue;
+
+        int3 b = int3(0, 0, 0);
+        int3 c = int3(0, 0, 0);
+        b[(axis + 1) % 3] = 1;
+        c[(axis + 2) % 3] = 1;
+        uint4 cubes;
+
+        if (!GetCubeIndex(int3(id), cubes.x) || !GetCubeIndex(int3(id) - b, cubes.y)
+            || !GetCubeIndex(int3(id) - b - c, cubes.z) || !GetCubeIndex(int3(id) - c, cubes.w))
+        {
+            continue;
+        }
+
+        uint4 quad = uint4(CubeVertices[cubes.x], CubeVertices[cubes.y], CubeVertices[cubes.z], CubeVertices[cubes.w]);
+
+        if (any(quad == NoVertex))
+            continue;
+
+        uint first;
+        SurfaceCount.InterlockedAdd(4, 2u, first);
+
+        if (first + 2 > Counts.w)
+            continue;
+
+        // The quad turns counter-clockwise around the axis, so it faces along the axis when the outside, where the
+        // distance is positive, is after the sample
+        if (tsdf < 0)
+        {
+            Triangles[first] = quad.xyz;
+            Triangles[first + 1] = quad.xzw;
+        }
+        else
+        {
+            Triangles[first] = quad.xzy;
+            Triangles[first + 1] = quad.xwz;
+        }
+    }
+}
+)";
+}
+
+TsdfFusionVolume::TsdfFusionVolume()
+{
+}
+
+TsdfFusionVolume::~TsdfFusionVolume()
+{
+    Release();
+}
+
+/// <summary>
+/// Sets the region and resolution of the volume, creating the Direct3D device on the first call. The volume is
+/// cleared when they change; the voxel size is increased if the bounds would need more voxels than the maximum.
+/// </summary>
+/// <param name="truncation">Distance from the surface, in meters, within which the points update the voxels</param>
+/// <param name="decay">Factor applied to the weight of the previous frames at each new frame</param>
+/// <returns>True if the volume is ready to integrate frames; false otherwise.</returns>
+bool TsdfFusionVolume::Configure(const float minBounds[3], const float maxBounds[3], float voxelSize, float truncation, float decay)
+{
+    if (voxelSize <= 0.0f)
+        return false;
+
+    double extents[3];
+    double numVoxels = 1.0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        extents[i] = (std::max)(static_cast<double>(maxBounds[i]) - minBounds[i], static_cast<double>(voxelSize));
+        numVoxels *= std::ceil(extents[i] / voxelSize);
+    }
+
+    if (numVoxels > MaxVoxels)
+        voxelSize = static_cast<float>(voxelSize * std::cbrt(numVoxels / MaxVoxels) * 1.01);
+
+    truncation = (std::max)(truncation, voxelSize);
+    this->decay = (std::min)((std::max)(decay, 0.0f), 1.0f);
+
+    bool isSameVolume = isConfigured && voxelSize == this->voxelSize && truncation == this->truncation;
+
+    for (int i = 0; i < 3; i++)
+    {
+        isSameVolume = isSameVolume && minBounds[i] == this->minBounds[i] && maxBounds[i] == this->maxBounds[i];
+        this->minBounds[i] = minBounds[i];
+        this->maxBounds[i] = maxBounds[i];
+        gridSize[i] = (std::max)(1u, static_cast<UINT>(std::ceil(extents[i] / voxelSize)));
+    }
+
+    if (isSameVolume)
+        return true;
+
+    this->voxelSize = voxelSize;
+    this->truncation = truncation;
+
+    ReleaseVolume();
+
+    if (!device && !CreateDevice())
+    {
+        Release();
+        return false;
+    }
+
+    isConfigured = CreateVolume();
+
+    return isConfigured;
+}
+
+bool TsdfFusionVolume::CreateDevice()
+{
+    D3D_FEATURE_LEVEL featureLevels[] = { D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0 };
+
+    if (FAILED(D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL, 0, featureLevels, ARRAYSIZE(featureLevels),
+        D3D11_SDK_VERSION, &device, NULL, &context)))
+    {
+        return false;
+    }
+
+    auto CompileShader = [&](const char* entryPoint, ID3D11ComputeShader** shader) {
+        ID3DBlob* byteCode = NULL;
+        ID3DBlob* errors = NULL;
+
+        HRESULT hr = D3DCompile(FusionShaderSource, strlen(FusionShaderSource), "FusionShader", NULL, NULL,
+            entryPoint, "cs_5_0", D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, &byteCode, &errors);
+
+        if (SUCCEEDED(hr))
+            hr = device->CreateComputeShader(byteCode->GetBufferPointer(), byteCode->GetBufferSize(), NULL, shader);
+
+        SafeRelease(errors);
+        SafeRelease(byteCode);
+
+        return SUCCEEDED(hr);
+    };
+
+    if (!CompileShader("Integrate", &integrateShader) || !CompileShader("Blend", &blendShader) || !CompileShader("Extract", &extractShader)
+        || !CompileShader("MeshVertices", &meshVerticesShader) || !CompileShader("MeshFaces", &meshFacesShader))
+    {
+        return false;
+    }
+
+    D3D11_BUFFER_DESC constantsDesc = {};
+    constantsDesc.ByteWidth = (sizeof(FusionConstants) + 15) & ~15;
+    constantsDesc.Usage = D3D11_USAGE_DYNAMIC;
+    constantsDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    constantsDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+    return SUCCEEDED(device->CreateBuffer(&constantsDesc, NULL, &constants));
+}
+
+bool TsdfFusionVolume::CreateVolume()
+{
+    UINT numVoxels = gridSize[0] * gridSize[1] * gridSize[2];
+
+    bool res = CreateRawBuffer(numVoxels * 4, &accumulatorBuffer, &accumulatorView)
+        && CreateStructuredBuffer(2 * sizeof(UINT), numVoxels, &volumeBuffer, &volumeView)
+        && CreateStructuredBuffer(sizeof(SurfacePoint), MaxSurfacePoints, &surfaceBuffer, &surfaceView)
+        && CreateRawBuffer(2, &surfaceCountBuffer, &surfaceCountView)
+        && CreateStagingBuffer(2 * sizeof(UINT), &countStaging)
+        && CreateStagingBuffer(MaxSurfacePoints * sizeof(SurfacePoint), &surfaceStaging);
+
+    if (!res)
+    {
+        ReleaseVolume();
+        return false;
+    }
+
+    // Start empty: no samples to add and no weight in any voxel
+    const UINT zeros[4] = { 0, 0, 0, 0 };
+    context->ClearUnorderedAccessViewUint(accumulatorView, zeros);
+    context->ClearUnorderedAccessViewUint(volumeView, zeros);
+
+    return true;
+}
+
+/// <summary>
+/// Creates the buffers of the mesh extraction, which are only needed once a mesh is extracted. There are never more
+/// mesh cubes than voxels.
+/// </summary>
+bool TsdfFusionVolume::CreateMeshBuffers()
+{
+    UINT numVoxels = gridSize[0] * gridSize[1] * gridSize[2];
+
+    bool res = CreateStructuredBuffer(sizeof(UINT), numVoxels, &cubeVertexBuffer, &cubeVertexView)
+        && CreateStructuredBuffer(3 * sizeof(UINT), MaxTriangles, &triangleBuffer, &triangleView)
+        && CreateStagingBuffer(MaxTriangles * 3 * sizeof(UINT), &triangleStaging);
+
+    if (!res)
+    {
+        SafeRelease(triangleStaging);
+        SafeRelease(triangleView);
+        SafeRelease(cubeVertexView);
+        SafeRelease(triangleBuffer);
+        SafeRelease(cubeVertexBuffer);
+    }
+
+    return res;
+}
+
+bool TsdfFusionVolume::CreateRawBuffer(UINT numWords, ID3D11Buffer** buffer, ID3D11UnorderedAccessView** view)
+{
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = numWords * sizeof(UINT);
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+    desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+
+    D3D11_UNORDERED_ACCESS_VIEW_DESC viewDesc = {};
+    viewDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+    viewDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+    viewDesc.Buffer.NumElements = numWords;
+    viewDesc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
+
+    return SUCCEEDED(device->CreateBuffer(&desc, NULL, buffer)) && SUCCEEDED(device->CreateUnorderedAccessView(*buffer, &viewDesc, view));
+}
+
+bool TsdfFusionVolume::CreateStructuredBuffer(UINT stride, UINT count, ID3D11Buffer** buffer, ID3D11UnorderedAccessView** view)
+{
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = stride * count;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+    desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+    desc.StructureByteStride = stride;
+
+    return SUCCEEDED(device->CreateBuffer(&desc, NULL, buffer)) && SUCCEEDED(device->CreateUnorderedAccessView(*buffer, NULL, view));
+}
+
+bool TsdfFusionVolume::CreateStagingBuffer(UINT byteWidth, ID3D11Buffer** buffer)
+{
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = byteWidth;
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+
+    return SUCCEEDED(device->CreateBuffer(&desc, NULL, buffer));
+}
+
+/// <summary>
+/// Grows the buffers the points of a camera are uploaded to, so that they can hold the given number of points.
+/// </summary>
+bool TsdfFusionVolume::ReservePoints(UINT numPoints)
+{
+    if (numPoints <= pointCapacity)
+        return true;
+
+    UINT capacity = (std::max)(numPoints, 65536u);
+    capacity = (std::min)((std::max)(capacity, pointCapacity * 3 / 2), MaxPoints);
+
+    SafeRelease(pointColorView);
+    SafeRelease(pointView);
+    SafeRelease(pointColorBuffer);
+    SafeRelease(pointBuffer);
+    pointCapacity = 0;
+
+    D3D11_BUFFER_DESC pointDesc = {};
+    pointDesc.ByteWidth = capacity * 3 * sizeof(float);
+    pointDesc.Usage = D3D11_USAGE_DEFAULT;
+    pointDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    pointDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+    pointDesc.StructureByteStride = 3 * sizeof(float);
+
+    // Raw colors, rounded up to whole 32-bit words with an extra word so that unaligned two-word loads stay in bounds
+    D3D11_BUFFER_DESC colorDesc = {};
+    colorDesc.ByteWidth = (capacity * 3 + 7) & ~3u;
+    colorDesc.Usage = D3D11_USAGE_DEFAULT;
+    colorDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    colorDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+
+    D3D11_SHADER_RESOURCE_VIEW_DESC colorViewDesc = {};
+    colorViewDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+    colorViewDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFEREX;
+    colorViewDesc.BufferEx.NumElements = colorDesc.ByteWidth / 4;
+    colorViewDesc.BufferEx.Flags = D3D11_BUFFEREX_SRV_FLAG_RAW;
+
+    bool res = SUCCEEDED(device->CreateBuffer(&pointDesc, NULL, &pointBuffer))
+        && SUCCEEDED(device->CreateShaderResourceView(pointBuffer, NULL, &pointView))
+        && SUCCEEDED(device->CreateBuffer(&colorDesc, NULL, &pointColorBuffer))
+        && SUCCEEDED(device->CreateShaderResourceView(pointColorBuffer, &colorViewDesc, &pointColorView));
+
+    if (!res)
+    {
+        SafeRelease(pointColorView);
+        SafeRelease(pointView);
+        SafeRelease(pointColorBuffer);
+        SafeRelease(pointBuffer);
+        return false;
+    }
+
+    pointCapacity = capacity;
+
+    return true;
+}
+
+void TsdfFusionVolume::UpdateConstants(const float origin[3], UINT numPoints, UINT meshStep)
+{
+    FusionConstants fusionConstants = {};
+
+    for (int i = 0; i < 3; i++)
+    {
+        fusionConstants.gridMin[i] = minBounds[i];
+        fusionConstants.gridSize[i] = gridSize[i];
+        fusionConstants.origin[i] = origin ? origin[i] : 0.0f;
+    }
+
+    fusionConstants.gridMin[3] = voxelSize;
+    fusionConstants.gridSize[3] = static_cast<UINT>(std::ceil(truncation / voxelSize));
+    fusionConstants.origin[3] = truncation;
+    fusionConstants.blending[0] = decay;
+    fusionConstants.blending[1] = MaxWeight;
+    fusionConstants.blending[2] = MinSurfaceWeight;
+    fusionConstants.blending[3] = ForgetWeight;
+    fusionConstants.counts[0] = numPoints;
+    fusionConstants.counts[1] = MaxSurfacePoints;
+    fusionConstants.counts[2] = meshStep;
+    fusionConstants.counts[3] = MaxTriangles;
+
+    D3D11_MAPPED_SUBRESOURCE mapped;
+
+    if (SUCCEEDED(context->Map(constants, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+    {
+        memcpy(mapped.pData, &fusionConstants, sizeof(FusionConstants));
+        context->Unmap(constants, 0);
+    }
+}
+
+void TsdfFusionVolume::Dispatch(ID3D11ComputeShader* shader, UINT groupsX, UINT groupsY, UINT groupsZ)
+{
+    ID3D11ShaderResourceView* views[] = { pointView, pointColorView };
+    ID3D11UnorderedAccessView* uavs[] = { accumulatorView, volumeView, surfaceView, surfaceCountView, cubeVertexView, triangleView };
+
+    context->CSSetShader(shader, NULL, 0);
+    context->CSSetConstantBuffers(0, 1, &constants);
+    context->CSSetShaderResources(0, ARRAYSIZE(views), views);
+    context->CSSetUnorderedAccessViews(0, ARRAYSIZE(uavs), uavs, NULL);
+    context->Dispatch(groupsX, groupsY, groupsZ);
+
+    ID3D11ShaderResourceView* nullViews[ARRAYSIZE(views)] = { NULL };
+    ID3D11UnorderedAccessView* nullUavs[ARRAYSIZE(uavs)] = { NULL };
+    context->CSSetShaderResources(0, ARRAYSIZE(nullViews), nullViews);
+    context->CSSetUnorderedAccessViews(0, ARRAYSIZE(nullUavs), nullUavs, NULL);
+}
+
+/// <summary>
+/// Adds the points of one camera to the samples of the current frame. The points and the origin of the camera are
+/// in world space; the points beyond the capacity of one dispatch are left out.
+/// </summary>
+/// <param name="colors">Three bytes per point, extracted in the same order</param>
+/// <returns>True if the points were integrated; false otherwise.</returns>
+bool TsdfFusionVolume::Integrate(const float* vertices, const unsigned char* colors, int numVertices, const float origin[3])
+{
+    if (!isConfigured)
+        return false;
+
+    UINT numPoints = (std::min)(static_cast<UINT>((std::max)(numVertices, 0)), MaxPoints);
+
+    if (numPoints == 0)
+        return true;
+
+    if (!ReservePoints(numPoints))
+        return false;
+
+    D3D11_BOX pointBox = { 0, 0, 0, numPoints * 3 * static_cast<UINT>(sizeof(float)), 1, 1 };
+    context->UpdateSubresource(pointBuffer, 0, &pointBox, vertices, 0, 0);
+    D3D11_BOX colorBox = { 0, 0, 0, numPoints * 3, 1, 1 };
+    context->UpdateSubresource(pointColorBuffer, 0, &colorBox, colors, 0, 0);
+
+    UpdateConstants(origin, numPoints);
+    Dispatch(integrateShader, (numPoints + PointGroupSize - 1) / PointGroupSize, 1, 1);
+
+    return true;
+}
+
+/// <summary>
+/// Blends the samples integrated since the last extraction into the volume and extracts its surface, read with
+/// GetVertices and GetColors until the next extraction.
+/// </summary>
+/// <returns>The number of points of the surface, or -1 if it could not be extracted</returns>
+int TsdfFusionVolume::Extract()
+{
+    surfaceVertices.clear();
+    surfaceColors.clear();
+    surfaceIndices.clear();
+
+    if (!isConfigured)
+        return -1;
+
+    UINT groups[3];
+
+    for (int i = 0; i < 3; i++)
+        groups[i] = (gridSize[i] + VoxelGroupSize - 1) / VoxelGroupSize;
+
+    UpdateConstants(NULL, 0);
+    Dispatch(blendShader, groups[0], groups[1], groups[2]);
+
+    const UINT zeros[4] = { 0, 0, 0, 0 };
+    context->ClearUnorderedAccessViewUint(surfaceCountView, zeros);
+    Dispatch(extractShader, groups[0], groups[1], groups[2]);
+
+    return ReadSurface(false);
+}
+
+/// <summary>
+/// Blends the samples integrated since the last extraction into the volume and extracts its surface as a triangle
+/// mesh: one vertex in each cube of step voxels on each side which the surface crosses, joined by two triangles
+/// across each edge between the samples at its corners which the surface crosses. Larger steps decimate the mesh.
+/// The vertices are read with GetVertices and GetColors, and the triangles with GetIndices, until the next extraction.
+/// </summary>
+/// <returns>The number of vertices of the mesh, or -1 if it could not be extracted</returns>
+int TsdfFusionVolume::ExtractMesh(int step)
+{
+    surfaceVertices.clear();
+    surfaceColors.clear();
+    surfaceIndices.clear();
+
+    if (!isConfigured || (!cubeVertexBuffer && !CreateMeshBuffers()))
+        return -1;
+
+    UINT meshStep = static_cast<UINT>((std::min)((std::max)(step, 1), MaxMeshStep));
+    UINT groups[3];
+    UINT cubeGroups[3];
+    UINT sampleGroups[3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        UINT numCubes = (gridSize[i] - 1) / meshStep;
+        groups[i] = (gridSize[i] + VoxelGroupSize - 1) / VoxelGroupSize;
+        cubeGroups[i] = (numCubes + VoxelGroupSize - 1) / VoxelGroupSize;
+        sampleGroups[i] = (numCubes + VoxelGroupSize) / VoxelGroupSize;
+    }
+
+    UpdateConstants(NULL, 0, meshStep);
+    Dispatch(blendShader, groups[0], groups[1], groups[2]);
+
+    // The faces need the vertices of all the cubes around them, so they are built by a second pass
+    const UINT zeros[4] = { 0, 0, 0, 0 };
+    context->ClearUnorderedAccessViewUint(surfaceCountView, zeros);
+    Dispatch(meshVerticesShader, cubeGroups[0], cubeGroups[1], cubeGroups[2]);
+    Dispatch(meshFacesShader, sampleGroups[0], sampleGroups[1], sampleGroups[2]);
+
+    return ReadSurface(true);
+}
+
+/// <summary>
+/// Reads back the surface points of the last extraction, and its triangles if it extracted a mesh
+/// </summary>
+int TsdfFusionVolume::ReadSurface(bool isMesh)
+{
+    // Read back the number of points first so that only the used part of the output is copied
+    context->CopyResource(countStaging, surfaceCountBuffer);
+
+    D3D11_MAPPED_SUBRESOURCE mapped;
+
+    if (FAILED(context->Map(countStaging, 0, D3D11_MAP_READ, 0, &mapped)))
+        return -1;
+
+    const UINT* counts = static_cast<const UINT*>(mapped.pData);
+    UINT numPoints = (std::min)(counts[0], MaxSurfacePoints);
+    UINT numTriangles = isMesh ? (std::min)(counts[1], MaxTriangles) : 0;
+    context->Unmap(countStaging, 0);
+
+    if (numPoints == 0)
+        return 0;
+
+    D3D11_BOX surfaceBox = { 0, 0, 0, static_cast<UINT>(numPoints * sizeof(SurfacePoint)), 1, 1 };
+    context->CopySubresourceRegion(surfaceStaging, 0, 0, 0, 0, surfaceBuffer, 0, &surfaceBox);
+
+    if (FAILED(context->Map(surfaceStaging, 0, D3D11_MAP_READ, 0, &mapped)))
+        return -1;
+
+    const SurfacePoint* points = static_cast<const SurfacePoint*>(mapped.pData);
+    surfaceVertices.resize(numPoints * 3);
+    surfaceColors.resize(numPoints * 3);
+
+    for (UINT i = 0; i < numPoints; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            surfaceVertices[i * 3 + j] = points[i].position[j];
+            surfaceColors[i * 3 + j] = static_cast<unsigned char>((points[i].color >> (8 * j)) & 0xFF);
+        }
+    }
+
+    context->Unmap(surfaceStaging, 0);
+
+    if (numTriangles > 0)
+    {
+        D3D11_BOX triangleBox = { 0, 0, 0, static_cast<UINT>(numTriangles * 3 * sizeof(UINT)), 1, 1 };
+        context->CopySubresourceRegion(triangleStaging, 0, 0, 0, 0, triangleBuffer, 0, &triangleBox);
+
+        if (FAILED(context->Map(triangleStaging, 0, D3D11_MAP_READ, 0, &mapped)))
+            return -1;
+
+        const int* indices = static_cast<const int*>(mapped.pData);
+        surfaceIndices.assign(indices, indices + numTriangles * 3);
+        context->Unmap(triangleStaging, 0);
+    }
+
+    return static_cast<int>(numPoints);
+}
+
+const float* TsdfFusionVolume::GetVertices() const
+{
+    return surfaceVertices.data();
+}
+
+const unsigned char* TsdfFusionVolume::GetColors() const
+{
+    return surfaceColors.data();
+}
+
+const int* TsdfFusionVolume::GetIndices() const
+{
+    return surfaceIndices.data();
+}
+
+int TsdfFusionVolume::GetTriangleCount() const
+{
+    return static_cast<int>(surfaceIndices.size() / 3);
+}
+
+void TsdfFusionVolume::ReleaseVolume()
+{
+    isConfigured = false;
+
+    SafeRelease(triangleStaging);
+    SafeRelease(surfaceStaging);
+    SafeRelease(countStaging);
+
+    SafeRelease(triangleView);
+    SafeRelease(cubeVertexView);
+    SafeRelease(surfaceCountView);
+    SafeRelease(surfaceView);
+    SafeRelease(volumeView);
+    SafeRelease(accumulatorView);
+    SafeRelease(triangleBuffer);
+    SafeRelease(cubeVertexBuffer);
+    SafeRelease(surfaceCountBuffer);
+    SafeRelease(surfaceBuffer);
+    SafeRelease(volumeBuffer);
+    SafeRelease(accumulatorBuffer);
+}
+
+void TsdfFusionVolume::Release()
+{
+    ReleaseVolume();
+
+    pointCapacity = 0;
+    SafeRelease(pointColorView);
+    SafeRelease(pointView);
+    SafeRelease(pointColorBuffer);
+    SafeRelease(pointBuffer);
+
+    SafeRelease(constants);
+    SafeRelease(meshFacesShader);
+    SafeRelease(meshVerticesShader);
+    SafeRelease(extractShader);
+    SafeRelease(blendShader);
+    SafeRelease(integrateShader);
+    SafeRelease(context);
+    SafeRelease(device);
+
+    surfaceVertices.clear();
+    surfaceColors.clear();
+    surfaceIndices.clear();
+}
@@ -0,0 +1,100 @@
+/***************************************************************************\
+
+Module Name:  ViewDecimator.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module decimates the points of the live view of the server to one point
+per voxel of a given size, which the view sizes to the pixels of its window,
+so that it does not draw many points per pixel while the frames stream. The
+voxels are kept in an open-addressing hash table whose slots are tagged with
+the generation of the call which wrote them, so that the table is never
+cleared between the calls.
+
+\***************************************************************************/
+
+#include "viewDecimator.h"
+#include "memoryUsage.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+/// <summary>
+/// Keeps the first point of each voxel, in the order of the points, so that the decimated points of a camera stay
+/// the same from one frame to the next when the camera does not move
+/// </summary>
+/// <param name="vertices">Positions of the points, in meters (x, y, z for each point)</param>
+/// <param name="colors">Colors of the points (r, g, b for each point)</param>
+/// <param name="voxelSize">Size of the voxels, in meters; 0 or less copies all the points</param>
+/// <param name="outVertices">Output positions, able to hold numPoints points</param>
+/// <param name="outColors">Output colors, able to hold numPoints points</param>
+/// <returns>The number of points written</returns>
+int ViewDecimator::Decimate(const float* vertices, const uint8_t* colors, int numPoints, float voxelSize,
+    float* outVertices, uint8_t* outColors) {
+    numPoints = (std::max)(numPoints, 0);
+
+    if (voxelSize <= 0.0f) {
+        memcpy(outVertices, vertices, sizeof(float) * 3 * numPoints);
+        memcpy(outColors, colors, 3 * numPoints);
+        return numPoints;
+    }
+
+    Reserve(numPoints);
+
+    float inverseVoxelSize = 1.0f / voxelSize;
+    const uint64_t CoordinateMask = (uint64_t(1) << 21) - 1;
+    int numKept = 0;
+
+    for (int i = 0; i < numPoints; i++) {
+        const float* position = vertices + 3 * i;
+        uint64_t x = static_cast<uint64_t>(static_cast<int64_t>(std::floor(position[0] * inverseVoxelSize))) & CoordinateMask;
+        uint64_t y = static_cast<uint64_t>(static_cast<int64_t>(std::floor(position[1] * inverseVoxelSize))) & CoordinateMask;
+        uint64_t z = static_cast<uint64_t>(static_cast<int64_t>(std::floor(position[2] * inverseVoxelSize))) & CoordinateMask;
+        uint64_t key = (z << 42) | (y << 21) | x;
+
+        // The table is at least twice as large as the points, so the probing always finds a free slot
+        size_t slot = static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & slotMask;
+
+        while (slotGenerations[slot] == generation && slotKeys[slot] != key)
+            slot = (slot + 1) & slotMask;
+
+        if (slotGenerations[slot] == generation)
+            continue;
+
+        slotGenerations[slot] = generation;
+        slotKeys[slot] = key;
+
+        memcpy(outVertices + 3 * numKept, position, 3 * sizeof(float));
+        memcpy(outColors + 3 * numKept, colors + 3 * i, 3);
+        numKept++;
+    }
+
+    return numKept;
+}
+
+size_t ViewDecimator::GetMemoryUsage() const {
+    return GetCapacityBytes(slotKeys) + GetCapacityBytes(slotGenerations);
+}
+
+// Starts a new generation of the table, growing it to at least twice the number of points
+void ViewDecimator::Reserve(int numPoints) {
+    size_t requiredSize = 16;
+
+    while (requiredSize < static_cast<size_t>(numPoints) * 2)
+        requiredSize *= 2;
+
+    if (slotKeys.size() < requiredSize) {
+        slotKeys.resize(requiredSize);
+        slotGenerations.assign(requiredSize, 0);
+        slotMask = requiredSize - 1;
+        generation = 0;
+    }
+
+    // The slots of the wrapped around generation could be taken for the current one
+    if (++generation == 0) {
+        std::fill(slotGenerations.begin(), slotGenerations.end(), 0);
+        generation = 1;
+    }
+}
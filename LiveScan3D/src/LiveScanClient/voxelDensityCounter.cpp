@@ -0,0 +1,162 @@
+/***************************************************************************\
+
+Module Name:  VoxelDensityCounter.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module counts the number of points falling in each cell of a voxel grid
+aligned to the world origin. Cells inside the Holoport volume are counted in a
+dense array; cells outside of it fall back to an open-addressing hash table.
+Only the cells touched since the last reset are cleared.
+
+\***************************************************************************/
+
+#include "voxelDensityCounter.h"
+#include "memoryUsage.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// Constructor for initializing the dense grid over the given volume
+VoxelDensityCounter::VoxelDensityCounter(float voxelSize, float centerX, float centerY, float centerZ, float halfRange)
+    : voxelSize(voxelSize), hashGeneration(0), hashMask(0), requiredHashSize(0) {
+    if (voxelSize <= 0.0f) throw std::invalid_argument("Voxel size must be positive.");
+
+    // The cells are aligned to the world origin, so the volume covers the cells containing its corners
+    minCellX = static_cast<int>(std::floor((centerX - halfRange) / voxelSize));
+    minCellY = static_cast<int>(std::floor((centerY - halfRange) / voxelSize));
+    minCellZ = static_cast<int>(std::floor((centerZ - halfRange) / voxelSize));
+
+    gridSizeX = static_cast<int>(std::floor((centerX + halfRange) / voxelSize)) - minCellX + 1;
+    gridSizeY = static_cast<int>(std::floor((centerY + halfRange) / voxelSize)) - minCellY + 1;
+    gridSizeZ = static_cast<int>(std::floor((centerZ + halfRange) / voxelSize)) - minCellZ + 1;
+
+    denseCounts.resize(static_cast<size_t>(gridSizeX) * gridSizeY * gridSizeZ, 0);
+}
+
+// Clears the counts of the cells touched since the last reset and makes room for the given number of insertions
+void VoxelDensityCounter::Reset(size_t maxInsertions) {
+    for (uint32_t cell : touchedCells)
+        denseCounts[cell] = 0;
+
+    touchedCells.clear();
+
+    // Stale hash slots are recognized by their generation instead of being cleared; the table is kept at most half full
+    // so that the handles returned by Insert remain valid until the next reset
+    size_t requiredSize = 16;
+
+    while (requiredSize < maxInsertions * 2)
+        requiredSize *= 2;
+
+    requiredHashSize = requiredSize;
+
+    if (hashKeys.size() < requiredSize) {
+        hashKeys.resize(requiredSize);
+        hashCounts.resize(requiredSize);
+        hashSlotStates.assign(requiredSize, 0);
+        hashMask = requiredSize - 1;
+        hashGeneration = 0;
+    }
+
+    hashGeneration++;
+
+    // On wrap around, the stored generations could be mistaken for the current one
+    if (hashGeneration == UINT32_MAX) {
+        std::fill(hashSlotStates.begin(), hashSlotStates.end(), 0);
+        hashGeneration = 1;
+    }
+}
+
+size_t VoxelDensityCounter::GetMemoryUsage() const {
+    return GetCapacityBytes(denseCounts) + GetCapacityBytes(hashKeys) + GetCapacityBytes(hashCounts)
+        + GetCapacityBytes(hashSlotStates) + GetCapacityBytes(touchedCells);
+}
+
+// Shrinks the hash table to the size the last reset needed when it is over twice as large, after a frame with more
+// points; the handles returned by Insert are invalidated, so it must be called after the counts of the frame are read
+void VoxelDensityCounter::ReleaseUnusedMemory() {
+    TrimCapacity(touchedCells);
+
+    if (hashKeys.size() <= 2 * requiredHashSize || GetCapacityBytes(hashKeys) < MinTrimmedBytes)
+        return;
+
+    hashKeys = std::vector<uint64_t>(requiredHashSize);
+    hashCounts = std::vector<uint16_t>(requiredHashSize);
+    hashSlotStates = std::vector<uint32_t>(requiredHashSize, 0);
+    hashMask = requiredHashSize - 1;
+    hashGeneration = 0;
+}
+
+// Counts a point and returns the handle of its cell, valid until the next reset; Reset must be called before the first insertion
+uint32_t VoxelDensityCounter::Insert(float x, float y, float z) {
+    int cx = static_cast<int>(std::floor(x / voxelSize));
+    int cy = static_cast<int>(std::floor(y / voxelSize));
+    int cz = static_cast<int>(std::floor(z / voxelSize));
+
+    int ix = cx - minCellX;
+    int iy = cy - minCellY;
+    int iz = cz - minCellZ;
+
+    if (ix < 0 || iy < 0 || iz < 0 || ix >= gridSizeX || iy >= gridSizeY || iz >= gridSizeZ)
+        return InsertOutsideCell(cx, cy, cz);
+
+    uint32_t cell = static_cast<uint32_t>((static_cast<size_t>(iz) * gridSizeY + iy) * gridSizeX + ix);
+    uint16_t& count = denseCounts[cell];
+
+    if (count == 0)
+        touchedCells.push_back(cell);
+
+    if (count < UINT16_MAX)
+        count++;
+
+    return cell;
+}
+
+// Returns the number of points counted in the cell with the given handle
+int VoxelDensityCounter::GetCount(uint32_t cell) const {
+    if (cell < denseCounts.size())
+        return denseCounts[cell];
+
+    return hashCounts[cell - denseCounts.size()];
+}
+
+// Tells whether the whole cell of a point lies within the given distance of it, in which case every point counted in
+// the cell is one of its neighbours within that distance
+bool VoxelDensityCounter::IsCellWithin(float x, float y, float z, float distance) const {
+    const float coordinates[3] = { x, y, z };
+    float farthestSquared = 0.0f;
+
+    // The farthest corner of the cell is on its far side along each axis
+    for (float coordinate : coordinates) {
+        float low = std::floor(coordinate / voxelSize) * voxelSize;
+        float extent = (std::max)(coordinate - low, low + voxelSize - coordinate);
+        farthestSquared += extent * extent;
+    }
+
+    return farthestSquared <= distance * distance;
+}
+
+// Counts a point of a cell outside the dense volume with linear probing
+uint32_t VoxelDensityCounter::InsertOutsideCell(int x, int y, int z) {
+    uint64_t key = (static_cast<uint64_t>(x) & 0x1FFFFF) << 42 |
+        (static_cast<uint64_t>(y) & 0x1FFFFF) << 21 |
+        (static_cast<uint64_t>(z) & 0x1FFFFF);
+
+    size_t slot = static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & hashMask;
+
+    while (hashSlotStates[slot] == hashGeneration && hashKeys[slot] != key)
+        slot = (slot + 1) & hashMask;
+
+    if (hashSlotStates[slot] != hashGeneration) {
+        hashSlotStates[slot] = hashGeneration;
+        hashKeys[slot] = key;
+        hashCounts[slot] = 0;
+    }
+
+    if (hashCounts[slot] < UINT16_MAX)
+        hashCounts[slot]++;
+
+    return static_cast<uint32_t>(denseCounts.size() + slot);
+}
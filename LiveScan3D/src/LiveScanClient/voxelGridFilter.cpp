@@ -7,43 +7,318 @@ Copyright (c) Canadian Space Agency.
 
 <Description>
 This module reduces points according to a voxel grid with customizeable size
-such that there remains only one point per grid cell.
+such that there remains only one point per grid cell. The cells are stored as
+bits packed in 64-bit words, each tagged with the generation in which it was
+last written, so that resetting the grid does not touch its memory and points
+can be inserted concurrently without locks. The voxels can also be shared out
+between the cameras of the calibration, each camera keeping only the points
+of the voxels it owns, so that the overlap of the cameras is not duplicated.
+Points can also be inserted in coarser voxels, blocks of the voxels of the
+grid, so that the density of the points varies over the frame. For the frames
+processed in parallel, the points claim their voxels in a hash table which
+keeps the lowest index of the points reaching each voxel, so that the point
+kept in a voxel does not depend on the order the threads reach it in.
 
 \***************************************************************************/
 
 #include "voxelGridFilter.h"
+#include "memoryUsage.h"
+#include <algorithm>
 #include <cmath>
 #include <stdexcept>
 
-// Constructor for initializing the voxel grid filter
-VoxelGridFilter::VoxelGridFilter(float voxelSize, float centerX, float centerY, float centerZ, float halfRange) {
-    if (voxelSize <= 0.0f) throw std::invalid_argument("Voxel size must be positive.");
-
-    // Store the inverse of the voxel size for faster computation later
-    invVoxelSize = 1.0f / voxelSize;
+const float VoxelGridFilter::MinOwnerViewCos = 0.866f; // 30 degrees off the optical axis
+const float VoxelGridFilter::MaxOwnerDistanceRatio = 0.9f;
 
+// Constructor for initializing the voxel grid filter
+VoxelGridFilter::VoxelGridFilter(float voxelSize, float centerX, float centerY, float centerZ, float halfRange)
+    : halfRange(halfRange), numWords(0), capacityWords(0), generation(1),
+      claimCapacity(0), claimShift(64), claimGeneration(0), ownerIndex(-1) {
     // Compute bounds
     minX = centerX - halfRange;
     minY = centerY - halfRange;
     minZ = centerZ - halfRange;
 
+    SetVoxelSize(voxelSize);
+}
+
+// Changes the size of the voxels over the same range. The grid storage is only reallocated when it has to grow, so
+// the voxel size can change from frame to frame; the grid is cleared, as the cells no longer match.
+// Must not be called while points are being inserted.
+void VoxelGridFilter::SetVoxelSize(float voxelSize) {
+    if (voxelSize <= 0.0f) throw std::invalid_argument("Voxel size must be positive.");
+
+    // Store the inverse of the voxel size for faster computation later
+    invVoxelSize = 1.0f / voxelSize;
+
     // Compute the number of voxels in each dimension
     gridSizeX = static_cast<size_t>(std::ceil((halfRange * 2) * invVoxelSize));
     gridSizeY = static_cast<size_t>(std::ceil((halfRange * 2) * invVoxelSize));
     gridSizeZ = static_cast<size_t>(std::ceil((halfRange * 2) * invVoxelSize));
 
-    // Allocate and initialize the voxel grid (as a 1D boolean array)
+    // Allocate and initialize the voxel grid (as a 1D bit array)
     size_t totalSize = gridSizeX * gridSizeY * gridSizeZ;
-    voxelGrid.resize(totalSize, false);
+    numWords = (totalSize + CellsPerWord - 1) / CellsPerWord;
+
+    if (numWords > capacityWords) {
+        voxelWords.reset(new std::atomic<uint64_t>[numWords]);
+        capacityWords = numWords;
+
+        for (size_t i = 0; i < numWords; i++)
+            voxelWords[i].store(0, std::memory_order_relaxed);
+
+        generation = 1;
+    }
+    else {
+        Reset();
+    }
+}
+
+size_t VoxelGridFilter::GetMemoryUsage() const {
+    return capacityWords * sizeof(uint64_t) + claimCapacity * 2 * sizeof(uint64_t);
+}
+
+// Reallocates the grid storage to the current grid when it is less than half used, after the voxel size got coarser or
+// the range smaller; the grid is cleared. Must not be called while points are being inserted.
+void VoxelGridFilter::ReleaseUnusedMemory() {
+    // The claim table is sized again for the next frame
+    if (claimCapacity * 2 * sizeof(uint64_t) >= MinTrimmedBytes) {
+        claimKeys.reset();
+        claimWinners.reset();
+        claimCapacity = 0;
+        claimShift = 64;
+        claimGeneration = 0;
+    }
+
+    if (capacityWords <= 2 * numWords || capacityWords * sizeof(uint64_t) < MinTrimmedBytes)
+        return;
+
+    voxelWords.reset(new std::atomic<uint64_t>[numWords]);
+    capacityWords = numWords;
+
+    for (size_t i = 0; i < numWords; i++)
+        voxelWords[i].store(0, std::memory_order_relaxed);
+
+    generation = 1;
 }
 
-// Clears the voxel grid by setting all entries to false
+// Clears the voxel grid by starting a new generation; words from older generations are treated as empty.
+// Must not be called while points are being inserted.
 void VoxelGridFilter::Reset() {
-    std::fill(voxelGrid.begin(), voxelGrid.end(), false);
+    generation++;
+
+    // On wrap around, the stored generations could be mistaken for the current one
+    if (generation == (1ull << (64 - GenerationShift))) {
+        for (size_t i = 0; i < capacityWords; i++)
+            voxelWords[i].store(0, std::memory_order_relaxed);
+
+        generation = 1;
+    }
 }
 
 // Inserts a point into the voxel grid if it hasn't been inserted before
 bool VoxelGridFilter::Insert(float x, float y, float z) {
+    size_t idx;
+
+    if (!VoxelIndex(x, y, z, 1, idx)) return false;
+
+    std::atomic<uint64_t>& word = voxelWords[idx / CellsPerWord];
+    uint64_t bit = 1ull << (idx % CellsPerWord);
+    uint64_t value = word.load(std::memory_order_relaxed);
+
+    // The word has not been written since the last reset
+    if ((value >> GenerationShift) != generation)
+        value = generation << GenerationShift;
+
+    // If the voxel has already been occupied, return false
+    if (value & bit) return false;
+
+    // Mark voxel as occupied and return true
+    word.store(value | bit, std::memory_order_relaxed);
+    return true;
+}
+
+// Same as Insert, but can be called from several threads at the same time; exactly one of the points reaching
+// a voxel is accepted
+bool VoxelGridFilter::InsertConcurrent(float x, float y, float z) {
+    size_t idx;
+
+    if (!VoxelIndex(x, y, z, 1, idx)) return false;
+
+    return InsertIndexConcurrent(idx);
+}
+
+// Same as InsertConcurrent, in voxels scale times larger on each side. Each block of scale^3 voxels of the grid is
+// represented by its first voxel, so that the coarse and the fine voxels share the grid; a fine point reaching the
+// voxel which represents a block already taken by a coarse point is rejected like a point of an occupied voxel
+bool VoxelGridFilter::InsertCoarseConcurrent(float x, float y, float z, int scale) {
+    size_t idx;
+
+    if (!VoxelIndex(x, y, z, (std::max)(scale, 1), idx)) return false;
+
+    return InsertIndexConcurrent(idx);
+}
+
+// Starts the claims of a new frame of at most maxClaims points by starting a new claim generation; the slots of older
+// generations are treated as empty. The table only grows, so that the steady state does not allocate.
+// Must not be called while points are being claimed.
+void VoxelGridFilter::BeginClaims(size_t maxClaims) {
+    size_t capacity = MinClaimSlots;
+    int shift = 64 - 10;
+
+    while (capacity < 2 * maxClaims) {
+        capacity *= 2;
+        shift--;
+    }
+
+    claimGeneration++;
+
+    // On wrap around, the stored generations could be mistaken for the current one
+    bool isCleared = claimGeneration == (1ull << (64 - ClaimGenerationShift));
+
+    if (capacity > claimCapacity) {
+        claimKeys.reset(new std::atomic<uint64_t>[capacity]);
+        claimWinners.reset(new std::atomic<uint64_t>[capacity]);
+        claimCapacity = capacity;
+        claimShift = shift;
+        isCleared = true;
+    }
+
+    if (isCleared) {
+        for (size_t i = 0; i < claimCapacity; i++) {
+            claimKeys[i].store(0, std::memory_order_relaxed);
+            claimWinners[i].store(0, std::memory_order_relaxed);
+        }
+
+        claimGeneration = 1;
+    }
+}
+
+// Claims the voxel containing a point, or the first voxel of its block of scale^3 voxels, for the point of the given
+// index, from any thread; the voxel keeps the lowest index of the points claiming it. Sets slot to the entry of the
+// voxel for IsClaimWinner, and returns false if the point lies outside the voxel grid. At most the maxClaims given
+// to BeginClaims can be claimed.
+bool VoxelGridFilter::ClaimConcurrent(float x, float y, float z, int scale, uint32_t pointIndex, uint32_t& slot) {
+    size_t idx;
+
+    if (!VoxelIndex(x, y, z, (std::max)(scale, 1), idx)) return false;
+
+    // Linear probing from the Fibonacci hash of the voxel
+    uint64_t key = (claimGeneration << ClaimGenerationShift) | (idx + 1);
+    size_t mask = claimCapacity - 1;
+    size_t s = static_cast<size_t>((idx * 0x9E3779B97F4A7C15ull) >> claimShift);
+
+    for (;; s = (s + 1) & mask) {
+        uint64_t current = claimKeys[s].load(std::memory_order_relaxed);
+
+        // A key of an older generation is a free slot; when another thread takes it first, current is set to its key,
+        // which may be of the same voxel
+        if ((current >> ClaimGenerationShift) != claimGeneration &&
+            claimKeys[s].compare_exchange_strong(current, key, std::memory_order_relaxed))
+            break;
+
+        if (current == key) break;
+    }
+
+    // Atomic minimum of the point indices; a winner of an older generation is replaced whatever its index
+    std::atomic<uint64_t>& winner = claimWinners[s];
+    uint64_t value = (claimGeneration << 32) | pointIndex;
+    uint64_t expected = winner.load(std::memory_order_relaxed);
+
+    while ((expected >> 32) != claimGeneration || (expected & 0xFFFFFFFFull) > pointIndex) {
+        if (winner.compare_exchange_weak(expected, value, std::memory_order_relaxed))
+            break;
+    }
+
+    slot = static_cast<uint32_t>(s);
+    return true;
+}
+
+// Returns true if the point of the given index is the lowest of the points which claimed the voxel of the slot. Only
+// meaningful once all the points of the frame were claimed, after the threads claiming them were joined.
+bool VoxelGridFilter::IsClaimWinner(uint32_t slot, uint32_t pointIndex) const {
+    return claimWinners[slot].load(std::memory_order_relaxed) == ((claimGeneration << 32) | pointIndex);
+}
+
+// Marks a voxel as occupied, from any thread; returns false if it already was
+bool VoxelGridFilter::InsertIndexConcurrent(size_t idx) {
+    std::atomic<uint64_t>& word = voxelWords[idx / CellsPerWord];
+    uint64_t bit = 1ull << (idx % CellsPerWord);
+    uint64_t expected = word.load(std::memory_order_relaxed);
+
+    for (;;) {
+        uint64_t cells = (expected >> GenerationShift) == generation ? (expected & CellMask) : 0;
+
+        if (cells & bit) return false;
+
+        if (word.compare_exchange_weak(expected, (generation << GenerationShift) | cells | bit, std::memory_order_relaxed))
+            return true;
+    }
+}
+
+// Sets the cameras which the voxels are shared out between, and which of them this grid keeps the voxels of; without
+// owners, or with an index outside of them, all the voxels are kept. Must not be called while points are being inserted.
+void VoxelGridFilter::SetOwners(const std::vector<VoxelOwner>& newOwners, int newOwnerIndex) {
+    if (newOwnerIndex < 0 || newOwnerIndex >= static_cast<int>(newOwners.size())) {
+        owners.clear();
+        ownerIndex = -1;
+        return;
+    }
+
+    owners = newOwners;
+    ownerIndex = newOwnerIndex;
+}
+
+bool VoxelGridFilter::HasOwners() const {
+    return !owners.empty();
+}
+
+// Returns true if the voxel containing the point belongs to this camera. Each voxel belongs to the nearest of the
+// cameras facing it, measured from the center of the voxel so that all the cameras agree on it. The calibration
+// does not tell what the other cameras actually see, so a nearer camera whose view of the voxel is occluded still
+// owns it.
+bool VoxelGridFilter::IsOwned(float x, float y, float z) const {
+    if (owners.empty()) return true;
+
+    float voxelSize = 1.0f / invVoxelSize;
+    float voxelCenter[3] = {
+        minX + (std::floor((x - minX) * invVoxelSize) + 0.5f) * voxelSize,
+        minY + (std::floor((y - minY) * invVoxelSize) + 0.5f) * voxelSize,
+        minZ + (std::floor((z - minZ) * invVoxelSize) + 0.5f) * voxelSize
+    };
+
+    auto SquaredDistance = [&](const VoxelOwner& owner, float& alongAxis) {
+        float distance = 0.0f;
+        alongAxis = 0.0f;
+
+        for (int i = 0; i < 3; i++) {
+            float delta = voxelCenter[i] - owner.center[i];
+            distance += delta * delta;
+            alongAxis += delta * owner.axis[i];
+        }
+
+        return distance;
+    };
+
+    // This camera sees its own points, so only the other cameras are tested against their view cone
+    float alongAxis;
+    float maxDistance = SquaredDistance(owners[ownerIndex], alongAxis) * MaxOwnerDistanceRatio * MaxOwnerDistanceRatio;
+
+    for (int i = 0; i < static_cast<int>(owners.size()); i++) {
+        if (i == ownerIndex) continue;
+
+        float distance = SquaredDistance(owners[i], alongAxis);
+
+        if (alongAxis > 0.0f && alongAxis * alongAxis >= MinOwnerViewCos * MinOwnerViewCos * distance && distance < maxDistance)
+            return false;
+    }
+
+    return true;
+}
+
+// Computes the 1D index of the voxel containing a point, or of the first voxel of the block of scale^3 voxels
+// containing it; returns false if the point lies outside the voxel grid
+bool VoxelGridFilter::VoxelIndex(float x, float y, float z, int scale, size_t& idx) const {
     // Compute voxel indices for the given point
     int ix = static_cast<int>((x - minX) * invVoxelSize);
     int iy = static_cast<int>((y - minY) * invVoxelSize);
@@ -57,20 +332,14 @@ bool VoxelGridFilter::Insert(float x, float y, float z) {
         return false;
     }
 
-    // Compute the 1D index for the voxel grid
-    size_t idx = VoxelIndex(ix, iy, iz);
-
-    // If the voxel has already been occupied, return false
-    if (voxelGrid[idx]) return false;
+    if (scale > 1) {
+        ix -= ix % scale;
+        iy -= iy % scale;
+        iz -= iz % scale;
+    }
 
-    // Mark voxel as occupied and return true
-    voxelGrid[idx] = true;
+    idx = static_cast<size_t>(iz) * gridSizeY * gridSizeX +
+        static_cast<size_t>(iy) * gridSizeX +
+        static_cast<size_t>(ix);
     return true;
-}
-
-// Converts 3D voxel indices into a 1D index for internal storage
-size_t VoxelGridFilter::VoxelIndex(int x, int y, int z) const {
-    return static_cast<size_t>(z) * gridSizeY * gridSizeX +
-        static_cast<size_t>(y) * gridSizeX +
-        static_cast<size_t>(x);
-}
+}
\ No newline at end of file
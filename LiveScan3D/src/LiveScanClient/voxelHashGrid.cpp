@@ -0,0 +1,319 @@
+/***************************************************************************\
+
+Module Name:  VoxelHashGrid.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module searches the neighbours of points in a uniform grid of voxels
+whose size is about the search radius, for the point clouds of the small
+volume of the Holoport, instead of a KD-tree. The voxels are hashed into a
+table of buckets, and the points are sorted by bucket with a counting sort,
+so the grid is built in linear time into a few flat arrays, and a query
+reads the contiguous points of the buckets of the voxels around its own.
+It is shared by the outlier filter of the clients and the alignments.
+
+\***************************************************************************/
+
+#include "voxelHashGrid.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+namespace
+{
+    // The table has at least one bucket per point, so the voxels rarely share a bucket
+    const uint32_t MinNumBuckets = 64;
+
+    // Packs the 21 low bits of each voxel coordinate, as the density counter does
+    inline uint64_t PackCell(int cellX, int cellY, int cellZ)
+    {
+        return (static_cast<uint64_t>(cellX) & 0x1FFFFF) << 42 |
+            (static_cast<uint64_t>(cellY) & 0x1FFFFF) << 21 |
+            (static_cast<uint64_t>(cellZ) & 0x1FFFFF);
+    }
+
+    struct CellOffset
+    {
+        int X, Y, Z;
+    };
+
+    // The 27 voxels around a voxel, its own first, then those sharing a face, an edge and a corner with it, so that the
+    // counts read the voxels most likely to hold the neighbours first
+    std::vector<CellOffset> GetNeighbourOffsets()
+    {
+        std::vector<CellOffset> offsets;
+
+        for (int z = -1; z <= 1; z++)
+        {
+            for (int y = -1; y <= 1; y++)
+            {
+                for (int x = -1; x <= 1; x++)
+                    offsets.push_back(CellOffset{ x, y, z });
+            }
+        }
+
+        std::stable_sort(offsets.begin(), offsets.end(), [](const CellOffset& a, const CellOffset& b)
+        {
+            return std::abs(a.X) + std::abs(a.Y) + std::abs(a.Z) < std::abs(b.X) + std::abs(b.Y) + std::abs(b.Z);
+        });
+
+        return offsets;
+    }
+
+    const std::vector<CellOffset> NeighbourOffsets = GetNeighbourOffsets();
+
+    // Squared gap between a query and a voxel at an offset from its own along an axis, from the gaps between the query
+    // and the faces of its voxel
+    inline float GetGapSquared(int offset, float lowGap, float highGap, float cellSize)
+    {
+        float gap = offset < 0 ? lowGap + (-offset - 1) * cellSize : offset > 0 ? highGap + (offset - 1) * cellSize : 0.0f;
+        return gap * gap;
+    }
+
+    template <typename T>
+    void TrimHalfEmpty(std::vector<T>& buffer)
+    {
+        if (buffer.capacity() > 2 * buffer.size())
+            buffer.shrink_to_fit();
+    }
+}
+
+/// <summary>
+/// Sorts the points into the buckets of their voxels: the bucket of each point is counted, the counts are turned into
+/// the first point of each bucket, and the points are scattered to their bucket. The buffers are kept between builds.
+/// </summary>
+/// <param name="stride">Floats between the coordinates of two consecutive points: 1 for separate coordinate arrays,
+/// 3 for interleaved points</param>
+/// <param name="cellSize">Size of the voxels, about the radius of the searches</param>
+void VoxelHashGrid::Build(const float* x, const float* y, const float* z, size_t stride, int numPoints, float cellSize)
+{
+    Clear();
+
+    if (numPoints <= 0 || !(cellSize > 0.0f))
+        return;
+
+    this->cellSize = cellSize;
+    inverseCellSize = 1.0f / cellSize;
+
+    uint32_t numBuckets = MinNumBuckets;
+
+    while (numBuckets < static_cast<uint32_t>(numPoints))
+        numBuckets *= 2;
+
+    bucketMask = numBuckets - 1;
+    bucketStarts.assign(numBuckets + 1, 0);
+    pointBuckets.resize(numPoints);
+    sortedCells.resize(numPoints);
+    sortedPoints.resize(3 * static_cast<size_t>(numPoints));
+    sortedIndices.resize(numPoints);
+
+    for (int i = 0; i < numPoints; i++)
+    {
+        size_t offset = i * stride;
+        uint32_t bucket = GetBucket(GetCell(x[offset]), GetCell(y[offset]), GetCell(z[offset]));
+        pointBuckets[i] = bucket;
+        bucketStarts[bucket + 1]++;
+    }
+
+    for (uint32_t bucket = 0; bucket < numBuckets; bucket++)
+        bucketStarts[bucket + 1] += bucketStarts[bucket];
+
+    // Each bucket is filled from its start, which is moved back to where it was once all the points are scattered
+    for (int i = 0; i < numPoints; i++)
+    {
+        size_t offset = i * stride;
+        uint32_t sorted = bucketStarts[pointBuckets[i]]++;
+
+        sortedCells[sorted] = PackCell(GetCell(x[offset]), GetCell(y[offset]), GetCell(z[offset]));
+        sortedPoints[3 * sorted] = x[offset];
+        sortedPoints[3 * sorted + 1] = y[offset];
+        sortedPoints[3 * sorted + 2] = z[offset];
+        sortedIndices[sorted] = i;
+    }
+
+    for (uint32_t bucket = numBuckets; bucket > 0; bucket--)
+        bucketStarts[bucket] = bucketStarts[bucket - 1];
+
+    bucketStarts[0] = 0;
+}
+
+/// <summary>
+/// Forgets the points; the buffers keep their capacity for the next build
+/// </summary>
+void VoxelHashGrid::Clear()
+{
+    bucketStarts.clear();
+    sortedCells.clear();
+    sortedPoints.clear();
+    sortedIndices.clear();
+    bucketMask = 0;
+}
+
+bool VoxelHashGrid::IsEmpty() const
+{
+    return sortedIndices.empty();
+}
+
+/// <summary>
+/// Counts the points within a radius of a query, the query included if it is one of the points, and stops once
+/// maxCount are found. The radius must not exceed the size of the voxels, so that the neighbours are in the 27 voxels
+/// around the voxel of the query; those farther from the query than the radius are not read.
+/// </summary>
+/// <returns>The number of points found, at most maxCount</returns>
+int VoxelHashGrid::CountNeighbours(float x, float y, float z, float radius, int maxCount) const
+{
+    if (IsEmpty())
+        return 0;
+
+    float radiusSquared = radius * radius;
+    int centerX = GetCell(x), centerY = GetCell(y), centerZ = GetCell(z);
+
+    // Gaps between the query and the faces of its voxel, below and above it along each axis
+    float lowX = x - centerX * cellSize, highX = (centerX + 1) * cellSize - x;
+    float lowY = y - centerY * cellSize, highY = (centerY + 1) * cellSize - y;
+    float lowZ = z - centerZ * cellSize, highZ = (centerZ + 1) * cellSize - z;
+    int count = 0;
+
+    for (const CellOffset& offset : NeighbourOffsets)
+    {
+        float gapSquared = GetGapSquared(offset.X, lowX, highX, cellSize) + GetGapSquared(offset.Y, lowY, highY, cellSize)
+            + GetGapSquared(offset.Z, lowZ, highZ, cellSize);
+
+        if (gapSquared > radiusSquared)
+            continue;
+
+        int cellX = centerX + offset.X, cellY = centerY + offset.Y, cellZ = centerZ + offset.Z;
+        uint32_t bucket = GetBucket(cellX, cellY, cellZ);
+        uint64_t cell = PackCell(cellX, cellY, cellZ);
+
+        for (uint32_t j = bucketStarts[bucket]; j < bucketStarts[bucket + 1]; j++)
+        {
+            if (sortedCells[j] != cell)
+                continue;
+
+            float dx = sortedPoints[3 * j] - x;
+            float dy = sortedPoints[3 * j + 1] - y;
+            float dz = sortedPoints[3 * j + 2] - z;
+
+            // Points on the sphere count too, as in the k-th neighbour distance test
+            if (dx * dx + dy * dy + dz * dz <= radiusSquared && ++count >= maxCount)
+                return count;
+        }
+    }
+
+    return count;
+}
+
+/// <summary>
+/// Finds the nearest point of a query in the voxels around the voxel of the query, a ring of voxels at a time, until no
+/// point out of the voxels searched can be nearer than the nearest one found. The voxels farther from the query than
+/// the nearest point found are not read.
+/// </summary>
+/// <param name="maxRings">Rings of voxels searched around the voxel of the query, at most</param>
+/// <param name="index">Output index of the nearest point in the built points</param>
+/// <param name="distanceSquared">Output squared distance to the nearest point</param>
+/// <returns>False if the rings searched cannot guarantee the nearest point, which must then be searched otherwise</returns>
+bool VoxelHashGrid::FindNearest(float x, float y, float z, int maxRings, int& index, float& distanceSquared) const
+{
+    index = -1;
+    distanceSquared = std::numeric_limits<float>::max();
+
+    if (IsEmpty())
+        return false;
+
+    int centerX = GetCell(x), centerY = GetCell(y), centerZ = GetCell(z);
+
+    float lowX = x - centerX * cellSize, highX = (centerX + 1) * cellSize - x;
+    float lowY = y - centerY * cellSize, highY = (centerY + 1) * cellSize - y;
+    float lowZ = z - centerZ * cellSize, highZ = (centerZ + 1) * cellSize - z;
+    float margin = (std::min)({ lowX, highX, lowY, highY, lowZ, highZ }); // Distance to the nearest face of its voxel
+
+    for (int ring = 0; ring <= maxRings; ring++)
+    {
+        for (int dz = -ring; dz <= ring; dz++)
+        {
+            for (int dy = -ring; dy <= ring; dy++)
+            {
+                // Inside the ring, only the voxels of its two faces along x are not searched yet
+                bool isOnFace = dz == -ring || dz == ring || dy == -ring || dy == ring;
+                int stepX = isOnFace || ring == 0 ? 1 : 2 * ring;
+                float gapSquaredYZ = GetGapSquared(dy, lowY, highY, cellSize) + GetGapSquared(dz, lowZ, highZ, cellSize);
+
+                for (int dx = -ring; dx <= ring; dx += stepX)
+                {
+                    if (gapSquaredYZ + GetGapSquared(dx, lowX, highX, cellSize) < distanceSquared)
+                        SearchCell(centerX + dx, centerY + dy, centerZ + dz, x, y, z, index, distanceSquared);
+                }
+            }
+        }
+
+        // The points out of the rings searched are farther than the faces of the outer ring
+        float bound = (std::max)(0.0f, margin + ring * cellSize);
+
+        if (index >= 0 && distanceSquared <= bound * bound)
+            return true;
+    }
+
+    return false;
+}
+
+size_t VoxelHashGrid::GetMemoryUsage() const
+{
+    return bucketStarts.capacity() * sizeof(uint32_t) + sortedCells.capacity() * sizeof(uint64_t)
+        + sortedPoints.capacity() * sizeof(float) + sortedIndices.capacity() * sizeof(int)
+        + pointBuckets.capacity() * sizeof(uint32_t);
+}
+
+/// <summary>
+/// Trims the buffers to twice what the last build needed
+/// </summary>
+void VoxelHashGrid::ReleaseUnusedMemory()
+{
+    TrimHalfEmpty(bucketStarts);
+    TrimHalfEmpty(sortedCells);
+    TrimHalfEmpty(sortedPoints);
+    TrimHalfEmpty(sortedIndices);
+    TrimHalfEmpty(pointBuckets);
+}
+
+int VoxelHashGrid::GetCell(float coordinate) const
+{
+    return static_cast<int>(std::floor(coordinate * inverseCellSize));
+}
+
+uint32_t VoxelHashGrid::GetBucket(int cellX, int cellY, int cellZ) const
+{
+    uint32_t hash = (static_cast<uint32_t>(cellX) * 73856093u) ^ (static_cast<uint32_t>(cellY) * 19349663u)
+        ^ (static_cast<uint32_t>(cellZ) * 83492791u);
+
+    return hash & bucketMask;
+}
+
+/// <summary>
+/// Keeps the nearest point of a voxel if it is nearer than the nearest point found so far
+/// </summary>
+void VoxelHashGrid::SearchCell(int cellX, int cellY, int cellZ, float x, float y, float z, int& index, float& distanceSquared) const
+{
+    uint32_t bucket = GetBucket(cellX, cellY, cellZ);
+    uint64_t cell = PackCell(cellX, cellY, cellZ);
+
+    for (uint32_t j = bucketStarts[bucket]; j < bucketStarts[bucket + 1]; j++)
+    {
+        if (sortedCells[j] != cell)
+            continue;
+
+        float dx = sortedPoints[3 * j] - x;
+        float dy = sortedPoints[3 * j + 1] - y;
+        float dz = sortedPoints[3 * j + 2] - z;
+        float distance = dx * dx + dy * dy + dz * dz;
+
+        if (distance < distanceSquared)
+        {
+            distanceSquared = distance;
+            index = sortedIndices[j];
+        }
+    }
+}
@@ -0,0 +1,655 @@
+/***************************************************************************\
+
+Module Name:  CaptureNode.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module serves the clients of a capture node to the remote clients of a
+server on another computer, one TCP connection for each client. The calls
+of the server are passed to the client through the LiveScanClient API and
+answered on the same connection, while the processed frames of the client
+are compressed and streamed as they are published, with its events. The
+clients keep running when the server disconnects, so that it can connect
+again without restarting the cameras. A node may also be the worker process
+of a single camera of a server on the same computer, which then publishes
+the frames in a shared frame ring instead, and only listens on loopback.
+
+\***************************************************************************/
+
+#include "captureNode.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+CaptureNode* CaptureNode::instance = nullptr;
+
+/// <summary>
+/// Serves the clients, in the order of their index on the node. The clients must be started, and stay alive until the
+/// node is destroyed.
+/// </summary>
+/// <param name="firstClientIndex">Index the first client was created with; the others follow it</param>
+/// <param name="frameRing">Ring of the single client of a worker, opened on the ring its server created; null to
+/// stream the frames on the connections</param>
+CaptureNode::CaptureNode(const std::vector<LiveScanClientHandle>& clients, int firstClientIndex, SharedFrameRing* frameRing) :
+    firstClientIndex(firstClientIndex),
+    frameRing(frameRing)
+{
+    instance = this;
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        std::unique_ptr<Session> session = std::make_unique<Session>();
+        session->ClientIndex = static_cast<int>(i);
+        session->Client = clients[i];
+
+        SetSendRecordedFrameCallback(session->Client, SendRecordedFrame);
+        sessions.push_back(std::move(session));
+    }
+}
+
+CaptureNode::~CaptureNode()
+{
+    RequestExit();
+
+    for (auto& session : sessions)
+    {
+        if (session->ReaderThread.joinable())
+            session->ReaderThread.join();
+
+        if (session->SenderThread.joinable())
+            session->SenderThread.join();
+
+        SetSendRecordedFrameCallback(session->Client, nullptr);
+    }
+
+    if (eventThread.joinable())
+        eventThread.join();
+
+    instance = nullptr;
+}
+
+/// <summary>
+/// Accepts the connections of the server on the port, until RequestExit is called or, for a worker, its server stops
+/// it. A worker listens on loopback, on a port of the system it tells its server through the ring.
+/// </summary>
+/// <returns>False if the port could not be opened</returns>
+bool CaptureNode::Run(int port)
+{
+    if (!StartWinsock())
+        return false;
+
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (listener == INVALID_SOCKET)
+        return false;
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(frameRing ? INADDR_LOOPBACK : INADDR_ANY);
+    address.sin_port = htons(static_cast<u_short>(frameRing ? 0 : port));
+    int addressSize = sizeof(address);
+
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR || listen(listener, SOMAXCONN) == SOCKET_ERROR
+        || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &addressSize) == SOCKET_ERROR)
+    {
+        std::cerr << "Failed to listen on port " << port << std::endl;
+        closesocket(listener);
+        return false;
+    }
+
+    port = ntohs(address.sin_port);
+
+    if (frameRing)
+        frameRing->SetControlPort(port);
+
+    for (auto& session : sessions)
+    {
+        Session* servedSession = session.get();
+        session->SenderThread = std::thread([this, servedSession]() { SendFrames(*servedSession); });
+    }
+
+    eventThread = std::thread([this]() { DispatchEvents(); });
+
+    std::cout << "Serving " << sessions.size() << " clients on port " << port << std::endl;
+
+    while (!isExitRequested)
+    {
+        if (frameRing && frameRing->IsExitRequested())
+        {
+            RequestExit();
+            break;
+        }
+
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(listener, &readable);
+        timeval timeout = { 0, AcceptWaitMs * 1000 };
+
+        if (select(0, &readable, nullptr, nullptr, &timeout) != 1)
+            continue;
+
+        SOCKET socket = accept(listener, nullptr, nullptr);
+
+        if (socket != INVALID_SOCKET)
+            Accept(socket);
+    }
+
+    closesocket(listener);
+
+    return true;
+}
+
+void CaptureNode::RequestExit()
+{
+    isExitRequested = true;
+
+    for (auto& session : sessions)
+    {
+        std::lock_guard<std::mutex> lock(session->ConnectionMutex);
+
+        if (session->Connection)
+            session->Connection->Shutdown();
+    }
+}
+
+/// <summary>
+/// Answers the hello of a new connection, then serves it the client it asks for. A new connection to a client replaces
+/// the previous one, which the server abandoned.
+/// </summary>
+void CaptureNode::Accept(SOCKET socket)
+{
+    std::shared_ptr<CaptureNodeConnection> connection = std::make_shared<CaptureNodeConnection>(socket);
+    uint16_t type = 0;
+    std::vector<char> content;
+
+    if (!connection->WaitReadable(HelloTimeoutMs) || !connection->Receive(type, content) || type != HelloMessage
+        || content.size() < sizeof(CaptureNodeHello))
+    {
+        return;
+    }
+
+    CaptureNodeHello hello;
+    memcpy(&hello, content.data(), sizeof(hello));
+
+    CaptureNodeInfo info = { CaptureNodeProtocolVersion, static_cast<int32_t>(sessions.size()) };
+
+    if (!connection->Send(NodeInfoMessage, &info, sizeof(info)) || hello.Version != CaptureNodeProtocolVersion
+        || hello.ClientIndex < 0 || hello.ClientIndex >= static_cast<int>(sessions.size()))
+    {
+        // Closed once the server read the answer to its query
+        return;
+    }
+
+    Session& session = *sessions[hello.ClientIndex];
+
+    {
+        std::lock_guard<std::mutex> lock(session.ConnectionMutex);
+
+        if (session.Connection)
+            session.Connection->Shutdown();
+    }
+
+    if (session.ReaderThread.joinable())
+        session.ReaderThread.join();
+
+    {
+        std::lock_guard<std::mutex> lock(session.EventMutex);
+
+        for (const ClientEvent& event : session.StateEvents)
+            connection->Send(EventMessage, &event, sizeof(event));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(session.ConnectionMutex);
+        session.Connection = connection;
+    }
+
+    std::cout << "Client " << session.ClientIndex << " connected" << std::endl;
+
+    session.ReaderThread = std::thread([this, &session, connection]() { ReadMessages(session, connection); });
+}
+
+void CaptureNode::ReadMessages(Session& session, std::shared_ptr<CaptureNodeConnection> connection)
+{
+    uint16_t type = 0;
+    std::vector<char> content;
+
+    while (!isExitRequested)
+    {
+        if (!connection->WaitReadable(AcceptWaitMs))
+            continue;
+
+        if (!connection->Receive(type, content))
+            break;
+
+        if (type == RecordedFramesRequest)
+        {
+            int32_t maxFrames = 0;
+
+            if (content.size() >= sizeof(maxFrames))
+                memcpy(&maxFrames, content.data(), sizeof(maxFrames));
+
+            SendRecordedFrames(session, connection, maxFrames);
+        }
+        else
+        {
+            HandleMessage(session, *connection, type, content);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(session.ConnectionMutex);
+
+        if (session.Connection == connection)
+            session.Connection.reset();
+    }
+
+    std::cout << "Client " << session.ClientIndex << " disconnected" << std::endl;
+}
+
+/// <summary>
+/// Passes a call of the server to the client, and sends back its answer for the requests
+/// </summary>
+void CaptureNode::HandleMessage(Session& session, CaptureNodeConnection& connection, uint16_t type, const std::vector<char>& content)
+{
+    LiveScanClientHandle client = session.Client;
+    int32_t values[3] = {};
+
+    if (!content.empty())
+        memcpy(values, content.data(), (std::min)(content.size(), sizeof(values)));
+
+    switch (type)
+    {
+    case StartFrameRecordingMessage:
+        StartFrameRecording(client);
+        break;
+
+    case CalibrateMessage:
+        Calibrate(client);
+        break;
+
+    case SetDocumentFrameIntervalMessage:
+        SetDocumentFrameInterval(client, values[0]);
+        break;
+
+    case SetMaxDocumentSizeMessage:
+        SetMaxDocumentSize(client, values[0], values[1]);
+        break;
+
+    case SetSettingsMessage:
+        SetSettings(session, content);
+        break;
+
+    case SetExposureMessage:
+        SetExposure(client, values[0] != 0, values[1]);
+        break;
+
+    case ReceiveCalibrationMessage:
+    {
+        if (content.size() < sizeof(AffineTransform))
+            break;
+
+        AffineTransform transform;
+        memcpy(&transform, content.data(), sizeof(transform));
+        ReceiveCalibration(client, &transform);
+        break;
+    }
+
+    case ReceiveCameraPosesMessage:
+    {
+        if (content.size() < sizeof(int32_t))
+            break;
+
+        std::vector<AffineTransform> poses((content.size() - sizeof(int32_t)) / sizeof(AffineTransform));
+
+        if (!poses.empty())
+            memcpy(poses.data(), content.data() + sizeof(int32_t), poses.size() * sizeof(AffineTransform));
+
+        ReceiveCameraPoses(client, poses.data(), static_cast<int>(poses.size()), values[0]);
+        break;
+    }
+
+    case ClearRecordedFramesMessage:
+        ClearRecordedFrames(client);
+        break;
+
+    case SaveFrameRingMessage:
+        SaveFrameRing(client, values[0]);
+        break;
+
+    case LearnExclusionMaskMessage:
+        LearnExclusionMask(client, values[0]);
+        break;
+
+    case EnableSyncMessage:
+        EnableSync(client, values[0], values[1], values[2]);
+        break;
+
+    case DisableSyncMessage:
+        DisableSync(client);
+        break;
+
+    case StartMasterMessage:
+        StartMaster(client);
+        break;
+
+    case ClockPingMessage:
+    {
+        if (content.size() < sizeof(CaptureNodeClockSample))
+            break;
+
+        CaptureNodeClockSample pong;
+        memcpy(&pong, content.data(), sizeof(pong));
+        pong.NodeTimeUs = GetSteadyTimeUs();
+        pong.NodeSystemTimeUs = GetSystemTimeUs();
+        connection.Send(ClockPongMessage, &pong, sizeof(pong));
+        break;
+    }
+
+    case CalibrationProgressRequest:
+    {
+        int numSamples = 0;
+        int numRequiredSamples = 0;
+        CaptureNodeCalibrationProgress progress;
+        progress.IsCalibrating = GetCalibrationProgress(client, &numSamples, &numRequiredSamples) ? 1 : 0;
+        progress.NumSamples = numSamples;
+        progress.NumRequiredSamples = numRequiredSamples;
+        connection.Send(CalibrationProgressReply, &progress, sizeof(progress));
+        break;
+    }
+
+    case PerfStatsRequest:
+    {
+        PerfStageStats stats[NumPerfStages] = {};
+        bool isReset = !content.empty() && content[0] != 0;
+        int numStages = GetPerfStats(client, stats, NumPerfStages, isReset);
+        connection.Send(PerfStatsReply, stats, numStages * sizeof(PerfStageStats));
+        break;
+    }
+
+    case MemoryStatsRequest:
+    {
+        ClientMemoryStats stats = {};
+        GetMemoryStats(client, &stats);
+        connection.Send(MemoryStatsReply, &stats, sizeof(stats));
+        break;
+    }
+
+    case FunnelStatsRequest:
+    {
+        FrameFunnelStats stats = {};
+        GetFunnelStats(client, &stats);
+        connection.Send(FunnelStatsReply, &stats, sizeof(stats));
+        break;
+    }
+
+    case DepthFrameRequest:
+        SendDepthFrame(session, connection, values[0]);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/// <summary>
+/// Gives the client the settings of the server, with the marker poses which follow them in the message
+/// </summary>
+void CaptureNode::SetSettings(Session& session, const std::vector<char>& content)
+{
+    if (content.size() < sizeof(CameraSettings))
+        return;
+
+    CameraSettings settings;
+    memcpy(&settings, content.data(), sizeof(settings));
+
+    // Copied out of the message, whose content is not aligned for them
+    std::vector<MarkerPose> markerPoses((content.size() - sizeof(settings)) / sizeof(MarkerPose));
+
+    if (!markerPoses.empty())
+        memcpy(markerPoses.data(), content.data() + sizeof(settings), markerPoses.size() * sizeof(MarkerPose));
+
+    settings.MarkerPoses = markerPoses.data();
+    settings.NumMarkers = static_cast<int>(markerPoses.size());
+
+    ::SetSettings(session.Client, &settings);
+}
+
+/// <summary>
+/// Has the client send its recorded frames, which the recorded frame callback forwards as they are read, then tells
+/// the server how many it sent
+/// </summary>
+void CaptureNode::SendRecordedFrames(Session& session, std::shared_ptr<CaptureNodeConnection> connection, int maxFrames)
+{
+    session.RecordedFrameConnection = connection;
+    session.NumRecordedFrames = 0;
+
+    if (maxFrames > 0)
+        RequestRecordedFrames(session.Client, maxFrames);
+    else
+        RequestRecordedFrame(session.Client);
+
+    session.RecordedFrameConnection.reset();
+
+    int32_t numFrames = session.NumRecordedFrames;
+    connection->Send(RecordedFramesReply, &numFrames, sizeof(numFrames));
+}
+
+/// <summary>
+/// Sends the next depth frame of the client, or an empty answer if none was acquired before the timeout
+/// </summary>
+void CaptureNode::SendDepthFrame(Session& session, CaptureNodeConnection& connection, int timeoutMs)
+{
+    std::vector<UINT16> depth(MaxDepthPixels);
+    CaptureNodeDepthFrameHeader header = {};
+    int width = 0;
+    int height = 0;
+
+    if (!AcquireDepthFrame(session.Client, depth.data(), MaxDepthPixels, &width, &height, header.Intrinsics, header.DepthToWorld, timeoutMs))
+    {
+        connection.Send(DepthFrameReply);
+        return;
+    }
+
+    header.Width = width;
+    header.Height = height;
+
+    connection.Send(DepthFrameReply, &header, sizeof(header), depth.data(), static_cast<size_t>(width) * height * sizeof(UINT16));
+}
+
+/// <summary>
+/// Encodes and sends each frame the client publishes while the server is connected. A frame which is published while
+/// the previous one is being sent is skipped, as the local clients skip the frames the server reads too slowly.
+/// </summary>
+void CaptureNode::SendFrames(Session& session)
+{
+    CaptureNodeFrameCodec codec;
+    std::vector<char> encoded;
+    unsigned long long lastSequenceNumber = 0;
+
+    while (!isExitRequested)
+    {
+        if (!WaitForFrame(session.Client, lastSequenceNumber, FrameWaitMs))
+            continue;
+
+        const Point3s* vertices = nullptr;
+        const RGB* colors = nullptr;
+        int count = 0;
+        unsigned long long sequenceNumber = 0;
+        unsigned long long timeStampUs = 0;
+        unsigned long long acquireAgeUs = 0;
+        unsigned long long publishAgeUs = 0;
+
+        LiveScanFrameHandle frame = AcquireLatestFrame(session.Client, &vertices, &colors, &count, &sequenceNumber, &timeStampUs);
+        GetFrameAges(frame, &acquireAgeUs, &publishAgeUs);
+        int64_t nowUs = GetSteadyTimeUs();
+        lastSequenceNumber = sequenceNumber;
+
+        if (frameRing)
+        {
+            // The server of a worker reads the frames from the ring, whether it is connected or not; the steady clock
+            // is that of the server
+            const unsigned char* normals = nullptr;
+            int numNormals = GetFrameNormals(frame, &normals);
+
+            SharedFrameInfo info;
+            info.SequenceNumber = sequenceNumber;
+            info.TimeStampUs = timeStampUs;
+            info.AcquireTimeUs = nowUs - static_cast<int64_t>(acquireAgeUs);
+            info.PublishTimeUs = nowUs - static_cast<int64_t>(publishAgeUs);
+            info.NumPoints = static_cast<uint32_t>(count);
+            info.NumNormals = 0;
+
+            if (!frameRing->Publish(info, vertices, colors, numNormals == count && count > 0 ? normals : nullptr))
+                std::cerr << "Dropped a frame of " << count << " points, larger than the frame ring" << std::endl;
+
+            ReleaseFrame(frame);
+            continue;
+        }
+
+        std::shared_ptr<CaptureNodeConnection> connection = GetConnection(session);
+        bool isEncoded = connection && codec.Encode(vertices, colors, count, encoded);
+
+        // The normals take one byte per point and hardly compress, so they are appended as they are
+        const unsigned char* normals = nullptr;
+        int numNormals = isEncoded ? GetFrameNormals(frame, &normals) : 0;
+
+        if (numNormals != count)
+            numNormals = 0;
+
+        if (numNormals > 0)
+            encoded.insert(encoded.end(), reinterpret_cast<const char*>(normals), reinterpret_cast<const char*>(normals) + numNormals);
+
+        ReleaseFrame(frame);
+
+        if (!isEncoded)
+            continue;
+
+        CaptureNodeFrameHeader header;
+        header.SequenceNumber = sequenceNumber;
+        header.TimeStampUs = timeStampUs;
+        header.AcquireTimeUs = nowUs - static_cast<int64_t>(acquireAgeUs);
+        header.PublishTimeUs = nowUs - static_cast<int64_t>(publishAgeUs);
+        header.NumPoints = static_cast<uint32_t>(count);
+        header.NumNormals = static_cast<uint32_t>(numNormals);
+
+        connection->Send(FrameMessage, &header, sizeof(header), encoded.data(), encoded.size());
+    }
+}
+
+/// <summary>
+/// Takes the events of all the clients and sends each to the server of its client. The state events are kept for the
+/// next connections; the others are dropped while the server is not connected.
+/// </summary>
+void CaptureNode::DispatchEvents()
+{
+    std::vector<ClientEvent> events(MaxEvents);
+
+    while (!isExitRequested)
+    {
+        int numEvents = WaitForClientEvents(events.data(), MaxEvents, EventWaitMs);
+
+        for (int i = 0; i < numEvents; i++)
+        {
+            const ClientEvent& event = events[i];
+
+            int sessionIndex = event.ClientIndex - firstClientIndex;
+
+            if (sessionIndex < 0 || sessionIndex >= static_cast<int>(sessions.size()))
+                continue;
+
+            Session& session = *sessions[sessionIndex];
+
+            if (event.Type == DocumentEvent)
+            {
+                SendDocument(session, event);
+                continue;
+            }
+
+            if (event.Type == SerialNumberEvent || event.Type == CalibratedEvent || event.Type == SyncStateEvent || event.Type == LoadShedEvent)
+            {
+                std::lock_guard<std::mutex> lock(session.EventMutex);
+
+                auto stateEvent = std::find_if(session.StateEvents.begin(), session.StateEvents.end(),
+                    [&event](const ClientEvent& other) { return other.Type == event.Type; });
+
+                if (stateEvent != session.StateEvents.end())
+                    *stateEvent = event;
+                else
+                    session.StateEvents.push_back(event);
+            }
+
+            std::shared_ptr<CaptureNodeConnection> connection = GetConnection(session);
+
+            if (connection)
+                connection->Send(EventMessage, &event, sizeof(event));
+        }
+    }
+}
+
+/// <summary>
+/// Copies the document a client announced and sends it to its server; the document is released either way
+/// </summary>
+void CaptureNode::SendDocument(Session& session, const ClientEvent& event)
+{
+    std::vector<unsigned char> jpeg((std::max)(event.Value, 0));
+    std::vector<unsigned char> signature(DocumentSignatureSize);
+    CaptureNodeDocumentHeader header = {};
+
+    int jpegSize = CopyDocument(session.Client, jpeg.data(), static_cast<int>(jpeg.size()), &header.Score, &header.Width, &header.Height,
+        signature.data(), static_cast<int>(signature.size()));
+
+    std::shared_ptr<CaptureNodeConnection> connection = GetConnection(session);
+
+    if (jpegSize == 0 || !connection)
+        return;
+
+    // The signature and the jpeg are sent as one block
+    header.SignatureSize = static_cast<uint32_t>(signature.size());
+    signature.insert(signature.end(), jpeg.begin(), jpeg.begin() + jpegSize);
+
+    connection->Send(DocumentMessage, &header, sizeof(header), signature.data(), signature.size());
+}
+
+std::shared_ptr<CaptureNodeConnection> CaptureNode::GetConnection(Session& session)
+{
+    std::lock_guard<std::mutex> lock(session.ConnectionMutex);
+    return session.Connection;
+}
+
+/// <summary>
+/// Forwards a recorded frame to the server which requested it; called by the client within RequestRecordedFrame(s),
+/// on the reader thread of its session
+/// </summary>
+void CaptureNode::SendRecordedFrame(int clientIndex, const Point3s* vertices, const RGB* colors, int count, bool noMoreFrames)
+{
+    if (!instance)
+        return;
+
+    int sessionIndex = clientIndex - instance->firstClientIndex;
+
+    if (sessionIndex < 0 || sessionIndex >= static_cast<int>(instance->sessions.size()))
+        return;
+
+    Session& session = *instance->sessions[sessionIndex];
+
+    if (!session.RecordedFrameConnection)
+        return;
+
+    CaptureNodeRecordedFrameHeader header;
+    header.NumPoints = static_cast<uint32_t>((std::max)(count, 0));
+    header.NoMoreFrames = noMoreFrames ? 1 : 0;
+
+    std::vector<char> points(header.NumPoints * (sizeof(Point3s) + sizeof(RGB)));
+
+    if (header.NumPoints > 0)
+    {
+        memcpy(points.data(), vertices, header.NumPoints * sizeof(Point3s));
+        memcpy(points.data() + header.NumPoints * sizeof(Point3s), colors, header.NumPoints * sizeof(RGB));
+    }
+
+    session.RecordedFrameConnection->Send(RecordedFrameMessage, &header, sizeof(header), points.data(), points.size());
+    session.NumRecordedFrames++;
+}
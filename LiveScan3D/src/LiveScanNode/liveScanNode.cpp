@@ -0,0 +1,172 @@
+/***************************************************************************\
+
+Module Name:  LiveScanNode.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is a console application which hosts the clients of the cameras
+connected to this computer, or of raw recordings, for a server running on
+another computer. The server connects to the node with the -node argument
+and controls its clients like its own, while the node streams their frames.
+The clients run until the application is closed with Ctrl+C. Started with
+--worker by a server with isolated cameras, the node hosts a single camera
+of the same computer for that server, and runs until the server stops it.
+
+\***************************************************************************/
+
+#include "captureNode.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct NodeOptions
+    {
+        int Port = DefaultCaptureNodePort;
+        int NumClients = -1; // All the connected cameras when negative
+        std::vector<std::string> ReplayPaths;
+        bool IsReplayRealTime = true;
+
+        // Camera hosted for a server of this computer, and the process of that server; -1 when not a worker
+        int WorkerIndex = -1;
+        DWORD ServerProcessId = 0;
+    };
+
+    std::atomic<CaptureNode*> runningNode{ nullptr };
+
+    void PrintUsage()
+    {
+        std::cerr << "Usage: LiveScanNode [--port <port>] [--clients <count>] [--replay <raw recording>...] [--maxspeed]" << std::endl
+            << "       LiveScanNode --worker <camera index> --server <process id>" << std::endl
+            << "Hosts the clients of the connected cameras, or of raw recordings, for a server on another computer." << std::endl;
+    }
+
+    bool ParseOptions(int argc, char** argv, NodeOptions& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (arg == "--port" && hasValue)
+                options.Port = std::atoi(argv[++i]);
+            else if (arg == "--clients" && hasValue)
+                options.NumClients = (std::max)(0, std::atoi(argv[++i]));
+            else if (arg == "--worker" && hasValue)
+                options.WorkerIndex = (std::max)(0, std::atoi(argv[++i]));
+            else if (arg == "--server" && hasValue)
+                options.ServerProcessId = static_cast<DWORD>(std::strtoul(argv[++i], nullptr, 10));
+            else if (arg == "--maxspeed")
+                options.IsReplayRealTime = false;
+            else if (arg == "--replay" && hasValue)
+            {
+                while (i + 1 < argc && argv[i + 1][0] != '-')
+                    options.ReplayPaths.push_back(argv[++i]);
+            }
+            else
+                return false;
+        }
+
+        if (options.WorkerIndex >= 0)
+            return options.ServerProcessId != 0 && options.ReplayPaths.empty();
+
+        return options.Port > 0 && options.Port < 65536;
+    }
+
+    BOOL WINAPI HandleConsoleControl(DWORD controlType)
+    {
+        CaptureNode* node = runningNode;
+
+        if (!node)
+            return FALSE;
+
+        node->RequestExit();
+        return TRUE;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    NodeOptions options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    std::vector<LiveScanClientHandle> clients;
+    SharedFrameRing frameRing;
+    bool isWorker = options.WorkerIndex >= 0;
+
+    if (isWorker)
+    {
+        // The ring is created by the server before it starts the worker
+        if (!frameRing.Open(SharedFrameRing::GetName(options.ServerProcessId, options.WorkerIndex)))
+        {
+            std::cerr << "No frame ring was created for camera " << options.WorkerIndex << std::endl;
+            return 1;
+        }
+
+        // The camera keeps the index of its client on the server, which selects its device
+        PrepareClients(1);
+        clients.push_back(CreateClient(options.WorkerIndex));
+    }
+    else if (!options.ReplayPaths.empty())
+    {
+        for (size_t i = 0; i < options.ReplayPaths.size(); i++)
+            clients.push_back(CreateReplayClient(static_cast<int>(i), options.ReplayPaths[i].c_str(), options.IsReplayRealTime));
+    }
+    else
+    {
+        int numClients = options.NumClients;
+
+        // Find the number of connected cameras, like the server does
+        if (numClients < 0)
+        {
+            ob::Context context;
+            numClients = static_cast<int>(context.queryDeviceList()->deviceCount());
+        }
+
+        if (numClients == 0)
+        {
+            std::cerr << "No camera is connected" << std::endl;
+            return 1;
+        }
+
+        PrepareClients(numClients);
+
+        for (int i = 0; i < numClients; i++)
+            clients.push_back(CreateClient(i));
+    }
+
+    for (LiveScanClientHandle client : clients)
+        StartClient(client);
+
+    bool isServed;
+
+    {
+        CaptureNode node(clients, isWorker ? options.WorkerIndex : 0, isWorker ? &frameRing : nullptr);
+        runningNode = &node;
+        SetConsoleCtrlHandler(HandleConsoleControl, TRUE);
+
+        isServed = node.Run(options.Port);
+
+        SetConsoleCtrlHandler(HandleConsoleControl, FALSE);
+        runningNode = nullptr;
+    }
+
+    for (LiveScanClientHandle client : clients)
+    {
+        StopClient(client);
+        DestroyClient(client);
+    }
+
+    return isServed ? 0 : 1;
+}
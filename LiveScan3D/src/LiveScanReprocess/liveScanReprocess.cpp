@@ -0,0 +1,624 @@
+/***************************************************************************\
+
+Module Name:  LiveScanReprocess.cpp
+Project:      LiveScan3D
+Authors:      Roxanne Archambault
+Copyright (c) Canadian Space Agency.
+
+<Description>
+This module is a console application which reprocesses the raw recordings
+of a session offline, with the calibration of the cameras found in the
+working directory and the filter settings given on the command line, into
+point cloud recordings like those of the clients. The frames of all the
+cameras are processed at once, each frame as a task of the shared task
+scheduler, so that the session is processed as fast as the disk reads it
+rather than in real time. The depth filters which carry state from frame to
+frame run on the reader of their camera, in order, and the processed frames
+of each camera are written in order whichever task finished first.
+
+\***************************************************************************/
+
+#include "calibration.h"
+#include "filter.h"
+#include "frameIOHandler.h"
+#include "pointCloudKernel.h"
+#include "rawFrameRecorder.h"
+#include "taskScheduler.h"
+#include "voxelDensityCounter.h"
+#include "voxelGridFilter.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct ReprocessOptions
+    {
+        std::vector<std::string> RecordingPaths; // Raw recordings, one for each camera of the session
+        float CaptureRange = 0.3f;
+        float Bounds[6] = { -0.5f, -0.5f, -0.5f, 0.5f, 0.5f, 0.5f }; // Minimum then maximum corner, in world space
+        bool IsFilterEnabled = false;
+        FilterMode Filter = KdTreeFilterMode;
+        int NumFilterNeighbours = 10;
+        float FilterThreshold = 0.1f;
+        bool IsDepthDenoiseEnabled = false;
+        bool IsDepthHoleFillEnabled = false;
+        int NumThreads = 0; // All the cores when 0
+        int CompressionLevel = 3;
+        bool IsDeltaEnabled = false;
+    };
+
+    // The voxel grids of the clients, which the capture range sets, without the point budget since a reprocessed
+    // session is not sent anywhere
+    const float DefaultRange = 0.3f;
+    const int MaxGridResolution = 511;
+    const float DensityVoxelSize = 0.006f;
+    const int MinPointsPerDensityVoxel = 12;
+
+    // Frames read ahead of the processing for each thread; they bound the memory taken by the raw frames
+    const int FramesInFlightPerThread = 2;
+
+    // A frame with its depth after the filters which carry state between frames, as it is handed to a task
+    struct FrameJob
+    {
+        int FrameIndex = 0;
+        RawFrame Frame;
+        std::vector<UINT16> DepthHistory; // Temporally filtered depth, when the depth is denoised
+        std::shared_ptr<const std::vector<Point2f>> Rays;
+    };
+
+    struct ProcessedFrame
+    {
+        std::shared_ptr<std::vector<Point3s>> Vertices = std::make_shared<std::vector<Point3s>>();
+        std::shared_ptr<std::vector<RGB>> Colors = std::make_shared<std::vector<RGB>>();
+        uint64_t Timestamp = 0;
+    };
+
+    // Working buffers of a task, which keep their capacity for the next frames processed with them
+    struct FrameBuffers
+    {
+        std::vector<UINT16> HoleFilledDepth;
+        std::vector<UINT16> DenoisedDepth;
+        std::vector<UINT16> FilteredDepth;
+        PointBuffer Points;
+        PointBuffer Candidates;
+        VoxelGridFilter VoxelGrid;
+        VoxelDensityCounter DensityCounter;
+        std::vector<uint32_t> DensityCells;
+        std::vector<unsigned char> SureKept;
+        RadiusOutlierFilter RadiusOutlier;
+        OrganizedFilter Organized;
+
+        FrameBuffers(float voxelSize, float halfRange) :
+            VoxelGrid(voxelSize, 0.0f, 0.0f, halfRange, halfRange),
+            DensityCounter(DensityVoxelSize, 0.0f, 0.0f, halfRange, halfRange)
+        {
+        }
+    };
+
+    struct CameraSession
+    {
+        int Index = 0;
+        std::string Path;
+        RawFrameReader Reader;
+        Calibration CameraCalibration;
+        FrameIOHandler Recording;
+        std::thread ReaderThread;
+
+        // State of the reader, which runs the stateful depth filters
+        std::vector<UINT16> DepthHistory;
+        std::vector<UINT16> HoleFilledDepth;
+
+        // Frames processed ahead of the next one to write, by frame index
+        std::mutex OutputMutex;
+        std::map<int, ProcessedFrame> CompletedFrames;
+        int NextWrittenFrame = 0;
+        uint64_t NumPoints = 0;
+
+        int NumReadFrames = 0;
+        uint64_t FirstTimestamp = 0;
+        uint64_t LastTimestamp = 0;
+    };
+
+    // Shared by the readers and the tasks of all the cameras
+    class Pipeline
+    {
+    public:
+        Pipeline(const ReprocessOptions& options, int maxFramesInFlight) :
+            options(options),
+            maxFramesInFlight(maxFramesInFlight),
+            kernel(SelectPointCloudKernel())
+        {
+            range = (std::min)((std::max)(options.CaptureRange, DefaultRange / 255), 10.0f);
+            voxelSize = (std::max)(DefaultRange / 255, range / MaxGridResolution);
+
+            // The threshold of the clients is set for the voxels of the default range
+            float scale = (DefaultRange / 255) / voxelSize;
+            minPointsPerDensityVoxel = (std::max)(2, static_cast<int>(std::lround(MinPointsPerDensityVoxel * scale * scale)));
+        }
+
+        void Submit(CameraSession& camera, std::shared_ptr<FrameJob> job);
+        void WaitIdle();
+
+    private:
+        const ReprocessOptions& options;
+        const int maxFramesInFlight;
+        const PointCloudKernelType kernel;
+        float range = DefaultRange;
+        float voxelSize = DefaultRange / 255;
+        int minPointsPerDensityVoxel = MinPointsPerDensityVoxel;
+
+        std::mutex inFlightMutex;
+        std::condition_variable inFlightCond;
+        int numFramesInFlight = 0;
+
+        std::mutex buffersMutex;
+        std::vector<std::unique_ptr<FrameBuffers>> freeBuffers;
+
+        std::unique_ptr<FrameBuffers> AcquireBuffers();
+        void ReleaseBuffers(std::unique_ptr<FrameBuffers> buffers);
+        void ProcessFrame(const CameraSession& camera, const FrameJob& job, FrameBuffers& buffers, ProcessedFrame& output);
+        void StoreFrame(CameraSession& camera, int frameIndex, ProcessedFrame output);
+    };
+
+    void PrintUsage()
+    {
+        std::cerr << "Usage: LiveScanReprocess <raw recording>... [--range <m>] [--bounds <minX> <minY> <minZ> <maxX> <maxY> <maxZ>]" << std::endl
+            << "                         [--filter] [--organized] [--neighbours <count>] [--threshold <m>]" << std::endl
+            << "                         [--denoise] [--hole-fill] [--threads <count>] [--compression <level>] [--delta]" << std::endl
+            << "Reprocesses the raw recordings of the cameras of a session into point cloud recordings, written to the" << std::endl
+            << "working directory, with the calibrations of the cameras found there." << std::endl;
+    }
+
+    bool ParseOptions(int argc, char** argv, ReprocessOptions& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (arg == "--range" && hasValue)
+                options.CaptureRange = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--bounds" && i + 6 < argc)
+            {
+                for (int j = 0; j < 6; j++)
+                    options.Bounds[j] = static_cast<float>(std::atof(argv[++i]));
+            }
+            else if (arg == "--filter")
+                options.IsFilterEnabled = true;
+            else if (arg == "--organized")
+                options.Filter = OrganizedFilterMode;
+            else if (arg == "--neighbours" && hasValue)
+                options.NumFilterNeighbours = (std::max)(1, std::atoi(argv[++i]));
+            else if (arg == "--threshold" && hasValue)
+                options.FilterThreshold = static_cast<float>(std::atof(argv[++i]));
+            else if (arg == "--denoise")
+                options.IsDepthDenoiseEnabled = true;
+            else if (arg == "--hole-fill")
+                options.IsDepthHoleFillEnabled = true;
+            else if (arg == "--threads" && hasValue)
+                options.NumThreads = (std::max)(0, std::atoi(argv[++i]));
+            else if (arg == "--compression" && hasValue)
+                options.CompressionLevel = (std::max)(0, std::atoi(argv[++i]));
+            else if (arg == "--delta")
+                options.IsDeltaEnabled = true;
+            else if (arg[0] != '-')
+                options.RecordingPaths.push_back(arg);
+            else
+                return false;
+        }
+
+        return !options.RecordingPaths.empty();
+    }
+
+    /// <summary>
+    /// Builds the unprojection rays of the depth pixels, as the capture managers do
+    /// </summary>
+    std::shared_ptr<const std::vector<Point2f>> BuildRayTable(const RawFrame& frame)
+    {
+        const RawCameraParams& params = frame.Header.CameraParams;
+        int width = frame.Header.DepthWidth;
+        int height = frame.Header.DepthHeight;
+        std::shared_ptr<std::vector<Point2f>> rays = std::make_shared<std::vector<Point2f>>(static_cast<size_t>(width) * height);
+
+        for (int v = 0; v < height; ++v)
+        {
+            float rayY = (v - params.DepthCy) / params.DepthFy;
+
+            for (int u = 0; u < width; ++u)
+                (*rays)[v * width + u] = Point2f((u - params.DepthCx) / params.DepthFx, rayY);
+        }
+
+        return rays;
+    }
+
+    /// <summary>
+    /// Acquires the working buffers of a task, from those the finished tasks released when there are some
+    /// </summary>
+    std::unique_ptr<FrameBuffers> Pipeline::AcquireBuffers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(buffersMutex);
+
+            if (!freeBuffers.empty())
+            {
+                std::unique_ptr<FrameBuffers> buffers = std::move(freeBuffers.back());
+                freeBuffers.pop_back();
+                return buffers;
+            }
+        }
+
+        return std::unique_ptr<FrameBuffers>(new FrameBuffers(voxelSize, range / 2.0f));
+    }
+
+    void Pipeline::ReleaseBuffers(std::unique_ptr<FrameBuffers> buffers)
+    {
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        freeBuffers.push_back(std::move(buffers));
+    }
+
+    /// <summary>
+    /// Queues the processing of a frame on the task scheduler, once fewer frames than the limit are being processed
+    /// </summary>
+    void Pipeline::Submit(CameraSession& camera, std::shared_ptr<FrameJob> job)
+    {
+        {
+            std::unique_lock<std::mutex> lock(inFlightMutex);
+            inFlightCond.wait(lock, [this]() { return numFramesInFlight < maxFramesInFlight; });
+            numFramesInFlight++;
+        }
+
+        TaskScheduler::Instance().Submit(FrameTaskPriority, [this, &camera, job]()
+        {
+            std::unique_ptr<FrameBuffers> buffers = AcquireBuffers();
+            ProcessedFrame output;
+            ProcessFrame(camera, *job, *buffers, output);
+            ReleaseBuffers(std::move(buffers));
+
+            StoreFrame(camera, job->FrameIndex, std::move(output));
+
+            {
+                std::lock_guard<std::mutex> lock(inFlightMutex);
+                numFramesInFlight--;
+            }
+
+            inFlightCond.notify_all();
+        });
+    }
+
+    void Pipeline::WaitIdle()
+    {
+        std::unique_lock<std::mutex> lock(inFlightMutex);
+        inFlightCond.wait(lock, [this]() { return numFramesInFlight == 0; });
+    }
+
+    /// <summary>
+    /// Processes a frame like a client which applies its calibration at capture time: the depth filters without
+    /// state, the point cloud in world space culled to the bounds, the voxel grid, the density filter and the outlier
+    /// filter. The points of a camera without calibration stay in its space and are neither culled nor decimated, as
+    /// in a client.
+    /// </summary>
+    void Pipeline::ProcessFrame(const CameraSession& camera, const FrameJob& job, FrameBuffers& buffers, ProcessedFrame& output)
+    {
+        const RawFrameHeader& header = job.Frame.Header;
+        const RawCameraParams& cameraParams = header.CameraParams;
+        int width = header.DepthWidth;
+        int height = header.DepthHeight;
+        size_t numPixels = static_cast<size_t>(width) * height;
+        const UINT16* depth = job.Frame.Depth.data();
+
+        // The holes of the denoised frames were filled by the reader, before its temporal filter
+        if (options.IsDepthDenoiseEnabled)
+        {
+            buffers.DenoisedDepth.resize(numPixels);
+            FilterDepthMedian(job.DepthHistory.data(), buffers.DenoisedDepth.data(), width, height);
+            depth = buffers.DenoisedDepth.data();
+        }
+        else if (options.IsDepthHoleFillEnabled)
+        {
+            buffers.HoleFilledDepth.resize(numPixels);
+            FillDepthHoles(depth, buffers.HoleFilledDepth.data(), width, height);
+            depth = buffers.HoleFilledDepth.data();
+        }
+
+        // Flying pixels are outliers too, so they are rejected along with the other filtering steps
+        if (options.IsFilterEnabled)
+        {
+            buffers.FilteredDepth.resize(numPixels);
+            RejectFlyingPixels(depth, buffers.FilteredDepth.data(), width, height);
+            depth = buffers.FilteredDepth.data();
+        }
+
+        PointCloudKernelParams params;
+        params.depth = depth;
+        params.rays = job.Rays->data();
+        params.depthWidth = width;
+        params.depthHeight = height;
+        params.color = job.Frame.Color.data();
+        params.colorWidth = header.ColorWidth;
+        params.colorHeight = header.ColorHeight;
+        params.colorFormat = ColorRgb888;
+        params.isColorVideoRange = false;
+        params.colorRgbx = nullptr;
+        params.colorFx = cameraParams.ColorFx;
+        params.colorFy = cameraParams.ColorFy;
+        params.colorCx = cameraParams.ColorCx;
+        params.colorCy = cameraParams.ColorCy;
+
+        for (int i = 0; i < 9; ++i)
+            params.rot[i] = cameraParams.Rot[i];
+
+        for (int i = 0; i < 3; ++i)
+            params.trans[i] = cameraParams.Trans[i] / 1000.0f;
+
+        bool isCalibrated = camera.CameraCalibration.isCalibrated;
+
+        if (isCalibrated)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                for (int j = 0; j < 4; ++j)
+                    params.world[i * 4 + j] = camera.CameraCalibration.worldTransform[i][j];
+            }
+
+            EnableBoundsCulling(params, cameraParams.DepthFx, cameraParams.DepthFy, cameraParams.DepthCx, cameraParams.DepthCy,
+                options.Bounds, options.Bounds + 3);
+        }
+        else
+        {
+            SetIdentityWorldTransform(params);
+            DisableBoundsCulling(params);
+        }
+
+        PointBuffer& points = buffers.Points;
+
+        if (points.Size() != numPixels)
+            points.Resize(numPixels);
+
+        PointCloudKernelOutput kernelOutput;
+        kernelOutput.X = points.X.data();
+        kernelOutput.Y = points.Y.data();
+        kernelOutput.Z = points.Z.data();
+        kernelOutput.colors = points.Colors.data();
+        kernelOutput.pixelIndices = points.PixelIndices.data();
+        kernelOutput.alignedDepth = nullptr;
+
+        size_t numPoints = static_cast<size_t>(RunPointCloudKernel(kernel, params, kernelOutput));
+
+        // The grid is filled serially within the frame, so that it keeps the same points as a client would
+        PointBuffer& candidates = buffers.Candidates;
+        candidates.Resize(numPoints);
+        size_t numCandidates = 0;
+
+        if (isCalibrated)
+        {
+            buffers.VoxelGrid.Reset();
+
+            for (size_t i = 0; i < numPoints; i++)
+            {
+                if (buffers.VoxelGrid.Insert(points.X[i], points.Y[i], points.Z[i]))
+                    candidates.CopyPoint(numCandidates++, points, i);
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < numPoints; i++)
+                candidates.CopyPoint(numCandidates++, points, i);
+        }
+
+        candidates.Resize(numCandidates);
+
+        // Remove the isolated points, then the outliers among the remaining ones
+        buffers.DensityCounter.Reset(numCandidates);
+        buffers.DensityCells.resize(numCandidates);
+
+        for (size_t i = 0; i < numCandidates; i++)
+            buffers.DensityCells[i] = buffers.DensityCounter.Insert(candidates.X[i], candidates.Y[i], candidates.Z[i]);
+
+        // As on the clients, the radius outlier filter does not search the points whose voxel alone has enough neighbours
+        size_t numKept = 0;
+        buffers.SureKept.resize(numCandidates);
+
+        for (size_t i = 0; i < numCandidates; i++)
+        {
+            int count = buffers.DensityCounter.GetCount(buffers.DensityCells[i]);
+
+            if (count < minPointsPerDensityVoxel)
+                continue;
+
+            buffers.SureKept[numKept] = count >= options.NumFilterNeighbours &&
+                buffers.DensityCounter.IsCellWithin(candidates.X[i], candidates.Y[i], candidates.Z[i], options.FilterThreshold);
+            candidates.MovePoint(numKept++, i);
+        }
+
+        candidates.Resize(numKept);
+
+        if (options.IsFilterEnabled)
+        {
+            if (options.Filter == OrganizedFilterMode)
+                buffers.Organized.Apply(candidates, width, height, options.NumFilterNeighbours, options.FilterThreshold);
+            else
+                buffers.RadiusOutlier.Apply(candidates, options.NumFilterNeighbours, options.FilterThreshold, nullptr, buffers.SureKept.data());
+        }
+
+        // Converted to shorts, in millimeters, as the clients record them
+        output.Vertices->reserve(candidates.Size());
+        output.Colors->reserve(candidates.Size());
+
+        for (size_t i = 0; i < candidates.Size(); i++)
+        {
+            output.Vertices->push_back(Point3s(static_cast<short>(1000 * candidates.X[i]), static_cast<short>(1000 * candidates.Y[i]),
+                static_cast<short>(1000 * candidates.Z[i])));
+            output.Colors->push_back(candidates.Colors[i]);
+        }
+
+        output.Timestamp = header.Timestamp;
+    }
+
+    /// <summary>
+    /// Writes the processed frame to the recording of its camera, with the frames after it which were waiting for it
+    /// </summary>
+    void Pipeline::StoreFrame(CameraSession& camera, int frameIndex, ProcessedFrame output)
+    {
+        std::lock_guard<std::mutex> lock(camera.OutputMutex);
+        camera.CompletedFrames.emplace(frameIndex, std::move(output));
+
+        auto next = camera.CompletedFrames.begin();
+
+        for (; next != camera.CompletedFrames.end() && next->first == camera.NextWrittenFrame; next = camera.CompletedFrames.erase(next))
+        {
+            const ProcessedFrame& frame = next->second;
+            camera.NumPoints += frame.Vertices->size();
+
+            // Waits for the writer rather than dropping the frame, as nothing is captured in the meantime
+            camera.Recording.WriteFrame(frame.Vertices, frame.Colors, frame.Timestamp, camera.Index, true);
+            camera.NextWrittenFrame++;
+        }
+    }
+
+    /// <summary>
+    /// Reads the frames of a camera in order, runs the depth filters whose output depends on the previous frames, and
+    /// hands each frame to the pipeline
+    /// </summary>
+    void ReadFrames(CameraSession& camera, const ReprocessOptions& options, Pipeline& pipeline)
+    {
+        std::shared_ptr<const std::vector<Point2f>> rays;
+        int depthWidth = 0;
+        int depthHeight = 0;
+
+        for (;;)
+        {
+            std::shared_ptr<FrameJob> job = std::make_shared<FrameJob>();
+
+            if (!camera.Reader.ReadFrame(job->Frame))
+                break;
+
+            const RawFrameHeader& header = job->Frame.Header;
+            int width = header.DepthWidth;
+            int height = header.DepthHeight;
+            size_t numPixels = static_cast<size_t>(width) * height;
+
+            // A new stream profile starts the temporal filter over, as a client does when its device is initialized again
+            if (!rays || width != depthWidth || height != depthHeight)
+            {
+                rays = BuildRayTable(job->Frame);
+                depthWidth = width;
+                depthHeight = height;
+                camera.DepthHistory.assign(numPixels, 0);
+            }
+
+            if (options.IsDepthDenoiseEnabled)
+            {
+                const UINT16* depth = job->Frame.Depth.data();
+
+                if (options.IsDepthHoleFillEnabled)
+                {
+                    camera.HoleFilledDepth.resize(numPixels);
+                    FillDepthHoles(depth, camera.HoleFilledDepth.data(), width, height);
+                    depth = camera.HoleFilledDepth.data();
+                }
+
+                UpdateTemporalDepth(depth, camera.DepthHistory.data(), static_cast<int>(numPixels));
+                job->DepthHistory = camera.DepthHistory;
+            }
+
+            if (camera.NumReadFrames == 0)
+                camera.FirstTimestamp = header.Timestamp;
+
+            camera.LastTimestamp = header.Timestamp;
+            job->FrameIndex = camera.NumReadFrames++;
+            job->Rays = rays;
+
+            pipeline.Submit(camera, std::move(job));
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    ReprocessOptions options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (options.NumThreads > 0)
+        TaskScheduler::Instance().SetThreadCount(options.NumThreads);
+
+    int numThreads = TaskScheduler::Instance().GetThreadCount();
+    std::vector<std::unique_ptr<CameraSession>> cameras;
+
+    for (size_t i = 0; i < options.RecordingPaths.size(); i++)
+    {
+        std::unique_ptr<CameraSession> camera(new CameraSession());
+        camera->Index = static_cast<int>(i);
+        camera->Path = options.RecordingPaths[i];
+
+        if (!camera->Reader.Open(camera->Path))
+        {
+            std::cerr << "Failed to open " << camera->Path << std::endl;
+            return 1;
+        }
+
+        if (!camera->CameraCalibration.LoadCalibration(camera->Reader.GetSerialNumber()) || !camera->CameraCalibration.isCalibrated)
+        {
+            camera->CameraCalibration.isCalibrated = false;
+            std::cerr << "No calibration for camera " << camera->Reader.GetSerialNumber() << "; its points stay in camera space" << std::endl;
+        }
+
+        camera->Recording.SetCompression(options.CompressionLevel, options.IsDeltaEnabled);
+        cameras.push_back(std::move(camera));
+    }
+
+    Pipeline pipeline(options, FramesInFlightPerThread * numThreads);
+    auto start = std::chrono::steady_clock::now();
+
+    for (auto& camera : cameras)
+    {
+        CameraSession* readCamera = camera.get();
+        camera->ReaderThread = std::thread([readCamera, &options, &pipeline]() { ReadFrames(*readCamera, options, pipeline); });
+    }
+
+    for (auto& camera : cameras)
+        camera->ReaderThread.join();
+
+    pipeline.WaitIdle();
+
+    double elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double sessionSeconds = 0.0;
+    int numFrames = 0;
+
+    for (auto& camera : cameras)
+    {
+        camera->Recording.CloseFile();
+
+        RecordingStats stats = camera->Recording.GetRecordingStats();
+        double cameraSeconds = (camera->LastTimestamp - camera->FirstTimestamp) / 1e6;
+        sessionSeconds = (std::max)(sessionSeconds, cameraSeconds);
+        numFrames += camera->NumReadFrames;
+
+        std::cerr << camera->Path << ": " << stats.NumWrittenFrames << " frames, "
+            << (stats.NumWrittenFrames > 0 ? camera->NumPoints / stats.NumWrittenFrames : 0) << " points per frame, "
+            << stats.NumWrittenBytes / (1024 * 1024) << " MB" << std::endl;
+    }
+
+    std::cerr << numFrames << " frames of " << sessionSeconds << " s reprocessed in " << elapsedSeconds << " s on " << numThreads << " threads";
+
+    if (elapsedSeconds > 0.0 && sessionSeconds > 0.0)
+        std::cerr << ", " << sessionSeconds / elapsedSeconds << " times real time";
+
+    std::cerr << std::endl;
+
+    return 0;
+}